@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <app.h>
 #include <kernel/thread.h>
+#include <lk/init.h>
 
 extern const struct app_descriptor __apps_start;
 extern const struct app_descriptor __apps_end;
@@ -36,8 +37,11 @@ void apps_init(void)
 
 	/* call all the init routines */
 	for (app = &__apps_start; app != &__apps_end; app++) {
-		if (app->init)
+		if (app->init) {
+			int slot = lk_boottime_begin(LK_BOOTTIME_APP_INIT, app->name, 0);
 			app->init(app);
+			lk_boottime_end(slot);
+		}
 	}
 
 	/* start any that want to start on boot */
@@ -52,7 +56,10 @@ static int app_thread_entry(void *arg)
 {
 	const struct app_descriptor *app = (const struct app_descriptor *)arg;
 
+	/* most never return, those stay listed as running */
+	int slot = lk_boottime_begin(LK_BOOTTIME_APP_ENTRY, app->name, 0);
 	app->entry(app, NULL);
+	lk_boottime_end(slot);
 
 	return 0;
 }
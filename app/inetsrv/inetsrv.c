@@ -29,23 +29,59 @@
 #include <compiler.h>
 #include <kernel/thread.h>
 #include <lib/minip.h>
+#include <lib/workqueue.h>
 #include <lib/tftp.h>
 #include <lib/cksum.h>
 #include <platform.h>
 
 #include "inetsrv.h"
 
-static int chargen_worker(void *socket)
+/* connections are served out of a shared pool of workers rather than a thread each */
+#define INETSRV_WORKERS_PER_CPU 4
+#define INETSRV_MAX_QUEUED 16
+
+static workqueue_t *inetsrv_wq;
+
+struct inetsrv_conn {
+    work_t work;
+    tcp_socket_t *socket;
+};
+
+/* hand an accepted socket to a worker, the worker closes it when it's done */
+static void inetsrv_start_worker(work_func_t func, tcp_socket_t *socket)
+{
+    struct inetsrv_conn *conn = malloc(sizeof(*conn));
+    if (!conn) {
+        TRACEF("error allocating connection\n");
+        tcp_close(socket);
+        return;
+    }
+
+    conn->work = (work_t)WORK_INITIAL_VALUE;
+    conn->socket = socket;
+
+    status_t err = workqueue_submit(inetsrv_wq, &conn->work, func, conn, 0);
+    if (err < 0) {
+        TRACEF("error %d queuing connection, dropping it\n", err);
+        tcp_close(socket);
+        free(conn);
+    }
+}
+
+static void chargen_worker(void *arg)
 {
     uint64_t count = 0;
-    tcp_socket_t *s = socket;
+    struct inetsrv_conn *conn = arg;
+    tcp_socket_t *s = conn->socket;
 
 /* enough buffer to hold an entire defacto chargen sequences */
 #define CHARGEN_BUFSIZE (0x5f * 0x5f) // 9025 bytes
 
     uint8_t *buf = malloc(CHARGEN_BUFSIZE);
-    if (!buf)
-        return ERR_NO_MEMORY;
+    if (!buf) {
+        TRACEF("error allocating buffer\n");
+        goto out;
+    }
 
     /* generate the sequence */
     uint8_t c = '!';
@@ -69,9 +105,10 @@ static int chargen_worker(void *socket)
     TRACEF("chargen worker exiting, wrote %llu bytes in %u msecs (%llu bytes/sec)\n",
         count, (uint32_t)t, count * 1000 / t);
     free(buf);
-    tcp_close(s);
 
-    return 0;
+out:
+    tcp_close(s);
+    free(conn);
 }
 
 static int chargen_server(void *arg)
@@ -96,21 +133,23 @@ static int chargen_server(void *arg)
         }
 
         TRACEF("starting chargen worker\n");
-        thread_detach_and_resume(thread_create("chargen_worker", &chargen_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        inetsrv_start_worker(&chargen_worker, accept_socket);
     }
 }
 
-static int discard_worker(void *socket)
+static void discard_worker(void *arg)
 {
     uint64_t count = 0;
     uint32_t crc = 0;
-    tcp_socket_t *s = socket;
+    struct inetsrv_conn *conn = arg;
+    tcp_socket_t *s = conn->socket;
 
 #define DISCARD_BUFSIZE 1024
 
     uint8_t *buf = malloc(DISCARD_BUFSIZE);
     if (!buf) {
         TRACEF("error allocating buffer\n");
+        goto out;
     }
 
     lk_time_t t = current_time();
@@ -127,11 +166,11 @@ static int discard_worker(void *socket)
 
     TRACEF("discard worker exiting, read %llu bytes in %u msecs (%llu bytes/sec), crc32 0x%x\n",
         count, (uint32_t)t, count * 1000 / t, crc);
-    tcp_close(s);
-
     free(buf);
 
-    return 0;
+out:
+    tcp_close(s);
+    free(conn);
 }
 
 static int discard_server(void *arg)
@@ -156,20 +195,21 @@ static int discard_server(void *arg)
         }
 
         TRACEF("starting discard worker\n");
-        thread_detach_and_resume(thread_create("discard_worker", &discard_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        inetsrv_start_worker(&discard_worker, accept_socket);
     }
 }
 
-static int echo_worker(void *socket)
+static void echo_worker(void *arg)
 {
-    tcp_socket_t *s = socket;
+    struct inetsrv_conn *conn = arg;
+    tcp_socket_t *s = conn->socket;
 
 #define ECHO_BUFSIZE 1024
 
     uint8_t *buf = malloc(ECHO_BUFSIZE);
     if (!buf) {
         TRACEF("error allocating buffer\n");
-        return ERR_NO_MEMORY;
+        goto out;
     }
 
     for (;;) {
@@ -183,10 +223,11 @@ static int echo_worker(void *socket)
     }
 
     TRACEF("echo worker exiting\n");
-    tcp_close(s);
     free(buf);
 
-    return 0;
+out:
+    tcp_close(s);
+    free(conn);
 }
 
 static int echo_server(void *arg)
@@ -211,7 +252,7 @@ static int echo_server(void *arg)
         }
 
         TRACEF("starting echo worker\n");
-        thread_detach_and_resume(thread_create("echo_worker", &echo_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        inetsrv_start_worker(&echo_worker, accept_socket);
     }
 }
 
@@ -225,6 +266,12 @@ static void inetsrv_entry(const struct app_descriptor *app, void *args)
 
     printf("starting internet servers\n");
 
+    inetsrv_wq = workqueue_create("inetsrv", INETSRV_WORKERS_PER_CPU, DEFAULT_PRIORITY, INETSRV_MAX_QUEUED);
+    if (!inetsrv_wq) {
+        printf("failed to create inetsrv work queue\n");
+        return;
+    }
+
     thread_detach_and_resume(thread_create("chargen", &chargen_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
     thread_detach_and_resume(thread_create("discard", &discard_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
     thread_detach_and_resume(thread_create("echo", &echo_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
@@ -10,5 +10,6 @@ MODULE_DEPS := \
     lib/cksum \
     lib/minip \
     lib/tftp  \
+    lib/workqueue \
 
 include make/module.mk
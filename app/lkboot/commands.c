@@ -34,12 +34,14 @@
 #include <trace.h>
 #include <pow2.h>
 
+#include <kernel/semaphore.h>
 #include <kernel/thread.h>
 #include <kernel/vm.h>
 
 #include <lib/bio.h>
 #include <lib/bootargs.h>
 #include <lib/bootimage.h>
+#include <lib/chunkimage.h>
 #include <lib/ptable.h>
 #include <lib/sysparam.h>
 
@@ -54,6 +56,14 @@
 
 #define LOCAL_TRACE 0
 
+/* flash data is staged in this many chunks, enough to cover the tcp window */
+#ifndef LKBOOT_FLASH_CHUNK_SIZE
+#define LKBOOT_FLASH_CHUNK_SIZE (64*1024)
+#endif
+#ifndef LKBOOT_FLASH_CHUNKS
+#define LKBOOT_FLASH_CHUNKS 4
+#endif
+
 struct lkb_command {
     struct lkb_command *next;
     const char *name;
@@ -98,6 +108,39 @@ static int chainload_thread(void *arg)
     for (;;);
 }
 
+/* if the lk section is a chunked image, inflate it into memory of its own on every cpu
+ * and point at that instead.
+ */
+static status_t inflate_lk_section(const void **ptr, size_t len)
+{
+    if (!chunkimage_probe(*ptr, len))
+        return NO_ERROR;
+
+    size_t image_size;
+    status_t err = chunkimage_get_size(*ptr, len, &image_size);
+    if (err < 0)
+        return err;
+
+    void *dst;
+    if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "lkboot_lk", ROUNDUP(image_size, PAGE_SIZE),
+        &dst, log2_uint(1024*1024), 0, ARCH_MMU_FLAG_CACHED) < 0) {
+        return ERR_NO_MEMORY;
+    }
+
+    lk_time_t t = current_time();
+    ssize_t inflated = chunkimage_decompress(*ptr, len, dst, image_size);
+    if (inflated < 0) {
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)dst);
+        return inflated;
+    }
+    TRACEF("inflated %zu byte lk image to %p in %u ms\n", image_size, dst, (uint)(current_time() - t));
+
+    arch_clean_cache_range((vaddr_t)dst, image_size);
+
+    *ptr = dst;
+    return NO_ERROR;
+}
+
 static int do_boot(lkb_t *lkb, size_t len, const char **result)
 {
     LTRACEF("lkb %p, len %zu, result %p\n", lkb, len, result);
@@ -160,12 +203,21 @@ static int do_boot(lkb_t *lkb, size_t len, const char **result)
             bootimage_get_range(bi, NULL, &bootimage_size);
 
             bootargs_add_bootimage_pointer(args, bootargs_size, "pmem", buf_phys, bootimage_size);
+
+            if (inflate_lk_section(&ptr, len) < 0) {
+                *result = "bad compressed lk image";
+                return -1;
+            }
         }
     } else {
         /* raw image, just chain load it directly */
         TRACEF("raw image, chainloading\n");
 
         ptr = buf;
+        if (inflate_lk_section(&ptr, len) < 0) {
+            *result = "bad compressed lk image";
+            return -1;
+        }
     }
 
     /* start a boot thread to complete the startup */
@@ -259,6 +311,13 @@ status_t do_flash_boot(void)
             bootimage_get_range(bi, NULL, &bootimage_size);
 
             bootargs_add_bootimage_pointer(args, bootargs_size, bdev->name, entry.offset, bootimage_size);
+
+            err = inflate_lk_section(&ptr, len);
+            if (err < 0) {
+                TRACEF("error %d inflating lk image\n", err);
+                bio_ioctl(bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+                return err;
+            }
         }
     } else {
         /* did not find a bootimage, abort */
@@ -275,6 +334,168 @@ status_t do_flash_boot(void)
     return NO_ERROR;
 }
 
+/* flash programming runs on a thread of its own, erasing just ahead of each
+ * chunk and writing it while the next ones are still arriving.
+ */
+struct flash_pipe {
+    bdev_t *bdev;
+    off_t offset;
+    off_t erased;
+    off_t end;
+
+    uint8_t *buf[LKBOOT_FLASH_CHUNKS];
+    size_t len[LKBOOT_FLASH_CHUNKS];   /* bytes in the chunk, 0 for end of data */
+
+    semaphore_t empty;      /* chunks free to receive into */
+    semaphore_t full;       /* chunks ready to program */
+    volatile status_t err;
+};
+
+static size_t flash_erase_size_at(const bdev_t *dev, off_t offset)
+{
+    for (size_t i = 0; i < dev->geometry_count; i++) {
+        const bio_erase_geometry_info_t *geo = &dev->geometry[i];
+        if (offset >= geo->start && offset < geo->start + geo->size) {
+            return geo->erase_size;
+        }
+    }
+    return 0;
+}
+
+static status_t flash_erase_to(struct flash_pipe *pipe, off_t end)
+{
+    end = MIN(end, pipe->end);
+
+    while (pipe->erased < end) {
+        /* without any geometry, hand the device the rest of the partition in one go */
+        size_t len = flash_erase_size_at(pipe->bdev, pipe->erased);
+        if (len == 0) {
+            len = pipe->end - pipe->erased;
+        }
+
+        ssize_t err = bio_erase(pipe->bdev, pipe->erased, len);
+        if (err != (ssize_t)len) {
+            return (err < 0) ? err : ERR_IO;
+        }
+        pipe->erased += len;
+    }
+
+    return NO_ERROR;
+}
+
+static int flash_writer(void *arg)
+{
+    struct flash_pipe *pipe = (struct flash_pipe *)arg;
+    off_t pos = pipe->offset;
+
+    for (uint i = 0; ; i = (i + 1) % LKBOOT_FLASH_CHUNKS) {
+        sem_wait(&pipe->full);
+
+        size_t len = pipe->len[i];
+        if (len == 0)
+            break;
+
+        /* after an error just drain the chunks so the receiver never blocks */
+        if (pipe->err == NO_ERROR) {
+            status_t err = flash_erase_to(pipe, pos + len);
+            if (err == NO_ERROR) {
+                ssize_t written = bio_write(pipe->bdev, pipe->buf[i], pos, len);
+                if (written != (ssize_t)len)
+                    err = (written < 0) ? written : ERR_IO;
+            }
+            pipe->err = err;
+        }
+        LTRACEF("chunk %u: %zu bytes at %lld, err %d\n", i, len, pos, pipe->err);
+
+        pos += len;
+        sem_post(&pipe->empty, false);
+    }
+
+    /* leave the rest of the partition blank, like an erase would */
+    if (pipe->err == NO_ERROR)
+        pipe->err = flash_erase_to(pipe, pipe->end);
+
+    return 0;
+}
+
+static int do_flash(lkb_t *lkb, bdev_t *bdev, const struct ptable_entry *entry, size_t len,
+                    const char **result)
+{
+    struct flash_pipe pipe = {
+        .bdev = bdev,
+        .offset = entry->offset,
+        .erased = entry->offset,
+        .end = entry->offset + entry->length,
+        .err = NO_ERROR,
+    };
+
+    size_t chunk_size = ROUNDUP(LKBOOT_FLASH_CHUNK_SIZE, bdev->block_size);
+    uint8_t *bufs = malloc(LKBOOT_FLASH_CHUNKS * chunk_size);
+    if (!bufs) {
+        *result = "memory allocation failed";
+        return -1;
+    }
+    for (uint i = 0; i < LKBOOT_FLASH_CHUNKS; i++)
+        pipe.buf[i] = bufs + i * chunk_size;
+    sem_init(&pipe.empty, LKBOOT_FLASH_CHUNKS);
+    sem_init(&pipe.full, 0);
+
+    thread_t *writer = thread_create("lkboot flash", &flash_writer, &pipe,
+                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!writer) {
+        *result = "memory allocation failed";
+        sem_destroy(&pipe.empty);
+        sem_destroy(&pipe.full);
+        free(bufs);
+        return -1;
+    }
+    thread_resume(writer);
+
+    printf("lkboot: writing %zu bytes to partition\n", len);
+    lk_time_t t = current_time();
+
+    int ret = 0;
+    size_t pos = 0;
+    uint i = 0;
+    while (pos < len && pipe.err == NO_ERROR) {
+        size_t toread = MIN(len - pos, chunk_size);
+
+        sem_wait(&pipe.empty);
+        if (lkb_read(lkb, pipe.buf[i], toread)) {
+            *result = "io error";
+            ret = -1;
+            break;
+        }
+
+        pipe.len[i] = toread;
+        sem_post(&pipe.full, false);
+
+        pos += toread;
+        i = (i + 1) % LKBOOT_FLASH_CHUNKS;
+    }
+
+    /* tell the writer we're done and wait for it to finish what's queued */
+    if (ret == 0)
+        sem_wait(&pipe.empty);
+    pipe.len[i] = 0;
+    sem_post(&pipe.full, true);
+    thread_join(writer, NULL, INFINITE_TIME);
+
+    if (ret == 0 && pipe.err < 0) {
+        TRACEF("error %d programming flash\n", pipe.err);
+        *result = "bio_write failed";
+        ret = -1;
+    }
+    if (ret == 0)
+        printf("lkboot: wrote %zu bytes in %u ms\n", len, (uint)(current_time() - t));
+
+    sem_destroy(&pipe.empty);
+    sem_destroy(&pipe.full);
+    free(bufs);
+
+    return ret;
+}
+
 // return NULL for success, error string for failure
 int lkb_handle_command(lkb_t *lkb, const char *cmd, const char *arg, size_t len, const char **result)
 {
@@ -315,44 +536,15 @@ int lkb_handle_command(lkb_t *lkb, const char *cmd, const char *arg, size_t len,
             return -1;
         }
 
+        if (!strcmp(cmd, "flash")) {
+            return do_flash(lkb, bdev, &entry, len, result);
+        }
+
         printf("lkboot: erasing partition of size %llu\n", entry.length);
         if (bio_erase(bdev, entry.offset, entry.length) != (ssize_t)entry.length) {
             *result = "bio_erase failed";
             return -1;
         }
-
-        if (!strcmp(cmd, "flash")) {
-            printf("lkboot: writing to partition\n");
-
-            void *buf = malloc(bdev->block_size);
-            if (!buf) {
-                *result = "memory allocation failed";
-                return -1;
-            }
-
-            size_t pos = 0;
-            while (pos < len) {
-                size_t toread = MIN(len - pos, bdev->block_size);
-
-                LTRACEF("offset %zu, toread %zu\n", pos, toread);
-
-                if (lkb_read(lkb, buf, toread)) {
-                    *result = "io error";
-                    free(buf);
-                    return -1;
-                }
-
-                if (bio_write(bdev, buf, entry.offset + pos, toread) != (ssize_t)toread) {
-                    *result = "bio_write failed";
-                    free(buf);
-                    return -1;
-                }
-
-                pos += toread;
-            }
-
-            free(buf);
-        }
     } else if (!strcmp(cmd, "remove")) {
         if (ptable_remove(arg) < 0) {
             *result = "remove failed";
@@ -27,6 +27,7 @@
 
 #include <platform.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <debug.h>
 #include <string.h>
 #include <pow2.h>
@@ -41,6 +42,7 @@
 
 #include <kernel/vm.h>
 #include <app/lkboot.h>
+#include <lib/miniz.h>
 
 #if WITH_LIB_MINIP
 #include <lib/minip.h>
@@ -55,6 +57,9 @@
 #ifndef LKBOOT_AUTOBOOT_TIMEOUT
 #define LKBOOT_AUTOBOOT_TIMEOUT 5000
 #endif
+#ifndef LKBOOT_TCP_RX_BUFFER_SIZE
+#define LKBOOT_TCP_RX_BUFFER_SIZE (256*1024)
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -64,6 +69,26 @@
 #define STATE_DONE 3
 #define STATE_ERROR 4
 
+/* compressed data is pulled off the wire this much at a time */
+#define LKB_INFLATE_IN_SIZE 4096
+
+/* state for inflating a CMD_FLAG_DEFLATE data phase as lkb_read() asks for it */
+struct lkb_inflate {
+    tinfl_decompressor decomp;
+    tinfl_status status;
+
+    /* output wraps around the dictionary */
+    uint8_t dict[TINFL_LZ_DICT_SIZE];
+    size_t dict_ofs;
+    size_t out_pos;
+    size_t out_avail;
+
+    uint8_t in[LKB_INFLATE_IN_SIZE];
+    size_t in_pos;
+    size_t in_len;
+    bool in_eof;
+};
+
 typedef struct LKB {
     lkb_read_hook *read;
     lkb_write_hook *write;
@@ -72,6 +97,9 @@ typedef struct LKB {
 
     int state;
     size_t avail;
+
+    uint flags; /* CMD_FLAG_* the client asked for, then what we accepted */
+    struct lkb_inflate *inflate;
 } lkb_t;
 
 lkb_t *lkboot_create_lkb(void *cookie, lkb_read_hook *read, lkb_write_hook *write) {
@@ -84,6 +112,8 @@ lkb_t *lkboot_create_lkb(void *cookie, lkb_read_hook *read, lkb_write_hook *writ
     lkb->avail = 0;
     lkb->read = read;
     lkb->write = write;
+    lkb->flags = 0;
+    lkb->inflate = NULL;
 
     return lkb;
 }
@@ -121,9 +151,9 @@ static int lkb_send(lkb_t *lkb, u8 opcode, const void *data, size_t len) {
     }
 
     hdr.opcode = opcode;
-    hdr.extra = 0;
+    hdr.extra = (opcode == MSG_GO_AHEAD) ? lkb->flags : 0;
     hdr.length = (opcode == MSG_SEND_DATA) ? (len - 1) : len;
-    if (lkb->write(lkb->cookie, &hdr, sizeof(hdr)) != sizeof(&hdr)) {
+    if (lkb->write(lkb->cookie, &hdr, sizeof(hdr)) != sizeof(hdr)) {
         printf("xmit hdr fail\n");
         lkb->state = STATE_ERROR;
         return -1;
@@ -150,38 +180,82 @@ int lkb_write(lkb_t *lkb, const void *_data, size_t len) {
     return 0;
 }
 
-int lkb_read(lkb_t *lkb, void *_data, size_t len) {
-    char *data = _data;
-
-    if (lkb->state == STATE_RESP) {
-        return 0;
+/* read up to len bytes of the data phase, returns 0 once the client ends it */
+static ssize_t lkb_read_some(lkb_t *lkb, void *data, size_t len) {
+    if (lkb->avail == 0) {
+        msg_hdr_t hdr;
+        if (lkb->read(lkb->cookie, &hdr, sizeof(hdr))) goto fail;
+        if (hdr.opcode == MSG_END_DATA) {
+            lkb->state = STATE_RESP;
+            return 0;
+        }
+        if (hdr.opcode != MSG_SEND_DATA) goto fail;
+        lkb->avail = ((size_t) hdr.length) + 1;
     }
-    if (lkb->state == STATE_OPEN) {
-        if (lkb_send(lkb, MSG_GO_AHEAD, NULL, 0)) return -1;
+
+    len = MIN(len, lkb->avail);
+    if (lkb->read(lkb->cookie, data, len)) goto fail;
+    lkb->avail -= len;
+    return len;
+
+fail:
+    lkb->state = STATE_ERROR;
+    return -1;
+}
+
+static int lkb_read_raw(lkb_t *lkb, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t r = lkb_read_some(lkb, data, len);
+        if (r <= 0) return -1;
+        data += r;
+        len -= r;
     }
+    return 0;
+}
+
+static int lkb_read_inflate(lkb_t *lkb, char *data, size_t len) {
+    struct lkb_inflate *inf = lkb->inflate;
+
     while (len > 0) {
-        if (lkb->avail == 0) {
-            msg_hdr_t hdr;
-            if (lkb->read(lkb->cookie, &hdr, sizeof(hdr))) goto fail;
-            if (hdr.opcode == MSG_END_DATA) {
-                lkb->state = STATE_RESP;
-                return -1;
-            }
-            if (hdr.opcode != MSG_SEND_DATA) goto fail;
-            lkb->avail = ((size_t) hdr.length) + 1;
+        if (inf->out_avail > 0) {
+            size_t xfer = MIN(len, inf->out_avail);
+            memcpy(data, inf->dict + inf->out_pos, xfer);
+            inf->out_pos += xfer;
+            inf->out_avail -= xfer;
+            data += xfer;
+            len -= xfer;
+            continue;
         }
-        if (lkb->avail >= len) {
-            if (lkb->read(lkb->cookie, data, len)) goto fail;
-            lkb->avail -= len;
-            return 0;
+
+        /* the stream ended short of what the command said it would send */
+        if (inf->status == TINFL_STATUS_DONE) return -1;
+
+        if (inf->in_pos == inf->in_len && !inf->in_eof) {
+            ssize_t r = lkb_read_some(lkb, inf->in, sizeof(inf->in));
+            if (r < 0) return -1;
+            inf->in_pos = 0;
+            inf->in_len = r;
+            inf->in_eof = (r == 0);
         }
-        if (lkb->read(lkb->cookie, data, lkb->avail)) {
-            lkb->state = STATE_ERROR;
-            return -1;
+
+        size_t in_size = inf->in_len - inf->in_pos;
+        size_t out_size = sizeof(inf->dict) - inf->dict_ofs;
+        inf->status = tinfl_decompress(&inf->decomp, inf->in + inf->in_pos, &in_size,
+                                       inf->dict, inf->dict + inf->dict_ofs, &out_size,
+                                       TINFL_FLAG_PARSE_ZLIB_HEADER |
+                                       (inf->in_eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT));
+        LTRACEF("inflate in %zu out %zu status %d\n", in_size, out_size, inf->status);
+
+        inf->in_pos += in_size;
+        inf->out_pos = inf->dict_ofs;
+        inf->out_avail = out_size;
+        inf->dict_ofs = (inf->dict_ofs + out_size) & (sizeof(inf->dict) - 1);
+
+        if (inf->status < TINFL_STATUS_DONE) {
+            TRACEF("inflate failed, status %d\n", inf->status);
+            goto fail;
         }
-        data += lkb->avail;
-        len -= lkb->avail;
-        lkb->avail = 0;
+        if (inf->status == TINFL_STATUS_NEEDS_MORE_INPUT && inf->in_eof) goto fail;
     }
     return 0;
 
@@ -190,6 +264,30 @@ fail:
     return -1;
 }
 
+int lkb_read(lkb_t *lkb, void *data, size_t len) {
+    if (lkb->state == STATE_RESP) {
+        return 0;
+    }
+    if (lkb->state == STATE_OPEN) {
+        /* take compressed data if we can set up to inflate it */
+        if (lkb->flags & CMD_FLAG_DEFLATE) {
+            lkb->inflate = calloc(1, sizeof(struct lkb_inflate));
+            if (lkb->inflate) {
+                tinfl_init(&lkb->inflate->decomp);
+                lkb->inflate->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+            }
+        }
+        lkb->flags = lkb->inflate ? CMD_FLAG_DEFLATE : 0;
+
+        if (lkb_send(lkb, MSG_GO_AHEAD, NULL, 0)) return -1;
+    }
+
+    if (lkb->inflate) {
+        return lkb_read_inflate(lkb, data, len);
+    }
+    return lkb_read_raw(lkb, data, len);
+}
+
 status_t lkboot_process_command(lkb_t *lkb)
 {
     msg_hdr_t hdr;
@@ -204,6 +302,7 @@ status_t lkboot_process_command(lkb_t *lkb)
     if (hdr.length > 127) goto fail;
     if (lkb->read(lkb->cookie, cmd, hdr.length)) goto fail;
     cmd[hdr.length] = 0;
+    lkb->flags = hdr.extra;
 
     TRACEF("recv '%s'\n", cmd);
 
@@ -220,6 +319,9 @@ status_t lkboot_process_command(lkb_t *lkb)
         lkb_fail(lkb, result);
     }
 
+    free(lkb->inflate);
+    lkb->inflate = NULL;
+
     TRACEF("command handled with success\n");
     return NO_ERROR;
 
@@ -239,6 +341,9 @@ static status_t lkboot_server(lk_time_t timeout)
         printf("lkboot: error opening listen socket\n");
         return ERR_NO_MEMORY;
     }
+
+    /* images come in over this, give them a big window */
+    tcp_set_buffer_sizes(listen_socket, LKBOOT_TCP_RX_BUFFER_SIZE, 0);
 #endif
 
     /* run the main lkserver loop */
@@ -46,11 +46,18 @@ typedef struct {
 // length must be zero
 // server indicates that command was valid and it is ready for data
 // client should send MSG_SEND_DATA messages to transfer data
+// extra holds the CMD_FLAG_* bits from MSG_CMD the server accepted
 
 #define MSG_CMD     0x40
 // length must be greater than zero
 // data will contain an ascii command
 // server may reject excessively large commands
+// extra may hold CMD_FLAG_* bits, servers ignore the ones they don't know
+
+#define CMD_FLAG_DEFLATE    0x01
+// client would like to send the data as a zlib stream
+// <decimal-datalen> is still the length of the inflated data
+// if the server doesn't echo the flag in MSG_GO_AHEAD the data is sent as is
 
 #define MSG_SEND_DATA   0x41
 // client sends data to server
@@ -73,6 +80,13 @@ typedef struct {
 // S: MSG_LOG "writing sectors"
 // S: MSG_OKAY
 //
+// C: MSG_CMD (extra CMD_FLAG_DEFLATE) "flash:1048576:system"
+// S: MSG_GO_AHEAD (extra CMD_FLAG_DEFLATE)
+// C: MSG_SEND_DATA 65536 ... (zlib stream)
+// C: MSG_SEND_DATA 12345 ...
+// C: MSG_END_DATA
+// S: MSG_OKAY
+//
 // C: MSG_CMD "eraese:0:bootloader"
 // S: MSG_FAIL "unknown command 'eraese'"
 //
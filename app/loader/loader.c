@@ -30,6 +30,8 @@
 #include <lib/tftp.h>
 #include <lib/cksum.h>
 #include <lib/elf.h>
+#include <lib/minip.h>
+#include <lib/pktbuf.h>
 
 #include <kernel/thread.h>
 
@@ -41,48 +43,77 @@
 
 #if defined(SDRAM_BASE)
 #define DOWNLOAD_BASE ((void*)SDRAM_BASE)
+#define DOWNLOAD_END ((unsigned char*)SDRAM_BASE + SDRAM_SIZE)
 #else
 #define DOWNLOAD_BASE ((void*)0)
+#define DOWNLOAD_END ((unsigned char*)0)
 #endif
 
 #define FNAME_SIZE 64
-#define DOWNLOAD_SLOT_SIZE (512 * 1024)
 
 typedef enum {
     DOWNLOAD_ANY,
     DOWNLOAD_ELF,
 } download_type;
 
+// A download is taken in as it arrives, a raw one written straight to memory
+// and an elf one parsed on the fly with each segment written straight to where
+// it's loaded. The crc is run over the data on the way through.
 typedef struct {
     unsigned char* start;
-    unsigned char* end;
     unsigned char* max;
+    size_t len;
+    unsigned long crc;
+    elf_handle_t elf;
+    status_t err;
     char name[FNAME_SIZE];
     download_type type;
+    uint16_t port;
 } download_t;
 
 static download_t* make_download(const char* name)
 {
     download_t* d = malloc(sizeof(download_t));
+    if (!d) {
+        return NULL;
+    }
     memset(d, 0, sizeof(download_t));
-    strncpy(d->name, name, FNAME_SIZE);
+    strncpy(d->name, name, FNAME_SIZE - 1);
     return d;
 }
 
-static void set_ram_zone(download_t* d, int slot) {
-    d->start = DOWNLOAD_BASE + (DOWNLOAD_SLOT_SIZE * slot);
-    d->end = d->start;
-    d->max = d->end + DOWNLOAD_SLOT_SIZE;
-    memset(d->start, 0, DOWNLOAD_SLOT_SIZE);
+static status_t download_begin(download_t* d)
+{
+    d->len = 0;
+    d->crc = 0;
+    d->err = NO_ERROR;
+    if (d->type == DOWNLOAD_ELF) {
+        return elf_open_handle_stream(&d->elf);
+    }
+    return NO_ERROR;
 }
 
-static size_t output_result(const download_t* download)
+static status_t download_write(download_t* d, const void* data, size_t len)
 {
-    size_t len = download->end - download->start;
-    unsigned long crc = crc32(0, download->start, len);
-    printf("[%s] done, start at: %p - %zu bytes, crc32 = %lu\n",
-           download->name, download->start, len, crc);
-    return len;
+    if (d->err < 0) {
+        return d->err;
+    }
+
+    d->crc = crc32(d->crc, data, len);
+
+    if (d->type == DOWNLOAD_ELF) {
+        d->err = elf_stream_write(&d->elf, data, len);
+    } else if (len > (size_t)(d->max - d->start) - d->len) {
+        printf("transfer too big, aborting\n");
+        d->err = ERR_TOO_BIG;
+    } else {
+        memcpy(d->start + d->len, data, len);
+    }
+
+    if (d->err == NO_ERROR) {
+        d->len += len;
+    }
+    return d->err;
 }
 
 static int run_elf(void* entry_point)
@@ -95,69 +126,108 @@ static int run_elf(void* entry_point)
     return 0;
 }
 
-static void process_elf_blob(const void* start, size_t len)
+static bool entry_is_loaded(const elf_handle_t* elf)
 {
-    void* entrypt;
-    elf_handle_t elf;
-
-    status_t st = elf_open_handle_memory(&elf, start, len);
-    if (st < 0) {
-        printf("unable to open elf handle\n");
-        return;
+    for (uint i = 0; i < elf->eheader.e_phnum; i++) {
+        const struct Elf32_Phdr* ph = &elf->pheaders[i];
+        if (ph->p_type == PT_LOAD && elf->entry >= ph->p_vaddr &&
+            elf->entry - ph->p_vaddr < ph->p_memsz) {
+            return true;
+        }
     }
+    return false;
+}
 
-    st = elf_load(&elf);
-    if (st < 0) {
-        printf("elf processing failed, status : %d\n", st);
-        goto exit;
+static void download_end(download_t* d)
+{
+    if (d->err < 0) {
+        printf("[%s] failed after %zu bytes, status : %d\n", d->name, d->len, d->err);
+    } else if (d->type == DOWNLOAD_ANY) {
+        printf("[%s] done, start at: %p - %zu bytes, crc32 = %lu\n",
+               d->name, d->start, d->len, d->crc);
+    } else {
+        status_t st = elf_stream_finish(&d->elf);
+        printf("[%s] done, %zu bytes, crc32 = %lu\n", d->name, d->len, d->crc);
+        if (st < 0) {
+            printf("elf processing failed, status : %d\n", st);
+        } else if (!entry_is_loaded(&d->elf)) {
+            printf("out of bounds entrypoint for elf : %p\n", (void*)d->elf.entry);
+        } else {
+            printf("elf looks good\n");
+            thread_resume(thread_create("elf_runner", &run_elf, (void*)d->elf.entry,
+                                        DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        }
     }
 
-    entrypt = (void*)elf.entry;
-    if (entrypt < start || entrypt >= (void*)((char*)start + len)) {
-        printf("out of bounds entrypoint for elf : %p\n", entrypt);
-        goto exit;
+    if (d->type == DOWNLOAD_ELF) {
+        elf_close_handle(&d->elf);
     }
-
-    printf("elf looks good\n");
-    thread_resume(thread_create("elf_runner", &run_elf, entrypt,
-                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-exit:
-    elf_close_handle(&elf);
 }
 
 int tftp_callback(void* data, size_t len, void* arg)
 {
     download_t* download = arg;
-    size_t final_len;
 
     if (!data) {
-        final_len = output_result(download);
-        if (download->type == DOWNLOAD_ELF) {
-            process_elf_blob(download->start, final_len);
-        }
-
-        download->end = download->start;
+        download_end(download);
+        // be ready for the file to be sent again
+        download->err = download_begin(download);
         return 0;
     }
 
-    if ((download->end + len) > download->max) {
-        printf("transfer too big, aborting\n");
-        return -1;
+    return (download_write(download, data, len) < 0) ? -1 : 0;
+}
+
+// Take one connection on the download's port and treat everything sent on it
+// as the file. The receive buffers are handed over as they are and copied in
+// from there, so the data is only copied the once.
+static int tcp_download_thread(void* arg)
+{
+    download_t* download = arg;
+    tcp_socket_t* listen_socket;
+    tcp_socket_t* socket;
+
+    status_t err = tcp_open_listen(&listen_socket, download->port);
+    if (err < 0) {
+        printf("error %d listening on port %u\n", err, download->port);
+        goto out;
+    }
+
+    err = tcp_accept(listen_socket, &socket);
+    tcp_close(listen_socket);
+    if (err < 0) {
+        printf("error %d accepting on port %u\n", err, download->port);
+        goto out;
     }
-    if (len) {
-        memcpy(download->end, data, len);
-        download->end += len;
+
+    for (;;) {
+        pktbuf_t* p;
+        ssize_t len = tcp_read_pktbuf(socket, &p);
+        if (len < 0) {
+            // the other end closing is the end of the file
+            if (len != ERR_CHANNEL_CLOSED) {
+                download->err = len;
+            }
+            break;
+        }
+        err = download_write(download, p->data, p->dlen);
+        pktbuf_free(p, true);
+        if (err < 0) {
+            break;
+        }
     }
+    tcp_close(socket);
+
+    download_end(download);
+out:
+    free(download);
     return 0;
 }
 
 static int loader(int argc, const cmd_args *argv)
 {
-    static int any_slot = 0;
-    static int elf_slot = 1;
-
     download_t* download;
-    int slot;
+    bool tcp;
 
     if (!DOWNLOAD_BASE) {
         printf("loader not available. it needs sdram\n");
@@ -166,37 +236,77 @@ static int loader(int argc, const cmd_args *argv)
 
     if (argc < 3) {
 usage:
-        printf("load any [filename] <slot>\n"
-               "load elf [filename] <slot>\n"
-               "protocol is tftp and <slot> is optional\n");
+        printf("load any [filename] <address>\n"
+               "load elf [filename]\n"
+               "load any tcp [port] <address>\n"
+               "load elf tcp [port]\n"
+               "protocol is tftp unless tcp is given. raw files go to <address>,\n"
+               "the start of sdram if not given, elf files to where they're linked\n");
         return 0;
     }
 
-    download = make_download(argv[2].str);
+    tcp = (strcmp(argv[2].str, "tcp") == 0);
+    if (tcp && argc < 4) {
+        goto usage;
+    }
+
+    download = make_download(tcp ? argv[3].str : argv[2].str);
+    if (!download) {
+        printf("out of memory\n");
+        return ERR_NO_MEMORY;
+    }
 
     if (strcmp(argv[1].str, "any") == 0) {
         download->type = DOWNLOAD_ANY;
-        slot = any_slot;
-        any_slot += 2;
+        download->start = DOWNLOAD_BASE;
+        download->max = DOWNLOAD_END;
+        if (argc == (tcp ? 5 : 4)) {
+            download->start = (unsigned char*)argv[tcp ? 4 : 3].u;
+        }
+        if (download->start < (unsigned char*)DOWNLOAD_BASE || download->start >= DOWNLOAD_END) {
+            printf("address %p is outside of sdram\n", download->start);
+            free(download);
+            return ERR_INVALID_ARGS;
+        }
     } else if (strcmp(argv[1].str, "elf") == 0) {
         download->type = DOWNLOAD_ELF;
-        slot = elf_slot;
-        elf_slot += 2;
     } else {
+        free(download);
         goto usage;
     }
 
-    if (argc == 4) {
-        slot = argv[3].i;
+    status_t err = download_begin(download);
+    if (err < 0) {
+        printf("error %d setting up the download\n", err);
+        free(download);
+        return err;
+    }
+
+    if (tcp) {
+        download->port = argv[3].u;
+        thread_t* t = thread_create("tcp loader", &tcp_download_thread, download,
+                                    DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t) {
+            if (download->type == DOWNLOAD_ELF) {
+                elf_close_handle(&download->elf);
+            }
+            free(download);
+            return ERR_NO_MEMORY;
+        }
+        thread_detach_and_resume(t);
+        printf("ready for %s over tcp port %u\n", argv[1].str, download->port);
+        return 0;
     }
 
-    set_ram_zone(download, slot);  
     tftp_set_write_client(download->name, &tftp_callback, download);
-    printf("ready for %s over tftp (at %p)\n", argv[2].str, download->start);
+    if (download->type == DOWNLOAD_ANY) {
+        printf("ready for %s over tftp (at %p)\n", argv[2].str, download->start);
+    } else {
+        printf("ready for %s over tftp\n", argv[2].str);
+    }
     return 0;
 }
 
 STATIC_COMMAND_START
-STATIC_COMMAND("load", "download and run via tftp", &loader)
+STATIC_COMMAND("load", "download and run via tftp or tcp", &loader)
 STATIC_COMMAND_END(loader);
-
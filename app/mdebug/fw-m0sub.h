@@ -1,10 +1,10 @@
 unsigned char zero_bin[] = {
-  0xf0, 0x3f, 0x00, 0x18, 0x41, 0x08, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18,
+  0xf0, 0x3f, 0x00, 0x18, 0xf1, 0x08, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18,
   0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18,
   0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18,
   0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18,
   0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18,
-  0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18, 0xc5, 0x07, 0x00, 0x18,
+  0x49, 0x00, 0x00, 0x18, 0x49, 0x00, 0x00, 0x18, 0x6b, 0x08, 0x00, 0x18,
   0x04, 0x48, 0x05, 0x49, 0xef, 0xf3, 0x03, 0x82, 0xff, 0x23, 0x1a, 0x40,
   0x11, 0x43, 0x01, 0x60, 0xfe, 0xe7, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18,
   0x00, 0x00, 0xee, 0xee, 0xc0, 0x46, 0xc0, 0x46, 0xc0, 0x46, 0xc0, 0x46,
@@ -144,43 +144,58 @@ unsigned char zero_bin[] = {
   0x7c, 0x60, 0x38, 0x68, 0xc0, 0x46, 0xc0, 0x46, 0xc8, 0x47, 0x7d, 0x60,
   0x30, 0x40, 0x40, 0x04, 0x5b, 0x08, 0x03, 0x43, 0xc8, 0x47, 0x7c, 0x60,
   0x38, 0x68, 0xc0, 0x46, 0xc0, 0x46, 0xc8, 0x47, 0x7d, 0x60, 0x30, 0x40,
-  0x40, 0x04, 0x5b, 0x08, 0x03, 0x43, 0x00, 0xbd, 0x5f, 0x48, 0x83, 0x46,
-  0x5f, 0x48, 0x82, 0x46, 0x5f, 0x48, 0x81, 0x46, 0x5f, 0x48, 0x80, 0x46,
-  0x5f, 0x4f, 0x60, 0x4e, 0x60, 0x4d, 0x61, 0x4c, 0x70, 0x47, 0x03, 0x20,
-  0x43, 0x46, 0xd8, 0x60, 0x00, 0xbd, 0x02, 0x20, 0x43, 0x46, 0xd8, 0x60,
-  0x00, 0xbd, 0x00, 0xb5, 0x5c, 0x48, 0x84, 0x46, 0x5b, 0x68, 0xff, 0xf7,
-  0xeb, 0xfc, 0x52, 0x4b, 0xbb, 0x60, 0xff, 0xf7, 0x79, 0xfe, 0x5b, 0x0f,
-  0x01, 0x2b, 0x09, 0xd0, 0x57, 0x49, 0xb9, 0x60, 0x02, 0x2b, 0xe6, 0xd1,
-  0x60, 0x46, 0x01, 0x38, 0x84, 0x46, 0xe6, 0xd0, 0x43, 0x46, 0xeb, 0xe7,
-  0xff, 0xf7, 0x6c, 0xfe, 0xff, 0xf7, 0xbd, 0xfc, 0x50, 0x49, 0xb9, 0x60,
-  0x59, 0x46, 0x31, 0x43, 0x79, 0x60, 0x41, 0x46, 0x4b, 0x60, 0x88, 0x60,
-  0x00, 0x20, 0xc8, 0x60, 0x00, 0xbd, 0x00, 0xb5, 0x49, 0x48, 0x84, 0x46,
-  0x5b, 0x68, 0xff, 0xf7, 0xc5, 0xfc, 0x08, 0xb4, 0x3e, 0x4b, 0xbb, 0x60,
-  0xff, 0xf7, 0x52, 0xfe, 0x5b, 0x0f, 0x01, 0x2b, 0x0a, 0xd0, 0x01, 0xbc,
-  0x43, 0x49, 0xb9, 0x60, 0x02, 0x2b, 0xbe, 0xd1, 0x60, 0x46, 0x01, 0x38,
-  0x84, 0x46, 0xbe, 0xd0, 0x43, 0x46, 0xe9, 0xe7, 0x3e, 0x4b, 0xbb, 0x60,
-  0xff, 0xf7, 0x32, 0xfe, 0x43, 0x46, 0x9b, 0x68, 0xff, 0xf7, 0xac, 0xfc,
-  0x08, 0xbc, 0xff, 0xf7, 0x2b, 0xfe, 0x43, 0x46, 0x00, 0x20, 0xd8, 0x60,
-  0x00, 0xbd, 0x00, 0xb5, 0x37, 0x4b, 0x9c, 0x46, 0xff, 0xf7, 0xa0, 0xfc,
-  0x63, 0x46, 0xff, 0xf7, 0x9d, 0xfc, 0x35, 0x4b, 0xff, 0xf7, 0x98, 0xfc,
-  0x63, 0x46, 0xff, 0xf7, 0x97, 0xfc, 0x63, 0x46, 0xff, 0xf7, 0x94, 0xfc,
-  0x43, 0x46, 0x00, 0x20, 0xd8, 0x60, 0x00, 0xbd, 0x00, 0xb5, 0x2f, 0x48,
-  0x00, 0x21, 0x01, 0x60, 0x43, 0x46, 0x18, 0x68, 0x05, 0x28, 0x00, 0xd9,
-  0x00, 0x20, 0x80, 0x00, 0x01, 0xa1, 0x0a, 0x58, 0x90, 0x47, 0x00, 0xbd,
-  0xf9, 0x07, 0x00, 0x18, 0xff, 0x07, 0x00, 0x18, 0xff, 0x06, 0x00, 0x18,
-  0x4b, 0x07, 0x00, 0x18, 0x9b, 0x07, 0x00, 0x18, 0x05, 0x08, 0x00, 0x18,
-  0x09, 0x20, 0xd8, 0x60, 0x70, 0x47, 0x00, 0x20, 0xd8, 0x60, 0x70, 0x47,
-  0x58, 0x68, 0x08, 0x28, 0x00, 0xd9, 0x00, 0x20, 0x80, 0x00, 0x03, 0xa1,
-  0x09, 0x58, 0x89, 0x46, 0x00, 0x20, 0xd8, 0x60, 0x70, 0x47, 0xc0, 0x46,
-  0x65, 0x00, 0x00, 0x18, 0x65, 0x00, 0x00, 0x18, 0x65, 0x00, 0x00, 0x18,
-  0x85, 0x00, 0x00, 0x18, 0x95, 0x00, 0x00, 0x18, 0x95, 0x00, 0x00, 0x18,
-  0xa5, 0x00, 0x00, 0x18, 0xa5, 0x00, 0x00, 0x18, 0xad, 0x00, 0x00, 0x18,
-  0x11, 0x48, 0x12, 0x49, 0x01, 0x60, 0xff, 0xf7, 0x45, 0xff, 0x11, 0x48,
-  0x02, 0x21, 0x01, 0x60, 0x30, 0xbf, 0xfd, 0xe7, 0x00, 0x88, 0x00, 0x00,
-  0x00, 0x80, 0x00, 0x00, 0x95, 0x00, 0x00, 0x18, 0x00, 0x40, 0x00, 0x18,
-  0x10, 0x12, 0x10, 0x40, 0x00, 0x40, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00,
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x00,
-  0xff, 0xff, 0xff, 0xff, 0x9e, 0xe7, 0x00, 0x00, 0x30, 0x31, 0x04, 0x40,
-  0x00, 0x00, 0x00, 0x18, 0x00, 0x00, 0xaa, 0xaa, 0x00, 0xe1, 0x00, 0xe0
+  0x40, 0x04, 0x5b, 0x08, 0x03, 0x43, 0x00, 0xbd, 0x8b, 0x48, 0x83, 0x46,
+  0x8b, 0x48, 0x82, 0x46, 0x8b, 0x48, 0x81, 0x46, 0x8b, 0x48, 0x80, 0x46,
+  0x8b, 0x4f, 0x8c, 0x4e, 0x8c, 0x4d, 0x8d, 0x4c, 0x70, 0x47, 0x03, 0x20,
+  0x00, 0xbd, 0x02, 0x20, 0x00, 0xbd, 0x00, 0xb5, 0x8a, 0x48, 0x84, 0x46,
+  0x5b, 0x68, 0xff, 0xf7, 0xef, 0xfc, 0x80, 0x4b, 0xbb, 0x60, 0xff, 0xf7,
+  0x7d, 0xfe, 0x5b, 0x0f, 0x01, 0x2b, 0x09, 0xd0, 0x85, 0x49, 0xb9, 0x60,
+  0x02, 0x2b, 0xea, 0xd1, 0x60, 0x46, 0x01, 0x38, 0x84, 0x46, 0xe8, 0xd0,
+  0x43, 0x46, 0xeb, 0xe7, 0xff, 0xf7, 0x70, 0xfe, 0xff, 0xf7, 0xc1, 0xfc,
+  0x7e, 0x49, 0xb9, 0x60, 0x59, 0x46, 0x31, 0x43, 0x79, 0x60, 0x41, 0x46,
+  0x4b, 0x60, 0x88, 0x60, 0x00, 0x20, 0x00, 0xbd, 0x00, 0xb5, 0x78, 0x48,
+  0x84, 0x46, 0x5b, 0x68, 0xff, 0xf7, 0xca, 0xfc, 0x08, 0xb4, 0x6d, 0x4b,
+  0xbb, 0x60, 0xff, 0xf7, 0x57, 0xfe, 0x5b, 0x0f, 0x01, 0x2b, 0x0a, 0xd0,
+  0x01, 0xbc, 0x72, 0x49, 0xb9, 0x60, 0x02, 0x2b, 0xc3, 0xd1, 0x60, 0x46,
+  0x01, 0x38, 0x84, 0x46, 0xc1, 0xd0, 0x43, 0x46, 0xe9, 0xe7, 0x6d, 0x4b,
+  0xbb, 0x60, 0xff, 0xf7, 0x37, 0xfe, 0x43, 0x46, 0x9b, 0x68, 0xff, 0xf7,
+  0xb1, 0xfc, 0x08, 0xbc, 0xff, 0xf7, 0x30, 0xfe, 0x00, 0x20, 0x00, 0xbd,
+  0x00, 0xb5, 0xff, 0xf7, 0xb2, 0xff, 0x43, 0x46, 0xd8, 0x60, 0x00, 0xbd,
+  0x00, 0xb5, 0xff, 0xf7, 0xd1, 0xff, 0x43, 0x46, 0xd8, 0x60, 0x00, 0xbd,
+  0x00, 0xb5, 0x43, 0x46, 0xd8, 0x69, 0x00, 0x28, 0x1e, 0xd0, 0x58, 0x69,
+  0x58, 0x60, 0xff, 0xf7, 0xa0, 0xff, 0x00, 0x28, 0x18, 0xd1, 0x43, 0x46,
+  0x58, 0x68, 0x99, 0x68, 0x41, 0x40, 0x0a, 0x0c, 0x51, 0x40, 0x0a, 0x0a,
+  0x51, 0x40, 0x0a, 0x09, 0x51, 0x40, 0x8a, 0x08, 0x51, 0x40, 0x4a, 0x08,
+  0x51, 0x40, 0xc9, 0x07, 0x07, 0xd1, 0x99, 0x69, 0x08, 0x60, 0x09, 0x1d,
+  0x99, 0x61, 0xd9, 0x69, 0x01, 0x39, 0xd9, 0x61, 0xdd, 0xe7, 0x04, 0x20,
+  0x43, 0x46, 0xd8, 0x60, 0x00, 0xbd, 0x00, 0xb5, 0x43, 0x46, 0xd8, 0x69,
+  0x00, 0x28, 0x1e, 0xd0, 0x99, 0x69, 0x08, 0x68, 0x98, 0x60, 0x01, 0x00,
+  0x0a, 0x0c, 0x51, 0x40, 0x0a, 0x0a, 0x51, 0x40, 0x0a, 0x09, 0x51, 0x40,
+  0x8a, 0x08, 0x51, 0x40, 0x4a, 0x08, 0x51, 0x40, 0xc9, 0x07, 0xc9, 0x0b,
+  0x58, 0x69, 0x08, 0x43, 0x58, 0x60, 0xff, 0xf7, 0x8d, 0xff, 0x00, 0x28,
+  0x07, 0xd1, 0x43, 0x46, 0x99, 0x69, 0x09, 0x1d, 0x99, 0x61, 0xd9, 0x69,
+  0x01, 0x39, 0xd9, 0x61, 0xdc, 0xe7, 0x43, 0x46, 0xd8, 0x60, 0x00, 0xbd,
+  0x00, 0xb5, 0x3a, 0x4b, 0x9c, 0x46, 0xff, 0xf7, 0x4d, 0xfc, 0x63, 0x46,
+  0xff, 0xf7, 0x4a, 0xfc, 0x37, 0x4b, 0xff, 0xf7, 0x45, 0xfc, 0x63, 0x46,
+  0xff, 0xf7, 0x44, 0xfc, 0x63, 0x46, 0xff, 0xf7, 0x41, 0xfc, 0x43, 0x46,
+  0x00, 0x20, 0xd8, 0x60, 0x00, 0xbd, 0x00, 0xb5, 0x31, 0x48, 0x00, 0x21,
+  0x01, 0x60, 0x43, 0x46, 0x18, 0x68, 0x07, 0x28, 0x00, 0xd9, 0x00, 0x20,
+  0x80, 0x00, 0x02, 0xa1, 0x0a, 0x58, 0x90, 0x47, 0x00, 0xbd, 0xc0, 0x46,
+  0xa9, 0x08, 0x00, 0x18, 0xaf, 0x08, 0x00, 0x18, 0x8d, 0x07, 0x00, 0x18,
+  0x99, 0x07, 0x00, 0x18, 0x41, 0x08, 0x00, 0x18, 0xb5, 0x08, 0x00, 0x18,
+  0xa5, 0x07, 0x00, 0x18, 0xf3, 0x07, 0x00, 0x18, 0x09, 0x20, 0xd8, 0x60,
+  0x70, 0x47, 0x00, 0x20, 0xd8, 0x60, 0x70, 0x47, 0x58, 0x68, 0x08, 0x28,
+  0x00, 0xd9, 0x00, 0x20, 0x80, 0x00, 0x03, 0xa1, 0x09, 0x58, 0x89, 0x46,
+  0x00, 0x20, 0xd8, 0x60, 0x70, 0x47, 0xc0, 0x46, 0x65, 0x00, 0x00, 0x18,
+  0x65, 0x00, 0x00, 0x18, 0x65, 0x00, 0x00, 0x18, 0x85, 0x00, 0x00, 0x18,
+  0x95, 0x00, 0x00, 0x18, 0x95, 0x00, 0x00, 0x18, 0xa5, 0x00, 0x00, 0x18,
+  0xa5, 0x00, 0x00, 0x18, 0xad, 0x00, 0x00, 0x18, 0x11, 0x48, 0x12, 0x49,
+  0x01, 0x60, 0xff, 0xf7, 0xed, 0xfe, 0x11, 0x48, 0x02, 0x21, 0x01, 0x60,
+  0x30, 0xbf, 0xfd, 0xe7, 0x00, 0x88, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00,
+  0x95, 0x00, 0x00, 0x18, 0x00, 0x40, 0x00, 0x18, 0x10, 0x12, 0x10, 0x40,
+  0x00, 0x40, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x20, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+  0x9e, 0xe7, 0x00, 0x00, 0x30, 0x31, 0x04, 0x40, 0x00, 0x00, 0x00, 0x18,
+  0x00, 0x00, 0xaa, 0xaa, 0x00, 0xe1, 0x00, 0xe0
 };
-unsigned int zero_bin_len = 2196;
+unsigned int zero_bin_len = 2372;
@@ -54,15 +54,72 @@ static u8 optable[16] = {
 };
 
 static const char *board_str = TARGET;
-static const char *build_str = "fw v0.91 (" __DATE__ ", " __TIME__ ")";
+static const char *build_str = "fw v0.92 (" __DATE__ ", " __TIME__ ")";
 
 static void _reboot(void) {
 	platform_halt(HALT_ACTION_REBOOT, HALT_REASON_SW_RESET);
 }
 
+// size of each txbuffer, less room for the closing status and pad
+#define TX_MAX_WORDS	(8192 / 4 - 2)
+
+// TAR auto-increment is only guaranteed within a 1KB block
+#define TAR_BLOCK	1024
+
+static unsigned mem_chunk(u32 addr, unsigned count) {
+	unsigned n = (TAR_BLOCK - (addr & (TAR_BLOCK - 1))) / 4;
+	return (n < count) ? n : count;
+}
+
+static int mem_read(u32 addr, u32 *data, unsigned count) {
+	unsigned n, got;
+	u32 tmp;
+	int status;
+
+	while (count > 0) {
+		n = mem_chunk(addr, count);
+		got = 0;
+		// AP reads are posted: the first DRW read returns stale data,
+		// each one after returns the one before, RDBUFF the last
+		status = swd_write(WR_AP1, addr);
+		if (!status)
+			status = swd_read(RD_AP3, &tmp);
+		if (!status && (n > 1))
+			status = swd_read_block(RD_AP3, data, n - 1, &got);
+		if (!status)
+			status = swd_read(RD_BUFFER, data + got);
+		if (status) {
+			while (got < count)
+				data[got++] = 0xfefefefe;
+			return status;
+		}
+		data += n;
+		count -= n;
+		addr += n * 4;
+	}
+	return 0;
+}
+
+static int mem_write(u32 addr, const u32 *data, unsigned count) {
+	unsigned n;
+	int status;
+
+	while (count > 0) {
+		n = mem_chunk(addr, count);
+		if ((status = swd_write(WR_AP1, addr)))
+			return status;
+		if ((status = swd_write_block(WR_AP3, data, n)))
+			return status;
+		data += n;
+		count -= n;
+		addr += n * 4;
+	}
+	return 0;
+}
+
 /* TODO bounds checking -- we trust the host far too much */
 void process_txn(u32 txnid, u32 *rx, int rxc, u32 *tx) {
-	unsigned msg, op, n;
+	unsigned msg, op, n, got;
 	unsigned txc = 1;
 	unsigned count = 0;
 	unsigned status = 0;
@@ -82,25 +139,54 @@ void process_txn(u32 txnid, u32 *rx, int rxc, u32 *tx) {
 		case CMD_NULL:
 			continue;
 		case CMD_SWD_WRITE:
-			while (n-- > 0) {
-				rxc--;
-				status = swd_write(optable[op], *rx++);
-				if (status) {
-					goto done;
-				}
+			if (n > (unsigned) rxc) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
+			rxc -= n;
+			status = swd_write_block(optable[op], rx, n);
+			rx += n;
+			if (status) {
+				goto done;
 			}
 			continue;
 		case CMD_SWD_READ:
+			if (txc + 1 + n > TX_MAX_WORDS) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
 			tx[txc++] = RSWD_MSG(CMD_SWD_DATA, 0, n);
-			while (n-- > 0) {
-				status = swd_read(optable[op], tx + txc);
-				if (status) {
-					txc++;
-					while (n-- > 0)
-						tx[txc++] = 0xfefefefe;
-					goto done;
-				}
-				txc++;
+			status = swd_read_block(optable[op], tx + txc, n, &got);
+			txc += n;
+			if (status) {
+				while (got < n)
+					tx[txc - n + got++] = 0xfefefefe;
+				goto done;
+			}
+			continue;
+		case CMD_MEM_READ:
+			if ((rxc < 1) || (*rx & 3) || (txc + 1 + n > TX_MAX_WORDS)) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
+			rxc--;
+			tx[txc++] = RSWD_MSG(CMD_SWD_DATA, 0, n);
+			status = mem_read(*rx++, tx + txc, n);
+			txc += n;
+			if (status) {
+				goto done;
+			}
+			continue;
+		case CMD_MEM_WRITE:
+			if ((n + 1 > (unsigned) rxc) || (*rx & 3)) {
+				status = ERR_INTERNAL;
+				goto done;
+			}
+			rxc -= n + 1;
+			status = mem_write(rx[0], rx + 1, n);
+			rx += n + 1;
+			if (status) {
+				goto done;
 			}
 			continue;
 		case CMD_SWD_DISCARD:
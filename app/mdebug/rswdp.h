@@ -57,6 +57,8 @@
 #define CMD_BOOTLOADER	0x09 /* return to bootloader for reflashing */
 #define CMD_SET_CLOCK	0x0A /* set SWCLK rate to n khz */
 #define CMD_SWO_CLOCK	0x0B /* set SWOCLK rate to n khz, 0 = disable SWO */
+#define CMD_MEM_READ	0x0C /* arg=count payload: addr x 1, replies CMD_SWD_DATA */
+#define CMD_MEM_WRITE	0x0D /* arg=count payload: addr x 1, data x count */
 
 /* valid: target to host */
 #define CMD_STATUS	0x10 /* op=errorcode, arg=commands since last TXN_START */
@@ -80,10 +82,11 @@
 #define ERR_IO		3
 #define ERR_PARITY	4
 
-#define RSWD_VERSION		0x0101
+#define RSWD_VERSION		0x0102
 
 #define RSWD_VERSION_1_0	0x0100
 #define RSWD_VERSION_1_1	0x0101
+#define RSWD_VERSION_1_2	0x0102
 
 // Pre-1.0
 //  - max packet size fixed at 2048 bytes
@@ -94,6 +97,13 @@
 //
 // Version 1.1
 // - CMD_SWO_DATA arg is now byte count, not word count
+//
+// Version 1.2
+// - CMD_MEM_READ, CMD_MEM_WRITE added: word bursts through the
+//   currently selected MEM-AP. The host sets up DP SELECT and a
+//   CSW of 32bit size, single auto-increment; the probe handles
+//   TAR (rewritten at each 1KB boundary) and the posted reads.
+//   addr must be word aligned.
 
 /* CMD_SWD_OP operations - combine for direct AP/DP io */
 #define OP_RD 0x00
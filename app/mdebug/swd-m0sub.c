@@ -90,6 +90,9 @@ static unsigned parity(unsigned n) {
 #define COMM_ARG1	0x18004004
 #define COMM_ARG2	0x18004008
 #define COMM_RESP	0x1800400C
+#define COMM_HDR	0x18004014
+#define COMM_ADDR	0x18004018
+#define COMM_COUNT	0x1800401C
 
 #define CMD_ERR		0
 #define CMD_NOP		1
@@ -97,9 +100,17 @@ static unsigned parity(unsigned n) {
 #define CMD_WRITE	3
 #define CMD_RESET	4
 #define CMD_SETCLOCK	5
+#define CMD_READ_BLOCK	6
+#define CMD_WRITE_BLOCK	7
 
 #define RSP_BUSY	0xFFFFFFFF
 
+// block transfers run out of two staging buffers in the m0's
+// sram, between its code and its stack, so the m4 can copy one
+// while the m0 clocks the other out over the wire
+#define M0_BLOCK_BUF(n)	(0x18001000 + (n) * 0x800)
+#define M0_BLOCK_WORDS	512
+
 void swd_init(void) {
 	gpio_init();
 
@@ -161,6 +172,78 @@ int swd_read(unsigned hdr, unsigned *val) {
 	return 0;
 }
 
+static void m0sub_block_start(unsigned cmd, unsigned hdr, unsigned buf, unsigned count) {
+	writel(cmd, COMM_CMD);
+	writel(hdr << 8, COMM_HDR);
+	writel(buf, COMM_ADDR);
+	writel(count, COMM_COUNT);
+	writel(RSP_BUSY, COMM_RESP);
+	DSB;
+	asm("sev");
+}
+
+static unsigned m0sub_block_wait(void) {
+	unsigned n;
+	while ((n = readl(COMM_RESP)) == RSP_BUSY) ;
+	return n;
+}
+
+int swd_read_block(unsigned hdr, unsigned *data, unsigned count, unsigned *done) {
+	unsigned b = 0;
+	unsigned n, got, status;
+
+	*done = 0;
+	if (count == 0) {
+		return 0;
+	}
+
+	n = (count > M0_BLOCK_WORDS) ? M0_BLOCK_WORDS : count;
+	m0sub_block_start(CMD_READ_BLOCK, hdr, M0_BLOCK_BUF(b), n);
+	for (;;) {
+		status = m0sub_block_wait();
+		// the m0 counts COMM_COUNT down as words arrive
+		got = n - readl(COMM_COUNT);
+		count -= got;
+
+		// get the next chunk going before copying this one out
+		if ((status == 0) && (count > 0)) {
+			n = (count > M0_BLOCK_WORDS) ? M0_BLOCK_WORDS : count;
+			m0sub_block_start(CMD_READ_BLOCK, hdr, M0_BLOCK_BUF(b ^ 1), n);
+		}
+		memcpy(data, (void*) M0_BLOCK_BUF(b), got * 4);
+		data += got;
+		*done += got;
+
+		if (status || (count == 0)) {
+			return status;
+		}
+		b ^= 1;
+	}
+}
+
+int swd_write_block(unsigned hdr, const unsigned *data, unsigned count) {
+	unsigned b = 0;
+	unsigned n, status;
+	int busy = 0;
+
+	for (;;) {
+		// fill one buffer while the m0 is still sending the other
+		n = (count > M0_BLOCK_WORDS) ? M0_BLOCK_WORDS : count;
+		memcpy((void*) M0_BLOCK_BUF(b), data, n * 4);
+		if (busy && (status = m0sub_block_wait())) {
+			return status;
+		}
+		if (n == 0) {
+			return 0;
+		}
+		m0sub_block_start(CMD_WRITE_BLOCK, hdr, M0_BLOCK_BUF(b), n);
+		busy = 1;
+		data += n;
+		count -= n;
+		b ^= 1;
+	}
+}
+
 void swd_reset(void) {
 	unsigned n;
 	writel(CMD_RESET, COMM_CMD);
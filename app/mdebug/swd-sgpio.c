@@ -345,6 +345,32 @@ int swd_write(unsigned reg, unsigned val) {
 	return sgpio_swd_write(div, reg, val);
 }
 
+int swd_read_block(unsigned reg, unsigned *data, unsigned count, unsigned *done) {
+	unsigned div = sgpio_div;
+	unsigned n;
+	int r = 0;
+	sgpio_swd_clock_setup(div);
+	for (n = 0; n < count; n++) {
+		if ((r = sgpio_swd_read(div, reg, data + n))) {
+			break;
+		}
+	}
+	*done = n;
+	return r;
+}
+
+int swd_write_block(unsigned reg, const unsigned *data, unsigned count) {
+	unsigned div = sgpio_div;
+	int r;
+	sgpio_swd_clock_setup(div);
+	while (count-- > 0) {
+		if ((r = sgpio_swd_write(div, reg, *data++))) {
+			return r;
+		}
+	}
+	return 0;
+}
+
 unsigned swd_set_clock(unsigned khz) {
 	unsigned div;
 	if (khz < 2000) khz = 2000;
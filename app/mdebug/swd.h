@@ -23,6 +23,12 @@ void swd_reset(void);
 int swd_write(unsigned reg, unsigned val);
 int swd_read(unsigned reg, unsigned *val);
 
+// count back to back transactions on one register, e.g. the DRW of
+// a MEM-AP with TAR auto-increment. Stops at the first error and
+// returns its status. *done is how many words were read before it.
+int swd_read_block(unsigned reg, unsigned *data, unsigned count, unsigned *done);
+int swd_write_block(unsigned reg, const unsigned *data, unsigned count);
+
 unsigned swd_set_clock(unsigned khz);
 unsigned swo_set_clock(unsigned khz);
 void swd_hw_reset(int assert);
@@ -61,11 +61,8 @@ static void tx_done(udc_request_t *req, unsigned actual, int status) {
 	}
 }
 
-void lpc43xx_DMA_IRQ(void) {
+static enum handler_return swo_dma_done(unsigned ch, unsigned status, void *arg) {
 	txn_t *txn = txwr;
-	arm_cm_irq_entry();
-	writel(0xFF, DMA_INTTCCLR);
-	writel(0xFF, DMA_INTERRCLR);
 	if (udc_request_queue(txept, txn->req)) {
 		// failed, usb probably offline, just re-use the buffer
 	} else {
@@ -76,7 +73,7 @@ void lpc43xx_DMA_IRQ(void) {
 		// if busy, when the usb txn completes, it will start dma then
 		swo_start_dma(txn->buf + 2);
 	}
-	arm_cm_irq_exit(0);
+	return INT_NO_RESCHEDULE;
 }
 
 void swo_init(udc_endpoint_t *_txept) {
@@ -97,9 +94,8 @@ void swo_init(udc_endpoint_t *_txept) {
 	TXN[n-1].next = TXN;
 
 	// configure peripheral 4 as uart1_rx
-	writel((readl(DMAMUX_REG) & DMAMUX_M(4)) | DMAMUX_P(4, P4_UART1_RX), DMAMUX_REG);
-	writel(DMA_CONFIG_EN, DMA_CONFIG);
-	NVIC_EnableIRQ(DMA_IRQn);
+	lpc43xx_dma_set_periph(4, P4_UART1_RX);
+	lpc43xx_dma_register(0, swo_dma_done, NULL);
 
 	// kick off the process with an initial DMA
 	swo_start_dma(txwr->buf + 2);
@@ -0,0 +1,653 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <endian.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <compiler.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <platform.h>
+
+#include "netperf.h"
+
+#define LOCAL_TRACE 0
+
+/* tcp on NETPERF_PORT is a plain sink, so iperf (version 2) clients can be pointed
+ * at it as well. udp on NETPERF_PORT and tcp on NETPERF_RR_PORT talk the little
+ * protocol below. */
+#define NETPERF_PORT            5001
+#define NETPERF_RR_PORT         5002
+
+#define NETPERF_BUFSIZE         8192
+#define NETPERF_DEFAULT_SECS    10
+#define NETPERF_MAX_SAMPLES     8192
+#define NETPERF_UDP_TIMEOUT     1000
+#define NETPERF_UDP_FIN_TRIES   3
+
+/* every udp datagram starts with this, in network byte order */
+struct netperf_udp_hdr {
+    uint32_t seq;
+    uint32_t flags;
+} __PACKED;
+
+#define NETPERF_UDP_ECHO        (1<<0)  /* send it straight back */
+#define NETPERF_UDP_FIN         (1<<1)  /* end of a stream, answer with a report */
+
+/* what the server saw of a stream */
+struct netperf_udp_report {
+    struct netperf_udp_hdr hdr;
+    uint32_t packets;
+    uint32_t bytes_hi;
+    uint32_t bytes_lo;
+    uint32_t lost;
+    uint32_t usecs;
+} __PACKED;
+
+/* cpu time the test used, from each cpu's idle time */
+struct netperf_cpu {
+    lk_bigtime_t start;
+    lk_bigtime_t idle[SMP_MAX_CPUS];
+};
+
+struct netperf_result {
+    const char *name;
+    uint64_t bytes;
+    uint64_t packets;
+    lk_bigtime_t usecs;
+
+    /* round trip times in usecs, only the first NETPERF_MAX_SAMPLES are kept */
+    lk_bigtime_t *rtt;
+    uint rtt_count;
+
+    struct netperf_cpu cpu;
+};
+
+static lk_bigtime_t netperf_idle_time(uint cpu)
+{
+#if THREAD_STATS
+    lk_bigtime_t idle = percpu[cpu].stats.idle_time;
+
+    /* a cpu sitting in idle hasn't had the current stretch added in yet */
+    if (mp.idle_cpus & (1 << cpu))
+        idle += current_time_hires() - percpu[cpu].stats.last_idle_timestamp;
+
+    return idle;
+#else
+    return 0;
+#endif
+}
+
+static void netperf_cpu_start(struct netperf_cpu *c)
+{
+    c->start = current_time_hires();
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        c->idle[i] = netperf_idle_time(i);
+}
+
+/* average load on the active cpus since netperf_cpu_start, in hundredths of a
+ * percent, or -1 if the kernel doesn't keep thread stats */
+static int netperf_cpu_busy(const struct netperf_cpu *c)
+{
+#if THREAD_STATS
+    lk_bigtime_t elapsed = current_time_hires() - c->start;
+    lk_bigtime_t busy = 0;
+    uint cpus = 0;
+
+    if (elapsed == 0)
+        return 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(mp.active_cpus & (1 << i)))
+            continue;
+
+        lk_bigtime_t idle = netperf_idle_time(i) - c->idle[i];
+        busy += elapsed - MIN(idle, elapsed);
+        cpus++;
+    }
+
+    return (busy * 10000) / (elapsed * MAX(cpus, 1));
+#else
+    return -1;
+#endif
+}
+
+static void netperf_result_init(struct netperf_result *r, const char *name, bool rtt)
+{
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    if (rtt) {
+        r->rtt = malloc(NETPERF_MAX_SAMPLES * sizeof(lk_bigtime_t));
+        if (!r->rtt)
+            printf("netperf: no memory for rtt samples, not keeping any\n");
+    }
+    netperf_cpu_start(&r->cpu);
+}
+
+static void netperf_rtt_sample(struct netperf_result *r, lk_bigtime_t rtt)
+{
+    if (r->rtt && r->rtt_count < NETPERF_MAX_SAMPLES)
+        r->rtt[r->rtt_count++] = rtt;
+}
+
+static int netperf_rtt_compare(const void *a, const void *b)
+{
+    lk_bigtime_t x = *(const lk_bigtime_t *)a;
+    lk_bigtime_t y = *(const lk_bigtime_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void netperf_report(struct netperf_result *r)
+{
+    int busy = netperf_cpu_busy(&r->cpu);
+    lk_bigtime_t usecs = MAX(r->usecs, 1ULL);
+
+    /* bits per usec is Mbit/s, keep two decimals */
+    uint64_t mbps = r->bytes * 800 / usecs;
+    uint64_t pps = r->packets * 1000000 / usecs;
+
+    printf("%s: %llu bytes, %llu packets in %llu.%03llu s, %llu.%02llu Mbit/s, %llu packets/s",
+           r->name, r->bytes, r->packets, usecs / 1000000, (usecs / 1000) % 1000,
+           mbps / 100, mbps % 100, pps);
+
+    if (r->rtt_count > 0) {
+        qsort(r->rtt, r->rtt_count, sizeof(lk_bigtime_t), &netperf_rtt_compare);
+        printf(", rtt p50 %llu us p99 %llu us",
+               r->rtt[r->rtt_count * 50 / 100], r->rtt[r->rtt_count * 99 / 100]);
+    }
+
+    if (busy >= 0)
+        printf(", cpu %d.%02d%%", busy / 100, busy % 100);
+
+    printf("\n");
+
+    free(r->rtt);
+    r->rtt = NULL;
+}
+
+/* read exactly len bytes */
+static ssize_t netperf_tcp_read_all(netperf_socket_t *s, void *buf, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        ssize_t ret = netperf_tcp_read(s, (uint8_t *)buf + pos, len - pos);
+        if (ret <= 0)
+            return ret < 0 ? ret : ERR_CHANNEL_CLOSED;
+        pos += ret;
+    }
+
+    return len;
+}
+
+static ssize_t netperf_tcp_write_all(netperf_socket_t *s, const void *buf, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        ssize_t ret = netperf_tcp_write(s, (const uint8_t *)buf + pos, len - pos);
+        if (ret <= 0)
+            return ret < 0 ? ret : ERR_CHANNEL_CLOSED;
+        pos += ret;
+    }
+
+    return len;
+}
+
+/* servers, one connection or stream at a time each */
+
+static int netperf_tcp_sink_server(void *arg)
+{
+    netperf_socket_t *listen_socket;
+    uint8_t *buf = malloc(NETPERF_BUFSIZE);
+
+    if (!buf || netperf_tcp_listen(&listen_socket, NETPERF_PORT) < 0) {
+        printf("netperf: can't listen on tcp port %u\n", NETPERF_PORT);
+        free(buf);
+        return -1;
+    }
+
+    for (;;) {
+        netperf_socket_t *s;
+        if (netperf_tcp_accept(listen_socket, &s) < 0)
+            continue;
+
+        struct netperf_result r;
+        netperf_result_init(&r, "tcp sink", false);
+
+        lk_bigtime_t start = current_time_hires();
+        for (;;) {
+            ssize_t ret = netperf_tcp_read(s, buf, NETPERF_BUFSIZE);
+            if (ret <= 0)
+                break;
+
+            r.bytes += ret;
+            r.packets++;
+        }
+        r.usecs = current_time_hires() - start;
+
+        netperf_close(s);
+        netperf_report(&r);
+    }
+
+    return 0;
+}
+
+/* sends back whatever comes in, for tcp_rr */
+static int netperf_tcp_rr_server(void *arg)
+{
+    netperf_socket_t *listen_socket;
+    uint8_t *buf = malloc(NETPERF_BUFSIZE);
+
+    if (!buf || netperf_tcp_listen(&listen_socket, NETPERF_RR_PORT) < 0) {
+        printf("netperf: can't listen on tcp port %u\n", NETPERF_RR_PORT);
+        free(buf);
+        return -1;
+    }
+
+    for (;;) {
+        netperf_socket_t *s;
+        if (netperf_tcp_accept(listen_socket, &s) < 0)
+            continue;
+
+        for (;;) {
+            ssize_t ret = netperf_tcp_read(s, buf, NETPERF_BUFSIZE);
+            if (ret <= 0)
+                break;
+
+            if (netperf_tcp_write_all(s, buf, ret) < 0)
+                break;
+        }
+
+        netperf_close(s);
+    }
+
+    return 0;
+}
+
+/* echoes datagrams that ask for it, counts the rest and reports on them at the end */
+static int netperf_udp_server(void *arg)
+{
+    netperf_socket_t *s;
+    uint8_t *buf = malloc(NETPERF_BUFSIZE);
+
+    if (!buf || netperf_udp_open(&s, 0, NETPERF_PORT, 0) < 0) {
+        printf("netperf: can't open udp port %u\n", NETPERF_PORT);
+        free(buf);
+        return -1;
+    }
+
+    /* the stream being received */
+    uint32_t peer_addr = 0;
+    uint16_t peer_port = 0;
+    uint32_t packets = 0;
+    uint32_t next_seq = 0;
+    uint32_t lost = 0;
+    uint64_t bytes = 0;
+    lk_bigtime_t first = 0;
+    lk_bigtime_t last = 0;
+
+    for (;;) {
+        uint32_t addr;
+        uint16_t port;
+
+        ssize_t len = netperf_udp_recv(s, buf, NETPERF_BUFSIZE, &addr, &port, INFINITE_TIME);
+        if (len < (ssize_t)sizeof(struct netperf_udp_hdr))
+            continue;
+
+        struct netperf_udp_hdr *hdr = (void *)buf;
+        uint32_t seq = ntohl(hdr->seq);
+        uint32_t flags = ntohl(hdr->flags);
+
+        if (flags & NETPERF_UDP_ECHO) {
+            netperf_udp_send(s, buf, len, addr, port);
+            continue;
+        }
+
+        if (addr != peer_addr || port != peer_port || seq == 0) {
+            peer_addr = addr;
+            peer_port = port;
+            packets = 0;
+            next_seq = 0;
+            lost = 0;
+            bytes = 0;
+            first = current_time_hires();
+        }
+
+        if (flags & NETPERF_UDP_FIN) {
+            struct netperf_udp_report rep = {
+                .hdr = { .seq = htonl(seq), .flags = htonl(NETPERF_UDP_FIN) },
+                .packets = htonl(packets),
+                .bytes_hi = htonl(bytes >> 32),
+                .bytes_lo = htonl(bytes),
+                .lost = htonl(lost + (seq > next_seq ? seq - next_seq : 0)),
+                .usecs = htonl(packets ? last - first : 0),
+            };
+            netperf_udp_send(s, &rep, sizeof(rep), addr, port);
+            continue;
+        }
+
+        /* anything skipped over counts as lost, late arrivals take it back */
+        if (seq >= next_seq) {
+            lost += seq - next_seq;
+            next_seq = seq + 1;
+        } else if (lost > 0) {
+            lost--;
+        }
+
+        packets++;
+        bytes += len;
+        last = current_time_hires();
+    }
+
+    return 0;
+}
+
+static void netperf_start_servers(void)
+{
+    static bool started;
+
+    if (started) {
+        printf("netperf: servers already running\n");
+        return;
+    }
+    started = true;
+
+    thread_detach_and_resume(thread_create("netperf tcp", &netperf_tcp_sink_server, NULL,
+                                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    thread_detach_and_resume(thread_create("netperf tcp_rr", &netperf_tcp_rr_server, NULL,
+                                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    thread_detach_and_resume(thread_create("netperf udp", &netperf_udp_server, NULL,
+                                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+
+    printf("netperf: tcp sink on port %u, tcp echo on %u, udp on %u\n",
+           NETPERF_PORT, NETPERF_RR_PORT, NETPERF_PORT);
+}
+
+/* clients, each runs for secs seconds in the calling thread */
+
+static status_t netperf_tcp_stream(uint32_t addr, lk_time_t secs, size_t size, uint8_t *buf)
+{
+    netperf_socket_t *s;
+    status_t err = netperf_tcp_connect(&s, addr, NETPERF_PORT);
+    if (err < 0)
+        return err;
+
+    struct netperf_result r;
+    netperf_result_init(&r, "tcp_stream", false);
+
+    lk_bigtime_t start = current_time_hires();
+    lk_bigtime_t end = start + secs * 1000000ULL;
+
+    do {
+        ssize_t ret = netperf_tcp_write(s, buf, size);
+        if (ret <= 0) {
+            err = ret < 0 ? ret : ERR_CHANNEL_CLOSED;
+            break;
+        }
+
+        r.bytes += ret;
+        r.packets++;
+    } while (current_time_hires() < end);
+    r.usecs = current_time_hires() - start;
+
+    netperf_close(s);
+    netperf_report(&r);
+
+    return err;
+}
+
+static status_t netperf_tcp_rr(uint32_t addr, lk_time_t secs, size_t size, uint8_t *buf)
+{
+    netperf_socket_t *s;
+    status_t err = netperf_tcp_connect(&s, addr, NETPERF_RR_PORT);
+    if (err < 0)
+        return err;
+
+    struct netperf_result r;
+    netperf_result_init(&r, "tcp_rr", true);
+
+    lk_bigtime_t start = current_time_hires();
+    lk_bigtime_t end = start + secs * 1000000ULL;
+    lk_bigtime_t now = start;
+
+    while (now < end) {
+        lk_bigtime_t t = now;
+
+        ssize_t ret = netperf_tcp_write_all(s, buf, size);
+        if (ret >= 0)
+            ret = netperf_tcp_read_all(s, buf, size);
+        if (ret < 0) {
+            err = ret;
+            break;
+        }
+
+        now = current_time_hires();
+        netperf_rtt_sample(&r, now - t);
+        r.bytes += size;
+        r.packets++;
+    }
+    r.usecs = current_time_hires() - start;
+
+    netperf_close(s);
+    netperf_report(&r);
+
+    return err;
+}
+
+static status_t netperf_udp_stream(uint32_t addr, lk_time_t secs, size_t size, uint8_t *buf)
+{
+    netperf_socket_t *s;
+    status_t err = netperf_udp_open(&s, addr, 0, NETPERF_PORT);
+    if (err < 0)
+        return err;
+
+    struct netperf_result r;
+    netperf_result_init(&r, "udp_stream", false);
+
+    struct netperf_udp_hdr *hdr = (void *)buf;
+    hdr->flags = 0;
+
+    lk_bigtime_t start = current_time_hires();
+    lk_bigtime_t end = start + secs * 1000000ULL;
+    uint32_t seq = 0;
+
+    do {
+        hdr->seq = htonl(seq);
+
+        /* out of buffers is just a drop as far as udp is concerned, keep going */
+        if (netperf_udp_send(s, buf, size, addr, NETPERF_PORT) >= 0) {
+            r.bytes += size;
+            r.packets++;
+        }
+        seq++;
+    } while (current_time_hires() < end);
+    r.usecs = current_time_hires() - start;
+
+    netperf_report(&r);
+
+    /* ask the server what made it */
+    struct netperf_udp_report rep;
+    hdr->seq = htonl(seq);
+    hdr->flags = htonl(NETPERF_UDP_FIN);
+
+    err = ERR_TIMED_OUT;
+    for (uint i = 0; i < NETPERF_UDP_FIN_TRIES && err < 0; i++) {
+        netperf_udp_send(s, hdr, sizeof(*hdr), addr, NETPERF_PORT);
+
+        ssize_t len;
+        while ((len = netperf_udp_recv(s, &rep, sizeof(rep), NULL, NULL, NETPERF_UDP_TIMEOUT)) >= 0) {
+            if (len == sizeof(rep) && (ntohl(rep.hdr.flags) & NETPERF_UDP_FIN)) {
+                err = NO_ERROR;
+                break;
+            }
+        }
+    }
+
+    if (err < 0) {
+        printf("udp_stream: no report from the server\n");
+    } else {
+        uint64_t bytes = (uint64_t)ntohl(rep.bytes_hi) << 32 | ntohl(rep.bytes_lo);
+        lk_bigtime_t usecs = MAX(ntohl(rep.usecs), 1U);
+        uint32_t packets = ntohl(rep.packets);
+        uint32_t lost = ntohl(rep.lost);
+        uint64_t mbps = bytes * 800 / usecs;
+        uint lostpct = lost * 10000ULL / MAX(seq, 1U);
+
+        printf("udp_stream: server received %u packets, %llu.%02llu Mbit/s, lost %u (%u.%02u%%)\n",
+               packets, mbps / 100, mbps % 100, lost, lostpct / 100, lostpct % 100);
+    }
+
+    netperf_close(s);
+
+    return err;
+}
+
+static status_t netperf_udp_rr(uint32_t addr, lk_time_t secs, size_t size, uint8_t *buf)
+{
+    netperf_socket_t *s;
+    status_t err = netperf_udp_open(&s, addr, 0, NETPERF_PORT);
+    if (err < 0)
+        return err;
+
+    struct netperf_result r;
+    netperf_result_init(&r, "udp_rr", true);
+
+    struct netperf_udp_hdr *hdr = (void *)buf;
+    struct netperf_udp_hdr reply;
+    uint32_t lost = 0;
+
+    lk_bigtime_t start = current_time_hires();
+    lk_bigtime_t end = start + secs * 1000000ULL;
+    lk_bigtime_t now = start;
+
+    for (uint32_t seq = 0; now < end; seq++) {
+        lk_bigtime_t t = now;
+
+        hdr->seq = htonl(seq);
+        hdr->flags = htonl(NETPERF_UDP_ECHO);
+        netperf_udp_send(s, buf, size, addr, NETPERF_PORT);
+
+        /* wait for this one, late answers to earlier ones are just dropped */
+        ssize_t len;
+        while ((len = netperf_udp_recv(s, &reply, sizeof(reply), NULL, NULL, NETPERF_UDP_TIMEOUT)) >= 0) {
+            if (len >= (ssize_t)sizeof(reply) && ntohl(reply.seq) == seq)
+                break;
+        }
+
+        now = current_time_hires();
+        if (len < 0) {
+            lost++;
+            continue;
+        }
+
+        netperf_rtt_sample(&r, now - t);
+        r.bytes += size;
+        r.packets++;
+    }
+    r.usecs = current_time_hires() - start;
+
+    netperf_close(s);
+    netperf_report(&r);
+    if (lost)
+        printf("udp_rr: %u requests went unanswered\n", lost);
+
+    return NO_ERROR;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static const struct {
+    const char *name;
+    status_t (*func)(uint32_t addr, lk_time_t secs, size_t size, uint8_t *buf);
+    size_t default_size;
+    size_t min_size;
+} netperf_tests[] = {
+    { "tcp_stream", &netperf_tcp_stream, NETPERF_BUFSIZE, 1 },
+    { "tcp_rr", &netperf_tcp_rr, 64, 1 },
+    { "udp_stream", &netperf_udp_stream, 1472, sizeof(struct netperf_udp_hdr) },
+    { "udp_rr", &netperf_udp_rr, 64, sizeof(struct netperf_udp_hdr) },
+};
+
+static int cmd_netperf(int argc, const cmd_args *argv)
+{
+    if (argc == 2 && !strcmp(argv[1].str, "server")) {
+        netperf_start_servers();
+        return 0;
+    }
+
+    if (argc < 3) {
+usage:
+        printf("usage: %s server\n", argv[0].str);
+        printf("usage: %s <test> <address> [seconds] [size]\n", argv[0].str);
+        printf("tests:");
+        for (uint i = 0; i < countof(netperf_tests); i++)
+            printf(" %s", netperf_tests[i].name);
+        printf("\n");
+        return -1;
+    }
+
+    uint i;
+    for (i = 0; i < countof(netperf_tests); i++) {
+        if (!strcmp(argv[1].str, netperf_tests[i].name))
+            break;
+    }
+    if (i == countof(netperf_tests))
+        goto usage;
+
+    uint32_t addr = netperf_parse_addr(argv[2].str);
+    lk_time_t secs = (argc > 3) ? argv[3].u : NETPERF_DEFAULT_SECS;
+    size_t size = (argc > 4) ? argv[4].u : netperf_tests[i].default_size;
+
+    if (size < netperf_tests[i].min_size || size > NETPERF_BUFSIZE) {
+        printf("size must be between %zu and %u\n", netperf_tests[i].min_size, NETPERF_BUFSIZE);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(NETPERF_BUFSIZE);
+    if (!buf)
+        return ERR_NO_MEMORY;
+    memset(buf, 0x5a, NETPERF_BUFSIZE);
+
+    status_t err = netperf_tests[i].func(addr, secs, size, buf);
+    if (err == ERR_NOT_SUPPORTED)
+        printf("%s: not supported by this network stack\n", netperf_tests[i].name);
+    else if (err < 0)
+        printf("%s: error %d\n", netperf_tests[i].name, err);
+
+    free(buf);
+
+    return err;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("netperf", "network throughput and latency tests", &cmd_netperf)
+STATIC_COMMAND_END(netperf);
+
+#endif
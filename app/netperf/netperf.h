@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The little of a network stack that netperf needs. stack_minip.c or stack_lwip.c
+ * provide it, depending on NETPERF_STACK. Addresses are ipv4 in network byte order,
+ * ports in host order.
+ */
+typedef struct netperf_socket netperf_socket_t;
+
+uint32_t netperf_parse_addr(const char *str);
+
+status_t netperf_tcp_listen(netperf_socket_t **s, uint16_t port);
+status_t netperf_tcp_accept(netperf_socket_t *listen_socket, netperf_socket_t **s);
+status_t netperf_tcp_connect(netperf_socket_t **s, uint32_t addr, uint16_t port);
+ssize_t netperf_tcp_read(netperf_socket_t *s, void *buf, size_t len);
+ssize_t netperf_tcp_write(netperf_socket_t *s, const void *buf, size_t len);
+
+/* a udp socket on the local port lport, 0 picks one. datagrams from anywhere are
+ * received if addr is 0, otherwise only those from addr:port. */
+status_t netperf_udp_open(netperf_socket_t **s, uint32_t addr, uint16_t lport, uint16_t port);
+ssize_t netperf_udp_send(netperf_socket_t *s, const void *buf, size_t len, uint32_t addr, uint16_t port);
+
+/* returns ERR_TIMED_OUT if nothing arrived within timeout */
+ssize_t netperf_udp_recv(netperf_socket_t *s, void *buf, size_t len,
+                         uint32_t *addr, uint16_t *port, lk_time_t timeout);
+
+void netperf_close(netperf_socket_t *s);
@@ -0,0 +1,21 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/netperf.c \
+
+# which network stack to measure, minip or lwip
+NETPERF_STACK ?= minip
+
+ifeq ($(NETPERF_STACK),minip)
+MODULE_DEPS += lib/minip
+MODULE_SRCS += $(LOCAL_DIR)/stack_minip.c
+else ifeq ($(NETPERF_STACK),lwip)
+MODULE_DEPS += lib/lwip
+MODULE_SRCS += $(LOCAL_DIR)/stack_lwip.c
+else
+$(error NETPERF_STACK must be minip or lwip)
+endif
+
+include make/module.mk
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "netperf.h"
+
+#include <err.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lwip/sockets.h>
+#include <lwip/ip_addr.h>
+
+struct netperf_socket {
+    int fd;
+    lk_time_t timeout;  /* receive timeout last set on fd */
+};
+
+uint32_t netperf_parse_addr(const char *str)
+{
+    return ipaddr_addr(str);
+}
+
+static void netperf_sockaddr(struct sockaddr_in *sin, uint32_t addr, uint16_t port)
+{
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_len = sizeof(*sin);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = addr;
+}
+
+static status_t netperf_socket_open(netperf_socket_t **s, int type, uint16_t lport)
+{
+    netperf_socket_t *ns = malloc(sizeof(*ns));
+    if (!ns)
+        return ERR_NO_MEMORY;
+
+    ns->timeout = INFINITE_TIME;
+    ns->fd = lwip_socket(AF_INET, type, 0);
+    if (ns->fd < 0) {
+        free(ns);
+        return ERR_NO_RESOURCES;
+    }
+
+    if (lport) {
+        struct sockaddr_in sin;
+        netperf_sockaddr(&sin, INADDR_ANY, lport);
+        if (lwip_bind(ns->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            netperf_close(ns);
+            return ERR_ALREADY_EXISTS;
+        }
+    }
+
+    *s = ns;
+    return NO_ERROR;
+}
+
+status_t netperf_tcp_listen(netperf_socket_t **s, uint16_t port)
+{
+    status_t err = netperf_socket_open(s, SOCK_STREAM, port);
+    if (err < 0)
+        return err;
+
+    if (lwip_listen((*s)->fd, 4) < 0) {
+        netperf_close(*s);
+        return ERR_IO;
+    }
+
+    return NO_ERROR;
+}
+
+/* request/response runs are all about latency, don't let nagle hold anything back */
+static void netperf_set_nodelay(int fd)
+{
+    int one = 1;
+    lwip_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+status_t netperf_tcp_accept(netperf_socket_t *listen_socket, netperf_socket_t **s)
+{
+    netperf_socket_t *ns = malloc(sizeof(*ns));
+    if (!ns)
+        return ERR_NO_MEMORY;
+
+    ns->timeout = INFINITE_TIME;
+    ns->fd = lwip_accept(listen_socket->fd, NULL, NULL);
+    if (ns->fd < 0) {
+        free(ns);
+        return ERR_IO;
+    }
+    netperf_set_nodelay(ns->fd);
+
+    *s = ns;
+    return NO_ERROR;
+}
+
+status_t netperf_tcp_connect(netperf_socket_t **s, uint32_t addr, uint16_t port)
+{
+    status_t err = netperf_socket_open(s, SOCK_STREAM, 0);
+    if (err < 0)
+        return err;
+
+    struct sockaddr_in sin;
+    netperf_sockaddr(&sin, addr, port);
+    if (lwip_connect((*s)->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        netperf_close(*s);
+        return ERR_CHANNEL_CLOSED;
+    }
+    netperf_set_nodelay((*s)->fd);
+
+    return NO_ERROR;
+}
+
+ssize_t netperf_tcp_read(netperf_socket_t *s, void *buf, size_t len)
+{
+    int ret = lwip_recv(s->fd, buf, len, 0);
+
+    return ret < 0 ? ERR_IO : ret;
+}
+
+ssize_t netperf_tcp_write(netperf_socket_t *s, const void *buf, size_t len)
+{
+    int ret = lwip_send(s->fd, buf, len, 0);
+
+    return ret < 0 ? ERR_IO : ret;
+}
+
+status_t netperf_udp_open(netperf_socket_t **s, uint32_t addr, uint16_t lport, uint16_t port)
+{
+    status_t err = netperf_socket_open(s, SOCK_DGRAM, lport);
+    if (err < 0)
+        return err;
+
+    /* a connected socket only hears from its peer */
+    if (addr) {
+        struct sockaddr_in sin;
+        netperf_sockaddr(&sin, addr, port);
+        if (lwip_connect((*s)->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            netperf_close(*s);
+            return ERR_IO;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+ssize_t netperf_udp_send(netperf_socket_t *s, const void *buf, size_t len, uint32_t addr, uint16_t port)
+{
+    struct sockaddr_in sin;
+    netperf_sockaddr(&sin, addr, port);
+
+    int ret = lwip_sendto(s->fd, buf, len, 0, (struct sockaddr *)&sin, sizeof(sin));
+
+    return ret < 0 ? ERR_IO : ret;
+}
+
+ssize_t netperf_udp_recv(netperf_socket_t *s, void *buf, size_t len,
+                         uint32_t *addr, uint16_t *port, lk_time_t timeout)
+{
+    if (timeout != s->timeout) {
+        /* lwip takes 0 to mean no timeout */
+        int ms = (timeout == INFINITE_TIME) ? 0 : MAX(timeout, 1);
+        lwip_setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &ms, sizeof(ms));
+        s->timeout = timeout;
+    }
+
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+
+    int ret = lwip_recvfrom(s->fd, buf, len, 0, (struct sockaddr *)&sin, &sinlen);
+    if (ret < 0)
+        return (errno == EWOULDBLOCK) ? ERR_TIMED_OUT : ERR_IO;
+
+    if (addr)
+        *addr = sin.sin_addr.s_addr;
+    if (port)
+        *port = ntohs(sin.sin_port);
+
+    return ret;
+}
+
+void netperf_close(netperf_socket_t *s)
+{
+    lwip_close(s->fd);
+    free(s);
+}
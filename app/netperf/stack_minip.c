@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "netperf.h"
+
+#include <err.h>
+#include <malloc.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <lib/minip.h>
+
+/* minip can only answer tcp connections, it has no way to open one */
+struct netperf_socket {
+    tcp_socket_t *tcp;
+    udp_socket_t *udp;
+    uint32_t addr;
+    uint16_t lport;
+    uint16_t port;
+
+    /* replies to a socket that takes datagrams from anyone go out through this,
+     * opened to one peer at a time */
+    udp_socket_t *reply;
+    uint32_t reply_addr;
+    uint16_t reply_port;
+};
+
+static volatile int netperf_next_port = 49152;
+
+uint32_t netperf_parse_addr(const char *str)
+{
+    return minip_parse_ipaddr(str, strlen(str));
+}
+
+static netperf_socket_t *netperf_socket_alloc(void)
+{
+    return calloc(1, sizeof(netperf_socket_t));
+}
+
+status_t netperf_tcp_listen(netperf_socket_t **s, uint16_t port)
+{
+    netperf_socket_t *ns = netperf_socket_alloc();
+    if (!ns)
+        return ERR_NO_MEMORY;
+
+    status_t err = tcp_open_listen(&ns->tcp, port);
+    if (err < 0) {
+        free(ns);
+        return err;
+    }
+
+    *s = ns;
+    return NO_ERROR;
+}
+
+status_t netperf_tcp_accept(netperf_socket_t *listen_socket, netperf_socket_t **s)
+{
+    netperf_socket_t *ns = netperf_socket_alloc();
+    if (!ns)
+        return ERR_NO_MEMORY;
+
+    status_t err = tcp_accept(listen_socket->tcp, &ns->tcp);
+    if (err < 0) {
+        free(ns);
+        return err;
+    }
+
+    *s = ns;
+    return NO_ERROR;
+}
+
+status_t netperf_tcp_connect(netperf_socket_t **s, uint32_t addr, uint16_t port)
+{
+    return ERR_NOT_SUPPORTED;
+}
+
+ssize_t netperf_tcp_read(netperf_socket_t *s, void *buf, size_t len)
+{
+    return tcp_read(s->tcp, buf, len);
+}
+
+ssize_t netperf_tcp_write(netperf_socket_t *s, const void *buf, size_t len)
+{
+    return tcp_write(s->tcp, buf, len);
+}
+
+status_t netperf_udp_open(netperf_socket_t **s, uint32_t addr, uint16_t lport, uint16_t port)
+{
+    netperf_socket_t *ns = netperf_socket_alloc();
+    if (!ns)
+        return ERR_NO_MEMORY;
+
+    if (lport == 0)
+        lport = atomic_add(&netperf_next_port, 1);
+    ns->addr = addr;
+    ns->lport = lport;
+    ns->port = port;
+
+    status_t err = udp_open(addr ? addr : IPV4_BCAST, lport, port, &ns->udp);
+    if (err < 0) {
+        free(ns);
+        return err;
+    }
+
+    *s = ns;
+    return NO_ERROR;
+}
+
+ssize_t netperf_udp_send(netperf_socket_t *s, const void *buf, size_t len, uint32_t addr, uint16_t port)
+{
+    udp_socket_t *handle = s->udp;
+
+    if (addr != s->addr || port != s->port) {
+        if (!s->reply || s->reply_addr != addr || s->reply_port != port) {
+            if (s->reply)
+                udp_close(s->reply);
+            s->reply = NULL;
+
+            /* opened after s->udp, so datagrams from the peer still queue on that */
+            status_t err = udp_open(addr, s->lport, port, &s->reply);
+            if (err < 0)
+                return err;
+            s->reply_addr = addr;
+            s->reply_port = port;
+        }
+        handle = s->reply;
+    }
+
+    status_t err = udp_send((void *)buf, len, handle);
+    if (err < 0)
+        return err;
+
+    return len;
+}
+
+ssize_t netperf_udp_recv(netperf_socket_t *s, void *buf, size_t len,
+                         uint32_t *addr, uint16_t *port, lk_time_t timeout)
+{
+    udp_msg_t msg = { .buf = buf, .len = len };
+
+    ssize_t ret = udp_recv_batch(&msg, 1, s->udp, timeout);
+    if (ret < 0)
+        return ret;
+    if (ret == 0)
+        return ERR_TIMED_OUT;
+
+    if (addr)
+        *addr = msg.addr;
+    if (port)
+        *port = msg.port;
+
+    return msg.len;
+}
+
+void netperf_close(netperf_socket_t *s)
+{
+    if (s->tcp)
+        tcp_close(s->tcp);
+    if (s->reply)
+        udp_close(s->reply);
+    if (s->udp)
+        udp_close(s->udp);
+    free(s);
+}
@@ -0,0 +1,761 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <compiler.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <lib/fs.h>
+#include <platform.h>
+#if WITH_LIB_MINIP
+#include <lib/minip.h>
+#endif
+#if WITH_LIB_GFX
+#include <dev/display.h>
+#include <lib/gfx.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/*
+ * Replays a scripted mix of work across subsystems at once, so regressions that
+ * only show up when they contend with each other get caught. A script is one
+ * directive per line, # starts a comment:
+ *
+ *   duration <secs>                  how long each run lasts
+ *   runs <n>                         how many runs to do
+ *   mount <path> <device>            mount a filesystem before starting
+ *   tcp_echo <port>                  echo whatever scripts/perfreplay.py load sends
+ *   fs_load <path> [threads]         fs_load_file the file over and over
+ *   timers <threads> <period us>     sleep on oneshot timers, latency is lateness
+ *   gfx <fps>                        fill and flush a frame at a fixed rate
+ *
+ * Every run prints one line of the json summary with the throughput and
+ * latency percentiles of each worker and how idle each cpu was.
+ */
+
+#define PERFREPLAY_VERSION          1
+#define PERFREPLAY_MAX_WORKERS      8
+#define PERFREPLAY_MAX_THREADS      8
+#define PERFREPLAY_MAX_SAMPLES      4096
+#define PERFREPLAY_MAX_ARGS         8
+#define PERFREPLAY_MAX_SCRIPT       4096
+#define PERFREPLAY_DEFAULT_SECS     10
+#define PERFREPLAY_DEFAULT_RUNS     3
+#define PERFREPLAY_TCP_BUFSIZE      2048
+#define PERFREPLAY_FS_MAX_FILE      (4 * 1024 * 1024)
+
+static const char perfreplay_builtin[] =
+    "# drive the echo with scripts/perfreplay.py load <host> 5003\n"
+    "duration 10\n"
+    "runs 3\n"
+    "mount /perf virtio0\n"
+    "tcp_echo 5003\n"
+    "fs_load /perf/data 2\n"
+    "timers 4 1000\n"
+    "gfx 60\n";
+
+enum perfreplay_type {
+    PERFREPLAY_TCP_ECHO,
+    PERFREPLAY_FS_LOAD,
+    PERFREPLAY_TIMERS,
+    PERFREPLAY_GFX,
+};
+
+struct perfreplay_worker {
+    enum perfreplay_type type;
+    char name[48];
+    char path[64];
+    uint threads;
+    uint param;             /* tcp port, timer period in us or frames per second */
+    size_t len;             /* size of the file fs_load reads */
+    thread_t *t[PERFREPLAY_MAX_THREADS];
+
+    /* the current run, under lock */
+    spin_lock_t lock;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t lat_seen;
+    uint32_t lat_max;
+    uint lat_count;
+    uint32_t lat[PERFREPLAY_MAX_SAMPLES];  /* us, a uniform sample of lat_seen */
+};
+
+struct perfreplay_cpu {
+    lk_bigtime_t start;
+    lk_bigtime_t idle[SMP_MAX_CPUS];
+};
+
+struct perfreplay_script {
+    uint secs;
+    uint runs;
+    uint worker_count;
+    struct perfreplay_worker *workers[PERFREPLAY_MAX_WORKERS];
+};
+
+static volatile bool perfreplay_running;
+
+static void perfreplay_record(struct perfreplay_worker *w, size_t bytes, lk_bigtime_t lat)
+{
+    uint32_t us = MIN(lat, (lk_bigtime_t)UINT32_MAX);
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&w->lock, state);
+    w->ops++;
+    w->bytes += bytes;
+    w->lat_max = MAX(w->lat_max, us);
+    if (w->lat_count < PERFREPLAY_MAX_SAMPLES) {
+        w->lat[w->lat_count++] = us;
+    } else {
+        /* reservoir sample, so a long run doesn't only keep its start */
+        uint64_t i = (((uint64_t)rand() << 31) ^ (uint64_t)rand()) % (w->lat_seen + 1);
+        if (i < PERFREPLAY_MAX_SAMPLES)
+            w->lat[i] = us;
+    }
+    w->lat_seen++;
+    spin_unlock_irqrestore(&w->lock, state);
+}
+
+static void perfreplay_error(struct perfreplay_worker *w)
+{
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&w->lock, state);
+    w->errors++;
+    spin_unlock_irqrestore(&w->lock, state);
+}
+
+static void perfreplay_reset(struct perfreplay_worker *w)
+{
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&w->lock, state);
+    w->ops = w->bytes = w->errors = w->lat_seen = 0;
+    w->lat_max = 0;
+    w->lat_count = 0;
+    spin_unlock_irqrestore(&w->lock, state);
+}
+
+#if WITH_LIB_MINIP
+/* the listener lives on past the run that started it, connections made by
+ * the host outlast any one run. They count into whichever worker is current */
+static spin_lock_t perfreplay_tcp_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct perfreplay_worker *perfreplay_tcp_worker;
+static uint16_t perfreplay_tcp_port;
+
+static int perfreplay_tcp_conn_thread(void *arg)
+{
+    tcp_socket_t *s = arg;
+    uint8_t *buf = malloc(PERFREPLAY_TCP_BUFSIZE);
+
+    while (buf) {
+        ssize_t len = tcp_read(s, buf, PERFREPLAY_TCP_BUFSIZE);
+        if (len <= 0)
+            break;
+
+        /* turnaround inside lk, the host side times the round trip */
+        lk_bigtime_t start = current_time_hires();
+        ssize_t pos = 0;
+        while (pos < len) {
+            ssize_t ret = tcp_write(s, buf + pos, len - pos);
+            if (ret <= 0)
+                break;
+            pos += ret;
+        }
+        lk_bigtime_t lat = current_time_hires() - start;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&perfreplay_tcp_lock, state);
+        if (perfreplay_tcp_worker) {
+            if (pos < len)
+                perfreplay_error(perfreplay_tcp_worker);
+            else
+                perfreplay_record(perfreplay_tcp_worker, len, lat);
+        }
+        spin_unlock_irqrestore(&perfreplay_tcp_lock, state);
+
+        if (pos < len)
+            break;
+    }
+
+    free(buf);
+    tcp_close(s);
+
+    return 0;
+}
+
+static int perfreplay_tcp_listen_thread(void *arg)
+{
+    tcp_socket_t *listen_socket = arg;
+
+    for (;;) {
+        tcp_socket_t *s;
+        if (tcp_accept(listen_socket, &s) < 0)
+            continue;
+
+        thread_t *t = thread_create("perfreplay tcp", &perfreplay_tcp_conn_thread, s,
+                                    DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t) {
+            tcp_close(s);
+            continue;
+        }
+        thread_detach_and_resume(t);
+    }
+
+    return 0;
+}
+
+static status_t perfreplay_tcp_listen(uint16_t port)
+{
+    if (perfreplay_tcp_port == port)
+        return NO_ERROR;
+    if (perfreplay_tcp_port)
+        return ERR_ALREADY_STARTED;
+
+    tcp_socket_t *listen_socket;
+    status_t err = tcp_open_listen(&listen_socket, port);
+    if (err < 0)
+        return err;
+
+    thread_t *t = thread_create("perfreplay listen", &perfreplay_tcp_listen_thread, listen_socket,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t) {
+        tcp_close(listen_socket);
+        return ERR_NO_MEMORY;
+    }
+    thread_detach_and_resume(t);
+    perfreplay_tcp_port = port;
+
+    return NO_ERROR;
+}
+
+static void perfreplay_tcp_set_worker(struct perfreplay_worker *w)
+{
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&perfreplay_tcp_lock, state);
+    perfreplay_tcp_worker = w;
+    spin_unlock_irqrestore(&perfreplay_tcp_lock, state);
+}
+#endif
+
+static int perfreplay_fs_thread(void *arg)
+{
+    struct perfreplay_worker *w = arg;
+    void *buf = malloc(w->len);
+
+    if (!buf) {
+        perfreplay_error(w);
+        return ERR_NO_MEMORY;
+    }
+
+    while (perfreplay_running) {
+        lk_bigtime_t start = current_time_hires();
+        ssize_t ret = fs_load_file(w->path, buf, w->len);
+        if (ret < 0) {
+            perfreplay_error(w);
+            /* don't spin the cpu if the file went away */
+            thread_sleep(10);
+            continue;
+        }
+        perfreplay_record(w, ret, current_time_hires() - start);
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static enum handler_return perfreplay_timer_callback(timer_t *t, lk_time_t now, void *arg)
+{
+    event_signal((event_t *)arg, false);
+
+    return INT_RESCHEDULE;
+}
+
+static int perfreplay_timers_thread(void *arg)
+{
+    struct perfreplay_worker *w = arg;
+    timer_t timer;
+    event_t event;
+
+    timer_initialize(&timer);
+    event_init(&event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    while (perfreplay_running) {
+        lk_bigtime_t deadline = current_time_hires() + w->param;
+        timer_set_oneshot_hires(&timer, w->param, &perfreplay_timer_callback, &event);
+        event_wait(&event);
+
+        lk_bigtime_t now = current_time_hires();
+        perfreplay_record(w, 0, (now > deadline) ? now - deadline : 0);
+    }
+
+    timer_cancel(&timer);
+    event_destroy(&event);
+
+    return 0;
+}
+
+#if WITH_LIB_GFX
+static int perfreplay_gfx_thread(void *arg)
+{
+    struct perfreplay_worker *w = arg;
+    struct display_info info;
+    gfx_surface *surface;
+
+    /* without a display the flushes are no-ops, but the fills still load memory */
+    if (display_get_info(&info) >= 0)
+        surface = gfx_create_surface_from_display(&info);
+    else
+        surface = gfx_create_surface(NULL, 640, 480, 640, GFX_FORMAT_RGB_x888);
+    if (!surface) {
+        perfreplay_error(w);
+        return ERR_NO_MEMORY;
+    }
+
+    lk_bigtime_t frame = 1000000 / w->param;
+    lk_bigtime_t next = current_time_hires();
+    uint color = 0;
+
+    while (perfreplay_running) {
+        lk_bigtime_t start = current_time_hires();
+        gfx_fillrect(surface, 0, 0, surface->width, surface->height, 0xff000000 | (color++ * 0x010305));
+        gfx_flush(surface);
+        perfreplay_record(w, surface->len, current_time_hires() - start);
+
+        /* a frame that ran over is dropped rather than caught up on */
+        next += frame;
+        lk_bigtime_t now = current_time_hires();
+        if (next > now)
+            thread_sleep_hires(next - now);
+        else
+            next = now;
+    }
+
+    gfx_surface_destroy(surface);
+
+    return 0;
+}
+#endif
+
+static lk_bigtime_t perfreplay_idle_time(uint cpu)
+{
+#if THREAD_STATS
+    lk_bigtime_t idle = percpu[cpu].stats.idle_time;
+
+    /* a cpu sitting in idle hasn't had the current stretch added in yet */
+    if (mp.idle_cpus & (1 << cpu))
+        idle += current_time_hires() - percpu[cpu].stats.last_idle_timestamp;
+
+    return idle;
+#else
+    return 0;
+#endif
+}
+
+static void perfreplay_cpu_start(struct perfreplay_cpu *c)
+{
+    c->start = current_time_hires();
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        c->idle[i] = perfreplay_idle_time(i);
+}
+
+/* idle time of each cpu since perfreplay_cpu_start, in hundredths of a percent */
+static void perfreplay_cpu_stop(struct perfreplay_cpu *c)
+{
+    lk_bigtime_t elapsed = MAX(current_time_hires() - c->start, 1ULL);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        lk_bigtime_t idle = perfreplay_idle_time(i) - c->idle[i];
+        c->idle[i] = MIN(idle, elapsed) * 10000 / elapsed;
+    }
+}
+
+static int perfreplay_lat_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t perfreplay_percentile(const struct perfreplay_worker *w, uint pct)
+{
+    if (w->lat_count == 0)
+        return 0;
+
+    return w->lat[MIN(w->lat_count * pct / 100, w->lat_count - 1)];
+}
+
+static void perfreplay_worker_name(struct perfreplay_worker *w)
+{
+    switch (w->type) {
+        case PERFREPLAY_TCP_ECHO:
+            snprintf(w->name, sizeof(w->name), "tcp_echo:%u", w->param);
+            break;
+        case PERFREPLAY_FS_LOAD:
+            snprintf(w->name, sizeof(w->name), "fs_load:%s", w->path);
+            break;
+        case PERFREPLAY_TIMERS:
+            snprintf(w->name, sizeof(w->name), "timers:%uus", w->param);
+            break;
+        case PERFREPLAY_GFX:
+            snprintf(w->name, sizeof(w->name), "gfx:%ufps", w->param);
+            break;
+    }
+}
+
+static status_t perfreplay_worker_start(struct perfreplay_worker *w)
+{
+    thread_start_routine entry;
+
+    switch (w->type) {
+#if WITH_LIB_MINIP
+        case PERFREPLAY_TCP_ECHO:
+            perfreplay_tcp_set_worker(w);
+            return NO_ERROR;
+#endif
+        case PERFREPLAY_FS_LOAD:
+            entry = &perfreplay_fs_thread;
+            break;
+        case PERFREPLAY_TIMERS:
+            entry = &perfreplay_timers_thread;
+            break;
+#if WITH_LIB_GFX
+        case PERFREPLAY_GFX:
+            entry = &perfreplay_gfx_thread;
+            break;
+#endif
+        default:
+            return ERR_NOT_SUPPORTED;
+    }
+
+    for (uint i = 0; i < w->threads; i++) {
+        w->t[i] = thread_create(w->name, entry, w, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!w->t[i])
+            return ERR_NO_MEMORY;
+        thread_resume(w->t[i]);
+    }
+
+    return NO_ERROR;
+}
+
+static void perfreplay_worker_stop(struct perfreplay_worker *w)
+{
+#if WITH_LIB_MINIP
+    if (w->type == PERFREPLAY_TCP_ECHO)
+        perfreplay_tcp_set_worker(NULL);
+#endif
+
+    for (uint i = 0; i < w->threads; i++) {
+        if (w->t[i])
+            thread_join(w->t[i], NULL, INFINITE_TIME);
+        w->t[i] = NULL;
+    }
+}
+
+static void perfreplay_report(const struct perfreplay_script *s, uint run, lk_bigtime_t usecs,
+                              const struct perfreplay_cpu *c)
+{
+    usecs = MAX(usecs, 1ULL);
+
+    printf("%s{\"run\": %u, \"usecs\": %llu, \"cpus\": [", run ? "," : "", run, usecs);
+    bool first = true;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(mp.active_cpus & (1 << i)))
+            continue;
+#if THREAD_STATS
+        printf("%s{\"cpu\": %u, \"idle_pct\": %llu.%02llu}", first ? "" : ", ", i,
+               c->idle[i] / 100, c->idle[i] % 100);
+#else
+        printf("%s{\"cpu\": %u, \"idle_pct\": null}", first ? "" : ", ", i);
+#endif
+        first = false;
+    }
+    printf("], \"workers\": [");
+
+    for (uint i = 0; i < s->worker_count; i++) {
+        struct perfreplay_worker *w = s->workers[i];
+
+        qsort(w->lat, w->lat_count, sizeof(w->lat[0]), &perfreplay_lat_compare);
+        printf("%s{\"name\": \"%s\", \"ops\": %llu, \"bytes\": %llu, \"errors\": %llu, "
+               "\"ops_per_sec\": %llu, \"kbytes_per_sec\": %llu, "
+               "\"lat_us\": {\"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u}}",
+               i ? ", " : "", w->name, w->ops, w->bytes, w->errors,
+               w->ops * 1000000 / usecs, w->bytes * 1000000 / 1024 / usecs,
+               perfreplay_percentile(w, 50), perfreplay_percentile(w, 90),
+               perfreplay_percentile(w, 99), w->lat_max);
+    }
+    printf("]}\n");
+}
+
+static status_t perfreplay_run(struct perfreplay_script *s, uint run)
+{
+    struct perfreplay_cpu c;
+    status_t err = NO_ERROR;
+
+    for (uint i = 0; i < s->worker_count; i++)
+        perfreplay_reset(s->workers[i]);
+
+    perfreplay_running = true;
+    perfreplay_cpu_start(&c);
+
+    for (uint i = 0; i < s->worker_count && err >= 0; i++)
+        err = perfreplay_worker_start(s->workers[i]);
+
+    if (err >= 0)
+        thread_sleep(s->secs * 1000);
+
+    /* stop the clock before the joins, they can take up to a frame or a load */
+    lk_bigtime_t usecs = current_time_hires() - c.start;
+    perfreplay_cpu_stop(&c);
+    perfreplay_running = false;
+
+    for (uint i = 0; i < s->worker_count; i++)
+        perfreplay_worker_stop(s->workers[i]);
+
+    if (err >= 0)
+        perfreplay_report(s, run, usecs, &c);
+
+    return err;
+}
+
+static int perfreplay_split(char *line, char **argv)
+{
+    int argc = 0;
+
+    while (argc < PERFREPLAY_MAX_ARGS) {
+        while (*line == ' ' || *line == '\t' || *line == '\r')
+            line++;
+        if (*line == '\0')
+            break;
+        argv[argc++] = line;
+        while (*line && *line != ' ' && *line != '\t' && *line != '\r')
+            line++;
+        if (*line)
+            *line++ = '\0';
+    }
+
+    return argc;
+}
+
+static status_t perfreplay_fs_setup(struct perfreplay_worker *w)
+{
+    filecookie cookie;
+    struct file_stat stat;
+
+    status_t err = fs_open_file(w->path, &cookie);
+    if (err < 0)
+        return err;
+    err = fs_stat_file(cookie, &stat);
+    fs_close_file(cookie);
+    if (err < 0)
+        return err;
+    if (stat.is_dir)
+        return ERR_NOT_FILE;
+
+    w->len = MIN((size_t)stat.size, (size_t)PERFREPLAY_FS_MAX_FILE);
+    if (w->len == 0)
+        w->len = 1;
+
+    return NO_ERROR;
+}
+
+/* parsing does the mounts and checks each worker can run here, the ones that
+ * can't are left out with a note rather than failing the whole script */
+static status_t perfreplay_parse(struct perfreplay_script *s, char *text)
+{
+    uint lineno = 0;
+
+    s->secs = PERFREPLAY_DEFAULT_SECS;
+    s->runs = PERFREPLAY_DEFAULT_RUNS;
+
+    for (char *line = text; line; ) {
+        char *next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char *argv[PERFREPLAY_MAX_ARGS];
+        int argc = perfreplay_split(line, argv);
+        line = next;
+        if (argc == 0)
+            continue;
+
+        if (!strcmp(argv[0], "duration") && argc == 2) {
+            s->secs = MAX(strtoul(argv[1], NULL, 0), 1UL);
+            continue;
+        } else if (!strcmp(argv[0], "runs") && argc == 2) {
+            s->runs = MAX(strtoul(argv[1], NULL, 0), 1UL);
+            continue;
+        } else if (!strcmp(argv[0], "mount") && argc == 3) {
+            status_t err = fs_mount(argv[1], argv[2]);
+            if (err < 0 && err != ERR_ALREADY_MOUNTED)
+                printf("perfreplay: line %u: mounting %s on %s failed: %d\n", lineno, argv[2], argv[1], err);
+            continue;
+        }
+
+        if (s->worker_count == PERFREPLAY_MAX_WORKERS) {
+            printf("perfreplay: line %u: more than %u workers\n", lineno, PERFREPLAY_MAX_WORKERS);
+            return ERR_TOO_BIG;
+        }
+
+        struct perfreplay_worker *w = calloc(1, sizeof(*w));
+        if (!w)
+            return ERR_NO_MEMORY;
+        spin_lock_init(&w->lock);
+
+        status_t err = NO_ERROR;
+        if (!strcmp(argv[0], "tcp_echo") && argc == 2) {
+            w->type = PERFREPLAY_TCP_ECHO;
+            w->param = strtoul(argv[1], NULL, 0);
+#if WITH_LIB_MINIP
+            err = perfreplay_tcp_listen(w->param);
+#else
+            err = ERR_NOT_SUPPORTED;
+#endif
+        } else if (!strcmp(argv[0], "fs_load") && (argc == 2 || argc == 3)) {
+            w->type = PERFREPLAY_FS_LOAD;
+            strlcpy(w->path, argv[1], sizeof(w->path));
+            w->threads = (argc == 3) ? strtoul(argv[2], NULL, 0) : 1;
+            err = perfreplay_fs_setup(w);
+        } else if (!strcmp(argv[0], "timers") && argc == 3) {
+            w->type = PERFREPLAY_TIMERS;
+            w->threads = strtoul(argv[1], NULL, 0);
+            w->param = MAX(strtoul(argv[2], NULL, 0), 1UL);
+        } else if (!strcmp(argv[0], "gfx") && argc == 2) {
+            w->type = PERFREPLAY_GFX;
+            w->threads = 1;
+            w->param = MAX(strtoul(argv[1], NULL, 0), 1UL);
+#if !WITH_LIB_GFX
+            err = ERR_NOT_SUPPORTED;
+#endif
+        } else {
+            printf("perfreplay: line %u: can't parse '%s'\n", lineno, argv[0]);
+            free(w);
+            return ERR_INVALID_ARGS;
+        }
+
+        w->threads = MIN(w->threads, (uint)PERFREPLAY_MAX_THREADS);
+        perfreplay_worker_name(w);
+
+        if (err < 0) {
+            printf("perfreplay: line %u: skipping %s: %d\n", lineno, w->name, err);
+            free(w);
+            continue;
+        }
+        s->workers[s->worker_count++] = w;
+    }
+
+    return NO_ERROR;
+}
+
+static status_t perfreplay(const char *script, uint runs)
+{
+    struct perfreplay_script s = { 0 };
+    char *text;
+
+    if (script) {
+        text = calloc(1, PERFREPLAY_MAX_SCRIPT + 1);
+        if (!text)
+            return ERR_NO_MEMORY;
+        ssize_t len = fs_load_file(script, text, PERFREPLAY_MAX_SCRIPT);
+        if (len < 0) {
+            printf("perfreplay: can't read %s: %d\n", script, (int)len);
+            free(text);
+            return len;
+        }
+    } else {
+        text = strdup(perfreplay_builtin);
+        if (!text)
+            return ERR_NO_MEMORY;
+    }
+
+    status_t err = perfreplay_parse(&s, text);
+    free(text);
+    if (runs)
+        s.runs = runs;
+
+    if (err >= 0 && s.worker_count == 0) {
+        printf("perfreplay: nothing to run\n");
+        err = ERR_NOT_FOUND;
+    }
+
+    if (err >= 0) {
+        printf("{\"perfreplay\": %u, \"script\": \"%s\", \"duration_secs\": %u, \"runs\": [\n",
+               PERFREPLAY_VERSION, script ? script : "builtin", s.secs);
+        for (uint i = 0; i < s.runs && err >= 0; i++)
+            err = perfreplay_run(&s, i);
+        printf("]}\n");
+        if (err < 0)
+            printf("perfreplay: run failed: %d\n", err);
+    }
+
+    for (uint i = 0; i < s.worker_count; i++)
+        free(s.workers[i]);
+
+    return err;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_perfreplay(int argc, const cmd_args *argv)
+{
+    if (argc >= 2 && !strcmp(argv[1].str, "run")) {
+        const char *script = NULL;
+        if (argc > 2 && strcmp(argv[2].str, "builtin"))
+            script = argv[2].str;
+        uint runs = (argc > 3) ? argv[3].u : 0;
+
+        return perfreplay(script, runs);
+    } else if (argc == 2 && !strcmp(argv[1].str, "show")) {
+        printf("%s", perfreplay_builtin);
+        return 0;
+    }
+
+    printf("usage: %s run [script file|builtin] [runs]\n", argv[0].str);
+    printf("usage: %s show\n", argv[0].str);
+    return -1;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("perfreplay", "replay a mixed workload and print a json summary", &cmd_perfreplay)
+STATIC_COMMAND_END(perfreplay);
+
+#endif
@@ -0,0 +1,13 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/perfreplay.c \
+
+MODULE_DEPS += \
+	lib/fs \
+	lib/fs/ext2 \
+	lib/minip \
+
+include make/module.mk
@@ -22,67 +22,110 @@
  */
 #include <sys/types.h>
 #include <stdio.h>
-#include <rand.h>
-#include <err.h>
 #include <stdlib.h>
 #include <string.h>
-#include <app/tests.h>
-#include <kernel/thread.h>
-#include <kernel/mutex.h>
-#include <kernel/semaphore.h>
+#include <arch/ops.h>
 #include <kernel/event.h>
-#include <platform.h>
+#include <kernel/thread.h>
+#include <lib/bench.h>
 
-const size_t BUFSIZE = (1024*1024);
-const uint ITER = 1024;
+#define BUFSIZE (1024*1024)
 
-__NO_INLINE static void bench_set_overhead(void)
+/* what the harness costs per iteration, the other results include it */
+BENCHMARK(loop_overhead)
 {
-    uint32_t *buf = malloc(BUFSIZE);
-
-    uint count = arch_cycle_count();
-    for (uint i = 0; i < ITER; i++) {
+    BENCH_LOOP(state) {
         __asm__ volatile("");
     }
-    count = arch_cycle_count() - count;
+}
+
+BENCHMARK(memset)
+{
+    void *buf = malloc(BUFSIZE);
 
-    printf("took %u cycles overhead to loop %u times\n",
-           count, ITER);
+    bench_set_bytes(state, BUFSIZE);
+    BENCH_LOOP(state) {
+        memset(buf, 0, BUFSIZE);
+        bench_clobber();
+    }
 
     free(buf);
 }
 
-__NO_INLINE static void bench_memset(void)
+/*
+ * The kernel fast paths, for comparing code layouts. Count the instruction
+ * cache with 'pmu on icache-misses cycles instructions' where the arch has the
+ * event and run 'bench kernel_' on the builds being compared.
+ */
+BENCHMARK(kernel_yield)
 {
-    void *buf = malloc(BUFSIZE);
+    BENCH_LOOP(state) {
+        thread_yield();
+    }
+}
 
-    uint count = arch_cycle_count();
-    for (uint i = 0; i < ITER; i++) {
-        memset(buf, 0, BUFSIZE);
+BENCHMARK(kernel_heap)
+{
+    BENCH_LOOP(state) {
+        void *p = malloc(64);
+        bench_do_not_optimize(p);
+        free(p);
     }
-    count = arch_cycle_count() - count;
+}
 
-    printf("took %u cycles to memset a buffer of size %u %d times (%u bytes), %f bytes/cycle\n",
-           count, BUFSIZE, ITER, BUFSIZE * ITER, (BUFSIZE * ITER) / (float)count);
+static event_t pingpong_ping;
+static event_t pingpong_pong;
+static volatile bool pingpong_done;
 
-    free(buf);
+static int pingpong_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&pingpong_ping);
+        if (pingpong_done)
+            break;
+        event_signal(&pingpong_pong, true);
+    }
+    return 0;
+}
+
+/* a round trip through the wait queues and the scheduler to a thread on the same cpu */
+BENCHMARK(kernel_event_pingpong)
+{
+    event_init(&pingpong_ping, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&pingpong_pong, false, EVENT_FLAG_AUTOUNSIGNAL);
+    pingpong_done = false;
+
+    thread_t *t = thread_create("pingpong", &pingpong_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        return;
+    thread_set_affinity(t, 1U << arch_curr_cpu_num());
+    thread_resume(t);
+
+    BENCH_LOOP(state) {
+        event_signal(&pingpong_ping, true);
+        event_wait(&pingpong_pong);
+    }
+
+    pingpong_done = true;
+    event_signal(&pingpong_ping, true);
+    thread_join(t, NULL, INFINITE_TIME);
+
+    event_destroy(&pingpong_ping);
+    event_destroy(&pingpong_pong);
 }
 
 #define bench_cset(type) \
-__NO_INLINE static void bench_cset_##type(void) \
+BENCHMARK(cset_##type) \
 { \
     type *buf = malloc(BUFSIZE); \
  \
-    uint count = arch_cycle_count(); \
-    for (uint i = 0; i < ITER; i++) { \
+    bench_set_bytes(state, BUFSIZE); \
+    BENCH_LOOP(state) { \
         for (uint j = 0; j < BUFSIZE / sizeof(*buf); j++) { \
             buf[j] = 0; \
         } \
+        bench_clobber(); \
     } \
-    count = arch_cycle_count() - count; \
- \
-    printf("took %u cycles to manually clear a buffer using wordsize %d of size %u %d times (%u bytes), %f bytes/cycle\n", \
-           count, sizeof(*buf), BUFSIZE, ITER, BUFSIZE * ITER, (BUFSIZE * ITER) / (float)count); \
  \
     free(buf); \
 }
@@ -92,12 +135,13 @@ bench_cset(uint16_t)
 bench_cset(uint32_t)
 bench_cset(uint64_t)
 
-__NO_INLINE static void bench_cset_wide(void)
+/* 8 words at a time */
+BENCHMARK(cset_wide)
 {
     uint32_t *buf = malloc(BUFSIZE);
 
-    uint count = arch_cycle_count();
-    for (uint i = 0; i < ITER; i++) {
+    bench_set_bytes(state, BUFSIZE);
+    BENCH_LOOP(state) {
         for (uint j = 0; j < BUFSIZE / sizeof(*buf) / 8; j++) {
             buf[j*8] = 0;
             buf[j*8+1] = 0;
@@ -108,62 +152,73 @@ __NO_INLINE static void bench_cset_wide(void)
             buf[j*8+6] = 0;
             buf[j*8+7] = 0;
         }
+        bench_clobber();
     }
-    count = arch_cycle_count() - count;
-
-    printf("took %u cycles to manually clear a buffer of size %u %d times 8 words at a time (%u bytes), %f bytes/cycle\n",
-           count, BUFSIZE, ITER, BUFSIZE * ITER, (BUFSIZE * ITER) / (float)count);
 
     free(buf);
 }
 
-__NO_INLINE static void bench_memcpy(void)
+/* bytes are source bytes */
+BENCHMARK(memcpy)
 {
     uint8_t *buf = malloc(BUFSIZE);
 
-    uint count = arch_cycle_count();
-    for (uint i = 0; i < ITER; i++) {
+    bench_set_bytes(state, BUFSIZE / 2);
+    BENCH_LOOP(state) {
         memcpy(buf, buf + BUFSIZE / 2, BUFSIZE / 2);
+        bench_clobber();
     }
-    count = arch_cycle_count() - count;
-
-    printf("took %u cycles to memcpy a buffer of size %u %d times (%u source bytes), %f source bytes/cycle\n",
-           count, BUFSIZE / 2, ITER, BUFSIZE / 2 * ITER, (BUFSIZE / 2 * ITER) / (float)count);
 
     free(buf);
 }
 
+/* short copies, where the startup cost of the copy loop shows */
+#define bench_memcpy_size(len) \
+BENCHMARK(memcpy_##len) \
+{ \
+    uint8_t *buf = malloc(BUFSIZE); \
+ \
+    bench_set_bytes(state, len); \
+    BENCH_LOOP(state) { \
+        memcpy(buf, buf + BUFSIZE / 2, len); \
+        bench_clobber(); \
+    } \
+ \
+    free(buf); \
+}
+
+bench_memcpy_size(8)
+bench_memcpy_size(32)
+bench_memcpy_size(64)
+bench_memcpy_size(256)
+bench_memcpy_size(1024)
+bench_memcpy_size(4096)
+
 #if ARCH_ARM
-__NO_INLINE static void arm_bench_cset_stm(void)
+BENCHMARK(arm_cset_stm)
 {
     uint32_t *buf = malloc(BUFSIZE);
 
-    uint count = arch_cycle_count();
-    for (uint i = 0; i < ITER; i++) {
+    bench_set_bytes(state, BUFSIZE);
+    BENCH_LOOP(state) {
         for (uint j = 0; j < BUFSIZE / sizeof(*buf) / 8; j++) {
             __asm__ volatile(
                 "stm    %0, {r0-r7};"
                 :: "r" (&buf[j*8])
+                : "memory"
             );
         }
     }
-    count = arch_cycle_count() - count;
-
-    printf("took %u cycles to manually clear a buffer of size %u %d times 8 words at a time using stm (%u bytes), %f bytes/cycle\n",
-           count, BUFSIZE, ITER, BUFSIZE * ITER, (BUFSIZE * ITER) / (float)count);
 
     free(buf);
 }
 
-__NO_INLINE static void arm_bench_multi_issue(void)
+/* 8 integer ops an iteration */
+BENCHMARK(arm_multi_issue)
 {
-    uint32_t cycles;
     uint32_t a = 0, b = 0, c = 0, d = 0, e = 0, f = 0, g = 0, h = 0;
 
-#define ITER 1000000
-    uint count = ITER;
-    cycles = arch_cycle_count();
-    while (count--) {
+    BENCH_LOOP(state) {
         asm volatile ("");
         asm volatile ("add %0, %0, %0" : "=r" (a) : "r" (a));
         asm volatile ("add %0, %0, %0" : "=r" (b) : "r" (b));
@@ -174,73 +229,29 @@ __NO_INLINE static void arm_bench_multi_issue(void)
         asm volatile ("and %0, %0, %0" : "=r" (g) : "r" (g));
         asm volatile ("mov %0, %0" : "=r" (h) : "r" (h));
     }
-    cycles = arch_cycle_count() - cycles;
-
-    printf("took %u cycles to issue 8 integer ops (%f cycles/iteration)\n", cycles, (float)cycles / ITER);
-#undef ITER
 }
 #endif // ARCH_ARM
 
 #if WITH_LIB_LIBM
 #include <math.h>
 
-__NO_INLINE static void bench_sincos(void)
-{
-    printf("touching the floating point unit\n");
-    __UNUSED volatile double _hole = sin(0);
-
-    uint count = arch_cycle_count();
-    __UNUSED double a = sin(2.0);
-    count = arch_cycle_count() - count;
-    printf("took %u cycles for sin()\n", count);
-
-    count = arch_cycle_count();
-    a = cos(2.0);
-    count = arch_cycle_count() - count;
-    printf("took %u cycles for cos()\n", count);
-
-    count = arch_cycle_count();
-    a = sinf(2.0);
-    count = arch_cycle_count() - count;
-    printf("took %u cycles for sinf()\n", count);
-
-    count = arch_cycle_count();
-    a = cosf(2.0);
-    count = arch_cycle_count() - count;
-    printf("took %u cycles for cosf()\n", count);
-
-    count = arch_cycle_count();
-    a = sqrt(1234567.0);
-    count = arch_cycle_count() - count;
-    printf("took %u cycles for sqrt()\n", count);
-
-    count = arch_cycle_count();
-    a = sqrtf(1234567.0f);
-    count = arch_cycle_count() - count;
-    printf("took %u cycles for sqrtf()\n", count);
+/* the argument goes through a volatile so the call can't be folded */
+#define bench_libm(func, type, arg) \
+BENCHMARK(func) \
+{ \
+    volatile type x = arg; \
+ \
+    BENCH_LOOP(state) { \
+        type r = func(x); \
+        bench_do_not_optimize(r); \
+    } \
 }
 
-#endif // WITH_LIB_LIBM
-
-void benchmarks(void)
-{
-    bench_set_overhead();
-    bench_memset();
-    bench_memcpy();
-
-    bench_cset_uint8_t();
-    bench_cset_uint16_t();
-    bench_cset_uint32_t();
-    bench_cset_uint64_t();
-    bench_cset_wide();
-
-#if ARCH_ARM
-    arm_bench_cset_stm();
-
-    arm_bench_multi_issue();
-#endif
-#if WITH_LIB_LIBM
-    bench_sincos();
-#endif
-}
+bench_libm(sin, double, 2.0)
+bench_libm(cos, double, 2.0)
+bench_libm(sinf, float, 2.0f)
+bench_libm(cosf, float, 2.0f)
+bench_libm(sqrt, double, 1234567.0)
+bench_libm(sqrtf, float, 1234567.0f)
 
+#endif // WITH_LIB_LIBM
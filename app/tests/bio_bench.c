@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if WITH_LIB_CONSOLE && WITH_LIB_BIO
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <malloc.h>
+#include <rand.h>
+#include <lib/bio.h>
+#include <lib/console.h>
+#include <platform.h>
+
+#if WITH_LIB_FS
+#include <lib/fs.h>
+#endif
+
+/*
+ * Block and filesystem benchmarks. Every result is printed as a single line of
+ * key=value pairs starting with "biobench", so a log can be scraped for them.
+ */
+
+#define BIOBENCH_DEFAULT_SPAN (4 * 1024 * 1024)
+#define BIOBENCH_MAX_DEPTH 16
+#define BIOBENCH_DEFAULT_ITER 256
+
+static const size_t bench_sizes[] = { 512, 4096, 16384, 65536 };
+static const uint bench_depths[] = { 1, 4, BIOBENCH_MAX_DEPTH };
+
+/* indexed by bit 0 random, bit 1 write */
+static const char *test_names[] = { "seqread", "randread", "seqwrite", "randwrite" };
+
+struct bench_result {
+    uint ops;
+    uint64_t bytes;
+    lk_bigtime_t elapsed;
+    lk_bigtime_t lat_total;
+    lk_bigtime_t lat_max;
+};
+
+static void print_result(const char *dev, const char *test, size_t size, uint depth,
+                         const struct bench_result *r)
+{
+    lk_bigtime_t elapsed = r->elapsed ? r->elapsed : 1;
+
+    printf("biobench dev=%s test=%s size=%zu qd=%u ops=%u bytes=%llu usecs=%llu "
+           "kbps=%llu iops=%llu lat_avg=%llu lat_max=%llu\n",
+           dev, test, size, depth, r->ops, r->bytes, r->elapsed,
+           r->bytes * 1000000 / 1024 / elapsed, (uint64_t)r->ops * 1000000 / elapsed,
+           r->ops ? r->lat_total / r->ops : 0, r->lat_max);
+}
+
+/* Move span bytes through the device in size sized requests, keeping depth of
+ * them in flight. Requests are reaped oldest first, so the latency of one that
+ * finishes early includes the wait for the ones ahead of it.
+ */
+static status_t bench_run(bdev_t *dev, uint op, bool random, size_t size, uint depth,
+                          size_t span, uint flags, uint8_t *buf, struct bench_result *r)
+{
+    bio_request_t reqs[BIOBENCH_MAX_DEPTH];
+    lk_bigtime_t start_time[BIOBENCH_MAX_DEPTH];
+    uint count = span / size;
+    uint submitted = 0;
+    uint done = 0;
+    status_t err = NO_ERROR;
+
+    memset(r, 0, sizeof(*r));
+
+    lk_bigtime_t t = current_time_hires();
+    while (done < submitted || (submitted < count && err >= 0)) {
+        /* top up the queue */
+        while (err >= 0 && submitted < count && submitted - done < depth) {
+            uint slot = submitted % depth;
+            off_t offset = (off_t)(random ? (uint)rand() % count : submitted) * size;
+
+            bio_request_init(&reqs[slot], op, buf + slot * size, offset, size, NULL, NULL);
+            reqs[slot].flags = flags;
+            start_time[slot] = current_time_hires();
+            err = bio_submit(dev, &reqs[slot]);
+            if (err < 0)
+                break;
+            submitted++;
+        }
+
+        if (done == submitted)
+            break;
+
+        uint slot = done % depth;
+        ssize_t result = bio_wait(&reqs[slot]);
+        lk_bigtime_t lat = current_time_hires() - start_time[slot];
+        done++;
+
+        if (result < 0) {
+            if (err >= 0)
+                err = result;
+            continue;
+        }
+
+        r->ops++;
+        r->bytes += result;
+        r->lat_total += lat;
+        if (lat > r->lat_max)
+            r->lat_max = lat;
+    }
+    r->elapsed = current_time_hires() - t;
+
+    return err;
+}
+
+static int bench_device(const char *name, bool do_write, size_t span, uint flags)
+{
+    bdev_t *dev = bio_open(name);
+    if (!dev) {
+        printf("error opening block device '%s'\n", name);
+        return ERR_NOT_FOUND;
+    }
+
+    if ((off_t)span > dev->total_size)
+        span = dev->total_size;
+
+    uint8_t *buf = memalign(CACHE_LINE, BIOBENCH_MAX_DEPTH * bench_sizes[countof(bench_sizes) - 1]);
+    if (!buf) {
+        bio_close(dev);
+        return ERR_NO_MEMORY;
+    }
+    memset(buf, 0x5a, BIOBENCH_MAX_DEPTH * bench_sizes[countof(bench_sizes) - 1]);
+
+    status_t err = NO_ERROR;
+    for (uint test = 0; test < countof(test_names) && err >= 0; test++) {
+        uint op = (test & 2) ? BIO_OP_WRITE : BIO_OP_READ;
+        bool random = test & 1;
+
+        if (op == BIO_OP_WRITE && !do_write)
+            break;
+
+        for (uint i = 0; i < countof(bench_sizes) && err >= 0; i++) {
+            size_t size = bench_sizes[i];
+
+            /* requests have to be whole blocks */
+            if (size < dev->block_size || size % dev->block_size || size > span)
+                continue;
+
+            for (uint j = 0; j < countof(bench_depths) && err >= 0; j++) {
+                struct bench_result r;
+
+                err = bench_run(dev, op, random, size, bench_depths[j], span, flags, buf, &r);
+                if (err < 0) {
+                    printf("biobench dev=%s test=%s size=%zu qd=%u err=%d\n",
+                           name, test_names[test], size, bench_depths[j], err);
+                    break;
+                }
+                print_result(name, test_names[test], size, bench_depths[j], &r);
+            }
+        }
+    }
+
+    free(buf);
+    bio_close(dev);
+
+    return err;
+}
+
+#if WITH_LIB_FS
+static void print_rate(const char *path, const char *test, uint ops, uint64_t bytes, lk_bigtime_t elapsed)
+{
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("biobench path=%s test=%s ops=%u bytes=%llu usecs=%llu kbps=%llu opsps=%llu\n",
+           path, test, ops, bytes, elapsed, bytes * 1000000 / 1024 / elapsed,
+           (uint64_t)ops * 1000000 / elapsed);
+}
+
+static int bench_fs(const char *path, uint iter)
+{
+    filecookie cookie;
+    struct file_stat stat;
+    lk_bigtime_t t;
+    uint i;
+
+    int err = fs_open_file(path, &cookie);
+    if (err < 0) {
+        printf("error %d opening '%s'\n", err, path);
+        return err;
+    }
+    err = fs_stat_file(cookie, &stat);
+    fs_close_file(cookie);
+    if (err < 0)
+        return err;
+
+    /* path lookups, these should mostly be served by the fs caches */
+    t = current_time_hires();
+    for (i = 0; i < iter; i++) {
+        err = fs_open_file(path, &cookie);
+        if (err < 0)
+            break;
+        fs_close_file(cookie);
+    }
+    print_rate(path, "open", i, 0, current_time_hires() - t);
+    if (err < 0)
+        return err;
+
+    t = current_time_hires();
+    for (i = 0; i < iter; i++) {
+        err = fs_open_file(path, &cookie);
+        if (err < 0)
+            break;
+        fs_stat_file(cookie, &stat);
+        fs_close_file(cookie);
+    }
+    print_rate(path, "stat", i, 0, current_time_hires() - t);
+    if (err < 0 || stat.is_dir)
+        return err;
+
+    void *buf = malloc(stat.size ? stat.size : 1);
+    if (!buf)
+        return ERR_NO_MEMORY;
+
+    /* the first load may come from the device, the rest from the block cache */
+    uint64_t bytes = 0;
+    for (uint pass = 0; pass < 2; pass++) {
+        uint loops = pass ? MAX(1U, iter / 16) : 1;
+        t = current_time_hires();
+        for (i = 0; i < loops; i++) {
+            ssize_t len = fs_load_file(path, buf, stat.size);
+            if (len < 0) {
+                err = len;
+                break;
+            }
+            bytes += len;
+        }
+        print_rate(path, pass ? "load" : "load_first", i, bytes, current_time_hires() - t);
+        bytes = 0;
+        if (err < 0)
+            break;
+    }
+
+    free(buf);
+
+    return err;
+}
+#endif
+
+static int cmd_biobench(int argc, const cmd_args *argv)
+{
+    if (argc < 3) {
+usage:
+        printf("usage:\n");
+        printf("%s dev <device> [poll] [write] [span]   (write destroys the data on the device)\n", argv[0].str);
+#if WITH_LIB_FS
+        printf("%s fs <path> [iterations]\n", argv[0].str);
+#endif
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "dev")) {
+        bool do_write = false;
+        size_t span = BIOBENCH_DEFAULT_SPAN;
+        uint flags = 0;
+        int i = 3;
+
+        if (argc > i && !strcmp(argv[i].str, "poll")) {
+            flags |= BIO_FLAG_POLL;
+            i++;
+        }
+        if (argc > i && !strcmp(argv[i].str, "write")) {
+            do_write = true;
+            i++;
+        }
+        if (argc > i)
+            span = argv[i].u;
+        if (span == 0)
+            goto usage;
+
+        return bench_device(argv[2].str, do_write, span, flags);
+#if WITH_LIB_FS
+    } else if (!strcmp(argv[1].str, "fs")) {
+        uint iter = (argc > 3) ? argv[3].u : BIOBENCH_DEFAULT_ITER;
+        if (iter == 0)
+            goto usage;
+
+        return bench_fs(argv[2].str, iter);
+#endif
+    }
+
+    goto usage;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("biobench", "block device and filesystem benchmarks", &cmd_biobench)
+STATIC_COMMAND_END(biobench);
+
+#endif
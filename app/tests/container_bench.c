@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <sys/types.h>
+#include <stdlib.h>
+#include <list.h>
+#include <rbtree.h>
+#include <hashtable.h>
+#include <lib/bench.h>
+
+/*
+ * The keyed lookup the tree's lookup structures do, with list.h against
+ * rbtree.h and hashtable.h at a few sizes. lookup_* finds one key per
+ * iteration, churn_* takes one entry out and puts it back in order.
+ */
+
+struct container_obj {
+    uint32_t key;
+    struct list_node list_node;
+    struct rb_node rb_node;
+    struct list_node hash_node;
+};
+
+struct container_set {
+    uint count;
+    struct container_obj *objs;
+    struct list_node list;      /* sorted by key, like the vmm region list */
+    struct rb_tree tree;
+    struct hash_table table;
+    struct list_node *buckets;
+};
+
+static int container_compare(const struct rb_node *a, const struct rb_node *b)
+{
+    uint32_t akey = rb_tree_entry(a, struct container_obj, rb_node)->key;
+    uint32_t bkey = rb_tree_entry(b, struct container_obj, rb_node)->key;
+
+    return (akey > bkey) - (akey < bkey);
+}
+
+static int container_key_compare(const void *key, const struct rb_node *node)
+{
+    uint32_t k = *(const uint32_t *)key;
+    uint32_t nkey = rb_tree_entry(node, struct container_obj, rb_node)->key;
+
+    return (k > nkey) - (k < nkey);
+}
+
+static void container_list_insert(struct container_set *set, struct container_obj *obj)
+{
+    struct container_obj *entry;
+
+    list_for_every_entry(&set->list, entry, struct container_obj, list_node) {
+        if (entry->key > obj->key) {
+            list_add_before(&entry->list_node, &obj->list_node);
+            return;
+        }
+    }
+    list_add_tail(&set->list, &obj->list_node);
+}
+
+static bool container_set_init(struct container_set *set, uint count)
+{
+    set->count = count;
+    set->objs = malloc(count * sizeof(*set->objs));
+    /* about two entries a bucket */
+    set->buckets = malloc(MAX(count / 2, 1U) * sizeof(*set->buckets));
+    if (!set->objs || !set->buckets) {
+        free(set->objs);
+        free(set->buckets);
+        return false;
+    }
+
+    list_initialize(&set->list);
+    rb_tree_initialize(&set->tree);
+    hash_table_init(&set->table, set->buckets, MAX(count / 2, 1U));
+
+    for (uint i = 0; i < count; i++) {
+        struct container_obj *obj = &set->objs[i];
+
+        /* distinct, and in no particular order */
+        obj->key = hash_u32(i);
+        container_list_insert(set, obj);
+        rb_tree_insert(&set->tree, &obj->rb_node, container_compare);
+        hash_table_add(&set->table, hash_u32(obj->key), &obj->hash_node);
+    }
+
+    return true;
+}
+
+static void container_set_free(struct container_set *set)
+{
+    free(set->objs);
+    free(set->buckets);
+}
+
+/* walk the keys in a scattered order, count is a power of two */
+static inline uint32_t container_next_key(struct container_set *set, uint *i)
+{
+    *i = (*i + 7919) & (set->count - 1);
+    return set->objs[*i].key;
+}
+
+static struct container_obj *container_list_find(struct container_set *set, uint32_t key)
+{
+    struct container_obj *obj;
+
+    list_for_every_entry(&set->list, obj, struct container_obj, list_node) {
+        if (obj->key == key)
+            return obj;
+    }
+    return NULL;
+}
+
+static struct container_obj *container_hash_find(struct container_set *set, uint32_t key)
+{
+    struct container_obj *obj;
+
+    hash_table_for_every_entry_in_bucket(&set->table, hash_u32(key), obj, struct container_obj, hash_node) {
+        if (obj->key == key)
+            return obj;
+    }
+    return NULL;
+}
+
+static void bench_list_lookup(struct bench_state *state, uint count)
+{
+    struct container_set set;
+    uint i = 0;
+
+    if (!container_set_init(&set, count))
+        return;
+
+    BENCH_LOOP(state) {
+        bench_do_not_optimize(container_list_find(&set, container_next_key(&set, &i)));
+    }
+
+    container_set_free(&set);
+}
+
+static void bench_rbtree_lookup(struct bench_state *state, uint count)
+{
+    struct container_set set;
+    uint i = 0;
+
+    if (!container_set_init(&set, count))
+        return;
+
+    BENCH_LOOP(state) {
+        uint32_t key = container_next_key(&set, &i);
+        bench_do_not_optimize(rb_tree_find(&set.tree, &key, container_key_compare));
+    }
+
+    container_set_free(&set);
+}
+
+static void bench_hash_lookup(struct bench_state *state, uint count)
+{
+    struct container_set set;
+    uint i = 0;
+
+    if (!container_set_init(&set, count))
+        return;
+
+    BENCH_LOOP(state) {
+        bench_do_not_optimize(container_hash_find(&set, container_next_key(&set, &i)));
+    }
+
+    container_set_free(&set);
+}
+
+static void bench_list_churn(struct bench_state *state, uint count)
+{
+    struct container_set set;
+    uint i = 0;
+
+    if (!container_set_init(&set, count))
+        return;
+
+    BENCH_LOOP(state) {
+        container_next_key(&set, &i);
+        list_delete(&set.objs[i].list_node);
+        container_list_insert(&set, &set.objs[i]);
+    }
+
+    container_set_free(&set);
+}
+
+static void bench_rbtree_churn(struct bench_state *state, uint count)
+{
+    struct container_set set;
+    uint i = 0;
+
+    if (!container_set_init(&set, count))
+        return;
+
+    BENCH_LOOP(state) {
+        container_next_key(&set, &i);
+        rb_tree_delete(&set.tree, &set.objs[i].rb_node);
+        rb_tree_insert(&set.tree, &set.objs[i].rb_node, container_compare);
+    }
+
+    container_set_free(&set);
+}
+
+static void bench_hash_churn(struct bench_state *state, uint count)
+{
+    struct container_set set;
+    uint i = 0;
+
+    if (!container_set_init(&set, count))
+        return;
+
+    BENCH_LOOP(state) {
+        uint32_t key = container_next_key(&set, &i);
+        hash_table_delete(&set.table, &set.objs[i].hash_node);
+        hash_table_add(&set.table, hash_u32(key), &set.objs[i].hash_node);
+    }
+
+    container_set_free(&set);
+}
+
+#define bench_containers(count) \
+BENCHMARK(list_lookup_##count) { bench_list_lookup(state, count); } \
+BENCHMARK(rbtree_lookup_##count) { bench_rbtree_lookup(state, count); } \
+BENCHMARK(hash_lookup_##count) { bench_hash_lookup(state, count); } \
+BENCHMARK(list_churn_##count) { bench_list_churn(state, count); } \
+BENCHMARK(rbtree_churn_##count) { bench_rbtree_churn(state, count); } \
+BENCHMARK(hash_churn_##count) { bench_hash_churn(state, count); }
+
+bench_containers(16)
+bench_containers(256)
+bench_containers(4096)
@@ -47,6 +47,8 @@ void printf_tests(void)
     printf("uintmax_t: %ju %ju %ju\n", (uintmax_t)-12345678, (uintmax_t)0, (uintmax_t)12345678);
     printf("ptrdiff_t: %td %td %td\n", (ptrdiff_t)-12345678, (ptrdiff_t)0, (ptrdiff_t)12345678);
     printf("ptrdiff_t (u): %tu %tu %tu\n", (ptrdiff_t)-12345678, (ptrdiff_t)0, (ptrdiff_t)12345678);
+    printf("digits: %d %d %d %d %d %d\n", 9, 10, 99, 100, 101, -100);
+    printf("digits: %llu %llu %llu\n", 4294967295ULL, 4294967296ULL, 18446744073709551615ULL);
 
     printf("hex:\n");
     printf("uint8: %hhx %hhx %hhx\n", -12, 0, 254);
@@ -4,16 +4,22 @@ MODULE := $(LOCAL_DIR)
 
 GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 
+MODULE_DEPS += \
+    lib/bench
+
 MODULE_SRCS += \
     $(LOCAL_DIR)/benchmarks.c \
+    $(LOCAL_DIR)/bio_bench.c \
     $(LOCAL_DIR)/cache_tests.c \
     $(LOCAL_DIR)/clock_tests.c \
+    $(LOCAL_DIR)/container_bench.c \
     $(LOCAL_DIR)/fibo.c \
     $(LOCAL_DIR)/float.c \
     $(LOCAL_DIR)/float_instructions.S \
     $(LOCAL_DIR)/float_test_vec.c \
     $(LOCAL_DIR)/mem_tests.c \
     $(LOCAL_DIR)/printf_tests.c \
+    $(LOCAL_DIR)/smp_bench.c \
     $(LOCAL_DIR)/tests.c \
     $(LOCAL_DIR)/thread_tests.c \
 
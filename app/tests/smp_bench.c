@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if WITH_LIB_CONSOLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <malloc.h>
+#include <lib/console.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <platform.h>
+
+/*
+ * Scaling benchmarks for the kernel primitives. Throughput tests run one
+ * worker pinned to each of the first 1, 2, .. N active cpus, latency tests
+ * bounce between the first cpu and each of the others, so the output is one
+ * point of a curve per line. Like biobench every line is key=value pairs
+ * starting with "smpbench".
+ */
+
+#define SMPBENCH_DEFAULT_ITER 100000
+#define SMPBENCH_PRIORITY (DEFAULT_PRIORITY + 1)
+
+/* the slower tests do a fraction of the default iterations */
+#define SMPBENCH_PINGPONG_DIV 10
+#define SMPBENCH_THREAD_DIV 100
+
+struct smpbench_worker {
+    thread_t *t;
+    uint iter;
+    lk_bigtime_t start;
+    lk_bigtime_t end;
+};
+
+typedef void (*smpbench_op_t)(uint iter);
+
+static event_t smpbench_go;
+static smpbench_op_t smpbench_op;
+
+static mutex_t smpbench_mutex = MUTEX_INITIAL_VALUE(smpbench_mutex);
+static spin_lock_t smpbench_lock = SPIN_LOCK_INITIAL_VALUE;
+static volatile uint smpbench_shared;
+
+/* the active cpus, lowest first */
+static uint smpbench_cpus(uint *cpus)
+{
+    uint count = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp.active_cpus & (1U << i))
+            cpus[count++] = i;
+    }
+    if (count == 0)
+        cpus[count++] = arch_curr_cpu_num();
+
+    return count;
+}
+
+static thread_t *smpbench_thread(const char *name, thread_start_routine entry, void *arg, uint cpu)
+{
+    thread_t *t = thread_create(name, entry, arg, SMPBENCH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (t)
+        t->pinned_cpu = cpu;
+
+    return t;
+}
+
+static int smpbench_worker(void *arg)
+{
+    struct smpbench_worker *w = arg;
+
+    event_wait(&smpbench_go);
+
+    w->start = current_time_hires();
+    smpbench_op(w->iter);
+    w->end = current_time_hires();
+
+    return 0;
+}
+
+/* run op iter times on each of the first 1..N cpus at once */
+static void smpbench_scale(const char *test, smpbench_op_t op, uint iter)
+{
+    uint cpus[SMP_MAX_CPUS];
+    uint ncpus = smpbench_cpus(cpus);
+    struct smpbench_worker w[SMP_MAX_CPUS];
+
+    smpbench_op = op;
+
+    for (uint n = 1; n <= ncpus; n++) {
+        event_init(&smpbench_go, false, 0);
+
+        uint started = 0;
+        for (uint i = 0; i < n; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "smpbench %s %u", test, i);
+
+            w[i].iter = iter;
+            w[i].t = smpbench_thread(name, &smpbench_worker, &w[i], cpus[i]);
+            if (!w[i].t)
+                break;
+            thread_resume(w[i].t);
+            started++;
+        }
+
+        event_signal(&smpbench_go, true);
+        for (uint i = 0; i < started; i++)
+            thread_join(w[i].t, NULL, INFINITE_TIME);
+        event_destroy(&smpbench_go);
+
+        if (started < n) {
+            printf("smpbench test=%s cpus=%u error=%d\n", test, n, ERR_NO_MEMORY);
+            return;
+        }
+
+        lk_bigtime_t start = w[0].start, end = w[0].end;
+        for (uint i = 1; i < n; i++) {
+            start = MIN(start, w[i].start);
+            end = MAX(end, w[i].end);
+        }
+        lk_bigtime_t elapsed = (end > start) ? end - start : 1;
+        uint64_t ops = (uint64_t)iter * n;
+
+        printf("smpbench test=%s cpus=%u ops=%llu usecs=%llu ops_per_sec=%llu ns_per_op=%llu\n",
+               test, n, ops, elapsed, ops * 1000000 / elapsed, elapsed * 1000 / ops);
+    }
+}
+
+static void mutex_op(uint iter)
+{
+    for (uint i = 0; i < iter; i++) {
+        mutex_acquire(&smpbench_mutex);
+        smpbench_shared++;
+        mutex_release(&smpbench_mutex);
+    }
+}
+
+static void spinlock_op(uint iter)
+{
+    spin_lock_saved_state_t state;
+
+    for (uint i = 0; i < iter; i++) {
+        spin_lock_irqsave(&smpbench_lock, state);
+        smpbench_shared++;
+        spin_unlock_irqrestore(&smpbench_lock, state);
+    }
+}
+
+static int thread_nop(void *arg)
+{
+    return 0;
+}
+
+static void thread_op(uint iter)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    for (uint i = 0; i < iter; i++) {
+        thread_t *t = smpbench_thread("smpbench nop", &thread_nop, NULL, cpu);
+        if (!t)
+            return;
+        thread_resume(t);
+        thread_join(t, NULL, INFINITE_TIME);
+    }
+}
+
+static void malloc_op(uint iter)
+{
+    static const size_t sizes[] = { 16, 64, 256, 1024 };
+
+    for (uint i = 0; i < iter; i++) {
+        volatile uint8_t *p = malloc(sizes[i % countof(sizes)]);
+        if (!p)
+            return;
+        p[0] = 0;
+        free((void *)p);
+    }
+}
+
+/* two threads handing a token back and forth with events or semaphores */
+struct pingpong {
+    bool sem;
+    uint iter;
+    event_t event[2];
+    semaphore_t semaphore[2];
+};
+
+struct pingpong_side {
+    struct pingpong *pp;
+    int self;
+};
+
+static int pingpong_thread(void *arg)
+{
+    struct pingpong_side *side = arg;
+    struct pingpong *pp = side->pp;
+    int self = side->self;
+
+    for (uint i = 0; i < pp->iter; i++) {
+        if (pp->sem) {
+            sem_wait(&pp->semaphore[self]);
+            sem_post(&pp->semaphore[!self], true);
+        } else {
+            event_wait(&pp->event[self]);
+            event_signal(&pp->event[!self], true);
+        }
+    }
+
+    return 0;
+}
+
+static void smpbench_pingpong(bool sem, uint iter)
+{
+    const char *test = sem ? "sem_pingpong" : "event_pingpong";
+    uint cpus[SMP_MAX_CPUS];
+    uint ncpus = smpbench_cpus(cpus);
+
+    /* the same cpu first, then every other one */
+    for (uint target = 0; target < ncpus; target++) {
+        struct pingpong pp;
+        struct pingpong_side side[2];
+        thread_t *t[2];
+
+        pp.sem = sem;
+        pp.iter = iter;
+        for (int i = 0; i < 2; i++) {
+            event_init(&pp.event[i], false, EVENT_FLAG_AUTOUNSIGNAL);
+            sem_init(&pp.semaphore[i], 0);
+            side[i].pp = &pp;
+            side[i].self = i;
+        }
+
+        t[0] = smpbench_thread("smpbench ping", &pingpong_thread, &side[0], cpus[0]);
+        t[1] = smpbench_thread("smpbench pong", &pingpong_thread, &side[1], cpus[target]);
+        if (!t[0] || !t[1]) {
+            printf("smpbench test=%s error=%d\n", test, ERR_NO_MEMORY);
+            return;
+        }
+        thread_resume(t[0]);
+        thread_resume(t[1]);
+
+        lk_bigtime_t start = current_time_hires();
+        if (sem)
+            sem_post(&pp.semaphore[0], true);
+        else
+            event_signal(&pp.event[0], true);
+        thread_join(t[0], NULL, INFINITE_TIME);
+        thread_join(t[1], NULL, INFINITE_TIME);
+        lk_bigtime_t elapsed = current_time_hires() - start;
+
+        for (int i = 0; i < 2; i++) {
+            event_destroy(&pp.event[i]);
+            sem_destroy(&pp.semaphore[i]);
+        }
+
+        printf("smpbench test=%s from=%u to=%u round_trips=%u usecs=%llu ns_per_round_trip=%llu\n",
+               test, cpus[0], cpus[target], iter, elapsed, elapsed * 1000 / iter);
+    }
+}
+
+#if WITH_SMP
+static void ipi_nop(void *context)
+{
+}
+
+struct ipi_args {
+    uint target;
+    uint iter;
+    lk_bigtime_t elapsed;
+};
+
+static int ipi_thread(void *arg)
+{
+    struct ipi_args *a = arg;
+
+    lk_bigtime_t start = current_time_hires();
+    for (uint i = 0; i < a->iter; i++)
+        mp_sync_exec(1U << a->target, &ipi_nop, NULL);
+    a->elapsed = current_time_hires() - start;
+
+    return 0;
+}
+
+/* mp_sync_exec of an empty task from the first cpu to each of the others */
+static void smpbench_ipi(uint iter)
+{
+    uint cpus[SMP_MAX_CPUS];
+    uint ncpus = smpbench_cpus(cpus);
+
+    for (uint target = 1; target < ncpus; target++) {
+        struct ipi_args a = { .target = cpus[target], .iter = iter };
+
+        thread_t *t = smpbench_thread("smpbench ipi", &ipi_thread, &a, cpus[0]);
+        if (!t) {
+            printf("smpbench test=ipi error=%d\n", ERR_NO_MEMORY);
+            return;
+        }
+        thread_resume(t);
+        thread_join(t, NULL, INFINITE_TIME);
+
+        printf("smpbench test=ipi from=%u to=%u round_trips=%u usecs=%llu ns_per_round_trip=%llu\n",
+               cpus[0], cpus[target], iter, a.elapsed, a.elapsed * 1000 / iter);
+    }
+}
+#endif
+
+static const char *smpbench_tests[] = {
+    "mutex", "spinlock", "event", "sem", "ipi", "thread", "malloc",
+};
+
+static bool smpbench_want(const char *which, const char *test)
+{
+    return !which || !strcmp(which, test);
+}
+
+static int cmd_smpbench(int argc, const cmd_args *argv)
+{
+    const char *which = NULL;
+    uint iter = SMPBENCH_DEFAULT_ITER;
+
+    if (argc >= 2) {
+        which = argv[1].str;
+        if (!strcmp(which, "all")) {
+            which = NULL;
+        } else {
+            bool found = false;
+            for (uint i = 0; i < countof(smpbench_tests); i++)
+                found |= !strcmp(which, smpbench_tests[i]);
+
+            if (!found) {
+                printf("usage: %s [test|all] [iterations]\n", argv[0].str);
+                printf("tests:");
+                for (uint i = 0; i < countof(smpbench_tests); i++)
+                    printf(" %s", smpbench_tests[i]);
+                printf("\ndefault %u iterations per cpu, the pingpong tests do a tenth of that\n"
+                       "and the thread test a hundredth\n", SMPBENCH_DEFAULT_ITER);
+                return ERR_INVALID_ARGS;
+            }
+        }
+    }
+    if (argc >= 3)
+        iter = MAX(argv[2].u, 1u);
+
+    uint pingpong_iter = MAX(iter / SMPBENCH_PINGPONG_DIV, 1u);
+    uint thread_iter = MAX(iter / SMPBENCH_THREAD_DIV, 1u);
+
+    if (smpbench_want(which, "mutex"))
+        smpbench_scale("mutex", &mutex_op, iter);
+    if (smpbench_want(which, "spinlock"))
+        smpbench_scale("spinlock", &spinlock_op, iter);
+    if (smpbench_want(which, "event"))
+        smpbench_pingpong(false, pingpong_iter);
+    if (smpbench_want(which, "sem"))
+        smpbench_pingpong(true, pingpong_iter);
+#if WITH_SMP
+    if (smpbench_want(which, "ipi"))
+        smpbench_ipi(pingpong_iter);
+#endif
+    if (smpbench_want(which, "thread"))
+        smpbench_scale("thread", &thread_op, thread_iter);
+    if (smpbench_want(which, "malloc"))
+        smpbench_scale("malloc", &malloc_op, iter);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("smpbench", "scaling of the kernel primitives across cpus", &cmd_smpbench)
+STATIC_COMMAND_END(smpbench);
+
+#endif
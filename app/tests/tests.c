@@ -33,7 +33,6 @@ STATIC_COMMAND("printf_tests", "test printf", (console_cmd)&printf_tests)
 STATIC_COMMAND("printf_tests_float", "test printf with floating point", (console_cmd)&printf_tests_float)
 STATIC_COMMAND("thread_tests", "test the scheduler", (console_cmd)&thread_tests)
 STATIC_COMMAND("clock_tests", "test clocks", (console_cmd)&clock_tests)
-STATIC_COMMAND("bench", "miscellaneous benchmarks", (console_cmd)&benchmarks)
 STATIC_COMMAND("fibo", "threaded fibonacci", (console_cmd)&fibo)
 STATIC_COMMAND("spinner", "create a spinning thread", (console_cmd)&spinner)
 STATIC_COMMAND_END(tests);
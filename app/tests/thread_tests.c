@@ -25,12 +25,18 @@
 #include <rand.h>
 #include <err.h>
 #include <assert.h>
+#include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <app/tests.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <kernel/rcu.h>
+#include <kernel/rwlock.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/poll.h>
+#include <kernel/timer.h>
 #include <platform.h>
 
 static int sleep_thread(void *arg)
@@ -157,6 +163,61 @@ static int mutex_thread(void *arg)
 	return 0;
 }
 
+static volatile int rwlock_readers;
+static volatile int rwlock_writer;
+static volatile int rwlock_threads;
+
+static int rwlock_thread(void *arg)
+{
+	rwlock_t *rw = (rwlock_t *)arg;
+	bool writer = (atomic_add(&rwlock_threads, 1) % 4) == 0; /* every 4th thread writes */
+
+	for (int i = 0; i < 10000; i++) {
+		if (writer) {
+			rwlock_acquire_write(rw);
+			if (rwlock_readers != 0 || rwlock_writer != 0)
+				panic("rwlock writer got in alongside %d readers, %d writers\n", rwlock_readers, rwlock_writer);
+			rwlock_writer++;
+			thread_yield();
+			rwlock_writer--;
+			rwlock_release_write(rw);
+		} else {
+			rwlock_acquire_read(rw);
+			atomic_add(&rwlock_readers, 1);
+			if (rwlock_writer != 0)
+				panic("rwlock reader got in alongside a writer\n");
+			thread_yield();
+			atomic_add(&rwlock_readers, -1);
+			rwlock_release_read(rw);
+		}
+		thread_yield();
+	}
+
+	return 0;
+}
+
+static void rwlock_test(void)
+{
+	rwlock_t rw;
+	thread_t *threads[8];
+
+	printf("testing rwlock\n");
+
+	rwlock_init(&rw);
+
+	for (uint i = 0; i < countof(threads); i++) {
+		threads[i] = thread_create("rwlock tester", &rwlock_thread, &rw, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+		thread_resume(threads[i]);
+	}
+
+	for (uint i = 0; i < countof(threads); i++)
+		thread_join(threads[i], NULL, INFINITE_TIME);
+
+	rwlock_destroy(&rw);
+
+	printf("done with rwlock tests\n");
+}
+
 static int mutex_timeout_thread(void *arg)
 {
 	mutex_t *timeout_mutex = (mutex_t *)arg;
@@ -325,6 +386,133 @@ void event_test(void)
 	printf("event tests done\n");
 }
 
+/* an autounsignal event goes to its highest priority waiter first */
+static event_t wake_order_event;
+static volatile int wake_order[3];
+static volatile int wake_order_count;
+
+static int wake_order_waiter(void *arg)
+{
+	event_wait(&wake_order_event);
+	wake_order[wake_order_count++] = (intptr_t)arg;
+
+	return 0;
+}
+
+static void wake_order_test(void)
+{
+	static const int priorities[] = { LOW_PRIORITY + 1, DEFAULT_PRIORITY - 1, LOW_PRIORITY + 2 };
+	thread_t *threads[countof(priorities)];
+
+	event_init(&wake_order_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+	wake_order_count = 0;
+
+	for (uint i = 0; i < countof(threads); i++) {
+		threads[i] = thread_create("wake order", &wake_order_waiter, (void *)(intptr_t)priorities[i],
+				priorities[i], DEFAULT_STACK_SIZE);
+		thread_resume(threads[i]);
+	}
+
+	/* let them all block, then release them one at a time */
+	thread_sleep(100);
+	for (uint i = 0; i < countof(threads); i++) {
+		event_signal(&wake_order_event, false);
+		thread_sleep(100);
+	}
+
+	for (uint i = 0; i < countof(threads); i++)
+		thread_join(threads[i], NULL, INFINITE_TIME);
+	event_destroy(&wake_order_event);
+
+	printf("wake order test: woke priorities %d %d %d (should be %d %d %d)\n",
+			wake_order[0], wake_order[1], wake_order[2],
+			DEFAULT_PRIORITY - 1, LOW_PRIORITY + 2, LOW_PRIORITY + 1);
+}
+
+static event_t poll_events[2];
+static semaphore_t poll_sem;
+
+static int poll_signaller(void *arg)
+{
+	thread_sleep(50);
+	event_signal(&poll_events[1], true);
+	thread_sleep(50);
+	sem_post(&poll_sem, true);
+	event_signal(&poll_events[0], true);
+
+	return 0;
+}
+
+static void poll_test(void)
+{
+	poller_t p;
+	poll_result_t r[4];
+	int ret;
+
+	printf("poll tests starting\n");
+
+	poller_init(&p);
+	event_init(&poll_events[0], false, 0);
+	event_init(&poll_events[1], false, EVENT_FLAG_AUTOUNSIGNAL);
+	sem_init(&poll_sem, 0);
+
+	poller_add_event(&p, &poll_events[0], POLL_IN, (void *)0);
+	poller_add_event(&p, &poll_events[1], POLL_IN, (void *)1);
+	poller_add_sem(&p, &poll_sem, POLL_OUT, (void *)2);
+	ret = poller_add_event(&p, &poll_events[1], POLL_IN, (void *)1);
+	printf("poll test: adding twice returns %d (should be %d)\n", ret, ERR_ALREADY_EXISTS);
+
+	ret = poller_wait(&p, r, countof(r), 0);
+	printf("poll test: nothing ready returns %d (should be %d)\n", ret, ERR_TIMED_OUT);
+
+	thread_t *t = thread_create("poll signaller", &poll_signaller, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+	thread_resume(t);
+
+	ret = poller_wait(&p, r, countof(r), 1000);
+	printf("poll test: first wait returns %d, cookie %p events 0x%x (should be 1, 0x1, 0x%x)\n",
+	       ret, ret > 0 ? r[0].cookie : NULL, ret > 0 ? r[0].events : 0, POLL_IN);
+
+	/* the other two come together or one at a time */
+	uint seen = 0;
+	while (seen != ((1U << 0) | (1U << 2))) {
+		ret = poller_wait(&p, r, countof(r), 1000);
+		if (ret < 0) {
+			printf("poll test: waiting for the rest returned %d, saw 0x%x\n", ret, seen);
+			break;
+		}
+		for (int i = 0; i < ret; i++)
+			seen |= 1U << (uintptr_t)r[i].cookie;
+	}
+	thread_join(t, NULL, INFINITE_TIME);
+
+	/* edge triggered, signalling an already signalled event isn't another edge */
+	event_signal(&poll_events[0], false);
+	ret = poller_wait(&p, r, countof(r), 0);
+	printf("poll test: signalling again returns %d (should be %d)\n", ret, ERR_TIMED_OUT);
+	event_unsignal(&poll_events[0]);
+	event_signal(&poll_events[0], false);
+	ret = poller_wait(&p, r, countof(r), 0);
+	printf("poll test: signalling after unsignal returns %d (should be 1)\n", ret);
+
+	/* destroying an object reports it a last time and drops it */
+	event_destroy(&poll_events[1]);
+	ret = poller_wait(&p, r, countof(r), 0);
+	printf("poll test: destroy returns %d, events 0x%x (should be 1, 0x%x)\n",
+	       ret, ret > 0 ? r[0].events : 0, POLL_IN | POLL_HUP);
+
+	ret = poller_destroy(&p);
+	printf("poll test: destroying the poller early returns %d (should be %d)\n", ret, ERR_BUSY);
+	poller_remove_event(&p, &poll_events[0]);
+	poller_remove_sem(&p, &poll_sem);
+	ret = poller_destroy(&p);
+	printf("poll test: destroying the poller returns %d (should be 0)\n", ret);
+
+	event_destroy(&poll_events[0]);
+	sem_destroy(&poll_sem);
+
+	printf("poll tests done\n");
+}
+
 static int quantum_tester(void *arg)
 {
 	for (;;) {
@@ -399,6 +587,80 @@ void context_switch_test(void)
 	thread_sleep(100);
 }
 
+/* two threads on one cpu handing control back and forth, so every
+ * iteration is one direct switch each way. with fp set both touch the fpu
+ * each turn, which shows what saving and restoring it on the switch costs */
+#define PINGPONG_ITERS 10000
+
+static event_t pingpong_event[2];
+static volatile double pingpong_sink;
+
+struct pingpong_args {
+	int self;
+	bool fp;
+	uint cycles;
+};
+
+static int pingpong_thread(void *arg)
+{
+	struct pingpong_args *a = arg;
+	event_t *mine = &pingpong_event[a->self];
+	event_t *other = &pingpong_event[!a->self];
+#if ARM_WITH_VFP || ARCH_ARM64
+	double f = 1.0 + a->self;
+#endif
+
+	uint start = arch_cycle_count();
+	for (int i = 0; i < PINGPONG_ITERS; i++) {
+		event_wait(mine);
+#if ARM_WITH_VFP || ARCH_ARM64
+		if (a->fp) {
+			f *= 1.0001;
+			pingpong_sink = f;
+		}
+#endif
+		event_signal(other, true);
+	}
+	a->cycles = arch_cycle_count() - start;
+
+	return 0;
+}
+
+static void pingpong_run(bool fp)
+{
+	struct pingpong_args args[2];
+	thread_t *t[2];
+
+	for (int i = 0; i < 2; i++) {
+		event_init(&pingpong_event[i], false, EVENT_FLAG_AUTOUNSIGNAL);
+		args[i].self = i;
+		args[i].fp = fp;
+		args[i].cycles = 0;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		t[i] = thread_create(i ? "pingpong b" : "pingpong a", &pingpong_thread, &args[i], DEFAULT_PRIORITY + 1, DEFAULT_STACK_SIZE);
+		t[i]->pinned_cpu = arch_curr_cpu_num();
+		thread_resume(t[i]);
+	}
+
+	event_signal(&pingpong_event[0], true);
+	for (int i = 0; i < 2; i++)
+		thread_join(t[i], NULL, INFINITE_TIME);
+
+	uint cycles = MAX(args[0].cycles, args[1].cycles);
+	printf("%s: %u cycles for %d round trips, %u per switch\n",
+	       fp ? "fp" : "integer", cycles, PINGPONG_ITERS, cycles / (PINGPONG_ITERS * 2));
+}
+
+static void context_switch_pingpong_test(void)
+{
+	pingpong_run(false);
+#if ARM_WITH_VFP || ARCH_ARM64
+	pingpong_run(true);
+#endif
+}
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -576,6 +838,252 @@ static void join_test(void)
 	printf("thread_join returns err %d, retval %d (should be 0 and 55)\n", err, ret);
 }
 
+/* short lived threads back to back. past the first few each one's struct and
+ * stack come back out of the thread pool, so this is mostly what a create, a
+ * couple of switches and an exit cost */
+#define CHURN_ITERS 1000
+
+static volatile int churn_exited;
+
+static int churn_thread(void *arg)
+{
+	return (long)arg;
+}
+
+static int churn_detached_thread(void *arg)
+{
+	atomic_add(&churn_exited, 1);
+	return 0;
+}
+
+static void thread_churn_test(void)
+{
+	int ret;
+	int bad = 0;
+
+	printf("testing thread create/exit churn\n");
+
+	lk_bigtime_t start = current_time_hires();
+	for (long i = 0; i < CHURN_ITERS; i++) {
+		thread_t *t = thread_create("churn", &churn_thread, (void *)i, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+		thread_resume(t);
+		if (thread_join(t, &ret, INFINITE_TIME) < 0 || ret != i)
+			bad++;
+	}
+	lk_bigtime_t elapsed = current_time_hires() - start;
+	printf("%d threads created and joined in %llu us, %llu us each, %d bad\n",
+	       CHURN_ITERS, elapsed, elapsed / CHURN_ITERS, bad);
+
+	churn_exited = 0;
+	start = current_time_hires();
+	for (int i = 0; i < CHURN_ITERS; i++) {
+		thread_detach_and_resume(thread_create("churn detached", &churn_detached_thread, NULL,
+		                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+	}
+	while (churn_exited < CHURN_ITERS)
+		thread_yield();
+	elapsed = current_time_hires() - start;
+	printf("%d detached threads created and exited in %llu us, %llu us each\n",
+	       CHURN_ITERS, elapsed, elapsed / CHURN_ITERS);
+}
+
+#define TIMER_TEST_COUNT 32
+
+static volatile int timer_test_fired;
+static int timer_test_order[TIMER_TEST_COUNT];
+
+static enum handler_return timer_test_callback(timer_t *t, lk_time_t now, void *arg)
+{
+	timer_test_order[timer_test_fired++] = (int)(uintptr_t)arg;
+	return INT_NO_RESCHEDULE;
+}
+
+static void timer_test(void)
+{
+	timer_t timers[TIMER_TEST_COUNT];
+	lk_time_t delay[TIMER_TEST_COUNT];
+	int i, expected = TIMER_TEST_COUNT - TIMER_TEST_COUNT / 4;
+
+	printf("testing timer ordering\n");
+
+	timer_test_fired = 0;
+
+	/* queue them up in a scrambled order, then knock every 4th one out again */
+	for (i = 0; i < TIMER_TEST_COUNT; i++) {
+		delay[i] = 10 + ((i * 7) % TIMER_TEST_COUNT) * 5;
+		timer_initialize(&timers[i]);
+		timer_set_oneshot(&timers[i], delay[i], timer_test_callback, (void *)(uintptr_t)i);
+	}
+	for (i = 0; i < TIMER_TEST_COUNT; i += 4)
+		timer_cancel(&timers[i]);
+
+	thread_sleep(10 + TIMER_TEST_COUNT * 5 + 100);
+
+	if (timer_test_fired != expected)
+		printf("timer test: %d timers fired, expected %d\n", timer_test_fired, expected);
+	for (i = 0; i < timer_test_fired; i++) {
+		int idx = timer_test_order[i];
+
+		if (idx % 4 == 0)
+			printf("timer test: canceled timer %d fired\n", idx);
+		if (i > 0 && delay[idx] < delay[timer_test_order[i - 1]])
+			printf("timer test: timer %d fired out of order\n", idx);
+	}
+
+	printf("timer test done\n");
+}
+
+#define DEADLINE_TEST_PERIODS 20
+
+struct deadline_test_args {
+	thread_deadline_params_t params;
+	lk_bigtime_t min_gap;
+};
+
+static int deadline_tester(void *arg)
+{
+	struct deadline_test_args *args = arg;
+	lk_bigtime_t last = 0;
+
+	/* burn half the budget each period and yield the rest */
+	for (int i = 0; i < DEADLINE_TEST_PERIODS; i++) {
+		lk_bigtime_t start = current_time_hires();
+		if (last && start - last < args->min_gap)
+			args->min_gap = start - last;
+		last = start;
+
+		while (current_time_hires() - start < args->params.runtime / 2)
+			;
+		thread_yield();
+	}
+
+	return 0;
+}
+
+static void deadline_test(void)
+{
+	struct deadline_test_args args[2] = {
+		{ .params = { .runtime = 2000, .deadline = 10000, .period = 10000 }, .min_gap = UINT64_MAX },
+		{ .params = { .runtime = 3000, .deadline = 20000, .period = 20000 }, .min_gap = UINT64_MAX },
+	};
+	thread_t *threads[2];
+	status_t err;
+
+	printf("testing deadline scheduling\n");
+
+	/* all on one cpu so admission control has something to reject */
+	for (uint i = 0; i < countof(threads); i++) {
+		threads[i] = thread_create("deadline tester", &deadline_tester, &args[i], LOW_PRIORITY, DEFAULT_STACK_SIZE);
+		threads[i]->pinned_cpu = 0;
+		err = thread_set_deadline(threads[i], &args[i].params);
+		if (err < 0)
+			printf("deadline test: thread %u not admitted, err %d\n", i, err);
+	}
+
+	/* neither may change what's already admitted */
+	thread_deadline_params_t too_much = { .runtime = 9000, .deadline = 10000, .period = 10000 };
+	err = thread_set_deadline(threads[1], &too_much);
+	printf("deadline test: over committing returns %d (should be %d)\n", err, ERR_NO_RESOURCES);
+	thread_deadline_params_t bad = { .runtime = 2000, .deadline = 1000, .period = 10000 };
+	err = thread_set_deadline(threads[0], &bad);
+	printf("deadline test: runtime past the deadline returns %d (should be %d)\n", err, ERR_INVALID_ARGS);
+
+	for (uint i = 0; i < countof(threads); i++)
+		thread_resume(threads[i]);
+	for (uint i = 0; i < countof(threads); i++) {
+		thread_join(threads[i], NULL, INFINITE_TIME);
+		printf("deadline test: thread %u shortest gap between periods %llu us, period %llu us\n",
+		       i, args[i].min_gap, args[i].params.period);
+	}
+
+	printf("deadline test done\n");
+}
+
+#define RCU_TEST_MAGIC 'rcut'
+
+struct rcu_test_obj {
+	int magic;
+	struct rcu_head rcu;
+};
+
+static struct rcu_test_obj *rcu_test_ptr;
+static volatile bool rcu_test_done;
+static volatile int rcu_test_freed;
+
+static int rcu_test_reader(void *arg)
+{
+	while (!rcu_test_done) {
+		rcu_read_lock();
+		struct rcu_test_obj *obj = rcu_dereference(rcu_test_ptr);
+		for (int i = 0; i < 100; i++) {
+			if (obj->magic != RCU_TEST_MAGIC)
+				panic("rcu reader saw a reclaimed object %p\n", obj);
+		}
+		rcu_read_unlock();
+		thread_yield();
+	}
+
+	return 0;
+}
+
+static void rcu_test_free(struct rcu_head *head)
+{
+	struct rcu_test_obj *obj = containerof(head, struct rcu_test_obj, rcu);
+
+	obj->magic = 0;
+	free(obj);
+	atomic_add(&rcu_test_freed, 1);
+}
+
+static void rcu_test(void)
+{
+	thread_t *threads[4];
+	struct rcu_test_obj *obj;
+
+	printf("testing rcu\n");
+
+	obj = malloc(sizeof(*obj));
+	obj->magic = RCU_TEST_MAGIC;
+	rcu_test_ptr = obj;
+	rcu_test_done = false;
+	rcu_test_freed = 0;
+
+	for (uint i = 0; i < countof(threads); i++) {
+		threads[i] = thread_create("rcu reader", &rcu_test_reader, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+		thread_resume(threads[i]);
+	}
+
+	/* replace the object, alternating between blocking and deferred reclaim */
+	for (int i = 0; i < 100; i++) {
+		struct rcu_test_obj *old = rcu_test_ptr;
+
+		obj = malloc(sizeof(*obj));
+		obj->magic = RCU_TEST_MAGIC;
+		rcu_assign_pointer(rcu_test_ptr, obj);
+
+		if (i & 1) {
+			call_rcu(&old->rcu, rcu_test_free);
+		} else {
+			synchronize_rcu();
+			rcu_test_free(&old->rcu);
+		}
+		thread_yield();
+	}
+
+	rcu_test_done = true;
+	for (uint i = 0; i < countof(threads); i++)
+		thread_join(threads[i], NULL, INFINITE_TIME);
+
+	/* callbacks run in order, so this flushes the outstanding call_rcu ones */
+	synchronize_rcu();
+
+	if (rcu_test_freed != 100)
+		printf("rcu test: %d objects reclaimed, expected 100\n", rcu_test_freed);
+	free(rcu_test_ptr);
+
+	printf("done with rcu tests\n");
+}
+
 static void spinlock_test(void)
 {
     spin_lock_saved_state_t state;
@@ -619,18 +1127,28 @@ static void spinlock_test(void)
 int thread_tests(void)
 {
 	mutex_test();
+	rwlock_test();
+	rcu_test();
 	semaphore_test();
 	event_test();
+	wake_order_test();
+	poll_test();
 
 	spinlock_test();
 	atomic_test();
 
 	thread_sleep(200);
 	context_switch_test();
+	context_switch_pingpong_test();
 
 	preempt_test();
 
 	join_test();
+	thread_churn_test();
+
+	timer_test();
+
+	deadline_test();
 
 	return 0;
 }
@@ -29,32 +29,37 @@
 #include <printf.h>
 #include <dev/udc.h>
 
-udc_request_t *txreq;
-udc_request_t *rxreq;
+// two requests each way, so one is always queued while the other completes
+#define NUM_REQS 2
+
+udc_request_t *txreq[NUM_REQS];
+udc_request_t *rxreq[NUM_REQS];
 udc_endpoint_t *txept;
 udc_endpoint_t *rxept;
 
-static char rxbuf[4096];
+static char rxbuf[NUM_REQS][4096];
 
 static void rx_complete(udc_request_t *req, unsigned actual, int status) {
 	//printf("rx done %d %d\n", actual, status);
 	if (status == 0) {
-		udc_request_queue(rxept, rxreq);
+		udc_request_queue(rxept, req);
 	}
 }
 
 static void tx_complete(udc_request_t *req, unsigned actual, int status) {
 	//printf("tx done %d %d\n", actual, status);
 	if (status == 0) {
-		udc_request_queue(txept, txreq);
+		udc_request_queue(txept, req);
 	}
 }
 
 static void udctest_notify(udc_gadget_t *gadget, unsigned event) {
 	printf("event %d\n", event);
 	if (event == UDC_EVENT_ONLINE) {
-		udc_request_queue(rxept, rxreq);
-		udc_request_queue(txept, txreq);
+		for (int i = 0; i < NUM_REQS; i++) {
+			udc_request_queue(rxept, rxreq[i]);
+			udc_request_queue(txept, txreq[i]);
+		}
 	}
 }
 
@@ -85,14 +90,16 @@ static void udctest_init(const struct app_descriptor *app)
 	udc_init(&udctest_device);
 	udctest_endpoints[0] = txept = udc_endpoint_alloc(UDC_BULK_IN, 512);
 	udctest_endpoints[1] = rxept = udc_endpoint_alloc(UDC_BULK_OUT, 512);
-	txreq = udc_request_alloc();
-	rxreq = udc_request_alloc();
-	rxreq->buffer = rxbuf;
-	rxreq->length = sizeof(rxbuf);
-	rxreq->complete = rx_complete;
-	txreq->buffer = rxbuf;
-	txreq->length = sizeof(rxbuf);
-	txreq->complete = tx_complete;
+	for (int i = 0; i < NUM_REQS; i++) {
+		txreq[i] = udc_request_alloc();
+		rxreq[i] = udc_request_alloc();
+		rxreq[i]->buffer = rxbuf[i];
+		rxreq[i]->length = sizeof(rxbuf[i]);
+		rxreq[i]->complete = rx_complete;
+		txreq[i]->buffer = rxbuf[i];
+		txreq[i]->length = sizeof(rxbuf[i]);
+		txreq[i]->complete = tx_complete;
+	}
 	udc_register_gadget(&udctest_gadget);
 }
 
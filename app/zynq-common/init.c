@@ -197,6 +197,9 @@ static void zynq_common_target_init(uint level)
         /* Configure IP stack and hook to the driver */
         minip_init_dhcp(gem_send_raw_pkt, NULL);
     }
+    /* gem takes a descriptor per pktbuf and fills in tcp/udp checksums, but recycles
+     * its rx buffers in place */
+    minip_set_offload(MINIP_OFFLOAD_SG | MINIP_OFFLOAD_TX_CSUM);
     gem_set_callback(minip_rx_driver_callback);
 #endif
 }
@@ -125,7 +125,7 @@ void _arm_cm_set_irqpri(uint32_t pri)
 	}
 }
 
-void arm_cm_irq_entry(void)
+void __HOT_TEXT arm_cm_irq_entry(void)
 {
 	// Set PRIMASK to 1
 	// This is so that later calls to arch_ints_disabled() returns true while we're inside the int handler
@@ -133,16 +133,17 @@ void arm_cm_irq_entry(void)
 	// the cpu to essentially max interrupt priority here. Will have to rethink it then.
 	__disable_irq();
 
-	THREAD_STATS_INC(interrupts);
+	THREAD_STATS_IRQ_ENTER();
 	KEVLOG_IRQ_ENTER(__get_IPSR());
 }
 
-void arm_cm_irq_exit(bool reschedule)
+void __HOT_TEXT arm_cm_irq_exit(bool reschedule)
 {
 	if (reschedule)
 		arm_cm_trigger_preempt();
 
 	KEVLOG_IRQ_EXIT(__get_IPSR());
+	THREAD_STATS_IRQ_EXIT();
 
 	__enable_irq(); // clear PRIMASK
 }
@@ -27,24 +27,42 @@
 /* externals */
 extern unsigned int __data_start_rom, __data_start, __data_end;
 extern unsigned int __bss_start, __bss_end;
+extern unsigned int __tcm_text_start_rom, __tcm_text_start, __tcm_text_end;
+extern unsigned int __tcm_data_start_rom, __tcm_data_start, __tcm_data_end;
+extern unsigned int __tcm_bss_start, __tcm_bss_end;
 
 extern void lk_main(void) __NO_RETURN __EXTERNALLY_VISIBLE;
 
-void _start(void)
+/* memcpy and memset may be hot text themselves, not copied in yet, so keep
+ * the compiler from turning the loops below into calls to them */
+static __OPTIMIZE("no-tree-loop-distribute-patterns")
+void copy_from_rom(unsigned int *dest, unsigned int *end, const unsigned int *src)
+{
+	/* already there if it runs in place */
+	if (dest == src)
+		return;
+
+	while (dest != end)
+		*dest++ = *src++;
+}
+
+static __OPTIMIZE("no-tree-loop-distribute-patterns")
+void zero(unsigned int *dest, unsigned int *end)
 {
-	/* copy data from rom */
-	if (&__data_start != &__data_start_rom) {
-		unsigned int *src = &__data_start_rom;
-		unsigned int *dest = &__data_start;
+	while (dest != end)
+		*dest++ = 0;
+}
 
-		while (dest != &__data_end)
-			*dest++ = *src++;
-	}
+void _start(void)
+{
+	/* copy hot text and data if they live in tcm, and the rest of the data, from rom */
+	copy_from_rom(&__tcm_text_start, &__tcm_text_end, &__tcm_text_start_rom);
+	copy_from_rom(&__tcm_data_start, &__tcm_data_end, &__tcm_data_start_rom);
+	copy_from_rom(&__data_start, &__data_end, &__data_start_rom);
 
 	/* zero out bss */
-	unsigned int *bss = &__bss_start;
-	while (bss != &__bss_end)
-		*bss++ = 0;
+	zero(&__bss_start, &__bss_end);
+	zero(&__tcm_bss_start, &__tcm_bss_end);
 
 	lk_main();
 }
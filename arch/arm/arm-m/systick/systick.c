@@ -68,7 +68,7 @@ static void arm_cm_systick_cancel_periodic(void)
 }
 
 /* main systick irq handler */
-void _systick(void)
+void __HOT_TEXT _systick(void)
 {
 	ticks++;
 
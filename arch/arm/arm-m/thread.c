@@ -57,8 +57,8 @@ static void initial_thread_func(void)
 	dump_thread(_current_thread);
 #endif
 
-	/* release the thread lock that was implicitly held across the reschedule */
-	spin_unlock(&thread_lock);
+	/* finish the switch that got us here */
+	thread_switch_finish();
 	arch_enable_ints();
 
 	ret = _current_thread->entry(_current_thread->arg);
@@ -183,7 +183,7 @@ __NAKED static void _thread_mode_bounce(void)
  * (interrupts disabled, in handler mode). If preempt_frame is set the thread
  * is being preempted.
  */
-void arch_context_switch(struct thread *oldthread, struct thread *newthread)
+void __HOT_TEXT arch_context_switch(struct thread *oldthread, struct thread *newthread)
 {
 	LTRACE_ENTRY;
 
@@ -195,7 +195,10 @@ void arch_context_switch(struct thread *oldthread, struct thread *newthread)
 
 		LTRACEF("we're preempted, new %d\n", newthread->arch.was_preempted);
 		if (newthread->arch.was_preempted) {
-			/* return directly to the preempted thread's iframe */
+			/* return directly to the preempted thread's iframe, which doesn't pass
+			 * back through thread_resched(). single cpu, so nothing else can run
+			 * the old thread before it's saved */
+			thread_switch_finish();
 			__asm__ volatile(
 			    "mov	sp, %0;"
 			    "cpsie	i;"
@@ -231,6 +234,7 @@ void arch_context_switch(struct thread *oldthread, struct thread *newthread)
 
 		if (newthread->arch.was_preempted) {
 			LTRACEF("not being preempted, but switching to preempted thread\n");
+			thread_switch_finish();
 			_half_save_and_svc(&oldthread->arch.sp, newthread->arch.sp);
 		} else {
 			/* fast path, both sides did not preempt */
@@ -26,6 +26,9 @@
 #include <stdbool.h>
 #include <string.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
+#include <arch/simd.h>
+#include <arch/ops.h>
 
 #define LOCAL_TRACE 0
 
@@ -58,6 +61,60 @@ void arm_fpu_set_enable(bool enable)
 }
 
 #if ARM_WITH_VFP
+/*
+ * Whose registers are loaded in each cpu's fpu, NULL for nobody.
+ *
+ * A thread that has used the fpu gets its registers loaded as it switches
+ * in, unless they are still there from its last run. Without SMP they stay
+ * put when it switches away and are only saved once another thread wants
+ * the fpu. With SMP the thread may wake up on another cpu, so it saves on
+ * the way out.
+ */
+static struct thread *fpu_owner[SMP_MAX_CPUS];
+
+/* the fpu has to be enabled for these */
+static void arm_fpu_save_regs(struct thread *t)
+{
+    __asm__ volatile("vmrs  %0, fpscr" : "=r" (t->arch.fpscr));
+    __asm__ volatile("vstm   %0, { d0-d15 }" :: "r" (&t->arch.fpregs[0]) : "memory");
+    if (!is_16regs()) {
+        __asm__ volatile("vstm   %0, { d16-d31 }" :: "r" (&t->arch.fpregs[16]) : "memory");
+    }
+}
+
+static void arm_fpu_load_regs(struct thread *t)
+{
+    __asm__ volatile("vmsr  fpscr, %0" :: "r" (t->arch.fpscr));
+    __asm__ volatile("vldm   %0, { d0-d15 }" :: "r" (&t->arch.fpregs[0]));
+    if (!is_16regs()) {
+        __asm__ volatile("vldm   %0, { d16-d31 }" :: "r" (&t->arch.fpregs[16]));
+    }
+}
+
+/* put whatever is live in this cpu's fpu back in its thread, leaves the fpu enabled */
+static void arm_fpu_flush(uint cpu)
+{
+    arm_fpu_set_enable(true);
+    if (fpu_owner[cpu]) {
+        LTRACEF("cpu %u, saving %p\n", cpu, fpu_owner[cpu]);
+        arm_fpu_save_regs(fpu_owner[cpu]);
+        fpu_owner[cpu] = NULL;
+    }
+}
+
+/* make t's registers the live ones, leaves the fpu enabled */
+static void arm_fpu_take(struct thread *t, uint cpu)
+{
+    if (fpu_owner[cpu] == t) {
+        arm_fpu_set_enable(true);
+        return;
+    }
+
+    arm_fpu_flush(cpu);
+    arm_fpu_load_regs(t);
+    fpu_owner[cpu] = t;
+}
+
 void arm_fpu_undefined_instruction(struct arm_iframe *frame)
 {
     thread_t *t = get_current_thread();
@@ -69,7 +126,7 @@ void arm_fpu_undefined_instruction(struct arm_iframe *frame)
     LTRACEF("enabling fpu on thread %p\n", t);
 
     t->arch.fpused = true;
-    arm_fpu_thread_swap(NULL, t);
+    arm_fpu_take(t, arch_curr_cpu_num());
 
     /* make sure the irq glue leaves the floating point unit enabled on the way out */
     frame->fpexc |= (1<<30);
@@ -85,49 +142,82 @@ void arm_fpu_thread_initialize(struct thread *t)
     t->arch.fpused = false;
 }
 
-void arm_fpu_thread_swap(struct thread *oldthread, struct thread *newthread)
+void arm_fpu_context_switch(struct thread *oldthread, struct thread *newthread)
 {
-    LTRACEF("old %p (%d), new %p (%d)\n",
-            oldthread, oldthread ? oldthread->arch.fpused : 0,
-            newthread, newthread ? newthread->arch.fpused : 0);
-
-    if (oldthread) {
-        if (oldthread->arch.fpused) {
-            /* save the old state */
-            uint32_t fpexc;
-            fpexc = read_fpexc();
-
-            oldthread->arch.fpexc = fpexc;
-
-            /* make sure that the fpu is enabled, so the next instructions won't fault */
-            arm_fpu_set_enable(true);
+    uint cpu = arch_curr_cpu_num();
 
-            __asm__ volatile("vmrs  %0, fpscr" : "=r" (oldthread->arch.fpscr));
-            __asm__ volatile("vstm   %0, { d0-d15 }" :: "r" (&oldthread->arch.fpregs[0]));
-            if (!is_16regs()) {
-                __asm__ volatile("vstm   %0, { d16-d31 }" :: "r" (&oldthread->arch.fpregs[16]));
-            }
+    LTRACEF("old %p (%d), new %p (%d), owner %p\n",
+            oldthread, oldthread->arch.fpused, newthread, newthread->arch.fpused, fpu_owner[cpu]);
 
-            arm_fpu_set_enable(false);
+    if (fpu_owner[cpu] == oldthread) {
+        if (oldthread->state == THREAD_DEATH) {
+            /* the thread struct is about to go away */
+            fpu_owner[cpu] = NULL;
+        } else {
+            oldthread->arch.fpexc = read_fpexc();
+#if WITH_SMP
+            arm_fpu_flush(cpu);
+#endif
         }
     }
 
-    if (newthread) {
-        if (newthread->arch.fpused) {
-            // load the new state
-            arm_fpu_set_enable(true);
-            __asm__ volatile("vmsr  fpscr, %0" :: "r" (newthread->arch.fpscr));
-
-            __asm__ volatile("vldm   %0, { d0-d15 }" :: "r" (&newthread->arch.fpregs[0]));
-            if (!is_16regs()) {
-                __asm__ volatile("vldm   %0, { d16-d31 }" :: "r" (&newthread->arch.fpregs[16]));
-            }
-            write_fpexc(newthread->arch.fpexc);
-        } else {
-            arm_fpu_set_enable(false);
-        }
+    if (newthread->arch.fpused) {
+        arm_fpu_take(newthread, cpu);
+        write_fpexc(newthread->arch.fpexc);
+    } else {
+        arm_fpu_set_enable(false);
     }
 }
+
+#if WITH_KERNEL_SIMD
+/* kernel code borrowing neon, see arch/simd.h */
+struct simd_cpu_state {
+    uint depth;
+    uint32_t fpexc;
+    spin_lock_saved_state_t irq_state;
+};
+
+static struct simd_cpu_state simd_cpu_state[SMP_MAX_CPUS];
+
+bool simd_available(void)
+{
+    return true;
+}
+
+void simd_begin(void)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    struct simd_cpu_state *s = &simd_cpu_state[cpu];
+    if (s->depth++ > 0)
+        return;
+
+    s->irq_state = state;
+    s->fpexc = read_fpexc();
+
+    /* stash whatever is live, this thread's registers or someone else's */
+    arm_fpu_flush(cpu);
+}
+
+void simd_end(void)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct simd_cpu_state *s = &simd_cpu_state[cpu];
+
+    DEBUG_ASSERT(s->depth > 0);
+    if (--s->depth > 0)
+        return;
+
+    thread_t *t = get_current_thread();
+    if (t->arch.fpused)
+        arm_fpu_take(t, cpu);
+    write_fpexc(s->fpexc);
+
+    arch_interrupt_restore(s->irq_state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+#endif
 #endif
 
 /* vim: set ts=4 sw=4 expandtab: */
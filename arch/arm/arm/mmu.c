@@ -65,6 +65,9 @@ static uint32_t mmu_flags_to_l1_arch_flags(uint flags)
         case ARCH_MMU_FLAG_UNCACHED_DEVICE:
             arch_flags |= MMU_MEMORY_L1_TYPE_DEVICE_SHARED;
             break;
+        case ARCH_MMU_FLAG_WRITE_COMBINE:
+            arch_flags |= MMU_MEMORY_L1_TYPE_NORMAL;
+            break;
         default:
             /* invalid user-supplied flag */
             DEBUG_ASSERT(1);
@@ -117,6 +120,9 @@ static uint32_t mmu_flags_to_l2_arch_flags_small_page(uint flags)
         case ARCH_MMU_FLAG_UNCACHED_DEVICE:
             arch_flags |= MMU_MEMORY_L2_TYPE_DEVICE_SHARED;
             break;
+        case ARCH_MMU_FLAG_WRITE_COMBINE:
+            arch_flags |= MMU_MEMORY_L2_TYPE_NORMAL;
+            break;
         default:
             /* invalid user-supplied flag */
             DEBUG_ASSERT(1);
@@ -248,6 +254,9 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
                     case MMU_MEMORY_L1_TYPE_DEVICE_NON_SHARED:
                         *flags |= ARCH_MMU_FLAG_UNCACHED_DEVICE;
                         break;
+                    case MMU_MEMORY_L1_TYPE_NORMAL:
+                        *flags |= ARCH_MMU_FLAG_WRITE_COMBINE;
+                        break;
                 }
                 switch (tt_entry & MMU_MEMORY_L1_AP_MASK) {
                     case MMU_MEMORY_L1_AP_P_RO_U_NA:
@@ -299,6 +308,9 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
                             case MMU_MEMORY_L2_TYPE_DEVICE_NON_SHARED:
                                 *flags |= ARCH_MMU_FLAG_UNCACHED_DEVICE;
                                 break;
+                            case MMU_MEMORY_L2_TYPE_NORMAL:
+                                *flags |= ARCH_MMU_FLAG_WRITE_COMBINE;
+                                break;
                         }
                         switch (l2_entry & MMU_MEMORY_L2_AP_MASK) {
                             case MMU_MEMORY_L2_AP_P_RO_U_NA:
@@ -49,7 +49,7 @@ status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
     uint gic_ipi_num = ipi + GIC_IPI_BASE;
 
     /* filter out targets outside of the range of cpus we care about */
-    target &= ((1UL << SMP_MAX_CPUS) - 1);
+    target &= MP_CPU_MASK_ALL;
     if (target != 0) {
         LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
         u_int flags = 0;
@@ -60,7 +60,7 @@ status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
     }
 #elif PLATFORM_BCM2835
     /* filter out targets outside of the range of cpus we care about */
-    target &= ((1UL << SMP_MAX_CPUS) - 1);
+    target &= MP_CPU_MASK_ALL;
     if (target != 0) {
         bcm2835_send_ipi(ipi, target);
     }
@@ -73,7 +73,7 @@ enum handler_return arm_ipi_generic_handler(void *arg)
 {
     LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
 
-    return INT_NO_RESCHEDULE;
+    return mp_mbx_generic_irq();
 }
 
 enum handler_return arm_ipi_reschedule_handler(void *arg)
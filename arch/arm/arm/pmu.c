@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/pmu.h>
+
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <arch/arm.h>
+#include <kernel/pmu.h>
+
+#define LOCAL_TRACE 0
+
+/* armv7 pmu, the event counters behind pmselr. the cycle counter stays with
+ * arch_cycle_count() */
+#define PMCR_E          (1 << 0)
+#define PMCR_N_SHIFT    11
+#define PMCR_N_MASK     0x1f
+
+/* common architectural events. cortex-a9 has no instructions retired on 0x08,
+ * it counts nothing there. */
+static const uint32_t arm_pmu_events[PMU_EVENT_COUNT] = {
+	[PMU_EVENT_CYCLES]        = 0x11,
+	[PMU_EVENT_INSTRUCTIONS]  = 0x08,
+	[PMU_EVENT_CACHE_MISSES]  = 0x03, /* l1 data cache refill */
+	[PMU_EVENT_BRANCH_MISSES] = 0x10,
+	[PMU_EVENT_ICACHE_MISSES] = 0x01, /* l1 instruction cache refill */
+};
+
+GEN_CP15_REG_FUNCS(pmcr, 0, c9, c12, 0);
+GEN_CP15_REG_FUNCS(pmcntenset, 0, c9, c12, 1);
+GEN_CP15_REG_FUNCS(pmcntenclr, 0, c9, c12, 2);
+GEN_CP15_REG_FUNCS(pmovsr, 0, c9, c12, 3);
+GEN_CP15_REG_FUNCS(pmselr, 0, c9, c12, 5);
+GEN_CP15_REG_FUNCS(pmxevtyper, 0, c9, c13, 1);
+GEN_CP15_REG_FUNCS(pmxevcntr, 0, c9, c13, 2);
+
+uint arch_pmu_counter_count(void)
+{
+	return (arm_read_pmcr() >> PMCR_N_SHIFT) & PMCR_N_MASK;
+}
+
+uint64_t arch_pmu_counter_mask(void)
+{
+	return 0xffffffff;
+}
+
+bool arch_pmu_event_supported(uint event)
+{
+	return event < PMU_EVENT_COUNT && arch_pmu_counter_count() > 0;
+}
+
+status_t arch_pmu_program(uint n, uint event)
+{
+	if (n >= arch_pmu_counter_count() || event >= PMU_EVENT_COUNT)
+		return ERR_INVALID_ARGS;
+
+	arm_write_pmcntenclr(1U << n);
+	arm_write_pmselr(n);
+	arm_write_pmxevtyper(arm_pmu_events[event]);
+	arm_write_pmxevcntr(0);
+	arm_write_pmovsr(1U << n);
+	arm_write_pmcntenset(1U << n);
+	arm_write_pmcr(arm_read_pmcr() | PMCR_E);
+
+	return NO_ERROR;
+}
+
+void arch_pmu_disable(void)
+{
+	/* leave PMCR.E and the cycle counter alone, ENABLE_CYCLE_COUNTER owns those */
+	arm_write_pmcntenclr((1U << arch_pmu_counter_count()) - 1);
+}
+
+uint64_t arch_pmu_read(uint n)
+{
+	arm_write_pmselr(n);
+	return arm_read_pmxevcntr();
+}
+
+// vim: set noexpandtab:
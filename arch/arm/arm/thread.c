@@ -50,8 +50,8 @@ static void initial_thread_func(void)
 //	dprintf("initial_thread_func: thread %p calling %p with arg %p\n", current_thread, current_thread->entry, current_thread->arg);
 //	dump_thread(current_thread);
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* finish the switch that got us here */
+    thread_switch_finish();
     arch_enable_ints();
 
 	thread_t *ct = get_current_thread();
@@ -89,7 +89,7 @@ void arch_context_switch(thread_t *oldthread, thread_t *newthread)
 {
 //	TRACEF("arch_context_switch: cpu %u old %p (%s), new %p (%s)\n", arch_curr_cpu_num(), oldthread, oldthread->name, newthread, newthread->name);
 #if ARM_WITH_VFP
-    arm_fpu_thread_swap(oldthread, newthread);
+    arm_fpu_context_switch(oldthread, newthread);
 #endif
 
 	arm_context_switch(&oldthread->arch.sp, newthread->arch.sp);
@@ -248,7 +248,7 @@ void arm_fpu_set_enable(bool enable);
 void arm_fpu_undefined_instruction(struct arm_iframe *frame);
 struct thread;
 void arm_fpu_thread_initialize(struct thread *t);
-void arm_fpu_thread_swap(struct thread *oldthread, struct thread *newthread);
+void arm_fpu_context_switch(struct thread *oldthread, struct thread *newthread);
 #endif
 
 __END_CDECLS
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct static_key;
+
+/* a disabled site is a nop, an enabled one a b to the traced code. both
+ * are 32 bits wide in thumb2 as well, nop.w and b.w */
+#define ARCH_STATIC_KEY_INSN_SIZE 4
+
+#if __thumb2__
+#define ARCH_STATIC_KEY_NOP "nop.w"
+#else
+#define ARCH_STATIC_KEY_NOP "nop"
+#endif
+
+static inline __ALWAYS_INLINE bool arch_static_key_branch(struct static_key *key)
+{
+    __asm__ goto("1: " ARCH_STATIC_KEY_NOP "\n"
+                 ".pushsection .static_key_jumps, \"aw\"\n"
+                 ".balign 4\n"
+                 ".long 1b, %l[enabled], %c0\n"
+                 ".popsection\n"
+                 :: "i" (key) :: enabled);
+    return false;
+enabled:
+    return true;
+}
+
+static inline void arch_static_key_patch(uintptr_t code, uintptr_t target, bool enable)
+{
+#if __thumb2__
+    /* thumb code is only halfword aligned, the two halves are stored separately */
+    uint16_t hw1 = 0xf3af, hw2 = 0x8000;
+
+    if (enable) {
+        uint32_t off = target - (code + 4);
+        uint32_t s = (off >> 24) & 1;
+        uint32_t j1 = (((off >> 23) & 1) ^ 1) ^ s;
+        uint32_t j2 = (((off >> 22) & 1) ^ 1) ^ s;
+
+        hw1 = 0xf000 | (s << 10) | ((off >> 12) & 0x3ff);
+        hw2 = 0x9000 | (j1 << 13) | (j2 << 11) | ((off >> 1) & 0x7ff);
+    }
+    ((volatile uint16_t *)code)[0] = hw1;
+    ((volatile uint16_t *)code)[1] = hw2;
+#else
+    uint32_t insn = 0xe320f000; /* nop */
+
+    if (enable)
+        insn = 0xea000000 | (((target - (code + 8)) >> 2) & 0xffffff);
+    *(volatile uint32_t *)code = insn;
+#endif
+}
+
+/* run by every other cpu after the text changed under it, before it leaves the ipi */
+static inline void arch_static_key_sync(void)
+{
+    __asm__ volatile("isb" ::: "memory");
+}
@@ -195,11 +195,32 @@ MODULE_ARM_OVERRIDE_SRCS := \
 	$(LOCAL_DIR)/arm/arch.c
 
 GLOBAL_DEFINES += \
-	ARCH_DEFAULT_STACK_SIZE=4096
+	ARCH_DEFAULT_STACK_SIZE=4096 \
+	ARCH_HAS_CACHE_RANGES=1
+
+# patched branches use the nop and isb of armv7, see arch/static_key.h
+ifneq ($(filter ARM_ISA_ARMv7A=1,$(GLOBAL_DEFINES)),)
+GLOBAL_DEFINES += ARCH_HAS_STATIC_KEYS=1
+endif
 
 ARCH_OPTFLAGS := -O2
 WITH_LINKER_GC ?= 1
 
+# simd_begin()/simd_end() for kernel vector code on cores with neon, see arch/simd.h
+ifneq ($(filter ARM_WITH_NEON=1,$(GLOBAL_DEFINES)),)
+KERNEL_SIMD ?= 1
+ifeq ($(KERNEL_SIMD),1)
+GLOBAL_DEFINES += WITH_KERNEL_SIMD=1
+endif
+endif
+
+# performance counters behind kernel/pmu.h on armv7-a cores
+ifeq ($(WITH_KERNEL_PMU),1)
+ifneq ($(filter ARM_ISA_ARMv7A=1,$(GLOBAL_DEFINES)),)
+MODULE_SRCS += $(LOCAL_DIR)/arm/pmu.c
+endif
+endif
+
 # we have a mmu and want the vmm/pmm
 WITH_KERNEL_VM ?= 1
 
@@ -286,6 +307,13 @@ ifeq ($(MEMVARS_SET),0)
 $(error missing MEMBASE or MEMSIZE variable, please set in target rules.mk)
 endif
 
+# tightly coupled memory that two segment binaries copy __HOT_TEXT and
+# __FAST_DATA into. without any, . leaves them with the rest of rom and ram
+ITCM_BASE ?= .
+ITCM_SIZE ?= 0xffffffff
+DTCM_BASE ?= .
+DTCM_SIZE ?= 0xffffffff
+
 LIBGCC := $(shell $(TOOLCHAIN_PREFIX)gcc $(GLOBAL_COMPILEFLAGS) $(ARCH_COMPILEFLAGS) $(THUMBCFLAGS) -print-libgcc-file-name)
 $(info LIBGCC = $(LIBGCC))
 
@@ -306,7 +334,7 @@ $(BUILDDIR)/system-onesegment.ld: $(LOCAL_DIR)/system-onesegment.ld $(wildcard a
 $(BUILDDIR)/system-twosegment.ld: $(LOCAL_DIR)/system-twosegment.ld $(wildcard arch/*.ld)
 	@echo generating $@
 	@$(MKDIR)
-	$(NOECHO)sed "s/%ROMBASE%/$(ROMBASE)/;s/%MEMBASE%/$(MEMBASE)/;s/%MEMSIZE%/$(MEMSIZE)/" < $< > $@
+	$(NOECHO)sed "s/%ROMBASE%/$(ROMBASE)/;s/%MEMBASE%/$(MEMBASE)/;s/%MEMSIZE%/$(MEMSIZE)/;s/%ITCMBASE%/$(ITCM_BASE)/;s/%ITCMSIZE%/$(ITCM_SIZE)/;s/%DTCMBASE%/$(DTCM_BASE)/;s/%DTCMSIZE%/$(DTCM_SIZE)/" < $< > $@
 
 # arm specific script to try to guess stack usage
 $(OUTELF).stack: LOCAL_DIR:=$(LOCAL_DIR)
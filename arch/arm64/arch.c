@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <err.h>
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/arm64.h>
@@ -31,13 +32,72 @@
 #include <lk/main.h>
 #include <platform.h>
 #include <trace.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
 #if WITH_SMP
+/* how long the boot cpu waits at the barrier for the secondaries it powered on */
+#define ARM64_SECONDARY_BOOT_TIMEOUT 100
+
 /* smp boot lock */
 static spin_lock_t arm_boot_cpu_lock = 1;
 static volatile int secondaries_to_init = 0;
+
+/* set if the secondaries were powered on through arm64_platform_cpu_on() */
+static bool secondaries_powered_on;
+
+extern void _start(void);
+
+/* default for platforms that hold the secondaries on the boot lock themselves */
+__WEAK status_t arm64_platform_cpu_on(ulong mpidr, paddr_t entry)
+{
+    return ERR_NOT_SUPPORTED;
+}
+
+/* the inverse of arch_curr_cpu_num() */
+static ulong arm64_cpu_num_to_mpidr(uint cpu)
+{
+    return ((ulong)(cpu >> SMP_CPU_CLUSTER_SHIFT) << 8) |
+           (cpu & ((1U << SMP_CPU_CLUSTER_SHIFT) - 1));
+}
+
+/* power on every secondary at once, without waiting for any of them to come
+ * up. they enter at _start and wait on the boot lock. returns how many
+ * secondaries to create bootstrap threads for, or -1 if the platform can't
+ * power cpus on.
+ */
+static int arm64_power_on_secondaries(void)
+{
+#if WITH_KERNEL_VM
+    paddr_t entry = kvaddr_to_paddr((void *)&_start);
+#else
+    paddr_t entry = (paddr_t)&_start;
+#endif
+    uint highest = 0;
+    int started = 0;
+
+    for (uint cpu = 1; cpu < SMP_MAX_CPUS; cpu++) {
+        status_t err = arm64_platform_cpu_on(arm64_cpu_num_to_mpidr(cpu), entry);
+        if (err == ERR_NOT_SUPPORTED && cpu == 1)
+            return -1;
+        if (err < 0) {
+            LTRACEF("cpu %u didn't power on, err %d\n", cpu, err);
+            continue;
+        }
+
+        highest = cpu;
+        started++;
+    }
+
+    /* counted before any of them can finish, they only decrement it once released */
+    secondaries_to_init = started;
+    secondaries_powered_on = true;
+
+    return highest;
+}
 #endif
 
 static void arm64_cpu_early_init(void)
@@ -67,11 +127,15 @@ void arch_init(void)
 
     LTRACEF("midr_el1 0x%llx\n", ARM64_READ_SYSREG(midr_el1));
 
-    secondaries_to_init = SMP_MAX_CPUS - 1; /* TODO: get count from somewhere else, or add cpus as they boot */
+    int secondaries = arm64_power_on_secondaries();
+    if (secondaries < 0) {
+        secondaries_to_init = SMP_MAX_CPUS - 1; /* TODO: get count from somewhere else, or add cpus as they boot */
+        secondaries = secondaries_to_init;
+    }
 
-    lk_init_secondary_cpus(secondaries_to_init);
+    lk_init_secondary_cpus(secondaries);
 
-    LTRACEF("releasing %d secondary cpus\n", secondaries_to_init);
+    LTRACEF("releasing %d secondary cpus\n", secondaries);
 
     /* release the secondary cpus */
     spin_unlock(&arm_boot_cpu_lock);
@@ -104,8 +168,11 @@ void arm64_secondary_entry(ulong asm_cpu_num)
 
     arm64_cpu_early_init();
 
-    spin_lock(&arm_boot_cpu_lock);
-    spin_unlock(&arm_boot_cpu_lock);
+    /* wait for the release without taking the lock, so the secondaries don't
+     * line up behind each other on the way into their early init */
+    while (*(volatile spin_lock_t *)&arm_boot_cpu_lock)
+        ;
+    smp_mb();
 
     /* run early secondary cpu init routines up to the threading level */
     lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
@@ -120,5 +187,22 @@ void arm64_secondary_entry(ulong asm_cpu_num)
 
     lk_secondary_cpu_entry();
 }
+
+/* the boot cpu carries on with its own init while the secondaries come up,
+ * and only waits for them here, before the apps start */
+static void arm64_secondaries_barrier(uint level)
+{
+    if (!secondaries_powered_on)
+        return;
+
+    lk_time_t start = current_time();
+    while (secondaries_to_init > 0 && current_time() - start < ARM64_SECONDARY_BOOT_TIMEOUT)
+        thread_sleep(1);
+
+    if (secondaries_to_init > 0)
+        dprintf(INFO, "arm64: %d secondary cpus didn't come up\n", secondaries_to_init);
+}
+
+LK_INIT_HOOK(arm64_secondaries_barrier, arm64_secondaries_barrier, LK_INIT_LEVEL_APPS - 1);
 #endif
 
@@ -22,8 +22,12 @@
  */
 #include <stdio.h>
 #include <debug.h>
+#include <err.h>
 #include <arch/arch_ops.h>
 #include <arch/arm64.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define SHUTDOWN_ON_FATAL 1
 
@@ -50,6 +54,39 @@ static void dump_iframe(const struct arm64_iframe_long *iframe)
     printf("spsr 0x%16llx\n", iframe->spsr);
 }
 
+#if WITH_KERNEL_VM
+/* hand translation faults to the vmm, returns true if the access can be retried */
+static bool arm64_page_fault(struct arm64_iframe_long *iframe, uint32_t ec, uint32_t iss)
+{
+    bool is_inst = (ec == 0x20 || ec == 0x21);
+    uint32_t fsc = iss & 0x3f;
+
+    /* translation fault, level 0-3 */
+    if ((fsc & 0x3c) != 0x04)
+        return false;
+
+    uint pf_flags = VMM_PF_FLAG_NOT_PRESENT;
+    if (is_inst)
+        pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+    else if (iss & (1 << 6)) /* WnR */
+        pf_flags |= VMM_PF_FLAG_WRITE;
+    if (ec == 0x20 || ec == 0x24)
+        pf_flags |= VMM_PF_FLAG_USER;
+
+    vaddr_t far = ARM64_READ_SYSREG(far_el1);
+
+    /* resolving it may block, so run with irqs as they were at the fault */
+    bool irqs_were_enabled = !(iframe->spsr & (1 << 7));
+    if (irqs_were_enabled)
+        arch_enable_ints();
+    status_t err = vmm_page_fault_handler(far, pf_flags);
+    if (irqs_were_enabled)
+        arch_disable_ints();
+
+    return err == NO_ERROR;
+}
+#endif
+
 void arm64_sync_exception(struct arm64_iframe_long *iframe)
 {
     struct fault_handler_table_entry *fault_handler;
@@ -74,6 +111,14 @@ void arm64_sync_exception(struct arm64_iframe_long *iframe)
         return;
     }
 
+#if WITH_KERNEL_VM
+    /* data or instruction abort, from either el */
+    if ((ec >= 0x20 && ec <= 0x21) || (ec >= 0x24 && ec <= 0x25)) {
+        if (arm64_page_fault(iframe, ec, iss))
+            return;
+    }
+#endif
+
     for (fault_handler = __fault_handler_table_start; fault_handler < __fault_handler_table_end; fault_handler++) {
         if (fault_handler->pc == iframe->elr) {
             iframe->elr = fault_handler->fault_handler;
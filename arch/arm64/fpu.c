@@ -22,28 +22,54 @@
  */
 
 #include <arch/arm64.h>
+#include <assert.h>
+#include <kernel/spinlock.h>
 #include <kernel/thread.h>
+#include <arch/simd.h>
 #include <trace.h>
 
 #define LOCAL_TRACE 0
 
-static struct fpstate *current_fpstate[SMP_MAX_CPUS];
+/*
+ * The fpu is switched lazily. Every thread starts its run with the fpu
+ * disabled; the first use traps and loads its registers, unless they are
+ * still sitting in this cpu's registers from its last run.
+ *
+ * A thread pinned to a cpu leaves its registers live when it switches away,
+ * and whoever next takes the fpu on that cpu saves them. Anything else may
+ * wake up on another cpu, so it still saves on the way out.
+ */
+struct fpu_cpu_state {
+    struct fpstate *owner;  /* whose registers are loaded, NULL for nobody */
+    bool dirty;             /* the registers may be newer than owner's saved copy */
+
+    /* arch_fpu_begin/end nesting */
+    uint kernel;
+    spin_lock_saved_state_t irq_state;
+};
+
+static struct fpu_cpu_state fpu_cpu_state[SMP_MAX_CPUS];
 
-static void arm64_fpu_load_state(struct thread *t)
+static inline bool arm64_fpu_enabled(void)
 {
-    uint cpu = arch_curr_cpu_num();
-    struct fpstate *fpstate = &t->arch.fpstate;
+    return ((ARM64_READ_SYSREG(cpacr_el1) >> 20) & 3) == 3;
+}
 
-    if (fpstate == current_fpstate[cpu] && fpstate->current_cpu == cpu) {
-        LTRACEF("cpu %d, thread %s, fpstate already valid\n", cpu, t->name);
-        return;
-    }
-    LTRACEF("cpu %d, thread %s, load fpstate %p, last cpu %d, last fpstate %p\n",
-            cpu, t->name, fpstate, fpstate->current_cpu, current_fpstate[cpu]);
-    fpstate->current_cpu = cpu;
-    current_fpstate[cpu] = fpstate;
+static inline void arm64_fpu_enable(void)
+{
+    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
+    ARM64_WRITE_SYSREG(cpacr_el1, cpacr | (3 << 20));
+}
 
+static inline void arm64_fpu_disable(void)
+{
+    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
+    if ((cpacr >> 20) & 3)
+        ARM64_WRITE_SYSREG(cpacr_el1, cpacr & ~(3 << 20));
+}
 
+static void arm64_fpu_load_regs(struct fpstate *fpstate)
+{
     STATIC_ASSERT(sizeof(fpstate->regs) == 16 * 32);
     __asm__ volatile("ldp     q0, q1, [%0, #(0 * 32)]\n"
                      "ldp     q2, q3, [%0, #(1 * 32)]\n"
@@ -63,12 +89,13 @@ static void arm64_fpu_load_state(struct thread *t)
                      "ldp     q30, q31, [%0, #(15 * 32)]\n"
                      "msr     fpcr, %1\n"
                      "msr     fpsr, %2\n"
-                     :: "r"(fpstate), "r"(fpstate->fpcr), "r"(fpstate->fpsr));
+                     :: "r"(fpstate), "r"((uint64_t)fpstate->fpcr), "r"((uint64_t)fpstate->fpsr));
 }
 
-void arm64_fpu_save_state(struct thread *t)
+static void arm64_fpu_save_regs(struct fpstate *fpstate)
 {
-    struct fpstate *fpstate = &t->arch.fpstate;
+    uint64_t fpcr, fpsr;
+
     __asm__ volatile("stp     q0, q1, [%2, #(0 * 32)]\n"
                      "stp     q2, q3, [%2, #(1 * 32)]\n"
                      "stp     q4, q5, [%2, #(2 * 32)]\n"
@@ -87,19 +114,149 @@ void arm64_fpu_save_state(struct thread *t)
                      "stp     q30, q31, [%2, #(15 * 32)]\n"
                      "mrs     %0, fpcr\n"
                      "mrs     %1, fpsr\n"
-                     : "=r"(fpstate->fpcr), "=r"(fpstate->fpsr)
-                     : "r"(fpstate));
+                     : "=r"(fpcr), "=r"(fpsr)
+                     : "r"(fpstate)
+                     : "memory");
+
+    fpstate->fpcr = fpcr;
+    fpstate->fpsr = fpsr;
+}
+
+/* with the fpu enabled, write back whatever is live in the registers */
+static void arm64_fpu_flush(struct fpu_cpu_state *f)
+{
+    if (f->owner && f->dirty) {
+        LTRACEF("saving fpstate %p\n", f->owner);
+        arm64_fpu_save_regs(f->owner);
+    }
+    f->dirty = false;
+}
+
+void arm64_fpu_save_state(struct thread *t)
+{
+    struct fpstate *fpstate = &t->arch.fpstate;
+
+    arm64_fpu_save_regs(fpstate);
 
     LTRACEF("thread %s, fpcr %x, fpsr %x\n", t->name, fpstate->fpcr, fpstate->fpsr);
 }
 
+static inline bool arm64_fpu_can_stay_live(const struct thread *t, uint cpu)
+{
+#if WITH_SMP
+    return t->pinned_cpu == (int)cpu;
+#else
+    return true;
+#endif
+}
+
+void arm64_fpu_context_switch(struct thread *oldthread, struct thread *newthread)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct fpu_cpu_state *f = &fpu_cpu_state[cpu];
+    struct fpstate *oldfp = &oldthread->arch.fpstate;
+    struct fpstate *newfp = &newthread->arch.fpstate;
+
+    DEBUG_ASSERT(!f->kernel);
+
+    if (oldthread->state == THREAD_DEATH) {
+        /* the thread struct is about to go away */
+        if (f->owner == oldfp) {
+            f->owner = NULL;
+            f->dirty = false;
+        }
+    } else if (arm64_fpu_enabled() && !arm64_fpu_can_stay_live(oldthread, cpu)) {
+        /* it used the fpu this run and may come back somewhere else, save it now */
+        DEBUG_ASSERT(f->owner == oldfp);
+        arm64_fpu_save_state(oldthread);
+        f->dirty = false;
+    }
+
+    /* if the new thread's registers are still loaded, it doesn't need to trap for them */
+    if (f->owner == newfp && newfp->current_cpu == cpu) {
+        LTRACEF("cpu %u, thread %s, fpstate still live\n", cpu, newthread->name);
+        arm64_fpu_enable();
+        f->dirty = true;
+    } else {
+        arm64_fpu_disable();
+    }
+}
+
 void arm64_fpu_exception(struct arm64_iframe_long *iframe)
 {
-    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
-    if (((cpacr >> 20) & 3) != 3) {
-        cpacr |= 3 << 20;
-        ARM64_WRITE_SYSREG(cpacr_el1, cpacr);
-        arm64_fpu_load_state(get_current_thread());
+    if (arm64_fpu_enabled())
+        return;
+
+    uint cpu = arch_curr_cpu_num();
+    struct fpu_cpu_state *f = &fpu_cpu_state[cpu];
+    struct thread *t = get_current_thread();
+    struct fpstate *fpstate = &t->arch.fpstate;
+
+    arm64_fpu_enable();
+
+    if (f->owner == fpstate && fpstate->current_cpu == cpu) {
+        LTRACEF("cpu %u, thread %s, fpstate already valid\n", cpu, t->name);
+        f->dirty = true;
         return;
     }
+
+    LTRACEF("cpu %u, thread %s, load fpstate %p, last cpu %u, last fpstate %p\n",
+            cpu, t->name, fpstate, fpstate->current_cpu, f->owner);
+
+    /* someone else's registers, possibly not saved yet */
+    arm64_fpu_flush(f);
+
+    arm64_fpu_load_regs(fpstate);
+    fpstate->current_cpu = cpu;
+    f->owner = fpstate;
+    f->dirty = true;
+}
+
+void arch_fpu_begin(void)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    struct fpu_cpu_state *f = &fpu_cpu_state[cpu];
+
+    if (f->kernel++ > 0)
+        return;
+    f->irq_state = state;
+
+    /* park whoever's registers are loaded, they get reloaded on their next use */
+    arm64_fpu_enable();
+    arm64_fpu_flush(f);
+    f->owner = NULL;
+}
+
+void arch_fpu_end(void)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct fpu_cpu_state *f = &fpu_cpu_state[cpu];
+
+    DEBUG_ASSERT(f->kernel > 0);
+    if (--f->kernel > 0)
+        return;
+
+    arm64_fpu_disable();
+
+    arch_interrupt_restore(f->irq_state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+#if WITH_KERNEL_SIMD
+bool simd_available(void)
+{
+    return true;
+}
+
+void simd_begin(void)
+{
+    arch_fpu_begin();
+}
+
+void simd_end(void)
+{
+    arch_fpu_end();
 }
+#endif
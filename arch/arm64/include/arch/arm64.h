@@ -67,16 +67,23 @@ extern void arm64_exception_base(void);
 void arm64_el3_to_el1(void);
 void arm64_fpu_exception(struct arm64_iframe_long *iframe);
 void arm64_fpu_save_state(struct thread *thread);
+void arm64_fpu_context_switch(struct thread *oldthread, struct thread *newthread);
 
-static inline void arm64_fpu_pre_context_switch(struct thread *thread)
-{
-    uint32_t cpacr = ARM64_READ_SYSREG(cpacr_el1);
-    if ((cpacr >> 20) & 3) {
-        arm64_fpu_save_state(thread);
-        cpacr &= ~(3 << 20);
-        ARM64_WRITE_SYSREG(cpacr_el1, cpacr);
-    }
-}
+/* borrow the fpu for simd code in the kernel, interrupts are off in between.
+ * the registers hold garbage on entry and aren't preserved for the caller.
+ * nests; only the outermost pair saves and restores anything. see also arch/simd.h.
+ */
+void arch_fpu_begin(void);
+void arch_fpu_end(void);
+
+#if WITH_SMP
+/* platform hook to power on the secondary cpu with the given mpidr at the
+ * physical address entry, without waiting for it to come up. a platform
+ * that doesn't have one returns ERR_NOT_SUPPORTED and its secondaries are
+ * expected to be held on the boot lock already.
+ */
+status_t arm64_platform_cpu_on(ulong mpidr, paddr_t entry);
+#endif
 
 __END_CDECLS
 
@@ -39,5 +39,9 @@
 #define PAGE_SIZE (1UL << PAGE_SIZE_SHIFT)
 #define USER_PAGE_SIZE (1UL << USER_PAGE_SIZE_SHIFT)
 
+/* range of block sizes the mmu code emits for suitably aligned runs */
+#define ARCH_MMU_LARGE_PAGE_MIN_SHIFT (PAGE_SIZE_SHIFT + (PAGE_SIZE_SHIFT - 3))
+#define ARCH_MMU_LARGE_PAGE_MAX_SHIFT (30)
+
 #define CACHE_LINE 32
 
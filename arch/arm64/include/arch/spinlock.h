@@ -44,6 +44,7 @@ static inline void arch_spin_lock(spin_lock_t *lock)
 
 static inline int arch_spin_trylock(spin_lock_t *lock)
 {
+    *lock = 1;
     return 0;
 }
 
@@ -58,10 +59,20 @@ static inline void arch_spin_lock_init(spin_lock_t *lock)
     *lock = SPIN_LOCK_INITIAL_VALUE;
 }
 
+#if WITH_SMP && ARM64_TICKET_SPINLOCK
+static inline bool arch_spin_lock_held(spin_lock_t *lock)
+{
+    spin_lock_t val = *(volatile spin_lock_t *)lock;
+
+    /* held while the ticket being served lags the next one */
+    return (uint32_t)val != (uint32_t)(val >> 32);
+}
+#else
 static inline bool arch_spin_lock_held(spin_lock_t *lock)
 {
     return *lock != 0;
 }
+#endif
 
 enum {
     /* Possible future flags:
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct static_key;
+
+/* a disabled site is a nop, an enabled one a b to the traced code */
+#define ARCH_STATIC_KEY_INSN_SIZE 4
+
+static inline __ALWAYS_INLINE bool arch_static_key_branch(struct static_key *key)
+{
+    __asm__ goto("1: nop\n"
+                 ".pushsection .static_key_jumps, \"aw\"\n"
+                 ".balign 8\n"
+                 ".quad 1b, %l[enabled], %c0\n"
+                 ".popsection\n"
+                 :: "i" (key) :: enabled);
+    return false;
+enabled:
+    return true;
+}
+
+static inline void arch_static_key_patch(uintptr_t code, uintptr_t target, bool enable)
+{
+    uint32_t insn = 0xd503201f; /* nop */
+
+    if (enable)
+        insn = 0x14000000 | (((target - code) >> 2) & 0x3ffffff);
+
+    /* a single aligned word, the caller cleans it to the point of unification */
+    *(volatile uint32_t *)code = insn;
+}
+
+/* run by every other cpu after the text changed under it, before it leaves the ipi */
+static inline void arch_static_key_sync(void)
+{
+    __asm__ volatile("isb" ::: "memory");
+}
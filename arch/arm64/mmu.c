@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <debug.h>
 #include <err.h>
+#include <kernel/asid.h>
 #include <kernel/vm.h>
 #include <lib/heap.h>
 #include <stdlib.h>
@@ -57,6 +58,9 @@ static pte_t mmu_flags_to_pte_attr(uint flags)
         case ARCH_MMU_FLAG_UNCACHED_DEVICE:
             attr |= MMU_PTE_ATTR_DEVICE;
             break;
+        case ARCH_MMU_FLAG_WRITE_COMBINE:
+            attr |= MMU_PTE_ATTR_NORMAL_UNCACHED | MMU_PTE_ATTR_SH_INNER_SHAREABLE;
+            break;
         default:
             /* invalid user-supplied flag */
             DEBUG_ASSERT(1);
@@ -89,7 +93,9 @@ static pte_t mmu_flags_to_pte_attr(uint flags)
     return attr;
 }
 
-status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
+static status_t arm64_mmu_query(vaddr_t vaddr, vaddr_t vaddr_base, uint top_size_shift,
+                                uint top_index_shift, uint page_size_shift,
+                                pte_t *top_page_table, paddr_t *paddr, uint *flags)
 {
     uint index;
     uint index_shift;
@@ -97,20 +103,17 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
     pte_t pte_addr;
     uint descriptor_type;
     pte_t *page_table;
-    vaddr_t kernel_base = ~0UL << MMU_KERNEL_SIZE_SHIFT;
     vaddr_t vaddr_rem;
 
-    if (vaddr < kernel_base) {
-        TRACEF("vaddr 0x%lx < base 0x%lx\n", vaddr, kernel_base);
+    if (vaddr < vaddr_base || vaddr - vaddr_base >= 1UL << top_size_shift) {
+        TRACEF("vaddr 0x%lx outside of base 0x%lx size shift %u\n", vaddr, vaddr_base, top_size_shift);
         return ERR_INVALID_ARGS;
     }
 
-    index_shift = MMU_KERNEL_TOP_SHIFT;
-    page_table = arm64_kernel_translation_table;
+    index_shift = top_index_shift;
+    page_table = top_page_table;
 
-    vaddr_rem = vaddr - kernel_base;
-    index = vaddr_rem >> index_shift;
-    ASSERT(index < MMU_KERNEL_PAGE_TABLE_ENTRIES_TOP);
+    vaddr_rem = vaddr - vaddr_base;
 
     while (true) {
         index = vaddr_rem >> index_shift;
@@ -125,19 +128,19 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
         if (descriptor_type == MMU_PTE_DESCRIPTOR_INVALID)
             return ERR_NOT_FOUND;
 
-        if (descriptor_type == ((index_shift > MMU_KERNEL_PAGE_SIZE_SHIFT) ?
+        if (descriptor_type == ((index_shift > page_size_shift) ?
                                  MMU_PTE_L012_DESCRIPTOR_BLOCK :
                                  MMU_PTE_L3_DESCRIPTOR_PAGE)) {
             break;
         }
 
-        if (index_shift <= MMU_KERNEL_PAGE_SIZE_SHIFT ||
+        if (index_shift <= page_size_shift ||
             descriptor_type != MMU_PTE_L012_DESCRIPTOR_TABLE) {
             PANIC_UNIMPLEMENTED;
         }
 
         page_table = paddr_to_kvaddr(pte_addr);
-        index_shift -= MMU_KERNEL_PAGE_SIZE_SHIFT - 3;
+        index_shift -= page_size_shift - 3;
     }
 
     if (paddr)
@@ -153,6 +156,9 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
             case MMU_PTE_ATTR_DEVICE:
                 *flags |= ARCH_MMU_FLAG_UNCACHED_DEVICE;
                 break;
+            case MMU_PTE_ATTR_NORMAL_UNCACHED:
+                *flags |= ARCH_MMU_FLAG_WRITE_COMBINE;
+                break;
             case MMU_PTE_ATTR_NORMAL_MEMORY:
                 break;
             default:
@@ -180,6 +186,13 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
     return 0;
 }
 
+status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
+{
+    return arm64_mmu_query(vaddr, ~0UL << MMU_KERNEL_SIZE_SHIFT, MMU_KERNEL_SIZE_SHIFT,
+                           MMU_KERNEL_TOP_SHIFT, MMU_KERNEL_PAGE_SIZE_SHIFT,
+                           arm64_kernel_translation_table, paddr, flags);
+}
+
 static int alloc_page_table(paddr_t *paddrp, uint page_size_shift)
 {
     size_t ret;
@@ -189,7 +202,7 @@ static int alloc_page_table(paddr_t *paddrp, uint page_size_shift)
 
     if (size >= PAGE_SIZE) {
         count = size / PAGE_SIZE;
-        ret = pmm_alloc_contiguous(count, page_size_shift, paddrp, NULL);
+        ret = pmm_alloc_contiguous_etc(count, page_size_shift, paddrp, NULL, PMM_ALLOC_FLAG_ZERO);
         if (ret != count)
             return ERR_NO_MEMORY;
     } else {
@@ -201,6 +214,7 @@ static int alloc_page_table(paddr_t *paddrp, uint page_size_shift)
             heap_free(vaddr);
             return ret;
         }
+        memset(vaddr, 0, size);
     }
     return 0;
 }
@@ -239,7 +253,8 @@ static pte_t *arm64_mmu_get_page_table(vaddr_t index, uint page_size_shift, pte_
         }
         vaddr = paddr_to_kvaddr(paddr);
         LTRACEF("allocated page table, vaddr %p, paddr 0x%lx\n", vaddr, paddr);
-        memset(vaddr, MMU_PTE_DESCRIPTOR_INVALID, 1U << page_size_shift);
+        /* alloc_page_table hands back zeroed memory */
+        STATIC_ASSERT(MMU_PTE_DESCRIPTOR_INVALID == 0);
         __asm__ volatile("dmb ishst" ::: "memory");
         pte = paddr | MMU_PTE_L012_DESCRIPTOR_TABLE;
         page_table[index] = pte;
@@ -278,10 +293,97 @@ static bool page_table_is_clear(pte_t *page_table, uint page_size_shift)
     return true;
 }
 
+/*
+ * Unmapping gathers the tlb maintenance for the ptes it clears and the page
+ * tables it empties, then does one round of invalidates behind a single
+ * barrier. Past ARM64_TLB_GATHER_MAX_PAGES pages, or once a page table has
+ * been emptied, the whole asid is flushed instead. The inner shareable tlbi
+ * forms reach every cpu, so no ipi is needed.
+ */
+#define ARM64_TLB_GATHER_MAX_PAGES 32
+#define ARM64_TLB_GATHER_MAX_TABLES 8
+
+struct arm64_tlb_gather {
+    uint asid;
+    uint page_size_shift;
+    vaddr_t start;
+    vaddr_t end;
+    uint table_count;
+    struct {
+        void *vaddr;
+        paddr_t paddr;
+    } tables[ARM64_TLB_GATHER_MAX_TABLES];
+};
+
+static void arm64_tlb_gather_init(struct arm64_tlb_gather *tlb, uint asid, uint page_size_shift)
+{
+    tlb->asid = asid;
+    tlb->page_size_shift = page_size_shift;
+    tlb->start = tlb->end = 0;
+    tlb->table_count = 0;
+}
+
+static void arm64_tlb_flush(struct arm64_tlb_gather *tlb)
+{
+    uint i;
+
+    if (tlb->start == tlb->end && !tlb->table_count)
+        return;
+
+    /* make the cleared entries visible to the table walkers first */
+    __asm__ volatile("dsb ishst" ::: "memory");
+
+    size_t pages = (tlb->end - tlb->start) >> tlb->page_size_shift;
+    if (tlb->table_count || pages > ARM64_TLB_GATHER_MAX_PAGES) {
+        if (tlb->asid == MMU_ARM64_GLOBAL_ASID)
+            __asm__ volatile("tlbi vmalle1is" ::: "memory");
+        else
+            __asm__ volatile("tlbi aside1is, %0" :: "r" ((vaddr_t)tlb->asid << 48) : "memory");
+    } else {
+        vaddr_t vaddr;
+        for (vaddr = tlb->start; vaddr != tlb->end; vaddr += 1UL << tlb->page_size_shift) {
+            if (tlb->asid == MMU_ARM64_GLOBAL_ASID)
+                __asm__ volatile("tlbi vaae1is, %0" :: "r" (vaddr >> 12) : "memory");
+            else
+                __asm__ volatile("tlbi vae1is, %0" :: "r" (vaddr >> 12 | (vaddr_t)tlb->asid << 48) : "memory");
+        }
+    }
+    __asm__ volatile("dsb ish" ::: "memory");
+    ISB;
+
+    /* nothing can be walking the emptied tables anymore */
+    for (i = 0; i < tlb->table_count; i++)
+        free_page_table(tlb->tables[i].vaddr, tlb->tables[i].paddr, tlb->page_size_shift);
+
+    tlb->start = tlb->end = 0;
+    tlb->table_count = 0;
+}
+
+static void arm64_tlb_gather_range(struct arm64_tlb_gather *tlb, vaddr_t vaddr, size_t size)
+{
+    if (tlb->start == tlb->end) {
+        tlb->start = vaddr;
+        tlb->end = vaddr + size;
+    } else {
+        tlb->start = MIN(tlb->start, vaddr);
+        tlb->end = MAX(tlb->end, vaddr + size);
+    }
+}
+
+static void arm64_tlb_gather_table(struct arm64_tlb_gather *tlb, void *vaddr, paddr_t paddr)
+{
+    if (tlb->table_count == ARM64_TLB_GATHER_MAX_TABLES)
+        arm64_tlb_flush(tlb);
+
+    tlb->tables[tlb->table_count].vaddr = vaddr;
+    tlb->tables[tlb->table_count].paddr = paddr;
+    tlb->table_count++;
+}
+
 static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
                                size_t size,
                                uint index_shift, uint page_size_shift,
-                               pte_t *page_table, uint asid)
+                               pte_t *page_table, struct arm64_tlb_gather *tlb)
 {
     pte_t *next_page_table;
     vaddr_t index;
@@ -311,22 +413,17 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
             arm64_mmu_unmap_pt(vaddr, vaddr_rem, chunk_size,
                                index_shift - (page_size_shift - 3),
                                page_size_shift,
-                               next_page_table, asid);
+                               next_page_table, tlb);
             if (chunk_size == block_size ||
                 page_table_is_clear(next_page_table, page_size_shift)) {
                 LTRACEF("pte %p[0x%lx] = 0 (was page table)\n", page_table, index);
                 page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-                __asm__ volatile("dmb ishst" ::: "memory");
-                free_page_table(next_page_table, page_table_paddr, page_size_shift);
+                arm64_tlb_gather_table(tlb, next_page_table, page_table_paddr);
             }
         } else if (pte) {
             LTRACEF("pte %p[0x%lx] = 0\n", page_table, index);
             page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
-            CF;
-            if (asid == MMU_ARM64_GLOBAL_ASID)
-                ARM64_TLBI(vaae1is, vaddr >> 12);
-            else
-                ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            arm64_tlb_gather_range(tlb, vaddr, chunk_size);
         } else {
             LTRACEF("pte %p[0x%lx] already clear\n", page_table, index);
         }
@@ -409,9 +506,12 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
 
     return 0;
 
-err:
+err: ;
+    struct arm64_tlb_gather tlb;
+    arm64_tlb_gather_init(&tlb, asid, page_size_shift);
     arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
-                       index_shift, page_size_shift, page_table, asid);
+                       index_shift, page_size_shift, page_table, &tlb);
+    arm64_tlb_flush(&tlb);
     DSB;
     return ERR_GENERIC;
 }
@@ -466,9 +566,11 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
         return ERR_INVALID_ARGS;
     }
 
+    struct arm64_tlb_gather tlb;
+    arm64_tlb_gather_init(&tlb, asid, page_size_shift);
     arm64_mmu_unmap_pt(vaddr, vaddr_rel, size,
-                       top_index_shift, page_size_shift, top_page_table, asid);
-    DSB;
+                       top_index_shift, page_size_shift, top_page_table, &tlb);
+    arm64_tlb_flush(&tlb);
     return 0;
 }
 
@@ -489,3 +591,109 @@ int arch_mmu_unmap(vaddr_t vaddr, uint count)
                            arm64_kernel_translation_table,
                            MMU_ARM64_GLOBAL_ASID);
 }
+
+/*
+ * User aspaces get a TTBR0 translation table each, with their mappings
+ * marked non global and tagged with an 8 bit asid from the allocator in
+ * kernel/asid.h, so moving between them doesn't have to flush the tlb. The
+ * kernel, in TTBR1, is the same in every one.
+ */
+#define ARM64_ASID_BITS 8
+
+static unsigned long arm64_asid_map[ASID_MAP_WORDS(ARM64_ASID_BITS)];
+static asid_allocator_t arm64_asid_allocator =
+    ASID_ALLOCATOR_INITIAL_VALUE(ARM64_ASID_BITS, arm64_asid_map);
+
+static inline uint arm64_aspace_asid(struct arch_aspace *aspace)
+{
+    /* whatever tlb entries it has are tagged with the asid it was last given */
+    return __atomic_load_n(&aspace->asid, __ATOMIC_RELAXED) & ((1U << ARM64_ASID_BITS) - 1);
+}
+
+status_t arch_mmu_init_aspace(struct arch_aspace *aspace, vaddr_t base, size_t size)
+{
+    paddr_t paddr;
+
+    LTRACEF("aspace %p, base 0x%lx, size 0x%zx\n", aspace, base, size);
+
+    /* it has to fit in what TTBR0 translates */
+    if (!size || base + size - 1 < base || base + size - 1 >= 1UL << MMU_USER_SIZE_SHIFT)
+        return ERR_INVALID_ARGS;
+
+    STATIC_ASSERT(MMU_USER_PAGE_TABLE_ENTRIES_TOP * sizeof(pte_t) <= 1UL << MMU_USER_PAGE_SIZE_SHIFT);
+    if (alloc_page_table(&paddr, MMU_USER_PAGE_SIZE_SHIFT))
+        return ERR_NO_MEMORY;
+
+    aspace->tt_phys = paddr;
+    aspace->tt_virt = paddr_to_kvaddr(paddr);
+    aspace->base = base;
+    aspace->size = size;
+    aspace->asid = 0;
+
+    return NO_ERROR;
+}
+
+status_t arch_mmu_destroy_aspace(struct arch_aspace *aspace)
+{
+    LTRACEF("aspace %p\n", aspace);
+
+    /* unmapping everything freed the lower tables along the way */
+    DEBUG_ASSERT(page_table_is_clear(aspace->tt_virt, MMU_USER_PAGE_SIZE_SHIFT));
+
+    free_page_table(aspace->tt_virt, aspace->tt_phys, MMU_USER_PAGE_SIZE_SHIFT);
+    aspace->tt_virt = NULL;
+
+    return NO_ERROR;
+}
+
+int arch_mmu_map_aspace(struct arch_aspace *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
+{
+    return arm64_mmu_map(vaddr, paddr, count * PAGE_SIZE,
+                         mmu_flags_to_pte_attr(flags) | MMU_PTE_ATTR_NON_GLOBAL,
+                         0, MMU_USER_SIZE_SHIFT,
+                         MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
+                         aspace->tt_virt, arm64_aspace_asid(aspace));
+}
+
+int arch_mmu_unmap_aspace(struct arch_aspace *aspace, vaddr_t vaddr, uint count)
+{
+    /* the inner shareable tlbi by asid reaches the cpus that still hold the
+     * asid from before a rollover, they carry the same number over */
+    return arm64_mmu_unmap(vaddr, count * PAGE_SIZE,
+                           0, MMU_USER_SIZE_SHIFT,
+                           MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
+                           aspace->tt_virt, arm64_aspace_asid(aspace));
+}
+
+status_t arch_mmu_query_aspace(struct arch_aspace *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags)
+{
+    return arm64_mmu_query(vaddr, 0, MMU_USER_SIZE_SHIFT,
+                           MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
+                           aspace->tt_virt, paddr, flags);
+}
+
+void arch_mmu_context_switch(struct arch_aspace *aspace)
+{
+    uint asid;
+    bool flush;
+
+    if (!aspace) {
+        /* no walks through TTBR0, and asid 0 is never handed out so nothing is tagged with it */
+        ARM64_WRITE_SYSREG(tcr_el1, MMU_TCR_FLAGS_KERNEL);
+        ARM64_WRITE_SYSREG(ttbr0_el1, 0UL);
+        return;
+    }
+
+    asid = asid_switch(&arm64_asid_allocator, &aspace->asid, arch_curr_cpu_num(), &flush);
+    if (flush) {
+        /* first switch since a rollover, the numbers may mean other aspaces now */
+        __asm__ volatile("tlbi vmalle1" ::: "memory");
+        __asm__ volatile("dsb nsh" ::: "memory");
+    }
+
+    LTRACEF("aspace %p, asid %u, flush %d\n", aspace, asid, flush);
+
+    /* A1 is clear, so the asid comes from TTBR0 and changes along with the table */
+    ARM64_WRITE_SYSREG(ttbr0_el1, aspace->tt_phys | ((uint64_t)asid << 48));
+    ARM64_WRITE_SYSREG(tcr_el1, MMU_TCR_FLAGS_USER);
+}
@@ -30,6 +30,8 @@
 
 #if WITH_DEV_INTERRUPT_ARM_GIC
 #include <dev/interrupt/arm_gic.h>
+#elif WITH_DEV_INTERRUPT_ARM_GICV3
+#include <dev/interrupt/arm_gicv3.h>
 #else
 #error need other implementation of interrupt controller that can ipi
 #endif
@@ -46,11 +48,19 @@ status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
     uint gic_ipi_num = ipi + GIC_IPI_BASE;
 
     /* filter out targets outside of the range of cpus we care about */
-    target &= ((1UL << SMP_MAX_CPUS) - 1);
+    target &= MP_CPU_MASK_ALL;
     if (target != 0) {
         LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
         arm_gic_sgi(gic_ipi_num, ARM_GIC_SGI_FLAG_NS, target);
     }
+#elif WITH_DEV_INTERRUPT_ARM_GICV3
+    uint gic_ipi_num = ipi + GIC_IPI_BASE;
+
+    target &= MP_CPU_MASK_ALL;
+    if (target != 0) {
+        LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
+        arm_gicv3_sgi(gic_ipi_num, target);
+    }
 #endif
 
     return NO_ERROR;
@@ -60,7 +70,7 @@ enum handler_return arm_ipi_generic_handler(void *arg)
 {
     LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
 
-    return INT_NO_RESCHEDULE;
+    return mp_mbx_generic_irq();
 }
 
 enum handler_return arm_ipi_reschedule_handler(void *arg)
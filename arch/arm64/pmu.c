@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/pmu.h>
+
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <arch/arm64.h>
+#include <kernel/pmu.h>
+
+#define LOCAL_TRACE 0
+
+/* armv8 pmu event counters, selected through pmselr_el0 */
+#define PMCR_E          (1 << 0)
+#define PMCR_N_SHIFT    11
+#define PMCR_N_MASK     0x1f
+
+/* common architectural events */
+static const uint32_t arm64_pmu_events[PMU_EVENT_COUNT] = {
+    [PMU_EVENT_CYCLES]        = 0x11,
+    [PMU_EVENT_INSTRUCTIONS]  = 0x08,
+    [PMU_EVENT_CACHE_MISSES]  = 0x03, /* l1 data cache refill */
+    [PMU_EVENT_BRANCH_MISSES] = 0x10,
+    [PMU_EVENT_ICACHE_MISSES] = 0x01, /* l1 instruction cache refill */
+};
+
+uint arch_pmu_counter_count(void)
+{
+    return (ARM64_READ_SYSREG(pmcr_el0) >> PMCR_N_SHIFT) & PMCR_N_MASK;
+}
+
+uint64_t arch_pmu_counter_mask(void)
+{
+    return 0xffffffff;
+}
+
+bool arch_pmu_event_supported(uint event)
+{
+    return event < PMU_EVENT_COUNT && arch_pmu_counter_count() > 0;
+}
+
+status_t arch_pmu_program(uint n, uint event)
+{
+    if (n >= arch_pmu_counter_count() || event >= PMU_EVENT_COUNT)
+        return ERR_INVALID_ARGS;
+
+    ARM64_WRITE_SYSREG(pmcntenclr_el0, 1UL << n);
+    ARM64_WRITE_SYSREG(pmselr_el0, (uint64_t)n);
+    ARM64_WRITE_SYSREG(pmxevtyper_el0, (uint64_t)arm64_pmu_events[event]);
+    ARM64_WRITE_SYSREG(pmxevcntr_el0, 0UL);
+    ARM64_WRITE_SYSREG(pmovsclr_el0, 1UL << n);
+    ARM64_WRITE_SYSREG(pmcntenset_el0, 1UL << n);
+    ARM64_WRITE_SYSREG(pmcr_el0, ARM64_READ_SYSREG(pmcr_el0) | PMCR_E);
+
+    return NO_ERROR;
+}
+
+void arch_pmu_disable(void)
+{
+    ARM64_WRITE_SYSREG(pmcntenclr_el0, (1UL << arch_pmu_counter_count()) - 1);
+}
+
+uint64_t arch_pmu_read(uint n)
+{
+    ARM64_WRITE_SYSREG(pmselr_el0, (uint64_t)n);
+    return ARM64_READ_SYSREG(pmxevcntr_el0);
+}
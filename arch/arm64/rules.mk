@@ -5,6 +5,7 @@ MODULE := $(LOCAL_DIR)
 GLOBAL_DEFINES += \
 	ARM64_CPU_$(ARM_CPU)=1 \
 	ARM_ISA_ARMV8=1 \
+	ARCH_HAS_STATIC_KEYS=1 \
 	IS_64BIT=1
 
 GLOBAL_INCLUDES += \
@@ -28,7 +29,8 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/arm/dcc.S
 
 GLOBAL_DEFINES += \
-	ARCH_DEFAULT_STACK_SIZE=4096
+	ARCH_DEFAULT_STACK_SIZE=4096 \
+	ARCH_HAS_CACHE_RANGES=1
 
 # if its requested we build with SMP, arm generically supports 4 cpus
 ifeq ($(WITH_SMP),1)
@@ -44,6 +46,16 @@ GLOBAL_DEFINES += \
 
 MODULE_SRCS += \
     $(LOCAL_DIR)/mp.c
+
+# spin_lock_t implementation:
+# ticket - fair, cpus take the lock in the order they asked for it
+# tas    - test and set, no ordering, a cpu may starve under contention
+ARM64_SPINLOCK ?= ticket
+ifeq ($(ARM64_SPINLOCK),ticket)
+GLOBAL_DEFINES += ARM64_TICKET_SPINLOCK=1
+else ifneq ($(ARM64_SPINLOCK),tas)
+$(error ARM64_SPINLOCK must be ticket or tas)
+endif
 else
 GLOBAL_DEFINES += \
     SMP_MAX_CPUS=1
@@ -51,6 +63,25 @@ endif
 
 ARCH_OPTFLAGS := -O2
 
+# ARMv8.1 lse atomics, so the read-modify-write ops in kernel/atomic.h are
+# single instructions instead of ldxr/stxr loops. only for cpus that have them.
+ARM64_LSE_ATOMICS ?= 0
+ifeq ($(ARM64_LSE_ATOMICS),1)
+ARCH_COMPILEFLAGS += -march=armv8-a+lse
+GLOBAL_DEFINES += ARM64_LSE_ATOMICS=1
+endif
+
+# simd_begin()/simd_end() for kernel vector code, see arch/simd.h
+KERNEL_SIMD ?= 1
+ifeq ($(KERNEL_SIMD),1)
+GLOBAL_DEFINES += WITH_KERNEL_SIMD=1
+endif
+
+# performance counters behind kernel/pmu.h
+ifeq ($(WITH_KERNEL_PMU),1)
+MODULE_SRCS += $(LOCAL_DIR)/pmu.c
+endif
+
 # we have a mmu and want the vmm/pmm
 WITH_KERNEL_VM ?= 1
 
@@ -68,7 +99,8 @@ GLOBAL_DEFINES += \
     KERNEL_ASPACE_BASE=$(KERNEL_ASPACE_BASE) \
     KERNEL_ASPACE_SIZE=$(KERNEL_ASPACE_SIZE) \
     USER_ASPACE_BASE=$(USER_ASPACE_BASE) \
-    USER_ASPACE_SIZE=$(USER_ASPACE_SIZE)
+    USER_ASPACE_SIZE=$(USER_ASPACE_SIZE) \
+    ARCH_HAS_ASPACE=1
 
 KERNEL_BASE ?= $(KERNEL_ASPACE_BASE)
 KERNEL_LOAD_OFFSET ?= 0
@@ -30,9 +30,8 @@
 
 #define LOCAL_TRACE 0
 
+/* what arm64_context_switch leaves on the stack, keep the two in sync */
 struct context_switch_frame {
-    vaddr_t lr;
-    vaddr_t r18;
     vaddr_t r19;
     vaddr_t r20;
     vaddr_t r21;
@@ -44,8 +43,11 @@ struct context_switch_frame {
     vaddr_t r27;
     vaddr_t r28;
     vaddr_t r29;
+    vaddr_t lr;
 };
 
+STATIC_ASSERT(sizeof(struct context_switch_frame) == 6 * 16);
+
 extern void arm64_context_switch(addr_t *old_sp, addr_t new_sp);
 
 static void initial_thread_func(void) __NO_RETURN;
@@ -57,8 +59,8 @@ static void initial_thread_func(void)
 
     LTRACEF("initial_thread_func: thread %p calling %p with arg %p\n", current_thread, current_thread->entry, current_thread->arg);
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* finish the switch that got us here */
+    thread_switch_finish();
     arch_enable_ints();
 
     ret = current_thread->entry(current_thread->arg);
@@ -90,7 +92,7 @@ void arch_thread_initialize(thread_t *t)
 void arch_context_switch(thread_t *oldthread, thread_t *newthread)
 {
     LTRACEF("old %p (%s), new %p (%s)\n", oldthread, oldthread->name, newthread, newthread->name);
-    arm64_fpu_pre_context_switch(oldthread);
+    arm64_fpu_context_switch(oldthread, newthread);
     arm64_context_switch(&oldthread->arch.sp, newthread->arch.sp);
 }
 
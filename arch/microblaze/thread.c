@@ -42,8 +42,8 @@ static void initial_thread_func(void)
     dump_thread(ct);
 #endif
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* finish the switch that got us here */
+    thread_switch_finish();
     arch_enable_ints();
 
     int ret = ct->entry(ct->arg);
@@ -43,8 +43,8 @@ static void initial_thread_func(void)
     dump_thread(ct);
 #endif
 
-    /* exit the implicit critical section we're within */
-    spin_unlock(&thread_lock);
+    /* finish the switch that got us here */
+    thread_switch_finish();
     arch_enable_ints();
 
     int ret = ct->entry(ct->arg);
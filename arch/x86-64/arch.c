@@ -27,17 +27,25 @@
 #include <arch/x86.h>
 #include <arch/x86/mmu.h>
 #include <arch/x86/descriptor.h>
+#include <arch/x86/mp.h>
 #include <platform.h>
 #include <sys/types.h>
 #include <string.h>
 
 static tss_t system_tss;
 
+/* crt0.S points %gs at the first one before calling lk_main */
+struct x86_percpu x86_percpu[SMP_MAX_CPUS];
+
 void arch_early_init(void)
 {
 	/* enable caches here for now */
 	clear_in_cr0(X86_CR0_NW | X86_CR0_CD);
 
+	/* sse is always there on x86-64, turn it on for simd_begin() users */
+	x86_set_cr0((x86_get_cr0() & ~X86_CR0_EM) | X86_CR0_MP);
+	x86_set_cr4(x86_get_cr4() | X86_CR4_OSFXSR | X86_CR4_OSXMMEXPT);
+
 	memset(&system_tss, 0, sizeof(tss_t));
 
 	set_global_desc(TSS_SELECTOR, &system_tss, sizeof(tss_t), 1, 0, 0, SEG_TYPE_TSS, 0, 0);
@@ -22,11 +22,15 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <err.h>
 #include <arch/x86.h>
 #include <kernel/thread.h>
 #include <arch/arch_ops.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
-static void dump_fault_frame(struct x86_iframe *frame)
+static void __COLD dump_fault_frame(struct x86_iframe *frame)
 {
 
 	dprintf(CRITICAL, " CS:     %04x EIP: %08x EFL: %08x CR2: %08x\n",
@@ -48,7 +52,7 @@ static void dump_fault_frame(struct x86_iframe *frame)
 	}
 }
 
-static void exception_die(struct x86_iframe *frame, const char *msg)
+static void __COLD exception_die(struct x86_iframe *frame, const char *msg)
 {
 	dprintf(CRITICAL, msg);
 	dump_fault_frame(frame);
@@ -116,6 +120,29 @@ void x86_pfe_handler(struct x86_iframe *frame)
 		error_code & PFEX_P ? "protection violation" : "page not present");
 #endif
 
+#if WITH_KERNEL_VM
+	/* give the vmm a chance to back a lazily allocated page */
+	if(!(error_code & (PFEX_P | PFEX_RSV))) {
+		uint pf_flags = VMM_PF_FLAG_NOT_PRESENT;
+		if(error_code & PFEX_W)
+			pf_flags |= VMM_PF_FLAG_WRITE;
+		if(error_code & PFEX_U)
+			pf_flags |= VMM_PF_FLAG_USER;
+		if(error_code & PFEX_I)
+			pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+
+		/* resolving it may block, so run with interrupts as they were at the fault */
+		bool ints_were_enabled = frame->rflags & X86_FLAGS_IF;
+		if(ints_were_enabled)
+			arch_enable_ints();
+		status_t err = vmm_page_fault_handler(x86_get_cr2(), pf_flags);
+		if(ints_were_enabled)
+			arch_disable_ints();
+		if(err == NO_ERROR)
+			return;
+	}
+#endif
+
 	current_thread = get_current_thread();
 	dump_thread(current_thread);
 
@@ -29,6 +29,7 @@
 #ifndef ASSEMBLY
 
 #include <arch/x86.h>
+#include <arch/x86/mp.h>
 
 /* override of some routines */
 static inline void arch_enable_ints(void)
@@ -58,7 +59,6 @@ static inline inline bool arch_ints_disabled(void)
 
 int _atomic_and(volatile int *ptr, int val);
 int _atomic_or(volatile int *ptr, int val);
-int _atomic_cmpxchg(volatile int *ptr, int oldval, int newval);
 
 static inline int atomic_add(volatile int *ptr, int val)
 {
@@ -84,10 +84,20 @@ static inline int atomic_swap(volatile int *ptr, int val)
 	return val;
 }
 
+static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval)
+{
+	__asm__ volatile(
+		"lock cmpxchgl %[newval], %[ptr];"
+		: "=a" (oldval), [ptr]"+m" (*ptr)
+		: "a" (oldval), [newval]"r" (newval)
+		: "memory"
+	);
+
+	return oldval;
+}
 
 static inline int atomic_and(volatile int *ptr, int val) { return _atomic_and(ptr, val); }
 static inline int atomic_or(volatile int *ptr, int val) { return _atomic_or(ptr, val); }
-static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval) { return _atomic_cmpxchg(ptr, oldval, newval); }
 
 static inline uint32_t arch_cycle_count(void)
 {
@@ -97,24 +107,53 @@ static inline uint32_t arch_cycle_count(void)
 	return timestamp;
 }
 
-/* use a global pointer to store the current_thread */
-extern struct thread *_current_thread;
-
+/* the current thread and cpu number live in the per cpu block %gs points at */
 static inline struct thread *get_current_thread(void)
 {
-    return _current_thread;
+	struct thread *t;
+
+	__asm__ volatile("movq %%gs:%c1, %0"
+	                 : "=r" (t)
+	                 : "i" (X86_PERCPU_OFFSET(current_thread)));
+
+	return t;
 }
 
 static inline void set_current_thread(struct thread *t)
 {
-    _current_thread = t;
+	__asm__ volatile("movq %0, %%gs:%c1"
+	                 :: "r" (t), "i" (X86_PERCPU_OFFSET(current_thread))
+	                 : "memory");
 }
 
 static inline uint arch_curr_cpu_num(void)
 {
-	    return 0;
+#if WITH_SMP
+	uint cpu;
+
+	__asm__ volatile("movl %%gs:%c1, %0"
+	                 : "=r" (cpu)
+	                 : "i" (X86_PERCPU_OFFSET(cpu_num)));
+
+	return cpu;
+#else
+	return 0;
+#endif
 }
 
+#define mb()        __asm__ volatile("mfence" : : : "memory")
+#define rmb()       __asm__ volatile("lfence" : : : "memory")
+#define wmb()       __asm__ volatile("sfence" : : : "memory")
+
+/* normal stores and loads are already ordered against each other on x86 */
+#ifdef WITH_SMP
+#define smp_mb()    mb()
+#else
+#define smp_mb()    CF
+#endif
+#define smp_wmb()   CF
+#define smp_rmb()   CF
+
 #endif // !ASSEMBLY
 
 #endif
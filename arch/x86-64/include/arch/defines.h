@@ -27,6 +27,10 @@
 #define PAGE_SIZE 4096
 #define PAGE_SIZE_SHIFT 12
 
+/* the mmu code maps 2MB aligned runs with large pages */
+#define ARCH_MMU_LARGE_PAGE_MIN_SHIFT 21
+#define ARCH_MMU_LARGE_PAGE_MAX_SHIFT 21
+
 #define CACHE_LINE 32
 #define ARCH_DEFAULT_STACK_SIZE 8192
 
@@ -33,7 +33,6 @@ typedef unsigned long spin_lock_t;
 typedef uint64_t spin_lock_saved_state_t;
 typedef uint spin_lock_save_flags_t;
 
-/* simple implementation of spinlocks for no smp support */
 static inline void arch_spin_lock_init(spin_lock_t *lock)
 {
     *lock = SPIN_LOCK_INITIAL_VALUE;
@@ -44,6 +43,35 @@ static inline bool arch_spin_lock_held(spin_lock_t *lock)
     return *lock != 0;
 }
 
+#if WITH_SMP
+/* test and set, the inner loop only reads so a waiter doesn't keep stealing the line */
+static inline int arch_spin_trylock(spin_lock_t *lock)
+{
+    unsigned long old = 1;
+
+    __asm__ volatile("xchgq %0, %1"
+                     : "+r" (old), "+m" (*lock)
+                     :: "memory");
+
+    return old;
+}
+
+static inline void arch_spin_lock(spin_lock_t *lock)
+{
+    while (arch_spin_trylock(lock)) {
+        while (*(volatile spin_lock_t *)lock)
+            __asm__ volatile("pause");
+    }
+}
+
+static inline void arch_spin_unlock(spin_lock_t *lock)
+{
+    /* stores aren't reordered with older loads or stores on x86 */
+    __asm__ volatile("" ::: "memory");
+    *(volatile spin_lock_t *)lock = 0;
+}
+#else
+/* simple implementation of spinlocks for no smp support */
 static inline void arch_spin_lock(spin_lock_t *lock)
 {
     *lock = 1;
@@ -51,6 +79,7 @@ static inline void arch_spin_lock(spin_lock_t *lock)
 
 static inline int arch_spin_trylock(spin_lock_t *lock)
 {
+    *lock = 1;
     return 0;
 }
 
@@ -58,6 +87,7 @@ static inline void arch_spin_unlock(spin_lock_t *lock)
 {
     *lock = 0;
 }
+#endif
 
 /* flags are unused on x86 */
 #define ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS  0
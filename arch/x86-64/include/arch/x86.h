@@ -38,6 +38,7 @@ __BEGIN_CDECLS
 #define X86_CPUID_ADDR_WIDTH 0x80000008
 
 void arch_mmu_init(void);
+void x86_mmu_init_percpu(void);
 
 struct x86_iframe {
 	uint64_t pivot;                                     // stack switch pivot
@@ -79,8 +80,15 @@ typedef struct __PACKED tss_64{
 #define X86_CR0_NW 0x20000000 /* not write-through */
 #define X86_CR0_CD 0x40000000 /* cache disable */
 #define X86_CR0_PG 0x80000000 /* enable paging */
+#define X86_FLAGS_IF 0x00000200 /* interrupts enabled */
+#define X86_CR4_PGE 0x00000080 /* global pages enable */
+#define X86_CR4_OSFXSR 0x00000200 /* os supports fxsave/fxrstor */
+#define X86_CR4_OSXMMEXPT 0x00000400 /* os handles simd fp exceptions */
+#define X86_CR4_PCIDE 0x00020000 /* process context ids in the low bits of cr3 */
 #define X86_CR4_SMEP 0x00100000 /* SMEP protection enabling */
 #define X86_CR4_SMAP 0x00200000 /* SMAP protection enabling */
+#define X86_CR3_NOFLUSH (1ul << 63) /* with pcids, keep the new pcid's tlb entries */
+#define X86_CR3_PCID_MASK 0xffful
 #define x86_EFER_NXE 0x00000800 /* to enable execute disable bit */
 #define x86_MSR_EFER 0xc0000080 /* EFER Model Specific Register id */
 
@@ -339,6 +347,15 @@ static inline void x86_set_cr4(uint64_t in_val)
 		:"r" (in_val));
 }
 
+static inline void x86_invlpg(uint64_t addr)
+{
+	__asm__ __volatile__ (
+		"invlpg (%0) \n\t"
+		:
+		:"r" (addr)
+		:"memory");
+}
+
 static inline uint64_t x86_get_cr0(void)
 {
 	uint64_t rv;
@@ -394,6 +411,90 @@ static inline uint64_t check_smap_avail(void)
 	return ((reg_b>>0x13) & 0x1);
 }
 
+static inline uint64_t check_pcid_avail(void)
+{
+	uint32_t a, b, c, d;
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (a), "=b" (b), "=c" (c), "=d" (d)
+		:"a" (0x01), "c" (0x0));
+	return ((c>>0x11) & 0x1);
+}
+
+static inline uint64_t check_pclmul_avail(void)
+{
+	uint32_t a, b, c, d;
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (a), "=b" (b), "=c" (c), "=d" (d)
+		:"a" (0x01), "c" (0x0));
+	return ((c>>0x01) & 0x1);
+}
+
+/* aes-ni, the aes code also needs sse4.1 */
+static inline uint64_t check_aesni_avail(void)
+{
+	uint32_t a, b, c, d;
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (a), "=b" (b), "=c" (c), "=d" (d)
+		:"a" (0x01), "c" (0x0));
+	return ((c>>0x19) & 0x1) && ((c>>0x13) & 0x1);
+}
+
+/* raw cpuid, leaf in eax and subleaf 0 */
+static inline void x86_cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+		:"a" (leaf), "c" (0x0));
+}
+
+static inline uint64_t x86_rdtsc(void)
+{
+	uint32_t low, high;
+	rdtsc(low, high);
+	return ((uint64_t)high << 32) | low;
+}
+
+/* cpuid leaf 7 feature bits, the string routines pick their copy loops from these */
+static inline void x86_cpuid_leaf7(uint32_t *ebx, uint32_t *edx)
+{
+	uint32_t a, c;
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (a), "=b" (*ebx), "=c" (c), "=d" (*edx)
+		:"a" (0x07), "c" (0x0));
+}
+
+static inline uint64_t check_erms_avail(void)
+{
+	uint32_t reg_b, reg_d;
+	x86_cpuid_leaf7(&reg_b, &reg_d);
+	return ((reg_b>>0x09) & 0x1);
+}
+
+static inline uint64_t check_fsrm_avail(void)
+{
+	uint32_t reg_b, reg_d;
+	x86_cpuid_leaf7(&reg_b, &reg_d);
+	return ((reg_d>>0x04) & 0x1);
+}
+
+/* sha extensions, leaf 7 ebx bit 29; the sha code also needs sse4.1 */
+static inline uint64_t check_sha_avail(void)
+{
+	uint32_t a, b, c, d;
+	uint32_t reg_b, reg_d;
+	x86_cpuid_leaf7(&reg_b, &reg_d);
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (a), "=b" (b), "=c" (c), "=d" (d)
+		:"a" (0x01), "c" (0x0));
+	return ((reg_b>>0x1d) & 0x1) && ((c>>0x13) & 0x1);
+}
+
 __END_CDECLS
 
 #endif
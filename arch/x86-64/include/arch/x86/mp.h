@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/* where x86_mp_start_secondaries() copies the real mode entry of the secondary cpus,
+ * it has to be page aligned and under 1MB for the startup ipi */
+#define X86_AP_TRAMPOLINE_PHYS  0x8000
+
+#define X86_MSR_GS_BASE         0xc0000101
+
+#ifndef ASSEMBLY
+
+#include <sys/types.h>
+#include <compiler.h>
+
+struct thread;
+
+/* one per cpu, %gs points at the running cpu's copy */
+struct x86_percpu {
+	struct thread *current_thread;
+	uint cpu_num;
+	uint apic_id;
+};
+
+extern struct x86_percpu x86_percpu[SMP_MAX_CPUS];
+
+#define X86_PERCPU_OFFSET(field) __offsetof(struct x86_percpu, field)
+
+#if WITH_SMP
+/* bring up whatever secondary cpus answer the startup ipi, called by the
+ * platform once its local apic driver is up */
+void x86_mp_start_secondaries(void);
+
+/* the local apic id of cpu, ERR_NOT_FOUND if it didn't come up */
+status_t x86_cpu_apic_id(uint cpu, uint *apic_id);
+
+/* provided by the platform's local apic driver */
+uint x86_lapic_id(void);
+void x86_lapic_send_ipi(uint apic_id, uint ipi);
+void x86_lapic_start_aps(paddr_t entry);
+#endif
+
+#endif // !ASSEMBLY
@@ -33,9 +33,16 @@
 #include <assert.h>
 #include <err.h>
 #include <arch/arch_ops.h>
+#include <arch/aspace.h>
+#include <kernel/asid.h>
+#include <kernel/mp.h>
+#include <kernel/vm.h>
 
 extern map_addr_t g_CR3;
 
+/* set once the boot cpu turned on CR4.PCIDE, the secondaries follow it */
+static bool x86_pcid_enabled;
+
 /* Address width */
 extern uint32_t g_addr_width;
 
@@ -276,10 +283,22 @@ static void update_pt_entry(vaddr_t vaddr, paddr_t paddr,  uint64_t pde, arch_fl
 	pt_index = (((uint64_t)vaddr >> PT_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
 	pt_table[pt_index] = (uint64_t)paddr;
 	pt_table[pt_index] |= flags | X86_MMU_PG_P;
-	if(!(flags & X86_MMU_PG_U))
+	if(!is_user_address(vaddr))
 		pt_table[pt_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
 }
 
+static void update_pd_large_entry(vaddr_t vaddr, paddr_t paddr, uint64_t pdpe, arch_flags_t flags)
+{
+	uint32_t pd_index;
+
+	uint64_t *pd_table = (uint64_t *)(pdpe & X86_PG_FRAME);
+	pd_index = (((uint64_t)vaddr >> PD_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
+	pd_table[pd_index] = (uint64_t)paddr;
+	pd_table[pd_index] |= flags | X86_MMU_PG_P | X86_MMU_PG_PS;
+	if(!is_user_address(vaddr))
+		pd_table[pd_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
+}
+
 static void update_pd_entry(vaddr_t vaddr, uint64_t pdpe, addr_t *m, arch_flags_t flags)
 {
 	uint32_t pd_index;
@@ -374,8 +393,8 @@ map_addr_t get_kernel_cr3()
  * 4KB pages.
  *
  */
-status_t x86_mmu_add_mapping(addr_t pml4, paddr_t paddr,
-				vaddr_t vaddr, arch_flags_t mmu_flags)
+static status_t x86_mmu_add_mapping_etc(addr_t pml4, paddr_t paddr,
+				vaddr_t vaddr, arch_flags_t mmu_flags, bool large)
 {
 	uint32_t pd_new = 0, pdp_new = 0;
 	uint64_t pml4e, pdpe, pde;
@@ -422,6 +441,24 @@ status_t x86_mmu_add_mapping(addr_t pml4, paddr_t paddr,
 	if(!pd_new)
 		pde = get_pd_entry_from_pd_table(vaddr, pdpe);
 
+	if(large) {
+		/* a 2MB page can only go in a slot that has no page table hanging off it */
+		if(!pd_new && (pde & X86_MMU_PG_P) && !(pde & X86_MMU_PG_PS)) {
+			ret = ERR_ALREADY_EXISTS;
+			goto clean;
+		}
+
+		update_pd_large_entry(vaddr, paddr, pdpe, get_x86_arch_flags(mmu_flags));
+		ret = NO_ERROR;
+		goto clean;
+	}
+
+	if(!pd_new && (pde & X86_MMU_PG_P) && (pde & X86_MMU_PG_PS)) {
+		/* already covered by a 2MB page, don't walk into it as if it were a table */
+		ret = ERR_ALREADY_EXISTS;
+		goto clean;
+	}
+
 	if(pd_new || (pde & X86_MMU_PG_P) == 0) {
 		/* Creating a new pt */
 		m  = _map_alloc(PAGE_SIZE);
@@ -453,6 +490,12 @@ status_t x86_mmu_add_mapping(addr_t pml4, paddr_t paddr,
 		return ret;
 }
 
+status_t x86_mmu_add_mapping(addr_t pml4, paddr_t paddr,
+				vaddr_t vaddr, arch_flags_t mmu_flags)
+{
+	return x86_mmu_add_mapping_etc(pml4, paddr, vaddr, mmu_flags, false);
+}
+
 /**
  * @brief  x86-64 MMU unmap an entry in the page tables recursively and clear out tables
  *
@@ -484,6 +527,15 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
 			next_table_addr = (vaddr_t *)X86_PHYS_TO_VIRT(table[offset]);
 			if((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) == 0)
 				return;
+			if(X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_PS) {
+				/* 2MB page: there is no table below it, drop the whole entry.
+				 * Large pages are only created over ranges that get unmapped as a unit.
+				 */
+				arch_disable_ints();
+				table[offset] &= X86_PTE_NOT_PRESENT;
+				arch_enable_ints();
+				return;
+			}
 			break;
 		case PT_L:
 			offset = (((uint64_t)vaddr >> PT_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
@@ -520,10 +572,68 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
 	}
 }
 
-status_t x86_mmu_unmap(addr_t pml4, vaddr_t vaddr, uint count)
+/*
+ * Unmaps clear all of their entries first and then invalidate the range in one
+ * go, on every cpu when running SMP. Past X86_TLB_FLUSH_MAX_PAGES pages the
+ * whole tlb is dropped instead of going page by page.
+ */
+#define X86_TLB_FLUSH_MAX_PAGES 32
+
+struct x86_tlb_flush {
+	vaddr_t vaddr;
+	uint count;
+	addr_t pml4;	/* a user aspace's, only cpus running it flush. 0 for the kernel */
+};
+
+/* drops every translation, the global ones and those of every pcid included */
+static void x86_tlb_flush_all(void)
 {
-	vaddr_t next_aligned_v_addr;
+	uint64_t cr4 = x86_get_cr4();
+
+	x86_set_cr4(cr4 ^ X86_CR4_PGE);
+	x86_set_cr4(cr4);
+}
+
+static void x86_tlb_flush_task(void *context)
+{
+	struct x86_tlb_flush *flush = context;
+	uint index;
+
+	/* invlpg only reaches the pcid a cpu is on and the global kernel pages, the
+	 * user aspace's translations anywhere else went with its old pcid */
+	if(flush->pml4 && (x86_get_cr3() & X86_PG_FRAME) != flush->pml4)
+		return;
+
+	if(flush->count > X86_TLB_FLUSH_MAX_PAGES) {
+		x86_tlb_flush_all();
+		return;
+	}
+
+	for(index = 0; index < flush->count; index++)
+		x86_invlpg(flush->vaddr + index * PAGE_SIZE);
+}
+
+static void x86_tlb_flush(addr_t pml4, vaddr_t vaddr, uint count)
+{
+	struct x86_tlb_flush flush = { vaddr, count, pml4 };
+
+#if WITH_SMP
+	mp_sync_exec(MP_CPU_ALL_BUT_LOCAL, x86_tlb_flush_task, &flush);
+#endif
+	x86_tlb_flush_task(&flush);
+}
 
+static void x86_mmu_unmap_entries(addr_t pml4, vaddr_t vaddr, uint count)
+{
+	while (count > 0) {
+		x86_mmu_unmap_entry(vaddr, PAGING_LEVELS, X86_PHYS_TO_VIRT(pml4));
+		vaddr += PAGE_SIZE;
+		count--;
+	}
+}
+
+status_t x86_mmu_unmap(addr_t pml4, vaddr_t vaddr, uint count)
+{
 	DEBUG_ASSERT(pml4);
 	if(!(x86_mmu_check_map_addr(vaddr)))
 		return ERR_INVALID_ARGS;
@@ -531,29 +641,22 @@ status_t x86_mmu_unmap(addr_t pml4, vaddr_t vaddr, uint count)
 	if (count == 0)
 		return NO_ERROR;
 
-	next_aligned_v_addr = vaddr;
-	while (count > 0) {
-		x86_mmu_unmap_entry(next_aligned_v_addr, PAGING_LEVELS, X86_PHYS_TO_VIRT(pml4));
-		next_aligned_v_addr += PAGE_SIZE;
-		count--;
-	}
+	x86_mmu_unmap_entries(pml4, vaddr, count);
+	x86_tlb_flush(0, vaddr, count);
 	return NO_ERROR;
 }
 
 int arch_mmu_unmap(vaddr_t vaddr, uint count)
 {
-	addr_t current_cr3_val;
-
 	if(!(x86_mmu_check_map_addr(vaddr)))
 		return ERR_INVALID_ARGS;
 
 	if (count == 0)
 		return NO_ERROR;
 
-	DEBUG_ASSERT(x86_get_cr3());
-	current_cr3_val = (addr_t)x86_get_cr3();
-
-	return(x86_mmu_unmap(current_cr3_val, vaddr, count));
+	/* the kernel's table, cr3 may be a user aspace's copy of it */
+	DEBUG_ASSERT(g_CR3);
+	return(x86_mmu_unmap(g_CR3, vaddr, count));
 }
 
 /**
@@ -606,7 +709,7 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
 		return ERR_INVALID_ARGS;
 
 	DEBUG_ASSERT(x86_get_cr3());
-	current_cr3_val = (addr_t)x86_get_cr3();
+	current_cr3_val = (addr_t)x86_get_cr3() & X86_PG_FRAME;
 
 	stat = x86_mmu_get_mapping(current_cr3_val, vaddr, &ret_level, &ret_flags, &last_valid_entry);
 	if(stat)
@@ -621,25 +724,54 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
 	return NO_ERROR;
 }
 
-int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
+/**
+ * @brief  Mapping a run of pages, using 2MB pages wherever vaddr and paddr line up
+ *
+ */
+static status_t x86_mmu_map_pages(addr_t pml4, vaddr_t vaddr, paddr_t paddr, uint count, arch_flags_t flags)
 {
-	addr_t current_cr3_val;
-	struct map_range range;
+	status_t map_status;
+	uint index = 0;
+
+	while(index < count) {
+		uint step = 1;
+
+		map_status = ERR_ALREADY_EXISTS;
+		if(IS_ALIGNED(vaddr, 1ul << PD_SHIFT) && IS_ALIGNED(paddr, 1ul << PD_SHIFT) &&
+			(count - index) >= (1u << ADDR_OFFSET)) {
+			map_status = x86_mmu_add_mapping_etc(pml4, paddr, vaddr, flags, true);
+			if(map_status == NO_ERROR)
+				step = 1u << ADDR_OFFSET;
+		}
+
+		/* fall back to a 4KB page if the 2MB slot is already split into a page table */
+		if(map_status == ERR_ALREADY_EXISTS)
+			map_status = x86_mmu_add_mapping(pml4, paddr, vaddr, flags);
+
+		if(map_status) {
+			dprintf(SPEW, "Add mapping failed with err=%d\n", map_status);
+			/* Unmap the partial mapping - if any */
+			x86_mmu_unmap(pml4, vaddr - index * PAGE_SIZE, index);
+			return map_status;
+		}
+		index += step;
+		vaddr += step * PAGE_SIZE;
+		paddr += step * PAGE_SIZE;
+	}
+	return NO_ERROR;
+}
 
+int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
+{
 	if((!x86_mmu_check_map_addr(paddr)) || (!x86_mmu_check_map_addr(vaddr)))
 		return ERR_INVALID_ARGS;
 
 	if (count == 0)
 		return NO_ERROR;
 
-	DEBUG_ASSERT(x86_get_cr3());
-	current_cr3_val = (addr_t)x86_get_cr3();
-
-	range.start_vaddr = vaddr;
-	range.start_paddr = paddr;
-	range.size = count * PAGE_SIZE;
-
-	return(x86_mmu_map_range(current_cr3_val, &range, flags));
+	/* the kernel's table, cr3 may be a user aspace's copy of it */
+	DEBUG_ASSERT(g_CR3);
+	return(x86_mmu_map_pages(g_CR3, vaddr, paddr, count, flags));
 }
 
 /**
@@ -661,6 +793,11 @@ void arch_mmu_init(void)
 		cr4 |= X86_CR4_SMEP;
 	if(check_smap_avail())
 		cr4 |=X86_CR4_SMAP;
+	/* cr3 has to have a pcid of 0 at this point, which it does */
+	if(check_pcid_avail()) {
+		cr4 |= X86_CR4_PCIDE;
+		x86_pcid_enabled = true;
+	}
 	x86_set_cr4(cr4);
 
 	/* Set NXE bit in MSR_EFER*/
@@ -668,3 +805,159 @@ void arch_mmu_init(void)
 	efer_msr |= x86_EFER_NXE;
 	write_msr(x86_MSR_EFER, efer_msr);
 }
+
+/* the secondaries come up with the boot cpu's cr4 minus PCIDE, which can only
+ * be turned on once in long mode */
+void x86_mmu_init_percpu(void)
+{
+	if(x86_pcid_enabled)
+		x86_set_cr4(x86_get_cr4() | X86_CR4_PCIDE);
+}
+
+/*
+ * User aspaces get a pml4 each, a copy of the kernel's so the kernel slots
+ * point at the same tables everywhere, with its own tables in the slots
+ * above them. USER_ASPACE_BASE is past every slot the kernel uses. Where the
+ * cpu has them, each one runs with a pcid from the allocator in
+ * kernel/asid.h and its pages aren't global, so switching between them keeps
+ * the tlb. PCID 0 is the kernel's own table, it is never handed out.
+ */
+#define X86_PCID_BITS 12
+
+static unsigned long x86_pcid_map[ASID_MAP_WORDS(X86_PCID_BITS)];
+static asid_allocator_t x86_pcid_allocator =
+	ASID_ALLOCATOR_INITIAL_VALUE(X86_PCID_BITS, x86_pcid_map);
+
+static bool x86_aspace_range_valid(const struct arch_aspace *aspace, vaddr_t vaddr, uint count)
+{
+	return vaddr >= aspace->base && count <= aspace->size / PAGE_SIZE &&
+		vaddr - aspace->base <= aspace->size - (size_t)count * PAGE_SIZE;
+}
+
+status_t arch_mmu_init_aspace(struct arch_aspace *aspace, vaddr_t base, size_t size)
+{
+	map_addr_t *kernel_table, *table;
+	uint index;
+
+	DEBUG_ASSERT(g_CR3);
+	if(!size || base + size - 1 < base)
+		return ERR_INVALID_ARGS;
+
+	/* the slots it spans have to be its own */
+	kernel_table = (map_addr_t *)X86_PHYS_TO_VIRT(g_CR3);
+	for(index = (base >> PML4_SHIFT) & ((1ul << ADDR_OFFSET) - 1);
+		index <= (((base + size - 1) >> PML4_SHIFT) & ((1ul << ADDR_OFFSET) - 1)); index++) {
+		if(kernel_table[index] & X86_MMU_PG_P)
+			return ERR_INVALID_ARGS;
+	}
+
+	table = (map_addr_t *)_map_alloc(PAGE_SIZE);
+	if(!table)
+		return ERR_NO_MEMORY;
+	memcpy(table, kernel_table, PAGE_SIZE);
+
+	aspace->pml4 = table;
+	aspace->pml4_phys = X86_VIRT_TO_PHYS((addr_t)table);
+	aspace->base = base;
+	aspace->size = size;
+	aspace->pcid = 0;
+
+	return NO_ERROR;
+}
+
+status_t arch_mmu_destroy_aspace(struct arch_aspace *aspace)
+{
+	/* unmapping everything freed its own tables along the way */
+	free(aspace->pml4);
+	aspace->pml4 = NULL;
+
+	return NO_ERROR;
+}
+
+int arch_mmu_map_aspace(struct arch_aspace *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
+{
+	status_t ret;
+
+	if((!x86_mmu_check_map_addr(paddr)) || (!x86_mmu_check_map_addr(vaddr)))
+		return ERR_INVALID_ARGS;
+
+	if(!x86_aspace_range_valid(aspace, vaddr, count))
+		return ERR_OUT_OF_RANGE;
+
+	if (count == 0)
+		return NO_ERROR;
+
+	ret = x86_mmu_map_pages(aspace->pml4_phys, vaddr, paddr, count, flags);
+
+	/* the partial mapping was taken down with a kernel style flush, which
+	 * doesn't reach the aspace's pcid on cpus that aren't running it */
+	if(ret && x86_pcid_enabled)
+		asid_invalidate(&aspace->pcid);
+
+	return ret;
+}
+
+int arch_mmu_unmap_aspace(struct arch_aspace *aspace, vaddr_t vaddr, uint count)
+{
+	if(!(x86_mmu_check_map_addr(vaddr)))
+		return ERR_INVALID_ARGS;
+
+	if(!x86_aspace_range_valid(aspace, vaddr, count))
+		return ERR_OUT_OF_RANGE;
+
+	if (count == 0)
+		return NO_ERROR;
+
+	x86_mmu_unmap_entries(aspace->pml4_phys, vaddr, count);
+
+	/* give up the pcid before the flush, anyone switching in from here on
+	 * starts clean and anyone already in it gets the ipi */
+	if(x86_pcid_enabled)
+		asid_invalidate(&aspace->pcid);
+	x86_tlb_flush(aspace->pml4_phys, vaddr, count);
+
+	return NO_ERROR;
+}
+
+status_t arch_mmu_query_aspace(struct arch_aspace *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags)
+{
+	uint32_t ret_level;
+	map_addr_t last_valid_entry;
+	arch_flags_t ret_flags;
+	status_t stat;
+
+	stat = x86_mmu_get_mapping(aspace->pml4_phys, vaddr, &ret_level, &ret_flags, &last_valid_entry);
+	if(stat)
+		return stat;
+
+	if(paddr)
+		*paddr = (paddr_t)(last_valid_entry);
+	if(flags)
+		*flags = ret_flags;
+
+	return NO_ERROR;
+}
+
+void arch_mmu_context_switch(struct arch_aspace *aspace)
+{
+	uint pcid;
+	bool flush;
+
+	if(!x86_pcid_enabled) {
+		x86_set_cr3(aspace ? aspace->pml4_phys : g_CR3);
+		return;
+	}
+
+	if(!aspace) {
+		x86_set_cr3(g_CR3 | X86_CR3_NOFLUSH);
+		return;
+	}
+
+	pcid = asid_switch(&x86_pcid_allocator, &aspace->pcid, arch_curr_cpu_num(), &flush);
+
+	/* first switch since a rollover, the pcids may mean other aspaces now */
+	if(flush)
+		x86_tlb_flush_all();
+
+	x86_set_cr3(aspace->pml4_phys | pcid | X86_CR3_NOFLUSH);
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/mp.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <arch/x86.h>
+#include <arch/x86/mmu.h>
+#include <arch/x86/mp.h>
+#include <kernel/mp.h>
+#include <stdlib.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <lk/main.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+#define X86_MSR_EFER        0xc0000080
+#define X86_EFER_LMA        (1U << 10)
+
+/* how long the secondaries get to show up after the startup ipis */
+#define X86_AP_BOOT_TIMEOUT 100
+
+/* the real mode entry in crt0.S and the values it loads before going to long mode */
+extern uint8_t x86_ap_trampoline[];
+extern uint8_t x86_ap_trampoline_end[];
+extern uint8_t x86_ap_trampoline_data[];
+
+struct x86_ap_trampoline_data {
+	uint32_t cr0;
+	uint32_t cr3;
+	uint32_t cr4;
+	uint32_t efer;
+};
+
+/* bumped by each secondary as it reaches long mode, which numbers them */
+volatile int x86_ap_count;
+
+/* initial stacks, which become the stacks of the idle threads */
+static uint8_t x86_ap_stacks[SMP_MAX_CPUS - 1][ARCH_DEFAULT_STACK_SIZE] __ALIGNED(16);
+vaddr_t x86_ap_stack_top[SMP_MAX_CPUS];
+
+/* held until the boot cpu knows how many secondaries made it */
+static spin_lock_t x86_boot_cpu_lock = 1;
+static uint x86_secondaries;
+static volatile int secondaries_to_init;
+
+void x86_secondary_entry(uint cpu);
+
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
+{
+	LTRACEF("target 0x%x, ipi %u\n", target, ipi);
+
+	/* filter out targets outside of the range of cpus we care about */
+	target &= MP_CPU_MASK_ALL;
+
+	for (uint cpu = 0; target; cpu++, target >>= 1) {
+		if (target & 1)
+			x86_lapic_send_ipi(x86_percpu[cpu].apic_id, ipi);
+	}
+
+	return NO_ERROR;
+}
+
+void arch_mp_init_percpu(void)
+{
+	/* the ipi vectors belong to the platform's local apic driver, which
+	 * registers them for every cpu at once */
+}
+
+void x86_mp_start_secondaries(void)
+{
+	x86_percpu[0].apic_id = x86_lapic_id();
+
+	/* the low 2MB are identity mapped, so the copy can go straight there */
+	size_t len = x86_ap_trampoline_end - x86_ap_trampoline;
+	memcpy((void *)X86_AP_TRAMPOLINE_PHYS, x86_ap_trampoline, len);
+
+	struct x86_ap_trampoline_data *data = (void *)(X86_AP_TRAMPOLINE_PHYS +
+	                                      (x86_ap_trampoline_data - x86_ap_trampoline));
+	data->cr0 = x86_get_cr0();
+	data->cr3 = x86_get_cr3() & X86_PG_FRAME;
+	/* PCIDE can't be set outside of long mode, x86_mmu_init_percpu() does it */
+	data->cr4 = x86_get_cr4() & ~X86_CR4_PCIDE;
+	data->efer = read_msr(X86_MSR_EFER) & ~X86_EFER_LMA;
+
+	for (uint i = 1; i < SMP_MAX_CPUS; i++)
+		x86_ap_stack_top[i] = (vaddr_t)x86_ap_stacks[i - 1] + ARCH_DEFAULT_STACK_SIZE;
+
+	x86_lapic_start_aps(X86_AP_TRAMPOLINE_PHYS);
+
+	/* nothing says how many cpus there are, take whoever shows up in time */
+	lk_time_t start = current_time();
+	while (x86_ap_count < SMP_MAX_CPUS - 1 && current_time() - start < X86_AP_BOOT_TIMEOUT)
+		thread_sleep(1);
+
+	x86_secondaries = MIN((uint)x86_ap_count, SMP_MAX_CPUS - 1);
+	secondaries_to_init = x86_secondaries;
+
+	dprintf(INFO, "x86: %u secondary cpus, %d answered\n", x86_secondaries, x86_ap_count);
+
+	lk_init_secondary_cpus(x86_secondaries);
+
+	/* release the secondary cpus */
+	smp_mb();
+	spin_unlock(&x86_boot_cpu_lock);
+}
+
+status_t x86_cpu_apic_id(uint cpu, uint *apic_id)
+{
+	/* only good once x86_mp_start_secondaries() is done counting */
+	if (cpu > x86_secondaries)
+		return ERR_NOT_FOUND;
+
+	*apic_id = x86_percpu[cpu].apic_id;
+	return NO_ERROR;
+}
+
+static void __NO_RETURN x86_park_cpu(void)
+{
+	arch_disable_ints();
+	for (;;)
+		__asm__ volatile("hlt");
+}
+
+/* called from crt0.S on the secondary's boot stack, interrupts off */
+void x86_secondary_entry(uint cpu)
+{
+	write_msr(X86_MSR_GS_BASE, (uint64_t)&x86_percpu[cpu]);
+	x86_percpu[cpu].cpu_num = cpu;
+	x86_percpu[cpu].apic_id = x86_lapic_id();
+
+	x86_mmu_init_percpu();
+
+	spin_lock(&x86_boot_cpu_lock);
+	spin_unlock(&x86_boot_cpu_lock);
+
+	/* came in after the boot cpu stopped counting */
+	if (cpu > x86_secondaries)
+		x86_park_cpu();
+
+	/* run early secondary cpu init routines up to the threading level */
+	lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
+
+	arch_mp_init_percpu();
+
+	LTRACEF("cpu num %u, apic id %u\n", cpu, x86_percpu[cpu].apic_id);
+
+	/* we're done, tell the main cpu we're up */
+	atomic_add(&secondaries_to_init, -1);
+
+	lk_secondary_cpu_entry();
+
+	x86_park_cpu();
+}
@@ -10,8 +10,25 @@ GLOBAL_DEFINES += \
 	MEMBASE=0x00200000U \
 	KERNEL_ASPACE_BASE=0x00200000U \
 	KERNEL_ASPACE_SIZE=0x7fe00000U \
-	IS_64BIT=1 \
-	SMP_MAX_CPUS=1
+	USER_ASPACE_BASE=0x0000008000000000UL \
+	USER_ASPACE_SIZE=0x00007f8000000000UL \
+	ARCH_HAS_ASPACE=1 \
+	ARCH_HAS_STATIC_KEYS=1 \
+	IS_64BIT=1
+
+# secondary cpus are started with INIT-SIPI-SIPI and the local apic, by the platform
+ifeq ($(WITH_SMP),1)
+SMP_MAX_CPUS ?= 4
+GLOBAL_DEFINES += \
+	WITH_SMP=1
+MODULE_SRCS += \
+	$(LOCAL_DIR)/mp.c
+else
+SMP_MAX_CPUS := 1
+endif
+
+GLOBAL_DEFINES += \
+	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
 
 KERNEL_BASE ?= 0x00200000
 KERNEL_LOAD_OFFSET ?= 0x0
@@ -28,6 +45,18 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/faults.c \
 	$(LOCAL_DIR)/descriptor.c
 
+# performance counters behind kernel/pmu.h
+ifeq ($(WITH_KERNEL_PMU),1)
+MODULE_SRCS += $(LOCAL_DIR)/pmu.c
+endif
+
+# simd_begin()/simd_end() for kernel vector code, see arch/simd.h
+KERNEL_SIMD ?= 1
+ifeq ($(KERNEL_SIMD),1)
+GLOBAL_DEFINES += WITH_KERNEL_SIMD=1
+MODULE_SRCS += $(LOCAL_DIR)/simd.c
+endif
+
 # set the default toolchain to x86 elf and set a #define
 ifndef TOOLCHAIN_PREFIX
 TOOLCHAIN_PREFIX := x86_64-elf-
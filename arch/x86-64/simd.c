@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/simd.h>
+#include <arch/ops.h>
+#include <assert.h>
+#include <compiler.h>
+#include <stdint.h>
+#include <kernel/spinlock.h>
+
+/*
+ * Threads don't carry sse state across context switches, so anything the
+ * compiler left in the xmm registers belongs to whoever is running here.
+ * The outermost simd_begin() parks it in a per cpu fxsave area and
+ * simd_end() puts it back.
+ */
+struct simd_cpu_state {
+	uint8_t fxsave[512] __ALIGNED(16);
+	uint depth;
+	spin_lock_saved_state_t irq_state;
+};
+
+static struct simd_cpu_state simd_cpu_state[SMP_MAX_CPUS];
+
+bool simd_available(void)
+{
+	/* sse2 is part of the x86-64 baseline */
+	return true;
+}
+
+void simd_begin(void)
+{
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	struct simd_cpu_state *s = &simd_cpu_state[arch_curr_cpu_num()];
+	if (s->depth++ > 0)
+		return;
+
+	s->irq_state = state;
+	__asm__ volatile("fxsave64 %0" : "=m" (s->fxsave));
+}
+
+void simd_end(void)
+{
+	struct simd_cpu_state *s = &simd_cpu_state[arch_curr_cpu_num()];
+
+	DEBUG_ASSERT(s->depth > 0);
+	if (--s->depth > 0)
+		return;
+
+	__asm__ volatile("fxrstor64 %0" : : "m" (s->fxsave));
+	arch_interrupt_restore(s->irq_state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
@@ -38,19 +38,17 @@ struct context_switch_frame {
 	uint64_t rip;
 };
 
-/* we're uniprocessor at this point for x86-64, so store a global pointer to the current thread */
-struct thread *_current_thread;
-
 static void initial_thread_func(void) __NO_RETURN;
 static void initial_thread_func(void)
 {
 	int ret;
 
-	/* release the thread lock that was implicitly held across the reschedule */
-	spin_unlock(&thread_lock);
+	/* finish the switch that got us here */
+	thread_switch_finish();
 	arch_enable_ints();
 
-	ret = _current_thread->entry(_current_thread->arg);
+	thread_t *ct = get_current_thread();
+	ret = ct->entry(ct->arg);
 
 	thread_exit(ret);
 }
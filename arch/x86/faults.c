@@ -26,7 +26,7 @@
 #include <kernel/thread.h>
 
 
-static void dump_fault_frame(struct x86_iframe *frame)
+static void __COLD dump_fault_frame(struct x86_iframe *frame)
 {
 	dprintf(CRITICAL, " CS:     %04x EIP: %08x EFL: %08x CR2: %08x\n",
 	        frame->cs, frame->eip, frame->eflags, x86_get_cr2());
@@ -46,7 +46,7 @@ static void dump_fault_frame(struct x86_iframe *frame)
 	}
 }
 
-static void exception_die(struct x86_iframe *frame, const char *msg)
+static void __COLD exception_die(struct x86_iframe *frame, const char *msg)
 {
 	dprintf(CRITICAL, msg);
 	dump_fault_frame(frame);
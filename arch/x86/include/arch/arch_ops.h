@@ -58,7 +58,6 @@ static inline bool arch_ints_disabled(void)
 
 int _atomic_and(volatile int *ptr, int val);
 int _atomic_or(volatile int *ptr, int val);
-int _atomic_cmpxchg(volatile int *ptr, int oldval, int newval);
 
 static inline int atomic_add(volatile int *ptr, int val)
 {
@@ -84,10 +83,20 @@ static inline int atomic_swap(volatile int *ptr, int val)
 	return val;
 }
 
+static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval)
+{
+	__asm__ volatile(
+		"lock cmpxchgl %[newval], %[ptr];"
+		: "=a" (oldval), [ptr]"+m" (*ptr)
+		: "a" (oldval), [newval]"r" (newval)
+		: "memory"
+	);
+
+	return oldval;
+}
 
 static inline int atomic_and(volatile int *ptr, int val) { return _atomic_and(ptr, val); }
 static inline int atomic_or(volatile int *ptr, int val) { return _atomic_or(ptr, val); }
-static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval) { return _atomic_cmpxchg(ptr, oldval, newval); }
 
 static inline uint32_t arch_cycle_count(void)
 {
@@ -115,6 +124,19 @@ static inline uint arch_curr_cpu_num(void)
     return 0;
 }
 
+#define mb()        __asm__ volatile("mfence" : : : "memory")
+#define rmb()       __asm__ volatile("lfence" : : : "memory")
+#define wmb()       __asm__ volatile("sfence" : : : "memory")
+
+/* normal stores and loads are already ordered against each other on x86 */
+#ifdef WITH_SMP
+#define smp_mb()    mb()
+#else
+#define smp_mb()    CF
+#endif
+#define smp_wmb()   CF
+#define smp_rmb()   CF
+
 #endif // !ASSEMBLY
 
 #endif
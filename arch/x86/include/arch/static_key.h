@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+
+struct static_key;
+
+/* a disabled site is a 5 byte nop, an enabled one a jmp rel32 of the same size */
+#define ARCH_STATIC_KEY_INSN_SIZE 5
+
+static inline __ALWAYS_INLINE bool arch_static_key_branch(struct static_key *key)
+{
+	__asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n"
+	             ".pushsection .static_key_jumps, \"aw\"\n"
+	             ".balign 4\n"
+	             ".long 1b, %l[enabled], %c0\n"
+	             ".popsection\n"
+	             :: "i" (key) :: enabled);
+	return false;
+enabled:
+	return true;
+}
+
+static inline void arch_static_key_patch(uintptr_t code, uintptr_t target, bool enable)
+{
+	uint8_t insn[ARCH_STATIC_KEY_INSN_SIZE] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+	if (enable) {
+		int32_t rel = (int32_t)(target - (code + ARCH_STATIC_KEY_INSN_SIZE));
+		insn[0] = 0xe9;
+		memcpy(&insn[1], &rel, sizeof(rel));
+	}
+	memcpy((void *)code, insn, sizeof(insn));
+}
+
+/* run by every other cpu after the text changed under it, before it leaves the ipi */
+static inline void arch_static_key_sync(void)
+{
+	uint32_t a = 0, b, c = 0, d;
+
+	/* cpuid serializes, so nothing stale from the old bytes gets executed */
+	__asm__ volatile("cpuid" : "+a" (a), "=b" (b), "+c" (c), "=d" (d) :: "memory");
+}
@@ -437,5 +437,45 @@ static inline uint32_t check_smap_avail(void)
 	return ((reg_b>>0x13) & 0x1);
 }
 
+/* raw cpuid, leaf in eax and subleaf 0 */
+static inline void x86_cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+		:"a" (leaf), "c" (0x0));
+}
+
+static inline uint64_t x86_rdtsc(void)
+{
+	uint32_t low, high;
+	rdtsc(low, high);
+	return ((uint64_t)high << 32) | low;
+}
+
+/* cpuid leaf 7 feature bits, the string routines pick their copy loops from these */
+static inline void x86_cpuid_leaf7(uint32_t *ebx, uint32_t *edx)
+{
+	uint32_t a, c;
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (a), "=b" (*ebx), "=c" (c), "=d" (*edx)
+		:"a" (0x07), "c" (0x0));
+}
+
+static inline uint32_t check_erms_avail(void)
+{
+	uint32_t reg_b, reg_d;
+	x86_cpuid_leaf7(&reg_b, &reg_d);
+	return ((reg_b>>0x09) & 0x1);
+}
+
+static inline uint32_t check_fsrm_avail(void)
+{
+	uint32_t reg_b, reg_d;
+	x86_cpuid_leaf7(&reg_b, &reg_d);
+	return ((reg_d>>0x04) & 0x1);
+}
+
 __END_CDECLS
 #endif
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/pmu.h>
+
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <arch/x86.h>
+#include <kernel/pmu.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Intel architectural performance monitoring, cpuid leaf 0xa. Cores without
+ * it, amd included, and most hypervisors report no counters.
+ */
+#define X86_CPUID_PERFMON       0xa
+
+#define X86_MSR_PMC0            0xc1
+#define X86_MSR_PERFEVTSEL0     0x186
+#define X86_MSR_PERF_GLOBAL_CTRL 0x38f
+
+#define PERFEVTSEL_USR          (1 << 16)
+#define PERFEVTSEL_OS           (1 << 17)
+#define PERFEVTSEL_EN           (1 << 22)
+
+/* there's no architectural instruction cache miss event, and the model
+ * specific ones moved around between generations */
+#define X86_PMU_NOT_ARCH 0xff
+
+/* event select and umask, and the leaf 0xa ebx bit that says the event is missing */
+static const struct {
+	uint16_t sel;
+	uint8_t unavail_bit;
+} x86_pmu_events[PMU_EVENT_COUNT] = {
+	[PMU_EVENT_CYCLES]        = { 0x003c, 0 },
+	[PMU_EVENT_INSTRUCTIONS]  = { 0x00c0, 1 },
+	[PMU_EVENT_CACHE_MISSES]  = { 0x412e, 4 }, /* last level cache misses */
+	[PMU_EVENT_BRANCH_MISSES] = { 0x00c5, 6 },
+	[PMU_EVENT_ICACHE_MISSES] = { 0, X86_PMU_NOT_ARCH },
+};
+
+static bool x86_pmu_probed;
+static uint x86_pmu_version;
+static uint x86_pmu_counters;
+static uint x86_pmu_width;
+static uint32_t x86_pmu_unavail;
+
+static void x86_pmu_probe(void)
+{
+	uint32_t a, b, c, d;
+
+	if (x86_pmu_probed)
+		return;
+	x86_pmu_probed = true;
+
+	x86_cpuid(0, &a, &b, &c, &d);
+	if (a < X86_CPUID_PERFMON)
+		return;
+
+	x86_cpuid(X86_CPUID_PERFMON, &a, &b, &c, &d);
+	x86_pmu_version = a & 0xff;
+	if (x86_pmu_version == 0)
+		return;
+
+	x86_pmu_counters = (a >> 8) & 0xff;
+	x86_pmu_width = (a >> 16) & 0xff;
+	x86_pmu_unavail = b;
+
+	LTRACEF("version %u, %u counters, %u bits wide, unavailable events 0x%x\n",
+	        x86_pmu_version, x86_pmu_counters, x86_pmu_width, x86_pmu_unavail);
+}
+
+uint arch_pmu_counter_count(void)
+{
+	x86_pmu_probe();
+
+	return x86_pmu_counters;
+}
+
+uint64_t arch_pmu_counter_mask(void)
+{
+	x86_pmu_probe();
+
+	if (x86_pmu_width == 0 || x86_pmu_width >= 64)
+		return ~0ULL;
+	return (1ULL << x86_pmu_width) - 1;
+}
+
+bool arch_pmu_event_supported(uint event)
+{
+	x86_pmu_probe();
+
+	if (event >= PMU_EVENT_COUNT || x86_pmu_counters == 0)
+		return false;
+	if (x86_pmu_events[event].unavail_bit == X86_PMU_NOT_ARCH)
+		return false;
+	return !(x86_pmu_unavail & (1U << x86_pmu_events[event].unavail_bit));
+}
+
+status_t arch_pmu_program(uint n, uint event)
+{
+	x86_pmu_probe();
+
+	if (n >= x86_pmu_counters || event >= PMU_EVENT_COUNT)
+		return ERR_INVALID_ARGS;
+	if (!arch_pmu_event_supported(event))
+		return ERR_NOT_SUPPORTED;
+
+	write_msr(X86_MSR_PERFEVTSEL0 + n, 0);
+	write_msr(X86_MSR_PMC0 + n, 0);
+	write_msr(X86_MSR_PERFEVTSEL0 + n, x86_pmu_events[event].sel | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+
+	/* version 2 and up also gate every counter through the global control */
+	if (x86_pmu_version >= 2)
+		write_msr(X86_MSR_PERF_GLOBAL_CTRL, read_msr(X86_MSR_PERF_GLOBAL_CTRL) | (1ULL << n));
+
+	return NO_ERROR;
+}
+
+void arch_pmu_disable(void)
+{
+	x86_pmu_probe();
+
+	for (uint i = 0; i < x86_pmu_counters; i++)
+		write_msr(X86_MSR_PERFEVTSEL0 + i, 0);
+	if (x86_pmu_version >= 2)
+		write_msr(X86_MSR_PERF_GLOBAL_CTRL, read_msr(X86_MSR_PERF_GLOBAL_CTRL) & ~((1ULL << x86_pmu_counters) - 1));
+}
+
+uint64_t arch_pmu_read(uint n)
+{
+	return read_msr(X86_MSR_PMC0 + n);
+}
+
+// vim: set noexpandtab:
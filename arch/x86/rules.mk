@@ -11,6 +11,7 @@ GLOBAL_DEFINES += \
 	MEMBASE=0x00200000U \
 	KERNEL_ASPACE_BASE=0x00200000U \
 	KERNEL_ASPACE_SIZE=0x7fe00000U \
+	ARCH_HAS_STATIC_KEYS=1 \
 	SMP_MAX_CPUS=1
 
 KERNEL_BASE ?= 0x00200000
@@ -28,6 +29,11 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/faults.c \
 	$(LOCAL_DIR)/descriptor.c
 
+# performance counters behind kernel/pmu.h
+ifeq ($(WITH_KERNEL_PMU),1)
+MODULE_SRCS += $(LOCAL_DIR)/pmu.c
+endif
+
 # set the default toolchain to x86 elf and set a #define
 ifndef TOOLCHAIN_PREFIX
 TOOLCHAIN_PREFIX := i386-elf-
@@ -51,8 +51,8 @@ static void initial_thread_func(void)
 {
 	int ret;
 
-	/* release the thread lock that was implicitly held across the reschedule */
-	spin_unlock(&thread_lock);
+	/* finish the switch that got us here */
+	thread_switch_finish();
 	arch_enable_ints();
 
 	ret = _current_thread->entry(_current_thread->arg);
@@ -21,9 +21,24 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <debug.h>
 #include <err.h>
 #include <dev/class/i2c.h>
 
+/* run a list of transactions through a driver that only queues them */
+static status_t i2c_submit_wait(struct device *dev, struct i2c_ops *ops,
+                                struct i2c_transaction *txn, size_t count)
+{
+	struct i2c_request req;
+
+	class_i2c_request_init(&req, txn, count, NULL, NULL);
+	status_t err = ops->submit(dev, &req);
+	if (err < 0)
+		return err;
+
+	return class_i2c_wait(&req);
+}
+
 status_t class_i2c_write(struct device *dev, uint8_t addr, const void *buf, size_t len)
 {
 	struct i2c_ops *ops = device_get_driver_ops(dev, struct i2c_ops, std);
@@ -32,8 +47,13 @@ status_t class_i2c_write(struct device *dev, uint8_t addr, const void *buf, size
 	
 	if (ops->write)
 		return ops->write(dev, addr, buf, len);
-	else
-		return ERR_NOT_SUPPORTED;
+
+	if (ops->submit) {
+		struct i2c_transaction txn = { addr, 0, (void *)buf, len };
+		return i2c_submit_wait(dev, ops, &txn, 1);
+	}
+
+	return ERR_NOT_SUPPORTED;
 }
 
 status_t class_i2c_read(struct device *dev, uint8_t addr, void *buf, size_t len)
@@ -44,8 +64,13 @@ status_t class_i2c_read(struct device *dev, uint8_t addr, void *buf, size_t len)
 	
 	if (ops->read)
 		return ops->read(dev, addr, buf, len);
-	else
-		return ERR_NOT_SUPPORTED;
+
+	if (ops->submit) {
+		struct i2c_transaction txn = { addr, I2C_READ, buf, len };
+		return i2c_submit_wait(dev, ops, &txn, 1);
+	}
+
+	return ERR_NOT_SUPPORTED;
 }
 
 status_t class_i2c_write_reg(struct device *dev, uint8_t addr, uint8_t reg, uint8_t value)
@@ -56,8 +81,14 @@ status_t class_i2c_write_reg(struct device *dev, uint8_t addr, uint8_t reg, uint
 	
 	if (ops->write_reg)
 		return ops->write_reg(dev, addr, reg, value);
-	else
-		return ERR_NOT_SUPPORTED;
+
+	if (ops->submit) {
+		uint8_t data[2] = { reg, value };
+		struct i2c_transaction txn = { addr, 0, data, sizeof(data) };
+		return i2c_submit_wait(dev, ops, &txn, 1);
+	}
+
+	return ERR_NOT_SUPPORTED;
 }
 
 status_t class_i2c_read_reg(struct device *dev, uint8_t addr, uint8_t reg, void *value)
@@ -68,7 +99,74 @@ status_t class_i2c_read_reg(struct device *dev, uint8_t addr, uint8_t reg, void
 	
 	if (ops->read_reg)
 		return ops->read_reg(dev, addr, reg, value);
-	else
+
+	if (ops->submit) {
+		struct i2c_transaction txn[2] = {
+			{ addr, 0, &reg, 1 },
+			{ addr, I2C_READ, value, 1 },
+		};
+		return i2c_submit_wait(dev, ops, txn, 2);
+	}
+
+	return ERR_NOT_SUPPORTED;
+}
+
+void class_i2c_request_init(struct i2c_request *req, struct i2c_transaction *txn, size_t count,
+                            i2c_callback_t callback, void *arg)
+{
+	req->txn = txn;
+	req->count = count;
+	req->callback = callback;
+	req->arg = arg;
+	req->result = NO_ERROR;
+	list_clear_node(&req->node);
+	event_init(&req->event, false, 0);
+}
+
+status_t class_i2c_submit(struct device *dev, struct i2c_request *req)
+{
+	struct i2c_ops *ops = device_get_driver_ops(dev, struct i2c_ops, std);
+	if (!ops)
+		return ERR_NOT_CONFIGURED;
+
+	if (ops->submit)
+		return ops->submit(dev, req);
+
+	if (!ops->read || !ops->write)
 		return ERR_NOT_SUPPORTED;
+
+	/* no queue in the driver, run it here. each transaction gets its own
+	 * start and stop since the synchronous ops can't chain them.
+	 */
+	status_t err = NO_ERROR;
+	for (size_t i = 0; i < req->count && err >= 0; i++) {
+		struct i2c_transaction *txn = &req->txn[i];
+
+		if (txn->flags & I2C_READ)
+			err = ops->read(dev, txn->addr, txn->buf, txn->len);
+		else
+			err = ops->write(dev, txn->addr, txn->buf, txn->len);
+	}
+
+	class_i2c_request_complete(req, err);
+	return NO_ERROR;
+}
+
+status_t class_i2c_wait(struct i2c_request *req)
+{
+	DEBUG_ASSERT(!req->callback);
+
+	event_wait(&req->event);
+
+	return req->result;
 }
 
+void class_i2c_request_complete(struct i2c_request *req, status_t result)
+{
+	req->result = result;
+
+	if (req->callback)
+		req->callback(req);
+	else
+		event_signal(&req->event, false);
+}
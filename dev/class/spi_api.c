@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <debug.h>
 #include <err.h>
 #include <dev/class/spi.h>
 
@@ -32,7 +33,68 @@ ssize_t class_spi_transaction(struct device *dev, struct spi_transaction *txn, s
 	
 	if (ops->transaction)
 		return ops->transaction(dev, txn, count);
+
+	if (ops->submit) {
+		struct spi_request req;
+
+		class_spi_request_init(&req, txn, count, NULL, NULL);
+		status_t err = ops->submit(dev, &req);
+		if (err < 0)
+			return err;
+
+		return class_spi_wait(&req);
+	}
+
+	return ERR_NOT_SUPPORTED;
+}
+
+void class_spi_request_init(struct spi_request *req, struct spi_transaction *txn, size_t count,
+                            spi_callback_t callback, void *arg)
+{
+	req->txn = txn;
+	req->count = count;
+	req->callback = callback;
+	req->arg = arg;
+	req->result = 0;
+	list_clear_node(&req->node);
+	event_init(&req->event, false, 0);
+}
+
+status_t class_spi_submit(struct device *dev, struct spi_request *req)
+{
+	struct spi_ops *ops = device_get_driver_ops(dev, struct spi_ops, std);
+	if (!ops)
+		return ERR_NOT_CONFIGURED;
+
+	if (ops->submit)
+		return ops->submit(dev, req);
+
+	/* no queue in the driver, run it here */
+	if (ops->transaction) {
+		class_spi_request_complete(req, ops->transaction(dev, req->txn, req->count));
+		return NO_ERROR;
+	}
+
+	return ERR_NOT_SUPPORTED;
+}
+
+ssize_t class_spi_wait(struct spi_request *req)
+{
+	DEBUG_ASSERT(!req->callback);
+
+	event_wait(&req->event);
+
+	return req->result;
+}
+
+void class_spi_request_complete(struct spi_request *req, ssize_t result)
+{
+	req->result = result;
+
+	/* the request belongs to the submitter again once it's signaled */
+	if (req->callback)
+		req->callback(req);
 	else
-		return ERR_NOT_SUPPORTED;
+		event_signal(&req->event, false);
 }
 
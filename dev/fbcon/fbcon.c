@@ -29,6 +29,7 @@
 #include <debug.h>
 #include <err.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <dev/fbcon.h>
 
@@ -53,6 +54,10 @@ static uint16_t         FGCOLOR;
 static struct pos       cur_pos;
 static struct pos       max_pos;
 
+/* lines to scroll at a time once the bottom is reached, so a burst of
+ * output moves the framebuffer once every few lines instead of every line */
+static unsigned         scroll_lines;
+
 static void fbcon_drawglyph(uint16_t *pixels, uint16_t paint, unsigned stride,
                             unsigned *glyph)
 {
@@ -90,36 +95,38 @@ static void fbcon_flush(void)
 		while (!config->update_done());
 }
 
-/* TODO: Take stride into account */
-static void fbcon_scroll_up(void)
+static void fbcon_fill_rows(unsigned y, unsigned count)
 {
-	unsigned short *dst = config->base;
-	unsigned short *src = dst + (config->width * FONT_HEIGHT);
-	unsigned count = config->width * (config->height - FONT_HEIGHT);
+	uint16_t *dst = (uint16_t *)config->base + y * config->stride;
 
-	while (count--) {
-		*dst++ = *src++;
+	for (unsigned i = 0; i < count; i++) {
+		for (unsigned x = 0; x < config->width; x++)
+			dst[x] = BGCOLOR;
+		dst += config->stride;
 	}
+}
 
-	count = config->width * FONT_HEIGHT;
-	while (count--) {
-		*dst++ = BGCOLOR;
-	}
+static void fbcon_scroll_up(unsigned lines)
+{
+	unsigned rows = lines * FONT_HEIGHT;
+	size_t pitch = config->stride * sizeof(uint16_t);
+
+	if (rows > config->height)
+		rows = config->height;
+
+	/* one move for the whole block, the rows are contiguous */
+	memmove(config->base, (uint8_t *)config->base + rows * pitch, (config->height - rows) * pitch);
+	fbcon_fill_rows(config->height - rows, rows);
 
 	fbcon_flush();
 }
 
-/* TODO: take stride into account */
 static void fbcon_clear(void)
 {
-	uint16_t *dst = config->base;
-	unsigned count = config->width * config->height;
-
 	cur_pos.x = 0;
 	cur_pos.y = 0;
 
-	while (count--)
-		*dst++ = BGCOLOR;
+	fbcon_fill_rows(0, config->height);
 }
 
 
@@ -148,7 +155,7 @@ void fbcon_putc(char c)
 	}
 
 	pixels = config->base;
-	pixels += cur_pos.y * FONT_HEIGHT * config->width;
+	pixels += cur_pos.y * FONT_HEIGHT * config->stride;
 	pixels += cur_pos.x * (FONT_WIDTH + 1);
 	fbcon_drawglyph(pixels, FGCOLOR, config->stride,
 	                font5x12 + (c - 32) * 2);
@@ -161,8 +168,8 @@ newline:
 	cur_pos.y++;
 	cur_pos.x = 0;
 	if (cur_pos.y >= max_pos.y) {
-		cur_pos.y = max_pos.y - 1;
-		fbcon_scroll_up();
+		cur_pos.y = max_pos.y - scroll_lines;
+		fbcon_scroll_up(scroll_lines);
 	} else
 		fbcon_flush();
 }
@@ -197,4 +204,5 @@ void fbcon_setup(struct fbcon_config *_config)
 	cur_pos.y = 0;
 	max_pos.x = config->width / (FONT_WIDTH+1);
 	max_pos.y = (config->height - 1) / FONT_HEIGHT;
+	scroll_lines = MAX(1u, (unsigned)max_pos.y / 4);
 }
@@ -29,6 +29,9 @@
 #include <reg.h>
 #include <kernel/thread.h>
 #include <kernel/debug.h>
+#include <kernel/irqstats.h>
+#include <kernel/mp.h>
+#include <lib/profile.h>
 #include <lk/init.h>
 #include <platform/interrupts.h>
 #include <arch/ops.h>
@@ -62,6 +65,11 @@ static spin_lock_t gicd_lock;
 #endif
 #define GIC_MAX_PER_CPU_INT 32
 
+/* interrupts taken per exception before returning to the interrupted code */
+#ifndef GIC_IRQ_BUDGET
+#define GIC_IRQ_BUDGET 8
+#endif
+
 #if WITH_LIB_SM
 static bool arm_gic_non_secure_interrupts_frozen;
 
@@ -304,6 +312,28 @@ static status_t arm_gic_set_target_locked(u_int irq, u_int cpu_mask, u_int enabl
 	return NO_ERROR;
 }
 
+status_t set_interrupt_affinity(unsigned int vector, uint cpu_mask)
+{
+	spin_lock_saved_state_t state;
+
+	if (vector < GIC_MAX_PER_CPU_INT || vector >= MAX_INT)
+		return ERR_INVALID_ARGS;
+
+	/* ITARGETSR only has room for 8 cpus */
+	if ((cpu_mask & 0xff) == 0)
+		return ERR_INVALID_ARGS;
+
+	/* keep it off isolated cpus unless it's only meant for them */
+	cpu_mask = mp_housekeeping_mask(cpu_mask & 0xff);
+
+	spin_lock_save(&gicd_lock, &state, GICD_LOCK_FLAGS);
+	if (arm_gic_interrupt_change_allowed(vector))
+		arm_gic_set_target_locked(vector, 0xff, cpu_mask);
+	spin_unlock_restore(&gicd_lock, state, GICD_LOCK_FLAGS);
+
+	return NO_ERROR;
+}
+
 static status_t arm_gic_get_priority(u_int irq)
 {
 	u_int reg = irq / 4;
@@ -369,38 +399,45 @@ status_t unmask_interrupt(unsigned int vector)
 }
 
 static
-enum handler_return __platform_irq(struct iframe *frame)
+enum handler_return __HOT_TEXT __platform_irq(struct iframe *frame)
 {
-	// get the current vector
-	uint32_t iar = GICREG(0, GICC_IAR);
-	unsigned int vector = iar & 0x3ff;
+	enum handler_return ret = INT_NO_RESCHEDULE;
+	uint cpu = arch_curr_cpu_num();
 
-	if (vector >= 0x3fe) {
-		// spurious
-		return INT_NO_RESCHEDULE;
-	}
+	/* take whatever else is pending before paying for another exception */
+	for (uint i = 0; i < GIC_IRQ_BUDGET; i++) {
+		// get the current vector
+		uint32_t iar = GICREG(0, GICC_IAR);
+		unsigned int vector = iar & 0x3ff;
 
-	THREAD_STATS_INC(interrupts);
-	KEVLOG_IRQ_ENTER(vector);
+		if (vector >= 0x3fe) {
+			// spurious, nothing left
+			break;
+		}
 
-	uint cpu = arch_curr_cpu_num();
+		THREAD_STATS_IRQ_ENTER();
+		KEVLOG_IRQ_ENTER(vector);
 
-	LTRACEF_LEVEL(2, "iar 0x%x cpu %u currthread %p vector %d pc 0x%lx\n", iar, cpu,
-	       get_current_thread(), vector, (uintptr_t)IFRAME_PC(frame));
+		LTRACEF_LEVEL(2, "iar 0x%x cpu %u currthread %p vector %d pc 0x%lx\n", iar, cpu,
+		       get_current_thread(), vector, (uintptr_t)IFRAME_PC(frame));
 
-	// deliver the interrupt
-	enum handler_return ret;
+		// deliver the interrupt
+		IRQSTATS_BEGIN(start);
+		struct int_handler_struct *handler = get_int_handler(vector, cpu);
+		if (handler->handler && handler->handler(handler->arg) == INT_RESCHEDULE)
+			ret = INT_RESCHEDULE;
+		IRQSTATS_END(vector, start);
 
-	ret = INT_NO_RESCHEDULE;
-	struct int_handler_struct *handler = get_int_handler(vector, cpu);
-	if (handler->handler)
-		ret = handler->handler(handler->arg);
+		GICREG(0, GICC_EOIR) = iar;
 
-	GICREG(0, GICC_EOIR) = iar;
+		LTRACEF_LEVEL(2, "cpu %u exit %d\n", cpu, ret);
 
-	LTRACEF_LEVEL(2, "cpu %u exit %d\n", cpu, ret);
+		KEVLOG_IRQ_EXIT(vector);
+		THREAD_STATS_IRQ_EXIT();
+	}
 
-	KEVLOG_IRQ_EXIT(vector);
+	/* the interrupted frame pointer isn't in the iframe, samples are pc only */
+	profile_irq_exit(IFRAME_PC(frame), 0);
 
 	return ret;
 }
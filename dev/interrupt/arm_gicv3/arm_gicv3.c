@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <err.h>
+#include <sys/types.h>
+#include <debug.h>
+#include <dev/interrupt/arm_gicv3.h>
+#include <reg.h>
+#include <kernel/thread.h>
+#include <kernel/debug.h>
+#include <kernel/irqstats.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <lib/profile.h>
+#include <lk/init.h>
+#include <platform/interrupts.h>
+#include <arch/ops.h>
+#include <arch/arm64.h>
+#include <platform/gic.h>
+#include <trace.h>
+
+#define LOCAL_TRACE 0
+
+#define GIC_MAX_PER_CPU_INT 32
+#define GIC_PRIORITY_DEFAULT 0xa0
+
+/* interrupts taken per exception before returning to the interrupted code */
+#ifndef GIC_IRQ_BUDGET
+#define GIC_IRQ_BUDGET 8
+#endif
+
+#define GICREG(gic, reg) (*REG32(GICBASE(gic) + (reg)))
+#define GICREG64(gic, reg) (*REG64(GICBASE(gic) + (reg)))
+
+/* distributor, the per cpu interrupts live in the redistributors once ARE is set */
+#define GICD_CTLR               (GICD_OFFSET + 0x0000)
+#define GICD_TYPER              (GICD_OFFSET + 0x0004)
+#define GICD_IGROUPR(n)         (GICD_OFFSET + 0x0080 + (n) * 4)
+#define GICD_ISENABLER(n)       (GICD_OFFSET + 0x0100 + (n) * 4)
+#define GICD_ICENABLER(n)       (GICD_OFFSET + 0x0180 + (n) * 4)
+#define GICD_ICPENDR(n)         (GICD_OFFSET + 0x0280 + (n) * 4)
+#define GICD_ICACTIVER(n)       (GICD_OFFSET + 0x0380 + (n) * 4)
+#define GICD_IPRIORITYR(n)      (GICD_OFFSET + 0x0400 + (n) * 4)
+#define GICD_IROUTER(n)         (GICD_OFFSET + 0x6000 + (n) * 8)
+
+#define GICD_IROUTER_IRM        (1ULL << 31)
+
+#define GICD_CTLR_ENABLE_G1NS   (1U << 1)
+#define GICD_CTLR_ARE_NS        (1U << 4)
+#define GICD_CTLR_RWP           (1U << 31)
+
+/* redistributor, offsets from the base of one cpu's frames */
+#define GICR_CTLR               (0x0000)
+#define GICR_WAKER              (0x0014)
+#define GICR_TYPER              (0x0008)
+#define GICR_SGI_BASE           (0x10000)
+#define GICR_IGROUPR0           (GICR_SGI_BASE + 0x0080)
+#define GICR_ISENABLER0         (GICR_SGI_BASE + 0x0100)
+#define GICR_ICENABLER0         (GICR_SGI_BASE + 0x0180)
+#define GICR_ICPENDR0           (GICR_SGI_BASE + 0x0280)
+#define GICR_ICACTIVER0         (GICR_SGI_BASE + 0x0380)
+#define GICR_IPRIORITYR(n)      (GICR_SGI_BASE + 0x0400 + (n) * 4)
+
+#define GICR_CTLR_RWP           (1U << 3)
+#define GICR_WAKER_PROCESSOR_SLEEP (1U << 1)
+#define GICR_WAKER_CHILDREN_ASLEEP (1U << 2)
+#define GICR_TYPER_VLPIS        (1ULL << 1)
+#define GICR_TYPER_LAST         (1ULL << 4)
+
+#define GICR_FRAME_SIZE         (0x20000)   /* RD_base + SGI_base */
+#define GICR_FRAME_SIZE_VLPI    (0x40000)   /* plus VLPI_base and a reserved frame */
+
+/* cpu interface system registers */
+#define ICC_PMR_EL1             S3_0_C4_C6_0
+#define ICC_IAR1_EL1            S3_0_C12_C12_0
+#define ICC_EOIR1_EL1           S3_0_C12_C12_1
+#define ICC_BPR1_EL1            S3_0_C12_C12_3
+#define ICC_CTLR_EL1            S3_0_C12_C12_4
+#define ICC_SRE_EL1             S3_0_C12_C12_5
+#define ICC_IGRPEN1_EL1         S3_0_C12_C12_7
+#define ICC_SGI1R_EL1           S3_0_C12_C11_5
+
+#define ICC_SRE_EL1_SRE         (1U << 0)
+#define ICC_SRE_EL1_DFB         (1U << 1)
+#define ICC_SRE_EL1_DIB         (1U << 2)
+#define ICC_CTLR_EL1_EOIMODE    (1U << 1)
+
+#define MPIDR_AFFINITY_MASK     (0xff00ffffffULL)
+
+static spin_lock_t gicd_lock;
+
+/* redistributor of each cpu, found by arm_gicv3_init_percpu */
+static vaddr_t gicr_base[SMP_MAX_CPUS];
+
+struct int_handler_struct {
+	int_handler handler;
+	void *arg;
+};
+
+static struct int_handler_struct int_handler_table_per_cpu[GIC_MAX_PER_CPU_INT][SMP_MAX_CPUS];
+static struct int_handler_struct int_handler_table_shared[MAX_INT-GIC_MAX_PER_CPU_INT];
+
+static struct int_handler_struct *get_int_handler(unsigned int vector, uint cpu)
+{
+	if (vector < GIC_MAX_PER_CPU_INT)
+		return &int_handler_table_per_cpu[vector][cpu];
+	else
+		return &int_handler_table_shared[vector - GIC_MAX_PER_CPU_INT];
+}
+
+void register_int_handler(unsigned int vector, int_handler handler, void *arg)
+{
+	struct int_handler_struct *h;
+	uint cpu = arch_curr_cpu_num();
+
+	spin_lock_saved_state_t state;
+
+	if (vector >= MAX_INT)
+		panic("register_int_handler: vector out of range %d\n", vector);
+
+	spin_lock_irqsave(&gicd_lock, state);
+
+	h = get_int_handler(vector, cpu);
+	h->handler = handler;
+	h->arg = arg;
+
+	spin_unlock_irqrestore(&gicd_lock, state);
+}
+
+#define GICR_REG(cpu, reg) (*REG32(gicr_base[cpu] + (reg)))
+
+static void gicd_wait_rwp(void)
+{
+	while (GICREG(0, GICD_CTLR) & GICD_CTLR_RWP)
+		;
+}
+
+static void gicr_wait_rwp(uint cpu)
+{
+	while (GICR_REG(cpu, GICR_CTLR) & GICR_CTLR_RWP)
+		;
+}
+
+static void gic_set_enable(uint vector, bool enable)
+{
+	uint32_t mask = 1U << (vector % 32);
+
+	if (vector < GIC_MAX_PER_CPU_INT) {
+		/* private interrupts are banked in this cpu's redistributor */
+		uint cpu = arch_curr_cpu_num();
+
+		if (enable) {
+			GICR_REG(cpu, GICR_ISENABLER0) = mask;
+		} else {
+			GICR_REG(cpu, GICR_ICENABLER0) = mask;
+			gicr_wait_rwp(cpu);
+		}
+	} else {
+		if (enable) {
+			GICREG(0, GICD_ISENABLER(vector / 32)) = mask;
+		} else {
+			GICREG(0, GICD_ICENABLER(vector / 32)) = mask;
+			gicd_wait_rwp();
+		}
+	}
+}
+
+status_t mask_interrupt(unsigned int vector)
+{
+	if (vector >= MAX_INT)
+		return ERR_INVALID_ARGS;
+
+	gic_set_enable(vector, false);
+
+	return NO_ERROR;
+}
+
+status_t unmask_interrupt(unsigned int vector)
+{
+	if (vector >= MAX_INT)
+		return ERR_INVALID_ARGS;
+
+	gic_set_enable(vector, true);
+
+	return NO_ERROR;
+}
+
+static uint64_t mpidr_affinity(void)
+{
+	return ARM64_READ_SYSREG(mpidr_el1) & MPIDR_AFFINITY_MASK;
+}
+
+/* the inverse of arch_curr_cpu_num, in MPIDR/GICD_IROUTER layout */
+static uint64_t cpu_affinity(uint cpu)
+{
+	uint cluster = cpu >> SMP_CPU_CLUSTER_SHIFT;
+
+	return (cpu & ((1U << SMP_CPU_CLUSTER_SHIFT) - 1)) |
+	       ((uint64_t)(cluster & 0xffff) << 8);
+}
+
+status_t set_interrupt_affinity(unsigned int vector, uint cpu_mask)
+{
+	spin_lock_saved_state_t state;
+	uint64_t route;
+
+	if (vector < GIC_MAX_PER_CPU_INT || vector >= MAX_INT)
+		return ERR_INVALID_ARGS;
+
+	cpu_mask &= MP_CPU_MASK_ALL;
+	if (cpu_mask == 0)
+		return ERR_INVALID_ARGS;
+
+	/* keep it off isolated cpus unless it's only meant for them */
+	cpu_mask = mp_housekeeping_mask(cpu_mask);
+
+	/* routing is to one cpu or to any of them, nothing in between */
+	if (cpu_mask == MP_CPU_MASK_ALL)
+		route = GICD_IROUTER_IRM;
+	else
+		route = cpu_affinity(__builtin_ctz(cpu_mask));
+
+	LTRACEF("vector %u, cpu_mask 0x%x, route 0x%llx\n", vector, cpu_mask, (unsigned long long)route);
+
+	spin_lock_irqsave(&gicd_lock, state);
+	GICREG64(0, GICD_IROUTER(vector)) = route;
+	spin_unlock_irqrestore(&gicd_lock, state);
+
+	return NO_ERROR;
+}
+
+static vaddr_t gicr_find(uint64_t affinity)
+{
+	/* GICR_TYPER holds aff3.aff2.aff1.aff0 in its top word */
+	uint32_t want = ((affinity >> 8) & 0xff000000) | (affinity & 0xffffff);
+	vaddr_t rd = GICBASE(0) + GICR_OFFSET;
+
+	for (;;) {
+		uint64_t typer = *REG64(rd + GICR_TYPER);
+
+		if ((typer >> 32) == want)
+			return rd;
+		if (typer & GICR_TYPER_LAST)
+			return 0;
+		rd += (typer & GICR_TYPER_VLPIS) ? GICR_FRAME_SIZE_VLPI : GICR_FRAME_SIZE;
+	}
+}
+
+static void arm_gicv3_init_percpu(uint level)
+{
+	uint cpu = arch_curr_cpu_num();
+	uint64_t affinity = mpidr_affinity();
+
+	DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+	vaddr_t rd = gicr_find(affinity);
+	if (!rd)
+		panic("gicv3: no redistributor for cpu %u, mpidr 0x%llx\n", cpu, (unsigned long long)affinity);
+	gicr_base[cpu] = rd;
+
+	LTRACEF("cpu %u, redistributor 0x%lx\n", cpu, rd);
+
+	/* wake the redistributor up */
+	GICR_REG(cpu, GICR_WAKER) &= ~GICR_WAKER_PROCESSOR_SLEEP;
+	while (GICR_REG(cpu, GICR_WAKER) & GICR_WAKER_CHILDREN_ASLEEP)
+		;
+
+	/* sgis and ppis, all group 1 ns and disabled until someone unmasks them */
+	GICR_REG(cpu, GICR_ICENABLER0) = ~0U;
+	gicr_wait_rwp(cpu);
+	GICR_REG(cpu, GICR_ICPENDR0) = ~0U;
+	GICR_REG(cpu, GICR_ICACTIVER0) = ~0U;
+	GICR_REG(cpu, GICR_IGROUPR0) = ~0U;
+	for (uint i = 0; i < GIC_MAX_PER_CPU_INT / 4; i++)
+		GICR_REG(cpu, GICR_IPRIORITYR(i)) = GIC_PRIORITY_DEFAULT * 0x01010101U;
+
+	/* switch this cpu to the system register interface, the mmio GICC is never touched */
+	ARM64_WRITE_SYSREG(ICC_SRE_EL1, ICC_SRE_EL1_SRE | ICC_SRE_EL1_DFB | ICC_SRE_EL1_DIB);
+
+	ARM64_WRITE_SYSREG(ICC_PMR_EL1, 0xff); /* unmask interrupts at all priority levels */
+	ARM64_WRITE_SYSREG(ICC_BPR1_EL1, 0);
+	/* EOI both drops priority and deactivates */
+	ARM64_WRITE_SYSREG(ICC_CTLR_EL1, ARM64_READ_SYSREG(ICC_CTLR_EL1) & ~ICC_CTLR_EL1_EOIMODE);
+	ARM64_WRITE_SYSREG(ICC_IGRPEN1_EL1, 1);
+}
+
+LK_INIT_HOOK_FLAGS(arm_gicv3_init_percpu,
+                   arm_gicv3_init_percpu,
+                   LK_INIT_LEVEL_PLATFORM_EARLY, LK_INIT_FLAG_SECONDARY_CPUS);
+
+static void arm_gicv3_init_dist(void)
+{
+	int i;
+
+	GICREG(0, GICD_CTLR) = 0;
+	gicd_wait_rwp();
+
+	for (i = GIC_MAX_PER_CPU_INT; i < MAX_INT; i += 32) {
+		GICREG(0, GICD_ICENABLER(i / 32)) = ~0U;
+		GICREG(0, GICD_ICPENDR(i / 32)) = ~0U;
+		GICREG(0, GICD_ICACTIVER(i / 32)) = ~0U;
+		GICREG(0, GICD_IGROUPR(i / 32)) = ~0U;
+	}
+	gicd_wait_rwp();
+
+	for (i = GIC_MAX_PER_CPU_INT; i < MAX_INT; i += 4)
+		GICREG(0, GICD_IPRIORITYR(i / 4)) = GIC_PRIORITY_DEFAULT * 0x01010101U;
+
+	/* affinity routing on, spis go to the boot cpu the way they did on gicv2 */
+	GICREG(0, GICD_CTLR) = GICD_CTLR_ARE_NS;
+	gicd_wait_rwp();
+
+	uint64_t affinity = mpidr_affinity();
+	for (i = GIC_MAX_PER_CPU_INT; i < MAX_INT; i++)
+		GICREG64(0, GICD_IROUTER(i)) = affinity;
+
+	GICREG(0, GICD_CTLR) = GICD_CTLR_ARE_NS | GICD_CTLR_ENABLE_G1NS;
+	gicd_wait_rwp();
+}
+
+void arm_gicv3_init(void)
+{
+	LTRACEF("typer 0x%x\n", GICREG(0, GICD_TYPER));
+
+	arm_gicv3_init_dist();
+	arm_gicv3_init_percpu(0);
+}
+
+status_t arm_gicv3_sgi(u_int irq, mp_cpu_mask_t cpu_mask)
+{
+	if (irq >= 16)
+		return ERR_INVALID_ARGS;
+
+	const uint cluster_mask = (1U << SMP_CPU_CLUSTER_SHIFT) - 1;
+
+	DSB;
+	while (cpu_mask) {
+		uint cpu = __builtin_ctz(cpu_mask);
+		uint cluster = cpu >> SMP_CPU_CLUSTER_SHIFT;
+		uint16_t targets = 0;
+
+		for (uint i = cpu; i < 32 && (i >> SMP_CPU_CLUSTER_SHIFT) == cluster; i++) {
+			if (cpu_mask & (1U << i)) {
+				/* the target list only covers aff0 0-15 of one cluster */
+				DEBUG_ASSERT((i & cluster_mask) < 16);
+				targets |= 1U << (i & cluster_mask);
+				cpu_mask &= ~(1U << i);
+			}
+		}
+
+		uint64_t val = targets |
+			((uint64_t)(cluster & 0xff) << 16) |      /* aff1 */
+			((uint64_t)irq << 24) |
+			((uint64_t)((cluster >> 8) & 0xff) << 32); /* aff2 */
+
+		LTRACEF("cpu_mask 0x%x, sgi1r 0x%llx\n", cpu_mask, (unsigned long long)val);
+		ARM64_WRITE_SYSREG(ICC_SGI1R_EL1, val);
+	}
+
+	return NO_ERROR;
+}
+
+static
+enum handler_return __HOT_TEXT __platform_irq(struct arm64_iframe_short *frame)
+{
+	enum handler_return ret = INT_NO_RESCHEDULE;
+	uint cpu = arch_curr_cpu_num();
+
+	/* take whatever else is pending before paying for another exception */
+	for (uint i = 0; i < GIC_IRQ_BUDGET; i++) {
+		// get the current vector
+		uint32_t iar = ARM64_READ_SYSREG(ICC_IAR1_EL1);
+		unsigned int vector = iar & 0xffffff;
+
+		if (vector >= 1020) {
+			// spurious, nothing left
+			break;
+		}
+
+		THREAD_STATS_IRQ_ENTER();
+		KEVLOG_IRQ_ENTER(vector);
+
+		LTRACEF_LEVEL(2, "iar 0x%x cpu %u currthread %p vector %d pc 0x%lx\n", iar, cpu,
+		       get_current_thread(), vector, (uintptr_t)frame->elr);
+
+		// deliver the interrupt
+		IRQSTATS_BEGIN(start);
+		if (vector < MAX_INT) {
+			struct int_handler_struct *handler = get_int_handler(vector, cpu);
+			if (handler->handler && handler->handler(handler->arg) == INT_RESCHEDULE)
+				ret = INT_RESCHEDULE;
+		}
+		IRQSTATS_END(vector, start);
+
+		ARM64_WRITE_SYSREG(ICC_EOIR1_EL1, iar);
+
+		LTRACEF_LEVEL(2, "cpu %u exit %d\n", cpu, ret);
+
+		KEVLOG_IRQ_EXIT(vector);
+		THREAD_STATS_IRQ_EXIT();
+	}
+
+	/* the interrupted frame pointer isn't in the iframe, samples are pc only */
+	profile_irq_exit(frame->elr, 0);
+
+	return ret;
+}
+
+enum handler_return platform_irq(struct arm64_iframe_short *frame)
+{
+	return __platform_irq(frame);
+}
+
+void platform_fiq(struct arm64_iframe_short *frame)
+{
+	PANIC_UNIMPLEMENTED;
+}
+
+/* vim: set ts=4 sw=4 noexpandtab: */
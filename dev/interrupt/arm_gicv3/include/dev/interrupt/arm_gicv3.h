@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __DEV_INTERRUPT_ARM_GICV3_H
+#define __DEV_INTERRUPT_ARM_GICV3_H
+
+#include <sys/types.h>
+#include <kernel/mp.h>
+
+/* the platform provides GICBASE(n), GICD_OFFSET and GICR_OFFSET in platform/gic.h,
+ * the redistributors of all the cpus are expected to sit back to back from GICR_OFFSET */
+void arm_gicv3_init(void);
+
+/* send sgi irq (0-15) to every cpu in cpu_mask, one ICC_SGI1R_EL1 write per cluster */
+status_t arm_gicv3_sgi(u_int irq, mp_cpu_mask_t cpu_mask);
+
+#endif
+
@@ -22,6 +22,7 @@
  */
 #include <err.h>
 #include <debug.h>
+#include <kernel/irqstats.h>
 #include <kernel/thread.h>
 #include <platform/interrupts.h>
 #include <platform/pic.h>
@@ -82,8 +83,10 @@ enum handler_return platform_irq(void)
 
     uint irq = __builtin_ffs(mfspr(OR1K_SPR_PIC_PICSR_ADDR)) - 1;
 
+    IRQSTATS_BEGIN(start);
     if (irq < MAX_INT && int_handler_table[irq].handler)
         ret = int_handler_table[irq].handler(int_handler_table[irq].arg);
+    IRQSTATS_END(irq, start);
 
     return ret;
 }
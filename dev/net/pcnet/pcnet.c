@@ -37,6 +37,7 @@
 #include <kernel/event.h>
 #include <dev/class/netif.h>
 #include <dev/pci.h>
+#include <lib/netpoll.h>
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
@@ -48,6 +49,19 @@
 #define PCNET_INIT_TIMEOUT 20000
 #define MAX_PACKET_SIZE 1518
 
+/* log2 of the ring sizes, the controller takes up to 512 descriptors each */
+#ifndef PCNET_RX_RING_ORDER
+#define PCNET_RX_RING_ORDER 8
+#endif
+#ifndef PCNET_TX_RING_ORDER
+#define PCNET_TX_RING_ORDER 7
+#endif
+
+STATIC_ASSERT(PCNET_RX_RING_ORDER <= 9 && PCNET_TX_RING_ORDER <= 9);
+
+/* frames handed to the stack per poll before other threads get a turn */
+#define PCNET_POLL_BUDGET 64
+
 #define QEMU_IRQ_BUG_WORKAROUND 1
 
 struct pcnet_state {
@@ -74,12 +88,18 @@ struct pcnet_state {
 
     int tx_pending;
 
+    /* a descriptor was handed over while the controller was busy without a
+     * poll demand, the next tx reclaim issues one for all of them */
+    bool tx_kick;
+
     mutex_t tx_lock;
 
-    /* bottom half state */
-    event_t event;
+    /* rx and tx completions are handled from the netpoll thread with the
+     * irq masked, it is the only one reading csr0 */
+    netpoll_t poll;
     event_t initialized;
-    bool done;
+
+    ulong rx_dropped; /* no pbuf to replace the one with the frame in */
 
     struct netstack_state *netstack_state;
 };
@@ -89,9 +109,11 @@ static status_t pcnet_read_pci_config(struct device *dev, pci_location_t *loc);
 
 static enum handler_return pcnet_irq_handler(void *arg);
 
-static int pcnet_thread(void *arg);
-static bool pcnet_service_tx(struct device *dev);
-static bool pcnet_service_rx(struct device *dev);
+static int pcnet_poll(void *arg, int budget);
+static bool pcnet_poll_done(void *arg);
+static void pcnet_reclaim_tx(struct device *dev);
+static int pcnet_service_rx(struct device *dev, int budget);
+static void pcnet_give_rx(struct rd_style3 *rd, struct pbuf *p);
 
 static status_t pcnet_set_state(struct device *dev, struct netstack_state *state);
 static ssize_t pcnet_get_hwaddr(struct device *dev, void *buf, size_t max_len);
@@ -187,9 +209,8 @@ static status_t pcnet_init(struct device *dev)
     /* DMA plus enable */
     pcnet_write_csr(dev, 4, pcnet_read_csr(dev, 4) | CSR4_DMAPLUS);
 
-    /* allocate 128 tx and 128 rx descriptor rings */
-    state->td_count = 128;
-    state->rd_count = 128;
+    state->td_count = 1 << PCNET_TX_RING_ORDER;
+    state->rd_count = 1 << PCNET_RX_RING_ORDER;
     state->td = memalign(16, state->td_count * DESC_SIZE);
     state->rd = memalign(16, state->rd_count * DESC_SIZE);
 
@@ -216,8 +237,8 @@ static status_t pcnet_init(struct device *dev)
     LTRACEF("Init block addr: %p\n", state->ib);
 
     /* setup init block */
-    state->ib->tlen = 7; // 128 descriptors
-    state->ib->rlen = 7; // 128 descriptors
+    state->ib->tlen = PCNET_TX_RING_ORDER;
+    state->ib->rlen = PCNET_RX_RING_ORDER;
     state->ib->mode = 0;
 
     state->ib->ladr = ~0;
@@ -230,28 +251,26 @@ static status_t pcnet_init(struct device *dev)
     pcnet_write_csr(dev, 1, (uint32_t) state->ib);
     pcnet_write_csr(dev, 2, (uint32_t) state->ib >> 16);
 
-    /* setup receive descriptors */
+    /* the controller dmas straight into the pbufs that go up the stack */
     for (i=0; i < state->rd_count; i++) {
-        //LTRACEF("Allocating pbuf %d\n", i);
         struct pbuf *p = pbuf_alloc(PBUF_RAW, MAX_PACKET_SIZE, PBUF_RAM);
-
-        state->rd[i].rbadr = (uint32_t) p->payload;
-        state->rd[i].bcnt = -p->tot_len;
-        state->rd[i].ones = 0xf;
-        state->rd[i].own = 1;
+        if (!p) {
+            res = ERR_NO_MEMORY;
+            goto error;
+        }
 
         state->rx_buffers[i] = p;
+        pcnet_give_rx(&state->rd[i], p);
     }
 
     mutex_init(&state->tx_lock);
 
-    state->done = false;
-    event_init(&state->event, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&state->initialized, false, 0);
 
-    /* start up a thread to process packet activity */
-    thread_resume(thread_create("[pcnet bh]", pcnet_thread, dev, DEFAULT_PRIORITY,
-                                DEFAULT_STACK_SIZE));
+    res = netpoll_init(&state->poll, "pcnet", pcnet_poll, pcnet_poll_done, dev,
+                       PCNET_POLL_BUDGET, HIGH_PRIORITY);
+    if (res)
+        goto error;
 
     register_int_handler(state->irq, pcnet_irq_handler, dev);
     unmask_interrupt(state->irq);
@@ -261,6 +280,11 @@ static status_t pcnet_init(struct device *dev)
     unmask_interrupt(INT_BASE + 15);
 #endif
 
+    netpoll_start(&state->poll);
+
+    /* kick off init, enable ints, and start operation */
+    pcnet_write_csr(dev, 0, CSR0_INIT | CSR0_IENA | CSR0_STRT);
+
     /* wait for initialization to complete */
     res = event_wait_timeout(&state->initialized, PCNET_INIT_TIMEOUT);
     if (res) {
@@ -276,6 +300,12 @@ error:
     LTRACEF("Error: %d\n", res);
 
     if (state) {
+        if (state->rx_buffers) {
+            for (i=0; i < state->rd_count; i++) {
+                if (state->rx_buffers[i])
+                    pbuf_free(state->rx_buffers[i]);
+            }
+        }
         free(state->td);
         free(state->rd);
         free(state->ib);
@@ -283,6 +313,8 @@ error:
         free(state->rx_buffers);
     }
 
+    dev->state = NULL;
+
     free(state);
 
     return res;
@@ -342,91 +374,95 @@ static enum handler_return pcnet_irq_handler(void *arg)
     struct device *dev = arg;
     struct pcnet_state *state = dev->state;
 
+    /* masked until the poll thread has caught up with both rings */
     mask_interrupt(state->irq);
 
 #if QEMU_IRQ_BUG_WORKAROUND
     mask_interrupt(INT_BASE + 15);
 #endif
 
-    event_signal(&state->event, false);
-
-    return INT_RESCHEDULE;
+    return netpoll_schedule(&state->poll);
 }
 
-static int pcnet_thread(void *arg)
+static int pcnet_poll(void *arg, int budget)
 {
-    DEBUG_ASSERT(arg);
-
     struct device *dev = arg;
     struct pcnet_state *state = dev->state;
 
-    /* kick off init, enable ints, and start operation */
-    pcnet_write_csr(dev, 0, CSR0_INIT | CSR0_IENA | CSR0_STRT);
+    int csr0 = pcnet_read_csr(dev, 0);
 
-    while (!state->done) {
-        LTRACEF("Waiting for event.\n");
-        //event_wait_timeout(&state->event, 5000);
-        event_wait(&state->event);
+    /* acknowledge what's pending and keep the controller from interrupting.
+     * anything that completes from here on raises it again once it's back on */
+    pcnet_write_csr(dev, 0, csr0 & ~CSR0_IENA);
 
-        int csr0 = pcnet_read_csr(dev, 0);
+    LTRACEF("CSR0 = %04x\n", csr0);
 
-        /* disable interrupts at the controller */
-        pcnet_write_csr(dev, 0, csr0 & ~CSR0_IENA);
+    if (csr0 & CSR0_IDON) {
+        LTRACEF("IDON\n");
 
-        LTRACEF("CSR0 = %04x\n", csr0);
-
-#if LOCAL_TRACE
-        if (csr0 & CSR0_RINT) TRACEF("RINT\n");
-        if (csr0 & CSR0_TINT) TRACEF("TINT\n");
-#endif
+        /* free the init block that we no longer need */
+        free(state->ib);
+        state->ib = NULL;
 
-        if (csr0 & CSR0_IDON) {
-            LTRACEF("IDON\n");
+        event_signal(&state->initialized, true);
+    }
 
-            /* free the init block that we no longer need */
-            free(state->ib);
-            state->ib = NULL;
+    if (csr0 & CSR0_ERR) {
+        LTRACEF("ERR\n");
 
-            event_signal(&state->initialized, true);
-        }
+        /* TODO: handle errors, though not many need it */
 
-        if (csr0 & CSR0_ERR) {
-            LTRACEF("ERR\n");
+        /* clear flags, preserve necessary enables */
+        pcnet_write_csr(dev, 0, csr0 & (CSR0_TXON | CSR0_RXON));
+    }
 
-            /* TODO: handle errors, though not many need it */
+    pcnet_reclaim_tx(dev);
 
-            /* clear flags, preserve necessary enables */
-            pcnet_write_csr(dev, 0, csr0 & (CSR0_TXON | CSR0_RXON | CSR0_IENA));
-        }
+    return pcnet_service_rx(dev, budget);
+}
 
-        bool again = !!(csr0 & (CSR0_RINT | CSR0_TINT));
-        while (again) {
-            again = pcnet_service_tx(dev) | pcnet_service_rx(dev);
-        }
+static bool pcnet_poll_done(void *arg)
+{
+    struct device *dev = arg;
+    struct pcnet_state *state = dev->state;
 
-        /* enable interrupts at the controller */
-        pcnet_write_csr(dev, 0, CSR0_IENA);
-        unmask_interrupt(state->irq);
+    /* enable interrupts at the controller */
+    pcnet_write_csr(dev, 0, CSR0_IENA);
+    unmask_interrupt(state->irq);
 
 #if QEMU_IRQ_BUG_WORKAROUND
-        unmask_interrupt(INT_BASE + 15);
+    unmask_interrupt(INT_BASE + 15);
 #endif
-    }
 
-    return 0;
+    return true;
 }
 
-static bool pcnet_service_tx(struct device *dev)
+/* hand an rx descriptor back to the controller with p as its buffer */
+static void pcnet_give_rx(struct rd_style3 *rd, struct pbuf *p)
 {
-    LTRACE_ENTRY;
+    memset(rd, 0, sizeof(*rd));
 
+    rd->rbadr = (uint32_t) p->payload;
+    rd->bcnt = -MAX_PACKET_SIZE;
+    rd->ones = 0xf;
+
+    /* the controller may take the descriptor as soon as it sees own */
+    CF;
+    rd->own = 1;
+}
+
+/* free the buffers of every frame the controller is done sending */
+static void pcnet_reclaim_tx(struct device *dev)
+{
     struct pcnet_state *state = dev->state;
 
     mutex_acquire(&state->tx_lock);
 
-    struct td_style3 *td = &state->td[state->td_tail];
+    while (state->tx_pending) {
+        struct td_style3 *td = &state->td[state->td_tail];
+        if (td->own)
+            break;
 
-    if (state->tx_pending && td->own == 0) {
         struct pbuf *p = state->tx_buffers[state->td_tail];
         DEBUG_ASSERT(p);
 
@@ -434,44 +470,37 @@ static bool pcnet_service_tx(struct device *dev)
 
         LTRACEF("Retiring packet: td_tail=%d p=%p tot_len=%u\n", state->td_tail, p, p->tot_len);
 
-        state->tx_pending--;
-        state->td_tail = (state->td_tail + 1) % state->td_count;
-
         if (td->err) {
             LTRACEF("Descriptor error status encountered\n");
             hexdump8(td, sizeof(*td));
         }
 
-        mutex_release(&state->tx_lock);
+        state->tx_pending--;
+        state->td_tail = (state->td_tail + 1) % state->td_count;
 
         pbuf_free(p);
+    }
 
-        LTRACE_EXIT;
-        return true;
-    } else {
-        mutex_release(&state->tx_lock);
-
-#if 0
-        LTRACEF("Nothing to do for TX.\n");
-        for (int i=0; i < state->td_count; i++)
-            printf("%d ", state->td[i].own);
-        printf("\n");
-#endif
-
-        LTRACE_EXIT;
-        return false;
+    /* one poll demand for everything queued behind a busy controller */
+    if (state->tx_kick) {
+        state->tx_kick = false;
+        if (state->tx_pending)
+            pcnet_write_csr(dev, 0, CSR0_TDMD);
     }
+
+    mutex_release(&state->tx_lock);
 }
 
-static bool pcnet_service_rx(struct device *dev)
+static int pcnet_service_rx(struct device *dev, int budget)
 {
-    LTRACE_ENTRY;
-
     struct pcnet_state *state = dev->state;
+    int count = 0;
 
-    struct rd_style3 *rd = &state->rd[state->rd_head];
+    while (count < budget) {
+        struct rd_style3 *rd = &state->rd[state->rd_head];
+        if (rd->own)
+            break;
 
-    if (rd->own == 0) {
         struct pbuf *p = state->rx_buffers[state->rd_head];
         DEBUG_ASSERT(p);
 
@@ -480,9 +509,13 @@ static bool pcnet_service_rx(struct device *dev)
         if (rd->err) {
             LTRACEF("Descriptor error status encountered\n");
             hexdump8(rd, sizeof(*rd));
+        } else if (rd->mcnt > p->tot_len) {
+            LTRACEF("RX packet size error: mcnt = %u, buf len = %u\n", rd->mcnt, p->tot_len);
         } else {
-            if (rd->mcnt <= p->tot_len) {
-
+            /* the frame goes up in the buffer it landed in. without a
+             * replacement it's dropped and its buffer reused instead */
+            struct pbuf *fresh = pbuf_alloc(PBUF_RAW, MAX_PACKET_SIZE, PBUF_RAM);
+            if (fresh) {
                 pbuf_realloc(p, rd->mcnt);
 
 #if LOCAL_TRACE
@@ -492,35 +525,19 @@ static bool pcnet_service_rx(struct device *dev)
 
                 class_netstack_input(dev, state->netstack_state, p);
 
-                p = state->rx_buffers[state->rd_head] = pbuf_alloc(PBUF_RAW, MAX_PACKET_SIZE, PBUF_RAM);
+                p = state->rx_buffers[state->rd_head] = fresh;
             } else {
-                LTRACEF("RX packet size error: mcnt = %u, buf len = %u\n", rd->mcnt, p->tot_len);
+                state->rx_dropped++;
             }
         }
 
-        memset(rd, 0, sizeof(*rd));
-        memset(p->payload, 0, p->tot_len);
-
-        rd->rbadr = (uint32_t) p->payload;
-        rd->bcnt = -p->tot_len;
-        rd->ones = 0xf;
-        rd->own = 1;
+        pcnet_give_rx(rd, p);
 
         state->rd_head = (state->rd_head + 1) % state->rd_count;
-
-        LTRACE_EXIT;
-        return true;
-    } else {
-#if 0
-        LTRACEF("Nothing to do for RX: rd_head=%d.\n", state->rd_head);
-        for (int i=0; i < state->rd_count; i++)
-            printf("%d ", state->rd[i].own);
-        printf("\n");
-#endif
+        count++;
     }
 
-    LTRACE_EXIT;
-    return false;
+    return count;
 }
 
 static status_t pcnet_set_state(struct device *dev, struct netstack_state *netstack_state)
@@ -574,11 +591,14 @@ static status_t pcnet_output(struct device *dev, struct pbuf *p)
     status_t res = NO_ERROR;
     struct pcnet_state *state = dev->state;
 
+    /* make room from frames that have gone out since the last interrupt */
+    pcnet_reclaim_tx(dev);
+
     mutex_acquire(&state->tx_lock);
 
     struct td_style3 *td = &state->td[state->td_head];
 
-    if (td->own) {
+    if (td->own || state->tx_buffers[state->td_head]) {
         LTRACEF("TX descriptor ring full\n");
         res = ERR_NOT_READY; // maybe this should be ERR_NOT_ENOUGH_BUFFER?
         goto done;
@@ -602,15 +622,22 @@ static status_t pcnet_output(struct device *dev, struct pbuf *p)
     td->add_no_fcs = 1;
     td->ones = 0xf;
 
+    /* a controller still working through earlier frames gets to this one
+     * on its own, only one that has gone idle needs the poll demand */
+    bool idle = state->tx_pending == 0;
+
     state->tx_buffers[state->td_head] = p;
     state->tx_pending++;
 
     state->td_head = (state->td_head + 1) % state->td_count;
 
+    CF;
     td->own = 1;
 
-    /* trigger tx */
-    pcnet_write_csr(dev, 0, CSR0_TDMD);
+    if (idle)
+        pcnet_write_csr(dev, 0, CSR0_TDMD);
+    else
+        state->tx_kick = true;
 
 done:
     mutex_release(&state->tx_lock);
@@ -8,6 +8,8 @@ GLOBAL_INCLUDES += \
 MODULE_SRCS += \
 	$(LOCAL_DIR)/pcnet.c
 
-MODULE_DEPS := lib/lwip
+MODULE_DEPS := \
+	lib/lwip \
+	lib/netpoll
 
 include make/module.mk
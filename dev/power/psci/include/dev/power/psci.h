@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* arm power state coordination interface, the calls this tree makes */
+#define PSCI_VERSION                0x84000000
+#define PSCI_FEATURES               0x8400000a
+#define PSCI64_CPU_SUSPEND          0xc4000001
+#define PSCI64_CPU_ON               0xc4000003
+
+#define PSCI_SUCCESS                0
+#define PSCI_NOT_SUPPORTED          (-1)
+#define PSCI_INVALID_PARAMETERS     (-2)
+#define PSCI_DENIED                 (-3)
+#define PSCI_ALREADY_ON             (-4)
+#define PSCI_ON_PENDING             (-5)
+
+#define PSCI_VERSION_MAJOR(v)       (((v) >> 16) & 0xffff)
+#define PSCI_VERSION_MINOR(v)       ((v) & 0xffff)
+
+/* original power_state format, bit 16 set means the core loses its context */
+#define PSCI_POWER_STATE_TYPE_POWERDOWN (1U << 16)
+
+/* smc or hvc, as picked by PSCI_USE_HVC */
+ulong psci_call(ulong function, ulong arg0, ulong arg1, ulong arg2);
+
+uint32_t psci_version(void);
+
+/* only standby states are supported, entry and context are for powerdown ones */
+int psci_cpu_suspend(uint32_t power_state, ulong entry, ulong context);
+
+/* start the cpu with the given mpidr at the physical address entry, with
+ * context in x0. returns as soon as the firmware has accepted the request.
+ */
+int psci_cpu_on(ulong mpidr, ulong entry, ulong context);
+
+/* register the standby idle states under /cpus/idle-states in the fdt, or a
+ * plain standby state after wfi if there are none.
+ */
+status_t psci_cpuidle_init(const void *fdt);
+
+__END_CDECLS
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <dev/power/psci.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/cpuidle.h>
+#include <libfdt.h>
+
+#define LOCAL_TRACE 0
+
+/* used when the fdt doesn't describe any idle states */
+#define PSCI_DEFAULT_STANDBY_LATENCY    10
+#define PSCI_DEFAULT_STANDBY_RESIDENCY  100
+
+uint32_t psci_version(void)
+{
+    return psci_call(PSCI_VERSION, 0, 0, 0);
+}
+
+int psci_cpu_suspend(uint32_t power_state, ulong entry, ulong context)
+{
+    return (int)psci_call(PSCI64_CPU_SUSPEND, power_state, entry, context);
+}
+
+int psci_cpu_on(ulong mpidr, ulong entry, ulong context)
+{
+    return (int)psci_call(PSCI64_CPU_ON, mpidr, entry, context);
+}
+
+static void psci_wfi_enter(const struct cpuidle_state *state)
+{
+    arch_idle();
+}
+
+static void psci_standby_enter(const struct cpuidle_state *state)
+{
+    /* a standby state comes back here like wfi, with nothing lost */
+    int ret = psci_cpu_suspend(state->arg, 0, 0);
+    if (ret != PSCI_SUCCESS) {
+        LTRACEF("cpu suspend 0x%x returned %d\n", state->arg, ret);
+        arch_idle();
+    }
+}
+
+static struct cpuidle_state psci_states[CPUIDLE_MAX_STATES] = {
+    {
+        .name = "wfi",
+        .exit_latency = 1,
+        .target_residency = 1,
+        .enter = psci_wfi_enter,
+    },
+};
+
+static uint32_t fdt_u32(const void *fdt, int node, const char *prop, uint32_t def)
+{
+    int len;
+    const fdt32_t *val = fdt_getprop(fdt, node, prop, &len);
+
+    return (val && len >= 4) ? fdt32_to_cpu(*val) : def;
+}
+
+/* the arm,idle-state nodes we can use, after wfi in psci_states */
+static uint psci_parse_idle_states(const void *fdt, uint count)
+{
+    int parent = fdt_path_offset(fdt, "/cpus/idle-states");
+    if (parent < 0)
+        return count;
+
+    for (int node = fdt_first_subnode(fdt, parent); node >= 0 && count < CPUIDLE_MAX_STATES;
+         node = fdt_next_subnode(fdt, node)) {
+        if (fdt_node_check_compatible(fdt, node, "arm,idle-state") != 0)
+            continue;
+
+        int len;
+        const fdt32_t *param = fdt_getprop(fdt, node, "arm,psci-suspend-param", &len);
+        if (!param || len < 4)
+            continue;
+
+        /* coming back from a powerdown state means restarting the core
+         * through a resume entry point, which there isn't one of yet */
+        uint32_t power_state = fdt32_to_cpu(*param);
+        if (power_state & PSCI_POWER_STATE_TYPE_POWERDOWN) {
+            dprintf(INFO, "psci: skipping powerdown idle state %s\n", fdt_get_name(fdt, node, NULL));
+            continue;
+        }
+
+        struct cpuidle_state *s = &psci_states[count++];
+        s->name = fdt_get_name(fdt, node, NULL);
+        s->exit_latency = fdt_u32(fdt, node, "exit-latency-us", PSCI_DEFAULT_STANDBY_LATENCY);
+        s->target_residency = fdt_u32(fdt, node, "min-residency-us", PSCI_DEFAULT_STANDBY_RESIDENCY);
+        s->enter = psci_standby_enter;
+        s->arg = power_state;
+    }
+
+    return count;
+}
+
+status_t psci_cpuidle_init(const void *fdt)
+{
+    uint32_t version = psci_version();
+    if ((int32_t)version == PSCI_NOT_SUPPORTED || PSCI_VERSION_MAJOR(version) == 0) {
+        dprintf(INFO, "psci: no psci 0.2 or later, idling with wfi only\n");
+        return ERR_NOT_SUPPORTED;
+    }
+    LTRACEF("psci version %u.%u\n", PSCI_VERSION_MAJOR(version), PSCI_VERSION_MINOR(version));
+
+    uint count = 1;
+    if (fdt && fdt_check_header(fdt) >= 0)
+        count = psci_parse_idle_states(fdt, count);
+
+    if (count == 1) {
+        /* power state 0 is the shallowest standby state in the original format */
+        psci_states[count++] = (struct cpuidle_state) {
+            .name = "psci-standby",
+            .exit_latency = PSCI_DEFAULT_STANDBY_LATENCY,
+            .target_residency = PSCI_DEFAULT_STANDBY_RESIDENCY,
+            .enter = psci_standby_enter,
+            .arg = 0,
+        };
+    }
+
+    return cpuidle_register(psci_states, count);
+}
@@ -0,0 +1,22 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+GLOBAL_INCLUDES += \
+    $(LOCAL_DIR)/include
+
+# the conduit depends on what's running above us, hvc under a hypervisor
+# that implements psci (qemu without el3 firmware), smc to the secure monitor
+PSCI_USE_HVC ?= 0
+
+MODULE_DEFINES += \
+    PSCI_USE_HVC=$(PSCI_USE_HVC)
+
+MODULE_SRCS += \
+    $(LOCAL_DIR)/psci.c \
+    $(LOCAL_DIR)/psci_asm.S
+
+MODULE_DEPS += \
+    lib/fdt
+
+include make/module.mk
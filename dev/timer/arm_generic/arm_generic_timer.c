@@ -127,21 +127,44 @@ static platform_timer_callback t_callback;
 static int timer_irq;
 
 struct fp_32_64 cntpct_per_ms;
+struct fp_32_64 cntpct_per_us;
 struct fp_32_64 ms_per_cntpct;
 struct fp_32_64 us_per_cntpct;
 
+#if ARCH_ARM64
+/* msecs and usecs per tick as 0.64 fixed point, which turns the conversion
+ * in current_time() and current_time_hires() into a single umulh. left 0,
+ * and the fp_32_64 path used, if a tick is longer than a usec or msec.
+ */
+static uint64_t ms_per_cntpct_frac;
+static uint64_t us_per_cntpct_frac;
+#endif
+
 static uint64_t lk_time_to_cntpct(lk_time_t lk_time)
 {
 	return u64_mul_u32_fp32_64(lk_time, cntpct_per_ms);
 }
 
+static uint64_t lk_bigtime_to_cntpct(lk_bigtime_t lk_bigtime)
+{
+	return u64_mul_u64_fp32_64(lk_bigtime, cntpct_per_us);
+}
+
 static lk_time_t cntpct_to_lk_time(uint64_t cntpct)
 {
+#if ARCH_ARM64
+	if (likely(ms_per_cntpct_frac))
+		return ((unsigned __int128)cntpct * ms_per_cntpct_frac) >> 64;
+#endif
 	return u32_mul_u64_fp32_64(cntpct, ms_per_cntpct);
 }
 
 static lk_bigtime_t cntpct_to_lk_bigtime(uint64_t cntpct)
 {
+#if ARCH_ARM64
+	if (likely(us_per_cntpct_frac))
+		return ((unsigned __int128)cntpct * us_per_cntpct_frac) >> 64;
+#endif
 	return u64_mul_u64_fp32_64(cntpct, us_per_cntpct);
 }
 
@@ -199,10 +222,8 @@ static enum handler_return platform_tick(void *arg)
 	}
 }
 
-status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+static status_t arm_generic_timer_set_oneshot(platform_timer_callback callback, void *arg, uint64_t cntpct_interval)
 {
-	uint64_t cntpct_interval = lk_time_to_cntpct(interval);
-
 	ASSERT(arg == NULL);
 
 	t_callback = callback;
@@ -215,6 +236,16 @@ status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg,
 	return 0;
 }
 
+status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+{
+	return arm_generic_timer_set_oneshot(callback, arg, lk_time_to_cntpct(interval));
+}
+
+status_t platform_set_oneshot_timer_hires(platform_timer_callback callback, void *arg, lk_bigtime_t interval)
+{
+	return arm_generic_timer_set_oneshot(callback, arg, lk_bigtime_to_cntpct(interval));
+}
+
 void platform_stop_timer(void)
 {
 	write_cntp_ctl(0);
@@ -312,9 +343,16 @@ static void test_time_conversions(uint32_t cntfrq)
 static void arm_generic_timer_init_conversion_factors(uint32_t cntfrq)
 {
 	fp_32_64_div_32_32(&cntpct_per_ms, cntfrq, 1000);
+	fp_32_64_div_32_32(&cntpct_per_us, cntfrq, 1000 * 1000);
 	fp_32_64_div_32_32(&ms_per_cntpct, 1000, cntfrq);
 	fp_32_64_div_32_32(&us_per_cntpct, 1000 * 1000, cntfrq);
+#if ARCH_ARM64
+	ms_per_cntpct_frac = (cntfrq > 1000) ? (uint64_t)(((unsigned __int128)1000 << 64) / cntfrq) : 0;
+	us_per_cntpct_frac = (cntfrq > 1000 * 1000) ? (uint64_t)(((unsigned __int128)(1000 * 1000) << 64) / cntfrq) : 0;
+	LTRACEF("ms_per_cntpct_frac: %016llx, us_per_cntpct_frac: %016llx\n", ms_per_cntpct_frac, us_per_cntpct_frac);
+#endif
 	LTRACEF("cntpct_per_ms: %08x.%08x%08x\n", cntpct_per_ms.l0, cntpct_per_ms.l32, cntpct_per_ms.l64);
+	LTRACEF("cntpct_per_us: %08x.%08x%08x\n", cntpct_per_us.l0, cntpct_per_us.l32, cntpct_per_us.l64);
 	LTRACEF("ms_per_cntpct: %08x.%08x%08x\n", ms_per_cntpct.l0, ms_per_cntpct.l32, ms_per_cntpct.l64);
 	LTRACEF("us_per_cntpct: %08x.%08x%08x\n", us_per_cntpct.l0, us_per_cntpct.l32, us_per_cntpct.l64);
 }
@@ -10,7 +10,8 @@ MODULE_SRCS += \
 
 MODULE_DEPS += \
 	dev/virtio \
-	lib/bio
+	lib/bio \
+	lib/dma
 
 
 include make/module.mk
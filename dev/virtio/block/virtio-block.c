@@ -30,9 +30,11 @@
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/bio.h>
+#include <lib/dma.h>
+#include <stddef.h>
 
 #define LOCAL_TRACE 0
 
@@ -46,6 +48,21 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0[3];
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 } __PACKED;
 
 struct virtio_blk_req {
@@ -54,6 +71,15 @@ struct virtio_blk_req {
     uint64_t sector;
 } __PACKED;
 
+/* the data of a discard or write zeroes request */
+struct virtio_blk_range {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __PACKED;
+
+#define VIRTIO_BLK_RANGE_F_UNMAP (1<<0) /* write zeroes may deallocate the range */
+
 #define VIRTIO_BLK_F_BARRIER  (1<<0)
 #define VIRTIO_BLK_F_SIZE_MAX (1<<1)
 #define VIRTIO_BLK_F_SEG_MAX  (1<<2)
@@ -64,10 +90,14 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_DISCARD  (1<<13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (1<<14)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
@@ -76,25 +106,91 @@ struct virtio_blk_req {
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static void virtio_bdev_poll(struct bdev *bdev);
+static ssize_t virtio_bdev_discard(struct bdev *bdev, off_t offset, size_t len);
+static ssize_t virtio_bdev_write_zeroes(struct bdev *bdev, off_t offset, size_t len);
+static status_t virtio_bdev_flush(struct bdev *bdev);
+static int virtio_bdev_ioctl(struct bdev *bdev, int request, void *argp);
+static bool virtio_block_can_map(struct bdev *bdev, off_t offset, size_t len, const void *buf,
+                                 const iovec_t *iov, uint iov_cnt);
+static void virtio_block_queue_data_piece(struct bdev *bdev, bio_request_t *bio, bool sync,
+                                          const bio_seg_t *seg, uint seg_count, off_t offset, size_t len);
+static void virtio_block_kick(struct bdev *bdev);
+static void virtio_block_sync_data(bio_request_t *bio, bool for_device);
+static void virtio_block_wait(struct bdev *bdev, event_t *event);
+
+#define VIRTIO_BLK_RING_LEN 256
+
+/* transfers are cut into pieces of at most this size, so that the descriptor chain of
+ * any one piece (header, one per physically contiguous run, response) fits in the ring
+ */
+#define VIRTIO_BLK_MAX_PIECE (128 * 1024)
+#define VIRTIO_BLK_MAX_SEGS  (VIRTIO_BLK_MAX_PIECE / PAGE_SIZE + 1)
+
+static const bio_piece_ops_t virtio_block_piece_ops = {
+    .can_map = virtio_block_can_map,
+    .queue_piece = virtio_block_queue_data_piece,
+    .kick = virtio_block_kick,
+    .sync_data = virtio_block_sync_data,
+    .wait = virtio_block_wait,
+};
+
+static const bio_piece_limits_t virtio_block_piece_limits = {
+    .max_len = VIRTIO_BLK_MAX_PIECE,
+    .max_segs = VIRTIO_BLK_MAX_SEGS,
+    .sector_size = 512,
+};
+
+/* state for one piece in flight, indexed by the head descriptor of its chain.
+ * a line each, so handing one to the device can't touch its neighbours */
+struct virtio_blk_io {
+    struct virtio_blk_req req;
+    struct virtio_blk_range range;
+    uint8_t status;
+    bool sync;
+    size_t len;
+    bio_request_t *bio;
+} __ALIGNED(CACHE_LINE);
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
+    /* protects the descriptors of the ring */
+    spin_lock_t lock;
+    event_t desc_event; /* signaled when descriptors are freed */
 
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
+    /* one io slot per descriptor, physically contiguous */
+    struct virtio_blk_io *io;
+    paddr_t io_phys;
 
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    /* pieces go out as a single ring descriptor pointing at an indirect table */
+    bool indirect;
+
+    /* synchronous transfers spin on the used ring before sleeping, see BIO_IOCTL_SET_POLL */
+    bool poll;
+
+    /* negotiated VIRTIO_BLK_F_* */
+    uint32_t features;
+
+    /* largest discard and write zeroes the device takes in one request, in bytes */
+    size_t max_discard;
+    size_t max_write_zeroes;
 };
 
+/* the bytes in the largest whole number of blocks a range request can cover */
+static size_t virtio_block_max_range(const bdev_t *bdev, uint32_t max_sectors)
+{
+    if (max_sectors == 0)
+        max_sectors = UINT32_MAX;
+
+    size_t max = (size_t)MIN((uint64_t)max_sectors * 512, (uint64_t)SIZE_MAX);
+
+    return MAX(ROUNDDOWN(max, bdev->block_size), bdev->block_size);
+}
+
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
 {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
@@ -104,25 +200,32 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    spin_lock_init(&bdev->lock);
+    event_init(&bdev->desc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    bdev->poll = false;
 
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
+    size_t io_size = VIRTIO_BLK_RING_LEN * sizeof(struct virtio_blk_io);
 #if WITH_KERNEL_VM
-    arch_mmu_query((vaddr_t)bdev->blk_req, &bdev->blk_req_phys, NULL);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    arch_mmu_query((vaddr_t)&bdev->blk_response, &bdev->blk_response_phys, NULL);
+    void *io;
+    if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_blk_io", ROUNDUP(io_size, PAGE_SIZE),
+                             &io, 0, 0, ARCH_MMU_FLAG_CACHED) < 0) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    bdev->io = io;
+    arch_mmu_query((vaddr_t)bdev->io, &bdev->io_phys, NULL);
 #else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
+    bdev->io = memalign(CACHE_LINE, io_size);
+    if (!bdev->io) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    bdev->io_phys = (uint64_t)(uintptr_t)bdev->io;
 #endif
+    LTRACEF("io slots at %p (0x%lx phys)\n", bdev->io, bdev->io_phys);
 
     /* make sure the device is reset */
     virtio_reset_device(dev);
@@ -137,10 +240,14 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    bdev->features = virtio_negotiate_features(dev, host_features,
+                                               VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES);
+    LTRACEF("features 0x%x\n", bdev->features);
 
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    virtio_alloc_ring(dev, 0, VIRTIO_BLK_RING_LEN);
+    bdev->indirect = (virtio_alloc_indirect(dev, 0, VIRTIO_BLK_MAX_SEGS + 2) >= 0);
+    LTRACEF("indirect descriptors %s\n", bdev->indirect ? "on" : "off");
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -159,6 +266,20 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bio_init_pieces(&bdev->bdev, &virtio_block_piece_ops, &virtio_block_piece_limits);
+    bdev->bdev.poll = &virtio_bdev_poll;
+    bdev->bdev.flush = &virtio_bdev_flush;
+    bdev->bdev.ioctl = &virtio_bdev_ioctl;
+
+    /* both describe the range with a single segment, so only the sector count limits them */
+    if (bdev->features & VIRTIO_BLK_F_DISCARD) {
+        bdev->max_discard = virtio_block_max_range(&bdev->bdev, config->max_discard_sectors);
+        bdev->bdev.discard = &virtio_bdev_discard;
+    }
+    if (bdev->features & VIRTIO_BLK_F_WRITE_ZEROES) {
+        bdev->max_write_zeroes = virtio_block_max_range(&bdev->bdev, config->max_write_zeroes_sectors);
+        bdev->bdev.write_zeroes = &virtio_bdev_write_zeroes;
+    }
 
     bio_register_device(&bdev->bdev);
 
@@ -173,7 +294,18 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    /* the slot is free for reuse as soon as the chain is, grab what we need first */
+    struct virtio_blk_io *io = &bdev->io[e->id];
+    dma_sync_range_for_cpu(io, sizeof(*io), DMA_FROM_DEVICE);
+    bio_request_t *bio = io->bio;
+    bool sync = io->sync;
+    size_t len = io->len;
+    uint8_t status = io->status;
+
+    LTRACEF("status 0x%hhx\n", status);
+
     /* parse our descriptor chain, add back to the free queue */
+    spin_lock(&bdev->lock);
     uint16_t i = e->id;
     for (;;) {
         int next;
@@ -194,120 +326,236 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
             break;
         i = next;
     }
+    spin_unlock(&bdev->lock);
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    /* wake anyone waiting for room in the ring */
+    event_signal(&bdev->desc_event, false);
+
+    /* pieces of a request complete in order of the irqs, so this needs no lock */
+    if (status != VIRTIO_BLK_S_OK)
+        bio->result = ERR_IO;
+    else if (bio->result >= 0)
+        bio->result += len;
+
+    bio_put_piece(&bdev->bdev, bio, sync);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+/* the cache work for the data of a whole request, once around all of its pieces */
+static void virtio_block_sync_data(bio_request_t *bio, bool for_device)
 {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
-
-    uint16_t i;
-    struct vring_desc *desc;
-    paddr_t pa;
-    vaddr_t va = (vaddr_t)buf;
+    /* flushes, discards and write zeroes have none */
+    if (!bio->buf && !bio->iov)
+        return;
+
+    uint dir = (bio->op == BIO_OP_WRITE) ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+
+    iovec_t single = { bio->buf, bio->len };
+    const iovec_t *iov = bio->iov ? bio->iov : &single;
+    uint iov_cnt = bio->iov ? bio->iov_cnt : 1;
+
+    size_t remaining = bio->len;
+    for (uint i = 0; i < iov_cnt && remaining > 0; i++) {
+        size_t len = MIN(iov[i].iov_len, remaining);
+        if (for_device)
+            dma_sync_range_for_device(iov[i].iov_base, len, dir);
+        else
+            dma_sync_range_for_cpu(iov[i].iov_base, len, dir);
+        remaining -= len;
+    }
+}
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+static struct vring_desc *virtio_block_next_desc(struct virtio_device *dev, struct vring_desc *table, const struct vring_desc *desc)
+{
+    return table ? &table[desc->next] : virtio_desc_index_to_desc(dev, 0, desc->next);
+}
 
-    mutex_acquire(&bdev->lock);
+/* queue one piece of a request, waiting for descriptors if the ring is full. reads and
+ * writes carry their data in seg, discards and write zeroes send a range describing
+ * len bytes at offset instead, and flushes have nothing.
+ */
+static void virtio_block_queue_piece(struct virtio_block_dev *bdev, bio_request_t *bio, bool sync, uint32_t type,
+                                     const bio_seg_t *seg, uint seg_count, off_t offset, size_t len)
+{
+    struct virtio_device *dev = bdev->dev;
+    bool range = (type == VIRTIO_BLK_T_DISCARD || type == VIRTIO_BLK_T_WRITE_ZEROES);
+    uint desc_count = seg_count + (range ? 1 : 0) + 2;
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    LTRACEF("dev %p, type %u, segs %u, offset 0x%llx, len %zu\n", dev, type, seg_count, offset, len);
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+    DEBUG_ASSERT(range || len <= VIRTIO_BLK_MAX_PIECE);
 
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
+    /* grab a chain for the header, the data and the response */
+    spin_lock_saved_state_t state;
+    struct vring_desc *desc;
+    uint16_t head;
+    for (;;) {
+        spin_lock_irqsave(&bdev->lock, state);
+        if (bdev->indirect)
+            desc = virtio_alloc_desc_chain_indirect(dev, 0, desc_count, &head);
+        else
+            desc = virtio_alloc_desc_chain(dev, 0, desc_count, &head);
+        if (desc)
+            break;
 
-    /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
-    desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
+        /* make sure what's already queued gets going, then wait for some of it to finish */
+        virtio_kick(dev, 0);
+        spin_unlock_irqrestore(&bdev->lock, state);
+        event_wait(&bdev->desc_event);
+    }
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    /* translate the first buffer */
-    arch_mmu_query(va, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
-#endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
+    /* an indirect chain is linked through its own table rather than the ring */
+    struct vring_desc *table = bdev->indirect ? desc : NULL;
 
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %zu\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        arch_mmu_query(va, &pa, NULL);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
+    /* set up the request */
+    struct virtio_blk_io *io = &bdev->io[head];
+    paddr_t io_phys = bdev->io_phys + head * sizeof(struct virtio_blk_io);
+
+    io->req.type = type;
+    io->req.ioprio = 0;
+    io->req.sector = (type == VIRTIO_BLK_T_FLUSH) ? 0 : offset / 512;
+    if (range) {
+        io->range.sector = offset / 512;
+        io->range.num_sectors = len / 512;
+        io->range.flags = (type == VIRTIO_BLK_T_WRITE_ZEROES) ? VIRTIO_BLK_RANGE_F_UNMAP : 0;
+    }
+    io->status = 0xff;
+    io->sync = sync;
+    io->len = len;
+    io->bio = bio;
+    LTRACEF("blk_req type %u ioprio %u sector %llu, head %u\n",
+            io->req.type, io->req.ioprio, io->req.sector, head);
 
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
+    dma_sync_range_for_device(io, sizeof(*io), DMA_BIDIRECTIONAL);
 
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
+    /* set up the descriptor pointing to the head */
+    desc->addr = io_phys + offsetof(struct virtio_blk_io, req);
+    desc->len = sizeof(struct virtio_blk_req);
+    desc->flags = VRING_DESC_F_NEXT;
+
+    /* set up the descriptor pointing to the range */
+    if (range) {
+        desc = virtio_block_next_desc(dev, table, desc);
+        desc->addr = io_phys + offsetof(struct virtio_blk_io, range);
+        desc->len = sizeof(struct virtio_blk_range);
+        desc->flags = VRING_DESC_F_NEXT;
+    }
 
-            desc = next_desc;
-        }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
+    /* set up the descriptors pointing to the buffer */
+    for (uint i = 0; i < seg_count; i++) {
+        desc = virtio_block_next_desc(dev, table, desc);
+        desc->addr = (uint64_t)seg[i].pa;
+        desc->len = seg[i].len;
+        desc->flags = VRING_DESC_F_NEXT;
+        desc->flags |= (type == VIRTIO_BLK_T_IN) ? VRING_DESC_F_WRITE : 0; /* mark buffer as write-only if its a block read */
     }
-#endif
 
     /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
+    desc = virtio_block_next_desc(dev, table, desc);
+    desc->addr = io_phys + offsetof(struct virtio_blk_io, status);
     desc->len = 1;
     desc->flags = VRING_DESC_F_WRITE;
 
     /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+    virtio_submit_chain(dev, 0, head);
+
+    /* pass along any descriptors left over to the next waiter */
+    bool more = dev->ring[0].free_count > 0;
+    spin_unlock_irqrestore(&bdev->lock, state);
+
+    if (more)
+        event_signal(&bdev->desc_event, false);
+}
+
+static void virtio_block_queue_data_piece(struct bdev *bdev, bio_request_t *bio, bool sync,
+                                          const bio_seg_t *seg, uint seg_count, off_t offset, size_t len)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+    uint32_t type = (bio->op == BIO_OP_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
 
-    /* kick it off */
-    virtio_kick(dev, 0);
+    virtio_block_queue_piece(dev, bio, sync, type, seg, seg_count, offset, len);
+}
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+static void virtio_block_kick(struct bdev *bdev)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+    virtio_kick(dev->dev, 0);
+}
 
-    mutex_release(&bdev->lock);
+/* wait for a request queued with sync set */
+static void virtio_block_wait(struct bdev *bdev, event_t *event)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
 
-    return len;
+    if (dev->poll)
+        bio_poll_wait(bdev, event);
+    else
+        event_wait(event);
+}
+
+/* run a request that carries no data, cut into pieces of at most max bytes. a flush
+ * is a single piece with no length.
+ */
+static ssize_t virtio_block_command(struct virtio_block_dev *bdev, uint32_t type, off_t offset, size_t len, size_t max)
+{
+    bio_request_t req;
+    bio_request_init(&req, BIO_OP_WRITE, NULL, offset, len, NULL, NULL);
+
+    req.result = 0;
+    req.pending = 1;
+
+    do {
+        size_t piece = MIN(len, max);
+
+        atomic_add(&req.pending, 1);
+        virtio_block_queue_piece(bdev, &req, true, type, NULL, 0, offset, piece);
+
+        offset += piece;
+        len -= piece;
+    } while (len > 0);
+
+    virtio_kick(bdev->dev, 0);
+
+    bio_put_piece(&bdev->bdev, &req, true);
+
+    return bio_pieces_wait(&bdev->bdev, &req);
+}
+
+/* can the request go straight to descriptor chains. the device only moves whole sectors,
+ * and every fragment but the last needs to be one or more, so that a piece limited by its
+ * descriptor count still covers at least a sector.
+ */
+static bool virtio_block_can_map(struct bdev *bdev, off_t offset, size_t len, const void *buf,
+                                 const iovec_t *iov, uint iov_cnt)
+{
+    if ((offset | len) & (bdev->block_size - 1))
+        return false;
+
+    for (uint i = 0; iov && i < iov_cnt && len > 0; i++) {
+        if (iov[i].iov_len < len && iov[i].iov_len < 512 && iov[i].iov_len > 0)
+            return false;
+        len -= MIN(len, iov[i].iov_len);
+    }
+
+    return true;
+}
+
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    if (len == 0)
+        return 0;
+
+    /* a request of our own that never goes through bio_submit */
+    bio_request_t req;
+    bio_request_init(&req, write ? BIO_OP_WRITE : BIO_OP_READ, buf, offset, len, NULL, NULL);
+
+    return bio_pieces_sync(&bdev->bdev, &req);
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
@@ -328,3 +576,57 @@ static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_
     return virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size, count * dev->bdev.block_size, true);
 }
 
+static ssize_t virtio_bdev_discard(struct bdev *bdev, off_t offset, size_t len)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, offset 0x%llx, len %zu\n", bdev, offset, len);
+
+    return virtio_block_command(dev, VIRTIO_BLK_T_DISCARD, offset, len, dev->max_discard);
+}
+
+static ssize_t virtio_bdev_write_zeroes(struct bdev *bdev, off_t offset, size_t len)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, offset 0x%llx, len %zu\n", bdev, offset, len);
+
+    return virtio_block_command(dev, VIRTIO_BLK_T_WRITE_ZEROES, offset, len, dev->max_write_zeroes);
+}
+
+static status_t virtio_bdev_flush(struct bdev *bdev)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    /* without the feature the device has no volatile cache, or keeps it to itself */
+    if (!(dev->features & VIRTIO_BLK_F_FLUSH))
+        return NO_ERROR;
+
+    ssize_t err = virtio_block_command(dev, VIRTIO_BLK_T_FLUSH, 0, 0, 0);
+
+    return (err < 0) ? (status_t)err : NO_ERROR;
+}
+
+static void virtio_bdev_poll(struct bdev *bdev)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    virtio_poll(dev->dev, 0);
+}
+
+static int virtio_bdev_ioctl(struct bdev *bdev, int request, void *argp)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    switch (request) {
+        case BIO_IOCTL_SET_POLL:
+            if (!argp)
+                return ERR_INVALID_ARGS;
+            dev->poll = *(int *)argp != 0;
+            return NO_ERROR;
+        case BIO_IOCTL_SYNC:
+            return virtio_bdev_flush(bdev);
+        default:
+            return ERR_NOT_SUPPORTED;
+    }
+}
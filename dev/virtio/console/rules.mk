@@ -0,0 +1,16 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+GLOBAL_INCLUDES += \
+	$(LOCAL_DIR)/include
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/virtio-console.c
+
+MODULE_DEPS += \
+	dev/virtio \
+	lib/cbuf \
+	lib/dma
+
+include make/module.mk
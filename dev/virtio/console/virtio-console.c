@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <dev/virtio/console.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <compiler.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <lib/cbuf.h>
+#include <lib/dma.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+#define VIRTIO_CONSOLE_F_SIZE               (1<<0)
+#define VIRTIO_CONSOLE_F_MULTIPORT          (1<<1)
+#define VIRTIO_CONSOLE_F_EMERG_WRITE        (1<<2)
+
+/* without multiport there's only port 0, on the first two queues */
+#define RING_RX 0
+#define RING_TX 1
+
+/* each descriptor owns a slot of the buffer, tx slots divide a page so none
+ * of them spans two */
+#define TX_RING_SIZE 32
+#define TX_SLOT_SIZE 512
+#define RX_RING_SIZE 4
+#define RX_SLOT_SIZE 64
+
+#define RXBUF_SIZE 256
+
+/* how long a write waits for the host to make room before the rest is dropped */
+#define TX_TIMEOUT_USECS 100000
+
+struct virtio_console_dev {
+    struct virtio_device *dev;
+
+    /* protects the tx descriptors */
+    spin_lock_t lock;
+
+    /* tx slots followed by rx slots, physically contiguous */
+    char *buf;
+    paddr_t buf_phys;
+
+    cbuf_t rx;
+    print_callback_t cb;
+
+    uint32_t dropped;
+};
+
+static struct virtio_console_dev *the_cdev;
+
+static inline char *tx_slot(struct virtio_console_dev *cdev, uint16_t i)
+{
+    return cdev->buf + i * TX_SLOT_SIZE;
+}
+
+static inline char *rx_slot(struct virtio_console_dev *cdev, uint16_t i)
+{
+    return cdev->buf + TX_RING_SIZE * TX_SLOT_SIZE + i * RX_SLOT_SIZE;
+}
+
+static inline paddr_t slot_phys(struct virtio_console_dev *cdev, const char *slot)
+{
+    return cdev->buf_phys + (slot - cdev->buf);
+}
+
+/* hand an rx slot to the device, called with dev->lock held or before the irq is on */
+static void virtio_console_queue_rx(struct virtio_console_dev *cdev, uint16_t i)
+{
+    struct virtio_device *dev = cdev->dev;
+    struct vring_desc *desc = virtio_desc_index_to_desc(dev, RING_RX, i);
+
+    dma_sync_range_for_device(rx_slot(cdev, i), RX_SLOT_SIZE, DMA_FROM_DEVICE);
+
+    desc->addr = slot_phys(cdev, rx_slot(cdev, i));
+    desc->len = RX_SLOT_SIZE;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    virtio_submit_chain(dev, RING_RX, i);
+}
+
+static enum handler_return virtio_console_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
+{
+    struct virtio_console_dev *cdev = (struct virtio_console_dev *)dev->priv;
+
+    LTRACEF("dev %p, ring %u, id %u, len %u\n", dev, ring, e->id, e->len);
+
+    if (ring == RING_TX) {
+        spin_lock(&cdev->lock);
+        virtio_free_desc(dev, ring, e->id);
+        spin_unlock(&cdev->lock);
+        return INT_NO_RESCHEDULE;
+    }
+
+    /* what doesn't fit in the cbuf is lost, like with a uart */
+    const char *slot = rx_slot(cdev, e->id);
+    size_t len = MIN(e->len, (uint32_t)RX_SLOT_SIZE);
+    dma_sync_range_for_cpu(slot, len, DMA_FROM_DEVICE);
+    for (size_t i = 0; i < len && cbuf_space_avail(&cdev->rx) > 0; i++)
+        cbuf_write_char(&cdev->rx, slot[i], false);
+
+    virtio_console_queue_rx(cdev, e->id);
+    virtio_kick(dev, RING_RX);
+
+    return len ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+/* copy str into as few tx slots as it takes, turning \n into \r\n, and
+ * notify the host once for the lot. when the ring is full the used ring is
+ * reaped here, the host may only be waiting on us to look. */
+static void virtio_console_write(struct virtio_console_dev *cdev, const char *str, size_t len)
+{
+    struct virtio_device *dev = cdev->dev;
+    bool queued = false;
+    bool waiting = false;
+    lk_bigtime_t wait_start = 0;
+    bool pending_cr = true;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cdev->lock, state);
+
+    while (len > 0) {
+        uint16_t i = virtio_alloc_desc(dev, RING_TX);
+        if (i == 0xffff) {
+            if (queued) {
+                virtio_kick(dev, RING_TX);
+                queued = false;
+            }
+            if (!waiting) {
+                waiting = true;
+                wait_start = current_time_hires();
+            }
+
+            spin_unlock_irqrestore(&cdev->lock, state);
+            bool reaped = virtio_poll(dev, RING_TX);
+            bool timed_out = !reaped && current_time_hires() - wait_start > TX_TIMEOUT_USECS;
+            spin_lock_irqsave(&cdev->lock, state);
+
+            if (timed_out) {
+                cdev->dropped += len;
+                break;
+            }
+            continue;
+        }
+        waiting = false;
+
+        char *slot = tx_slot(cdev, i);
+        size_t used = 0;
+        while (len > 0 && used < TX_SLOT_SIZE) {
+            if (*str == '\n' && pending_cr) {
+                /* the \n itself goes next, even if that's in the next slot */
+                slot[used++] = '\r';
+                pending_cr = false;
+                continue;
+            }
+            slot[used++] = *str++;
+            len--;
+            pending_cr = true;
+        }
+        dma_sync_range_for_device(slot, used, DMA_TO_DEVICE);
+
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, RING_TX, i);
+        desc->addr = slot_phys(cdev, slot);
+        desc->len = used;
+        desc->flags = 0;
+
+        virtio_submit_chain(dev, RING_TX, i);
+        queued = true;
+    }
+
+    if (queued)
+        virtio_kick(dev, RING_TX);
+
+    spin_unlock_irqrestore(&cdev->lock, state);
+}
+
+static void virtio_console_print(print_callback_t *cb, const char *str, size_t len)
+{
+    struct virtio_console_dev *cdev = containerof(cb, struct virtio_console_dev, cb);
+
+    virtio_console_write(cdev, str, len);
+}
+
+bool virtio_console_active(void)
+{
+    return the_cdev != NULL;
+}
+
+int virtio_console_getc(char *c, bool wait)
+{
+    if (!the_cdev)
+        return -1;
+
+    return (cbuf_read_char(&the_cdev->rx, c, wait) == 1) ? 0 : -1;
+}
+
+status_t virtio_console_init(struct virtio_device *dev, uint32_t host_features)
+{
+    LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
+
+    /* only the first one gets the debug output */
+    if (the_cdev)
+        return ERR_ALREADY_EXISTS;
+
+    struct virtio_console_dev *cdev = calloc(1, sizeof(struct virtio_console_dev));
+    if (!cdev)
+        return ERR_NO_MEMORY;
+
+    cdev->dev = dev;
+    dev->priv = cdev;
+    cdev->lock = SPIN_LOCK_INITIAL_VALUE;
+
+    size_t size = ROUNDUP(TX_RING_SIZE * TX_SLOT_SIZE + RX_RING_SIZE * RX_SLOT_SIZE, PAGE_SIZE);
+#if WITH_KERNEL_VM
+    void *vptr;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_console", size, &vptr, 0, 0, 0);
+    if (err < 0) {
+        free(cdev);
+        return ERR_NO_MEMORY;
+    }
+    cdev->buf = vptr;
+    cdev->buf_phys = kvaddr_to_paddr(vptr);
+#else
+    cdev->buf = memalign(PAGE_SIZE, size);
+    if (!cdev->buf) {
+        free(cdev);
+        return ERR_NO_MEMORY;
+    }
+    cdev->buf_phys = (paddr_t)cdev->buf;
+#endif
+
+    cbuf_initialize_flags(&cdev->rx, RXBUF_SIZE, NULL, CBUF_FLAG_SPSC);
+
+    /* ack and set the driver status bit */
+    virtio_status_acknowledge_driver(dev);
+
+    /* a single console port, nothing else to ask for */
+    virtio_negotiate_features(dev, host_features, 0);
+
+    /* allocate the virtio rings, modern devices want them before DRIVER_OK */
+    virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE);
+    virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE);
+
+    dev->irq_driver_callback = &virtio_console_irq_driver_callback;
+
+    /* set DRIVER_OK */
+    virtio_status_driver_ok(dev);
+
+    /* rx descriptors stay with the device for good, each on its own slot */
+    for (uint i = 0; i < RX_RING_SIZE; i++)
+        virtio_console_queue_rx(cdev, virtio_alloc_desc(dev, RING_RX));
+    virtio_kick(dev, RING_RX);
+
+    cdev->cb.print = &virtio_console_print;
+    register_print_callback(&cdev->cb);
+    the_cdev = cdev;
+
+    dprintf(INFO, "virtio-console: taking the debug console\n");
+
+    return NO_ERROR;
+}
+
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+static int cmd_virtio_console(int argc, const cmd_args *argv)
+{
+    if (!the_cdev) {
+        printf("no virtio console\n");
+        return ERR_NOT_FOUND;
+    }
+
+    printf("virtio console: dev %p, %u tx free of %u, %u bytes dropped\n", the_cdev->dev,
+           the_cdev->dev->ring[RING_TX].free_count, TX_RING_SIZE, the_cdev->dropped);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("virtio_console", "virtio console stats", &cmd_virtio_console)
+STATIC_COMMAND_END(virtio_console);
+
+#endif
@@ -32,6 +32,7 @@
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/gfx.h>
 #include <dev/display.h>
@@ -43,6 +44,7 @@
 static enum handler_return virtio_gpu_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static enum handler_return virtio_gpu_config_change_callback(struct virtio_device *dev);
 static int virtio_gpu_flush_thread(void *arg);
+void virtio_gpu_gfx_flush(uint starty, uint endy);
 
 struct virtio_gpu_dev {
     struct virtio_device *dev;
@@ -67,6 +69,25 @@ struct virtio_gpu_dev {
 
     /* framebuffer */
     void *fb;
+
+    /* optional second framebuffer to flip to, back_resource_id is 0 if there isn't one */
+    void *back_fb;
+    uint32_t back_resource_id;
+
+    /* the resources are virtual_height rows tall, the display shows the rows
+     * starting at scanout_y */
+    uint32_t virtual_height;
+
+    /* resource currently set as scanout, and where in it */
+    uint32_t scanout_resource_id;
+    uint32_t scanout_y;
+
+    /* what the flush thread has to send next, pending_width is 0 if nothing */
+    spin_lock_t pending_lock;
+    uint32_t pending_resource_id;
+    uint32_t pending_x, pending_y;
+    uint32_t pending_width, pending_height;
+    uint32_t pending_pan_y;
 };
 
 static struct virtio_gpu_dev *the_gdev;
@@ -247,11 +268,11 @@ static status_t attach_backing(struct virtio_gpu_dev *gdev, uint32_t resource_id
     return err;
 }
 
-static status_t set_scanout(struct virtio_gpu_dev *gdev, uint32_t scanout_id, uint32_t resource_id, uint32_t width, uint32_t height)
+static status_t set_scanout(struct virtio_gpu_dev *gdev, uint32_t scanout_id, uint32_t resource_id, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
     status_t err;
 
-    LTRACEF("gdev %p, scanout_id %u, resource_id %u, width %u, height %u\n", gdev, scanout_id, resource_id, width, height);
+    LTRACEF("gdev %p, scanout_id %u, resource_id %u, x %u, y %u, width %u, height %u\n", gdev, scanout_id, resource_id, x, y, width, height);
 
     /* grab a lock to keep this single message at a time */
     mutex_acquire(&gdev->lock);
@@ -261,7 +282,8 @@ static status_t set_scanout(struct virtio_gpu_dev *gdev, uint32_t scanout_id, ui
     memset(&req, 0, sizeof(req));
 
     req.hdr.type = VIRTIO_GPU_CMD_SET_SCANOUT;
-    req.r.x = req.r.y = 0;
+    req.r.x = x;
+    req.r.y = y;
     req.r.width = width;
     req.r.height = height;
     req.scanout_id = scanout_id;
@@ -282,11 +304,11 @@ static status_t set_scanout(struct virtio_gpu_dev *gdev, uint32_t scanout_id, ui
     return err;
 }
 
-static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t width, uint32_t height)
+static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
     status_t err;
 
-    LTRACEF("gdev %p, resource_id %u, width %u, height %u\n", gdev, resource_id, width, height);
+    LTRACEF("gdev %p, resource_id %u, x %u, y %u, width %u, height %u\n", gdev, resource_id, x, y, width, height);
 
     /* grab a lock to keep this single message at a time */
     mutex_acquire(&gdev->lock);
@@ -296,7 +318,8 @@ static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id
     memset(&req, 0, sizeof(req));
 
     req.hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
-    req.r.x = req.r.y = 0;
+    req.r.x = x;
+    req.r.y = y;
     req.r.width = width;
     req.r.height = height;
     req.resource_id = resource_id;
@@ -316,11 +339,11 @@ static status_t flush_resource(struct virtio_gpu_dev *gdev, uint32_t resource_id
     return err;
 }
 
-static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t width, uint32_t height)
+static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resource_id, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
     status_t err;
 
-    LTRACEF("gdev %p, resource_id %u, width %u, height %u\n", gdev, resource_id, width, height);
+    LTRACEF("gdev %p, resource_id %u, x %u, y %u, width %u, height %u\n", gdev, resource_id, x, y, width, height);
 
     /* grab a lock to keep this single message at a time */
     mutex_acquire(&gdev->lock);
@@ -330,10 +353,12 @@ static status_t transfer_to_host_2d(struct virtio_gpu_dev *gdev, uint32_t resour
     memset(&req, 0, sizeof(req));
 
     req.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
-    req.r.x = req.r.y = 0;
+    req.r.x = x;
+    req.r.y = y;
     req.r.width = width;
     req.r.height = height;
-    req.offset = 0;
+    /* where the rectangle starts in the backing store */
+    req.offset = ((uint64_t)y * gdev->pmode.r.width + x) * 4;
     req.resource_id = resource_id;
 
     /* send the command and get a response */
@@ -371,16 +396,31 @@ status_t virtio_gpu_start(struct virtio_device *dev)
         return ERR_NOT_FOUND;
     }
 
+    /*
+     * Allocate the framebuffer twice the height of the display if there's
+     * room, which gives hardware scrolling somewhere to pan to.
+     */
+    gdev->virtual_height = gdev->pmode.r.height * 2;
+    size_t len = gdev->pmode.r.width * gdev->virtual_height * 4;
+    gdev->fb = pmm_alloc_kpages(ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE, NULL);
+    if (!gdev->fb) {
+        gdev->virtual_height = gdev->pmode.r.height;
+        len = gdev->pmode.r.width * gdev->virtual_height * 4;
+        gdev->fb = pmm_alloc_kpages(ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE, NULL);
+        if (!gdev->fb) {
+            LTRACEF("failed to allocate framebuffer\n");
+            return ERR_NO_MEMORY;
+        }
+    }
+
     /* allocate a resource */
-    err = allocate_2d_resource(gdev, &gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
+    err = allocate_2d_resource(gdev, &gdev->display_resource_id, gdev->pmode.r.width, gdev->virtual_height);
     if (err < 0) {
         LTRACEF("failed to allocate 2d resource\n");
         return err;
     }
 
     /* attach a backing store to the resource */
-    size_t len = gdev->pmode.r.width * gdev->pmode.r.height * 4;
-    gdev->fb = pmm_alloc_kpages(ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE, NULL);
     err = attach_backing(gdev, gdev->display_resource_id, gdev->fb, len);
     if (err < 0) {
         LTRACEF("failed to attach backing store\n");
@@ -388,11 +428,27 @@ status_t virtio_gpu_start(struct virtio_device *dev)
     }
 
     /* attach this resource as a scanout */
-    err = set_scanout(gdev, gdev->pmode_id, gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
+    err = set_scanout(gdev, gdev->pmode_id, gdev->display_resource_id, 0, 0, gdev->pmode.r.width, gdev->pmode.r.height);
     if (err < 0) {
         LTRACEF("failed to set scanout\n");
         return err;
     }
+    gdev->scanout_resource_id = gdev->display_resource_id;
+    gdev->scanout_y = 0;
+
+    /* a second resource to flip to, the display works single buffered without it */
+    gdev->back_fb = pmm_alloc_kpages(ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE, NULL);
+    if (gdev->back_fb) {
+        uint32_t id;
+        if (allocate_2d_resource(gdev, &id, gdev->pmode.r.width, gdev->virtual_height) == NO_ERROR &&
+                attach_backing(gdev, id, gdev->back_fb, len) == NO_ERROR) {
+            gdev->back_resource_id = id;
+        } else {
+            LTRACEF("failed to set up back buffer\n");
+            pmm_free_kpages(gdev->back_fb, ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE);
+            gdev->back_fb = NULL;
+        }
+    }
 
     /* create the flush thread */
     thread_t *t;
@@ -400,7 +456,7 @@ status_t virtio_gpu_start(struct virtio_device *dev)
     thread_detach_and_resume(t);
 
     /* kick it once */
-    event_signal(&gdev->flush_event, true);
+    virtio_gpu_gfx_flush(0, gdev->pmode.r.height - 1);
 
     LTRACE_EXIT;
 
@@ -428,12 +484,17 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features)
     mutex_init(&gdev->lock);
     event_init(&gdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
     event_init(&gdev->flush_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    spin_lock_init(&gdev->pending_lock);
 
     gdev->dev = dev;
     dev->priv = gdev;
 
     gdev->pmode_id = -1;
     gdev->next_resource_id = 1;
+    gdev->back_fb = NULL;
+    gdev->back_resource_id = 0;
+    gdev->pending_width = 0;
+    gdev->pending_pan_y = 0;
 
     /* allocate memory for a gpu request */
 #if WITH_KERNEL_VM
@@ -454,6 +515,7 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features)
     virtio_status_acknowledge_driver(dev);
 
     // XXX check features bits and ack/nak them
+    virtio_negotiate_features(dev, host_features, 0);
 
     /* allocate a virtio ring */
     virtio_alloc_ring(dev, 0, 16);
@@ -527,15 +589,50 @@ static int virtio_gpu_flush_thread(void *arg)
     for (;;) {
         event_wait(&gdev->flush_event);
 
-        /* transfer to host 2d */
-        err = transfer_to_host_2d(gdev, gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
-        if (err < 0) {
-            LTRACEF("failed to flush resource\n");
-            continue;
+        /* grab whatever has piled up since the last pass */
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&gdev->pending_lock, state);
+        uint32_t resource_id = gdev->pending_resource_id;
+        uint32_t x = gdev->pending_x;
+        uint32_t y = gdev->pending_y;
+        uint32_t width = gdev->pending_width;
+        uint32_t height = gdev->pending_height;
+        uint32_t pan_y = gdev->pending_pan_y;
+        gdev->pending_width = 0;
+        spin_unlock_irqrestore(&gdev->pending_lock, state);
+
+        if (width == 0) {
+            if (pan_y == gdev->scanout_y)
+                continue;
+            resource_id = gdev->scanout_resource_id;
+        } else {
+            /* transfer to host 2d */
+            err = transfer_to_host_2d(gdev, resource_id, x, y, width, height);
+            if (err < 0) {
+                LTRACEF("failed to flush resource\n");
+                continue;
+            }
+        }
+
+        /* page flip or pan if a different buffer or part of it is being shown */
+        if (resource_id != gdev->scanout_resource_id || pan_y != gdev->scanout_y) {
+            err = set_scanout(gdev, gdev->pmode_id, resource_id, 0, pan_y, gdev->pmode.r.width, gdev->pmode.r.height);
+            if (err < 0) {
+                LTRACEF("failed to set scanout\n");
+                continue;
+            }
+            gdev->scanout_resource_id = resource_id;
+            gdev->scanout_y = pan_y;
+
+            /* the whole screen moved */
+            x = 0;
+            y = pan_y;
+            width = gdev->pmode.r.width;
+            height = gdev->pmode.r.height;
         }
 
         /* resource flush */
-        err = flush_resource(gdev, gdev->display_resource_id, gdev->pmode.r.width, gdev->pmode.r.height);
+        err = flush_resource(gdev, resource_id, x, y, width, height);
         if (err < 0) {
             LTRACEF("failed to flush resource\n");
             continue;
@@ -545,9 +642,68 @@ static int virtio_gpu_flush_thread(void *arg)
     return 0;
 }
 
+static void virtio_gpu_gfx_flush_rect(void *buffer, uint x, uint y, uint width, uint height)
+{
+    struct virtio_gpu_dev *gdev = the_gdev;
+    uint32_t resource_id;
+
+    if (buffer == gdev->fb) {
+        resource_id = gdev->display_resource_id;
+    } else if (buffer && buffer == gdev->back_fb) {
+        resource_id = gdev->back_resource_id;
+    } else {
+        return;
+    }
+
+    if (width == 0 || height == 0)
+        return;
+
+    /*
+     * Merge with what's pending. A flip to the other buffer takes the pending
+     * rectangle along, the flipping surface copies everything it drew into
+     * both buffers.
+     */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&gdev->pending_lock, state);
+    if (gdev->pending_width == 0) {
+        gdev->pending_x = x;
+        gdev->pending_y = y;
+        gdev->pending_width = width;
+        gdev->pending_height = height;
+    } else {
+        uint32_t x2 = MAX(gdev->pending_x + gdev->pending_width, x + width);
+        uint32_t y2 = MAX(gdev->pending_y + gdev->pending_height, y + height);
+        gdev->pending_x = MIN(gdev->pending_x, x);
+        gdev->pending_y = MIN(gdev->pending_y, y);
+        gdev->pending_width = x2 - gdev->pending_x;
+        gdev->pending_height = y2 - gdev->pending_y;
+    }
+    gdev->pending_resource_id = resource_id;
+    spin_unlock_irqrestore(&gdev->pending_lock, state);
+
+    event_signal(&gdev->flush_event, !arch_ints_disabled());
+}
+
+static status_t virtio_gpu_gfx_pan(uint y)
+{
+    struct virtio_gpu_dev *gdev = the_gdev;
+
+    if (y + gdev->pmode.r.height > gdev->virtual_height)
+        return ERR_INVALID_ARGS;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&gdev->pending_lock, state);
+    gdev->pending_pan_y = y;
+    spin_unlock_irqrestore(&gdev->pending_lock, state);
+
+    event_signal(&gdev->flush_event, !arch_ints_disabled());
+
+    return NO_ERROR;
+}
+
 void virtio_gpu_gfx_flush(uint starty, uint endy)
 {
-    event_signal(&the_gdev->flush_event, !arch_ints_disabled());
+    virtio_gpu_gfx_flush_rect(the_gdev->fb, 0, starty, the_gdev->pmode.r.width, endy - starty + 1);
 }
 
 status_t display_get_info(struct display_info *info)
@@ -563,6 +719,14 @@ status_t display_get_info(struct display_info *info)
     info->height = the_gdev->pmode.r.height;
     info->stride = info->width;
     info->flush = virtio_gpu_gfx_flush;
+    info->flush_rect = virtio_gpu_gfx_flush_rect;
+    info->back_framebuffer = the_gdev->back_fb;
+    if (the_gdev->virtual_height > info->height) {
+        info->virtual_height = the_gdev->virtual_height;
+        info->pan = virtio_gpu_gfx_pan;
+    } else {
+        info->virtual_height = info->height;
+    }
 
     return NO_ERROR;
 }
@@ -26,15 +26,24 @@
 #include <assert.h>
 #include <list.h>
 #include <sys/types.h>
+#include <kernel/spinlock.h>
 #include <dev/virtio/virtio_ring.h>
 
 /* detect a virtio mmio hardware block
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[]);
 
-#define MAX_VIRTIO_RINGS 4
+/* detect virtio 1.0 devices on the pci bus
+ * returns number of devices found */
+int virtio_pci_detect(void);
+
+#define MAX_VIRTIO_RINGS 17 /* room for 8 net queue pairs and their control queue */
+
+/* device follows the 1.0 spec rather than the legacy interface */
+#define VIRTIO_F_VERSION_1 32
 
 struct virtio_mmio_config;
+struct virtio_transport_ops;
 
 struct virtio_device {
     bool valid;
@@ -42,15 +51,24 @@ struct virtio_device {
     uint index;
     uint irq;
 
+    /* how the core reaches the device, mmio or pci */
+    const struct virtio_transport_ops *ops;
+    void *transport; /* transport private state */
+
     volatile struct virtio_mmio_config *mmio_config;
     void *config_ptr;
 
     void *priv; /* a place for the driver to put private data */
 
+    uint64_t features; /* as accepted by virtio_negotiate_features */
+    uint64_t transport_features; /* high bits the transport needs, always accepted */
+
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
     enum handler_return (*config_change_callback)(struct virtio_device *dev);
+    enum handler_return (*ring_poll_callback)(struct virtio_device *dev, uint ring);
 
     /* virtio rings */
+    spin_lock_t lock; /* used ring processing, between the irq and virtio_poll */
     uint32_t active_rings_bitmap;
     struct vring ring[MAX_VIRTIO_RINGS];
 };
@@ -59,9 +77,18 @@ void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
+/* accept the features in driver_features the host offers, along with any of the ring
+ * features (indirect descriptors, event index) it does. call before allocating rings.
+ * returns the accepted set. */
+uint32_t virtio_negotiate_features(struct virtio_device *dev, uint32_t host_features, uint32_t driver_features);
+
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
 
+/* give every descriptor of an allocated ring a table of max_descs indirect descriptors.
+ * ERR_NOT_SUPPORTED if VIRTIO_RING_F_INDIRECT_DESC wasn't negotiated. */
+status_t virtio_alloc_indirect(struct virtio_device *dev, uint ring_index, uint16_t max_descs) __NONNULL();
+
 /* add a descriptor at index desc_index to the free list on ring_index */
 void virtio_free_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
@@ -71,6 +98,11 @@ uint16_t virtio_alloc_desc(struct virtio_device *dev, uint ring_index);
 /* allocate a descriptor chain the free list */
 struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index);
 
+/* allocate a single ring descriptor pointing at an indirect table of count entries.
+ * returns the table, whose entries are linked in order through next, or NULL if the
+ * ring is full. the chain is freed by freeing the head descriptor. */
+struct vring_desc *virtio_alloc_desc_chain_indirect(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index);
+
 static inline struct vring_desc *virtio_desc_index_to_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     DEBUG_ASSERT(desc_index != 0xffff);
@@ -82,6 +114,21 @@ void virtio_dump_desc(const struct vring_desc *desc);
 /* submit a chain to the avail list */
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
+/* notify the host of new chains, unless it has said it doesn't need to hear about them */
 void virtio_kick(struct virtio_device *dev, uint ring_idnex);
 
+/* run the irq driver callback on whatever the host has finished on a ring, from
+ * thread context. for drivers spinning on a completion instead of sleeping until the
+ * interrupt, which still arrives and finds nothing left. returns true if it found work. */
+bool virtio_poll(struct virtio_device *dev, uint ring_index);
+
+/* interrupt mitigation. the irq leaves a polled ring alone, it masks further interrupts
+ * for it and calls ring_poll_callback. the driver then drains it with virtio_poll_ring,
+ * which runs the irq driver callback on up to budget entries and returns how many, and
+ * calls virtio_ring_unmask when it's empty. that returns false, staying masked, if more
+ * turned up first. */
+void virtio_ring_set_polled(struct virtio_device *dev, uint ring_index);
+uint virtio_poll_ring(struct virtio_device *dev, uint ring_index, uint budget);
+bool virtio_ring_unmask(struct virtio_device *dev, uint ring_index);
+
 
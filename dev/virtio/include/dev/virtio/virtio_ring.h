@@ -33,6 +33,8 @@
  *
  * Copyright Rusty Russell IBM Corporation 2007. */
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <pow2.h>
 
 /* This marks a buffer as continuing via the next field. */
@@ -99,7 +101,17 @@ struct vring {
     uint16_t free_list; /* head of a free list of descriptors per ring. 0xffff is NULL */
     uint16_t free_count;
 
-    uint16_t last_used;
+    uint16_t last_used; /* free running, like the used index */
+    uint16_t last_kick; /* avail index as of the last notify */
+
+    bool event_idx; /* VIRTIO_RING_F_EVENT_IDX was negotiated */
+    bool polled; /* the driver drains it with virtio_poll_ring, not from the irq */
+    bool masked; /* polled, and the driver is busy with it, so no interrupts */
+
+    /* per head descriptor tables for VRING_DESC_F_INDIRECT chains, indirect_max entries each */
+    uint16_t indirect_max;
+    struct vring_desc *indirect;
+    uint64_t indirect_phys;
 
     struct vring_desc *desc;
 
@@ -135,7 +147,8 @@ struct vring {
 /* We publish the used event index at the end of the available ring, and vice
  * versa. They are at the end for backwards compatibility. */
 #define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
-#define vring_avail_event(vr) (*(uint16_t *)&(vr)->used->ring[(vr)->num])
+#define vring_avail_event(vr) (*(volatile uint16_t *)((uintptr_t)(vr)->used + \
+    offsetof(struct vring_used, ring) + (vr)->num * sizeof(struct vring_used_elem)))
 
 static inline void vring_init(struct vring *vr, unsigned int num, void *p,
                   unsigned long align)
@@ -145,6 +158,11 @@ static inline void vring_init(struct vring *vr, unsigned int num, void *p,
     vr->free_list = 0xffff;
     vr->free_count = 0;
     vr->last_used = 0;
+    vr->last_kick = 0;
+    vr->event_idx = false;
+    vr->indirect_max = 0;
+    vr->indirect = NULL;
+    vr->indirect_phys = 0;
     vr->desc = p;
     vr->avail = p + num*sizeof(struct vring_desc);
     vr->used = (void *)(((unsigned long)&vr->avail->ring[num] + sizeof(uint16_t)
@@ -10,6 +10,7 @@ MODULE_SRCS += \
 
 MODULE_DEPS += \
 	dev/virtio \
-	lib/minip
+	lib/minip \
+	lib/netpoll
 
 include make/module.mk
@@ -27,14 +27,18 @@
 #include <trace.h>
 #include <compiler.h>
 #include <list.h>
+#include <stdlib.h>
 #include <string.h>
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/spinlock.h>
 #include <kernel/vm.h>
+#include <platform.h>
+#include <arch/ops.h>
 #include <lib/pktbuf.h>
 #include <lib/minip.h>
+#include <lib/netpoll.h>
 
 #define LOCAL_TRACE 0
 
@@ -54,6 +58,12 @@ struct virtio_net_hdr {
     uint16_t num_buffers; // unused in tx
 } __PACKED;
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM         (1<<0)
+#define VIRTIO_NET_HDR_F_DATA_VALID         (1<<1)
+
+#define VIRTIO_NET_HDR_GSO_NONE             0
+#define VIRTIO_NET_HDR_GSO_TCPV4            1
+
 #define VIRTIO_NET_F_CSUM                   (1<<0)
 #define VIRTIO_NET_F_GUEST_CSUM             (1<<1)
 #define VIRTIO_NET_F_CTRL_GUEST_OFFLOADS    (1<<2)
@@ -79,34 +89,87 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-#define TX_RING_SIZE 16
+#define TX_RING_SIZE 64 /* a scatter gather tso frame can take a descriptor per pktbuf */
 #define RX_RING_SIZE 16
 
-#define RING_RX 0
-#define RING_TX 1
+/* rx buffers across all the queues, the pktbuf pool is shared with everything else */
+#define VIRTIO_NET_RX_BUFS 64
+
+/* queue pairs sit in ring 2q (rx) and 2q + 1 (tx), the control queue right after the
+ * last pair the device supports */
+#define RING_RX(q) ((q) * 2)
+#define RING_TX(q) ((q) * 2 + 1)
+#define VIRTIO_NET_MAX_QUEUES MIN(SMP_MAX_CPUS, (MAX_VIRTIO_RINGS - 1) / 2)
 
 #define VIRTIO_NET_MSS 1514
 
-struct virtio_net_dev {
-    struct virtio_device *dev;
-    bool started;
+/* control queue commands */
+#define VIRTIO_NET_OK                       0
+#define VIRTIO_NET_ERR                      1
 
-    struct virtio_net_config *config;
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+
+struct virtio_net_ctrl {
+    uint8_t class;
+    uint8_t cmd;
+    uint16_t virtqueue_pairs;
+    uint8_t ack;
+} __PACKED;
+
+struct virtio_net_dev;
+
+/* one rx/tx pair, used by one cpu */
+struct virtio_net_queue {
+    struct virtio_net_dev *ndev;
+    uint index;
 
     spin_lock_t lock;
-    event_t rx_event;
+    netpoll_t rx_poll;
+    char rx_poll_name[32];
+
+    /* packet being put back together out of mergeable buffers, may span polls */
+    pktbuf_t *merge;
+    uint merge_left;
+
+    /* buffers to give back to the device */
+    pktbuf_t *refill[RX_RING_SIZE];
+    uint refill_count;
 
     /* list of active tx/rx packets to be freed at irq time */
     pktbuf_t *pending_tx_packet[TX_RING_SIZE];
     pktbuf_t *pending_rx_packet[RX_RING_SIZE];
 
     uint tx_pending_count;
+    bool tx_kick_pending; /* submitted the front of a batch without notifying the device */
     struct list_node completed_rx_queue;
+} __CPU_ALIGN;
+
+struct virtio_net_dev {
+    struct virtio_device *dev;
+    bool started;
+
+    struct virtio_net_config *config;
+
+    size_t hdr_len; /* num_buffers is only there for modern or mergeable devices */
+    bool mergeable; /* packets may span several rx buffers */
+    uint32_t offload; /* MINIP_OFFLOAD_* we told minip about */
+
+    uint queue_count;
+    struct virtio_net_queue queue[VIRTIO_NET_MAX_QUEUES];
+
+    /* control queue, only set up for multiqueue */
+    int ctrl_ring;
+    struct virtio_net_ctrl *ctrl;
+    paddr_t ctrl_phys;
+    volatile bool ctrl_done;
 };
 
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
-static int virtio_net_rx_worker(void *arg);
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p);
+static enum handler_return virtio_net_ring_poll_callback(struct virtio_device *dev, uint ring);
+static int virtio_net_rx_poll(void *arg, int budget);
+static bool virtio_net_rx_poll_done(void *arg);
+static void virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t **bufs, uint count);
 
 // XXX remove need for this
 static struct virtio_net_dev *the_ndev;
@@ -138,22 +201,75 @@ static void dump_feature_bits(uint32_t feature)
     printf("\n");
 }
 
+/* ask the device to spread traffic over pairs queue pairs. runs before the irq is
+ * unmasked, so it polls for the answer */
+static status_t virtio_net_set_queue_pairs(struct virtio_net_dev *ndev, uint pairs)
+{
+    struct virtio_device *dev = ndev->dev;
+
+    uint16_t i;
+    struct vring_desc *desc = virtio_alloc_desc_chain(dev, ndev->ctrl_ring, 3, &i);
+    if (!desc)
+        return ERR_NO_MEMORY;
+
+    ndev->ctrl->class = VIRTIO_NET_CTRL_MQ;
+    ndev->ctrl->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    ndev->ctrl->virtqueue_pairs = pairs;
+    ndev->ctrl->ack = VIRTIO_NET_ERR;
+    ndev->ctrl_done = false;
+
+    /* header, command data, and the ack the device writes */
+    desc->addr = ndev->ctrl_phys + offsetof(struct virtio_net_ctrl, class);
+    desc->len = 2;
+    desc->flags |= VRING_DESC_F_NEXT;
+
+    desc = virtio_desc_index_to_desc(dev, ndev->ctrl_ring, desc->next);
+    desc->addr = ndev->ctrl_phys + offsetof(struct virtio_net_ctrl, virtqueue_pairs);
+    desc->len = sizeof(uint16_t);
+    desc->flags |= VRING_DESC_F_NEXT;
+
+    desc = virtio_desc_index_to_desc(dev, ndev->ctrl_ring, desc->next);
+    desc->addr = ndev->ctrl_phys + offsetof(struct virtio_net_ctrl, ack);
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    virtio_submit_chain(dev, ndev->ctrl_ring, i);
+    virtio_kick(dev, ndev->ctrl_ring);
+
+    lk_time_t start = current_time();
+    while (!ndev->ctrl_done) {
+        if (current_time() - start > 1000)
+            return ERR_TIMED_OUT;
+        if (!virtio_poll(dev, ndev->ctrl_ring))
+            thread_yield();
+    }
+
+    return (ndev->ctrl->ack == VIRTIO_NET_OK) ? NO_ERROR : ERR_IO;
+}
+
 status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
 {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new net device */
-    struct virtio_net_dev *ndev = calloc(1, sizeof(struct virtio_net_dev));
+    struct virtio_net_dev *ndev = memalign(CACHE_LINE, sizeof(struct virtio_net_dev));
     if (!ndev)
         return ERR_NO_MEMORY;
+    memset(ndev, 0, sizeof(*ndev));
 
     ndev->dev = dev;
     dev->priv = ndev;
     ndev->started = false;
+    ndev->ctrl_ring = -1;
 
-    ndev->lock = SPIN_LOCK_INITIAL_VALUE;
-    event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-    list_initialize(&ndev->completed_rx_queue);
+    for (uint i = 0; i < VIRTIO_NET_MAX_QUEUES; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+
+        q->ndev = ndev;
+        q->index = i;
+        q->lock = SPIN_LOCK_INITIAL_VALUE;
+        list_initialize(&q->completed_rx_queue);
+    }
 
     ndev->config = (struct virtio_net_config *)dev->config_ptr;
 
@@ -163,15 +279,80 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
     // XXX check features bits and ack/nak them
     dump_feature_bits(host_features);
 
-    /* set our irq handler */
+    uint32_t want = VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MRG_RXBUF;
+    if (host_features & VIRTIO_NET_F_CSUM)
+        want |= VIRTIO_NET_F_HOST_TSO4;
+
+    /* multiqueue needs the control queue, which has to fit after the device's last pair */
+    uint max_pairs = 1;
+    if ((host_features & VIRTIO_NET_F_MQ) && (host_features & VIRTIO_NET_F_CTRL_VQ)) {
+        max_pairs = ndev->config->max_virtqueue_pairs;
+        if (VIRTIO_NET_MAX_QUEUES > 1 && max_pairs > 1 && RING_RX(max_pairs) < MAX_VIRTIO_RINGS)
+            want |= VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+        else
+            max_pairs = 1;
+    }
+    uint32_t features = virtio_negotiate_features(dev, host_features, want);
+
+    ndev->mergeable = !!(features & VIRTIO_NET_F_MRG_RXBUF);
+    ndev->hdr_len = sizeof(struct virtio_net_hdr);
+    if ((dev->features & (1ULL << VIRTIO_F_VERSION_1)) == 0 && !ndev->mergeable)
+        ndev->hdr_len -= sizeof(uint16_t);
+
+    if (features & VIRTIO_NET_F_CSUM)
+        ndev->offload |= MINIP_OFFLOAD_TX_CSUM;
+    if (features & VIRTIO_NET_F_HOST_TSO4)
+        ndev->offload |= MINIP_OFFLOAD_TSO4;
+
+    /* every pktbuf goes in its own descriptor, and rx buffers are only ever lent to the stack */
+    ndev->offload |= MINIP_OFFLOAD_SG | MINIP_OFFLOAD_RX_KEEP;
+
+    ndev->queue_count = 1;
+    if (features & VIRTIO_NET_F_MQ) {
+        ndev->queue_count = MIN(max_pairs, (uint)VIRTIO_NET_MAX_QUEUES);
+        ndev->ctrl_ring = RING_RX(max_pairs);
+    }
+
+    /* allocate the virtio rings, modern devices want them before DRIVER_OK */
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        virtio_alloc_ring(dev, RING_RX(i), RX_RING_SIZE); // rx
+        virtio_alloc_ring(dev, RING_TX(i), TX_RING_SIZE); // tx
+    }
+    if (ndev->ctrl_ring >= 0) {
+        ndev->ctrl = memalign(8, sizeof(struct virtio_net_ctrl));
+        if (!ndev->ctrl || virtio_alloc_ring(dev, ndev->ctrl_ring, 4) < 0) {
+            free(ndev->ctrl);
+            ndev->ctrl = NULL;
+            ndev->ctrl_ring = -1;
+            ndev->queue_count = 1;
+        } else {
+#if WITH_KERNEL_VM
+            ndev->ctrl_phys = kvaddr_to_paddr(ndev->ctrl);
+#else
+            ndev->ctrl_phys = (paddr_t)ndev->ctrl;
+#endif
+        }
+    }
+
+    /* set our irq handler, rx rings are drained by their poll threads */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
+    dev->ring_poll_callback = &virtio_net_ring_poll_callback;
+    for (uint i = 0; i < ndev->queue_count; i++)
+        virtio_ring_set_polled(dev, RING_RX(i));
 
     /* set DRIVER_OK */
     virtio_status_driver_ok(dev);
 
-    /* allocate a pair of virtio rings */
-    virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
-    virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
+    /* the device starts out on the first pair until told otherwise */
+    if (ndev->queue_count > 1) {
+        status_t err = virtio_net_set_queue_pairs(ndev, ndev->queue_count);
+        if (err < 0) {
+            TRACEF("failed to enable %u queue pairs, err %d\n", ndev->queue_count, err);
+            ndev->queue_count = 1;
+        }
+    }
+
+    LTRACEF("%u queue pairs\n", ndev->queue_count);
 
     the_ndev = ndev;
 
@@ -185,23 +366,42 @@ status_t virtio_net_start(void)
 
     the_ndev->started = true;
 
-    /* start the rx worker thread */
-    thread_resume(thread_create("virtio_net_rx", &virtio_net_rx_worker, (void *)the_ndev, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
-
-    /* queue up a bunch of rxes */
-    for (uint i = 0; i < RX_RING_SIZE - 1; i++) {
-        pktbuf_t *p = pktbuf_alloc();
-        if (p) {
-            virtio_net_queue_rx(the_ndev, p);
+    minip_set_offload(the_ndev->offload);
+
+    uint rx_bufs = MIN(RX_RING_SIZE - 1, VIRTIO_NET_RX_BUFS / the_ndev->queue_count);
+
+    for (uint i = 0; i < the_ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &the_ndev->queue[i];
+
+        /* start the rx poll thread, next to the cpu that sends on this pair */
+        snprintf(q->rx_poll_name, sizeof(q->rx_poll_name), "virtio_net_rx %u", i);
+        status_t err = netpoll_init(&q->rx_poll, q->rx_poll_name, &virtio_net_rx_poll,
+                                    &virtio_net_rx_poll_done, q, 0, HIGH_PRIORITY);
+        if (err < 0)
+            return err;
+        if (the_ndev->queue_count > 1)
+            q->rx_poll.thread->pinned_cpu = i;
+        netpoll_start(&q->rx_poll);
+
+        /* queue up a bunch of rxes */
+        pktbuf_t *bufs[RX_RING_SIZE];
+        uint count = 0;
+        for (uint j = 0; j < rx_bufs; j++) {
+            bufs[count] = pktbuf_alloc();
+            if (bufs[count])
+                count++;
         }
+        virtio_net_queue_rx(q, bufs, count);
     }
 
     return NO_ERROR;
 }
 
-static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t *p2)
+static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_queue *q, pktbuf_t *p2)
 {
+    struct virtio_net_dev *ndev = q->ndev;
     struct virtio_device *vdev = ndev->dev;
+    uint ring = RING_TX(q->index);
 
     uint16_t i;
     pktbuf_t *p;
@@ -213,59 +413,113 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
         return ERR_NO_MEMORY;
 
     /* point our header to the base of the first pktbuf */
-    struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
+    struct virtio_net_hdr *hdr = pktbuf_append(p, ndev->hdr_len);
     memset(hdr, 0, p->dlen);
 
+    /* offloads minip asked for, offsets are from the start of the frame */
+    if (p2->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = p2->csum_start - (p2->data - p2->buffer);
+        hdr->csum_offset = p2->csum_offset;
+
+        if (p2->flags & PKTBUF_FLAG_GSO_TCPV4) {
+            const uint8_t *tcp = p2->buffer + p2->csum_start;
+
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            hdr->gso_size = p2->gso_size;
+            hdr->hdr_len = hdr->csum_start + (tcp[12] >> 4) * 4;
+        }
+    }
+
+    /* one descriptor for our header and one for each part of the packet */
+    uint count = 1;
+    for (const pktbuf_t *part = p2; part; part = part->next)
+        count++;
+
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->lock, state);
 
     /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
+    if (q->tx_pending_count + count > TX_RING_SIZE)
         goto nodesc;
 
     /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ring, count, &i);
     if (!desc) {
-        spin_unlock_irqrestore(&ndev->lock, state);
+        spin_unlock_irqrestore(&q->lock, state);
 
 nodesc:
-        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
+        TRACEF("out of virtio tx descriptors, queue %u tx_pending_count %u\n", q->index, q->tx_pending_count);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
-
-    /* save a pointer to our pktbufs for the irq handler to free */
-    LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
-    DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
-    ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[desc->next] = p2;
+    q->tx_pending_count += count;
 
     /* set up the descriptor pointing to the header */
+    LTRACEF("saving pointer to pkt in index %u\n", i);
+    DEBUG_ASSERT(q->pending_tx_packet[i] == NULL);
+    q->pending_tx_packet[i] = p;
     desc->addr = pktbuf_data_phys(p);
     desc->len = p->dlen;
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+    /* and then one pointing to each part, the irq handler frees them one at a time */
+    for (pktbuf_t *part = p2; part; ) {
+        pktbuf_t *next = part->next;
+        uint16_t index = desc->next;
 
-    /* submit the transfer */
-    virtio_submit_chain(vdev, RING_TX, i);
+        DEBUG_ASSERT(q->pending_tx_packet[index] == NULL);
+        q->pending_tx_packet[index] = part;
 
-    /* kick it off */
-    virtio_kick(vdev, RING_TX);
+        desc = virtio_desc_index_to_desc(vdev, ring, index);
+        desc->addr = pktbuf_data_phys(part);
+        desc->len = part->dlen;
+        desc->flags = next ? VRING_DESC_F_NEXT : 0;
+
+        part = next;
+    }
+
+    /* submit the transfer */
+    virtio_submit_chain(vdev, ring, i);
+
+    /* kick it off, once for a whole batch */
+    if (p2->flags & PKTBUF_FLAG_TX_MORE) {
+        q->tx_kick_pending = true;
+    } else {
+        virtio_kick(vdev, ring);
+        q->tx_kick_pending = false;
+    }
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->lock, state);
 
     return NO_ERROR;
 }
 
+/* notify the device about anything a batch left sitting in a tx ring. the sender
+ * may have changed cpus partway through, so it could be any of them. */
+static void virtio_net_flush_tx(struct virtio_net_dev *ndev)
+{
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&q->lock, state);
+        if (q->tx_kick_pending) {
+            virtio_kick(ndev->dev, RING_TX(q->index));
+            q->tx_kick_pending = false;
+        }
+        spin_unlock_irqrestore(&q->lock, state);
+    }
+}
+
+/* pick the pair for the cpu we're on. it doesn't matter if we move, each pair has its own lock */
+static struct virtio_net_queue *virtio_net_tx_queue(struct virtio_net_dev *ndev)
+{
+    return &ndev->queue[arch_curr_cpu_num() % ndev->queue_count];
+}
+
 /* variant of the above function that copies the buffer into a pktbuf before sending */
 static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf, size_t len)
 {
@@ -282,7 +536,7 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     memcpy(p->data, buf, len);
 
     /* call through to the variant of the function that takes a pre-populated pktbuf */
-    status_t err = virtio_net_queue_tx_pktbuf(ndev, p);
+    status_t err = virtio_net_queue_tx_pktbuf(virtio_net_tx_queue(ndev), p);
     if (err < 0) {
         pktbuf_free(p, true);
     }
@@ -290,46 +544,60 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     return err;
 }
 
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
+/* post a batch of rx buffers, kicking the device once for all of them */
+static void virtio_net_queue_rx(struct virtio_net_queue *q, pktbuf_t **bufs, uint count)
 {
+    struct virtio_net_dev *ndev = q->ndev;
     struct virtio_device *vdev = ndev->dev;
+    uint ring = RING_RX(q->index);
 
     DEBUG_ASSERT(ndev);
-    DEBUG_ASSERT(p);
 
-    /* point our header to the base of the pktbuf */
-    p->data = p->buffer;
-    struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
+    if (count == 0)
+        return;
+
+    for (uint j = 0; j < count; j++) {
+        pktbuf_t *p = bufs[j];
+        DEBUG_ASSERT(p);
 
-    p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+        /* point our header to the base of the pktbuf */
+        p->data = p->buffer;
+        struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
+        memset(hdr, 0, ndev->hdr_len);
+
+        /* mergeable buffers hand the device the whole thing, otherwise a full frame has to fit */
+        p->dlen = ndev->mergeable ? p->blen : ndev->hdr_len + VIRTIO_NET_MSS;
+        p->flags &= ~(PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
+    }
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&ndev->lock, state);
+    spin_lock_irqsave(&q->lock, state);
 
-    /* allocate a chain of descriptors for our transfer */
-    uint16_t i;
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_RX, 1, &i);
-    DEBUG_ASSERT(desc); /* shouldn't be possible not to have a descriptor ready */
+    for (uint j = 0; j < count; j++) {
+        pktbuf_t *p = bufs[j];
 
-    /* save a pointer to our pktbufs for the irq handler to use */
-    DEBUG_ASSERT(ndev->pending_rx_packet[i] == NULL);
-    ndev->pending_rx_packet[i] = p;
+        /* allocate a chain of descriptors for our transfer */
+        uint16_t i;
+        struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ring, 1, &i);
+        DEBUG_ASSERT(desc); /* shouldn't be possible not to have a descriptor ready */
 
-    /* set up the descriptor pointing to the header */
-    desc->addr = pktbuf_data_phys(p);
-    desc->len = p->dlen;
-    desc->flags = VRING_DESC_F_WRITE;
+        /* save a pointer to our pktbufs for the irq handler to use */
+        DEBUG_ASSERT(q->pending_rx_packet[i] == NULL);
+        q->pending_rx_packet[i] = p;
 
-    /* submit the transfer */
-    virtio_submit_chain(vdev, RING_RX, i);
+        /* set up the descriptor pointing to the buffer */
+        desc->addr = pktbuf_data_phys(p);
+        desc->len = p->dlen;
+        desc->flags = VRING_DESC_F_WRITE;
 
-    /* kick it off */
-    virtio_kick(vdev, RING_RX);
+        /* submit the transfer */
+        virtio_submit_chain(vdev, ring, i);
+    }
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    /* kick it off */
+    virtio_kick(vdev, ring);
 
-    return NO_ERROR;
+    spin_unlock_irqrestore(&q->lock, state);
 }
 
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
@@ -338,7 +606,28 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    spin_lock(&ndev->lock);
+    /* a finished control command, only ever one outstanding */
+    if ((int)ring == ndev->ctrl_ring) {
+        uint16_t i = e->id;
+        for (;;) {
+            struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
+            bool next = desc->flags & VRING_DESC_F_NEXT;
+            uint16_t next_i = desc->next;
+
+            virtio_free_desc(dev, ring, i);
+            if (!next)
+                break;
+            i = next_i;
+        }
+        ndev->ctrl_done = true;
+
+        return INT_NO_RESCHEDULE;
+    }
+
+    struct virtio_net_queue *q = &ndev->queue[ring / 2];
+    bool rx = (ring == RING_RX(q->index));
+
+    spin_lock(&q->lock);
 
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
@@ -355,28 +644,28 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
         virtio_free_desc(dev, ring, i);
 
-        if (ring == RING_RX) {
+        if (rx) {
             /* put the freed rx buffer in a queue */
-            pktbuf_t *p = ndev->pending_rx_packet[i];
-            ndev->pending_rx_packet[i] = NULL;
+            pktbuf_t *p = q->pending_rx_packet[i];
+            q->pending_rx_packet[i] = NULL;
 
             DEBUG_ASSERT(p);
             LTRACEF("rx pktbuf %p filled\n", p);
 
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > p->dlen) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
                 p->dlen = e->len;
             }
 
-            list_add_tail(&ndev->completed_rx_queue, &p->list);
-        } else { // ring == RING_TX
+            list_add_tail(&q->completed_rx_queue, &p->list);
+        } else {
             /* free the pktbuf associated with the tx packet we just consumed */
-            pktbuf_t *p = ndev->pending_tx_packet[i];
-            ndev->pending_tx_packet[i] = NULL;
-            ndev->tx_pending_count--;
+            pktbuf_t *p = q->pending_tx_packet[i];
+            q->pending_tx_packet[i] = NULL;
+            q->tx_pending_count--;
 
             DEBUG_ASSERT(p);
             LTRACEF("freeing pktbuf %p\n", p);
@@ -389,49 +678,111 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
         i = next;
     }
 
-    spin_unlock(&ndev->lock);
-
-    /* if rx ring, signal our event */
-    if (ring == 0) {
-        event_signal(&ndev->rx_event, false);
-    }
+    spin_unlock(&q->lock);
 
     return INT_RESCHEDULE;
 }
 
-static int virtio_net_rx_worker(void *arg)
+/* an rx interrupt, its ring is masked until the poll thread has drained it */
+static enum handler_return virtio_net_ring_poll_callback(struct virtio_device *dev, uint ring)
 {
-    struct virtio_net_dev *ndev = (struct virtio_net_dev *)arg;
+    struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
 
-    for (;;) {
-        event_wait(&ndev->rx_event);
+    return netpoll_schedule(&ndev->queue[ring / 2].rx_poll);
+}
 
-        /* pull some packets from the received queue */
-        for (;;) {
-            spin_lock_saved_state_t state;
-            spin_lock_irqsave(&ndev->lock, state);
+static int virtio_net_rx_poll(void *arg, int budget)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *)arg;
+    struct virtio_net_dev *ndev = q->ndev;
+
+    /* take up to budget finished buffers off the ring, the irq callback queues them for us */
+    uint count = virtio_poll_ring(ndev->dev, RING_RX(q->index), budget);
 
-            pktbuf_t *p = list_remove_head_type(&ndev->completed_rx_queue, pktbuf_t, list);
+    /* pull the packets from the received queue */
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&q->lock, state);
 
-            spin_unlock_irqrestore(&ndev->lock, state);
+        pktbuf_t *p = list_remove_head_type(&q->completed_rx_queue, pktbuf_t, list);
 
-            if (!p)
-                break; /* nothing left in the queue, go back to waiting */
+        spin_unlock_irqrestore(&q->lock, state);
 
-            LTRACEF("got packet len %u\n", p->dlen);
+        if (!p)
+            break;
 
+        LTRACEF("got packet len %u\n", p->dlen);
+
+        if (q->merge_left > 0) {
+            /* the rest of a packet, which carries no header of its own */
+            pktbuf_t *merge = q->merge;
+            if (merge) {
+                if (pktbuf_avail_tail(merge) >= p->dlen) {
+                    pktbuf_append_data(merge, p->data, p->dlen);
+                } else {
+                    pktbuf_free(merge, true);
+                    q->merge = merge = NULL;
+                }
+            }
+            if (--q->merge_left == 0 && merge) {
+                minip_rx_driver_callback(merge);
+                pktbuf_free(merge, true);
+                q->merge = NULL;
+            }
+        } else {
             /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
+            struct virtio_net_hdr *hdr = pktbuf_consume(p, ndev->hdr_len);
             if (hdr) {
-                /* call up into the stack */
-                minip_rx_driver_callback(p);
+                uint num_buffers = ndev->mergeable ? hdr->num_buffers : 1;
+
+                /* the device checked it, or it came from the host and never had one */
+                uint32_t good = 0;
+                if (hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))
+                    good = PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+
+                if (num_buffers <= 1) {
+                    /* call up into the stack */
+                    p->flags |= good;
+                    minip_rx_driver_callback(p);
+                } else {
+                    /* copy it out into a big enough buffer, dropped if there isn't one */
+                    q->merge = pktbuf_alloc_large();
+                    if (q->merge) {
+                        q->merge->flags |= good;
+                        pktbuf_append_data(q->merge, p->data, p->dlen);
+                    }
+                    q->merge_left = num_buffers - 1;
+                }
             }
+        }
+
+        /* the stack kept this one, give the device a new one in its place */
+        if (p->ref > 1) {
+            pktbuf_free(p, false);
+            p = pktbuf_alloc();
+            if (!p)
+                continue;
+        }
 
-            /* requeue the pktbuf in the rx queue */
-            virtio_net_queue_rx(ndev, p);
+        /* requeue the pktbuf in the rx queue, a batch at a time */
+        q->refill[q->refill_count++] = p;
+        if (q->refill_count == countof(q->refill)) {
+            virtio_net_queue_rx(q, q->refill, q->refill_count);
+            q->refill_count = 0;
         }
     }
-    return 0;
+
+    virtio_net_queue_rx(q, q->refill, q->refill_count);
+    q->refill_count = 0;
+
+    return count;
+}
+
+static bool virtio_net_rx_poll_done(void *arg)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *)arg;
+
+    return virtio_ring_unmask(q->ndev->dev, RING_RX(q->index));
 }
 
 int virtio_net_found(void)
@@ -455,17 +806,17 @@ status_t virtio_net_send_minip_pkt(pktbuf_t *p)
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
+    bool more = p->flags & PKTBUF_FLAG_TX_MORE;
 
-        return ERR_NOT_IMPLEMENTED;
+    /* hand the pktbufs off to the nic, it owns them from now on out unless it fails */
+    status_t err = virtio_net_queue_tx_pktbuf(virtio_net_tx_queue(the_ndev), p);
+    if (err < 0) {
+        pktbuf_free_chain(p, true);
     }
 
-    /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
-    status_t err = virtio_net_queue_tx_pktbuf(the_ndev, p);
-    if (err < 0) {
-        pktbuf_free(p, true);
+    /* the end of a batch, or as far as it got */
+    if (!more || err < 0) {
+        virtio_net_flush_tx(the_ndev);
     }
 
     return err;
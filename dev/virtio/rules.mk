@@ -8,4 +8,10 @@ GLOBAL_INCLUDES += \
 MODULE_SRCS += \
 	$(LOCAL_DIR)/virtio.c
 
+# the pci transport sits on the pc platform's config space accessors
+ifeq ($(PLATFORM),pc)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/virtio_pci.c
+endif
+
 include make/module.mk
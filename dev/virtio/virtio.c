@@ -48,9 +48,15 @@
 #if WITH_DEV_VIRTIO_GPU
 #include <dev/virtio/gpu.h>
 #endif
+#if WITH_DEV_VIRTIO_CONSOLE
+#include <dev/virtio/console.h>
+#endif
 
 #define LOCAL_TRACE 0
 
+/* transport features we handle for every driver */
+#define VIRTIO_RING_FEATURES ((1u << VIRTIO_RING_F_INDIRECT_DESC) | (1u << VIRTIO_RING_F_EVENT_IDX))
+
 static struct virtio_device *devices;
 
 static void dump_mmio_config(const volatile struct virtio_mmio_config *mmio)
@@ -78,18 +84,118 @@ void virtio_dump_desc(const struct vring_desc *desc)
     printf("\tnext  0x%hhx\n", desc->next);
 }
 
-static enum handler_return virtio_mmio_irq(void *arg)
+/* hand the driver everything the host has finished on a ring, called with dev->lock held */
+static enum handler_return virtio_process_ring(struct virtio_device *dev, uint r)
 {
-    struct virtio_device *dev = (struct virtio_device *)arg;
-    LTRACEF("dev %p, index %u\n", dev, dev->index);
+    struct vring *ring = &dev->ring[r];
+    enum handler_return ret = INT_NO_RESCHEDULE;
 
-    uint32_t irq_status = dev->mmio_config->interrupt_status;
-    LTRACEF("status 0x%x\n", irq_status);
+    LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
+
+    for (;;) {
+        uint16_t cur_idx = ring->used->idx;
+        while (ring->last_used != cur_idx) {
+            LTRACEF("looking at idx %u\n", ring->last_used);
+
+            // process chain
+            struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+            LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+
+            DEBUG_ASSERT(dev->irq_driver_callback);
+            ret |= dev->irq_driver_callback(dev, r, used_elem);
+
+            ring->last_used++;
+        }
+
+        if (!ring->event_idx)
+            break;
+
+        /* ask for an interrupt on the next completion, then pick up any that
+         * landed before the host could have seen the request */
+        vring_used_event(ring) = ring->last_used;
+        DSB;
+        if (ring->used->idx == ring->last_used)
+            break;
+    }
+
+    return ret;
+}
+
+static void virtio_ring_mask_locked(struct vring *ring)
+{
+    ring->masked = true;
+
+    /* with the event index there's no interrupt until used_event moves on again */
+    if (!ring->event_idx)
+        ring->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+void virtio_ring_set_polled(struct virtio_device *dev, uint ring_index)
+{
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+    DEBUG_ASSERT(dev->ring_poll_callback);
+
+    dev->ring[ring_index].polled = true;
+}
+
+uint virtio_poll_ring(struct virtio_device *dev, uint ring_index, uint budget)
+{
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+
+    struct vring *ring = &dev->ring[ring_index];
+    uint count = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->lock, state);
+
+    while (count < budget && ring->last_used != ring->used->idx) {
+        struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+        LTRACEF("ring %u: id %u, len %u\n", ring_index, used_elem->id, used_elem->len);
+
+        dev->irq_driver_callback(dev, ring_index, used_elem);
+
+        ring->last_used++;
+        count++;
+    }
+
+    spin_unlock_irqrestore(&dev->lock, state);
+
+    return count;
+}
+
+bool virtio_ring_unmask(struct virtio_device *dev, uint ring_index)
+{
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+
+    struct vring *ring = &dev->ring[ring_index];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->lock, state);
+
+    ring->masked = false;
+    if (ring->event_idx)
+        vring_used_event(ring) = ring->last_used;
+    else
+        ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+
+    /* anything that landed before the host saw that won't interrupt, keep polling */
+    DSB;
+    bool empty = (ring->used->idx == ring->last_used);
+    if (!empty)
+        virtio_ring_mask_locked(ring);
+
+    spin_unlock_irqrestore(&dev->lock, state);
+
+    return empty;
+}
+
+enum handler_return virtio_handle_irq(struct virtio_device *dev, uint32_t irq_status)
+{
+    LTRACEF("dev %p, index %u, status 0x%x\n", dev, dev->index, irq_status);
 
     enum handler_return ret = INT_NO_RESCHEDULE;
-    if (irq_status & 0x1) { /* used ring update */
-        // XXX is this safe?
-        dev->mmio_config->interrupt_ack = 0x1;
+    if (irq_status & VIRTIO_IRQ_RING) { /* used ring update */
+        spin_lock(&dev->lock);
 
         /* cycle through all the active rings */
         for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
@@ -97,26 +203,21 @@ static enum handler_return virtio_mmio_irq(void *arg)
                 continue;
 
             struct vring *ring = &dev->ring[r];
-            LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
-
-            uint cur_idx = ring->used->idx;
-            for (uint i = ring->last_used; i != (cur_idx & ring->num_mask); i = (i + 1) & ring->num_mask) {
-                LTRACEF("looking at idx %u\n", i);
-
-                // process chain
-                struct vring_used_elem *used_elem = &ring->used->ring[i];
-                LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
-
-                DEBUG_ASSERT(dev->irq_driver_callback);
-                ret |= dev->irq_driver_callback(dev, r, used_elem);
-
-                ring->last_used = (ring->last_used + 1) & ring->num_mask;
+            if (ring->polled) {
+                /* the driver's poll routine does the work, just wake it up */
+                if (!ring->masked && ring->used->idx != ring->last_used) {
+                    virtio_ring_mask_locked(ring);
+                    ret |= dev->ring_poll_callback(dev, r);
+                }
+                continue;
             }
+
+            ret |= virtio_process_ring(dev, r);
         }
-    }
-    if (irq_status & 0x2) { /* config change */
-        dev->mmio_config->interrupt_ack = 0x2;
 
+        spin_unlock(&dev->lock);
+    }
+    if (irq_status & VIRTIO_IRQ_CONFIG) { /* config change */
         if (dev->config_change_callback) {
             ret |= dev->config_change_callback(dev);
         }
@@ -127,6 +228,136 @@ static enum handler_return virtio_mmio_irq(void *arg)
     return ret;
 }
 
+bool virtio_poll(struct virtio_device *dev, uint ring_index)
+{
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+
+    struct vring *ring = &dev->ring[ring_index];
+
+    /* cheap check before touching the lock, this gets called in a loop */
+    if (ring->used->idx == ring->last_used)
+        return false;
+
+    /* the callbacks expect to run like the irq handler would */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->lock, state);
+    bool any = (ring->used->idx != ring->last_used);
+    virtio_process_ring(dev, ring_index);
+    spin_unlock_irqrestore(&dev->lock, state);
+
+    return any;
+}
+
+static enum handler_return virtio_mmio_irq(void *arg)
+{
+    struct virtio_device *dev = (struct virtio_device *)arg;
+
+    uint32_t irq_status = dev->mmio_config->interrupt_status;
+
+    // XXX is this safe?
+    dev->mmio_config->interrupt_ack = irq_status;
+
+    return virtio_handle_irq(dev, irq_status);
+}
+
+static uint8_t virtio_mmio_get_status(struct virtio_device *dev)
+{
+    return dev->mmio_config->status;
+}
+
+static void virtio_mmio_set_status(struct virtio_device *dev, uint8_t status)
+{
+    dev->mmio_config->status = status;
+}
+
+static void virtio_mmio_set_features(struct virtio_device *dev, uint64_t features)
+{
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
+}
+
+static status_t virtio_mmio_setup_ring(struct virtio_device *dev, uint index, uint16_t len,
+                                       paddr_t desc, paddr_t avail, paddr_t used)
+{
+    /* legacy devices take the whole ring as one page aligned block */
+    DEBUG_ASSERT((desc % PAGE_SIZE) == 0);
+
+    dev->mmio_config->guest_page_size = PAGE_SIZE;
+    dev->mmio_config->queue_sel = index;
+    dev->mmio_config->queue_num = len;
+    dev->mmio_config->queue_align = PAGE_SIZE;
+    dev->mmio_config->queue_pfn = desc / PAGE_SIZE;
+
+    return NO_ERROR;
+}
+
+static void virtio_mmio_notify(struct virtio_device *dev, uint index)
+{
+    dev->mmio_config->queue_notify = index;
+}
+
+static const struct virtio_transport_ops virtio_mmio_ops = {
+    .get_status = virtio_mmio_get_status,
+    .set_status = virtio_mmio_set_status,
+    .set_features = virtio_mmio_set_features,
+    .setup_ring = virtio_mmio_setup_ring,
+    .notify = virtio_mmio_notify,
+};
+
+bool virtio_probe_device(struct virtio_device *dev, uint32_t device_id, uint32_t host_features)
+{
+    status_t err = ERR_NOT_FOUND;
+
+    LTRACEF("dev %p, device_id %u, host_features 0x%x\n", dev, device_id, host_features);
+
+    spin_lock_init(&dev->lock);
+
+#if WITH_DEV_VIRTIO_BLOCK
+    if (device_id == 2) { // block device
+        LTRACEF("found block device\n");
+
+        err = virtio_block_init(dev, host_features);
+    }
+#endif // WITH_DEV_VIRTIO_BLOCK
+#if WITH_DEV_VIRTIO_NET
+    if (device_id == 1) { // network device
+        LTRACEF("found net device\n");
+
+        err = virtio_net_init(dev, host_features);
+    }
+#endif // WITH_DEV_VIRTIO_NET
+#if WITH_DEV_VIRTIO_CONSOLE
+    if (device_id == 3) { // console
+        LTRACEF("found console device\n");
+
+        err = virtio_console_init(dev, host_features);
+    }
+#endif // WITH_DEV_VIRTIO_CONSOLE
+#if WITH_DEV_VIRTIO_GPU
+    if (device_id == 0x10) { // virtio-gpu
+        LTRACEF("found gpu device\n");
+
+        err = virtio_gpu_init(dev, host_features);
+    }
+#endif // WITH_DEV_VIRTIO_GPU
+
+    if (err < 0)
+        return false;
+
+    // good device
+    dev->valid = true;
+
+    if (dev->irq_driver_callback)
+        unmask_interrupt(dev->irq);
+
+#if WITH_DEV_VIRTIO_GPU
+    if (device_id == 0x10)
+        virtio_gpu_start(dev);
+#endif
+
+    return true;
+}
+
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 {
     LTRACEF("ptr %p, count %u\n", ptr, count);
@@ -164,76 +395,14 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
         }
 #endif
 
-#if WITH_DEV_VIRTIO_BLOCK
-        if (mmio->device_id == 2) { // block device
-            LTRACEF("found block device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_block_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-
-                // XXX quick test code, remove
-#if 0
-                uint8_t buf[512];
-                memset(buf, 0x99, sizeof(buf));
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-
-                buf[0]++;
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), true);
-
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-#endif
-            }
-
-        }
-#endif // WITH_DEV_VIRTIO_BLOCK
-#if WITH_DEV_VIRTIO_NET
-        if (mmio->device_id == 1) { // network device
-            LTRACEF("found net device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_net_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_NET
-#if WITH_DEV_VIRTIO_GPU
-        if (mmio->device_id == 0x10) { // virtio-gpu
-            LTRACEF("found gpu device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_gpu_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
+        if (mmio->device_id == 0)
+            continue;
 
-                virtio_gpu_start(dev);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_GPU
+        dev->ops = &virtio_mmio_ops;
+        dev->mmio_config = mmio;
+        dev->config_ptr = (void *)mmio->config;
 
-        if (dev->valid)
+        if (virtio_probe_device(dev, mmio->device_id, mmio->host_features))
             found++;
     }
 
@@ -298,6 +467,35 @@ struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_
     return last;
 }
 
+struct vring_desc *virtio_alloc_desc_chain_indirect(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    DEBUG_ASSERT(ring->indirect);
+    DEBUG_ASSERT(count > 0 && count <= ring->indirect_max);
+
+    uint16_t i = virtio_alloc_desc(dev, ring_index);
+    if (i == 0xffff)
+        return NULL;
+
+    struct vring_desc *table = &ring->indirect[i * ring->indirect_max];
+    for (size_t j = 0; j < count; j++) {
+        table[j].flags = (j + 1 < count) ? VRING_DESC_F_NEXT : 0;
+        table[j].next = j + 1;
+    }
+
+    struct vring_desc *desc = &ring->desc[i];
+    desc->addr = ring->indirect_phys + i * ring->indirect_max * sizeof(struct vring_desc);
+    desc->len = count * sizeof(struct vring_desc);
+    desc->flags = VRING_DESC_F_INDIRECT;
+    desc->next = 0;
+
+    if (start_index)
+        *start_index = i;
+
+    return table;
+}
+
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     LTRACEF("dev %p, ring %u, desc %u\n", dev, ring_index, desc_index);
@@ -318,8 +516,45 @@ void virtio_kick(struct virtio_device *dev, uint ring_index)
 {
     LTRACEF("dev %p, ring %u\n", dev, ring_index);
 
-    dev->mmio_config->queue_notify = ring_index;
+    struct vring *ring = &dev->ring[ring_index];
+
+    /* the avail index has to be out before we look at what the host wants */
     DSB;
+
+    /* callers may race here, which at worst costs an extra notify: every kicker checks
+     * from an index no later than the last one actually checked up to */
+    uint16_t new_idx = ring->avail->idx;
+    uint16_t old_idx = ring->last_kick;
+    ring->last_kick = new_idx;
+
+    if (ring->event_idx) {
+        if (!vring_need_event(vring_avail_event(ring), new_idx, old_idx))
+            return;
+    } else if (ring->used->flags & VRING_USED_F_NO_NOTIFY) {
+        return;
+    }
+
+    dev->ops->notify(dev, ring_index);
+    DSB;
+}
+
+uint32_t virtio_negotiate_features(struct virtio_device *dev, uint32_t host_features, uint32_t driver_features)
+{
+    uint32_t features = host_features & (driver_features | VIRTIO_RING_FEATURES);
+
+    LTRACEF("dev %p, host 0x%x, driver 0x%x, accepted 0x%x\n", dev, host_features, driver_features, features);
+
+    dev->features = features | dev->transport_features;
+    dev->ops->set_features(dev, dev->features);
+
+    /* modern devices get a chance to turn the set down */
+    if (dev->features & (1ULL << VIRTIO_F_VERSION_1)) {
+        dev->ops->set_status(dev, dev->ops->get_status(dev) | VIRTIO_STATUS_FEATURES_OK);
+        if ((dev->ops->get_status(dev) & VIRTIO_STATUS_FEATURES_OK) == 0)
+            TRACEF("dev %p did not accept features 0x%llx\n", dev, dev->features);
+    }
+
+    return features;
 }
 
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
@@ -341,7 +576,7 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 
 #if WITH_KERNEL_VM
     void *vptr;
-    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_ring", size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_ring", size, &vptr, 0, VMM_FLAG_ZERO, ARCH_MMU_FLAG_UNCACHED_DEVICE);
     if (err < 0)
         return ERR_NO_MEMORY;
 
@@ -371,6 +606,7 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     vring_init(ring, len, vptr, PAGE_SIZE);
     dev->ring[index].free_list = 0xffff;
     dev->ring[index].free_count = 0;
+    ring->event_idx = !!(dev->features & (1u << VIRTIO_RING_F_EVENT_IDX));
 
     /* add all the descriptors to the free list */
     for (uint i = 0; i < len; i++) {
@@ -378,12 +614,12 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     }
 
     /* register the ring with the device */
-    DEBUG_ASSERT(dev->mmio_config);
-    dev->mmio_config->guest_page_size = PAGE_SIZE;
-    dev->mmio_config->queue_sel = index;
-    dev->mmio_config->queue_num = len;
-    dev->mmio_config->queue_align = PAGE_SIZE;
-    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+    DEBUG_ASSERT(dev->ops);
+    status_t serr = dev->ops->setup_ring(dev, index, len, pa,
+                                         pa + ((uintptr_t)ring->avail - (uintptr_t)vptr),
+                                         pa + ((uintptr_t)ring->used - (uintptr_t)vptr));
+    if (serr < 0)
+        return serr;
 
     /* mark the ring active */
     dev->active_rings_bitmap |= (1 << index);
@@ -391,19 +627,61 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     return NO_ERROR;
 }
 
+status_t virtio_alloc_indirect(struct virtio_device *dev, uint ring_index, uint16_t max_descs)
+{
+    LTRACEF("dev %p, ring %u, max_descs %u\n", dev, ring_index, max_descs);
+
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+    DEBUG_ASSERT(dev->active_rings_bitmap & (1 << ring_index));
+    DEBUG_ASSERT(max_descs > 0);
+
+    if ((dev->features & (1u << VIRTIO_RING_F_INDIRECT_DESC)) == 0)
+        return ERR_NOT_SUPPORTED;
+
+    struct vring *ring = &dev->ring[ring_index];
+    size_t size = ROUNDUP(ring->num * max_descs * sizeof(struct vring_desc), PAGE_SIZE);
+
+#if WITH_KERNEL_VM
+    void *vptr;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_indirect", size, &vptr, 0, VMM_FLAG_ZERO, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0)
+        return ERR_NO_MEMORY;
+
+    paddr_t pa;
+    err = arch_mmu_query((vaddr_t)vptr, &pa, NULL);
+    if (err < 0)
+        return ERR_NO_MEMORY;
+#else
+    void *vptr = memalign(PAGE_SIZE, size);
+    if (!vptr)
+        return ERR_NO_MEMORY;
+
+    memset(vptr, 0, size);
+    paddr_t pa = (paddr_t)vptr;
+#endif
+
+    LTRACEF("indirect tables at va %p pa 0x%lx\n", vptr, pa);
+
+    ring->indirect = vptr;
+    ring->indirect_phys = pa;
+    ring->indirect_max = max_descs;
+
+    return NO_ERROR;
+}
+
 void virtio_reset_device(struct virtio_device *dev)
 {
-    dev->mmio_config->status = 0;
+    dev->ops->set_status(dev, 0);
 }
 
 void virtio_status_acknowledge_driver(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    dev->ops->set_status(dev, dev->ops->get_status(dev) | VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
 }
 
 void virtio_status_driver_ok(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
+    dev->ops->set_status(dev, dev->ops->get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
 }
 
 void virtio_init(uint level)
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <dev/virtio.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <reg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <dev/pci.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/vm.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+
+#include "virtio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* virtio 1.0 pci transport. the device describes where its register blocks live
+ * with vendor capabilities. we run off the legacy interrupt pin.
+ */
+
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+
+#define PCI_CAP_ID_VENDOR 0x09
+
+/* vendor capability cfg_type */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+struct virtio_pci_cap {
+    uint8_t cap_vndr;
+    uint8_t cap_next;
+    uint8_t cap_len;
+    uint8_t cfg_type;
+    uint8_t bar;
+    uint8_t padding[3];
+    uint32_t offset;
+    uint32_t length;
+} __PACKED;
+
+struct virtio_pci_common_cfg {
+/* 0x00 */  uint32_t device_feature_select;
+            uint32_t device_feature;
+            uint32_t driver_feature_select;
+            uint32_t driver_feature;
+/* 0x10 */  uint16_t msix_config;
+            uint16_t num_queues;
+            uint8_t device_status;
+            uint8_t config_generation;
+            uint16_t queue_select;
+            uint16_t queue_size;
+            uint16_t queue_msix_vector;
+            uint16_t queue_enable;
+            uint16_t queue_notify_off;
+/* 0x20 */  uint32_t queue_desc_lo;
+            uint32_t queue_desc_hi;
+            uint32_t queue_driver_lo;
+            uint32_t queue_driver_hi;
+/* 0x30 */  uint32_t queue_device_lo;
+            uint32_t queue_device_hi;
+};
+
+STATIC_ASSERT(sizeof(struct virtio_pci_common_cfg) == 0x38);
+
+/* pci ids, modern devices are 0x1040 + the virtio device id */
+static const struct {
+    uint16_t pci_id;
+    uint16_t device_id;
+} virtio_pci_ids[] = {
+    { 0x1000, 1 },      // transitional net
+    { 0x1001, 2 },      // transitional block
+    { 0x1003, 3 },      // transitional console
+    { 0x1041, 1 },      // net
+    { 0x1042, 2 },      // block
+    { 0x1043, 3 },      // console
+    { 0x1050, 0x10 },   // gpu
+};
+
+struct virtio_pci_dev {
+    struct virtio_device dev;
+    struct list_node node;
+
+    pci_location_t loc;
+
+    volatile struct virtio_pci_common_cfg *common;
+    volatile uint8_t *isr;
+    volatile uint8_t *notify_base;
+    uint32_t notify_mult;
+    uint16_t notify_off[MAX_VIRTIO_RINGS];
+};
+
+/* every device we've found, legacy pins are shared so the irq handler looks at all of them */
+static struct list_node virtio_pci_list = LIST_INITIAL_VALUE(virtio_pci_list);
+static uint16_t virtio_pci_irq_registered;
+static uint virtio_pci_found_index;
+
+static inline struct virtio_pci_dev *to_pci_dev(struct virtio_device *dev)
+{
+    return (struct virtio_pci_dev *)dev->transport;
+}
+
+static uint8_t virtio_pci_get_status(struct virtio_device *dev)
+{
+    return to_pci_dev(dev)->common->device_status;
+}
+
+static void virtio_pci_set_status(struct virtio_device *dev, uint8_t status)
+{
+    volatile struct virtio_pci_common_cfg *common = to_pci_dev(dev)->common;
+
+    common->device_status = status;
+
+    /* a reset isn't done until the device says so */
+    if (status == 0) {
+        while (common->device_status != 0)
+            thread_yield();
+    }
+}
+
+static void virtio_pci_set_features(struct virtio_device *dev, uint64_t features)
+{
+    volatile struct virtio_pci_common_cfg *common = to_pci_dev(dev)->common;
+
+    common->driver_feature_select = 0;
+    common->driver_feature = features;
+    common->driver_feature_select = 1;
+    common->driver_feature = features >> 32;
+}
+
+static status_t virtio_pci_setup_ring(struct virtio_device *dev, uint index, uint16_t len,
+                                      paddr_t desc, paddr_t avail, paddr_t used)
+{
+    struct virtio_pci_dev *pdev = to_pci_dev(dev);
+    volatile struct virtio_pci_common_cfg *common = pdev->common;
+
+    if (index >= common->num_queues)
+        return ERR_NOT_FOUND;
+
+    common->queue_select = index;
+    if (len > common->queue_size) {
+        TRACEF("ring %u len %u larger than device max %u\n", index, len, common->queue_size);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    common->queue_size = len;
+    common->queue_msix_vector = VIRTIO_MSI_NO_VECTOR;
+    common->queue_desc_lo = desc;
+    common->queue_desc_hi = (uint64_t)desc >> 32;
+    common->queue_driver_lo = avail;
+    common->queue_driver_hi = (uint64_t)avail >> 32;
+    common->queue_device_lo = used;
+    common->queue_device_hi = (uint64_t)used >> 32;
+    pdev->notify_off[index] = common->queue_notify_off;
+    common->queue_enable = 1;
+
+    return NO_ERROR;
+}
+
+static void virtio_pci_notify(struct virtio_device *dev, uint index)
+{
+    struct virtio_pci_dev *pdev = to_pci_dev(dev);
+
+    *REG16(pdev->notify_base + pdev->notify_off[index] * pdev->notify_mult) = index;
+}
+
+static const struct virtio_transport_ops virtio_pci_ops = {
+    .get_status = virtio_pci_get_status,
+    .set_status = virtio_pci_set_status,
+    .set_features = virtio_pci_set_features,
+    .setup_ring = virtio_pci_setup_ring,
+    .notify = virtio_pci_notify,
+};
+
+static enum handler_return virtio_pci_irq(void *arg)
+{
+    uint irq = (uintptr_t)arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    struct virtio_pci_dev *pdev;
+    list_for_every_entry(&virtio_pci_list, pdev, struct virtio_pci_dev, node) {
+        if (pdev->dev.irq != irq)
+            continue;
+
+        /* reading the isr acks it */
+        uint32_t irq_status = *pdev->isr;
+        if (irq_status)
+            ret |= virtio_handle_irq(&pdev->dev, irq_status);
+    }
+
+    return ret;
+}
+
+/* read a bar, following it into the next one if it's 64 bit. 0 if it isn't memory space */
+static paddr_t virtio_pci_bar(const pci_location_t *loc, uint bar)
+{
+    uint32_t lo, hi = 0;
+
+    if (bar >= 6 || pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES + bar * 4, &lo) != _PCI_SUCCESSFUL)
+        return 0;
+    if (lo & 1)
+        return 0;
+    if ((lo & 0x6) == 0x4 && bar < 5)
+        pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES + (bar + 1) * 4, &hi);
+
+    paddr_t base = lo & ~0xfU;
+    base |= (uint64_t)hi << 32;
+    return base;
+}
+
+/* map the region a capability points at */
+static void *virtio_pci_map_cap(const pci_location_t *loc, const struct virtio_pci_cap *cap)
+{
+    paddr_t base = virtio_pci_bar(loc, cap->bar);
+    if (base == 0)
+        return NULL;
+
+    paddr_t pa = base + cap->offset;
+#if WITH_KERNEL_VM
+    paddr_t map_base = ROUNDDOWN(pa, PAGE_SIZE);
+    size_t map_size = ROUNDUP(pa + cap->length, PAGE_SIZE) - map_base;
+
+    void *ptr;
+    if (vmm_alloc_physical(vmm_get_kernel_aspace(), "virtio pci", map_size, &ptr,
+                           PAGE_SIZE_SHIFT, map_base, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE) < 0)
+        return NULL;
+
+    return (uint8_t *)ptr + (pa - map_base);
+#else
+    return (void *)pa;
+#endif
+}
+
+static status_t virtio_pci_init_device(const pci_location_t *loc, uint32_t device_id)
+{
+    uint16_t command, status;
+    uint8_t irq, cap_ptr;
+
+    if (pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command) != _PCI_SUCCESSFUL ||
+            pci_read_config_half(loc, PCI_CONFIG_STATUS, &status) != _PCI_SUCCESSFUL ||
+            pci_read_config_byte(loc, PCI_CONFIG_INTERRUPT_LINE, &irq) != _PCI_SUCCESSFUL ||
+            pci_read_config_byte(loc, PCI_CONFIG_CAPABILITIES, &cap_ptr) != _PCI_SUCCESSFUL)
+        return ERR_IO;
+
+    if ((status & PCI_STATUS_NEW_CAPS) == 0 || irq >= 16) {
+        LTRACEF("unusable device, status 0x%x irq %u\n", status, irq);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    struct virtio_pci_dev *pdev = calloc(1, sizeof(struct virtio_pci_dev));
+    if (!pdev)
+        return ERR_NO_MEMORY;
+
+    pdev->loc = *loc;
+
+    /* walk the capabilities for the register blocks */
+    void *device_cfg = NULL;
+    for (uint n = 0; cap_ptr != 0 && n < 48; n++) {
+        struct virtio_pci_cap cap;
+        uint8_t *p = (uint8_t *)&cap;
+
+        cap_ptr &= ~3;
+        for (uint i = 0; i < sizeof(cap); i++)
+            pci_read_config_byte(loc, cap_ptr + i, &p[i]);
+
+        if (cap.cap_vndr == PCI_CAP_ID_VENDOR) {
+            LTRACEF("cap type %u bar %u offset 0x%x length 0x%x\n", cap.cfg_type, cap.bar, cap.offset, cap.length);
+
+            switch (cap.cfg_type) {
+                case VIRTIO_PCI_CAP_COMMON_CFG:
+                    if (!pdev->common)
+                        pdev->common = virtio_pci_map_cap(loc, &cap);
+                    break;
+                case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                    if (!pdev->notify_base) {
+                        pci_read_config_word(loc, cap_ptr + sizeof(cap), &pdev->notify_mult);
+                        pdev->notify_base = virtio_pci_map_cap(loc, &cap);
+                    }
+                    break;
+                case VIRTIO_PCI_CAP_ISR_CFG:
+                    if (!pdev->isr)
+                        pdev->isr = virtio_pci_map_cap(loc, &cap);
+                    break;
+                case VIRTIO_PCI_CAP_DEVICE_CFG:
+                    if (!device_cfg)
+                        device_cfg = virtio_pci_map_cap(loc, &cap);
+                    break;
+            }
+        }
+
+        cap_ptr = cap.cap_next;
+    }
+
+    /* legacy only devices don't have the modern register blocks */
+    if (!pdev->common || !pdev->notify_base || !pdev->isr || !device_cfg) {
+        LTRACEF("no modern interface, common %p notify %p isr %p device %p\n",
+                pdev->common, pdev->notify_base, pdev->isr, device_cfg);
+        free(pdev);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    /* memory space and dma on, and make sure the pin isn't masked */
+    command |= PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN;
+    command &= ~(1 << 10); // interrupt disable
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND, command);
+
+    struct virtio_device *dev = &pdev->dev;
+    dev->index = virtio_pci_found_index++;
+    dev->irq = INT_BASE + irq;
+    dev->ops = &virtio_pci_ops;
+    dev->transport = pdev;
+    dev->config_ptr = device_cfg;
+
+    /* start from scratch, and don't let config changes look for an msi-x vector */
+    virtio_reset_device(dev);
+    pdev->common->msix_config = VIRTIO_MSI_NO_VECTOR;
+
+    pdev->common->device_feature_select = 1;
+    uint32_t host_features_hi = pdev->common->device_feature;
+    pdev->common->device_feature_select = 0;
+    uint32_t host_features = pdev->common->device_feature;
+
+    if ((host_features_hi & (1U << (VIRTIO_F_VERSION_1 - 32))) == 0) {
+        LTRACEF("device doesn't offer VERSION_1\n");
+        free(pdev);
+        return ERR_NOT_SUPPORTED;
+    }
+    dev->transport_features = 1ULL << VIRTIO_F_VERSION_1;
+
+    LTRACEF("device %u at %02x:%02x irq %u features 0x%x:%08x\n",
+            device_id, loc->bus, loc->dev_fn, irq, host_features_hi, host_features);
+
+    /* the handler has to be in place before the driver can unmask it */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    list_add_tail(&virtio_pci_list, &pdev->node);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if ((virtio_pci_irq_registered & (1U << irq)) == 0) {
+        virtio_pci_irq_registered |= (1U << irq);
+        register_int_handler(dev->irq, &virtio_pci_irq, (void *)(uintptr_t)dev->irq);
+    }
+
+    if (!virtio_probe_device(dev, device_id, host_features)) {
+        /* leave it on the list, its isr reads back 0 */
+        virtio_reset_device(dev);
+        return ERR_NOT_FOUND;
+    }
+
+    return NO_ERROR;
+}
+
+int virtio_pci_detect(void)
+{
+    int found = 0;
+
+    for (uint i = 0; i < countof(virtio_pci_ids); i++) {
+        pci_location_t loc;
+
+        for (uint16_t index = 0; pci_find_pci_device(&loc, virtio_pci_ids[i].pci_id, VIRTIO_PCI_VENDOR_ID, index) == _PCI_SUCCESSFUL; index++) {
+            LTRACEF("found virtio pci id 0x%x at %02x:%02x\n", virtio_pci_ids[i].pci_id, loc.bus, loc.dev_fn);
+
+            if (virtio_pci_init_device(&loc, virtio_pci_ids[i].device_id) == NO_ERROR)
+                found++;
+        }
+    }
+
+    return found;
+}
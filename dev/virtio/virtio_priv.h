@@ -24,6 +24,35 @@
 
 #include <compiler.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <platform/interrupts.h>
+
+struct virtio_device;
+
+/* ring updates have to be ordered against the device seeing them, the code is
+ * written in terms of the arm barrier */
+#if ARCH_X86 || ARCH_X86_64
+#define DSB __asm__ volatile("mfence" ::: "memory")
+#endif
+
+/* the parts of talking to a device that differ between transports */
+struct virtio_transport_ops {
+    uint8_t (*get_status)(struct virtio_device *dev);
+    void (*set_status)(struct virtio_device *dev, uint8_t status);
+    void (*set_features)(struct virtio_device *dev, uint64_t features);
+    status_t (*setup_ring)(struct virtio_device *dev, uint index, uint16_t len,
+                           paddr_t desc, paddr_t avail, paddr_t used);
+    void (*notify)(struct virtio_device *dev, uint index);
+};
+
+/* hand a device to the driver for its type, returns true if the driver took it */
+bool virtio_probe_device(struct virtio_device *dev, uint32_t device_id, uint32_t host_features);
+
+/* common interrupt path, once the transport has read and acked the cause */
+enum handler_return virtio_handle_irq(struct virtio_device *dev, uint32_t irq_status);
+
+#define VIRTIO_IRQ_RING   (1<<0)
+#define VIRTIO_IRQ_CONFIG (1<<1)
 
 struct virtio_mmio_config {
 /* 0x00 */  uint32_t magic;
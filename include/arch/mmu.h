@@ -31,6 +31,7 @@ __BEGIN_CDECLS
 #define ARCH_MMU_FLAG_CACHED            (0<<0)
 #define ARCH_MMU_FLAG_UNCACHED          (1<<0)
 #define ARCH_MMU_FLAG_UNCACHED_DEVICE   (2<<0) /* only exists on some arches, otherwise UNCACHED */
+#define ARCH_MMU_FLAG_WRITE_COMBINE     (3<<0) /* normal uncached memory, only exists on some arches, otherwise UNCACHED */
 #define ARCH_MMU_FLAG_CACHE_MASK        (3<<0)
 
 #define ARCH_MMU_FLAG_PERM_USER         (1<<2)
@@ -48,5 +49,22 @@ vaddr_t arch_mmu_pick_spot(vaddr_t base, uint prev_region_arch_mmu_flags,
 
 void arch_disable_mmu(void);
 
+#if ARCH_HAS_ASPACE
+/* Arches with ARCH_HAS_ASPACE give each user aspace its own translation table,
+ * tagged so switching between them doesn't flush the tlb. The kernel stays
+ * mapped in all of them, and the calls above keep working on its table. */
+struct arch_aspace;
+
+status_t arch_mmu_init_aspace(struct arch_aspace *aspace, vaddr_t base, size_t size);
+status_t arch_mmu_destroy_aspace(struct arch_aspace *aspace);
+int arch_mmu_map_aspace(struct arch_aspace *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags);
+int arch_mmu_unmap_aspace(struct arch_aspace *aspace, vaddr_t vaddr, uint count);
+status_t arch_mmu_query_aspace(struct arch_aspace *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags);
+
+/* make aspace the one the current cpu translates user addresses with, NULL
+ * leaves just the kernel mapped. Called with interrupts disabled. */
+void arch_mmu_context_switch(struct arch_aspace *aspace);
+#endif
+
 __END_CDECLS
 
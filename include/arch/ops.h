@@ -64,6 +64,38 @@ void arch_clean_invalidate_cache_range(addr_t start, size_t len);
 void arch_invalidate_cache_range(addr_t start, size_t len);
 void arch_sync_cache_range(addr_t start, size_t len);
 
+/* one span of memory for the batched cache operations */
+struct arch_cache_range {
+    addr_t start;
+    size_t len;
+};
+
+/* the same as the single range calls on each span, with one barrier at the
+ * end, for drivers handing a list of buffers to a device at once */
+#if ARCH_HAS_CACHE_RANGES
+void arch_clean_cache_ranges(const struct arch_cache_range *ranges, uint count);
+void arch_clean_invalidate_cache_ranges(const struct arch_cache_range *ranges, uint count);
+void arch_invalidate_cache_ranges(const struct arch_cache_range *ranges, uint count);
+#else
+static inline void arch_clean_cache_ranges(const struct arch_cache_range *ranges, uint count)
+{
+    for (uint i = 0; i < count; i++)
+        arch_clean_cache_range(ranges[i].start, ranges[i].len);
+}
+
+static inline void arch_clean_invalidate_cache_ranges(const struct arch_cache_range *ranges, uint count)
+{
+    for (uint i = 0; i < count; i++)
+        arch_clean_invalidate_cache_range(ranges[i].start, ranges[i].len);
+}
+
+static inline void arch_invalidate_cache_ranges(const struct arch_cache_range *ranges, uint count)
+{
+    for (uint i = 0; i < count; i++)
+        arch_invalidate_cache_range(ranges[i].start, ranges[i].len);
+}
+#endif
+
 void arch_idle(void);
 
 __END_CDECLS
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Per cpu performance counter hooks behind kernel/pmu.h. Everything acts on
+ * the calling cpu with interrupts disabled. Arches without a pmu get the weak
+ * versions in kernel/pmu.c, which report no counters.
+ */
+
+/* general purpose counters available, 0 if there is no pmu */
+uint arch_pmu_counter_count(void);
+
+/* counters wrap at this mask, deltas are taken modulo it */
+uint64_t arch_pmu_counter_mask(void);
+
+/* whether arch_pmu_program() can count event at all */
+bool arch_pmu_event_supported(uint event);
+
+/* set counter n to count event (PMU_EVENT_*), zero it and start it */
+status_t arch_pmu_program(uint n, uint event);
+
+/* stop and disable every counter */
+void arch_pmu_disable(void);
+
+uint64_t arch_pmu_read(uint n);
+
+__END_CDECLS
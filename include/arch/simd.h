@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Vector units (neon, sse) for kernel code.
+ *
+ * Vector code goes between simd_begin() and simd_end(), which save whatever
+ * thread state is in the registers and put it back afterwards. The pair nests.
+ * Interrupts, and with them preemption, are off in between, so keep the work
+ * short or break it into chunks.
+ *
+ * Libraries build their vector variants when WITH_KERNEL_SIMD is set and pick
+ * them at run time with simd_available().
+ */
+#if WITH_KERNEL_SIMD
+bool simd_available(void);
+void simd_begin(void);
+void simd_end(void);
+#else
+static inline bool simd_available(void) { return false; }
+static inline void simd_begin(void) {}
+static inline void simd_end(void) {}
+#endif
+
+__END_CDECLS
@@ -46,6 +46,18 @@
 #define __ISCONSTANT(x) __builtin_constant_p(x)
 #define __NO_INLINE __attribute((noinline))
 #define __SRAM __NO_INLINE __SECTION(".sram.text")
+/* fast path and error path functions. gcc optimizes __HOT ones for speed and
+ * __COLD ones for size, treats branches to calls of __COLD ones as unlikely and
+ * puts them in .text.hot and .text.unlikely, which the linker scripts group
+ * together ahead of the rest of the text so the fast paths share cache lines */
+#define __HOT __attribute__((hot))
+#define __COLD __attribute__((cold))
+/* hot code and data, run out of tightly coupled memory on parts whose linker
+ * script puts it there and kept with the rest of the hot text otherwise. the
+ * text can't be a .text.* name or the rom .text would claim it first */
+#define __HOT_TEXT __HOT __SECTION(".tcm.text")
+#define __FAST_DATA __SECTION(".data.tcm")
+#define __FAST_BSS __SECTION(".bss.tcm")
 #define __CONSTRUCTOR __attribute__((constructor))
 #define __DESTRUCTOR __attribute__((destructor))
 #define __OPTIMIZE(x) __attribute__((optimize(x)))
@@ -139,6 +151,11 @@
 #define __PRINTFLIKE(__fmt,__varargs)
 #define __SCANFLIKE(__fmt,__varargs)
 #define __SECTION(x)
+#define __HOT
+#define __COLD
+#define __HOT_TEXT
+#define __FAST_DATA
+#define __FAST_BSS
 #define __PURE
 #define __CONST
 #define __NONNULL(x)
@@ -57,8 +57,8 @@ int _dprintf(const char *fmt, ...) __PRINTFLIKE(1, 2);
 FILE get_panic_fd(void);
 
 /* dump memory */
-void hexdump(const void *ptr, size_t len);
-void hexdump8_ex(const void *ptr, size_t len, uint64_t disp_addr_start);
+void hexdump(const void *ptr, size_t len) __COLD;
+void hexdump8_ex(const void *ptr, size_t len, uint64_t disp_addr_start) __COLD;
 
 #else
 
@@ -83,7 +83,7 @@ void unregister_print_callback(print_callback_t *cb);
 #define dprintf(level, x...) do { if ((level) <= LK_DEBUGLEVEL) { _dprintf(x); } } while (0)
 
 /* systemwide halts */
-void _panic(void *caller, const char *fmt, ...) __PRINTFLIKE(2, 3) __NO_RETURN;
+void _panic(void *caller, const char *fmt, ...) __PRINTFLIKE(2, 3) __NO_RETURN __COLD;
 #define panic(x...) _panic(__GET_CALLER(), x)
 
 #define PANIC_UNIMPLEMENTED panic("%s unimplemented\n", __PRETTY_FUNCTION__)
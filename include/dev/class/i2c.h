@@ -24,7 +24,42 @@
 #define __DEV_CLASS_I2C_H
 
 #include <compiler.h>
+#include <list.h>
 #include <dev/driver.h>
+#include <kernel/event.h>
+
+/* i2c transaction flags */
+enum i2c_flags {
+	I2C_READ = (1<<0), /* read into buf, otherwise buf is written */
+};
+
+/* one transfer to or from a device. consecutive transactions in a request
+ * are joined with a repeated start, the bus is stopped after the last one.
+ */
+struct i2c_transaction {
+	uint8_t addr;
+	enum i2c_flags flags;
+	void *buf;
+	size_t len;
+};
+
+/* a list of transactions completed asynchronously, see struct spi_request */
+struct i2c_request;
+typedef void (*i2c_callback_t)(struct i2c_request *req);
+
+typedef struct i2c_request {
+	struct i2c_transaction *txn;
+	size_t count;
+	i2c_callback_t callback;
+	void *arg;
+
+	/* NO_ERROR or the error that stopped the request */
+	status_t result;
+
+	/* owned by the driver while the request is outstanding */
+	struct list_node node;
+	event_t event;
+} i2c_request_t;
 
 /* i2c interface */
 struct i2c_ops {
@@ -35,6 +70,11 @@ struct i2c_ops {
 
 	status_t (*write_reg)(struct device *dev, uint8_t addr, uint8_t reg, uint8_t value);
 	status_t (*read_reg)(struct device *dev, uint8_t addr, uint8_t reg, void *value);
+
+	/* queue a request, drivers call class_i2c_request_complete when it finishes.
+	 * drivers that implement this may leave the synchronous ops unset.
+	 */
+	status_t (*submit)(struct device *dev, struct i2c_request *req);
 };
 
 __BEGIN_CDECLS
@@ -44,6 +84,14 @@ status_t class_i2c_read(struct device *dev, uint8_t addr, void *buf, size_t len)
 status_t class_i2c_write_reg(struct device *dev, uint8_t addr, uint8_t reg, uint8_t value);
 status_t class_i2c_read_reg(struct device *dev, uint8_t addr, uint8_t reg, void *value);
 
+void class_i2c_request_init(struct i2c_request *req, struct i2c_transaction *txn, size_t count,
+                            i2c_callback_t callback, void *arg);
+status_t class_i2c_submit(struct device *dev, struct i2c_request *req);
+status_t class_i2c_wait(struct i2c_request *req);
+
+/* for drivers */
+void class_i2c_request_complete(struct i2c_request *req, status_t result);
+
 __END_CDECLS
 
 #endif
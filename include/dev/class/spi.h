@@ -24,7 +24,9 @@
 #define __DEV_CLASS_SPI_H
 
 #include <compiler.h>
+#include <list.h>
 #include <dev/driver.h>
+#include <kernel/event.h>
 
 /* spi transaction flags */
 enum spi_flags {
@@ -42,17 +44,50 @@ struct spi_transaction {
 	size_t len;
 };
 
+/* a list of transactions run back to back, completed asynchronously.
+ * if callback is set it is called when the request finishes, possibly from
+ * interrupt context and possibly before class_spi_submit returns. otherwise
+ * class_spi_wait blocks until it is done.
+ */
+struct spi_request;
+typedef void (*spi_callback_t)(struct spi_request *req);
+
+typedef struct spi_request {
+	struct spi_transaction *txn;
+	size_t count;
+	spi_callback_t callback;
+	void *arg;
+
+	/* bytes transferred or an error, valid once the request is complete */
+	ssize_t result;
+
+	/* owned by the driver while the request is outstanding */
+	struct list_node node;
+	event_t event;
+} spi_request_t;
+
 /* spi interface */
 struct spi_ops {
 	struct driver_ops std;
 
 	ssize_t (*transaction)(struct device *dev, struct spi_transaction *txn, size_t count);
+
+	/* queue a request, drivers call class_spi_request_complete when it finishes */
+	status_t (*submit)(struct device *dev, struct spi_request *req);
 };
 
 __BEGIN_CDECLS
 
 ssize_t class_spi_transaction(struct device *dev, struct spi_transaction *txn, size_t count);
 
+void class_spi_request_init(struct spi_request *req, struct spi_transaction *txn, size_t count,
+                            spi_callback_t callback, void *arg);
+status_t class_spi_submit(struct device *dev, struct spi_request *req);
+ssize_t class_spi_wait(struct spi_request *req);
+
+/* for drivers */
+void class_spi_request_complete(struct spi_request *req, ssize_t result);
+
 __END_CDECLS
 
 #endif
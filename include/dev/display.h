@@ -40,6 +40,18 @@ struct display_info {
 
 	// Update function
 	void (*flush)(uint starty, uint endy);
+
+	// optional, update a rectangle of buffer and make sure it's the one on
+	// display. used instead of flush when set
+	void (*flush_rect)(void *buffer, uint x, uint y, uint width, uint height);
+
+	// optional second buffer of the same layout, for double buffering with flush_rect
+	void *back_framebuffer;
+
+	// optional hardware scrolling. the framebuffers are virtual_height rows
+	// tall and pan shows the height rows starting at row y
+	uint virtual_height;
+	status_t (*pan)(uint y);
 };
 
 status_t display_get_info(struct display_info *info);
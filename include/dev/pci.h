@@ -90,6 +90,7 @@
 #define PCI_COMMAND_AD_STEP_EN      0x0080
 #define PCI_COMMAND_SERR_EN         0x0100
 #define PCI_COMMAND_FAST_B2B_EN     0x0200
+#define PCI_COMMAND_INT_DISABLE     0x0400
 
 /*
  * PCI status register bits
@@ -145,6 +146,41 @@ typedef struct {
 	uint8_t next;
 } __PACKED pci_capability_t;
 
+/*
+ * PCI capability ids
+ */
+#define PCI_CAP_ID_MSI              0x05
+#define PCI_CAP_ID_MSIX             0x11
+
+/*
+ * MSI capability, offsets from the capability and message control bits
+ */
+#define PCI_MSI_CONTROL             0x02
+#define PCI_MSI_ADDRESS_LO          0x04
+#define PCI_MSI_ADDRESS_HI          0x08
+#define PCI_MSI_DATA_32             0x08
+#define PCI_MSI_DATA_64             0x0c
+#define PCI_MSI_CONTROL_ENABLE      0x0001
+#define PCI_MSI_CONTROL_64BIT       0x0080
+
+/*
+ * MSI-X capability, offsets from the capability and message control bits,
+ * and the layout of a 16 byte table entry
+ */
+#define PCI_MSIX_CONTROL            0x02
+#define PCI_MSIX_TABLE              0x04
+#define PCI_MSIX_CONTROL_SIZE(c)    (((c) & 0x7ff) + 1)
+#define PCI_MSIX_CONTROL_MASK       0x4000
+#define PCI_MSIX_CONTROL_ENABLE     0x8000
+#define PCI_MSIX_TABLE_BIR(t)       ((t) & 0x7)
+#define PCI_MSIX_TABLE_OFFSET(t)    ((t) & ~0x7U)
+#define PCI_MSIX_ENTRY_SIZE         16
+#define PCI_MSIX_ENTRY_ADDRESS_LO   0x0
+#define PCI_MSIX_ENTRY_ADDRESS_HI   0x4
+#define PCI_MSIX_ENTRY_DATA         0x8
+#define PCI_MSIX_ENTRY_CONTROL      0xc
+#define PCI_MSIX_ENTRY_MASKED       0x1
+
 typedef struct {
 	uint8_t bus;
 	uint8_t device;
@@ -178,4 +214,28 @@ int pci_write_config_word(const pci_location_t *state, uint32_t reg, uint32_t va
 int pci_get_irq_routing_options(irq_routing_entry *entries, uint16_t *count, uint16_t *pci_irqs);
 int pci_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq);
 
+/* offset of the first capability with the given id, 0 if the device has none */
+uint8_t pci_find_capability(const pci_location_t *state, uint8_t cap_id);
+
+/* point the device's MSI at vector on cpu, and turn off its INTx line. a cpu
+ * that didn't come up gets the boot cpu instead */
+status_t pci_enable_msi(const pci_location_t *state, uint vector, uint cpu);
+
+/* a device's MSI-X table, mapped by pci_msix_init() */
+typedef struct {
+	pci_location_t loc;
+	uint8_t cap;
+	uint count;     /* entries in the table */
+	addr_t table;
+} pci_msix_t;
+
+/* find and map the MSI-X table, every entry starts out masked */
+status_t pci_msix_init(const pci_location_t *state, pci_msix_t *msix);
+
+/* point table entry at vector on cpu and unmask it, same cpu rule as pci_enable_msi() */
+status_t pci_msix_set(pci_msix_t *msix, uint entry, uint vector, uint cpu);
+
+/* switch the device over to MSI-X, and turn off its INTx line */
+void pci_msix_enable(pci_msix_t *msix);
+
 #endif
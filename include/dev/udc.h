@@ -38,14 +38,23 @@ typedef struct udc_device udc_device_t;
 /* endpoints are opaque handles specific to the particular device controller */
 typedef struct udc_endpoint udc_endpoint_t;
 
-/* USB Device Controller Transfer Request */
+/* USB Device Controller Transfer Request
+ *
+ * Any number of requests may be queued on an endpoint. They're handed to the
+ * controller as they're queued and complete in order, so keeping two or more
+ * queued keeps the endpoint busy while the completed buffer is dealt with.
+ */
 struct udc_request {
 	void *buffer;
 	unsigned length;
 	void (*complete)(udc_request_t *req, unsigned actual, int status);
 	void *context;
+	unsigned flags;
 };
 
+/* end an IN transfer that fills its last packet with a zero length packet */
+#define UDC_REQUEST_FLAG_ZLP 0x1
+
 udc_request_t *udc_request_alloc(void);
 void udc_request_free(udc_request_t *req);
 int udc_request_queue(udc_endpoint_t *ept, udc_request_t *req);
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __HASHTABLE_H
+#define __HASHTABLE_H
+
+#include <compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <list.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Intrusive chained hash table, built out of list.h.
+ *
+ * Objects embed a struct list_node and the caller supplies the bucket array,
+ * whose length must be a power of two, and computes the hashes. A lookup
+ * walks the one bucket the key hashes to:
+ *
+ *	static struct list_node socket_buckets[64];
+ *	static struct hash_table sockets;
+ *
+ *	hash_table_init(&sockets, socket_buckets, countof(socket_buckets));
+ *	hash_table_add(&sockets, hash_u32(s->port), &s->node);
+ *
+ *	hash_table_for_every_entry_in_bucket(&sockets, hash_u32(port), s, struct socket, node) {
+ *		if (s->port == port)
+ *			return s;
+ *	}
+ *
+ * The bucket is picked with the low bits of the hash, so use a hash whose low
+ * bits depend on the whole key, like the ones below. The table doesn't grow,
+ * size it for the expected number of entries. No locking.
+ */
+struct hash_table {
+	struct list_node *buckets;
+	size_t mask;	/* bucket count - 1 */
+	size_t count;
+};
+
+static inline void hash_table_init(struct hash_table *table, struct list_node *buckets, size_t bucket_count)
+{
+	table->buckets = buckets;
+	table->mask = bucket_count - 1;
+	table->count = 0;
+
+	for (size_t i = 0; i < bucket_count; i++)
+		list_initialize(&buckets[i]);
+}
+
+static inline struct list_node *hash_table_bucket(struct hash_table *table, uint32_t hash)
+{
+	return &table->buckets[hash & table->mask];
+}
+
+/* new entries go at the head of their bucket */
+static inline void hash_table_add(struct hash_table *table, uint32_t hash, struct list_node *node)
+{
+	list_add_head(hash_table_bucket(table, hash), node);
+	table->count++;
+}
+
+static inline void hash_table_delete(struct hash_table *table, struct list_node *node)
+{
+	list_delete(node);
+	table->count--;
+}
+
+static inline size_t hash_table_count(const struct hash_table *table)
+{
+	return table->count;
+}
+
+/* the entries whose hash lands in the same bucket as hash, not only the equal ones */
+#define hash_table_for_every_entry_in_bucket(table, hash, entry, type, member) \
+	list_for_every_entry(hash_table_bucket(table, hash), entry, type, member)
+
+/* every entry, in no particular order. break only leaves the current bucket */
+#define hash_table_for_every_entry(table, entry, type, member) \
+	for (size_t __bucket = 0; __bucket <= (table)->mask; __bucket++) \
+		list_for_every_entry(&(table)->buckets[__bucket], entry, type, member)
+
+/* hashes that spread any of their input bits into the low bits */
+static inline uint32_t hash_u32(uint32_t x)
+{
+	x *= 2654435761U;
+	return x ^ (x >> 16);
+}
+
+static inline uint32_t hash_u64(uint64_t x)
+{
+	return hash_u32((uint32_t)x ^ (uint32_t)(x >> 32));
+}
+
+static inline uint32_t hash_ptr(const void *ptr)
+{
+	return hash_u64((uintptr_t)ptr);
+}
+
+/* fnv-1a */
+static inline uint32_t hash_string(const char *str)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+__END_CDECLS;
+
+#endif
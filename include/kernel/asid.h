@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Generation based allocator for the ids the mmu tags tlb entries with, the
+ * arm64 ASID and the x86-64 PCID. An aspace's id is kept as a 64 bit value,
+ * the hardware id in the low bits and the generation it was handed out in
+ * above them, 0 if it never had one. Once every id of a generation is taken a
+ * new generation starts, the ids the cpus are running right then carry over,
+ * and each cpu drops its whole non global tlb the next time it switches. An
+ * aspace only has to go through the lock when its id is from an older
+ * generation.
+ */
+#define ASID_MAP_WORDS(bits) (((1UL << (bits)) + sizeof(unsigned long) * 8 - 1) / (sizeof(unsigned long) * 8))
+
+typedef struct asid_allocator {
+    spin_lock_t lock;
+    uint bits;
+    uint next;                          /* where the search for a free id picks up */
+    uint64_t generation;                /* in units of 1 << bits, never 0 */
+    unsigned long *map;                 /* ids taken in this generation, id 0 is never handed out */
+    uint64_t active[SMP_MAX_CPUS];      /* what each cpu runs, 0 once a rollover went by */
+    uint64_t reserved[SMP_MAX_CPUS];    /* what each cpu was running at the last rollover */
+    mp_cpu_mask_t flush_pending;        /* cpus that haven't flushed since the last rollover */
+} asid_allocator_t;
+
+/* map has to be ASID_MAP_WORDS(bits) words */
+#define ASID_ALLOCATOR_INITIAL_VALUE(_bits, _map) \
+{ \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
+    .bits = (_bits), \
+    .next = 1, \
+    .generation = 1ULL << (_bits), \
+    .map = (_map), \
+}
+
+/* Hand back the hardware id the aspace whose id is at *asid should run with on
+ * this cpu, giving it a new one first if it's from an older generation. *flush
+ * is set if the cpu has to drop its non global tlb entries before running it.
+ * Called with interrupts disabled, from the context switch path. */
+uint asid_switch(asid_allocator_t *a, uint64_t *asid, uint cpu, bool *flush);
+
+/* Have the aspace pick up a fresh id on its next switch, for when translations
+ * tagged with the current one can't all be reached. The old id stays taken
+ * until the next rollover. */
+static inline void asid_invalidate(uint64_t *asid)
+{
+    __atomic_store_n(asid, 0, __ATOMIC_RELAXED);
+}
+
+__END_CDECLS
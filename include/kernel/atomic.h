@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_ATOMIC_H
+#define __KERNEL_ATOMIC_H
+
+#include <compiler.h>
+#include <stdbool.h>
+
+/*
+ * Atomic operations with an explicit memory ordering, for lock free code.
+ *
+ * These wrap the compiler's __atomic builtins and take a pointer to any
+ * naturally aligned integer or pointer no wider than the native word. Use the
+ * weakest ordering that is correct:
+ *
+ * ATOMIC_RELAXED - atomic, orders nothing else. counters, statistics.
+ * ATOMIC_ACQUIRE - loads and rmw ops. later accesses can't move above it.
+ *                  taking ownership, reading what another cpu published.
+ * ATOMIC_RELEASE - stores and rmw ops. earlier accesses can't move below it.
+ *                  giving up ownership, publishing.
+ * ATOMIC_ACQ_REL - rmw ops that do both.
+ * ATOMIC_SEQ_CST - additionally a single order across all cpus, for the
+ *                  rare store then load of a different location pattern.
+ *
+ * On arm64 acquire loads and release stores are single ldar/stlr instructions
+ * and relaxed ones are plain ldr/str, rather than accesses bracketed by dmbs.
+ * Building with ARM64_LSE_ATOMICS=1 turns the rmw ops into single ARMv8.1 lse
+ * instructions (ldadd, ldclr, ldset, swp, cas) instead of ldxr/stxr loops. On
+ * x86 every load and store short of a seq_cst one is a plain mov.
+ *
+ * The atomic_add() family in arch/ops.h predates this and promises no
+ * particular ordering, which differs between arches. New code should use
+ * these instead.
+ */
+#define ATOMIC_RELAXED __ATOMIC_RELAXED
+#define ATOMIC_ACQUIRE __ATOMIC_ACQUIRE
+#define ATOMIC_RELEASE __ATOMIC_RELEASE
+#define ATOMIC_ACQ_REL __ATOMIC_ACQ_REL
+#define ATOMIC_SEQ_CST __ATOMIC_SEQ_CST
+
+#define atomic_load_relaxed(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define atomic_load_acquire(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_store_relaxed(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+#define atomic_store_release(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/* read-modify-write, all return the value from before the operation */
+#define atomic_fetch_add_explicit(ptr, val, order) __atomic_fetch_add(ptr, val, order)
+#define atomic_fetch_sub_explicit(ptr, val, order) __atomic_fetch_sub(ptr, val, order)
+#define atomic_fetch_and_explicit(ptr, val, order) __atomic_fetch_and(ptr, val, order)
+#define atomic_fetch_or_explicit(ptr, val, order) __atomic_fetch_or(ptr, val, order)
+#define atomic_fetch_xor_explicit(ptr, val, order) __atomic_fetch_xor(ptr, val, order)
+#define atomic_exchange_explicit(ptr, val, order) __atomic_exchange_n(ptr, val, order)
+
+/*
+ * compare and swap. if *ptr equals *expected store desired and return true,
+ * else copy *ptr into *expected and return false. a failed swap is only a
+ * load, so it gets order minus any release half.
+ */
+#define ATOMIC_CAS_FAIL_ORDER(order) \
+	((order) == __ATOMIC_RELEASE ? __ATOMIC_RELAXED : \
+	 (order) == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE : (order))
+
+#define atomic_cas_explicit(ptr, expected, desired, order) \
+	__atomic_compare_exchange_n(ptr, expected, desired, false, order, ATOMIC_CAS_FAIL_ORDER(order))
+
+/* may fail even when *ptr equals *expected, for loops that retry anyway */
+#define atomic_cas_weak_explicit(ptr, expected, desired, order) \
+	__atomic_compare_exchange_n(ptr, expected, desired, true, order, ATOMIC_CAS_FAIL_ORDER(order))
+
+/*
+ * fences, for ordering plain or relaxed accesses to several locations at
+ * once. an acquire fence orders earlier loads before everything after it, a
+ * release fence orders everything before it before later stores, and
+ * atomic_fence() orders everything, store then load included.
+ */
+#define atomic_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define atomic_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* orders against an interrupt handler on the same cpu only, costs no instructions */
+#define atomic_signal_fence() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+#endif
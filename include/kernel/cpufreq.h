@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <err.h>
+#include <list.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Cpu frequency scaling.
+ *
+ * The platform registers its operating points and a way to switch between
+ * them. A thread then samples every cpu's utilization out of the idle time in
+ * the thread stats every CPUFREQ_SAMPLE_MS, hands it to the current governor
+ * and switches to whatever frequency it picks.
+ */
+
+#define CPUFREQ_SAMPLE_MS 20
+
+struct cpufreq_ops {
+	const uint *khz;        /* operating points, lowest first */
+	uint count;
+
+	/* one clock for every cpu, set is only called for cpu 0 with the busiest cpu's load */
+	bool shared;
+
+	/* switch a cpu, called from a thread so it may block */
+	status_t (*set)(uint cpu, uint khz);
+};
+
+struct cpufreq_governor {
+	struct list_node node;
+	const char *name;
+
+	/* utilization is the percentage of the last sample the cpu was busy.
+	 * returns the frequency to run at, snapped to an operating point by the caller.
+	 */
+	uint (*target)(const struct cpufreq_ops *ops, uint cpu, uint utilization, uint cur_khz);
+};
+
+#if WITH_KERNEL_CPUFREQ
+
+/* start sampling with the default governor, ops must stay around */
+status_t cpufreq_register(const struct cpufreq_ops *ops);
+
+/* add a governor alongside the built in performance, powersave and ondemand ones */
+void cpufreq_register_governor(struct cpufreq_governor *gov);
+status_t cpufreq_set_governor(const char *name);
+
+/* the frequency last set on a cpu, 0 before the first sample */
+uint cpufreq_get(uint cpu);
+
+#else
+
+static inline status_t cpufreq_register(const struct cpufreq_ops *ops) { return ERR_NOT_SUPPORTED; }
+static inline void cpufreq_register_governor(struct cpufreq_governor *gov) {}
+static inline status_t cpufreq_set_governor(const char *name) { return ERR_NOT_SUPPORTED; }
+static inline uint cpufreq_get(uint cpu) { return 0; }
+
+#endif
+
+__END_CDECLS
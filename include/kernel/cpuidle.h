@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <err.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Idle states.
+ *
+ * The platform registers its idle states, shallowest first. Each time the
+ * idle thread runs it predicts how long the cpu will stay idle, from the next
+ * timer deadline and how long recent idle periods actually lasted, and enters
+ * the deepest state whose target residency fits and whose exit latency is
+ * within the current limit. With nothing registered the idle thread just calls
+ * arch_idle().
+ */
+
+#define CPUIDLE_MAX_STATES 8
+
+struct cpuidle_state {
+	const char *name;
+	lk_bigtime_t exit_latency;      /* us from the wakeup event to running again */
+	lk_bigtime_t target_residency;  /* us the cpu has to stay in it to be worth entering */
+
+	/* called with interrupts disabled, returns once one is pending. wfi does
+	 * this on arm, x86 needs sti; hlt. interrupts may be left either way.
+	 */
+	void (*enter)(const struct cpuidle_state *state);
+	uint arg;                       /* for the platform, e.g. a psci power state */
+};
+
+#if WITH_KERNEL_CPUIDLE
+
+/* states[0] should be the shallowest, the array must stay around */
+status_t cpuidle_register(const struct cpuidle_state *states, uint count);
+
+/* don't pick states that take longer than this to get out of, in us */
+void cpuidle_set_latency_limit(lk_bigtime_t usecs);
+
+/* one trip through the idle states, called by the idle thread */
+void cpuidle_idle(void);
+
+#else
+
+static inline status_t cpuidle_register(const struct cpuidle_state *states, uint count) { return ERR_NOT_SUPPORTED; }
+static inline void cpuidle_set_latency_limit(lk_bigtime_t usecs) {}
+static inline void cpuidle_idle(void) { arch_idle(); }
+
+#endif
+
+__END_CDECLS
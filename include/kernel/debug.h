@@ -28,28 +28,54 @@
 __BEGIN_CDECLS;
 
 #include <debug.h>
+#include <stdint.h>
+#include <kernel/static_key.h>
+#include <sys/types.h>
 
-/* kernel event log */
+/* kernel event log
+ *
+ * Each cpu logs into its own ring of fixed size records. Writers reserve a slot
+ * with an atomic add on their ring's head and never take a lock, so tracepoints
+ * are safe from interrupt context and cost a handful of stores. The rings are
+ * dumped as text with the kevlog command, or exported raw with 'kevlog export'
+ * for scripts/kevlog2trace.py to turn into a chrome/perfetto trace.
+ */
 #if WITH_KERNEL_EVLOG
 
-#include <lib/evlog.h>
-
+/* records per cpu, must be a power of 2 */
 #ifndef KERNEL_EVLOG_LEN
 #define KERNEL_EVLOG_LEN 1024
 #endif
 
+/* the layout is part of the export format, bump the version in kernel/debug.c if it changes */
+struct kernel_evlog_record {
+	uint64_t time;      /* current_time_hires() */
+	uint32_t id;        /* KERNEL_EVLOG_*, written last, NULL while the slot is being filled */
+	uint32_t cpu;
+	uint64_t arg0;
+	uint64_t arg1;
+};
+
 void kernel_evlog_init(void);
 
-void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1);
+void kernel_evlog_add(uint id, uint64_t arg0, uint64_t arg1);
 void kernel_evlog_dump(void);
 
+/* every tracepoint below is patched in or out with this key, 'kevlog on|off' */
+STATIC_KEY_DECLARE(kernel_evlog_key);
+
+#define KEVLOG_ADD(id, arg0, arg1) \
+	do { if (static_key_enabled(&kernel_evlog_key)) kernel_evlog_add(id, arg0, arg1); } while (0)
+
 #else // !WITH_KERNEL_EVLOG
 
 /* do nothing versions */
 static inline void kernel_evlog_init(void) {}
-static inline void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1) {}
+static inline void kernel_evlog_add(uint id, uint64_t arg0, uint64_t arg1) {}
 static inline void kernel_evlog_dump(void) {}
 
+#define KEVLOG_ADD(id, arg0, arg1) kernel_evlog_add(id, arg0, arg1)
+
 #endif
 
 enum {
@@ -60,14 +86,28 @@ enum {
 	KERNEL_EVLOG_TIMER_CALL,
 	KERNEL_EVLOG_IRQ_ENTER,
 	KERNEL_EVLOG_IRQ_EXIT,
+	KERNEL_EVLOG_THREAD_WAKEUP,
+	KERNEL_EVLOG_WORK_BEGIN,
+	KERNEL_EVLOG_WORK_END,
+	KERNEL_EVLOG_BIO_SUBMIT,
+	KERNEL_EVLOG_BIO_COMPLETE,
+
+	/* drivers and apps define their own ids from here up and log them with KEVLOG_USER */
+	KERNEL_EVLOG_USER = 0x1000,
 };
 
-#define KEVLOG_THREAD_SWITCH(from, to) kernel_evlog_add(KERNEL_EVLOG_CONTEXT_SWITCH, (uintptr_t)from, (uintptr_t)to)
-#define KEVLOG_THREAD_PREEMPT(thread) kernel_evlog_add(KERNEL_EVLOG_PREEMPT, (uintptr_t)thread, 0)
-#define KEVLOG_TIMER_TICK() kernel_evlog_add(KERNEL_EVLOG_TIMER_TICK, 0, 0)
-#define KEVLOG_TIMER_CALL(ptr, arg) kernel_evlog_add(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)ptr, (uintptr_t)arg)
-#define KEVLOG_IRQ_ENTER(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
-#define KEVLOG_IRQ_EXIT(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+#define KEVLOG_THREAD_SWITCH(from, to) KEVLOG_ADD(KERNEL_EVLOG_CONTEXT_SWITCH, (uintptr_t)from, (uintptr_t)to)
+#define KEVLOG_THREAD_PREEMPT(thread) KEVLOG_ADD(KERNEL_EVLOG_PREEMPT, (uintptr_t)thread, 0)
+#define KEVLOG_THREAD_WAKEUP(thread) KEVLOG_ADD(KERNEL_EVLOG_THREAD_WAKEUP, (uintptr_t)thread, 0)
+#define KEVLOG_TIMER_TICK() KEVLOG_ADD(KERNEL_EVLOG_TIMER_TICK, 0, 0)
+#define KEVLOG_TIMER_CALL(ptr, arg) KEVLOG_ADD(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)ptr, (uintptr_t)arg)
+#define KEVLOG_IRQ_ENTER(irqn) KEVLOG_ADD(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
+#define KEVLOG_IRQ_EXIT(irqn) KEVLOG_ADD(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+#define KEVLOG_WORK_BEGIN(func, arg) KEVLOG_ADD(KERNEL_EVLOG_WORK_BEGIN, (uintptr_t)func, (uintptr_t)arg)
+#define KEVLOG_WORK_END(func, arg) KEVLOG_ADD(KERNEL_EVLOG_WORK_END, (uintptr_t)func, (uintptr_t)arg)
+#define KEVLOG_BIO_SUBMIT(req, len) KEVLOG_ADD(KERNEL_EVLOG_BIO_SUBMIT, (uintptr_t)req, len)
+#define KEVLOG_BIO_COMPLETE(req, result) KEVLOG_ADD(KERNEL_EVLOG_BIO_COMPLETE, (uintptr_t)req, (uint64_t)(result))
+#define KEVLOG_USER(id, arg0, arg1) KEVLOG_ADD(KERNEL_EVLOG_USER + (id), (uint64_t)(arg0), (uint64_t)(arg1))
 
 __END_CDECLS;
 
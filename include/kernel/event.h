@@ -34,17 +34,20 @@ __BEGIN_CDECLS;
 
 typedef struct event {
 	int magic;
-	bool signalled;
+	int state;	/* EVENT_STATE_SIGNALLED, plus EVENT_STATE_WAITER per thread in event_wait */
 	uint flags;
 	wait_queue_t wait;
 } event_t;
 
 #define EVENT_FLAG_AUTOUNSIGNAL 1
 
+#define EVENT_STATE_SIGNALLED 1
+#define EVENT_STATE_WAITER    2
+
 #define EVENT_INITIAL_VALUE(e, initial, _flags) \
 { \
 	.magic = EVENT_MAGIC, \
-	.signalled = initial, \
+	.state = (initial) ? EVENT_STATE_SIGNALLED : 0, \
 	.flags = _flags, \
 	.wait = WAIT_QUEUE_INITIAL_VALUE((e).wait), \
 }
@@ -57,8 +60,8 @@ typedef struct event {
  *   - Wake up any waiting threads when signaled.
  *   - Continue to do so (no threads will wait) until unsignaled.
  * - Events with FLAG_AUTOUNSIGNAL:
- *   - If one or more threads are waiting when signaled, one thread will
- *     be woken up and return.  The signaled state will not be set.
+ *   - If one or more threads are waiting when signaled, the highest priority
+ *     one will be woken up and return.  The signaled state will not be set.
  *   - If no threads are waiting when signaled, the Event will remain
  *     in the signaled state until a thread attempts to wait (at which
  *     time it will unsignal atomicly and return immediately) or
@@ -71,6 +74,10 @@ status_t event_wait_timeout(event_t *, lk_time_t); /* wait on the event with a t
 status_t event_signal(event_t *, bool reschedule);
 status_t event_unsignal(event_t *);
 
+static inline bool event_is_signalled(event_t *e) {
+	return __atomic_load_n(&e->state, __ATOMIC_ACQUIRE) & EVENT_STATE_SIGNALLED;
+}
+
 static inline bool event_initialized(event_t *e) {
 	return e->magic == EVENT_MAGIC;
 }
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_IRQSTATS_H
+#define __KERNEL_IRQSTATS_H
+
+#include <compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Per vector interrupt statistics, enabled by building with WITH_IRQ_STATS=1.
+ *
+ * Interrupt controller code brackets each handler call with IRQSTATS_BEGIN()
+ * and IRQSTATS_END(). Every cpu keeps its own count, total and longest
+ * handler time per vector, in arch_cycle_count() cycles, so times read as 0
+ * on arches without a cycle counter. The irqstats console command dumps them.
+ */
+#ifndef IRQ_STATS_VECTORS
+#define IRQ_STATS_VECTORS 256
+#endif
+
+#if WITH_IRQ_STATS
+void irqstats_record(uint vector, uint32_t cycles);
+
+#define IRQSTATS_BEGIN(start) uint32_t start = arch_cycle_count()
+#define IRQSTATS_END(vector, start) irqstats_record(vector, arch_cycle_count() - (start))
+#else
+#define IRQSTATS_BEGIN(start) do { } while (0)
+#define IRQSTATS_END(vector, start) do { } while (0)
+#endif
+
+__END_CDECLS;
+
+#endif
+
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_LOCKSTAT_H
+#define __KERNEL_LOCKSTAT_H
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Lock contention profiling, enabled by building with WITH_LOCK_STATS=1.
+ *
+ * Every spin_lock() and mutex acquisition is counted against the address of
+ * the lock. Contended acquisitions also record how long they waited, and the
+ * call site of the longest wait is kept. The lockstat console command dumps
+ * the table sorted by total wait time.
+ */
+enum lockstat_type {
+	LOCKSTAT_SPIN,
+	LOCKSTAT_MUTEX,
+};
+
+#if WITH_LOCK_STATS
+void lockstat_record(const void *lock, enum lockstat_type type, bool contended, lk_bigtime_t wait, void *caller);
+
+/* record an acquisition, attributed to the caller of the current function */
+#define LOCKSTAT_RECORD(lock, type, contended, wait) \
+	lockstat_record(lock, type, contended, wait, __GET_CALLER())
+#else
+#define LOCKSTAT_RECORD(lock, type, contended, wait) do { } while (0)
+#endif
+
+__END_CDECLS;
+
+#endif
+
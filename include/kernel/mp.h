@@ -34,8 +34,15 @@ void mp_init(void);
 
 typedef uint32_t mp_cpu_mask_t;
 
+/* one bit per cpu */
+STATIC_ASSERT(SMP_MAX_CPUS <= 32);
+
 #define MP_CPU_ALL_BUT_LOCAL (UINT32_MAX)
 
+/* every cpu the kernel was built for. shifted down rather than built as 1 << n - 1,
+ * which is undefined once n reaches the width of the type */
+#define MP_CPU_MASK_ALL ((mp_cpu_mask_t)(~0ULL >> (64 - SMP_MAX_CPUS)))
+
 /* by default, mp_mbx_reschedule does not signal to cpus that are running realtime
  * threads. Override this behavior.
  */
@@ -52,10 +59,46 @@ typedef enum {
 /* called from arch code during reschedule irq */
 enum handler_return mp_mbx_reschedule_irq(void);
 
+/* called from arch code during generic irq */
+enum handler_return mp_mbx_generic_irq(void);
+
+/* cross cpu function calls.
+ * the task runs in interrupt context with interrupts disabled on each target cpu.
+ * the local cpu, if targeted, runs the task directly. cpus that are not active
+ * are skipped. MP_CPU_ALL_BUT_LOCAL targets every other active cpu.
+ */
+typedef void (*mp_sync_task_t)(void *context);
+
+struct mp_call;
+
+struct mp_call_node {
+    struct mp_call_node *next;
+    struct mp_call *call;
+};
+
+/* state for an outstanding async call, owned by the caller until mp_async_wait() returns */
+typedef struct mp_call {
+    mp_sync_task_t task;
+    void *context;
+    volatile int outstanding;
+    struct mp_call_node node[SMP_MAX_CPUS];
+} mp_call_t;
+
+/* run task on the target cpus and wait for all of them to finish */
+void mp_sync_exec(mp_cpu_mask_t target, mp_sync_task_t task, void *context);
+
+/* queue task on the target cpus and return without waiting */
+void mp_async_exec(mp_call_t *call, mp_cpu_mask_t target, mp_sync_task_t task, void *context);
+bool mp_async_done(const mp_call_t *call);
+void mp_async_wait(mp_call_t *call);
+
 /* global mp state to track what the cpus are up to */
 struct mp_state {
     volatile mp_cpu_mask_t active_cpus;
 
+    /* set at boot, see mp_set_isolated_cpus() */
+    mp_cpu_mask_t isolated_cpus;
+
     /* only safely accessible with thread lock held */
     mp_cpu_mask_t idle_cpus;
     mp_cpu_mask_t realtime_cpus;
@@ -94,4 +137,25 @@ static inline mp_cpu_mask_t mp_get_realtime_mask(void)
     return mp.realtime_cpus;
 }
 
+/* isolated cpus only run threads whose affinity names them explicitly, and
+ * are left out when spreading timers and interrupts around. the set starts
+ * out as SMP_ISOLATED_CPUS, and may be changed at boot, before the secondary
+ * cpus are started, by the platform from an isolcpus=<list> boot argument.
+ * cpu 0 can't be isolated.
+ */
+status_t mp_set_isolated_cpus(mp_cpu_mask_t mask);
+void mp_parse_boot_args(const char *cmdline);
+
+static inline mp_cpu_mask_t mp_get_isolated_mask(void)
+{
+    return mp.isolated_cpus;
+}
+
+/* the cpus in mask that aren't isolated, or all of mask if they all are */
+static inline mp_cpu_mask_t mp_housekeeping_mask(mp_cpu_mask_t mask)
+{
+    mp_cpu_mask_t m = mask & ~mp.isolated_cpus;
+    return m ? m : mask;
+}
+
 __END_CDECLS;
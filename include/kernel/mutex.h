@@ -36,21 +36,31 @@ __BEGIN_CDECLS;
 typedef struct mutex {
 	uint32_t magic;
 	thread_t *holder;
-	int count;
+	int val; /* 0 = unlocked, 1 = locked, 2 = locked and may have waiters */
 	wait_queue_t wait;
+	struct list_node held_node; /* on the holder's held_mutexes while contested */
+	thread_t *held_by; /* whose held_mutexes held_node is on, may lag behind holder */
 } mutex_t;
 
 #define MUTEX_INITIAL_VALUE(m) \
 { \
 	.magic = MUTEX_MAGIC, \
 	.holder = NULL, \
-	.count = 0, \
+	.val = 0, \
 	.wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+	.held_node = LIST_INITIAL_CLEARED_VALUE, \
+	.held_by = NULL, \
 }
 
 /* Rules for Mutexes:
  * - Mutexes are only safe to use from thread context.
  * - Mutexes are non-recursive.
+ * - Uncontended acquire and release are a single atomic operation on val and
+ *   never take the wait queue lock. Released mutexes are not handed off; woken
+ *   waiters compete for the mutex again.
+ * - A holder inherits the priority of the highest priority thread waiting on
+ *   any mutex it holds, until it releases that mutex. Inheritance is not
+ *   passed on to a holder that is itself blocked on another mutex.
 */
 
 void mutex_init(mutex_t *);
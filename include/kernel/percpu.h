@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+#include <kernel/atomic.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Per cpu state.
+ *
+ * The current thread lives in the arch's own per cpu register (tpidr_el1,
+ * tpidrprw or %gs), the rest of what the kernel keeps per cpu is here, a
+ * cache line or more each so that cpus never share a line.
+ *
+ * Looking up the calling cpu's slot is only stable while it can't migrate,
+ * with interrupts or preemption disabled, or from a pinned thread.
+ */
+
+typedef struct percpu {
+	uint cpu_num;
+#if THREAD_STATS
+	struct thread_stats stats;
+#endif
+} __CPU_ALIGN percpu_t;
+
+extern percpu_t percpu[SMP_MAX_CPUS];
+
+static inline percpu_t *get_percpu(void)
+{
+	return &percpu[arch_curr_cpu_num()];
+}
+
+static inline percpu_t *get_percpu_cpu(uint cpu)
+{
+	return &percpu[cpu];
+}
+
+/*
+ * Per cpu variables for other subsystems, padded out the same way.
+ *
+ *   PERCPU_DECLARE(struct foo_stats, foo_stats);    in a header
+ *   PERCPU_DEFINE(foo_stats);                       in one .c file
+ *   PERCPU_STATIC(struct foo_stats, foo_stats);     or just file local
+ *
+ *   percpu_var(foo_stats)->hits++;
+ */
+#define PERCPU_DECLARE(type, name) \
+	struct percpu_var_##name { type val; } __CPU_ALIGN; \
+	extern struct percpu_var_##name name[SMP_MAX_CPUS]
+
+#define PERCPU_DEFINE(name) \
+	struct percpu_var_##name name[SMP_MAX_CPUS]
+
+#define PERCPU_STATIC(type, name) \
+	static struct percpu_var_##name { type val; } __CPU_ALIGN name[SMP_MAX_CPUS]
+
+#define percpu_var(name) (&(name)[arch_curr_cpu_num()].val)
+#define percpu_var_cpu(name, cpu) (&(name)[cpu].val)
+
+/*
+ * Statistics counters that any cpu may bump. Each cpu adds into a slot on a
+ * cache line of its own and readers sum the slots, so a hot counter never
+ * bounces between cpus. A read isn't a snapshot, adds racing with it may or
+ * may not be counted.
+ *
+ * The add is atomic only because the caller may migrate between picking its
+ * slot and adding to it, it's relaxed and the line is nearly always local.
+ * An object holding counters must be cache line aligned for them not to
+ * share lines with their neighbours, memalign() it or give its slab the
+ * alignment.
+ */
+#if WITH_SMP
+#define __PERCPU_COUNTER_ALIGN __CPU_ALIGN
+#else
+#define __PERCPU_COUNTER_ALIGN
+#endif
+
+typedef struct percpu_counter {
+	struct {
+		ulong count;
+	} __PERCPU_COUNTER_ALIGN slot[SMP_MAX_CPUS];
+} percpu_counter_t;
+
+static inline void percpu_counter_add(percpu_counter_t *c, ulong n)
+{
+	atomic_fetch_add_explicit(&c->slot[arch_curr_cpu_num()].count, n, ATOMIC_RELAXED);
+}
+
+static inline void percpu_counter_inc(percpu_counter_t *c)
+{
+	percpu_counter_add(c, 1);
+}
+
+static inline uint64_t percpu_counter_read(const percpu_counter_t *c)
+{
+	uint64_t sum = 0;
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		sum += atomic_load_relaxed(&c->slot[i].count);
+
+	return sum;
+}
+
+/* counts added while this runs may survive it */
+static inline void percpu_counter_reset(percpu_counter_t *c)
+{
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		atomic_store_relaxed(&c->slot[i].count, 0);
+}
+
+__END_CDECLS
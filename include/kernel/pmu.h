@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <err.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Hardware performance counters.
+ *
+ * pmu_configure() programs the same events on every cpu. The counts are
+ * virtualized per thread: the scheduler folds what the counters moved into
+ * the outgoing thread on every context switch, so pmu_read() gives the
+ * current thread's own counts no matter where it ran. Counts are reset
+ * whenever the configuration changes.
+ */
+
+enum pmu_event {
+	PMU_EVENT_CYCLES,
+	PMU_EVENT_INSTRUCTIONS,
+	PMU_EVENT_CACHE_MISSES,
+	PMU_EVENT_BRANCH_MISSES,
+	PMU_EVENT_ICACHE_MISSES,
+
+	PMU_EVENT_COUNT
+};
+
+/* the most events that can be configured at once, the arch may offer fewer */
+#define PMU_MAX_COUNTERS 4
+
+struct thread;
+
+#if WITH_KERNEL_PMU
+
+/* count events[0..count) on every cpu, count 0 turns the counters off */
+status_t pmu_configure(const uint *events, uint count);
+
+/* number of configured events, their ids copied to events if it's not NULL */
+uint pmu_get_config(uint *events);
+
+/* the current thread's counts, in configured order. returns how many were filled */
+uint pmu_read(uint64_t *counts);
+
+/* another thread's counts as of its last context switch */
+uint pmu_read_thread(struct thread *t, uint64_t *counts);
+
+const char *pmu_event_name(uint event);
+
+/* called by the scheduler with the thread lock held */
+void pmu_context_switch(struct thread *oldthread, struct thread *newthread);
+
+#else
+
+static inline status_t pmu_configure(const uint *events, uint count) { return ERR_NOT_SUPPORTED; }
+static inline uint pmu_get_config(uint *events) { return 0; }
+static inline uint pmu_read(uint64_t *counts) { return 0; }
+static inline uint pmu_read_thread(struct thread *t, uint64_t *counts) { return 0; }
+static inline const char *pmu_event_name(uint event) { return "unknown"; }
+static inline void pmu_context_switch(struct thread *oldthread, struct thread *newthread) {}
+
+#endif
+
+__END_CDECLS
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_POLL_H
+#define __KERNEL_POLL_H
+
+#include <compiler.h>
+#include <list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <kernel/event.h>
+#include <kernel/semaphore.h>
+#include <kernel/wait.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Pollers, one thread waiting on many objects at once.
+ *
+ * Any object built on a wait queue can be added to a poller: events, semaphores,
+ * and whatever is built on those, cbufs and tcp sockets among them. A poller
+ * is edge triggered. An object is reported once each time it becomes ready: an
+ * event when it's signalled, a semaphore when it's posted up to an available
+ * count. Reporting doesn't consume anything, the caller then waits on, reads
+ * from or trywaits the object itself, and should keep going until it would
+ * block before polling again. An object that's already ready when it's added
+ * is reported straight away.
+ *
+ * Each object/poller pair costs one small allocation. Destroying an object
+ * reports it one last time with POLL_HUP and drops it from the poller.
+ *
+ * Locking: the object's wait queue lock nests outside the poller's.
+ */
+
+#define POLLER_MAGIC 'pllr'
+
+/* what to report, chosen when the object is added */
+#define POLL_IN  0x1
+#define POLL_OUT 0x2
+#define POLL_HUP 0x4 /* the object was destroyed */
+
+typedef struct poller {
+	int magic;
+	wait_queue_t wait; /* its lock protects the poller */
+	struct list_node ready;
+	uint attached;
+} poller_t;
+
+typedef struct poll_result {
+	void *cookie;
+	uint events;
+} poll_result_t;
+
+#define POLLER_INITIAL_VALUE(p) \
+{ \
+	.magic = POLLER_MAGIC, \
+	.wait = WAIT_QUEUE_INITIAL_VALUE((p).wait), \
+	.ready = LIST_INITIAL_VALUE((p).ready), \
+	.attached = 0, \
+}
+
+void poller_init(poller_t *);
+
+/* every object has to have been removed first, returns ERR_BUSY otherwise */
+status_t poller_destroy(poller_t *);
+
+/* report events with cookie each time the object becomes ready. an object may
+ * be added to several pollers, but only once to each.
+ */
+status_t poller_add_event(poller_t *, event_t *, uint events, void *cookie);
+status_t poller_add_sem(poller_t *, semaphore_t *, uint events, void *cookie);
+status_t poller_remove_event(poller_t *, event_t *);
+status_t poller_remove_sem(poller_t *, semaphore_t *);
+
+/*
+ * wait for objects to become ready, filling in up to max results. an object
+ * that was ready more than once since the last call is reported once, with
+ * its events or'd together. returns the number of results, ERR_TIMED_OUT or
+ * ERR_OBJECT_DESTROYED.
+ */
+int poller_wait(poller_t *, poll_result_t *results, uint max, lk_time_t timeout);
+
+/* for objects built on a wait queue, with the queue's lock held */
+void wait_queue_poll_notify(wait_queue_t *);
+void wait_queue_poll_detach(wait_queue_t *);
+
+__END_CDECLS;
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_RCU_H
+#define __KERNEL_RCU_H
+
+#include <compiler.h>
+#include <list.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Read-copy-update, for read-mostly data structures such as lookup tables.
+ *
+ * Readers take no lock. They bracket their accesses with
+ * rcu_read_lock()/rcu_read_unlock(), which defer preemption of the current
+ * thread and count the reader in its cpu's nesting count, and load published
+ * pointers with rcu_dereference():
+ *
+ *	rcu_read_lock();
+ *	struct foo *f = rcu_dereference(foo_table[i]);
+ *	if (f)
+ *		use(f->bar);
+ *	rcu_read_unlock();
+ *
+ * Writers serialize among themselves with their own lock, publish a new
+ * version with rcu_assign_pointer(), and free the old one only after a grace
+ * period, either by blocking in synchronize_rcu() or by handing it to
+ * call_rcu(). A grace period has elapsed once every cpu has passed through
+ * the scheduler, or was seen idle or interrupted with no reader inside, at
+ * which point no reader can still hold the old pointer.
+ *
+ * Read side sections may nest and may be entered from interrupt context,
+ * but must not block, sleep or yield. The nesting count is what keeps an
+ * interrupt handler reading on an otherwise idle cpu from being missed.
+ */
+struct rcu_head;
+typedef void (*rcu_callback_t)(struct rcu_head *head);
+
+struct rcu_head {
+	struct list_node node;
+	rcu_callback_t func;
+};
+
+/* per cpu count of passes through the scheduler, a quiescent state, and of
+ * the read side sections the cpu is in. readers is only changed by its own cpu,
+ * an interrupt that reads puts it back before returning.
+ */
+struct rcu_cpu_state {
+	volatile ulong switches;
+	volatile uint readers;
+} __CPU_ALIGN;
+
+extern struct rcu_cpu_state rcu_cpu_state[SMP_MAX_CPUS];
+
+static inline void rcu_read_lock(void)
+{
+	thread_preempt_disable();
+	rcu_cpu_state[arch_curr_cpu_num()].readers++;
+
+	/* pairs with the fence in rcu_check_gp, it sees us before we see the old pointer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock(void)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rcu_cpu_state[arch_curr_cpu_num()].readers--;
+	thread_preempt_enable();
+}
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* run func(head) from thread context after a grace period. callable from
+ * interrupt context. the callback may free the object containing head.
+ */
+void call_rcu(struct rcu_head *head, rcu_callback_t func);
+
+/* block until a grace period has elapsed */
+void synchronize_rcu(void);
+
+/* called by the scheduler on every reschedule */
+static inline void rcu_note_context_switch(uint cpu)
+{
+	rcu_cpu_state[cpu].switches++;
+}
+
+__END_CDECLS;
+
+#endif
+
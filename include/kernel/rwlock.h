@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_RWLOCK_H
+#define __KERNEL_RWLOCK_H
+
+#include <compiler.h>
+#include <debug.h>
+#include <stdint.h>
+#include <kernel/thread.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS;
+
+#define RWLOCK_MAGIC 'rwlk'
+
+typedef struct rwlock {
+	uint32_t magic;
+	spin_lock_t lock;
+	int count; /* > 0 = number of readers, -1 = held for write, 0 = free */
+	thread_t *writer;
+	uint readers_waiting;
+	uint writers_waiting;
+	wait_queue_t read_wait;
+	wait_queue_t write_wait;
+} rwlock_t;
+
+#define RWLOCK_INITIAL_VALUE(rw) \
+{ \
+	.magic = RWLOCK_MAGIC, \
+	.lock = SPIN_LOCK_INITIAL_VALUE, \
+	.count = 0, \
+	.writer = NULL, \
+	.readers_waiting = 0, \
+	.writers_waiting = 0, \
+	.read_wait = WAIT_QUEUE_INITIAL_VALUE((rw).read_wait), \
+	.write_wait = WAIT_QUEUE_INITIAL_VALUE((rw).write_wait), \
+}
+
+/* Rules for Reader-Writer Locks:
+ * - Reader-writer locks are only safe to use from thread context.
+ * - Any number of readers may hold the lock at once, or a single writer.
+ * - Writers are preferred: once a writer is waiting, new readers block behind
+ *   it. A release hands the lock directly to the next waiting writer, or
+ *   failing that to every waiting reader, so woken threads never retry.
+ * - Reader-writer locks are non-recursive, and a reader may not upgrade.
+*/
+
+void rwlock_init(rwlock_t *);
+void rwlock_destroy(rwlock_t *);
+void rwlock_acquire_read(rwlock_t *);
+void rwlock_release_read(rwlock_t *);
+void rwlock_acquire_write(rwlock_t *);
+void rwlock_release_write(rwlock_t *);
+
+/* does the current thread hold the lock for write? */
+static inline bool is_rwlock_write_held(const rwlock_t *rw) {
+	return rw->writer == get_current_thread();
+}
+
+__END_CDECLS;
+#endif
+
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_SEQLOCK_H
+#define __KERNEL_SEQLOCK_H
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Sequence lock, for small, hot, read-mostly data.
+ *
+ * Readers never write to shared memory or block. They take a snapshot of the
+ * sequence count, read the data, and retry if a writer ran in the meantime:
+ *
+ *	uint32_t seq;
+ *	do {
+ *		seq = seqlock_read_begin(&s);
+ *		copy = data;
+ *	} while (seqlock_read_retry(&s, seq));
+ *
+ * Writers are serialized by a spinlock with interrupts disabled, so a seqlock
+ * may be read or written from interrupt context. Readers may see torn data
+ * inside the loop and must not follow pointers out of it.
+ */
+typedef struct seqlock {
+	uint32_t seq; /* odd while a write is in progress */
+	spin_lock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INITIAL_VALUE(s) \
+{ \
+	.seq = 0, \
+	.lock = SPIN_LOCK_INITIAL_VALUE, \
+}
+
+static inline void seqlock_init(seqlock_t *s)
+{
+	s->seq = 0;
+	spin_lock_init(&s->lock);
+}
+
+static inline uint32_t seqlock_read_begin(const seqlock_t *s)
+{
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+
+	return seq;
+}
+
+static inline bool seqlock_read_retry(const seqlock_t *s, uint32_t seq)
+{
+	/* order the data reads before the second look at the count */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqlock_write_begin(seqlock_t *s, spin_lock_saved_state_t *state)
+{
+	spin_lock_save(&s->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	/* make the odd count visible before any of the data writes */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(seqlock_t *s, spin_lock_saved_state_t state)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+	spin_unlock_restore(&s->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+__END_CDECLS;
+#endif
+
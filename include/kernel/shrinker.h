@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_SHRINKER_H
+#define __KERNEL_SHRINKER_H
+
+#include <compiler.h>
+#include <list.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Memory pressure callbacks for caches.
+ *
+ * A cache that holds on to memory it could do without registers a shrinker.
+ * When an allocation in the pmm or the heap fails, or the pmm drops below its
+ * low watermark, the registered caches are asked to give memory back, each in
+ * proportion to what its count hook says it could release.
+ *
+ * Caches are shrunk most recently registered first, so one built on top of
+ * another (thread structs in a slab, slabs in pages) releases into it before
+ * it is asked.
+ *
+ * The scan hook may be called on behalf of an allocation that is holding
+ * locks of its own. It must not allocate, and must not block on anything
+ * an allocator may be holding. A cache whose release needs such locks sets
+ * SHRINKER_FLAG_BACKGROUND and is only shrunk from the background thread.
+ */
+struct shrinker;
+
+/* shrinker flags */
+#define SHRINKER_FLAG_BACKGROUND (1<<0) /* never shrunk from within an allocation */
+
+typedef struct shrinker {
+	struct list_node node;
+	const char *name;
+	uint flags;
+
+	/* bytes the cache could give back right now, an estimate is fine */
+	size_t (*count)(struct shrinker *);
+	/* give back about target bytes, returns how many were released */
+	size_t (*scan)(struct shrinker *, size_t target);
+	void *arg;
+
+	/* stats, protected by the shrinker lock */
+	ulong calls;
+	size_t freed;
+} shrinker_t;
+
+#define SHRINKER_INITIAL_VALUE(_name, _flags, _count, _scan, _arg) \
+{ \
+	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.name = _name, \
+	.flags = _flags, \
+	.count = _count, \
+	.scan = _scan, \
+	.arg = _arg, \
+	.calls = 0, \
+	.freed = 0, \
+}
+
+void shrinker_register(shrinker_t *);
+void shrinker_unregister(shrinker_t *);
+
+/* why caches are being shrunk */
+enum shrink_reason {
+	SHRINK_ALLOC_FAILED = 0,
+	SHRINK_BACKGROUND, /* low watermark, or what a failed allocation didn't get back */
+	SHRINK_MANUAL,
+
+	SHRINK_REASON_COUNT,
+};
+
+/* ask the caches for about bytes back and wait for them, returns how many
+ * they released. does nothing, returning 0, if called from inside a scan */
+size_t shrink_caches(size_t bytes, enum shrink_reason reason);
+
+/* have the background thread shrink by about bytes, callable with a mutex held */
+void shrink_caches_async(size_t bytes);
+
+__END_CDECLS;
+
+#endif
@@ -27,11 +27,34 @@
 
 __BEGIN_CDECLS
 
+#if WITH_SMP && LK_DEBUGLEVEL > 1
+/* counts the contention in thread_stats and waits for the lock */
+void spin_lock_contended(spin_lock_t *lock);
+#endif
+
+#if WITH_LOCK_STATS
+/* records the acquisition in the lock profiler, see kernel/lockstat.h */
+void spin_lock_stats(spin_lock_t *lock);
+
+/* interrupts should already be disabled */
+static inline void spin_lock(spin_lock_t *lock)
+{
+    spin_lock_stats(lock);
+}
+#elif WITH_SMP && LK_DEBUGLEVEL > 1
+/* interrupts should already be disabled */
+static inline void spin_lock(spin_lock_t *lock)
+{
+    if (unlikely(arch_spin_trylock(lock)))
+        spin_lock_contended(lock);
+}
+#else
 /* interrupts should already be disabled */
 static inline void spin_lock(spin_lock_t *lock)
 {
     arch_spin_lock(lock);
 }
+#endif
 
  /* Returns 0 on success, non-0 on failure */
 static inline int spin_trylock(spin_lock_t *lock)
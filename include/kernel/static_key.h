@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_STATIC_KEY_H
+#define __KERNEL_STATIC_KEY_H
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Runtime patched branches for instrumentation that is normally off.
+ *
+ *   STATIC_KEY_DEFINE(mytrace, false);
+ *   ...
+ *   if (static_key_enabled(&mytrace))
+ *       do_expensive_tracing();
+ *
+ * On arches with ARCH_HAS_STATIC_KEYS each test compiles to a single nop in
+ * line with the surrounding code, and the traced code is moved out of line.
+ * Flipping the key rewrites every one of its nops into a jump to the traced
+ * code, or back. Elsewhere the test is a load and a predicted not taken
+ * branch on the key.
+ *
+ * Flipping a key is slow: it holds every other cpu in an ipi while the text
+ * is rewritten. It's meant for the console, not for anything on a fast path.
+ * Keys are found by name from there, see the statickey command.
+ */
+struct static_key {
+	volatile bool enabled;
+	const char *name;
+};
+
+/* one per static_key_enabled() site, emitted by the arch header */
+struct static_key_jump {
+	uintptr_t code;
+	uintptr_t target;
+	struct static_key *key;
+};
+
+#define STATIC_KEY_DEFINE_NAMED(var, keyname, on) \
+	struct static_key var __SECTION(".static_keys") __ALIGNED(sizeof(void *)) = { \
+		.enabled = (on), \
+		.name = (keyname), \
+	}
+
+#define STATIC_KEY_DEFINE(var, on) STATIC_KEY_DEFINE_NAMED(var, #var, on)
+#define STATIC_KEY_DECLARE(var) extern struct static_key var
+
+#if ARCH_HAS_STATIC_KEYS
+#include <arch/static_key.h>
+
+#define static_key_enabled(key) arch_static_key_branch(key)
+#else
+#define static_key_enabled(key) unlikely((key)->enabled)
+#endif
+
+status_t static_key_set(struct static_key *key, bool enable);
+static inline status_t static_key_enable(struct static_key *key) { return static_key_set(key, true); }
+static inline status_t static_key_disable(struct static_key *key) { return static_key_set(key, false); }
+
+struct static_key *static_key_find(const char *name);
+
+__END_CDECLS;
+
+#endif
+
@@ -29,9 +29,13 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/pmu.h>
 #include <kernel/wait.h>
 #include <kernel/spinlock.h>
+#include <kernel/static_key.h>
+#include <kernel/timer.h>
 #include <debug.h>
+#include <assert.h>
 
 __BEGIN_CDECLS;
 
@@ -46,6 +50,16 @@ enum thread_state {
 
 typedef int (*thread_start_routine)(void *arg);
 
+/* thread level statistics. a build can define THREAD_STATS=1 to compile the
+ * counters in with them switched off, see the thread_stats static key */
+#ifndef THREAD_STATS
+#if LK_DEBUGLEVEL > 1
+#define THREAD_STATS 1
+#else
+#define THREAD_STATS 0
+#endif
+#endif
+
 /* thread local storage */
 enum thread_tls_list {
 #ifdef WITH_LIB_UTHREAD
@@ -53,6 +67,12 @@ enum thread_tls_list {
 #endif
 #ifdef WITH_LIB_LKUSER
 	TLS_ENTRY_LKUSER,
+#endif
+#if WITH_MALLOC_THREAD_CACHE
+	TLS_ENTRY_MALLOC,
+#endif
+#ifdef WITH_LIB_FIBER
+	TLS_ENTRY_FIBER,
 #endif
 	MAX_TLS_ENTRY
 };
@@ -62,6 +82,14 @@ enum thread_tls_list {
 #define THREAD_FLAG_FREE_STRUCT 0x4
 #define THREAD_FLAG_REAL_TIME 0x8
 #define THREAD_FLAG_IDLE 0x10
+#define THREAD_FLAG_DEADLINE 0x20
+
+/* deadline scheduling parameters, see thread_set_deadline(). all in us */
+typedef struct thread_deadline_params {
+	lk_bigtime_t runtime;	/* cpu time guaranteed each period */
+	lk_bigtime_t deadline;	/* relative to the start of the period */
+	lk_bigtime_t period;
+} thread_deadline_params_t;
 
 #define THREAD_MAGIC 'thrd'
 
@@ -71,12 +99,22 @@ typedef struct thread {
 
 	/* active bits */
 	struct list_node queue_node;
-	int priority;
+	int priority; /* effective priority, the higher of base and inherited */
+	int base_priority;
+	int inherited_priority; /* from waiters on mutexes this thread holds, or -1 */
+	struct list_node held_mutexes; /* contested mutexes held, see mutex.c */
 	enum thread_state state;
 	int remaining_quantum;
 	unsigned int flags;
 	int curr_cpu;
+	int last_cpu; /* cpu this thread most recently ran on, or -1 */
+	int rq_cpu; /* cpu whose run queue lock covers it while queued or running there, or -1 */
+	bool on_cpu; /* running, or not yet finished switching away */
+	spin_lock_t sched_lock; /* serializes wakeups and scheduling parameter changes */
 	int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+	uint32_t affinity; /* mp_cpu_mask_t it may run on, 0 for any cpu that isn't isolated */
+	int preempt_disable_count; /* involuntary preemption deferred while > 0 */
+	bool preempt_pending; /* a preemption arrived while it was disabled */
 
 	/* if blocked, a pointer to the wait queue */
 	struct wait_queue *blocking_wait_queue;
@@ -85,6 +123,11 @@ typedef struct thread {
 	/* architecture stuff */
 	struct arch_thread arch;
 
+#if WITH_KERNEL_VM
+	/* user aspace it runs in, NULL if none, see vmm_set_active_aspace() */
+	struct vmm_aspace *aspace;
+#endif
+
 	/* stack stuff */
 	void *stack;
 	size_t stack_size;
@@ -100,6 +143,35 @@ typedef struct thread {
 	/* thread local storage */
 	uintptr_t tls[MAX_TLS_ENTRY];
 
+#if THREAD_STATS
+	/* when it last went into a run queue, and the irq entry that put it there if any */
+	lk_bigtime_t ready_time;
+	lk_bigtime_t ready_irq_time;
+
+	/* cpu time used, not counting the current run if it's running */
+	lk_bigtime_t runtime;
+	lk_bigtime_t last_run_time; /* when it was last switched in */
+	ulong context_switches; /* times switched in */
+	ulong migrations; /* switched in on a different cpu than last time */
+#endif
+
+	/* deadline scheduling state, only meaningful with THREAD_FLAG_DEADLINE */
+	struct {
+		thread_deadline_params_t params;
+		lk_bigtime_t abs_deadline; /* of the current period */
+		lk_bigtime_t budget; /* runtime left in the current period */
+		lk_bigtime_t run_start; /* when it was switched in, 0 if not running */
+		uint bw; /* runtime / period, fixed point */
+		int cpu; /* cpu it was admitted to */
+		bool throttled; /* out of budget until the next period */
+		timer_t timer; /* replenishes the budget of a throttled thread */
+	} dl;
+
+#if WITH_KERNEL_PMU
+	/* performance counter events counted while this thread ran, see kernel/pmu.h */
+	uint64_t pmu_count[PMU_MAX_COUNTERS];
+#endif
+
 	char name[32];
 } thread_t;
 
@@ -133,14 +205,27 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 status_t thread_resume(thread_t *);
 void thread_exit(int retcode) __NO_RETURN;
 void thread_sleep(lk_time_t delay);
+void thread_sleep_hires(lk_bigtime_t delay);
 status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+status_t thread_set_deadline(thread_t *t, const thread_deadline_params_t *params);
+status_t thread_set_affinity(thread_t *t, uint32_t cpu_mask);
+void thread_set_inherited_priority_locked(thread_t *t, int priority);
+
+const char *thread_state_to_str(enum thread_state state);
+void dump_thread(thread_t *t) __COLD;
+void arch_dump_thread(thread_t *t) __COLD;
+void dump_all_threads(void) __COLD;
+void dump_all_threads_unlocked(void) __COLD;
 
-void dump_thread(thread_t *t);
-void arch_dump_thread(thread_t *t);
-void dump_all_threads(void);
+/* call cb on every thread with the thread lock held, cb must not block */
+void thread_for_each(void (*cb)(thread_t *t, void *arg), void *arg);
+
+/* call cb with t's scheduling state locked, so the scheduler isn't changing its
+ * state or accounting meanwhile. nests inside the thread lock, cb must not block */
+void thread_snapshot(thread_t *t, void (*cb)(thread_t *t, void *arg), void *arg);
 
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
@@ -148,6 +233,10 @@ void thread_preempt(void); /* get preempted (inserted into head of run queue) */
 void thread_block(void); /* block on something and reschedule */
 void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
 
+/* the new thread's half of a context switch, called with interrupts disabled
+ * by the arch code before a new thread first runs */
+void thread_switch_finish(void);
+
 #ifdef WITH_LIB_UTHREAD
 void uthread_context_switch(thread_t *oldthread, thread_t *newthread);
 #endif
@@ -159,7 +248,9 @@ enum handler_return thread_timer_tick(void);
 thread_t *get_current_thread(void);
 void set_current_thread(thread_t *);
 
-/* scheduler lock */
+/* protects the thread list, the wait queue lists, priority inheritance and
+ * deadline admission. nests inside any wait queue lock. the run queues and
+ * thread states have locks of their own, see kernel/thread.c */
 extern spin_lock_t thread_lock;
 
 #define THREAD_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave(&thread_lock, state)
@@ -184,12 +275,28 @@ static inline __ALWAYS_INLINE uintptr_t __tls_set(uint entry, uintptr_t val)
 		__tls_set(e, v); \
 	})
 
-/* thread level statistics */
-#if LK_DEBUGLEVEL > 1
-#define THREAD_STATS 1
-#else
-#define THREAD_STATS 0
-#endif
+/* defer involuntary preemption of the current thread. interrupts still
+ * run, but a preemption they request is held until the matching enable.
+ * the thread must not block, sleep or yield while preemption is disabled.
+ */
+static inline void thread_preempt_disable(void)
+{
+	get_current_thread()->preempt_disable_count++;
+	CF;
+}
+
+static inline void thread_preempt_enable(void)
+{
+	thread_t *t = get_current_thread();
+
+	CF;
+	DEBUG_ASSERT(t->preempt_disable_count > 0);
+	if (--t->preempt_disable_count == 0 && t->preempt_pending) {
+		t->preempt_pending = false;
+		thread_preempt();
+	}
+}
+
 #if THREAD_STATS
 struct thread_stats {
 	lk_bigtime_t idle_time;
@@ -201,24 +308,65 @@ struct thread_stats {
 	ulong interrupts; /* platform code increment this */
 	ulong timer_ints; /* timer code increment this */
 	ulong timers; /* timer code increment this */
+	ulong timers_coalesced; /* timers fired early inside their slack, sharing another's interrupt */
+	lk_bigtime_t irq_enter_time; /* while inside an irq handler, 0 otherwise */
 
 #if WITH_SMP
 	ulong reschedule_ipis;
+	ulong generic_ipis;
+	ulong steals; /* threads taken from another cpu's run queue */
+	ulong spin_contended; /* spin_lock() calls that had to wait */
 #endif
 };
 
-extern struct thread_stats thread_stats[SMP_MAX_CPUS];
+/* kept in the per cpu struct, see kernel/percpu.h. counted while the
+ * thread_stats key is on, which it is from boot in debug builds */
+STATIC_KEY_DECLARE(thread_stats_key);
+
+#define THREAD_STATS_INC(name) do { if (static_key_enabled(&thread_stats_key)) get_percpu()->stats.name++; } while(0)
+
+/* scheduling latency histograms, log2 of microseconds. the last bucket takes everything above */
+#define SCHED_LATENCY_BUCKETS 24
+#define SCHED_RUNQ_BUCKETS 16
+
+struct sched_latency {
+	uint32_t ready[SCHED_LATENCY_BUCKETS]; /* into a run queue until picked to run */
+	uint32_t irq[SCHED_LATENCY_BUCKETS]; /* irq entry until the thread it readied runs */
+	uint32_t prio[NUM_PRIORITIES][SCHED_LATENCY_BUCKETS]; /* ready latency by priority */
+	uint32_t runq[SCHED_RUNQ_BUCKETS]; /* threads left waiting in the run queue at each pick */
+	lk_bigtime_t ready_max;
+	lk_bigtime_t irq_max;
+};
+
+/* copy out a cpu's histograms, consistent with each other */
+void sched_latency_snapshot(uint cpu, struct sched_latency *l);
+void sched_latency_reset(void);
+
+/* cpu time t has used so far, including its current run. the thread lock must
+ * be held to keep t around */
+lk_bigtime_t thread_runtime_locked(thread_t *t);
 
-#define THREAD_STATS_INC(name) do { thread_stats[arch_curr_cpu_num()].name++; } while(0)
+/* platform irq code brackets its handlers with these. besides counting
+ * interrupts they let the scheduler measure irq to thread latency. */
+void thread_stats_irq_enter(void);
+void thread_stats_irq_exit(void);
+
+#define THREAD_STATS_IRQ_ENTER() thread_stats_irq_enter()
+#define THREAD_STATS_IRQ_EXIT() thread_stats_irq_exit()
 
 #else
 
 #define THREAD_STATS_INC(name) do { } while (0)
+#define THREAD_STATS_IRQ_ENTER() do { } while (0)
+#define THREAD_STATS_IRQ_EXIT() do { } while (0)
 
 #endif
 
 __END_CDECLS;
 
+/* needs struct thread_stats from above */
+#include <kernel/percpu.h>
+
 #endif
 
 /* vim: set ts=4 sw=4 noexpandtab: */
@@ -24,6 +24,7 @@
 #define __KERNEL_TIMER_H
 
 #include <compiler.h>
+#include <stdbool.h>
 #include <list.h>
 #include <sys/types.h>
 
@@ -36,23 +37,51 @@ typedef enum handler_return (*timer_callback)(struct timer *, lk_time_t now, voi
 
 #define TIMER_MAGIC 'timr'
 
+/* timer flags */
+#define TIMER_FLAG_DEFERRABLE	(1<<0)	/* may be moved off an idle cpu */
+
 typedef struct timer {
 	int magic;
+#if KERNEL_TIMER_HEAP
+	/* pairing heap links, prev points at the parent of a leftmost child */
+	struct timer *heap_child;
+	struct timer *heap_next;
+	struct timer *heap_prev;
+#else
 	struct list_node node;
+#endif
+	int cpu; /* cpu that owns the timer, -1 if it has never been set */
+	bool queued;
+	uint flags;
 
-	lk_time_t scheduled_time;
-	lk_time_t periodic_time;
+	lk_bigtime_t scheduled_time;	/* absolute deadline, in us */
+	lk_bigtime_t periodic_time;	/* period in us, 0 if oneshot */
+	lk_bigtime_t slack;		/* how late, in us, the timer may fire */
 
 	timer_callback callback;
 	void *arg;
 } timer_t;
 
+#if KERNEL_TIMER_HEAP
+#define TIMER_QUEUE_INITIAL_VALUE \
+	.heap_child = NULL, \
+	.heap_next = NULL, \
+	.heap_prev = NULL,
+#else
+#define TIMER_QUEUE_INITIAL_VALUE \
+	.node = LIST_INITIAL_CLEARED_VALUE,
+#endif
+
 #define TIMER_INITIAL_VALUE(t) \
 { \
 	.magic = TIMER_MAGIC, \
-	.node = LIST_INITIAL_CLEARED_VALUE, \
+	TIMER_QUEUE_INITIAL_VALUE \
+	.cpu = -1, \
+	.queued = false, \
+	.flags = 0, \
 	.scheduled_time = 0, \
 	.periodic_time = 0, \
+	.slack = 0, \
 	.callback = NULL, \
 	.arg = NULL, \
 }
@@ -61,13 +90,40 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Deadlines are kept in us. On platforms with PLATFORM_HAS_DYNAMIC_TIMER the
+ *   hardware is programmed for the earliest deadline, so the _hires variants
+ *   can fire with sub-millisecond resolution. Elsewhere timers are dispatched
+ *   from a 10ms periodic tick.
+ * - A timer with slack may fire up to that many us late, which lets the
+ *   hardware be programmed once for a batch of nearby timers. It never fires
+ *   early.
+ * - Timers run on the cpu they were set from, or the one passed to
+ *   timer_set_on_cpu(). Each cpu has its own queue, so setting and firing
+ *   timers on different cpus doesn't contend.
+ * - A deferrable timer may instead be moved to a busy cpu when its cpu idles,
+ *   so it won't wake that cpu back up just to run it.
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
+void timer_set_oneshot_hires(timer_t *, lk_bigtime_t delay, timer_callback, void *arg);
+void timer_set_periodic_hires(timer_t *, lk_bigtime_t period, timer_callback, void *arg);
+status_t timer_set_on_cpu(timer_t *, uint cpu, lk_bigtime_t delay, lk_bigtime_t period, timer_callback, void *arg);
+void timer_set_slack(timer_t *, lk_bigtime_t slack);
+void timer_set_deferrable(timer_t *, bool deferrable);
 void timer_cancel(timer_t *);
 
+/* called by the idle thread before idling the cpu */
+void timer_migrate_deferrable(void);
+
+/* when the next timer interrupt is due on this cpu, as a current_time_hires()
+ * value, or TIMER_NO_DEADLINE if nothing is queued. Elsewhere than
+ * PLATFORM_HAS_DYNAMIC_TIMER it's no later than the next periodic tick.
+ * Interrupts must be disabled.
+ */
+#define TIMER_NO_DEADLINE UINT64_MAX
+lk_bigtime_t timer_next_deadline(void);
+
 __END_CDECLS;
 
 #endif
@@ -52,6 +52,9 @@
 #include <stdlib.h>
 #include <arch.h>
 #include <arch/mmu.h>
+#if ARCH_HAS_ASPACE
+#include <arch/aspace.h>
+#endif
 
 __BEGIN_CDECLS
 
@@ -83,10 +86,14 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8; /* if free and queued in the pmm, log2 of the pages in the block it heads */
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_ZEROED   (0x2) /* zero filled while free, cleared when the page is freed again */
+#define VM_PAGE_FLAG_MOVABLE  (0x4) /* allocated, and the vmm may move its contents to another page */
+#define VM_PAGE_FLAG_CMA      (0x8) /* belongs to a PMM_ARENA_FLAG_CMA arena, kept across frees */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -120,12 +127,18 @@ static inline bool is_user_address(vaddr_t va)
 
 
 /* physical allocator */
+
+/* free pages are kept in naturally aligned power of two blocks of up to
+ * 1 << PMM_MAX_ORDER pages */
+#define PMM_MAX_ORDER 20
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
 
     uint flags;
     uint priority;
+    uint node_id; /* numa node or memory bank, for PMM_ALLOC_FLAG_LOCAL */
 
     paddr_t base;
     size_t  size;
@@ -133,19 +146,47 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER + 1]; /* buddy free lists, by block order */
+    size_t zero_cursor; /* next page for the background zeroing to look at */
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
+#define PMM_ARENA_FLAG_CMA  (0x2) /* kept for contiguous runs, lent to movable pages meanwhile. needs KMAP */
+#define PMM_ARENA_FLAG_FAST (0x4) /* on chip sram or tcm, for PMM_ALLOC_FLAG_FAST */
 
     /* Add a pre-filled memory arena to the physical allocator. */
 status_t pmm_add_arena(pmm_arena_t *arena) __NONNULL((1));
 
+    /* Put cpu on a numa node, the one PMM_ALLOC_FLAG_LOCAL prefers on it.
+     * All cpus start out on node 0.
+     */
+void pmm_set_cpu_node(uint cpu, uint node);
+
+    /* Page counts over the arenas on a node. ERR_NOT_FOUND if there are none. */
+typedef struct pmm_node_stats {
+    uint arenas;
+    size_t total_pages;
+    size_t free_pages;
+    size_t fast_free_pages;
+} pmm_node_stats_t;
+
+status_t pmm_get_node_stats(uint node, pmm_node_stats_t *stats) __NONNULL((2));
+
+    /* Call func on each run of allocated pages in the kernel mapped arenas,
+     * arena by arena, stopping at the first error it returns. Takes no locks, it's
+     * meant for crash dumps once nothing else is running.
+     */
+typedef status_t (*pmm_used_range_func_t)(paddr_t pa, void *va, size_t len, void *arg);
+status_t pmm_for_each_used_range_unlocked(pmm_used_range_func_t func, void *arg) __NONNULL((1));
+
     /* Allocate count pages of physical memory, adding to the tail of the passed list.
      * The list must be initialized.
      * Returns the number of pages allocated.
      */
-size_t pmm_alloc_pages(uint count, struct list_node *list) __NONNULL((2));
+size_t pmm_alloc_pages_etc(uint count, struct list_node *list, uint flags) __NONNULL((2));
+static inline size_t pmm_alloc_pages(uint count, struct list_node *list) {
+    return pmm_alloc_pages_etc(count, list, 0);
+}
 
     /* Allocate a specific range of physical pages, adding to the tail of the passed list.
      * The list must be initialized.
@@ -161,20 +202,49 @@ size_t pmm_free(struct list_node *list) __NONNULL((1));
     /* Helper routine for the above. */
 size_t pmm_free_page(vm_page_t *page) __NONNULL((1));
 
+    /* Allocate a single page, NULL if none are left.
+     * Single page allocations and frees go through a per cpu cache and
+     * normally take no lock.
+     */
+vm_page_t *pmm_alloc_page(void);
+
     /* Allocate a run of contiguous pages, aligned on log2 byte boundary (0-31)
      * If the optional physical address pointer is passed, return the address.
      * If the optional list is passed, append the allocate page structures to the tail of the list.
+     * Once the other kmap arenas can't fit the run, movable pages are migrated
+     * out of a CMA arena to make room, so this may block on the vmm.
      */
-size_t pmm_alloc_contiguous(uint count, uint8_t align_log2, paddr_t *pa, struct list_node *list);
+size_t pmm_alloc_contiguous_etc(uint count, uint8_t align_log2, paddr_t *pa, struct list_node *list, uint flags);
+static inline size_t pmm_alloc_contiguous(uint count, uint8_t align_log2, paddr_t *pa, struct list_node *list) {
+    return pmm_alloc_contiguous_etc(count, align_log2, pa, list, 0);
+}
 
     /* Allocate a run of pages out of the kernel area and return the pointer in kernel space.
      * If the optional list is passed, append the allocate page structures to the tail of the list.
      */
-void *pmm_alloc_kpages(uint count, struct list_node *list);
+void *pmm_alloc_kpages_etc(uint count, struct list_node *list, uint flags);
+static inline void *pmm_alloc_kpages(uint count, struct list_node *list) {
+    return pmm_alloc_kpages_etc(count, list, 0);
+}
+
+    /* Flags for the _etc variants above. */
+#define PMM_ALLOC_FLAG_ZERO (0x1) /* zero fill, using pages pre-zeroed in the background where possible */
+#define PMM_ALLOC_FLAG_MOVABLE (0x2) /* pmm_alloc_pages_etc only, may be lent out of a CMA arena. see VMM_FLAG_MOVABLE */
+    /* Placement preferences. Arenas that fit are tried first, then the rest, so
+     * these never fail an allocation that would have worked without them. */
+#define PMM_ALLOC_FLAG_LOCAL (0x4) /* from the node of the calling cpu */
+#define PMM_ALLOC_FLAG_FAST  (0x8) /* from PMM_ARENA_FLAG_FAST arenas */
+#define PMM_ALLOC_FLAG_BULK  (0x10) /* from anything but PMM_ARENA_FLAG_FAST arenas, leaving those for who needs them */
 
     /* Helper routine for pmm_alloc_kpages. */
 static inline void *pmm_alloc_kpage(void) { return pmm_alloc_kpages(1, NULL); }
 
+    /* Free count pages starting at a page aligned kernel address inside a run
+     * from pmm_alloc_kpages. The pages need not be a whole run.
+     * Returns the number of pages freed.
+     */
+size_t pmm_free_kpages(void *ptr, uint count);
+
 /* physical to virtual */
 void *paddr_to_kvaddr(paddr_t pa);
 
@@ -192,23 +262,48 @@ typedef struct vmm_aspace {
     size_t  size;
 
     struct list_node region_list;
+    struct vmm_region *region_tree;
+
+#if ARCH_HAS_ASPACE
+    /* translation table and tlb tag, user aspaces only */
+    struct arch_aspace arch_aspace;
+#endif
 } vmm_aspace_t;
 
+/* fills in a page of a backed region the first time it's touched. offset is from
+ * the start of the region, page is a kernel mapping of the new page. */
+typedef status_t (*vmm_fill_func_t)(void *arg, size_t offset, void *page);
+
 typedef struct vmm_region {
     struct list_node node;
     char name[32];
 
+    /* avl tree of the aspace's regions keyed by base, with the free gap in
+     * front of each region and the largest such gap in each subtree */
+    struct vmm_region *tree_parent;
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    int tree_height;
+    size_t gap;
+    size_t max_gap;
+
     uint flags;
     uint arch_mmu_flags;
 
     vaddr_t base;
     size_t  size;
 
+    /* lazy regions only, zero filled if not set */
+    vmm_fill_func_t fill;
+    void *fill_arg;
+
     struct list_node page_list;
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
 #define VMM_REGION_FLAG_PHYSICAL 0x2
+#define VMM_REGION_FLAG_LAZY     0x4
+#define VMM_REGION_FLAG_MOVABLE  0x8
 
 /* grab a handle to the kernel address space */
 extern vmm_aspace_t _kernel_aspace;
@@ -233,11 +328,37 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
 status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, uint vmm_flags, uint arch_mmu_flags)
     __NONNULL((1));
 
+/* allocate a lazy region whose pages are filled in by fill as they're touched, instead of zeroed.
+   fill runs from the page fault handler without the vmm lock held, and may block. */
+status_t vmm_alloc_backed(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2,
+                          vmm_fill_func_t fill, void *fill_arg, uint vmm_flags, uint arch_mmu_flags)
+    __NONNULL((1, 6));
+
 /* Unmap previously allocated region and free physical memory pages backing it (if any) */
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
+/* Resolve a page fault at addr by backing a lazy region with a fresh zeroed or filled page.
+   Called by the arch fault handlers, returns NO_ERROR if the access can be retried. */
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags);
+
+#define VMM_PF_FLAG_WRITE       0x1
+#define VMM_PF_FLAG_USER        0x2
+#define VMM_PF_FLAG_INSTRUCTION 0x4
+#define VMM_PF_FLAG_NOT_PRESENT 0x8
+
     /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
+    /* Zero fill the memory, vmm_alloc_contiguous only. */
+#define VMM_FLAG_ZERO 0x2
+    /* Only reserve the space, vmm_alloc only. Pages are allocated zeroed and mapped on first touch. */
+#define VMM_FLAG_LAZY 0x4
+    /* Leave an unmapped guard page below the returned pointer, vmm_alloc only.
+       The guard is part of the region, so vmm_free_region on the pointer releases it too. */
+#define VMM_FLAG_GUARD 0x8
+    /* Back the memory with pages the pmm may take back for contiguous runs, vmm_alloc on cached memory only.
+       While a page is being moved its mapping is briefly gone and touching it blocks on the vmm, so the
+       memory must not be used from interrupt context or with a spinlock held. */
+#define VMM_FLAG_MOVABLE 0x10
 
 /* allocate a new address space */
 status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags)
@@ -249,6 +370,14 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
 
 #define VMM_FLAG_ASPACE_KERNEL 0x1
 
+/* Switch the current thread to aspace, NULL for none. The kernel aspace is
+ * mapped regardless, user aspaces come and go with the threads running in
+ * them. Threads start out in none. */
+void vmm_set_active_aspace(vmm_aspace_t *aspace);
+
+/* called by the scheduler when the next thread runs in a different aspace */
+void vmm_context_switch(vmm_aspace_t *oldaspace, vmm_aspace_t *newaspace);
+
 __END_CDECLS
 
 #endif // !ASSEMBLY
@@ -29,31 +29,51 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/spinlock.h>
 
 __BEGIN_CDECLS;
 
 /* wait queue stuff */
 #define WAIT_QUEUE_MAGIC 'wait'
 
+struct poll_entry;
+
 typedef struct wait_queue {
 	int magic;
-	struct list_node list;
+	spin_lock_t lock;
+	struct list_node list;	/* highest priority first, fifo within a priority */
 	int count;
+	uint32_t bitmap;	/* priorities with a thread in the list */
+	struct poll_entry *pollers; /* pollers watching the object built on this queue, see kernel/poll.h */
 } wait_queue_t;
 
 #define WAIT_QUEUE_INITIAL_VALUE(q) \
 { \
 	.magic = WAIT_QUEUE_MAGIC, \
+	.lock = SPIN_LOCK_INITIAL_VALUE, \
 	.list = LIST_INITIAL_VALUE((q).list), \
-	.count = 0 \
+	.count = 0, \
+	.bitmap = 0, \
+	.pollers = NULL, \
 }
 
+/* each wait queue carries its own lock, which objects built on top of a wait
+ * queue (mutexes, events, semaphores) also use to protect their own state.
+ * it nests outside the scheduler's thread_lock.
+ */
+#define WAIT_QUEUE_LOCK(wait, state) spin_lock_saved_state_t state; spin_lock_irqsave(&(wait)->lock, state)
+#define WAIT_QUEUE_UNLOCK(wait, state) spin_unlock_irqrestore(&(wait)->lock, state)
+
+/* for a wait that ended in ERR_OBJECT_DESTROYED, which returns without the lock */
+#define WAIT_QUEUE_RESTORE(state) arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS)
+
 /* wait queue primitive */
-/* NOTE: must be inside critical section when using these */
+/* NOTE: must hold the wait queue's lock when using these */
 void wait_queue_init(wait_queue_t *wait);
 
 /*
- * release all the threads on this wait queue with a return code of ERR_OBJECT_DESTROYED.
+ * release all the threads on this wait queue with a return code of ERR_OBJECT_DESTROYED,
+ * and tell any pollers watching it that it's gone.
  * the caller must assure that no other threads are operating on the wait queue during or
  * after the call.
  */
@@ -64,20 +84,28 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
  * return status is whatever the caller of wait_queue_wake_*() specifies.
  * a timeout other than INFINITE_TIME will set abort after the specified time
  * and return ERR_TIMED_OUT. a timeout of 0 will immediately return.
+ * the wait queue's lock is held again on return, except after ERR_OBJECT_DESTROYED:
+ * the queue may be freed by then, so only the interrupt state is left to restore.
  */
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 
+/* same as wait_queue_block() with the timeout in us, INFINITE_TIME_HIRES to wait forever */
+status_t wait_queue_block_hires(wait_queue_t *, lk_bigtime_t timeout);
+
 /*
- * release one or more threads from the wait queue.
+ * release one or more threads from the wait queue, highest priority first.
  * reschedule = should the system reschedule if any is released.
  * wait_queue_error = what wait_queue_block() should return for the blocking thread.
+ * wait_queue_wake_n() releases up to count threads.
  */
 int wait_queue_wake_one(wait_queue_t *, bool reschedule, status_t wait_queue_error);
+int wait_queue_wake_n(wait_queue_t *, int count, bool reschedule, status_t wait_queue_error);
 int wait_queue_wake_all(wait_queue_t *, bool reschedule, status_t wait_queue_error);
 
 /*
  * remove the thread from whatever wait queue it's in.
  * return an error if the thread is not currently blocked (or is the current thread)
+ * the lock of the queue the thread is blocked on must be held.
  */
 status_t thread_unblock_from_wait_queue(struct thread *t, status_t wait_queue_error);
 
@@ -6,6 +6,7 @@
 #ifndef AES_H
 #define AES_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 enum AES_KEYSIZE {
@@ -27,6 +28,8 @@ typedef struct {
 struct aes_key_struct_sw {
     unsigned long rd_key[60];
     int rounds;
+    /* rd_key again as byte strings, the layout the aes instructions take */
+    unsigned char rd_key_bytes[15 * 16] __attribute__((aligned(16)));
 };
 
 typedef struct aes_key_struct_sw AES_KEY;
@@ -35,6 +38,9 @@ typedef struct aes_key_struct_sw AES_KEY;
 
 #define AES_BLOCK_SIZE 16
 
+#define AES_ENCRYPT 1
+#define AES_DECRYPT 0
+
 int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
                             AES_KEY *key);
 
@@ -47,5 +53,22 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 void AES_encrypt(const unsigned char *in, unsigned char *out,
                          const AES_KEY *key);
 
+/* cbc over length bytes, which should be a multiple of AES_BLOCK_SIZE, a
+ * trailing partial block is ignored. ivec is updated for the next call.
+ * enc is AES_ENCRYPT or AES_DECRYPT, key must have been set up to match.
+ */
+void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
+                     size_t length, const AES_KEY *key,
+                     unsigned char *ivec, const int enc);
+
+/* ctr mode with a 128 bit big endian counter in ivec, takes an encryption
+ * key in both directions. ecount_buf and num carry a partially used block
+ * of key stream between calls, start with *num = 0.
+ */
+void AES_ctr128_encrypt(const unsigned char *in, unsigned char *out,
+                        size_t length, const AES_KEY *key,
+                        unsigned char ivec[AES_BLOCK_SIZE],
+                        unsigned char ecount_buf[AES_BLOCK_SIZE],
+                        unsigned int *num);
 
 #endif
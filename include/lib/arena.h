@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Bump pointer arenas for allocations that all die together.
+ *
+ * An arena hands out memory by bumping a pointer through a chunk and never
+ * frees anything on its own. arena_reset() throws away everything allocated
+ * so far in one go, arena_destroy() also gives the memory back. Growable
+ * arenas take their chunks from the page allocator with the kernel vm, or
+ * the heap otherwise. An arena over a caller supplied buffer never grows.
+ *
+ * Arenas do no locking of their own.
+ */
+
+typedef struct arena {
+	struct list_node chunks;	/* newest first, the one being bumped through at the head */
+	uint8_t *pos;
+	uint8_t *end;
+	size_t chunk_size;
+	uint flags;
+
+	/* stats */
+	size_t allocated;
+	size_t chunk_bytes;
+} arena_t;
+
+/* set up a growable arena that takes chunk_size sized chunks (0 for a default) */
+void arena_init(arena_t *arena, size_t chunk_size);
+
+/* set up an arena that allocates out of the given buffer, and nothing else */
+void arena_init_buffer(arena_t *arena, void *buf, size_t len);
+
+/* heap allocated arena_t around arena_init() */
+arena_t *arena_create(size_t chunk_size);
+
+/* returns NULL when out of memory, align must be a power of two or 0 */
+void *arena_alloc(arena_t *arena, size_t size, size_t align);
+
+/* free everything allocated out of the arena, keeping one chunk to reuse */
+void arena_reset(arena_t *arena);
+
+/* free everything and give back all the memory, and the arena_t if it came from arena_create */
+void arena_destroy(arena_t *arena);
+
+__END_CDECLS
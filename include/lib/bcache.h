@@ -23,10 +23,20 @@
 #ifndef __LIB_BCACHE_H
 #define __LIB_BCACHE_H
 
+#include <sys/types.h>
 #include <lib/bio.h>
 
 typedef void * bcache_t;
 
+/* how often, in ms, dirty blocks are written back in the background by default */
+#define BCACHE_DEFAULT_WRITEBACK_INTERVAL 1000
+
+/* most blocks a single bcache_prefetch will start reading */
+#define BCACHE_MAX_READAHEAD 32
+
+/* most dirty blocks written back with a single write */
+#define BCACHE_MAX_WRITEBACK 32
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count);
 void bcache_destroy(bcache_t);
 
@@ -36,5 +46,22 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+// dirty blocks are written back when they're evicted, by bcache_flush, and
+// every writeback interval ms by a background thread. an interval of 0 turns
+// the thread off.
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+int bcache_flush(bcache_t);
+// drop any cached copy of count blocks from block on without writing it back,
+// for callers about to write them to the device behind the cache's back.
+int bcache_discard(bcache_t, uint block, uint count);
+status_t bcache_set_writeback(bcache_t, lk_time_t interval);
+
+// start reading up to count blocks from block on into the cache in the
+// background, skipping the ones already there. returns how many were started.
+int bcache_prefetch(bcache_t, uint block, uint count);
+
+void bcache_dump(bcache_t, const char *name);
+
 #endif
 
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <kernel/pmu.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Microbenchmarks.
+ *
+ * A benchmark is a function that runs its timed loop state->iters times:
+ *
+ *   BENCHMARK(memset_4k)
+ *   {
+ *       void *buf = malloc(4096);
+ *       bench_set_bytes(state, 4096);
+ *       BENCH_LOOP(state) {
+ *           memset(buf, 0, 4096);
+ *       }
+ *       free(buf);
+ *   }
+ *
+ * Only the loop is timed, setup and teardown around it are not. The harness
+ * picks an iteration count that makes a run last about BENCH_TARGET_RUN_US,
+ * throws away a few warmup runs, then reports the min, median and p99 of the
+ * per iteration time and cycles over the measured runs, along with whatever
+ * the pmu command has the counters set to. The 'bench' console command lists
+ * and runs them, as text, csv or json.
+ */
+
+struct bench_state {
+	uint64_t iters;         /* iterations the loop should run */
+	size_t bytes;           /* bytes moved per iteration, 0 if it doesn't apply */
+	void *arg;              /* from the bench_desc */
+
+	/* filled in by BENCH_LOOP */
+	uint64_t remaining;
+	uint64_t start_cycles;
+	uint64_t end_cycles;
+	lk_bigtime_t start_time;
+	lk_bigtime_t end_time;
+	uint pmu_count;
+	uint64_t pmu_start[PMU_MAX_COUNTERS];
+	uint64_t pmu_end[PMU_MAX_COUNTERS];
+};
+
+typedef void (*bench_func)(struct bench_state *state);
+
+struct bench_desc {
+	const char *name;
+	bench_func func;
+	void *arg;
+};
+
+#define BENCH_TARGET_RUN_US    10000
+#define BENCH_DEFAULT_WARMUP   2
+#define BENCH_DEFAULT_RUNS     15
+#define BENCH_MAX_RUNS         128
+
+#define BENCHMARK(_name) \
+	static void bench_##_name(struct bench_state *state); \
+	const struct bench_desc _bench_desc_##_name __ALIGNED(sizeof(void *)) __SECTION(".benchmarks") = { \
+		.name = #_name, \
+		.func = bench_##_name, \
+	}; \
+	static void bench_##_name(struct bench_state *state)
+
+/* 64 bit cycle count. where the hardware counter is only 32 bits it's widened
+ * in software, which keeps the difference across a run right as long as the
+ * run is shorter than one wrap of the counter.
+ */
+uint64_t bench_cycles(void);
+
+void bench_start(struct bench_state *state);
+void bench_stop(struct bench_state *state);
+
+static inline bool bench_keep_running(struct bench_state *state)
+{
+	if (likely(state->remaining > 0)) {
+		state->remaining--;
+		return true;
+	}
+	bench_stop(state);
+	return false;
+}
+
+#define BENCH_LOOP(state) for (bench_start(state); bench_keep_running(state); )
+
+static inline void bench_set_bytes(struct bench_state *state, size_t bytes)
+{
+	state->bytes = bytes;
+}
+
+/* keep the compiler from optimizing away a result or the stores to it */
+#define bench_do_not_optimize(x) __asm__ volatile("" : : "g" (x) : "memory")
+#define bench_clobber() __asm__ volatile("" : : : "memory")
+
+enum bench_format {
+	BENCH_FORMAT_TEXT,
+	BENCH_FORMAT_CSV,
+	BENCH_FORMAT_JSON,
+};
+
+struct bench_result {
+	const char *name;
+	uint64_t iters;         /* per run */
+	uint runs;
+	size_t bytes;
+
+	/* per iteration */
+	double min_ns, median_ns, p99_ns;
+	double min_cycles, median_cycles, p99_cycles;
+
+	/* configured pmu events, averaged over the runs */
+	uint pmu_count;
+	uint pmu_events[PMU_MAX_COUNTERS];
+	double pmu[PMU_MAX_COUNTERS];
+};
+
+/* run one benchmark warmup + runs times, runs is capped at BENCH_MAX_RUNS */
+status_t bench_run(const struct bench_desc *desc, uint warmup, uint runs, struct bench_result *result);
+
+/* run every benchmark whose name starts with prefix, NULL for all, printing as it goes */
+int bench_run_all(const char *prefix, uint warmup, uint runs, enum bench_format format);
+
+/* for suites that build their bench_descs at run time and call bench_run themselves */
+void bench_print_header(enum bench_format format);
+void bench_print_result(enum bench_format format, const struct bench_result *result, bool first);
+void bench_print_footer(enum bench_format format);
+
+__END_CDECLS
@@ -25,9 +25,17 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <list.h>
+#include <iovec.h>
+#include <kernel/event.h>
+#include <lib/workqueue.h>
 
 typedef uint32_t bnum_t;
 
+struct bio_request;
+struct bio_queue;
+struct bio_piece_ops;
+struct bio_piece_limits;
+
 typedef struct bio_erase_geometry_info {
 	off_t  start;  // start of the region in bytes.
 	off_t  size;
@@ -57,11 +65,72 @@ typedef struct bdev {
 	ssize_t (*read_block)(struct bdev *, void *buf, bnum_t block, uint count);
 	ssize_t (*write)(struct bdev *, const void *buf, off_t offset, size_t len);
 	ssize_t (*write_block)(struct bdev *, const void *buf, bnum_t block, uint count);
+	/* scatter gather, len is the part of the iovec that fits on the device */
+	ssize_t (*readv)(struct bdev *, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len);
+	ssize_t (*writev)(struct bdev *, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len);
 	ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
+	/* block aligned, drop the contents of a range, it reads back as anything after */
+	ssize_t (*discard)(struct bdev *, off_t offset, size_t len);
+	/* block aligned, make a range read back as zeros without moving them over the bus */
+	ssize_t (*write_zeroes)(struct bdev *, off_t offset, size_t len);
+	/* make everything written so far survive a power loss */
+	status_t (*flush)(struct bdev *);
 	int (*ioctl)(struct bdev *, int request, void *argp);
 	void (*close)(struct bdev *);
+
+	/* start an asynchronous request, finished later with bio_request_complete() */
+	status_t (*submit)(struct bdev *, struct bio_request *req);
+	/* optional, finish whatever the device has done without waiting for its interrupt */
+	void (*poll)(struct bdev *);
+
+	/* optional request scheduler in front of submit, see lib/bio_sched.h */
+	struct bio_queue *queue;
+
+	/* set by bio_init_pieces, for drivers that cut requests into pieces */
+	const struct bio_piece_ops *piece_ops;
+	const struct bio_piece_limits *piece_limits;
 } bdev_t;
 
+/* asynchronous requests */
+enum bio_op {
+	BIO_OP_READ = 0,
+	BIO_OP_WRITE,
+	BIO_OP_ERASE,
+};
+
+typedef void (*bio_callback_t)(struct bio_request *req);
+
+/* request flags */
+#define BIO_FLAG_POLL (1 << 0) /* bio_wait spins on the device's poll hook for a while before sleeping */
+
+typedef struct bio_request {
+	/* set up by bio_request_init */
+	uint op;
+	void *buf;
+	const iovec_t *iov; /* used instead of buf if set */
+	uint iov_cnt;
+	off_t offset;
+	size_t len;
+	bio_callback_t callback;
+	void *arg;
+	uint flags; /* BIO_FLAG_*, cleared by bio_request_init */
+
+	/* bytes transferred or error, valid once the request completes */
+	ssize_t result;
+
+	/* owned by bio and the driver while the request is outstanding */
+	bdev_t *dev;
+	struct list_node node;
+	work_t work;
+	event_t event;
+	volatile int pending; /* pieces still outstanding, for drivers that split requests */
+
+	/* owned by the device's scheduler, if it has one */
+	struct bio_queue *queue;
+	uint sched_flags;
+	lk_bigtime_t queue_time;
+} bio_request_t;
+
 /* user api */
 bdev_t *bio_open(const char *name);
 void bio_close(bdev_t *dev);
@@ -69,9 +138,90 @@ ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len);
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count);
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len);
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
+ssize_t bio_readv(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset);
+ssize_t bio_writev(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
+/* tell the device a range is no longer in use. partial blocks at either end are
+ * left alone. returns the bytes discarded, or ERR_NOT_SUPPORTED if the device
+ * can't, which is harmless to ignore. */
+ssize_t bio_discard(bdev_t *dev, off_t offset, size_t len);
+/* zero a range, offloaded to the device where it can, written out where not */
+ssize_t bio_write_zeroes(bdev_t *dev, off_t offset, size_t len);
+/* a barrier, everything written before it is durable once it returns */
+status_t bio_flush(bdev_t *dev);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* asynchronous api. a request with a callback is handed to it on completion,
+ * possibly before bio_submit returns and possibly from interrupt context.
+ * without a callback, bio_wait blocks until it completes and returns the result.
+ * the buffer and the request must stay around until then. a completed request
+ * may be submitted again.
+ */
+void bio_request_init(bio_request_t *req, uint op, void *buf, off_t offset, size_t len,
+					  bio_callback_t callback, void *arg);
+void bio_request_init_iovec(bio_request_t *req, uint op, const iovec_t *iov, uint iov_cnt, off_t offset,
+							bio_callback_t callback, void *arg);
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+ssize_t bio_wait(bio_request_t *req);
+
+/* called by the driver when a submitted request finishes, from interrupt context if
+ * it likes. should that drop the last reference to the device, it's closed later on
+ * the bio workqueue. */
+void bio_request_complete(bio_request_t *req, ssize_t result);
+
+/* wait for a completion event, calling the device's poll hook for up to
+ * BIO_POLL_USECS first. for drivers whose synchronous path can poll. */
+void bio_poll_wait(bdev_t *dev, event_t *event);
+
+/* for drivers that cut requests into pieces the hardware takes in one go, see
+ * lib/bio/piece.c. bio_init_pieces() points the device's readv, writev and submit
+ * hooks at lib/bio, which walks each request's data and hands the physically
+ * contiguous segments of every piece to the driver's queue_piece with a reference
+ * held on bio->pending. the driver drops it with bio_put_piece() once the piece is
+ * done, possibly from interrupt context. whatever can't be mapped goes through the
+ * device's synchronous hooks instead.
+ */
+#define BIO_MAX_PIECE_SEGS 64
+
+typedef struct bio_seg {
+	paddr_t pa;
+	size_t len;
+} bio_seg_t;
+
+typedef struct bio_piece_limits {
+	size_t max_len;     /* bytes in one piece */
+	uint max_segs;      /* segments in one piece, no more than BIO_MAX_PIECE_SEGS */
+	size_t sector_size; /* a piece that runs out of segments is cut back to a multiple of this */
+	bool page_joins;    /* segments only meet on page boundaries, a piece ends at any other */
+} bio_piece_limits_t;
+
+typedef struct bio_piece_ops {
+	/* can the data go straight to the hardware. buf is NULL for an iovec */
+	bool (*can_map)(bdev_t *dev, off_t offset, size_t len, const void *buf, const iovec_t *iov, uint iov_cnt);
+	/* queue one piece, waiting for room on the hardware if need be */
+	void (*queue_piece)(bdev_t *dev, bio_request_t *bio, bool sync, const bio_seg_t *seg, uint seg_count,
+						off_t offset, size_t len);
+	/* optional, after every piece of a request is queued */
+	void (*kick)(bdev_t *dev);
+	/* optional, cache maintenance for a request's data before its first piece is
+	 * queued and after its last one is done */
+	void (*sync_data)(bio_request_t *bio, bool for_device);
+	/* optional, wait for a synchronous request instead of a plain event_wait */
+	void (*wait)(bdev_t *dev, event_t *event);
+} bio_piece_ops_t;
+
+/* after bio_initialize_bdev. ops and limits have to stay around with the device */
+void bio_init_pieces(bdev_t *dev, const bio_piece_ops_t *ops, const bio_piece_limits_t *limits);
+/* run a request on the caller's thread, for the driver's own plain read and write hooks */
+ssize_t bio_pieces_sync(bdev_t *dev, bio_request_t *req);
+/* wait for a request whose pieces were queued with sync set */
+ssize_t bio_pieces_wait(bdev_t *dev, bio_request_t *req);
+/* a piece is done with, finishes the request if it was the last */
+void bio_put_piece(bdev_t *dev, bio_request_t *bio, bool sync);
+/* finish a submitted request with the device's synchronous hooks, for erases and
+ * data the driver can't map */
+void bio_submit_unmapped(bdev_t *dev, bio_request_t *req);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
@@ -93,6 +243,18 @@ status_t bio_publish_subdevice(const char *parent_dev,
 							   bnum_t startblock,
 							   bnum_t block_count);
 
+/* write back cache in front of parent_dev, see lib/bio/cachedev.c. a cache_size
+ * or flush_delay (in ms) of 0 picks the default, a flush_delay of INFINITE_TIME
+ * only writes back on eviction, sync and close.
+ */
+status_t bio_publish_cache_device(const char *parent_dev,
+								  const char *name,
+								  size_t cache_size,
+								  lk_time_t flush_delay);
+
+/* bio_flush every registered device, for before powering down */
+void bio_sync_all(void);
+
 /* memory based block device */
 int create_membdev(const char *name, void *ptr, size_t len);
 
@@ -134,6 +296,8 @@ enum bio_ioctl_num {
 	BIO_IOCTL_NULL = 0,
 	BIO_IOCTL_GET_MEM_MAP, /* if supported, request a pointer to the memory map of the device */
 	BIO_IOCTL_PUT_MEM_MAP, /* if needed, return the pointer (to 'close' the map) */
+	BIO_IOCTL_SET_POLL, /* argp is an int, nonzero to poll for the device's own synchronous transfers */
+	BIO_IOCTL_SYNC, /* write back anything the device is holding on to, see bio_flush */
 };
 
 // vim: set ts=4 sw=4 noexpandtab:
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <sys/types.h>
+#include <kernel/spinlock.h>
+#include <lib/bio.h>
+#include <lib/workqueue.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Optional per device request scheduler.
+ *
+ * A device with a scheduler attached holds asynchronous requests in its queue
+ * and hands at most depth of them to the driver's submit hook at a time. The
+ * policy decides the order they go out in, and policies that merge glue
+ * requests for adjacent ranges into a single scatter gather transfer.
+ * Synchronous calls bypass the queue.
+ */
+
+#define BIO_SCHED_DEFAULT_DEPTH 16
+#define BIO_SCHED_MAX_MERGE 16              /* requests per merged transfer */
+#define BIO_SCHED_MAX_MERGE_BYTES (1024*1024)
+
+typedef struct bio_queue bio_queue_t;
+
+typedef struct bio_sched_policy {
+	const char *name;
+	bool merge; /* try to merge adjacent requests when dispatching */
+
+	/* both are called with the queue locked */
+	void (*add)(bio_queue_t *q, bio_request_t *req); /* put req on q->pending */
+	bio_request_t *(*next)(bio_queue_t *q); /* take the next request off q->pending */
+} bio_sched_policy_t;
+
+struct bio_merge;
+
+struct bio_queue {
+	bdev_t *dev;
+	const bio_sched_policy_t *policy;
+	uint depth;
+
+	/* everything below is protected by lock */
+	spin_lock_t lock;
+	struct list_node pending;
+	uint queued;
+	uint inflight;
+	off_t next_offset; /* end of the last dispatched request */
+	work_t dispatch_work;
+	struct list_node merge_free;
+	struct bio_merge *merge_pool;
+
+	/* stats */
+	ulong submitted;
+	ulong dispatched;
+	ulong merges;
+	ulong completed;
+	uint64_t bytes;
+	lk_bigtime_t latency; /* submit to completion, summed over completed requests */
+};
+
+/* built in policies */
+extern const bio_sched_policy_t bio_sched_noop;     /* fifo */
+extern const bio_sched_policy_t bio_sched_merge;    /* fifo, merging adjacent requests */
+extern const bio_sched_policy_t bio_sched_deadline; /* sorted by offset with a deadline, merging */
+
+const bio_sched_policy_t *bio_sched_find_policy(const char *name);
+
+/* attach a scheduler to a device, or switch the policy and depth of the one it has.
+ * depth of 0 picks BIO_SCHED_DEFAULT_DEPTH. fails with ERR_BUSY while requests are outstanding.
+ */
+status_t bio_set_scheduler(bdev_t *dev, const bio_sched_policy_t *policy, uint depth);
+
+__END_CDECLS
+
+// vim: set ts=4 sw=4 noexpandtab:
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Compressed RAM block device.
+ *
+ * Behaves like create_membdev() but keeps every 4KB page deflated on the
+ * heap, so a mostly empty or compressible ramdisk only costs what it holds.
+ * Pages filled with one repeated word, zero included, take no storage at all.
+ */
+status_t create_zram_bdev(const char *name, size_t len);
+
+struct zram_stats {
+	uint64_t disk_size;     /* bytes the device claims to hold */
+	uint64_t orig_bytes;    /* bytes of pages held compressed or raw */
+	uint64_t stored_bytes;  /* heap used for them */
+	uint32_t same_pages;    /* pages of one repeated nonzero word */
+	uint32_t compressed_pages;
+	uint32_t raw_pages;     /* didn't compress well enough to bother */
+	uint32_t reads;         /* page decompressions */
+	uint32_t writes;        /* page compressions */
+};
+
+status_t zram_get_stats(const char *name, struct zram_stats *stats);
+
+__END_CDECLS
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Binary log with the formatting deferred to the host.
+ *
+ * BLOG() takes a printf style format and up to BLOG_MAX_ARGS arguments, but
+ * only stores the address of the format and the raw argument words in a per
+ * cpu ring, which costs a timestamp and a handful of stores. Nothing is
+ * formatted on the target. 'blog export' dumps the rings and
+ * scripts/blog2txt.py expands the records using the strings in the lk elf.
+ *
+ * Arguments are stored as native words, so on 32 bit targets a 64 bit value
+ * has to be split across two arguments. %s works for strings that live in
+ * the image, anything else comes out as its address.
+ *
+ * Without lib/blog in the build BLOG() is a plain printf.
+ */
+
+#define BLOG_MAX_ARGS 4
+
+/* records kept per cpu, must be a power of 2 */
+#ifndef BLOG_LEN
+#define BLOG_LEN 512
+#endif
+
+/* same layout on every target, the host unpacks it by endianness alone */
+struct blog_record {
+	uint64_t time;      /* current_time_hires() */
+	uint64_t fmt;       /* address of the format, written last, 0 while the slot is being filled */
+	uint32_t cpu;
+	uint32_t nargs;
+	uint64_t args[BLOG_MAX_ARGS];
+};
+
+#if WITH_LIB_BLOG
+
+extern volatile bool blog_enable;
+
+void blog_add(const char *fmt, uint nargs, uintptr_t a0, uintptr_t a1, uintptr_t a2, uintptr_t a3);
+void blog_dump(void);
+void blog_export(void);
+void blog_clear(void);
+
+#define __BLOG_NARGS(...) __BLOG_NARGS_(_, ##__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+#define __BLOG_NARGS_(_x, _1, _2, _3, _4, _5, n, ...) n
+#define __BLOG_ARGS(_x, a0, a1, a2, a3, ...) (uintptr_t)(a0), (uintptr_t)(a1), (uintptr_t)(a2), (uintptr_t)(a3)
+
+/* the format has to be a literal, it is looked up in the image by address.
+ * the dead printf only keeps the compiler checking the arguments. */
+#define BLOG(fmt, ...) do { \
+	static const char __blog_fmt[] __SECTION(".rodata.blog") = fmt; \
+	STATIC_ASSERT(__BLOG_NARGS(__VA_ARGS__) <= BLOG_MAX_ARGS); \
+	if (0) \
+		printf(fmt, ##__VA_ARGS__); \
+	if (blog_enable) \
+		blog_add(__blog_fmt, __BLOG_NARGS(__VA_ARGS__), __BLOG_ARGS(_, ##__VA_ARGS__, 0, 0, 0, 0)); \
+} while (0)
+
+#else
+
+static inline void blog_dump(void) {}
+static inline void blog_export(void) {}
+static inline void blog_clear(void) {}
+
+#define BLOG(fmt, ...) printf(fmt, ##__VA_ARGS__)
+
+#endif
+
+__END_CDECLS
@@ -2,6 +2,7 @@
 #define __CKSUM_H
 
 #include <compiler.h>
+#include <sys/types.h>
 
 __BEGIN_CDECLS
 
@@ -22,6 +23,9 @@ unsigned short update_crc16(unsigned short crc, const unsigned char *buf, unsign
 
 unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len);
 
+/* crc of A followed by B, given crc32(A), crc32(B) and the length of B */
+unsigned long crc32_combine(unsigned long crc1, unsigned long crc2, off_t len2);
+
 unsigned long adler32(unsigned long adler, const unsigned char *buf, unsigned int len);
 
 __END_CDECLS
@@ -104,6 +104,16 @@ void console_register_commands(cmd_block *block);
 int console_run_script(const char *string);
 int console_run_script_locked(const char *string); // special case from inside a command
 console_cmd console_get_command_handler(const char *command);
+
+/* scripts that get run more than once can be tokenized up front. commands are
+ * looked up when the script is compiled, ones not found yet are looked up again
+ * when it runs.
+ */
+typedef struct console_script console_script_t;
+status_t console_compile_script(const char *string, console_script_t **script);
+int console_run_compiled_script(console_script_t *script);
+int console_run_compiled_script_locked(console_script_t *script); // special case from inside a command
+void console_free_script(console_script_t *script);
 void console_abort_script(void);
 
 /* panic shell api */
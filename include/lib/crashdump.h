@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Crash dumps.
+ *
+ * Once a target is set, a panic streams a dump to it before dropping into the
+ * panic shell: the thread list, the klog buffers and every allocated page of the
+ * kernel mapped pmm arenas, deflated in 64KB chunks at the fastest level. Free
+ * pages are left out. scripts/crashdump.py takes the stream apart again.
+ *
+ * The target is either a block device, typically a ptable partition reserved
+ * for it, or a UDP port on another machine. Everything the dump needs is
+ * allocated when the target is set, since nothing can be at panic time.
+ */
+
+/* stream a dump to the start of a block device, which is kept open */
+status_t crashdump_set_target_bdev(const char *name);
+
+/* send a dump as UDP datagrams to host (network order) and port. A first
+ * datagram goes out right away, so the host's mac is known by the time of a
+ * panic.
+ */
+status_t crashdump_set_target_udp(uint32_t host, uint16_t port);
+
+void crashdump_clear_target(void);
+
+/* take a dump of the running system now, ERR_NOT_READY if there's no target */
+status_t crashdump_capture(const char *reason);
+
+/* called by _panic */
+void crashdump_panic(void *caller, const char *fmt, va_list ap);
+
+/*
+ * Stream format, all little endian on little endian targets. A header, then
+ * records each followed by stored_len bytes, then a CRASHDUMP_RECORD_END.
+ */
+#define CRASHDUMP_MAGIC   0x44434b4c /* "LKCD" */
+#define CRASHDUMP_VERSION 1
+
+struct crashdump_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;   /* records start here */
+	uint32_t page_size;
+	uint64_t time;          /* current_time_hires() as the dump began */
+	uint64_t caller;        /* where panic was called from, 0 if asked for */
+	char reason[96];
+};
+
+enum crashdump_record_type {
+	CRASHDUMP_RECORD_END = 0,
+	CRASHDUMP_RECORD_THREADS,   /* dump_all_threads text, addr is the offset into it */
+	CRASHDUMP_RECORD_KLOG,      /* klog text, addr is the buffer, pieces of one are in order */
+	CRASHDUMP_RECORD_MEMORY,    /* addr is the physical address */
+};
+
+#define CRASHDUMP_RECORD_FLAG_DEFLATE (1 << 0) /* raw deflate, no zlib header */
+#define CRASHDUMP_RECORD_FLAG_ZERO    (1 << 1) /* len zero bytes, nothing stored */
+
+struct crashdump_record {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t addr;
+	uint32_t len;           /* bytes when expanded */
+	uint32_t stored_len;    /* bytes that follow */
+};
+
+/* over UDP the stream is cut into datagrams of at most 1024 bytes after this
+ * header, and finished with a few holding just the header.
+ */
+#define CRASHDUMP_UDP_MAGIC 0x55434b4c /* "LKCU" */
+
+struct crashdump_udp_header {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t offset;        /* where the payload goes in the stream */
+};
+
+__END_CDECLS
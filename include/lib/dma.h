@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Handing memory to a device.
+ *
+ * dma_map translates a buffer into the physical segments a device is
+ * programmed with and does the cache maintenance for the transfer.
+ * If the segments don't fit, or the device can't reach them, the device
+ * gets a bounce buffer instead. The bounce copy happens in the sync calls.
+ *
+ * The caller owns the dma_map_t and the segment array, so mapping never
+ * allocates unless it has to bounce.
+ *
+ * The cpu side of a buffer the device writes should stay untouched until
+ * dma_sync_for_cpu or dma_unmap. Ideally it is cache line aligned at both
+ * ends. Otherwise, anything the cpu writes to the lines it shares with its
+ * neighbours during the transfer is lost.
+ */
+
+#define DMA_TO_DEVICE       0x1 /* the device reads the buffer */
+#define DMA_FROM_DEVICE     0x2 /* the device writes it */
+#define DMA_BIDIRECTIONAL   (DMA_TO_DEVICE | DMA_FROM_DEVICE)
+
+/* any physical address will do */
+#define DMA_ADDR_ANY        ((paddr_t)-1)
+
+/* one physically contiguous run */
+struct dma_seg {
+	paddr_t addr;
+	size_t len;
+};
+
+typedef struct dma_map {
+	void *buf;
+	size_t len;
+	uint dir;
+
+	void *bounce; /* what the device really sees, NULL if it's buf */
+
+	struct dma_seg *segs;
+	uint max_segs;
+	uint seg_count;
+} dma_map_t;
+
+/* map len bytes at buf for a device that takes up to max_segs segments, all
+ * at or below max_addr. fills in segs and does the cache work for the device
+ * to start, there is no need to call dma_sync_for_device on a fresh map.
+ * returns ERR_NO_MEMORY if it had to bounce and there was no room.
+ */
+status_t dma_map(dma_map_t *map, void *buf, size_t len, uint dir,
+                 paddr_t max_addr, struct dma_seg *segs, uint max_segs);
+
+/* done with the map, the cpu owns the buffer again and sees what the device wrote */
+void dma_unmap(dma_map_t *map);
+
+/* hand a mapped buffer back and forth for repeated transfers */
+void dma_sync_for_device(dma_map_t *map);
+void dma_sync_for_cpu(dma_map_t *map);
+
+/* the cache half of the above for memory the caller translates itself, e.g.
+ * descriptor rings or buffers already known to be reachable
+ */
+void dma_sync_range_for_device(const void *buf, size_t len, uint dir);
+void dma_sync_range_for_cpu(const void *buf, size_t len, uint dir);
+
+/* the physical address of va, returns how many of the len bytes from there
+ * are physically contiguous, at least one and at most to the end of the page
+ */
+size_t dma_phys_run(const void *va, size_t len, paddr_t *pa);
+
+__END_CDECLS
@@ -24,13 +24,40 @@
 #define __KERNEL_DPC_H
 
 #include <list.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 typedef void (*dpc_callback)(void *arg);
 
+typedef struct dpc {
+	struct list_node node;
+
+	dpc_callback cb;
+	void *arg;
+	bool allocated; /* freed by the dpc thread once it has run */
+	int queued;     /* set while sitting in one of the cpu queues */
+} dpc_t;
+
+#define DPC_INITIAL_VALUE \
+{ \
+	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.cb = NULL, \
+	.arg = NULL, \
+	.allocated = false, \
+	.queued = 0, \
+}
+
 #define DPC_FLAG_NORESCHED 0x1
 
+/* queue a callback to run on the dpc thread, allocating the dpc */
 status_t dpc_queue(dpc_callback, void *arg, uint flags);
 
+/* queue a caller owned dpc to run on this cpu's dpc thread. it may be requeued
+ * once its callback has started, until then queuing it again anywhere returns
+ * ERR_ALREADY_EXISTS. with DPC_FLAG_NORESCHED this is safe to call from
+ * interrupt context.
+ */
+status_t dpc_queue_etc(dpc_t *dpc, dpc_callback, void *arg, uint flags);
+
 #endif
 
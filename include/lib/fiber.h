@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Fibers, cooperatively scheduled stackful coroutines.
+ *
+ * A fiber loop runs any number of fibers on the one thread that calls
+ * fiber_loop_run(). A fiber runs until it yields, sleeps, waits on a fiber
+ * event or exits, and then the loop switches to the next ready one. Only the
+ * callee saved registers are switched, so a switch costs about as much as a
+ * function call and there's no thread_t, kernel stack or scheduler work per
+ * fiber.
+ *
+ * Each fiber gets a small stack, a fiber and its stack are one allocation,
+ * and exited fibers are kept on the loop for reuse. The bottom of every stack
+ * carries a canary that's checked each time the fiber switches out.
+ *
+ * Fibers must not block the loop thread: waiting on a kernel event, mutex or
+ * wait queue from a fiber stops every fiber on the loop until it returns. Fiber
+ * events are the blocking primitive instead. They can be signaled from other
+ * threads and from interrupt context, which wakes the loop thread through its
+ * own event_t when it has nothing else to run, so a driver or another thread
+ * can hand work to a fiber the same way it would to a thread.
+ *
+ * Floating point and simd state isn't preserved across a switch beyond what
+ * the calling convention requires. Don't yield inside simd_begin()/simd_end().
+ */
+
+#define FIBER_DEFAULT_STACK_SIZE 2048
+#define FIBER_MIN_STACK_SIZE     512
+#define FIBER_DEFAULT_MAX_FREE   32
+
+typedef struct fiber fiber_t;
+typedef struct fiber_loop fiber_loop_t;
+typedef int (*fiber_start_routine)(void *arg);
+
+/* a loop whose fibers get stack_size byte stacks, 0 for the default. up to
+ * max_free exited fibers are kept around for reuse, 0 for the default.
+ */
+fiber_loop_t *fiber_loop_create(const char *name, size_t stack_size, uint max_free);
+
+/* free the loop and its pool, it must not be running or have fibers left */
+status_t fiber_loop_destroy(fiber_loop_t *loop);
+
+/* run the loop's fibers on this thread, until they've all exited or
+ * fiber_loop_stop() is called. fibers left over when stopped stay suspended
+ * until the loop is run again.
+ */
+status_t fiber_loop_run(fiber_loop_t *loop);
+
+/* make fiber_loop_run() return once the running fiber switches out, from anywhere */
+void fiber_loop_stop(fiber_loop_t *loop);
+
+/* a new fiber that calls entry(arg), ready to run. may be called from any
+ * thread and from other fibers, but not from interrupt context.
+ */
+fiber_t *fiber_create(fiber_loop_t *loop, fiber_start_routine entry, void *arg);
+
+/* the running fiber, NULL if the caller isn't on a fiber */
+fiber_t *fiber_current(void);
+
+/* these may only be called from a fiber */
+void fiber_yield(void);
+void fiber_sleep(lk_time_t delay);
+void fiber_exit(int retcode) __NO_RETURN;
+
+/* fiber events, with the semantics of event_t */
+#define FIBER_EVENT_MAGIC 'fbev'
+
+typedef struct fiber_event {
+	int magic;
+	bool signalled;
+	uint flags;
+	fiber_loop_t *loop;
+	struct list_node waiters;
+} fiber_event_t;
+
+#define FIBER_EVENT_FLAG_AUTOUNSIGNAL 1
+
+/* only fibers on loop may wait on the event, anything can signal it */
+void fiber_event_init(fiber_event_t *e, fiber_loop_t *loop, bool initial, uint flags);
+
+/* wakes the waiters with ERR_OBJECT_DESTROYED */
+void fiber_event_destroy(fiber_event_t *e);
+
+/* from a fiber on the event's loop */
+status_t fiber_event_wait_timeout(fiber_event_t *e, lk_time_t timeout);
+
+static inline status_t fiber_event_wait(fiber_event_t *e)
+{
+	return fiber_event_wait_timeout(e, INFINITE_TIME);
+}
+
+/* from a fiber, a thread or interrupt context. the woken fibers run once the
+ * caller, if it's a fiber, switches out.
+ */
+status_t fiber_event_signal(fiber_event_t *e);
+status_t fiber_event_unsignal(fiber_event_t *e);
+
+__END_CDECLS
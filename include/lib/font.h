@@ -30,5 +30,14 @@
 
 void font_draw_char(gfx_surface *surface, unsigned char c, int x, int y, uint32_t color);
 
+/* the built-in glyphs pre-rendered as opaque tiles in one pair of colors,
+ * each rendered the first time it's drawn */
+struct font_cache;
+struct font_cache *font_cache_create(gfx_format format, uint32_t color, uint32_t back_color);
+void font_cache_destroy(struct font_cache *cache);
+
+/* draw a glyph cell, background included. unlike font_draw_char, doesn't flush */
+void font_draw_char_cached(gfx_surface *surface, struct font_cache *cache, unsigned char c, int x, int y);
+
 #endif
 
@@ -25,6 +25,7 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
+#include <iovec.h>
 
 struct file_stat {
 	bool is_dir;
@@ -39,13 +40,33 @@ int fs_unmount(const char *path);
 
 /* file api */
 int fs_open_file(const char *path, filecookie *fcookie);
+int fs_create_file(const char *path, filecookie *fcookie);
+int fs_make_dir(const char *path);
 int fs_read_file(filecookie fcookie, void *buf, off_t offset, size_t len);
+ssize_t fs_read_file_iovec(filecookie fcookie, const iovec_t *iov, uint iov_cnt, off_t offset);
+int fs_write_file(filecookie fcookie, const void *buf, off_t offset, size_t len);
+int fs_truncate_file(filecookie fcookie, off_t len);
 int fs_close_file(filecookie fcookie);
 int fs_stat_file(filecookie fcookie, struct file_stat *);
 
+/* borrow the file's data at offset in place rather than copying it out. *ptr is
+ * set to it and the return is how many bytes it's good for, at least one unless
+ * offset is at or past the end of the file. it's read only and has to be handed
+ * back with fs_put_file_data before the file is closed. not every filesystem
+ * can do it, ERR_NOT_SUPPORTED means fall back to fs_read_file. */
+ssize_t fs_get_file_data(filecookie fcookie, off_t offset, const void **ptr);
+int fs_put_file_data(filecookie fcookie, const void *ptr);
+
 /* convenience routines */
 ssize_t fs_load_file(const char *path, void *ptr, size_t maxlen);
 
+/* map a whole file read only. with the vm, pages are read in as they are first
+ * touched, otherwise the file is read in up front. mapping a path that's already
+ * mapped hands back the same mapping. it must not be touched after the last
+ * fs_munmap_file of it. */
+int fs_mmap_file(const char *path, const void **ptr, size_t *len);
+int fs_munmap_file(const void *ptr);
+
 /* walk through a path string, removing duplicate path seperators, flattening . and .. references */
 void fs_normalize_path(char *path);
 
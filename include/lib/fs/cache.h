@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __LIB_FS_CACHE_H
+#define __LIB_FS_CACHE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Inode and directory entry caches a filesystem can keep per mount, so path
+ * lookups don't have to go back to disk for every component.
+ *
+ * Inodes are stored as opaque copies of the filesystem's own in memory inode,
+ * directory entries map a name inside a directory to the inode number it
+ * names. An inode number of 0 caches the fact that the name doesn't exist.
+ * Both are bounded, the least recently used entry is dropped to make room.
+ */
+
+/* names longer than this aren't cached, they just miss every time */
+#define FS_DCACHE_NAME_MAX 48
+
+typedef uint64_t fs_ino_t;
+typedef struct fs_cache fs_cache_t;
+
+fs_cache_t *fs_cache_create(const char *name, size_t inode_size, uint inode_count, uint dentry_count);
+void fs_cache_destroy(fs_cache_t *cache);
+
+/* copy a cached inode out, returns false if it isn't there */
+bool fs_icache_lookup(fs_cache_t *cache, fs_ino_t ino, void *inode);
+void fs_icache_insert(fs_cache_t *cache, fs_ino_t ino, const void *inode);
+
+/* look up name in dir. returns false on a miss, true with *ino set to the
+ * entry's inode, or 0 if the name is known not to exist. */
+bool fs_dcache_lookup(fs_cache_t *cache, fs_ino_t dir, const char *name, size_t namelen, fs_ino_t *ino);
+void fs_dcache_insert(fs_cache_t *cache, fs_ino_t dir, const char *name, size_t namelen, fs_ino_t ino);
+
+/* forget an inode and every entry in or pointing at it */
+void fs_cache_invalidate(fs_cache_t *cache, fs_ino_t ino);
+
+void fs_cache_dump(fs_cache_t *cache);
+
+#endif
@@ -34,9 +34,14 @@ int ext2_unmount(fscookie cookie);
 
 /* file api */
 int ext2_open_file(fscookie cookie, const char *path, fsfilecookie *fcookie);
+int ext2_create_file(fscookie cookie, const char *path, fsfilecookie *fcookie);
 int ext2_read_file(fsfilecookie fcookie, void *buf, off_t offset, size_t len);
+int ext2_write_file(fsfilecookie fcookie, const void *buf, off_t offset, size_t len);
+int ext2_truncate_file(fsfilecookie fcookie, off_t len);
 int ext2_close_file(fsfilecookie fcookie);
 int ext2_stat_file(fsfilecookie fcookie, struct file_stat *);
+ssize_t ext2_get_file_data(fsfilecookie fcookie, off_t offset, const void **ptr);
+int ext2_put_file_data(fsfilecookie fcookie, const void *ptr);
 
 #endif
 
@@ -48,6 +48,14 @@ typedef enum {
  * to.  Elements include a pointer to the actual pixel memory, its size, its
  * layout, and pointers to basic drawing functions.
  *
+ * The gfx_* drawing calls track the rectangle they've touched since the last
+ * flush, and flushing only sends that to the display. Code that writes to ptr
+ * directly has to call gfx_surface_mark_dirty() for it to be flushed.
+ *
+ * A double buffered surface draws into a back buffer while the display shows
+ * the front one. Flushing flips the two and brings the new back buffer up to
+ * date with what was just drawn.
+ *
  * @ingroup graphics
  */
 typedef struct gfx_surface {
@@ -61,11 +69,19 @@ typedef struct gfx_surface {
 	size_t len;
 	uint alpha;
 
+	// damage since the last flush, [x1, x2) by [y1, y2), clean when x2 is 0
+	uint dirty_x1, dirty_y1;
+	uint dirty_x2, dirty_y2;
+
+	// the buffer on display when double buffered, NULL otherwise
+	void *front;
+
 	// function pointers
 	void (*copyrect)(struct gfx_surface *, uint x, uint y, uint width, uint height, uint x2, uint y2);
 	void (*fillrect)(struct gfx_surface *, uint x, uint y, uint width, uint height, uint color);
 	void (*putpixel)(struct gfx_surface *, uint x, uint y, uint color);
 	void (*flush)(uint starty, uint endy);
+	void (*flush_rect)(void *buffer, uint x, uint y, uint width, uint height);
 } gfx_surface;
 
 // copy a rect from x,y with width x height to x2, y2
@@ -77,22 +93,34 @@ void gfx_fillrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
 // draw a pixel at x, y in the surface
 void gfx_putpixel(gfx_surface *surface, uint x, uint y, uint color);
 
-// clear the entire surface with a color
-static inline void gfx_clear(gfx_surface *surface, uint color)
-{
-	surface->fillrect(surface, 0, 0, surface->width, surface->height, color);
-
-	if (surface->flush)
-		surface->flush(0, surface->height-1);
-}
-
 // blend between two surfaces
 void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty);
 
+// one entry of a gfx_surface_blend_list() batch
+struct gfx_blit {
+	struct gfx_surface *source;
+	uint destx, desty;
+};
+
+// blend a batch of surfaces onto target in order, cheaper than one at a time for small ones
+void gfx_surface_blend_list(struct gfx_surface *target, const struct gfx_blit *blits, uint count);
+
+// send whatever was drawn since the last flush to the display, flipping if double buffered
 void gfx_flush(struct gfx_surface *surface);
 
+// same as gfx_flush, but only what changed within the rows start to end
 void gfx_flush_rows(struct gfx_surface *surface, uint start, uint end);
 
+// note a rectangle written to without the gfx_* calls, for the next flush
+void gfx_surface_mark_dirty(struct gfx_surface *surface, uint x, uint y, uint width, uint height);
+
+// clear the entire surface with a color
+static inline void gfx_clear(gfx_surface *surface, uint color)
+{
+	gfx_fillrect(surface, 0, 0, surface->width, surface->height, color);
+	gfx_flush(surface);
+}
+
 // surface setup
 gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride, gfx_format format);
 
@@ -100,6 +128,9 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
 struct display_info;
 gfx_surface *gfx_create_surface_from_display(struct display_info *);
 
+// same, but double buffered if the display has a back buffer to flip to
+gfx_surface *gfx_create_surface_from_display_etc(struct display_info *, bool double_buffer);
+
 // free the surface
 // optionally frees the buffer if the free bit is set
 void gfx_surface_destroy(struct gfx_surface *surface);
@@ -35,16 +35,30 @@ struct heap_stats {
 	size_t heap_free;
 	size_t heap_max_chunk;
 	size_t heap_low_watermark;
+	size_t heap_returned;	// bytes handed back to the pmm so far
 };
 
 void *heap_alloc(size_t, unsigned int alignment);
+/* heap_alloc on behalf of caller, which the allocation profile charges it to */
+void *heap_alloc_etc(size_t, unsigned int alignment, void *caller);
 void heap_free(void *);
 
+/* allocate up to count blocks of size bytes, returns how many it got */
+size_t heap_alloc_batch(size_t size, void **ptrs, size_t count);
+/* free count blocks, NULL entries are skipped. ptrs is clobbered */
+void heap_free_batch(void **ptrs, size_t count);
+/* number of bytes usable at ptr, at least what was asked for */
+size_t heap_usable_size(void *ptr);
+
 void heap_init(void);
 void heap_add_block(void *, size_t);
 
 void heap_get_stats(struct heap_stats *ptr);
 
+/* give whole free pages back to the pmm, returns the number of bytes released.
+ * with the kernel vm, blocks passed to heap_add_block must be pmm pages for this */
+size_t heap_trim(void);
+
 /* critical section time delayed free */
 void heap_delayed_free(void *);
 
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Interrupt mitigation for network drivers.
+ *
+ * Rather than signal a thread for every received frame, a driver's interrupt
+ * handler masks its rx interrupt and calls netpoll_schedule(). A thread then
+ * calls the driver's poll routine, which handles up to budget frames and
+ * returns how many it did. As long as it uses its whole budget it is called
+ * again, after anything else at its priority gets a turn. Once it comes up
+ * short the ring is drained and done is called to unmask the interrupt.
+ */
+
+/* handle up to budget received frames, returns how many there were */
+typedef int (*netpoll_func_t)(void *arg, int budget);
+
+/* unmask the device's rx interrupt. returns false, leaving it masked, if more
+ * frames arrived in the meantime and polling should carry on. */
+typedef bool (*netpoll_done_func_t)(void *arg);
+
+#define NETPOLL_DEFAULT_BUDGET 64
+
+typedef struct netpoll {
+	struct list_node node;
+	const char *name;
+	netpoll_func_t poll;
+	netpoll_done_func_t done;
+	void *arg;
+	int budget;
+
+	event_t event;
+	thread_t *thread;
+
+	/* stats */
+	ulong schedules;
+	ulong polls;
+	ulong frames;
+	ulong exhausted; /* polls that used their whole budget */
+} netpoll_t;
+
+/* set up np and create its thread at the given priority, without starting it so
+ * the caller can pin it first. budget of 0 picks a default. */
+status_t netpoll_init(netpoll_t *np, const char *name, netpoll_func_t poll, netpoll_done_func_t done,
+                      void *arg, int budget, int priority);
+
+void netpoll_start(netpoll_t *np);
+
+/* from the interrupt handler, once it has masked the device's rx interrupt */
+enum handler_return netpoll_schedule(netpoll_t *np);
+
+__END_CDECLS
@@ -28,6 +28,12 @@
 /* examine and try to publish partitions on a particular device at a particular offset */
 int partition_publish(const char *device, off_t offset);
 
+/* same as partition_publish, for several devices at once. the header reads are
+ * all issued before any is waited on, returns the total number of partitions
+ * published.
+ */
+int partition_publish_devices(const char * const *devices, uint count, off_t offset);
+
 /* remove any published subdevices on this device */
 int partition_unpublish(const char *device);
 
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Statistical sampling profiler.
+ *
+ * A periodic timer on every cpu asks for a sample, and the interrupt exit
+ * path of the platform takes it from the interrupted frame with
+ * profile_irq_exit(). A pmu overflow handler can call profile_sample()
+ * directly instead. Samples land in a per cpu histogram keyed by the pc and,
+ * if enabled, a frame pointer backtrace. The histogram is dumped raw with
+ * 'profile dump' and symbolized on the host with scripts/profile2txt.py.
+ */
+
+/* frames kept per sample, the interrupted pc included */
+#ifndef PROFILE_MAX_DEPTH
+#define PROFILE_MAX_DEPTH 8
+#endif
+
+/* distinct stacks tracked per cpu, must be a power of 2 */
+#ifndef PROFILE_BUCKETS
+#define PROFILE_BUCKETS 512
+#endif
+
+#define PROFILE_DEFAULT_HZ 1000
+
+/* start sampling every cpu at hz, walking frame pointers if backtrace is set.
+ * clears whatever was collected before. */
+status_t profile_start(uint hz, bool backtrace);
+void profile_stop(void);
+void profile_dump(void);
+
+/* record a sample for the current cpu, from interrupt context only.
+ * fp is the interrupted frame pointer or 0 if the arch can't provide it. */
+void profile_sample(uintptr_t pc, uintptr_t fp);
+
+#if WITH_LIB_PROFILE
+
+extern volatile bool profile_pending[SMP_MAX_CPUS];
+
+/* called by platform interrupt code on the way out of every irq */
+static inline void profile_irq_exit(uintptr_t pc, uintptr_t fp)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	if (unlikely(profile_pending[cpu])) {
+		profile_pending[cpu] = false;
+		profile_sample(pc, fp);
+	}
+}
+
+#else
+
+static inline void profile_irq_exit(uintptr_t pc, uintptr_t fp) {}
+
+#endif
+
+__END_CDECLS
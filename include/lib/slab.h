@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Object caches for fixed size kernel objects.
+ *
+ * Objects are carved out of power of two sized slabs taken from the page
+ * allocator. Each cpu keeps a small magazine of free objects in front of the
+ * slabs, so most allocations and frees touch neither the cache lock nor the
+ * heap. slab_free() never blocks, slab_alloc() may when it has to grow the
+ * cache.
+ */
+
+#define SLAB_MAGAZINE_SIZE 16
+
+typedef void (*slab_ctor_t)(void *obj);
+
+struct slab_magazine {
+	uint count;
+	void *objs[SLAB_MAGAZINE_SIZE];
+
+	/* stats */
+	ulong hits;
+	ulong refills;
+	ulong spills;
+} __CPU_ALIGN;
+
+typedef struct slab_cache {
+	struct list_node node;
+	const char *name;
+	size_t size;
+	size_t align;
+	slab_ctor_t ctor;
+
+	/* everything below is protected by lock */
+	spin_lock_t lock;
+	bool setup;
+	size_t obj_size;
+	size_t obj_offset;
+	size_t slab_size;
+	uint objs_per_slab;
+
+	struct list_node partial_list;
+	struct list_node full_list;
+	struct list_node empty_list;
+	uint slab_count;
+	uint empty_count;
+	ulong slab_allocs;
+	ulong slab_frees;
+
+	struct slab_magazine mag[SMP_MAX_CPUS];
+} slab_cache_t;
+
+#define SLAB_CACHE_INITIAL_VALUE(cache, _name, _size, _align, _ctor) \
+{ \
+	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.name = _name, \
+	.size = _size, \
+	.align = _align, \
+	.ctor = _ctor, \
+	.lock = SPIN_LOCK_INITIAL_VALUE, \
+	.setup = false, \
+	.partial_list = LIST_INITIAL_VALUE((cache).partial_list), \
+	.full_list = LIST_INITIAL_VALUE((cache).full_list), \
+	.empty_list = LIST_INITIAL_VALUE((cache).empty_list), \
+}
+
+/* initialize a cache at run time. align of 0 picks the heap's default alignment.
+ * ctor, if set, is run on every object slab_alloc() hands out.
+ */
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t size, size_t align, slab_ctor_t ctor);
+
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *obj);
+
+__END_CDECLS
@@ -37,6 +37,8 @@ void sysparam_dump(bool show_all);
 
 ssize_t sysparam_length(const char *name);
 ssize_t sysparam_read(const char *name, void *data, size_t len);
+/* the pointer may be straight into a memory mapped device, and is good until
+ * the next sysparam_reload or sysparam_write */
 status_t sysparam_get_ptr(const char *name, const void **ptr, size_t *len);
 
 #if SYSPARAM_ALLOW_WRITE
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <arch/defines.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Work queues, a pool of worker threads pinned to each cpu.
+ *
+ * Work is queued on the submitting cpu and run by one of that cpu's workers,
+ * high priority work ahead of normal work. Work items are owned by the caller,
+ * so submitting never allocates and is safe from interrupt context with
+ * WORK_FLAG_NORESCHED. Each cpu's queue holds at most max_queued items.
+ */
+
+struct work;
+struct workqueue_cpu;
+
+typedef void (*work_func_t)(void *arg);
+
+typedef struct work {
+	struct list_node node;
+	work_func_t func;
+	void *arg;
+	struct workqueue_cpu *queue; /* the cpu queue it was last submitted to */
+} work_t;
+
+#define WORK_INITIAL_VALUE \
+{ \
+	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.func = NULL, \
+	.arg = NULL, \
+	.queue = NULL, \
+}
+
+#define WORK_FLAG_NORESCHED     0x1
+#define WORK_FLAG_HIGH_PRIORITY 0x2
+
+#define WORK_PRIORITY_HIGH   0
+#define WORK_PRIORITY_NORMAL 1
+#define WORK_PRIORITY_COUNT  2
+
+struct workqueue_cpu {
+	spin_lock_t lock;
+	struct list_node pending[WORK_PRIORITY_COUNT];
+	uint queued;
+	uint running;
+
+	event_t work_event; /* wakes a worker */
+	event_t idle_event; /* signaled while nothing is queued or running */
+
+	/* stats */
+	ulong submitted;
+	ulong rejected;
+} __CPU_ALIGN;
+
+typedef struct workqueue {
+	struct list_node node;
+	const char *name;
+	uint max_queued;
+
+	struct workqueue_cpu cpu[SMP_MAX_CPUS];
+} workqueue_t;
+
+/* start threads_per_cpu workers at the given thread priority on every cpu.
+ * max_queued of 0 picks a default.
+ */
+workqueue_t *workqueue_create(const char *name, uint threads_per_cpu, int priority, uint max_queued);
+
+/* queue work to run func(arg) on this cpu. the work may be submitted again once
+ * func has started, returns ERR_ALREADY_EXISTS while it's still queued and
+ * ERR_BUSY if the queue is full.
+ */
+status_t workqueue_submit(workqueue_t *wq, work_t *work, work_func_t func, void *arg, uint flags);
+
+/* same as workqueue_submit, but queue on a particular cpu. work for a cpu that
+ * isn't up yet waits there until it is.
+ */
+status_t workqueue_submit_cpu(workqueue_t *wq, uint cpu, work_t *work, work_func_t func, void *arg, uint flags);
+
+/* pull work back off the queue if it hasn't started, returns true if it was removed */
+bool workqueue_cancel(work_t *work);
+
+/* wait for every cpu's queue to go idle, including work submitted while waiting */
+void workqueue_flush(workqueue_t *wq);
+
+__END_CDECLS
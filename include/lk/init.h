@@ -1,6 +1,7 @@
 #pragma once
 
 #include <compiler.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 /*
@@ -33,6 +34,9 @@ enum lk_init_flags {
     LK_INIT_FLAG_ALL_CPUS        = LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_SECONDARY_CPUS,
     LK_INIT_FLAG_CPU_SUSPEND     = 0x4,
     LK_INIT_FLAG_CPU_RESUME      = 0x8,
+
+    /* may run on its own thread, alongside the other hooks of its level */
+    LK_INIT_FLAG_PARALLEL        = 0x10,
 };
 
 void lk_init_level(enum lk_init_flags flags, uint start_level, uint stop_level);
@@ -50,27 +54,78 @@ struct lk_init_struct {
     uint flags;
     lk_init_hook hook;
     const char *name;
+
+    /* names of hooks at the same or an earlier level to wait for */
+    const char * const *deps;
+    uint dep_count;
 };
 
 #ifdef ARCH_X86_64
-#define LK_INIT_HOOK_FLAGS(_name, _hook, _level, _flags) \
+#define LK_INIT_HOOK_FLAGS_DEPS(_name, _hook, _level, _flags, _deps, _dep_count) \
     const struct lk_init_struct _init_struct_##_name __ALIGNED(8) __SECTION(".lk_init") = { \
         .level = _level, \
         .flags = _flags, \
         .hook = _hook, \
         .name = #_name, \
+        .deps = _deps, \
+        .dep_count = _dep_count, \
     };
 #else
-#define LK_INIT_HOOK_FLAGS(_name, _hook, _level, _flags) \
+#define LK_INIT_HOOK_FLAGS_DEPS(_name, _hook, _level, _flags, _deps, _dep_count) \
     const struct lk_init_struct _init_struct_##_name __SECTION(".lk_init") = { \
         .level = _level, \
         .flags = _flags, \
         .hook = _hook, \
         .name = #_name, \
+        .deps = _deps, \
+        .dep_count = _dep_count, \
     };
 #endif
 
+#define LK_INIT_HOOK_FLAGS(_name, _hook, _level, _flags) \
+    LK_INIT_HOOK_FLAGS_DEPS(_name, _hook, _level, _flags, NULL, 0)
+
 #define LK_INIT_HOOK(_name, _hook, _level) \
     LK_INIT_HOOK_FLAGS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU)
 
+/*
+ * From LK_INIT_LEVEL_THREADING on, a level holding any parallel hook is run
+ * with each of those on a thread of its own, while the rest are called in
+ * order as usual. The level still finishes as a whole before the next one
+ * starts. Any hook can name others it has to wait for, e.g.
+ *
+ *   LK_INIT_HOOK_PARALLEL(nvme, &nvme_init, LK_INIT_LEVEL_PLATFORM + 1);
+ *   LK_INIT_HOOK_DEPS(myfs, &myfs_init, LK_INIT_LEVEL_PLATFORM + 1, "nvme", "ahci");
+ *
+ * Dependencies that aren't built in are ignored.
+ */
+#define LK_INIT_HOOK_DEPS(_name, _hook, _level, ...) \
+    static const char * const _init_deps_##_name[] = { __VA_ARGS__ }; \
+    LK_INIT_HOOK_FLAGS_DEPS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU, \
+                            _init_deps_##_name, countof(_init_deps_##_name))
+
+#define LK_INIT_HOOK_PARALLEL(_name, _hook, _level, ...) \
+    static const char * const _init_deps_##_name[] = { __VA_ARGS__ }; \
+    LK_INIT_HOOK_FLAGS_DEPS(_name, _hook, _level, LK_INIT_FLAG_PRIMARY_CPU | LK_INIT_FLAG_PARALLEL, \
+                            _init_deps_##_name, countof(_init_deps_##_name))
+
+/*
+ * Boot time trace. Every init hook, the fixed init steps in lk_main and
+ * bootstrap2, and each app's init and entry are timed into a table that the
+ * boottime console command dumps. Build with LK_BOOTTIME_PRINT=1 to have it
+ * printed once the last init level has run.
+ */
+enum lk_boottime_type {
+    LK_BOOTTIME_HOOK,
+    LK_BOOTTIME_STEP,
+    LK_BOOTTIME_APP_INIT,
+    LK_BOOTTIME_APP_ENTRY,
+};
+
+/* start timing something, the name must stay around. returns the slot to
+ * hand to lk_boottime_end, or -1 if the table is full. */
+int lk_boottime_begin(enum lk_boottime_type type, const char *name, uint level);
+void lk_boottime_end(int slot);
+void lk_boottime_dump(bool sorted);
+
 // vim: set ts=4 sw=4 expandtab:
@@ -35,6 +35,9 @@ void *calloc(size_t count, size_t size) __MALLOC;
 void *realloc(void *ptr, size_t size) __MALLOC;
 void free(void *ptr);
 
+/* return the calling thread's cached blocks to the heap */
+void malloc_thread_cache_flush(void);
+
 __END_CDECLS
 
 #endif
@@ -33,6 +33,15 @@ __BEGIN_CDECLS
 void platform_dputc(char c);
 int platform_dgetc(char *c, bool wait);
 
+// Write a run of characters. Platforms with an interrupt or dma driven
+// transmitter may queue them and return before they're on the wire.
+// The default calls platform_dputc for each one.
+void platform_dputs(const char *str, size_t len);
+
+// Called as the system starts to panic. Queued output is flushed and
+// everything after is written synchronously.
+void platform_panic_start(void);
+
 // Should be available even if the system has panicked.
 void platform_pputc(char c);
 int platform_pgetc(char *c, bool wait);
@@ -23,6 +23,7 @@
 #ifndef __PLATFORM_INTERRUPTS_H
 #define __PLATFORM_INTERRUPTS_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 status_t mask_interrupt(unsigned int vector);
@@ -32,4 +33,21 @@ typedef enum handler_return (*int_handler)(void *arg);
 
 void register_int_handler(unsigned int vector, int_handler handler, void *arg);
 
+/* steer a shared interrupt to the cpus in cpu_mask (an mp_cpu_mask_t). interrupt
+ * controllers that can only target one cpu at a time use the lowest one in the mask.
+ * returns ERR_NOT_SUPPORTED if the platform can't route interrupts. */
+status_t set_interrupt_affinity(unsigned int vector, uint cpu_mask);
+
+/* threaded interrupt handlers.
+ * check runs in interrupt context and returns true if the thread should run, it
+ * should do no more than figure out if the device raised the interrupt and quiet it.
+ * a NULL check always wakes the thread. the vector stays masked from then on until
+ * handler has returned, so a level triggered source can't storm in the meantime.
+ * handler runs in a thread of its own at priority, once per wakeup. */
+typedef bool (*int_check_handler)(void *arg);
+typedef void (*int_thread_handler)(void *arg);
+
+status_t register_int_handler_threaded(unsigned int vector, int_check_handler check,
+                                       int_thread_handler handler, void *arg, int priority);
+
 #endif
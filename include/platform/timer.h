@@ -31,6 +31,8 @@ status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval);
+/* interval in us. the kernel provides a weak version that rounds up to ms */
+status_t platform_set_oneshot_timer_hires(platform_timer_callback callback, void *arg, lk_bigtime_t interval);
 void     platform_stop_timer(void);
 #endif
 
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __RBTREE_H
+#define __RBTREE_H
+
+#include <compiler.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <list.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Intrusive red-black tree, for lookups that outgrow a list.
+ *
+ * Like list.h the node is embedded in the object and containerof() gets back
+ * to it. The tree doesn't know about keys, the caller orders nodes with a
+ * compare function that returns <0, 0 or >0 like strcmp. Nodes that compare
+ * equal are kept in insertion order.
+ *
+ *	struct region {
+ *		struct rb_node node;
+ *		vaddr_t base;
+ *		size_t size;
+ *	};
+ *
+ *	static int region_compare(const struct rb_node *a, const struct rb_node *b)
+ *	{
+ *		vaddr_t abase = rb_tree_entry(a, struct region, node)->base;
+ *		vaddr_t bbase = rb_tree_entry(b, struct region, node)->base;
+ *		return (abase > bbase) - (abase < bbase);
+ *	}
+ *
+ *	static int region_contains(const void *key, const struct rb_node *n)
+ *	{
+ *		vaddr_t va = *(const vaddr_t *)key;
+ *		const struct region *r = rb_tree_entry(n, struct region, node);
+ *		return (va < r->base) ? -1 : (va - r->base >= r->size) ? 1 : 0;
+ *	}
+ *
+ *	rb_tree_insert(&tree, &r->node, region_compare);
+ *	struct rb_node *n = rb_tree_find(&tree, &va, region_contains);
+ *
+ * Code that wants the comparison inlined can walk the tree itself and hand
+ * the empty link it ended up at to rb_tree_insert_at().
+ *
+ * No locking, that's up to the caller.
+ */
+struct rb_node {
+	struct rb_node *parent;
+	struct rb_node *left;
+	struct rb_node *right;
+	bool red;
+};
+
+struct rb_tree {
+	struct rb_node *root;
+};
+
+#define RB_TREE_INITIAL_VALUE { NULL }
+
+#define rb_tree_entry(node, type, member) containerof(node, type, member)
+
+/* same as rb_tree_entry, but a NULL node gives a NULL object */
+#define rb_tree_entry_or_null(node, type, member) ({\
+    struct rb_node *__nod = (node);\
+    __nod ? containerof(__nod, type, member) : (type *)0;\
+})
+
+typedef int (*rb_compare_func)(const struct rb_node *a, const struct rb_node *b);
+typedef int (*rb_key_compare_func)(const void *key, const struct rb_node *node);
+
+static inline void rb_tree_initialize(struct rb_tree *tree)
+{
+	tree->root = NULL;
+}
+
+static inline bool rb_tree_is_empty(const struct rb_tree *tree)
+{
+	return tree->root == NULL;
+}
+
+/* add node, after any nodes that compare equal to it */
+void rb_tree_insert(struct rb_tree *tree, struct rb_node *node, rb_compare_func compare);
+
+/* add node at an empty link found by walking down from the root, parent is the
+ * node that link belongs to or NULL for an empty tree */
+void rb_tree_insert_at(struct rb_tree *tree, struct rb_node *parent, struct rb_node **link, struct rb_node *node);
+
+void rb_tree_delete(struct rb_tree *tree, struct rb_node *node);
+
+/* a node key compares equal to, NULL if none */
+struct rb_node *rb_tree_find(const struct rb_tree *tree, const void *key, rb_key_compare_func compare);
+
+/* the first node that doesn't compare below key, NULL if none */
+struct rb_node *rb_tree_lower_bound(const struct rb_tree *tree, const void *key, rb_key_compare_func compare);
+
+/* in order traversal, all NULL past either end */
+struct rb_node *rb_tree_first(const struct rb_tree *tree);
+struct rb_node *rb_tree_last(const struct rb_tree *tree);
+struct rb_node *rb_tree_next(const struct rb_node *node);
+struct rb_node *rb_tree_prev(const struct rb_node *node);
+
+/* iterates in order. the current entry may not be deleted */
+#define rb_tree_for_every_entry(tree, entry, type, member) \
+	for ((entry) = rb_tree_entry_or_null(rb_tree_first(tree), type, member); \
+	     (entry); \
+	     (entry) = rb_tree_entry_or_null(rb_tree_next(&(entry)->member), type, member))
+
+__END_CDECLS;
+
+#endif
@@ -49,6 +49,7 @@ typedef int kobj_id;
 typedef uint32_t lk_time_t;
 typedef unsigned long long lk_bigtime_t;
 #define INFINITE_TIME UINT32_MAX
+#define INFINITE_TIME_HIRES UINT64_MAX
 
 #define TIME_GTE(a, b) ((int32_t)((a) - (b)) >= 0)
 #define TIME_LTE(a, b) ((int32_t)((a) - (b)) <= 0)
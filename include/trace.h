@@ -33,11 +33,22 @@
 #define TRACE printf("%s:%d\n", __PRETTY_FUNCTION__, __LINE__)
 #define TRACEF(str, x...) do { printf("%s:%d: " str, __PRETTY_FUNCTION__, __LINE__, ## x); } while (0)
 
-/* trace routines that work if LOCAL_TRACE is set */
-#define LTRACE_ENTRY do { if (LOCAL_TRACE) { TRACE_ENTRY; } } while (0)
-#define LTRACE_EXIT do { if (LOCAL_TRACE) { TRACE_EXIT; } } while (0)
-#define LTRACE do { if (LOCAL_TRACE) { TRACE; } } while (0)
-#define LTRACEF(x...) do { if (LOCAL_TRACE) { TRACEF(x); } } while (0)
+/* trace routines that work if LOCAL_TRACE is set, or with WITH_LTRACE_KEYS
+ * once the file's static key is switched on */
+#if WITH_LTRACE_KEYS
+#include <kernel/static_key.h>
+
+static __UNUSED STATIC_KEY_DEFINE_NAMED(__ltrace_key, __FILE__, false);
+
+#define LTRACE_ON (LOCAL_TRACE || static_key_enabled(&__ltrace_key))
+#else
+#define LTRACE_ON (LOCAL_TRACE)
+#endif
+
+#define LTRACE_ENTRY do { if (LTRACE_ON) { TRACE_ENTRY; } } while (0)
+#define LTRACE_EXIT do { if (LTRACE_ON) { TRACE_EXIT; } } while (0)
+#define LTRACE do { if (LTRACE_ON) { TRACE; } } while (0)
+#define LTRACEF(x...) do { if (LTRACE_ON) { TRACEF(x); } } while (0)
 #define LTRACEF_LEVEL(level, x...) do { if (LOCAL_TRACE >= (level)) { TRACEF(x); } } while (0)
 
 #endif
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/cpufreq.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <platform.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/percpu.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/* ondemand goes straight to the top above this much load, and otherwise
+ * picks the lowest frequency that would keep the load under it.
+ */
+#define CPUFREQ_UP_THRESHOLD 80
+
+static const struct cpufreq_ops *cpufreq_ops;
+static struct cpufreq_governor *cpufreq_gov;
+static uint cpufreq_khz[SMP_MAX_CPUS];
+static uint cpufreq_util[SMP_MAX_CPUS];
+
+/* guards the governor list and the current governor */
+static mutex_t cpufreq_lock = MUTEX_INITIAL_VALUE(cpufreq_lock);
+static struct list_node cpufreq_governors = LIST_INITIAL_VALUE(cpufreq_governors);
+
+static uint performance_target(const struct cpufreq_ops *ops, uint cpu, uint utilization, uint cur_khz)
+{
+	return ops->khz[ops->count - 1];
+}
+
+static uint powersave_target(const struct cpufreq_ops *ops, uint cpu, uint utilization, uint cur_khz)
+{
+	return ops->khz[0];
+}
+
+static uint ondemand_target(const struct cpufreq_ops *ops, uint cpu, uint utilization, uint cur_khz)
+{
+	uint max = ops->khz[ops->count - 1];
+
+	if (utilization >= CPUFREQ_UP_THRESHOLD || cur_khz == 0)
+		return max;
+
+	/* the load was measured at cur_khz, scale it to what would keep it at the threshold */
+	return (uint)((uint64_t)cur_khz * utilization / CPUFREQ_UP_THRESHOLD);
+}
+
+static struct cpufreq_governor builtin_governors[] = {
+	{ .name = "performance", .target = performance_target },
+	{ .name = "powersave", .target = powersave_target },
+	{ .name = "ondemand", .target = ondemand_target },
+};
+
+/* the lowest operating point at or above khz, or the top one */
+static uint cpufreq_snap(const struct cpufreq_ops *ops, uint khz)
+{
+	for (uint i = 0; i < ops->count; i++) {
+		if (ops->khz[i] >= khz)
+			return ops->khz[i];
+	}
+
+	return ops->khz[ops->count - 1];
+}
+
+#if THREAD_STATS
+static lk_bigtime_t cpufreq_idle_time(uint cpu, lk_bigtime_t now)
+{
+	lk_bigtime_t idle = percpu[cpu].stats.idle_time;
+
+	/* count the time since it went idle if it's still there */
+	if (mp.idle_cpus & (1U << cpu))
+		idle += now - percpu[cpu].stats.last_idle_timestamp;
+
+	return idle;
+}
+#endif
+
+static int cpufreq_thread(void *arg)
+{
+	static lk_bigtime_t last_idle[SMP_MAX_CPUS];
+	lk_bigtime_t last = current_time_hires();
+
+	for (;;) {
+		thread_sleep(CPUFREQ_SAMPLE_MS);
+
+		lk_bigtime_t now = current_time_hires();
+		lk_bigtime_t period = (now > last) ? now - last : 1;
+
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+#if THREAD_STATS
+			lk_bigtime_t idle = cpufreq_idle_time(cpu, now);
+			lk_bigtime_t delta = MIN(idle - last_idle[cpu], period);
+
+			last_idle[cpu] = idle;
+			cpufreq_util[cpu] = 100 - (uint)(delta * 100 / period);
+#else
+			/* no idle accounting to go on, look busy */
+			cpufreq_util[cpu] = 100;
+#endif
+		}
+		last = now;
+
+		mutex_acquire(&cpufreq_lock);
+		const struct cpufreq_ops *ops = cpufreq_ops;
+		struct cpufreq_governor *gov = cpufreq_gov;
+
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (!(mp.active_cpus & (1U << cpu)))
+				continue;
+
+			uint util = cpufreq_util[cpu];
+			if (ops->shared) {
+				if (cpu != 0)
+					break;
+				for (uint i = 1; i < SMP_MAX_CPUS; i++) {
+					if (mp.active_cpus & (1U << i))
+						util = MAX(util, cpufreq_util[i]);
+				}
+			}
+
+			uint khz = cpufreq_snap(ops, gov->target(ops, cpu, util, cpufreq_khz[cpu]));
+			if (khz == cpufreq_khz[cpu])
+				continue;
+
+			LTRACEF("cpu %u load %u%%, %u -> %u khz\n", cpu, util, cpufreq_khz[cpu], khz);
+			status_t err = ops->set(cpu, khz);
+			if (err < 0) {
+				TRACEF("cpu %u: error %d switching to %u khz\n", cpu, err, khz);
+				continue;
+			}
+			if (ops->shared) {
+				for (uint i = 0; i < SMP_MAX_CPUS; i++)
+					cpufreq_khz[i] = khz;
+			} else {
+				cpufreq_khz[cpu] = khz;
+			}
+		}
+		mutex_release(&cpufreq_lock);
+	}
+
+	return 0;
+}
+
+static void cpufreq_add_builtins_locked(void)
+{
+	if (!list_is_empty(&cpufreq_governors))
+		return;
+
+	for (uint i = 0; i < countof(builtin_governors); i++)
+		list_add_tail(&cpufreq_governors, &builtin_governors[i].node);
+}
+
+void cpufreq_register_governor(struct cpufreq_governor *gov)
+{
+	DEBUG_ASSERT(gov && gov->name && gov->target);
+
+	mutex_acquire(&cpufreq_lock);
+	cpufreq_add_builtins_locked();
+	list_add_tail(&cpufreq_governors, &gov->node);
+	mutex_release(&cpufreq_lock);
+}
+
+status_t cpufreq_set_governor(const char *name)
+{
+	status_t err = ERR_NOT_FOUND;
+
+	mutex_acquire(&cpufreq_lock);
+	cpufreq_add_builtins_locked();
+
+	struct cpufreq_governor *gov;
+	list_for_every_entry(&cpufreq_governors, gov, struct cpufreq_governor, node) {
+		if (!strcmp(gov->name, name)) {
+			cpufreq_gov = gov;
+			err = NO_ERROR;
+			break;
+		}
+	}
+	mutex_release(&cpufreq_lock);
+
+	return err;
+}
+
+status_t cpufreq_register(const struct cpufreq_ops *ops)
+{
+	if (!ops || !ops->khz || ops->count == 0 || !ops->set)
+		return ERR_INVALID_ARGS;
+	if (cpufreq_ops)
+		return ERR_ALREADY_EXISTS;
+
+	mutex_acquire(&cpufreq_lock);
+	cpufreq_ops = ops;
+	mutex_release(&cpufreq_lock);
+
+	if (!cpufreq_gov)
+		cpufreq_set_governor("ondemand");
+
+	thread_t *t = thread_create("cpufreq", &cpufreq_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+	if (!t)
+		return ERR_NO_MEMORY;
+	thread_detach_and_resume(t);
+
+	dprintf(INFO, "cpufreq: %u operating points, %u to %u khz\n", ops->count, ops->khz[0], ops->khz[ops->count - 1]);
+
+	return NO_ERROR;
+}
+
+uint cpufreq_get(uint cpu)
+{
+	return (cpu < SMP_MAX_CPUS) ? cpufreq_khz[cpu] : 0;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_cpufreq(int argc, const cmd_args *argv)
+{
+	if (argc >= 3 && !strcmp(argv[1].str, "governor")) {
+		status_t err = cpufreq_set_governor(argv[2].str);
+		if (err < 0)
+			printf("no governor '%s'\n", argv[2].str);
+		return err;
+	} else if (argc >= 2) {
+		printf("usage:\n");
+		printf("%s                 : frequency and load per cpu\n", argv[0].str);
+		printf("%s governor <name> : switch governors\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	if (!cpufreq_ops) {
+		printf("no cpufreq backend registered\n");
+		return NO_ERROR;
+	}
+
+	mutex_acquire(&cpufreq_lock);
+	printf("governor %s, available:", cpufreq_gov ? cpufreq_gov->name : "none");
+	struct cpufreq_governor *gov;
+	list_for_every_entry(&cpufreq_governors, gov, struct cpufreq_governor, node)
+		printf(" %s", gov->name);
+	printf("\n");
+	mutex_release(&cpufreq_lock);
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (mp.active_cpus & (1U << cpu))
+			printf("cpu %u: %u khz, load %u%%\n", cpu, cpufreq_khz[cpu], cpufreq_util[cpu]);
+	}
+
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("cpufreq", "cpu frequency scaling", &cmd_cpufreq)
+STATIC_COMMAND_END(cpufreq);
+
+#endif
+
+// vim: set noexpandtab:
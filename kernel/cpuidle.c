@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/cpuidle.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <platform.h>
+#include <kernel/mp.h>
+#include <kernel/percpu.h>
+#include <kernel/timer.h>
+
+#define LOCAL_TRACE 0
+
+struct cpuidle_cpu {
+	/* running average of how long the cpu actually stayed idle, in us */
+	lk_bigtime_t avg_idle;
+
+	ulong entries[CPUIDLE_MAX_STATES];
+	lk_bigtime_t residency[CPUIDLE_MAX_STATES];
+};
+
+PERCPU_STATIC(struct cpuidle_cpu, cpuidle_cpus);
+
+static const struct cpuidle_state *idle_states;
+static uint idle_state_count;
+static lk_bigtime_t latency_limit = UINT64_MAX;
+
+status_t cpuidle_register(const struct cpuidle_state *states, uint count)
+{
+	if (!states || count == 0 || count > CPUIDLE_MAX_STATES)
+		return ERR_INVALID_ARGS;
+
+	for (uint i = 0; i < count; i++) {
+		if (!states[i].enter)
+			return ERR_INVALID_ARGS;
+	}
+
+	/* the idle threads only look at the count, publish it after the array */
+	idle_states = states;
+	smp_wmb();
+	idle_state_count = count;
+
+	for (uint i = 0; i < count; i++) {
+		dprintf(INFO, "cpuidle: state %u '%s', exit latency %llu us, residency %llu us\n",
+		        i, states[i].name, states[i].exit_latency, states[i].target_residency);
+	}
+
+	return NO_ERROR;
+}
+
+void cpuidle_set_latency_limit(lk_bigtime_t usecs)
+{
+	latency_limit = usecs;
+}
+
+/* the deepest state that pays off over predicted us */
+static uint cpuidle_select(lk_bigtime_t predicted)
+{
+	for (uint i = idle_state_count - 1; i > 0; i--) {
+		const struct cpuidle_state *s = &idle_states[i];
+
+		if (s->target_residency <= predicted && s->exit_latency <= latency_limit)
+			return i;
+	}
+
+	return 0;
+}
+
+void cpuidle_idle(void)
+{
+	if (idle_state_count == 0) {
+		arch_idle();
+		return;
+	}
+
+	/* nothing that wakes us can be lost between here and the state being entered,
+	 * the interrupt just stays pending until the state returns.
+	 */
+	arch_disable_ints();
+
+	struct cpuidle_cpu *c = percpu_var(cpuidle_cpus);
+	lk_bigtime_t now = current_time_hires();
+	lk_bigtime_t deadline = timer_next_deadline();
+	lk_bigtime_t predicted = (deadline > now) ? deadline - now : 0;
+
+	/* device interrupts and ipis wake the cpu well before the timer does,
+	 * trust recent history when it says the idle periods are shorter.
+	 */
+	if (c->avg_idle && c->avg_idle * 2 < predicted)
+		predicted = c->avg_idle * 2;
+
+	uint i = cpuidle_select(predicted);
+	const struct cpuidle_state *s = &idle_states[i];
+
+	LTRACEF("predicted %llu us, entering %s\n", predicted, s->name);
+	s->enter(s);
+
+	lk_bigtime_t idle = current_time_hires() - now;
+	c->avg_idle = (c->avg_idle * 7 + idle) / 8;
+	c->entries[i]++;
+	c->residency[i] += idle;
+
+	arch_enable_ints();
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_cpuidle(int argc, const cmd_args *argv)
+{
+	if (argc >= 3 && !strcmp(argv[1].str, "latency")) {
+		cpuidle_set_latency_limit(argv[2].u);
+		return NO_ERROR;
+	} else if (argc >= 2) {
+		printf("usage:\n");
+		printf("%s              : idle state usage\n", argv[0].str);
+		printf("%s latency <us> : limit the exit latency of the states picked\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	if (idle_state_count == 0) {
+		printf("no idle states registered, idling with arch_idle\n");
+		return NO_ERROR;
+	}
+
+	if (latency_limit != UINT64_MAX)
+		printf("exit latency limit %llu us\n", latency_limit);
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (!(mp.active_cpus & (1U << cpu)))
+			continue;
+
+		const struct cpuidle_cpu *c = percpu_var_cpu(cpuidle_cpus, cpu);
+		printf("cpu %u: average idle %llu us\n", cpu, c->avg_idle);
+		for (uint i = 0; i < idle_state_count; i++) {
+			printf("\t%-16s entries %lu residency %llu us\n",
+			       idle_states[i].name, c->entries[i], c->residency[i]);
+		}
+	}
+
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("cpuidle", "idle state usage", &cmd_cpuidle)
+STATIC_COMMAND_END(cpuidle);
+
+#endif
+
+// vim: set noexpandtab:
@@ -32,7 +32,10 @@
  */
 
 #include <debug.h>
+#include <malloc.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -46,6 +49,8 @@
 static int cmd_threads(int argc, const cmd_args *argv);
 static int cmd_threadstats(int argc, const cmd_args *argv);
 static int cmd_threadload(int argc, const cmd_args *argv);
+static int cmd_schedlat(int argc, const cmd_args *argv);
+static int cmd_top(int argc, const cmd_args *argv);
 static int cmd_kevlog(int argc, const cmd_args *argv);
 
 STATIC_COMMAND_START
@@ -55,9 +60,11 @@ STATIC_COMMAND("threads", "list kernel threads", &cmd_threads)
 #if THREAD_STATS
 STATIC_COMMAND("threadstats", "thread level statistics", &cmd_threadstats)
 STATIC_COMMAND("threadload", "toggle thread load display", &cmd_threadload)
+STATIC_COMMAND("schedlat", "scheduler latency histograms", &cmd_schedlat)
+STATIC_COMMAND("top", "per thread cpu use over an interval", &cmd_top)
 #endif
 #if WITH_KERNEL_EVLOG
-STATIC_COMMAND("kevlog", "dump kernel event log", &cmd_kevlog)
+STATIC_COMMAND("kevlog", "dump or export the kernel event log", &cmd_kevlog)
 #endif
 STATIC_COMMAND_END(kernel);
 
@@ -72,6 +79,35 @@ static int cmd_threads(int argc, const cmd_args *argv)
 #endif
 
 #if THREAD_STATS
+#if WITH_KERNEL_PMU
+struct threadstats_pmu_args {
+	uint events[PMU_MAX_COUNTERS];
+	uint count;
+};
+
+/* called with the thread lock held, the counts are as of each thread's last switch out */
+static void threadstats_pmu(thread_t *t, void *arg)
+{
+	const struct threadstats_pmu_args *a = arg;
+	int cycles = -1, instructions = -1;
+
+	printf("\t%-24s", t->name);
+	for (uint i = 0; i < a->count; i++) {
+		printf(" %12llu", t->pmu_count[i]);
+		if (a->events[i] == PMU_EVENT_CYCLES)
+			cycles = i;
+		else if (a->events[i] == PMU_EVENT_INSTRUCTIONS)
+			instructions = i;
+	}
+	if (cycles >= 0 && instructions >= 0 && t->pmu_count[cycles] > 0) {
+		/* ipc in hundredths, no floating point in here */
+		uint64_t ipc = t->pmu_count[instructions] * 100 / t->pmu_count[cycles];
+		printf("  ipc %llu.%02llu", ipc / 100, ipc % 100);
+	}
+	printf("\n");
+}
+#endif
+
 static int cmd_threadstats(int argc, const cmd_args *argv)
 {
 	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
@@ -79,19 +115,35 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
 			continue;
 
 		printf("thread stats (cpu %d):\n", i);
-		printf("\ttotal idle time: %lld\n", thread_stats[i].idle_time);
-		printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats[i].idle_time);
-		printf("\treschedules: %lu\n", thread_stats[i].reschedules);
+		printf("\ttotal idle time: %lld\n", percpu[i].stats.idle_time);
+		printf("\ttotal busy time: %lld\n", current_time_hires() - percpu[i].stats.idle_time);
+		printf("\treschedules: %lu\n", percpu[i].stats.reschedules);
 #if WITH_SMP
-		printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+		printf("\treschedule_ipis: %lu\n", percpu[i].stats.reschedule_ipis);
+		printf("\tgeneric_ipis: %lu\n", percpu[i].stats.generic_ipis);
+		printf("\tsteals: %lu\n", percpu[i].stats.steals);
+		printf("\tspinlock contention: %lu\n", percpu[i].stats.spin_contended);
 #endif
-		printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
-		printf("\tpreempts: %lu\n", thread_stats[i].preempts);
-		printf("\tyields: %lu\n", thread_stats[i].yields);
-		printf("\tinterrupts: %lu\n", thread_stats[i].interrupts);
-		printf("\ttimer interrupts: %lu\n", thread_stats[i].timer_ints);
-		printf("\ttimers: %lu\n", thread_stats[i].timers);
+		printf("\tcontext_switches: %lu\n", percpu[i].stats.context_switches);
+		printf("\tpreempts: %lu\n", percpu[i].stats.preempts);
+		printf("\tyields: %lu\n", percpu[i].stats.yields);
+		printf("\tinterrupts: %lu\n", percpu[i].stats.interrupts);
+		printf("\ttimer interrupts: %lu\n", percpu[i].stats.timer_ints);
+		printf("\ttimers: %lu\n", percpu[i].stats.timers);
+		printf("\ttimers coalesced: %lu\n", percpu[i].stats.timers_coalesced);
+	}
+
+#if WITH_KERNEL_PMU
+	struct threadstats_pmu_args pmu_args;
+	pmu_args.count = pmu_get_config(pmu_args.events);
+	if (pmu_args.count > 0) {
+		printf("thread counters:");
+		for (uint i = 0; i < pmu_args.count; i++)
+			printf(" %s", pmu_event_name(pmu_args.events[i]));
+		printf("\n");
+		thread_for_each(&threadstats_pmu, &pmu_args);
 	}
+#endif
 
 	return 0;
 }
@@ -106,12 +158,12 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
 		if (!(mp.active_cpus & (1 << i)))
 			continue;
 
-		lk_bigtime_t idle_time = thread_stats[i].idle_time;
+		lk_bigtime_t idle_time = percpu[i].stats.idle_time;
 
 		/* if the cpu is currently idle, add the time since it went idle up until now to the idle counter */
 		bool is_idle = !!(mp.idle_cpus & (1 << i));
 		if (is_idle) {
-			idle_time += current_time_hires() - thread_stats[i].last_idle_timestamp;
+			idle_time += current_time_hires() - percpu[i].stats.last_idle_timestamp;
 		}
 
 		lk_bigtime_t delta_time = idle_time - last_idle_time[i];
@@ -130,16 +182,16 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
 		       "tmrs %lu\n",
 		       i,
 		       busypercent / 100, busypercent % 100,
-		       thread_stats[i].context_switches - old_stats[i].context_switches,
-		       thread_stats[i].preempts - old_stats[i].preempts,
+		       percpu[i].stats.context_switches - old_stats[i].context_switches,
+		       percpu[i].stats.preempts - old_stats[i].preempts,
 #if WITH_SMP
-		       thread_stats[i].reschedule_ipis - old_stats[i].reschedule_ipis,
+		       percpu[i].stats.reschedule_ipis - old_stats[i].reschedule_ipis,
 #endif
-		       thread_stats[i].interrupts - old_stats[i].interrupts,
-		       thread_stats[i].timer_ints - old_stats[i].timer_ints,
-		       thread_stats[i].timers - old_stats[i].timers);
+		       percpu[i].stats.interrupts - old_stats[i].interrupts,
+		       percpu[i].stats.timer_ints - old_stats[i].timer_ints,
+		       percpu[i].stats.timers - old_stats[i].timers);
 
-		old_stats[i] = thread_stats[i];
+		old_stats[i] = percpu[i].stats;
 		last_idle_time[i] = idle_time;
 	}
 
@@ -164,75 +216,461 @@ static int cmd_threadload(int argc, const cmd_args *argv)
 	return 0;
 }
 
+static void schedlat_bucket_name(char *buf, size_t len, uint b, uint count)
+{
+	if (b == 0)
+		snprintf(buf, len, "0-1");
+	else if (b == count - 1)
+		snprintf(buf, len, "%u+", 1U << b);
+	else
+		snprintf(buf, len, "%u-%u", 1U << b, (2U << b) - 1);
+}
+
+static int cmd_schedlat(int argc, const cmd_args *argv)
+{
+	if (argc > 1) {
+		if (strcmp(argv[1].str, "reset")) {
+			printf("usage: %s [reset]\n", argv[0].str);
+			return ERR_INVALID_ARGS;
+		}
+		sched_latency_reset();
+		return 0;
+	}
+
+	/* a snapshot, so the printing doesn't race the scheduler */
+	static struct sched_latency l;
+	static uint32_t prio[NUM_PRIORITIES][SCHED_LATENCY_BUCKETS];
+	char name[16];
+
+	memset(prio, 0, sizeof(prio));
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!(mp.active_cpus & (1 << i)))
+			continue;
+
+		sched_latency_snapshot(i, &l);
+
+		for (uint p = 0; p < NUM_PRIORITIES; p++) {
+			for (uint b = 0; b < SCHED_LATENCY_BUCKETS; b++)
+				prio[p][b] += l.prio[p][b];
+		}
+
+		printf("cpu %u: ready to run max %llu us, irq to thread max %llu us\n", i, l.ready_max, l.irq_max);
+		printf("\t%12s %10s %10s\n", "usecs", "ready", "irq");
+		for (uint b = 0; b < SCHED_LATENCY_BUCKETS; b++) {
+			if (!l.ready[b] && !l.irq[b])
+				continue;
+			schedlat_bucket_name(name, sizeof(name), b, SCHED_LATENCY_BUCKETS);
+			printf("\t%12s %10u %10u\n", name, l.ready[b], l.irq[b]);
+		}
+		printf("\tthreads left queued at each pick:");
+		for (uint b = 0; b < SCHED_RUNQ_BUCKETS; b++) {
+			if (l.runq[b]) {
+				printf(" %u%s:%u", b, (b == SCHED_RUNQ_BUCKETS - 1) ? "+" : "", l.runq[b]);
+			}
+		}
+		printf("\n");
+	}
+
+	printf("ready to run latency by priority, all cpus:\n");
+	for (uint p = 0; p < NUM_PRIORITIES; p++) {
+		bool any = false;
+		for (uint b = 0; b < SCHED_LATENCY_BUCKETS; b++) {
+			if (!prio[p][b])
+				continue;
+			if (!any)
+				printf("\tpri %2u:", p);
+			any = true;
+			schedlat_bucket_name(name, sizeof(name), b, SCHED_LATENCY_BUCKETS);
+			printf(" %s:%u", name, prio[p][b]);
+		}
+		if (any)
+			printf("\n");
+	}
+
+	return 0;
+}
+
+/* threads tracked by top, the rest are left out of the display */
+#define TOP_MAX_THREADS 128
+
+struct top_entry {
+	thread_t *t;
+	char name[32];
+	lk_bigtime_t runtime;
+	ulong switches;
+	ulong migrations;
+	int priority;
+	int cpu;
+	enum thread_state state;
+
+	/* over the interval, filled in for the second snapshot */
+	lk_bigtime_t delta;
+	ulong delta_switches;
+	ulong delta_migrations;
+};
+
+struct top_snapshot {
+	struct top_entry e[TOP_MAX_THREADS];
+	uint count;
+	lk_bigtime_t time;
+};
+
+/* called with the thread lock held */
+static void top_snap_thread(thread_t *t, void *arg)
+{
+	struct top_snapshot *s = arg;
+
+	if (s->count == TOP_MAX_THREADS)
+		return;
+
+	struct top_entry *e = &s->e[s->count++];
+	e->t = t;
+	strlcpy(e->name, t->name, sizeof(e->name));
+	e->runtime = thread_runtime_locked(t);
+	e->switches = t->context_switches;
+	e->migrations = t->migrations;
+	e->priority = t->priority;
+	e->cpu = (t->state == THREAD_RUNNING) ? t->curr_cpu : t->last_cpu;
+	e->state = t->state;
+}
+
+static void top_snap(struct top_snapshot *s)
+{
+	s->count = 0;
+	s->time = current_time_hires();
+	thread_for_each(&top_snap_thread, s);
+}
+
+static int top_cmp(const void *_a, const void *_b)
+{
+	const struct top_entry *a = _a;
+	const struct top_entry *b = _b;
+
+	if (a->delta != b->delta)
+		return (a->delta > b->delta) ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+static int cmd_top(int argc, const cmd_args *argv)
+{
+	lk_time_t interval = (argc > 1) ? argv[1].u : 1000;
+	uint iterations = (argc > 2) ? argv[2].u : 1;
+
+	if (interval == 0) {
+		printf("usage: %s [interval ms] [iterations]\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	struct top_snapshot *prev = malloc(sizeof(struct top_snapshot));
+	struct top_snapshot *cur = malloc(sizeof(struct top_snapshot));
+	if (!prev || !cur) {
+		free(prev);
+		free(cur);
+		return ERR_NO_MEMORY;
+	}
+
+	uint cpus = 0;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (mp.active_cpus & (1 << i))
+			cpus++;
+	}
+
+	top_snap(prev);
+	for (uint n = 0; n < iterations; n++) {
+		thread_sleep(interval);
+		top_snap(cur);
+
+		lk_bigtime_t elapsed = cur->time - prev->time;
+		if (elapsed == 0)
+			elapsed = 1;
+
+		/* threads created during the interval count from zero */
+		for (uint i = 0; i < cur->count; i++) {
+			struct top_entry *e = &cur->e[i];
+
+			e->delta = e->runtime;
+			e->delta_switches = e->switches;
+			e->delta_migrations = e->migrations;
+			for (uint j = 0; j < prev->count; j++) {
+				const struct top_entry *p = &prev->e[j];
+				if (p->t == e->t && !strcmp(p->name, e->name) && p->runtime <= e->runtime) {
+					e->delta = e->runtime - p->runtime;
+					e->delta_switches = e->switches - p->switches;
+					e->delta_migrations = e->migrations - p->migrations;
+					break;
+				}
+			}
+		}
+
+		/* sort a copy, the next interval diffs against this one in order */
+		memcpy(prev, cur, sizeof(*cur));
+		qsort(cur->e, cur->count, sizeof(struct top_entry), &top_cmp);
+
+		printf("%u threads, %u cpus, %llu ms interval, %% of one cpu\n",
+		       cur->count, cpus, elapsed / 1000);
+		printf("%7s %10s %8s %6s %4s %4s %-10s %s\n",
+		       "cpu%", "total ms", "switches", "migr", "pri", "cpu", "state", "name");
+		for (uint i = 0; i < cur->count; i++) {
+			const struct top_entry *e = &cur->e[i];
+			uint share = (e->delta * 10000) / elapsed;
+
+			printf("%4u.%02u %10llu %8lu %6lu %4d %4d %-10s %s\n",
+			       share / 100, share % 100, e->runtime / 1000, e->delta_switches,
+			       e->delta_migrations, e->priority, e->cpu,
+			       thread_state_to_str(e->state), e->name);
+		}
+		if (cur->count == TOP_MAX_THREADS)
+			printf("(more than %u threads, the rest not shown)\n", TOP_MAX_THREADS);
+	}
+
+	free(prev);
+	free(cur);
+
+	return 0;
+}
+
 #endif // THREAD_STATS
 
 #endif // WITH_LIB_CONSOLE
 
 #if WITH_KERNEL_EVLOG
 
-#include <lib/evlog.h>
+#include <assert.h>
+#include <endian.h>
+#include <malloc.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/atomic.h>
+
+STATIC_ASSERT((KERNEL_EVLOG_LEN & (KERNEL_EVLOG_LEN - 1)) == 0);
+
+/* bumped whenever struct kernel_evlog_record changes */
+#define KERNEL_EVLOG_EXPORT_VERSION 1
+
+struct kernel_evlog_cpu {
+	/* count of records ever reserved, the slot is this masked by the ring length */
+	volatile int head;
+	struct kernel_evlog_record *records;
+} __CPU_ALIGN;
 
-static evlog_t kernel_evlog;
-volatile bool kernel_evlog_enable;
+static struct kernel_evlog_cpu kernel_evlog[SMP_MAX_CPUS];
+
+/* off until the rings are allocated */
+STATIC_KEY_DEFINE_NAMED(kernel_evlog_key, "kevlog", false);
+
+/* set while the rings are missing, being read or cleared. cheaper than flipping the key */
+static volatile bool kernel_evlog_paused = true;
 
 void kernel_evlog_init(void)
 {
-	evlog_init(&kernel_evlog, KERNEL_EVLOG_LEN, 4);
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		size_t size = KERNEL_EVLOG_LEN * sizeof(struct kernel_evlog_record);
+		struct kernel_evlog_record *r = memalign(CACHE_LINE, size);
+		if (!r) {
+			dprintf(CRITICAL, "kernel_evlog: failed to allocate %zu bytes for cpu %u\n", size, i);
+			return;
+		}
+		memset(r, 0, size);
+		kernel_evlog[i].records = r;
+	}
 
-	kernel_evlog_enable = true;
+	kernel_evlog_paused = false;
+	static_key_enable(&kernel_evlog_key);
 }
 
-void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
+void kernel_evlog_add(uint id, uint64_t arg0, uint64_t arg1)
 {
-	if (kernel_evlog_enable) {
-		uint index = evlog_bump_head(&kernel_evlog);
+	if (kernel_evlog_paused)
+		return;
+
+	/* if we migrate after reading the cpu number we just share the old cpu's ring
+	 * for a moment, the atomic still hands out unique slots */
+	uint cpu = arch_curr_cpu_num();
+	struct kernel_evlog_cpu *c = &kernel_evlog[cpu];
+	uint index = (uint)atomic_add(&c->head, 1) & (KERNEL_EVLOG_LEN - 1);
+	struct kernel_evlog_record *r = &c->records[index];
+
+	/* a reader skips the slot until the id is back */
+	r->id = KERNEL_EVLOG_NULL;
+	smp_wmb();
+	r->time = current_time_hires();
+	r->cpu = cpu;
+	r->arg0 = arg0;
+	r->arg1 = arg1;
+	atomic_store_release(&r->id, id);
+}
 
-		kernel_evlog.items[index] = (uintptr_t)current_time_hires();
-		kernel_evlog.items[index+1] = (arch_curr_cpu_num() << 16) | id;
-		kernel_evlog.items[index+2] = arg0;
-		kernel_evlog.items[index+3] = arg1;
-	}
+/* oldest and one past the newest record still in a cpu's ring */
+static void kernel_evlog_range(const struct kernel_evlog_cpu *c, uint *start, uint *end)
+{
+	*end = (uint)c->head;
+	*start = (*end > KERNEL_EVLOG_LEN) ? *end - KERNEL_EVLOG_LEN : 0;
+}
+
+static const struct kernel_evlog_record *kernel_evlog_get(const struct kernel_evlog_cpu *c, uint i)
+{
+	return &c->records[i & (KERNEL_EVLOG_LEN - 1)];
 }
 
 #if WITH_LIB_CONSOLE
 
-static void kevdump_cb(const uintptr_t *i)
+static void kevdump(const struct kernel_evlog_record *r)
 {
-	switch (i[1] & 0xffff) {
+	unsigned long long t = r->time;
+	uint cpu = r->cpu;
+
+	switch (r->id) {
 		case KERNEL_EVLOG_CONTEXT_SWITCH:
-			printf("%lu.%lu: context switch from %p to %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
+			printf("%llu.%u: context switch from %p to %p\n", t, cpu, (void *)(uintptr_t)r->arg0, (void *)(uintptr_t)r->arg1);
 			break;
 		case KERNEL_EVLOG_PREEMPT:
-			printf("%lu.%lu: preempt on thread %p\n", i[0], i[1] >> 16, (void *)i[2]);
+			printf("%llu.%u: preempt on thread %p\n", t, cpu, (void *)(uintptr_t)r->arg0);
+			break;
+		case KERNEL_EVLOG_THREAD_WAKEUP:
+			printf("%llu.%u: wakeup thread %p\n", t, cpu, (void *)(uintptr_t)r->arg0);
 			break;
 		case KERNEL_EVLOG_TIMER_TICK:
-			printf("%lu.%lu: timer tick\n", i[0], i[1] >> 16);
+			printf("%llu.%u: timer tick\n", t, cpu);
 			break;
 		case KERNEL_EVLOG_TIMER_CALL:
-			printf("%lu.%lu: timer call %p, arg %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
+			printf("%llu.%u: timer call %p, arg %p\n", t, cpu, (void *)(uintptr_t)r->arg0, (void *)(uintptr_t)r->arg1);
 			break;
 		case KERNEL_EVLOG_IRQ_ENTER:
-			printf("%lu.%lu: irq entry %lu\n", i[0], i[1] >> 16, i[2]);
+			printf("%llu.%u: irq entry %llu\n", t, cpu, (unsigned long long)r->arg0);
 			break;
 		case KERNEL_EVLOG_IRQ_EXIT:
-			printf("%lu.%lu: irq exit  %lu\n", i[0], i[1] >> 16, i[2]);
+			printf("%llu.%u: irq exit  %llu\n", t, cpu, (unsigned long long)r->arg0);
+			break;
+		case KERNEL_EVLOG_WORK_BEGIN:
+			printf("%llu.%u: work begin %p, arg %p\n", t, cpu, (void *)(uintptr_t)r->arg0, (void *)(uintptr_t)r->arg1);
+			break;
+		case KERNEL_EVLOG_WORK_END:
+			printf("%llu.%u: work end   %p, arg %p\n", t, cpu, (void *)(uintptr_t)r->arg0, (void *)(uintptr_t)r->arg1);
+			break;
+		case KERNEL_EVLOG_BIO_SUBMIT:
+			printf("%llu.%u: bio submit %p, len %llu\n", t, cpu, (void *)(uintptr_t)r->arg0, (unsigned long long)r->arg1);
+			break;
+		case KERNEL_EVLOG_BIO_COMPLETE:
+			printf("%llu.%u: bio complete %p, result %lld\n", t, cpu, (void *)(uintptr_t)r->arg0, (long long)r->arg1);
 			break;
 		default:
-			printf("%lu: unknown id 0x%lx 0x%lx 0x%lx\n", i[0], i[1], i[2], i[3]);
+			printf("%llu.%u: id 0x%x 0x%llx 0x%llx\n", t, cpu, r->id,
+			       (unsigned long long)r->arg0, (unsigned long long)r->arg1);
+	}
+}
+
+/* walk every ring at once, oldest record first */
+static void kernel_evlog_walk(void (*cb)(const struct kernel_evlog_record *))
+{
+	uint pos[SMP_MAX_CPUS];
+	uint end[SMP_MAX_CPUS];
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		kernel_evlog_range(&kernel_evlog[i], &pos[i], &end[i]);
+
+	for (;;) {
+		const struct kernel_evlog_record *next = NULL;
+		uint next_cpu = 0;
+
+		for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+			/* skip slots a writer was in the middle of when logging stopped */
+			while (pos[i] != end[i] && kernel_evlog_get(&kernel_evlog[i], pos[i])->id == KERNEL_EVLOG_NULL)
+				pos[i]++;
+			if (pos[i] == end[i])
+				continue;
+
+			const struct kernel_evlog_record *r = kernel_evlog_get(&kernel_evlog[i], pos[i]);
+			if (!next || r->time < next->time) {
+				next = r;
+				next_cpu = i;
+			}
+		}
+
+		if (!next)
+			break;
+
+		cb(next);
+		pos[next_cpu]++;
 	}
 }
 
 void kernel_evlog_dump(void)
 {
-	kernel_evlog_enable = false;
-	evlog_dump(&kernel_evlog, &kevdump_cb);
-	kernel_evlog_enable = true;
+	if (!kernel_evlog[0].records)
+		return;
+
+	kernel_evlog_paused = true;
+	kernel_evlog_walk(&kevdump);
+	kernel_evlog_paused = false;
+}
+
+static void kevexport(const struct kernel_evlog_record *r)
+{
+	const uint8_t *b = (const uint8_t *)r;
+
+	printf("kevlog r ");
+	for (size_t i = 0; i < sizeof(*r); i++)
+		printf("%02x", b[i]);
+	printf("\n");
+}
+
+static void kevexport_thread(thread_t *t, void *arg)
+{
+	printf("kevlog t %p %s\n", t, t->name);
+}
+
+/* the raw records, hex encoded so they survive a serial console. the
+ * header carries what the host needs to unpack them. */
+static void kernel_evlog_export(void)
+{
+	kernel_evlog_paused = true;
+
+	printf("kevlog begin %u %s %zu %u\n", KERNEL_EVLOG_EXPORT_VERSION,
+#if BYTE_ORDER == LITTLE_ENDIAN
+	       "le",
+#else
+	       "be",
+#endif
+	       sizeof(struct kernel_evlog_record), SMP_MAX_CPUS);
+	thread_for_each(&kevexport_thread, NULL);
+	kernel_evlog_walk(&kevexport);
+	printf("kevlog end\n");
+
+	kernel_evlog_paused = false;
 }
 
 static int cmd_kevlog(int argc, const cmd_args *argv)
 {
-	printf("kernel event log:\n");
-	kernel_evlog_dump();
+	if (!kernel_evlog[0].records) {
+		printf("kernel event log not allocated\n");
+		return ERR_NO_MEMORY;
+	}
+
+	if (argc < 2) {
+		printf("kernel event log:\n");
+		kernel_evlog_dump();
+	} else if (!strcmp(argv[1].str, "export")) {
+		kernel_evlog_export();
+	} else if (!strcmp(argv[1].str, "clear")) {
+		kernel_evlog_paused = true;
+		for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+			memset(kernel_evlog[i].records, 0, KERNEL_EVLOG_LEN * sizeof(struct kernel_evlog_record));
+			kernel_evlog[i].head = 0;
+		}
+		kernel_evlog_paused = false;
+	} else if (!strcmp(argv[1].str, "on")) {
+		static_key_enable(&kernel_evlog_key);
+	} else if (!strcmp(argv[1].str, "off")) {
+		static_key_disable(&kernel_evlog_key);
+	} else {
+		printf("usage:\n");
+		printf("%s              : dump the log as text\n", argv[0].str);
+		printf("%s export       : dump the raw records for scripts/kevlog2trace.py\n", argv[0].str);
+		printf("%s clear        : empty every cpu's ring\n", argv[0].str);
+		printf("%s on|off       : start or stop logging\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
 
 	return NO_ERROR;
 }
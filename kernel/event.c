@@ -44,8 +44,35 @@
 #include <debug.h>
 #include <assert.h>
 #include <err.h>
+#include <kernel/poll.h>
 #include <kernel/thread.h>
 
+/*
+ * e->state holds the signalled bit and a count of the threads registered in
+ * event_wait_timeout's slow path. Threads only register, and go away again,
+ * with the wait queue lock held, and a signaller that sees one takes the lock
+ * too. So the common cases are a single compare and swap on state: waiting
+ * on an event that's already signalled, and signalling one no one is waiting
+ * on.
+ */
+
+/* take the signal if it's there, unsignalling an autounsignal event */
+static inline bool event_take(event_t *e)
+{
+	int state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+
+	while (state & EVENT_STATE_SIGNALLED) {
+		if (!(e->flags & EVENT_FLAG_AUTOUNSIGNAL))
+			return true;
+
+		/* autounsignal flag lets one thread fall through before unsignalling */
+		if (__atomic_compare_exchange_n(&e->state, &state, state & ~EVENT_STATE_SIGNALLED, true,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return true;
+	}
+	return false;
+}
+
 /**
  * @brief  Initialize an event object
  *
@@ -71,14 +98,18 @@ void event_destroy(event_t *e)
 {
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	THREAD_LOCK(state);
+	WAIT_QUEUE_LOCK(&e->wait, state);
 
+	/*
+	 * the waiters woken here leave without touching the event again, it may be
+	 * freed as soon as we return, so their registrations are dropped for them
+	 */
 	e->magic = 0;
-	e->signalled = false;
+	__atomic_store_n(&e->state, 0, __ATOMIC_RELAXED);
 	e->flags = 0;
 	wait_queue_destroy(&e->wait, true);
 
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&e->wait, state);
 }
 
 /**
@@ -102,20 +133,28 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
 
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	THREAD_LOCK(state);
+	/* signalled, we're going to fall through */
+	if (likely(event_take(e)))
+		return NO_ERROR;
 
-	if (e->signalled) {
-		/* signalled, we're going to fall through */
-		if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
-			/* autounsignal flag lets one thread fall through before unsignalling */
-			e->signalled = false;
-		}
-	} else {
+	WAIT_QUEUE_LOCK(&e->wait, state);
+
+	/* register before looking again, so a signaller either sees us or we see it */
+	__atomic_add_fetch(&e->state, EVENT_STATE_WAITER, __ATOMIC_SEQ_CST);
+
+	if (!event_take(e)) {
 		/* unsignalled, block here */
 		ret = wait_queue_block(&e->wait, timeout);
+		if (ret == ERR_OBJECT_DESTROYED) {
+			/* event_destroy dropped our registration, e may be gone */
+			WAIT_QUEUE_RESTORE(state);
+			return ret;
+		}
 	}
 
-	THREAD_UNLOCK(state);
+	__atomic_sub_fetch(&e->state, EVENT_STATE_WAITER, __ATOMIC_RELAXED);
+
+	WAIT_QUEUE_UNLOCK(&e->wait, state);
 
 	return ret;
 }
@@ -141,9 +180,26 @@ status_t event_signal(event_t *e, bool reschedule)
 {
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	THREAD_LOCK(state);
+	/* no one waiting and not signalled yet, just set it */
+	int old = 0;
+	if (likely(__atomic_compare_exchange_n(&e->state, &old, EVENT_STATE_SIGNALLED, false,
+	                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))) {
+		/* pairs with the fence in poller_add, either it sees the bit or we see it */
+		if (likely(!__atomic_load_n(&e->wait.pollers, __ATOMIC_SEQ_CST)))
+			return NO_ERROR;
+
+		WAIT_QUEUE_LOCK(&e->wait, state);
+		wait_queue_poll_notify(&e->wait);
+		WAIT_QUEUE_UNLOCK(&e->wait, state);
+		return NO_ERROR;
+	}
+
+	if (old & EVENT_STATE_SIGNALLED)
+		return NO_ERROR;
 
-	if (!e->signalled) {
+	WAIT_QUEUE_LOCK(&e->wait, state);
+
+	if (!event_is_signalled(e)) {
 		if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
 			/* try to release one thread and leave unsignalled if successful */
 			if (wait_queue_wake_one(&e->wait, reschedule, NO_ERROR) <= 0) {
@@ -152,16 +208,20 @@ status_t event_signal(event_t *e, bool reschedule)
 				 * signalled state and let the next call to event_wait
 				 * unsignal the event.
 				 */
-				e->signalled = true;
+				__atomic_or_fetch(&e->state, EVENT_STATE_SIGNALLED, __ATOMIC_RELEASE);
 			}
 		} else {
 			/* release all threads and remain signalled */
-			e->signalled = true;
+			__atomic_or_fetch(&e->state, EVENT_STATE_SIGNALLED, __ATOMIC_RELEASE);
 			wait_queue_wake_all(&e->wait, reschedule, NO_ERROR);
 		}
+
+		/* a thread that took an autounsignal event consumed it, pollers only see it left signalled */
+		if (event_is_signalled(e))
+			wait_queue_poll_notify(&e->wait);
 	}
 
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&e->wait, state);
 
 	return NO_ERROR;
 }
@@ -182,7 +242,7 @@ status_t event_unsignal(event_t *e)
 {
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	e->signalled = false;
+	__atomic_and_fetch(&e->state, ~EVENT_STATE_SIGNALLED, __ATOMIC_RELEASE);
 
 	return NO_ERROR;
 }
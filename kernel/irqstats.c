@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/irqstats.h>
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include <kernel/mp.h>
+#include <kernel/percpu.h>
+
+struct irqstats_counts {
+	ulong count;
+	uint64_t total_cycles;
+	uint32_t max_cycles;
+};
+
+struct irqstats_cpu {
+	struct irqstats_counts vector[IRQ_STATS_VECTORS];
+};
+
+/* each cpu only updates its own counts, from interrupt context */
+PERCPU_STATIC(struct irqstats_cpu, irqstats_cpu);
+static percpu_counter_t irqstats_dropped; /* vectors past IRQ_STATS_VECTORS */
+
+void irqstats_record(uint vector, uint32_t cycles)
+{
+	if (vector >= IRQ_STATS_VECTORS) {
+		percpu_counter_inc(&irqstats_dropped);
+		return;
+	}
+
+	struct irqstats_counts *c = &percpu_var(irqstats_cpu)->vector[vector];
+
+	c->count++;
+	c->total_cycles += cycles;
+	if (cycles > c->max_cycles)
+		c->max_cycles = cycles;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_irqstats(int argc, const cmd_args *argv);
+
+STATIC_COMMAND_START
+STATIC_COMMAND("irqstats", "per vector interrupt counts and handler time", &cmd_irqstats)
+STATIC_COMMAND_END(irqstats);
+
+static int cmd_irqstats(int argc, const cmd_args *argv)
+{
+	if (argc > 1 && !strcmp(argv[1].str, "reset")) {
+		memset(irqstats_cpu, 0, sizeof(irqstats_cpu));
+		percpu_counter_reset(&irqstats_dropped);
+		return 0;
+	}
+
+	printf("%6s", "vector");
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (mp.active_cpus & (1U << cpu)) {
+			char name[16];
+			snprintf(name, sizeof(name), "cpu%u", cpu);
+			printf(" %10s", name);
+		}
+	}
+	printf(" %14s %10s %10s\n", "total cycles", "avg", "max");
+
+	for (uint vector = 0; vector < IRQ_STATS_VECTORS; vector++) {
+		ulong count = 0;
+		uint64_t total = 0;
+		uint32_t max = 0;
+
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			const struct irqstats_counts *c = &percpu_var_cpu(irqstats_cpu, cpu)->vector[vector];
+
+			count += c->count;
+			total += c->total_cycles;
+			if (c->max_cycles > max)
+				max = c->max_cycles;
+		}
+		if (count == 0)
+			continue;
+
+		printf("%6u", vector);
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (mp.active_cpus & (1U << cpu))
+				printf(" %10lu", percpu_var_cpu(irqstats_cpu, cpu)->vector[vector].count);
+		}
+		printf(" %14llu %10llu %10u\n",
+		       (unsigned long long)total, (unsigned long long)(total / count), max);
+	}
+	uint64_t dropped = percpu_counter_read(&irqstats_dropped);
+	if (dropped)
+		printf("%llu interrupts past vector %u not counted\n", (unsigned long long)dropped, IRQ_STATS_VECTORS - 1);
+
+	return 0;
+}
+
+#endif
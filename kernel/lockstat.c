@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/lockstat.h>
+#include <debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+
+/* locks are tracked in a fixed, open addressed table keyed by address */
+#define LOCKSTAT_ENTRIES 256
+
+struct lockstat_counts {
+	ulong acquires;
+	ulong contended;
+	lk_bigtime_t total_wait;
+	lk_bigtime_t max_wait;
+	void *max_caller;
+};
+
+static const void *lockstat_keys[LOCKSTAT_ENTRIES];
+static enum lockstat_type lockstat_types[LOCKSTAT_ENTRIES];
+static ulong lockstat_dropped; /* acquisitions not recorded because the table was full */
+
+/* each cpu only updates its own counts, with interrupts disabled */
+static struct lockstat_counts lockstat_counts[SMP_MAX_CPUS][LOCKSTAT_ENTRIES];
+
+static int lockstat_slot(const void *lock, enum lockstat_type type)
+{
+	uint hash = ((uintptr_t)lock >> 2) * 2654435761U;
+
+	for (uint i = 0; i < LOCKSTAT_ENTRIES; i++) {
+		uint slot = (hash + i) % LOCKSTAT_ENTRIES;
+		const void *key = __atomic_load_n(&lockstat_keys[slot], __ATOMIC_ACQUIRE);
+
+		if (key == lock)
+			return slot;
+		if (key == NULL) {
+			if (__atomic_compare_exchange_n(&lockstat_keys[slot], &key, lock, false,
+			                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				lockstat_types[slot] = type;
+				return slot;
+			}
+			/* lost the race for this slot, see who won it */
+			if (key == lock)
+				return slot;
+		}
+	}
+
+	return -1;
+}
+
+void lockstat_record(const void *lock, enum lockstat_type type, bool contended, lk_bigtime_t wait, void *caller)
+{
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	int slot = lockstat_slot(lock, type);
+	if (slot < 0) {
+		lockstat_dropped++;
+		goto out;
+	}
+
+	struct lockstat_counts *c = &lockstat_counts[arch_curr_cpu_num()][slot];
+
+	c->acquires++;
+	if (contended) {
+		c->contended++;
+		c->total_wait += wait;
+		if (wait >= c->max_wait) {
+			c->max_wait = wait;
+			c->max_caller = caller;
+		}
+	}
+
+out:
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* instrumented spin_lock(), see kernel/spinlock.h */
+void spin_lock_stats(spin_lock_t *lock)
+{
+	if (likely(arch_spin_trylock(lock) == 0)) {
+		LOCKSTAT_RECORD(lock, LOCKSTAT_SPIN, false, 0);
+		return;
+	}
+
+	lk_bigtime_t start = current_time_hires();
+#if THREAD_STATS && WITH_SMP
+	spin_lock_contended(lock);
+#else
+	arch_spin_lock(lock);
+#endif
+	LOCKSTAT_RECORD(lock, LOCKSTAT_SPIN, true, current_time_hires() - start);
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_lockstat(int argc, const cmd_args *argv);
+
+STATIC_COMMAND_START
+STATIC_COMMAND("lockstat", "lock contention statistics", &cmd_lockstat)
+STATIC_COMMAND_END(lockstat);
+
+static struct lockstat_counts lockstat_totals[LOCKSTAT_ENTRIES];
+static uint16_t lockstat_order[LOCKSTAT_ENTRIES];
+
+static void lockstat_sum(void)
+{
+	for (uint slot = 0; slot < LOCKSTAT_ENTRIES; slot++) {
+		struct lockstat_counts *t = &lockstat_totals[slot];
+
+		memset(t, 0, sizeof(*t));
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			const struct lockstat_counts *c = &lockstat_counts[cpu][slot];
+
+			t->acquires += c->acquires;
+			t->contended += c->contended;
+			t->total_wait += c->total_wait;
+			if (c->max_wait >= t->max_wait) {
+				t->max_wait = c->max_wait;
+				t->max_caller = c->max_caller;
+			}
+		}
+	}
+}
+
+static int cmd_lockstat(int argc, const cmd_args *argv)
+{
+	uint count = 0;
+	uint limit = 32;
+
+	if (argc > 1 && !strcmp(argv[1].str, "reset")) {
+		memset(lockstat_counts, 0, sizeof(lockstat_counts));
+		lockstat_dropped = 0;
+		return 0;
+	}
+	if (argc > 1)
+		limit = argv[1].u;
+
+	lockstat_sum();
+
+	/* insertion sort the used slots by total wait time, longest first */
+	for (uint slot = 0; slot < LOCKSTAT_ENTRIES; slot++) {
+		if (!lockstat_keys[slot] || lockstat_totals[slot].acquires == 0)
+			continue;
+
+		uint i = count++;
+		while (i > 0 && lockstat_totals[lockstat_order[i - 1]].total_wait < lockstat_totals[slot].total_wait) {
+			lockstat_order[i] = lockstat_order[i - 1];
+			i--;
+		}
+		lockstat_order[i] = slot;
+	}
+
+	printf("%-18s %-5s %10s %10s %12s %10s %s\n",
+	       "lock", "type", "acquires", "contended", "total wait", "max wait", "max wait caller");
+	for (uint i = 0; i < count && i < limit; i++) {
+		uint slot = lockstat_order[i];
+		const struct lockstat_counts *t = &lockstat_totals[slot];
+
+		printf("%-18p %-5s %10lu %10lu %12llu %10llu %p\n",
+		       lockstat_keys[slot], (lockstat_types[slot] == LOCKSTAT_MUTEX) ? "mutex" : "spin",
+		       t->acquires, t->contended, t->total_wait, t->max_wait, t->max_caller);
+	}
+	printf("%u locks tracked, wait times in usecs", count);
+	if (lockstat_dropped)
+		printf(", %lu acquisitions dropped, table full", lockstat_dropped);
+	printf("\n");
+
+	return 0;
+}
+
+#endif
+
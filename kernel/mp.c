@@ -23,7 +23,10 @@
 
 #include <kernel/mp.h>
 
+#include <ctype.h>
+#include <err.h>
 #include <stdlib.h>
+#include <string.h>
 #include <debug.h>
 #include <assert.h>
 #include <trace.h>
@@ -32,8 +35,68 @@
 
 #define LOCAL_TRACE 0
 
+#ifndef SMP_ISOLATED_CPUS
+#define SMP_ISOLATED_CPUS 0
+#endif
+STATIC_ASSERT((SMP_ISOLATED_CPUS & 1) == 0);
+
 /* a global state structure, aligned on cpu cache line to minimize aliasing */
-struct mp_state mp __CPU_ALIGN;
+struct mp_state mp __CPU_ALIGN = {
+	.isolated_cpus = SMP_ISOLATED_CPUS & MP_CPU_MASK_ALL,
+};
+
+#if WITH_SMP
+/*
+ * Per cpu queue of pending cross cpu calls. Senders push onto the head with a
+ * compare and swap, the target takes the whole list at once in its generic
+ * ipi handler, so neither side ever takes a lock.
+ */
+struct mp_call_queue {
+	struct mp_call_node *head;
+} __CPU_ALIGN;
+
+static struct mp_call_queue call_queue[SMP_MAX_CPUS];
+
+static void mp_call_queue_push(uint cpu, struct mp_call_node *node)
+{
+	struct mp_call_node *head = __atomic_load_n(&call_queue[cpu].head, __ATOMIC_RELAXED);
+
+	do {
+		node->next = head;
+	} while (!__atomic_compare_exchange_n(&call_queue[cpu].head, &head, node, true,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* run everything queued for the local cpu, in the order it was queued */
+static void mp_call_queue_run(void)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	DEBUG_ASSERT(arch_ints_disabled());
+
+	struct mp_call_node *list = __atomic_exchange_n(&call_queue[cpu].head, NULL, __ATOMIC_ACQUIRE);
+	struct mp_call_node *fifo = NULL;
+
+	/* reverse it, the queue is pushed lifo */
+	while (list) {
+		struct mp_call_node *next = list->next;
+		list->next = fifo;
+		fifo = list;
+		list = next;
+	}
+
+	while (fifo) {
+		struct mp_call *call = fifo->call;
+
+		/* the call may go away as soon as outstanding drops, so don't touch it after */
+		fifo = fifo->next;
+
+		LTRACEF("cpu %u, task %p, context %p\n", cpu, call->task, call->context);
+		call->task(call->context);
+		__atomic_fetch_sub(&call->outstanding, 1, __ATOMIC_RELEASE);
+	}
+}
+#endif
 
 void mp_init(void)
 {
@@ -61,6 +124,135 @@ void mp_reschedule(mp_cpu_mask_t target, uint flags)
 #endif
 }
 
+void mp_async_exec(mp_call_t *call, mp_cpu_mask_t target, mp_sync_task_t task, void *context)
+{
+	uint local_cpu = arch_curr_cpu_num();
+	bool run_local;
+
+	if (target == MP_CPU_ALL_BUT_LOCAL)
+		target = ~(1U << local_cpu);
+
+	/* mask out cpus that are not active or do not exist */
+	target &= mp.active_cpus | (1U << local_cpu);
+	target &= MP_CPU_MASK_ALL;
+
+	run_local = target & (1U << local_cpu);
+	target &= ~(1U << local_cpu);
+
+	LTRACEF("local %u, target 0x%x, run local %d\n", local_cpu, target, run_local);
+
+	call->task = task;
+	call->context = context;
+	call->outstanding = 0;
+
+#if WITH_SMP
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (target & (1U << cpu))
+			call->outstanding++;
+	}
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (target & (1U << cpu)) {
+			call->node[cpu].call = call;
+			mp_call_queue_push(cpu, &call->node[cpu]);
+		}
+	}
+
+	if (target)
+		arch_mp_send_ipi(target, MP_IPI_GENERIC);
+#endif
+
+	if (run_local) {
+		spin_lock_saved_state_t state;
+		arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+		task(context);
+		arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+	}
+}
+
+bool mp_async_done(const mp_call_t *call)
+{
+	return __atomic_load_n(&call->outstanding, __ATOMIC_ACQUIRE) == 0;
+}
+
+void mp_async_wait(mp_call_t *call)
+{
+	while (!mp_async_done(call)) {
+#if WITH_SMP
+		/* if we can't take the ipi, drain our own queue so two cpus calling
+		 * each other with interrupts disabled can't deadlock.
+		 */
+		if (arch_ints_disabled())
+			mp_call_queue_run();
+#endif
+	}
+}
+
+void mp_sync_exec(mp_cpu_mask_t target, mp_sync_task_t task, void *context)
+{
+	mp_call_t call;
+
+	mp_async_exec(&call, target, task, context);
+	mp_async_wait(&call);
+}
+
+status_t mp_set_isolated_cpus(mp_cpu_mask_t mask)
+{
+	mask &= MP_CPU_MASK_ALL;
+
+	/* the boot cpu is where everything unaffined ends up */
+	if (mask & 1)
+		return ERR_INVALID_ARGS;
+
+	mp.isolated_cpus = mask;
+
+	return NO_ERROR;
+}
+
+/* pick isolcpus=<list> out of a boot command line, list being cpus and
+ * ranges of them such as 1,3-5 */
+void mp_parse_boot_args(const char *cmdline)
+{
+	const char *p = cmdline;
+
+	while ((p = strstr(p, "isolcpus=")) != NULL) {
+		if (p == cmdline || p[-1] == ' ')
+			break;
+		p++;
+	}
+	if (!p)
+		return;
+
+	p += strlen("isolcpus=");
+
+	mp_cpu_mask_t mask = 0;
+	while (isdigit((unsigned char)*p)) {
+		uint first = 0;
+		while (isdigit((unsigned char)*p))
+			first = first * 10 + (*p++ - '0');
+
+		uint last = first;
+		if (*p == '-' && isdigit((unsigned char)p[1])) {
+			p++;
+			last = 0;
+			while (isdigit((unsigned char)*p))
+				last = last * 10 + (*p++ - '0');
+		}
+
+		for (uint cpu = first; cpu <= last && cpu < SMP_MAX_CPUS; cpu++)
+			mask |= 1U << cpu;
+
+		if (*p != ',')
+			break;
+		p++;
+	}
+
+	if (mp_set_isolated_cpus(mask) < 0)
+		dprintf(INFO, "mp: ignoring isolcpus, cpu 0 can't be isolated\n");
+	else if (mask)
+		dprintf(INFO, "mp: isolated cpus 0x%x\n", mask);
+}
+
 void mp_set_curr_cpu_active(bool active)
 {
 	atomic_or((volatile int *)&mp.active_cpus, 1U << arch_curr_cpu_num());
@@ -77,6 +269,17 @@ enum handler_return mp_mbx_reschedule_irq(void)
 
 	return (mp.active_cpus & (1U << cpu)) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
+
+enum handler_return mp_mbx_generic_irq(void)
+{
+	LTRACEF("cpu %u\n", arch_curr_cpu_num());
+
+	THREAD_STATS_INC(generic_ipis);
+
+	mp_call_queue_run();
+
+	return INT_NO_RESCHEDULE;
+}
 #endif
 
 // vim: set noexpandtab:
@@ -34,8 +34,130 @@
 #include <debug.h>
 #include <assert.h>
 #include <err.h>
+#include <platform.h>
+#include <stdlib.h>
+#include <kernel/lockstat.h>
 #include <kernel/thread.h>
 
+/* states of mutex_t.val */
+#define MUTEX_UNLOCKED  0
+#define MUTEX_LOCKED    1
+#define MUTEX_CONTESTED 2 /* locked, and there may be threads in the wait queue */
+
+/* number of times to poll a mutex held by a thread running on another cpu before blocking */
+#ifndef MUTEX_SPIN_COUNT
+#define MUTEX_SPIN_COUNT 1000
+#endif
+
+static inline bool mutex_trylock_fast(mutex_t *m)
+{
+	int expected = MUTEX_UNLOCKED;
+
+	return __atomic_compare_exchange_n(&m->val, &expected, MUTEX_LOCKED, false,
+	                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+#if WITH_SMP
+/*
+ * Adaptive spin: if the holder is currently running on another cpu it will
+ * probably drop the mutex shortly, so poll for a while instead of paying for a
+ * block and wakeup. Give up as soon as the holder is seen off cpu.
+ *
+ * The holder pointer is only peeked at, never written through, so racing with
+ * the holder releasing the mutex (or exiting) is harmless.
+ */
+static bool mutex_spin(mutex_t *m)
+{
+	for (uint i = 0; i < MUTEX_SPIN_COUNT; i++) {
+		if (__atomic_load_n(&m->val, __ATOMIC_RELAXED) == MUTEX_UNLOCKED && mutex_trylock_fast(m))
+			return true;
+
+		thread_t *holder = __atomic_load_n(&m->holder, __ATOMIC_RELAXED);
+		if (holder && holder->curr_cpu < 0)
+			break;
+	}
+
+	return false;
+}
+#endif
+
+/*
+ * Priority inheritance. Once a mutex has waiters it is put on its holder's
+ * held_mutexes list, and the holder runs at the priority of the highest waiter
+ * across that list. Wait queue lists are only modified with thread_lock held,
+ * so holding it is enough to walk any of them.
+ */
+static int mutex_waiter_priority(mutex_t *m)
+{
+	/* the wait queue is in priority order */
+	thread_t *t = list_peek_head_type(&m->wait.list, thread_t, queue_node);
+
+	return t ? t->priority : -1;
+}
+
+/* recompute the priority the holder inherits, thread_lock must be held */
+static void mutex_update_inherited_priority(thread_t *holder)
+{
+	int priority = -1;
+	mutex_t *m;
+
+	list_for_every_entry(&holder->held_mutexes, m, mutex_t, held_node)
+		priority = MAX(priority, mutex_waiter_priority(m));
+
+	thread_set_inherited_priority_locked(holder, priority);
+}
+
+/*
+ * put m on t's held_mutexes. a new holder can take m by the fast path before the
+ * previous one has unboosted, so take it off that one's list first and give back
+ * what it inherited through m. thread_lock must be held.
+ */
+static void mutex_set_held_by(mutex_t *m, thread_t *t)
+{
+	thread_t *prev = m->held_by;
+
+	if (prev == t)
+		return;
+
+	if (prev) {
+		list_delete(&m->held_node);
+		m->held_by = NULL;
+		mutex_update_inherited_priority(prev);
+	}
+
+	list_add_tail(&t->held_mutexes, &m->held_node);
+	m->held_by = t;
+}
+
+/* about to block on m, lend our priority to the holder. wait queue lock must be held */
+static void mutex_boost_holder(mutex_t *m, thread_t *current_thread)
+{
+	thread_t *holder = m->holder;
+
+	/* the holder may have taken the fast path and not published itself yet */
+	if (!holder)
+		return;
+
+	spin_lock(&thread_lock);
+	mutex_set_held_by(m, holder);
+	if (current_thread->priority > holder->priority)
+		thread_set_inherited_priority_locked(holder, MAX(holder->inherited_priority, current_thread->priority));
+	spin_unlock(&thread_lock);
+}
+
+/* m is no longer contested by the current holder, drop what it inherited through it */
+static void mutex_unboost(mutex_t *m, thread_t *holder)
+{
+	spin_lock(&thread_lock);
+	/* a newer holder may have taken m over already, then it's not ours to drop */
+	if (m->held_by == holder) {
+		list_delete(&m->held_node);
+		m->held_by = NULL;
+		mutex_update_inherited_priority(holder);
+	}
+	spin_unlock(&thread_lock);
+}
+
 /**
  * @brief  Initialize a mutex_t
  */
@@ -60,11 +182,13 @@ void mutex_destroy(mutex_t *m)
 		      get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
 #endif
 
-	THREAD_LOCK(state);
+	WAIT_QUEUE_LOCK(&m->wait, state);
+	if (m->held_by)
+		mutex_unboost(m, m->held_by);
 	m->magic = 0;
-	m->count = 0;
+	m->val = MUTEX_UNLOCKED;
 	wait_queue_destroy(&m->wait, true);
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&m->wait, state);
 }
 
 /**
@@ -87,33 +211,77 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
 		      get_current_thread(), get_current_thread()->name, m);
 #endif
 
-	THREAD_LOCK(state);
-
-	status_t ret = NO_ERROR;
-	if (unlikely(++m->count > 1)) {
-		ret = wait_queue_block(&m->wait, timeout);
-		if (unlikely(ret < NO_ERROR)) {
-			/* if the acquisition timed out, back out the acquire and exit */
-			if (likely(ret == ERR_TIMED_OUT)) {
-				/*
-				 * race: the mutex may have been destroyed after the timeout,
-				 * but before we got scheduled again which makes messing with the
-				 * count variable dangerous.
-				 */
-				m->count--;
+	if (likely(mutex_trylock_fast(m))) {
+		LOCKSTAT_RECORD(m, LOCKSTAT_MUTEX, false, 0);
+		goto done;
+	}
+
+	if (timeout == 0)
+		return ERR_TIMED_OUT;
+
+#if WITH_LOCK_STATS
+	lk_bigtime_t wait_start = current_time_hires();
+#endif
+
+#if WITH_SMP
+	if (mutex_spin(m))
+		goto contended_done;
+#endif
+
+	lk_time_t start = current_time();
+	thread_t *current_thread = get_current_thread();
+	status_t ret;
+
+	WAIT_QUEUE_LOCK(&m->wait, state);
+
+	/*
+	 * mark the mutex contested before sleeping so the holder's release takes the
+	 * slow path and wakes us. if it turns out to be free we own it, but leave it
+	 * marked since other threads may still be waiting behind us.
+	 */
+	while (__atomic_exchange_n(&m->val, MUTEX_CONTESTED, __ATOMIC_ACQUIRE) != MUTEX_UNLOCKED) {
+		lk_time_t remaining = INFINITE_TIME;
+		if (timeout != INFINITE_TIME) {
+			lk_time_t elapsed = current_time() - start;
+			remaining = (elapsed < timeout) ? timeout - elapsed : 0;
+		}
+
+		mutex_boost_holder(m, current_thread);
+
+		ret = wait_queue_block(&m->wait, remaining);
+		if (unlikely(ret == ERR_OBJECT_DESTROYED)) {
+			/* destroyed out from underneath us, and maybe freed already */
+			WAIT_QUEUE_RESTORE(state);
+			return ret;
+		} else if (unlikely(ret < NO_ERROR)) {
+			/* timed out */
+			if (m->holder) {
+				/* the holder no longer needs our priority */
+				spin_lock(&thread_lock);
+				mutex_update_inherited_priority(m->holder);
+				spin_unlock(&thread_lock);
 			}
-			/* if there was a general error, it may have been destroyed out from
-			 * underneath us, so just exit (which is really an invalid state anyway)
-			 */
-			goto err;
+			WAIT_QUEUE_UNLOCK(&m->wait, state);
+			return ret;
 		}
 	}
 
-	m->holder = get_current_thread();
+	/* inherit from whoever is still queued up behind us */
+	m->holder = current_thread;
+	if (m->wait.count > 0) {
+		spin_lock(&thread_lock);
+		mutex_set_held_by(m, current_thread);
+		mutex_update_inherited_priority(current_thread);
+		spin_unlock(&thread_lock);
+	}
 
-err:
-	THREAD_UNLOCK(state);
-	return ret;
+	WAIT_QUEUE_UNLOCK(&m->wait, state);
+
+contended_done:
+	LOCKSTAT_RECORD(m, LOCKSTAT_MUTEX, true, current_time_hires() - wait_start);
+done:
+	m->holder = get_current_thread();
+	return NO_ERROR;
 }
 
 /**
@@ -130,16 +298,18 @@ status_t mutex_release(mutex_t *m)
 	}
 #endif
 
-	THREAD_LOCK(state);
-
+	thread_t *current_thread = get_current_thread();
 	m->holder = 0;
 
-	if (unlikely(--m->count >= 1)) {
-		/* release a thread */
-		wait_queue_wake_one(&m->wait, true, NO_ERROR);
-	}
+	if (likely(__atomic_exchange_n(&m->val, MUTEX_UNLOCKED, __ATOMIC_RELEASE) == MUTEX_LOCKED))
+		return NO_ERROR;
+
+	/* release a thread */
+	WAIT_QUEUE_LOCK(&m->wait, state);
+	mutex_unboost(m, current_thread);
+	wait_queue_wake_one(&m->wait, true, NO_ERROR);
+	WAIT_QUEUE_UNLOCK(&m->wait, state);
 
-	THREAD_UNLOCK(state);
 	return NO_ERROR;
 }
 
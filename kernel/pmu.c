@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/pmu.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <arch/pmu.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+#define PMU_ALL_CPUS MP_CPU_MASK_ALL
+
+/* counter values at each cpu's last context switch */
+struct pmu_cpu {
+	uint64_t last[PMU_MAX_COUNTERS];
+} __CPU_ALIGN;
+
+static struct pmu_cpu pmu_cpus[SMP_MAX_CPUS];
+
+/* protects the configuration, the scheduler only looks at pmu_active */
+static mutex_t pmu_lock = MUTEX_INITIAL_VALUE(pmu_lock);
+static uint pmu_events[PMU_MAX_COUNTERS];
+static uint pmu_event_count;
+static volatile uint pmu_active;
+static uint64_t pmu_mask;
+static volatile int pmu_program_err;
+
+static const char *pmu_event_names[PMU_EVENT_COUNT] = {
+	[PMU_EVENT_CYCLES] = "cycles",
+	[PMU_EVENT_INSTRUCTIONS] = "instructions",
+	[PMU_EVENT_CACHE_MISSES] = "cache-misses",
+	[PMU_EVENT_BRANCH_MISSES] = "branch-misses",
+	[PMU_EVENT_ICACHE_MISSES] = "icache-misses",
+};
+
+/* arches with a pmu override these */
+__WEAK uint arch_pmu_counter_count(void)
+{
+	return 0;
+}
+
+__WEAK uint64_t arch_pmu_counter_mask(void)
+{
+	return 0;
+}
+
+__WEAK bool arch_pmu_event_supported(uint event)
+{
+	return false;
+}
+
+__WEAK status_t arch_pmu_program(uint n, uint event)
+{
+	return ERR_NOT_SUPPORTED;
+}
+
+__WEAK void arch_pmu_disable(void)
+{
+}
+
+__WEAK uint64_t arch_pmu_read(uint n)
+{
+	return 0;
+}
+
+const char *pmu_event_name(uint event)
+{
+	return (event < PMU_EVENT_COUNT) ? pmu_event_names[event] : "unknown";
+}
+
+static void pmu_program_cpu(void *arg)
+{
+	struct pmu_cpu *c = &pmu_cpus[arch_curr_cpu_num()];
+
+	arch_pmu_disable();
+	for (uint i = 0; i < pmu_event_count; i++) {
+		status_t err = arch_pmu_program(i, pmu_events[i]);
+		if (err < 0)
+			pmu_program_err = err;
+		c->last[i] = arch_pmu_read(i);
+	}
+}
+
+static void pmu_zero_thread(thread_t *t, void *arg)
+{
+	memset(t->pmu_count, 0, sizeof(t->pmu_count));
+}
+
+status_t pmu_configure(const uint *events, uint count)
+{
+	if (count > PMU_MAX_COUNTERS || count > arch_pmu_counter_count())
+		return ERR_NOT_SUPPORTED;
+
+	for (uint i = 0; i < count; i++) {
+		if (events[i] >= PMU_EVENT_COUNT)
+			return ERR_INVALID_ARGS;
+	}
+
+	mutex_acquire(&pmu_lock);
+
+	/* stop the scheduler from accumulating while things change under it */
+	pmu_active = 0;
+	smp_mb();
+
+	memcpy(pmu_events, events, count * sizeof(uint));
+	pmu_event_count = count;
+	pmu_mask = arch_pmu_counter_mask();
+	pmu_program_err = NO_ERROR;
+	mp_sync_exec(PMU_ALL_CPUS, &pmu_program_cpu, NULL);
+
+	status_t err = pmu_program_err;
+	if (err < 0) {
+		pmu_event_count = 0;
+		mp_sync_exec(PMU_ALL_CPUS, &pmu_program_cpu, NULL);
+	} else {
+		thread_for_each(&pmu_zero_thread, NULL);
+		pmu_active = count;
+	}
+
+	LTRACEF("%u events, err %d\n", count, err);
+
+	mutex_release(&pmu_lock);
+
+	return err;
+}
+
+uint pmu_get_config(uint *events)
+{
+	mutex_acquire(&pmu_lock);
+
+	uint count = pmu_active;
+	if (events)
+		memcpy(events, pmu_events, count * sizeof(uint));
+
+	mutex_release(&pmu_lock);
+
+	return count;
+}
+
+void pmu_context_switch(thread_t *oldthread, thread_t *newthread)
+{
+	uint count = pmu_active;
+	struct pmu_cpu *c = &pmu_cpus[arch_curr_cpu_num()];
+
+	for (uint i = 0; i < count; i++) {
+		uint64_t v = arch_pmu_read(i);
+
+		oldthread->pmu_count[i] += (v - c->last[i]) & pmu_mask;
+		c->last[i] = v;
+	}
+}
+
+uint pmu_read(uint64_t *counts)
+{
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	/* what has ticked since we were switched in hasn't been folded in yet */
+	thread_t *t = get_current_thread();
+	const struct pmu_cpu *c = &pmu_cpus[arch_curr_cpu_num()];
+	uint count = pmu_active;
+	for (uint i = 0; i < count; i++)
+		counts[i] = t->pmu_count[i] + ((arch_pmu_read(i) - c->last[i]) & pmu_mask);
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	return count;
+}
+
+struct pmu_read_thread_args {
+	uint64_t *counts;
+	uint count;
+};
+
+/* its counts only change as it's switched out, with its scheduling state locked */
+static void pmu_read_thread_cb(thread_t *t, void *arg)
+{
+	struct pmu_read_thread_args *args = arg;
+
+	args->count = pmu_active;
+	memcpy(args->counts, t->pmu_count, args->count * sizeof(uint64_t));
+}
+
+uint pmu_read_thread(thread_t *t, uint64_t *counts)
+{
+	if (t == get_current_thread())
+		return pmu_read(counts);
+
+	struct pmu_read_thread_args args = { counts, 0 };
+	thread_snapshot(t, pmu_read_thread_cb, &args);
+
+	return args.count;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_pmu(int argc, const cmd_args *argv)
+{
+	if (argc < 2) {
+		uint events[PMU_MAX_COUNTERS];
+		uint count = pmu_get_config(events);
+
+		printf("%u hardware counters, counting:", arch_pmu_counter_count());
+		for (uint i = 0; i < count; i++)
+			printf(" %s", pmu_event_name(events[i]));
+		printf("%s\n", count ? "" : " nothing");
+		printf("usage:\n");
+		printf("%s on [event...] : count events on every cpu, default all the supported ones. events:", argv[0].str);
+		for (uint i = 0; i < PMU_EVENT_COUNT; i++)
+			printf(" %s", pmu_event_name(i));
+		printf("\n");
+		printf("%s off           : stop counting\n", argv[0].str);
+		printf("per thread counts are shown by threadstats\n");
+		return NO_ERROR;
+	}
+
+	uint events[PMU_MAX_COUNTERS];
+	uint count = 0;
+	if (!strcmp(argv[1].str, "on")) {
+		if (argc == 2) {
+			for (uint i = 0; i < PMU_EVENT_COUNT && count < MIN(arch_pmu_counter_count(), PMU_MAX_COUNTERS); i++) {
+				if (arch_pmu_event_supported(i))
+					events[count++] = i;
+			}
+		}
+		for (int i = 2; i < argc; i++) {
+			uint e;
+			for (e = 0; e < PMU_EVENT_COUNT; e++) {
+				if (!strcmp(argv[i].str, pmu_event_name(e)))
+					break;
+			}
+			if (e == PMU_EVENT_COUNT || count == PMU_MAX_COUNTERS) {
+				printf("bad or too many events\n");
+				return ERR_INVALID_ARGS;
+			}
+			events[count++] = e;
+		}
+	} else if (strcmp(argv[1].str, "off")) {
+		printf("unknown subcommand\n");
+		return ERR_INVALID_ARGS;
+	}
+
+	status_t err = pmu_configure(events, count);
+	if (err < 0)
+		printf("error %d configuring counters\n", err);
+
+	return err;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("pmu", "configure the hardware performance counters", &cmd_pmu)
+STATIC_COMMAND_END(pmu);
+
+#endif
+
+// vim: set noexpandtab:
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/poll.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <trace.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/* one object being watched by one poller */
+struct poll_entry {
+	struct poll_entry *next; /* the object's list, under its wait queue lock */
+	wait_queue_t *wait; /* NULL once the object is destroyed */
+	poller_t *poller;
+	void *cookie;
+	uint events;
+
+	/* under the poller's lock */
+	struct list_node ready_node;
+	uint pending;
+	bool queued;
+};
+
+void poller_init(poller_t *p)
+{
+	*p = (poller_t)POLLER_INITIAL_VALUE(*p);
+}
+
+/* poller lock held */
+static void poll_entry_queue(poller_t *p, struct poll_entry *pe, uint events)
+{
+	pe->pending |= events;
+	if (!pe->queued) {
+		pe->queued = true;
+		list_add_tail(&p->ready, &pe->ready_node);
+		wait_queue_wake_one(&p->wait, false, NO_ERROR);
+	}
+}
+
+void wait_queue_poll_notify(wait_queue_t *wait)
+{
+	DEBUG_ASSERT(spin_lock_held(&wait->lock));
+
+	for (struct poll_entry *pe = wait->pollers; pe; pe = pe->next) {
+		poller_t *p = pe->poller;
+
+		LTRACEF("wait %p poller %p cookie %p\n", wait, p, pe->cookie);
+
+		spin_lock(&p->wait.lock);
+		poll_entry_queue(p, pe, pe->events);
+		spin_unlock(&p->wait.lock);
+	}
+}
+
+void wait_queue_poll_detach(wait_queue_t *wait)
+{
+	DEBUG_ASSERT(spin_lock_held(&wait->lock));
+
+	/* hand the entries over to their pollers, which free them once reported */
+	struct poll_entry *pe = wait->pollers;
+	while (pe) {
+		struct poll_entry *next = pe->next;
+		poller_t *p = pe->poller;
+
+		spin_lock(&p->wait.lock);
+		pe->wait = NULL;
+		pe->next = NULL;
+		p->attached--;
+		poll_entry_queue(p, pe, pe->events | POLL_HUP);
+		spin_unlock(&p->wait.lock);
+
+		pe = next;
+	}
+	wait->pollers = NULL;
+}
+
+/*
+ * sem_post and event_signal change the object's state without the wait queue
+ * lock when they can, then look for pollers. So once attached, a fence, and
+ * only then is the state looked at with poller_add_ready. One side or the
+ * other sees the change.
+ */
+static status_t poller_add(poller_t *p, wait_queue_t *wait, struct poll_entry *pe)
+{
+	DEBUG_ASSERT(spin_lock_held(&wait->lock));
+
+	for (struct poll_entry *e = wait->pollers; e; e = e->next) {
+		if (e->poller == p)
+			return ERR_ALREADY_EXISTS;
+	}
+
+	pe->wait = wait;
+	pe->poller = p;
+	pe->next = wait->pollers;
+	__atomic_store_n(&wait->pollers, pe, __ATOMIC_RELAXED);
+
+	spin_lock(&p->wait.lock);
+	p->attached++;
+	spin_unlock(&p->wait.lock);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return NO_ERROR;
+}
+
+static void poller_add_ready(poller_t *p, struct poll_entry *pe)
+{
+	spin_lock(&p->wait.lock);
+	poll_entry_queue(p, pe, pe->events);
+	spin_unlock(&p->wait.lock);
+}
+
+static struct poll_entry *poller_remove(poller_t *p, wait_queue_t *wait)
+{
+	DEBUG_ASSERT(spin_lock_held(&wait->lock));
+
+	for (struct poll_entry **prev = &wait->pollers; *prev; prev = &(*prev)->next) {
+		struct poll_entry *pe = *prev;
+		if (pe->poller != p)
+			continue;
+
+		*prev = pe->next;
+
+		spin_lock(&p->wait.lock);
+		if (pe->queued)
+			list_delete(&pe->ready_node);
+		p->attached--;
+		spin_unlock(&p->wait.lock);
+
+		return pe;
+	}
+
+	return NULL;
+}
+
+static struct poll_entry *poll_entry_alloc(uint events, void *cookie)
+{
+	struct poll_entry *pe = calloc(1, sizeof(struct poll_entry));
+	if (pe) {
+		pe->events = events;
+		pe->cookie = cookie;
+	}
+	return pe;
+}
+
+status_t poller_add_event(poller_t *p, event_t *e, uint events, void *cookie)
+{
+	DEBUG_ASSERT(p->magic == POLLER_MAGIC);
+	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
+
+	struct poll_entry *pe = poll_entry_alloc(events, cookie);
+	if (!pe)
+		return ERR_NO_MEMORY;
+
+	WAIT_QUEUE_LOCK(&e->wait, state);
+	status_t err = poller_add(p, &e->wait, pe);
+	if (err >= 0 && event_is_signalled(e))
+		poller_add_ready(p, pe);
+	WAIT_QUEUE_UNLOCK(&e->wait, state);
+
+	if (err < 0)
+		free(pe);
+	return err;
+}
+
+status_t poller_add_sem(poller_t *p, semaphore_t *sem, uint events, void *cookie)
+{
+	DEBUG_ASSERT(p->magic == POLLER_MAGIC);
+	DEBUG_ASSERT(sem->magic == SEMAPHORE_MAGIC);
+
+	struct poll_entry *pe = poll_entry_alloc(events, cookie);
+	if (!pe)
+		return ERR_NO_MEMORY;
+
+	WAIT_QUEUE_LOCK(&sem->wait, state);
+	status_t err = poller_add(p, &sem->wait, pe);
+	if (err >= 0 && __atomic_load_n(&sem->count, __ATOMIC_RELAXED) > 0)
+		poller_add_ready(p, pe);
+	WAIT_QUEUE_UNLOCK(&sem->wait, state);
+
+	if (err < 0)
+		free(pe);
+	return err;
+}
+
+status_t poller_remove_event(poller_t *p, event_t *e)
+{
+	DEBUG_ASSERT(p->magic == POLLER_MAGIC);
+
+	WAIT_QUEUE_LOCK(&e->wait, state);
+	struct poll_entry *pe = poller_remove(p, &e->wait);
+	WAIT_QUEUE_UNLOCK(&e->wait, state);
+
+	if (!pe)
+		return ERR_NOT_FOUND;
+	free(pe);
+	return NO_ERROR;
+}
+
+status_t poller_remove_sem(poller_t *p, semaphore_t *sem)
+{
+	DEBUG_ASSERT(p->magic == POLLER_MAGIC);
+
+	WAIT_QUEUE_LOCK(&sem->wait, state);
+	struct poll_entry *pe = poller_remove(p, &sem->wait);
+	WAIT_QUEUE_UNLOCK(&sem->wait, state);
+
+	if (!pe)
+		return ERR_NOT_FOUND;
+	free(pe);
+	return NO_ERROR;
+}
+
+int poller_wait(poller_t *p, poll_result_t *results, uint max, lk_time_t timeout)
+{
+	DEBUG_ASSERT(p->magic == POLLER_MAGIC);
+	DEBUG_ASSERT(max > 0);
+
+	struct list_node detached = LIST_INITIAL_VALUE(detached);
+	int count = 0;
+
+	WAIT_QUEUE_LOCK(&p->wait, state);
+
+	/* another thread waiting on the poller may have taken what we were woken for */
+	while (list_is_empty(&p->ready)) {
+		status_t err = wait_queue_block(&p->wait, timeout);
+		if (err == ERR_OBJECT_DESTROYED) {
+			WAIT_QUEUE_RESTORE(state);
+			return err;
+		} else if (err < 0) {
+			WAIT_QUEUE_UNLOCK(&p->wait, state);
+			return err;
+		}
+	}
+
+	struct poll_entry *pe;
+	while (count < (int)max && (pe = list_remove_head_type(&p->ready, struct poll_entry, ready_node))) {
+		results[count].cookie = pe->cookie;
+		results[count].events = pe->pending;
+		count++;
+
+		pe->pending = 0;
+		pe->queued = false;
+
+		/* nothing else can see it once its object is gone */
+		if (!pe->wait)
+			list_add_tail(&detached, &pe->ready_node);
+	}
+
+	WAIT_QUEUE_UNLOCK(&p->wait, state);
+
+	while ((pe = list_remove_head_type(&detached, struct poll_entry, ready_node)))
+		free(pe);
+
+	return count;
+}
+
+status_t poller_destroy(poller_t *p)
+{
+	DEBUG_ASSERT(p->magic == POLLER_MAGIC);
+
+	struct list_node detached = LIST_INITIAL_VALUE(detached);
+
+	WAIT_QUEUE_LOCK(&p->wait, state);
+
+	if (p->attached > 0) {
+		WAIT_QUEUE_UNLOCK(&p->wait, state);
+		return ERR_BUSY;
+	}
+
+	/* only entries for destroyed objects can be left, waiting to be reported */
+	struct poll_entry *pe;
+	while ((pe = list_remove_head_type(&p->ready, struct poll_entry, ready_node)))
+		list_add_tail(&detached, &pe->ready_node);
+
+	p->magic = 0;
+	wait_queue_destroy(&p->wait, true);
+
+	WAIT_QUEUE_UNLOCK(&p->wait, state);
+
+	while ((pe = list_remove_head_type(&detached, struct poll_entry, ready_node)))
+		free(pe);
+
+	return NO_ERROR;
+}
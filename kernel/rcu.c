@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/rcu.h>
+#include <debug.h>
+#include <assert.h>
+#include <list.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <lib/dpc.h>
+
+/* how often to check a grace period in progress, and how late the check may run */
+#define RCU_POLL_US 1000
+#define RCU_POLL_SLACK_US 1000
+
+struct rcu_cpu_state rcu_cpu_state[SMP_MAX_CPUS];
+
+static spin_lock_t rcu_lock = SPIN_LOCK_INITIAL_VALUE;
+
+/* callbacks queued since the current grace period started */
+static struct list_node rcu_pending = LIST_INITIAL_VALUE(rcu_pending);
+
+/* callbacks waiting on the current grace period */
+static struct list_node rcu_waiting = LIST_INITIAL_VALUE(rcu_waiting);
+
+/* callbacks whose grace period has elapsed, run by the dpc */
+static struct list_node rcu_done = LIST_INITIAL_VALUE(rcu_done);
+
+static bool rcu_gp_active;
+static mp_cpu_mask_t rcu_gp_cpus; /* cpus yet to pass a quiescent state */
+static ulong rcu_gp_snapshot[SMP_MAX_CPUS];
+
+static timer_t rcu_timer = TIMER_INITIAL_VALUE(rcu_timer);
+static dpc_t rcu_dpc = DPC_INITIAL_VALUE;
+
+static enum handler_return rcu_timer_callback(struct timer *t, lk_time_t now, void *arg);
+
+static void rcu_list_move(struct list_node *dest, struct list_node *src)
+{
+	struct list_node *node;
+
+	while ((node = list_remove_head(src)) != NULL)
+		list_add_tail(dest, node);
+}
+
+/* rcu_lock held */
+static void rcu_start_gp(void)
+{
+	DEBUG_ASSERT(!rcu_gp_active);
+
+	rcu_list_move(&rcu_waiting, &rcu_pending);
+
+	rcu_gp_cpus = mp.active_cpus;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		rcu_gp_snapshot[i] = rcu_cpu_state[i].switches;
+
+	rcu_gp_active = true;
+}
+
+static void rcu_arm_timer(void)
+{
+	timer_set_slack(&rcu_timer, RCU_POLL_SLACK_US);
+	timer_set_oneshot_hires(&rcu_timer, RCU_POLL_US, rcu_timer_callback, NULL);
+}
+
+static void rcu_dpc_callback(void *arg)
+{
+	for (;;) {
+		spin_lock_saved_state_t state;
+		spin_lock_irqsave(&rcu_lock, state);
+		struct rcu_head *head = list_remove_head_type(&rcu_done, struct rcu_head, node);
+		spin_unlock_irqrestore(&rcu_lock, state);
+
+		if (!head)
+			break;
+
+		head->func(head);
+	}
+}
+
+/* rcu_lock held, returns the cpus still inside the grace period */
+static mp_cpu_mask_t rcu_check_gp(void)
+{
+	uint local_cpu = arch_curr_cpu_num();
+	mp_cpu_mask_t idle = mp_get_idle_mask();
+
+	rcu_gp_cpus &= mp.active_cpus;
+
+	/* pairs with the fence in rcu_read_lock */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		mp_cpu_mask_t bit = 1U << i;
+
+		if ((rcu_gp_cpus & bit) == 0)
+			continue;
+
+		if (rcu_cpu_state[i].switches != rcu_gp_snapshot[i]) {
+			rcu_gp_cpus &= ~bit;
+		} else if (((idle & bit) || i == local_cpu) && rcu_cpu_state[i].readers == 0) {
+			/*
+			 * an idle cpu, or the thread we interrupted, is quiescent unless it
+			 * is reading, an interrupt handler on an idle cpu included
+			 */
+			rcu_gp_cpus &= ~bit;
+		}
+	}
+
+	return rcu_gp_cpus;
+}
+
+static enum handler_return rcu_timer_callback(struct timer *t, lk_time_t now, void *arg)
+{
+	bool queue_dpc = false;
+	bool rearm = true;
+	mp_cpu_mask_t lagging;
+
+	spin_lock(&rcu_lock);
+
+	DEBUG_ASSERT(rcu_gp_active);
+
+	lagging = rcu_check_gp();
+	if (lagging == 0) {
+		rcu_list_move(&rcu_done, &rcu_waiting);
+		rcu_gp_active = false;
+		queue_dpc = true;
+
+		/* callbacks arrived meanwhile, go again */
+		if (!list_is_empty(&rcu_pending)) {
+			rcu_start_gp();
+			lagging = rcu_check_gp();
+		} else {
+			rearm = false;
+		}
+	}
+
+	spin_unlock(&rcu_lock);
+
+	/* kick busy cpus that have not rescheduled on their own */
+	if (lagging)
+		mp_reschedule(lagging, MP_RESCHEDULE_FLAG_REALTIME);
+
+	if (rearm)
+		rcu_arm_timer();
+
+	if (queue_dpc) {
+		dpc_queue_etc(&rcu_dpc, rcu_dpc_callback, NULL, DPC_FLAG_NORESCHED);
+		return INT_RESCHEDULE;
+	}
+
+	return INT_NO_RESCHEDULE;
+}
+
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+	bool start;
+
+	head->func = func;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&rcu_lock, state);
+
+	list_add_tail(&rcu_pending, &head->node);
+
+	start = !rcu_gp_active;
+	if (start)
+		rcu_start_gp();
+
+	spin_unlock_irqrestore(&rcu_lock, state);
+
+	/* only the thread that starts a grace period arms the timer, the callback rearms it after */
+	if (start)
+		rcu_arm_timer();
+}
+
+struct rcu_sync {
+	struct rcu_head head;
+	event_t done;
+};
+
+static void rcu_sync_callback(struct rcu_head *head)
+{
+	struct rcu_sync *sync = containerof(head, struct rcu_sync, head);
+
+	event_signal(&sync->done, false);
+}
+
+void synchronize_rcu(void)
+{
+	struct rcu_sync sync;
+
+	DEBUG_ASSERT(get_current_thread()->preempt_disable_count == 0);
+
+	event_init(&sync.done, false, 0);
+	call_rcu(&sync.head, rcu_sync_callback);
+	event_wait(&sync.done);
+	event_destroy(&sync.done);
+}
+
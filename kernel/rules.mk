@@ -5,13 +5,20 @@ MODULE := $(LOCAL_DIR)
 MODULE_DEPS := \
 	lib/libc \
 	lib/debug \
-	lib/heap
+	lib/dpc \
+	lib/heap \
+	lib/slab
 
 MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
 	$(LOCAL_DIR)/init.c \
 	$(LOCAL_DIR)/mutex.c \
+	$(LOCAL_DIR)/poll.c \
+	$(LOCAL_DIR)/rcu.c \
+	$(LOCAL_DIR)/rwlock.c \
+	$(LOCAL_DIR)/shrinker.c \
+	$(LOCAL_DIR)/static_key.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
@@ -21,4 +28,55 @@ ifeq ($(WITH_KERNEL_VM),1)
 MODULE_DEPS += kernel/vm
 endif
 
+# keep LTRACEF and friends compiled in where LOCAL_TRACE is 0, behind a static
+# key per file named after it, for 'statickey on <file>'. costs the strings.
+ifeq ($(WITH_LTRACE_KEYS),1)
+GLOBAL_DEFINES += WITH_LTRACE_KEYS=1
+endif
+
+# lock contention profiling, see the lockstat console command
+ifeq ($(WITH_LOCK_STATS),1)
+GLOBAL_DEFINES += WITH_LOCK_STATS=1
+MODULE_SRCS += $(LOCAL_DIR)/lockstat.c
+endif
+
+# per vector interrupt counts and handler time, see the irqstats console command
+ifeq ($(WITH_IRQ_STATS),1)
+GLOBAL_DEFINES += WITH_IRQ_STATS=1
+MODULE_SRCS += $(LOCAL_DIR)/irqstats.c
+endif
+
+# per thread hardware performance counters, see kernel/pmu.h and the pmu console command
+ifeq ($(WITH_KERNEL_PMU),1)
+GLOBAL_DEFINES += WITH_KERNEL_PMU=1
+MODULE_SRCS += $(LOCAL_DIR)/pmu.c
+endif
+
+# idle state selection, see kernel/cpuidle.h and the cpuidle console command
+ifeq ($(WITH_KERNEL_CPUIDLE),1)
+GLOBAL_DEFINES += WITH_KERNEL_CPUIDLE=1
+MODULE_SRCS += $(LOCAL_DIR)/cpuidle.c
+endif
+
+# frequency scaling governors, see kernel/cpufreq.h and the cpufreq console command
+ifeq ($(WITH_KERNEL_CPUFREQ),1)
+GLOBAL_DEFINES += WITH_KERNEL_CPUFREQ=1
+MODULE_SRCS += $(LOCAL_DIR)/cpufreq.c
+endif
+
+# per cpu event trace rings, see the kevlog console command and scripts/kevlog2trace.py
+ifeq ($(WITH_KERNEL_EVLOG),1)
+GLOBAL_DEFINES += WITH_KERNEL_EVLOG=1
+endif
+
+# backend for the per cpu timer queues:
+# heap - pairing heap, O(log n) insert and cancel
+# list - sorted linked list, O(n) insert
+KERNEL_TIMER_QUEUE ?= heap
+ifeq ($(KERNEL_TIMER_QUEUE),heap)
+GLOBAL_DEFINES += KERNEL_TIMER_HEAP=1
+else ifneq ($(KERNEL_TIMER_QUEUE),list)
+$(error KERNEL_TIMER_QUEUE must be heap or list)
+endif
+
 include make/module.mk
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Reader-writer lock functions
+ *
+ * @defgroup rwlock Reader-writer lock
+ * @{
+ */
+
+#include <kernel/rwlock.h>
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <kernel/thread.h>
+
+/*
+ * The lock word and waiter counts are protected by rw->lock. A thread about to
+ * block takes the wait queue's lock before dropping rw->lock, so a releasing
+ * thread, which only wakes after dropping rw->lock, always finds it queued.
+ */
+
+/**
+ * @brief  Initialize a rwlock_t
+ */
+void rwlock_init(rwlock_t *rw)
+{
+	*rw = (rwlock_t)RWLOCK_INITIAL_VALUE(*rw);
+}
+
+/**
+ * @brief  Destroy a rwlock_t
+ *
+ * The caller must make sure no thread holds or is waiting on the lock. The
+ * rwlock_t object itself is not freed.
+ */
+void rwlock_destroy(rwlock_t *rw)
+{
+	DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&rw->lock, state);
+	rw->magic = 0;
+	rw->count = 0;
+	rw->readers_waiting = rw->writers_waiting = 0;
+
+	spin_lock(&rw->read_wait.lock);
+	wait_queue_destroy(&rw->read_wait, false);
+	spin_unlock(&rw->read_wait.lock);
+
+	spin_lock(&rw->write_wait.lock);
+	wait_queue_destroy(&rw->write_wait, false);
+	spin_unlock(&rw->write_wait.lock);
+
+	spin_unlock_irqrestore(&rw->lock, state);
+}
+
+/* drop rw->lock and sleep on wait until a releasing thread hands us the lock */
+static void rwlock_block(rwlock_t *rw, wait_queue_t *wait, spin_lock_saved_state_t state)
+{
+	spin_lock(&wait->lock);
+	spin_unlock(&rw->lock);
+
+	if (wait_queue_block(wait, INFINITE_TIME) == ERR_OBJECT_DESTROYED) {
+		WAIT_QUEUE_RESTORE(state);
+		return;
+	}
+
+	spin_unlock_irqrestore(&wait->lock, state);
+}
+
+/*
+ * The lock just became free, hand it to the next writer or else to every
+ * waiting reader. Called with rw->lock held, which it drops before waking.
+ */
+static void rwlock_hand_off(rwlock_t *rw, spin_lock_saved_state_t state)
+{
+	DEBUG_ASSERT(rw->count == 0);
+
+	if (rw->writers_waiting > 0) {
+		rw->writers_waiting--;
+		rw->count = -1;
+		spin_unlock(&rw->lock);
+
+		spin_lock(&rw->write_wait.lock);
+		wait_queue_wake_one(&rw->write_wait, true, NO_ERROR);
+		spin_unlock_irqrestore(&rw->write_wait.lock, state);
+	} else if (rw->readers_waiting > 0) {
+		uint readers = rw->readers_waiting;
+
+		rw->readers_waiting = 0;
+		rw->count = readers;
+		spin_unlock(&rw->lock);
+
+		/*
+		 * wake exactly as many readers as were counted above. anyone who
+		 * queued up since then is waiting on a writer, and which of them
+		 * gets let in is up to the wait queue's priority order.
+		 */
+		spin_lock(&rw->read_wait.lock);
+		wait_queue_wake_n(&rw->read_wait, readers, true, NO_ERROR);
+		spin_unlock_irqrestore(&rw->read_wait.lock, state);
+	} else {
+		spin_unlock_irqrestore(&rw->lock, state);
+	}
+}
+
+/**
+ * @brief  Acquire the lock for reading
+ *
+ * Blocks while a writer holds the lock or is waiting for it.
+ */
+void rwlock_acquire_read(rwlock_t *rw)
+{
+	DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+	if (unlikely(is_rwlock_write_held(rw)))
+		panic("rwlock_acquire_read: thread %p (%s) tried to read lock %p it holds for write.\n",
+		      get_current_thread(), get_current_thread()->name, rw);
+#endif
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&rw->lock, state);
+
+	if (likely(rw->count >= 0 && rw->writers_waiting == 0)) {
+		rw->count++;
+		spin_unlock_irqrestore(&rw->lock, state);
+		return;
+	}
+
+	rw->readers_waiting++;
+	rwlock_block(rw, &rw->read_wait, state);
+}
+
+/**
+ * @brief  Release a read lock
+ */
+void rwlock_release_read(rwlock_t *rw)
+{
+	DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&rw->lock, state);
+
+	DEBUG_ASSERT(rw->count > 0);
+
+	if (--rw->count == 0) {
+		rwlock_hand_off(rw, state);
+		return;
+	}
+
+	spin_unlock_irqrestore(&rw->lock, state);
+}
+
+/**
+ * @brief  Acquire the lock for writing
+ *
+ * Blocks until there are no readers or other writers.
+ */
+void rwlock_acquire_write(rwlock_t *rw)
+{
+	DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+	if (unlikely(is_rwlock_write_held(rw)))
+		panic("rwlock_acquire_write: thread %p (%s) tried to acquire lock %p it already owns.\n",
+		      get_current_thread(), get_current_thread()->name, rw);
+#endif
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&rw->lock, state);
+
+	if (likely(rw->count == 0)) {
+		rw->count = -1;
+		spin_unlock_irqrestore(&rw->lock, state);
+	} else {
+		rw->writers_waiting++;
+		rwlock_block(rw, &rw->write_wait, state);
+	}
+
+	rw->writer = get_current_thread();
+}
+
+/**
+ * @brief  Release a write lock
+ */
+void rwlock_release_write(rwlock_t *rw)
+{
+	DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+	if (unlikely(!is_rwlock_write_held(rw)))
+		panic("rwlock_release_write: thread %p (%s) tried to release lock %p it doesn't own. owned by %p\n",
+		      get_current_thread(), get_current_thread()->name, rw, rw->writer);
+#endif
+
+	rw->writer = NULL;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&rw->lock, state);
+
+	DEBUG_ASSERT(rw->count == -1);
+	rw->count = 0;
+
+	rwlock_hand_off(rw, state);
+}
+
@@ -16,9 +16,40 @@
 
 #include <debug.h>
 #include <err.h>
+#include <kernel/poll.h>
 #include <kernel/semaphore.h>
 #include <kernel/thread.h>
 
+/*
+ * count is the number of resources available, or minus the number of threads
+ * waiting for one. It only goes negative with the wait queue lock held, so
+ * taking a resource while it's positive, or adding one while no one is
+ * waiting, is a single compare and swap that never touches the lock.
+ */
+static inline bool sem_trydown_fast(semaphore_t *sem)
+{
+	int count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, true,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+static inline bool sem_up_fast(semaphore_t *sem)
+{
+	int count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+	while (count >= 0) {
+		if (__atomic_compare_exchange_n(&sem->count, &count, count + 1, true,
+		                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
 void sem_init(semaphore_t *sem, unsigned int value)
 {
 	*sem = (semaphore_t)SEMAPHORE_INITIAL_VALUE(*sem, value);
@@ -26,26 +57,39 @@ void sem_init(semaphore_t *sem, unsigned int value)
 
 void sem_destroy(semaphore_t *sem)
 {
-	THREAD_LOCK(state);
+	WAIT_QUEUE_LOCK(&sem->wait, state);
 	sem->count = 0;
 	wait_queue_destroy(&sem->wait, true);
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&sem->wait, state);
 }
 
 int sem_post(semaphore_t *sem, bool resched)
 {
 	int ret = 0;
 
-	THREAD_LOCK(state);
+	if (likely(sem_up_fast(sem))) {
+		/* pairs with the fence in poller_add, either it sees the new count or we see it */
+		if (likely(!__atomic_load_n(&sem->wait.pollers, __ATOMIC_SEQ_CST)))
+			return 0;
+
+		WAIT_QUEUE_LOCK(&sem->wait, state);
+		wait_queue_poll_notify(&sem->wait);
+		WAIT_QUEUE_UNLOCK(&sem->wait, state);
+		return 0;
+	}
+
+	WAIT_QUEUE_LOCK(&sem->wait, state);
 
 	/*
 	 * If the count is or was negative then a thread is waiting for a resource, otherwise
 	 * it's safe to just increase the count available with no downsides
 	 */
-	if (unlikely(++sem->count <= 0))
+	if (unlikely(__atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST) <= 0))
 		ret = wait_queue_wake_one(&sem->wait, resched, NO_ERROR);
+	else
+		wait_queue_poll_notify(&sem->wait);
 
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&sem->wait, state);
 
 	return ret;
 }
@@ -53,48 +97,55 @@ int sem_post(semaphore_t *sem, bool resched)
 status_t sem_wait(semaphore_t *sem)
 {
 	status_t ret = NO_ERROR;
-	THREAD_LOCK(state);
+
+	if (likely(sem_trydown_fast(sem)))
+		return NO_ERROR;
+
+	WAIT_QUEUE_LOCK(&sem->wait, state);
 
 	/*
 	 * If there are no resources available then we need to
 	 * sit in the wait queue until sem_post adds some.
 	 */
-	if (unlikely(--sem->count < 0))
+	if (unlikely(__atomic_sub_fetch(&sem->count, 1, __ATOMIC_ACQUIRE) < 0)) {
 		ret = wait_queue_block(&sem->wait, INFINITE_TIME);
+		if (ret == ERR_OBJECT_DESTROYED) {
+			/* the semaphore may be freed already, leave it be */
+			WAIT_QUEUE_RESTORE(state);
+			return ret;
+		}
+	}
 
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&sem->wait, state);
 	return ret;
 }
 
 status_t sem_trywait(semaphore_t *sem)
 {
-	status_t ret = NO_ERROR;
-	THREAD_LOCK(state);
-
-	if (unlikely(sem->count <= 0))
-		ret = ERR_NOT_READY;
-	else
-		sem->count--;
-
-	THREAD_UNLOCK(state);
-	return ret;
+	return sem_trydown_fast(sem) ? NO_ERROR : ERR_NOT_READY;
 }
 
 status_t sem_timedwait(semaphore_t *sem, lk_time_t timeout)
 {
 	status_t ret = NO_ERROR;
-	THREAD_LOCK(state);
 
-	if (unlikely(--sem->count < 0)) {
+	if (likely(sem_trydown_fast(sem)))
+		return NO_ERROR;
+
+	WAIT_QUEUE_LOCK(&sem->wait, state);
+
+	if (unlikely(__atomic_sub_fetch(&sem->count, 1, __ATOMIC_ACQUIRE) < 0)) {
 		ret = wait_queue_block(&sem->wait, timeout);
-		if (ret < NO_ERROR) {
-			if (ret == ERR_TIMED_OUT) {
-				sem->count++;
-			}
+		if (ret == ERR_OBJECT_DESTROYED) {
+			/* the semaphore may be freed already, leave it be */
+			WAIT_QUEUE_RESTORE(state);
+			return ret;
+		} else if (ret == ERR_TIMED_OUT) {
+			__atomic_add_fetch(&sem->count, 1, __ATOMIC_RELAXED);
 		}
 	}
 
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&sem->wait, state);
 	return ret;
 }
 
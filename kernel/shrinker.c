@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/shrinker.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+/* least time between background shrinks, so constant pressure doesn't keep it running */
+#define SHRINK_BACKGROUND_INTERVAL 100 /* ms */
+
+/* registered shrinkers, most recent first. held across the scans, which also
+ * keeps shrinks from running on top of each other */
+static struct list_node shrinker_list = LIST_INITIAL_VALUE(shrinker_list);
+static mutex_t shrinker_lock = MUTEX_INITIAL_VALUE(shrinker_lock);
+
+/* the largest background request since the thread last ran */
+static size_t shrink_pending;
+static event_t shrink_event = EVENT_INITIAL_VALUE(shrink_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+/* stats, protected by shrinker_lock */
+static struct {
+	ulong count;
+	size_t asked;
+	size_t freed;
+} shrink_stats[SHRINK_REASON_COUNT];
+
+static const char *shrink_reason_name[SHRINK_REASON_COUNT] = {
+	[SHRINK_ALLOC_FAILED] = "alloc failed",
+	[SHRINK_BACKGROUND] = "background",
+	[SHRINK_MANUAL] = "manual",
+};
+
+void shrinker_register(shrinker_t *s)
+{
+	DEBUG_ASSERT(s && s->count && s->scan);
+
+	LTRACEF("%s\n", s->name);
+
+	mutex_acquire(&shrinker_lock);
+	list_add_head(&shrinker_list, &s->node);
+	mutex_release(&shrinker_lock);
+}
+
+void shrinker_unregister(shrinker_t *s)
+{
+	DEBUG_ASSERT(s);
+
+	LTRACEF("%s\n", s->name);
+
+	mutex_acquire(&shrinker_lock);
+	list_delete(&s->node);
+	mutex_release(&shrinker_lock);
+}
+
+size_t shrink_caches(size_t bytes, enum shrink_reason reason)
+{
+	DEBUG_ASSERT(reason < SHRINK_REASON_COUNT);
+
+	/* a scan that ends up allocating doesn't get to shrink again */
+	if (bytes == 0 || is_mutex_held(&shrinker_lock))
+		return 0;
+
+	/* only a failed allocation may be holding locks the background shrinkers need */
+	bool all = (reason != SHRINK_ALLOC_FAILED);
+
+	mutex_acquire(&shrinker_lock);
+
+	size_t total = 0;
+	shrinker_t *s;
+	list_for_every_entry(&shrinker_list, s, shrinker_t, node) {
+		if (all || !(s->flags & SHRINKER_FLAG_BACKGROUND))
+			total += s->count(s);
+	}
+
+	/* each cache gives up its share of what was asked for. the ones shrunk first
+	 * release into the ones after them, so those are counted again on their turn */
+	size_t freed = 0;
+	list_for_every_entry(&shrinker_list, s, shrinker_t, node) {
+		if (total == 0)
+			break;
+		if (!all && (s->flags & SHRINKER_FLAG_BACKGROUND))
+			continue;
+
+		size_t count = s->count(s);
+		if (count == 0)
+			continue;
+
+		size_t share = (size_t)(((uint64_t)bytes * count + total - 1) / total);
+		size_t got = s->scan(s, MIN(share, count));
+		LTRACEF("%s: %zu of %zu, released %zu\n", s->name, share, count, got);
+
+		s->calls++;
+		s->freed += got;
+		freed += got;
+	}
+
+	shrink_stats[reason].count++;
+	shrink_stats[reason].asked += bytes;
+	shrink_stats[reason].freed += freed;
+
+	mutex_release(&shrinker_lock);
+
+	LTRACEF("asked for %zu (%s), released %zu\n", bytes, shrink_reason_name[reason], freed);
+
+	/* let the background thread try the rest with the shrinkers we skipped */
+	if (!all && freed < bytes)
+		shrink_caches_async(bytes - freed);
+
+	return freed;
+}
+
+void shrink_caches_async(size_t bytes)
+{
+	size_t old = __atomic_load_n(&shrink_pending, __ATOMIC_RELAXED);
+	while (old < bytes &&
+	        !__atomic_compare_exchange_n(&shrink_pending, &old, bytes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	event_signal(&shrink_event, false);
+}
+
+static int shrink_thread(void *arg)
+{
+	for (;;) {
+		event_wait(&shrink_event);
+
+		size_t bytes = __atomic_exchange_n(&shrink_pending, 0, __ATOMIC_RELAXED);
+		shrink_caches(bytes, SHRINK_BACKGROUND);
+
+		thread_sleep(SHRINK_BACKGROUND_INTERVAL);
+	}
+
+	return 0;
+}
+
+static void shrink_init(uint level)
+{
+	thread_detach_and_resume(thread_create("shrinker", &shrink_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+}
+
+LK_INIT_HOOK(shrinker, &shrink_init, LK_INIT_LEVEL_THREADING);
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_mem(int argc, const cmd_args *argv)
+{
+	if (argc >= 3 && !strcmp(argv[1].str, "shrink")) {
+		size_t freed = shrink_caches(argv[2].u, SHRINK_MANUAL);
+		printf("released %zu bytes\n", freed);
+		return NO_ERROR;
+	} else if (argc < 2 || strcmp(argv[1].str, "pressure")) {
+		printf("usage:\n");
+		printf("%s pressure       : shrinks so far and what each cache could release\n", argv[0].str);
+		printf("%s shrink <bytes> : ask the caches for memory back\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	mutex_acquire(&shrinker_lock);
+
+	for (uint i = 0; i < SHRINK_REASON_COUNT; i++) {
+		printf("%-14s %8lu shrinks, %10zu bytes asked for, %10zu released\n", shrink_reason_name[i],
+		       shrink_stats[i].count, shrink_stats[i].asked, shrink_stats[i].freed);
+	}
+
+	printf("%-16s %12s %8s %12s\n", "cache", "reclaimable", "calls", "released");
+	shrinker_t *s;
+	list_for_every_entry(&shrinker_list, s, shrinker_t, node) {
+		printf("%-16s %12zu %8lu %12zu%s\n", s->name, s->count(s), s->calls, s->freed,
+		       (s->flags & SHRINKER_FLAG_BACKGROUND) ? " (background)" : "");
+	}
+
+	mutex_release(&shrinker_lock);
+
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("mem", "memory pressure and cache shrinking", &cmd_mem)
+STATIC_COMMAND_END(shrinker);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/static_key.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+extern struct static_key __static_keys[];
+extern struct static_key __static_keys_end[];
+extern struct static_key_jump __static_key_jumps[];
+extern struct static_key_jump __static_key_jumps_end[];
+
+/* serializes flipping keys, held across the text patching */
+static mutex_t static_key_lock = MUTEX_INITIAL_VALUE(static_key_lock);
+
+#if ARCH_HAS_STATIC_KEYS
+static void patch_sites(struct static_key *key, bool enable)
+{
+	for (struct static_key_jump *j = __static_key_jumps; j < __static_key_jumps_end; j++) {
+		if (j->key != key)
+			continue;
+
+		LTRACEF("key %s site %p -> %p %s\n", key->name, (void *)j->code, (void *)j->target, enable ? "on" : "off");
+		arch_static_key_patch(j->code, j->target, enable);
+		arch_sync_cache_range(j->code, ARCH_STATIC_KEY_INSN_SIZE);
+	}
+}
+
+struct patch_hold {
+	volatile int held;
+	volatile int done;
+};
+
+/* every other cpu waits in here, with interrupts off, while the text changes */
+static void patch_hold_cpu(void *arg)
+{
+	struct patch_hold *h = arg;
+
+	__atomic_add_fetch(&h->held, 1, __ATOMIC_ACQ_REL);
+	while (!__atomic_load_n(&h->done, __ATOMIC_ACQUIRE))
+		;
+	arch_static_key_sync();
+}
+#endif
+
+status_t static_key_set(struct static_key *key, bool enable)
+{
+	DEBUG_ASSERT(key);
+
+	mutex_acquire(&static_key_lock);
+
+	if (key->enabled == enable) {
+		mutex_release(&static_key_lock);
+		return NO_ERROR;
+	}
+
+#if ARCH_HAS_STATIC_KEYS
+	/* a site may only be rewritten while no cpu can be executing it, so
+	 * park the others in an ipi for the duration. with interrupts off here
+	 * we can't migrate off the cpu that isn't parked.
+	 */
+	struct patch_hold hold = { 0, 0 };
+	mp_call_t call;
+	spin_lock_saved_state_t state;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	mp_async_exec(&call, MP_CPU_ALL_BUT_LOCAL, &patch_hold_cpu, &hold);
+	/* nobody finishes before done is set, so this is still every target */
+	int targets = call.outstanding;
+	while (__atomic_load_n(&hold.held, __ATOMIC_ACQUIRE) < targets)
+		;
+
+	key->enabled = enable;
+	patch_sites(key, enable);
+	arch_static_key_sync();
+
+	__atomic_store_n(&hold.done, 1, __ATOMIC_RELEASE);
+	mp_async_wait(&call);
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+#else
+	key->enabled = enable;
+#endif
+
+	mutex_release(&static_key_lock);
+
+	return NO_ERROR;
+}
+
+struct static_key *static_key_find(const char *name)
+{
+	for (struct static_key *k = __static_keys; k < __static_keys_end; k++) {
+		if (!strcmp(k->name, name))
+			return k;
+	}
+
+	return NULL;
+}
+
+/* sites are all built disabled, turn on the ones whose key starts out on.
+ * nothing else is running yet, so there's no one to hold off */
+static void static_key_init(uint level)
+{
+#if ARCH_HAS_STATIC_KEYS
+	for (struct static_key *k = __static_keys; k < __static_keys_end; k++) {
+		if (k->enabled)
+			patch_sites(k, true);
+	}
+#endif
+}
+
+LK_INIT_HOOK(static_keys, &static_key_init, LK_INIT_LEVEL_EARLIEST);
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static uint static_key_sites(const struct static_key *key)
+{
+	uint count = 0;
+
+	for (const struct static_key_jump *j = __static_key_jumps; j < __static_key_jumps_end; j++) {
+		if (j->key == key)
+			count++;
+	}
+
+	return count;
+}
+
+static int cmd_statickey(int argc, const cmd_args *argv)
+{
+	if (argc < 2 || !strcmp(argv[1].str, "list")) {
+		for (struct static_key *k = __static_keys; k < __static_keys_end; k++)
+			printf("%-32s %-3s %u sites\n", k->name, k->enabled ? "on" : "off", static_key_sites(k));
+		return NO_ERROR;
+	}
+
+	if (argc < 3 || (strcmp(argv[1].str, "on") && strcmp(argv[1].str, "off"))) {
+		printf("usage:\n");
+		printf("%s [list]        : list the keys and their state\n", argv[0].str);
+		printf("%s on|off <key>  : patch a key's sites in or out\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	struct static_key *k = static_key_find(argv[2].str);
+	if (!k) {
+		printf("no key '%s'\n", argv[2].str);
+		return ERR_NOT_FOUND;
+	}
+
+	return static_key_set(k, !strcmp(argv[1].str, "on"));
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("statickey", "list or flip runtime patched tracepoints", &cmd_statickey)
+STATIC_COMMAND_END(static_key);
+
+#endif
+
+// vim: set noexpandtab:
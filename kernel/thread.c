@@ -34,78 +34,680 @@
 #include <assert.h>
 #include <list.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <printf.h>
 #include <err.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
+#include <kernel/cpuidle.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
 #include <kernel/mp.h>
+#include <kernel/poll.h>
+#include <kernel/rcu.h>
+#include <kernel/shrinker.h>
+#include <kernel/static_key.h>
 #include <platform.h>
 #include <target.h>
 #include <lib/heap.h>
+#include <lib/slab.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #if LK_DEBUGLEVEL > 1
 #define THREAD_CHECKS 1
 #endif
 
+percpu_t percpu[SMP_MAX_CPUS];
+
 #if THREAD_STATS
-struct thread_stats thread_stats[SMP_MAX_CPUS];
+/* guarded by the cpu's run queue lock */
+static struct sched_latency sched_latency[SMP_MAX_CPUS];
+
+STATIC_KEY_DEFINE_NAMED(thread_stats_key, "thread_stats", LK_DEBUGLEVEL > 1);
+#endif
+
+#if THREAD_STATS && WITH_SMP
+/* slow path of spin_lock(), taken when the first try fails */
+void spin_lock_contended(spin_lock_t *lock)
+{
+	THREAD_STATS_INC(spin_contended);
+	arch_spin_lock(lock);
+}
 #endif
 
 /* global thread list */
 static struct list_node thread_list;
 
+/* thread structures created by thread_create_etc */
+static slab_cache_t thread_cache = SLAB_CACHE_INITIAL_VALUE(thread_cache, "thread_t", sizeof(thread_t), 0, NULL);
+
+#if WITH_KERNEL_VM
+/*
+ * Stacks for threads created without one come out of the kernel aspace with an
+ * unmapped guard page below them, so running off the end faults right away
+ * instead of corrupting whatever happens to be next to it. They're reused
+ * along with their thread through the thread pool below.
+ */
+
+/* kept at the bottom of a dead stack until it can be freed */
+struct thread_stack_free {
+	struct thread_stack_free *next;
+};
+#endif
+
+/*
+ * Threads whose struct and stack both came from thread_create go back into a
+ * per cpu pool with the stack still attached, so the next thread_create of the
+ * same stack size skips both allocations. A detached thread is still running
+ * on its stack in thread_exit, so it goes on its cpu's dead list instead and
+ * is reaped by whatever runs there next: thread_create, thread_join or the
+ * idle thread. What doesn't fit in a cpu's pool goes to a shared one the other
+ * cpus take from, which keeps churn cheap when workers exit somewhere other
+ * than where they were created.
+ */
+#ifndef THREAD_POOL_DEPTH
+#define THREAD_POOL_DEPTH 4	/* threads kept per cpu */
+#endif
+#define THREAD_POOL_SHARED_DEPTH (THREAD_POOL_DEPTH * SMP_MAX_CPUS)
+
+struct thread_pool {
+	struct list_node free;
+	uint count;
+	struct list_node dead;	/* exited on this cpu, maybe not switched away yet */
+#if WITH_KERNEL_VM
+	/* stacks of detached threads that exited here with a struct that isn't
+	 * ours to pool. reaped along with the dead list */
+	struct thread_stack_free *dead_stacks;
+#endif
+} __CPU_ALIGN;
+
+static struct thread_pool thread_pools[SMP_MAX_CPUS];
+static struct list_node thread_pool_shared = LIST_INITIAL_VALUE(thread_pool_shared);
+static uint thread_pool_shared_count;
+static spin_lock_t thread_pool_lock = SPIN_LOCK_INITIAL_VALUE;
+
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/*
+ * The run queues, one set per cpu, each with its own lock. A thread's rq_cpu
+ * names the queue whose lock covers its state, queue_node and scheduling
+ * fields while it's queued there or running on that cpu. It's -1 while the
+ * thread is blocked, sleeping, suspended or dead, or on its way between
+ * cpus. The current thread changes its own state with just the local lock,
+ * and thread_resched() takes no other, save a trylock of a queue to steal from.
+ *
+ * A thread that isn't attached to a queue is only put in one with its
+ * sched_lock held, which wakers, thread_resume() and the parameter setters
+ * take first. Lock order: wait queue lock, thread_lock, a thread's
+ * sched_lock, then a single run queue lock. thread_lock is left with the
+ * thread list, the wait queue lists, priority inheritance and deadline
+ * admission.
+ *
+ * on_cpu is set from when a thread is switched in until the next thread on
+ * that cpu has finished switching away from it, see thread_switch_finish().
+ * Until then nothing may queue it on another cpu, or it could be loaded there
+ * before its registers are saved here. Other cpus read count and bitmap
+ * without the lock, as hints for placement and stealing.
+ */
+struct run_queue {
+	spin_lock_t lock;
+	struct list_node queue[NUM_PRIORITIES];
+	uint32_t bitmap;
+	uint count;
+
+	/* deadline threads, earliest deadline first, not counted in count */
+	struct list_node dl_queue;
+	uint dl_count;
+
+	/* the switch in progress on this cpu, only touched by it */
+	thread_t *switch_prev;
+	thread_t *migrate; /* switch_prev, to be queued on another cpu afterwards */
+	bool migrate_head;
+} __CPU_ALIGN;
+
+static struct run_queue run_queues[SMP_MAX_CPUS] __FAST_BSS;
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queues[0].bitmap) * 8);
+
+/* a thread a waker or setter is about to queue may still be switching away */
+static inline void thread_wait_off_cpu(thread_t *t)
+{
+#if WITH_SMP
+	while (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE))
+		;
+#endif
+}
 
 /* the idle thread(s) (statically allocated) */
 static thread_t idle_threads[SMP_MAX_CPUS];
 
+/* the current thread changes its own state with this cpu's run queue locked
+ * and interrupts disabled. thread_resched() drops the lock */
+#define LOCAL_RUN_QUEUE_LOCK(state) \
+	spin_lock_saved_state_t state; \
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS); \
+	spin_lock(&run_queues[arch_curr_cpu_num()].lock)
+#define LOCAL_RUN_QUEUE_RESTORE(state) arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS)
+
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
+static uint thread_enqueue(thread_t *t, bool head);
+static void thread_sleep_etc(lk_bigtime_t delay, lk_bigtime_t slack);
+static status_t wait_queue_block_etc(wait_queue_t *wait, lk_bigtime_t timeout, lk_bigtime_t slack);
+static void wait_queue_insert(wait_queue_t *wait, thread_t *t);
+static void wait_queue_remove(wait_queue_t *wait, thread_t *t);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
-static timer_t preempt_timer[SMP_MAX_CPUS];
+/* preemption timer, only armed while another thread is waiting for the cpu */
+struct preempt_timer_cpu {
+	timer_t timer;
+	bool active;
+};
+PERCPU_STATIC(struct preempt_timer_cpu, preempt_timer);
+
+/* period of the preemption tick, in ms */
+#define PREEMPT_TICK_MS 10
+
+static void update_preempt_timer(uint cpu, thread_t *current_thread);
+#endif
+
+/*
+ * Slack, in us, given to the timers behind the ms granular sleep and wait
+ * calls so that nearby wakeups can share a timer interrupt. The _hires
+ * variants fire as close to their deadline as the hardware allows.
+ */
+#ifndef THREAD_TIMER_SLACK_US
+#define THREAD_TIMER_SLACK_US 500
+#endif
+
+/*
+ * Time slice handed out per quarter of the priority range, lowest band first,
+ * in preemption ticks. The slice is shortened when the run queue is deep so that
+ * every queued thread gets a turn within about THREAD_SCHED_LATENCY_TICKS, but
+ * never below THREAD_MIN_QUANTUM_TICKS.
+ */
+#ifndef THREAD_QUANTUM_BAND_TICKS
+#define THREAD_QUANTUM_BAND_TICKS 5, 5, 5, 5
+#endif
+#ifndef THREAD_SCHED_LATENCY_TICKS
+#define THREAD_SCHED_LATENCY_TICKS 20
 #endif
+#ifndef THREAD_MIN_QUANTUM_TICKS
+#define THREAD_MIN_QUANTUM_TICKS 1
+#endif
+
+static const int quantum_band_ticks[4] = { THREAD_QUANTUM_BAND_TICKS };
 
-/* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t)
+/*
+ * Deadline threads are admitted to one cpu each, as long as the sum of their
+ * bandwidths (runtime / period) there stays under THREAD_DEADLINE_MAX_BW_PCT.
+ * The rest is left over for the priority scheduled threads.
+ */
+#ifndef THREAD_DEADLINE_MAX_BW_PCT
+#define THREAD_DEADLINE_MAX_BW_PCT 95
+#endif
+#define DEADLINE_BW_SHIFT 20
+
+/* bandwidth admitted on each cpu, protected by thread_lock */
+static uint deadline_bw[SMP_MAX_CPUS];
+
+/* budget enforcement for the deadline thread running on each cpu */
+struct deadline_timer_cpu {
+	timer_t timer;
+	bool armed;
+};
+PERCPU_STATIC(struct deadline_timer_cpu, deadline_timer);
+
+/* the cpus a thread may be queued on */
+static mp_cpu_mask_t thread_cpu_mask(thread_t *t)
 {
-#if THREAD_CHECKS
-	ASSERT(t->magic == THREAD_MAGIC);
-	ASSERT(t->state == THREAD_READY);
-	ASSERT(!list_in_list(&t->queue_node));
-	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	if (t->pinned_cpu >= 0)
+		return 1U << t->pinned_cpu;
+	if (t->affinity)
+		return t->affinity;
+
+	/* isolated cpus only run threads that ask for them */
+	return ~mp_get_isolated_mask();
+}
+
+/*
+ * Pick the cpu whose run queue a thread that is becoming ready should go in.
+ * Threads only ever live in the queue of a cpu they may run on, so the scheduler
+ * never has to skip over them. A thread that is still running (yield, preempt)
+ * stays local if it's allowed to. Otherwise prefer an idle cpu, starting with the
+ * one the thread last ran on, then fall back to the last cpu for cache warmth.
+ */
+static uint select_run_queue_cpu(thread_t *t)
+{
+	if (t->pinned_cpu >= 0)
+		return t->pinned_cpu;
+
+	mp_cpu_mask_t allowed = thread_cpu_mask(t);
+	if (t->curr_cpu >= 0 && (allowed & (1U << t->curr_cpu)))
+		return t->curr_cpu;
+
+#if WITH_SMP
+	uint local_cpu = arch_curr_cpu_num();
+	uint last_cpu = (t->last_cpu >= 0) ? (uint)t->last_cpu : local_cpu;
+	mp_cpu_mask_t online = allowed & mp.active_cpus;
+	mp_cpu_mask_t idle = mp_get_idle_mask() & online;
+
+	if (idle & (1U << last_cpu))
+		return last_cpu;
+	if (idle & (1U << local_cpu))
+		return local_cpu;
+	if (idle)
+		return __builtin_ctz(idle);
+	if (online & (1U << last_cpu))
+		return last_cpu;
+	if (online & (1U << local_cpu))
+		return local_cpu;
+	if (online)
+		return __builtin_ctz(online);
+
+	/* none of its cpus are up yet, wait in the queue of one of them */
+	allowed &= MP_CPU_MASK_ALL;
+	return allowed ? (uint)__builtin_ctz(allowed) : local_cpu;
+#else
+	return 0;
+#endif
+}
+
+#if THREAD_STATS
+void thread_stats_irq_enter(void)
+{
+	struct thread_stats *s = &get_percpu()->stats;
+
+	s->interrupts++;
+	s->irq_enter_time = current_time_hires();
+}
+
+void thread_stats_irq_exit(void)
+{
+	get_percpu()->stats.irq_enter_time = 0;
+}
+
+/* note when t became runnable. a thread put back in the queue by its own
+ * preemption or yield wasn't readied by the irq it happens to be in. */
+static inline void sched_latency_ready(thread_t *t)
+{
+	t->ready_time = current_time_hires();
+	t->ready_irq_time = (t != get_current_thread()) ? get_percpu()->stats.irq_enter_time : 0;
+}
+
+static uint sched_latency_bucket(lk_bigtime_t usecs)
+{
+	if (usecs < 2)
+		return 0;
+
+	uint b = 63 - __builtin_clzll(usecs);
+	return MIN(b, SCHED_LATENCY_BUCKETS - 1);
+}
+
+/* t was just picked to run on cpu */
+static void sched_latency_run(uint cpu, thread_t *t, uint queued)
+{
+	if (!t->ready_time)
+		return;
+
+	struct sched_latency *l = &sched_latency[cpu];
+	lk_bigtime_t now = current_time_hires();
+	lk_bigtime_t lat = now - t->ready_time;
+	uint b = sched_latency_bucket(lat);
+
+	l->ready[b]++;
+	l->prio[t->priority][b]++;
+	if (lat > l->ready_max)
+		l->ready_max = lat;
+
+	if (t->ready_irq_time) {
+		lat = now - t->ready_irq_time;
+		l->irq[sched_latency_bucket(lat)]++;
+		if (lat > l->irq_max)
+			l->irq_max = lat;
+	}
+
+	l->runq[MIN(queued, SCHED_RUNQ_BUCKETS - 1)]++;
+
+	t->ready_time = 0;
+	t->ready_irq_time = 0;
+}
+
+static void thread_runtime_cb(thread_t *t, void *arg)
+{
+	lk_bigtime_t *runtime = arg;
+
+	*runtime = t->runtime;
+	if (t->state == THREAD_RUNNING)
+		*runtime += current_time_hires() - t->last_run_time;
+}
+
+lk_bigtime_t thread_runtime_locked(thread_t *t)
+{
+	DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+	lk_bigtime_t runtime;
+	thread_snapshot(t, thread_runtime_cb, &runtime);
+
+	return runtime;
+}
+
+void sched_latency_snapshot(uint cpu, struct sched_latency *l)
+{
+	spin_lock_saved_state_t state;
+
+	spin_lock_irqsave(&run_queues[cpu].lock, state);
+	*l = sched_latency[cpu];
+	spin_unlock_irqrestore(&run_queues[cpu].lock, state);
+}
+
+void sched_latency_reset(void)
+{
+	spin_lock_saved_state_t state;
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		spin_lock_irqsave(&run_queues[cpu].lock, state);
+		memset(&sched_latency[cpu], 0, sizeof(sched_latency[cpu]));
+		spin_unlock_irqrestore(&run_queues[cpu].lock, state);
+	}
+}
+#else
+static inline void sched_latency_ready(thread_t *t) {}
 #endif
 
-	list_add_head(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+static inline bool thread_is_deadline(thread_t *t)
+{
+	return !!(t->flags & THREAD_FLAG_DEADLINE);
+}
+
+/* take the time a deadline thread has been running out of its budget */
+static void deadline_charge(thread_t *t, lk_bigtime_t now)
+{
+	if (!t->dl.run_start)
+		return;
+
+	lk_bigtime_t used = now - t->dl.run_start;
+	t->dl.budget = (used < t->dl.budget) ? t->dl.budget - used : 0;
+	t->dl.run_start = 0;
 }
 
-static void insert_in_run_queue_tail(thread_t *t)
+/* start of the thread's next period */
+static inline lk_bigtime_t deadline_next_period(thread_t *t)
 {
+	return t->dl.abs_deadline - t->dl.params.deadline + t->dl.params.period;
+}
+
+static void deadline_replenish(thread_t *t, lk_bigtime_t now)
+{
+	t->dl.abs_deadline += t->dl.params.period;
+	if (t->dl.abs_deadline <= now)
+		t->dl.abs_deadline = now + t->dl.params.deadline;
+	t->dl.budget = t->dl.params.runtime;
+}
+
+static enum handler_return deadline_replenish_timer(timer_t *timer, lk_time_t now, void *arg)
+{
+	thread_t *t = (thread_t *)arg;
+
+	spin_lock(&t->sched_lock);
+
+	/* it may have been requeued, and even throttled again, while we were
+	 * waiting for the lock */
+	lk_bigtime_t now_hires = current_time_hires();
+	if (!t->dl.throttled || now_hires < deadline_next_period(t)) {
+		spin_unlock(&t->sched_lock);
+		return INT_NO_RESCHEDULE;
+	}
+
+	/* it may have throttled itself on the way off its cpu */
+	thread_wait_off_cpu(t);
+	t->dl.throttled = false;
+	deadline_replenish(t, now_hires);
+	uint cpu = thread_enqueue(t, true);
+
+	spin_unlock(&t->sched_lock);
+
+	if (cpu != arch_curr_cpu_num()) {
+		mp_reschedule(1U << cpu, 0);
+		return INT_NO_RESCHEDULE;
+	}
+
+	return INT_RESCHEDULE;
+}
+
+/*
+ * A deadline thread is becoming ready on the cpu it was admitted to. This is
+ * a constant bandwidth server: a thread coming back from the cpu keeps its
+ * deadline and what's left of its budget, and once that's gone it's held
+ * out of the queue until its next period. A thread waking up keeps them too
+ * unless running out the budget before the deadline would take more than
+ * its bandwidth, in which case it gets a fresh budget and deadline. Returns
+ * false if it's throttled instead of going in the queue.
+ */
+static bool deadline_ready(thread_t *t)
+{
+	uint cpu = t->dl.cpu;
+	lk_bigtime_t now = current_time_hires();
+
+	if (t->dl.run_start) {
+		deadline_charge(t, now);
+	} else if (t->dl.abs_deadline <= now ||
+			t->dl.budget * t->dl.params.period > (t->dl.abs_deadline - now) * t->dl.params.runtime) {
+		t->dl.abs_deadline = now + t->dl.params.deadline;
+		t->dl.budget = t->dl.params.runtime;
+	}
+
+	if (t->dl.budget == 0) {
+		lk_bigtime_t next = deadline_next_period(t);
+		if (next > now) {
+			/* throttled, the timer puts it back in the queue */
+			t->dl.throttled = true;
+			if (timer_set_on_cpu(&t->dl.timer, cpu, next - now, 0, deadline_replenish_timer, t) < 0)
+				timer_set_oneshot_hires(&t->dl.timer, next - now, deadline_replenish_timer, t);
+			return false;
+		}
+		deadline_replenish(t, now);
+	}
+
+	return true;
+}
+
+/* the run queue's lock must be held */
+static void deadline_queue_add(struct run_queue *rq, thread_t *t)
+{
+	thread_t *entry;
+	list_for_every_entry(&rq->dl_queue, entry, thread_t, queue_node) {
+		if (entry->dl.abs_deadline > t->dl.abs_deadline) {
+			list_add_before(&entry->queue_node, &t->queue_node);
+			goto queued;
+		}
+	}
+	list_add_tail(&rq->dl_queue, &t->queue_node);
+queued:
+	rq->dl_count++;
+}
+
+static enum handler_return deadline_timer_tick(timer_t *timer, lk_time_t now, void *arg)
+{
+	/* out of budget, the reschedule throttles it */
+	return INT_RESCHEDULE;
+}
+
+/* a thread is about to run on cpu, arm the budget timer if it's a deadline thread */
+static void deadline_switch_in(uint cpu, thread_t *t)
+{
+	struct deadline_timer_cpu *d = percpu_var_cpu(deadline_timer, cpu);
+
+	if (d->armed) {
+		timer_cancel(&d->timer);
+		d->armed = false;
+	}
+
+	if (thread_is_deadline(t)) {
+		t->dl.run_start = current_time_hires();
+		timer_set_oneshot_hires(&d->timer, t->dl.budget, deadline_timer_tick, NULL);
+		d->armed = true;
+	}
+}
+
+/*
+ * Put a ready thread in a run queue, ahead of or behind the others of its
+ * priority. Returns the cpu it's queued on, for the caller to poke.
+ *
+ * The current thread queues itself with the local run queue locked. If it
+ * belongs on another cpu it's handed to thread_switch_finish() to be queued
+ * there once it has switched away. For any other thread its sched_lock must
+ * be held, no run queue lock, and it must be off its cpu.
+ */
+static uint run_queue_insert(thread_t *t, bool head)
+{
+	uint local_cpu = arch_curr_cpu_num();
+	bool self = (t == get_current_thread());
+
 #if THREAD_CHECKS
 	ASSERT(t->magic == THREAD_MAGIC);
 	ASSERT(t->state == THREAD_READY);
 	ASSERT(!list_in_list(&t->queue_node));
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(self ? spin_lock_held(&run_queues[local_cpu].lock) : spin_lock_held(&t->sched_lock));
 #endif
 
-	list_add_tail(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+	bool deadline = thread_is_deadline(t);
+	uint cpu = unlikely(deadline) ? (uint)t->dl.cpu : select_run_queue_cpu(t);
+
+	if (self && cpu != local_cpu) {
+		run_queues[local_cpu].migrate = t;
+		run_queues[local_cpu].migrate_head = head;
+		return cpu;
+	}
+
+	if (unlikely(deadline) && !deadline_ready(t))
+		return cpu;
+
+	struct run_queue *rq = &run_queues[cpu];
+
+	if (!self)
+		spin_lock(&rq->lock);
+	if (unlikely(deadline)) {
+		deadline_queue_add(rq, t);
+	} else {
+		if (head)
+			list_add_head(&rq->queue[t->priority], &t->queue_node);
+		else
+			list_add_tail(&rq->queue[t->priority], &t->queue_node);
+		rq->bitmap |= (1<<t->priority);
+		rq->count++;
+	}
+	t->rq_cpu = cpu;
+	if (!self)
+		spin_unlock(&rq->lock);
+
+	if (unlikely(deadline)) {
+		/* the callers' reschedule doesn't interrupt real time threads, this does */
+		if (cpu != local_cpu && (mp.realtime_cpus & (1U << cpu)))
+			mp_reschedule(1U << cpu, MP_RESCHEDULE_FLAG_REALTIME);
+	}
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	else if (cpu == local_cpu && !self) {
+		/* someone may now want our cpu, make sure the running thread can be preempted */
+		update_preempt_timer(cpu, get_current_thread());
+	}
+#endif
+
+	return cpu;
+}
+
+/* run_queue_insert() for a thread that just became ready */
+static uint thread_enqueue(thread_t *t, bool head)
+{
+	sched_latency_ready(t);
+	return run_queue_insert(t, head);
+}
+
+/* make a blocked, sleeping or suspended thread ready. its sched_lock must be held */
+static uint thread_wake(thread_t *t)
+{
+	thread_wait_off_cpu(t);
+
+	t->state = THREAD_READY;
+	KEVLOG_THREAD_WAKEUP(t);
+
+	return thread_enqueue(t, true);
+}
+
+/* the run queue's lock must be held */
+static void remove_from_run_queue(struct run_queue *rq, thread_t *t)
+{
+	list_delete(&t->queue_node);
+	rq->count--;
+
+	if (list_is_empty(&rq->queue[t->priority]))
+		rq->bitmap &= ~(1<<t->priority);
+}
+
+/* a ready thread in one of the run queues, rather than on its way to one */
+static inline bool thread_is_queued(thread_t *t)
+{
+	return t->state == THREAD_READY && list_in_list(&t->queue_node);
+}
+
+/*
+ * lock the run queue t is attached to, see rq_cpu, or return NULL if it isn't
+ * attached to one. t's sched_lock must be held, so it can't be attached to one
+ * meanwhile, though it may still move between them until we have the lock.
+ */
+static struct run_queue *run_queue_lock_of(thread_t *t)
+{
+	for (;;) {
+		int cpu = __atomic_load_n(&t->rq_cpu, __ATOMIC_ACQUIRE);
+		if (cpu < 0)
+			return NULL;
+
+		struct run_queue *rq = &run_queues[cpu];
+		spin_lock(&rq->lock);
+		if (t->rq_cpu == cpu)
+			return rq;
+		spin_unlock(&rq->lock);
+	}
+}
+
+/* take a queued thread out of its run queue, whose lock is held */
+static void dequeue_ready_thread(struct run_queue *rq, thread_t *t)
+{
+	if (unlikely(thread_is_deadline(t))) {
+		list_delete(&t->queue_node);
+		rq->dl_count--;
+	} else {
+		remove_from_run_queue(rq, t);
+	}
+	t->rq_cpu = -1;
+}
+
+static inline uint run_queue_highest_priority(uint32_t bitmap)
+{
+	return HIGHEST_PRIORITY - __builtin_clz(bitmap)
+		- (sizeof(bitmap) * 8 - NUM_PRIORITIES);
+}
+
+/* compute a fresh quantum for a thread about to run on cpu */
+static int thread_quantum(uint cpu, thread_t *t)
+{
+	int quantum = quantum_band_ticks[t->priority / (NUM_PRIORITIES / 4)];
+	int share = THREAD_SCHED_LATENCY_TICKS / (int)(run_queues[cpu].count + 1);
+
+	if (share < quantum)
+		quantum = share;
+	if (quantum < THREAD_MIN_QUANTUM_TICKS)
+		quantum = THREAD_MIN_QUANTUM_TICKS;
+
+	return quantum;
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
@@ -113,9 +715,268 @@ static void init_thread_struct(thread_t *t, const char *name)
 	memset(t, 0, sizeof(thread_t));
 	t->magic = THREAD_MAGIC;
 	t->pinned_cpu = -1;
+	t->last_cpu = -1;
+	t->inherited_priority = -1;
+	t->rq_cpu = -1;
+	spin_lock_init(&t->sched_lock);
+	list_initialize(&t->held_mutexes);
+	timer_initialize(&t->dl.timer);
+	t->preempt_disable_count = 0;
+	t->preempt_pending = false;
 	strlcpy(t->name, name, sizeof(t->name));
 }
 
+static void *thread_stack_alloc(size_t stack_size)
+{
+#if WITH_KERNEL_VM
+	void *stack;
+	if (vmm_alloc(vmm_get_kernel_aspace(), "kstack", ROUNDUP(stack_size, PAGE_SIZE), &stack, 0,
+			VMM_FLAG_GUARD, ARCH_MMU_FLAG_CACHED | ARCH_MMU_FLAG_PERM_NO_EXECUTE) < 0)
+		return NULL;
+
+	return stack;
+#else
+	return malloc(stack_size);
+#endif
+}
+
+/*
+ * exiting is set when a detached thread frees its own stack on the way out,
+ * with interrupts disabled. the stack is still in use until the thread switches
+ * away, so it waits on the cpu's pool to be reaped.
+ */
+static void thread_stack_free(void *stack, size_t stack_size, bool exiting)
+{
+#if WITH_KERNEL_VM
+	if (exiting) {
+		struct thread_pool *p = &thread_pools[arch_curr_cpu_num()];
+		struct thread_stack_free *s = stack;
+
+		s->next = p->dead_stacks;
+		p->dead_stacks = s;
+		return;
+	}
+	vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)stack);
+#else
+	if (exiting)
+		heap_delayed_free(stack);
+	else
+		free(stack);
+#endif
+}
+
+static inline bool thread_is_poolable(thread_t *t)
+{
+	const uint flags = THREAD_FLAG_FREE_STRUCT | THREAD_FLAG_FREE_STACK;
+
+	return (t->flags & flags) == flags && t->stack;
+}
+
+/* called with interrupts disabled, returns t if there's no room for it */
+static thread_t *thread_pool_put(struct thread_pool *p, thread_t *t)
+{
+	if (p->count < THREAD_POOL_DEPTH) {
+		list_add_head(&p->free, &t->thread_list_node);
+		p->count++;
+		return NULL;
+	}
+
+	spin_lock(&thread_pool_lock);
+	if (thread_pool_shared_count < THREAD_POOL_SHARED_DEPTH) {
+		list_add_head(&thread_pool_shared, &t->thread_list_node);
+		thread_pool_shared_count++;
+		t = NULL;
+	}
+	spin_unlock(&thread_pool_lock);
+
+	return t;
+}
+
+/* a pool's leftovers, to be freed once interrupts are back on */
+struct thread_pool_leftover {
+	struct list_node threads;
+#if WITH_KERNEL_VM
+	struct thread_stack_free *stacks;
+#endif
+};
+
+#if WITH_KERNEL_VM
+#define THREAD_POOL_LEFTOVER_INITIAL_VALUE(l) { LIST_INITIAL_VALUE((l).threads), NULL }
+#else
+#define THREAD_POOL_LEFTOVER_INITIAL_VALUE(l) { LIST_INITIAL_VALUE((l).threads) }
+#endif
+
+/*
+ * Called with interrupts disabled. Anything running on this cpu means the
+ * threads on its dead list have switched away for good, so they can be pooled.
+ * The ones there's no room for, and the loose dead stacks, are moved to leftover.
+ */
+static void thread_pool_reap(struct thread_pool *p, struct thread_pool_leftover *leftover)
+{
+	thread_t *t;
+
+	while ((t = list_remove_head_type(&p->dead, thread_t, thread_list_node))) {
+		if (thread_pool_put(p, t))
+			list_add_tail(&leftover->threads, &t->thread_list_node);
+	}
+#if WITH_KERNEL_VM
+	while (p->dead_stacks) {
+		struct thread_stack_free *s = p->dead_stacks;
+		p->dead_stacks = s->next;
+		s->next = leftover->stacks;
+		leftover->stacks = s;
+	}
+#endif
+}
+
+static void thread_pool_release(struct thread_pool_leftover *leftover)
+{
+	thread_t *t;
+
+	while ((t = list_remove_head_type(&leftover->threads, thread_t, thread_list_node))) {
+		thread_stack_free(t->stack, t->stack_size, false);
+		slab_free(&thread_cache, t);
+	}
+#if WITH_KERNEL_VM
+	while (leftover->stacks) {
+		struct thread_stack_free *s = leftover->stacks;
+		leftover->stacks = s->next;
+		vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)s);
+	}
+#endif
+}
+
+static thread_t *thread_pool_find(struct list_node *list, size_t stack_size)
+{
+	thread_t *t;
+
+	list_for_every_entry(list, t, thread_t, thread_list_node) {
+		if (t->stack_size == stack_size) {
+			list_delete(&t->thread_list_node);
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+/* a pooled thread with a stack of stack_size, or NULL */
+static thread_t *thread_pool_get(size_t stack_size)
+{
+	struct thread_pool_leftover leftover = THREAD_POOL_LEFTOVER_INITIAL_VALUE(leftover);
+	spin_lock_saved_state_t state;
+	thread_t *t;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	struct thread_pool *p = &thread_pools[arch_curr_cpu_num()];
+	thread_pool_reap(p, &leftover);
+	if ((t = thread_pool_find(&p->free, stack_size))) {
+		p->count--;
+	} else if (!list_is_empty(&thread_pool_shared)) {
+		spin_lock(&thread_pool_lock);
+		if ((t = thread_pool_find(&thread_pool_shared, stack_size)))
+			thread_pool_shared_count--;
+		spin_unlock(&thread_pool_lock);
+	}
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	thread_pool_release(&leftover);
+
+	return t;
+}
+
+/* pool a thread that has switched away for good, or free it */
+static void thread_pool_recycle(thread_t *t)
+{
+	struct thread_pool_leftover leftover = THREAD_POOL_LEFTOVER_INITIAL_VALUE(leftover);
+	spin_lock_saved_state_t state;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	struct thread_pool *p = &thread_pools[arch_curr_cpu_num()];
+	thread_pool_reap(p, &leftover);
+	if (thread_pool_put(p, t))
+		list_add_tail(&leftover.threads, &t->thread_list_node);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	thread_pool_release(&leftover);
+}
+
+/* the idle thread can't free anything, what doesn't fit stays on the dead list */
+static void thread_pool_reap_idle(void)
+{
+	struct list_node leftover = LIST_INITIAL_VALUE(leftover);
+	spin_lock_saved_state_t state;
+	thread_t *t;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	struct thread_pool *p = &thread_pools[arch_curr_cpu_num()];
+	while ((t = list_remove_head_type(&p->dead, thread_t, thread_list_node))) {
+		if (thread_pool_put(p, t))
+			list_add_tail(&leftover, &t->thread_list_node);
+	}
+	while ((t = list_remove_head_type(&leftover, thread_t, thread_list_node)))
+		list_add_tail(&p->dead, &t->thread_list_node);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/*
+ * Under memory pressure the pooled threads of the cpu the shrinker runs on,
+ * and the shared pool, are freed outright. The other cpus' pools are only
+ * touched from their own cpu and stay as they are, they're bounded by
+ * THREAD_POOL_DEPTH. Freeing a stack takes the kernel aspace lock, which an
+ * allocating thread may hold, so this only runs in the background.
+ */
+static size_t thread_shrinker_count(shrinker_t *s)
+{
+	spin_lock_saved_state_t state;
+	size_t bytes = 0;
+	thread_t *t;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	struct thread_pool *p = &thread_pools[arch_curr_cpu_num()];
+	list_for_every_entry(&p->free, t, thread_t, thread_list_node)
+		bytes += sizeof(thread_t) + t->stack_size;
+	spin_lock(&thread_pool_lock);
+	list_for_every_entry(&thread_pool_shared, t, thread_t, thread_list_node)
+		bytes += sizeof(thread_t) + t->stack_size;
+	spin_unlock(&thread_pool_lock);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	return bytes;
+}
+
+static size_t thread_shrinker_scan(shrinker_t *s, size_t target)
+{
+	struct thread_pool_leftover list = THREAD_POOL_LEFTOVER_INITIAL_VALUE(list);
+	spin_lock_saved_state_t state;
+	size_t freed = 0;
+	thread_t *t;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	struct thread_pool *p = &thread_pools[arch_curr_cpu_num()];
+	thread_pool_reap(p, &list);
+	while (freed < target && (t = list_remove_head_type(&p->free, thread_t, thread_list_node))) {
+		p->count--;
+		list_add_tail(&list.threads, &t->thread_list_node);
+		freed += sizeof(thread_t) + t->stack_size;
+	}
+	spin_lock(&thread_pool_lock);
+	while (freed < target && (t = list_remove_head_type(&thread_pool_shared, thread_t, thread_list_node))) {
+		thread_pool_shared_count--;
+		list_add_tail(&list.threads, &t->thread_list_node);
+		freed += sizeof(thread_t) + t->stack_size;
+	}
+	spin_unlock(&thread_pool_lock);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	thread_pool_release(&list);
+
+	return freed;
+}
+
+static shrinker_t thread_shrinker = SHRINKER_INITIAL_VALUE("thread pool", SHRINKER_FLAG_BACKGROUND,
+		&thread_shrinker_count, &thread_shrinker_scan, NULL);
+
 /**
  * @brief  Create a new thread
  *
@@ -147,8 +1008,13 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 {
 	unsigned int flags = 0;
 
+	if (!t && !stack && (t = thread_pool_get(stack_size))) {
+		stack = t->stack;
+		flags |= THREAD_FLAG_FREE_STRUCT | THREAD_FLAG_FREE_STACK;
+	}
+
 	if (!t) {
-		t = malloc(sizeof(thread_t));
+		t = slab_alloc(&thread_cache);
 		if (!t)
 			return NULL;
 		flags |= THREAD_FLAG_FREE_STRUCT;
@@ -158,7 +1024,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 
 	t->entry = entry;
 	t->arg = arg;
-	t->priority = priority;
+	t->priority = t->base_priority = priority;
 	t->state = THREAD_SUSPENDED;
 	t->blocking_wait_queue = NULL;
 	t->wait_queue_block_ret = NO_ERROR;
@@ -169,10 +1035,10 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 
 	/* create the stack */
 	if (!stack) {
-		t->stack = malloc(stack_size);
+		t->stack = thread_stack_alloc(stack_size);
 		if (!t->stack) {
 			if (flags & THREAD_FLAG_FREE_STRUCT)
-				free(t);
+				slab_free(&thread_cache, t);
 			return NULL;
 		}
 		flags |= THREAD_FLAG_FREE_STACK;
@@ -190,6 +1056,10 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 	int i;
 	for (i=0; i < MAX_TLS_ENTRY; i++)
 		t->tls[i] = current_thread->tls[i];
+#if WITH_MALLOC_THREAD_CACHE
+	/* but not the parent's malloc cache */
+	t->tls[TLS_ENTRY_MALLOC] = 0;
+#endif
 
 	/* set up the initial stack frame */
 	arch_thread_initialize(t);
@@ -223,15 +1093,21 @@ status_t thread_set_real_time(thread_t *t)
 	ASSERT(t->magic == THREAD_MAGIC);
 #endif
 
-	THREAD_LOCK(state);
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&t->sched_lock, state);
+	struct run_queue *rq = run_queue_lock_of(t);
+
+	t->flags |= THREAD_FLAG_REAL_TIME;
 #if PLATFORM_HAS_DYNAMIC_TIMER
 	if (t == get_current_thread()) {
-		/* if we're currently running, cancel the preemption timer. */
-		timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+		/* if we're currently running, this cancels the preemption timer. */
+		update_preempt_timer(arch_curr_cpu_num(), t);
 	}
 #endif
-	t->flags |= THREAD_FLAG_REAL_TIME;
-	THREAD_UNLOCK(state);
+
+	if (rq)
+		spin_unlock(&rq->lock);
+	spin_unlock_irqrestore(&t->sched_lock, state);
 
 	return NO_ERROR;
 }
@@ -246,9 +1122,224 @@ static bool thread_is_idle(thread_t *t)
 	return !!(t->flags & THREAD_FLAG_IDLE);
 }
 
+/* nothing but a wakeup or its budget running out preempts these */
 static bool thread_is_real_time_or_idle(thread_t *t)
 {
-	return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
+	return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE | THREAD_FLAG_DEADLINE));
+}
+
+/**
+ * @brief  Schedule a thread by deadline
+ *
+ * The thread is guaranteed params->runtime us of cpu time within
+ * params->deadline us of the start of every params->period us, and runs
+ * ahead of all priority scheduled threads, earliest deadline first. It's
+ * admitted to a single cpu out of its affinity mask, and held to its
+ * runtime: once a period's budget is used up it doesn't run again until the
+ * next period. thread_yield() gives up the rest of the current period.
+ *
+ * @param t Thread to set
+ * @param params Scheduling parameters, or NULL to go back to priority
+ * scheduling
+ *
+ * @return NO_ERROR on success, ERR_INVALID_ARGS unless
+ * 0 < runtime <= deadline <= period, ERR_NO_RESOURCES if no cpu has the
+ * bandwidth left for it.
+ */
+status_t thread_set_deadline(thread_t *t, const thread_deadline_params_t *params)
+{
+	if (!t)
+		return ERR_INVALID_ARGS;
+	if (params && (params->runtime == 0 || params->runtime > params->deadline ||
+			params->deadline > params->period))
+		return ERR_INVALID_ARGS;
+
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+	ASSERT(!thread_is_idle(t));
+#endif
+
+	uint bw = params ? (uint)((params->runtime << DEADLINE_BW_SHIFT) / params->period) : 0;
+
+	/* thread_lock for the admission, the parameters only change with it held too */
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&thread_lock);
+	spin_lock(&t->sched_lock);
+
+	if (t->state == THREAD_DEATH) {
+		spin_unlock(&t->sched_lock);
+		spin_unlock(&thread_lock);
+		arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+		return ERR_INVALID_ARGS;
+	}
+
+	bool was_deadline = thread_is_deadline(t);
+	uint local_cpu = arch_curr_cpu_num();
+
+	/* least loaded cpu it fits on */
+	int cpu = -1;
+	if (params) {
+		uint limit = (THREAD_DEADLINE_MAX_BW_PCT << DEADLINE_BW_SHIFT) / 100;
+		uint best = 0;
+
+		for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+			if (!(thread_cpu_mask(t) & (1U << i)))
+				continue;
+			if (!(mp.active_cpus & (1U << i)) && i != local_cpu)
+				continue;
+
+			uint used = deadline_bw[i];
+			if (was_deadline && t->dl.cpu == (int)i)
+				used -= t->dl.bw;
+			if (used + bw > limit)
+				continue;
+			if (cpu < 0 || used < best) {
+				cpu = i;
+				best = used;
+			}
+		}
+
+		if (cpu < 0) {
+			spin_unlock(&t->sched_lock);
+			spin_unlock(&thread_lock);
+			arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+			return ERR_NO_RESOURCES;
+		}
+	}
+
+	struct run_queue *rq = run_queue_lock_of(t);
+
+	/* pull it out of whichever queue it's in, it's requeued below */
+	bool requeue = rq && thread_is_queued(t);
+	if (requeue) {
+		dequeue_ready_thread(rq, t);
+	} else if (t->state == THREAD_READY && was_deadline && t->dl.throttled) {
+		timer_cancel(&t->dl.timer);
+		t->dl.throttled = false;
+		requeue = true;
+	}
+
+	if (was_deadline)
+		deadline_bw[t->dl.cpu] -= t->dl.bw;
+
+	if (params) {
+		lk_bigtime_t now = current_time_hires();
+
+		t->dl.params = *params;
+		t->dl.bw = bw;
+		t->dl.cpu = cpu;
+		t->dl.budget = params->runtime;
+		t->dl.abs_deadline = now + params->deadline;
+		t->dl.run_start = (t == get_current_thread()) ? now : 0;
+		deadline_bw[cpu] += bw;
+		t->flags |= THREAD_FLAG_DEADLINE;
+	} else {
+		t->dl.run_start = 0;
+		t->flags &= ~THREAD_FLAG_DEADLINE;
+	}
+
+	int running_cpu = (rq && t->state == THREAD_RUNNING) ? (int)(rq - run_queues) : -1;
+	if (rq)
+		spin_unlock(&rq->lock);
+	spin_unlock(&thread_lock);
+
+	if (requeue) {
+		/* it may have been queued by its own cpu on the way off it */
+		thread_wait_off_cpu(t);
+		uint c = thread_enqueue(t, true);
+		mp_reschedule(1U << c, 0);
+	}
+
+	if (t == get_current_thread()) {
+		deadline_switch_in(local_cpu, t);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+		update_preempt_timer(local_cpu, t);
+#endif
+	} else if (running_cpu >= 0) {
+		/* running elsewhere, get it requeued under the new parameters */
+		mp_reschedule(1U << running_cpu, MP_RESCHEDULE_FLAG_REALTIME);
+	}
+
+	spin_unlock(&t->sched_lock);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	return NO_ERROR;
+}
+
+/**
+ * @brief  Set the cpus a thread may run on
+ *
+ * A mask with a single cpu is the same as setting pinned_cpu. Isolated cpus
+ * only run threads whose mask includes them, a mask of 0 lets the thread run
+ * on any cpu that isn't isolated. A thread running or queued on a cpu it's no
+ * longer allowed on is moved right away. Deadline threads stay on the cpu they
+ * were admitted to until thread_set_deadline() is called again.
+ *
+ * @param t Thread to set
+ * @param cpu_mask An mp_cpu_mask_t of cpus
+ *
+ * @return NO_ERROR on success, ERR_INVALID_ARGS if the mask has no cpus that
+ * exist.
+ */
+status_t thread_set_affinity(thread_t *t, uint32_t cpu_mask)
+{
+	if (!t)
+		return ERR_INVALID_ARGS;
+
+	uint32_t cpus = MP_CPU_MASK_ALL;
+	if (cpu_mask && !(cpu_mask & cpus))
+		return ERR_INVALID_ARGS;
+	cpu_mask &= cpus;
+
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+	ASSERT(!thread_is_idle(t));
+#endif
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&t->sched_lock, state);
+	struct run_queue *rq = run_queue_lock_of(t);
+
+	t->affinity = cpu_mask;
+	t->pinned_cpu = (cpu_mask && !(cpu_mask & (cpu_mask - 1))) ? __builtin_ctz(cpu_mask) : -1;
+
+	/* not attached to a queue, it goes where it may when it's next queued */
+	if (!rq) {
+		spin_unlock_irqrestore(&t->sched_lock, state);
+		return NO_ERROR;
+	}
+
+	uint cpu = rq - run_queues;
+	bool move = !(thread_cpu_mask(t) & (1U << cpu)) && !thread_is_deadline(t);
+	if (move && thread_is_queued(t)) {
+		dequeue_ready_thread(rq, t);
+		spin_unlock(&rq->lock);
+
+		/* it may have been queued by its own cpu on the way off it */
+		thread_wait_off_cpu(t);
+		cpu = thread_enqueue(t, true);
+		spin_unlock_irqrestore(&t->sched_lock, state);
+		mp_reschedule(1U << cpu, 0);
+	} else if (move && t->state == THREAD_RUNNING) {
+		if (t == get_current_thread()) {
+			/* requeue ourselves on one of the allowed cpus */
+			t->state = THREAD_READY;
+			thread_enqueue(t, false);
+			spin_unlock(&t->sched_lock);
+			thread_resched();
+			arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+		} else {
+			spin_unlock(&rq->lock);
+			spin_unlock_irqrestore(&t->sched_lock, state);
+			mp_reschedule(1U << cpu, MP_RESCHEDULE_FLAG_REALTIME);
+		}
+	} else {
+		spin_unlock(&rq->lock);
+		spin_unlock_irqrestore(&t->sched_lock, state);
+	}
+
+	return NO_ERROR;
 }
 
 /**
@@ -270,17 +1361,17 @@ status_t thread_resume(thread_t *t)
 
 	bool resched = false;
 	bool ints_disabled = arch_ints_disabled();
-	THREAD_LOCK(state);
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&t->sched_lock, state);
 	if (t->state == THREAD_SUSPENDED) {
-		t->state = THREAD_READY;
-		insert_in_run_queue_head(t);
+		uint cpu = thread_wake(t);
 		if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
 			resched = true;
-	}
 
-	mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+		mp_reschedule(1U << cpu, 0);
+	}
 
-	THREAD_UNLOCK(state);
+	spin_unlock_irqrestore(&t->sched_lock, state);
 
 	if (resched)
 		thread_yield();
@@ -303,19 +1394,23 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
 	ASSERT(t->magic == THREAD_MAGIC);
 #endif
 
-	THREAD_LOCK(state);
+	/* the retcode wait queue lock serializes us against thread_exit and thread_detach */
+	WAIT_QUEUE_LOCK(&t->retcode_wait_queue, state);
 
 	if (t->flags & THREAD_FLAG_DETACHED) {
 		/* the thread is detached, go ahead and exit */
-		THREAD_UNLOCK(state);
+		WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
 		return ERR_THREAD_DETACHED;
 	}
 
 	/* wait for the thread to die */
 	if (t->state != THREAD_DEATH) {
 		status_t err = wait_queue_block(&t->retcode_wait_queue, timeout);
-		if (err < 0) {
-			THREAD_UNLOCK(state);
+		if (err == ERR_OBJECT_DESTROYED) {
+			WAIT_QUEUE_RESTORE(state);
+			return err;
+		} else if (err < 0) {
+			WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
 			return err;
 		}
 	}
@@ -331,20 +1426,30 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
 	if (retcode)
 		*retcode = t->retcode;
 
+	/* it's dead, but may not have finished switching away yet */
+	thread_wait_off_cpu(t);
+
 	/* remove it from the master thread list */
+	spin_lock(&thread_lock);
 	list_delete(&t->thread_list_node);
+	spin_unlock(&thread_lock);
 
 	/* clear the structure's magic */
 	t->magic = 0;
 
-	THREAD_UNLOCK(state);
+	WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
+
+	if (thread_is_poolable(t)) {
+		thread_pool_recycle(t);
+		return NO_ERROR;
+	}
 
 	/* free its stack and the thread structure itself */
 	if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
-		free(t->stack);
+		thread_stack_free(t->stack, t->stack_size, false);
 
 	if (t->flags & THREAD_FLAG_FREE_STRUCT)
-		free(t);
+		slab_free(&thread_cache, t);
 
 	return NO_ERROR;
 }
@@ -355,7 +1460,7 @@ status_t thread_detach(thread_t *t)
 	ASSERT(t->magic == THREAD_MAGIC);
 #endif
 
-	THREAD_LOCK(state);
+	WAIT_QUEUE_LOCK(&t->retcode_wait_queue, state);
 
 	/* if another thread is blocked inside thread_join() on this thread,
 	 * wake them up with a specific return code */
@@ -363,12 +1468,16 @@ status_t thread_detach(thread_t *t)
 
 	/* if it's already dead, then just do what join would have and exit */
 	if (t->state == THREAD_DEATH) {
+		spin_lock(&t->sched_lock);
 		t->flags &= ~THREAD_FLAG_DETACHED; /* makes sure thread_join continues */
-		THREAD_UNLOCK(state);
+		spin_unlock(&t->sched_lock);
+		WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
 		return thread_join(t, NULL, 0);
 	} else {
+		spin_lock(&t->sched_lock);
 		t->flags |= THREAD_FLAG_DETACHED;
-		THREAD_UNLOCK(state);
+		spin_unlock(&t->sched_lock);
+		WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
 		return NO_ERROR;
 	}
 }
@@ -392,29 +1501,58 @@ void thread_exit(int retcode)
 
 //	dprintf("thread_exit: current %p\n", current_thread);
 
-	THREAD_LOCK(state);
+#if WITH_MALLOC_THREAD_CACHE
+	malloc_thread_cache_flush();
+#endif
+
+	WAIT_QUEUE_LOCK(&current_thread->retcode_wait_queue, state);
+
+	bool detached = !!(current_thread->flags & THREAD_FLAG_DETACHED);
+	if (!detached) {
+		/* signal if anyone is waiting. they cannot get past their wait queue
+		 * lock until we're dead, nor tear us down until we've switched away */
+		wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
+	}
+
+	/* all of them, so nothing admits or changes anything of ours once we're dead */
+	spin_lock(&thread_lock);
+	spin_lock(&current_thread->sched_lock);
+	spin_lock(&run_queues[arch_curr_cpu_num()].lock);
 
 	/* enter the dead state */
 	current_thread->state = THREAD_DEATH;
 	current_thread->retcode = retcode;
 
-	/* if we're detached, then do our teardown here */
-	if (current_thread->flags & THREAD_FLAG_DETACHED) {
-		/* remove it from the master thread list */
+	if (thread_is_deadline(current_thread)) {
+		deadline_bw[current_thread->dl.cpu] -= current_thread->dl.bw;
+		current_thread->flags &= ~THREAD_FLAG_DEADLINE;
+	}
+
+	/* remove it from the master thread list */
+	if (detached)
 		list_delete(&current_thread->thread_list_node);
 
+	spin_unlock(&current_thread->sched_lock);
+	spin_unlock(&thread_lock);
+	spin_unlock(&current_thread->retcode_wait_queue.lock);
+
+	/* if we're detached, then do our teardown here */
+	if (detached) {
 		/* clear the structure's magic */
 		current_thread->magic = 0;
 
-		/* free its stack and the thread structure itself */
-		if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack)
-			heap_delayed_free(current_thread->stack);
-
-		if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-			heap_delayed_free(current_thread);
-	} else {
-		/* signal if anyone is waiting */
-		wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
+		if (thread_is_poolable(current_thread)) {
+			/* reaped once something else runs here */
+			list_add_head(&thread_pools[arch_curr_cpu_num()].dead, &current_thread->thread_list_node);
+		} else {
+			/* free its stack and the thread structure itself */
+			if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack)
+				thread_stack_free(current_thread->stack, current_thread->stack_size, true);
+
+			/* the struct stays in this cpu's magazine until we've switched away */
+			if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
+				slab_free(&thread_cache, current_thread);
+		}
 	}
 
 	/* reschedule */
@@ -425,34 +1563,105 @@ void thread_exit(int retcode)
 
 static void idle_thread_routine(void)
 {
-	for (;;)
-		arch_idle();
+	for (;;) {
+		timer_migrate_deferrable();
+		thread_pool_reap_idle();
+		cpuidle_idle();
+	}
 }
 
-static thread_t *get_top_thread(int cpu)
+/* the run queue's lock must be held and its bitmap nonzero */
+static thread_t *pop_run_queue(struct run_queue *rq)
 {
-	thread_t *newthread;
-	uint32_t local_run_queue_bitmap = run_queue_bitmap;
-	uint next_queue;
+	uint next_queue = run_queue_highest_priority(rq->bitmap);
+	thread_t *newthread = list_peek_head_type(&rq->queue[next_queue], thread_t, queue_node);
+
+	remove_from_run_queue(rq, newthread);
 
-	while (local_run_queue_bitmap) {
-		/* find the first (remaining) queue with a thread in it */
-		next_queue = HIGHEST_PRIORITY - __builtin_clz(local_run_queue_bitmap)
-			- (sizeof(run_queue_bitmap) * 8 - NUM_PRIORITIES);
+	return newthread;
+}
 
-		list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
-			if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu) {
-				list_delete(&newthread->queue_node);
+#if WITH_SMP
+/*
+ * Our run queue is empty, try to take the highest priority thread that may run
+ * here from the cpu with the deepest run queue. Threads that can only run on the
+ * victim are only ever in the victim's queue (see select_run_queue_cpu) so this
+ * is the only place that has to look past them. Our own queue's lock is held,
+ * so the victim's is only tried, or two cpus stealing from each other would
+ * deadlock.
+ */
+static thread_t *steal_thread(uint cpu)
+{
+	struct run_queue *victim = NULL;
+	uint depth = 0;
 
-				if (list_is_empty(&run_queue[next_queue]))
-					run_queue_bitmap &= ~(1<<next_queue);
+	/* unlocked, the depths are only a hint which queue to look in */
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (i == cpu)
+			continue;
+		uint count = __atomic_load_n(&run_queues[i].count, __ATOMIC_RELAXED);
+		if (count > depth) {
+			victim = &run_queues[i];
+			depth = count;
+		}
+	}
 
-				return newthread;
+	if (!victim)
+		return NULL;
+
+	thread_t *stolen = NULL;
+	if (spin_trylock(&victim->lock) != 0)
+		return NULL;
+	uint32_t bitmap = victim->bitmap;
+	while (bitmap && !stolen) {
+		uint next_queue = run_queue_highest_priority(bitmap);
+
+		thread_t *t;
+		list_for_every_entry(&victim->queue[next_queue], t, thread_t, queue_node) {
+			/* not one the victim is still switching away from */
+			if (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE))
+				continue;
+			if (thread_cpu_mask(t) & (1U << cpu)) {
+				remove_from_run_queue(victim, t);
+				/* ours before the victim's lock goes, see run_queue_lock_of */
+				t->rq_cpu = cpu;
+				THREAD_STATS_INC(steals);
+				stolen = t;
+				break;
 			}
 		}
 
-		local_run_queue_bitmap &= ~(1<<next_queue);
+		bitmap &= ~(1<<next_queue);
+	}
+	spin_unlock(&victim->lock);
+
+	return stolen;
+}
+#endif
+
+/* the cpu's run queue lock must be held */
+static thread_t *get_top_thread(int cpu)
+{
+	struct run_queue *rq = &run_queues[cpu];
+	thread_t *newthread = NULL;
+
+	if (unlikely(rq->dl_count)) {
+		/* deadline threads go ahead of every priority */
+		rq->dl_count--;
+		newthread = list_remove_head_type(&rq->dl_queue, thread_t, queue_node);
+	} else if (likely(rq->bitmap)) {
+		newthread = pop_run_queue(rq);
 	}
+
+	if (likely(newthread))
+		return newthread;
+
+#if WITH_SMP
+	newthread = steal_thread(cpu);
+	if (newthread)
+		return newthread;
+#endif
+
 	/* no threads to run, select the idle thread for this cpu */
 	return &idle_threads[cpu];
 }
@@ -464,46 +1673,78 @@ static thread_t *get_top_thread(int cpu)
  * state and queues it needs to be in. This routine simply picks the next thread and
  * switches to it.
  *
+ * Called with interrupts disabled and this cpu's run queue locked, which it
+ * drops before switching. Interrupts are still disabled when it returns.
+ *
  * This is probably not the function you're looking for. See
  * thread_yield() instead.
  */
-void thread_resched(void)
+void __HOT_TEXT thread_resched(void)
 {
 	thread_t *oldthread;
 	thread_t *newthread;
 
 	thread_t *current_thread = get_current_thread();
 	uint cpu = arch_curr_cpu_num();
+	struct run_queue *rq = &run_queues[cpu];
 
 #if THREAD_CHECKS
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(spin_lock_held(&rq->lock));
 	ASSERT(current_thread->state != THREAD_RUNNING);
+	ASSERT(current_thread->preempt_disable_count == 0);
 #endif
 
 	THREAD_STATS_INC(reschedules);
 
+	rcu_note_context_switch(cpu);
+
+	if (unlikely(thread_is_deadline(current_thread)))
+		deadline_charge(current_thread, current_time_hires());
+
 	newthread = get_top_thread(cpu);
 
 #if THREAD_CHECKS
 	ASSERT(newthread);
 #endif
 
+#if THREAD_STATS
+	sched_latency_run(cpu, newthread, rq->count);
+#endif
+
 	newthread->state = THREAD_RUNNING;
+	newthread->rq_cpu = cpu;
 
 	oldthread = current_thread;
 
-	if (newthread == oldthread)
-		return;
-
 	/* set up quantum for the new thread if it was consumed */
 	if (newthread->remaining_quantum <= 0) {
-		newthread->remaining_quantum = 5; // XXX make this smarter
+		newthread->remaining_quantum = thread_quantum(cpu, newthread);
+	}
+
+	if (unlikely(thread_is_deadline(newthread) || percpu_var_cpu(deadline_timer, cpu)->armed))
+		deadline_switch_in(cpu, newthread);
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	/* tickless: only run the preemption timer if something else wants this cpu */
+	update_preempt_timer(cpu, newthread);
+#endif
+
+	if (newthread == oldthread) {
+		spin_unlock(&rq->lock);
+		return;
 	}
 
+#if THREAD_STATS
+	if (newthread->last_cpu >= 0 && newthread->last_cpu != (int)cpu)
+		newthread->migrations++;
+#endif
+
 	/* mark the cpu ownership of the threads */
 	oldthread->curr_cpu = -1;
 	newthread->curr_cpu = cpu;
+	newthread->last_cpu = cpu;
+	newthread->on_cpu = true;
 
 	if (thread_is_idle(newthread)) {
 		mp_set_cpu_idle(cpu);
@@ -520,37 +1761,33 @@ void thread_resched(void)
 #if THREAD_STATS
 	THREAD_STATS_INC(context_switches);
 
+	lk_bigtime_t now = current_time_hires();
 	if (thread_is_idle(oldthread)) {
-		lk_bigtime_t now = current_time_hires();
-		thread_stats[cpu].idle_time += now - thread_stats[cpu].last_idle_timestamp;
+		percpu[cpu].stats.idle_time += now - percpu[cpu].stats.last_idle_timestamp;
 	}
 	if (thread_is_idle(newthread)) {
-		thread_stats[cpu].last_idle_timestamp = current_time_hires();
+		percpu[cpu].stats.last_idle_timestamp = now;
 	}
+
+	oldthread->runtime += now - oldthread->last_run_time;
+	newthread->last_run_time = now;
+	newthread->context_switches++;
 #endif
 
 	KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-	if (thread_is_real_time_or_idle(newthread)) {
-		if (!thread_is_real_time_or_idle(oldthread)) {
-			/* if we're switching from a non real time to a real time, cancel
-			 * the preemption timer. */
-#ifdef DEBUG_THREAD_CONTEXT_SWITCH
-			dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-				cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-			timer_cancel(&preempt_timer[cpu]);
-		}
-	} else if (thread_is_real_time_or_idle(oldthread)) {
-		/* if we're switching from a real time (or idle thread) to a regular one,
-		 * set up a periodic timer to run our preemption tick. */
-#ifdef DEBUG_THREAD_CONTEXT_SWITCH
-		dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-			cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-		timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
-	}
+	pmu_context_switch(oldthread, newthread);
+
+	/* done with the old thread's scheduling state, its setters may go ahead */
+	if (!thread_is_queued(oldthread))
+		__atomic_store_n(&oldthread->rq_cpu, -1, __ATOMIC_RELEASE);
+
+	rq->switch_prev = oldthread;
+	spin_unlock(&rq->lock);
+
+#if WITH_KERNEL_VM
+	if (oldthread->aspace != newthread->aspace)
+		vmm_context_switch(oldthread->aspace, newthread->aspace);
 #endif
 
 	/* set some optional target debug leds */
@@ -566,10 +1803,40 @@ void thread_resched(void)
 		newthread->priority, newthread->flags);
 #endif
 
-#ifdef WITH_LIB_UTHREAD
-	uthread_context_switch(oldthread, newthread);
-#endif
-	arch_context_switch(oldthread, newthread);
+#ifdef WITH_LIB_UTHREAD
+	uthread_context_switch(oldthread, newthread);
+#endif
+	arch_context_switch(oldthread, newthread);
+
+	thread_switch_finish();
+}
+
+/*
+ * Finish a switch on the side of the thread switched to, maybe on another cpu
+ * than the one it left. Called with interrupts disabled, from thread_resched()
+ * when it's switched back in and from the arch code before a new thread runs.
+ * The thread switched away from is now free to run elsewhere, and is queued
+ * there if it asked to move.
+ */
+void thread_switch_finish(void)
+{
+	struct run_queue *rq = &run_queues[arch_curr_cpu_num()];
+	thread_t *prev = rq->switch_prev;
+	thread_t *migrate = rq->migrate;
+
+	rq->switch_prev = NULL;
+	rq->migrate = NULL;
+
+	if (prev)
+		__atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+
+	if (unlikely(migrate)) {
+		spin_lock(&migrate->sched_lock);
+		uint cpu = run_queue_insert(migrate, rq->migrate_head);
+		spin_unlock(&migrate->sched_lock);
+
+		mp_reschedule(1U << cpu, 0);
+	}
 }
 
 /**
@@ -581,7 +1848,7 @@ void thread_resched(void)
  * This function will return at some later time. Possibly immediately if
  * no other threads are waiting to execute.
  */
-void thread_yield(void)
+void __HOT thread_yield(void)
 {
 	thread_t *current_thread = get_current_thread();
 
@@ -590,19 +1857,23 @@ void thread_yield(void)
 	ASSERT(current_thread->state == THREAD_RUNNING);
 #endif
 
-	THREAD_LOCK(state);
+	LOCAL_RUN_QUEUE_LOCK(state);
 
 	THREAD_STATS_INC(yields);
 
 	/* we are yielding the cpu, so stick ourselves into the tail of the run queue and reschedule */
 	current_thread->state = THREAD_READY;
 	current_thread->remaining_quantum = 0;
+	if (thread_is_deadline(current_thread)) {
+		/* done for this period */
+		current_thread->dl.budget = 0;
+	}
 	if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-		insert_in_run_queue_tail(current_thread);
+		thread_enqueue(current_thread, false);
 	}
 	thread_resched();
 
-	THREAD_UNLOCK(state);
+	LOCAL_RUN_QUEUE_RESTORE(state);
 }
 
 /**
@@ -620,7 +1891,7 @@ void thread_yield(void)
  * This function will return at some later time. Possibly immediately if
  * no other threads are waiting to execute.
  */
-void thread_preempt(void)
+void __HOT thread_preempt(void)
 {
 	thread_t *current_thread = get_current_thread();
 
@@ -629,6 +1900,12 @@ void thread_preempt(void)
 	ASSERT(current_thread->state == THREAD_RUNNING);
 #endif
 
+	/* hold the preemption until thread_preempt_enable() */
+	if (unlikely(current_thread->preempt_disable_count > 0)) {
+		current_thread->preempt_pending = true;
+		return;
+	}
+
 #if THREAD_STATS
 	if (!thread_is_idle(current_thread))
 		THREAD_STATS_INC(preempts); /* only track when a meaningful preempt happens */
@@ -636,19 +1913,17 @@ void thread_preempt(void)
 
 	KEVLOG_THREAD_PREEMPT(current_thread);
 
-	THREAD_LOCK(state);
+	LOCAL_RUN_QUEUE_LOCK(state);
 
-	/* we are being preempted, so we get to go back into the front of the run queue if we have quantum left */
+	/* we are being preempted, so we get to go back into the front of the run queue if we have quantum left,
+	 * to the tail of the queue if we're out of it */
 	current_thread->state = THREAD_READY;
 	if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-		if (current_thread->remaining_quantum > 0)
-			insert_in_run_queue_head(current_thread);
-		else
-			insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+		thread_enqueue(current_thread, current_thread->remaining_quantum > 0);
 	}
 	thread_resched();
 
-	THREAD_UNLOCK(state);
+	LOCAL_RUN_QUEUE_RESTORE(state);
 }
 
 /**
@@ -658,39 +1933,87 @@ void thread_preempt(void)
  * return until the thread is made runable again by some other module.
  *
  * You probably don't want to call this function directly; it's meant to be called
- * from other modules, such as mutex, which will presumably set the thread's
- * state to blocked and add it to some queue or another.
+ * from other modules, such as mutex, which will presumably add the thread to
+ * some queue or another, with interrupts disabled, before it's marked blocked here.
  */
 void thread_block(void)
 {
-#if THREAD_CHECKS
 	thread_t *current_thread = get_current_thread();
 
+#if THREAD_CHECKS
 	ASSERT(current_thread->magic == THREAD_MAGIC);
-	ASSERT(current_thread->state == THREAD_BLOCKED);
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(current_thread->state == THREAD_RUNNING);
+	ASSERT(arch_ints_disabled());
 	ASSERT(!thread_is_idle(current_thread));
 #endif
 
 	/* we are blocking on something. the blocking code should have already stuck us on a queue */
+	spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+	current_thread->state = THREAD_BLOCKED;
 	thread_resched();
 }
 
+/* t must be blocked and already off whatever it was blocked on */
 void thread_unblock(thread_t *t, bool resched)
 {
 #if THREAD_CHECKS
 	ASSERT(t->magic == THREAD_MAGIC);
 	ASSERT(t->state == THREAD_BLOCKED);
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(arch_ints_disabled());
 	ASSERT(!thread_is_idle(t));
 #endif
 
-	t->state = THREAD_READY;
-	insert_in_run_queue_head(t);
-	mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-	if (resched)
+	spin_lock(&t->sched_lock);
+	uint cpu = thread_wake(t);
+	spin_unlock(&t->sched_lock);
+	mp_reschedule(1U << cpu, 0);
+
+	if (resched) {
+		thread_t *current_thread = get_current_thread();
+
+		spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+		current_thread->state = THREAD_READY;
+		thread_enqueue(current_thread, true);
 		thread_resched();
+	}
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+static enum handler_return preempt_timer_tick(timer_t *timer, lk_time_t now, void *arg)
+{
+	return thread_timer_tick();
+}
+
+/*
+ * Start or stop this cpu's preemption timer. It is only needed when the
+ * running thread is neither real time nor idle and at least one other thread
+ * is queued here; otherwise nothing could preempt it and the tick is wasted.
+ * Called on the cpu in question with interrupts disabled.
+ */
+static void update_preempt_timer(uint cpu, thread_t *current_thread)
+{
+	struct preempt_timer_cpu *p = percpu_var_cpu(preempt_timer, cpu);
+	bool needed = !thread_is_real_time_or_idle(current_thread) && run_queues[cpu].count > 0;
+
+	if (needed == p->active)
+		return;
+
+	if (needed) {
+#ifdef DEBUG_THREAD_CONTEXT_SWITCH
+		dprintf(ALWAYS, "start preempt, cpu %d, current %p (%s)\n",
+			cpu, current_thread, current_thread->name);
+#endif
+		timer_set_periodic(&p->timer, PREEMPT_TICK_MS, preempt_timer_tick, NULL);
+	} else {
+#ifdef DEBUG_THREAD_CONTEXT_SWITCH
+		dprintf(ALWAYS, "stop preempt, cpu %d, current %p (%s)\n",
+			cpu, current_thread, current_thread->name);
+#endif
+		timer_cancel(&p->timer);
+	}
+	p->active = needed;
 }
+#endif
 
 enum handler_return thread_timer_tick(void)
 {
@@ -717,12 +2040,15 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
 	ASSERT(t->state == THREAD_SLEEPING);
 #endif
 
-	THREAD_LOCK(state);
-
-	t->state = THREAD_READY;
-	insert_in_run_queue_head(t);
+	spin_lock(&t->sched_lock);
+	uint cpu = thread_wake(t);
+	spin_unlock(&t->sched_lock);
 
-	THREAD_UNLOCK(state);
+	if (cpu != arch_curr_cpu_num()) {
+		/* it landed on another cpu, poke that one instead of ourselves */
+		mp_reschedule(1U << cpu, 0);
+		return INT_NO_RESCHEDULE;
+	}
 
 	return INT_RESCHEDULE;
 }
@@ -738,6 +2064,23 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
  * be placed at the head of the run queue.
  */
 void thread_sleep(lk_time_t delay)
+{
+	thread_sleep_etc(delay * 1000ULL, THREAD_TIMER_SLACK_US);
+}
+
+/**
+ * @brief  Put thread to sleep; delay specified in us
+ *
+ * Same as thread_sleep(), but with a us delay. Sleeps shorter than 1ms are
+ * only honored on platforms with PLATFORM_HAS_DYNAMIC_TIMER, elsewhere the
+ * wakeup happens on the next timer tick.
+ */
+void thread_sleep_hires(lk_bigtime_t delay)
+{
+	thread_sleep_etc(delay, 0);
+}
+
+static void thread_sleep_etc(lk_bigtime_t delay, lk_bigtime_t slack)
 {
 	timer_t timer;
 
@@ -750,12 +2093,14 @@ void thread_sleep(lk_time_t delay)
 #endif
 
 	timer_initialize(&timer);
+	timer_set_slack(&timer, slack);
 
-	THREAD_LOCK(state);
-	timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
+	/* asleep before the timer can see us */
+	LOCAL_RUN_QUEUE_LOCK(state);
 	current_thread->state = THREAD_SLEEPING;
+	timer_set_oneshot_hires(&timer, delay, thread_sleep_handler, (void *)current_thread);
 	thread_resched();
-	THREAD_UNLOCK(state);
+	LOCAL_RUN_QUEUE_RESTORE(state);
 }
 
 /**
@@ -769,9 +2114,16 @@ void thread_init_early(void)
 
 	DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
-	/* initialize the run queues */
-	for (i=0; i < NUM_PRIORITIES; i++)
-		list_initialize(&run_queue[i]);
+	/* initialize the run queues and per cpu state */
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		spin_lock_init(&run_queues[cpu].lock);
+		for (i=0; i < NUM_PRIORITIES; i++)
+			list_initialize(&run_queues[cpu].queue[i]);
+		list_initialize(&run_queues[cpu].dl_queue);
+		list_initialize(&thread_pools[cpu].free);
+		list_initialize(&thread_pools[cpu].dead);
+		percpu[cpu].cpu_num = cpu;
+	}
 
 	/* initialize the thread list */
 	list_initialize(&thread_list);
@@ -781,10 +2133,12 @@ void thread_init_early(void)
 	init_thread_struct(t, "bootstrap");
 
 	/* half construct this thread, since we're already running */
-	t->priority = HIGHEST_PRIORITY;
+	t->priority = t->base_priority = HIGHEST_PRIORITY;
 	t->state = THREAD_RUNNING;
 	t->flags = THREAD_FLAG_DETACHED;
 	t->curr_cpu = 0;
+	t->rq_cpu = 0;
+	t->on_cpu = true;
 	t->pinned_cpu = 0;
 	wait_queue_init(&t->retcode_wait_queue);
 	list_add_head(&thread_list, &t->thread_list_node);
@@ -798,9 +2152,13 @@ void thread_init_early(void)
  */
 void thread_init(void)
 {
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		timer_initialize(&percpu_var_cpu(deadline_timer, i)->timer);
+	}
+	shrinker_register(&thread_shrinker);
 #if PLATFORM_HAS_DYNAMIC_TIMER
 	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-		timer_initialize(&preempt_timer[i]);
+		timer_initialize(&percpu_var_cpu(preempt_timer, i)->timer);
 	}
 #endif
 }
@@ -823,19 +2181,77 @@ void thread_set_priority(int priority)
 {
 	thread_t *current_thread = get_current_thread();
 
-	THREAD_LOCK(state);
-
 	if (priority <= IDLE_PRIORITY)
 		priority = IDLE_PRIORITY + 1;
 	if (priority > HIGHEST_PRIORITY)
 		priority = HIGHEST_PRIORITY;
-	current_thread->priority = priority;
+
+	/* the mutex code may be changing what we inherit meanwhile */
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&current_thread->sched_lock, state);
+	spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+
+	current_thread->base_priority = priority;
+	current_thread->priority = MAX(priority, current_thread->inherited_priority);
+	spin_unlock(&current_thread->sched_lock);
 
 	current_thread->state = THREAD_READY;
-	insert_in_run_queue_head(current_thread);
+	thread_enqueue(current_thread, true);
 	thread_resched();
 
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/**
+ * @brief Set the priority a thread inherits from the waiters on its mutexes
+ *
+ * The thread runs at the higher of its base priority and \a priority. Pass -1
+ * to drop any inherited priority. Used by the mutex code, thread_lock must be
+ * held.
+ */
+void thread_set_inherited_priority_locked(thread_t *t, int priority)
+{
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+	ASSERT(spin_lock_held(&thread_lock));
+#endif
+
+	spin_lock(&t->sched_lock);
+
+	t->inherited_priority = priority;
+
+	int effective = MAX(t->base_priority, priority);
+	if (effective == t->priority) {
+		spin_unlock(&t->sched_lock);
+		return;
+	}
+
+	if (t->blocking_wait_queue) {
+		/* keep the wait queue it's in sorted, which thread_lock alone allows */
+		wait_queue_remove(t->blocking_wait_queue, t);
+		t->priority = effective;
+		wait_queue_insert(t->blocking_wait_queue, t);
+		spin_unlock(&t->sched_lock);
+		return;
+	}
+
+	struct run_queue *rq = run_queue_lock_of(t);
+	if (rq && thread_is_queued(t) && !thread_is_deadline(t)) {
+		/* requeue it at the new priority in the same queue, the deadline queue doesn't care */
+		remove_from_run_queue(rq, t);
+		t->priority = effective;
+		list_add_tail(&rq->queue[t->priority], &t->queue_node);
+		rq->bitmap |= (1<<t->priority);
+		rq->count++;
+		spin_unlock(&rq->lock);
+		mp_reschedule(1U << (rq - run_queues), 0);
+	} else {
+		t->priority = effective;
+		if (rq)
+			spin_unlock(&rq->lock);
+	}
+
+	spin_unlock(&t->sched_lock);
 }
 
 /**
@@ -856,7 +2272,7 @@ void thread_become_idle(void)
 	thread_set_name(name);
 
 	/* mark ourself as idle */
-	t->priority = IDLE_PRIORITY;
+	t->priority = t->base_priority = IDLE_PRIORITY;
 	t->flags |= THREAD_FLAG_IDLE;
 	t->pinned_cpu = arch_curr_cpu_num();
 
@@ -886,10 +2302,12 @@ void thread_secondary_cpu_init_early(void)
 	t->pinned_cpu = cpu;
 
 	/* half construct this thread, since we're already running */
-	t->priority = HIGHEST_PRIORITY;
+	t->priority = t->base_priority = HIGHEST_PRIORITY;
 	t->state = THREAD_RUNNING;
 	t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
 	t->curr_cpu = cpu;
+	t->rq_cpu = cpu;
+	t->on_cpu = true;
 	t->pinned_cpu = cpu;
 	wait_queue_init(&t->retcode_wait_queue);
 
@@ -905,7 +2323,7 @@ void thread_secondary_cpu_entry(void)
 {
 	uint cpu = arch_curr_cpu_num();
 	thread_t *t = get_current_thread();
-	t->priority = IDLE_PRIORITY;
+	t->priority = t->base_priority = IDLE_PRIORITY;
 
 	mp_set_curr_cpu_active(true);
 	mp_set_cpu_idle(cpu);
@@ -917,7 +2335,7 @@ void thread_secondary_cpu_entry(void)
 	idle_thread_routine();
 }
 
-static const char *thread_state_to_str(enum thread_state state)
+const char *thread_state_to_str(enum thread_state state)
 {
 	switch (state) {
 		case THREAD_SUSPENDED: return "susp";
@@ -936,11 +2354,20 @@ static const char *thread_state_to_str(enum thread_state state)
 void dump_thread(thread_t *t)
 {
 	dprintf(INFO, "dump_thread: t %p (%s)\n", t, t->name);
-	dprintf(INFO, "\tstate %s, curr_cpu %d, pinned_cpu %d, priority %d, remaining quantum %d\n",
-				  thread_state_to_str(t->state), t->curr_cpu, t->pinned_cpu, t->priority, t->remaining_quantum);
+	dprintf(INFO, "\tstate %s, curr_cpu %d, last_cpu %d, pinned_cpu %d, affinity 0x%x, priority %d (base %d), remaining quantum %d\n",
+				  thread_state_to_str(t->state), t->curr_cpu, t->last_cpu, t->pinned_cpu, t->affinity, t->priority, t->base_priority, t->remaining_quantum);
 	dprintf(INFO, "\tstack %p, stack_size %zd\n", t->stack, t->stack_size);
 	dprintf(INFO, "\tentry %p, arg %p, flags 0x%x\n", t->entry, t->arg, t->flags);
 	dprintf(INFO, "\twait queue %p, wait queue ret %d\n", t->blocking_wait_queue, t->wait_queue_block_ret);
+	if (thread_is_deadline(t)) {
+		dprintf(INFO, "\tdeadline: runtime %llu deadline %llu period %llu us, cpu %d, budget %llu us, abs deadline %llu%s\n",
+					  t->dl.params.runtime, t->dl.params.deadline, t->dl.params.period, t->dl.cpu,
+					  t->dl.budget, t->dl.abs_deadline, t->dl.throttled ? ", throttled" : "");
+	}
+#if THREAD_STATS
+	dprintf(INFO, "\truntime %llu us, context switches %lu, migrations %lu\n",
+				  t->runtime, t->context_switches, t->migrations);
+#endif
 #if (MAX_TLS_ENTRY > 0)
 	dprintf(INFO, "\ttls:");
 	int i;
@@ -966,6 +2393,41 @@ void dump_all_threads(void)
 	THREAD_UNLOCK(state);
 }
 
+/* for crash dumps, the thread lock may be held by whoever panicked */
+void dump_all_threads_unlocked(void)
+{
+	thread_t *t;
+
+	list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+		dump_thread(t);
+	}
+}
+
+void thread_for_each(void (*cb)(thread_t *t, void *arg), void *arg)
+{
+	thread_t *t;
+
+	THREAD_LOCK(state);
+	list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+		cb(t, arg);
+	}
+	THREAD_UNLOCK(state);
+}
+
+void thread_snapshot(thread_t *t, void (*cb)(thread_t *t, void *arg), void *arg)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&t->sched_lock, state);
+
+	/* once it's off its queue the switch away from it is done with it too */
+	struct run_queue *rq = run_queue_lock_of(t);
+	cb(t, arg);
+	if (rq)
+		spin_unlock(&rq->lock);
+
+	spin_unlock_irqrestore(&t->sched_lock, state);
+}
+
 /** @} */
 
 
@@ -978,32 +2440,117 @@ void wait_queue_init(wait_queue_t *wait)
 	*wait = (wait_queue_t)WAIT_QUEUE_INITIAL_VALUE(*wait);
 }
 
+/* make sure the bitmap is large enough to cover our number of priorities */
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(((wait_queue_t *)0)->bitmap) * 8);
+
+/*
+ * Waiters are kept highest priority first and fifo within a priority, so a
+ * wakeup always takes the head. The bitmap has a bit for each priority with a
+ * waiter, which lets a thread that isn't above everyone already queued go
+ * straight to the tail and one above everyone go straight to the head.
+ *
+ * The list and bitmap are only changed with thread_lock held, so thread_lock
+ * alone is enough to walk the list or requeue a waiter, as is a waiter's
+ * blocking_wait_queue. The count is left to the callers, it's read with just
+ * the wait queue's lock.
+ */
+static void wait_queue_insert(wait_queue_t *wait, thread_t *t)
+{
+	uint32_t below = wait->bitmap & ((1U << t->priority) - 1);
+
+	if (below == 0) {
+		list_add_tail(&wait->list, &t->queue_node);
+	} else if (below == wait->bitmap) {
+		list_add_head(&wait->list, &t->queue_node);
+	} else {
+		/* go in front of the first waiter of lower priority */
+		thread_t *entry;
+		list_for_every_entry(&wait->list, entry, thread_t, queue_node) {
+			if (entry->priority < t->priority) {
+				list_add_before(&entry->queue_node, &t->queue_node);
+				break;
+			}
+		}
+	}
+
+	wait->bitmap |= 1U << t->priority;
+}
+
+static void wait_queue_remove(wait_queue_t *wait, thread_t *t)
+{
+	/* waiters of one priority are next to each other */
+	thread_t *prev = list_prev_type(&wait->list, &t->queue_node, thread_t, queue_node);
+	thread_t *next = list_next_type(&wait->list, &t->queue_node, thread_t, queue_node);
+
+	if ((!prev || prev->priority != t->priority) && (!next || next->priority != t->priority))
+		wait->bitmap &= ~(1U << t->priority);
+
+	list_delete(&t->queue_node);
+}
+
 static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t now, void *arg)
 {
 	thread_t *thread = (thread_t *)arg;
+	wait_queue_t *wait;
 
 #if THREAD_CHECKS
 	ASSERT(thread->magic == THREAD_MAGIC);
 #endif
 
+	/*
+	 * The wait queue lock nests outside thread_lock, but we only learn which
+	 * wait queue the thread is in by looking at it under thread_lock. Since the
+	 * thread's blocking_wait_queue only changes with both locks held, trylock the
+	 * queue and back off on failure; the thread cannot leave the queue (and the
+	 * queue cannot go away) while we hold thread_lock and see it blocked there,
+	 * nor once we hold the queue's lock.
+	 */
 	spin_lock(&thread_lock);
+	for (;;) {
+		wait = thread->blocking_wait_queue;
+		if (wait == NULL) {
+			/* beaten to it by a wakeup */
+			spin_unlock(&thread_lock);
+			return INT_NO_RESCHEDULE;
+		}
+
+		if (spin_trylock(&wait->lock) == 0)
+			break;
+
+		spin_unlock(&thread_lock);
+		spin_lock(&thread_lock);
+	}
+	spin_unlock(&thread_lock);
 
 	enum handler_return ret = INT_NO_RESCHEDULE;
 	if (thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT) >= NO_ERROR) {
 		ret = INT_RESCHEDULE;
 	}
 
-	spin_unlock(&thread_lock);
+	spin_unlock(&wait->lock);
 
 	return ret;
 }
 
+/*
+ * Drop the wait queue lock and switch away, then reacquire it once we're running
+ * again. The current thread is already ready or queued. For wakers, which still
+ * own the queue. Waiters don't retake the lock of a destroyed queue.
+ */
+static void wait_queue_resched(wait_queue_t *wait)
+{
+	spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+	spin_unlock(&wait->lock);
+	thread_resched();
+	spin_lock(&wait->lock);
+}
+
 /**
  * @brief  Block until a wait queue is notified.
  *
- * This function puts the current thread at the end of a wait
- * queue and then blocks until some other thread wakes the queue
- * up again.
+ * This function puts the current thread in a wait queue, behind
+ * the threads of the same or higher priority already there, and
+ * then blocks until some other thread wakes the queue up again.
  *
  * @param  wait     The wait queue to enter
  * @param  timeout  The maximum time, in ms, to wait
@@ -1013,10 +2560,34 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
  * waits indefinitely.  Otherwise, this function returns with
  * ERR_TIMED_OUT at the end of the timeout period.
  *
+ * The wait queue's lock must be held on entry. It is dropped while the
+ * thread is blocked and is held again on return, unless the queue was
+ * destroyed. Whoever destroyed it may have freed it already, so then only
+ * the interrupt state is left for the caller to restore.
+ *
  * @return ERR_TIMED_OUT on timeout, else returns the return
  * value specified when the queue was woken by wait_queue_wake_one().
  */
-status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
+status_t __HOT wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
+{
+	if (timeout == INFINITE_TIME)
+		return wait_queue_block_etc(wait, INFINITE_TIME_HIRES, 0);
+
+	return wait_queue_block_etc(wait, timeout * 1000ULL, THREAD_TIMER_SLACK_US);
+}
+
+/**
+ * @brief  Block until a wait queue is notified, timeout specified in us
+ *
+ * Same as wait_queue_block(), but the timeout is in us and
+ * INFINITE_TIME_HIRES waits indefinitely.
+ */
+status_t __HOT wait_queue_block_hires(wait_queue_t *wait, lk_bigtime_t timeout)
+{
+	return wait_queue_block_etc(wait, timeout, 0);
+}
+
+static status_t __HOT wait_queue_block_etc(wait_queue_t *wait, lk_bigtime_t timeout, lk_bigtime_t slack)
 {
 	timer_t timer;
 
@@ -1026,156 +2597,172 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
 	ASSERT(current_thread->state == THREAD_RUNNING);
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(spin_lock_held(&wait->lock));
 #endif
 
-	if (timeout == 0)
+	if (unlikely(timeout == 0))
 		return ERR_TIMED_OUT;
 
-	list_add_tail(&wait->list, &current_thread->queue_node);
-	wait->count++;
-	current_thread->state = THREAD_BLOCKED;
+	spin_lock(&thread_lock);
+	wait_queue_insert(wait, current_thread);
 	current_thread->blocking_wait_queue = wait;
+	spin_unlock(&thread_lock);
+
+	wait->count++;
 	current_thread->wait_queue_block_ret = NO_ERROR;
 
 	/* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
-	if (timeout != INFINITE_TIME) {
+	if (timeout != INFINITE_TIME_HIRES) {
 		timer_initialize(&timer);
-		timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
+		timer_set_slack(&timer, slack);
+		timer_set_oneshot_hires(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
 	}
 
+	/* wakers can't see us in the queue until we let go of its lock, blocked by then */
+	spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+	current_thread->state = THREAD_BLOCKED;
+	spin_unlock(&wait->lock);
 	thread_resched();
 
 	/* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
-	if (timeout != INFINITE_TIME) {
+	if (timeout != INFINITE_TIME_HIRES) {
 		timer_cancel(&timer);
 	}
 
-	return current_thread->wait_queue_block_ret;
+	status_t ret = current_thread->wait_queue_block_ret;
+	if (likely(ret != ERR_OBJECT_DESTROYED))
+		spin_lock(&wait->lock);
+
+	return ret;
 }
 
 /**
  * @brief  Wake up one thread sleeping on a wait queue
  *
- * This function removes one thread (if any) from the head of the wait queue and
- * makes it executable.  The new thread will be placed at the head of the
- * run queue.
+ * This function removes the highest priority thread (if any) from the wait
+ * queue and makes it executable.  The new thread will be placed at the head
+ * of the run queue.
  *
  * @param wait  The wait queue to wake
  * @param reschedule  If true, the newly-woken thread will run immediately.
  * @param wait_queue_error  The return value which the new thread will receive
  * from wait_queue_block().
  *
+ * The wait queue's lock must be held. If reschedule is set it is dropped
+ * while other threads run and is held again on return.
+ *
  * @return  The number of threads woken (zero or one)
  */
-int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
+int __HOT wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
 {
-	thread_t *t;
-	int ret = 0;
-
-	thread_t *current_thread = get_current_thread();
-
-#if THREAD_CHECKS
-	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
-	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
-#endif
-
-	t = list_remove_head_type(&wait->list, thread_t, queue_node);
-	if (t) {
-		wait->count--;
-#if THREAD_CHECKS
-		ASSERT(t->state == THREAD_BLOCKED);
-#endif
-		t->state = THREAD_READY;
-		t->wait_queue_block_ret = wait_queue_error;
-		t->blocking_wait_queue = NULL;
-
-		/* if we're instructed to reschedule, stick the current thread on the head
-		 * of the run queue first, so that the newly awakened thread gets a chance to run
-		 * before the current one, but the current one doesn't get unnecessarilly punished.
-		 */
-		if (reschedule) {
-			current_thread->state = THREAD_READY;
-			insert_in_run_queue_head(current_thread);
-		}
-		insert_in_run_queue_head(t);
-		mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-		if (reschedule) {
-			thread_resched();
-		}
-		ret = 1;
-
-	}
-
-	return ret;
+	return wait_queue_wake_n(wait, 1, reschedule, wait_queue_error);
 }
 
-
 /**
- * @brief  Wake all threads sleeping on a wait queue
+ * @brief  Wake up to a number of threads sleeping on a wait queue
  *
- * This function removes all threads (if any) from the wait queue and
- * makes them executable.  The new threads will be placed at the head of the
- * run queue.
+ * This function removes up to count threads from the wait queue, highest
+ * priority first, and makes them executable.  The new threads will be placed
+ * at the head of the run queue.
+ *
+ * For when the caller knows how many waiters can make progress, so the rest
+ * aren't woken just to block again.
  *
  * @param wait  The wait queue to wake
+ * @param count  The most threads to wake
  * @param reschedule  If true, the newly-woken threads will run immediately.
- * @param wait_queue_error  The return value which the new thread will receive
+ * @param wait_queue_error  The return value which the new threads will receive
  * from wait_queue_block().
  *
- * @return  The number of threads woken (zero or one)
+ * The wait queue's lock must be held. If reschedule is set it is dropped
+ * while other threads run and is held again on return.
+ *
+ * @return  The number of threads woken
  */
-int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
+int __HOT wait_queue_wake_n(wait_queue_t *wait, int count, bool reschedule, status_t wait_queue_error)
 {
 	thread_t *t;
 	int ret = 0;
+	mp_cpu_mask_t cpus = 0;
 
 	thread_t *current_thread = get_current_thread();
 
 #if THREAD_CHECKS
 	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(spin_lock_held(&wait->lock));
 #endif
 
-	if (reschedule && wait->count > 0) {
+	if (wait->count == 0 || count <= 0)
+		return 0;
+
+	if (reschedule) {
 		/* if we're instructed to reschedule, stick the current thread on the head
 		 * of the run queue first, so that the newly awakened threads get a chance to run
 		 * before the current one, but the current one doesn't get unnecessarilly punished.
 		 */
+		struct run_queue *rq = &run_queues[arch_curr_cpu_num()];
+
+		spin_lock(&rq->lock);
 		current_thread->state = THREAD_READY;
-		insert_in_run_queue_head(current_thread);
+		thread_enqueue(current_thread, true);
+		spin_unlock(&rq->lock);
 	}
 
-	/* pop all the threads off the wait queue into the run queue */
-	while ((t = list_remove_head_type(&wait->list, thread_t, queue_node))) {
+	/* pop threads off the front of the wait queue. they stay blocked, off the
+	 * list, until they're put in a run queue below */
+	struct list_node woken = LIST_INITIAL_VALUE(woken);
+
+	spin_lock(&thread_lock);
+	while (ret < count && (t = list_peek_head_type(&wait->list, thread_t, queue_node))) {
+		wait_queue_remove(wait, t);
 		wait->count--;
 #if THREAD_CHECKS
 		ASSERT(t->state == THREAD_BLOCKED);
 #endif
-		t->state = THREAD_READY;
 		t->wait_queue_block_ret = wait_queue_error;
 		t->blocking_wait_queue = NULL;
 
-		insert_in_run_queue_head(t);
+		list_add_tail(&woken, &t->queue_node);
 		ret++;
 	}
+	spin_unlock(&thread_lock);
 
-#if THREAD_CHECKS
-	ASSERT(wait->count == 0);
-#endif
-
-	if (ret > 0) {
-		mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-		if (reschedule) {
-			thread_resched();
-		}
+	while ((t = list_remove_head_type(&woken, thread_t, queue_node))) {
+		spin_lock(&t->sched_lock);
+		cpus |= 1U << thread_wake(t);
+		spin_unlock(&t->sched_lock);
 	}
 
+	mp_reschedule(cpus, 0);
+	if (reschedule)
+		wait_queue_resched(wait);
+
 	return ret;
 }
 
+/**
+ * @brief  Wake all threads sleeping on a wait queue
+ *
+ * This function removes all threads (if any) from the wait queue and
+ * makes them executable.  The new threads will be placed at the head of the
+ * run queue.
+ *
+ * @param wait  The wait queue to wake
+ * @param reschedule  If true, the newly-woken threads will run immediately.
+ * @param wait_queue_error  The return value which the new thread will receive
+ * from wait_queue_block().
+ *
+ * The wait queue's lock must be held. If reschedule is set it is dropped
+ * while other threads run and is held again on return.
+ *
+ * @return  The number of threads woken
+ */
+int __HOT wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
+{
+	return wait_queue_wake_n(wait, wait->count, reschedule, wait_queue_error);
+}
+
 /**
  * @brief  Free all resources allocated in wait_queue_init()
  *
@@ -1186,9 +2773,11 @@ void wait_queue_destroy(wait_queue_t *wait, bool reschedule)
 #if THREAD_CHECKS
 	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(spin_lock_held(&wait->lock));
 #endif
 	wait_queue_wake_all(wait, reschedule, ERR_OBJECT_DESTROYED);
+	if (wait->pollers)
+		wait_queue_poll_detach(wait);
 	wait->magic = 0;
 }
 
@@ -1202,6 +2791,8 @@ void wait_queue_destroy(wait_queue_t *wait, bool reschedule)
  * @param wait_queue_error  The return value which the new thread will receive
  *   from wait_queue_block().
  *
+ * The lock of the wait queue the thread is blocked in must be held.
+ *
  * @return ERR_NOT_BLOCKED if thread was not in any wait queue.
  */
 status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
@@ -1209,25 +2800,34 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
 #if THREAD_CHECKS
 	ASSERT(t->magic == THREAD_MAGIC);
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
 #endif
 
-	if (t->state != THREAD_BLOCKED)
+	spin_lock(&thread_lock);
+
+	wait_queue_t *wait = t->blocking_wait_queue;
+	if (wait == NULL) {
+		spin_unlock(&thread_lock);
 		return ERR_NOT_BLOCKED;
+	}
 
 #if THREAD_CHECKS
-	ASSERT(t->blocking_wait_queue != NULL);
-	ASSERT(t->blocking_wait_queue->magic == WAIT_QUEUE_MAGIC);
+	ASSERT(t->state == THREAD_BLOCKED);
+	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
+	ASSERT(spin_lock_held(&wait->lock));
 	ASSERT(list_in_list(&t->queue_node));
 #endif
 
-	list_delete(&t->queue_node);
-	t->blocking_wait_queue->count--;
+	wait_queue_remove(wait, t);
+	wait->count--;
 	t->blocking_wait_queue = NULL;
-	t->state = THREAD_READY;
 	t->wait_queue_block_ret = wait_queue_error;
-	insert_in_run_queue_head(t);
-	mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+
+	spin_unlock(&thread_lock);
+
+	spin_lock(&t->sched_lock);
+	uint cpu = thread_wake(t);
+	spin_unlock(&t->sched_lock);
+	mp_reschedule(1U << cpu, 0);
 
 	return NO_ERROR;
 }
@@ -32,30 +32,290 @@
  *
  * Timer callback functions are called in interrupt context.
  *
+ * Deadlines are tracked in us against current_time_hires(). The ms
+ * interfaces are thin wrappers around the _hires ones.
+ *
+ * Each cpu has its own queue and lock. A timer belongs to the cpu whose
+ * queue it was last put on, and that cpu's lock protects it, including
+ * after it fires. Moving a timer to another cpu takes both cpus' locks,
+ * lowest numbered first.
+ *
  * @{
  */
 #include <debug.h>
 #include <trace.h>
 #include <assert.h>
+#include <err.h>
 #include <list.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
 #include <kernel/spinlock.h>
+#include <kernel/mp.h>
 #include <platform/timer.h>
 #include <platform.h>
 
 #define LOCAL_TRACE 0
 
-spin_lock_t timer_lock;
+/* period of the tick without PLATFORM_HAS_DYNAMIC_TIMER */
+#define TIMER_TICK_MS 10
+
+static enum handler_return timer_tick(void *arg, lk_time_t now);
+
+/* the latest the timer may fire; the queues are ordered by this */
+static inline lk_bigtime_t timer_expire_time(const timer_t *timer)
+{
+	return timer->scheduled_time + timer->slack;
+}
 
 struct timer_state {
+	spin_lock_t lock;
+#if KERNEL_TIMER_HEAP
+	timer_t *root;
+#else
 	struct list_node timer_queue;
+#endif
+	uint deferrable; /* queued timers with TIMER_FLAG_DEFERRABLE */
+#if WITH_SMP && PLATFORM_HAS_DYNAMIC_TIMER
+	mp_call_t kick; /* reprograms the hardware after a remote insert */
+#endif
 } __CPU_ALIGN;
 
-static struct timer_state timers[SMP_MAX_CPUS];
+static struct timer_state timers[SMP_MAX_CPUS] __FAST_BSS;
 
-static enum handler_return timer_tick(void *arg, lk_time_t now);
+#if KERNEL_TIMER_HEAP
+/*
+ * Each cpu's pending timers are kept in a pairing heap ordered by deadline.
+ * Insert is O(1), removing the head or an arbitrary timer is O(log n)
+ * amortized.
+ */
+
+/* merge two detached heaps, returning the new root */
+static timer_t *timer_heap_merge(timer_t *a, timer_t *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	/* on a tie the existing root wins, keeping equal deadlines roughly fifo */
+	if (timer_expire_time(b) < timer_expire_time(a)) {
+		timer_t *temp = a;
+		a = b;
+		b = temp;
+	}
+
+	/* b becomes the leftmost child of a */
+	b->heap_prev = a;
+	b->heap_next = a->heap_child;
+	if (a->heap_child)
+		a->heap_child->heap_prev = b;
+	a->heap_child = b;
+
+	return a;
+}
+
+/* standard two pass merge of a list of siblings into a single heap */
+static timer_t *timer_heap_merge_pairs(timer_t *first)
+{
+	timer_t *pairs = NULL;
+
+	/* merge left to right in pairs, stacking the results up in reverse order */
+	while (first) {
+		timer_t *a = first;
+		timer_t *b = a->heap_next;
+
+		first = b ? b->heap_next : NULL;
+
+		a->heap_next = a->heap_prev = NULL;
+		if (b) {
+			b->heap_next = b->heap_prev = NULL;
+			a = timer_heap_merge(a, b);
+		}
+
+		a->heap_next = pairs;
+		pairs = a;
+	}
+
+	/* then fold the stack right to left */
+	timer_t *root = NULL;
+	while (pairs) {
+		timer_t *next = pairs->heap_next;
+
+		pairs->heap_next = NULL;
+		root = timer_heap_merge(pairs, root);
+		pairs = next;
+	}
+
+	return root;
+}
+
+static void timer_queue_init(uint cpu)
+{
+	timers[cpu].root = NULL;
+}
+
+static inline timer_t *timer_queue_peek(uint cpu)
+{
+	return timers[cpu].root;
+}
+
+static void timer_queue_insert(uint cpu, timer_t *timer)
+{
+	timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+	timers[cpu].root = timer_heap_merge(timers[cpu].root, timer);
+}
+
+static void timer_queue_remove(uint cpu, timer_t *timer)
+{
+	timer_t *children = timer->heap_child;
+
+	if (timer == timers[cpu].root) {
+		timers[cpu].root = timer_heap_merge_pairs(children);
+	} else {
+		/* cut the timer's subtree out of its sibling list */
+		if (timer->heap_prev->heap_child == timer)
+			timer->heap_prev->heap_child = timer->heap_next;
+		else
+			timer->heap_prev->heap_next = timer->heap_next;
+		if (timer->heap_next)
+			timer->heap_next->heap_prev = timer->heap_prev;
+
+		timers[cpu].root = timer_heap_merge(timers[cpu].root, timer_heap_merge_pairs(children));
+	}
+
+	timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+}
+
+/* preorder walk of the heap without a stack */
+static timer_t *timer_heap_walk_next(timer_t *timer)
+{
+	if (timer->heap_child)
+		return timer->heap_child;
+
+	while (timer) {
+		if (timer->heap_next)
+			return timer->heap_next;
+
+		/* back up to the leftmost sibling, whose prev is the parent */
+		while (timer->heap_prev && timer->heap_prev->heap_child != timer)
+			timer = timer->heap_prev;
+		timer = timer->heap_prev;
+	}
+
+	return NULL;
+}
+
+static timer_t *timer_queue_find_deferrable(uint cpu)
+{
+	for (timer_t *timer = timers[cpu].root; timer; timer = timer_heap_walk_next(timer)) {
+		if (timer->flags & TIMER_FLAG_DEFERRABLE)
+			return timer;
+	}
+
+	return NULL;
+}
+
+#else
+/* Each cpu's pending timers are kept in a list sorted by deadline. */
+
+static void timer_queue_init(uint cpu)
+{
+	list_initialize(&timers[cpu].timer_queue);
+}
+
+static inline timer_t *timer_queue_peek(uint cpu)
+{
+	return list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+}
+
+static void timer_queue_insert(uint cpu, timer_t *timer)
+{
+	timer_t *entry;
+
+	list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
+		if (timer_expire_time(entry) > timer_expire_time(timer)) {
+			list_add_before(&entry->node, &timer->node);
+			return;
+		}
+	}
+
+	/* walked off the end of the list */
+	list_add_tail(&timers[cpu].timer_queue, &timer->node);
+}
+
+static void timer_queue_remove(uint cpu, timer_t *timer)
+{
+	list_delete(&timer->node);
+}
+
+static timer_t *timer_queue_find_deferrable(uint cpu)
+{
+	timer_t *timer;
+
+	list_for_every_entry(&timers[cpu].timer_queue, timer, timer_t, node) {
+		if (timer->flags & TIMER_FLAG_DEFERRABLE)
+			return timer;
+	}
+
+	return NULL;
+}
+#endif
+
+static inline bool timer_queued(const timer_t *timer)
+{
+	return timer->queued;
+}
+
+static void timer_lock_pair(uint a, uint b)
+{
+	if (SMP_MAX_CPUS == 1 || a == b) {
+		spin_lock(&timers[a].lock);
+	} else if (a < b) {
+		spin_lock(&timers[a].lock);
+		spin_lock(&timers[b].lock);
+	} else {
+		spin_lock(&timers[b].lock);
+		spin_lock(&timers[a].lock);
+	}
+}
+
+static void timer_unlock_pair(uint a, uint b)
+{
+	spin_unlock(&timers[a].lock);
+	if (SMP_MAX_CPUS > 1 && a != b)
+		spin_unlock(&timers[b].lock);
+}
+
+/* lock the cpu that owns the timer, -1 if it has never been set. Interrupts
+ * must be disabled. The owner can change until we hold its lock. */
+static int timer_lock_owner(timer_t *timer)
+{
+	for (;;) {
+		int owner = *(volatile int *)&timer->cpu;
+		if (owner < 0)
+			return -1;
+
+		spin_lock(&timers[owner].lock);
+		if (timer->cpu == owner)
+			return owner;
+		spin_unlock(&timers[owner].lock);
+	}
+}
+
+/* same, but also lock cpu, which the timer is about to be moved to */
+static int timer_lock_owner_and(timer_t *timer, uint cpu)
+{
+	for (;;) {
+		int owner = *(volatile int *)&timer->cpu;
+		uint first = (owner < 0) ? cpu : (uint)owner;
+
+		timer_lock_pair(first, cpu);
+		if (timer->cpu == owner)
+			return owner;
+		timer_unlock_pair(first, cpu);
+	}
+}
 
 /**
  * @brief  Initialize a timer object
@@ -67,58 +327,122 @@ void timer_initialize(timer_t *timer)
 
 static void insert_timer_in_queue(uint cpu, timer_t *timer)
 {
-	timer_t *entry;
+	DEBUG_ASSERT(arch_ints_disabled());
 
+	LTRACEF("timer %p, cpu %u, scheduled %llu, periodic %llu\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+
+	timer_queue_insert(cpu, timer);
+	timer->cpu = cpu;
+	timer->queued = true;
+	if (timer->flags & TIMER_FLAG_DEFERRABLE)
+		timers[cpu].deferrable++;
+}
+
+/* the timer stays owned by its cpu once it's off the queue */
+static void remove_timer_from_queue(timer_t *timer)
+{
 	DEBUG_ASSERT(arch_ints_disabled());
+	DEBUG_ASSERT(timer_queued(timer));
+
+	timer_queue_remove(timer->cpu, timer);
+	timer->queued = false;
+	if (timer->flags & TIMER_FLAG_DEFERRABLE)
+		timers[timer->cpu].deferrable--;
+}
 
-	LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* program the hardware for the head of the queue, which must not be empty */
+static void timer_program(uint cpu, lk_bigtime_t now)
+{
+	timer_t *timer = timer_queue_peek(cpu);
+	lk_bigtime_t delay;
 
-	list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-		if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-			list_add_before(&entry->node, &timer->node);
-			return;
-		}
+	DEBUG_ASSERT(timer);
+
+	if (timer_expire_time(timer) <= now)
+		delay = 0;
+	else
+		delay = timer_expire_time(timer) - now;
+
+	LTRACEF("setting new timer for %llu usecs for event %p\n", delay, timer);
+	platform_set_oneshot_timer_hires(timer_tick, NULL, delay);
+}
+
+/* fallback for platforms that can only program the hardware in ms */
+__WEAK status_t platform_set_oneshot_timer_hires(platform_timer_callback callback, void *arg, lk_bigtime_t interval)
+{
+	lk_bigtime_t msecs = (interval + 999) / 1000;
+
+	return platform_set_oneshot_timer(callback, arg, (msecs > INFINITE_TIME) ? INFINITE_TIME : msecs);
+}
+
+#if WITH_SMP
+static void timer_kick_task(void *arg)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	spin_lock(&timers[cpu].lock);
+	if (timer_queue_peek(cpu))
+		timer_program(cpu, current_time_hires());
+	spin_unlock(&timers[cpu].lock);
+}
+#endif
+#endif
+
+/* the head of cpu's queue changed, called with its lock held */
+static void timer_head_changed(uint cpu, lk_bigtime_t now)
+{
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	if (cpu == arch_curr_cpu_num()) {
+		timer_program(cpu, now);
+		return;
 	}
 
-	/* walked off the end of the list */
-	list_add_tail(&timers[cpu].timer_queue, &timer->node);
+#if WITH_SMP
+	/* only that cpu can program its hardware. if a kick is already in
+	 * flight it'll pick up the new head when it runs */
+	if (mp_async_done(&timers[cpu].kick))
+		mp_async_exec(&timers[cpu].kick, 1U << cpu, timer_kick_task, NULL);
+#endif
+#endif
 }
 
-static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
+/* target -1 queues it on the calling cpu */
+static void timer_set(timer_t *timer, int target, lk_bigtime_t delay, lk_bigtime_t period, timer_callback callback, void *arg)
 {
-	lk_time_t now;
+	lk_bigtime_t now;
 
-	LTRACEF("timer %p, delay %u, period %u, callback %p, arg %p\n", timer, delay, period, callback, arg);
+	LTRACEF("timer %p, cpu %d, delay %llu, period %llu, callback %p, arg %p\n", timer, target, delay, period, callback, arg);
 
 	DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
-	if (list_in_list(&timer->node)) {
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	uint cpu = (target < 0) ? arch_curr_cpu_num() : (uint)target;
+	int owner = timer_lock_owner_and(timer, cpu);
+
+	if (timer_queued(timer)) {
 		panic("timer %p already in list\n", timer);
 	}
 
-	now = current_time();
+	now = current_time_hires();
 	timer->scheduled_time = now + delay;
 	timer->periodic_time = period;
 	timer->callback = callback;
 	timer->arg = arg;
 
-	LTRACEF("scheduled time %u\n", timer->scheduled_time);
-
-	spin_lock_saved_state_t state;
-	spin_lock_irqsave(&timer_lock, state);
+	LTRACEF("scheduled time %llu\n", timer->scheduled_time);
 
-	uint cpu = arch_curr_cpu_num();
 	insert_timer_in_queue(cpu, timer);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-	if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
+	if (timer_queue_peek(cpu) == timer) {
 		/* we just modified the head of the timer queue */
-		LTRACEF("setting new timer for %u msecs\n", delay);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+		timer_head_changed(cpu, now);
 	}
-#endif
 
-	spin_unlock_irqrestore(&timer_lock, state);
+	timer_unlock_pair((owner < 0) ? cpu : (uint)owner, cpu);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 /**
@@ -139,7 +463,20 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
 {
 	if (delay == 0)
 		delay = 1;
-	timer_set(timer, delay, 0, callback, arg);
+	timer_set(timer, -1, delay * 1000ULL, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once, delay specified in us
+ *
+ * Same as timer_set_oneshot(), but with a us delay. The deadline is only
+ * honored to better than 1ms on platforms with PLATFORM_HAS_DYNAMIC_TIMER.
+ */
+void timer_set_oneshot_hires(timer_t *timer, lk_bigtime_t delay, timer_callback callback, void *arg)
+{
+	if (delay == 0)
+		delay = 1;
+	timer_set(timer, -1, delay, 0, callback, arg);
 }
 
 /**
@@ -160,7 +497,73 @@ void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callbac
 {
 	if (period == 0)
 		period = 1;
-	timer_set(timer, period, period, callback, arg);
+	timer_set(timer, -1, period * 1000ULL, period * 1000ULL, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes repeatedly, period specified in us
+ */
+void timer_set_periodic_hires(timer_t *timer, lk_bigtime_t period, timer_callback callback, void *arg)
+{
+	if (period == 0)
+		period = 1;
+	timer_set(timer, -1, period, period, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer on a specific cpu
+ *
+ * The callback runs on that cpu. delay and period are in us, a period of
+ * 0 makes it a oneshot. Deferrable timers may still be moved off the cpu
+ * while it idles.
+ *
+ * @return ERR_INVALID_ARGS if there's no such cpu, ERR_NOT_READY if it
+ * isn't running.
+ */
+status_t timer_set_on_cpu(timer_t *timer, uint cpu, lk_bigtime_t delay, lk_bigtime_t period, timer_callback callback, void *arg)
+{
+	if (cpu >= SMP_MAX_CPUS)
+		return ERR_INVALID_ARGS;
+	if (!(mp.active_cpus & (1U << cpu)) && cpu != arch_curr_cpu_num())
+		return ERR_NOT_READY;
+
+	if (delay == 0)
+		delay = 1;
+	timer_set(timer, cpu, delay, period, callback, arg);
+
+	return NO_ERROR;
+}
+
+/**
+ * @brief  Set how late, in us, a timer may fire
+ *
+ * Timers with slack may be batched together with other timers into a single
+ * hardware timer interrupt. The timer must not be pending.
+ */
+void timer_set_slack(timer_t *timer, lk_bigtime_t slack)
+{
+	DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+	DEBUG_ASSERT(!timer_queued(timer));
+
+	timer->slack = slack;
+}
+
+/**
+ * @brief  Mark a timer as deferrable
+ *
+ * A deferrable timer doesn't need to run on the cpu that set it. When that
+ * cpu goes idle its deferrable timers are moved to a busy cpu rather than
+ * waking it back up, if there is one. The timer must not be pending.
+ */
+void timer_set_deferrable(timer_t *timer, bool deferrable)
+{
+	DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+	DEBUG_ASSERT(!timer_queued(timer));
+
+	if (deferrable)
+		timer->flags |= TIMER_FLAG_DEFERRABLE;
+	else
+		timer->flags &= ~TIMER_FLAG_DEFERRABLE;
 }
 
 /**
@@ -171,16 +574,22 @@ void timer_cancel(timer_t *timer)
 	DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
 	spin_lock_saved_state_t state;
-	spin_lock_irqsave(&timer_lock, state);
-
-#if PLATFORM_HAS_DYNAMIC_TIMER
-	uint cpu = arch_curr_cpu_num();
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	int cpu = timer_lock_owner(timer);
+	if (cpu < 0) {
+		/* never been set, so there's nothing to race with */
+		timer->periodic_time = 0;
+		timer->callback = NULL;
+		timer->arg = NULL;
+		arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+		return;
+	}
 
-	timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-#endif
+	timer_t *oldhead = timer_queue_peek(cpu);
 
-	if (list_in_list(&timer->node))
-		list_delete(&timer->node);
+	if (timer_queued(timer))
+		remove_timer_from_queue(timer);
 
 	/* to keep it from being reinserted into the queue if called from
 	 * periodic timer callback.
@@ -190,30 +599,102 @@ void timer_cancel(timer_t *timer)
 	timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	/* see if we've just modified the head of the timer queue */
-	timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-	if (newhead == NULL) {
-		LTRACEF("clearing old hw timer, nothing in the queue\n");
-		platform_stop_timer();
-	} else if (newhead != oldhead) {
-		lk_time_t delay;
-		lk_time_t now = current_time();
+	/* see if we've just modified the head of the timer queue. a remote cpu
+	 * just takes one early interrupt and reprograms itself */
+	if ((uint)cpu == arch_curr_cpu_num()) {
+		timer_t *newhead = timer_queue_peek(cpu);
+		if (newhead == NULL) {
+			LTRACEF("clearing old hw timer, nothing in the queue\n");
+			platform_stop_timer();
+		} else if (newhead != oldhead) {
+			timer_program(cpu, current_time_hires());
+		}
+	}
+#endif
 
-		if (TIME_LT(newhead->scheduled_time, now))
-			delay = 0;
-		else
-			delay = newhead->scheduled_time - now;
+	spin_unlock(&timers[cpu].lock);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/**
+ * @brief  Move this cpu's deferrable timers to a busy cpu
+ *
+ * Called by the idle thread before it idles. Isolated cpus are never picked.
+ * If every other cpu is idle too the timers stay where they are.
+ */
+void timer_migrate_deferrable(void)
+{
+	if (SMP_MAX_CPUS == 1)
+		return;
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	uint cpu = arch_curr_cpu_num();
+	if (timers[cpu].deferrable == 0)
+		goto out;
 
-		LTRACEF("setting new timer to %u\n", (uint) delay);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+	/* the idle mask is only a hint without the thread lock, which is fine,
+	 * a cpu that just went idle will pass the timers on again */
+	mp_cpu_mask_t busy = mp.active_cpus & ~mp_get_idle_mask() & ~mp_get_isolated_mask() & ~(1U << cpu);
+	busy &= MP_CPU_MASK_ALL;
+	if (!busy)
+		goto out;
+
+	uint target = __builtin_ctz(busy);
+
+	timer_lock_pair(cpu, target);
+
+	timer_t *oldhead = timer_queue_peek(cpu);
+	timer_t *oldtarget = timer_queue_peek(target);
+	timer_t *timer;
+	while ((timer = timer_queue_find_deferrable(cpu))) {
+		remove_timer_from_queue(timer);
+		insert_timer_in_queue(target, timer);
 	}
+
+	lk_bigtime_t now = current_time_hires();
+	if (timer_queue_peek(target) != oldtarget)
+		timer_head_changed(target, now);
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	timer_t *newhead = timer_queue_peek(cpu);
+	if (newhead == NULL)
+		platform_stop_timer();
+	else if (newhead != oldhead)
+		timer_program(cpu, now);
+#else
+	(void)oldhead;
 #endif
 
-	spin_unlock_irqrestore(&timer_lock, state);
+	timer_unlock_pair(cpu, target);
+
+out:
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+lk_bigtime_t timer_next_deadline(void)
+{
+	DEBUG_ASSERT(arch_ints_disabled());
+
+	uint cpu = arch_curr_cpu_num();
+	lk_bigtime_t deadline = TIMER_NO_DEADLINE;
+
+	spin_lock(&timers[cpu].lock);
+	timer_t *timer = timer_queue_peek(cpu);
+	if (timer)
+		deadline = timer_expire_time(timer);
+	spin_unlock(&timers[cpu].lock);
+
+#if !PLATFORM_HAS_DYNAMIC_TIMER
+	deadline = MIN(deadline, current_time_hires() + TIMER_TICK_MS * 1000ULL);
+#endif
+
+	return deadline;
 }
 
 /* called at interrupt time to process any pending timers */
-static enum handler_return timer_tick(void *arg, lk_time_t now)
+static enum handler_return __HOT_TEXT timer_tick(void *arg, lk_time_t now)
 {
 	timer_t *timer;
 	enum handler_return ret = INT_NO_RESCHEDULE;
@@ -224,31 +705,34 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 //	KEVLOG_TIMER_TICK(); // enable only if necessary
 
 	uint cpu = arch_curr_cpu_num();
+	lk_bigtime_t now_hires = current_time_hires();
 
-	LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
+	LTRACEF("cpu %u now %u (%llu), sp %p\n", cpu, now, now_hires, __GET_FRAME());
 
-	spin_lock(&timer_lock);
+	spin_lock(&timers[cpu].lock);
 
 	for (;;) {
 		/* see if there's an event to process */
-		timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+		timer = timer_queue_peek(cpu);
 		if (likely(timer == 0))
 			break;
-		LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-		if (likely(TIME_LT(now, timer->scheduled_time)))
+		LTRACEF("next item on timer queue %p at %llu now %llu (%p, arg %p)\n", timer, timer->scheduled_time, now_hires, timer->callback, timer->arg);
+		if (likely(now_hires < timer->scheduled_time))
 			break;
 
 		/* process it */
 		LTRACEF("timer %p\n", timer);
 		DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-		list_delete(&timer->node);
+		remove_timer_from_queue(timer);
 
 		/* we pulled it off the list, release the list lock to handle it */
-		spin_unlock(&timer_lock);
+		spin_unlock(&timers[cpu].lock);
 
-		LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+		LTRACEF("dequeued timer %p, scheduled %llu periodic %llu\n", timer, timer->scheduled_time, timer->periodic_time);
 
 		THREAD_STATS_INC(timers);
+		if (timer_expire_time(timer) > now_hires)
+			THREAD_STATS_INC(timers_coalesced);
 
 		bool periodic = timer->periodic_time > 0;
 
@@ -258,36 +742,33 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 			ret = INT_RESCHEDULE;
 
 		/* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-		spin_lock(&timer_lock);
+		spin_lock(&timers[cpu].lock);
 
-		/* if it was a periodic timer and it hasn't been requeued
-		 * by the callback put it back in the list
+		/* if it was a periodic timer and it hasn't been requeued or moved
+		 * to another cpu by the callback put it back in the list
 		 */
-		if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-			LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-			timer->scheduled_time = now + timer->periodic_time;
+		if (periodic && !timer_queued(timer) && timer->periodic_time > 0 && timer->cpu == (int)cpu) {
+			LTRACEF("periodic timer, period %llu\n", timer->periodic_time);
+			timer->scheduled_time = now_hires + timer->periodic_time;
 			insert_timer_in_queue(cpu, timer);
 		}
 	}
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 	/* reset the timer to the next event */
-	timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+	timer = timer_queue_peek(cpu);
 	if (timer) {
 		/* has to be the case or it would have fired already */
-		DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-		lk_time_t delay = timer->scheduled_time - now;
+		DEBUG_ASSERT(timer->scheduled_time > now_hires);
 
-		LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+		timer_program(cpu, now_hires);
 	}
 
 	/* we're done manipulating the timer queue */
-	spin_unlock(&timer_lock);
+	spin_unlock(&timers[cpu].lock);
 #else
 	/* release the timer lock before calling the tick handler */
-	spin_unlock(&timer_lock);
+	spin_unlock(&timers[cpu].lock);
 
 	/* let the scheduler have a shot to do quantum expiration, etc */
 	/* in case of dynamic timer, the scheduler will set up a periodic timer */
@@ -300,13 +781,13 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
 void timer_init(void)
 {
-	timer_lock = SPIN_LOCK_INITIAL_VALUE;
 	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-		list_initialize(&timers[i].timer_queue);
+		spin_lock_init(&timers[i].lock);
+		timer_queue_init(i);
 	}
 #if !PLATFORM_HAS_DYNAMIC_TIMER
 	/* register for a periodic timer tick */
-	platform_set_periodic_timer(timer_tick, NULL, 10); /* 10ms */
+	platform_set_periodic_timer(timer_tick, NULL, TIMER_TICK_MS);
 #endif
 }
 
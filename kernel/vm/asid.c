@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <trace.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/asid.h>
+
+#if ARCH_HAS_ASPACE
+
+#define LOCAL_TRACE 0
+
+#define BITS_PER_WORD (sizeof(unsigned long) * 8)
+
+static inline uint64_t asid_mask(const asid_allocator_t *a)
+{
+    return (1ULL << a->bits) - 1;
+}
+
+static inline bool asid_current(const asid_allocator_t *a, uint64_t asid)
+{
+    return !((asid ^ __atomic_load_n(&a->generation, __ATOMIC_RELAXED)) >> a->bits);
+}
+
+static inline bool map_test_and_set(unsigned long *map, uint64_t id)
+{
+    unsigned long bit = 1UL << (id % BITS_PER_WORD);
+    bool was_set = map[id / BITS_PER_WORD] & bit;
+
+    map[id / BITS_PER_WORD] |= bit;
+    return was_set;
+}
+
+/* first clear bit at or past start, or the map size if there isn't one */
+static uint64_t map_find_clear(const unsigned long *map, uint64_t start, uint64_t size)
+{
+    for (uint64_t i = start; i < size; ) {
+        unsigned long word = ~map[i / BITS_PER_WORD] >> (i % BITS_PER_WORD);
+        if (word)
+            return MIN(i + __builtin_ctzl(word), size);
+        i = ROUNDDOWN(i, BITS_PER_WORD) + BITS_PER_WORD;
+    }
+    return size;
+}
+
+/* start a new generation, keeping the ids the cpus are on */
+static void asid_rollover(asid_allocator_t *a)
+{
+    memset(a->map, 0, ASID_MAP_WORDS(a->bits) * sizeof(unsigned long));
+    map_test_and_set(a->map, 0);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        uint64_t asid = __atomic_exchange_n(&a->active[cpu], 0, __ATOMIC_RELAXED);
+
+        /* a cpu that hasn't switched since the previous rollover is still on its reserved id */
+        if (asid == 0)
+            asid = a->reserved[cpu];
+        map_test_and_set(a->map, asid & asid_mask(a));
+        a->reserved[cpu] = asid;
+    }
+
+    a->flush_pending = MP_CPU_MASK_ALL;
+    a->generation += 1ULL << a->bits;
+
+    LTRACEF("generation 0x%llx\n", (unsigned long long)a->generation);
+}
+
+/* move the reserved copies of asid into the current generation, if a cpu has one */
+static bool asid_update_reserved(asid_allocator_t *a, uint64_t asid, uint64_t new_asid)
+{
+    bool hit = false;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (a->reserved[cpu] == asid) {
+            a->reserved[cpu] = new_asid;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+static uint64_t asid_new(asid_allocator_t *a, uint64_t asid)
+{
+    uint64_t size = 1ULL << a->bits;
+    uint64_t id;
+
+    if (asid) {
+        uint64_t new_asid = a->generation | (asid & asid_mask(a));
+
+        /* a cpu was still running it at the rollover, it carried over */
+        if (asid_update_reserved(a, asid, new_asid))
+            return new_asid;
+
+        /* or nobody has taken the old number in this generation yet */
+        if (!map_test_and_set(a->map, new_asid & asid_mask(a)))
+            return new_asid;
+    }
+
+    id = map_find_clear(a->map, a->next, size);
+    if (id == size) {
+        asid_rollover(a);
+        id = map_find_clear(a->map, 1, size);
+        /* there are more ids than cpus holding ones over */
+        DEBUG_ASSERT(id != size);
+    }
+
+    map_test_and_set(a->map, id);
+    a->next = id + 1;
+    return a->generation | id;
+}
+
+uint asid_switch(asid_allocator_t *a, uint64_t *aspace_asid, uint cpu, bool *flush)
+{
+    uint64_t asid = __atomic_load_n(aspace_asid, __ATOMIC_RELAXED);
+    uint64_t old_active = __atomic_load_n(&a->active[cpu], __ATOMIC_RELAXED);
+
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    *flush = false;
+
+    /*
+     * The id is from this generation and no rollover has zeroed this cpu's
+     * active slot since the last switch. If one gets in between the two, the
+     * exchange fails and the slow path sorts it out.
+     */
+    if (old_active && asid_current(a, asid) &&
+        __atomic_compare_exchange_n(&a->active[cpu], &old_active, asid, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return asid & asid_mask(a);
+
+    spin_lock(&a->lock);
+
+    asid = __atomic_load_n(aspace_asid, __ATOMIC_RELAXED);
+    if (!asid_current(a, asid)) {
+        asid = asid_new(a, asid);
+        __atomic_store_n(aspace_asid, asid, __ATOMIC_RELAXED);
+    }
+
+    if (a->flush_pending & (1U << cpu)) {
+        a->flush_pending &= ~(1U << cpu);
+        *flush = true;
+    }
+
+    __atomic_store_n(&a->active[cpu], asid, __ATOMIC_RELAXED);
+
+    spin_unlock(&a->lock);
+
+    return asid & asid_mask(a);
+}
+
+#endif // ARCH_HAS_ASPACE
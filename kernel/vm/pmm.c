@@ -31,13 +31,66 @@
 #include <string.h>
 #include <pow2.h>
 #include <lib/console.h>
+#include <arch/ops.h>
+#include <kernel/mp.h>
 #include <kernel/mutex.h>
+#include <kernel/shrinker.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
 
 #define LOCAL_TRACE 0
 
+/* per cpu page cache sizing: pages moved to or from the arenas at a time, and
+ * the most pages a cpu may hold */
+#ifndef PMM_CACHE_BATCH
+#define PMM_CACHE_BATCH 16
+#endif
+#ifndef PMM_CACHE_DEPTH
+#define PMM_CACHE_DEPTH 64
+#endif
+
+STATIC_ASSERT(PMM_CACHE_BATCH > 0 && PMM_CACHE_BATCH <= PMM_CACHE_DEPTH);
+
+/* how many free pages the background thread keeps zeroed, 0 to disable it */
+#ifndef PMM_ZERO_POOL_PAGES
+#define PMM_ZERO_POOL_PAGES 1024
+#endif
+
+/* free pages below which the caches are shrunk in the background, back up to
+ * twice as many. 0 leaves them alone until an allocation fails */
+#ifndef PMM_LOW_WATERMARK
+#define PMM_LOW_WATERMARK 256
+#endif
+
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
+/* single pages are allocated and freed through a per cpu cache, only touched
+ * by its own cpu with interrupts disabled. pages in the cache are marked
+ * allocated as far as the arenas are concerned, so an allocation that comes up
+ * short has them drained back, through the shrinker or pmm_cache_drain().
+ */
+struct pmm_cache {
+    uint count;
+    vm_page_t *pages[PMM_CACHE_DEPTH];
+
+    /* stats */
+    ulong hits;
+    ulong refills;
+    ulong drains;
+} __CPU_ALIGN;
+
+static struct pmm_cache pmm_cache[SMP_MAX_CPUS];
+
+static size_t pmm_cache_drain(void);
+
+/* free pages flagged VM_PAGE_FLAG_ZEROED, protected by lock */
+static size_t zeroed_free_count;
+
+/* numa node of each cpu, only ever a hint so read unlocked */
+static uint cpu_node[SMP_MAX_CPUS];
+
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
      ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
@@ -53,6 +106,202 @@ static inline bool page_is_free(const vm_page_t *page)
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+static inline bool arena_is_cma(const pmm_arena_t *a)
+{
+    return a->flags & PMM_ARENA_FLAG_CMA;
+}
+
+#define PMM_ALLOC_PLACEMENT_FLAGS (PMM_ALLOC_FLAG_LOCAL | PMM_ALLOC_FLAG_FAST | PMM_ALLOC_FLAG_BULK)
+#define ARENA_RANKS 4
+
+/* how far an arena is from the placement asked for, 0 being a match. the
+ * arenas are tried a rank at a time, and the wrong kind of memory counts for
+ * more than the wrong node.
+ */
+static uint arena_rank(const pmm_arena_t *a, uint flags, uint local)
+{
+    bool fast = a->flags & PMM_ARENA_FLAG_FAST;
+    uint rank = 0;
+
+    if (((flags & PMM_ALLOC_FLAG_FAST) && !fast) || ((flags & PMM_ALLOC_FLAG_BULK) && fast))
+        rank += 2;
+    if ((flags & PMM_ALLOC_FLAG_LOCAL) && a->node_id != local)
+        rank += 1;
+
+    return rank;
+}
+
+/* without placement flags every arena is rank 0, one pass will do */
+static inline uint arena_ranks(uint flags)
+{
+    return (flags & PMM_ALLOC_PLACEMENT_FLAGS) ? ARENA_RANKS : 1;
+}
+
+static inline uint curr_cpu_node(void)
+{
+    return cpu_node[arch_curr_cpu_num()];
+}
+
+/*
+ * Buddy allocator.
+ *
+ * The free pages of each arena are kept as naturally aligned blocks of
+ * 1 << order pages, queued by their first page on free_list[order]. Blocks
+ * are aligned on their physical page number rather than their index in the
+ * arena, so a block of order n is always aligned to PAGE_SIZE << n.
+ *
+ * A free page that heads a block is in a free list and records the order, the
+ * other pages of a free block have a cleared list node. Allocated pages are
+ * marked VM_PAGE_FLAG_NONFREE and belong to the caller's list.
+ */
+static inline size_t arena_page_count(const pmm_arena_t *a)
+{
+    return a->size / PAGE_SIZE;
+}
+
+static inline bool page_is_free_head(vm_page_t *page)
+{
+    return page_is_free(page) && list_in_list(&page->node);
+}
+
+/* physical page number of the page at index in the arena */
+static inline size_t arena_pfn(const pmm_arena_t *a, size_t index)
+{
+    return a->base / PAGE_SIZE + index;
+}
+
+/* queue the free block at index without trying to merge it */
+static void buddy_queue(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(order <= PMM_MAX_ORDER);
+    DEBUG_ASSERT((arena_pfn(a, index) & ((1UL << order) - 1)) == 0);
+
+    page->order = order;
+    list_add_head(&a->free_list[order], &page->node);
+}
+
+/* free the block at index, merging it with its buddy for as long as that is free too */
+static void buddy_free(pmm_arena_t *a, size_t index, uint order)
+{
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = (arena_pfn(a, index) ^ (1UL << order)) - arena_pfn(a, 0);
+
+        /* a buddy before the start of the arena wraps to a large index */
+        if (buddy >= arena_page_count(a))
+            break;
+
+        vm_page_t *page = &a->page_array[buddy];
+        if (!page_is_free_head(page) || page->order != order)
+            break;
+
+        list_delete(&page->node);
+        index = MIN(index, buddy);
+        order++;
+    }
+
+    buddy_queue(a, index, order);
+}
+
+/* release a run of pages that are already marked free, as the largest aligned blocks that fit */
+static void buddy_free_range(pmm_arena_t *a, size_t index, size_t end)
+{
+    while (index < end) {
+        uint order = 0;
+        while (order < PMM_MAX_ORDER &&
+                (arena_pfn(a, index) & ((2UL << order) - 1)) == 0 &&
+                index + (2UL << order) <= end)
+            order++;
+
+        buddy_free(a, index, order);
+        index += 1UL << order;
+    }
+}
+
+/* pull a block of at least the requested order off the free lists, splitting
+ * a larger one if need be. returns the index of the block or -1.
+ */
+static ssize_t buddy_alloc(pmm_arena_t *a, uint order)
+{
+    for (uint o = order; o <= PMM_MAX_ORDER; o++) {
+        vm_page_t *page = list_remove_head_type(&a->free_list[o], vm_page_t, node);
+        if (!page)
+            continue;
+
+        size_t index = page - a->page_array;
+
+        /* give back the upper halves we don't need */
+        while (o > order) {
+            o--;
+            buddy_queue(a, index + (1UL << o), o);
+        }
+
+        return index;
+    }
+
+    return -1;
+}
+
+/* carve the single free page at index out of the free block that contains it */
+static void buddy_alloc_page(pmm_arena_t *a, size_t index)
+{
+    size_t head = index;
+    uint order;
+
+    DEBUG_ASSERT(page_is_free(&a->page_array[index]));
+
+    /* find the head of the containing block, aligned down at each order in turn */
+    for (order = 0; order <= PMM_MAX_ORDER; order++) {
+        head = (arena_pfn(a, index) & ~((1UL << order) - 1)) - arena_pfn(a, 0);
+        DEBUG_ASSERT(head < arena_page_count(a));
+
+        vm_page_t *page = &a->page_array[head];
+        if (page_is_free_head(page) && page->order >= order) {
+            order = page->order;
+            break;
+        }
+    }
+    DEBUG_ASSERT(order <= PMM_MAX_ORDER);
+
+    list_delete(&a->page_array[head].node);
+
+    /* split it down, requeueing the halves that don't hold the page */
+    while (order > 0) {
+        order--;
+        size_t half = 1UL << order;
+        if (index < head + half) {
+            buddy_queue(a, head + half, order);
+        } else {
+            buddy_queue(a, head, order);
+            head += half;
+        }
+    }
+
+    DEBUG_ASSERT(head == index);
+}
+
+/* mark a run of pages allocated, appending them to the list if one is passed */
+static void mark_pages_allocated(pmm_arena_t *a, size_t index, size_t count, struct list_node *list)
+{
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+
+        DEBUG_ASSERT(page_is_free(p));
+
+        /* the flag is left for the allocator to see and cleared when the page is freed */
+        if (p->flags & VM_PAGE_FLAG_ZEROED)
+            zeroed_free_count--;
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+        if (list)
+            list_add_tail(list, &p->node);
+        else
+            list_clear_node(&p->node);
+    }
+    a->free_count -= count;
+}
+
 paddr_t page_to_address(const vm_page_t *page)
 {
     pmm_arena_t *a;
@@ -100,7 +349,9 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    arena->zero_cursor = 0;
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_list[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -108,65 +359,224 @@ done_add:
 
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
+    if (arena_is_cma(arena)) {
+        /* contiguous runs are carved out of it through the kernel mapping */
+        DEBUG_ASSERT(arena->flags & PMM_ARENA_FLAG_KMAP);
+        for (size_t i = 0; i < page_count; i++)
+            arena->page_array[i].flags = VM_PAGE_FLAG_CMA;
+    }
+
+    /* hand them all to the buddy allocator */
+    buddy_free_range(arena, 0, page_count);
+    arena->free_count = page_count;
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
+    return NO_ERROR;
+}
 
-        list_add_tail(&arena->free_list, &p->node);
+/* allocate single pages out of the arenas of a rank that are or aren't CMA. lock held */
+static uint alloc_pages_from(bool cma, uint rank, uint count, struct list_node *list, uint flags)
+{
+    uint page_flags = (flags & PMM_ALLOC_FLAG_MOVABLE) ? VM_PAGE_FLAG_MOVABLE : 0;
+    uint local = curr_cpu_node();
+    uint allocated = 0;
 
-        arena->free_count++;
+    /* walk the arenas in order, allocating as many pages as we can from each */
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (arena_is_cma(a) != cma || arena_rank(a, flags, local) != rank)
+            continue;
+
+        while (allocated < count) {
+            ssize_t index = buddy_alloc(a, 0);
+            if (index < 0)
+                break;
+
+            mark_pages_allocated(a, index, 1, list);
+            a->page_array[index].flags |= page_flags;
+
+            allocated++;
+        }
     }
 
-    return NO_ERROR;
+    return allocated;
 }
 
-size_t pmm_alloc_pages(uint count, struct list_node *list)
+void pmm_set_cpu_node(uint cpu, uint node)
 {
-    LTRACEF("count %u\n", count);
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
 
-    /* list must be initialized prior to calling this */
-    DEBUG_ASSERT(list);
+    if (cpu < SMP_MAX_CPUS)
+        cpu_node[cpu] = node;
+}
 
-    uint allocated = 0;
-    if (count == 0)
-        return 0;
+status_t pmm_get_node_stats(uint node, pmm_node_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
 
     mutex_acquire(&lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
+        if (a->node_id != node)
+            continue;
+
+        stats->arenas++;
+        stats->total_pages += arena_page_count(a);
+        stats->free_pages += a->free_count;
+        if (a->flags & PMM_ARENA_FLAG_FAST)
+            stats->fast_free_pages += a->free_count;
+    }
 
-            a->free_count--;
+    mutex_release(&lock);
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+    return stats->arenas ? NO_ERROR : ERR_NOT_FOUND;
+}
 
-            allocated++;
+status_t pmm_for_each_used_range_unlocked(pmm_used_range_func_t func, void *arg)
+{
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        size_t count = arena_page_count(a);
+        for (size_t i = 0; i < count; ) {
+            if (page_is_free(&a->page_array[i])) {
+                i++;
+                continue;
+            }
+
+            size_t start = i;
+            while (i < count && !page_is_free(&a->page_array[i]))
+                i++;
+
+            paddr_t pa = a->base + start * PAGE_SIZE;
+            status_t err = func(pa, paddr_to_kvaddr(pa), (i - start) * PAGE_SIZE, arg);
+            if (err < 0)
+                return err;
         }
     }
 
-done:
+    return NO_ERROR;
+}
+
+/* kick the background shrinker once free memory dips under the low watermark. lock held */
+static void check_watermark(void)
+{
+#if PMM_LOW_WATERMARK > 0
+    size_t free = 0;
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node)
+        free += a->free_count;
+
+    if (free < PMM_LOW_WATERMARK)
+        shrink_caches_async((2 * PMM_LOW_WATERMARK - free) * PAGE_SIZE);
+#endif
+}
+
+/* an allocation from the fast arenas failing says nothing about the rest of memory */
+static inline bool may_shrink(uint flags)
+{
+    return !(flags & PMM_ALLOC_FLAG_FAST);
+}
+
+static uint alloc_pages_ranked(uint count, struct list_node *list, uint flags)
+{
+    uint allocated = 0;
+
+    mutex_acquire(&lock);
+
+    for (uint rank = 0; rank < arena_ranks(flags) && allocated < count; rank++) {
+        /* movable pages use up the CMA arenas first, leaving the rest for pages that can't be moved */
+        if (flags & PMM_ALLOC_FLAG_MOVABLE)
+            allocated += alloc_pages_from(true, rank, count - allocated, list, flags);
+        allocated += alloc_pages_from(false, rank, count - allocated, list, flags);
+    }
+
+    check_watermark();
+
     mutex_release(&lock);
     return allocated;
 }
 
-size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
+static size_t pmm_alloc_pages_uncached(uint count, struct list_node *list, uint flags)
 {
-    LTRACEF("address 0x%lx, count %u\n", address, count);
+    uint allocated = alloc_pages_ranked(count, list, flags);
+
+    /* out of pages, have the caches give some back and try once more */
+    if (allocated < count && may_shrink(flags) &&
+            shrink_caches((size_t)(count - allocated) * PAGE_SIZE, SHRINK_ALLOC_FAILED) > 0)
+        allocated += alloc_pages_ranked(count - allocated, list, flags);
 
+    return allocated;
+}
+
+vm_page_t *pmm_alloc_page(void)
+{
+    spin_lock_saved_state_t state;
+    struct pmm_cache *c;
+    vm_page_t *page;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    c = &pmm_cache[arch_curr_cpu_num()];
+    if (likely(c->count > 0)) {
+        page = c->pages[--c->count];
+        c->hits++;
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return page;
+    }
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* empty, refill from the arenas, near this cpu where there's a choice. we
+     * may have moved cpus by the time we get back */
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    if (pmm_alloc_pages_uncached(PMM_CACHE_BATCH, &list, PMM_ALLOC_FLAG_LOCAL) == 0)
+        return NULL;
+
+    page = list_remove_head_type(&list, vm_page_t, node);
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    c = &pmm_cache[arch_curr_cpu_num()];
+    c->refills++;
+    while (c->count < PMM_CACHE_DEPTH && !list_is_empty(&list))
+        c->pages[c->count++] = list_remove_head_type(&list, vm_page_t, node);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* someone else filled it meanwhile */
+    if (!list_is_empty(&list))
+        pmm_free(&list);
+
+    return page;
+}
+
+size_t pmm_alloc_pages_etc(uint count, struct list_node *list, uint flags)
+{
+    LTRACEF("count %u, flags 0x%x\n", count, flags);
+
+    /* list must be initialized prior to calling this */
     DEBUG_ASSERT(list);
 
-    uint allocated = 0;
     if (count == 0)
         return 0;
 
-    address = ROUNDDOWN(address, PAGE_SIZE);
+    /* the cache only holds pages that can't be lent out of a CMA arena, from
+     * the local node and of whatever kind */
+    if (count == 1 && !(flags & (PMM_ALLOC_FLAG_MOVABLE | PMM_ALLOC_FLAG_FAST | PMM_ALLOC_FLAG_BULK))) {
+        vm_page_t *page = pmm_alloc_page();
+        if (!page)
+            return 0;
+
+        list_add_tail(list, &page->node);
+        return 1;
+    }
+
+    return pmm_alloc_pages_uncached(count, list, flags);
+}
+
+/* take the free pages from address on, stopping at the first one in use */
+static uint alloc_range_from(paddr_t address, uint count, struct list_node *list)
+{
+    uint allocated = 0;
 
     mutex_acquire(&lock);
 
@@ -184,15 +594,19 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            /* a free block that fits in what is left of the range is taken
+             * whole, so large ranges aren't carved out a page at a time */
+            size_t run = 1;
+            if (page_is_free_head(page) && (1UL << page->order) <= count - allocated) {
+                run = 1UL << page->order;
+                list_delete(&page->node);
+            } else {
+                buddy_alloc_page(a, index);
+            }
+            mark_pages_allocated(a, index, run, list);
 
-            a->free_count--;
-            allocated++;
-            address += PAGE_SIZE;
+            allocated += run;
+            address += run * PAGE_SIZE;
         }
 
         if (allocated == count)
@@ -203,6 +617,26 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
     return allocated;
 }
 
+size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
+{
+    LTRACEF("address 0x%lx, count %u\n", address, count);
+
+    DEBUG_ASSERT(list);
+
+    if (count == 0)
+        return 0;
+
+    address = ROUNDDOWN(address, PAGE_SIZE);
+
+    uint allocated = alloc_range_from(address, count, list);
+
+    /* the page we stopped at may only be sitting in a cpu's cache */
+    if (allocated < count && pmm_cache_drain() > 0)
+        allocated += alloc_range_from(address + (paddr_t)allocated * PAGE_SIZE, count - allocated, list);
+
+    return allocated;
+}
+
 size_t pmm_free(struct list_node *list)
 {
     LTRACEF("list %p\n", list);
@@ -222,9 +656,9 @@ size_t pmm_free(struct list_node *list)
         pmm_arena_t *a;
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
+                page->flags &= ~(VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_ZEROED | VM_PAGE_FLAG_MOVABLE);
 
-                list_add_head(&a->free_list, &page->node);
+                buddy_free(a, page - a->page_array, 0);
                 a->free_count++;
                 count++;
                 break;
@@ -238,121 +672,452 @@ size_t pmm_free(struct list_node *list)
 
 size_t pmm_free_page(vm_page_t *page)
 {
-    struct list_node list;
-    list_initialize(&list);
+    spin_lock_saved_state_t state;
+    struct pmm_cache *c;
 
-    list_add_head(&list, &page->node);
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
 
-    return pmm_free(&list);
+    /* CMA pages go straight back, so they're there for the next contiguous run */
+    if (page->flags & VM_PAGE_FLAG_CMA) {
+        struct list_node list = LIST_INITIAL_VALUE(list);
+        list_add_tail(&list, &page->node);
+        return pmm_free(&list);
+    }
+
+    page->flags &= ~VM_PAGE_FLAG_MOVABLE;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    c = &pmm_cache[arch_curr_cpu_num()];
+    if (likely(c->count < PMM_CACHE_DEPTH)) {
+        c->pages[c->count++] = page;
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return 1;
+    }
+
+    /* full, send a batch back to the arenas along with this page */
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    list_add_tail(&list, &page->node);
+    for (uint i = 0; i < PMM_CACHE_BATCH; i++)
+        list_add_tail(&list, &c->pages[--c->count]->node);
+    c->drains++;
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    pmm_free(&list);
+
+    return 1;
+}
+
+/* empty this cpu's cache onto its list, run on each cpu by mp_sync_exec */
+static void pmm_cache_drain_cpu(void *context)
+{
+    struct list_node *lists = context;
+    uint cpu = arch_curr_cpu_num();
+    struct pmm_cache *c = &pmm_cache[cpu];
+
+    while (c->count > 0)
+        list_add_tail(&lists[cpu], &c->pages[--c->count]->node);
+    c->drains++;
+}
+
+/* give every cpu's cached pages back to the arenas, returns how many */
+static size_t pmm_cache_drain(void)
+{
+    struct list_node lists[SMP_MAX_CPUS];
+    mp_cpu_mask_t cpus = 0;
+
+    /* unlocked, a cache that fills meanwhile is left for next time */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        list_initialize(&lists[i]);
+        if (pmm_cache[i].count > 0)
+            cpus |= 1U << i;
+    }
+    if (!cpus)
+        return 0;
+
+    mp_sync_exec(cpus, &pmm_cache_drain_cpu, lists);
+
+    size_t freed = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        freed += pmm_free(&lists[i]);
+
+    return freed;
+}
+
+static size_t pmm_cache_shrinker_count(shrinker_t *s)
+{
+    size_t pages = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        pages += pmm_cache[i].count;
+
+    return pages * PAGE_SIZE;
+}
+
+/* the caches are small, all of them go however little was asked for */
+static size_t pmm_cache_shrinker_scan(shrinker_t *s, size_t target)
+{
+    return pmm_cache_drain() * PAGE_SIZE;
+}
+
+static shrinker_t pmm_cache_shrinker = SHRINKER_INITIAL_VALUE("pmm cache", 0,
+        &pmm_cache_shrinker_count, &pmm_cache_shrinker_scan, NULL);
+
+static void pmm_cache_init(uint level)
+{
+    shrinker_register(&pmm_cache_shrinker);
 }
 
+LK_INIT_HOOK(pmm_cache, &pmm_cache_init, LK_INIT_LEVEL_HEAP);
+
 /* physically allocate a run from arenas marked as KMAP */
-void *pmm_alloc_kpages(uint count, struct list_node *list)
+void *pmm_alloc_kpages_etc(uint count, struct list_node *list, uint flags)
 {
-    LTRACEF("count %u\n", count);
+    LTRACEF("count %u, flags 0x%x\n", count, flags);
 
     // XXX do fast path for single page
 
 
     paddr_t pa;
-    size_t alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list);
+    size_t alloc_count = pmm_alloc_contiguous_etc(count, PAGE_SIZE_SHIFT, &pa, list, flags);
     if (alloc_count == 0)
         return NULL;
 
     return paddr_to_kvaddr(pa);
 }
 
-size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
+size_t pmm_free_kpages(void *_ptr, uint count)
 {
-    LTRACEF("count %u, align %u\n", count, alignment_log2);
+    LTRACEF("ptr %p, count %u\n", _ptr, count);
 
-    if (count == 0)
-        return 0;
-    if (alignment_log2 < PAGE_SIZE_SHIFT)
-        alignment_log2 = PAGE_SIZE_SHIFT;
+    uint8_t *ptr = (uint8_t *)_ptr;
+    struct list_node list = LIST_INITIAL_VALUE(list);
 
-    mutex_acquire(&lock);
+    DEBUG_ASSERT(IS_PAGE_ALIGNED((uintptr_t)ptr));
+
+    for (uint i = 0; i < count; i++, ptr += PAGE_SIZE) {
+        vm_page_t *p = address_to_page(kvaddr_to_paddr(ptr));
+        if (p)
+            list_add_tail(&list, &p->node);
+    }
+
+    return pmm_free(&list);
+}
+
+/* zero the pages of a freshly allocated run that the background thread has not already */
+static void zero_run(pmm_arena_t *a, size_t start, size_t count)
+{
+    size_t dirty = start;
+
+    for (size_t i = start; i <= start + count; i++) {
+        if (i < start + count && !(a->page_array[i].flags & VM_PAGE_FLAG_ZEROED))
+            continue;
+
+        /* zero the dirty pages since the last clean one in one go */
+        if (i > dirty)
+            memset(paddr_to_kvaddr(a->base + dirty * PAGE_SIZE), 0, (i - dirty) * PAGE_SIZE);
+        dirty = i + 1;
+    }
+}
+
+/* take a run out of the buddy free lists of the kmap arenas that are or aren't CMA.
+ * lock held */
+static pmm_arena_t *buddy_alloc_run(bool cma, uint flags, uint order, uint count, struct list_node *list,
+                                    size_t *_start)
+{
+    uint local = curr_cpu_node();
+
+    for (uint rank = 0; rank < arena_ranks(flags); rank++) {
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            // XXX make this a flag to only search kmap?
+            if (!(a->flags & PMM_ARENA_FLAG_KMAP) || arena_is_cma(a) != cma ||
+                    arena_rank(a, flags, local) != rank)
+                continue;
+
+            ssize_t start = buddy_alloc(a, order);
+            if (start < 0)
+                continue;
+
+            LTRACEF("found run from pn %zd to %zd\n", start, start + count);
+
+            /* give back the tail of the block past the run */
+            buddy_free_range(a, start + count, start + (1UL << order));
+
+            mark_pages_allocated(a, start, count, list);
+
+            *_start = start;
+            return a;
+        }
+    }
+
+    return NULL;
+}
+
+/* claim the free pages of a window, if nothing but free and movable pages are in it.
+ * otherwise returns false, with the first page in the way in blocker. lock held */
+static bool cma_claim_window(pmm_arena_t *a, size_t start, size_t count, struct list_node *claimed, size_t *blocker)
+{
+    for (size_t i = start + count; i > start; i--) {
+        const vm_page_t *p = &a->page_array[i - 1];
+        if (!page_is_free(p) && !(p->flags & VM_PAGE_FLAG_MOVABLE)) {
+            *blocker = i - 1;
+            return false;
+        }
+    }
+
+    for (size_t i = start; i < start + count; i++) {
+        if (page_is_free(&a->page_array[i])) {
+            buddy_alloc_page(a, i);
+            mark_pages_allocated(a, i, 1, claimed);
+        }
+    }
+
+    return true;
+}
+
+/* find a window in a CMA arena holding only free and movable pages, and have
+ * the vmm move the movable ones out of it. lock not held */
+static pmm_arena_t *cma_alloc_run(uint count, uint8_t alignment_log2, struct list_node *list, size_t *_start)
+{
+    size_t align = 1UL << (alignment_log2 - PAGE_SIZE_SHIFT);
 
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        if (!arena_is_cma(a))
+            continue;
+
+        size_t start = ROUNDUP(arena_pfn(a, 0), align) - arena_pfn(a, 0);
+        while (start + count <= arena_page_count(a)) {
+            struct list_node claimed = LIST_INITIAL_VALUE(claimed);
+            struct list_node vacated = LIST_INITIAL_VALUE(vacated);
+            size_t blocker;
+
+            mutex_acquire(&lock);
+            bool ok = cma_claim_window(a, start, count, &claimed, &blocker);
+            mutex_release(&lock);
+            if (!ok) {
+                /* every window up to the pinned page would have it too */
+                start = ROUNDUP(arena_pfn(a, blocker + 1), align) - arena_pfn(a, 0);
                 continue;
+            }
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
-
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                   ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
+            LTRACEF("migrating pn %zu to %zu out of arena '%s'\n", start, start + count, a->name);
 
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
+            status_t err = NO_ERROR;
+            if (list_length(&claimed) < count)
+                err = vmm_migrate_pages(a->base + start * PAGE_SIZE, count, &vacated);
 
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
+            mutex_acquire(&lock);
 
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
+            /* what the vacated pages held lives elsewhere now, they're ours */
+            vm_page_t *p;
+            while ((p = list_remove_head_type(&vacated, vm_page_t, node))) {
+                p->flags &= ~VM_PAGE_FLAG_ZEROED;
+                list_add_tail(&claimed, &p->node);
+            }
+
+            /* pages the owners freed while the rest moved */
+            for (size_t i = start; i < start + count; i++) {
+                if (page_is_free(&a->page_array[i])) {
+                    buddy_alloc_page(a, i);
+                    mark_pages_allocated(a, i, 1, &claimed);
+                }
+            }
 
+            /* anything short of the whole window is still in use by someone, a
+             * movable page the vmm couldn't find mapped or another allocation */
+            bool done = list_length(&claimed) == count;
+            if (done) {
+                for (size_t i = start; i < start + count; i++) {
+                    p = &a->page_array[i];
+                    list_delete(&p->node);
                     if (list)
                         list_add_tail(list, &p->node);
                 }
+            }
+
+            mutex_release(&lock);
+
+            if (done) {
+                *_start = start;
+                return a;
+            }
 
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
+            pmm_free(&claimed);
 
-                mutex_release(&lock);
+            /* the vmm can't move anything right now, say the caller holds its lock */
+            if (err < 0)
+                return NULL;
 
-                return count;
+            start += align;
+        }
+    }
+
+    return NULL;
+}
+
+static pmm_arena_t *alloc_run(uint count, uint order, uint8_t alignment_log2, struct list_node *list, size_t *start,
+                              uint flags)
+{
+    pmm_arena_t *a = NULL;
+
+    if (order <= PMM_MAX_ORDER) {
+        mutex_acquire(&lock);
+
+        /* leave the CMA arenas for when nothing else fits */
+        a = buddy_alloc_run(false, flags, order, count, list, start);
+        if (!a)
+            a = buddy_alloc_run(true, flags, order, count, list, start);
+
+        check_watermark();
+
+        mutex_release(&lock);
+    } else {
+        LTRACEF("run of order %u is larger than the largest block\n", order);
+    }
+
+    /* the CMA arenas don't need a whole free block, only a window with nothing pinned in it */
+    if (!a)
+        a = cma_alloc_run(count, alignment_log2, list, start);
+
+    return a;
+}
+
+size_t pmm_alloc_contiguous_etc(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list, uint flags)
+{
+    LTRACEF("count %u, align %u, flags 0x%x\n", count, alignment_log2, flags);
+
+    if (count == 0)
+        return 0;
+    if (alignment_log2 < PAGE_SIZE_SHIFT)
+        alignment_log2 = PAGE_SIZE_SHIFT;
+
+    /* round up to a block that covers both the count and the alignment */
+    uint order = log2_uint(count);
+    if ((1UL << order) < count)
+        order++;
+    order = MAX(order, (uint)alignment_log2 - PAGE_SIZE_SHIFT);
+
+    size_t start;
+    pmm_arena_t *a = alloc_run(count, order, alignment_log2, list, &start, flags);
+
+    /* nothing free that fits, have the caches give some back and look once more */
+    if (!a && may_shrink(flags) && shrink_caches((size_t)count * PAGE_SIZE, SHRINK_ALLOC_FAILED) > 0)
+        a = alloc_run(count, order, alignment_log2, list, &start, flags);
+
+    if (!a) {
+        LTRACEF("couldn't find run\n");
+        return 0;
+    }
+
+    if (pa)
+        *pa = a->base + start * PAGE_SIZE;
+
+    /* the pages are ours now, zero them outside the lock */
+    if (flags & PMM_ALLOC_FLAG_ZERO)
+        zero_run(a, start, count);
+
+    return count;
+}
+
+#if PMM_ZERO_POOL_PAGES > 0
+/* take a free, not yet zeroed page out of a kmap arena. lock held */
+static vm_page_t *zero_pool_grab(pmm_arena_t **arena)
+{
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        /* carry on from where the last sweep left off */
+        for (size_t scanned = 0; scanned < arena_page_count(a); scanned++) {
+            if (a->zero_cursor >= arena_page_count(a))
+                a->zero_cursor = 0;
+
+            size_t index = a->zero_cursor++;
+            vm_page_t *p = &a->page_array[index];
+            if (page_is_free(p) && !(p->flags & VM_PAGE_FLAG_ZEROED)) {
+                buddy_alloc_page(a, index);
+                mark_pages_allocated(a, index, 1, NULL);
+                *arena = a;
+                return p;
             }
         }
     }
 
-    mutex_release(&lock);
+    return NULL;
+}
+
+/* lowest priority thread that zeroes free pages while there is nothing else to do */
+static int zero_pool_thread(void *arg)
+{
+    for (;;) {
+        pmm_arena_t *a = NULL;
+        vm_page_t *p = NULL;
+
+        mutex_acquire(&lock);
+        if (zeroed_free_count < PMM_ZERO_POOL_PAGES)
+            p = zero_pool_grab(&a);
+        mutex_release(&lock);
+
+        if (!p) {
+            thread_sleep(1000);
+            continue;
+        }
+
+        size_t index = p - a->page_array;
+        memset(paddr_to_kvaddr(a->base + index * PAGE_SIZE), 0, PAGE_SIZE);
+
+        /* put it back, flagged */
+        mutex_acquire(&lock);
+        p->flags = (p->flags & ~VM_PAGE_FLAG_NONFREE) | VM_PAGE_FLAG_ZEROED;
+        buddy_free(a, index, 0);
+        a->free_count++;
+        zeroed_free_count++;
+        mutex_release(&lock);
+    }
 
-    LTRACEF("couldn't find run\n");
     return 0;
 }
 
+static void zero_pool_init(uint level)
+{
+    thread_detach_and_resume(thread_create("pmm zero", &zero_pool_thread, NULL, LOWEST_PRIORITY + 1, DEFAULT_STACK_SIZE));
+}
+
+LK_INIT_HOOK(pmm_zero, &zero_pool_init, LK_INIT_LEVEL_THREADING);
+#endif
+
 static void dump_page(const vm_page_t *page)
 {
     printf("page %p: address 0x%lx flags 0x%x\n", page, page_to_address(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
+static void dump_arena(pmm_arena_t *arena, bool dump_pages)
 {
-    printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
-           arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
+    printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u node %u flags 0x%x\n",
+           arena, arena->name, arena->base, arena->size, arena->priority, arena->node_id, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
 
+    if (arena_is_cma(arena)) {
+        size_t movable = 0;
+        for (size_t i = 0; i < arena_page_count(arena); i++) {
+            if (arena->page_array[i].flags & VM_PAGE_FLAG_MOVABLE)
+                movable++;
+        }
+        printf("\tcma, %zu pages lent to movable allocations\n", movable);
+    }
+
+    /* dump the buddy free lists */
+    printf("\tfree blocks by order:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        size_t blocks = list_length(&arena->free_list[i]);
+        if (blocks)
+            printf(" %u:%zu", i, blocks);
+    }
+    printf("\n");
+
     /* dump all of the pages */
     if (dump_pages) {
         for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
@@ -389,7 +1154,9 @@ notenoughargs:
 usage:
         printf("usage:\n");
         printf("%s arenas\n", argv[0].str);
-        printf("%s alloc <count>\n", argv[0].str);
+        printf("%s cache\n", argv[0].str);
+        printf("%s nodes\n", argv[0].str);
+        printf("%s alloc <count> [flags]\n", argv[0].str);
         printf("%s alloc_range <address> <count>\n", argv[0].str);
         printf("%s alloc_kpages <count>\n", argv[0].str);
         printf("%s alloc_contig <count> <alignment>\n", argv[0].str);
@@ -405,13 +1172,41 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+    } else if (!strcmp(argv[1].str, "cache")) {
+        printf("per cpu page cache: batch %u, depth %u\n", PMM_CACHE_BATCH, PMM_CACHE_DEPTH);
+        printf("zeroed free pages: %zu of %u\n", zeroed_free_count, PMM_ZERO_POOL_PAGES);
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            const struct pmm_cache *c = &pmm_cache[i];
+            printf("\tcpu %u: %u pages cached, %lu hits, %lu refills, %lu drains\n",
+                   i, c->count, c->hits, c->refills, c->drains);
+        }
+    } else if (!strcmp(argv[1].str, "nodes")) {
+        uint max_node = 0;
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            max_node = MAX(max_node, a->node_id);
+        }
+
+        for (uint n = 0; n <= max_node; n++) {
+            pmm_node_stats_t stats;
+            if (pmm_get_node_stats(n, &stats) < 0)
+                continue;
+
+            printf("node %u: %u arenas, %zu of %zu pages free, %zu of them fast, cpus",
+                   n, stats.arenas, stats.free_pages, stats.total_pages, stats.fast_free_pages);
+            for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+                if (cpu_node[i] == n)
+                    printf(" %u", i);
+            }
+            printf("\n");
+        }
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
         struct list_node list;
         list_initialize(&list);
 
-        uint count = pmm_alloc_pages(argv[2].u, &list);
+        uint count = pmm_alloc_pages_etc(argv[2].u, &list, (argc > 3) ? argv[3].u : 0);
         printf("alloc returns %u\n", count);
 
         vm_page_t *p;
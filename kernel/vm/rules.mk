@@ -2,7 +2,10 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_DEPS += lib/slab
+
 MODULE_SRCS += \
+	$(LOCAL_DIR)/asid.c \
 	$(LOCAL_DIR)/bootalloc.c \
 	$(LOCAL_DIR)/pmm.c \
 	$(LOCAL_DIR)/vm.c \
@@ -51,20 +51,45 @@ static void mark_pages_in_use(vaddr_t va, size_t len)
 
     LTRACEF("aligned va 0x%lx, len 0x%zx\n", va, len);
 
+    /* the range is almost always inside one of the linear initial mappings,
+     * so it can be translated and allocated as a single run */
+    struct mmu_initial_mapping *map = mmu_initial_mappings;
+    while (map->size > 0) {
+        if (!(map->flags & MMU_INITIAL_MAPPING_TEMPORARY) &&
+            va >= map->virt && va - map->virt + len <= map->size) {
+            paddr_t pa = map->phys + (va - map->virt);
+
+            LTRACEF("linear in mapping '%s', pa 0x%lx\n", map->name, pa);
+            pmm_alloc_range(pa, len / PAGE_SIZE, &list);
+            return;
+        }
+        map++;
+    }
+
+    /* otherwise look up each page, collecting physically contiguous runs */
+    paddr_t run_pa = 0;
+    size_t run_len = 0;
     for (size_t offset = 0; offset < len; offset += PAGE_SIZE) {
         uint flags;
         paddr_t pa;
 
         status_t err = arch_mmu_query(va + offset, &pa, &flags);
-        if (err >= 0) {
-            //LTRACEF("va 0x%x, pa 0x%x, flags 0x%x, err %d\n", va + offset, pa, flags, err);
+        if (err < 0)
+            panic("Could not find pa for va 0x%lx\n", va + offset);
 
-            /* alloate the range, throw the results away */
-            pmm_alloc_range(pa, 1, &list);
-        } else {
-            panic("Could not find pa for va 0x%lx\n", va);
+        if (run_len > 0 && pa == run_pa + run_len) {
+            run_len += PAGE_SIZE;
+            continue;
         }
+
+        /* alloate the range, throw the results away */
+        if (run_len > 0)
+            pmm_alloc_range(run_pa, run_len / PAGE_SIZE, &list);
+        run_pa = pa;
+        run_len = PAGE_SIZE;
     }
+    if (run_len > 0)
+        pmm_alloc_range(run_pa, run_len / PAGE_SIZE, &list);
 }
 
 static void vm_init_preheap(uint level)
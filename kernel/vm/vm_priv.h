@@ -34,5 +34,9 @@ extern uintptr_t boot_alloc_end;
 paddr_t page_to_address(const vm_page_t *page);
 vm_page_t *address_to_page(paddr_t addr);
 
+/* move the contents of the movable pages in count pages at base elsewhere,
+ * appending the pages they leave behind to vacated. for the pmm */
+status_t vmm_migrate_pages(paddr_t base, size_t count, struct list_node *vacated);
+
 void vmm_init(void);
 
@@ -27,6 +27,8 @@
 #include <lib/console.h>
 #include <kernel/vm.h>
 #include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <lib/slab.h>
 #include "vm_priv.h"
 
 #define LOCAL_TRACE 0
@@ -36,6 +38,8 @@ static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
 
 vmm_aspace_t _kernel_aspace;
 
+static slab_cache_t region_cache = SLAB_CACHE_INITIAL_VALUE(region_cache, "vmm_region", sizeof(vmm_region_t), 0, NULL);
+
 static void dump_aspace(const vmm_aspace_t *a);
 static void dump_region(const vmm_region_t *r);
 
@@ -47,6 +51,7 @@ void vmm_init(void)
     _kernel_aspace.size = KERNEL_ASPACE_SIZE,
     _kernel_aspace.flags = VMM_FLAG_ASPACE_KERNEL;
     list_initialize(&_kernel_aspace.region_list);
+    _kernel_aspace.region_tree = NULL;
 
     list_add_head(&aspace_list, &_kernel_aspace.node);
 }
@@ -56,6 +61,43 @@ static inline bool is_inside_aspace(const vmm_aspace_t *aspace, vaddr_t vaddr)
     return (vaddr >= aspace->base && vaddr <= aspace->base + aspace->size - 1);
 }
 
+/* user aspaces have their own translation tables where the arch supports it */
+static inline bool has_arch_aspace(const vmm_aspace_t *aspace)
+{
+#if ARCH_HAS_ASPACE
+    return !(aspace->flags & VMM_FLAG_ASPACE_KERNEL);
+#else
+    return false;
+#endif
+}
+
+static int aspace_mmu_map(vmm_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
+{
+#if ARCH_HAS_ASPACE
+    if (has_arch_aspace(aspace))
+        return arch_mmu_map_aspace(&aspace->arch_aspace, vaddr, paddr, count, flags);
+#endif
+    return arch_mmu_map(vaddr, paddr, count, flags);
+}
+
+static int aspace_mmu_unmap(vmm_aspace_t *aspace, vaddr_t vaddr, uint count)
+{
+#if ARCH_HAS_ASPACE
+    if (has_arch_aspace(aspace))
+        return arch_mmu_unmap_aspace(&aspace->arch_aspace, vaddr, count);
+#endif
+    return arch_mmu_unmap(vaddr, count);
+}
+
+static status_t aspace_mmu_query(vmm_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags)
+{
+#if ARCH_HAS_ASPACE
+    if (has_arch_aspace(aspace))
+        return arch_mmu_query_aspace(&aspace->arch_aspace, vaddr, paddr, flags);
+#endif
+    return arch_mmu_query(vaddr, paddr, flags);
+}
+
 static bool is_region_inside_aspace(const vmm_aspace_t *aspace, vaddr_t vaddr, size_t size)
 {
     /* is the starting address within the address space*/
@@ -101,11 +143,246 @@ static size_t trim_to_aspace(const vmm_aspace_t *aspace, vaddr_t vaddr, size_t s
     return size;
 }
 
+/*
+ *  The region list stays sorted by base for walking the aspace in order. Next to
+ *  it every aspace keeps an avl tree of the same regions so lookups and the
+ *  search for a free gap don't have to walk the list.
+ */
+static inline int tree_height(const vmm_region_t *r)
+{
+    return r ? r->tree_height : 0;
+}
+
+static void tree_update(vmm_region_t *r)
+{
+    r->tree_height = 1 + MAX(tree_height(r->tree_left), tree_height(r->tree_right));
+
+    r->max_gap = r->gap;
+    if (r->tree_left)
+        r->max_gap = MAX(r->max_gap, r->tree_left->max_gap);
+    if (r->tree_right)
+        r->max_gap = MAX(r->max_gap, r->tree_right->max_gap);
+}
+
+static void tree_replace_child(vmm_aspace_t *aspace, vmm_region_t *parent,
+                               vmm_region_t *old, vmm_region_t *new)
+{
+    if (!parent)
+        aspace->region_tree = new;
+    else if (parent->tree_left == old)
+        parent->tree_left = new;
+    else
+        parent->tree_right = new;
+}
+
+static vmm_region_t *tree_rotate_left(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *pivot = r->tree_right;
+
+    r->tree_right = pivot->tree_left;
+    if (r->tree_right)
+        r->tree_right->tree_parent = r;
+
+    pivot->tree_parent = r->tree_parent;
+    tree_replace_child(aspace, r->tree_parent, r, pivot);
+
+    pivot->tree_left = r;
+    r->tree_parent = pivot;
+
+    tree_update(r);
+    tree_update(pivot);
+    return pivot;
+}
+
+static vmm_region_t *tree_rotate_right(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *pivot = r->tree_left;
+
+    r->tree_left = pivot->tree_right;
+    if (r->tree_left)
+        r->tree_left->tree_parent = r;
+
+    pivot->tree_parent = r->tree_parent;
+    tree_replace_child(aspace, r->tree_parent, r, pivot);
+
+    pivot->tree_right = r;
+    r->tree_parent = pivot;
+
+    tree_update(r);
+    tree_update(pivot);
+    return pivot;
+}
+
+/* recompute heights and gaps from r up to the root, rebalancing on the way */
+static void tree_fixup(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    while (r) {
+        tree_update(r);
+
+        int balance = tree_height(r->tree_left) - tree_height(r->tree_right);
+        if (balance > 1) {
+            if (tree_height(r->tree_left->tree_left) < tree_height(r->tree_left->tree_right))
+                tree_rotate_left(aspace, r->tree_left);
+            r = tree_rotate_right(aspace, r);
+        } else if (balance < -1) {
+            if (tree_height(r->tree_right->tree_right) < tree_height(r->tree_right->tree_left))
+                tree_rotate_right(aspace, r->tree_right);
+            r = tree_rotate_left(aspace, r);
+        }
+
+        r = r->tree_parent;
+    }
+}
+
+static void tree_insert(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *parent = NULL;
+    vmm_region_t **link = &aspace->region_tree;
+
+    while (*link) {
+        parent = *link;
+        link = (r->base < parent->base) ? &parent->tree_left : &parent->tree_right;
+    }
+
+    r->tree_parent = parent;
+    r->tree_left = r->tree_right = NULL;
+    *link = r;
+
+    tree_fixup(aspace, r);
+}
+
+static void tree_remove(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *fix;
+
+    if (!r->tree_left || !r->tree_right) {
+        vmm_region_t *child = r->tree_left ? r->tree_left : r->tree_right;
+
+        if (child)
+            child->tree_parent = r->tree_parent;
+        tree_replace_child(aspace, r->tree_parent, r, child);
+        fix = r->tree_parent;
+    } else {
+        /* splice the successor into r's spot */
+        vmm_region_t *succ = r->tree_right;
+        while (succ->tree_left)
+            succ = succ->tree_left;
+
+        if (succ->tree_parent == r) {
+            fix = succ;
+        } else {
+            fix = succ->tree_parent;
+            fix->tree_left = succ->tree_right;
+            if (succ->tree_right)
+                succ->tree_right->tree_parent = fix;
+            succ->tree_right = r->tree_right;
+            succ->tree_right->tree_parent = succ;
+        }
+
+        succ->tree_left = r->tree_left;
+        succ->tree_left->tree_parent = succ;
+        succ->tree_parent = r->tree_parent;
+        tree_replace_child(aspace, r->tree_parent, r, succ);
+    }
+
+    tree_fixup(aspace, fix);
+}
+
+/* last region with base <= vaddr */
+static vmm_region_t *tree_find_le(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *r = aspace->region_tree;
+    vmm_region_t *found = NULL;
+
+    while (r) {
+        if (vaddr < r->base) {
+            r = r->tree_left;
+        } else {
+            found = r;
+            r = r->tree_right;
+        }
+    }
+
+    return found;
+}
+
+/* lowest region in the subtree with at least size bytes free in front of it */
+static vmm_region_t *tree_first_gap(vmm_region_t *r, size_t size)
+{
+    while (r) {
+        if (r->tree_left && r->tree_left->max_gap >= size)
+            r = r->tree_left;
+        else if (r->gap >= size)
+            return r;
+        else if (r->tree_right && r->tree_right->max_gap >= size)
+            r = r->tree_right;
+        else
+            return NULL;
+    }
+
+    return NULL;
+}
+
+/* next region after r in address order with at least size bytes free in front of it */
+static vmm_region_t *tree_next_gap(vmm_region_t *r, size_t size)
+{
+    if (r->tree_right && r->tree_right->max_gap >= size)
+        return tree_first_gap(r->tree_right, size);
+
+    for (;;) {
+        /* climb until we come up out of a left subtree */
+        while (r->tree_parent && r->tree_parent->tree_right == r)
+            r = r->tree_parent;
+        r = r->tree_parent;
+        if (!r)
+            return NULL;
+
+        if (r->gap >= size)
+            return r;
+        if (r->tree_right && r->tree_right->max_gap >= size)
+            return tree_first_gap(r->tree_right, size);
+    }
+}
+
+/* recompute the free gap in front of r from its list predecessor */
+static void region_update_gap(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vaddr_t gap_beg = prev ? prev->base + prev->size : aspace->base;
+
+    r->gap = r->base - gap_beg;
+    tree_fixup(aspace, r);
+}
+
+/* r has just been put on the region list, mirror it in the tree */
+static void region_inserted(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    r->gap = r->base - (prev ? prev->base + prev->size : aspace->base);
+    tree_insert(aspace, r);
+
+    if (next)
+        region_update_gap(aspace, next);
+}
+
+static void region_remove(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    list_delete(&r->node);
+    tree_remove(aspace, r);
+
+    if (next)
+        region_update_gap(aspace, next);
+}
+
 static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t size, uint flags, uint arch_mmu_flags)
 {
     DEBUG_ASSERT(name);
 
-    vmm_region_t *r = malloc(sizeof(vmm_region_t));
+    vmm_region_t *r = slab_alloc(&region_cache);
     if (!r)
         return NULL;
 
@@ -114,6 +391,8 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     r->size = size;
     r->flags = flags;
     r->arch_mmu_flags = arch_mmu_flags;
+    r->fill = NULL;
+    r->fill_arg = NULL;
     list_initialize(&r->page_list);
 
     return r;
@@ -137,31 +416,26 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
-    }
+    /* find the neighbors it would go between */
+    vmm_region_t *prev = tree_find_le(aspace, r->base);
+    vmm_region_t *next;
+    if (prev)
+        next = list_next_type(&aspace->region_list, &prev->node, vmm_region_t, node);
+    else
+        next = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    if ((prev && r->base <= prev->base + prev->size - 1) || (next && r_end >= next->base)) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    if (prev)
+        list_add_after(&prev->node, &r->node);
+    else
+        list_add_head(&aspace->region_list, &r->node);
+    region_inserted(aspace, r);
+
+    return NO_ERROR;
 }
 
 /*
@@ -239,20 +513,19 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t spot;
     vmm_region_t *r = NULL;
 
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
-        goto done;
-
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
+    /* walk the gaps in front of regions that are at least big enough, lowest first */
+    vmm_region_t *next;
+    for (next = tree_first_gap(aspace->region_tree, size); next; next = tree_next_gap(next, size)) {
+        r = list_prev_type(&aspace->region_list, &next->node, vmm_region_t, node);
+        if (check_gap(aspace, r, next, &spot, align, size, arch_mmu_flags))
             goto done;
     }
 
+    /* try the gap at the end of the address space */
+    r = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+    if (check_gap(aspace, r, NULL, &spot, align, size, arch_mmu_flags))
+        goto done;
+
     /* couldn't find anything */
     return -1;
 
@@ -277,7 +550,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         /* stick it in the list, checking to see if it fits */
         if (add_region_to_aspace(aspace, r) < 0) {
             /* didn't fit */
-            free(r);
+            slab_free(&region_cache, r);
             return NULL;
         }
     } else {
@@ -289,7 +562,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
 
         if (vaddr == (vaddr_t)-1) {
             LTRACEF("failed to find spot\n");
-            free(r);
+            slab_free(&region_cache, r);
             return NULL;
         }
 
@@ -299,6 +572,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
 
         /* add it to the region list */
         list_add_after(before, &r->node);
+        region_inserted(aspace, r);
     }
 
     return r;
@@ -332,7 +606,7 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
 
     /* lookup how it's already mapped */
     uint arch_mmu_flags = 0;
-    arch_mmu_query(vaddr, NULL, &arch_mmu_flags);
+    aspace_mmu_query(aspace, vaddr, NULL, &arch_mmu_flags);
 
     /* build a new region structure */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, 0, VMM_FLAG_VALLOC_SPECIFIC, VMM_REGION_FLAG_RESERVED, arch_mmu_flags);
@@ -341,6 +615,44 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     return r ? NO_ERROR : ERR_NO_MEMORY;
 }
 
+/*
+ *  Raise the alignment of a physically contiguous run so its virtual address lines
+ *  up with the physical one on the largest block the arch mmu can map it with.
+ */
+static uint8_t large_page_align(paddr_t pa, size_t size, uint8_t align_pow2)
+{
+#ifdef ARCH_MMU_LARGE_PAGE_MAX_SHIFT
+    uint shift;
+
+    for (shift = ARCH_MMU_LARGE_PAGE_MAX_SHIFT; shift >= ARCH_MMU_LARGE_PAGE_MIN_SHIFT; shift--) {
+        if (size >= (1UL << shift) && IS_ALIGNED(pa, 1UL << shift))
+            return MAX(align_pow2, shift);
+    }
+#endif
+    return align_pow2;
+}
+
+/*
+ *  Allocate a region for a physically contiguous run, preferring a large page
+ *  friendly spot and falling back to the requested alignment.
+ */
+static vmm_region_t *alloc_physical_region(vmm_aspace_t *aspace, const char *name, size_t size,
+        vaddr_t vaddr, uint8_t align_pow2, paddr_t pa, uint vmm_flags, uint arch_mmu_flags)
+{
+    vmm_region_t *r = NULL;
+
+    if (!(vmm_flags & VMM_FLAG_VALLOC_SPECIFIC)) {
+        uint8_t large_align = large_page_align(pa, size, align_pow2);
+        if (large_align != align_pow2) {
+            r = alloc_region(aspace, name, size, vaddr, large_align, vmm_flags, VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+            if (r)
+                return r;
+        }
+    }
+
+    return alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags, VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+}
+
 status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, paddr_t paddr, uint vmm_flags, uint arch_mmu_flags)
 {
     status_t ret;
@@ -376,7 +688,7 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags, VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = alloc_physical_region(aspace, name, size, vaddr, align_log2, paddr, vmm_flags, arch_mmu_flags);
     if (!r) {
         ret = ERR_NO_MEMORY;
         goto err_alloc_region;
@@ -387,7 +699,7 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         *ptr = (void *)r->base;
 
     /* map all of the pages */
-    int err = arch_mmu_map(r->base, paddr, size / PAGE_SIZE, arch_mmu_flags);
+    int err = aspace_mmu_map(aspace, r->base, paddr, size / PAGE_SIZE, arch_mmu_flags);
     LTRACEF("arch_mmu_map returns %d\n", err);
 
     ret = NO_ERROR;
@@ -431,7 +743,8 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
 
     paddr_t pa = 0;
     /* allocate a run of physical pages */
-    size_t count = pmm_alloc_contiguous(size / PAGE_SIZE, align_pow2, &pa, &page_list);
+    uint pmm_flags = (vmm_flags & VMM_FLAG_ZERO) ? PMM_ALLOC_FLAG_ZERO : 0;
+    size_t count = pmm_alloc_contiguous_etc(size / PAGE_SIZE, align_pow2, &pa, &page_list, pmm_flags);
     if (count < size / PAGE_SIZE) {
         err = ERR_NO_MEMORY;
         goto err;
@@ -440,7 +753,7 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags, VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = alloc_physical_region(aspace, name, size, vaddr, align_pow2, pa, vmm_flags, arch_mmu_flags);
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -450,8 +763,12 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
     if (ptr)
         *ptr = (void *)r->base;
 
+    /* the zeroes went in through the cached kernel mapping, push them out before an uncached mapping sees the memory */
+    if ((vmm_flags & VMM_FLAG_ZERO) && (arch_mmu_flags & ARCH_MMU_FLAG_CACHE_MASK) != ARCH_MMU_FLAG_CACHED)
+        arch_clean_invalidate_cache_range((addr_t)paddr_to_kvaddr(pa), size);
+
     /* map all of the pages */
-    arch_mmu_map(r->base, pa, size / PAGE_SIZE, arch_mmu_flags);
+    aspace_mmu_map(aspace, r->base, pa, size / PAGE_SIZE, arch_mmu_flags);
     // XXX deal with error mapping here
 
     vm_page_t *p;
@@ -485,6 +802,16 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     if (!name)
         name = "";
 
+    /* the guard page sits below the allocation, unmapped, so running off the
+     * bottom faults instead of scribbling on whatever is mapped there */
+    size_t guard = 0;
+    if (vmm_flags & VMM_FLAG_GUARD) {
+        /* a lazy region would just fill the guard page in on the first touch */
+        if (vmm_flags & (VMM_FLAG_LAZY | VMM_FLAG_VALLOC_SPECIFIC))
+            return ERR_INVALID_ARGS;
+        guard = PAGE_SIZE;
+    }
+
     vaddr_t vaddr = 0;
 
     /* if they're asking for a specific spot, copy the address */
@@ -497,13 +824,37 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         vaddr = (vaddr_t)*ptr;
     }
 
+    /* the contents are copied through the kernel mapping when the pages move */
+    uint region_flags = VMM_REGION_FLAG_PHYSICAL;
+    uint pmm_flags = 0;
+    if (vmm_flags & VMM_FLAG_MOVABLE) {
+        if ((arch_mmu_flags & ARCH_MMU_FLAG_CACHE_MASK) != ARCH_MMU_FLAG_CACHED)
+            return ERR_INVALID_ARGS;
+        region_flags |= VMM_REGION_FLAG_MOVABLE;
+        pmm_flags |= PMM_ALLOC_FLAG_MOVABLE;
+    }
+
+    if (vmm_flags & VMM_FLAG_LAZY) {
+        /* just carve out the space, vmm_page_fault_handler fills it in a page at a time */
+        mutex_acquire(&vmm_lock);
+        vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                                       region_flags | VMM_REGION_FLAG_LAZY, arch_mmu_flags);
+        mutex_release(&vmm_lock);
+        if (!r)
+            return ERR_NO_MEMORY;
+
+        if (ptr)
+            *ptr = (void *)r->base;
+        return NO_ERROR;
+    }
+
     /* allocate physical memory up front, in case it cant be satisfied */
 
     /* allocate a random pile of pages */
     struct list_node page_list;
     list_initialize(&page_list);
 
-    size_t count = pmm_alloc_pages(size / PAGE_SIZE, &page_list);
+    size_t count = pmm_alloc_pages_etc(size / PAGE_SIZE, &page_list, pmm_flags);
     DEBUG_ASSERT(count <= size);
     if (count < size / PAGE_SIZE) {
         LTRACEF("failed to allocate enough pages (asked for %zu, got %zu)\n", size / PAGE_SIZE, count);
@@ -514,7 +865,7 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags, VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = alloc_region(aspace, name, size + guard, vaddr, align_pow2, vmm_flags, region_flags, arch_mmu_flags);
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -522,12 +873,12 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
 
     /* return the vaddr if requested */
     if (ptr)
-        *ptr = (void *)r->base;
+        *ptr = (void *)(r->base + guard);
 
     /* map all of the pages */
     /* XXX use smarter algorithm that tries to build runs */
     vm_page_t *p;
-    vaddr_t va = r->base;
+    vaddr_t va = r->base + guard;
     DEBUG_ASSERT(IS_PAGE_ALIGNED(va));
     while ((p = list_remove_head_type(&page_list, vm_page_t, node))) {
         DEBUG_ASSERT(va <= r->base + r->size - 1);
@@ -535,7 +886,7 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         paddr_t pa = page_to_address(p);
         DEBUG_ASSERT(IS_PAGE_ALIGNED(pa));
 
-        arch_mmu_map(va, pa, 1, arch_mmu_flags);
+        aspace_mmu_map(aspace, va, pa, 1, arch_mmu_flags);
         // XXX deal with error mapping here
 
         list_add_tail(&r->page_list, &p->node);
@@ -553,6 +904,49 @@ err:
     return err;
 }
 
+status_t vmm_alloc_backed(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_pow2,
+                          vmm_fill_func_t fill, void *fill_arg, uint vmm_flags, uint arch_mmu_flags)
+{
+    LTRACEF("aspace %p name '%s' size 0x%zx fill %p arg %p vmm_flags 0x%x arch_mmu_flags 0x%x\n",
+            aspace, name, size, fill, fill_arg, vmm_flags, arch_mmu_flags);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(fill);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+    if (size == 0)
+        return ERR_INVALID_ARGS;
+
+    if (vmm_flags & VMM_FLAG_GUARD)
+        return ERR_INVALID_ARGS;
+
+    if (!name)
+        name = "";
+
+    vaddr_t vaddr = 0;
+    if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
+        if (!ptr)
+            return ERR_INVALID_ARGS;
+        vaddr = (vaddr_t)*ptr;
+    }
+
+    mutex_acquire(&vmm_lock);
+    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                                   VMM_REGION_FLAG_PHYSICAL | VMM_REGION_FLAG_LAZY, arch_mmu_flags);
+    if (r) {
+        /* nothing can fault on it before we let go of the lock */
+        r->fill = fill;
+        r->fill_arg = fill_arg;
+    }
+    mutex_release(&vmm_lock);
+    if (!r)
+        return ERR_NO_MEMORY;
+
+    if (ptr)
+        *ptr = (void *)r->base;
+    return NO_ERROR;
+}
+
 static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
 {
     vmm_region_t *r;
@@ -562,11 +956,10 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
-            return r;
-    }
+    /* the only candidate is the last region starting at or below vaddr */
+    r = tree_find_le(aspace, vaddr);
+    if (r && vaddr <= r->base + r->size - 1)
+        return r;
 
     return NULL;
 }
@@ -582,10 +975,10 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     }
 
     /* remove it from aspace */
-    list_delete(&r->node);
+    region_remove(aspace, r);
 
     /* unmap it */
-    arch_mmu_unmap(r->base, r->size / PAGE_SIZE);
+    aspace_mmu_unmap(aspace, r->base, r->size / PAGE_SIZE);
 
     mutex_release(&vmm_lock);
 
@@ -593,11 +986,193 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     pmm_free(&r->page_list);
 
     /* free it */
-    free(r);
+    slab_free(&region_cache, r);
+
+    return NO_ERROR;
+}
+
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags)
+{
+    status_t err;
+
+    LTRACEF("addr 0x%lx pf_flags 0x%x\n", addr, pf_flags);
+
+    /* only missing pages can be filled in */
+    if (!(pf_flags & VMM_PF_FLAG_NOT_PRESENT))
+        return ERR_NOT_FOUND;
+
+    /* user addresses resolve against the aspace the faulting thread runs in */
+    vmm_aspace_t *aspace = get_current_thread()->aspace;
+    if (!aspace || !is_inside_aspace(aspace, addr))
+        aspace = vmm_get_kernel_aspace();
+    if (!is_inside_aspace(aspace, addr))
+        return ERR_NOT_FOUND;
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = vmm_find_region(aspace, addr);
+    if (!r) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    vaddr_t va = ROUNDDOWN(addr, PAGE_SIZE);
+
+    /* another thread may have faulted the page in while we waited for the lock,
+     * or the page was mapped all along and we hit it while it was being moved */
+    paddr_t pa;
+    if (aspace_mmu_query(aspace, va, &pa, NULL) == NO_ERROR) {
+        err = NO_ERROR;
+        goto out;
+    }
+
+    if (!(r->flags & VMM_REGION_FLAG_LAZY)) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    /* don't paper over an access the mapping wouldn't have allowed anyway */
+    if (((pf_flags & VMM_PF_FLAG_WRITE) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_RO)) ||
+        ((pf_flags & VMM_PF_FLAG_INSTRUCTION) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_NO_EXECUTE)) ||
+        ((pf_flags & VMM_PF_FLAG_USER) && !(r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_USER))) {
+        err = ERR_ACCESS_DENIED;
+        goto out;
+    }
+
+    vm_page_t *p;
+    if (r->flags & VMM_REGION_FLAG_MOVABLE) {
+        struct list_node list = LIST_INITIAL_VALUE(list);
+        p = pmm_alloc_pages_etc(1, &list, PMM_ALLOC_FLAG_MOVABLE) ? list_remove_head_type(&list, vm_page_t, node) : NULL;
+    } else {
+        p = pmm_alloc_page();
+    }
+    if (!p) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    pa = page_to_address(p);
+    if (r->fill) {
+        /* filling may mean i/o, don't hold up every other fault and allocation meanwhile */
+        vmm_fill_func_t fill = r->fill;
+        void *fill_arg = r->fill_arg;
+        mutex_release(&vmm_lock);
+        err = fill(fill_arg, va - r->base, paddr_to_kvaddr(pa));
+        mutex_acquire(&vmm_lock);
+
+        if (err < 0) {
+            pmm_free_page(p);
+            goto out;
+        }
+
+        /* the region can be freed, or the page faulted in by someone else, while we were away */
+        paddr_t other;
+        if (vmm_find_region(aspace, addr) != r || r->fill_arg != fill_arg) {
+            pmm_free_page(p);
+            err = ERR_NOT_FOUND;
+            goto out;
+        }
+        if (aspace_mmu_query(aspace, va, &other, NULL) == NO_ERROR) {
+            pmm_free_page(p);
+            err = NO_ERROR;
+            goto out;
+        }
+
+        if ((r->arch_mmu_flags & ARCH_MMU_FLAG_CACHE_MASK) != ARCH_MMU_FLAG_CACHED)
+            arch_clean_invalidate_cache_range((addr_t)paddr_to_kvaddr(pa), PAGE_SIZE);
+    } else if (!(p->flags & VM_PAGE_FLAG_ZEROED)) {
+        memset(paddr_to_kvaddr(pa), 0, PAGE_SIZE);
+        if ((r->arch_mmu_flags & ARCH_MMU_FLAG_CACHE_MASK) != ARCH_MMU_FLAG_CACHED)
+            arch_clean_invalidate_cache_range((addr_t)paddr_to_kvaddr(pa), PAGE_SIZE);
+    }
+
+    err = aspace_mmu_map(aspace, va, pa, 1, r->arch_mmu_flags);
+    if (err < 0) {
+        pmm_free_page(p);
+        goto out;
+    }
+    err = NO_ERROR;
+
+    list_add_tail(&r->page_list, &p->node);
+
+out:
+    mutex_release(&vmm_lock);
+    return err;
+}
+
+/* copy the movable pages a region has mapped between base and base + count pages
+ * to fresh ones, remapping them in place. vmm_lock held */
+static status_t migrate_region(vmm_aspace_t *aspace, vmm_region_t *r, paddr_t base, size_t count,
+                               struct list_node *vacated)
+{
+    for (size_t offset = 0; offset < r->size; offset += PAGE_SIZE) {
+        vaddr_t va = r->base + offset;
+
+        paddr_t pa;
+        if (aspace_mmu_query(aspace, va, &pa, NULL) < 0)
+            continue;
+        if (pa < base || pa - base >= count * PAGE_SIZE)
+            continue;
+
+        vm_page_t *old = address_to_page(pa);
+        if (!old || !(old->flags & VM_PAGE_FLAG_MOVABLE))
+            continue;
+
+        struct list_node list = LIST_INITIAL_VALUE(list);
+        if (pmm_alloc_pages_etc(1, &list, PMM_ALLOC_FLAG_MOVABLE) == 0)
+            return ERR_NO_MEMORY;
+
+        vm_page_t *p = list_remove_head_type(&list, vm_page_t, node);
+        paddr_t new_pa = page_to_address(p);
+
+        LTRACEF("moving va 0x%lx from pa 0x%lx to 0x%lx\n", va, pa, new_pa);
+
+        /* with the mapping gone, anyone touching the page waits for us in the fault handler */
+        aspace_mmu_unmap(aspace, va, 1);
+        memcpy(paddr_to_kvaddr(new_pa), paddr_to_kvaddr(pa), PAGE_SIZE);
+        aspace_mmu_map(aspace, va, new_pa, 1, r->arch_mmu_flags);
+
+        /* take the old page's place in the region */
+        list_add_after(&old->node, &p->node);
+        list_delete(&old->node);
+
+        old->flags &= ~VM_PAGE_FLAG_MOVABLE;
+        list_add_tail(vacated, &old->node);
+    }
 
     return NO_ERROR;
 }
 
+status_t vmm_migrate_pages(paddr_t base, size_t count, struct list_node *vacated)
+{
+    LTRACEF("base 0x%lx count %zu\n", base, count);
+
+    /* an allocation made under the lock, a region struct say, would wait on itself */
+    if (is_mutex_held(&vmm_lock))
+        return ERR_BUSY;
+
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_aspace_t *aspace;
+    list_for_every_entry(&aspace_list, aspace, vmm_aspace_t, node) {
+        vmm_region_t *r;
+        list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
+            if (!(r->flags & VMM_REGION_FLAG_MOVABLE))
+                continue;
+
+            err = migrate_region(aspace, r, base, count, vacated);
+            if (err < 0)
+                goto out;
+        }
+    }
+
+out:
+    mutex_release(&vmm_lock);
+    return err;
+}
+
 status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 {
     vmm_aspace_t *aspace = malloc(sizeof(vmm_aspace_t));
@@ -609,6 +1184,8 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
     else
         strlcpy(aspace->name, "unnamed", sizeof(aspace->name));
 
+    aspace->flags = flags;
+
     if (flags & VMM_FLAG_ASPACE_KERNEL) {
         aspace->base = KERNEL_ASPACE_BASE;
         aspace->size = KERNEL_ASPACE_SIZE;
@@ -617,8 +1194,19 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
         aspace->size = USER_ASPACE_SIZE;
     }
 
+#if ARCH_HAS_ASPACE
+    if (has_arch_aspace(aspace)) {
+        status_t err = arch_mmu_init_aspace(&aspace->arch_aspace, aspace->base, aspace->size);
+        if (err < 0) {
+            free(aspace);
+            return err;
+        }
+    }
+#endif
+
     list_clear_node(&aspace->node);
     list_initialize(&aspace->region_list);
+    aspace->region_tree = NULL;
 
     mutex_acquire(&vmm_lock);
     list_add_head(&aspace_list, &aspace->node);
@@ -631,6 +1219,10 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 
 status_t vmm_free_aspace(vmm_aspace_t *aspace)
 {
+    /* don't pull the tables out from under ourselves, other threads in it are the caller's problem */
+    if (get_current_thread()->aspace == aspace)
+        vmm_set_active_aspace(NULL);
+
     /* pop it out of the global aspace list */
     mutex_acquire(&vmm_lock);
     if (!list_in_list(&aspace->node)) {
@@ -648,8 +1240,9 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
         list_add_tail(&region_list, &r->node);
 
         /* unmap it */
-        arch_mmu_unmap(r->base, r->size / PAGE_SIZE);
+        aspace_mmu_unmap(aspace, r->base, r->size / PAGE_SIZE);
     }
+    aspace->region_tree = NULL;
     mutex_release(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
@@ -658,15 +1251,51 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
         pmm_free(&r->page_list);
 
         /* free it */
-        free(r);
+        slab_free(&region_cache, r);
     }
 
+#if ARCH_HAS_ASPACE
+    if (has_arch_aspace(aspace))
+        arch_mmu_destroy_aspace(&aspace->arch_aspace);
+#endif
+
     /* free the aspace */
     free(aspace);
 
     return NO_ERROR;
 }
 
+void vmm_context_switch(vmm_aspace_t *oldaspace, vmm_aspace_t *newaspace)
+{
+    DEBUG_ASSERT(arch_ints_disabled());
+
+#if ARCH_HAS_ASPACE
+    /* the kernel aspace is in every translation table, treat it like none */
+    if (newaspace && !has_arch_aspace(newaspace))
+        newaspace = NULL;
+    if (oldaspace && !has_arch_aspace(oldaspace))
+        oldaspace = NULL;
+    if (oldaspace != newaspace)
+        arch_mmu_context_switch(newaspace ? &newaspace->arch_aspace : NULL);
+#endif
+}
+
+void vmm_set_active_aspace(vmm_aspace_t *aspace)
+{
+    thread_t *t = get_current_thread();
+
+    if (t->aspace == aspace)
+        return;
+
+    /* with interrupts off the scheduler can't switch in between */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    vmm_aspace_t *old = t->aspace;
+    t->aspace = aspace;
+    vmm_context_switch(old, aspace);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
 static void dump_region(const vmm_region_t *r)
 {
     printf("\tregion %p: name '%s' range 0x%lx - 0x%lx size 0x%zx flags 0x%x mmu_flags 0x%x\n",
@@ -697,6 +1326,7 @@ usage:
         printf("%s alloc_physical <paddr> <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_contig <size> <align_pow2>\n", argv[0].str);
         printf("%s create_aspace\n", argv[0].str);
+        printf("%s set_aspace <aspace, 0 for none>\n", argv[0].str);
         return ERR_GENERIC;
     }
 
@@ -727,6 +1357,10 @@ usage:
         vmm_aspace_t *aspace;
         status_t err = vmm_create_aspace(&aspace, "test", 0);
         printf("vmm_create_aspace returns %d, aspace %p\n", err, aspace);
+    } else if (!strcmp(argv[1].str, "set_aspace")) {
+        if (argc < 3) goto notenoughargs;
+
+        vmm_set_active_aspace((vmm_aspace_t *)argv[2].u);
     } else {
         printf("unknown command\n");
         goto usage;
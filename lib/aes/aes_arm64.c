@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/arm64.h>
+#include <arch/simd.h>
+#include <lk/init.h>
+#include <stdlib.h>
+#include "aes_hw.h"
+
+/* see aes_armv8.S */
+void aes_armv8_encrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks);
+void aes_armv8_decrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks);
+void aes_armv8_cbc_encrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out,
+                           size_t blocks, uint8_t iv[16]);
+void aes_armv8_cbc_decrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out,
+                           size_t blocks, uint8_t iv[16]);
+void aes_armv8_ctr(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out,
+                   size_t blocks, uint8_t ctr[16]);
+
+/* keep each simd section, and the interrupts off time with it, to 4KB */
+#define ARMV8_CHUNK_BLOCKS 256
+
+static bool aes_armv8_present;
+
+static void aes_armv8_init(uint level)
+{
+    /* ID_AA64ISAR0_EL1.AES, bits [7:4] */
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    aes_armv8_present = simd_available() && ((isar0 >> 4) & 0xf) != 0;
+}
+
+LK_INIT_HOOK(aes_armv8, &aes_armv8_init, LK_INIT_LEVEL_EARLIEST);
+
+bool aes_hw_available(void)
+{
+    return aes_armv8_present;
+}
+
+void aes_hw_encrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    while (blocks) {
+        size_t n = MIN(blocks, ARMV8_CHUNK_BLOCKS);
+
+        simd_begin();
+        aes_armv8_encrypt(key->rd_key_bytes, key->rounds, in, out, n);
+        simd_end();
+
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        blocks -= n;
+    }
+}
+
+void aes_hw_decrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    while (blocks) {
+        size_t n = MIN(blocks, ARMV8_CHUNK_BLOCKS);
+
+        simd_begin();
+        aes_armv8_decrypt(key->rd_key_bytes, key->rounds, in, out, n);
+        simd_end();
+
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        blocks -= n;
+    }
+}
+
+void aes_hw_cbc_encrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t iv[16])
+{
+    while (blocks) {
+        size_t n = MIN(blocks, ARMV8_CHUNK_BLOCKS);
+
+        simd_begin();
+        aes_armv8_cbc_encrypt(key->rd_key_bytes, key->rounds, in, out, n, iv);
+        simd_end();
+
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        blocks -= n;
+    }
+}
+
+void aes_hw_cbc_decrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t iv[16])
+{
+    while (blocks) {
+        size_t n = MIN(blocks, ARMV8_CHUNK_BLOCKS);
+
+        simd_begin();
+        aes_armv8_cbc_decrypt(key->rd_key_bytes, key->rounds, in, out, n, iv);
+        simd_end();
+
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        blocks -= n;
+    }
+}
+
+void aes_hw_ctr(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t ctr[16])
+{
+    while (blocks) {
+        size_t n = MIN(blocks, ARMV8_CHUNK_BLOCKS);
+
+        simd_begin();
+        aes_armv8_ctr(key->rd_key_bytes, key->rounds, in, out, n, ctr);
+        simd_end();
+
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        blocks -= n;
+    }
+}
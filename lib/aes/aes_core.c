@@ -37,6 +37,7 @@
 
 #include <lib/aes.h>
 #include "aes_locl.h"
+#include "aes_hw.h"
 
 /*
 Te0[x] = S [x].[02, 01, 01, 03];
@@ -720,10 +721,15 @@ static const u32 rcon[] = {
 	0x1B000000, 0x36000000, /* for 128-bit blocks, Rijndael never uses more than 10 rcon values */
 };
 
-/**
- * Expand the cipher key into the encryption key schedule.
- */
-int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
+/* copy the schedule out as byte strings for the aes instructions */
+static void aes_key_bytes(AES_KEY *key) {
+	int i;
+
+	for (i = 0; i < 4 * (key->rounds + 1); i++)
+		PUTU32(key->rd_key_bytes + 4 * i, key->rd_key[i]);
+}
+
+static int aes_expand_key(const unsigned char *userKey, const int bits,
 			AES_KEY *key) {
 
 	u32 *rk;
@@ -821,6 +827,20 @@ int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
 	return 0;
 }
 
+/**
+ * Expand the cipher key into the encryption key schedule.
+ */
+int AES_set_encrypt_key(const unsigned char *userKey, const int bits,
+			AES_KEY *key) {
+
+	int status = aes_expand_key(userKey, bits, key);
+	if (status < 0)
+		return status;
+
+	aes_key_bytes(key);
+	return 0;
+}
+
 /**
  * Expand the cipher key into the decryption key schedule.
  */
@@ -869,6 +889,7 @@ int AES_set_decrypt_key(const unsigned char *userKey, const int bits,
 			Td2[Te4[(rk[3] >>  8) & 0xff] & 0xff] ^
 			Td3[Te4[(rk[3]      ) & 0xff] & 0xff];
 	}
+	aes_key_bytes(key);
 	return 0;
 }
 
@@ -886,6 +907,12 @@ void AES_encrypt(const unsigned char *in, unsigned char *out,
 #endif /* ?FULL_UNROLL */
 
 	if(!(in && out && key)) return;
+#if AES_HW
+	if (aes_hw_available()) {
+		aes_hw_encrypt(key, in, out, 1);
+		return;
+	}
+#endif
 	rk = key->rd_key;
 
 	/*
@@ -1077,6 +1104,12 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 #endif /* ?FULL_UNROLL */
 
 	if(!(in && out && key)) return;
+#if AES_HW
+	if (aes_hw_available()) {
+		aes_hw_decrypt(key, in, out, 1);
+		return;
+	}
+#endif
 	rk = key->rd_key;
 
 	/*
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <lib/aes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if AES_HW
+/* cpu specific bulk routines over whole blocks, each arch decides at boot
+ * whether it can run them. iv and ctr are updated for the next call.
+ */
+bool aes_hw_available(void);
+void aes_hw_encrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks);
+void aes_hw_decrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks);
+void aes_hw_cbc_encrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t iv[16]);
+void aes_hw_cbc_decrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t iv[16]);
+void aes_hw_ctr(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t ctr[16]);
+#endif
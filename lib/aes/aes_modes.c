@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/aes.h>
+#include <string.h>
+#include "aes_hw.h"
+
+/* cbc and ctr on top of the block cipher, or the cpu's bulk routines when
+ * there are some. Same interface as the openssl ones.
+ */
+
+static void xor_block(unsigned char *out, const unsigned char *a, const unsigned char *b)
+{
+	for (int i = 0; i < AES_BLOCK_SIZE; i++)
+		out[i] = a[i] ^ b[i];
+}
+
+/* 128 bit big endian increment */
+static void ctr128_inc(unsigned char *ctr)
+{
+	for (int i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
+		if (++ctr[i])
+			break;
+	}
+}
+
+static void cbc_encrypt_sw(const unsigned char *in, unsigned char *out, size_t blocks,
+                           const AES_KEY *key, unsigned char *ivec)
+{
+	const unsigned char *iv = ivec;
+
+	while (blocks--) {
+		xor_block(out, in, iv);
+		AES_encrypt(out, out, key);
+		iv = out;
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+	}
+	memmove(ivec, iv, AES_BLOCK_SIZE);
+}
+
+static void cbc_decrypt_sw(const unsigned char *in, unsigned char *out, size_t blocks,
+                           const AES_KEY *key, unsigned char *ivec)
+{
+	unsigned char next_iv[AES_BLOCK_SIZE];
+
+	while (blocks--) {
+		/* in and out may be the same buffer */
+		memcpy(next_iv, in, AES_BLOCK_SIZE);
+		AES_decrypt(in, out, key);
+		xor_block(out, out, ivec);
+		memcpy(ivec, next_iv, AES_BLOCK_SIZE);
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+	}
+}
+
+void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
+                     size_t length, const AES_KEY *key,
+                     unsigned char *ivec, const int enc)
+{
+	size_t blocks = length / AES_BLOCK_SIZE;
+
+	if (blocks == 0)
+		return;
+
+#if AES_HW
+	if (aes_hw_available()) {
+		if (enc)
+			aes_hw_cbc_encrypt(key, in, out, blocks, ivec);
+		else
+			aes_hw_cbc_decrypt(key, in, out, blocks, ivec);
+		return;
+	}
+#endif
+
+	if (enc)
+		cbc_encrypt_sw(in, out, blocks, key, ivec);
+	else
+		cbc_decrypt_sw(in, out, blocks, key, ivec);
+}
+
+static void ctr_sw(const unsigned char *in, unsigned char *out, size_t blocks,
+                   const AES_KEY *key, unsigned char *ivec)
+{
+	unsigned char stream[AES_BLOCK_SIZE];
+
+	while (blocks--) {
+		AES_encrypt(ivec, stream, key);
+		ctr128_inc(ivec);
+		xor_block(out, in, stream);
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+	}
+}
+
+void AES_ctr128_encrypt(const unsigned char *in, unsigned char *out,
+                        size_t length, const AES_KEY *key,
+                        unsigned char ivec[AES_BLOCK_SIZE],
+                        unsigned char ecount_buf[AES_BLOCK_SIZE],
+                        unsigned int *num)
+{
+	unsigned int n = *num;
+
+	/* finish off the key stream left over from the last call */
+	while (n && length) {
+		*out++ = *in++ ^ ecount_buf[n];
+		n = (n + 1) % AES_BLOCK_SIZE;
+		length--;
+	}
+
+	size_t blocks = length / AES_BLOCK_SIZE;
+	if (blocks) {
+#if AES_HW
+		if (aes_hw_available())
+			aes_hw_ctr(key, in, out, blocks, ivec);
+		else
+#endif
+			ctr_sw(in, out, blocks, key, ivec);
+
+		in += blocks * AES_BLOCK_SIZE;
+		out += blocks * AES_BLOCK_SIZE;
+		length -= blocks * AES_BLOCK_SIZE;
+	}
+
+	if (length) {
+		AES_encrypt(ivec, ecount_buf, key);
+		ctr128_inc(ivec);
+		while (length--) {
+			out[n] = in[n] ^ ecount_buf[n];
+			n++;
+		}
+	}
+
+	*num = n;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/x86.h>
+#include <arch/simd.h>
+#include <lk/init.h>
+#include <stdlib.h>
+#include "aes_hw.h"
+
+/* see aes_aesni.S */
+void aesni_encrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks);
+void aesni_decrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out, size_t blocks);
+void aesni_cbc_encrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out,
+                       size_t blocks, uint8_t iv[16]);
+void aesni_cbc_decrypt(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out,
+                       size_t blocks, uint8_t iv[16]);
+void aesni_ctr(const uint8_t *rk, int rounds, const uint8_t *in, uint8_t *out,
+               size_t blocks, uint8_t ctr[16]);
+
+/* interrupts are off inside simd_begin(), so do big buffers 4KB at a time */
+#define AESNI_CHUNK_BLOCKS 256
+
+static bool aesni_present;
+
+static void aesni_init(uint level)
+{
+	aesni_present = simd_available() && check_aesni_avail();
+}
+
+LK_INIT_HOOK(aesni, &aesni_init, LK_INIT_LEVEL_EARLIEST);
+
+bool aes_hw_available(void)
+{
+	return aesni_present;
+}
+
+void aes_hw_encrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+	while (blocks) {
+		size_t n = MIN(blocks, AESNI_CHUNK_BLOCKS);
+
+		simd_begin();
+		aesni_encrypt(key->rd_key_bytes, key->rounds, in, out, n);
+		simd_end();
+
+		in += n * AES_BLOCK_SIZE;
+		out += n * AES_BLOCK_SIZE;
+		blocks -= n;
+	}
+}
+
+void aes_hw_decrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks)
+{
+	while (blocks) {
+		size_t n = MIN(blocks, AESNI_CHUNK_BLOCKS);
+
+		simd_begin();
+		aesni_decrypt(key->rd_key_bytes, key->rounds, in, out, n);
+		simd_end();
+
+		in += n * AES_BLOCK_SIZE;
+		out += n * AES_BLOCK_SIZE;
+		blocks -= n;
+	}
+}
+
+void aes_hw_cbc_encrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t iv[16])
+{
+	while (blocks) {
+		size_t n = MIN(blocks, AESNI_CHUNK_BLOCKS);
+
+		simd_begin();
+		aesni_cbc_encrypt(key->rd_key_bytes, key->rounds, in, out, n, iv);
+		simd_end();
+
+		in += n * AES_BLOCK_SIZE;
+		out += n * AES_BLOCK_SIZE;
+		blocks -= n;
+	}
+}
+
+void aes_hw_cbc_decrypt(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t iv[16])
+{
+	while (blocks) {
+		size_t n = MIN(blocks, AESNI_CHUNK_BLOCKS);
+
+		simd_begin();
+		aesni_cbc_decrypt(key->rd_key_bytes, key->rounds, in, out, n, iv);
+		simd_end();
+
+		in += n * AES_BLOCK_SIZE;
+		out += n * AES_BLOCK_SIZE;
+		blocks -= n;
+	}
+}
+
+void aes_hw_ctr(const AES_KEY *key, const uint8_t *in, uint8_t *out, size_t blocks, uint8_t ctr[16])
+{
+	while (blocks) {
+		size_t n = MIN(blocks, AESNI_CHUNK_BLOCKS);
+
+		simd_begin();
+		aesni_ctr(key->rd_key_bytes, key->rounds, in, out, n, ctr);
+		simd_end();
+
+		in += n * AES_BLOCK_SIZE;
+		out += n * AES_BLOCK_SIZE;
+		blocks -= n;
+	}
+}
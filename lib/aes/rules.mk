@@ -7,6 +7,21 @@ GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 
 
 MODULE_SRCS := \
-	$(LOCAL_DIR)/aes_core.c
+	$(LOCAL_DIR)/aes_core.c \
+	$(LOCAL_DIR)/aes_modes.c
+
+# aes instructions where the cpu has them, checked at boot
+ifeq ($(ARCH)-$(KERNEL_SIMD),arm64-1)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/aes_arm64.c \
+	$(LOCAL_DIR)/aes_armv8.S
+MODULE_DEFINES += AES_HW=1
+endif
+ifeq ($(ARCH)-$(KERNEL_SIMD),x86-64-1)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/aes_x86_64.c \
+	$(LOCAL_DIR)/aes_aesni.S
+MODULE_DEFINES += AES_HW=1
+endif
 
 include make/module.mk
@@ -5,6 +5,7 @@
 #include <lib/aes.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <platform.h>
 #include <debug.h>
@@ -32,6 +33,98 @@ static const uint8_t expected_ciphertext[] = {
 	0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
 };
 
+/*
+ * NIST SP 800-38A, F.2.1 "CBC-AES128.Encrypt" and F.5.1 "CTR-AES128.Encrypt"
+ */
+static const uint8_t sp800_38a_key[] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+static const uint8_t sp800_38a_plaintext[] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+	0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+	0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+
+static const uint8_t cbc_iv[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+static const uint8_t cbc_ciphertext[] = {
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+	0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+	0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+	0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+	0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7
+};
+
+static const uint8_t ctr_counter[] = {
+	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+	0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+static const uint8_t ctr_ciphertext[] = {
+	0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+	0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+	0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+	0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+	0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+	0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+	0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+	0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee
+};
+
+static void check_result(const char *what, const uint8_t *expected, const uint8_t *actual, size_t len)
+{
+	if (memcmp(expected, actual, len)) {
+		TRACEF("%s failed.  Expected:\n", what);
+		hexdump8(expected, len);
+		TRACEF("Actual:\n");
+		hexdump8(actual, len);
+		TRACEF("FAILED %s\n", what);
+	} else {
+		TRACEF("PASSED %s\n", what);
+	}
+}
+
+static void aes_modes_test(void)
+{
+	AES_KEY aes_key;
+	uint8_t buf[sizeof(sp800_38a_plaintext)];
+	uint8_t iv[AES_BLOCK_SIZE];
+	uint8_t ecount[AES_BLOCK_SIZE];
+	unsigned int num;
+
+	AES_set_encrypt_key(sp800_38a_key, 128, &aes_key);
+	memcpy(iv, cbc_iv, sizeof(iv));
+	AES_cbc_encrypt(sp800_38a_plaintext, buf, sizeof(buf), &aes_key, iv, AES_ENCRYPT);
+	check_result("AES-CBC encryption", cbc_ciphertext, buf, sizeof(buf));
+
+	/* in place */
+	AES_set_decrypt_key(sp800_38a_key, 128, &aes_key);
+	memcpy(iv, cbc_iv, sizeof(iv));
+	AES_cbc_encrypt(buf, buf, sizeof(buf), &aes_key, iv, AES_DECRYPT);
+	check_result("AES-CBC decryption", sp800_38a_plaintext, buf, sizeof(buf));
+
+	/* in two uneven pieces to cover the carried key stream */
+	AES_set_encrypt_key(sp800_38a_key, 128, &aes_key);
+	memcpy(iv, ctr_counter, sizeof(iv));
+	num = 0;
+	AES_ctr128_encrypt(sp800_38a_plaintext, buf, 21, &aes_key, iv, ecount, &num);
+	AES_ctr128_encrypt(sp800_38a_plaintext + 21, buf + 21, sizeof(buf) - 21, &aes_key, iv, ecount, &num);
+	check_result("AES-CTR encryption", ctr_ciphertext, buf, sizeof(buf));
+}
+
 static int aes_command(int argc, const cmd_args *argv)
 {
 	AES_KEY aes_key;
@@ -57,6 +150,8 @@ static int aes_command(int argc, const cmd_args *argv)
 	} else {
 		TRACEF("PASSED AES encryption\n");
 	}
+
+	aes_modes_test();
 	return 0;
 }
 
@@ -87,6 +182,41 @@ static int aes_bench(int argc, const cmd_args *argv)
 
 	printf("%u cycles to encrypt block of 16 bytes\n", c / ITER);
 
+#define BULK_SIZE 4096
+#define BULK_ITER 64
+	uint8_t *buf = malloc(BULK_SIZE);
+	if (!buf)
+		return -1;
+	memset(buf, 0, BULK_SIZE);
+
+	uint8_t iv[AES_BLOCK_SIZE];
+	uint8_t ecount[AES_BLOCK_SIZE];
+	unsigned int num = 0;
+	memset(iv, 0, sizeof(iv));
+
+	c = arch_cycle_count();
+	for (i = 0; i < BULK_ITER; i++) {
+		AES_cbc_encrypt(buf, buf, BULK_SIZE, &aes_key, iv, AES_ENCRYPT);
+	}
+	c = arch_cycle_count() - c;
+	printf("%u cycles per 1KB cbc encrypt\n", c / (BULK_ITER * BULK_SIZE / 1024));
+
+	c = arch_cycle_count();
+	for (i = 0; i < BULK_ITER; i++) {
+		AES_ctr128_encrypt(buf, buf, BULK_SIZE, &aes_key, iv, ecount, &num);
+	}
+	c = arch_cycle_count() - c;
+	printf("%u cycles per 1KB ctr\n", c / (BULK_ITER * BULK_SIZE / 1024));
+
+	AES_set_decrypt_key(key, 128, &aes_key);
+	c = arch_cycle_count();
+	for (i = 0; i < BULK_ITER; i++) {
+		AES_cbc_encrypt(buf, buf, BULK_SIZE, &aes_key, iv, AES_DECRYPT);
+	}
+	c = arch_cycle_count() - c;
+	printf("%u cycles per 1KB cbc decrypt\n", c / (BULK_ITER * BULK_SIZE / 1024));
+
+	free(buf);
 	return 0;
 }
 
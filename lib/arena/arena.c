@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/arena.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <pow2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <lib/heap.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+#define ARENA_DEFAULT_CHUNK_SIZE (16 * 1024)
+#define ARENA_MIN_ALIGN sizeof(void *)
+
+#define ARENA_FLAG_BUFFER  0x1 /* a single caller supplied chunk, never grows or gets freed */
+#define ARENA_FLAG_CREATED 0x2 /* the arena_t itself came from arena_create */
+
+/* placed at the start of every chunk */
+struct arena_chunk {
+	struct list_node node;
+	size_t len;
+};
+
+static struct arena_chunk *chunk_alloc(size_t len)
+{
+#if WITH_KERNEL_VM
+	len = ROUNDUP(len, PAGE_SIZE);
+	struct arena_chunk *chunk = pmm_alloc_kpages(len / PAGE_SIZE, NULL);
+#else
+	struct arena_chunk *chunk = heap_alloc(len, 0);
+#endif
+	if (!chunk)
+		return NULL;
+
+	LTRACEF("chunk %p len 0x%zx\n", chunk, len);
+
+	chunk->len = len;
+	return chunk;
+}
+
+static void chunk_free(struct arena_chunk *chunk)
+{
+	LTRACEF("chunk %p len 0x%zx\n", chunk, chunk->len);
+
+#if WITH_KERNEL_VM
+	pmm_free_kpages(chunk, chunk->len / PAGE_SIZE);
+#else
+	heap_free(chunk);
+#endif
+}
+
+static inline uint8_t *chunk_start(struct arena_chunk *chunk)
+{
+	return (uint8_t *)(chunk + 1);
+}
+
+static inline uint8_t *chunk_end(struct arena_chunk *chunk)
+{
+	return (uint8_t *)chunk + chunk->len;
+}
+
+void arena_init(arena_t *arena, size_t chunk_size)
+{
+	DEBUG_ASSERT(arena);
+
+	list_initialize(&arena->chunks);
+	arena->pos = arena->end = NULL;
+	arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+	arena->flags = 0;
+	arena->allocated = 0;
+	arena->chunk_bytes = 0;
+}
+
+void arena_init_buffer(arena_t *arena, void *buf, size_t len)
+{
+	DEBUG_ASSERT(arena);
+	DEBUG_ASSERT(buf);
+
+	arena_init(arena, 0);
+	arena->flags = ARENA_FLAG_BUFFER;
+
+	/* the buffer becomes the one and only chunk */
+	uintptr_t start = ROUNDUP((uintptr_t)buf, ARENA_MIN_ALIGN);
+	uintptr_t end = (uintptr_t)buf + len;
+	if (end <= start || end - start < sizeof(struct arena_chunk))
+		return;
+
+	struct arena_chunk *chunk = (struct arena_chunk *)start;
+	chunk->len = end - start;
+	list_add_head(&arena->chunks, &chunk->node);
+
+	arena->pos = chunk_start(chunk);
+	arena->end = chunk_end(chunk);
+	arena->chunk_bytes = chunk->len;
+}
+
+arena_t *arena_create(size_t chunk_size)
+{
+	arena_t *arena = malloc(sizeof(arena_t));
+	if (!arena)
+		return NULL;
+
+	arena_init(arena, chunk_size);
+	arena->flags |= ARENA_FLAG_CREATED;
+
+	return arena;
+}
+
+void *arena_alloc(arena_t *arena, size_t size, size_t align)
+{
+	DEBUG_ASSERT(arena);
+	DEBUG_ASSERT(align == 0 || ispow2(align));
+
+	if (align < ARENA_MIN_ALIGN)
+		align = ARENA_MIN_ALIGN;
+
+	/* fast path, it fits in the current chunk */
+	uintptr_t ptr = ROUNDUP((uintptr_t)arena->pos, align);
+	if (arena->pos && ptr <= (uintptr_t)arena->end && size <= (uintptr_t)arena->end - ptr) {
+		arena->pos = (uint8_t *)(ptr + size);
+		arena->allocated += size;
+		return (void *)ptr;
+	}
+
+	if (arena->flags & ARENA_FLAG_BUFFER)
+		return NULL;
+
+	/* grab a new chunk, big enough for this allocation if it's oversized */
+	size_t need = sizeof(struct arena_chunk) + align + size;
+	if (need < size)
+		return NULL;
+
+	struct arena_chunk *chunk = chunk_alloc(MAX(need, arena->chunk_size));
+	if (!chunk)
+		return NULL;
+
+	arena->chunk_bytes += chunk->len;
+
+	ptr = ROUNDUP((uintptr_t)chunk_start(chunk), align);
+	uint8_t *pos = (uint8_t *)(ptr + size);
+
+	/* keep bumping through whichever chunk has more left over. an oversized
+	 * allocation shouldn't throw away the rest of the current chunk */
+	struct arena_chunk *head = list_peek_head_type(&arena->chunks, struct arena_chunk, node);
+	if (head && (size_t)(arena->end - arena->pos) > (size_t)(chunk_end(chunk) - pos)) {
+		list_add_head(&head->node, &chunk->node);
+	} else {
+		list_add_head(&arena->chunks, &chunk->node);
+		arena->pos = pos;
+		arena->end = chunk_end(chunk);
+	}
+
+	arena->allocated += size;
+	return (void *)ptr;
+}
+
+void arena_reset(arena_t *arena)
+{
+	DEBUG_ASSERT(arena);
+
+	LTRACEF("arena %p, 0x%zx bytes allocated\n", arena, arena->allocated);
+
+	/* hang on to the oldest chunk, free the rest */
+	struct arena_chunk *keep = list_remove_tail_type(&arena->chunks, struct arena_chunk, node);
+
+	struct arena_chunk *chunk;
+	while ((chunk = list_remove_head_type(&arena->chunks, struct arena_chunk, node))) {
+		arena->chunk_bytes -= chunk->len;
+		chunk_free(chunk);
+	}
+
+	arena->allocated = 0;
+	if (keep) {
+		list_add_head(&arena->chunks, &keep->node);
+		arena->pos = chunk_start(keep);
+		arena->end = chunk_end(keep);
+	} else {
+		arena->pos = arena->end = NULL;
+	}
+}
+
+void arena_destroy(arena_t *arena)
+{
+	if (!arena)
+		return;
+
+	LTRACEF("arena %p\n", arena);
+
+	if (!(arena->flags & ARENA_FLAG_BUFFER)) {
+		struct arena_chunk *chunk;
+		while ((chunk = list_remove_head_type(&arena->chunks, struct arena_chunk, node)))
+			chunk_free(chunk);
+	}
+
+	if (arena->flags & ARENA_FLAG_CREATED) {
+		free(arena);
+		return;
+	}
+
+	arena_init(arena, arena->chunk_size);
+}
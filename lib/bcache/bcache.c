@@ -24,66 +24,158 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <err.h>
 #include <sys/types.h>
 #include <debug.h>
 #include <trace.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/percpu.h>
+#include <kernel/thread.h>
+#include <arch/ops.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
+#include <lib/slab.h>
 
 #define LOCAL_TRACE 0
 
+struct bcache_readahead;
+
 struct bcache_block {
 	struct list_node node;
+	struct list_node hash_node;
 	bnum_t blocknum;
 	int ref_count;
 	bool is_dirty;
 	void *ptr;
+
+	/* set while a prefetch is filling the block, cleared by the completion */
+	volatile int loading;
+	int fill_err;
+	struct bcache_readahead *ra;
+};
+
+/* one asynchronous fill of a run of blocks */
+struct bcache_readahead {
+	bio_request_t req;
+	event_t done;
+	volatile int busy;
+	uint count;
+	iovec_t iov[BCACHE_MAX_READAHEAD];
+	struct bcache_block *blocks[BCACHE_MAX_READAHEAD];
 };
 
+#define BCACHE_READAHEAD_SLOTS 2
+
 struct bcache_stats {
-	uint32_t hits;
-	uint32_t depth;
-	uint32_t misses;
-	uint32_t reads;
-	uint32_t writes;
+	percpu_counter_t hits;
+	percpu_counter_t depth;
+	percpu_counter_t misses;
+	percpu_counter_t reads;
+	percpu_counter_t writes;
+	percpu_counter_t write_runs;
+	percpu_counter_t writebacks;
+	percpu_counter_t prefetches;
+	percpu_counter_t prefetch_hits;
 };
 
 struct bcache {
+	struct list_node node;
 	bdev_t *dev;
 	size_t block_size;
 	int count;
+
+	/* bumped from any cpu without the lock */
 	struct bcache_stats stats;
 
+	/* everything below is protected by lock */
+	mutex_t lock;
+
 	struct list_node free_list;
 	struct list_node lru_list;
 
+	/* blocks in the lru, by block number */
+	struct list_node *hash;
+	uint hash_mask;
+
 	struct bcache_block *blocks;
+
+	/* scratch for flushing, the dirty blocks in block order */
+	struct bcache_block **flush_list;
+	iovec_t flush_iov[BCACHE_MAX_WRITEBACK];
+
+	struct bcache_readahead readahead[BCACHE_READAHEAD_SLOTS];
+
+	/* background writeback, started when the first block gets dirty */
+	lk_time_t writeback_interval;
+	thread_t *writeback_thread;
+	event_t writeback_event;
 };
 
+static slab_cache_t bcache_cache = SLAB_CACHE_INITIAL_VALUE(bcache_cache, "bcache", sizeof(struct bcache), CACHE_LINE, NULL);
+
+/* every cache, for the console */
+static struct list_node bcache_list = LIST_INITIAL_VALUE(bcache_list);
+static mutex_t bcache_list_lock = MUTEX_INITIAL_VALUE(bcache_list_lock);
+
+static inline struct list_node *hash_bucket(struct bcache *cache, bnum_t blocknum)
+{
+	return &cache->hash[blocknum & cache->hash_mask];
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
 	struct bcache *cache;
 
-	cache = malloc(sizeof(struct bcache));
+	cache = slab_alloc(&bcache_cache);
+	if (!cache)
+		return NULL;
 
 	cache->dev = dev;
 	cache->block_size = block_size;
 	cache->count = block_count;
+	mutex_init(&cache->lock);
 	memset(&cache->stats, 0, sizeof(cache->stats));
 
 	list_initialize(&cache->free_list);
 	list_initialize(&cache->lru_list);
 
+	/* a bucket per block keeps the chains about one long */
+	uint buckets = 1;
+	while (buckets < (uint)block_count)
+		buckets <<= 1;
+	cache->hash = malloc(sizeof(struct list_node) * buckets);
+	cache->hash_mask = buckets - 1;
+	for (uint i = 0; i < buckets; i++)
+		list_initialize(&cache->hash[i]);
+
 	cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
+	cache->flush_list = malloc(sizeof(struct bcache_block *) * block_count);
 	int i;
 	for (i=0; i < block_count; i++) {
 		cache->blocks[i].ref_count = 0;
 		cache->blocks[i].is_dirty = false;
 		cache->blocks[i].ptr = malloc(block_size);
+		list_clear_node(&cache->blocks[i].hash_node);
+		cache->blocks[i].loading = 0;
+		cache->blocks[i].ra = NULL;
 		// add to the free list
 		list_add_head(&cache->free_list, &cache->blocks[i].node);
 	}
 
+	for (i = 0; i < BCACHE_READAHEAD_SLOTS; i++) {
+		cache->readahead[i].busy = 0;
+		event_init(&cache->readahead[i].done, true, 0);
+	}
+
+	cache->writeback_interval = BCACHE_DEFAULT_WRITEBACK_INTERVAL;
+	cache->writeback_thread = NULL;
+	event_init(&cache->writeback_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+	mutex_acquire(&bcache_list_lock);
+	list_add_tail(&bcache_list, &cache->node);
+	mutex_release(&bcache_list_lock);
+
 	return (bcache_t)cache;
 }
 
@@ -98,17 +190,140 @@ static int flush_block(struct bcache *cache, struct bcache_block *block)
 		goto exit;
 
 	block->is_dirty = false;
-	cache->stats.writes++;
+	percpu_counter_inc(&cache->stats.writes);
 	rc = 0;
 exit:
 	return (rc);
 }
 
+static int compare_blocknum(const void *_a, const void *_b)
+{
+	const struct bcache_block *a = *(struct bcache_block * const *)_a;
+	const struct bcache_block *b = *(struct bcache_block * const *)_b;
+
+	return (a->blocknum > b->blocknum) - (a->blocknum < b->blocknum);
+}
+
+/* write back every dirty block, in block order so that neighbours go out in one write */
+static int flush_locked(struct bcache *cache)
+{
+	struct bcache_block *block;
+	uint count = 0;
+
+	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+		if (block->is_dirty)
+			cache->flush_list[count++] = block;
+	}
+
+	qsort(cache->flush_list, count, sizeof(struct bcache_block *), &compare_blocknum);
+
+	for (uint i = 0; i < count; ) {
+		uint run = 0;
+		do {
+			cache->flush_iov[run].iov_base = cache->flush_list[i + run]->ptr;
+			cache->flush_iov[run].iov_len = cache->block_size;
+			run++;
+		} while (i + run < count && run < BCACHE_MAX_WRITEBACK &&
+		         cache->flush_list[i + run]->blocknum == cache->flush_list[i]->blocknum + run);
+
+		LTRACEF("blocks %u-%u\n", cache->flush_list[i]->blocknum, cache->flush_list[i]->blocknum + run - 1);
+
+		ssize_t rc = bio_writev(cache->dev, cache->flush_iov, run,
+		                        (off_t)cache->flush_list[i]->blocknum * cache->block_size);
+		if (rc < (ssize_t)(run * cache->block_size))
+			return (rc < 0) ? (int)rc : ERR_IO;
+
+		for (uint j = 0; j < run; j++)
+			cache->flush_list[i + j]->is_dirty = false;
+		percpu_counter_add(&cache->stats.writes, run);
+		percpu_counter_inc(&cache->stats.write_runs);
+		i += run;
+	}
+
+	return 0;
+}
+
+static int bcache_writeback_thread(void *arg)
+{
+	struct bcache *cache = arg;
+
+	mutex_acquire(&cache->lock);
+
+	/* run until bcache_set_writeback or bcache_destroy lets go of us */
+	while (cache->writeback_thread == get_current_thread()) {
+		lk_time_t interval = cache->writeback_interval;
+		mutex_release(&cache->lock);
+
+		event_wait_timeout(&cache->writeback_event, interval);
+
+		mutex_acquire(&cache->lock);
+		if (cache->writeback_thread != get_current_thread())
+			break;
+
+		percpu_counter_inc(&cache->stats.writebacks);
+		if (flush_locked(cache) < 0)
+			TRACEF("writeback to %s failed\n", cache->dev->name);
+	}
+
+	mutex_release(&cache->lock);
+
+	return 0;
+}
+
+/* a block just got dirty, make sure someone is going to write it back */
+static void dirtied_locked(struct bcache *cache)
+{
+	if (!cache->writeback_interval || cache->writeback_thread)
+		return;
+
+	/* if this fails dirty blocks still go out on eviction and bcache_flush */
+	thread_t *t = thread_create("bcache writeback", &bcache_writeback_thread, cache,
+	                            LOW_PRIORITY, DEFAULT_STACK_SIZE);
+	if (t) {
+		cache->writeback_thread = t;
+		thread_resume(t);
+	}
+}
+
+/* detach the writeback thread, the caller waits for it with stop_writeback_finish */
+static thread_t *stop_writeback_locked(struct bcache *cache)
+{
+	thread_t *t = cache->writeback_thread;
+	cache->writeback_thread = NULL;
+
+	return t;
+}
+
+static void stop_writeback_finish(struct bcache *cache, thread_t *t)
+{
+	if (!t)
+		return;
+
+	event_signal(&cache->writeback_event, true);
+	thread_join(t, NULL, INFINITE_TIME);
+}
+
 void bcache_destroy(bcache_t _cache)
 {
 	struct bcache *cache = _cache;
 	int i;
 
+	mutex_acquire(&bcache_list_lock);
+	list_delete(&cache->node);
+	mutex_release(&bcache_list_lock);
+
+	mutex_acquire(&cache->lock);
+	thread_t *t = stop_writeback_locked(cache);
+	mutex_release(&cache->lock);
+	stop_writeback_finish(cache, t);
+
+	for (i = 0; i < BCACHE_READAHEAD_SLOTS; i++) {
+		event_wait(&cache->readahead[i].done);
+		while (cache->readahead[i].busy)
+			thread_yield();
+		event_destroy(&cache->readahead[i].done);
+	}
+
 	for (i=0; i < cache->count; i++) {
 		DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
@@ -119,7 +334,29 @@ void bcache_destroy(bcache_t _cache)
 		free(cache->blocks[i].ptr);
 	}
 
-	free(cache);
+	event_destroy(&cache->writeback_event);
+	mutex_destroy(&cache->lock);
+	free(cache->blocks);
+	free(cache->flush_list);
+	free(cache->hash);
+	slab_free(&bcache_cache, cache);
+}
+
+/* look a block up in the hash without touching the lru or the stats */
+static struct bcache_block *lookup_block(struct bcache *cache, uint blocknum, uint32_t *depth)
+{
+	struct bcache_block *block;
+
+	list_for_every_entry(hash_bucket(cache, blocknum), block, struct bcache_block, hash_node) {
+		LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
+		if (depth)
+			(*depth)++;
+
+		if (block->blocknum == blocknum)
+			return block;
+	}
+
+	return NULL;
 }
 
 /* find a block if it's already present */
@@ -130,25 +367,20 @@ static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
 
 	LTRACEF("num %u\n", blocknum);
 
-	block = NULL;
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-		LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-		depth++;
-
-		if (block->blocknum == blocknum) {
-			list_delete(&block->node);
-			list_add_tail(&cache->lru_list, &block->node);
-			cache->stats.hits++;
-			cache->stats.depth += depth;
-			return block;
-		}
+	block = lookup_block(cache, blocknum, &depth);
+	if (block) {
+		list_delete(&block->node);
+		list_add_tail(&cache->lru_list, &block->node);
+		percpu_counter_inc(&cache->stats.hits);
+		percpu_counter_add(&cache->stats.depth, depth);
+		return block;
 	}
 
-	cache->stats.misses++;
+	percpu_counter_inc(&cache->stats.misses);
 	return NULL;
 }
 
-/* allocate a new block */
+/* allocate a new block, the caller hashes it once it has a number */
 static struct bcache_block *alloc_block(struct bcache *cache)
 {
 	int err;
@@ -158,6 +390,7 @@ static struct bcache_block *alloc_block(struct bcache *cache)
 	block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
 	if (block) {
 		block->ref_count = 0;
+		block->ra = NULL;
 		list_add_tail(&cache->lru_list, &block->node);
 		LTRACEF("found block %p on free list\n", block);
 		return block;
@@ -166,13 +399,16 @@ static struct bcache_block *alloc_block(struct bcache *cache)
 	/* walk the lru, looking for a free block */
 	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
 		LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-		if (block->ref_count == 0) {
+		if (block->ref_count == 0 && !block->loading) {
 			if (block->is_dirty) {
 				err = flush_block(cache, block);
 				if (err)
 					return NULL;
 			}
 
+			list_delete(&block->hash_node);
+			block->ra = NULL;
+
 			// add it to the tail of the lru
 			list_delete(&block->node);
 			list_add_tail(&cache->lru_list, &block->node);
@@ -183,6 +419,42 @@ static struct bcache_block *alloc_block(struct bcache *cache)
 	return NULL;
 }
 
+/* give a block alloc_block handed out back without using it */
+static void free_block(struct bcache *cache, struct bcache_block *block)
+{
+	list_delete(&block->node);
+	list_add_tail(&cache->free_list, &block->node);
+}
+
+/* first touch of a block since it was prefetched, it may still be on its way.
+ * drops the block and returns NULL if the prefetch failed.
+ */
+static struct bcache_block *wait_for_fill(struct bcache *cache, struct bcache_block *block)
+{
+	if (!block || !block->ra)
+		return block;
+
+	/* hold a ref so it stays put while we sleep */
+	block->ref_count++;
+	while (block->loading) {
+		struct bcache_readahead *ra = block->ra;
+		mutex_release(&cache->lock);
+		event_wait(&ra->done);
+		mutex_acquire(&cache->lock);
+	}
+	block->ref_count--;
+	block->ra = NULL;
+
+	if (block->fill_err < 0) {
+		list_delete(&block->hash_node);
+		free_block(cache, block);
+		return NULL;
+	}
+
+	percpu_counter_inc(&cache->stats.prefetch_hits);
+	return block;
+}
+
 static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
 {
 	int err;
@@ -190,13 +462,14 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 	LTRACEF("block %u\n", blocknum);
 
 	/* see if it's already in the cache */
-	struct bcache_block *block = find_block(cache, blocknum);
+	struct bcache_block *block = wait_for_fill(cache, find_block(cache, blocknum));
 	if (block == NULL) {
 		LTRACEF("wasn't allocated\n");
 
 		/* allocate a new block and fill it */
 		block = alloc_block(cache);
-		DEBUG_ASSERT(block);
+		if (!block)
+			return NULL;
 
 		LTRACEF("wasn't allocated, new block %p\n", block);
 
@@ -204,11 +477,12 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 		err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
 		if (err < 0) {
 			/* free the block, return an error */
-			list_add_tail(&cache->free_list, &block->node);
+			free_block(cache, block);
 			return NULL;
 		}
 
-		cache->stats.reads++;
+		list_add_head(hash_bucket(cache, blocknum), &block->hash_node);
+		percpu_counter_inc(&cache->stats.reads);
 	}
 
 	DEBUG_ASSERT(block->blocknum == blocknum);
@@ -219,38 +493,49 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 {
 	struct bcache *cache = _cache;
+	int err = 0;
 
 	LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
+	mutex_acquire(&cache->lock);
+
 	struct bcache_block *block = find_or_fill_block(cache, blocknum);
 	if (block == NULL) {
 		/* error */
-		return -1;
+		err = -1;
+		goto exit;
 	}
 
 	memcpy(buf, block->ptr, cache->block_size);
-	return 0;
+exit:
+	mutex_release(&cache->lock);
+	return err;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 {
 	struct bcache *cache = _cache;
+	int err = 0;
 
 	LTRACEF("ptr %p, blocknum %u\n", ptr, blocknum);
 
 	DEBUG_ASSERT(ptr);
 
+	mutex_acquire(&cache->lock);
+
 	struct bcache_block *block = find_or_fill_block(cache, blocknum);
 	if (block == NULL) {
 		/* error */
-		return -1;
+		err = -1;
+		goto exit;
 	}
 
 	/* increment the ref count to keep it from being freed */
 	block->ref_count++;
 	*ptr = block->ptr;
-
-	return 0;
+exit:
+	mutex_release(&cache->lock);
+	return err;
 }
 
 int bcache_put_block(bcache_t _cache, uint blocknum)
@@ -259,7 +544,9 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
 	LTRACEF("blocknum %u\n", blocknum);
 
-	struct bcache_block *block = find_block(cache, blocknum);
+	mutex_acquire(&cache->lock);
+
+	struct bcache_block *block = lookup_block(cache, blocknum, NULL);
 
 	/* be pretty hard on the caller for now */
 	DEBUG_ASSERT(block);
@@ -267,6 +554,8 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
 	block->ref_count--;
 
+	mutex_release(&cache->lock);
+
 	return 0;
 }
 
@@ -276,6 +565,8 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 	struct bcache *cache = priv;
 	struct bcache_block *block;
 
+	mutex_acquire(&cache->lock);
+
 	block = find_block(cache, blocknum);
 	if (!block) {
 		err = -1;
@@ -283,8 +574,10 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 	}
 
 	block->is_dirty = true;
+	dirtied_locked(cache);
 	err = 0;
 exit:
+	mutex_release(&cache->lock);
 	return (err);
 }
 
@@ -294,7 +587,9 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 	struct bcache *cache = priv;
 	struct bcache_block *block;
 
-	block = find_block(cache, blocknum);
+	mutex_acquire(&cache->lock);
+
+	block = wait_for_fill(cache, find_block(cache, blocknum));
 	if (!block) {
 		block = alloc_block(cache);
 		if (!block) {
@@ -303,48 +598,234 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 		}
 
 		block->blocknum = blocknum;
+		list_add_head(hash_bucket(cache, blocknum), &block->hash_node);
 	}
 
 	memset(block->ptr, 0, cache->block_size);
 	block->is_dirty = true;
+	dirtied_locked(cache);
 	err = 0;
 exit:
+	mutex_release(&cache->lock);
 	return (err);
 }
 
-int bcache_flush(bcache_t priv)
+int bcache_discard(bcache_t priv, uint blocknum, uint count)
 {
-	int err;
 	struct bcache *cache = priv;
-	struct bcache_block *block;
+	int err = 0;
 
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-		if (block->is_dirty) {
-			err = flush_block(cache, block);
-			if (err)
-				goto exit;
+	LTRACEF("blocks %u-%u\n", blocknum, blocknum + count - 1);
+
+	mutex_acquire(&cache->lock);
+
+	for (uint i = 0; i < count; i++) {
+		struct bcache_block *block = wait_for_fill(cache, lookup_block(cache, blocknum + i, NULL));
+		if (!block)
+			continue;
+
+		/* someone is still looking at it, they'd see it change under them */
+		if (block->ref_count > 0) {
+			err = ERR_BUSY;
+			continue;
 		}
+
+		list_delete(&block->hash_node);
+		block->is_dirty = false;
+		free_block(cache, block);
+	}
+
+	mutex_release(&cache->lock);
+	return err;
+}
+
+/* runs in whatever context the device completes in, so no locks */
+static void bcache_readahead_done(bio_request_t *req)
+{
+	struct bcache_readahead *ra = req->arg;
+	ssize_t remaining = req->result;
+
+	for (uint i = 0; i < ra->count; i++) {
+		struct bcache_block *block = ra->blocks[i];
+
+		block->fill_err = (remaining >= (ssize_t)ra->iov[i].iov_len) ? 0 : ERR_IO;
+		if (remaining > 0)
+			remaining -= MIN((size_t)remaining, ra->iov[i].iov_len);
+		atomic_swap(&block->loading, 0);
+	}
+
+	/* wake the waiters before the slot can be reused and its event reset */
+	event_signal(&ra->done, false);
+	atomic_swap(&ra->busy, 0);
+}
+
+int bcache_prefetch(bcache_t priv, uint blocknum, uint count)
+{
+	struct bcache *cache = priv;
+	struct bcache_readahead *ra = NULL;
+	uint queued = 0;
+
+	LTRACEF("blocknum %u, count %u\n", blocknum, count);
+
+	/* never let readahead push out more than half the cache */
+	count = MIN(count, (uint)cache->count / 2);
+	count = MIN(count, (uint)BCACHE_MAX_READAHEAD);
+
+	mutex_acquire(&cache->lock);
+
+	for (uint i = 0; i < BCACHE_READAHEAD_SLOTS; i++) {
+		if (!cache->readahead[i].busy) {
+			ra = &cache->readahead[i];
+			break;
+		}
+	}
+	if (!ra)
+		goto exit;
+
+	/* one run of blocks that aren't cached yet, starting at the first one that isn't */
+	uint start = blocknum;
+	for (uint i = 0; i < count; i++) {
+		uint num = blocknum + i;
+
+		if (lookup_block(cache, num, NULL)) {
+			if (queued > 0)
+				break;
+			start = num + 1;
+			continue;
+		}
+
+		struct bcache_block *block = alloc_block(cache);
+		if (!block)
+			break;
+
+		block->blocknum = num;
+		block->loading = 1;
+		block->fill_err = 0;
+		block->ra = ra;
+		list_add_head(hash_bucket(cache, num), &block->hash_node);
+
+		ra->blocks[queued] = block;
+		ra->iov[queued].iov_base = block->ptr;
+		ra->iov[queued].iov_len = cache->block_size;
+		queued++;
+	}
+
+	if (queued == 0)
+		goto exit;
+
+	ra->count = queued;
+	ra->busy = 1;
+	event_unsignal(&ra->done);
+	percpu_counter_add(&cache->stats.prefetches, queued);
+
+	bio_request_init_iovec(&ra->req, BIO_OP_READ, ra->iov, queued, (off_t)start * cache->block_size,
+	                       bcache_readahead_done, ra);
+	status_t err = bio_submit(cache->dev, &ra->req);
+	if (err < 0) {
+		ra->req.result = err;
+		bcache_readahead_done(&ra->req);
 	}
 
-	err = 0;
 exit:
+	mutex_release(&cache->lock);
+	return queued;
+}
+
+int bcache_flush(bcache_t priv)
+{
+	int err;
+	struct bcache *cache = priv;
+
+	mutex_acquire(&cache->lock);
+	err = flush_locked(cache);
+	mutex_release(&cache->lock);
+
 	return (err);
 }
 
+status_t bcache_set_writeback(bcache_t priv, lk_time_t interval)
+{
+	struct bcache *cache = priv;
+	thread_t *t = NULL;
+	bool dirty = false;
+
+	mutex_acquire(&cache->lock);
+
+	cache->writeback_interval = interval;
+	if (!interval) {
+		t = stop_writeback_locked(cache);
+	} else if (cache->writeback_thread) {
+		/* pick up the new interval */
+		event_signal(&cache->writeback_event, false);
+	} else {
+		struct bcache_block *block;
+		list_for_every_entry(&cache->lru_list, block, struct bcache_block, node)
+			dirty |= block->is_dirty;
+		if (dirty)
+			dirtied_locked(cache);
+	}
+
+	mutex_release(&cache->lock);
+
+	stop_writeback_finish(cache, t);
+
+	return NO_ERROR;
+}
+
 void bcache_dump(bcache_t priv, const char *name)
 {
-	uint32_t finds;
+	uint32_t dirty = 0;
 	struct bcache *cache = priv;
+	struct bcache_block *block;
+
+	mutex_acquire(&cache->lock);
+
+	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+		if (block->is_dirty)
+			dirty++;
+	}
 
-	finds = cache->stats.hits + cache->stats.misses;
+	mutex_release(&cache->lock);
 
-	printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+	unsigned long long hits = percpu_counter_read(&cache->stats.hits);
+	unsigned long long misses = percpu_counter_read(&cache->stats.misses);
+	unsigned long long finds = hits + misses;
+
+	printf("%s: hits=%llu(%llu%%) depth=%llu misses=%llu(%llu%%) reads=%llu writes=%llu(%llu runs) dirty=%u writebacks=%llu "
+	       "prefetches=%llu prefetch_hits=%llu\n",
 	       name,
-	       cache->stats.hits,
-	       finds ? (cache->stats.hits * 100) / finds : 0,
-	       cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-	       cache->stats.misses,
-	       finds ? (cache->stats.misses * 100) / finds : 0,
-	       cache->stats.reads,
-	       cache->stats.writes);
+	       hits,
+	       finds ? (hits * 100) / finds : 0,
+	       hits ? (unsigned long long)percpu_counter_read(&cache->stats.depth) / hits : 0,
+	       misses,
+	       finds ? (misses * 100) / finds : 0,
+	       (unsigned long long)percpu_counter_read(&cache->stats.reads),
+	       (unsigned long long)percpu_counter_read(&cache->stats.writes),
+	       (unsigned long long)percpu_counter_read(&cache->stats.write_runs),
+	       dirty,
+	       (unsigned long long)percpu_counter_read(&cache->stats.writebacks),
+	       (unsigned long long)percpu_counter_read(&cache->stats.prefetches),
+	       (unsigned long long)percpu_counter_read(&cache->stats.prefetch_hits));
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_bcache(int argc, const cmd_args *argv)
+{
+	struct bcache *cache;
+
+	mutex_acquire(&bcache_list_lock);
+	list_for_every_entry(&bcache_list, cache, struct bcache, node) {
+		bcache_dump(cache, cache->dev->name);
+	}
+	mutex_release(&bcache_list_lock);
+
+	return 0;
 }
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bcache", "block cache statistics", &cmd_bcache)
+STATIC_COMMAND_END(bcache);
+
+#endif
@@ -2,7 +2,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
-MODULE_DEPS += lib/bio
+MODULE_DEPS += lib/bio lib/slab
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/bcache.c
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/bench.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#if ARCH_X86_64
+#include <arch/x86.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* don't let calibration run away on a loop the compiler emptied */
+#define BENCH_MAX_ITERS (1ULL << 40)
+
+extern const struct bench_desc __benchmarks[];
+extern const struct bench_desc __benchmarks_end[];
+
+uint64_t bench_cycles(void)
+{
+#if ARCH_X86_64
+	return x86_rdtsc();
+#else
+	static struct {
+		uint32_t last;
+		uint32_t high;
+	} wide[SMP_MAX_CPUS];
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	uint cpu = arch_curr_cpu_num();
+	uint32_t count = arch_cycle_count();
+	if (count < wide[cpu].last)
+		wide[cpu].high++;
+	wide[cpu].last = count;
+	uint64_t cycles = ((uint64_t)wide[cpu].high << 32) | count;
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	return cycles;
+#endif
+}
+
+void bench_start(struct bench_state *state)
+{
+	state->remaining = state->iters;
+	state->pmu_count = pmu_read(state->pmu_start);
+	state->start_time = current_time_hires();
+	state->start_cycles = bench_cycles();
+}
+
+void bench_stop(struct bench_state *state)
+{
+	state->end_cycles = bench_cycles();
+	state->end_time = current_time_hires();
+	pmu_read(state->pmu_end);
+}
+
+static status_t bench_run_once(const struct bench_desc *desc, struct bench_state *state, uint64_t iters)
+{
+	memset(state, 0, sizeof(*state));
+	state->iters = iters;
+	state->arg = desc->arg;
+
+	desc->func(state);
+
+	/* the benchmark never went through BENCH_LOOP, or bailed out of it */
+	if (state->end_time == 0 || state->remaining != 0)
+		return ERR_NOT_VALID;
+
+	return NO_ERROR;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* value at percentile pct of the sorted samples, divided down to one iteration */
+static double bench_percentile(const uint64_t *sorted, uint count, uint pct, uint64_t iters)
+{
+	uint i = (count * pct + 99) / 100;
+	i = i ? i - 1 : 0;
+
+	return (double)sorted[i] / iters;
+}
+
+static double bench_median(const uint64_t *sorted, uint count, uint64_t iters)
+{
+	if (count & 1)
+		return (double)sorted[count / 2] / iters;
+
+	return ((double)sorted[count / 2 - 1] + sorted[count / 2]) / 2 / iters;
+}
+
+status_t bench_run(const struct bench_desc *desc, uint warmup, uint runs, struct bench_result *result)
+{
+	DEBUG_ASSERT(desc);
+	DEBUG_ASSERT(result);
+
+	runs = MIN(MAX(runs, 1u), BENCH_MAX_RUNS);
+
+	uint64_t *times = malloc(sizeof(uint64_t) * runs * 2);
+	if (!times)
+		return ERR_NO_MEMORY;
+	uint64_t *cycles = times + runs;
+
+	/* the cycle counter is per cpu, keep the run on one */
+	thread_t *t = get_current_thread();
+	int old_pinned = t->pinned_cpu;
+	t->pinned_cpu = arch_curr_cpu_num();
+
+	struct bench_state state;
+	status_t err;
+
+	memset(result, 0, sizeof(*result));
+	result->pmu_count = pmu_get_config(result->pmu_events);
+	uint64_t pmu_total[PMU_MAX_COUNTERS] = { 0 };
+
+	/* grow the iteration count until a run takes long enough to time */
+	uint64_t iters = 1;
+	for (;;) {
+		err = bench_run_once(desc, &state, iters);
+		if (err < 0)
+			goto out;
+
+		lk_bigtime_t elapsed = state.end_time - state.start_time;
+		if (elapsed >= BENCH_TARGET_RUN_US / 2 || iters >= BENCH_MAX_ITERS)
+			break;
+
+		uint64_t next;
+		if (elapsed > BENCH_TARGET_RUN_US / 100)
+			next = iters * BENCH_TARGET_RUN_US / elapsed;
+		else
+			next = iters * 10;
+		iters = MIN(MAX(next, iters + 1), BENCH_MAX_ITERS);
+	}
+	LTRACEF("%s: %llu iterations per run\n", desc->name, iters);
+
+	for (uint i = 0; i < warmup; i++) {
+		err = bench_run_once(desc, &state, iters);
+		if (err < 0)
+			goto out;
+	}
+
+	for (uint i = 0; i < runs; i++) {
+		err = bench_run_once(desc, &state, iters);
+		if (err < 0)
+			goto out;
+
+		times[i] = (state.end_time - state.start_time) * 1000;
+		cycles[i] = state.end_cycles - state.start_cycles;
+		for (uint j = 0; j < MIN(state.pmu_count, result->pmu_count); j++)
+			pmu_total[j] += state.pmu_end[j] - state.pmu_start[j];
+	}
+
+	qsort(times, runs, sizeof(uint64_t), bench_compare);
+	qsort(cycles, runs, sizeof(uint64_t), bench_compare);
+
+	result->name = desc->name;
+	result->iters = iters;
+	result->runs = runs;
+	result->bytes = state.bytes;
+	result->min_ns = (double)times[0] / iters;
+	result->median_ns = bench_median(times, runs, iters);
+	result->p99_ns = bench_percentile(times, runs, 99, iters);
+	result->min_cycles = (double)cycles[0] / iters;
+	result->median_cycles = bench_median(cycles, runs, iters);
+	result->p99_cycles = bench_percentile(cycles, runs, 99, iters);
+	for (uint j = 0; j < result->pmu_count; j++)
+		result->pmu[j] = (double)pmu_total[j] / (iters * runs);
+
+out:
+	t->pinned_cpu = old_pinned;
+	free(times);
+
+	return err;
+}
+
+static bool bench_match(const struct bench_desc *desc, const char *prefix)
+{
+	return !prefix || !strncmp(desc->name, prefix, strlen(prefix));
+}
+
+/* megabytes per second out of the median time, 0 if the benchmark doesn't move bytes */
+static double bench_mbps(const struct bench_result *r)
+{
+	if (!r->bytes || r->median_ns == 0)
+		return 0;
+
+	return r->bytes * 1000.0 / r->median_ns;
+}
+
+void bench_print_header(enum bench_format format)
+{
+	switch (format) {
+		case BENCH_FORMAT_TEXT:
+			printf("%-32s %12s %4s %12s %12s %12s %14s %10s\n",
+			       "name", "iters", "runs", "min ns", "median ns", "p99 ns", "median cycles", "MB/s");
+			break;
+		case BENCH_FORMAT_CSV:
+			printf("name,iters,runs,bytes,min_ns,median_ns,p99_ns,min_cycles,median_cycles,p99_cycles\n");
+			break;
+		case BENCH_FORMAT_JSON:
+			printf("{\"benchmarks\": [\n");
+			break;
+	}
+}
+
+void bench_print_result(enum bench_format format, const struct bench_result *r, bool first)
+{
+	switch (format) {
+		case BENCH_FORMAT_TEXT:
+			printf("%-32s %12llu %4u %12.1f %12.1f %12.1f %14.1f %10.1f\n",
+			       r->name, r->iters, r->runs, r->min_ns, r->median_ns, r->p99_ns,
+			       r->median_cycles, bench_mbps(r));
+			if (r->pmu_count) {
+				printf("\t");
+				for (uint i = 0; i < r->pmu_count; i++)
+					printf("%s %.2f ", pmu_event_name(r->pmu_events[i]), r->pmu[i]);
+				printf("per iteration\n");
+			}
+			break;
+		case BENCH_FORMAT_CSV:
+			printf("%s,%llu,%u,%zu,%f,%f,%f,%f,%f,%f\n",
+			       r->name, r->iters, r->runs, r->bytes, r->min_ns, r->median_ns, r->p99_ns,
+			       r->min_cycles, r->median_cycles, r->p99_cycles);
+			break;
+		case BENCH_FORMAT_JSON:
+			printf("%s{\"name\": \"%s\", \"iters\": %llu, \"runs\": %u, \"bytes\": %zu, "
+			       "\"min_ns\": %f, \"median_ns\": %f, \"p99_ns\": %f, "
+			       "\"min_cycles\": %f, \"median_cycles\": %f, \"p99_cycles\": %f",
+			       first ? "" : ",", r->name, r->iters, r->runs, r->bytes,
+			       r->min_ns, r->median_ns, r->p99_ns,
+			       r->min_cycles, r->median_cycles, r->p99_cycles);
+			for (uint i = 0; i < r->pmu_count; i++)
+				printf(", \"%s\": %f", pmu_event_name(r->pmu_events[i]), r->pmu[i]);
+			printf("}\n");
+			break;
+	}
+}
+
+void bench_print_footer(enum bench_format format)
+{
+	if (format == BENCH_FORMAT_JSON)
+		printf("]}\n");
+}
+
+int bench_run_all(const char *prefix, uint warmup, uint runs, enum bench_format format)
+{
+	int count = 0;
+
+	bench_print_header(format);
+
+	for (const struct bench_desc *desc = __benchmarks; desc != __benchmarks_end; desc++) {
+		if (!bench_match(desc, prefix))
+			continue;
+
+		struct bench_result result;
+		status_t err = bench_run(desc, warmup, runs, &result);
+		if (err < 0) {
+			/* stderr isn't split out on the console, keep the csv and json parseable */
+			if (format == BENCH_FORMAT_TEXT)
+				printf("%-32s error %d\n", desc->name, err);
+			continue;
+		}
+
+		bench_print_result(format, &result, count == 0);
+		count++;
+	}
+
+	bench_print_footer(format);
+
+	return count;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_bench(int argc, const cmd_args *argv)
+{
+	enum bench_format format = BENCH_FORMAT_TEXT;
+
+	if (argc >= 2) {
+		if (!strcmp(argv[1].str, "list")) {
+			for (const struct bench_desc *desc = __benchmarks; desc != __benchmarks_end; desc++)
+				printf("%s\n", desc->name);
+			return NO_ERROR;
+		} else if (!strcmp(argv[1].str, "run")) {
+			format = BENCH_FORMAT_TEXT;
+		} else if (!strcmp(argv[1].str, "csv")) {
+			format = BENCH_FORMAT_CSV;
+		} else if (!strcmp(argv[1].str, "json")) {
+			format = BENCH_FORMAT_JSON;
+		} else {
+			printf("usage:\n");
+			printf("%s                                     : run everything\n", argv[0].str);
+			printf("%s list                                : list the benchmarks\n", argv[0].str);
+			printf("%s run|csv|json [name|all] [runs] [warmup] : run the ones starting with name,\n"
+			       "\tdefault %u runs after %u warmup runs\n",
+			       argv[0].str, BENCH_DEFAULT_RUNS, BENCH_DEFAULT_WARMUP);
+			return ERR_INVALID_ARGS;
+		}
+	}
+
+	const char *prefix = NULL;
+	if (argc >= 3 && strcmp(argv[2].str, "all"))
+		prefix = argv[2].str;
+	uint runs = (argc >= 4) ? argv[3].u : BENCH_DEFAULT_RUNS;
+	uint warmup = (argc >= 5) ? argv[4].u : BENCH_DEFAULT_WARMUP;
+
+	if (bench_run_all(prefix, warmup, runs, format) == 0 && format == BENCH_FORMAT_TEXT)
+		printf("no benchmarks ran\n");
+
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bench", "microbenchmarks", &cmd_bench)
+STATIC_COMMAND_END(bench);
+
+#endif
+
+// vim: set noexpandtab:
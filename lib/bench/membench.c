@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/bench.h>
+
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/defines.h>
+#include <arch/mmu.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/*
+ * Memory characterization. Streaming read, write and copy bandwidth and
+ * dependent load latency over buffer sizes from well inside the L1 out to
+ * dram, on cached, uncached and write combining mappings.
+ */
+
+#define MEMBENCH_MIN_SIZE       (4 * 1024)
+#define MEMBENCH_DEFAULT_MAX    (16 * 1024 * 1024)
+
+struct membench_ctx {
+	uint8_t *buf;
+	size_t size;
+};
+
+struct membench_type {
+	const char *name;
+	uint arch_mmu_flags;
+};
+
+static const struct membench_type membench_types[] = {
+	{ "cached", ARCH_MMU_FLAG_CACHED },
+#if WITH_KERNEL_VM
+	{ "uncached", ARCH_MMU_FLAG_UNCACHED },
+	{ "wc", ARCH_MMU_FLAG_WRITE_COMBINE },
+#endif
+};
+
+static void membench_read(struct bench_state *state)
+{
+	struct membench_ctx *ctx = state->arg;
+	const uint64_t *p = (const uint64_t *)ctx->buf;
+	size_t words = ctx->size / sizeof(uint64_t);
+
+	bench_set_bytes(state, ctx->size);
+	BENCH_LOOP(state) {
+		uint64_t a = 0, b = 0, c = 0, d = 0;
+		for (size_t i = 0; i < words; i += 4) {
+			a += p[i];
+			b += p[i + 1];
+			c += p[i + 2];
+			d += p[i + 3];
+		}
+		bench_do_not_optimize(a + b + c + d);
+	}
+}
+
+static void membench_write(struct bench_state *state)
+{
+	struct membench_ctx *ctx = state->arg;
+	uint64_t *p = (uint64_t *)ctx->buf;
+	size_t words = ctx->size / sizeof(uint64_t);
+
+	bench_set_bytes(state, ctx->size);
+	BENCH_LOOP(state) {
+		for (size_t i = 0; i < words; i += 4) {
+			p[i] = i;
+			p[i + 1] = i;
+			p[i + 2] = i;
+			p[i + 3] = i;
+		}
+		bench_clobber();
+	}
+}
+
+/* the first half into the second, bytes are the bytes copied */
+static void membench_copy(struct bench_state *state)
+{
+	struct membench_ctx *ctx = state->arg;
+	size_t words = ctx->size / 2 / sizeof(uint64_t);
+	const uint64_t *src = (const uint64_t *)ctx->buf;
+	uint64_t *dst = (uint64_t *)ctx->buf + words;
+
+	bench_set_bytes(state, ctx->size / 2);
+	BENCH_LOOP(state) {
+		for (size_t i = 0; i < words; i += 4) {
+			dst[i] = src[i];
+			dst[i + 1] = src[i + 1];
+			dst[i + 2] = src[i + 2];
+			dst[i + 3] = src[i + 3];
+		}
+		bench_clobber();
+	}
+}
+
+static void membench_memcpy(struct bench_state *state)
+{
+	struct membench_ctx *ctx = state->arg;
+	size_t half = ctx->size / 2;
+
+	bench_set_bytes(state, half);
+	BENCH_LOOP(state) {
+		memcpy(ctx->buf + half, ctx->buf, half);
+		bench_clobber();
+	}
+}
+
+/* one cache line load per iteration, so the time is the load to use latency */
+static void membench_latency(struct bench_state *state)
+{
+	struct membench_ctx *ctx = state->arg;
+	void * const *p = (void * const *)ctx->buf;
+
+	BENCH_LOOP(state) {
+		p = *p;
+	}
+	bench_do_not_optimize(p);
+}
+
+/* link every cache line of the buffer into one cycle in a random order, so
+ * neither the prefetcher nor the tlb sees a pattern.
+ */
+static status_t membench_build_chain(struct membench_ctx *ctx)
+{
+	uint lines = ctx->size / CACHE_LINE;
+	uint *order = malloc(sizeof(uint) * lines);
+	if (!order)
+		return ERR_NO_MEMORY;
+
+	for (uint i = 0; i < lines; i++)
+		order[i] = i;
+	for (uint i = lines - 1; i > 0; i--) {
+		uint j = rand() % (i + 1);
+		uint t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	for (uint i = 0; i < lines; i++) {
+		void **slot = (void **)(ctx->buf + order[i] * CACHE_LINE);
+		*slot = ctx->buf + order[(i + 1) % lines] * CACHE_LINE;
+	}
+
+	free(order);
+
+	return NO_ERROR;
+}
+
+static void *membench_alloc(size_t size, uint arch_mmu_flags)
+{
+#if WITH_KERNEL_VM
+	void *ptr;
+	if (vmm_alloc(vmm_get_kernel_aspace(), "membench", size, &ptr, 0, 0, arch_mmu_flags) < 0)
+		return NULL;
+	return ptr;
+#else
+	return memalign(CACHE_LINE, size);
+#endif
+}
+
+static void membench_free(void *ptr)
+{
+#if WITH_KERNEL_VM
+	vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+#else
+	free(ptr);
+#endif
+}
+
+static const struct {
+	const char *name;
+	bench_func func;
+} membench_tests[] = {
+	{ "read", membench_read },
+	{ "write", membench_write },
+	{ "copy", membench_copy },
+	{ "memcpy", membench_memcpy },
+	{ "latency", membench_latency },
+};
+
+/* every test on every size from MEMBENCH_MIN_SIZE up to max_size, doubling */
+static int membench_type(const struct membench_type *type, size_t max_size, uint runs,
+                         enum bench_format format, int count)
+{
+	for (size_t size = MEMBENCH_MIN_SIZE; size <= max_size; size *= 2) {
+		struct membench_ctx ctx = { .size = size };
+
+		ctx.buf = membench_alloc(size, type->arch_mmu_flags);
+		if (!ctx.buf) {
+			if (format == BENCH_FORMAT_TEXT)
+				printf("%s: can't allocate %zu bytes\n", type->name, size);
+			break;
+		}
+
+		for (uint i = 0; i < countof(membench_tests); i++) {
+			if (membench_tests[i].func == membench_latency && membench_build_chain(&ctx) < 0)
+				continue;
+
+			char name[32];
+			snprintf(name, sizeof(name), "%s_%s_%zuk", membench_tests[i].name, type->name, size / 1024);
+
+			struct bench_desc desc = {
+				.name = name,
+				.func = membench_tests[i].func,
+				.arg = &ctx,
+			};
+			struct bench_result result;
+			status_t err = bench_run(&desc, BENCH_DEFAULT_WARMUP, runs, &result);
+			if (err < 0) {
+				if (format == BENCH_FORMAT_TEXT)
+					printf("%-32s error %d\n", name, err);
+				continue;
+			}
+
+			bench_print_result(format, &result, count == 0);
+			count++;
+		}
+
+		membench_free(ctx.buf);
+	}
+
+	return count;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_membench(int argc, const cmd_args *argv)
+{
+	enum bench_format format = BENCH_FORMAT_TEXT;
+	const char *which = NULL;
+	size_t max_size = MEMBENCH_DEFAULT_MAX;
+	uint runs = BENCH_DEFAULT_RUNS;
+
+	/* the first number is the largest size, the second the run count */
+	uint numbers = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i].str, "csv")) {
+			format = BENCH_FORMAT_CSV;
+		} else if (!strcmp(argv[i].str, "json")) {
+			format = BENCH_FORMAT_JSON;
+		} else if (!strcmp(argv[i].str, "all")) {
+			which = NULL;
+		} else if (argv[i].str[0] >= '0' && argv[i].str[0] <= '9') {
+			if (numbers++ == 0)
+				max_size = argv[i].u;
+			else
+				runs = argv[i].u;
+		} else {
+			which = argv[i].str;
+		}
+	}
+
+	bool known = !which;
+	for (uint i = 0; i < countof(membench_types); i++)
+		known |= which && !strcmp(which, membench_types[i].name);
+
+	if (!known || max_size < MEMBENCH_MIN_SIZE) {
+		printf("usage: %s [cached|uncached|wc|all] [csv|json] [max size] [runs]\n", argv[0].str);
+		printf("sizes double from %u up to max size, default %u\n", MEMBENCH_MIN_SIZE, MEMBENCH_DEFAULT_MAX);
+		return ERR_INVALID_ARGS;
+	}
+
+	int count = 0;
+	bench_print_header(format);
+	for (uint i = 0; i < countof(membench_types); i++) {
+		if (!which || !strcmp(which, membench_types[i].name))
+			count = membench_type(&membench_types[i], max_size, runs, format, count);
+	}
+	bench_print_footer(format);
+
+	if (count == 0 && format == BENCH_FORMAT_TEXT)
+		printf("nothing ran\n");
+
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("membench", "memory bandwidth and latency", &cmd_membench)
+STATIC_COMMAND_END(membench);
+
+#endif
+
+// vim: set noexpandtab:
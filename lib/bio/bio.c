@@ -29,17 +29,49 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+#include <kernel/atomic.h>
+#include <kernel/debug.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
 #include <lk/init.h>
+#include <platform.h>
+
+#include "bio_priv.h"
 
 #define LOCAL_TRACE 0
 
+/* workers that run requests for drivers without a submit hook of their own */
+#define BIO_WORKERS_PER_CPU 2
+#define BIO_MAX_QUEUED 256
+
+/* how long bio_poll_wait spins before sleeping until the interrupt */
+#ifndef BIO_POLL_USECS
+#define BIO_POLL_USECS 100
+#endif
+
+/* how soon to try again when the workqueue is too full to take a device to close */
+#define BIO_CLOSE_RETRY_MS 10
+
+static workqueue_t *bio_workqueue;
+static mutex_t bio_workqueue_lock = MUTEX_INITIAL_VALUE(bio_workqueue_lock);
+
+/* devices whose last reference went with a request's completion, possibly in
+ * interrupt context, waiting for the workqueue to close them */
+static struct list_node bio_closing_list = LIST_INITIAL_VALUE(bio_closing_list);
+static spin_lock_t bio_closing_lock = SPIN_LOCK_INITIAL_VALUE;
+static work_t bio_closing_work = WORK_INITIAL_VALUE;
+static timer_t bio_closing_timer = TIMER_INITIAL_VALUE(bio_closing_timer);
+static volatile int bio_closing_timer_armed;
+
 static struct {
 	struct list_node list;
-	mutex_t lock;
+	rwlock_t lock;
 } bdevs = {
 	.list = LIST_INITIAL_VALUE(bdevs.list),
-	.lock = MUTEX_INITIAL_VALUE(bdevs.lock),
+	.lock = RWLOCK_INITIAL_VALUE(bdevs.lock),
 };
 
 /* default implementation is to use the read_block hook to 'deblock' the device */
@@ -191,24 +223,73 @@ err:
 	return (err >= 0) ? bytes_written : err;
 }
 
-static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
+/* default vector implementation is one transfer per fragment */
+static ssize_t bio_default_readv(struct bdev *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	ssize_t bytes_read = 0;
+
+	for (uint i = 0; i < iov_cnt && len > 0; i++) {
+		size_t tocopy = MIN(iov[i].iov_len, len);
+		if (tocopy == 0)
+			continue;
+
+		ssize_t err = dev->read(dev, iov[i].iov_base, offset, tocopy);
+		if (err < 0)
+			return err;
+
+		bytes_read += err;
+		offset += err;
+		len -= err;
+
+		if ((size_t)err < tocopy)
+			break;
+	}
+
+	return bytes_read;
+}
+
+static ssize_t bio_default_writev(struct bdev *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	ssize_t bytes_written = 0;
+
+	for (uint i = 0; i < iov_cnt && len > 0; i++) {
+		size_t tocopy = MIN(iov[i].iov_len, len);
+		if (tocopy == 0)
+			continue;
+
+		ssize_t err = dev->write(dev, iov[i].iov_base, offset, tocopy);
+		if (err < 0)
+			return err;
+
+		bytes_written += err;
+		offset += err;
+		len -= err;
+
+		if ((size_t)err < tocopy)
+			break;
+	}
+
+	return bytes_written;
+}
+
+/* write a byte pattern over a range a block at a time */
+static ssize_t bio_fill(struct bdev *dev, uint8_t c, off_t offset, size_t len)
 {
-	/* default erase operation is to just write zeros over the device */
-	STACKBUF_DMA_ALIGN(erase_buf, dev->block_size);
+	STACKBUF_DMA_ALIGN(fill_buf, dev->block_size);
 
-	memset(erase_buf, dev->erase_byte, dev->block_size);
+	memset(fill_buf, c, dev->block_size);
 
-	ssize_t erased = 0;
+	ssize_t filled = 0;
 	size_t remaining = len;
 	off_t pos = offset;
 	while (remaining > 0) {
 		size_t towrite = MIN(remaining, dev->block_size);
 
-		ssize_t written = bio_write(dev, erase_buf, pos, towrite);
+		ssize_t written = bio_write(dev, fill_buf, pos, towrite);
 		if (written < 0)
 			return written;
 
-		erased += written;
+		filled += written;
 		pos += written;
 		remaining -= written;
 
@@ -216,7 +297,68 @@ static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
 			break;
 	}
 
-	return erased;
+	return filled;
+}
+
+/* zero an already trimmed range, handing the whole blocks in it to the device */
+static ssize_t bio_zero_range(struct bdev *dev, off_t offset, size_t len)
+{
+	off_t end = offset + len;
+	off_t start_block = ((offset + dev->block_size - 1) >> dev->block_shift) << dev->block_shift;
+	off_t end_block = (end >> dev->block_shift) << dev->block_shift;
+
+	if (start_block >= end_block)
+		return bio_fill(dev, 0, offset, len);
+
+	ssize_t err;
+	if (start_block > offset) {
+		err = bio_fill(dev, 0, offset, start_block - offset);
+		if (err < 0)
+			return err;
+	}
+
+	err = dev->write_zeroes(dev, start_block, end_block - start_block);
+	if (err == ERR_NOT_SUPPORTED)
+		err = bio_fill(dev, 0, start_block, end_block - start_block);
+	if (err < 0)
+		return err;
+	if (err < end_block - start_block)
+		return start_block - offset + err;
+
+	if (end > end_block) {
+		err = bio_fill(dev, 0, end_block, end - end_block);
+		if (err < 0)
+			return err;
+	}
+
+	return len;
+}
+
+static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
+{
+	/* default erase operation is to just write the erase byte over the device */
+	if (dev->erase_byte == 0)
+		return bio_zero_range(dev, offset, len);
+
+	return bio_fill(dev, dev->erase_byte, offset, len);
+}
+
+static ssize_t bio_default_discard(struct bdev *dev, off_t offset, size_t len)
+{
+	return ERR_NOT_SUPPORTED;
+}
+
+static ssize_t bio_default_write_zeroes(struct bdev *dev, off_t offset, size_t len)
+{
+	return bio_fill(dev, 0, offset, len);
+}
+
+/* devices that hold on to writes do their write back in the sync ioctl */
+static status_t bio_default_flush(struct bdev *dev)
+{
+	int err = bio_ioctl(dev, BIO_IOCTL_SYNC, NULL);
+
+	return (err == ERR_NOT_SUPPORTED || err == ERR_NOT_IMPLEMENTED) ? NO_ERROR : err;
 }
 
 static ssize_t bio_default_read_block(struct bdev *dev, void *buf, bnum_t block, uint count)
@@ -229,32 +371,164 @@ static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t
 	return ERR_NOT_SUPPORTED;
 }
 
-static void bdev_inc_ref(bdev_t *dev)
+static void bio_request_worker(void *arg)
+{
+	bio_request_t *req = (bio_request_t *)arg;
+	bdev_t *dev = req->dev;
+	ssize_t result;
+
+	switch (req->op) {
+		case BIO_OP_READ:
+			if (req->iov)
+				result = dev->readv(dev, req->iov, req->iov_cnt, req->offset, req->len);
+			else
+				result = dev->read(dev, req->buf, req->offset, req->len);
+			break;
+		case BIO_OP_WRITE:
+			if (req->iov)
+				result = dev->writev(dev, req->iov, req->iov_cnt, req->offset, req->len);
+			else
+				result = dev->write(dev, req->buf, req->offset, req->len);
+			break;
+		case BIO_OP_ERASE:
+			result = dev->erase(dev, req->offset, req->len);
+			break;
+		default:
+			result = ERR_INVALID_ARGS;
+			break;
+	}
+
+	bio_request_complete(req, result);
+}
+
+/* never goes away once created, so after the first call this is safe from interrupt context */
+workqueue_t *bio_get_workqueue(void)
+{
+	if (bio_workqueue)
+		return bio_workqueue;
+
+	mutex_acquire(&bio_workqueue_lock);
+	if (!bio_workqueue)
+		bio_workqueue = workqueue_create("bio", BIO_WORKERS_PER_CPU, DEFAULT_PRIORITY, BIO_MAX_QUEUED);
+	mutex_release(&bio_workqueue_lock);
+
+	return bio_workqueue;
+}
+
+/* default submit is to run the synchronous hooks on a worker thread */
+static status_t bio_default_submit(struct bdev *dev, bio_request_t *req)
+{
+	workqueue_t *wq = bio_get_workqueue();
+	if (!wq)
+		return ERR_NO_MEMORY;
+
+	return workqueue_submit(wq, &req->work, bio_request_worker, req, 0);
+}
+
+void bdev_inc_ref(bdev_t *dev)
 {
 	LTRACEF("Add ref \"%s\" %d -> %d\n", dev->name, dev->ref, dev->ref + 1);
-	atomic_add(&dev->ref, 1);
+	atomic_fetch_add_explicit(&dev->ref, 1, ATOMIC_RELAXED);
+}
+
+/* the last reference is gone */
+static void bdev_close(bdev_t *dev)
+{
+	TRACEF("last ref, removing (%s)\n", dev->name);
+
+	// call the close hook if it exists
+	if (dev->queue) {
+		bio_queue_free(dev->queue);
+		dev->queue = NULL;
+	}
+
+	if (dev->close)
+		dev->close(dev);
+
+	free(dev->name);
 }
 
-static void bdev_dec_ref(bdev_t *dev)
+void bdev_dec_ref(bdev_t *dev)
 {
-	int oldval = atomic_add(&dev->ref, -1);
+	/* release our use of the device before anyone can see the count drop */
+	int oldval = atomic_fetch_sub_explicit(&dev->ref, 1, ATOMIC_RELEASE);
 
 	LTRACEF("Dec ref \"%s\" %d -> %d\n", dev->name, oldval, dev->ref);
 
 	if (oldval == 1) {
 		// last ref, remove it
+		atomic_fence_acquire();
 		DEBUG_ASSERT(!list_in_list(&dev->node));
 
-		TRACEF("last ref, removing (%s)\n", dev->name);
+		bdev_close(dev);
+	}
+}
+
+static void bio_closing_worker(void *arg)
+{
+	for (;;) {
+		spin_lock_saved_state_t state;
+		spin_lock_irqsave(&bio_closing_lock, state);
+		bdev_t *dev = list_remove_head_type(&bio_closing_list, bdev_t, node);
+		spin_unlock_irqrestore(&bio_closing_lock, state);
 
-		// call the close hook if it exists
-		if (dev->close)
-			dev->close(dev);
+		if (!dev)
+			break;
 
-		free(dev->name);
+		bdev_close(dev);
 	}
 }
 
+static enum handler_return bio_closing_retry(timer_t *t, lk_time_t now, void *arg);
+
+/* hand the closing list to the workqueue, trying again shortly if it's full */
+static void bio_kick_closing(void)
+{
+	/* bio_register_device created the queue, so this doesn't allocate */
+	if (!bio_workqueue) {
+		TRACEF("no workqueue, devices left open\n");
+		return;
+	}
+
+	/* completions on any cpu kick the one work item, and it's only checked for
+	 * being queued already under the lock of the cpu it's submitted to. so it
+	 * always goes to the same one. */
+	status_t err = workqueue_submit_cpu(bio_workqueue, 0, &bio_closing_work, bio_closing_worker, NULL,
+										WORK_FLAG_NORESCHED);
+	if (err == ERR_BUSY && atomic_swap(&bio_closing_timer_armed, 1) == 0)
+		timer_set_oneshot(&bio_closing_timer, BIO_CLOSE_RETRY_MS, bio_closing_retry, NULL);
+}
+
+static enum handler_return bio_closing_retry(timer_t *t, lk_time_t now, void *arg)
+{
+	atomic_swap(&bio_closing_timer_armed, 0);
+	bio_kick_closing();
+
+	return INT_NO_RESCHEDULE;
+}
+
+/* bdev_dec_ref for completions, which may be in interrupt context where the close
+ * hook and free can't run. the last reference leaves them to the workqueue. */
+static void bdev_dec_ref_deferred(bdev_t *dev)
+{
+	int oldval = atomic_fetch_sub_explicit(&dev->ref, 1, ATOMIC_RELEASE);
+
+	LTRACEF("Dec ref \"%s\" %d -> %d\n", dev->name, oldval, oldval - 1);
+
+	if (oldval != 1)
+		return;
+
+	atomic_fence_acquire();
+	DEBUG_ASSERT(!list_in_list(&dev->node));
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&bio_closing_lock, state);
+	list_add_tail(&bio_closing_list, &dev->node);
+	spin_unlock_irqrestore(&bio_closing_lock, state);
+
+	bio_kick_closing();
+}
+
 size_t bio_trim_range(const bdev_t *dev, off_t offset, size_t len)
 {
 	/* range check */
@@ -290,7 +564,7 @@ bdev_t *bio_open(const char *name)
 
 	/* see if it's in our list */
 	bdev_t *entry;
-	mutex_acquire(&bdevs.lock);
+	rwlock_acquire_read(&bdevs.lock);
 	list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 		DEBUG_ASSERT(entry->ref > 0);
 		if (!strcmp(entry->name, name)) {
@@ -299,7 +573,7 @@ bdev_t *bio_open(const char *name)
 			break;
 		}
 	}
-	mutex_release(&bdevs.lock);
+	rwlock_release_read(&bdevs.lock);
 
 	return bdev;
 }
@@ -371,6 +645,36 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
 	return dev->write_block(dev, buf, block, count);
 }
 
+ssize_t bio_readv(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset)
+{
+	LTRACEF("dev '%s', iov %p, iov_cnt %u, offset %lld\n", dev->name, iov, iov_cnt, offset);
+
+	DEBUG_ASSERT(dev && dev->ref > 0);
+	DEBUG_ASSERT(iov);
+
+	/* range check */
+	size_t len = bio_trim_range(dev, offset, iovec_size(iov, iov_cnt));
+	if (len == 0)
+		return 0;
+
+	return dev->readv(dev, iov, iov_cnt, offset, len);
+}
+
+ssize_t bio_writev(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset)
+{
+	LTRACEF("dev '%s', iov %p, iov_cnt %u, offset %lld\n", dev->name, iov, iov_cnt, offset);
+
+	DEBUG_ASSERT(dev && dev->ref > 0);
+	DEBUG_ASSERT(iov);
+
+	/* range check */
+	size_t len = bio_trim_range(dev, offset, iovec_size(iov, iov_cnt));
+	if (len == 0)
+		return 0;
+
+	return dev->writev(dev, iov, iov_cnt, offset, len);
+}
+
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
 {
 	LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
@@ -385,6 +689,48 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
 	return dev->erase(dev, offset, len);
 }
 
+ssize_t bio_discard(bdev_t *dev, off_t offset, size_t len)
+{
+	LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
+
+	DEBUG_ASSERT(dev && dev->ref > 0);
+
+	/* range check, then shrink it to the whole blocks inside */
+	len = bio_trim_range(dev, offset, len);
+	if (len == 0)
+		return 0;
+
+	off_t start = ((offset + dev->block_size - 1) >> dev->block_shift) << dev->block_shift;
+	off_t end = ((offset + len) >> dev->block_shift) << dev->block_shift;
+	if (start >= end)
+		return 0;
+
+	return dev->discard(dev, start, end - start);
+}
+
+ssize_t bio_write_zeroes(bdev_t *dev, off_t offset, size_t len)
+{
+	LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
+
+	DEBUG_ASSERT(dev && dev->ref > 0);
+
+	/* range check */
+	len = bio_trim_range(dev, offset, len);
+	if (len == 0)
+		return 0;
+
+	return bio_zero_range(dev, offset, len);
+}
+
+status_t bio_flush(bdev_t *dev)
+{
+	LTRACEF("dev '%s'\n", dev->name);
+
+	DEBUG_ASSERT(dev && dev->ref > 0);
+
+	return dev->flush(dev);
+}
+
 int bio_ioctl(bdev_t *dev, int request, void *argp)
 {
 	LTRACEF("dev '%s', request %08x, argp %p\n", dev->name, request, argp);
@@ -396,6 +742,140 @@ int bio_ioctl(bdev_t *dev, int request, void *argp)
 	}
 }
 
+void bio_request_init(bio_request_t *req, uint op, void *buf, off_t offset, size_t len,
+					  bio_callback_t callback, void *arg)
+{
+	DEBUG_ASSERT(req);
+
+	req->op = op;
+	req->buf = buf;
+	req->iov = NULL;
+	req->iov_cnt = 0;
+	req->offset = offset;
+	req->len = len;
+	req->callback = callback;
+	req->arg = arg;
+	req->flags = 0;
+	req->result = 0;
+	req->dev = NULL;
+	req->queue = NULL;
+	req->sched_flags = 0;
+	list_clear_node(&req->node);
+	req->work = (work_t)WORK_INITIAL_VALUE;
+	event_init(&req->event, false, 0);
+}
+
+void bio_request_init_iovec(bio_request_t *req, uint op, const iovec_t *iov, uint iov_cnt, off_t offset,
+							bio_callback_t callback, void *arg)
+{
+	DEBUG_ASSERT(iov);
+
+	bio_request_init(req, op, NULL, offset, iovec_size(iov, iov_cnt), callback, arg);
+	req->iov = iov;
+	req->iov_cnt = iov_cnt;
+}
+
+status_t bio_submit(bdev_t *dev, bio_request_t *req)
+{
+	LTRACEF("dev '%s', req %p, op %u, buf %p, offset %lld, len %zd\n",
+			dev->name, req, req->op, req->buf, req->offset, req->len);
+
+	DEBUG_ASSERT(dev && dev->ref > 0);
+	DEBUG_ASSERT(req);
+
+	if (req->op > BIO_OP_ERASE)
+		return ERR_INVALID_ARGS;
+	if (req->op != BIO_OP_ERASE && !req->buf && !req->iov)
+		return ERR_INVALID_ARGS;
+
+	/* the request holds a ref to the device until it completes */
+	bdev_inc_ref(dev);
+	req->dev = dev;
+	req->result = 0;
+	req->queue = NULL;
+	req->sched_flags = 0;
+	event_unsignal(&req->event);
+
+	/* range check */
+	req->len = bio_trim_range(dev, req->offset, req->len);
+	KEVLOG_BIO_SUBMIT(req, req->len);
+	if (req->len == 0) {
+		bio_request_complete(req, 0);
+		return NO_ERROR;
+	}
+
+	/* a scheduler takes everything and reports errors through completion */
+	if (dev->queue) {
+		bio_queue_submit(dev->queue, req);
+		return NO_ERROR;
+	}
+
+	status_t err = dev->submit(dev, req);
+	if (err < 0) {
+		req->dev = NULL;
+		bdev_dec_ref(dev);
+	}
+
+	return err;
+}
+
+ssize_t bio_wait(bio_request_t *req)
+{
+	DEBUG_ASSERT(req);
+	DEBUG_ASSERT(!req->callback);
+
+	if (req->flags & BIO_FLAG_POLL)
+		bio_poll_wait(req->dev, &req->event);
+	else
+		event_wait(&req->event);
+
+	return req->result;
+}
+
+void bio_poll_wait(bdev_t *dev, event_t *event)
+{
+	DEBUG_ASSERT(dev);
+
+	/* the poll hook finishes requests on this thread, so most of the time the event
+	 * is set before we would have gotten the interrupt */
+	if (dev->poll) {
+		lk_bigtime_t start = current_time_hires();
+		while (!event_is_signalled(event) && current_time_hires() - start < BIO_POLL_USECS)
+			dev->poll(dev);
+	}
+
+	event_wait(event);
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t result)
+{
+	bdev_t *dev = req->dev;
+
+	LTRACEF("dev '%s', req %p, result %zd\n", dev->name, req, result);
+
+	DEBUG_ASSERT(dev);
+
+	/* grab what the scheduler needs, req may be reused as soon as it's handed back */
+	struct bio_queue *q = req->queue;
+	bool dispatched = q && (req->sched_flags & BIO_SCHED_DISPATCHED);
+	if (q)
+		bio_queue_account(q, req, result);
+
+	req->result = result;
+	KEVLOG_BIO_COMPLETE(req, result);
+
+	/* the request belongs to the submitter again after this, don't touch it */
+	if (req->callback)
+		req->callback(req);
+	else
+		event_signal(&req->event, false);
+
+	if (dispatched)
+		bio_queue_finished(q);
+
+	bdev_dec_ref_deferred(dev);
+}
+
 void bio_initialize_bdev(bdev_t *dev,
 						 const char *name,
 						 size_t block_size,
@@ -466,7 +946,18 @@ void bio_initialize_bdev(bdev_t *dev,
 	dev->read_block = bio_default_read_block;
 	dev->write = bio_default_write;
 	dev->write_block = bio_default_write_block;
+	dev->readv = bio_default_readv;
+	dev->writev = bio_default_writev;
 	dev->erase = bio_default_erase;
+	dev->discard = bio_default_discard;
+	dev->write_zeroes = bio_default_write_zeroes;
+	dev->flush = bio_default_flush;
+	dev->submit = bio_default_submit;
+	dev->poll = NULL;
+	dev->queue = NULL;
+	dev->piece_ops = NULL;
+	dev->piece_limits = NULL;
+	dev->ioctl = NULL;
 	dev->close = NULL;
 }
 
@@ -476,11 +967,14 @@ void bio_register_device(bdev_t *dev)
 
 	LTRACEF(" '%s'\n", dev->name);
 
+	/* for closing devices whose last reference goes with a completion */
+	bio_get_workqueue();
+
 	bdev_inc_ref(dev);
 
-	mutex_acquire(&bdevs.lock);
+	rwlock_acquire_write(&bdevs.lock);
 	list_add_tail(&bdevs.list, &dev->node);
-	mutex_release(&bdevs.lock);
+	rwlock_release_write(&bdevs.lock);
 }
 
 void bio_unregister_device(bdev_t *dev)
@@ -490,18 +984,31 @@ void bio_unregister_device(bdev_t *dev)
 	LTRACEF(" '%s'\n", dev->name);
 
 	// remove it from the list
-	mutex_acquire(&bdevs.lock);
+	rwlock_acquire_write(&bdevs.lock);
 	list_delete(&dev->node);
-	mutex_release(&bdevs.lock);
+	rwlock_release_write(&bdevs.lock);
 
 	bdev_dec_ref(dev); // remove the ref the list used to have
 }
 
+void bio_sync_all(void)
+{
+	bdev_t *entry;
+
+	rwlock_acquire_read(&bdevs.lock);
+	list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
+		status_t err = bio_flush(entry);
+		if (err < 0)
+			TRACEF("error %d syncing %s\n", err, entry->name);
+	}
+	rwlock_release_read(&bdevs.lock);
+}
+
 void bio_dump_devices(void)
 {
 	printf("block devices:\n");
 	bdev_t *entry;
-	mutex_acquire(&bdevs.lock);
+	rwlock_acquire_read(&bdevs.lock);
 	list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 
 		printf("\t%s, size %lld, bsize %zd, ref %d",
@@ -518,9 +1025,12 @@ void bio_dump_devices(void)
 			}
 		}
 
+		if (entry->queue)
+			bio_queue_dump(entry->queue);
+
 		printf("\n");
 	}
-	mutex_release(&bdevs.lock);
+	rwlock_release_read(&bdevs.lock);
 }
 
 // vim: set ts=4 sw=4 noexpandtab:
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <lib/bio.h>
+#include <lib/bio_sched.h>
+#include <lib/workqueue.h>
+
+/* shared between the pieces of lib/bio, not for drivers */
+
+/* bio_request_t.sched_flags */
+#define BIO_SCHED_QUEUED     (1 << 0) /* went through the device's queue, counts in its stats */
+#define BIO_SCHED_DISPATCHED (1 << 1) /* handed to the driver by the queue, counts against depth */
+
+void bdev_inc_ref(bdev_t *dev);
+void bdev_dec_ref(bdev_t *dev);
+
+/* the workqueue behind the default submit hook, created on first use */
+workqueue_t *bio_get_workqueue(void);
+
+void bio_queue_submit(bio_queue_t *q, bio_request_t *req);
+void bio_queue_account(bio_queue_t *q, bio_request_t *req, ssize_t result);
+void bio_queue_finished(bio_queue_t *q);
+void bio_queue_dump(const bio_queue_t *q);
+void bio_queue_free(bio_queue_t *q);
+
+// vim: set ts=4 sw=4 noexpandtab:
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <string.h>
+#include <stdlib.h>
+#include <list.h>
+#include <malloc.h>
+#include <lib/bio.h>
+#include <kernel/mutex.h>
+#include <kernel/percpu.h>
+#include <kernel/timer.h>
+#include <lib/workqueue.h>
+
+#include "bio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/*
+ * A write back cache that stacks on top of another block device.
+ *
+ * Writes land in a small set of RAM lines, each covering one erase block of
+ * the parent (or one block if it has no erase geometry), and go out later as
+ * a single write per line. A line that isn't fully overwritten is read in
+ * from the parent first, so flushing it rewrites what was already there
+ * around the dirty span. Reads go to the parent with cached lines laid over
+ * the top. Full line writes that miss the cache go straight through.
+ *
+ * Dirty lines are written back when they're evicted, flush_delay after the
+ * first write following a flush, on bio_flush(), bio_sync_all() and when
+ * the device is closed. Discards and write zeroes drop the lines they cover
+ * and go straight to the parent.
+ */
+
+#define CACHEDEV_DEFAULT_SIZE   (64 * 1024)
+#define CACHEDEV_DEFAULT_DELAY  1000 /* ms */
+#define CACHEDEV_MIN_LINES      2
+
+typedef struct cache_line {
+	struct list_node node; /* on the lru list, most recently used first */
+	off_t base;            /* device offset of the line, -1 if unused */
+	size_t dirty_start;    /* dirty bytes within the line, none if equal */
+	size_t dirty_end;
+	uint8_t *data;
+} cache_line_t;
+
+typedef struct cachedev {
+	bdev_t dev;
+
+	bdev_t *parent;
+
+	mutex_t lock;
+	struct list_node lru;
+	cache_line_t *lines;
+	uint8_t *data;
+	size_t line_size;
+	uint line_count;
+	uint dirty_count;
+
+	lk_time_t flush_delay;
+	timer_t timer;
+	bool timer_armed;
+	work_t work;
+
+	/* stats, bumped from any cpu */
+	percpu_counter_t write_hits;
+	percpu_counter_t write_misses;
+	percpu_counter_t write_through;
+	percpu_counter_t flushes;
+	percpu_counter_t flushed_bytes;
+} cachedev_t;
+
+static size_t line_len(cachedev_t *cache, const cache_line_t *line)
+{
+	return MIN(cache->line_size, (size_t)(cache->dev.total_size - line->base));
+}
+
+static cache_line_t *find_line(cachedev_t *cache, off_t base)
+{
+	cache_line_t *line;
+	list_for_every_entry(&cache->lru, line, cache_line_t, node) {
+		if (line->base == base)
+			return line;
+	}
+	return NULL;
+}
+
+static void touch_line(cachedev_t *cache, cache_line_t *line)
+{
+	list_delete(&line->node);
+	list_add_head(&cache->lru, &line->node);
+}
+
+static bool line_dirty(const cache_line_t *line)
+{
+	return line->dirty_end > line->dirty_start;
+}
+
+static void clean_line(cachedev_t *cache, cache_line_t *line)
+{
+	if (line_dirty(line))
+		cache->dirty_count--;
+	line->dirty_start = line->dirty_end = 0;
+}
+
+/* write the dirty span of a line, widened to whole blocks, to the parent */
+static status_t flush_line(cachedev_t *cache, cache_line_t *line)
+{
+	if (!line_dirty(line))
+		return NO_ERROR;
+
+	size_t start = ROUNDDOWN(line->dirty_start, cache->dev.block_size);
+	size_t end = MIN(ROUNDUP(line->dirty_end, cache->dev.block_size), line_len(cache, line));
+
+	LTRACEF("line 0x%llx, [0x%zx, 0x%zx)\n", line->base, start, end);
+
+	ssize_t err = bio_write(cache->parent, line->data + start, line->base + start, end - start);
+	if (err < 0)
+		return err;
+	if ((size_t)err < end - start)
+		return ERR_IO;
+
+	percpu_counter_inc(&cache->flushes);
+	percpu_counter_add(&cache->flushed_bytes, end - start);
+	clean_line(cache, line);
+	return NO_ERROR;
+}
+
+/* write back every dirty line, oldest first. returns the first error but keeps going */
+static status_t flush_all(cachedev_t *cache)
+{
+	status_t result = NO_ERROR;
+
+	DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+	cache_line_t *line = list_peek_tail_type(&cache->lru, cache_line_t, node);
+	for (; line; line = list_prev_type(&cache->lru, &line->node, cache_line_t, node)) {
+		status_t err = flush_line(cache, line);
+		if (err < 0 && result == NO_ERROR)
+			result = err;
+	}
+	return result;
+}
+
+static void flush_worker(void *arg)
+{
+	cachedev_t *cache = (cachedev_t *)arg;
+
+	mutex_acquire(&cache->lock);
+	cache->timer_armed = false;
+	if (cache->parent) {
+		status_t err = flush_all(cache);
+		if (err < 0)
+			TRACEF("%s: error %d writing back\n", cache->dev.name, err);
+	}
+	mutex_release(&cache->lock);
+}
+
+static enum handler_return flush_timer(timer_t *t, lk_time_t now, void *arg)
+{
+	cachedev_t *cache = (cachedev_t *)arg;
+
+	/* the queue was created at publish time, so this doesn't allocate */
+	if (workqueue_submit(bio_get_workqueue(), &cache->work, flush_worker, cache, WORK_FLAG_NORESCHED) == ERR_BUSY)
+		timer_set_oneshot(&cache->timer, cache->flush_delay, flush_timer, cache);
+
+	return INT_NO_RESCHEDULE;
+}
+
+static void arm_flush(cachedev_t *cache)
+{
+	if (cache->timer_armed || cache->flush_delay == INFINITE_TIME)
+		return;
+
+	cache->timer_armed = true;
+	timer_set_oneshot(&cache->timer, cache->flush_delay, flush_timer, cache);
+}
+
+/* take the least recently used line for base, writing it back first if it's dirty */
+static cache_line_t *alloc_line(cachedev_t *cache, off_t base, status_t *err)
+{
+	cache_line_t *line = list_peek_tail_type(&cache->lru, cache_line_t, node);
+
+	*err = flush_line(cache, line);
+	if (*err < 0)
+		return NULL;
+
+	line->base = base;
+	touch_line(cache, line);
+	return line;
+}
+
+static ssize_t cachedev_read(struct bdev *_dev, void *_buf, off_t offset, size_t len)
+{
+	cachedev_t *cache = (cachedev_t *)_dev;
+	uint8_t *buf = (uint8_t *)_buf;
+	ssize_t err;
+
+	LTRACEF("offset 0x%llx, len 0x%zx\n", offset, len);
+
+	mutex_acquire(&cache->lock);
+
+	/* all within one cached line, skip the parent */
+	off_t base = offset - offset % cache->line_size;
+	cache_line_t *line = find_line(cache, base);
+	if (line && offset + len <= base + line_len(cache, line)) {
+		memcpy(buf, line->data + (offset - base), len);
+		err = len;
+		goto done;
+	}
+
+	err = bio_read(cache->parent, buf, offset, len);
+	if (err <= 0)
+		goto done;
+
+	/* lay whatever is cached over what came back */
+	off_t end = offset + err;
+	list_for_every_entry(&cache->lru, line, cache_line_t, node) {
+		if (line->base < 0)
+			continue;
+
+		off_t lstart = MAX(line->base, offset);
+		off_t lend = MIN(line->base + (off_t)line_len(cache, line), end);
+		if (lstart < lend)
+			memcpy(buf + (lstart - offset), line->data + (lstart - line->base), lend - lstart);
+	}
+
+done:
+	mutex_release(&cache->lock);
+
+	return err;
+}
+
+static ssize_t cachedev_write(struct bdev *_dev, const void *_buf, off_t offset, size_t len)
+{
+	cachedev_t *cache = (cachedev_t *)_dev;
+	const uint8_t *buf = (const uint8_t *)_buf;
+	ssize_t written = 0;
+	status_t err = NO_ERROR;
+
+	LTRACEF("offset 0x%llx, len 0x%zx\n", offset, len);
+
+	mutex_acquire(&cache->lock);
+
+	while (len > 0) {
+		off_t base = offset - offset % cache->line_size;
+		size_t start = offset - base;
+		size_t llen = MIN(cache->line_size, (size_t)(cache->dev.total_size - base));
+		size_t chunk = MIN(llen - start, len);
+
+		cache_line_t *line = find_line(cache, base);
+		if (line) {
+			percpu_counter_inc(&cache->write_hits);
+		} else if (chunk == llen) {
+			/* already a whole line, nothing to batch it with */
+			percpu_counter_inc(&cache->write_through);
+			ssize_t ret = bio_write(cache->parent, buf, offset, chunk);
+			if (ret < 0) {
+				err = ret;
+				break;
+			}
+			if ((size_t)ret < chunk) {
+				written += ret;
+				break;
+			}
+			goto next;
+		} else {
+			percpu_counter_inc(&cache->write_misses);
+			line = alloc_line(cache, base, &err);
+			if (!line)
+				break;
+
+			ssize_t ret = bio_read(cache->parent, line->data, base, llen);
+			if (ret < 0 || (size_t)ret < llen) {
+				line->base = -1;
+				err = (ret < 0) ? ret : ERR_IO;
+				break;
+			}
+		}
+
+		memcpy(line->data + start, buf, chunk);
+		if (!line_dirty(line)) {
+			cache->dirty_count++;
+			line->dirty_start = start;
+			line->dirty_end = start + chunk;
+		} else {
+			line->dirty_start = MIN(line->dirty_start, start);
+			line->dirty_end = MAX(line->dirty_end, start + chunk);
+		}
+		touch_line(cache, line);
+		arm_flush(cache);
+
+next:
+		buf += chunk;
+		offset += chunk;
+		len -= chunk;
+		written += chunk;
+	}
+
+	mutex_release(&cache->lock);
+
+	return (written > 0) ? written : err;
+}
+
+static ssize_t cachedev_read_block(struct bdev *_dev, void *buf, bnum_t block, uint count)
+{
+	return cachedev_read(_dev, buf, (off_t)block << _dev->block_shift, (size_t)count << _dev->block_shift);
+}
+
+static ssize_t cachedev_write_block(struct bdev *_dev, const void *buf, bnum_t block, uint count)
+{
+	return cachedev_write(_dev, buf, (off_t)block << _dev->block_shift, (size_t)count << _dev->block_shift);
+}
+
+/* forget the lines a range covers, dirty or not. ones it only touches are
+ * written back first so the parts it doesn't cover survive */
+static status_t drop_range(cachedev_t *cache, off_t offset, size_t len)
+{
+	off_t end = offset + len;
+	cache_line_t *line;
+	list_for_every_entry(&cache->lru, line, cache_line_t, node) {
+		if (line->base < 0)
+			continue;
+
+		off_t lend = line->base + line_len(cache, line);
+		if (line->base >= end || lend <= offset)
+			continue;
+
+		if (line->base < offset || lend > end) {
+			status_t err = flush_line(cache, line);
+			if (err < 0)
+				return err;
+		}
+		clean_line(cache, line);
+		line->base = -1;
+	}
+
+	return NO_ERROR;
+}
+
+static ssize_t cachedev_erase(struct bdev *_dev, off_t offset, size_t len)
+{
+	cachedev_t *cache = (cachedev_t *)_dev;
+
+	LTRACEF("offset 0x%llx, len 0x%zx\n", offset, len);
+
+	mutex_acquire(&cache->lock);
+	ssize_t err = drop_range(cache, offset, len);
+	if (err >= 0)
+		err = bio_erase(cache->parent, offset, len);
+	mutex_release(&cache->lock);
+
+	return err;
+}
+
+static ssize_t cachedev_discard(struct bdev *_dev, off_t offset, size_t len)
+{
+	cachedev_t *cache = (cachedev_t *)_dev;
+
+	LTRACEF("offset 0x%llx, len 0x%zx\n", offset, len);
+
+	mutex_acquire(&cache->lock);
+	ssize_t err = drop_range(cache, offset, len);
+	if (err >= 0)
+		err = bio_discard(cache->parent, offset, len);
+	mutex_release(&cache->lock);
+
+	return err;
+}
+
+static ssize_t cachedev_write_zeroes(struct bdev *_dev, off_t offset, size_t len)
+{
+	cachedev_t *cache = (cachedev_t *)_dev;
+
+	LTRACEF("offset 0x%llx, len 0x%zx\n", offset, len);
+
+	mutex_acquire(&cache->lock);
+	ssize_t err = drop_range(cache, offset, len);
+	if (err >= 0)
+		err = bio_write_zeroes(cache->parent, offset, len);
+	mutex_release(&cache->lock);
+
+	return err;
+}
+
+static int cachedev_ioctl(struct bdev *_dev, int request, void *argp)
+{
+	cachedev_t *cache = (cachedev_t *)_dev;
+	int err;
+
+	switch (request) {
+		case BIO_IOCTL_SYNC:
+			mutex_acquire(&cache->lock);
+			err = flush_all(cache);
+			mutex_release(&cache->lock);
+			if (err < 0)
+				return err;
+
+			return bio_flush(cache->parent);
+		case BIO_IOCTL_GET_MEM_MAP:
+		case BIO_IOCTL_PUT_MEM_MAP:
+			/* a mapping would see around the cache */
+			return ERR_NOT_SUPPORTED;
+		default:
+			return bio_ioctl(cache->parent, request, argp);
+	}
+}
+
+static void cachedev_close(struct bdev *_dev)
+{
+	cachedev_t *cache = (cachedev_t *)_dev;
+
+	timer_cancel(&cache->timer);
+	workqueue_cancel(&cache->work);
+
+	mutex_acquire(&cache->lock);
+	status_t err = flush_all(cache);
+	if (err < 0)
+		TRACEF("%s: error %d writing back, dropping %u dirty lines\n", cache->dev.name, err, cache->dirty_count);
+
+	bio_close(cache->parent);
+	cache->parent = NULL;
+	mutex_release(&cache->lock);
+
+	LTRACEF("hits %llu misses %llu through %llu flushes %llu (%llu bytes)\n",
+	        percpu_counter_read(&cache->write_hits), percpu_counter_read(&cache->write_misses),
+	        percpu_counter_read(&cache->write_through), percpu_counter_read(&cache->flushes),
+	        percpu_counter_read(&cache->flushed_bytes));
+}
+
+/* the largest erase block of the parent, if every region is aligned to it */
+static size_t pick_line_size(const bdev_t *parent)
+{
+	size_t size = parent->block_size;
+
+	for (size_t i = 0; i < parent->geometry_count; i++)
+		size = MAX(size, parent->geometry[i].erase_size);
+
+	for (size_t i = 0; i < parent->geometry_count; i++) {
+		if (parent->geometry[i].start % size)
+			return parent->block_size;
+	}
+
+	return size;
+}
+
+#define BAIL(__err) do { err = __err; goto bailout; } while (0)
+status_t bio_publish_cache_device(const char *parent_dev, const char *name,
+                                  size_t cache_size, lk_time_t flush_delay)
+{
+	status_t err = NO_ERROR;
+	bdev_t *parent = NULL;
+	cachedev_t *cache = NULL;
+
+	LTRACEF("parent \"%s\", name \"%s\", size 0x%zx, delay %u\n", parent_dev, name, cache_size, flush_delay);
+
+	parent = bio_open(parent_dev);
+	if (!parent)
+		BAIL(ERR_NOT_FOUND);
+
+	/* the flush timer hands off to the bio workqueue from interrupt context */
+	if (!bio_get_workqueue())
+		BAIL(ERR_NO_MEMORY);
+
+	/* aligned so the counters don't share lines */
+	cache = memalign(CACHE_LINE, sizeof(cachedev_t));
+	if (!cache)
+		BAIL(ERR_NO_MEMORY);
+	memset(cache, 0, sizeof(cachedev_t));
+
+	if (cache_size == 0)
+		cache_size = CACHEDEV_DEFAULT_SIZE;
+	if (flush_delay == 0)
+		flush_delay = CACHEDEV_DEFAULT_DELAY;
+
+	cache->line_size = pick_line_size(parent);
+	cache->line_count = MAX(cache_size / cache->line_size, (size_t)CACHEDEV_MIN_LINES);
+	cache->flush_delay = flush_delay;
+
+	cache->lines = calloc(cache->line_count, sizeof(cache_line_t));
+	cache->data = memalign(CACHE_LINE, cache->line_count * cache->line_size);
+	if (!cache->lines || !cache->data)
+		BAIL(ERR_NO_MEMORY);
+
+	mutex_init(&cache->lock);
+	list_initialize(&cache->lru);
+	for (uint i = 0; i < cache->line_count; i++) {
+		cache->lines[i].base = -1;
+		cache->lines[i].data = cache->data + i * cache->line_size;
+		list_add_tail(&cache->lru, &cache->lines[i].node);
+	}
+	timer_initialize(&cache->timer);
+
+	bio_initialize_bdev(&cache->dev, name,
+	                    parent->block_size, parent->block_count,
+	                    parent->geometry_count, parent->geometry);
+	cache->dev.erase_byte = parent->erase_byte;
+
+	cache->parent = parent;
+
+	cache->dev.read = &cachedev_read;
+	cache->dev.read_block = &cachedev_read_block;
+	cache->dev.write = &cachedev_write;
+	cache->dev.write_block = &cachedev_write_block;
+	cache->dev.erase = &cachedev_erase;
+	cache->dev.discard = &cachedev_discard;
+	cache->dev.write_zeroes = &cachedev_write_zeroes;
+	cache->dev.ioctl = &cachedev_ioctl;
+	cache->dev.close = &cachedev_close;
+
+	LTRACEF("%u lines of 0x%zx\n", cache->line_count, cache->line_size);
+
+	bio_register_device(&cache->dev);
+
+bailout:
+	if (err < 0) {
+		if (parent)
+			bio_close(parent);
+		if (cache) {
+			free(cache->data);
+			free(cache->lines);
+			free(cache);
+		}
+	}
+
+	return err;
+}
+#undef BAIL
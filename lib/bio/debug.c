@@ -28,6 +28,7 @@
 #include <err.h>
 #include <lib/console.h>
 #include <lib/bio.h>
+#include <lib/bio_sched.h>
 #include <lib/partition.h>
 #include <platform.h>
 
@@ -56,11 +57,17 @@ usage:
         printf("%s list\n", argv[0].str);
         printf("%s read <device> <address> <offset> <len>\n", argv[0].str);
         printf("%s write <device> <address> <offset> <len>\n", argv[0].str);
+        printf("%s aread <device> <address> <offset> <len> [request size]\n", argv[0].str);
         printf("%s dump <device> <offset> <len>\n", argv[0].str);
         printf("%s erase <device> <offset> <len>\n", argv[0].str);
+        printf("%s discard <device> <offset> <len>\n", argv[0].str);
+        printf("%s zero <device> <offset> <len>\n", argv[0].str);
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
+        printf("%s sched <device> <noop|merge|deadline> [depth]\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s cache <device> <name> [size] [flush delay ms]\n", argv[0].str);
+        printf("%s sync [device]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -114,6 +121,64 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "aread")) {
+        if (argc < 6) goto notenoughargs;
+
+        addr_t address = argv[3].u;
+        off_t offset = argv[4].u; // XXX use long
+        size_t len = argv[5].u;
+        size_t req_size = (argc >= 7) ? argv[6].u : 65536;
+
+        if (req_size == 0) {
+            printf("bad request size\n");
+            return -1;
+        }
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        /* put the whole range in flight at once, then collect the results */
+        size_t count = (len + req_size - 1) / req_size;
+        bio_request_t *reqs = malloc(count * sizeof(bio_request_t));
+        if (!reqs) {
+            printf("error allocating %zu requests\n", count);
+            bio_close(dev);
+            return -1;
+        }
+
+        lk_time_t t = current_time();
+        size_t submitted;
+        ssize_t err = 0;
+        for (submitted = 0; submitted < count; submitted++) {
+            size_t pos = submitted * req_size;
+            bio_request_init(&reqs[submitted], BIO_OP_READ, (uint8_t *)address + pos, offset + pos,
+                             MIN(req_size, len - pos), NULL, NULL);
+            err = bio_submit(dev, &reqs[submitted]);
+            if (err < 0) {
+                printf("bio_submit returns %d\n", (int)err);
+                break;
+            }
+        }
+
+        ssize_t total = 0;
+        for (size_t i = 0; i < submitted; i++) {
+            ssize_t result = bio_wait(&reqs[i]);
+            if (result < 0 && err >= 0)
+                err = result;
+            else if (result > 0)
+                total += result;
+        }
+        t = current_time() - t;
+        dprintf(INFO, "%zu requests read %d bytes, took %u msecs (%d bytes/sec)\n",
+                submitted, (int)total, (uint)t, (uint32_t)((uint64_t)total * 1000 / (t ? t : 1)));
+
+        free(reqs);
+        bio_close(dev);
+
+        rc = (err < 0) ? err : total;
     } else if (!strcmp(argv[1].str, "dump")) {
         if (argc < 5) {
             printf("not enough arguments:\n");
@@ -156,7 +221,7 @@ usage:
 
         bio_close(dev);
         rc = err;
-    } else if (!strcmp(argv[1].str, "erase")) {
+    } else if (!strcmp(argv[1].str, "erase") || !strcmp(argv[1].str, "discard") || !strcmp(argv[1].str, "zero")) {
         if (argc < 5) goto notenoughargs;
 
         off_t offset = argv[3].u; // XXX use long
@@ -169,9 +234,16 @@ usage:
         }
 
         lk_time_t t = current_time();
-        ssize_t err = bio_erase(dev, offset, len);
-        t = current_time() - t;
-        dprintf(INFO, "bio_erase returns %d, took %u msecs (%d bytes/sec)\n", (int)err, (uint)t, (uint32_t)((uint64_t)err * 1000 / t));
+        ssize_t err;
+        if (argv[1].str[0] == 'e')
+            err = bio_erase(dev, offset, len);
+        else if (argv[1].str[0] == 'd')
+            err = bio_discard(dev, offset, len);
+        else
+            err = bio_write_zeroes(dev, offset, len);
+        t = MAX(current_time() - t, 1u);
+        dprintf(INFO, "%s returns %d, took %u msecs (%d bytes/sec)\n", argv[1].str, (int)err, (uint)t,
+                (err > 0) ? (uint32_t)((uint64_t)err * 1000 / t) : 0);
 
         bio_close(dev);
 
@@ -204,6 +276,27 @@ usage:
         }
 
         bio_unregister_device(dev);
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "sched")) {
+        if (argc < 4) goto notenoughargs;
+
+        const bio_sched_policy_t *policy = bio_sched_find_policy(argv[3].str);
+        if (!policy) {
+            printf("unknown scheduler '%s'\n", argv[3].str);
+            return -1;
+        }
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        uint depth = (argc >= 5) ? argv[4].u : 0;
+        rc = bio_set_scheduler(dev, policy, depth);
+        if (rc < 0)
+            printf("error %d setting scheduler\n", rc);
+
         bio_close(dev);
     } else if (!strcmp(argv[1].str, "test")) {
         if (argc < 3) goto notenoughargs;
@@ -218,6 +311,29 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "cache")) {
+        if (argc < 4) goto notenoughargs;
+
+        size_t size = (argc >= 5) ? argv[4].u : 0;
+        lk_time_t delay = (argc >= 6) ? argv[5].u : 0;
+
+        rc = bio_publish_cache_device(argv[2].str, argv[3].str, size, delay);
+        if (rc < 0)
+            printf("error %d publishing cache device\n", rc);
+    } else if (!strcmp(argv[1].str, "sync")) {
+        if (argc < 3) {
+            bio_sync_all();
+            return 0;
+        }
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_flush(dev);
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
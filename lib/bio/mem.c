@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <string.h>
 #include <stdlib.h>
@@ -80,6 +81,73 @@ static ssize_t mem_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t b
 	return count * BLOCKSIZE;
 }
 
+static ssize_t mem_bdev_readv(bdev_t *bdev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	mem_bdev_t *mem = (mem_bdev_t *)bdev;
+	const uint8_t *src = (const uint8_t *)mem->ptr + offset;
+	size_t total = len;
+
+	LTRACEF("bdev %s, iov %p, iov_cnt %u, offset %lld, len %zu\n", bdev->name, iov, iov_cnt, offset, len);
+
+	for (uint i = 0; i < iov_cnt && len > 0; i++) {
+		size_t tocopy = MIN(iov[i].iov_len, len);
+		memcpy(iov[i].iov_base, src, tocopy);
+		src += tocopy;
+		len -= tocopy;
+	}
+
+	return total - len;
+}
+
+static ssize_t mem_bdev_writev(bdev_t *bdev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	mem_bdev_t *mem = (mem_bdev_t *)bdev;
+	uint8_t *dst = (uint8_t *)mem->ptr + offset;
+	size_t total = len;
+
+	LTRACEF("bdev %s, iov %p, iov_cnt %u, offset %lld, len %zu\n", bdev->name, iov, iov_cnt, offset, len);
+
+	for (uint i = 0; i < iov_cnt && len > 0; i++) {
+		size_t tocopy = MIN(iov[i].iov_len, len);
+		memcpy(dst, iov[i].iov_base, tocopy);
+		dst += tocopy;
+		len -= tocopy;
+	}
+
+	return total - len;
+}
+
+/* memory is never slow enough to be worth a thread, finish requests right away */
+static status_t mem_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+	mem_bdev_t *mem = (mem_bdev_t *)bdev;
+	ssize_t result = req->len;
+
+	LTRACEF("bdev %s, req %p, op %u, offset %lld, len %zu\n", bdev->name, req, req->op, req->offset, req->len);
+
+	switch (req->op) {
+		case BIO_OP_READ:
+			if (req->iov)
+				result = mem_bdev_readv(bdev, req->iov, req->iov_cnt, req->offset, req->len);
+			else
+				memcpy(req->buf, (uint8_t *)mem->ptr + req->offset, req->len);
+			break;
+		case BIO_OP_WRITE:
+			if (req->iov)
+				result = mem_bdev_writev(bdev, req->iov, req->iov_cnt, req->offset, req->len);
+			else
+				memcpy((uint8_t *)mem->ptr + req->offset, req->buf, req->len);
+			break;
+		default:
+			result = bdev->erase(bdev, req->offset, req->len);
+			break;
+	}
+
+	bio_request_complete(req, result);
+
+	return NO_ERROR;
+}
+
 int create_membdev(const char *name, void *ptr, size_t len)
 {
 	mem_bdev_t *mem = malloc(sizeof(mem_bdev_t));
@@ -93,6 +161,9 @@ int create_membdev(const char *name, void *ptr, size_t len)
 	mem->dev.read_block = mem_bdev_read_block;
 	mem->dev.write = mem_bdev_write;
 	mem->dev.write_block = mem_bdev_write_block;
+	mem->dev.readv = mem_bdev_readv;
+	mem->dev.writev = mem_bdev_writev;
+	mem->dev.submit = mem_bdev_submit;
 
 	/* register it */
 	bio_register_device(&mem->dev);
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <lib/bio.h>
+#include <lib/dma.h>
+#include <arch/ops.h>
+
+#define LOCAL_TRACE 0
+
+/* gather the physically contiguous runs in the next len bytes of the iovec, at most
+ * limits->max_segs of them and only meeting where limits->page_joins allows.
+ * returns how many bytes they cover.
+ */
+static size_t bio_collect_segs(const bio_piece_limits_t *limits, const iovec_t *iov, uint iov_cnt,
+							   uint index, size_t pos, size_t len, bio_seg_t *seg, uint *seg_count)
+{
+	uint count = 0;
+	size_t total = 0;
+
+	while (total < len && index < iov_cnt) {
+		if (pos >= iov[index].iov_len) {
+			index++;
+			pos = 0;
+			continue;
+		}
+
+		const uint8_t *va = (const uint8_t *)iov[index].iov_base + pos;
+		size_t chunk = MIN(iov[index].iov_len - pos, len - total);
+		paddr_t pa;
+		chunk = dma_phys_run(va, chunk, &pa);
+		if (chunk == 0)
+			break;
+		if (limits->page_joins && count > 0 &&
+			((seg[count - 1].pa + seg[count - 1].len) % PAGE_SIZE || pa % PAGE_SIZE))
+			break;
+		if (count > 0 && seg[count - 1].pa + seg[count - 1].len == pa) {
+			seg[count - 1].len += chunk;
+		} else {
+			if (count == limits->max_segs)
+				break;
+			seg[count].pa = pa;
+			seg[count].len = chunk;
+			count++;
+		}
+		pos += chunk;
+		total += chunk;
+	}
+
+	*seg_count = count;
+	return total;
+}
+
+/* wake a synchronous request's waiter, or complete an asynchronous one */
+static void bio_finish_pieces(bio_request_t *bio, bool sync)
+{
+	if (sync)
+		event_signal(&bio->event, false);
+	else
+		bio_request_complete(bio, bio->result);
+}
+
+void bio_put_piece(bdev_t *dev, bio_request_t *bio, bool sync)
+{
+	if (atomic_add(&bio->pending, -1) != 1)
+		return;
+
+	if (dev->piece_ops->sync_data)
+		dev->piece_ops->sync_data(bio, false);
+
+	bio_finish_pieces(bio, sync);
+}
+
+/* queue every piece of a request, the last one to complete finishes it */
+static void bio_queue_pieces(bdev_t *dev, bio_request_t *bio, bool sync)
+{
+	const bio_piece_ops_t *ops = dev->piece_ops;
+	const bio_piece_limits_t *limits = dev->piece_limits;
+
+	DEBUG_ASSERT(bio->len > 0);
+	DEBUG_ASSERT(limits->max_segs > 0 && limits->max_segs <= BIO_MAX_PIECE_SEGS);
+
+	/* a plain buffer is just a single entry iovec */
+	iovec_t single = { bio->buf, bio->len };
+	const iovec_t *iov = bio->iov ? bio->iov : &single;
+	uint iov_cnt = bio->iov ? bio->iov_cnt : 1;
+	uint index = 0;
+	size_t pos = 0;
+
+	/* hold a reference of our own until every piece is queued */
+	bio->result = 0;
+	bio->pending = 1;
+
+	if (ops->sync_data)
+		ops->sync_data(bio, true);
+
+	off_t offset = bio->offset;
+	size_t remaining = bio->len;
+	while (remaining > 0) {
+		bio_seg_t seg[BIO_MAX_PIECE_SEGS];
+		uint seg_count;
+
+		size_t want = MIN(remaining, limits->max_len);
+		size_t len = bio_collect_segs(limits, iov, iov_cnt, index, pos, want, seg, &seg_count);
+		if (len < want) {
+			/* out of segments, end the piece on a sector boundary */
+			size_t excess = len - ROUNDDOWN(len, limits->sector_size);
+			len -= excess;
+			while (excess > 0) {
+				size_t trim = MIN(excess, seg[seg_count - 1].len);
+				seg[seg_count - 1].len -= trim;
+				if (seg[seg_count - 1].len == 0)
+					seg_count--;
+				excess -= trim;
+			}
+		}
+		DEBUG_ASSERT(len > 0);
+
+		LTRACEF("bio %p, segs %u, offset 0x%llx, len %zu\n", bio, seg_count, offset, len);
+
+		atomic_add(&bio->pending, 1);
+		ops->queue_piece(dev, bio, sync, seg, seg_count, offset, len);
+
+		/* advance the iovec cursor */
+		offset += len;
+		remaining -= len;
+		while (len > 0) {
+			size_t step = MIN(len, iov[index].iov_len - pos);
+			pos += step;
+			len -= step;
+			if (pos == iov[index].iov_len) {
+				index++;
+				pos = 0;
+			}
+		}
+	}
+
+	if (ops->kick)
+		ops->kick(dev);
+
+	bio_put_piece(dev, bio, sync);
+}
+
+ssize_t bio_pieces_wait(bdev_t *dev, bio_request_t *req)
+{
+	if (dev->piece_ops->wait)
+		dev->piece_ops->wait(dev, &req->event);
+	else
+		event_wait(&req->event);
+	event_destroy(&req->event);
+
+	return req->result;
+}
+
+ssize_t bio_pieces_sync(bdev_t *dev, bio_request_t *req)
+{
+	bio_queue_pieces(dev, req, true);
+
+	return bio_pieces_wait(dev, req);
+}
+
+/* one transfer per fragment, for what can't be mapped directly */
+static ssize_t bio_rw_fragments(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len,
+								bool write)
+{
+	ssize_t bytes = 0;
+
+	for (uint i = 0; i < iov_cnt && len > 0; i++) {
+		size_t tocopy = MIN(iov[i].iov_len, len);
+		if (tocopy == 0)
+			continue;
+
+		ssize_t err = write ? dev->write(dev, iov[i].iov_base, offset, tocopy) :
+					  dev->read(dev, iov[i].iov_base, offset, tocopy);
+		if (err < 0)
+			return err;
+
+		bytes += err;
+		offset += err;
+		len -= err;
+
+		if ((size_t)err < tocopy)
+			break;
+	}
+
+	return bytes;
+}
+
+static ssize_t bio_pieces_rw_iovec(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len,
+								   bool write)
+{
+	LTRACEF("dev '%s', iov %p, iov_cnt %u, offset 0x%llx, len %zu\n", dev->name, iov, iov_cnt, offset, len);
+
+	if (!dev->piece_ops->can_map(dev, offset, len, NULL, iov, iov_cnt))
+		return bio_rw_fragments(dev, iov, iov_cnt, offset, len, write);
+
+	bio_request_t req;
+	bio_request_init_iovec(&req, write ? BIO_OP_WRITE : BIO_OP_READ, iov, iov_cnt, offset, NULL, NULL);
+	req.len = len;
+
+	return bio_pieces_sync(dev, &req);
+}
+
+static ssize_t bio_pieces_readv(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	return bio_pieces_rw_iovec(dev, iov, iov_cnt, offset, len, false);
+}
+
+static ssize_t bio_pieces_writev(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	return bio_pieces_rw_iovec(dev, iov, iov_cnt, offset, len, true);
+}
+
+void bio_submit_unmapped(bdev_t *dev, bio_request_t *req)
+{
+	ssize_t result;
+	if (req->op == BIO_OP_ERASE)
+		result = dev->erase(dev, req->offset, req->len);
+	else if (req->iov)
+		result = bio_rw_fragments(dev, req->iov, req->iov_cnt, req->offset, req->len,
+								  req->op == BIO_OP_WRITE);
+	else if (req->op == BIO_OP_READ)
+		result = dev->read(dev, req->buf, req->offset, req->len);
+	else
+		result = dev->write(dev, req->buf, req->offset, req->len);
+
+	bio_request_complete(req, result);
+}
+
+static status_t bio_pieces_submit(bdev_t *dev, bio_request_t *req)
+{
+	LTRACEF("dev '%s', req %p, op %u, offset 0x%llx, len %zu\n", dev->name, req, req->op, req->offset, req->len);
+
+	/* erases and anything that can't be mapped are rare, let the synchronous hooks sort them out */
+	if (req->op == BIO_OP_ERASE ||
+		!dev->piece_ops->can_map(dev, req->offset, req->len, req->buf, req->iov, req->iov_cnt)) {
+		bio_submit_unmapped(dev, req);
+		return NO_ERROR;
+	}
+
+	bio_queue_pieces(dev, req, false);
+
+	return NO_ERROR;
+}
+
+void bio_init_pieces(bdev_t *dev, const bio_piece_ops_t *ops, const bio_piece_limits_t *limits)
+{
+	DEBUG_ASSERT(ops->can_map && ops->queue_piece);
+
+	dev->piece_ops = ops;
+	dev->piece_limits = limits;
+	dev->readv = bio_pieces_readv;
+	dev->writev = bio_pieces_writev;
+	dev->submit = bio_pieces_submit;
+}
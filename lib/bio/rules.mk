@@ -2,10 +2,18 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_DEPS += \
+	lib/dma \
+	lib/iovec \
+	lib/workqueue
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/bio.c \
+	$(LOCAL_DIR)/cachedev.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/mem.c \
+	$(LOCAL_DIR)/piece.c \
+	$(LOCAL_DIR)/sched.c \
 	$(LOCAL_DIR)/subdev.c 
 
 include make/module.mk
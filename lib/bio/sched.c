@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <lib/bio.h>
+#include <lib/bio_sched.h>
+#include <platform.h>
+
+#include "bio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* how long the deadline policy lets a request wait before it jumps the sort, in usecs */
+#define BIO_DEADLINE_READ_EXPIRE  (100 * 1000)
+#define BIO_DEADLINE_WRITE_EXPIRE (500 * 1000)
+
+/* a single transfer standing in for several adjacent requests */
+struct bio_merge {
+	bio_request_t req;
+	bio_queue_t *q;
+	uint count;
+	iovec_t iov[BIO_SCHED_MAX_MERGE];
+	bio_request_t *child[BIO_SCHED_MAX_MERGE];
+};
+
+/* noop and merge, first come first served */
+static void bio_fifo_add(bio_queue_t *q, bio_request_t *req)
+{
+	list_add_tail(&q->pending, &req->node);
+}
+
+static bio_request_t *bio_fifo_next(bio_queue_t *q)
+{
+	return list_remove_head_type(&q->pending, bio_request_t, node);
+}
+
+/* deadline keeps the queue sorted by offset and sweeps upwards from the end of
+ * the last request, wrapping around at the top. the oldest request goes first
+ * once it has waited longer than its deadline.
+ */
+static void bio_deadline_add(bio_queue_t *q, bio_request_t *req)
+{
+	bio_request_t *r;
+	list_for_every_entry(&q->pending, r, bio_request_t, node) {
+		if (r->offset > req->offset) {
+			/* goes in front of r */
+			list_add_tail(&r->node, &req->node);
+			return;
+		}
+	}
+
+	list_add_tail(&q->pending, &req->node);
+}
+
+static bio_request_t *bio_deadline_next(bio_queue_t *q)
+{
+	if (list_is_empty(&q->pending))
+		return NULL;
+
+	bio_request_t *r;
+	bio_request_t *oldest = NULL;
+	bio_request_t *pick = NULL;
+	list_for_every_entry(&q->pending, r, bio_request_t, node) {
+		if (!oldest || r->queue_time < oldest->queue_time)
+			oldest = r;
+		if (!pick && r->offset >= q->next_offset)
+			pick = r;
+	}
+
+	lk_bigtime_t expire = (oldest->op == BIO_OP_READ) ? BIO_DEADLINE_READ_EXPIRE : BIO_DEADLINE_WRITE_EXPIRE;
+	if (current_time_hires() - oldest->queue_time >= expire)
+		pick = oldest;
+	else if (!pick)
+		pick = list_peek_head_type(&q->pending, bio_request_t, node);
+
+	list_delete(&pick->node);
+	return pick;
+}
+
+const bio_sched_policy_t bio_sched_noop = {
+	.name = "noop",
+	.merge = false,
+	.add = bio_fifo_add,
+	.next = bio_fifo_next,
+};
+
+const bio_sched_policy_t bio_sched_merge = {
+	.name = "merge",
+	.merge = true,
+	.add = bio_fifo_add,
+	.next = bio_fifo_next,
+};
+
+const bio_sched_policy_t bio_sched_deadline = {
+	.name = "deadline",
+	.merge = true,
+	.add = bio_deadline_add,
+	.next = bio_deadline_next,
+};
+
+static const bio_sched_policy_t *const bio_sched_policies[] = {
+	&bio_sched_noop,
+	&bio_sched_merge,
+	&bio_sched_deadline,
+};
+
+const bio_sched_policy_t *bio_sched_find_policy(const char *name)
+{
+	for (uint i = 0; i < countof(bio_sched_policies); i++) {
+		if (!strcmp(bio_sched_policies[i]->name, name))
+			return bio_sched_policies[i];
+	}
+
+	return NULL;
+}
+
+/* split the result of a merged transfer back out to the requests it was made of */
+static void bio_merge_done(bio_request_t *req)
+{
+	struct bio_merge *m = (struct bio_merge *)req->arg;
+	bio_queue_t *q = m->q;
+	ssize_t remaining = req->result;
+
+	for (uint i = 0; i < m->count; i++) {
+		bio_request_t *child = m->child[i];
+
+		/* errors go to everyone, a short transfer shortchanges the tail */
+		ssize_t result = remaining;
+		if (remaining >= 0) {
+			result = MIN((size_t)remaining, child->len);
+			remaining -= result;
+		}
+
+		bio_request_complete(child, result);
+	}
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+	list_add_head(&q->merge_free, &m->req.node);
+	spin_unlock_irqrestore(&q->lock, state);
+}
+
+/* pull requests that continue where req ends off the queue and glue them onto it */
+static bio_request_t *bio_queue_merge_locked(bio_queue_t *q, bio_request_t *req)
+{
+	if (req->iov || req->op == BIO_OP_ERASE || list_is_empty(&q->merge_free))
+		return req;
+
+	struct bio_merge *m = NULL;
+	off_t end = req->offset + req->len;
+	size_t len = req->len;
+
+	while (!m || m->count < BIO_SCHED_MAX_MERGE) {
+		bio_request_t *r;
+		bio_request_t *next = NULL;
+		list_for_every_entry(&q->pending, r, bio_request_t, node) {
+			if (r->offset == end && r->op == req->op && !r->iov &&
+					len + r->len <= BIO_SCHED_MAX_MERGE_BYTES) {
+				next = r;
+				break;
+			}
+		}
+		if (!next)
+			break;
+
+		if (!m) {
+			m = list_remove_head_type(&q->merge_free, struct bio_merge, req.node);
+			m->child[0] = req;
+			m->iov[0].iov_base = req->buf;
+			m->iov[0].iov_len = req->len;
+			m->count = 1;
+		}
+
+		list_delete(&next->node);
+		q->queued--;
+		q->merges++;
+
+		m->child[m->count] = next;
+		m->iov[m->count].iov_base = next->buf;
+		m->iov[m->count].iov_len = next->len;
+		m->count++;
+
+		end += next->len;
+		len += next->len;
+	}
+
+	if (!m)
+		return req;
+
+	LTRACEF("merged %u requests at offset %lld, len %zu\n", m->count, req->offset, len);
+
+	/* the merged transfer holds its own ref, the children keep theirs until they complete */
+	bio_request_init_iovec(&m->req, req->op, m->iov, m->count, req->offset, bio_merge_done, m);
+	bdev_inc_ref(q->dev);
+	m->req.dev = q->dev;
+	m->req.queue = q;
+
+	return &m->req;
+}
+
+/* hand requests to the driver until the queue is empty or depth are outstanding */
+static void bio_queue_dispatch(bio_queue_t *q)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+
+	while (q->inflight < q->depth) {
+		bio_request_t *req = q->policy->next(q);
+		if (!req)
+			break;
+
+		q->queued--;
+		if (q->policy->merge)
+			req = bio_queue_merge_locked(q, req);
+
+		req->sched_flags |= BIO_SCHED_DISPATCHED;
+		q->next_offset = req->offset + req->len;
+		q->inflight++;
+		q->dispatched++;
+		spin_unlock_irqrestore(&q->lock, state);
+
+		LTRACEF("dev '%s', req %p, op %u, offset %lld, len %zu\n",
+				q->dev->name, req, req->op, req->offset, req->len);
+
+		status_t err = q->dev->submit(q->dev, req);
+		if (err < 0)
+			bio_request_complete(req, err);
+
+		spin_lock_irqsave(&q->lock, state);
+	}
+
+	spin_unlock_irqrestore(&q->lock, state);
+}
+
+static void bio_queue_dispatch_work(void *arg)
+{
+	bio_queue_t *q = (bio_queue_t *)arg;
+	bdev_t *dev = q->dev;
+
+	bio_queue_dispatch(q);
+
+	/* taken by bio_queue_finished */
+	bdev_dec_ref(dev);
+}
+
+/* called by bio_submit, the request already holds its device ref */
+void bio_queue_submit(bio_queue_t *q, bio_request_t *req)
+{
+	req->queue = q;
+	req->sched_flags = BIO_SCHED_QUEUED;
+	req->queue_time = current_time_hires();
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+	q->policy->add(q, req);
+	q->queued++;
+	q->submitted++;
+	spin_unlock_irqrestore(&q->lock, state);
+
+	bio_queue_dispatch(q);
+}
+
+/* called by bio_request_complete before the request goes back to its owner */
+void bio_queue_account(bio_queue_t *q, bio_request_t *req, ssize_t result)
+{
+	if (!(req->sched_flags & BIO_SCHED_QUEUED))
+		return;
+
+	lk_bigtime_t latency = current_time_hires() - req->queue_time;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+	q->completed++;
+	if (result > 0)
+		q->bytes += result;
+	q->latency += latency;
+	spin_unlock_irqrestore(&q->lock, state);
+}
+
+/* a dispatched request finished, possibly in interrupt context. the next ones
+ * go out from the bio workqueue so drivers can block in their submit hook.
+ */
+void bio_queue_finished(bio_queue_t *q)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+	DEBUG_ASSERT(q->inflight > 0);
+	q->inflight--;
+	bool more = (q->queued > 0);
+	spin_unlock_irqrestore(&q->lock, state);
+
+	if (!more)
+		return;
+
+	/* the caller still holds a ref, so this can't be the one that keeps the device alive */
+	bdev_inc_ref(q->dev);
+	if (workqueue_submit(bio_get_workqueue(), &q->dispatch_work, bio_queue_dispatch_work, q,
+						 WORK_FLAG_NORESCHED) < 0)
+		bdev_dec_ref(q->dev);
+}
+
+void bio_queue_dump(const bio_queue_t *q)
+{
+	ulong completed = q->completed;
+
+	printf("\n\t\tsched %s, depth %u, queued %u, inflight %u", q->policy->name, q->depth, q->queued, q->inflight);
+	printf("\n\t\trequests %lu, dispatched %lu, merges %lu, avg size %llu, avg latency %llu us",
+		   q->submitted, q->dispatched, q->merges,
+		   completed ? q->bytes / completed : 0ULL,
+		   completed ? q->latency / completed : 0ULL);
+}
+
+void bio_queue_free(bio_queue_t *q)
+{
+	DEBUG_ASSERT(q->queued == 0 && q->inflight == 0);
+
+	free(q->merge_pool);
+	free(q);
+}
+
+status_t bio_set_scheduler(bdev_t *dev, const bio_sched_policy_t *policy, uint depth)
+{
+	DEBUG_ASSERT(dev);
+	DEBUG_ASSERT(policy);
+
+	if (depth == 0)
+		depth = BIO_SCHED_DEFAULT_DEPTH;
+
+	/* completions kick the queue from the workqueue, make sure it's there before any can happen */
+	if (!bio_get_workqueue())
+		return ERR_NO_MEMORY;
+
+	/* at most one merged transfer per outstanding request */
+	struct bio_merge *pool = calloc(depth, sizeof(struct bio_merge));
+	if (!pool)
+		return ERR_NO_MEMORY;
+
+	bio_queue_t *q = dev->queue;
+	if (!q) {
+		q = calloc(1, sizeof(bio_queue_t));
+		if (!q) {
+			free(pool);
+			return ERR_NO_MEMORY;
+		}
+
+		q->dev = dev;
+		spin_lock_init(&q->lock);
+		list_initialize(&q->pending);
+		list_initialize(&q->merge_free);
+		q->dispatch_work = (work_t)WORK_INITIAL_VALUE;
+	}
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+
+	if (q->queued || q->inflight) {
+		spin_unlock_irqrestore(&q->lock, state);
+		free(pool);
+		return ERR_BUSY;
+	}
+
+	struct bio_merge *old_pool = q->merge_pool;
+	q->policy = policy;
+	q->depth = depth;
+	q->merge_pool = pool;
+	list_initialize(&q->merge_free);
+	for (uint i = 0; i < depth; i++) {
+		pool[i].q = q;
+		list_add_tail(&q->merge_free, &pool[i].req.node);
+	}
+
+	/* submitters take the lock before looking inside, publishing it under the lock is enough */
+	dev->queue = q;
+	spin_unlock_irqrestore(&q->lock, state);
+
+	free(old_pool);
+
+	return NO_ERROR;
+}
+
+// vim: set ts=4 sw=4 noexpandtab:
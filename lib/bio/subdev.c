@@ -71,6 +71,21 @@ static ssize_t subdev_write_block(struct bdev *_dev, const void *buf, bnum_t blo
 	return bio_write_block(subdev->parent, buf, block + subdev->offset, count);
 }
 
+/* the range was already trimmed to the subdevice, which lies inside the parent */
+static ssize_t subdev_readv(struct bdev *_dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	return subdev->parent->readv(subdev->parent, iov, iov_cnt, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
+static ssize_t subdev_writev(struct bdev *_dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	return subdev->parent->writev(subdev->parent, iov, iov_cnt, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
 static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len)
 {
 	subdev_t *subdev = (subdev_t *)_dev;
@@ -78,6 +93,41 @@ static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len)
 	return bio_erase(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
 }
 
+static ssize_t subdev_discard(struct bdev *_dev, off_t offset, size_t len)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	return bio_discard(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
+static ssize_t subdev_write_zeroes(struct bdev *_dev, off_t offset, size_t len)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	return bio_write_zeroes(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
+static status_t subdev_flush(struct bdev *_dev)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	return bio_flush(subdev->parent);
+}
+
+static int subdev_ioctl(struct bdev *_dev, int request, void *argp)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	switch (request) {
+		case BIO_IOCTL_GET_MEM_MAP:
+		case BIO_IOCTL_PUT_MEM_MAP:
+			/* the parent's map doesn't start where we do */
+			return ERR_NOT_SUPPORTED;
+		default:
+			return bio_ioctl(subdev->parent, request, argp);
+	}
+}
+
 static void subdev_close(struct bdev *_dev)
 {
 	subdev_t *subdev = (subdev_t *)_dev;
@@ -181,7 +231,13 @@ status_t bio_publish_subdevice(const char *parent_dev,
 	sub->dev.read_block = &subdev_read_block;
 	sub->dev.write = &subdev_write;
 	sub->dev.write_block = &subdev_write_block;
+	sub->dev.readv = &subdev_readv;
+	sub->dev.writev = &subdev_writev;
 	sub->dev.erase = &subdev_erase;
+	sub->dev.discard = &subdev_discard;
+	sub->dev.write_zeroes = &subdev_write_zeroes;
+	sub->dev.flush = &subdev_flush;
+	sub->dev.ioctl = &subdev_ioctl;
 	sub->dev.close = &subdev_close;
 
 	bio_register_device(&sub->dev);
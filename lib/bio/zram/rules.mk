@@ -0,0 +1,12 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS += \
+	lib/bio \
+	lib/miniz
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/zram.c
+
+include make/module.mk
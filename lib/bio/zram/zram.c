@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <kernel/mutex.h>
+#include <lib/bio.h>
+#include <lib/bio_zram.h>
+#include <lib/miniz.h>
+
+#define LOCAL_TRACE 0
+
+#define ZRAM_BLOCK_SIZE 512
+#define ZRAM_PAGE_SHIFT 12
+#define ZRAM_PAGE_SIZE  (1U << ZRAM_PAGE_SHIFT)
+
+/* pages that don't deflate to at least a quarter smaller are kept raw */
+#define ZRAM_MAX_COMPRESSED (ZRAM_PAGE_SIZE * 3 / 4)
+
+/* a single hash probe with greedy parsing, about what deflate level 1 does */
+#define ZRAM_DEFLATE_FLAGS (1 | TDEFL_GREEDY_PARSING_FLAG)
+
+typedef struct zram_slot {
+	void *data;    /* NULL if the page is fill repeated */
+	uint32_t len;  /* bytes at data, ZRAM_PAGE_SIZE if stored raw */
+	uint32_t fill;
+} zram_slot_t;
+
+typedef struct zram_bdev {
+	bdev_t dev;
+
+	mutex_t lock;
+	uint page_count;
+	zram_slot_t *slots;
+
+	/* the codec state is big, so there's one of each per device */
+	tdefl_compressor *comp;
+	tinfl_decompressor *decomp;
+	uint8_t *scratch;  /* a page, for partial page updates */
+	uint8_t *cbuf;     /* ZRAM_MAX_COMPRESSED of deflate output */
+
+	struct zram_stats stats;
+} zram_bdev_t;
+
+static bool page_is_fill(const uint8_t *page, uint32_t *fill)
+{
+	/* a page is one repeated word if it matches itself shifted by a word */
+	if (memcmp(page, page + sizeof(uint32_t), ZRAM_PAGE_SIZE - sizeof(uint32_t)))
+		return false;
+
+	memcpy(fill, page, sizeof(uint32_t));
+	return true;
+}
+
+static void account(zram_bdev_t *z, const zram_slot_t *slot, int dir)
+{
+	if (!slot->data) {
+		if (slot->fill)
+			z->stats.same_pages += dir;
+		return;
+	}
+
+	z->stats.orig_bytes += dir * (int64_t)ZRAM_PAGE_SIZE;
+	z->stats.stored_bytes += dir * (int64_t)slot->len;
+	if (slot->len == ZRAM_PAGE_SIZE)
+		z->stats.raw_pages += dir;
+	else
+		z->stats.compressed_pages += dir;
+}
+
+static status_t load_page(zram_bdev_t *z, uint page, uint8_t *dst)
+{
+	const zram_slot_t *slot = &z->slots[page];
+
+	if (!slot->data) {
+		for (uint i = 0; i < ZRAM_PAGE_SIZE; i += sizeof(uint32_t))
+			memcpy(dst + i, &slot->fill, sizeof(uint32_t));
+		return NO_ERROR;
+	}
+
+	if (slot->len == ZRAM_PAGE_SIZE) {
+		memcpy(dst, slot->data, ZRAM_PAGE_SIZE);
+		return NO_ERROR;
+	}
+
+	z->stats.reads++;
+
+	size_t in_len = slot->len;
+	size_t out_len = ZRAM_PAGE_SIZE;
+	tinfl_init(z->decomp);
+	tinfl_status status = tinfl_decompress(z->decomp, slot->data, &in_len, dst, dst, &out_len,
+	                                       TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+	if (status != TINFL_STATUS_DONE || out_len != ZRAM_PAGE_SIZE) {
+		TRACEF("%s: page %u failed to inflate, status %d\n", z->dev.name, page, status);
+		return ERR_IO;
+	}
+
+	return NO_ERROR;
+}
+
+static void free_page(zram_bdev_t *z, uint page)
+{
+	zram_slot_t *slot = &z->slots[page];
+
+	account(z, slot, -1);
+	free(slot->data);
+	slot->data = NULL;
+	slot->len = 0;
+	slot->fill = 0;
+}
+
+/* replace a page with the page at src. on failure the old contents are kept */
+static status_t store_page(zram_bdev_t *z, uint page, const uint8_t *src)
+{
+	zram_slot_t *slot = &z->slots[page];
+	uint32_t fill;
+
+	if (page_is_fill(src, &fill)) {
+		free_page(z, page);
+		slot->fill = fill;
+		account(z, slot, 1);
+		return NO_ERROR;
+	}
+
+	z->stats.writes++;
+
+	size_t in_len = ZRAM_PAGE_SIZE;
+	size_t out_len = ZRAM_MAX_COMPRESSED;
+	const uint8_t *data = src;
+	size_t len = ZRAM_PAGE_SIZE;
+
+	tdefl_init(z->comp, NULL, NULL, ZRAM_DEFLATE_FLAGS);
+	if (tdefl_compress(z->comp, src, &in_len, z->cbuf, &out_len, TDEFL_FINISH) == TDEFL_STATUS_DONE) {
+		data = z->cbuf;
+		len = out_len;
+	}
+
+	void *buf = malloc(len);
+	if (!buf)
+		return ERR_NO_MEMORY;
+	memcpy(buf, data, len);
+
+	free_page(z, page);
+	slot->data = buf;
+	slot->len = len;
+	account(z, slot, 1);
+
+	return NO_ERROR;
+}
+
+static ssize_t zram_read(bdev_t *bdev, void *_buf, off_t offset, size_t len)
+{
+	zram_bdev_t *z = (zram_bdev_t *)bdev;
+	uint8_t *buf = (uint8_t *)_buf;
+	ssize_t result = len;
+
+	LTRACEF("bdev %s, buf %p, offset %lld, len %zu\n", bdev->name, buf, offset, len);
+
+	mutex_acquire(&z->lock);
+	while (len > 0) {
+		uint page = offset >> ZRAM_PAGE_SHIFT;
+		size_t start = offset & (ZRAM_PAGE_SIZE - 1);
+		size_t chunk = MIN(ZRAM_PAGE_SIZE - start, len);
+
+		status_t err;
+		if (chunk == ZRAM_PAGE_SIZE) {
+			err = load_page(z, page, buf);
+		} else {
+			err = load_page(z, page, z->scratch);
+			memcpy(buf, z->scratch + start, chunk);
+		}
+		if (err < 0) {
+			result = err;
+			break;
+		}
+
+		buf += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	mutex_release(&z->lock);
+
+	return result;
+}
+
+/* write len bytes at offset, zeros if buf is NULL */
+static ssize_t zram_update(zram_bdev_t *z, const uint8_t *buf, off_t offset, size_t len)
+{
+	ssize_t written = 0;
+	status_t err = NO_ERROR;
+
+	mutex_acquire(&z->lock);
+	while (len > 0) {
+		uint page = offset >> ZRAM_PAGE_SHIFT;
+		size_t start = offset & (ZRAM_PAGE_SIZE - 1);
+		size_t chunk = MIN(ZRAM_PAGE_SIZE - start, len);
+
+		if (chunk == ZRAM_PAGE_SIZE && !buf) {
+			free_page(z, page);
+		} else if (chunk == ZRAM_PAGE_SIZE) {
+			err = store_page(z, page, buf);
+		} else {
+			err = load_page(z, page, z->scratch);
+			if (err >= 0) {
+				if (buf)
+					memcpy(z->scratch + start, buf, chunk);
+				else
+					memset(z->scratch + start, 0, chunk);
+				err = store_page(z, page, z->scratch);
+			}
+		}
+		if (err < 0)
+			break;
+
+		if (buf)
+			buf += chunk;
+		offset += chunk;
+		len -= chunk;
+		written += chunk;
+	}
+	mutex_release(&z->lock);
+
+	return (written > 0) ? written : err;
+}
+
+static ssize_t zram_write(bdev_t *bdev, const void *buf, off_t offset, size_t len)
+{
+	LTRACEF("bdev %s, buf %p, offset %lld, len %zu\n", bdev->name, buf, offset, len);
+
+	return zram_update((zram_bdev_t *)bdev, buf, offset, len);
+}
+
+static ssize_t zram_read_block(bdev_t *bdev, void *buf, bnum_t block, uint count)
+{
+	return zram_read(bdev, buf, (off_t)block * ZRAM_BLOCK_SIZE, count * ZRAM_BLOCK_SIZE);
+}
+
+static ssize_t zram_write_block(bdev_t *bdev, const void *buf, bnum_t block, uint count)
+{
+	return zram_write(bdev, buf, (off_t)block * ZRAM_BLOCK_SIZE, count * ZRAM_BLOCK_SIZE);
+}
+
+/* erasing to zero drops whole pages rather than compressing them */
+static ssize_t zram_erase(bdev_t *bdev, off_t offset, size_t len)
+{
+	LTRACEF("bdev %s, offset %lld, len %zu\n", bdev->name, offset, len);
+
+	return zram_update((zram_bdev_t *)bdev, NULL, offset, len);
+}
+
+status_t create_zram_bdev(const char *name, size_t len)
+{
+	status_t err = ERR_NO_MEMORY;
+
+	len = ROUNDUP(len, ZRAM_PAGE_SIZE);
+	if (len == 0)
+		return ERR_INVALID_ARGS;
+
+	zram_bdev_t *z = calloc(1, sizeof(zram_bdev_t));
+	if (!z)
+		return ERR_NO_MEMORY;
+
+	z->page_count = len / ZRAM_PAGE_SIZE;
+	z->slots = calloc(z->page_count, sizeof(zram_slot_t));
+	z->comp = malloc(sizeof(tdefl_compressor));
+	z->decomp = malloc(sizeof(tinfl_decompressor));
+	z->scratch = malloc(ZRAM_PAGE_SIZE);
+	z->cbuf = malloc(ZRAM_MAX_COMPRESSED);
+	if (!z->slots || !z->comp || !z->decomp || !z->scratch || !z->cbuf)
+		goto fail;
+
+	mutex_init(&z->lock);
+	z->stats.disk_size = len;
+
+	bio_initialize_bdev(&z->dev, name, ZRAM_BLOCK_SIZE, len / ZRAM_BLOCK_SIZE, 0, NULL);
+
+	z->dev.read = zram_read;
+	z->dev.read_block = zram_read_block;
+	z->dev.write = zram_write;
+	z->dev.write_block = zram_write_block;
+	z->dev.erase = zram_erase;
+
+	LTRACEF("%s: %u pages\n", name, z->page_count);
+
+	bio_register_device(&z->dev);
+
+	return NO_ERROR;
+
+fail:
+	free(z->cbuf);
+	free(z->scratch);
+	free(z->decomp);
+	free(z->comp);
+	free(z->slots);
+	free(z);
+	return err;
+}
+
+status_t zram_get_stats(const char *name, struct zram_stats *stats)
+{
+	bdev_t *dev = bio_open(name);
+	if (!dev)
+		return ERR_NOT_FOUND;
+
+	status_t err = ERR_INVALID_ARGS;
+	if (dev->read == zram_read) {
+		zram_bdev_t *z = (zram_bdev_t *)dev;
+
+		mutex_acquire(&z->lock);
+		*stats = z->stats;
+		mutex_release(&z->lock);
+		err = NO_ERROR;
+	}
+
+	bio_close(dev);
+	return err;
+}
+
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+static int cmd_zram(int argc, const cmd_args *argv)
+{
+	if (argc < 3) {
+		printf("usage:\n");
+		printf("%s create <name> <size>\n", argv[0].str);
+		printf("%s stats <name>\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	if (!strcmp(argv[1].str, "create")) {
+		if (argc < 4)
+			return ERR_INVALID_ARGS;
+
+		status_t err = create_zram_bdev(argv[2].str, argv[3].u);
+		if (err < 0)
+			printf("error %d creating %s\n", err, argv[2].str);
+		return err;
+	} else if (!strcmp(argv[1].str, "stats")) {
+		struct zram_stats s;
+		status_t err = zram_get_stats(argv[2].str, &s);
+		if (err < 0) {
+			printf("%s isn't a zram device\n", argv[2].str);
+			return err;
+		}
+
+		printf("%s: %llu bytes, %u same filled pages, %u compressed, %u raw\n", argv[2].str,
+		       s.disk_size, s.same_pages, s.compressed_pages, s.raw_pages);
+		printf("\t%llu bytes stored in %llu", s.orig_bytes, s.stored_bytes);
+		if (s.stored_bytes)
+			printf(" (%llu.%02llu:1)", s.orig_bytes / s.stored_bytes,
+			       (s.orig_bytes % s.stored_bytes) * 100 / s.stored_bytes);
+		printf(", %u page reads %u page writes\n", s.reads, s.writes);
+		return NO_ERROR;
+	} else {
+		printf("unknown command\n");
+		return ERR_INVALID_ARGS;
+	}
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("zram", "compressed ram block devices", &cmd_zram)
+STATIC_COMMAND_END(zram);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/blog.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <endian.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/atomic.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* bumped whenever struct blog_record or the export lines change */
+#define BLOG_EXPORT_VERSION 1
+
+STATIC_ASSERT((BLOG_LEN & (BLOG_LEN - 1)) == 0);
+STATIC_ASSERT(sizeof(struct blog_record) == 24 + 8 * BLOG_MAX_ARGS);
+
+struct blog_cpu {
+	/* count of records ever reserved, the slot is this masked by the ring length */
+	volatile int head;
+	struct blog_record *records;
+} __CPU_ALIGN;
+
+static struct blog_cpu blog_cpus[SMP_MAX_CPUS];
+volatile bool blog_enable;
+
+void blog_add(const char *fmt, uint nargs, uintptr_t a0, uintptr_t a1, uintptr_t a2, uintptr_t a3)
+{
+	/* a migration after reading the cpu number just shares the old cpu's
+	 * ring for a moment, the atomic still hands out unique slots */
+	uint cpu = arch_curr_cpu_num();
+	struct blog_cpu *c = &blog_cpus[cpu];
+	uint index = (uint)atomic_add(&c->head, 1) & (BLOG_LEN - 1);
+	struct blog_record *r = &c->records[index];
+
+	/* readers skip the slot until the format is back */
+	r->fmt = 0;
+	smp_wmb();
+	r->time = current_time_hires();
+	r->cpu = cpu;
+	r->nargs = nargs;
+	r->args[0] = a0;
+	r->args[1] = a1;
+	r->args[2] = a2;
+	r->args[3] = a3;
+	atomic_store_release(&r->fmt, (uintptr_t)fmt);
+}
+
+/* oldest and one past the newest record still in a cpu's ring */
+static void blog_range(const struct blog_cpu *c, uint *start, uint *end)
+{
+	*end = (uint)c->head;
+	*start = (*end > BLOG_LEN) ? *end - BLOG_LEN : 0;
+}
+
+/* walk every ring at once, oldest record first. logging is paused around
+ * this so the rings hold still. */
+static void blog_walk(void (*cb)(const struct blog_record *))
+{
+	uint pos[SMP_MAX_CPUS];
+	uint end[SMP_MAX_CPUS];
+
+	if (!blog_cpus[0].records)
+		return;
+
+	bool was_enabled = blog_enable;
+	blog_enable = false;
+	smp_mb();
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		blog_range(&blog_cpus[i], &pos[i], &end[i]);
+
+	for (;;) {
+		const struct blog_record *next = NULL;
+		uint next_cpu = 0;
+
+		for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+			/* skip slots a writer was in the middle of */
+			while (pos[i] != end[i] && blog_cpus[i].records[pos[i] & (BLOG_LEN - 1)].fmt == 0)
+				pos[i]++;
+			if (pos[i] == end[i])
+				continue;
+
+			const struct blog_record *r = &blog_cpus[i].records[pos[i] & (BLOG_LEN - 1)];
+			if (!next || r->time < next->time) {
+				next = r;
+				next_cpu = i;
+			}
+		}
+
+		if (!next)
+			break;
+
+		cb(next);
+		pos[next_cpu]++;
+	}
+
+	blog_enable = was_enabled;
+}
+
+/* the format is in memory, but the arguments can't be pushed back through
+ * printf, so this just shows both side by side */
+static void blog_dump_record(const struct blog_record *r)
+{
+	printf("%llu.%u: \"", (unsigned long long)r->time, r->cpu);
+	for (const char *c = (const char *)(uintptr_t)r->fmt; *c; c++) {
+		if (*c == '\n')
+			printf("\\n");
+		else
+			putchar(*c);
+	}
+	printf("\"");
+	for (uint i = 0; i < r->nargs && i < BLOG_MAX_ARGS; i++)
+		printf(" 0x%llx", (unsigned long long)r->args[i]);
+	printf("\n");
+}
+
+void blog_dump(void)
+{
+	blog_walk(&blog_dump_record);
+}
+
+static void blog_export_record(const struct blog_record *r)
+{
+	const uint8_t *b = (const uint8_t *)r;
+
+	printf("blog r ");
+	for (size_t i = 0; i < sizeof(*r); i++)
+		printf("%02x", b[i]);
+	printf("\n");
+}
+
+/* the raw records, hex encoded so they survive a serial console. the
+ * header carries what the host needs to unpack them. */
+void blog_export(void)
+{
+	printf("blog begin %u %s %zu %u\n", BLOG_EXPORT_VERSION,
+	       (BYTE_ORDER == LITTLE_ENDIAN) ? "le" : "be",
+	       sizeof(struct blog_record), (uint)sizeof(uintptr_t));
+	blog_walk(&blog_export_record);
+	printf("blog end\n");
+}
+
+void blog_clear(void)
+{
+	bool was_enabled = blog_enable;
+	blog_enable = false;
+	smp_mb();
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (blog_cpus[i].records)
+			memset(blog_cpus[i].records, 0, BLOG_LEN * sizeof(struct blog_record));
+		blog_cpus[i].head = 0;
+	}
+
+	blog_enable = was_enabled;
+}
+
+static void blog_init(uint level)
+{
+	size_t size = BLOG_LEN * sizeof(struct blog_record);
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		struct blog_record *r = memalign(CACHE_LINE, size);
+		if (!r) {
+			dprintf(CRITICAL, "blog: failed to allocate %zu bytes for cpu %u\n", size, i);
+			return;
+		}
+		memset(r, 0, size);
+		blog_cpus[i].records = r;
+	}
+
+	LTRACEF("%u records of %zu bytes per cpu\n", BLOG_LEN, sizeof(struct blog_record));
+
+	blog_enable = true;
+}
+
+LK_INIT_HOOK(blog, blog_init, LK_INIT_LEVEL_HEAP);
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_blog(int argc, const cmd_args *argv)
+{
+	if (argc < 2) {
+		blog_dump();
+		return 0;
+	}
+
+	if (!strcmp(argv[1].str, "export")) {
+		blog_export();
+	} else if (!strcmp(argv[1].str, "clear")) {
+		blog_clear();
+	} else if (!strcmp(argv[1].str, "on")) {
+		if (!blog_cpus[0].records)
+			return ERR_NO_MEMORY;
+		blog_enable = true;
+	} else if (!strcmp(argv[1].str, "off")) {
+		blog_enable = false;
+	} else {
+		printf("usage:\n");
+		printf("%s                 : dump the log with raw arguments\n", argv[0].str);
+		printf("%s export          : dump the raw records for scripts/blog2txt.py\n", argv[0].str);
+		printf("%s clear           : empty the log\n", argv[0].str);
+		printf("%s on|off          : start or stop logging\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("blog", "binary log", &cmd_blog)
+STATIC_COMMAND_END(blog);
+
+#endif
@@ -28,29 +28,30 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <lib/bio.h>
 #include <lib/bootimage_struct.h>
 #include <lib/mincrypt/sha256.h>
+#include <kernel/event.h>
 
 #define LOCAL_TRACE 1
 
+/* entries that fit in the header page */
+#define BOOT_ENTRY_COUNT (4096 / sizeof(bootentry))
+
 struct bootimage {
     const uint8_t *ptr;
     size_t len;
 };
 
-static status_t validate_bootimage(bootimage_t *bi)
+/* check the header page, and that every entry it lists makes sense for an image of len bytes */
+static status_t validate_header(const bootentry *be, size_t len)
 {
-    if (!bi)
-        return ERR_INVALID_ARGS;
-
     /* is it large enough to hold the first entry */
-    if (bi->len < 4096) {
+    if (len < 4096) {
         LTRACEF("bootentry too short\n");
         return ERR_BAD_LEN;
     }
 
-    bootentry *be = (bootentry *)bi->ptr;
-
     /* check that the first entry is a file, type boot info, and is 4096 bytes at offset 0 */
     if (be->kind != KIND_FILE ||
             be->file.type != TYPE_BOOT_IMAGE ||
@@ -80,7 +81,7 @@ static status_t validate_bootimage(bootimage_t *bi)
         return ERR_INVALID_ARGS;
     }
 
-    bootentry_info *info = &be[1].info;
+    const bootentry_info *info = &be[1].info;
 
     /* is the image a handled version */
     if (info->version > BOOT_VERSION) {
@@ -89,16 +90,13 @@ static status_t validate_bootimage(bootimage_t *bi)
     }
 
     /* is the image the right size? */
-    if (info->image_size > bi->len) {
+    if (info->image_size > len) {
         LTRACEF("boot image block says image is too big (0x%x bytes)\n", info->image_size);
         return ERR_INVALID_ARGS;
     }
 
-    /* trim the len to what the info block says */
-    bi->len = info->image_size;
-
     /* iterate over the remaining entries in the list */
-    for (size_t i = 2; i < info->entry_count; i++) {
+    for (size_t i = 2; i < info->entry_count && i < BOOT_ENTRY_COUNT; i++) {
         if (be[i].kind == 0)
             break;
 
@@ -123,20 +121,6 @@ static status_t validate_bootimage(bootimage_t *bi)
                     LTRACEF("bad file section, size too large\n");
                     return ERR_INVALID_ARGS;
                 }
-
-                /* check the sha256 hash */
-                SHA256_init(&ctx);
-
-                LTRACEF("\tvalidating SHA256 hash\n");
-                SHA256_update(&ctx, (const uint8_t *)bi->ptr + be[i].file.offset, be[i].file.length);
-                const uint8_t *hash = SHA256_final(&ctx);
-
-                if (memcmp(hash, be[i].file.sha256, sizeof(be[i].file.sha256)) != 0) {
-                    LTRACEF("bad hash of file section\n");
-
-                    return ERR_CHECKSUM_FAIL;
-                }
-
                 break;
             }
             default:
@@ -145,6 +129,61 @@ static status_t validate_bootimage(bootimage_t *bi)
         }
     }
 
+    return NO_ERROR;
+}
+
+static const bootentry_file *find_file_section(const bootentry *be, uint32_t type)
+{
+    const bootentry_info *info = &be[1].info;
+
+    for (size_t i = 2; i < info->entry_count && i < BOOT_ENTRY_COUNT; i++) {
+        if (be[i].kind == 0)
+            break;
+
+        if (be[i].kind == KIND_FILE && be[i].file.type == type)
+            return &be[i].file;
+    }
+
+    return NULL;
+}
+
+static status_t validate_bootimage(bootimage_t *bi)
+{
+    if (!bi)
+        return ERR_INVALID_ARGS;
+
+    const bootentry *be = (const bootentry *)bi->ptr;
+
+    status_t err = validate_header(be, bi->len);
+    if (err < 0)
+        return err;
+
+    const bootentry_info *info = &be[1].info;
+
+    /* trim the len to what the info block says */
+    bi->len = info->image_size;
+
+    /* check the sha256 hash of every file section */
+    for (size_t i = 2; i < info->entry_count && i < BOOT_ENTRY_COUNT; i++) {
+        if (be[i].kind == 0)
+            break;
+        if (be[i].kind != KIND_FILE)
+            continue;
+
+        SHA256_CTX ctx;
+        SHA256_init(&ctx);
+
+        LTRACEF("\tvalidating SHA256 hash\n");
+        SHA256_update(&ctx, (const uint8_t *)bi->ptr + be[i].file.offset, be[i].file.length);
+        const uint8_t *hash = SHA256_final(&ctx);
+
+        if (memcmp(hash, be[i].file.sha256, sizeof(be[i].file.sha256)) != 0) {
+            LTRACEF("bad hash of file section\n");
+
+            return ERR_CHECKSUM_FAIL;
+        }
+    }
+
     LTRACEF("image good\n");
     return NO_ERROR;
 }
@@ -199,25 +238,221 @@ status_t bootimage_get_file_section(bootimage_t *bi, uint32_t type, const void *
     if (!bi)
         return ERR_INVALID_ARGS;
 
-    bootentry *be = (bootentry *)bi->ptr;
-    bootentry_info *info = &be[1].info;
+    const bootentry_file *file = find_file_section((const bootentry *)bi->ptr, type);
+    if (!file)
+        return ERR_NOT_FOUND;
 
-    for (size_t i = 2; i < info->entry_count; i++) {
-        if (be[i].kind == 0)
+    if (ptr)
+        *ptr = bi->ptr + file->offset;
+    if (len)
+        *len = file->length;
+    return NO_ERROR;
+}
+
+/*
+ * Streaming access. Only the header page is read up front, each file section is
+ * then read straight into the caller's buffer and hashed a chunk at a time as it
+ * arrives, so a section is loaded and verified in a single pass over the source.
+ */
+#define BOOTIMAGE_STREAM_CHUNK (64 * 1024)
+
+struct bootimage_stream {
+    bootimage_read_hook_t read_hook;
+    void *read_hook_arg;
+
+    bdev_t *dev;
+    off_t dev_offset;
+
+    bootentry header[BOOT_ENTRY_COUNT];
+};
+
+static ssize_t bootimage_stream_read(bootimage_stream_t *bs, void *buf, off_t offset, size_t len)
+{
+    if (bs->dev)
+        return bio_read(bs->dev, buf, bs->dev_offset + offset, len);
+
+    return bs->read_hook(bs->read_hook_arg, buf, offset, len);
+}
+
+static status_t bootimage_stream_read_header(bootimage_stream_t *bs, size_t len)
+{
+    ssize_t err = bootimage_stream_read(bs, bs->header, 0, sizeof(bs->header));
+    if (err < 0)
+        return err;
+    if (err != sizeof(bs->header))
+        return ERR_IO;
+
+    return validate_header(bs->header, len);
+}
+
+status_t bootimage_stream_open(bootimage_read_hook_t read_hook, void *arg, size_t len, bootimage_stream_t **bs)
+{
+    LTRACEF("hook %p, arg %p, len %zu\n", read_hook, arg, len);
+
+    if (!read_hook || !bs)
+        return ERR_INVALID_ARGS;
+
+    *bs = calloc(1, sizeof(bootimage_stream_t));
+    if (!*bs)
+        return ERR_NO_MEMORY;
+
+    (*bs)->read_hook = read_hook;
+    (*bs)->read_hook_arg = arg;
+
+    status_t err = bootimage_stream_read_header(*bs, len);
+    if (err < 0) {
+        bootimage_stream_close(*bs);
+        return err;
+    }
+
+    return NO_ERROR;
+}
+
+status_t bootimage_stream_open_bio(bdev_t *dev, off_t offset, bootimage_stream_t **bs)
+{
+    LTRACEF("dev %p, offset 0x%llx\n", dev, offset);
+
+    if (!dev || !bs || offset < 0 || offset > dev->total_size)
+        return ERR_INVALID_ARGS;
+
+    *bs = calloc(1, sizeof(bootimage_stream_t));
+    if (!*bs)
+        return ERR_NO_MEMORY;
+
+    (*bs)->dev = dev;
+    (*bs)->dev_offset = offset;
+
+    status_t err = bootimage_stream_read_header(*bs, dev->total_size - offset);
+    if (err < 0) {
+        bootimage_stream_close(*bs);
+        return err;
+    }
+
+    return NO_ERROR;
+}
+
+status_t bootimage_stream_close(bootimage_stream_t *bs)
+{
+    if (bs)
+        free(bs);
+
+    return NO_ERROR;
+}
+
+status_t bootimage_stream_get_file_section(bootimage_stream_t *bs, uint32_t type, size_t *len)
+{
+    if (!bs)
+        return ERR_INVALID_ARGS;
+
+    const bootentry_file *file = find_file_section(bs->header, type);
+    if (!file)
+        return ERR_NOT_FOUND;
+
+    if (len)
+        *len = file->length;
+    return NO_ERROR;
+}
+
+/* read and hash the section through the block device, keeping the next chunk's read in flight while the last one is hashed */
+static ssize_t bootimage_stream_load_bio(bootimage_stream_t *bs, const bootentry_file *file, uint8_t *buf, SHA256_CTX *ctx)
+{
+    bio_request_t req[2];
+    size_t pos[2];
+    size_t submitted = 0;
+    size_t hashed = 0;
+    uint pending = 0; /* requests in flight, the oldest is req[(index - pending) & 1] */
+    uint index = 0;
+    ssize_t err = NO_ERROR;
+
+    while (hashed < file->length) {
+        /* keep two reads outstanding */
+        while (err >= 0 && pending < 2 && submitted < file->length) {
+            size_t len = MIN(file->length - submitted, BOOTIMAGE_STREAM_CHUNK);
+            bio_request_t *r = &req[index & 1];
+
+            bio_request_init(r, BIO_OP_READ, buf + submitted, bs->dev_offset + file->offset + submitted, len, NULL, NULL);
+            err = bio_submit(bs->dev, r);
+            if (err < 0) {
+                event_destroy(&r->event);
+                break;
+            }
+            pos[index & 1] = submitted;
+            submitted += len;
+            pending++;
+            index++;
+        }
+
+        if (pending == 0)
             break;
 
-        if (be[i].kind != KIND_FILE)
-            continue;
+        /* retire the oldest, in order */
+        uint slot = (index - pending) & 1;
+        ssize_t result = bio_wait(&req[slot]);
+        event_destroy(&req[slot].event);
+        pending--;
 
-        if (type == be[i].file.type) {
-            if (ptr)
-                *ptr = bi->ptr + be[i].file.offset;
-            if (len)
-                *len = be[i].file.length;
-            return NO_ERROR;
+        if (err < 0)
+            continue;
+        if (result < 0) {
+            err = result;
+            continue;
+        }
+        if ((size_t)result != req[slot].len) {
+            err = ERR_IO;
+            continue;
         }
+
+        SHA256_update(ctx, buf + pos[slot], result);
+        hashed += result;
     }
 
-    return ERR_NOT_FOUND;
+    return err;
 }
 
+ssize_t bootimage_stream_read_file_section(bootimage_stream_t *bs, uint32_t type, void *buf, size_t len)
+{
+    if (!bs || !buf)
+        return ERR_INVALID_ARGS;
+
+    const bootentry_file *file = find_file_section(bs->header, type);
+    if (!file)
+        return ERR_NOT_FOUND;
+
+    LTRACEF("type 0x%x offset 0x%x, length 0x%x, buf %p\n", type, file->offset, file->length, buf);
+
+    if (len < file->length)
+        return ERR_NOT_ENOUGH_BUFFER;
+
+    SHA256_CTX ctx;
+    SHA256_init(&ctx);
+
+    ssize_t err = NO_ERROR;
+    if (bs->dev) {
+        err = bootimage_stream_load_bio(bs, file, buf, &ctx);
+    } else {
+        for (size_t pos = 0; pos < file->length; ) {
+            size_t chunk = MIN(file->length - pos, BOOTIMAGE_STREAM_CHUNK);
+
+            err = bs->read_hook(bs->read_hook_arg, (uint8_t *)buf + pos, file->offset + pos, chunk);
+            if (err < 0)
+                break;
+            if ((size_t)err != chunk) {
+                err = ERR_IO;
+                break;
+            }
+
+            SHA256_update(&ctx, (uint8_t *)buf + pos, chunk);
+            pos += chunk;
+        }
+    }
+    if (err < 0)
+        return err;
+
+    const uint8_t *hash = SHA256_final(&ctx);
+    if (memcmp(hash, file->sha256, sizeof(file->sha256)) != 0) {
+        LTRACEF("bad hash of file section\n");
+        return ERR_CHECKSUM_FAIL;
+    }
+
+    return file->length;
+}
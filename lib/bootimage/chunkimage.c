@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <lib/chunkimage.h>
+#include <trace.h>
+#include <err.h>
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <lib/miniz.h>
+#include <lib/workqueue.h>
+
+#define LOCAL_TRACE 0
+
+struct chunkimage_job {
+    const uint8_t *ptr;
+    const chunkimage_chunk *index;
+    uint32_t chunk_count;
+    uint32_t chunk_size;
+    uint32_t image_size;
+    uint8_t *dst;
+
+    volatile int next_chunk;
+    volatile int err;           /* the first failure stops every worker */
+    volatile int outstanding;   /* helpers that haven't finished yet */
+    event_t done;
+
+    work_t work[SMP_MAX_CPUS];
+};
+
+/* helpers pinned to each cpu, made the first time an image is inflated */
+static workqueue_t *chunkimage_wq;
+static mutex_t chunkimage_wq_lock = MUTEX_INITIAL_VALUE(chunkimage_wq_lock);
+
+static const chunkimage_header *validate_chunkimage(const void *ptr, size_t len)
+{
+    const chunkimage_header *hdr = ptr;
+
+    if (len < sizeof(*hdr)) {
+        LTRACEF("too short for a header\n");
+        return NULL;
+    }
+
+    if (memcmp(hdr->magic, CHUNKIMAGE_MAGIC, CHUNKIMAGE_MAGIC_LENGTH)) {
+        LTRACEF("bad magic\n");
+        return NULL;
+    }
+
+    if ((hdr->version & 0xffff0000) != (CHUNKIMAGE_VERSION & 0xffff0000)) {
+        LTRACEF("unsupported version 0x%x\n", hdr->version);
+        return NULL;
+    }
+
+    if (hdr->chunk_size == 0 ||
+            hdr->chunk_count != (hdr->image_size + (uint64_t)hdr->chunk_size - 1) / hdr->chunk_size) {
+        LTRACEF("bad chunk size %u count %u for image size %u\n",
+                hdr->chunk_size, hdr->chunk_count, hdr->image_size);
+        return NULL;
+    }
+
+    uint64_t index_end = sizeof(*hdr) + (uint64_t)hdr->chunk_count * sizeof(chunkimage_chunk);
+    if (hdr->header_size < index_end || hdr->header_size > len) {
+        LTRACEF("bad header size %u\n", hdr->header_size);
+        return NULL;
+    }
+
+    const chunkimage_chunk *index = (const chunkimage_chunk *)(hdr + 1);
+    for (uint32_t i = 0; i < hdr->chunk_count; i++) {
+        if (index[i].offset < hdr->header_size ||
+                (uint64_t)index[i].offset + index[i].length > len) {
+            LTRACEF("chunk %u out of range\n", i);
+            return NULL;
+        }
+    }
+
+    return hdr;
+}
+
+bool chunkimage_probe(const void *ptr, size_t len)
+{
+    return len >= CHUNKIMAGE_MAGIC_LENGTH && !memcmp(ptr, CHUNKIMAGE_MAGIC, CHUNKIMAGE_MAGIC_LENGTH);
+}
+
+status_t chunkimage_get_size(const void *ptr, size_t len, size_t *image_size)
+{
+    const chunkimage_header *hdr = validate_chunkimage(ptr, len);
+    if (!hdr)
+        return ERR_NOT_VALID;
+
+    *image_size = hdr->image_size;
+    return NO_ERROR;
+}
+
+static status_t inflate_chunk(struct chunkimage_job *job, tinfl_decompressor *decomp, uint32_t i)
+{
+    const chunkimage_chunk *chunk = &job->index[i];
+    uint8_t *out = job->dst + (size_t)i * job->chunk_size;
+    size_t out_len = MIN(job->chunk_size, job->image_size - i * job->chunk_size);
+    size_t in_len = chunk->length;
+    size_t expected = out_len;
+
+    /* every chunk is a stream of its own, so nothing may reach back before out */
+    tinfl_init(decomp);
+    tinfl_status status = tinfl_decompress(decomp, job->ptr + chunk->offset, &in_len, out, out, &out_len,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+
+    if (status == TINFL_STATUS_ADLER32_MISMATCH) {
+        LTRACEF("chunk %u checksum mismatch\n", i);
+        return ERR_CHECKSUM_FAIL;
+    }
+    if (status != TINFL_STATUS_DONE || out_len != expected) {
+        LTRACEF("chunk %u failed, status %d, %zu of %zu bytes\n", i, status, out_len, expected);
+        return ERR_NOT_VALID;
+    }
+
+    return NO_ERROR;
+}
+
+/* pull chunks off the job until they run out or one of them fails */
+static void chunkimage_inflate_chunks(struct chunkimage_job *job)
+{
+    tinfl_decompressor *decomp = malloc(sizeof(tinfl_decompressor));
+    if (!decomp) {
+        job->err = ERR_NO_MEMORY;
+        return;
+    }
+
+    while (job->err == NO_ERROR) {
+        int i = atomic_add(&job->next_chunk, 1);
+        if ((uint32_t)i >= job->chunk_count)
+            break;
+
+        status_t err = inflate_chunk(job, decomp, i);
+        if (err < 0)
+            job->err = err;
+    }
+
+    free(decomp);
+}
+
+static void chunkimage_worker(void *arg)
+{
+    struct chunkimage_job *job = arg;
+
+    chunkimage_inflate_chunks(job);
+
+    if (atomic_add(&job->outstanding, -1) == 1)
+        event_signal(&job->done, true);
+}
+
+static workqueue_t *chunkimage_get_workqueue(void)
+{
+    mutex_acquire(&chunkimage_wq_lock);
+    if (!chunkimage_wq)
+        chunkimage_wq = workqueue_create("chunkimage", 1, DEFAULT_PRIORITY, 0);
+    mutex_release(&chunkimage_wq_lock);
+
+    return chunkimage_wq;
+}
+
+ssize_t chunkimage_decompress(const void *ptr, size_t len, void *dst, size_t dst_len)
+{
+    const chunkimage_header *hdr = validate_chunkimage(ptr, len);
+    if (!hdr)
+        return ERR_NOT_VALID;
+
+    if (dst_len < hdr->image_size)
+        return ERR_NOT_ENOUGH_BUFFER;
+
+    struct chunkimage_job job = {
+        .ptr = ptr,
+        .index = (const chunkimage_chunk *)(hdr + 1),
+        .chunk_count = hdr->chunk_count,
+        .chunk_size = hdr->chunk_size,
+        .image_size = hdr->image_size,
+        .dst = dst,
+        .next_chunk = 0,
+        .err = NO_ERROR,
+        .outstanding = 1,
+    };
+    event_init(&job.done, false, 0);
+
+    /* one helper on every other active cpu, as long as there are chunks left for it */
+    workqueue_t *wq = (hdr->chunk_count > 1) ? chunkimage_get_workqueue() : NULL;
+    uint helpers = 0;
+    if (wq) {
+        uint curr_cpu = arch_curr_cpu_num();
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS && helpers + 1 < hdr->chunk_count; cpu++) {
+            if (cpu == curr_cpu || !(mp.active_cpus & (1U << cpu)))
+                continue;
+
+            work_t *work = &job.work[cpu];
+            list_clear_node(&work->node);
+            work->queue = NULL;
+
+            atomic_add(&job.outstanding, 1);
+            if (workqueue_submit_cpu(wq, cpu, work, chunkimage_worker, &job, WORK_FLAG_NORESCHED) < 0) {
+                atomic_add(&job.outstanding, -1);
+                continue;
+            }
+            helpers++;
+        }
+    }
+
+    LTRACEF("%u chunks of %u bytes, %u helpers\n", hdr->chunk_count, hdr->chunk_size, helpers);
+
+    /* the caller takes chunks too, then waits for the helpers to drain the rest */
+    chunkimage_inflate_chunks(&job);
+    if (atomic_add(&job.outstanding, -1) != 1)
+        event_wait(&job.done);
+    event_destroy(&job.done);
+
+    if (job.err < 0)
+        return job.err;
+
+    return hdr->image_size;
+}
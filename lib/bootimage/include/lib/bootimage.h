@@ -26,6 +26,8 @@
 #include <compiler.h>
 #include <lib/bootimage_struct.h>
 
+struct bdev;
+
 typedef struct bootimage bootimage_t;
 
 status_t bootimage_open(const void *ptr, size_t len, bootimage_t **bi) __NONNULL();
@@ -35,3 +37,19 @@ status_t bootimage_get_range(bootimage_t *bi, const void **ptr, size_t *len) __N
 /* ask for a file section of the bootimage, by type */
 status_t bootimage_get_file_section(bootimage_t *bi, uint32_t type, const void **ptr, size_t *len) __NONNULL((1));
 
+/*
+ * Streaming access, for images that aren't already mapped in memory. Opening
+ * reads and checks just the header page. Reading a file section copies it into
+ * buf and checks its sha256 on the way, returning its length or
+ * ERR_CHECKSUM_FAIL, in which case the contents of buf must not be trusted.
+ */
+typedef struct bootimage_stream bootimage_stream_t;
+
+/* read len bytes at offset into the image, returns bytes read or error */
+typedef ssize_t (*bootimage_read_hook_t)(void *arg, void *buf, off_t offset, size_t len);
+
+status_t bootimage_stream_open(bootimage_read_hook_t read_hook, void *arg, size_t len, bootimage_stream_t **bs) __NONNULL((1, 4));
+status_t bootimage_stream_open_bio(struct bdev *dev, off_t offset, bootimage_stream_t **bs) __NONNULL();
+status_t bootimage_stream_close(bootimage_stream_t *bs) __NONNULL();
+status_t bootimage_stream_get_file_section(bootimage_stream_t *bs, uint32_t type, size_t *len) __NONNULL((1));
+ssize_t bootimage_stream_read_file_section(bootimage_stream_t *bs, uint32_t type, void *buf, size_t len) __NONNULL();
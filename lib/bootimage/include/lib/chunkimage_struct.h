@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Chunked compressed image, as built by tools/mkchunkimage.
+ *
+ * The image is cut into chunk_size pieces, each compressed as its own zlib
+ * stream so they can be inflated independently and in any order. The header
+ * and an index of every chunk come first, then the chunks themselves.
+ * All fields are little endian.
+ */
+typedef struct {
+    uint8_t magic[8];
+    uint32_t version;       /* chunkimage version */
+    uint32_t header_size;   /* byte size of the header plus the index */
+    uint32_t image_size;    /* byte size of the decompressed image */
+    uint32_t chunk_size;    /* decompressed size of every chunk but the last */
+    uint32_t chunk_count;   /* number of entries in the index */
+    uint32_t reserved[3];
+} __attribute__((packed)) chunkimage_header;
+
+typedef struct {
+    uint32_t offset;    /* byte offset from start of file */
+    uint32_t length;    /* compressed length in bytes */
+} __attribute__((packed)) chunkimage_chunk;
+
+#define CHUNKIMAGE_VERSION 0x00010000   /* 1.0 */
+
+#define CHUNKIMAGE_MAGIC "lkchunk"
+#define CHUNKIMAGE_MAGIC_LENGTH 8
@@ -5,9 +5,13 @@ MODULE := $(LOCAL_DIR)
 GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 
 MODULE_DEPS := \
-    lib/mincrypt
+    lib/bio \
+    lib/mincrypt \
+    lib/miniz \
+    lib/workqueue
 
 MODULE_SRCS := \
-	$(LOCAL_DIR)/bootimage.c
+	$(LOCAL_DIR)/bootimage.c \
+	$(LOCAL_DIR)/chunkimage.c
 
 include make/module.mk
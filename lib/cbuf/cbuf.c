@@ -41,30 +41,133 @@ void cbuf_initialize(cbuf_t *cbuf, size_t len)
 }
 
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf)
+{
+    cbuf_initialize_flags(cbuf, len, buf, 0);
+}
+
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags)
 {
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(len > 0);
     DEBUG_ASSERT(ispow2(len));
 
+    if (!buf)
+        buf = malloc(len);
+
     cbuf->head = 0;
     cbuf->tail = 0;
     cbuf->len_pow2 = log2_uint(len);
     cbuf->buf = buf;
-    event_init(&cbuf->event, false, 0);
+    cbuf->flags = flags;
+    cbuf->reader_waiting = false;
+    /* a spsc reader only waits once it's seen the buffer empty, and each wait
+     * wants exactly one wakeup */
+    event_init(&cbuf->event, false, (flags & CBUF_FLAG_SPSC) ? EVENT_FLAG_AUTOUNSIGNAL : 0);
     spin_lock_init(&cbuf->lock);
 
-    LTRACEF("len %zd, len_pow2 %u\n", len, cbuf->len_pow2);
+    LTRACEF("len %zd, len_pow2 %u, flags 0x%x\n", len, cbuf->len_pow2, flags);
 }
 
+/* the acquire loads make the data behind the indices visible with CBUF_FLAG_SPSC */
 size_t cbuf_space_avail(cbuf_t *cbuf)
 {
-    uint consumed = modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+    uint head = __atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE);
+    uint tail = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+    uint consumed = modpow2((uint)(head - tail), cbuf->len_pow2);
     return valpow2(cbuf->len_pow2) - consumed - 1;
 }
 
 size_t cbuf_space_used(cbuf_t *cbuf)
 {
-    return modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+    uint head = __atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE);
+    uint tail = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+    return modpow2((uint)(head - tail), cbuf->len_pow2);
+}
+
+/*
+ * CBUF_FLAG_SPSC: head is only stored by the writer and tail only by the
+ * reader. Each publishes with a release store and reads the other's index with
+ * an acquire load, so the data behind an index is visible once the index is.
+ *
+ * A reader about to block sets reader_waiting and then checks for data again,
+ * a writer publishes head and then checks reader_waiting. The full fences
+ * between each side's store and load mean at least one of them sees the
+ * other's, so a wakeup can be spurious but never lost.
+ */
+static void cbuf_spsc_wake(cbuf_t *cbuf, bool canreschedule)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (likely(!__atomic_load_n(&cbuf->reader_waiting, __ATOMIC_RELAXED)))
+        return;
+    if (__atomic_exchange_n(&cbuf->reader_waiting, false, __ATOMIC_RELAXED))
+        event_signal(&cbuf->event, canreschedule);
+}
+
+static void cbuf_spsc_wait(cbuf_t *cbuf)
+{
+    __atomic_store_n(&cbuf->reader_waiting, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&cbuf->head, __ATOMIC_RELAXED) == cbuf->tail)
+        event_wait(&cbuf->event);
+    else
+        __atomic_store_n(&cbuf->reader_waiting, false, __ATOMIC_RELAXED);
+}
+
+static size_t cbuf_write_spsc(cbuf_t *cbuf, const char *buf, size_t len, bool canreschedule)
+{
+    uint head = cbuf->head;
+    uint tail = __atomic_load_n(&cbuf->tail, __ATOMIC_ACQUIRE);
+    size_t size = valpow2(cbuf->len_pow2);
+
+    size_t avail = size - modpow2(head - tail, cbuf->len_pow2) - 1;
+    size_t write_len = MIN(len, avail);
+    if (write_len == 0)
+        return 0;
+
+    // at most two pieces, up to the end of the buffer and then from the start
+    size_t first = MIN(write_len, size - head);
+    if (buf) {
+        memcpy(cbuf->buf + head, buf, first);
+        memcpy(cbuf->buf, buf + first, write_len - first);
+    } else {
+        memset(cbuf->buf + head, 0, first);
+        memset(cbuf->buf, 0, write_len - first);
+    }
+
+    __atomic_store_n(&cbuf->head, INC_POINTER(cbuf, head, write_len), __ATOMIC_RELEASE);
+
+    cbuf_spsc_wake(cbuf, canreschedule);
+
+    return write_len;
+}
+
+static size_t cbuf_read_spsc(cbuf_t *cbuf, char *buf, size_t buflen, bool block)
+{
+    if (buflen == 0)
+        return 0;
+
+    for (;;) {
+        uint tail = cbuf->tail;
+        uint head = __atomic_load_n(&cbuf->head, __ATOMIC_ACQUIRE);
+        size_t read_len = MIN(buflen, modpow2(head - tail, cbuf->len_pow2));
+
+        if (read_len > 0) {
+            size_t first = MIN(read_len, valpow2(cbuf->len_pow2) - tail);
+            if (buf) {
+                memcpy(buf, cbuf->buf + tail, first);
+                memcpy(buf + first, cbuf->buf, read_len - first);
+            }
+
+            __atomic_store_n(&cbuf->tail, INC_POINTER(cbuf, tail, read_len), __ATOMIC_RELEASE);
+            return read_len;
+        }
+
+        if (!block)
+            return 0;
+
+        cbuf_spsc_wait(cbuf);
+    }
 }
 
 size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule)
@@ -76,6 +179,9 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(len < valpow2(cbuf->len_pow2));
 
+    if (cbuf->flags & CBUF_FLAG_SPSC)
+        return cbuf_write_spsc(cbuf, buf, len, canreschedule);
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
@@ -122,6 +228,9 @@ size_t cbuf_read(cbuf_t *cbuf, void *_buf, size_t buflen, bool block)
 
     DEBUG_ASSERT(cbuf);
 
+    if (cbuf->flags & CBUF_FLAG_SPSC)
+        return cbuf_read_spsc(cbuf, buf, buflen, block);
+
 retry:
     // block on the cbuf outside of the lock, which may
     // unblock us early and we'll have to double check below
@@ -179,6 +288,8 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t* regions)
 {
     DEBUG_ASSERT(cbuf && regions);
 
+    // with CBUF_FLAG_SPSC only the reader may peek, the lock doesn't keep the writer out
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
@@ -207,6 +318,9 @@ size_t cbuf_write_char(cbuf_t *cbuf, char c, bool canreschedule)
 {
     DEBUG_ASSERT(cbuf);
 
+    if (cbuf->flags & CBUF_FLAG_SPSC)
+        return cbuf_write_spsc(cbuf, &c, 1, canreschedule);
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&cbuf->lock, state);
 
@@ -231,6 +345,9 @@ size_t cbuf_read_char(cbuf_t *cbuf, char *c, bool block)
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(c);
 
+    if (cbuf->flags & CBUF_FLAG_SPSC)
+        return cbuf_read_spsc(cbuf, c, 1, block);
+
 retry:
     if (block)
         event_wait(&cbuf->event);
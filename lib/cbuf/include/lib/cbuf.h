@@ -22,8 +22,10 @@
  */
 #pragma once
 
+#include <err.h>
 #include <sys/types.h>
 #include <kernel/event.h>
+#include <kernel/poll.h>
 #include <kernel/spinlock.h>
 #include <iovec.h>
 
@@ -34,8 +36,15 @@ typedef struct cbuf {
     char *buf;
     event_t event;
     spin_lock_t lock;
+    uint flags;
+    bool reader_waiting; // CBUF_FLAG_SPSC: the reader is about to block, or blocked
 } cbuf_t;
 
+/* one writer and one reader at a time, which may be an irq handler and a
+ * thread. reads and writes then never take the lock, and the event is only
+ * signalled when the reader is blocked waiting for data. */
+#define CBUF_FLAG_SPSC 0x1
+
 /**
  * cbuf_initialize
  *
@@ -58,6 +67,19 @@ void cbuf_initialize(cbuf_t *cbuf, size_t len);
  */
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf);
 
+/**
+ * cbuf_initialize_flags
+ *
+ * Initialize a cbuf structure with CBUF_FLAG_* flags.
+ *
+ * @param[in] cbuf A pointer to the cbuf structure to allocate.
+ * @param[in] len The size of the buffer, in bytes.
+ * @param[in] buf A pointer to the memory to be used for internal storage, or
+ * NULL to malloc it.
+ * @param[in] flags CBUF_FLAG_* values.
+ */
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags);
+
 /**
  * cbuf_read
  *
@@ -153,6 +175,31 @@ static inline void cbuf_reset(cbuf_t *cbuf)
     cbuf_read(cbuf, NULL, cbuf_size(cbuf), false);
 }
 
+/**
+ * cbuf_poller_add
+ *
+ * Have a poller report the cbuf each time data arrives in it while it's empty.
+ * Use cbuf_read() without blocking to drain it before polling again.
+ *
+ * @param[in] cbuf The cbuf instance to watch.
+ * @param[in] poller The poller to add it to.
+ * @param[in] cookie Handed back by poller_wait() with POLL_IN.
+ *
+ * @return NO_ERROR, ERR_NOT_SUPPORTED for a CBUF_FLAG_SPSC cbuf, which only
+ * signals a blocked reader, or the error from poller_add_event().
+ */
+static inline status_t cbuf_poller_add(cbuf_t *cbuf, poller_t *poller, void *cookie)
+{
+    if (cbuf->flags & CBUF_FLAG_SPSC)
+        return ERR_NOT_SUPPORTED;
+    return poller_add_event(poller, &cbuf->event, POLL_IN, cookie);
+}
+
+static inline status_t cbuf_poller_remove(cbuf_t *cbuf, poller_t *poller)
+{
+    return poller_remove_event(poller, &cbuf->event);
+}
+
 /* special cases for dealing with a single char of data */
 size_t cbuf_read_char(cbuf_t *cbuf, char *c, bool block);
 size_t cbuf_write_char(cbuf_t *cbuf, char c, bool canreschedule);
@@ -6,6 +6,8 @@
 /* @(#) $Id$ */
 
 #include "zutil.h"
+#include <string.h>
+#include <arch/simd.h>
 
 local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 
@@ -59,6 +61,54 @@ local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 #  define MOD63(a) a %= BASE
 #endif
 
+#if WITH_KERNEL_SIMD
+/* below this the simd_begin() overhead isn't worth it */
+#define SIMD_MIN 256
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+/* Sum n 16 byte blocks, n <= NMAX / 16.  Each block is loaded as four little
+   endian words and split into the vectors b0..b3 of their first to last bytes, so byte
+   j = 4 * k + m of a block sits in lane k of bm.  s1v[k] collects the four
+   bytes of word k, ps the s1 * 16 term every block adds to sum2, and wv the
+   m part of the (16 * (n - c) - j) weight byte j in block c gets in sum2.
+   Must be called between simd_begin() and simd_end(). */
+__NO_INLINE local void adler32_simd(unsigned long *adler, unsigned long *sum2,
+                                    const Bytef *buf, unsigned n)
+{
+    const u32x4 mask = { 0xff, 0xff, 0xff, 0xff };
+    u32x4 s1v = {0};
+    u32x4 ps = {0};
+    u32x4 wv = {0};
+    unsigned long long a = *adler;
+    unsigned long long b = *sum2;
+    unsigned i;
+
+    b += (unsigned long long)a * 16 * n;
+    for (i = 0; i < n; i++) {
+        u32x4 w, t3, t23, t123;
+
+        memcpy(&w, buf, sizeof(w));
+        t3 = w >> 24;
+        t23 = ((w >> 16) & mask) + t3;
+        t123 = ((w >> 8) & mask) + t23;
+        ps += s1v;
+        s1v += (w & mask) + t123;
+        wv += t123 + t23 + t3;
+        buf += 16;
+    }
+
+    for (i = 0; i < 4; i++) {
+        a += s1v[i];
+        b += 16 * ((unsigned long long)ps[i] + s1v[i]);
+        b -= 4ULL * i * s1v[i] + wv[i];
+    }
+
+    *adler = a % BASE;
+    *sum2 = b % BASE;
+}
+#endif
+
 /* ========================================================================= */
 uLong ZEXPORT adler32(adler, buf, len)
     uLong adler;
@@ -99,6 +149,22 @@ uLong ZEXPORT adler32(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#if WITH_KERNEL_SIMD
+    /* vector unit in NMAX pieces, which also bounds the time interrupts
+       are off for */
+    if (len >= SIMD_MIN && simd_available()) {
+        MOD(sum2);
+        while (len >= 16) {
+            n = (len < NMAX ? len : NMAX) / 16;
+            simd_begin();
+            adler32_simd(&adler, &sum2, buf, n);
+            simd_end();
+            buf += n * 16;
+            len -= n * 16;
+        }
+    }
+#endif
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/arm64.h>
+#include <lk/init.h>
+#include "crc32_hw.h"
+
+/* armv8 crc32 instructions, optional before armv8.1 */
+uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf, size_t len);
+
+#if __ARM_FEATURE_CRC32
+static const bool crc32_armv8_present = true;
+#else
+static bool crc32_armv8_present;
+
+static void crc32_armv8_init(uint level)
+{
+    /* ID_AA64ISAR0_EL1.CRC32, bits [19:16] */
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    crc32_armv8_present = ((isar0 >> 16) & 0xf) != 0;
+}
+
+LK_INIT_HOOK(crc32_armv8, &crc32_armv8_init, LK_INIT_LEVEL_EARLIEST);
+#endif
+
+bool crc32_hw_available(void)
+{
+    return crc32_armv8_present;
+}
+
+uint32_t crc32_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    return crc32_armv8(crc, buf, len);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/x86.h>
+#include <arch/simd.h>
+#include <lk/init.h>
+#include <stdlib.h>
+#include "crc32_hw.h"
+
+/* see crc32_pclmul.S */
+uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t len);
+
+/* below this the setup costs more than folding saves */
+#define PCLMUL_MIN 128
+
+/* interrupts are off inside simd_begin(), so do big buffers a piece at a time */
+#define PCLMUL_CHUNK 4096
+
+static bool crc32_pclmul_present;
+
+static void crc32_pclmul_init(uint level)
+{
+	crc32_pclmul_present = simd_available() && check_pclmul_avail();
+}
+
+LK_INIT_HOOK(crc32_pclmul, &crc32_pclmul_init, LK_INIT_LEVEL_EARLIEST);
+
+bool crc32_hw_available(void)
+{
+	return crc32_pclmul_present;
+}
+
+uint32_t crc32_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	if (len < PCLMUL_MIN)
+		return crc32_tables(crc, buf, len);
+
+	/* the folding loop wants 16 byte aligned blocks */
+	size_t head = -(uintptr_t)buf & 15;
+	crc = crc32_tables(crc, buf, head);
+	buf += head;
+	len -= head;
+
+	while (len >= 64) {
+		size_t chunk = MIN(len, PCLMUL_CHUNK) & ~(size_t)15;
+
+		simd_begin();
+		crc = crc32_pclmul(crc, buf, chunk);
+		simd_end();
+
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return crc32_tables(crc, buf, len);
+}
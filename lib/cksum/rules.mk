@@ -8,6 +8,20 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/crc32.c \
 	$(LOCAL_DIR)/debug.c
 
+# hardware crc32 where the cpu has it, checked at boot
+ifeq ($(ARCH),arm64)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/crc32_arm64.c \
+	$(LOCAL_DIR)/crc32_armv8.S
+MODULE_DEFINES += CRC32_HW=1
+endif
+ifeq ($(ARCH)-$(KERNEL_SIMD),x86-64-1)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/crc32_x86_64.c \
+	$(LOCAL_DIR)/crc32_pclmul.S
+MODULE_DEFINES += CRC32_HW=1
+endif
+
 MODULE_CFLAGS += -Wno-strict-prototypes
 
 include make/module.mk
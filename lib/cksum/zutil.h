@@ -11,7 +11,7 @@ typedef uint8_t Byte;
 typedef Byte Bytef;
 typedef off_t z_off_t;
 typedef int64_t z_off64_t;
-typedef unsigned long z_crc_t;
+typedef uint32_t z_crc_t;
 
 //#define Z_U4 uint32_t
 
@@ -45,6 +45,8 @@
 
 #define MAX_NUM_ARGS 16
 
+#define TOKEN_BUF_LEN 1024
+
 #define HISTORY_LEN 16
 
 #define LOCAL_TRACE 0
@@ -78,6 +80,21 @@ static void dump_history(void);
 /* list of installed commands */
 static cmd_block *command_list = NULL;
 
+/* hashed index of the commands in command_list. each registered block gets
+ * its entries chained in ahead of the older ones, so a lookup finds the same
+ * command the list walk would.
+ */
+#define CMD_HASH_SIZE 128
+
+struct cmd_hash_entry {
+    struct cmd_hash_entry *next;
+    const cmd *command;
+    uint32_t hash;
+};
+
+static struct cmd_hash_entry *cmd_hash[CMD_HASH_SIZE];
+static bool cmd_hash_incomplete; /* a block couldn't be indexed, fall back to the list */
+
 /* a linear array of statically defined command blocks,
    defined in the linker script.
  */
@@ -217,11 +234,53 @@ static const char *prev_history(uint *cursor)
 }
 #endif
 
+static uint32_t cmd_hash_string(const char *str)
+{
+    /* fnv-1a */
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void cmd_hash_add_block(cmd_block *block)
+{
+    struct cmd_hash_entry *entries = malloc(block->count * sizeof(struct cmd_hash_entry));
+    if (!entries) {
+        cmd_hash_incomplete = true;
+        return;
+    }
+
+    /* push them in backwards so the first command of a block ends up first in its chain */
+    for (size_t i = block->count; i-- > 0; ) {
+        struct cmd_hash_entry *e = &entries[i];
+
+        e->command = &block->list[i];
+        e->hash = cmd_hash_string(e->command->cmd_str);
+        e->next = cmd_hash[e->hash % CMD_HASH_SIZE];
+        cmd_hash[e->hash % CMD_HASH_SIZE] = e;
+    }
+}
+
 static const cmd *match_command(const char *command, const uint8_t availability_mask)
 {
     cmd_block *block;
     size_t i;
 
+    if (likely(!cmd_hash_incomplete)) {
+        uint32_t hash = cmd_hash_string(command);
+
+        for (struct cmd_hash_entry *e = cmd_hash[hash % CMD_HASH_SIZE]; e; e = e->next) {
+            if (e->hash != hash || (availability_mask & e->command->availability_mask) == 0)
+                continue;
+            if (strcmp(command, e->command->cmd_str) == 0)
+                return e->command;
+        }
+        return NULL;
+    }
+
     for (block = command_list; block != NULL; block = block->next) {
         const cmd *curr_cmd = block->list;
         for (i = 0; i < block->count; i++) {
@@ -552,12 +611,47 @@ static void convert_args(int argc, cmd_args *argv)
 }
 
 
-static status_t command_loop(int (*get_line)(const char **, void *), void *get_line_cookie, bool showprompt, bool locked)
+/* run a matched command, returns true if it asked for the script to be aborted */
+static bool run_command(const cmd *command, int argc, const cmd_args *args, bool locked)
 {
-    bool exit;
+    bool exit = false;
+
+    if (!locked)
+        mutex_acquire(command_lock);
+
+    abort_script = false;
+    lastresult = command->cmd_callback(argc, args);
+
 #if WITH_LIB_ENV
     bool report_result;
+    env_get_bool("reportresult", &report_result, false);
+    if (report_result) {
+        if (lastresult < 0)
+            printf("FAIL %d\n", lastresult);
+        else
+            printf("PASS %d\n", lastresult);
+    }
+#endif
+
+#if WITH_LIB_ENV
+    // stuff the result in an environment var
+    env_set_int("?", lastresult, true);
 #endif
+
+    // someone must have aborted the current script
+    if (abort_script)
+        exit = true;
+    abort_script = false;
+
+    if (!locked)
+        mutex_release(command_lock);
+
+    return exit;
+}
+
+static status_t command_loop(int (*get_line)(const char **, void *), void *get_line_cookie, bool showprompt, bool locked)
+{
+    bool exit;
     cmd_args *args = NULL;
     const char *buffer;
     const char *continuebuffer;
@@ -568,7 +662,7 @@ static status_t command_loop(int (*get_line)(const char **, void *), void *get_l
         goto no_mem_error;
     }
 
-    const size_t outbuflen = 1024;
+    const size_t outbuflen = TOKEN_BUF_LEN;
     outbuf = malloc(outbuflen);
     if (unlikely(outbuf == NULL)) {
         goto no_mem_error;
@@ -619,35 +713,7 @@ static status_t command_loop(int (*get_line)(const char **, void *), void *get_l
             continue;
         }
 
-        if (!locked)
-            mutex_acquire(command_lock);
-
-        abort_script = false;
-        lastresult = command->cmd_callback(argc, args);
-
-#if WITH_LIB_ENV
-        bool report_result;
-        env_get_bool("reportresult", &report_result, false);
-        if (report_result) {
-            if (lastresult < 0)
-                printf("FAIL %d\n", lastresult);
-            else
-                printf("PASS %d\n", lastresult);
-        }
-#endif
-
-#if WITH_LIB_ENV
-        // stuff the result in an environment var
-        env_set_int("?", lastresult, true);
-#endif
-
-        // someone must have aborted the current script
-        if (abort_script)
-            exit = true;
-        abort_script = false;
-
-        if (!locked)
-            mutex_release(command_lock);
+        exit = run_command(command, argc, args, locked);
     }
 
     free(outbuf);
@@ -745,6 +811,213 @@ int console_run_script_locked(const char *string)
     return console_run_script_etc(string, true);
 }
 
+/*
+ * Compiled scripts are split into commands and tokenized once, then can be run
+ * any number of times. A command using $variables keeps its text and is
+ * tokenized again each time it runs, so it sees the environment as it is then.
+ */
+struct script_cmd {
+    const cmd *command; /* NULL if it wasn't found at compile time */
+    char *text;         /* set for a command that's tokenized when run */
+    int argc;
+    cmd_args args[];    /* followed by the argument strings */
+};
+
+struct console_script {
+    size_t count;
+    size_t capacity;
+    struct script_cmd **cmds;
+};
+
+static status_t script_append(console_script_t *script, struct script_cmd *sc)
+{
+    if (script->count == script->capacity) {
+        size_t capacity = script->capacity ? script->capacity * 2 : 16;
+        struct script_cmd **cmds = realloc(script->cmds, capacity * sizeof(struct script_cmd *));
+        if (!cmds)
+            return ERR_NO_MEMORY;
+        script->cmds = cmds;
+        script->capacity = capacity;
+    }
+
+    script->cmds[script->count++] = sc;
+    return NO_ERROR;
+}
+
+/* pack a tokenized command, with copies of its argument strings */
+static struct script_cmd *script_cmd_create(int argc, const cmd_args *args, const char *tokenbuf)
+{
+    size_t strings_len = 0;
+    for (int i = 0; i < argc; i++)
+        strings_len = MAX(strings_len, (size_t)(args[i].str - tokenbuf) + strlen(args[i].str) + 1);
+
+    struct script_cmd *sc = malloc(sizeof(struct script_cmd) + argc * sizeof(cmd_args) + strings_len);
+    if (!sc)
+        return NULL;
+
+    char *strings = (char *)&sc->args[argc];
+    memcpy(strings, tokenbuf, strings_len);
+
+    sc->text = NULL;
+    sc->argc = argc;
+    for (int i = 0; i < argc; i++)
+        sc->args[i].str = strings + (args[i].str - tokenbuf);
+    convert_args(argc, sc->args);
+
+    sc->command = match_command(sc->args[0].str, CMD_AVAIL_NORMAL);
+
+    return sc;
+}
+
+static struct script_cmd *script_cmd_create_text(const char *text, size_t len)
+{
+    struct script_cmd *sc = malloc(sizeof(struct script_cmd) + len + 1);
+    if (!sc)
+        return NULL;
+
+    sc->command = NULL;
+    sc->text = (char *)(sc + 1);
+    memcpy(sc->text, text, len);
+    sc->text[len] = 0;
+    sc->argc = 0;
+
+    return sc;
+}
+
+status_t console_compile_script(const char *string, console_script_t **_script)
+{
+    status_t err = NO_ERROR;
+    struct line_read_struct lineread;
+    const char *buffer;
+    const char *continuebuffer = NULL;
+
+    /* lines are read and split the same way console_run_script does it */
+    lineread.string = string;
+    lineread.pos = 0;
+    lineread.buffer = malloc(LINE_LEN);
+    lineread.buflen = LINE_LEN;
+
+    console_script_t *script = calloc(1, sizeof(console_script_t));
+    cmd_args *args = malloc(MAX_NUM_ARGS * sizeof(cmd_args));
+    char *tokenbuf = malloc(TOKEN_BUF_LEN);
+    if (!lineread.buffer || !script || !args || !tokenbuf) {
+        err = ERR_NO_MEMORY;
+        goto done;
+    }
+
+    for (;;) {
+        if (continuebuffer == NULL) {
+            int len = fetch_next_line(&buffer, &lineread);
+            if (len < 0)
+                break;
+            if (len == 0)
+                continue;
+        } else {
+            buffer = continuebuffer;
+        }
+
+        int argc = tokenize_command(buffer, &continuebuffer, tokenbuf, TOKEN_BUF_LEN,
+                                    args, MAX_NUM_ARGS);
+        if (argc <= 0)
+            continue;
+
+        /* the text of just this command, up to a ; separating it from the next one */
+        size_t len = continuebuffer ? (size_t)(continuebuffer - 1 - buffer) : strlen(buffer);
+
+        struct script_cmd *sc;
+        if (memchr(buffer, '$', len))
+            sc = script_cmd_create_text(buffer, len);
+        else
+            sc = script_cmd_create(argc, args, tokenbuf);
+
+        if (!sc || script_append(script, sc) < 0) {
+            free(sc);
+            err = ERR_NO_MEMORY;
+            goto done;
+        }
+    }
+
+done:
+    free(tokenbuf);
+    free(args);
+    free(lineread.buffer);
+
+    if (err < 0) {
+        if (script)
+            console_free_script(script);
+        return err;
+    }
+
+    *_script = script;
+    return NO_ERROR;
+}
+
+void console_free_script(console_script_t *script)
+{
+    for (size_t i = 0; i < script->count; i++)
+        free(script->cmds[i]);
+    free(script->cmds);
+    free(script);
+}
+
+static int console_run_compiled_script_etc(console_script_t *script, bool locked)
+{
+    cmd_args *args = NULL;
+    char *tokenbuf = NULL;
+
+    for (size_t i = 0; i < script->count; i++) {
+        struct script_cmd *sc = script->cmds[i];
+        const cmd *command = sc->command;
+        const cmd_args *argv = sc->args;
+        int argc = sc->argc;
+
+        if (sc->text) {
+            if (!args) {
+                args = malloc(MAX_NUM_ARGS * sizeof(cmd_args));
+                tokenbuf = malloc(TOKEN_BUF_LEN);
+                if (!args || !tokenbuf) {
+                    lastresult = ERR_NO_MEMORY;
+                    break;
+                }
+            }
+
+            const char *continuebuffer;
+            argc = tokenize_command(sc->text, &continuebuffer, tokenbuf, TOKEN_BUF_LEN,
+                                    args, MAX_NUM_ARGS);
+            if (argc <= 0)
+                continue;
+
+            convert_args(argc, args);
+            argv = args;
+            command = match_command(args[0].str, CMD_AVAIL_NORMAL);
+        } else if (!command) {
+            /* it may have been registered since */
+            command = match_command(argv[0].str, CMD_AVAIL_NORMAL);
+        }
+
+        if (!command)
+            continue;
+
+        if (run_command(command, argc, argv, locked))
+            break;
+    }
+
+    free(tokenbuf);
+    free(args);
+
+    return lastresult;
+}
+
+int console_run_compiled_script(console_script_t *script)
+{
+    return console_run_compiled_script_etc(script, false);
+}
+
+int console_run_compiled_script_locked(console_script_t *script)
+{
+    return console_run_compiled_script_etc(script, true);
+}
+
 console_cmd console_get_command_handler(const char *commandstr)
 {
     const cmd *command = match_command(commandstr, CMD_AVAIL_NORMAL);
@@ -762,6 +1035,8 @@ void console_register_commands(cmd_block *block)
 
     block->next = command_list;
     command_list = block;
+
+    cmd_hash_add_block(block);
 }
 
 
@@ -0,0 +1,645 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/crashdump.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <platform.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <lib/bio.h>
+#include <lib/console.h>
+#include <lib/miniz.h>
+#include <lk/init.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+#if WITH_LIB_KLOG
+#include <lib/klog.h>
+#endif
+#if WITH_LIB_MINIP
+#include <lib/minip.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* memory and text go out in pieces of this much, each deflated on its own */
+#define CHUNK_SIZE (64 * 1024)
+
+/* what the thread list gets to, the rest is cut off */
+#define TEXT_SIZE CHUNK_SIZE
+
+#define UDP_PAYLOAD 1024
+#define UDP_END_COUNT 4
+
+/* a single hash probe with greedy parsing, about what deflate level 1 does */
+#define DEFLATE_FLAGS (1 | TDEFL_GREEDY_PARSING_FLAG)
+
+enum target_type {
+	TARGET_NONE,
+	TARGET_BDEV,
+	TARGET_UDP,
+};
+
+static struct {
+	enum target_type type;
+
+	bdev_t *bdev;
+	size_t erase_size;      /* 0 if the device can be written without erasing */
+	off_t erased;           /* the device is erased below this, this dump */
+
+#if WITH_LIB_MINIP
+	udp_socket_t *sock;
+	uint32_t seq;
+#endif
+
+	/* allocated along with the first target and kept */
+	tdefl_compressor *comp;
+	uint8_t *out;           /* a deflated chunk */
+	uint8_t *stage;         /* stream bytes on their way to the target */
+	char *text;
+
+	size_t staged;
+	size_t text_len;
+	off_t pos;              /* stream bytes handed to the target */
+	uint records;
+
+	print_callback_t text_cb;
+	bool panicked;
+	volatile bool dumping;
+} cd;
+
+/* serializes setting targets and dumps asked for from the console, a panic
+ * doesn't take it */
+static mutex_t cd_lock = MUTEX_INITIAL_VALUE(cd_lock);
+
+static size_t stage_header_size(void)
+{
+#if WITH_LIB_MINIP
+	if (cd.type == TARGET_UDP)
+		return sizeof(struct crashdump_udp_header);
+#endif
+	return 0;
+}
+
+static size_t stage_size(void)
+{
+	return cd.type == TARGET_UDP ? UDP_PAYLOAD : CHUNK_SIZE;
+}
+
+static status_t flush_bdev(void)
+{
+	size_t len = cd.staged;
+
+	/* the last write of the dump isn't whole blocks */
+	size_t padded = ROUNDUP(len, cd.bdev->block_size);
+	memset(cd.stage + len, 0, padded - len);
+
+	status_t full = NO_ERROR;
+	if (cd.pos + (off_t)padded > cd.bdev->total_size) {
+		padded = cd.bdev->total_size - cd.pos;
+		full = ERR_NO_RESOURCES;
+	}
+
+	if (cd.erase_size) {
+		off_t end = ROUNDUP(cd.pos + (off_t)padded, (off_t)cd.erase_size);
+		if (end > cd.erased) {
+			ssize_t err = bio_erase(cd.bdev, cd.erased, end - cd.erased);
+			if (err < 0)
+				return err;
+			cd.erased = end;
+		}
+	}
+
+	if (padded) {
+		ssize_t err = bio_write(cd.bdev, cd.stage, cd.pos, padded);
+		if (err < 0)
+			return err;
+		if ((size_t)err != padded)
+			return ERR_IO;
+	}
+
+	cd.pos += padded;
+	cd.staged = 0;
+
+	return full;
+}
+
+#if WITH_LIB_MINIP
+static status_t send_udp(size_t len)
+{
+	struct crashdump_udp_header *hdr = (struct crashdump_udp_header *)cd.stage;
+
+	hdr->magic = CRASHDUMP_UDP_MAGIC;
+	hdr->seq = cd.seq++;
+	hdr->offset = cd.pos;
+
+	return udp_send(cd.stage, sizeof(*hdr) + len, cd.sock);
+}
+
+static status_t flush_udp(void)
+{
+	status_t err = send_udp(cd.staged);
+	if (err < 0)
+		return err;
+
+	cd.pos += cd.staged;
+	cd.staged = 0;
+
+	return NO_ERROR;
+}
+#endif
+
+static status_t flush_stage(void)
+{
+	if (cd.staged == 0)
+		return NO_ERROR;
+
+	switch (cd.type) {
+		case TARGET_BDEV:
+			return flush_bdev();
+#if WITH_LIB_MINIP
+		case TARGET_UDP:
+			return flush_udp();
+#endif
+		default:
+			return ERR_NOT_READY;
+	}
+}
+
+static status_t stream_write(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t hdr = stage_header_size();
+	size_t size = stage_size();
+
+	while (len > 0) {
+		size_t n = MIN(len, size - cd.staged);
+		memcpy(cd.stage + hdr + cd.staged, p, n);
+		cd.staged += n;
+		p += n;
+		len -= n;
+
+		if (cd.staged == size) {
+			status_t err = flush_stage();
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+static bool all_zero(const void *buf, size_t len)
+{
+	const unsigned long *p = buf;
+	DEBUG_ASSERT(IS_ALIGNED((uintptr_t)buf, sizeof(unsigned long)));
+
+	for (size_t i = 0; i < len / sizeof(*p); i++) {
+		if (p[i])
+			return false;
+	}
+	return true;
+}
+
+static status_t emit_record(uint32_t type, uint64_t addr, const void *data, size_t len)
+{
+	DEBUG_ASSERT(len <= CHUNK_SIZE);
+
+	struct crashdump_record rec = {
+		.type = type,
+		.flags = 0,
+		.addr = addr,
+		.len = len,
+		.stored_len = len,
+	};
+	const void *payload = data;
+
+	if (type == CRASHDUMP_RECORD_MEMORY && all_zero(data, len)) {
+		rec.flags = CRASHDUMP_RECORD_FLAG_ZERO;
+		rec.stored_len = 0;
+	} else if (len > 0) {
+		size_t in_len = len;
+		size_t out_len = CHUNK_SIZE;
+
+		/* anything that doesn't fit in a chunk again goes out as it is */
+		tdefl_init(cd.comp, NULL, NULL, DEFLATE_FLAGS);
+		if (tdefl_compress(cd.comp, data, &in_len, cd.out, &out_len, TDEFL_FINISH) == TDEFL_STATUS_DONE &&
+				out_len < len) {
+			rec.flags = CRASHDUMP_RECORD_FLAG_DEFLATE;
+			rec.stored_len = out_len;
+			payload = cd.out;
+		}
+	}
+
+	status_t err = stream_write(&rec, sizeof(rec));
+	if (err < 0)
+		return err;
+
+	cd.records++;
+	return stream_write(payload, rec.stored_len);
+}
+
+static status_t emit_chunked(uint32_t type, uint64_t addr, bool offsets, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (size_t off = 0; off < len; off += CHUNK_SIZE) {
+		status_t err = emit_record(type, offsets ? addr + off : addr, p + off, MIN(len - off, CHUNK_SIZE));
+		if (err < 0)
+			return err;
+	}
+
+	return NO_ERROR;
+}
+
+static void text_print(print_callback_t *cb, const char *str, size_t len)
+{
+	size_t n = MIN(len, TEXT_SIZE - cd.text_len);
+
+	memcpy(cd.text + cd.text_len, str, n);
+	cd.text_len += n;
+}
+
+static status_t dump_threads(void)
+{
+	cd.text_len = 0;
+	cd.text_cb.print = text_print;
+
+	register_print_callback(&cd.text_cb);
+	if (cd.panicked) {
+		/* the thread lock may be held by whoever panicked */
+		dump_all_threads_unlocked();
+	} else {
+		dump_all_threads();
+	}
+	unregister_print_callback(&cd.text_cb);
+
+	return emit_chunked(CRASHDUMP_RECORD_THREADS, 0, true, cd.text, cd.text_len);
+}
+
+static status_t dump_klog(void)
+{
+#if WITH_LIB_KLOG
+	for (uint b = 0; b < klog_buffer_count(); b++) {
+		iovec_t vec[2];
+		int count = klog_get_buffer(b, vec);
+
+		for (int i = 0; i < count; i++) {
+			status_t err = emit_chunked(CRASHDUMP_RECORD_KLOG, b, false, vec[i].iov_base, vec[i].iov_len);
+			if (err < 0)
+				return err;
+		}
+	}
+#endif
+	return NO_ERROR;
+}
+
+#if WITH_KERNEL_VM
+static status_t dump_range(paddr_t pa, void *va, size_t len, void *arg)
+{
+	if (!va)
+		return NO_ERROR;
+
+	return emit_chunked(CRASHDUMP_RECORD_MEMORY, pa, true, va, len);
+}
+#endif
+
+static status_t dump_memory(void)
+{
+#if WITH_KERNEL_VM
+	return pmm_for_each_used_range_unlocked(dump_range, NULL);
+#else
+	return NO_ERROR;
+#endif
+}
+
+static status_t finish(void)
+{
+	struct crashdump_record end = { .type = CRASHDUMP_RECORD_END };
+
+	status_t err = stream_write(&end, sizeof(end));
+	if (err < 0)
+		return err;
+
+	err = flush_stage();
+	if (err < 0)
+		return err;
+
+#if WITH_LIB_MINIP
+	if (cd.type == TARGET_UDP) {
+		/* tell the other end it has everything, a few times in case one gets lost */
+		for (int i = 0; i < UDP_END_COUNT; i++)
+			send_udp(0);
+	}
+#endif
+
+	if (cd.type == TARGET_BDEV)
+		bio_flush(cd.bdev);
+
+	return NO_ERROR;
+}
+
+static status_t dump(void *caller, const char *reason)
+{
+	if (cd.type == TARGET_NONE)
+		return ERR_NOT_READY;
+	if (cd.dumping)
+		return ERR_BUSY;
+	cd.dumping = true;
+
+	cd.staged = 0;
+	cd.pos = 0;
+	cd.erased = 0;
+	cd.records = 0;
+
+	/* the driver can't count on its interrupts from here on */
+	int poll = 1;
+	if (cd.type == TARGET_BDEV)
+		bio_ioctl(cd.bdev, BIO_IOCTL_SET_POLL, &poll);
+
+	lk_bigtime_t start = current_time_hires();
+	dprintf(ALWAYS, "crashdump: writing dump...\n");
+
+	struct crashdump_header hdr = {
+		.magic = CRASHDUMP_MAGIC,
+		.version = CRASHDUMP_VERSION,
+		.header_size = sizeof(hdr),
+		.page_size = PAGE_SIZE,
+		.time = start,
+		.caller = (uintptr_t)caller,
+	};
+	strlcpy(hdr.reason, reason, sizeof(hdr.reason));
+
+	status_t err = stream_write(&hdr, sizeof(hdr));
+	if (err >= 0)
+		err = dump_threads();
+	if (err >= 0)
+		err = dump_klog();
+	if (err >= 0)
+		err = dump_memory();
+	if (err >= 0)
+		err = finish();
+
+	lk_bigtime_t elapsed = current_time_hires() - start;
+
+	if (err < 0) {
+		dprintf(ALWAYS, "crashdump: failed with %d after %lld bytes\n", err, (long long)cd.pos);
+	} else {
+		dprintf(ALWAYS, "crashdump: %u records, %lld bytes in %llu ms\n",
+				cd.records, (long long)cd.pos, elapsed / 1000);
+	}
+
+	if (cd.type == TARGET_BDEV && !cd.panicked) {
+		poll = 0;
+		bio_ioctl(cd.bdev, BIO_IOCTL_SET_POLL, &poll);
+	}
+
+	cd.dumping = false;
+	return err;
+}
+
+void crashdump_panic(void *caller, const char *fmt, va_list ap)
+{
+	char reason[sizeof(((struct crashdump_header *)0)->reason)];
+
+	cd.panicked = true;
+	if (cd.type == TARGET_NONE || cd.dumping)
+		return;
+
+	vsnprintf(reason, sizeof(reason), fmt, ap);
+	dump(caller, reason);
+}
+
+status_t crashdump_capture(const char *reason)
+{
+	/* from the panic shell, the lock may never be let go of */
+	if (cd.panicked)
+		return dump(NULL, reason);
+
+	mutex_acquire(&cd_lock);
+	status_t err = dump(NULL, reason);
+	mutex_release(&cd_lock);
+
+	return err;
+}
+
+static status_t alloc_buffers(void)
+{
+	if (!cd.comp)
+		cd.comp = malloc(sizeof(tdefl_compressor));
+	if (!cd.out)
+		cd.out = malloc(CHUNK_SIZE);
+	if (!cd.stage)
+		cd.stage = malloc(CHUNK_SIZE);
+	if (!cd.text)
+		cd.text = malloc(TEXT_SIZE);
+
+	if (!cd.comp || !cd.out || !cd.stage || !cd.text)
+		return ERR_NO_MEMORY;
+
+	return NO_ERROR;
+}
+
+/* called with the lock held */
+static void clear_target(void)
+{
+	if (cd.bdev)
+		bio_close(cd.bdev);
+	cd.bdev = NULL;
+
+	/* minip has no way to let go of a socket, it's kept around for the next target */
+	cd.type = TARGET_NONE;
+}
+
+void crashdump_clear_target(void)
+{
+	mutex_acquire(&cd_lock);
+	clear_target();
+	mutex_release(&cd_lock);
+}
+
+status_t crashdump_set_target_bdev(const char *name)
+{
+	status_t err;
+
+	mutex_acquire(&cd_lock);
+
+	err = alloc_buffers();
+	if (err < 0)
+		goto out;
+
+	bdev_t *dev = bio_open(name);
+	if (!dev) {
+		err = ERR_NOT_FOUND;
+		goto out;
+	}
+
+	if (dev->block_size > CHUNK_SIZE || (CHUNK_SIZE % dev->block_size)) {
+		bio_close(dev);
+		err = ERR_NOT_SUPPORTED;
+		goto out;
+	}
+
+	clear_target();
+
+	cd.bdev = dev;
+	cd.erase_size = 0;
+	for (size_t i = 0; i < dev->geometry_count; i++)
+		cd.erase_size = MAX(cd.erase_size, dev->geometry[i].erase_size);
+	cd.type = TARGET_BDEV;
+
+	err = NO_ERROR;
+
+out:
+	mutex_release(&cd_lock);
+	return err;
+}
+
+status_t crashdump_set_target_udp(uint32_t host, uint16_t port)
+{
+#if WITH_LIB_MINIP
+	status_t err;
+
+	mutex_acquire(&cd_lock);
+
+	err = alloc_buffers();
+	if (err < 0)
+		goto out;
+
+	udp_socket_t *sock;
+	err = udp_open(host, port, port, &sock);
+	if (err < 0)
+		goto out;
+
+	clear_target();
+
+	cd.sock = sock;
+	cd.type = TARGET_UDP;
+	cd.pos = 0;
+
+	/* gets the host into the arp cache */
+	send_udp(0);
+
+	err = NO_ERROR;
+
+out:
+	mutex_release(&cd_lock);
+	return err;
+#else
+	return ERR_NOT_SUPPORTED;
+#endif
+}
+
+#if defined(CRASHDUMP_TARGET_BDEV)
+static void crashdump_init(uint level)
+{
+	status_t err = crashdump_set_target_bdev(CRASHDUMP_TARGET_BDEV);
+	if (err < 0)
+		dprintf(INFO, "crashdump: no target device '%s' (%d)\n", CRASHDUMP_TARGET_BDEV, err);
+}
+
+LK_INIT_HOOK(crashdump, &crashdump_init, LK_INIT_LEVEL_APPS - 1);
+#endif
+
+#if LK_DEBUGLEVEL > 0
+static void show_header(void)
+{
+	struct crashdump_header hdr;
+
+	if (cd.type != TARGET_BDEV) {
+		printf("not dumping to a block device\n");
+		return;
+	}
+
+	ssize_t err = bio_read(cd.bdev, &hdr, 0, sizeof(hdr));
+	if (err < (ssize_t)sizeof(hdr)) {
+		printf("error %ld reading %s\n", (long)err, cd.bdev->name);
+		return;
+	}
+	if (hdr.magic != CRASHDUMP_MAGIC || hdr.version != CRASHDUMP_VERSION) {
+		printf("no dump in %s\n", cd.bdev->name);
+		return;
+	}
+
+	hdr.reason[sizeof(hdr.reason) - 1] = 0;
+	printf("dump in %s taken at %llu us, caller 0x%llx: %s\n", cd.bdev->name,
+		   hdr.time, hdr.caller, hdr.reason);
+}
+
+static int cmd_crashdump(int argc, const cmd_args *argv)
+{
+	status_t err;
+
+	if (argc < 2) {
+usage:
+		printf("usage:\n");
+		printf("%s bdev <device>     : dump to a block device on panic\n", argv[0].str);
+#if WITH_LIB_MINIP
+		printf("%s udp <ip> <port>   : dump to a udp port on panic\n", argv[0].str);
+#endif
+		printf("%s off               : don't dump on panic\n", argv[0].str);
+		printf("%s now               : take a dump right away\n", argv[0].str);
+		printf("%s info              : show the dump held by the block device\n", argv[0].str);
+		return ERR_GENERIC;
+	}
+
+	if (!strcmp(argv[1].str, "bdev")) {
+		if (argc < 3)
+			goto usage;
+		err = crashdump_set_target_bdev(argv[2].str);
+#if WITH_LIB_MINIP
+	} else if (!strcmp(argv[1].str, "udp")) {
+		if (argc < 4)
+			goto usage;
+		uint32_t host = minip_parse_ipaddr(argv[2].str, strlen(argv[2].str));
+		err = crashdump_set_target_udp(host, argv[3].u);
+#endif
+	} else if (!strcmp(argv[1].str, "off")) {
+		crashdump_clear_target();
+		err = NO_ERROR;
+	} else if (!strcmp(argv[1].str, "now")) {
+		err = crashdump_capture(cd.panicked ? "from the panic shell" : "from the console");
+	} else if (!strcmp(argv[1].str, "info")) {
+		show_header();
+		err = NO_ERROR;
+	} else {
+		goto usage;
+	}
+
+	if (err < 0)
+		printf("error %d\n", err);
+
+	return err;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND_MASKED("crashdump", "crash dump target and capture", &cmd_crashdump, CMD_AVAIL_ALWAYS)
+STATIC_COMMAND_END(crashdump);
+#endif
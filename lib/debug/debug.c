@@ -33,6 +33,10 @@
 #include <platform/debug.h>
 #include <kernel/thread.h>
 
+#if WITH_LIB_CRASHDUMP
+#include <lib/crashdump.h>
+#endif
+
 #if !DISABLE_DEBUG_OUTPUT
 static int _dvprintf(const char *fmt, va_list ap);
 #else
@@ -49,10 +53,9 @@ static spin_lock_t print_spin_lock = 0;
 static struct list_node print_callbacks = LIST_INITIAL_VALUE(print_callbacks);
 
 /* print lock must be held when invoking out, outs, outc */
-static void out_count(const char *str, size_t len)
+static void out_count_direct(const char *str, size_t len)
 {
 	print_callback_t *cb;
-	size_t i;
 
 	/* print to any registered loggers */
 	if (!list_is_empty(&print_callbacks)) {
@@ -67,12 +70,168 @@ static void out_count(const char *str, size_t len)
 		spin_unlock_restore(&print_spin_lock, state, PRINT_LOCK_FLAGS);
 	}
 
-	/* write out the serial port */
-	for (i = 0; i < len; i++) {
-		platform_dputc(str[i]);
+	/* write out the serial port, platforms with a buffered uart just queue it */
+	platform_dputs(str, len);
+}
+
+#if DEBUG_PRINT_ASYNC
+#include <kernel/event.h>
+#include <lk/init.h>
+
+/* output buffered per cpu, must be a power of 2 */
+#ifndef DEBUG_PRINT_BUFFER_SIZE
+#define DEBUG_PRINT_BUFFER_SIZE 4096
+#endif
+
+/* a single dprintf is collected into runs of this size before it is buffered,
+ * so lines up to this long come out whole */
+#define DEBUG_PRINT_LINE 128
+
+/* how long a line without a wakeup, one printed from an irq say, may wait */
+#define DEBUG_PRINT_DRAIN_INTERVAL 10
+
+STATIC_ASSERT((DEBUG_PRINT_BUFFER_SIZE & (DEBUG_PRINT_BUFFER_SIZE - 1)) == 0);
+
+struct print_buffer {
+	/* head and dropped are only written by the owning cpu with interrupts off,
+	 * tail and dropped_reported only by the drain */
+	volatile uint head;
+	volatile uint tail;
+	volatile uint dropped;
+	uint dropped_reported;
+	char *buf;
+} __CPU_ALIGN;
+
+static struct print_buffer print_buffers[SMP_MAX_CPUS];
+static event_t print_drain_event = EVENT_INITIAL_VALUE(print_drain_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+/* set once the buffers and the drain thread exist, cleared for good by a panic */
+static volatile bool print_async;
+
+static void print_buffer_write(const char *str, size_t len)
+{
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, PRINT_LOCK_FLAGS);
+
+	struct print_buffer *b = &print_buffers[arch_curr_cpu_num()];
+	uint head = b->head;
+
+	if (len > DEBUG_PRINT_BUFFER_SIZE - (head - b->tail)) {
+		/* the drain reports these, there's nothing else to do from an irq */
+		b->dropped += len;
+	} else {
+		/* the drain has to be done reading the space before we reuse it */
+		smp_mb();
+
+		uint off = head & (DEBUG_PRINT_BUFFER_SIZE - 1);
+		size_t first = MIN(len, DEBUG_PRINT_BUFFER_SIZE - off);
+		memcpy(&b->buf[off], str, first);
+		memcpy(b->buf, str + first, len - first);
+
+		smp_wmb();
+		b->head = head + len;
+	}
+
+	arch_interrupt_restore(state, PRINT_LOCK_FLAGS);
+}
+
+/* hand whatever a cpu has buffered to the callbacks and the uart */
+static void print_buffer_drain(struct print_buffer *b)
+{
+	uint tail = b->tail;
+	uint head = b->head;
+	smp_rmb();
+
+	uint dropped = b->dropped;
+	if (dropped != b->dropped_reported) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "\n[%u bytes of debug output dropped]\n", dropped - b->dropped_reported);
+		out_count_direct(msg, strlen(msg));
+		b->dropped_reported = dropped;
+	}
+
+	while (tail != head) {
+		uint off = tail & (DEBUG_PRINT_BUFFER_SIZE - 1);
+		size_t len = MIN(head - tail, DEBUG_PRINT_BUFFER_SIZE - off);
+
+		out_count_direct(&b->buf[off], len);
+		tail += len;
+	}
+
+	smp_mb();
+	b->tail = tail;
+}
+
+static int print_drain_thread(void *arg)
+{
+	for (;;) {
+		event_wait_timeout(&print_drain_event, DEBUG_PRINT_DRAIN_INTERVAL);
+
+		for (uint i = 0; i < SMP_MAX_CPUS; i++)
+			print_buffer_drain(&print_buffers[i]);
+	}
+
+	return 0;
+}
+
+/* before this everything is written out synchronously */
+static void print_async_init(uint level)
+{
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		print_buffers[i].buf = malloc(DEBUG_PRINT_BUFFER_SIZE);
+		if (!print_buffers[i].buf)
+			return;
+	}
+
+	thread_t *t = thread_create("dprintf drain", &print_drain_thread, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+	if (!t)
+		return;
+	thread_detach_and_resume(t);
+
+	print_async = true;
+}
+
+LK_INIT_HOOK(print_async, print_async_init, LK_INIT_LEVEL_THREADING);
+
+static void out_count(const char *str, size_t len)
+{
+	if (!print_async) {
+		out_count_direct(str, len);
+		return;
 	}
+
+	print_buffer_write(str, len);
+
+	/* waking the drain takes the thread lock, which may already be held if
+	 * interrupts are off. the drain finds those lines on its next pass. */
+	if (!arch_ints_disabled() && memchr(str, '\n', len))
+		event_signal(&print_drain_event, false);
 }
 
+/* panic output goes straight out, after whatever was still buffered */
+static void print_async_stop(void)
+{
+	if (!print_async)
+		return;
+
+	print_async = false;
+	smp_mb();
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		print_buffer_drain(&print_buffers[i]);
+}
+
+#else
+
+static void out_count(const char *str, size_t len)
+{
+	out_count_direct(str, len);
+}
+
+static inline void print_async_stop(void) {}
+
+#endif // DEBUG_PRINT_ASYNC
+
 void register_print_callback(print_callback_t *cb)
 {
 	spin_lock_saved_state_t state;
@@ -103,6 +262,10 @@ void spin(uint32_t usecs)
 
 void _panic(void *caller, const char *fmt, ...)
 {
+	/* flush any buffered output and write everything from here on directly */
+	print_async_stop();
+	platform_panic_start();
+
 	dprintf(ALWAYS, "panic (caller %p): ", caller);
 
 	va_list ap;
@@ -110,6 +273,12 @@ void _panic(void *caller, const char *fmt, ...)
 	_dvprintf(fmt, ap);
 	va_end(ap);
 
+#if WITH_LIB_CRASHDUMP
+	va_start(ap, fmt);
+	crashdump_panic(caller, fmt, ap);
+	va_end(ap);
+#endif
+
 	platform_halt(HALT_ACTION_HALT, HALT_REASON_SW_PANIC);
 }
 
@@ -182,6 +351,50 @@ FILE get_panic_fd(void)
 
 #if !DISABLE_DEBUG_OUTPUT
 
+#if DEBUG_PRINT_ASYNC
+
+/* the printf engine hands over a piece at a time, collect them so another
+ * thread on this cpu can't land in the middle of the line */
+struct dprintf_line {
+	size_t len;
+	char buf[DEBUG_PRINT_LINE];
+};
+
+static int _dprintf_output_func(const char *str, size_t len, void *state)
+{
+	struct dprintf_line *line = state;
+	size_t left = len;
+
+	while (left > 0) {
+		size_t n = MIN(left, sizeof(line->buf) - line->len);
+		memcpy(&line->buf[line->len], str, n);
+		line->len += n;
+		str += n;
+		left -= n;
+
+		if (line->len == sizeof(line->buf)) {
+			out_count(line->buf, line->len);
+			line->len = 0;
+		}
+	}
+
+	return len;
+}
+
+int _dvprintf(const char *fmt, va_list ap)
+{
+	struct dprintf_line line;
+	line.len = 0;
+
+	int err = _printf_engine(&_dprintf_output_func, &line, fmt, ap);
+	if (line.len > 0)
+		out_count(line.buf, line.len);
+
+	return err;
+}
+
+#else
+
 static int _dprintf_output_func(const char *str, size_t len, void *state)
 {
 	out_count(str, len);
@@ -193,13 +406,15 @@ int _dvprintf(const char *fmt, va_list ap)
 	return _printf_engine(&_dprintf_output_func, NULL, fmt, ap);
 }
 
+#endif // DEBUG_PRINT_ASYNC
+
 int _dprintf(const char *fmt, ...)
 {
 	int err;
 	va_list ap;
 
 	va_start(ap, fmt);
-	err = _printf_engine(&_dprintf_output_func, NULL, fmt, ap);
+	err = _dvprintf(fmt, ap);
 	va_end(ap);
 
 	return err;
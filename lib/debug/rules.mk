@@ -5,4 +5,9 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/debug.c
 
+# copy debug output into per cpu buffers and write it out from a thread
+ifeq ($(DEBUG_PRINT_ASYNC),1)
+GLOBAL_DEFINES += DEBUG_PRINT_ASYNC=1
+endif
+
 include make/module.mk
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/devicetree_index.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libfdt.h>
+
+struct dt_compat {
+	const char *compat;
+	u32 hash;
+	dt_node_t *node;
+	struct dt_compat *next;
+};
+
+struct dt_index {
+	const void *fdt;
+
+	dt_node_t *nodes;	/* in tree order, nodes[0] is the root */
+	u32 node_count;
+	dt_prop_t *props;
+	struct dt_compat *compats;
+
+	dt_node_t **phandle_hash;
+	u32 phandle_hash_mask;
+	struct dt_compat **compat_hash;
+	u32 compat_hash_mask;
+};
+
+static u32 str_hash(const char *s) {
+	/* fnv-1a */
+	u32 h = 2166136261u;
+	while (*s) {
+		h ^= (u8)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* smallest power of two bucket count giving chains of about one entry */
+static u32 hash_size(u32 count) {
+	u32 size = 1;
+	while (size < count)
+		size <<= 1;
+	return size;
+}
+
+/* number of strings in a string list property */
+static u32 stringlist_count(const char *s, int len) {
+	u32 count = 0;
+	for (int i = 0; i < len; i++) {
+		if (s[i] == 0)
+			count++;
+	}
+	return count;
+}
+
+/* iterate the nodes in tree order, returns the next offset or < 0 at the end */
+static int next_node(const void *fdt, int offset, int *depth) {
+	offset = fdt_next_node(fdt, offset, depth);
+	if (offset >= 0 && *depth < 0)
+		return -FDT_ERR_NOTFOUND;
+	return offset;
+}
+
+status_t dt_index_create(const void *fdt, dt_index_t **dti) {
+	if (!fdt || !dti)
+		return ERR_INVALID_ARGS;
+	if (fdt_check_header(fdt) < 0)
+		return ERR_INVALID_ARGS;
+
+	/* first pass, size everything */
+	u32 node_count = 0, prop_count = 0, compat_count = 0;
+	int depth = -1;
+	int offset;
+	for (offset = next_node(fdt, -1, &depth); offset >= 0; offset = next_node(fdt, offset, &depth)) {
+		node_count++;
+
+		for (int prop = fdt_first_property_offset(fdt, offset); prop >= 0;
+				prop = fdt_next_property_offset(fdt, prop)) {
+			const char *name;
+			int len;
+			const char *data = fdt_getprop_by_offset(fdt, prop, &name, &len);
+			if (!data)
+				return ERR_INVALID_ARGS;
+
+			prop_count++;
+			if (!strcmp(name, "compatible"))
+				compat_count += stringlist_count(data, len);
+		}
+	}
+	if (offset != -FDT_ERR_NOTFOUND || node_count == 0)
+		return ERR_INVALID_ARGS;
+
+	/* everything comes out of one allocation, each piece a multiple of pointer size */
+	u32 phandle_buckets = hash_size(node_count);
+	u32 compat_buckets = hash_size(compat_count);
+	size_t size = sizeof(dt_index_t) +
+		node_count * sizeof(dt_node_t) +
+		prop_count * sizeof(dt_prop_t) +
+		compat_count * sizeof(struct dt_compat) +
+		phandle_buckets * sizeof(dt_node_t *) +
+		compat_buckets * sizeof(struct dt_compat *);
+
+	dt_index_t *idx = calloc(1, size);
+	if (!idx)
+		return ERR_NO_MEMORY;
+
+	idx->fdt = fdt;
+	idx->node_count = node_count;
+	idx->nodes = (dt_node_t *)(idx + 1);
+	idx->props = (dt_prop_t *)(idx->nodes + node_count);
+	idx->compats = (struct dt_compat *)(idx->props + prop_count);
+	idx->phandle_hash = (dt_node_t **)(idx->compats + compat_count);
+	idx->phandle_hash_mask = phandle_buckets - 1;
+	idx->compat_hash = (struct dt_compat **)(idx->phandle_hash + phandle_buckets);
+	idx->compat_hash_mask = compat_buckets - 1;
+
+	/* second pass, unflatten */
+	dt_node_t *n = idx->nodes;
+	dt_prop_t *p = idx->props;
+	struct dt_compat *c = idx->compats;
+	dt_node_t *prev = NULL;
+	int prev_depth = -1;
+	depth = -1;
+	for (offset = next_node(fdt, -1, &depth); offset >= 0; offset = next_node(fdt, offset, &depth), n++) {
+		n->name = fdt_get_name(fdt, offset, NULL);
+		n->offset = offset;
+		list_initialize(&n->children);
+
+		/* the parent is the previous node, or one of its ancestors when stepping back up */
+		dt_node_t *parent = prev;
+		for (int d = prev_depth; d >= depth && parent; d--)
+			parent = parent->parent;
+		n->parent = parent;
+		if (parent)
+			list_add_tail(&parent->children, &n->node);
+		prev = n;
+		prev_depth = depth;
+
+		n->props = p;
+		for (int prop = fdt_first_property_offset(fdt, offset); prop >= 0;
+				prop = fdt_next_property_offset(fdt, prop)) {
+			int len;
+			p->data = fdt_getprop_by_offset(fdt, prop, &p->name, &len);
+			p->size = len;
+
+			if (!strcmp(p->name, "compatible")) {
+				const char *s = p->data;
+				const char *end = s + len;
+				while (s < end) {
+					size_t slen = strnlen(s, end - s);
+					if (s + slen == end)
+						break;
+					c->compat = s;
+					c->hash = str_hash(s);
+					c->node = n;
+					c++;
+					s += slen + 1;
+				}
+			} else if ((!strcmp(p->name, "phandle") || !strcmp(p->name, "linux,phandle")) &&
+					len == sizeof(u32) && !n->phandle) {
+				n->phandle = fdt32_to_cpu(*(const fdt32_t *)p->data);
+			}
+			p++;
+		}
+		n->prop_count = p - n->props;
+	}
+
+	/* hash the phandles and compatible strings, walking backwards so the chains end up in tree order */
+	for (n = idx->nodes + node_count; n-- > idx->nodes; ) {
+		if (n->phandle) {
+			dt_node_t **bucket = &idx->phandle_hash[n->phandle & idx->phandle_hash_mask];
+			n->phandle_next = *bucket;
+			*bucket = n;
+		}
+	}
+	while (c-- > idx->compats) {
+		struct dt_compat **bucket = &idx->compat_hash[c->hash & idx->compat_hash_mask];
+		c->next = *bucket;
+		*bucket = c;
+	}
+
+	*dti = idx;
+	return NO_ERROR;
+}
+
+void dt_index_destroy(dt_index_t *dti) {
+	free(dti);
+}
+
+dt_node_t *dt_index_root(dt_index_t *dti) {
+	return &dti->nodes[0];
+}
+
+/* match the way fdt_subnode_offset_namelen compares a name */
+static bool name_matches(const char *node_name, const char *name, size_t len) {
+	if (strncmp(node_name, name, len))
+		return false;
+	if (node_name[len] == 0)
+		return true;
+	return node_name[len] == '@' && !memchr(name, '@', len);
+}
+
+static dt_node_t *find_child_namelen(dt_node_t *node, const char *name, size_t len) {
+	dt_node_t *child;
+	dt_for_every_child(node, child) {
+		if (name_matches(child->name, name, len))
+			return child;
+	}
+	return NULL;
+}
+
+dt_node_t *dt_find_child(dt_node_t *node, const char *name) {
+	return find_child_namelen(node, name, strlen(name));
+}
+
+dt_node_t *dt_find_path(dt_index_t *dti, const char *path) {
+	dt_node_t *node = dt_index_root(dti);
+	const char *end = path + strlen(path);
+	const char *p = path;
+
+	/* a path not starting with / starts with an alias */
+	if (*path != '/') {
+		const char *q = strchr(path, '/');
+		if (!q)
+			q = end;
+
+		dt_node_t *aliases = dt_find_child(node, "aliases");
+		if (!aliases)
+			return NULL;
+
+		const char *alias = NULL;
+		for (u32 i = 0; i < aliases->prop_count; i++) {
+			const dt_prop_t *prop = &aliases->props[i];
+			if (!strncmp(prop->name, path, q - path) && prop->name[q - path] == 0) {
+				alias = prop->data;
+				break;
+			}
+		}
+		if (!alias)
+			return NULL;
+
+		node = dt_find_path(dti, alias);
+		if (!node)
+			return NULL;
+		p = q;
+	}
+
+	while (p < end) {
+		while (*p == '/')
+			p++;
+		if (p == end)
+			break;
+
+		const char *q = strchr(p, '/');
+		if (!q)
+			q = end;
+
+		node = find_child_namelen(node, p, q - p);
+		if (!node)
+			return NULL;
+		p = q;
+	}
+
+	return node;
+}
+
+dt_node_t *dt_find_phandle(dt_index_t *dti, u32 phandle) {
+	if (phandle == 0 || phandle == (u32)-1)
+		return NULL;
+
+	for (dt_node_t *n = dti->phandle_hash[phandle & dti->phandle_hash_mask]; n; n = n->phandle_next) {
+		if (n->phandle == phandle)
+			return n;
+	}
+	return NULL;
+}
+
+dt_node_t *dt_find_compatible(dt_index_t *dti, dt_node_t *from, const char *compat) {
+	u32 hash = str_hash(compat);
+	bool past_from = (from == NULL);
+
+	/* the chain is in tree order, so the answer is the first match after from's entry */
+	for (struct dt_compat *c = dti->compat_hash[hash & dti->compat_hash_mask]; c; c = c->next) {
+		if (c->hash != hash || strcmp(c->compat, compat))
+			continue;
+		if (past_from)
+			return c->node;
+		if (c->node == from)
+			past_from = true;
+	}
+	return NULL;
+}
+
+const dt_prop_t *dt_find_prop(const dt_node_t *node, const char *name) {
+	for (u32 i = 0; i < node->prop_count; i++) {
+		if (!strcmp(node->props[i].name, name))
+			return &node->props[i];
+	}
+	return NULL;
+}
+
+const void *dt_getprop(const dt_node_t *node, const char *name, u32 *size) {
+	const dt_prop_t *prop = dt_find_prop(node, name);
+	if (!prop)
+		return NULL;
+	if (size)
+		*size = prop->size;
+	return prop->data;
+}
+
+bool dt_node_is_compatible(const dt_node_t *node, const char *compat) {
+	u32 len;
+	const char *list = dt_getprop(node, "compatible", &len);
+	if (!list)
+		return false;
+	return fdt_stringlist_contains(list, len, compat);
+}
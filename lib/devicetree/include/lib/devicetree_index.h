@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * An unflattened copy of a device tree, built once from a libfdt blob so
+ * that finding a node by path, phandle or compatible string, or a property
+ * of a node, doesn't rescan the blob each time. Names and property data
+ * point into the blob, which has to stay mapped while the index is used.
+ */
+typedef struct dt_prop {
+	const char *name;
+	const void *data;
+	u32 size;
+} dt_prop_t;
+
+typedef struct dt_node {
+	struct list_node node;		/* in the parent's children list */
+	struct list_node children;
+	struct dt_node *parent;
+	const char *name;		/* including the unit address */
+	int offset;			/* of the node in the blob */
+	u32 phandle;			/* 0 if none */
+	dt_prop_t *props;
+	u32 prop_count;
+
+	struct dt_node *phandle_next;	/* hash chain */
+} dt_node_t;
+
+typedef struct dt_index dt_index_t;
+
+status_t dt_index_create(const void *fdt, dt_index_t **dti);
+void dt_index_destroy(dt_index_t *dti);
+
+dt_node_t *dt_index_root(dt_index_t *dti);
+
+/* same path and alias rules as fdt_path_offset */
+dt_node_t *dt_find_path(dt_index_t *dti, const char *path);
+dt_node_t *dt_find_phandle(dt_index_t *dti, u32 phandle);
+
+/* next node in tree order after 'from' listing compat, or the first if from is NULL */
+dt_node_t *dt_find_compatible(dt_index_t *dti, dt_node_t *from, const char *compat);
+
+/* direct child by name, a name without a unit address also matches "name@..." */
+dt_node_t *dt_find_child(dt_node_t *node, const char *name);
+
+const dt_prop_t *dt_find_prop(const dt_node_t *node, const char *name);
+const void *dt_getprop(const dt_node_t *node, const char *name, u32 *size);
+bool dt_node_is_compatible(const dt_node_t *node, const char *compat);
+
+#define dt_for_every_child(parent, child) \
+	list_for_every_entry(&(parent)->children, child, dt_node_t, node)
+
+__END_CDECLS;
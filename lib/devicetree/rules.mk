@@ -2,7 +2,15 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+GLOBAL_INCLUDES += $(LOCAL_DIR)/include
+
+MODULE_INCLUDES += $(LOCAL_DIR)/include/lib
+
+MODULE_DEPS += \
+	lib/fdt
+
 MODULE_SRCS += \
-	$(LOCAL_DIR)/devicetree.c
+	$(LOCAL_DIR)/devicetree.c \
+	$(LOCAL_DIR)/devicetree_index.c
 
 include make/module.mk
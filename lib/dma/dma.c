@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/dma.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lk/init.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+#if WITH_KERNEL_VM
+
+#ifndef DMA_BOUNCE_PAGES
+#define DMA_BOUNCE_PAGES 64
+#endif
+
+/* bounce buffers come out of one physically contiguous run set aside at boot,
+ * so a device's address limit only has to be checked against that */
+static spin_lock_t bounce_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint8_t *bounce_base;
+static paddr_t bounce_phys;
+static bool bounce_used[DMA_BOUNCE_PAGES];
+
+static void *bounce_alloc(size_t len, paddr_t max_addr, paddr_t *pa)
+{
+	uint count = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+
+	if (!bounce_base || count > DMA_BOUNCE_PAGES)
+		return NULL;
+	if (bounce_phys + DMA_BOUNCE_PAGES * PAGE_SIZE - 1 > max_addr)
+		return NULL;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&bounce_lock, state);
+
+	/* first fit */
+	uint start = 0;
+	uint run = 0;
+	for (uint i = 0; i < DMA_BOUNCE_PAGES && run < count; i++) {
+		if (bounce_used[i]) {
+			start = i + 1;
+			run = 0;
+		} else {
+			run++;
+		}
+	}
+
+	void *ptr = NULL;
+	if (run == count) {
+		for (uint i = start; i < start + count; i++)
+			bounce_used[i] = true;
+		ptr = bounce_base + start * PAGE_SIZE;
+		*pa = bounce_phys + start * PAGE_SIZE;
+	}
+
+	spin_unlock_irqrestore(&bounce_lock, state);
+
+	LTRACEF("len %zu, %p\n", len, ptr);
+
+	return ptr;
+}
+
+static void bounce_free(void *ptr, size_t len)
+{
+	uint start = ((uint8_t *)ptr - bounce_base) / PAGE_SIZE;
+	uint count = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&bounce_lock, state);
+	for (uint i = start; i < start + count; i++) {
+		DEBUG_ASSERT(bounce_used[i]);
+		bounce_used[i] = false;
+	}
+	spin_unlock_irqrestore(&bounce_lock, state);
+}
+
+static void dma_init(uint level)
+{
+	bounce_base = pmm_alloc_kpages(DMA_BOUNCE_PAGES, NULL);
+	if (!bounce_base) {
+		printf("dma: no memory for bounce buffers\n");
+		return;
+	}
+	bounce_phys = kvaddr_to_paddr(bounce_base);
+
+	LTRACEF("%u bounce pages at %p (0x%lx phys)\n", DMA_BOUNCE_PAGES, bounce_base, (ulong)bounce_phys);
+}
+
+LK_INIT_HOOK(dma, dma_init, LK_INIT_LEVEL_VM + 1);
+
+#else
+
+/* without a vm the heap is as good as anywhere, as long as it's reachable */
+static void *bounce_alloc(size_t len, paddr_t max_addr, paddr_t *pa)
+{
+	void *ptr = memalign(CACHE_LINE, ROUNDUP(len, CACHE_LINE));
+	if (ptr && (paddr_t)(uintptr_t)ptr + len - 1 > max_addr) {
+		free(ptr);
+		ptr = NULL;
+	}
+	if (ptr)
+		*pa = (paddr_t)(uintptr_t)ptr;
+
+	return ptr;
+}
+
+static void bounce_free(void *ptr, size_t len)
+{
+	free(ptr);
+}
+
+#endif
+
+size_t dma_phys_run(const void *va, size_t len, paddr_t *pa)
+{
+#if WITH_KERNEL_VM
+	vaddr_t v = (vaddr_t)va;
+	if (arch_mmu_query(v, pa, NULL) < 0)
+		return 0;
+
+	return MIN(len, PAGE_ALIGN(v + 1) - v);
+#else
+	*pa = (paddr_t)(uintptr_t)va;
+
+	return len;
+#endif
+}
+
+void dma_sync_range_for_device(const void *buf, size_t len, uint dir)
+{
+	/* a dirty line evicted while the device is writing would land on top of
+	 * what it wrote, so those go out now too */
+	if (dir & DMA_FROM_DEVICE)
+		arch_clean_invalidate_cache_range((addr_t)buf, len);
+	else
+		arch_clean_cache_range((addr_t)buf, len);
+}
+
+void dma_sync_range_for_cpu(const void *buf, size_t len, uint dir)
+{
+	/* drop whatever was pulled in speculatively while the device had it */
+	if (dir & DMA_FROM_DEVICE)
+		arch_invalidate_cache_range((addr_t)buf, len);
+}
+
+void dma_sync_for_device(dma_map_t *map)
+{
+	DEBUG_ASSERT(map);
+
+	if (map->bounce && (map->dir & DMA_TO_DEVICE))
+		memcpy(map->bounce, map->buf, map->len);
+
+	dma_sync_range_for_device(map->bounce ? map->bounce : map->buf, map->len, map->dir);
+}
+
+void dma_sync_for_cpu(dma_map_t *map)
+{
+	DEBUG_ASSERT(map);
+
+	dma_sync_range_for_cpu(map->bounce ? map->bounce : map->buf, map->len, map->dir);
+
+	if (map->bounce && (map->dir & DMA_FROM_DEVICE))
+		memcpy(map->buf, map->bounce, map->len);
+}
+
+status_t dma_map(dma_map_t *map, void *buf, size_t len, uint dir,
+                 paddr_t max_addr, struct dma_seg *segs, uint max_segs)
+{
+	DEBUG_ASSERT(map);
+	DEBUG_ASSERT(dir & DMA_BIDIRECTIONAL);
+
+	LTRACEF("buf %p, len %zu, dir %u, max_addr 0x%llx, max_segs %u\n",
+	        buf, len, dir, (unsigned long long)max_addr, max_segs);
+
+	if (len == 0 || !segs || max_segs == 0)
+		return ERR_INVALID_ARGS;
+
+	map->buf = buf;
+	map->len = len;
+	map->dir = dir;
+	map->bounce = NULL;
+	map->segs = segs;
+	map->max_segs = max_segs;
+	map->seg_count = 0;
+
+	/* gather the physically contiguous runs, giving up on the first one the
+	 * device can't reach or can't fit */
+	bool direct = true;
+	uint count = 0;
+	for (size_t pos = 0; pos < len; ) {
+		paddr_t pa;
+		size_t run = dma_phys_run((uint8_t *)buf + pos, len - pos, &pa);
+		if (run == 0)
+			return ERR_INVALID_ARGS;
+
+		if (pa + run - 1 > max_addr) {
+			direct = false;
+			break;
+		}
+		if (count > 0 && segs[count - 1].addr + segs[count - 1].len == pa) {
+			segs[count - 1].len += run;
+		} else {
+			if (count == max_segs) {
+				direct = false;
+				break;
+			}
+			segs[count].addr = pa;
+			segs[count].len = run;
+			count++;
+		}
+		pos += run;
+	}
+
+	if (!direct) {
+		paddr_t pa;
+		map->bounce = bounce_alloc(len, max_addr, &pa);
+		if (!map->bounce)
+			return ERR_NO_MEMORY;
+
+		segs[0].addr = pa;
+		segs[0].len = len;
+		count = 1;
+	}
+	map->seg_count = count;
+
+	dma_sync_for_device(map);
+
+	return NO_ERROR;
+}
+
+void dma_unmap(dma_map_t *map)
+{
+	DEBUG_ASSERT(map);
+
+	dma_sync_for_cpu(map);
+
+	if (map->bounce) {
+		bounce_free(map->bounce, map->len);
+		map->bounce = NULL;
+	}
+	map->seg_count = 0;
+}
@@ -22,61 +22,96 @@
  */
 #include <debug.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <list.h>
-#include <malloc.h>
 #include <err.h>
 #include <lib/dpc.h>
+#include <lib/slab.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
 #include <lk/init.h>
 
-struct dpc {
-	struct list_node node;
+/* one queue and thread per cpu, a dpc runs on the cpu that queued it */
+struct dpc_queue {
+	struct list_node list;
+	spin_lock_t lock;
+	event_t event;
+} __CPU_ALIGN;
 
-	dpc_callback cb;
-	void *arg;
-};
-
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+static struct dpc_queue dpc_queues[SMP_MAX_CPUS];
+static slab_cache_t dpc_cache = SLAB_CACHE_INITIAL_VALUE(dpc_cache, "dpc", sizeof(dpc_t), 0, NULL);
 
 static int dpc_thread_routine(void *arg);
 
-status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+status_t dpc_queue_etc(dpc_t *dpc, dpc_callback cb, void *arg, uint flags)
 {
-	struct dpc *dpc;
+	/* claim it first, a dpc can only sit in one queue at a time */
+	int expected = 0;
+	if (!__atomic_compare_exchange_n(&dpc->queued, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return ERR_ALREADY_EXISTS;
 
-	dpc = malloc(sizeof(struct dpc));
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-	if (dpc == NULL)
-		return ERR_NO_MEMORY;
+	/* we can't migrate with interrupts off */
+	struct dpc_queue *q = &dpc_queues[arch_curr_cpu_num()];
 
+	spin_lock(&q->lock);
 	dpc->cb = cb;
 	dpc->arg = arg;
-	enter_critical_section();
-	list_add_tail(&dpc_list, &dpc->node);
-	event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-	exit_critical_section();
+	list_add_tail(&q->list, &dpc->node);
+	spin_unlock(&q->lock);
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	event_signal(&q->event, (flags & DPC_FLAG_NORESCHED) ? false : true);
 
 	return NO_ERROR;
 }
 
+status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+{
+	dpc_t *dpc;
+
+	dpc = slab_alloc(&dpc_cache);
+
+	if (dpc == NULL)
+		return ERR_NO_MEMORY;
+
+	*dpc = (dpc_t)DPC_INITIAL_VALUE;
+	dpc->allocated = true;
+
+	return dpc_queue_etc(dpc, cb, arg, flags);
+}
+
 static int dpc_thread_routine(void *arg)
 {
+	struct dpc_queue *q = arg;
+
 	for (;;) {
-		event_wait(&dpc_event);
+		event_wait(&q->event);
 
-		enter_critical_section();
-		struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
+		spin_lock_saved_state_t state;
+		spin_lock_irqsave(&q->lock, state);
+		dpc_t *dpc = list_remove_head_type(&q->list, dpc_t, node);
 		if (!dpc)
-			event_unsignal(&dpc_event);
-		exit_critical_section();
+			event_unsignal(&q->event);
+		spin_unlock_irqrestore(&q->lock, state);
 
 		if (dpc) {
-//			dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-			dpc->cb(dpc->arg);
+			/* a caller owned dpc may be requeued or freed by its callback, grab what we need first */
+			dpc_callback cb = dpc->cb;
+			void *arg = dpc->arg;
+
+			if (dpc->allocated)
+				slab_free(&dpc_cache, dpc);
+			else
+				__atomic_store_n(&dpc->queued, 0, __ATOMIC_RELEASE);
 
-			free(dpc);
+//			dprintf("dpc calling %p, arg %p\n", cb, arg);
+			cb(arg);
 		}
 	}
 
@@ -85,11 +120,21 @@ static int dpc_thread_routine(void *arg)
 
 static void dpc_init(uint level)
 {
-	event_init(&dpc_event, false, 0);
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		struct dpc_queue *q = &dpc_queues[cpu];
 
-	thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
-}
+		list_initialize(&q->list);
+		spin_lock_init(&q->lock);
+		event_init(&q->event, false, 0);
 
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+		/* threads for cpus that aren't up yet wait in their run queue until they are */
+		char name[16];
+		snprintf(name, sizeof(name), "dpc %u", cpu);
 
+		thread_t *t = thread_create(name, &dpc_thread_routine, q, DPC_PRIORITY, DEFAULT_STACK_SIZE);
+		t->pinned_cpu = cpu;
+		thread_detach_and_resume(t);
+	}
+}
 
+LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
@@ -28,10 +28,66 @@
 #include <trace.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arch/defines.h>
 #include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <lib/bio.h>
+#include <lib/miniz.h>
+#include <lib/workqueue.h>
 
 #define LOCAL_TRACE 0
 
+#define ELF_MAX_SEGMENTS 16
+#define ELF_READ_CHUNK (256 * 1024)   /* size of the reads segments are split into */
+#define ELF_READ_DEPTH 4              /* reads kept in flight on a block device */
+#define ELF_ZERO_PIECE (256 * 1024)   /* bss is zeroed in pieces of this size */
+#define ELF_PARALLEL_ZERO_MIN (1024 * 1024) /* below this it's zeroed inline */
+#define ELF_STREAM_HDR_MAX 4096       /* a stream's program headers must end within this */
+
+struct elf_segment {
+    uint8_t *ptr;
+    uint32_t offset;
+    uint32_t filesz;
+    uint32_t memsz;
+
+    /* for ELF_PF_ZLIB segments, how far the stream has inflated */
+    tinfl_decompressor *decomp;
+    size_t out_len;
+};
+
+struct elf_read {
+    uint seg;
+    uint32_t pos;       /* offset into the segment's file data */
+    size_t len;
+    uint8_t *buf;
+    ssize_t result;
+    bio_request_t req;
+};
+
+struct elf_zero_job {
+    struct {
+        uint8_t *ptr;
+        size_t len;
+    } range[ELF_MAX_SEGMENTS];
+    uint range_count;
+    uint piece_count;
+
+    volatile int next_piece;
+    volatile int outstanding;   /* helpers that haven't finished yet */
+    event_t done;
+
+    work_t work[SMP_MAX_CPUS];
+};
+
+struct elf_stream;
+static void elf_stream_end(struct elf_stream *stream, status_t err);
+
+/* helpers pinned to each cpu, made the first time bss is zeroed in parallel */
+static workqueue_t *elf_wq;
+static mutex_t elf_wq_lock = MUTEX_INITIAL_VALUE(elf_wq_lock);
+
 struct read_hook_memory_args {
     const uint8_t *ptr;
     size_t len;
@@ -61,6 +117,18 @@ static ssize_t elf_read_hook_memory(struct elf_handle *handle, void *buf, uint64
     return toread;
 }
 
+struct read_hook_bio_args {
+    bdev_t *dev;
+    off_t offset;
+};
+
+static ssize_t elf_read_hook_bio(struct elf_handle *handle, void *buf, uint64_t offset, size_t len)
+{
+    struct read_hook_bio_args *args = handle->read_hook_arg;
+
+    return bio_read(args->dev, buf, args->offset + offset, len);
+}
+
 status_t elf_open_handle(elf_handle_t *handle, elf_read_hook_t read_hook, void *read_hook_arg, bool free_read_hook_arg)
 {
     if (!handle)
@@ -93,6 +161,30 @@ status_t elf_open_handle_memory(elf_handle_t *handle, const void *ptr, size_t le
     return err;
 }
 
+status_t elf_open_handle_bio(elf_handle_t *handle, bdev_t *dev, off_t offset)
+{
+    if (!dev)
+        return ERR_INVALID_ARGS;
+
+    struct read_hook_bio_args *args = malloc(sizeof(struct read_hook_bio_args));
+    if (!args)
+        return ERR_NO_MEMORY;
+
+    args->dev = dev;
+    args->offset = offset;
+
+    status_t err = elf_open_handle(handle, elf_read_hook_bio, (void *)args, true);
+    if (err < 0) {
+        free(args);
+        return err;
+    }
+
+    handle->bdev = dev;
+    handle->bdev_offset = offset;
+
+    return NO_ERROR;
+}
+
 void elf_close_handle(elf_handle_t *handle)
 {
     if (!handle || !handle->open)
@@ -103,6 +195,11 @@ void elf_close_handle(elf_handle_t *handle)
     if (handle->free_read_hook_arg)
         free(handle->read_hook_arg);
 
+    if (handle->stream) {
+        elf_stream_end(handle->stream, ERR_CANCELLED);
+        free(handle->stream);
+    }
+
     free(handle->pheaders);
 }
 
@@ -153,12 +250,352 @@ static int verify_eheader(const struct Elf32_Ehdr *eheader)
     return NO_ERROR;
 }
 
+static size_t range_pieces(size_t len)
+{
+    return (len + ELF_ZERO_PIECE - 1) / ELF_ZERO_PIECE;
+}
+
+static void elf_zero_pieces(struct elf_zero_job *job)
+{
+    for (;;) {
+        uint piece = atomic_add(&job->next_piece, 1);
+        if (piece >= job->piece_count)
+            break;
+
+        /* find the range the piece falls in */
+        uint r = 0;
+        size_t pieces;
+        while (piece >= (pieces = range_pieces(job->range[r].len))) {
+            piece -= pieces;
+            r++;
+        }
+
+        size_t start = (size_t)piece * ELF_ZERO_PIECE;
+        memset(job->range[r].ptr + start, 0, MIN(ELF_ZERO_PIECE, job->range[r].len - start));
+    }
+}
+
+static void elf_zero_worker(void *arg)
+{
+    struct elf_zero_job *job = arg;
+
+    elf_zero_pieces(job);
+
+    if (atomic_add(&job->outstanding, -1) == 1)
+        event_signal(&job->done, true);
+}
+
+static workqueue_t *elf_get_workqueue(void)
+{
+    mutex_acquire(&elf_wq_lock);
+    if (!elf_wq)
+        elf_wq = workqueue_create("elf", 1, DEFAULT_PRIORITY, 0);
+    mutex_release(&elf_wq_lock);
+
+    return elf_wq;
+}
+
+/* hand the job's ranges to a helper on every other active cpu, if there's enough to go around */
+static void elf_zero_start(struct elf_zero_job *job)
+{
+    size_t total = 0;
+
+    job->piece_count = 0;
+    for (uint i = 0; i < job->range_count; i++) {
+        job->piece_count += range_pieces(job->range[i].len);
+        total += job->range[i].len;
+    }
+    job->next_piece = 0;
+    job->outstanding = 1;
+    event_init(&job->done, false, 0);
+
+    workqueue_t *wq = (total >= ELF_PARALLEL_ZERO_MIN) ? elf_get_workqueue() : NULL;
+    if (!wq)
+        return;
+
+    uint helpers = 0;
+    uint curr_cpu = arch_curr_cpu_num();
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS && helpers + 1 < job->piece_count; cpu++) {
+        if (cpu == curr_cpu || !(mp.active_cpus & (1U << cpu)))
+            continue;
+
+        work_t *work = &job->work[cpu];
+        list_clear_node(&work->node);
+        work->queue = NULL;
+
+        atomic_add(&job->outstanding, 1);
+        if (workqueue_submit_cpu(wq, cpu, work, elf_zero_worker, job, WORK_FLAG_NORESCHED) < 0) {
+            atomic_add(&job->outstanding, -1);
+            continue;
+        }
+        helpers++;
+    }
+
+    LTRACEF("zeroing %zu bytes in %u pieces, %u helpers\n", total, job->piece_count, helpers);
+}
+
+/* zero whatever the helpers haven't gotten to and wait for them */
+static void elf_zero_finish(struct elf_zero_job *job)
+{
+    elf_zero_pieces(job);
+    if (atomic_add(&job->outstanding, -1) != 1)
+        event_wait(&job->done);
+    event_destroy(&job->done);
+}
+
+/* feed the next piece of a compressed segment's file data to its stream */
+static status_t elf_inflate(struct elf_segment *seg, const uint8_t *buf, size_t len, bool last)
+{
+    size_t in_len = len;
+    size_t out_len = seg->memsz - seg->out_len;
+    tinfl_status status = tinfl_decompress(seg->decomp, buf, &in_len, seg->ptr, seg->ptr + seg->out_len, &out_len,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF |
+                                           (last ? 0 : TINFL_FLAG_HAS_MORE_INPUT));
+    seg->out_len += out_len;
+
+    if (status == TINFL_STATUS_ADLER32_MISMATCH) {
+        LTRACEF("segment %p checksum mismatch\n", seg->ptr);
+        return ERR_CHECKSUM_FAIL;
+    }
+    if (last ? status != TINFL_STATUS_DONE : status != TINFL_STATUS_NEEDS_MORE_INPUT) {
+        LTRACEF("segment %p failed to inflate, status %d\n", seg->ptr, status);
+        return ERR_NOT_VALID;
+    }
+
+    return NO_ERROR;
+}
+
+/* take in the next piece of a segment's file data once it has landed */
+static status_t elf_consume(elf_handle_t *handle, struct elf_segment *seg, const struct elf_read *rd)
+{
+    if (handle->digest_hook)
+        handle->digest_hook(handle, rd->buf, rd->len);
+
+    if (!seg->decomp)
+        return NO_ERROR;
+
+    return elf_inflate(seg, rd->buf, rd->len, rd->pos + rd->len == seg->filesz);
+}
+
+static status_t elf_read_issue(elf_handle_t *handle, struct elf_segment *seg, struct elf_read *rd)
+{
+    if (!handle->bdev) {
+        rd->result = handle->read_hook(handle, rd->buf, seg->offset + rd->pos, rd->len);
+        return NO_ERROR;
+    }
+
+    bio_request_init(&rd->req, BIO_OP_READ, rd->buf, handle->bdev_offset + seg->offset + rd->pos, rd->len, NULL, NULL);
+    return bio_submit(handle->bdev, &rd->req);
+}
+
+static ssize_t elf_read_wait(elf_handle_t *handle, struct elf_read *rd)
+{
+    if (!handle->bdev)
+        return rd->result;
+
+    ssize_t result = bio_wait(&rd->req);
+    event_destroy(&rd->req.event);
+    return result;
+}
+
+/*
+ * Read the file data of every segment, in order and split into chunks. On a
+ * block device a few reads are kept in flight, so the device stays busy while
+ * the oldest one is hashed or inflated.
+ */
+static status_t elf_read_segments(elf_handle_t *handle, struct elf_segment *segs, uint seg_count)
+{
+    struct elf_read reads[ELF_READ_DEPTH];
+    uint8_t *staging[ELF_READ_DEPTH] = { 0 };
+    uint depth = handle->bdev ? ELF_READ_DEPTH : 1;
+    uint head = 0, count = 0;
+    uint next_seg = 0;
+    uint32_t next_pos = 0;
+    status_t err = NO_ERROR;
+
+    for (;;) {
+        /* keep the queue full */
+        while (err == NO_ERROR && count < depth) {
+            while (next_seg < seg_count && next_pos == segs[next_seg].filesz) {
+                next_seg++;
+                next_pos = 0;
+            }
+            if (next_seg == seg_count)
+                break;
+
+            struct elf_segment *seg = &segs[next_seg];
+            uint slot = (head + count) % depth;
+            struct elf_read *rd = &reads[slot];
+
+            rd->seg = next_seg;
+            rd->pos = next_pos;
+            rd->len = MIN(ELF_READ_CHUNK, seg->filesz - next_pos);
+            if (seg->decomp) {
+                /* compressed data lands in a staging buffer and inflates from there */
+                if (!staging[slot])
+                    staging[slot] = malloc(ELF_READ_CHUNK);
+                if (!staging[slot]) {
+                    err = ERR_NO_MEMORY;
+                    break;
+                }
+                rd->buf = staging[slot];
+            } else {
+                rd->buf = seg->ptr + next_pos;
+            }
+
+            LTRACEF("reading %zu bytes at offset %u to %p\n", rd->len, seg->offset + next_pos, rd->buf);
+            status_t serr = elf_read_issue(handle, seg, rd);
+            if (serr < 0) {
+                if (handle->bdev)
+                    event_destroy(&rd->req.event);
+                err = serr;
+                break;
+            }
+            next_pos += rd->len;
+            count++;
+        }
+
+        if (count == 0)
+            break;
+
+        /* retire the oldest, after an error just drain what's outstanding */
+        struct elf_read *rd = &reads[head];
+        ssize_t result = elf_read_wait(handle, rd);
+        head = (head + 1) % depth;
+        count--;
+
+        if (err < 0)
+            continue;
+        if (result < (ssize_t)rd->len) {
+            LTRACEF("error %ld reading segment %u\n", result, rd->seg);
+            err = (result < 0) ? result : ERR_IO;
+            continue;
+        }
+        err = elf_consume(handle, &segs[rd->seg], rd);
+    }
+
+    for (uint i = 0; i < depth; i++)
+        free(staging[i]);
+
+    return err;
+}
+
+/* sanity check the number of program headers before reading them in */
+static status_t elf_check_pheaders(const elf_handle_t *handle)
+{
+    LTRACEF("number of program headers %u, entry size %u\n", handle->eheader.e_phnum, handle->eheader.e_phentsize);
+    if (handle->eheader.e_phnum > ELF_MAX_SEGMENTS || handle->eheader.e_phentsize != sizeof(struct Elf32_Phdr)) {
+        LTRACEF("too many program headers or bad size\n");
+        return ERR_NO_MEMORY;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ * Work out where every PT_LOAD segment goes and set up its inflate stream, and
+ * the bss ranges to zero alongside the file data. On error the segments so far
+ * are still in segs, for elf_finish_segments to clean up.
+ */
+static status_t elf_setup_segments(elf_handle_t *handle, struct elf_segment *segs, uint *load_count,
+                                   struct elf_zero_job *zero)
+{
+    LTRACEF("program headers:\n");
+    *load_count = 0;
+    zero->range_count = 0;
+    for (uint i = 0; i < handle->eheader.e_phnum; i++) {
+        // parse the program headers
+        struct Elf32_Phdr *pheader = &handle->pheaders[i];
+
+        LTRACEF("%u: type %u offset 0x%x vaddr 0x%x paddr 0x%x memsiz %u filesize %u\n",
+                i, pheader->p_type, pheader->p_offset, pheader->p_vaddr, pheader->p_paddr, pheader->p_memsz, pheader->p_filesz);
+
+        // we only care about PT_LOAD segments at the moment
+        if (pheader->p_type != PT_LOAD)
+            continue;
+
+        bool compressed = pheader->p_flags & ELF_PF_ZLIB;
+        if (!compressed && pheader->p_filesz > pheader->p_memsz) {
+            LTRACEF("segment %u file size larger than memory size\n", i);
+            return ERR_NOT_VALID;
+        }
+
+        // if the memory allocation hook exists, call it
+        void *ptr = (void *)(uintptr_t)pheader->p_vaddr;
+
+        if (handle->mem_alloc_hook) {
+            status_t err = handle->mem_alloc_hook(handle, &ptr, pheader->p_memsz, *load_count, 0);
+            if (err < 0) {
+                LTRACEF("mem hook failed, abort\n");
+                // XXX clean up what we got so far
+                return err;
+            }
+        }
+
+        struct elf_segment *seg = &segs[*load_count];
+        seg->ptr = ptr;
+        seg->offset = pheader->p_offset;
+        seg->filesz = pheader->p_filesz;
+        seg->memsz = pheader->p_memsz;
+        seg->decomp = NULL;
+        seg->out_len = 0;
+
+        // track the number of load segments we have seen to pass the mem alloc hook
+        (*load_count)++;
+
+        if (compressed) {
+            seg->decomp = malloc(sizeof(tinfl_decompressor));
+            if (!seg->decomp)
+                return ERR_NO_MEMORY;
+            tinfl_init(seg->decomp);
+        } else if (seg->memsz > seg->filesz) {
+            // zero out the difference between memsz and filesz, on other cpus while the
+            // reads go on. the cache line shared with the file data is left for after.
+            uint8_t *start = (uint8_t *)ROUNDUP((uintptr_t)seg->ptr + seg->filesz, CACHE_LINE);
+            if (start < seg->ptr + seg->memsz) {
+                zero->range[zero->range_count].ptr = start;
+                zero->range[zero->range_count].len = seg->ptr + seg->memsz - start;
+                zero->range_count++;
+            }
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/* zero the rest of the bss and sync the caches once all the file data is in, or
+ * just free the inflate streams if loading failed */
+static void elf_finish_segments(struct elf_segment *segs, uint load_count, status_t err)
+{
+    for (uint i = 0; i < load_count; i++) {
+        struct elf_segment *seg = &segs[i];
+
+        if (seg->decomp) {
+            // whatever the stream didn't fill is bss
+            if (err == NO_ERROR)
+                memset(seg->ptr + seg->out_len, 0, seg->memsz - seg->out_len);
+            free(seg->decomp);
+            seg->decomp = NULL;
+        } else if (err == NO_ERROR && seg->memsz > seg->filesz) {
+            uint8_t *bss = seg->ptr + seg->filesz;
+            uint8_t *end = (uint8_t *)ROUNDUP((uintptr_t)bss, CACHE_LINE);
+            memset(bss, 0, MIN(end, seg->ptr + seg->memsz) - bss);
+        }
+
+        // make sure the i&d cache are coherent, if they exist
+        if (err == NO_ERROR)
+            arch_sync_cache_range((addr_t)seg->ptr, seg->memsz);
+    }
+}
+
 status_t elf_load(elf_handle_t *handle)
 {
     if (!handle)
         return ERR_INVALID_ARGS;
     if (!handle->open)
         return ERR_NOT_READY;
+    if (handle->stream)
+        return ERR_NOT_SUPPORTED;
 
     // validate that this is an ELF file
     ssize_t readerr = handle->read_hook(handle, &handle->eheader, 0, sizeof(handle->eheader));
@@ -172,12 +609,9 @@ status_t elf_load(elf_handle_t *handle)
         return ERR_NOT_FOUND;
     }
 
-    // sanity check number of program headers
-    LTRACEF("number of program headers %u, entry size %u\n", handle->eheader.e_phnum, handle->eheader.e_phentsize);
-    if (handle->eheader.e_phnum > 16 || handle->eheader.e_phentsize != sizeof(struct Elf32_Phdr)) {
-        LTRACEF("too many program headers or bad size\n");
-        return ERR_NO_MEMORY;
-    }
+    status_t err = elf_check_pheaders(handle);
+    if (err < 0)
+        return err;
 
     // allocate and read in the program headers
     handle->pheaders = calloc(1, handle->eheader.e_phnum * handle->eheader.e_phentsize);
@@ -192,56 +626,221 @@ status_t elf_load(elf_handle_t *handle)
         return ERR_NO_MEMORY;
     }
 
-    LTRACEF("program headers:\n");
-    uint load_count = 0;
-    for (uint i = 0; i < handle->eheader.e_phnum; i++) {
-        // parse the program headers
-        struct Elf32_Phdr *pheader = &handle->pheaders[i];
+    struct elf_segment segs[ELF_MAX_SEGMENTS];
+    struct elf_zero_job zero;
+    uint load_count;
+    err = elf_setup_segments(handle, segs, &load_count, &zero);
+    if (err == NO_ERROR) {
+        elf_zero_start(&zero);
+        err = elf_read_segments(handle, segs, load_count);
+        elf_zero_finish(&zero);
+    }
 
-        LTRACEF("%u: type %u offset 0x%x vaddr 0x%x paddr 0x%x memsiz %u filesize %u\n",
-                i, pheader->p_type, pheader->p_offset, pheader->p_vaddr, pheader->p_paddr, pheader->p_memsz, pheader->p_filesz);
+    elf_finish_segments(segs, load_count, err);
 
-        // we only care about PT_LOAD segments at the moment
-        if (pheader->p_type == PT_LOAD) {
-            // if the memory allocation hook exists, call it
-            void *ptr = (void *)(uintptr_t)pheader->p_vaddr;
-
-            if (handle->mem_alloc_hook) {
-                status_t err = handle->mem_alloc_hook(handle, &ptr, pheader->p_memsz, load_count, 0);
-                if (err < 0) {
-                    LTRACEF("mem hook failed, abort\n");
-                    // XXX clean up what we got so far
-                    return err;
-                }
-            }
+    if (err < 0)
+        return err;
 
-            // read the file portion of the segment into memory at vaddr
-            LTRACEF("reading segment at offset %u to address %p\n", pheader->p_offset, ptr);
-            readerr = handle->read_hook(handle, ptr, pheader->p_offset, pheader->p_filesz);
-            if (readerr < (ssize_t)pheader->p_filesz) {
-                LTRACEF("error %ld reading program header %u\n", readerr, i);
-                return (readerr < 0) ? readerr : ERR_IO;
-            }
+    // save the entry point
+    handle->entry = handle->eheader.e_entry;
 
-            // zero out he difference between memsz and filesz
-            size_t tozero = pheader->p_memsz - pheader->p_filesz;
-            if (tozero > 0) {
-                uint8_t *ptr2 = (uint8_t *)ptr + pheader->p_filesz;
-                LTRACEF("zeroing memory at %p, size %zu\n", ptr2, tozero);
-                memset(ptr2, 0, tozero);
-            }
+    return NO_ERROR;
+}
+
+struct elf_stream {
+    uint64_t pos;       /* how much of the file has been written */
+    uint64_t end;       /* end of the file data of the last segment */
+    status_t err;       /* once a write fails, the rest do too */
+
+    /* the start of the file is kept until the program headers are in. only
+     * the elf header is asked for at first, then up to the end of the program
+     * headers once their offset is known. */
+    size_t hdr_len;
+    bool have_eheader;
+    bool parsed;
+    uint8_t hdr[ELF_STREAM_HDR_MAX];
+
+    struct elf_segment segs[ELF_MAX_SEGMENTS];
+    uint load_count;
+    bool zeroing;
+    struct elf_zero_job zero;
+};
+
+status_t elf_open_handle_stream(elf_handle_t *handle)
+{
+    if (!handle)
+        return ERR_INVALID_ARGS;
+
+    struct elf_stream *stream = calloc(1, sizeof(struct elf_stream));
+    if (!stream)
+        return ERR_NO_MEMORY;
+
+    memset(handle, 0, sizeof(*handle));
+
+    stream->hdr_len = sizeof(struct Elf32_Ehdr);
+    handle->stream = stream;
+    handle->open = true;
 
-            // make sure the i&d cache are coherent, if they exist
-            arch_sync_cache_range((addr_t)ptr, pheader->p_memsz);
+    return NO_ERROR;
+}
 
-            // track the number of load segments we have seen to pass the mem alloc hook
-            load_count++;
+/* copy the part of [pos, pos + len) of the file that belongs to a segment there */
+static status_t elf_stream_data(elf_handle_t *handle, const uint8_t *buf, uint64_t pos, size_t len)
+{
+    struct elf_stream *stream = handle->stream;
+
+    for (uint i = 0; i < stream->load_count; i++) {
+        struct elf_segment *seg = &stream->segs[i];
+        uint64_t start = MAX(pos, seg->offset);
+        uint64_t end = MIN(pos + len, (uint64_t)seg->offset + seg->filesz);
+        if (start >= end)
+            continue;
+
+        const uint8_t *src = buf + (start - pos);
+        size_t n = end - start;
+        if (handle->digest_hook)
+            handle->digest_hook(handle, src, n);
+
+        if (seg->decomp) {
+            status_t err = elf_inflate(seg, src, n, end == (uint64_t)seg->offset + seg->filesz);
+            if (err < 0)
+                return err;
+        } else {
+            memcpy(seg->ptr + (start - seg->offset), src, n);
         }
     }
 
+    return NO_ERROR;
+}
+
+/* the elf header is in, work out how much more of the start of the file to keep */
+static status_t elf_stream_eheader(elf_handle_t *handle)
+{
+    struct elf_stream *stream = handle->stream;
+
+    memcpy(&handle->eheader, stream->hdr, sizeof(handle->eheader));
+    if (verify_eheader(&handle->eheader)) {
+        LTRACEF("header not valid\n");
+        return ERR_NOT_FOUND;
+    }
+
+    status_t err = elf_check_pheaders(handle);
+    if (err < 0)
+        return err;
+
+    uint64_t phend = (uint64_t)handle->eheader.e_phoff + handle->eheader.e_phnum * handle->eheader.e_phentsize;
+    if (phend > ELF_STREAM_HDR_MAX) {
+        LTRACEF("program headers end at %llu, too far into the file\n", phend);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    stream->hdr_len = MAX(phend, stream->hdr_len);
+    stream->have_eheader = true;
+
+    return NO_ERROR;
+}
+
+/* the program headers are in, set up the segments and fill in whatever of
+ * them was in the start of the file */
+static status_t elf_stream_pheaders(elf_handle_t *handle)
+{
+    struct elf_stream *stream = handle->stream;
+    size_t len = handle->eheader.e_phnum * handle->eheader.e_phentsize;
+
+    handle->pheaders = calloc(1, len);
+    if (!handle->pheaders) {
+        LTRACEF("failed to allocate memory for program headers\n");
+        return ERR_NO_MEMORY;
+    }
+    memcpy(handle->pheaders, stream->hdr + handle->eheader.e_phoff, len);
+
+    status_t err = elf_setup_segments(handle, stream->segs, &stream->load_count, &stream->zero);
+    if (err < 0)
+        return err;
+
+    for (uint i = 0; i < stream->load_count; i++)
+        stream->end = MAX(stream->end, (uint64_t)stream->segs[i].offset + stream->segs[i].filesz);
+
+    // zero bss on the other cpus while the file data comes in
+    elf_zero_start(&stream->zero);
+    stream->zeroing = true;
+    stream->parsed = true;
+
+    return elf_stream_data(handle, stream->hdr, 0, stream->hdr_len);
+}
+
+status_t elf_stream_write(elf_handle_t *handle, const void *buf, size_t len)
+{
+    if (!handle || !handle->open || !handle->stream)
+        return ERR_INVALID_ARGS;
+
+    struct elf_stream *stream = handle->stream;
+    if (stream->err < 0)
+        return stream->err;
+
+    const uint8_t *ptr = buf;
+    uint64_t pos = stream->pos;
+    stream->pos += len;
+
+    status_t err = NO_ERROR;
+    while (!stream->parsed) {
+        size_t take = MIN(len, stream->hdr_len - pos);
+        memcpy(stream->hdr + pos, ptr, take);
+        ptr += take;
+        pos += take;
+        len -= take;
+        if (pos < stream->hdr_len)
+            return NO_ERROR;
+
+        err = stream->have_eheader ? elf_stream_pheaders(handle) : elf_stream_eheader(handle);
+        if (err < 0)
+            goto fail;
+    }
+
+    if (len > 0)
+        err = elf_stream_data(handle, ptr, pos, len);
+
+fail:
+    if (err < 0)
+        stream->err = err;
+    return err;
+}
+
+/* wait for the bss helpers and let go of the inflate streams */
+static void elf_stream_end(struct elf_stream *stream, status_t err)
+{
+    if (stream->zeroing) {
+        elf_zero_finish(&stream->zero);
+        stream->zeroing = false;
+    }
+    elf_finish_segments(stream->segs, stream->load_count, err);
+    stream->load_count = 0;
+}
+
+status_t elf_stream_finish(elf_handle_t *handle)
+{
+    if (!handle || !handle->open || !handle->stream)
+        return ERR_INVALID_ARGS;
+
+    struct elf_stream *stream = handle->stream;
+    status_t err = stream->err;
+    if (err == NO_ERROR && !stream->parsed) {
+        LTRACEF("stream ended in the headers\n");
+        err = ERR_NOT_FOUND;
+    }
+    if (err == NO_ERROR && stream->pos < stream->end) {
+        LTRACEF("stream ended at %llu, segments run to %llu\n", stream->pos, stream->end);
+        err = ERR_IO;
+    }
+
+    elf_stream_end(stream, err);
+    stream->err = (err < 0) ? err : ERR_ALREADY_STARTED;
+
+    if (err < 0)
+        return err;
+
     // save the entry point
     handle->entry = handle->eheader.e_entry;
 
     return NO_ERROR;
 }
-
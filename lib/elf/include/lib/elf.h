@@ -26,10 +26,19 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+/* a PT_LOAD segment whose file data is a zlib stream, inflated into the
+ * segment at load time. p_filesz is the compressed size, whatever the stream
+ * doesn't fill up to p_memsz is zeroed.
+ */
+#define ELF_PF_ZLIB 0x00100000
+
 /* api */
 struct elf_handle;
+struct bdev;
+struct elf_stream;
 typedef ssize_t (*elf_read_hook_t)(struct elf_handle *, void *buf, uint64_t offset, size_t len);
 typedef status_t (*elf_mem_alloc_t)(struct elf_handle *, void **ptr, size_t len, uint num, uint flags);
+typedef void (*elf_digest_hook_t)(struct elf_handle *, const void *buf, size_t len);
 
 typedef struct elf_handle {
     bool open;
@@ -39,10 +48,25 @@ typedef struct elf_handle {
     void *read_hook_arg;
     bool free_read_hook_arg;
 
+    // set by elf_open_handle_bio, segments are then read with overlapped
+    // asynchronous requests instead of through the read hook
+    struct bdev *bdev;
+    off_t bdev_offset;
+
+    // set by elf_open_handle_stream, the file is pushed in with
+    // elf_stream_write instead of being read
+    struct elf_stream *stream;
+
     // memory allocation callback
     elf_mem_alloc_t mem_alloc_hook;
     void *mem_alloc_hook_arg;
 
+    // optional, handed the file data of every PT_LOAD segment in program
+    // header order as it's loaded, to hash it without a second pass. a stream
+    // hands it over in the order it arrives instead.
+    elf_digest_hook_t digest_hook;
+    void *digest_hook_arg;
+
     // loaded info about the elf file
     struct Elf32_Ehdr eheader;    // a copy of the main elf header
     struct Elf32_Phdr *pheaders;  // a pointer to a buffer of program headers
@@ -53,7 +77,18 @@ typedef struct elf_handle {
 
 status_t elf_open_handle(elf_handle_t *handle, elf_read_hook_t read_hook, void *read_hook_arg, bool free_read_hook_arg);
 status_t elf_open_handle_memory(elf_handle_t *handle, const void *ptr, size_t len);
+status_t elf_open_handle_bio(elf_handle_t *handle, struct bdev *dev, off_t offset);
 void     elf_close_handle(elf_handle_t *handle);
 
 status_t elf_load(elf_handle_t *handle);
 
+/* streaming loads, for files that arrive in order and can't be read back, like
+ * over the network. The headers are parsed as soon as they're in and every
+ * segment's file data is copied straight to where it's loaded as it goes by,
+ * so nothing is staged and the file can be any size. The program headers have
+ * to be within the first 4KB. elf_stream_finish() stands in for elf_load()
+ * once the whole file has been written. */
+status_t elf_open_handle_stream(elf_handle_t *handle);
+status_t elf_stream_write(elf_handle_t *handle, const void *buf, size_t len);
+status_t elf_stream_finish(elf_handle_t *handle);
+
@@ -135,6 +135,7 @@
 #define PF_X        0x1
 #define PF_W        0x2
 #define PF_R        0x4
+#define PF_MASKOS   0x0ff00000
 #define PF_MASKPROC 0xf0000000
 
 #define PT_NULL 0
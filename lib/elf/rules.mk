@@ -4,6 +4,11 @@ MODULE := $(LOCAL_DIR)
 
 GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 
+MODULE_DEPS := \
+	lib/bio \
+	lib/miniz \
+	lib/workqueue
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/elf.c
 
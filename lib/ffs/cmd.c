@@ -92,9 +92,9 @@ usage:
 			wattr = fno.fattrib & AM_RDO ? '-' : 'w';
 
 			if (fno.fattrib & AM_DIR)
-				printf("dr%cxr%cxr%cx %10lu %s\n", wattr, wattr, wattr, fno.fsize, fn);
+				printf("dr%cxr%cxr%cx %10u %s\n", wattr, wattr, wattr, (unsigned int)fno.fsize, fn);
 			else
-				printf(" r%c-r%c-r%c- %10lu %s\n", wattr, wattr, wattr, fno.fsize, fn);
+				printf(" r%c-r%c-r%c- %10u %s\n", wattr, wattr, wattr, (unsigned int)fno.fsize, fn);
 		}
 
 		if (res != FR_OK)
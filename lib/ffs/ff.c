@@ -2418,9 +2418,16 @@ FRESULT f_read (
 			sect += csect;
 			cc = btr / SS(fp->fs);				/* When remaining bytes >= sector size, */
 			if (cc) {							/* Read maximum contiguous sectors directly */
-				if (csect + cc > fp->fs->csize)	/* Clip at cluster boundary */
-					cc = fp->fs->csize - csect;
-				if (disk_read(fp->fs->drv, rbuff, sect, (BYTE)cc) != RES_OK)
+				UINT avail = fp->fs->csize - csect;	/* Sectors up to the end of the contiguous run */
+				while (avail < cc) {			/* Extend over following clusters that are adjacent on the disk */
+					clst = get_fat(fp->fs, fp->clust);
+					if (clst != fp->clust + 1 || clst >= fp->fs->n_fatent) break;	/* Fragmented, end of chain or error, the next cluster boundary sorts it out */
+					fp->clust = clst;
+					avail += fp->fs->csize;
+				}
+				if (cc > avail)					/* Clip at the end of the run */
+					cc = avail;
+				if (disk_read(fp->fs->drv, rbuff, sect, cc) != RES_OK)
 					ABORT(fp->fs, FR_DISK_ERR);
 #if !_FS_READONLY && _FS_MINIMIZE <= 2			/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if _FS_TINY
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <ffs.h>
+
+#include "ff.h"
+#include "ffs_priv.h"
+
+#define LOCAL_TRACE 0
+
+#define FFS_PATH_MAX 512
+
+struct ffs_fs {
+	uint vol;
+};
+
+struct ffs_file {
+	bool is_dir;
+	union {
+		FIL fil;
+		DIR dir;
+	};
+};
+
+static status_t ffs_err(FRESULT res)
+{
+	switch (res) {
+		case FR_OK:
+			return NO_ERROR;
+		case FR_NO_FILE:
+		case FR_NO_PATH:
+			return ERR_NOT_FOUND;
+		case FR_INVALID_NAME:
+			return ERR_BAD_PATH;
+		case FR_DENIED:
+			return ERR_ACCESS_DENIED;
+		case FR_EXIST:
+			return ERR_ALREADY_EXISTS;
+		case FR_WRITE_PROTECTED:
+			return ERR_NOT_ALLOWED;
+		case FR_NOT_READY:
+			return ERR_NOT_READY;
+		case FR_NO_FILESYSTEM:
+			return ERR_NOT_VALID;
+		case FR_TIMEOUT:
+			return ERR_TIMED_OUT;
+		case FR_LOCKED:
+			return ERR_BUSY;
+		case FR_NOT_ENOUGH_CORE:
+			return ERR_NO_MEMORY;
+		case FR_TOO_MANY_OPEN_FILES:
+			return ERR_NO_RESOURCES;
+		case FR_INVALID_PARAMETER:
+			return ERR_INVALID_ARGS;
+		default:
+			return ERR_IO;
+	}
+}
+
+/* lib/fs hands us the path below the mount point, FatFs wants it prefixed with the volume */
+static status_t ffs_path(const struct ffs_fs *fs, const char *path, char *buf)
+{
+	if (snprintf(buf, FFS_PATH_MAX, "%u:%s", fs->vol, path) >= FFS_PATH_MAX)
+		return ERR_BAD_PATH;
+	return NO_ERROR;
+}
+
+int ffs_fs_mount(bdev_t *dev, fscookie *cookie)
+{
+	int vol = ffs_attach_bdev(dev);
+	if (vol < 0)
+		return vol;
+
+	struct ffs_fs *fs = malloc(sizeof(*fs));
+	if (!fs) {
+		ffs_detach_bdev(vol);
+		return ERR_NO_MEMORY;
+	}
+	fs->vol = vol;
+
+	/* FatFs mounts lazily, look at the root to find out now if it's a FAT volume */
+	char path[FFS_PATH_MAX];
+	ffs_path(fs, "/", path);
+
+	DIR dir;
+	FRESULT res = f_opendir(&dir, path);
+	if (res != FR_OK) {
+		LTRACEF("dev %s: error %d\n", dev->name, res);
+		ffs_detach_bdev(vol);
+		free(fs);
+		return ffs_err(res);
+	}
+
+	*cookie = fs;
+
+	return NO_ERROR;
+}
+
+int ffs_fs_unmount(fscookie cookie)
+{
+	struct ffs_fs *fs = cookie;
+
+	ffs_detach_bdev(fs->vol);
+	free(fs);
+
+	return NO_ERROR;
+}
+
+static int ffs_open(fscookie cookie, const char *_path, BYTE mode, filecookie *fcookie)
+{
+	char path[FFS_PATH_MAX];
+	status_t err = ffs_path(cookie, _path, path);
+	if (err < 0)
+		return err;
+
+	struct ffs_file *file = malloc(sizeof(*file));
+	if (!file)
+		return ERR_NO_MEMORY;
+
+	file->is_dir = false;
+	FRESULT res = f_open(&file->fil, path, mode);
+
+	/* read only files and media, and files someone else has open, can still be read */
+	if ((res == FR_DENIED || res == FR_WRITE_PROTECTED || res == FR_LOCKED) && !(mode & FA_CREATE_NEW))
+		res = f_open(&file->fil, path, FA_READ);
+
+	/* directories can be opened for stat */
+	if (res == FR_NO_FILE && !(mode & FA_CREATE_NEW)) {
+		if (f_opendir(&file->dir, path) == FR_OK) {
+			file->is_dir = true;
+			res = FR_OK;
+		}
+	}
+
+	if (res != FR_OK) {
+		free(file);
+		return ffs_err(res);
+	}
+
+	*fcookie = file;
+
+	return NO_ERROR;
+}
+
+int ffs_fs_open_file(fscookie cookie, const char *path, filecookie *fcookie)
+{
+	return ffs_open(cookie, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING, fcookie);
+}
+
+int ffs_fs_create_file(fscookie cookie, const char *path, filecookie *fcookie)
+{
+	return ffs_open(cookie, path, FA_READ | FA_WRITE | FA_CREATE_NEW, fcookie);
+}
+
+int ffs_fs_make_dir(fscookie cookie, const char *_path)
+{
+	char path[FFS_PATH_MAX];
+	status_t err = ffs_path(cookie, _path, path);
+	if (err < 0)
+		return err;
+
+	return ffs_err(f_mkdir(path));
+}
+
+int ffs_fs_stat_file(filecookie fcookie, struct file_stat *stat)
+{
+	struct ffs_file *file = fcookie;
+
+	stat->is_dir = file->is_dir;
+	stat->size = file->is_dir ? 0 : f_size(&file->fil);
+
+	return NO_ERROR;
+}
+
+static FRESULT ffs_seek(FIL *fil, off_t offset)
+{
+	if (offset < 0 || offset > UINT32_MAX)
+		return FR_INVALID_PARAMETER;
+
+	if (f_tell(fil) == offset)
+		return FR_OK;
+
+	return f_lseek(fil, offset);
+}
+
+int ffs_fs_read_file(filecookie fcookie, void *buf, off_t offset, size_t len)
+{
+	struct ffs_file *file = fcookie;
+
+	if (file->is_dir)
+		return ERR_NOT_FILE;
+
+	FRESULT res = ffs_seek(&file->fil, offset);
+	if (res != FR_OK)
+		return ffs_err(res);
+
+	UINT br;
+	res = f_read(&file->fil, buf, MIN(len, INT_MAX), &br);
+	if (res != FR_OK)
+		return ffs_err(res);
+
+	return br;
+}
+
+int ffs_fs_write_file(filecookie fcookie, const void *buf, off_t offset, size_t len)
+{
+	struct ffs_file *file = fcookie;
+
+	if (file->is_dir)
+		return ERR_NOT_FILE;
+
+	FRESULT res = ffs_seek(&file->fil, offset);
+	if (res != FR_OK)
+		return ffs_err(res);
+
+	/* a seek past the end only grows files opened for writing, and only as far as it can */
+	if (f_tell(&file->fil) != offset)
+		return ERR_IO;
+
+	UINT bw;
+	res = f_write(&file->fil, buf, MIN(len, INT_MAX), &bw);
+	if (res != FR_OK)
+		return ffs_err(res);
+
+	return bw;
+}
+
+int ffs_fs_truncate_file(filecookie fcookie, off_t len)
+{
+	struct ffs_file *file = fcookie;
+
+	if (file->is_dir)
+		return ERR_NOT_FILE;
+
+	/* seeking past the end grows it, f_truncate cuts it off at the file pointer */
+	FRESULT res = ffs_seek(&file->fil, len);
+	if (res != FR_OK)
+		return ffs_err(res);
+	if (f_tell(&file->fil) != len)
+		return ERR_IO;
+
+	return ffs_err(f_truncate(&file->fil));
+}
+
+int ffs_fs_close_file(filecookie fcookie)
+{
+	struct ffs_file *file = fcookie;
+
+	/* directories have nothing to close in this version of FatFs */
+	FRESULT res = file->is_dir ? FR_OK : f_close(&file->fil);
+
+	free(file);
+
+	return ffs_err(res);
+}
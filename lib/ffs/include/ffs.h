@@ -25,8 +25,23 @@
 
 #include <sys/types.h>
 #include <dev/driver.h>
+#include <lib/bio.h>
+#include <lib/fs.h>
 
+/* bind a block class device to a FatFs volume directly */
 status_t ffs_mount(size_t index, struct device *dev);
 
+/* lib/fs backend on bio devices */
+int ffs_fs_mount(bdev_t *dev, fscookie *cookie);
+int ffs_fs_unmount(fscookie cookie);
+int ffs_fs_open_file(fscookie cookie, const char *path, filecookie *fcookie);
+int ffs_fs_create_file(fscookie cookie, const char *path, filecookie *fcookie);
+int ffs_fs_make_dir(fscookie cookie, const char *path);
+int ffs_fs_stat_file(filecookie fcookie, struct file_stat *stat);
+int ffs_fs_read_file(filecookie fcookie, void *buf, off_t offset, size_t len);
+int ffs_fs_write_file(filecookie fcookie, const void *buf, off_t offset, size_t len);
+int ffs_fs_truncate_file(filecookie fcookie, off_t len);
+int ffs_fs_close_file(filecookie fcookie);
+
 #endif
 
@@ -12,6 +12,8 @@
 
 #else			/* Embedded platform */
 
+#include <stdint.h>
+
 /* These types must be 16-bit, 32-bit or larger integer */
 typedef int				INT;
 typedef unsigned int	UINT;
@@ -27,10 +29,10 @@ typedef unsigned short	USHORT;
 typedef unsigned short	WORD;
 typedef unsigned short	WCHAR;
 
-/* These types must be 32-bit integer */
-typedef long			LONG;
-typedef unsigned long	ULONG;
-typedef unsigned long	DWORD;
+/* These types must be 32-bit integer, long is 64 bits on LP64 targets */
+typedef int32_t			LONG;
+typedef uint32_t		ULONG;
+typedef uint32_t		DWORD;
 
 #endif
 
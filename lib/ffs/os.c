@@ -1,45 +1,115 @@
+#include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <kernel/mutex.h>
 #include <malloc.h>
 #include <dev/driver.h>
 #include <dev/class/block.h>
+#include <lib/bio.h>
+#include <lib/bcache.h>
 #include <err.h>
 
 #include "ff.h"
 #include "diskio.h"
+#include "ffs_priv.h"
 
+/* a volume is backed either by a block class device or by a bio device */
 static struct {
 	FATFS work;
 	struct device *dev;
+	bdev_t *bdev;
+	bcache_t fat_cache;
 } mount_table[_VOLUMES];
 
+static mutex_t mount_lock = MUTEX_INITIAL_VALUE(mount_lock);
+
 status_t ffs_mount(size_t index, struct device *dev)
 {
 	FRESULT res;
 
 	if (index >= countof(mount_table))
 		return ERR_INVALID_ARGS;
-	
-	if (dev && mount_table[index].dev)
+
+	mutex_acquire(&mount_lock);
+
+	if (dev && (mount_table[index].dev || mount_table[index].bdev)) {
+		mutex_release(&mount_lock);
 		return ERR_ALREADY_MOUNTED;
-	
+	}
+
 	if (dev) {
 		mount_table[index].dev = dev;
 
 		res = f_mount(index, &mount_table[index].work);
-		if (res != FR_OK)
-			return ERR_INVALID_ARGS;
 	} else {
 		mount_table[index].dev = NULL;
 
 		res = f_mount(index, NULL);
-		if (res != FR_OK)
-			return ERR_NOT_FOUND;
 	}
 
+	mutex_release(&mount_lock);
+
+	if (res != FR_OK)
+		return dev ? ERR_INVALID_ARGS : ERR_NOT_FOUND;
+
 	return NO_ERROR;
 }
 
+int ffs_attach_bdev(bdev_t *dev)
+{
+	int vol = ERR_NO_RESOURCES;
+
+	mutex_acquire(&mount_lock);
+
+	for (uint i = 0; i < countof(mount_table); i++) {
+		if (mount_table[i].dev || mount_table[i].bdev)
+			continue;
+
+		/* nothing is read until the first access, see disk_initialize */
+		if (f_mount(i, &mount_table[i].work) != FR_OK) {
+			vol = ERR_GENERIC;
+			break;
+		}
+
+		mount_table[i].bdev = dev;
+		vol = i;
+		break;
+	}
+
+	mutex_release(&mount_lock);
+
+	return vol;
+}
+
+void ffs_detach_bdev(uint vol)
+{
+	DEBUG_ASSERT(vol < countof(mount_table));
+
+	mutex_acquire(&mount_lock);
+
+	f_mount(vol, NULL);
+
+	/* writes back whatever is still dirty */
+	if (mount_table[vol].fat_cache) {
+		bcache_destroy(mount_table[vol].fat_cache);
+		mount_table[vol].fat_cache = NULL;
+	}
+	mount_table[vol].bdev = NULL;
+
+	mutex_release(&mount_lock);
+}
+
+/* the FAT area is only known once the volume is mounted, until then nothing is cached */
+static bool is_fat_sector(BYTE pdrv, DWORD sector, UINT count)
+{
+	const FATFS *fs = &mount_table[pdrv].work;
+
+	if (!mount_table[pdrv].fat_cache || !fs->fs_type)
+		return false;
+
+	return sector >= fs->fatbase && sector + count <= fs->fatbase + fs->fsize * fs->n_fats;
+}
+
 #if _USE_LFN == 3
 void *ff_memalloc(UINT size)
 {
@@ -84,6 +154,16 @@ void ff_rel_grant(_SYNC_t sobj)
 
 DSTATUS disk_initialize(BYTE pdrv)
 {
+	/* the FAT is read one sector at a time all the time, keep it in memory. the
+	 * volume may be mounted again after a mkfs wrote the FAT behind the cache's
+	 * back, so start over with an empty one. without it everything still works,
+	 * just uncached. */
+	if (mount_table[pdrv].bdev) {
+		if (mount_table[pdrv].fat_cache)
+			bcache_destroy(mount_table[pdrv].fat_cache);
+		mount_table[pdrv].fat_cache = bcache_create(mount_table[pdrv].bdev, FFS_SECTOR_SIZE, FFS_FAT_CACHE_SECTORS);
+	}
+
 	return RES_OK;
 }
 
@@ -92,10 +172,57 @@ DSTATUS disk_status(BYTE pdrv)
 	return RES_OK;
 }
 
-DRESULT disk_read(BYTE pdrv, BYTE* buf, DWORD sector, BYTE count)
+static DRESULT bdev_read(BYTE pdrv, BYTE* buf, DWORD sector, UINT count)
+{
+	if (is_fat_sector(pdrv, sector, count)) {
+		for (UINT i = 0; i < count; i++) {
+			if (bcache_read_block(mount_table[pdrv].fat_cache, buf + i * FFS_SECTOR_SIZE, sector + i) < 0)
+				return RES_ERROR;
+		}
+		return RES_OK;
+	}
+
+	/* file data comes in runs of whole clusters, straight from the device */
+	ssize_t len = (ssize_t)count * FFS_SECTOR_SIZE;
+	if (bio_read(mount_table[pdrv].bdev, buf, (off_t)sector * FFS_SECTOR_SIZE, len) != len)
+		return RES_ERROR;
+
+	return RES_OK;
+}
+
+#if _READONLY == 0
+static DRESULT bdev_write(BYTE pdrv, const BYTE* buf, DWORD sector, UINT count)
+{
+	if (is_fat_sector(pdrv, sector, count)) {
+		bcache_t cache = mount_table[pdrv].fat_cache;
+
+		/* written back by CTRL_SYNC or the cache's writeback thread */
+		for (UINT i = 0; i < count; i++) {
+			void *ptr;
+			if (bcache_get_block(cache, &ptr, sector + i) < 0)
+				return RES_ERROR;
+			memcpy(ptr, buf + i * FFS_SECTOR_SIZE, FFS_SECTOR_SIZE);
+			bcache_mark_block_dirty(cache, sector + i);
+			bcache_put_block(cache, sector + i);
+		}
+		return RES_OK;
+	}
+
+	ssize_t len = (ssize_t)count * FFS_SECTOR_SIZE;
+	if (bio_write(mount_table[pdrv].bdev, buf, (off_t)sector * FFS_SECTOR_SIZE, len) != len)
+		return RES_ERROR;
+
+	return RES_OK;
+}
+#endif
+
+DRESULT disk_read(BYTE pdrv, BYTE* buf, DWORD sector, UINT count)
 {
 	ssize_t ret;
 
+	if (mount_table[pdrv].bdev)
+		return bdev_read(pdrv, buf, sector, count);
+
 	struct device *dev = mount_table[pdrv].dev;
 	if (!dev)
 		return RES_NOTRDY;
@@ -108,10 +235,13 @@ DRESULT disk_read(BYTE pdrv, BYTE* buf, DWORD sector, BYTE count)
 }
 
 #if	_READONLY == 0
-DRESULT disk_write(BYTE pdrv, const BYTE* buf, DWORD sector, BYTE count)
+DRESULT disk_write(BYTE pdrv, const BYTE* buf, DWORD sector, UINT count)
 {
 	ssize_t ret;
 
+	if (mount_table[pdrv].bdev)
+		return bdev_write(pdrv, buf, sector, count);
+
 	struct device *dev = mount_table[pdrv].dev;
 	if (!dev)
 		return RES_NOTRDY;
@@ -124,10 +254,42 @@ DRESULT disk_write(BYTE pdrv, const BYTE* buf, DWORD sector, BYTE count)
 }
 #endif
 
+static DRESULT bdev_ioctl(BYTE pdrv, BYTE cmd, void* buf)
+{
+	bdev_t *dev = mount_table[pdrv].bdev;
+
+	switch (cmd) {
+		case CTRL_SYNC:
+			if (bcache_flush(mount_table[pdrv].fat_cache) < 0)
+				return RES_ERROR;
+			break;
+
+		case GET_SECTOR_SIZE:
+			*(WORD *)buf = FFS_SECTOR_SIZE;
+			break;
+
+		case GET_BLOCK_SIZE:
+			*(DWORD *)buf = 1;
+			break;
+
+		case GET_SECTOR_COUNT:
+			*(DWORD *)buf = dev->total_size / FFS_SECTOR_SIZE;
+			break;
+
+		default:
+			return RES_PARERR;
+	}
+
+	return RES_OK;
+}
+
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buf)
 {
 	ssize_t ret;
 
+	if (mount_table[pdrv].bdev)
+		return bdev_ioctl(pdrv, cmd, buf);
+
 	struct device *dev = mount_table[pdrv].dev;
 	if (!dev)
 		return RES_NOTRDY;
@@ -4,10 +4,16 @@ MODULE := $(LOCAL_DIR)
 
 GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 
+MODULE_DEPS += \
+	lib/bio \
+	lib/bcache \
+	lib/fs
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/ff.c \
 	$(LOCAL_DIR)/option/ccsbcs.c \
 	$(LOCAL_DIR)/os.c \
+	$(LOCAL_DIR)/fs.c \
 	$(LOCAL_DIR)/cmd.c \
 
 include make/module.mk
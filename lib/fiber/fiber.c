@@ -0,0 +1,673 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/fiber.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+
+#define LOCAL_TRACE 0
+
+#define FIBER_MAGIC 'fibr'
+#define FIBER_LOOP_MAGIC 'fblp'
+
+#define FIBER_STACK_CANARY ((uintptr_t)0xf1be25a5f1be25a5ULL)
+#define FIBER_STACK_CANARY_WORDS 4
+
+enum fiber_state {
+	FIBER_READY,
+	FIBER_RUNNING,
+	FIBER_BLOCKED,
+	FIBER_DEAD,
+};
+
+/* sits at the top of its own stack allocation, the stack grows down away from it */
+struct fiber {
+	int magic;
+	struct list_node node; /* on the run queue, an event's waiters or the free list */
+	fiber_loop_t *loop;
+	enum fiber_state state;
+
+	vaddr_t sp;
+	void *stack;
+
+	fiber_start_routine entry;
+	void *arg;
+
+	/* while blocked */
+	fiber_event_t *blocking_event;
+	status_t wait_ret;
+	lk_bigtime_t wait_deadline;
+	timer_t timer;
+};
+
+struct fiber_loop {
+	int magic;
+	struct list_node node;
+	char name[32];
+	size_t stack_size;
+	uint max_free;
+
+	spin_lock_t lock; /* protects everything down to wake */
+	struct list_node run_queue;
+	struct list_node free_list;
+	uint free_count;
+	uint live; /* created and not yet exited */
+	bool sleeping; /* the loop thread is waiting on wake */
+	bool stop;
+	thread_t *thread; /* running the loop, NULL when nobody is */
+
+	event_t wake;
+
+	/* only touched from the loop thread */
+	fiber_t *current;
+	vaddr_t loop_sp;
+
+	/* stats */
+	ulong switches;
+	ulong created;
+	ulong allocated;
+};
+
+/* what fiber_context_switch() leaves on the stack, keep in sync with arch/$(ARCH)/fiber_switch.S */
+#if ARCH_X86_64
+struct fiber_frame {
+	uint64_t r15, r14, r13, r12, rbx, rbp;
+	uint64_t rip;
+	uint64_t ret; /* fake return address of the entry, keeps the abi stack alignment */
+};
+#define FIBER_FRAME_SET_PC(frame, pc) ((frame)->rip = (pc))
+#elif ARCH_ARM64
+struct fiber_frame {
+	uint64_t d[8]; /* d8-d15 */
+	uint64_t x[10]; /* x19-x28 */
+	uint64_t fp, lr;
+};
+#define FIBER_FRAME_SET_PC(frame, pc) ((frame)->lr = (pc))
+#else
+#error "lib/fiber has no context switch for this arch"
+#endif
+
+extern void fiber_context_switch(vaddr_t *old_sp, vaddr_t new_sp);
+
+/* every loop made by fiber_loop_create, for the console */
+static struct list_node fiber_loop_list = LIST_INITIAL_VALUE(fiber_loop_list);
+static spin_lock_t fiber_loop_list_lock = SPIN_LOCK_INITIAL_VALUE;
+
+fiber_t *fiber_current(void)
+{
+	fiber_loop_t *loop = (fiber_loop_t *)tls_get(TLS_ENTRY_FIBER);
+
+	/* threads inherit their creator's tls, so check it's really the loop thread */
+	if (!loop || loop->thread != get_current_thread())
+		return NULL;
+
+	return loop->current;
+}
+
+static void fiber_check_stack(fiber_t *f)
+{
+	const uintptr_t *canary = f->stack;
+
+	for (uint i = 0; i < FIBER_STACK_CANARY_WORDS; i++) {
+		if (unlikely(canary[i] != FIBER_STACK_CANARY))
+			panic("fiber %p on loop '%s' overflowed its %zu byte stack\n", f, f->loop->name, f->loop->stack_size);
+	}
+}
+
+/* back to the loop, which picks the next fiber. returns when this one is run again */
+static void fiber_switch_out(fiber_t *f)
+{
+	fiber_check_stack(f);
+	fiber_context_switch(&f->sp, f->loop->loop_sp);
+}
+
+/* loop->lock held. returns true if the loop thread has to be woken */
+static bool fiber_make_ready_locked(fiber_loop_t *loop, fiber_t *f, status_t ret)
+{
+	f->state = FIBER_READY;
+	f->wait_ret = ret;
+	f->blocking_event = NULL;
+	list_add_tail(&loop->run_queue, &f->node);
+
+	if (loop->sleeping) {
+		loop->sleeping = false;
+		return true;
+	}
+	return false;
+}
+
+static enum handler_return fiber_timeout(timer_t *timer, lk_time_t now, void *arg)
+{
+	fiber_t *f = arg;
+	fiber_loop_t *loop = f->loop;
+	bool wake = false;
+
+	spin_lock(&loop->lock);
+
+	/* a callback that lost the race with timer_cancel() from an earlier wait
+	 * finds the fiber ready, or blocked with a later deadline
+	 */
+	if (f->state == FIBER_BLOCKED && current_time_hires() >= f->wait_deadline) {
+		if (f->blocking_event)
+			list_delete(&f->node);
+		wake = fiber_make_ready_locked(loop, f, ERR_TIMED_OUT);
+	}
+
+	spin_unlock(&loop->lock);
+
+	if (wake) {
+		event_signal(&loop->wake, false);
+		return INT_RESCHEDULE;
+	}
+	return INT_NO_RESCHEDULE;
+}
+
+/* loop->lock held, which this drops. the fiber is on an event's waiters, or
+ * on nothing for a plain sleep
+ */
+static status_t fiber_block_locked(fiber_t *f, lk_time_t timeout, spin_lock_saved_state_t state)
+{
+	fiber_loop_t *loop = f->loop;
+
+	f->state = FIBER_BLOCKED;
+	f->wait_ret = NO_ERROR;
+	if (timeout != INFINITE_TIME) {
+		f->wait_deadline = current_time_hires() + timeout * 1000ULL;
+		timer_set_oneshot(&f->timer, timeout, fiber_timeout, f);
+	}
+
+	/* nothing can run the fiber again before it has switched out, only the loop
+	 * thread switches into fibers, so the lock needn't be held across the switch
+	 */
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	fiber_switch_out(f);
+
+	if (timeout != INFINITE_TIME)
+		timer_cancel(&f->timer);
+
+	return f->wait_ret;
+}
+
+static void fiber_trampoline(void) __NO_RETURN;
+static void fiber_trampoline(void)
+{
+	fiber_t *f = fiber_current();
+
+	fiber_exit(f->entry(f->arg));
+}
+
+static fiber_t *fiber_alloc(fiber_loop_t *loop)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+	fiber_t *f = list_remove_head_type(&loop->free_list, fiber_t, node);
+	if (f)
+		loop->free_count--;
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	if (!f) {
+		void *block = memalign(16, loop->stack_size + sizeof(fiber_t));
+		if (!block)
+			return NULL;
+
+		f = (fiber_t *)((uint8_t *)block + loop->stack_size);
+		f->magic = FIBER_MAGIC;
+		f->loop = loop;
+		f->stack = block;
+		timer_initialize(&f->timer);
+
+		uintptr_t *canary = block;
+		for (uint i = 0; i < FIBER_STACK_CANARY_WORDS; i++)
+			canary[i] = FIBER_STACK_CANARY;
+
+		spin_lock_irqsave(&loop->lock, state);
+		loop->allocated++;
+		spin_unlock_irqrestore(&loop->lock, state);
+	}
+
+	return f;
+}
+
+/* from the loop thread, once f has switched out for the last time */
+static void fiber_free(fiber_loop_t *loop, fiber_t *f)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+	loop->live--;
+	bool keep = loop->free_count < loop->max_free;
+	if (keep) {
+		list_add_head(&loop->free_list, &f->node);
+		loop->free_count++;
+	} else {
+		loop->allocated--;
+	}
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	if (!keep) {
+		f->magic = 0;
+		free(f->stack);
+	}
+}
+
+fiber_t *fiber_create(fiber_loop_t *loop, fiber_start_routine entry, void *arg)
+{
+	DEBUG_ASSERT(loop->magic == FIBER_LOOP_MAGIC);
+
+	fiber_t *f = fiber_alloc(loop);
+	if (!f)
+		return NULL;
+
+	f->entry = entry;
+	f->arg = arg;
+	f->blocking_event = NULL;
+	f->wait_ret = NO_ERROR;
+
+	/* a frame for fiber_context_switch() to return into fiber_trampoline() with */
+	vaddr_t stack_top = ROUNDDOWN((vaddr_t)f->stack + loop->stack_size, 16);
+	struct fiber_frame *frame = (struct fiber_frame *)stack_top - 1;
+	memset(frame, 0, sizeof(*frame));
+	FIBER_FRAME_SET_PC(frame, (vaddr_t)&fiber_trampoline);
+	f->sp = (vaddr_t)frame;
+
+	LTRACEF("loop %p fiber %p entry %p arg %p\n", loop, f, entry, arg);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+	loop->live++;
+	loop->created++;
+	bool wake = fiber_make_ready_locked(loop, f, NO_ERROR);
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	if (wake)
+		event_signal(&loop->wake, true);
+
+	return f;
+}
+
+void fiber_yield(void)
+{
+	fiber_t *f = fiber_current();
+	DEBUG_ASSERT(f);
+	fiber_loop_t *loop = f->loop;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+
+	/* nothing else to run, carry on without the round trip through the loop */
+	if (list_is_empty(&loop->run_queue) && !loop->stop) {
+		spin_unlock_irqrestore(&loop->lock, state);
+		return;
+	}
+
+	fiber_make_ready_locked(loop, f, NO_ERROR);
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	fiber_switch_out(f);
+}
+
+void fiber_sleep(lk_time_t delay)
+{
+	fiber_t *f = fiber_current();
+	DEBUG_ASSERT(f);
+
+	if (delay == 0) {
+		fiber_yield();
+		return;
+	}
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&f->loop->lock, state);
+	f->blocking_event = NULL;
+	fiber_block_locked(f, delay, state);
+}
+
+void fiber_exit(int retcode)
+{
+	fiber_t *f = fiber_current();
+	DEBUG_ASSERT(f);
+
+	LTRACEF("fiber %p retcode %d\n", f, retcode);
+
+	/* the loop frees it once it's switched off the stack */
+	f->state = FIBER_DEAD;
+	fiber_switch_out(f);
+
+	panic("dead fiber %p resumed\n", f);
+}
+
+fiber_loop_t *fiber_loop_create(const char *name, size_t stack_size, uint max_free)
+{
+	if (stack_size == 0)
+		stack_size = FIBER_DEFAULT_STACK_SIZE;
+	if (stack_size < FIBER_MIN_STACK_SIZE)
+		return NULL;
+	if (max_free == 0)
+		max_free = FIBER_DEFAULT_MAX_FREE;
+
+	fiber_loop_t *loop = calloc(1, sizeof(fiber_loop_t));
+	if (!loop)
+		return NULL;
+
+	loop->magic = FIBER_LOOP_MAGIC;
+	strlcpy(loop->name, name, sizeof(loop->name));
+	loop->stack_size = ROUNDUP(stack_size, 16);
+	loop->max_free = max_free;
+	spin_lock_init(&loop->lock);
+	list_initialize(&loop->run_queue);
+	list_initialize(&loop->free_list);
+	event_init(&loop->wake, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&fiber_loop_list_lock, state);
+	list_add_tail(&fiber_loop_list, &loop->node);
+	spin_unlock_irqrestore(&fiber_loop_list_lock, state);
+
+	return loop;
+}
+
+status_t fiber_loop_destroy(fiber_loop_t *loop)
+{
+	DEBUG_ASSERT(loop->magic == FIBER_LOOP_MAGIC);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+	if (loop->thread || loop->live) {
+		spin_unlock_irqrestore(&loop->lock, state);
+		return ERR_BUSY;
+	}
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	spin_lock_irqsave(&fiber_loop_list_lock, state);
+	list_delete(&loop->node);
+	spin_unlock_irqrestore(&fiber_loop_list_lock, state);
+
+	fiber_t *f;
+	while ((f = list_remove_head_type(&loop->free_list, fiber_t, node))) {
+		f->magic = 0;
+		free(f->stack);
+	}
+
+	event_destroy(&loop->wake);
+	loop->magic = 0;
+	free(loop);
+
+	return NO_ERROR;
+}
+
+status_t fiber_loop_run(fiber_loop_t *loop)
+{
+	DEBUG_ASSERT(loop->magic == FIBER_LOOP_MAGIC);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+	if (loop->thread) {
+		spin_unlock_irqrestore(&loop->lock, state);
+		return ERR_BUSY;
+	}
+	loop->thread = get_current_thread();
+	loop->stop = false;
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	uintptr_t old_tls = tls_set(TLS_ENTRY_FIBER, (uintptr_t)loop);
+
+	for (;;) {
+		spin_lock_irqsave(&loop->lock, state);
+
+		if (loop->stop) {
+			spin_unlock_irqrestore(&loop->lock, state);
+			break;
+		}
+
+		fiber_t *f = list_remove_head_type(&loop->run_queue, fiber_t, node);
+		if (!f) {
+			if (loop->live == 0) {
+				spin_unlock_irqrestore(&loop->lock, state);
+				break;
+			}
+
+			/* anything that readies a fiber from here on signals wake */
+			loop->sleeping = true;
+			spin_unlock_irqrestore(&loop->lock, state);
+			event_wait(&loop->wake);
+			continue;
+		}
+
+		f->state = FIBER_RUNNING;
+		spin_unlock_irqrestore(&loop->lock, state);
+
+		loop->current = f;
+		loop->switches++;
+		fiber_context_switch(&loop->loop_sp, f->sp);
+		loop->current = NULL;
+
+		if (f->state == FIBER_DEAD)
+			fiber_free(loop, f);
+	}
+
+	tls_set(TLS_ENTRY_FIBER, old_tls);
+
+	spin_lock_irqsave(&loop->lock, state);
+	loop->thread = NULL;
+	loop->sleeping = false;
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	return NO_ERROR;
+}
+
+void fiber_loop_stop(fiber_loop_t *loop)
+{
+	DEBUG_ASSERT(loop->magic == FIBER_LOOP_MAGIC);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+	loop->stop = true;
+	bool wake = loop->sleeping;
+	loop->sleeping = false;
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	if (wake)
+		event_signal(&loop->wake, false);
+}
+
+void fiber_event_init(fiber_event_t *e, fiber_loop_t *loop, bool initial, uint flags)
+{
+	DEBUG_ASSERT(loop->magic == FIBER_LOOP_MAGIC);
+
+	e->magic = FIBER_EVENT_MAGIC;
+	e->signalled = initial;
+	e->flags = flags;
+	e->loop = loop;
+	list_initialize(&e->waiters);
+}
+
+void fiber_event_destroy(fiber_event_t *e)
+{
+	DEBUG_ASSERT(e->magic == FIBER_EVENT_MAGIC);
+	fiber_loop_t *loop = e->loop;
+	bool wake = false;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+
+	fiber_t *f;
+	while ((f = list_remove_head_type(&e->waiters, fiber_t, node)))
+		wake |= fiber_make_ready_locked(loop, f, ERR_OBJECT_DESTROYED);
+
+	e->magic = 0;
+	e->signalled = false;
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	if (wake)
+		event_signal(&loop->wake, false);
+}
+
+status_t fiber_event_wait_timeout(fiber_event_t *e, lk_time_t timeout)
+{
+	DEBUG_ASSERT(e->magic == FIBER_EVENT_MAGIC);
+	fiber_t *f = fiber_current();
+	DEBUG_ASSERT(f && f->loop == e->loop);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&e->loop->lock, state);
+
+	if (e->signalled) {
+		/* signalled, we're going to fall through */
+		if (e->flags & FIBER_EVENT_FLAG_AUTOUNSIGNAL)
+			e->signalled = false;
+		spin_unlock_irqrestore(&e->loop->lock, state);
+		return NO_ERROR;
+	}
+
+	if (timeout == 0) {
+		spin_unlock_irqrestore(&e->loop->lock, state);
+		return ERR_TIMED_OUT;
+	}
+
+	f->blocking_event = e;
+	list_add_tail(&e->waiters, &f->node);
+
+	return fiber_block_locked(f, timeout, state);
+}
+
+status_t fiber_event_signal(fiber_event_t *e)
+{
+	DEBUG_ASSERT(e->magic == FIBER_EVENT_MAGIC);
+	fiber_loop_t *loop = e->loop;
+	bool wake = false;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&loop->lock, state);
+
+	if (!e->signalled) {
+		fiber_t *f;
+		if (e->flags & FIBER_EVENT_FLAG_AUTOUNSIGNAL) {
+			/* release one fiber, or stay signalled for the next to wait */
+			f = list_remove_head_type(&e->waiters, fiber_t, node);
+			if (f)
+				wake = fiber_make_ready_locked(loop, f, NO_ERROR);
+			else
+				e->signalled = true;
+		} else {
+			e->signalled = true;
+			while ((f = list_remove_head_type(&e->waiters, fiber_t, node)))
+				wake |= fiber_make_ready_locked(loop, f, NO_ERROR);
+		}
+	}
+
+	spin_unlock_irqrestore(&loop->lock, state);
+
+	/* no reschedule, this may be interrupt context */
+	if (wake)
+		event_signal(&loop->wake, false);
+
+	return NO_ERROR;
+}
+
+status_t fiber_event_unsignal(fiber_event_t *e)
+{
+	DEBUG_ASSERT(e->magic == FIBER_EVENT_MAGIC);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&e->loop->lock, state);
+	e->signalled = false;
+	spin_unlock_irqrestore(&e->loop->lock, state);
+
+	return NO_ERROR;
+}
+
+#if WITH_LIB_BENCH
+#include <lib/bench.h>
+
+static volatile bool fiber_bench_done;
+
+static int fiber_bench_partner(void *arg)
+{
+	while (!fiber_bench_done)
+		fiber_yield();
+	return 0;
+}
+
+static int fiber_bench_timed(void *arg)
+{
+	struct bench_state *state = arg;
+
+	BENCH_LOOP(state) {
+		fiber_yield();
+	}
+	fiber_bench_done = true;
+	return 0;
+}
+
+/* one iteration is a yield to the partner fiber and its yield back */
+BENCHMARK(fiber_yield_pair)
+{
+	fiber_loop_t *loop = fiber_loop_create("bench", 4096, 2);
+	if (!loop)
+		return;
+
+	fiber_bench_done = false;
+	fiber_create(loop, fiber_bench_timed, state);
+	fiber_create(loop, fiber_bench_partner, NULL);
+	fiber_loop_run(loop);
+	fiber_loop_destroy(loop);
+}
+#endif
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_fiber(int argc, const cmd_args *argv)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&fiber_loop_list_lock, state);
+
+	fiber_loop_t *loop;
+	list_for_every_entry(&fiber_loop_list, loop, fiber_loop_t, node) {
+		printf("fiber loop '%s', thread %p, %zu byte stacks\n",
+		       loop->name, loop->thread, loop->stack_size);
+		printf("\tlive %u allocated %lu free %u created %lu switches %lu\n",
+		       loop->live, loop->allocated, loop->free_count, loop->created, loop->switches);
+	}
+
+	spin_unlock_irqrestore(&fiber_loop_list_lock, state);
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("fiber", "fiber loop statistics", &cmd_fiber)
+STATIC_COMMAND_END(fiber);
+
+#endif
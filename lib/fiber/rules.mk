@@ -0,0 +1,15 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/fiber.c
+
+# the context switch is per arch, along with struct fiber_frame in fiber.c
+ifeq ($(wildcard $(LOCAL_DIR)/arch/$(ARCH)/fiber_switch.S),)
+$(error lib/fiber has no context switch for $(ARCH))
+endif
+MODULE_SRCS += \
+	$(LOCAL_DIR)/arch/$(ARCH)/fiber_switch.S
+
+include make/module.mk
@@ -32,6 +32,10 @@
  */
 
 #include <debug.h>
+#include <assert.h>
+#include <bits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <lib/gfx.h>
 #include <lib/font.h>
 
@@ -59,4 +63,94 @@ void font_draw_char(gfx_surface *surface, unsigned char c, int x, int y, uint32_
 	gfx_flush_rows(surface, y, y + FONT_Y);
 }
 
+#define FONT_GLYPHS 128
 
+struct font_cache {
+	gfx_surface *tiles; // FONT_X wide, a FONT_Y tall tile per glyph
+	uint32_t color;
+	uint32_t back_color;
+	unsigned long rendered[BITMAP_NUM_WORDS(FONT_GLYPHS)];
+};
+
+/**
+ * @brief Create a cache of glyph tiles for surfaces of one format
+ *
+ * @ingroup graphics
+ */
+struct font_cache *font_cache_create(gfx_format format, uint32_t color, uint32_t back_color)
+{
+	struct font_cache *cache = calloc(1, sizeof(struct font_cache));
+	if (!cache)
+		return NULL;
+
+	cache->tiles = gfx_create_surface(NULL, FONT_X, FONT_Y * FONT_GLYPHS, FONT_X, format);
+	if (!cache->tiles) {
+		free(cache);
+		return NULL;
+	}
+	cache->color = color;
+	cache->back_color = back_color;
+
+	return cache;
+}
+
+void font_cache_destroy(struct font_cache *cache)
+{
+	gfx_surface_destroy(cache->tiles);
+	free(cache);
+}
+
+static void font_cache_render(struct font_cache *cache, unsigned char c)
+{
+	uint i, j;
+	uint line;
+	uint y = c * FONT_Y;
+
+	gfx_fillrect(cache->tiles, 0, y, FONT_X, FONT_Y, cache->back_color);
+	for (i = 0; i < FONT_Y; i++) {
+		line = FONT[c * FONT_Y + i];
+		for (j = 0; j < FONT_X; j++) {
+			if (line & 0x1)
+				gfx_putpixel(cache->tiles, j, y + i, cache->color);
+			line = line >> 1;
+		}
+	}
+
+	bitmap_set(cache->rendered, c);
+}
+
+/**
+ * @brief Draw one character cell from a glyph cache
+ *
+ * The surface has to be the format the cache was created for. The cell is
+ * clipped to the surface and marked dirty, but not flushed.
+ *
+ * @ingroup graphics
+ */
+void font_draw_char_cached(gfx_surface *surface, struct font_cache *cache, unsigned char c, int x, int y)
+{
+	DEBUG_ASSERT(surface->format == cache->tiles->format);
+
+	if (c >= FONT_GLYPHS)
+		c = ' ';
+	if (x < 0 || y < 0 || (uint)x >= surface->width || (uint)y >= surface->height)
+		return;
+
+	if (!bitmap_test(cache->rendered, c))
+		font_cache_render(cache, c);
+
+	uint width = MIN(FONT_X, surface->width - x);
+	uint height = MIN(FONT_Y, surface->height - y);
+	size_t pitch = surface->stride * surface->pixelsize;
+	size_t tile_pitch = cache->tiles->stride * cache->tiles->pixelsize;
+	const uint8_t *src = (const uint8_t *)cache->tiles->ptr + c * FONT_Y * tile_pitch;
+	uint8_t *dest = (uint8_t *)surface->ptr + y * pitch + x * surface->pixelsize;
+
+	for (uint i = 0; i < height; i++) {
+		memcpy(dest, src, width * surface->pixelsize);
+		dest += pitch;
+		src += tile_pitch;
+	}
+
+	gfx_surface_mark_dirty(surface, x, y, width, height);
+}
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/fs/cache.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/mutex.h>
+
+#define LOCAL_TRACE 0
+
+struct fs_icache_entry {
+	struct list_node lru_node;
+	struct list_node hash_node;
+	fs_ino_t ino;
+	bool valid;
+	uint8_t inode[];
+};
+
+struct fs_dcache_entry {
+	struct list_node lru_node;
+	struct list_node hash_node;
+	fs_ino_t dir;
+	fs_ino_t ino; // 0 for a negative entry
+	uint32_t hash;
+	uint8_t namelen; // 0 if the slot is unused
+	char name[FS_DCACHE_NAME_MAX];
+};
+
+struct fs_cache {
+	struct list_node node;
+	const char *name;
+	size_t inode_size;
+
+	/* everything below is protected by lock */
+	mutex_t lock;
+
+	/* most recently used at the head, every entry is always on its lru */
+	struct list_node ilru;
+	struct list_node dlru;
+	struct list_node *ihash;
+	struct list_node *dhash;
+	uint ihash_mask;
+	uint dhash_mask;
+
+	uint8_t *inodes;
+	struct fs_dcache_entry *dentries;
+	size_t ientry_size;
+
+	/* stats */
+	ulong ihits;
+	ulong imisses;
+	ulong dhits;
+	ulong dmisses;
+	ulong negative_hits;
+};
+
+static struct list_node fs_cache_list = LIST_INITIAL_VALUE(fs_cache_list);
+static mutex_t fs_cache_list_lock = MUTEX_INITIAL_VALUE(fs_cache_list_lock);
+
+/* smallest power of two at least count, minus one */
+static uint hash_mask(uint count)
+{
+	uint size = 1;
+	while (size < count)
+		size <<= 1;
+	return size - 1;
+}
+
+static uint32_t name_hash(fs_ino_t dir, const char *name, size_t namelen)
+{
+	/* fnv-1a, seeded with the directory */
+	uint32_t hash = 2166136261u ^ (uint32_t)dir ^ (uint32_t)(dir >> 32);
+	for (size_t i = 0; i < namelen; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline struct fs_icache_entry *icache_entry(fs_cache_t *cache, uint i)
+{
+	return (struct fs_icache_entry *)(cache->inodes + i * cache->ientry_size);
+}
+
+fs_cache_t *fs_cache_create(const char *name, size_t inode_size, uint inode_count, uint dentry_count)
+{
+	DEBUG_ASSERT(inode_count > 0 && dentry_count > 0);
+
+	fs_cache_t *cache = calloc(1, sizeof(fs_cache_t));
+	if (!cache)
+		return NULL;
+
+	cache->name = name;
+	cache->inode_size = inode_size;
+	cache->ientry_size = ROUNDUP(sizeof(struct fs_icache_entry) + inode_size, sizeof(void *));
+	mutex_init(&cache->lock);
+	list_initialize(&cache->ilru);
+	list_initialize(&cache->dlru);
+
+	cache->ihash_mask = hash_mask(inode_count);
+	cache->dhash_mask = hash_mask(dentry_count);
+	cache->ihash = malloc(sizeof(struct list_node) * (cache->ihash_mask + 1));
+	cache->dhash = malloc(sizeof(struct list_node) * (cache->dhash_mask + 1));
+	cache->inodes = calloc(inode_count, cache->ientry_size);
+	cache->dentries = calloc(dentry_count, sizeof(struct fs_dcache_entry));
+	if (!cache->ihash || !cache->dhash || !cache->inodes || !cache->dentries) {
+		free(cache->ihash);
+		free(cache->dhash);
+		free(cache->inodes);
+		free(cache->dentries);
+		free(cache);
+		return NULL;
+	}
+
+	for (uint i = 0; i <= cache->ihash_mask; i++)
+		list_initialize(&cache->ihash[i]);
+	for (uint i = 0; i <= cache->dhash_mask; i++)
+		list_initialize(&cache->dhash[i]);
+
+	/* unused entries sit on the lru off any hash chain, so they're taken first */
+	for (uint i = 0; i < inode_count; i++)
+		list_add_tail(&cache->ilru, &icache_entry(cache, i)->lru_node);
+	for (uint i = 0; i < dentry_count; i++)
+		list_add_tail(&cache->dlru, &cache->dentries[i].lru_node);
+
+	mutex_acquire(&fs_cache_list_lock);
+	list_add_tail(&fs_cache_list, &cache->node);
+	mutex_release(&fs_cache_list_lock);
+
+	return cache;
+}
+
+void fs_cache_destroy(fs_cache_t *cache)
+{
+	if (!cache)
+		return;
+
+	mutex_acquire(&fs_cache_list_lock);
+	list_delete(&cache->node);
+	mutex_release(&fs_cache_list_lock);
+
+	mutex_destroy(&cache->lock);
+	free(cache->ihash);
+	free(cache->dhash);
+	free(cache->inodes);
+	free(cache->dentries);
+	free(cache);
+}
+
+static struct fs_icache_entry *icache_find(fs_cache_t *cache, fs_ino_t ino)
+{
+	struct fs_icache_entry *entry;
+	list_for_every_entry(&cache->ihash[ino & cache->ihash_mask], entry, struct fs_icache_entry, hash_node) {
+		if (entry->ino == ino)
+			return entry;
+	}
+	return NULL;
+}
+
+static void icache_drop(struct fs_icache_entry *entry)
+{
+	if (entry->valid) {
+		list_delete(&entry->hash_node);
+		entry->valid = false;
+	}
+}
+
+bool fs_icache_lookup(fs_cache_t *cache, fs_ino_t ino, void *inode)
+{
+	mutex_acquire(&cache->lock);
+
+	struct fs_icache_entry *entry = icache_find(cache, ino);
+	if (entry) {
+		memcpy(inode, entry->inode, cache->inode_size);
+		list_delete(&entry->lru_node);
+		list_add_head(&cache->ilru, &entry->lru_node);
+		cache->ihits++;
+	} else {
+		cache->imisses++;
+	}
+
+	mutex_release(&cache->lock);
+
+	LTRACEF("cache %p ino %llu: %s\n", cache, ino, entry ? "hit" : "miss");
+
+	return entry != NULL;
+}
+
+void fs_icache_insert(fs_cache_t *cache, fs_ino_t ino, const void *inode)
+{
+	mutex_acquire(&cache->lock);
+
+	struct fs_icache_entry *entry = icache_find(cache, ino);
+	if (!entry) {
+		entry = list_peek_tail_type(&cache->ilru, struct fs_icache_entry, lru_node);
+		icache_drop(entry);
+
+		entry->ino = ino;
+		entry->valid = true;
+		list_add_head(&cache->ihash[ino & cache->ihash_mask], &entry->hash_node);
+	}
+
+	memcpy(entry->inode, inode, cache->inode_size);
+	list_delete(&entry->lru_node);
+	list_add_head(&cache->ilru, &entry->lru_node);
+
+	mutex_release(&cache->lock);
+}
+
+static struct fs_dcache_entry *dcache_find(fs_cache_t *cache, uint32_t hash, fs_ino_t dir,
+                                           const char *name, size_t namelen)
+{
+	struct fs_dcache_entry *entry;
+	list_for_every_entry(&cache->dhash[hash & cache->dhash_mask], entry, struct fs_dcache_entry, hash_node) {
+		if (entry->hash == hash && entry->dir == dir && entry->namelen == namelen &&
+		        memcmp(entry->name, name, namelen) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static void dcache_drop(struct fs_dcache_entry *entry)
+{
+	if (entry->namelen) {
+		list_delete(&entry->hash_node);
+		entry->namelen = 0;
+	}
+}
+
+bool fs_dcache_lookup(fs_cache_t *cache, fs_ino_t dir, const char *name, size_t namelen, fs_ino_t *ino)
+{
+	if (namelen == 0 || namelen > FS_DCACHE_NAME_MAX)
+		return false;
+
+	uint32_t hash = name_hash(dir, name, namelen);
+
+	mutex_acquire(&cache->lock);
+
+	struct fs_dcache_entry *entry = dcache_find(cache, hash, dir, name, namelen);
+	if (entry) {
+		*ino = entry->ino;
+		list_delete(&entry->lru_node);
+		list_add_head(&cache->dlru, &entry->lru_node);
+		cache->dhits++;
+		if (entry->ino == 0)
+			cache->negative_hits++;
+	} else {
+		cache->dmisses++;
+	}
+
+	mutex_release(&cache->lock);
+
+	return entry != NULL;
+}
+
+void fs_dcache_insert(fs_cache_t *cache, fs_ino_t dir, const char *name, size_t namelen, fs_ino_t ino)
+{
+	if (namelen == 0 || namelen > FS_DCACHE_NAME_MAX)
+		return;
+
+	uint32_t hash = name_hash(dir, name, namelen);
+
+	mutex_acquire(&cache->lock);
+
+	struct fs_dcache_entry *entry = dcache_find(cache, hash, dir, name, namelen);
+	if (!entry) {
+		entry = list_peek_tail_type(&cache->dlru, struct fs_dcache_entry, lru_node);
+		dcache_drop(entry);
+
+		entry->dir = dir;
+		entry->hash = hash;
+		entry->namelen = namelen;
+		memcpy(entry->name, name, namelen);
+		list_add_head(&cache->dhash[hash & cache->dhash_mask], &entry->hash_node);
+	}
+
+	entry->ino = ino;
+	list_delete(&entry->lru_node);
+	list_add_head(&cache->dlru, &entry->lru_node);
+
+	mutex_release(&cache->lock);
+}
+
+void fs_cache_invalidate(fs_cache_t *cache, fs_ino_t ino)
+{
+	mutex_acquire(&cache->lock);
+
+	struct fs_icache_entry *ientry = icache_find(cache, ino);
+	if (ientry) {
+		icache_drop(ientry);
+		list_delete(&ientry->lru_node);
+		list_add_tail(&cache->ilru, &ientry->lru_node);
+	}
+
+	/* entries are hashed by name, so this has to look at all of them */
+	struct fs_dcache_entry *dentry, *temp;
+	list_for_every_entry_safe(&cache->dlru, dentry, temp, struct fs_dcache_entry, lru_node) {
+		if (dentry->namelen && (dentry->dir == ino || dentry->ino == ino)) {
+			dcache_drop(dentry);
+			list_delete(&dentry->lru_node);
+			list_add_tail(&cache->dlru, &dentry->lru_node);
+		}
+	}
+
+	mutex_release(&cache->lock);
+}
+
+void fs_cache_dump(fs_cache_t *cache)
+{
+	mutex_acquire(&cache->lock);
+
+	uint inodes = 0, dentries = 0, negative = 0;
+	struct fs_icache_entry *ientry;
+	list_for_every_entry(&cache->ilru, ientry, struct fs_icache_entry, lru_node) {
+		if (ientry->valid)
+			inodes++;
+	}
+	struct fs_dcache_entry *dentry;
+	list_for_every_entry(&cache->dlru, dentry, struct fs_dcache_entry, lru_node) {
+		if (dentry->namelen) {
+			dentries++;
+			if (dentry->ino == 0)
+				negative++;
+		}
+	}
+
+	printf("fs cache '%s': %u inodes, %u dentries (%u negative)\n", cache->name, inodes, dentries, negative);
+	printf("\tinode hits %lu misses %lu, dentry hits %lu (%lu negative) misses %lu\n",
+	       cache->ihits, cache->imisses, cache->dhits, cache->negative_hits, cache->dmisses);
+
+	mutex_release(&cache->lock);
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_fscache(int argc, const cmd_args *argv)
+{
+	mutex_acquire(&fs_cache_list_lock);
+
+	fs_cache_t *cache;
+	list_for_every_entry(&fs_cache_list, cache, fs_cache_t, node)
+		fs_cache_dump(cache);
+
+	mutex_release(&fs_cache_list_lock);
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("fscache", "inode and directory entry cache statistics", &cmd_fscache)
+STATIC_COMMAND_END(fscache);
+
+#endif
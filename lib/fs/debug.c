@@ -38,9 +38,6 @@ STATIC_COMMAND("fs", "fs debug commands", &cmd_fs)
 STATIC_COMMAND_END(fs);
 
 extern int fs_mount_type(const char *path, const char *device, const char *name);
-extern int fs_create_file(const char *path, filecookie *fcookie);
-extern int fs_make_dir(const char *path);
-extern int fs_write_file(filecookie fcookie, const void *buf, off_t offset, size_t len);
 
 static int cmd_fs(int argc, const cmd_args *argv)
 {
@@ -56,6 +53,7 @@ usage:
 		printf("%s mkdir <path>\n", argv[0].str);
 		printf("%s read <path> [<offset>] [<len>]\n", argv[0].str);
 		printf("%s write <path> <string> [<offset>]\n", argv[0].str);
+		printf("%s truncate <path> <len>\n", argv[0].str);
 		printf("%s stat <file>\n", argv[0].str);
 		return -1;
 	}
@@ -197,6 +195,27 @@ usage:
 			return err;
 		}
 
+		fs_close_file(cookie);
+	} else if (!strcmp(argv[1].str, "truncate")) {
+		int err;
+		filecookie cookie;
+
+		if (argc < 4)
+			goto notenoughargs;
+
+		err = fs_open_file(argv[2].str, &cookie);
+		if (err < 0) {
+			printf("error %d opening file\n", err);
+			return err;
+		}
+
+		err = fs_truncate_file(cookie, argv[3].u);
+		if (err < 0) {
+			printf("error %d truncating file\n", err);
+			fs_close_file(cookie);
+			return err;
+		}
+
 		fs_close_file(cookie);
 	} else if (!strcmp(argv[1].str, "stat")) {
 		int err;
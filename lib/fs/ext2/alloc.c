@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <debug.h>
+#include <trace.h>
+#include <lib/fs/ext2.h>
+#include "ext2_priv.h"
+
+#define LOCAL_TRACE 0
+
+static inline bool bitmap_test(const uint8_t *bitmap, uint bit)
+{
+	return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void bitmap_set(uint8_t *bitmap, uint bit)
+{
+	bitmap[bit / 8] |= (1 << (bit % 8));
+}
+
+static inline void bitmap_clear(uint8_t *bitmap, uint bit)
+{
+	bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+static int load_bitmap(ext2_t *ext2, blocknum_t bnum, uint8_t **bitmap)
+{
+	if (*bitmap)
+		return 0;
+
+	uint8_t *buf = malloc(EXT2_BLOCK_SIZE(ext2->sb));
+	if (!buf)
+		return ERR_NO_MEMORY;
+
+	int err = ext2_read_block(ext2, buf, bnum);
+	if (err < 0) {
+		free(buf);
+		return err;
+	}
+
+	*bitmap = buf;
+	return 0;
+}
+
+/* blocks in a group, the last one is usually short */
+static uint group_block_count(ext2_t *ext2, groupnum_t group)
+{
+	uint32_t start = ext2->sb.s_first_data_block + group * ext2->sb.s_blocks_per_group;
+
+	return MIN(ext2->sb.s_blocks_per_group, ext2->sb.s_blocks_count - start);
+}
+
+int ext2_alloc_blocks(ext2_t *ext2, blocknum_t goal, uint count, blocknum_t *start)
+{
+	DEBUG_ASSERT(count > 0);
+
+	if (goal < ext2->sb.s_first_data_block || goal >= ext2->sb.s_blocks_count)
+		goal = ext2->sb.s_first_data_block;
+
+	groupnum_t goal_group = (goal - ext2->sb.s_first_data_block) / ext2->sb.s_blocks_per_group;
+	uint goal_bit = (goal - ext2->sb.s_first_data_block) % ext2->sb.s_blocks_per_group;
+
+	/* start at the goal, then try every other group in turn, coming back around to the
+	 * part of the goal's group before the goal last */
+	for (int i = 0; i <= ext2->s_group_count; i++) {
+		groupnum_t group = (goal_group + i) % ext2->s_group_count;
+		if (ext2->gd[group].bg_free_blocks_count == 0)
+			continue;
+
+		struct ext2_group *g = &ext2->groups[group];
+		int err = load_bitmap(ext2, ext2->gd[group].bg_block_bitmap, &g->block_bitmap);
+		if (err < 0)
+			return err;
+
+		uint blocks = group_block_count(ext2, group);
+		uint bit = (i == 0) ? goal_bit : 0;
+		while (bit < blocks && bitmap_test(g->block_bitmap, bit))
+			bit++;
+		if (bit == blocks)
+			continue;
+
+		uint run = 0;
+		while (run < count && bit + run < blocks && !bitmap_test(g->block_bitmap, bit + run)) {
+			bitmap_set(g->block_bitmap, bit + run);
+			run++;
+		}
+
+		ext2->gd[group].bg_free_blocks_count -= run;
+		ext2->sb.s_free_blocks_count -= run;
+		g->block_bitmap_dirty = true;
+		g->desc_dirty = true;
+		ext2->sb_dirty = true;
+
+		*start = ext2->sb.s_first_data_block + group * ext2->sb.s_blocks_per_group + bit;
+
+		LTRACEF("goal %u count %u: got %u at %u\n", goal, count, run, *start);
+
+		return run;
+	}
+
+	return ERR_NO_RESOURCES;
+}
+
+void ext2_free_blocks(ext2_t *ext2, blocknum_t start, uint count)
+{
+	LTRACEF("start %u count %u\n", start, count);
+
+	/* nobody should be looking at them anymore, and writing them back is a waste */
+	bcache_discard(ext2->cache, start, count);
+
+	for (uint i = 0; i < count; i++) {
+		blocknum_t block = start + i;
+		groupnum_t group = (block - ext2->sb.s_first_data_block) / ext2->sb.s_blocks_per_group;
+		uint bit = (block - ext2->sb.s_first_data_block) % ext2->sb.s_blocks_per_group;
+
+		struct ext2_group *g = &ext2->groups[group];
+		if (load_bitmap(ext2, ext2->gd[group].bg_block_bitmap, &g->block_bitmap) < 0) {
+			TRACEF("couldn't load the bitmap for group %u, leaking block %u\n", group, block);
+			continue;
+		}
+
+		if (!bitmap_test(g->block_bitmap, bit)) {
+			TRACEF("freeing free block %u\n", block);
+			continue;
+		}
+
+		bitmap_clear(g->block_bitmap, bit);
+		ext2->gd[group].bg_free_blocks_count++;
+		ext2->sb.s_free_blocks_count++;
+		g->block_bitmap_dirty = true;
+		g->desc_dirty = true;
+		ext2->sb_dirty = true;
+	}
+}
+
+int ext2_alloc_inode(ext2_t *ext2, groupnum_t goal, bool is_dir, inodenum_t *inum)
+{
+	for (int i = 0; i < ext2->s_group_count; i++) {
+		groupnum_t group = (goal + i) % ext2->s_group_count;
+		if (ext2->gd[group].bg_free_inodes_count == 0)
+			continue;
+
+		struct ext2_group *g = &ext2->groups[group];
+		int err = load_bitmap(ext2, ext2->gd[group].bg_inode_bitmap, &g->inode_bitmap);
+		if (err < 0)
+			return err;
+
+		/* the reserved inodes at the start of group 0 are set in the bitmap already,
+		 * but don't trust it with them */
+		uint bit = (group == 0) ? EXT2_FIRST_INO(ext2->sb) - 1 : 0;
+		while (bit < ext2->sb.s_inodes_per_group && bitmap_test(g->inode_bitmap, bit))
+			bit++;
+		if (bit == ext2->sb.s_inodes_per_group)
+			continue;
+
+		bitmap_set(g->inode_bitmap, bit);
+		ext2->gd[group].bg_free_inodes_count--;
+		if (is_dir)
+			ext2->gd[group].bg_used_dirs_count++;
+		ext2->sb.s_free_inodes_count--;
+		g->inode_bitmap_dirty = true;
+		g->desc_dirty = true;
+		ext2->sb_dirty = true;
+
+		*inum = group * ext2->sb.s_inodes_per_group + bit + 1;
+
+		LTRACEF("goal group %u: inode %u\n", goal, *inum);
+
+		return 0;
+	}
+
+	return ERR_NO_RESOURCES;
+}
+
+void ext2_free_inode(ext2_t *ext2, inodenum_t inum, bool is_dir)
+{
+	groupnum_t group = (inum - 1) / ext2->sb.s_inodes_per_group;
+	uint bit = (inum - 1) % ext2->sb.s_inodes_per_group;
+
+	struct ext2_group *g = &ext2->groups[group];
+	if (load_bitmap(ext2, ext2->gd[group].bg_inode_bitmap, &g->inode_bitmap) < 0)
+		return;
+
+	if (!bitmap_test(g->inode_bitmap, bit))
+		return;
+
+	bitmap_clear(g->inode_bitmap, bit);
+	ext2->gd[group].bg_free_inodes_count++;
+	if (is_dir)
+		ext2->gd[group].bg_used_dirs_count--;
+	ext2->sb.s_free_inodes_count++;
+	g->inode_bitmap_dirty = true;
+	g->desc_dirty = true;
+	ext2->sb_dirty = true;
+}
+
+int ext2_begin_write(ext2_t *ext2)
+{
+	if (!ext2->writable)
+		return ERR_NOT_ALLOWED;
+
+	if (ext2->modified)
+		return 0;
+
+	/* get the superblock marked not clean on the disk first, so that if we don't
+	 * make it to unmount the next mount knows to check it */
+	ext2->was_clean = ext2->sb.s_state & EXT2_VALID_FS;
+	ext2->sb.s_state &= ~EXT2_VALID_FS;
+
+	int err = ext2_write_super(ext2);
+	if (err >= 0)
+		err = bcache_flush(ext2->cache);
+	if (err < 0)
+		return err;
+
+	ext2->modified = true;
+	return 0;
+}
+
+int ext2_commit(ext2_t *ext2)
+{
+	int err;
+
+	LTRACEF("ext2 %p\n", ext2);
+
+	/* the bitmaps and descriptors go into the cache, it writes them back along with everything else */
+	for (int i = 0; i < ext2->s_group_count; i++) {
+		struct ext2_group *g = &ext2->groups[i];
+
+		if (g->block_bitmap_dirty) {
+			err = ext2_write_block(ext2, g->block_bitmap, ext2->gd[i].bg_block_bitmap);
+			if (err < 0)
+				return err;
+			g->block_bitmap_dirty = false;
+		}
+		if (g->inode_bitmap_dirty) {
+			err = ext2_write_block(ext2, g->inode_bitmap, ext2->gd[i].bg_inode_bitmap);
+			if (err < 0)
+				return err;
+			g->inode_bitmap_dirty = false;
+		}
+		if (g->desc_dirty) {
+			err = ext2_write_group_desc(ext2, i);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	if (ext2->sb_dirty) {
+		err = ext2_write_super(ext2);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+void ext2_free_groups(ext2_t *ext2)
+{
+	if (!ext2->groups)
+		return;
+
+	for (int i = 0; i < ext2->s_group_count; i++) {
+		free(ext2->groups[i].block_bitmap);
+		free(ext2->groups[i].inode_bitmap);
+	}
+	free(ext2->groups);
+	ext2->groups = NULL;
+}
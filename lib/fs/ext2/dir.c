@@ -31,7 +31,7 @@
 #define LOCAL_TRACE 0
 
 /* read in the dir, look for the entry */
-static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const char *name, inodenum_t *inum)
+static int ext2_dir_lookup(ext2_t *ext2, inodenum_t dir_inum, struct ext2_inode *dir_inode, const char *name, inodenum_t *inum)
 {
 	uint file_blocknum;
 	int err;
@@ -41,15 +41,29 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 	if (!S_ISDIR(dir_inode->i_mode))
 		return ERR_NOT_DIR;
 
+	fs_ino_t cached;
+	if (ext2->fs_cache && fs_dcache_lookup(ext2->fs_cache, dir_inum, name, namelen, &cached)) {
+		if (cached == 0)
+			return ERR_NOT_FOUND;
+		*inum = cached;
+		return 1;
+	}
+
 	buf = malloc(EXT2_BLOCK_SIZE(ext2->sb));
 
 	file_blocknum = 0;
 	for (;;) {
 		/* read in the offset */
-		err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+		err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb), NULL);
 		if (err <= 0) {
 			free(buf);
-			return -1;
+			if (err < 0)
+				return -1;
+
+			/* ran off the end of the directory, remember it isn't there */
+			if (ext2->fs_cache)
+				fs_dcache_insert(ext2->fs_cache, dir_inum, name, namelen, 0);
+			return ERR_NOT_FOUND;
 		}
 
 		/* walk through the directory entries, looking for the one that matches */
@@ -70,6 +84,8 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 				*inum = LE32(ent->inode);
 				LTRACEF("match: inode %d\n", *inum);
 				free(buf);
+				if (ext2->fs_cache)
+					fs_dcache_insert(ext2->fs_cache, dir_inum, name, namelen, *inum);
 				return 1;
 			}
 
@@ -87,15 +103,16 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 }
 
 /* note, trashes path */
-static int ext2_walk(ext2_t *ext2, char *path, struct ext2_inode *start_inode, inodenum_t *inum, int recurse)
+static int ext2_walk(ext2_t *ext2, char *path, inodenum_t start_inum, inodenum_t *inum, int recurse)
 {
 	char *ptr;
 	struct ext2_inode inode;
 	struct ext2_inode dir_inode;
+	inodenum_t dir_inum;
 	int err;
 	bool done;
 
-	LTRACEF("path '%s', start_inode %p, inum %p, recurse %d\n", path, start_inode, inum, recurse);
+	LTRACEF("path '%s', start_inum %u, inum %p, recurse %d\n", path, start_inum, inum, recurse);
 
 	if (recurse > 4)
 		return ERR_RECURSE_TOO_DEEP;
@@ -105,8 +122,12 @@ static int ext2_walk(ext2_t *ext2, char *path, struct ext2_inode *start_inode, i
 	while (*ptr == '/')
 		ptr++;
 
+	dir_inum = start_inum;
+	err = ext2_load_inode(ext2, dir_inum, &dir_inode);
+	if (err < 0)
+		return err;
+
 	done = false;
-	memcpy(&dir_inode, start_inode, sizeof(struct ext2_inode));
 	while (!done) {
 		/* process the first component */
 		char *next_sep = strchr(ptr, '/');
@@ -121,7 +142,7 @@ static int ext2_walk(ext2_t *ext2, char *path, struct ext2_inode *start_inode, i
 		LTRACEF("component '%s', done %d\n", ptr, done);
 
 		/* do the lookup on this component */
-		err = ext2_dir_lookup(ext2, &dir_inode, ptr, inum);
+		err = ext2_dir_lookup(ext2, dir_inum, &dir_inode, ptr, inum);
 		if (err < 0)
 			return err;
 
@@ -148,9 +169,9 @@ nextcomponent:
 			/* recurse, parsing the link */
 			if (link[0] == '/') {
 				/* link starts with '/', so start over again at the rootfs */
-				err = ext2_walk(ext2, link, &ext2->root_inode, inum, recurse + 1);
+				err = ext2_walk(ext2, link, EXT2_ROOT_INO, inum, recurse + 1);
 			} else {
-				err = ext2_walk(ext2, link, &dir_inode, inum, recurse + 1);
+				err = ext2_walk(ext2, link, dir_inum, inum, recurse + 1);
 			}
 
 			LTRACEF("recursive walk returns %d\n", err);
@@ -165,6 +186,7 @@ nextcomponent:
 		} else if (S_ISDIR(inode.i_mode)) {
 			/* for the next cycle, point the dir inode at our new directory */
 			memcpy(&dir_inode, &inode, sizeof(struct ext2_inode));
+			dir_inum = *inum;
 		} else {
 			if (!done) {
 				/* we aren't done and this walked over a nondir, abort */
@@ -194,6 +216,6 @@ int ext2_lookup(ext2_t *ext2, const char *_path, inodenum_t *inum)
 	char path[512];
 	strlcpy(path, _path, sizeof(path));
 
-	return ext2_walk(ext2, path, &ext2->root_inode, inum, 1);
+	return ext2_walk(ext2, path, EXT2_ROOT_INO, inum, 1);
 }
 
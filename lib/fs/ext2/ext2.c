@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <debug.h>
@@ -69,6 +70,7 @@ static void endian_swap_superblock(struct ext2_super_block *sb)
 	LE32SWAP(sb->s_journal_inum);
 	LE32SWAP(sb->s_journal_dev);
 	LE32SWAP(sb->s_last_orphan);
+	LE16SWAP(sb->s_desc_size);
 	LE32SWAP(sb->s_default_mount_opts);
 	LE32SWAP(sb->s_first_meta_bg);
 }
@@ -114,7 +116,7 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 
 	LTRACEF("dev %p\n", dev);
 
-	ext2_t *ext2 = malloc(sizeof(ext2_t));
+	ext2_t *ext2 = calloc(1, sizeof(ext2_t));
 	ext2->dev = dev;
 
 	err = bio_read(dev, &ext2->sb, 1024, sizeof(struct ext2_super_block));
@@ -126,7 +128,7 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 	/* see if the superblock is good */
 	if (ext2->sb.s_magic != EXT2_SUPER_MAGIC) {
 		err = -1;
-		return err;
+		goto err;
 	}
 
 	/* calculate group count, rounded up */
@@ -147,25 +149,41 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 	/* we only support dynamic revs */
 	if (ext2->sb.s_rev_level > EXT2_DYNAMIC_REV) {
 		err = -2;
-		return err;
+		goto err;
 	}
 
-	/* make sure it doesn't have any ro features we don't support */
-	if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+	/* ro compat features only matter to writers, but anything incompatible we don't know has to go */
+	if (ext2->sb.s_feature_incompat & ~EXT2_INCOMPAT_READ_SUPP) {
 		err = -3;
-		return err;
+		goto err;
+	}
+
+	/* 64 bit filesystems have bigger group descriptors, we only look at the 32 bit part */
+	size_t desc_size = sizeof(struct ext2_group_desc);
+	if (ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		desc_size = ext2->sb.s_desc_size;
+		if (desc_size < sizeof(struct ext2_group_desc)) {
+			err = -3;
+			goto err;
+		}
 	}
 
-	/* read in all the group descriptors */
+	/* read in all the group descriptors, they start in the block after the superblock */
 	ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
-	err = bio_read(ext2->dev, (void *)ext2->gd,
-	               (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
-	               sizeof(struct ext2_group_desc) * ext2->s_group_count);
+	uint8_t *gd_buf = malloc(desc_size * ext2->s_group_count);
+	err = bio_read(ext2->dev, gd_buf,
+	               (off_t)(ext2->sb.s_first_data_block + 1) * EXT2_BLOCK_SIZE(ext2->sb),
+	               desc_size * ext2->s_group_count);
 	if (err < 0) {
+		free(gd_buf);
 		err = -4;
 		return err;
 	}
 
+	for (int i = 0; i < ext2->s_group_count; i++)
+		memcpy(&ext2->gd[i], gd_buf + i * desc_size, sizeof(struct ext2_group_desc));
+	free(gd_buf);
+
 	int i;
 	for (i=0; i < ext2->s_group_count; i++) {
 		endian_swap_group_desc(&ext2->gd[i]);
@@ -179,7 +197,17 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 	}
 
 	/* initialize the block cache */
-	ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 4);
+	ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), EXT2_CACHE_BLOCKS);
+
+	/* anything the writer doesn't know how to keep consistent makes it a read only mount */
+	ext2->writable = !(ext2->sb.s_feature_incompat & ~EXT2_INCOMPAT_WRITE_SUPP) &&
+	                 !(ext2->sb.s_feature_ro_compat & ~EXT2_RO_COMPAT_WRITE_SUPP);
+	mutex_init(&ext2->lock);
+	ext2->groups = calloc(ext2->s_group_count, sizeof(struct ext2_group));
+	LTRACEF("writable %d\n", ext2->writable);
+
+	/* lookups still work without it, just slower */
+	ext2->fs_cache = fs_cache_create("ext2", sizeof(struct ext2_inode), EXT2_INODE_CACHE_SIZE, EXT2_DENTRY_CACHE_SIZE);
 
 	/* load the first inode */
 	err = ext2_load_inode(ext2, EXT2_ROOT_INO, &ext2->root_inode);
@@ -204,7 +232,23 @@ int ext2_unmount(fscookie cookie)
 	// free it up
 	ext2_t *ext2 = (ext2_t *)cookie;
 
+	/* write everything back, marking the filesystem clean again if it was when we found it */
+	mutex_acquire(&ext2->lock);
+	if (ext2->modified) {
+		if (ext2->was_clean) {
+			ext2->sb.s_state |= EXT2_VALID_FS;
+			ext2->sb_dirty = true;
+		}
+		ext2_commit(ext2);
+		bcache_flush(ext2->cache);
+	}
+	mutex_release(&ext2->lock);
+
+	ext2_free_groups(ext2);
+	mutex_destroy(&ext2->lock);
+	fs_cache_destroy(ext2->fs_cache);
 	bcache_destroy(ext2->cache);
+	free(ext2->zero_block);
 	free(ext2->gd);
 	free(ext2);
 
@@ -232,6 +276,9 @@ int ext2_load_inode(ext2_t *ext2, inodenum_t num, struct ext2_inode *inode)
 
 	LTRACEF("num %d, inode %p\n", num, inode);
 
+	if (ext2->fs_cache && fs_icache_lookup(ext2->fs_cache, num, inode))
+		return 0;
+
 	blocknum_t bnum;
 	size_t block_offset;
 	get_inode_addr(ext2, num, &bnum, &block_offset);
@@ -253,8 +300,107 @@ int ext2_load_inode(ext2_t *ext2, inodenum_t num, struct ext2_inode *inode)
 	/* endian swap it */
 	endian_swap_inode(inode);
 
+	if (ext2->fs_cache)
+		fs_icache_insert(ext2->fs_cache, num, inode);
+
 	LTRACEF("read inode: mode 0x%x, size %d\n", inode->i_mode, inode->i_size);
 
 	return 0;
 }
 
+int ext2_write_inode(ext2_t *ext2, inodenum_t num, const struct ext2_inode *inode)
+{
+	LTRACEF("num %d, inode %p\n", num, inode);
+
+	blocknum_t bnum;
+	size_t block_offset;
+	get_inode_addr(ext2, num, &bnum, &block_offset);
+
+	void *cache_ptr;
+	int err = bcache_get_block(ext2->cache, &cache_ptr, bnum);
+	if (err < 0)
+		return err;
+
+	/* only the part we know about, anything past it in a bigger inode is left alone */
+	struct ext2_inode *disk_inode = (struct ext2_inode *)((uint8_t *)cache_ptr + block_offset);
+	memcpy(disk_inode, inode, sizeof(struct ext2_inode));
+	endian_swap_inode(disk_inode);
+
+	bcache_mark_block_dirty(ext2->cache, bnum);
+	bcache_put_block(ext2->cache, bnum);
+
+	if (ext2->fs_cache)
+		fs_icache_insert(ext2->fs_cache, num, inode);
+
+	return 0;
+}
+
+/* clear all of an inode on disk, including any part of it we don't know about */
+int ext2_zero_inode(ext2_t *ext2, inodenum_t num)
+{
+	blocknum_t bnum;
+	size_t block_offset;
+	get_inode_addr(ext2, num, &bnum, &block_offset);
+
+	void *cache_ptr;
+	int err = bcache_get_block(ext2->cache, &cache_ptr, bnum);
+	if (err < 0)
+		return err;
+
+	memset((uint8_t *)cache_ptr + block_offset, 0, EXT2_INODE_SIZE(ext2->sb));
+
+	bcache_mark_block_dirty(ext2->cache, bnum);
+	bcache_put_block(ext2->cache, bnum);
+
+	return 0;
+}
+
+/* copy something out to where it lives on disk, through the cache */
+static int ext2_write_metadata(ext2_t *ext2, off_t offset, const void *buf, size_t len)
+{
+	blocknum_t bnum = offset / EXT2_BLOCK_SIZE(ext2->sb);
+	size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
+
+	DEBUG_ASSERT(block_offset + len <= EXT2_BLOCK_SIZE(ext2->sb));
+
+	void *cache_ptr;
+	int err = bcache_get_block(ext2->cache, &cache_ptr, bnum);
+	if (err < 0)
+		return err;
+
+	memcpy((uint8_t *)cache_ptr + block_offset, buf, len);
+
+	bcache_mark_block_dirty(ext2->cache, bnum);
+	bcache_put_block(ext2->cache, bnum);
+
+	return 0;
+}
+
+int ext2_write_super(ext2_t *ext2)
+{
+	struct ext2_super_block sb = ext2->sb;
+	endian_swap_superblock(&sb);
+
+	/* backups in the other groups are left as they are, same as linux does for the counts */
+	int err = ext2_write_metadata(ext2, 1024, &sb, sizeof(sb));
+	if (err < 0)
+		return err;
+
+	ext2->sb_dirty = false;
+	return 0;
+}
+
+int ext2_write_group_desc(ext2_t *ext2, groupnum_t group)
+{
+	struct ext2_group_desc gd = ext2->gd[group];
+	endian_swap_group_desc(&gd);
+
+	/* the writer doesn't do 64 bit filesystems, so descriptors are all the small kind */
+	off_t offset = (off_t)(ext2->sb.s_first_data_block + 1) * EXT2_BLOCK_SIZE(ext2->sb) + group * sizeof(gd);
+	int err = ext2_write_metadata(ext2, offset, &gd, sizeof(gd));
+	if (err < 0)
+		return err;
+
+	ext2->groups[group].desc_dirty = false;
+	return 0;
+}
@@ -283,7 +283,7 @@ struct ext2_super_block {
 	uint32_t	s_hash_seed[4];		/* HTREE hash seed */
 	uint8_t	s_def_hash_version;	/* Default hash version to use */
 	uint8_t	s_reserved_char_pad;
-	uint16_t	s_reserved_word_pad;
+	uint16_t	s_desc_size;		/* Group descriptor size, 64bit only */
 	uint32_t	s_default_mount_opts;
  	uint32_t	s_first_meta_bg; 	/* First metablock block group */
 	uint32_t	s_reserved[190];	/* Padding to the end of the block */
@@ -350,6 +350,11 @@ struct ext2_super_block {
 #define EXT3_FEATURE_INCOMPAT_RECOVER		0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT4_FEATURE_INCOMPAT_EXTENTS		0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT		0x0080
+#define EXT4_FEATURE_INCOMPAT_MMP		0x0100
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG		0x0200
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED		0x2000
 #define EXT2_FEATURE_INCOMPAT_ANY		0xffffffff
 
 #define EXT2_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
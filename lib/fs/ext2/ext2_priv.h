@@ -26,20 +26,74 @@
 
 #include <lib/bio.h>
 #include <lib/bcache.h>
+#include <lib/fs/cache.h>
+#include <kernel/mutex.h>
 #include "ext2_fs.h"
+#include "ext4_extents.h"
+
+/* incompatible features the reader copes with. a journal that needs recovery
+ * is ignored, which can show an older state of the filesystem. */
+#define EXT2_INCOMPAT_READ_SUPP (EXT2_FEATURE_INCOMPAT_FILETYPE | \
+                                 EXT3_FEATURE_INCOMPAT_RECOVER | \
+                                 EXT2_FEATURE_INCOMPAT_META_BG | \
+                                 EXT4_FEATURE_INCOMPAT_EXTENTS | \
+                                 EXT4_FEATURE_INCOMPAT_64BIT | \
+                                 EXT4_FEATURE_INCOMPAT_MMP | \
+                                 EXT4_FEATURE_INCOMPAT_FLEX_BG | \
+                                 EXT4_FEATURE_INCOMPAT_CSUM_SEED)
+
+/* features the writer keeps consistent, a filesystem with any others is mounted
+ * read only. extent mapped files can't be written, new files are always block mapped. */
+#define EXT2_INCOMPAT_WRITE_SUPP (EXT2_FEATURE_INCOMPAT_FILETYPE | \
+                                  EXT4_FEATURE_INCOMPAT_EXTENTS | \
+                                  EXT4_FEATURE_INCOMPAT_FLEX_BG)
+#define EXT2_RO_COMPAT_WRITE_SUPP (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | \
+                                   EXT2_FEATURE_RO_COMPAT_LARGE_FILE | \
+                                   EXT2_FEATURE_RO_COMPAT_BTREE_DIR)
+
+/* blocks in the per mount cache. the readahead window is at most a quarter of it, since
+ * up to one and a half windows sit unread in it and they must not push each other out */
+#define EXT2_CACHE_BLOCKS 64
+
+/* inodes and directory entries kept around for path lookups */
+#define EXT2_INODE_CACHE_SIZE 64
+#define EXT2_DENTRY_CACHE_SIZE 256
+
+/* appended blocks held back per open file before they're given disk blocks,
+ * so a stream of small writes ends up contiguous and goes out in big writes */
+#define EXT2_DALLOC_BLOCKS 32
 
 typedef uint32_t blocknum_t;
 typedef uint32_t inodenum_t;
 typedef uint32_t groupnum_t;
 
+/* allocation state of a block group, the bitmaps are read in on first use */
+struct ext2_group {
+	uint8_t *block_bitmap;
+	uint8_t *inode_bitmap;
+	bool block_bitmap_dirty;
+	bool inode_bitmap_dirty;
+	bool desc_dirty;
+};
+
 typedef struct {
 	bdev_t *dev;
 	bcache_t cache;
+	fs_cache_t *fs_cache; // may be NULL
 
 	struct ext2_super_block sb;
 	int s_group_count;
 	struct ext2_group_desc *gd;
 	struct ext2_inode root_inode;
+	void *zero_block; // what borrowed holes point at, allocated on first use
+
+	/* writing, everything below is protected by lock */
+	bool writable;  // all the features are ones the writer knows about
+	mutex_t lock;
+	bool modified;  // the superblock has been marked not clean
+	bool was_clean; // and is put back to clean by unmount
+	bool sb_dirty;
+	struct ext2_group *groups;
 } ext2_t;
 
 struct cache_block {
@@ -47,27 +101,110 @@ struct cache_block {
 	void *ptr;
 };
 
+/* sequential access tracking for readahead */
+struct ext2_readahead {
+	off_t next_offset; // where a sequential reader picks up
+	uint end;          // file block just past what has been prefetched
+	uint window;       // blocks to prefetch at a time, 0 while access is random
+};
+
+/* recently used extents of an extent mapped file, so reads don't walk the tree every time */
+#define EXT2_EXTENT_CACHE_SIZE 8
+
+struct ext2_extent_cache {
+	uint next; // slot to replace next
+	struct {
+		uint32_t file_block;
+		uint32_t len;         // 0 if the slot is empty
+		blocknum_t phys_block; // 0 if it reads as zeros
+	} ent[EXT2_EXTENT_CACHE_SIZE];
+};
+
+/* per open file state that speeds up reads */
+struct ext2_file_state {
+	struct ext2_readahead ra;
+	struct ext2_extent_cache extents;
+};
+
+/* hash indexed directory, the index goes stale once anything is added to it */
+#define EXT2_INDEX_FL 0x00001000
+
+/* most cache blocks one open file can have borrowed at once */
+#define EXT2_FILE_BORROWED_MAX 4
+
 /* open file handle */
 typedef struct {
 	ext2_t *ext2;
+	inodenum_t inum;
+	bool inode_dirty;
 
 	struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
 	struct ext2_inode inode;
+	struct ext2_file_state state;
+
+	/* data handed out by ext2_get_file_data and not yet put back */
+	struct {
+		const void *ptr; // NULL if the slot is free
+		blocknum_t bnum; // 0 for holes, which hold no cache block
+	} borrowed[EXT2_FILE_BORROWED_MAX];
+
+	/* appended data that has no disk blocks yet */
+	struct {
+		uint8_t *buf;     // EXT2_DALLOC_BLOCKS blocks, allocated on first append
+		uint file_block;  // file block of the first one held
+		uint count;       // blocks held
+	} dalloc;
 } ext2_file_t;
 
 /* internal routines */
 int ext2_load_inode(ext2_t *ext2, inodenum_t num, struct ext2_inode *inode);
+int ext2_write_inode(ext2_t *ext2, inodenum_t num, const struct ext2_inode *inode);
+int ext2_zero_inode(ext2_t *ext2, inodenum_t num);
+int ext2_write_super(ext2_t *ext2);
+int ext2_write_group_desc(ext2_t *ext2, groupnum_t group);
 int ext2_lookup(ext2_t *ext2, const char *path, inodenum_t *inum); // path to inode
 
 /* io */
 int ext2_read_block(ext2_t *ext2, void *buf, blocknum_t bnum);
+int ext2_write_block(ext2_t *ext2, const void *buf, blocknum_t bnum);
 int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum);
 int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
+int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_find, uint32_t *level, uint32_t pos[]);
+// the block behind a file block, 0 for holes. state is optional
+blocknum_t ext2_file_block(ext2_t *ext2, struct ext2_inode *inode, struct ext2_file_state *state, uint file_block);
+
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
-int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+// state is optional
+int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len,
+                    struct ext2_file_state *state);
+/* reference the data at offset in place, up to the end of its block. bnum is set to
+ * the cache block to put back when done with it, or 0 if there's none. state is optional */
+int ext2_get_inode_data(ext2_t *ext2, struct ext2_inode *inode, off_t offset, const void **ptr,
+                        blocknum_t *bnum, struct ext2_file_state *state);
+
+/* extents, map up to max file blocks from file_block on. returns how many map
+ * to consecutive blocks starting at *phys_block, which is 0 for holes. cache is optional.
+ */
+uint ext2_extent_map(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *cache,
+                     uint file_block, uint max, blocknum_t *phys_block);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
+/* allocation, all with lock held. ext2_alloc_blocks returns how many consecutive
+ * blocks up to count it got, starting as close to goal as it could. */
+int ext2_alloc_blocks(ext2_t *ext2, blocknum_t goal, uint count, blocknum_t *start);
+void ext2_free_blocks(ext2_t *ext2, blocknum_t start, uint count);
+int ext2_alloc_inode(ext2_t *ext2, groupnum_t goal, bool is_dir, inodenum_t *inum);
+void ext2_free_inode(ext2_t *ext2, inodenum_t inum, bool is_dir);
+int ext2_begin_write(ext2_t *ext2);
+int ext2_commit(ext2_t *ext2);
+void ext2_free_groups(ext2_t *ext2);
+
+/* writing, with lock held */
+int ext2_flush_file(ext2_file_t *file);
+int ext2_dir_add(ext2_t *ext2, inodenum_t dir_inum, struct ext2_inode *dir_inode,
+                 const char *name, inodenum_t inum, uint8_t file_type);
+
 /* mode stuff */
 #define S_IFMT      0170000
 #define S_IFIFO     0010000
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * ext4 extent tree, on disk little endian.
+ *
+ * An inode with EXT4_EXTENTS_FL set keeps the root of the tree in i_block
+ * instead of block pointers. Every node starts with a header, followed by
+ * index entries in interior nodes and extents in leaves, both sorted by
+ * the first file block they cover.
+ */
+
+#define EXT4_EXTENTS_FL     0x00080000 /* inode uses extents */
+
+#define EXT4_EXT_MAGIC      0xf30a
+
+/* extents longer than this are preallocated but not written yet, and read as zeros */
+#define EXT4_EXT_INIT_MAX_LEN (1U << 15)
+
+struct ext4_extent_header {
+	uint16_t eh_magic;
+	uint16_t eh_entries;    /* valid entries following the header */
+	uint16_t eh_max;        /* capacity of the node */
+	uint16_t eh_depth;      /* 0 for leaves */
+	uint32_t eh_generation;
+};
+
+/* leaf entry */
+struct ext4_extent {
+	uint32_t ee_block;      /* first file block covered */
+	uint16_t ee_len;
+	uint16_t ee_start_hi;
+	uint32_t ee_start_lo;   /* first physical block */
+};
+
+/* interior entry */
+struct ext4_extent_idx {
+	uint32_t ei_block;      /* first file block covered by the subtree */
+	uint32_t ei_leaf_lo;    /* block the next level down is in */
+	uint16_t ei_leaf_hi;
+	uint16_t ei_unused;
+};
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <debug.h>
+#include <trace.h>
+#include <lib/fs/ext2.h>
+#include "ext2_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* deep enough for any file that fits in 2^32 blocks */
+#define EXT4_EXT_MAX_DEPTH 5
+
+static uint extent_cache_lookup(struct ext2_extent_cache *cache, uint file_block, uint max, blocknum_t *phys_block)
+{
+	for (uint i = 0; i < EXT2_EXTENT_CACHE_SIZE; i++) {
+		uint32_t start = cache->ent[i].file_block;
+		uint32_t len = cache->ent[i].len;
+
+		if (len > 0 && file_block >= start && file_block - start < len) {
+			uint offset = file_block - start;
+			*phys_block = cache->ent[i].phys_block ? cache->ent[i].phys_block + offset : 0;
+			return MIN(max, len - offset);
+		}
+	}
+
+	return 0;
+}
+
+static void extent_cache_insert(struct ext2_extent_cache *cache, uint32_t file_block, uint32_t len, blocknum_t phys_block)
+{
+	uint slot = cache->next;
+	cache->next = (slot + 1) % EXT2_EXTENT_CACHE_SIZE;
+
+	cache->ent[slot].file_block = file_block;
+	cache->ent[slot].len = len;
+	cache->ent[slot].phys_block = phys_block;
+}
+
+static bool extent_header_valid(ext2_t *ext2, const struct ext4_extent_header *eh, size_t node_size)
+{
+	if (LE16(eh->eh_magic) != EXT4_EXT_MAGIC)
+		return false;
+	if (LE16(eh->eh_depth) > EXT4_EXT_MAX_DEPTH)
+		return false;
+
+	/* index entries and extents are the same size */
+	size_t capacity = (node_size - sizeof(*eh)) / sizeof(struct ext4_extent);
+	return LE16(eh->eh_entries) <= LE16(eh->eh_max) && LE16(eh->eh_max) <= capacity;
+}
+
+uint ext2_extent_map(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *cache,
+                     uint file_block, uint max, blocknum_t *phys_block)
+{
+	LTRACEF("inode %p, file_block %u, max %u\n", inode, file_block, max);
+
+	DEBUG_ASSERT(max > 0);
+
+	*phys_block = 0;
+
+	if (cache) {
+		uint run = extent_cache_lookup(cache, file_block, max, phys_block);
+		if (run > 0)
+			return run;
+	}
+
+	/* walk down from the root in the inode, holding the one tree block we're looking at */
+	const struct ext4_extent_header *eh = (const struct ext4_extent_header *)inode->i_block;
+	size_t node_size = sizeof(inode->i_block);
+	blocknum_t node_block = 0;
+	uint run = 1;
+
+	for (;;) {
+		if (!extent_header_valid(ext2, eh, node_size)) {
+			TRACEF("bad extent node %u in inode %p\n", node_block, inode);
+			goto done;
+		}
+
+		uint entries = LE16(eh->eh_entries);
+
+		if (LE16(eh->eh_depth) == 0)
+			break;
+
+		/* last index entry starting at or before file_block */
+		const struct ext4_extent_idx *idx = (const struct ext4_extent_idx *)(eh + 1);
+		uint i;
+		for (i = 0; i < entries && LE32(idx[i].ei_block) <= file_block; i++)
+			;
+		if (i == 0)
+			goto done; /* hole in front of the first subtree */
+
+		if (LE16(idx[i - 1].ei_leaf_hi) != 0) {
+			TRACEF("extent node beyond 32 bit block numbers\n");
+			goto done;
+		}
+
+		blocknum_t next_block = LE32(idx[i - 1].ei_leaf_lo);
+		void *next;
+		if (ext2_get_block(ext2, &next, next_block) < 0)
+			goto done;
+
+		if (node_block)
+			ext2_put_block(ext2, node_block);
+		node_block = next_block;
+		eh = next;
+		node_size = EXT2_BLOCK_SIZE(ext2->sb);
+	}
+
+	/* leaf, last extent starting at or before file_block */
+	const struct ext4_extent *ext = (const struct ext4_extent *)(eh + 1);
+	uint entries = LE16(eh->eh_entries);
+	uint i;
+	for (i = 0; i < entries && LE32(ext[i].ee_block) <= file_block; i++)
+		;
+
+	if (i > 0) {
+		const struct ext4_extent *e = &ext[i - 1];
+		uint32_t start = LE32(e->ee_block);
+		uint32_t len = LE16(e->ee_len);
+		bool written = true;
+
+		if (len > EXT4_EXT_INIT_MAX_LEN) {
+			len -= EXT4_EXT_INIT_MAX_LEN;
+			written = false;
+		}
+
+		if (file_block - start < len) {
+			if (LE16(e->ee_start_hi) != 0) {
+				TRACEF("extent beyond 32 bit block numbers\n");
+				goto done;
+			}
+
+			blocknum_t phys = written ? LE32(e->ee_start_lo) : 0;
+			if (cache)
+				extent_cache_insert(cache, start, len, phys);
+
+			uint offset = file_block - start;
+			*phys_block = phys ? phys + offset : 0;
+			run = MIN(max, len - offset);
+			goto done;
+		}
+	}
+
+	/* a hole, runs up to the next extent in this leaf */
+	if (i < entries)
+		run = MIN(max, LE32(ext[i].ee_block) - file_block);
+
+done:
+	if (node_block)
+		ext2_put_block(ext2, node_block);
+
+	LTRACEF("file_block %u -> %u, run %u\n", file_block, *phys_block, run);
+
+	return run;
+}
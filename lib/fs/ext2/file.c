@@ -55,6 +55,7 @@ int ext2_open_file(fscookie cookie, const char *path, fsfilecookie *fcookie)
 	}
 
 	file->ext2 = ext2;
+	file->inum = inum;
 	*fcookie = file;
 
 	return 0;
@@ -71,16 +72,90 @@ int ext2_read_file(fsfilecookie fcookie, void *buf, off_t offset, size_t len)
 		return -1;
 	}
 
+	// anything held back has to be on the disk to be read back
+	if (file->dalloc.count > 0) {
+		mutex_acquire(&file->ext2->lock);
+		err = ext2_flush_file(file);
+		mutex_release(&file->ext2->lock);
+		if (err < 0)
+			return err;
+	}
+
 	// read from the inode
-	err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+	err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len, &file->state);
 
 	return err;
 }
 
+ssize_t ext2_get_file_data(fsfilecookie fcookie, off_t offset, const void **ptr)
+{
+	ext2_file_t *file = (ext2_file_t *)fcookie;
+
+	if (!S_ISREG(file->inode.i_mode))
+		return ERR_NOT_FILE;
+
+	uint slot;
+	for (slot = 0; slot < EXT2_FILE_BORROWED_MAX; slot++) {
+		if (!file->borrowed[slot].ptr)
+			break;
+	}
+	if (slot == EXT2_FILE_BORROWED_MAX)
+		return ERR_BUSY;
+
+	if (file->dalloc.count > 0) {
+		mutex_acquire(&file->ext2->lock);
+		int err = ext2_flush_file(file);
+		mutex_release(&file->ext2->lock);
+		if (err < 0)
+			return err;
+	}
+
+	blocknum_t bnum;
+	int len = ext2_get_inode_data(file->ext2, &file->inode, offset, ptr, &bnum, &file->state);
+	if (len <= 0)
+		return len;
+
+	file->borrowed[slot].ptr = *ptr;
+	file->borrowed[slot].bnum = bnum;
+
+	return len;
+}
+
+int ext2_put_file_data(fsfilecookie fcookie, const void *ptr)
+{
+	ext2_file_t *file = (ext2_file_t *)fcookie;
+
+	for (uint i = 0; i < EXT2_FILE_BORROWED_MAX; i++) {
+		if (file->borrowed[i].ptr == ptr) {
+			if (file->borrowed[i].bnum != 0)
+				ext2_put_block(file->ext2, file->borrowed[i].bnum);
+			file->borrowed[i].ptr = NULL;
+			return 0;
+		}
+	}
+
+	return ERR_NOT_FOUND;
+}
+
 int ext2_close_file(fsfilecookie fcookie)
 {
 	ext2_file_t *file = (ext2_file_t *)fcookie;
 
+	// hand back anything still borrowed
+	for (uint i = 0; i < EXT2_FILE_BORROWED_MAX; i++) {
+		if (file->borrowed[i].ptr)
+			ext2_put_file_data(file, file->borrowed[i].ptr);
+	}
+
+	// get whatever was written out to the cache, it writes it back from there
+	int err = 0;
+	if (file->ext2->modified) {
+		mutex_acquire(&file->ext2->lock);
+		err = ext2_flush_file(file);
+		mutex_release(&file->ext2->lock);
+	}
+	free(file->dalloc.buf);
+
 	// see if we need to free any of the cache blocks
 	int i;
 	for (i=0; i < 3; i++) {
@@ -91,7 +166,7 @@ int ext2_close_file(fsfilecookie fcookie)
 
 	free(file);
 
-	return 0;
+	return err;
 }
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode)
@@ -130,7 +205,7 @@ int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len
 		return ERR_NO_MEMORY;
 
 	if (linklen > 60) {
-		int err = ext2_read_inode(ext2, inode, str, 0, linklen);
+		int err = ext2_read_inode(ext2, inode, str, 0, linklen, NULL);
 		if (err < 0)
 			return err;
 		str[linklen] = 0;
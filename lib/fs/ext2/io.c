@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <err.h>
 #include <debug.h>
 #include <trace.h>
 #include <lib/fs/ext2.h>
@@ -30,11 +31,37 @@
 
 #define LOCAL_TRACE 0
 
+/* readahead window, in blocks. it starts small and doubles while the reader keeps going */
+#define EXT2_READAHEAD_MIN 4
+#define EXT2_READAHEAD_MAX (EXT2_CACHE_BLOCKS / 4)
+
+/* runs of at least this many blocks are read directly, bypassing the cache.
+ * shorter ones go through it so they can make use of readahead. */
+#define EXT2_DIRECT_READ_MIN 8
+
 int ext2_read_block(ext2_t *ext2, void *buf, blocknum_t bnum)
 {
 	return bcache_read_block(ext2->cache, buf, bnum);
 }
 
+/* replace a whole block, without reading it in first */
+int ext2_write_block(ext2_t *ext2, const void *buf, blocknum_t bnum)
+{
+	void *ptr;
+
+	int err = bcache_zero_block(ext2->cache, bnum);
+	if (err >= 0)
+		err = bcache_get_block(ext2->cache, &ptr, bnum);
+	if (err < 0)
+		return err;
+
+	memcpy(ptr, buf, EXT2_BLOCK_SIZE(ext2->sb));
+	bcache_mark_block_dirty(ext2->cache, bnum);
+	bcache_put_block(ext2->cache, bnum);
+
+	return 0;
+}
+
 int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum)
 {
 	return bcache_get_block(ext2->cache, ptr, bnum);
@@ -45,7 +72,7 @@ int ext2_put_block(ext2_t *ext2, blocknum_t bnum)
 	return bcache_put_block(ext2->cache, bnum);
 }
 
-static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_find, uint32_t *level, uint32_t pos[])
+int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_find, uint32_t *level, uint32_t pos[])
 {
 	uint32_t block_ptr_per_block, block_ptr_per_2nd_block;
 
@@ -144,13 +171,19 @@ error:
 }
 
 /* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock)
+static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *extents,
+                                         uint fileblock)
 {
 	int err;
 	blocknum_t block;
 
 	LTRACEF("inode %p, fileblock %u\n", inode, fileblock);
 
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		ext2_extent_map(ext2, inode, extents, fileblock, 1, &block);
+		return block;
+	}
+
 	uint32_t pos[4];
 	uint32_t level = 0;
 	ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
@@ -181,7 +214,152 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
 	return block;
 }
 
-int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
+blocknum_t ext2_file_block(ext2_t *ext2, struct ext2_inode *inode, struct ext2_file_state *state, uint file_block)
+{
+	return file_block_to_fs_block(ext2, inode, state ? &state->extents : NULL, file_block);
+}
+
+/* count how many file blocks from file_block on, up to max, sit in consecutive
+ * physical blocks. for block mapped files only the one block pointer table
+ * file_block is in is looked at, so a run stops at the end of it, and holes
+ * are runs of one. either way holes have a start of 0.
+ */
+static uint file_block_run(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *extents,
+                           uint file_block, uint max, blocknum_t *start)
+{
+	uint32_t pos[4];
+	uint32_t level = 0;
+
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return ext2_extent_map(ext2, inode, extents, file_block, max, start);
+
+	*start = 0;
+	if (ext2_calculate_block_pointer_pos(ext2, file_block, &level, pos) < 0)
+		return 1;
+
+	const blocknum_t *table;
+	uint entries;
+	uint table_block = 0;
+	if (level == 0) {
+		table = inode->i_block;
+		entries = EXT2_NDIR_BLOCKS;
+	} else {
+		blocknum_t *ind_table;
+		if (ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &table_block) < 0)
+			return 1;
+		table = ind_table;
+		entries = EXT2_ADDR_PER_BLOCK(ext2->sb);
+	}
+
+	uint index = pos[level];
+	uint run = 1;
+	*start = LE32(table[index]);
+	if (*start != 0) {
+		while (run < max && index + run < entries && LE32(table[index + run]) == *start + run)
+			run++;
+	}
+
+	if (level > 0)
+		ext2_put_block(ext2, table_block);
+
+	LTRACEF("file block %u, phys block %u, run %u\n", file_block, *start, run);
+
+	return run;
+}
+
+/* prefetch the blocks behind file blocks [start, end), a physically contiguous run at a time */
+static void ext2_prefetch(ext2_t *ext2, struct ext2_inode *inode, struct ext2_extent_cache *extents,
+                          uint start, uint end)
+{
+	blocknum_t run_start = 0;
+	uint run_len = 0;
+
+	for (uint file_block = start; file_block < end; ) {
+		blocknum_t phys_block;
+		uint run = file_block_run(ext2, inode, extents, file_block, end - file_block, &phys_block);
+
+		/* runs can break at table boundaries while still being contiguous on disk */
+		if (run_len > 0 && phys_block == run_start + run_len) {
+			run_len += run;
+		} else {
+			if (run_len > 0)
+				bcache_prefetch(ext2->cache, run_start, run_len);
+
+			/* holes read as zeros, nothing to fetch */
+			run_start = phys_block;
+			run_len = (phys_block != 0) ? run : 0;
+		}
+
+		file_block += run;
+	}
+
+	if (run_len > 0)
+		bcache_prefetch(ext2->cache, run_start, run_len);
+}
+
+/* called as a sequential reader gets to file_block, keeps a window's worth in flight ahead of it */
+static void ext2_readahead(ext2_t *ext2, struct ext2_inode *inode, struct ext2_file_state *state,
+                           uint file_block, uint file_blocks)
+{
+	if (!state || state->ra.window == 0)
+		return;
+
+	struct ext2_readahead *ra = &state->ra;
+
+	/* top it up once the reader is halfway into what's been prefetched */
+	if (file_block + ra->window / 2 < ra->end)
+		return;
+
+	uint start = MAX(ra->end, file_block);
+	uint end = MIN(start + ra->window, file_blocks);
+	if (start >= end)
+		return;
+
+	LTRACEF("file blocks %u-%u, window %u\n", start, end - 1, ra->window);
+
+	ext2_prefetch(ext2, inode, &state->extents, start, end);
+	ra->end = end;
+	ra->window = MIN(ra->window * 2, EXT2_READAHEAD_MAX);
+}
+
+/* picking up where the last access left off turns readahead on, anything else resets it */
+static void ext2_track_access(struct ext2_file_state *state, off_t offset, size_t len)
+{
+	if (!state)
+		return;
+
+	struct ext2_readahead *ra = &state->ra;
+	if (offset == ra->next_offset) {
+		if (ra->window == 0)
+			ra->window = EXT2_READAHEAD_MIN;
+	} else {
+		ra->window = 0;
+		ra->end = 0;
+	}
+	ra->next_offset = offset + len;
+}
+
+/* copy part of a file block out of the cache, holes read as zeros */
+static int ext2_copy_block(ext2_t *ext2, blocknum_t phys_block, void *buf, size_t block_offset, size_t len)
+{
+	if (phys_block == 0) {
+		memset(buf, 0, len);
+		return 0;
+	}
+
+	void *ptr;
+	int err = ext2_get_block(ext2, &ptr, phys_block);
+	if (err < 0)
+		return err;
+
+	memcpy(buf, (uint8_t *)ptr + block_offset, len);
+	ext2_put_block(ext2, phys_block);
+
+	return 0;
+}
+
+int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len,
+                    struct ext2_file_state *state)
 {
 	int err = 0;
 	int bytes_read = 0;
@@ -202,23 +380,20 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 
 	/* calculate the starting file block */
 	uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+	uint file_blocks = (file_size + EXT2_BLOCK_SIZE(ext2->sb) - 1) / EXT2_BLOCK_SIZE(ext2->sb);
+
+	ext2_track_access(state, offset, len);
+	struct ext2_extent_cache *extents = state ? &state->extents : NULL;
 
 	/* handle partial first block */
 	if ((offset % EXT2_BLOCK_SIZE(ext2->sb)) != 0) {
-		uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+		ext2_readahead(ext2, inode, state, file_block, file_blocks);
 
-		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-		if (phys_block == 0) {
-			memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-		} else {
-			ext2_read_block(ext2, temp, phys_block);
-		}
-
-		/* copy out what we need */
+		/* calculate the block and copy out what we need */
+		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, extents, file_block);
 		size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
 		size_t tocopy = MIN(len, EXT2_BLOCK_SIZE(ext2->sb) - block_offset);
-		memcpy(buf, temp + block_offset, tocopy);
+		ext2_copy_block(ext2, phys_block, buf, block_offset, tocopy);
 
 		/* increment our stuff */
 		file_block++;
@@ -227,37 +402,55 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 		buf += tocopy;
 	}
 
-	/* handle middle blocks */
+	/* handle middle blocks, a physically contiguous run at a time */
 	while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-		if (phys_block == 0) {
-			memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+		blocknum_t phys_block;
+		uint run = file_block_run(ext2, inode, extents, file_block, len / EXT2_BLOCK_SIZE(ext2->sb), &phys_block);
+		size_t run_len = run * EXT2_BLOCK_SIZE(ext2->sb);
+
+		if (phys_block != 0 && run >= EXT2_DIRECT_READ_MIN) {
+			/* straight from the device into the caller's buffer. anything written
+			 * through the cache has to be on the device first for that to see it. */
+			if (ext2->modified) {
+				err = bcache_flush(ext2->cache);
+				if (err < 0)
+					break;
+			}
+
+			ssize_t ret = bio_read(ext2->dev, buf, (off_t)phys_block * EXT2_BLOCK_SIZE(ext2->sb), run_len);
+			if (ret < (ssize_t)run_len) {
+				err = (ret < 0) ? (int)ret : ERR_IO;
+				break;
+			}
+
+			/* no point prefetching what was just read */
+			if (state)
+				state->ra.end = MAX(state->ra.end, file_block + run);
 		} else {
-			ext2_read_block(ext2, buf, phys_block);
+			ext2_readahead(ext2, inode, state, file_block, file_blocks);
+
+			if (phys_block == 0) {
+				memset(buf, 0, run_len);
+			} else {
+				for (uint i = 0; i < run; i++)
+					ext2_read_block(ext2, buf + i * EXT2_BLOCK_SIZE(ext2->sb), phys_block + i);
+			}
 		}
 
 		/* increment our stuff */
-		file_block++;
-		len -= EXT2_BLOCK_SIZE(ext2->sb);
-		bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-		buf += EXT2_BLOCK_SIZE(ext2->sb);
+		file_block += run;
+		len -= run_len;
+		bytes_read += run_len;
+		buf += run_len;
 	}
 
 	/* handle partial last block */
-	if (len > 0) {
-		uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+	if (len > 0 && err >= 0) {
+		ext2_readahead(ext2, inode, state, file_block, file_blocks);
 
-		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-		if (phys_block == 0) {
-			memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-		} else {
-			ext2_read_block(ext2, temp, phys_block);
-		}
-
-		/* copy out what we need */
-		memcpy(buf, temp, len);
+		/* calculate the block and copy out what we need */
+		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, extents, file_block);
+		ext2_copy_block(ext2, phys_block, buf, 0, len);
 
 		/* increment our stuff */
 		bytes_read += len;
@@ -268,3 +461,47 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 	return (err < 0) ? err : bytes_read;
 }
 
+
+int ext2_get_inode_data(ext2_t *ext2, struct ext2_inode *inode, off_t offset, const void **ptr,
+                        blocknum_t *bnum, struct ext2_file_state *state)
+{
+	off_t file_size = ext2_file_len(ext2, inode);
+
+	LTRACEF("inode %p, offset %lld, file_size %lld\n", inode, offset, file_size);
+
+	*ptr = NULL;
+	*bnum = 0;
+	if (offset < 0 || offset >= file_size)
+		return 0;
+
+	uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+	uint file_blocks = (file_size + EXT2_BLOCK_SIZE(ext2->sb) - 1) / EXT2_BLOCK_SIZE(ext2->sb);
+	size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
+	size_t len = MIN(EXT2_BLOCK_SIZE(ext2->sb) - block_offset, (size_t)(file_size - offset));
+
+	/* a scan through borrowed blocks gets readahead just like a read would */
+	ext2_track_access(state, offset, len);
+	ext2_readahead(ext2, inode, state, file_block, file_blocks);
+
+	blocknum_t phys_block = file_block_to_fs_block(ext2, inode, state ? &state->extents : NULL, file_block);
+	if (phys_block == 0) {
+		/* holes all share the one block of zeros */
+		if (!ext2->zero_block) {
+			ext2->zero_block = calloc(1, EXT2_BLOCK_SIZE(ext2->sb));
+			if (!ext2->zero_block)
+				return ERR_NO_MEMORY;
+		}
+		*ptr = (const uint8_t *)ext2->zero_block + block_offset;
+		return len;
+	}
+
+	void *block;
+	int err = ext2_get_block(ext2, &block, phys_block);
+	if (err < 0)
+		return err;
+
+	*ptr = (const uint8_t *)block + block_offset;
+	*bnum = phys_block;
+
+	return len;
+}
@@ -8,9 +8,12 @@ MODULE_DEPS += \
 	lib/bio
 
 MODULE_SRCS += \
+	$(LOCAL_DIR)/alloc.c \
 	$(LOCAL_DIR)/ext2.c \
 	$(LOCAL_DIR)/dir.c \
 	$(LOCAL_DIR)/io.c \
-	$(LOCAL_DIR)/file.c
+	$(LOCAL_DIR)/extent.c \
+	$(LOCAL_DIR)/file.c \
+	$(LOCAL_DIR)/write.c
 
 include make/module.mk
@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <debug.h>
+#include <trace.h>
+#include <lib/fs/ext2.h>
+#include "ext2_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* i_blocks counts 512 byte sectors */
+#define BLOCK_SECTORS(ext2) (EXT2_BLOCK_SIZE((ext2)->sb) / 512)
+
+static void set_file_len(ext2_t *ext2, struct ext2_inode *inode, off_t len)
+{
+	inode->i_size = len;
+	if (ext2->sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
+		inode->i_size_high = (uint64_t)len >> 32;
+}
+
+/* largest a file can get, by the block map or by the size field */
+static off_t max_file_len(ext2_t *ext2)
+{
+	uint64_t per = EXT2_ADDR_PER_BLOCK(ext2->sb);
+	uint64_t blocks = EXT2_NDIR_BLOCKS + per + per * per + per * per * per;
+
+	off_t len = MIN(blocks, (uint64_t)UINT32_MAX) * EXT2_BLOCK_SIZE(ext2->sb);
+	if (!(ext2->sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE))
+		len = MIN(len, (off_t)INT32_MAX);
+
+	return len;
+}
+
+/* where to start looking for a block for file_block: right after the one before it, or failing that
+ * at the start of the inode's group */
+static blocknum_t alloc_goal(ext2_t *ext2, inodenum_t inum, struct ext2_inode *inode, uint file_block)
+{
+	if (file_block > 0) {
+		blocknum_t prev = ext2_file_block(ext2, inode, NULL, file_block - 1);
+		if (prev != 0)
+			return prev + 1;
+	}
+
+	groupnum_t group = (inum - 1) / ext2->sb.s_inodes_per_group;
+	return ext2->sb.s_first_data_block + group * ext2->sb.s_blocks_per_group;
+}
+
+/* a new block for an indirect table, zeroed in the cache */
+static int alloc_table(ext2_t *ext2, struct ext2_inode *inode, blocknum_t goal, blocknum_t *table)
+{
+	int err = ext2_alloc_blocks(ext2, goal, 1, table);
+	if (err < 0)
+		return err;
+
+	err = bcache_zero_block(ext2->cache, *table);
+	if (err < 0) {
+		ext2_free_blocks(ext2, *table, 1);
+		return err;
+	}
+
+	inode->i_blocks += BLOCK_SECTORS(ext2);
+	return 0;
+}
+
+/* point file_block of a block mapped inode at phys_block, adding indirect tables as needed */
+static int set_file_block(ext2_t *ext2, struct ext2_inode *inode, uint file_block, blocknum_t phys_block)
+{
+	uint32_t pos[4];
+	uint32_t level = 0;
+	int err;
+
+	if (ext2_calculate_block_pointer_pos(ext2, file_block, &level, pos) < 0)
+		return ERR_TOO_BIG;
+
+	LTRACEF("file block %u, phys block %u, level %u\n", file_block, phys_block, level);
+
+	if (level == 0) {
+		inode->i_block[pos[0]] = LE32(phys_block);
+		return 0;
+	}
+
+	blocknum_t table = LE32(inode->i_block[pos[0]]);
+	if (table == 0) {
+		err = alloc_table(ext2, inode, phys_block + 1, &table);
+		if (err < 0)
+			return err;
+		inode->i_block[pos[0]] = LE32(table);
+	}
+
+	for (uint l = 1; l <= level; l++) {
+		uint32_t *entries;
+		err = ext2_get_block(ext2, (void **)(void *)&entries, table);
+		if (err < 0)
+			return err;
+
+		blocknum_t next = phys_block;
+		if (l < level) {
+			next = LE32(entries[pos[l]]);
+			if (next == 0) {
+				err = alloc_table(ext2, inode, phys_block + 1, &next);
+				if (err < 0) {
+					ext2_put_block(ext2, table);
+					return err;
+				}
+			}
+		}
+
+		if (LE32(entries[pos[l]]) != next) {
+			entries[pos[l]] = LE32(next);
+			bcache_mark_block_dirty(ext2->cache, table);
+		}
+		ext2_put_block(ext2, table);
+
+		table = next;
+	}
+
+	return 0;
+}
+
+/* free the part of an indirect table of the given level that maps from start on, relative
+ * to the table. returns true if it's now empty and the table itself can go. */
+static bool free_table(ext2_t *ext2, struct ext2_inode *inode, blocknum_t table, uint level, uint start)
+{
+	uint32_t *entries;
+	if (ext2_get_block(ext2, (void **)(void *)&entries, table) < 0)
+		return false;
+
+	uint per = EXT2_ADDR_PER_BLOCK(ext2->sb);
+	uint child_span = 1;
+	for (uint l = 1; l < level; l++)
+		child_span *= per;
+
+	bool dirty = false;
+	for (uint i = start / child_span; i < per; i++) {
+		blocknum_t block = LE32(entries[i]);
+		if (block == 0)
+			continue;
+
+		/* only the first child can be cut partway */
+		uint child_start = (i == start / child_span) ? start % child_span : 0;
+		if (level == 1 || free_table(ext2, inode, block, level - 1, child_start)) {
+			ext2_free_blocks(ext2, block, 1);
+			inode->i_blocks -= BLOCK_SECTORS(ext2);
+			entries[i] = 0;
+			dirty = true;
+		}
+	}
+
+	/* a table that goes away doesn't need writing */
+	bool empty = (start == 0);
+	if (dirty && !empty)
+		bcache_mark_block_dirty(ext2->cache, table);
+	ext2_put_block(ext2, table);
+
+	return empty;
+}
+
+/* free every block of a block mapped inode from file block first on */
+static void free_file_blocks(ext2_t *ext2, struct ext2_inode *inode, uint first)
+{
+	LTRACEF("inode %p, first %u\n", inode, first);
+
+	for (uint i = first; i < EXT2_NDIR_BLOCKS; i++) {
+		if (inode->i_block[i]) {
+			ext2_free_blocks(ext2, LE32(inode->i_block[i]), 1);
+			inode->i_blocks -= BLOCK_SECTORS(ext2);
+			inode->i_block[i] = 0;
+		}
+	}
+
+	uint64_t per = EXT2_ADDR_PER_BLOCK(ext2->sb);
+	uint64_t base = EXT2_NDIR_BLOCKS;
+	uint64_t span = per;
+	for (uint level = 1; level <= 3; level++) {
+		uint32_t *slot = &inode->i_block[EXT2_IND_BLOCK + level - 1];
+		uint64_t start = (first > base) ? first - base : 0;
+
+		if (*slot && start < span && free_table(ext2, inode, LE32(*slot), level, start)) {
+			ext2_free_blocks(ext2, LE32(*slot), 1);
+			inode->i_blocks -= BLOCK_SECTORS(ext2);
+			*slot = 0;
+		}
+
+		base += span;
+		span *= per;
+	}
+}
+
+/* give the held back appended blocks disk blocks, as few runs as the free space allows,
+ * and write them out straight from the buffer */
+static int flush_dalloc(ext2_file_t *file)
+{
+	ext2_t *ext2 = file->ext2;
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+	while (file->dalloc.count > 0) {
+		uint file_block = file->dalloc.file_block;
+
+		blocknum_t start;
+		int run = ext2_alloc_blocks(ext2, alloc_goal(ext2, file->inum, &file->inode, file_block),
+		                            file->dalloc.count, &start);
+		if (run < 0)
+			return run;
+
+		LTRACEF("file blocks %u-%u at %u\n", file_block, file_block + run - 1, start);
+
+		/* the data goes around the cache, so nothing stale can be left behind in it */
+		bcache_discard(ext2->cache, start, run);
+		ssize_t ret = bio_write(ext2->dev, file->dalloc.buf, (off_t)start * block_size, run * block_size);
+		if (ret < (ssize_t)(run * block_size)) {
+			ext2_free_blocks(ext2, start, run);
+			return (ret < 0) ? (int)ret : ERR_IO;
+		}
+
+		int mapped;
+		int err = 0;
+		for (mapped = 0; mapped < run; mapped++) {
+			err = set_file_block(ext2, &file->inode, file_block + mapped, start + mapped);
+			if (err < 0)
+				break;
+			file->inode.i_blocks += BLOCK_SECTORS(ext2);
+		}
+		if (mapped < run)
+			ext2_free_blocks(ext2, start + mapped, run - mapped);
+		file->inode_dirty = true;
+
+		file->dalloc.file_block += mapped;
+		file->dalloc.count -= mapped;
+		memmove(file->dalloc.buf, file->dalloc.buf + mapped * block_size, file->dalloc.count * block_size);
+
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/* hold an appended block back, true if it took it */
+static bool dalloc_add(ext2_file_t *file, uint file_block, size_t block_offset, const void *buf, size_t len)
+{
+	ext2_t *ext2 = file->ext2;
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+	/* only a run of blocks at a time, pushing out what's there if this doesn't follow on */
+	if (file->dalloc.count > 0 &&
+	        (file_block != file->dalloc.file_block + file->dalloc.count || file->dalloc.count == EXT2_DALLOC_BLOCKS)) {
+		if (flush_dalloc(file) < 0)
+			return false;
+	}
+
+	if (!file->dalloc.buf) {
+		file->dalloc.buf = malloc(EXT2_DALLOC_BLOCKS * block_size);
+		if (!file->dalloc.buf)
+			return false;
+	}
+
+	if (file->dalloc.count == 0)
+		file->dalloc.file_block = file_block;
+
+	uint8_t *block = file->dalloc.buf + file->dalloc.count * block_size;
+	memset(block, 0, block_size);
+	memcpy(block + block_offset, buf, len);
+	file->dalloc.count++;
+
+	return true;
+}
+
+/* write part of one file block */
+static int write_file_block(ext2_file_t *file, uint file_block, size_t block_offset, const void *buf, size_t len,
+                            off_t file_len)
+{
+	ext2_t *ext2 = file->ext2;
+	struct ext2_inode *inode = &file->inode;
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+	int err;
+
+	/* already being held back */
+	if (file->dalloc.count > 0 && file_block >= file->dalloc.file_block &&
+	        file_block < file->dalloc.file_block + file->dalloc.count) {
+		memcpy(file->dalloc.buf + (file_block - file->dalloc.file_block) * block_size + block_offset, buf, len);
+		return 0;
+	}
+
+	/* already has a block, write over it in the cache */
+	blocknum_t phys_block = ext2_file_block(ext2, inode, &file->state, file_block);
+	if (phys_block != 0) {
+		void *ptr;
+		err = ext2_get_block(ext2, &ptr, phys_block);
+		if (err < 0)
+			return err;
+
+		memcpy((uint8_t *)ptr + block_offset, buf, len);
+		bcache_mark_block_dirty(ext2->cache, phys_block);
+		ext2_put_block(ext2, phys_block);
+		return 0;
+	}
+
+	/* the writer only knows how to map blocks in the old way */
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return ERR_NOT_SUPPORTED;
+
+	/* past the end, it can wait for its block */
+	uint file_blocks = (file_len + block_size - 1) / block_size;
+	if (file_block >= file_blocks && dalloc_add(file, file_block, block_offset, buf, len))
+		return 0;
+
+	/* filling in a hole, or out of memory to hold it back */
+	err = ext2_alloc_blocks(ext2, alloc_goal(ext2, file->inum, inode, file_block), 1, &phys_block);
+	if (err < 0)
+		return err;
+
+	err = bcache_zero_block(ext2->cache, phys_block);
+	if (err >= 0)
+		err = set_file_block(ext2, inode, file_block, phys_block);
+	if (err < 0) {
+		ext2_free_blocks(ext2, phys_block, 1);
+		return err;
+	}
+	inode->i_blocks += BLOCK_SECTORS(ext2);
+	file->inode_dirty = true;
+
+	void *ptr;
+	err = ext2_get_block(ext2, &ptr, phys_block);
+	if (err < 0)
+		return err;
+
+	memcpy((uint8_t *)ptr + block_offset, buf, len);
+	bcache_mark_block_dirty(ext2->cache, phys_block);
+	ext2_put_block(ext2, phys_block);
+
+	return 0;
+}
+
+int ext2_write_file(fsfilecookie fcookie, const void *_buf, off_t offset, size_t len)
+{
+	ext2_file_t *file = (ext2_file_t *)fcookie;
+	ext2_t *ext2 = file->ext2;
+	const uint8_t *buf = _buf;
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+	LTRACEF("file %p, offset %lld, len %zu\n", file, offset, len);
+
+	if (!S_ISREG(file->inode.i_mode))
+		return ERR_NOT_FILE;
+	if (offset < 0)
+		return ERR_INVALID_ARGS;
+	if (len == 0)
+		return 0;
+
+	mutex_acquire(&ext2->lock);
+
+	int err = ext2_begin_write(ext2);
+	if (err < 0)
+		goto out;
+
+	off_t max_len = max_file_len(ext2);
+	if (offset >= max_len) {
+		err = ERR_TOO_BIG;
+		goto out;
+	}
+	len = MIN(len, (size_t)MIN(max_len - offset, INT32_MAX));
+
+	off_t file_len = ext2_file_len(ext2, &file->inode);
+	size_t written = 0;
+	while (written < len) {
+		uint file_block = offset / block_size;
+		size_t block_offset = offset % block_size;
+		size_t tocopy = MIN(len - written, block_size - block_offset);
+
+		err = write_file_block(file, file_block, block_offset, buf, tocopy, file_len);
+		if (err < 0)
+			break;
+
+		offset += tocopy;
+		buf += tocopy;
+		written += tocopy;
+
+		if (offset > file_len) {
+			file_len = offset;
+			set_file_len(ext2, &file->inode, file_len);
+			file->inode_dirty = true;
+		}
+	}
+
+	/* a short write is still a write */
+	if (written > 0)
+		err = written;
+
+out:
+	mutex_release(&ext2->lock);
+
+	LTRACEF("returning %d\n", err);
+
+	return err;
+}
+
+int ext2_truncate_file(fsfilecookie fcookie, off_t len)
+{
+	ext2_file_t *file = (ext2_file_t *)fcookie;
+	ext2_t *ext2 = file->ext2;
+	struct ext2_inode *inode = &file->inode;
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+	LTRACEF("file %p, len %lld\n", file, len);
+
+	if (!S_ISREG(inode->i_mode))
+		return ERR_NOT_FILE;
+	if (len < 0)
+		return ERR_INVALID_ARGS;
+
+	mutex_acquire(&ext2->lock);
+
+	int err = ext2_begin_write(ext2);
+	if (err < 0)
+		goto out;
+
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		err = ERR_NOT_SUPPORTED;
+		goto out;
+	}
+	if (len > max_file_len(ext2)) {
+		err = ERR_TOO_BIG;
+		goto out;
+	}
+
+	/* simplest to give everything held back its blocks before cutting */
+	err = flush_dalloc(file);
+	if (err < 0)
+		goto out;
+
+	/* growing just leaves a hole at the end */
+	if (len < ext2_file_len(ext2, inode)) {
+		uint keep = (len + block_size - 1) / block_size;
+		free_file_blocks(ext2, inode, keep);
+
+		/* the rest of the last block has to read as zeros if the file grows again */
+		size_t tail = len % block_size;
+		blocknum_t phys_block = (tail != 0) ? ext2_file_block(ext2, inode, NULL, keep - 1) : 0;
+		if (phys_block != 0) {
+			void *ptr;
+			err = ext2_get_block(ext2, &ptr, phys_block);
+			if (err < 0)
+				goto out;
+			memset((uint8_t *)ptr + tail, 0, block_size - tail);
+			bcache_mark_block_dirty(ext2->cache, phys_block);
+			ext2_put_block(ext2, phys_block);
+		}
+
+		/* any readahead or extents remembered past here are gone */
+		memset(&file->state, 0, sizeof(file->state));
+	}
+
+	set_file_len(ext2, inode, len);
+	file->inode_dirty = true;
+	err = 0;
+
+out:
+	mutex_release(&ext2->lock);
+	return err;
+}
+
+int ext2_flush_file(ext2_file_t *file)
+{
+	int err = flush_dalloc(file);
+	if (err < 0)
+		return err;
+
+	if (file->inode_dirty) {
+		err = ext2_write_inode(file->ext2, file->inum, &file->inode);
+		if (err < 0)
+			return err;
+		file->inode_dirty = false;
+	}
+
+	return ext2_commit(file->ext2);
+}
+
+int ext2_dir_add(ext2_t *ext2, inodenum_t dir_inum, struct ext2_inode *dir_inode,
+                 const char *name, inodenum_t inum, uint8_t file_type)
+{
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+	size_t namelen = strlen(name);
+	uint need = ROUNDUP(8 + namelen, 4);
+	int err;
+
+	LTRACEF("dir %u, name '%s', inum %u\n", dir_inum, name, inum);
+
+	if (!S_ISDIR(dir_inode->i_mode))
+		return ERR_NOT_DIR;
+	if (namelen == 0 || namelen > 255)
+		return ERR_BAD_PATH;
+
+	/* look through all of it for the name, remembering the first place it would fit */
+	uint dir_blocks = ext2_file_len(ext2, dir_inode) / block_size;
+	blocknum_t slot_block = 0;
+	uint slot_pos = 0;
+	for (uint file_block = 0; file_block < dir_blocks; file_block++) {
+		blocknum_t phys_block = ext2_file_block(ext2, dir_inode, NULL, file_block);
+		if (phys_block == 0)
+			continue;
+
+		uint8_t *buf;
+		err = ext2_get_block(ext2, (void **)(void *)&buf, phys_block);
+		if (err < 0)
+			return err;
+
+		uint pos = 0;
+		while (pos + 8 <= block_size) {
+			struct ext2_dir_entry_2 *ent = (struct ext2_dir_entry_2 *)&buf[pos];
+			uint rec_len = LE16(ent->rec_len);
+			if (rec_len < 8 || pos + rec_len > block_size)
+				break;
+
+			if (ent->inode != 0 && ent->name_len == namelen && memcmp(name, ent->name, namelen) == 0) {
+				ext2_put_block(ext2, phys_block);
+				return ERR_ALREADY_EXISTS;
+			}
+
+			uint used = ent->inode ? ROUNDUP(8 + ent->name_len, 4) : 0;
+			if (slot_block == 0 && rec_len - used >= need) {
+				slot_block = phys_block;
+				slot_pos = pos;
+			}
+
+			pos += rec_len;
+		}
+
+		ext2_put_block(ext2, phys_block);
+	}
+
+	uint8_t *buf;
+	struct ext2_dir_entry_2 *ent;
+	if (slot_block != 0) {
+		/* split the slack off the end of the entry, or take it over if it's empty */
+		err = ext2_get_block(ext2, (void **)(void *)&buf, slot_block);
+		if (err < 0)
+			return err;
+
+		ent = (struct ext2_dir_entry_2 *)&buf[slot_pos];
+		uint rec_len = LE16(ent->rec_len);
+		if (ent->inode != 0) {
+			uint used = ROUNDUP(8 + ent->name_len, 4);
+			ent->rec_len = LE16(used);
+			ent = (struct ext2_dir_entry_2 *)&buf[slot_pos + used];
+			rec_len -= used;
+		}
+		ent->rec_len = LE16(rec_len);
+	} else {
+		/* no room anywhere, grow it by a block */
+		if (dir_inode->i_flags & EXT4_EXTENTS_FL)
+			return ERR_NOT_SUPPORTED;
+
+		err = ext2_alloc_blocks(ext2, alloc_goal(ext2, dir_inum, dir_inode, dir_blocks), 1, &slot_block);
+		if (err < 0)
+			return err;
+
+		err = bcache_zero_block(ext2->cache, slot_block);
+		if (err >= 0)
+			err = set_file_block(ext2, dir_inode, dir_blocks, slot_block);
+		if (err < 0) {
+			ext2_free_blocks(ext2, slot_block, 1);
+			return err;
+		}
+
+		dir_inode->i_blocks += BLOCK_SECTORS(ext2);
+		dir_inode->i_size += block_size;
+
+		err = ext2_get_block(ext2, (void **)(void *)&buf, slot_block);
+		if (err < 0)
+			return err;
+
+		ent = (struct ext2_dir_entry_2 *)buf;
+		ent->rec_len = LE16(block_size);
+	}
+
+	ent->inode = LE32(inum);
+	ent->name_len = namelen;
+	ent->file_type = (ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) ? file_type : 0;
+	memcpy(ent->name, name, namelen);
+
+	bcache_mark_block_dirty(ext2->cache, slot_block);
+	ext2_put_block(ext2, slot_block);
+
+	/* the hash index doesn't know about the new entry, so it's a plain directory from now on */
+	dir_inode->i_flags &= ~EXT2_INDEX_FL;
+
+	err = ext2_write_inode(ext2, dir_inum, dir_inode);
+	if (err < 0)
+		return err;
+
+	if (ext2->fs_cache)
+		fs_dcache_insert(ext2->fs_cache, dir_inum, name, namelen, inum);
+
+	return 0;
+}
+
+int ext2_create_file(fscookie cookie, const char *_path, fsfilecookie *fcookie)
+{
+	ext2_t *ext2 = (ext2_t *)cookie;
+	int err;
+
+	LTRACEF("path '%s'\n", _path);
+
+	/* split off the last component */
+	char path[512];
+	strlcpy(path, _path, sizeof(path));
+	char *name = strrchr(path, '/');
+	if (name)
+		*name++ = 0;
+	else
+		name = path;
+	if (*name == 0)
+		return ERR_BAD_PATH;
+
+	mutex_acquire(&ext2->lock);
+
+	err = ext2_begin_write(ext2);
+	if (err < 0)
+		goto out;
+
+	inodenum_t dir_inum = EXT2_ROOT_INO;
+	if (name != path && path[0] != 0) {
+		err = ext2_lookup(ext2, path, &dir_inum);
+		if (err < 0)
+			goto out;
+	}
+
+	struct ext2_inode dir_inode;
+	err = ext2_load_inode(ext2, dir_inum, &dir_inode);
+	if (err < 0)
+		goto out;
+	if (!S_ISDIR(dir_inode.i_mode)) {
+		err = ERR_NOT_DIR;
+		goto out;
+	}
+
+	ext2_file_t *file = calloc(1, sizeof(ext2_file_t));
+	if (!file) {
+		err = ERR_NO_MEMORY;
+		goto out;
+	}
+
+	/* keep it near its directory */
+	err = ext2_alloc_inode(ext2, (dir_inum - 1) / ext2->sb.s_inodes_per_group, false, &file->inum);
+	if (err < 0) {
+		free(file);
+		goto out;
+	}
+
+	file->ext2 = ext2;
+	file->inode.i_mode = S_IFREG | 0644;
+	file->inode.i_links_count = 1;
+
+	err = ext2_zero_inode(ext2, file->inum);
+	if (err >= 0)
+		err = ext2_write_inode(ext2, file->inum, &file->inode);
+	if (err >= 0)
+		err = ext2_dir_add(ext2, dir_inum, &dir_inode, name, file->inum, EXT2_FT_REG_FILE);
+	if (err < 0) {
+		ext2_free_inode(ext2, file->inum, false);
+		free(file);
+		goto out;
+	}
+
+	*fcookie = file;
+	err = 0;
+
+out:
+	mutex_release(&ext2->lock);
+	return err;
+}
@@ -36,6 +36,9 @@
 #if WITH_LIB_FS_FAT32
 #include <lib/fs/fat32.h>
 #endif
+#if WITH_LIB_FFS
+#include <ffs.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -49,7 +52,12 @@ struct fs_type {
 	int (*stat)(filecookie, struct file_stat *);
 	int (*read)(filecookie, void *, off_t, size_t);
 	int (*write)(filecookie, const void *, off_t, size_t);
+	int (*truncate)(filecookie, off_t);
 	int (*close)(filecookie);
+
+	/* optional, borrowing data straight out of the fs cache */
+	ssize_t (*get_data)(filecookie, off_t, const void **);
+	int (*put_data)(filecookie, const void *);
 };
 
 struct fs_mount {
@@ -75,9 +83,29 @@ static struct fs_type types[] = {
 		.mount = ext2_mount,
 		.unmount = ext2_unmount,
 		.open = ext2_open_file,
+		.create = ext2_create_file,
 		.stat = ext2_stat_file,
 		.read = ext2_read_file,
+		.write = ext2_write_file,
+		.truncate = ext2_truncate_file,
 		.close = ext2_close_file,
+		.get_data = ext2_get_file_data,
+		.put_data = ext2_put_file_data,
+	},
+#endif
+#if WITH_LIB_FFS
+	{
+		.name = "fat",
+		.mount = ffs_fs_mount,
+		.unmount = ffs_fs_unmount,
+		.open = ffs_fs_open_file,
+		.create = ffs_fs_create_file,
+		.mkdir = ffs_fs_make_dir,
+		.stat = ffs_fs_stat_file,
+		.read = ffs_fs_read_file,
+		.write = ffs_fs_write_file,
+		.truncate = ffs_fs_truncate_file,
+		.close = ffs_fs_close_file,
 	},
 #endif
 #if WITH_LIB_FS_FAT32
@@ -196,7 +224,16 @@ static int mount(const char *path, const char *device, struct fs_type *type)
 
 int fs_mount(const char *path, const char *device)
 {
-	return mount(path, device, &types[0]);
+	int err = ERR_NOT_SUPPORTED;
+
+	/* try each filesystem in turn until one recognizes the device */
+	for (size_t i = 0; i < countof(types); i++) {
+		err = mount(path, device, &types[i]);
+		if (err >= 0 || err == ERR_ALREADY_MOUNTED || err == ERR_BAD_PATH)
+			break;
+	}
+
+	return err;
 }
 
 int fs_mount_type(const char *path, const char *device, const char *name)
@@ -325,6 +362,49 @@ int fs_read_file(filecookie fcookie, void *buf, off_t offset, size_t len)
 	return f->mount->type->read(f->cookie, buf, offset, len);
 }
 
+ssize_t fs_read_file_iovec(filecookie fcookie, const iovec_t *iov, uint iov_cnt, off_t offset)
+{
+	struct fs_file *f = fcookie;
+	ssize_t total = 0;
+
+	/* one read per piece, in order, so the filesystem still sees a sequential reader */
+	for (uint i = 0; i < iov_cnt; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+
+		int err = f->mount->type->read(f->cookie, iov[i].iov_base, offset, iov[i].iov_len);
+		if (err < 0)
+			return (total > 0) ? total : err;
+
+		total += err;
+		offset += err;
+		if ((size_t)err < iov[i].iov_len)
+			break;
+	}
+
+	return total;
+}
+
+ssize_t fs_get_file_data(filecookie fcookie, off_t offset, const void **ptr)
+{
+	struct fs_file *f = fcookie;
+
+	if (!f->mount->type->get_data)
+		return ERR_NOT_SUPPORTED;
+
+	return f->mount->type->get_data(f->cookie, offset, ptr);
+}
+
+int fs_put_file_data(filecookie fcookie, const void *ptr)
+{
+	struct fs_file *f = fcookie;
+
+	if (!f->mount->type->put_data)
+		return ERR_NOT_SUPPORTED;
+
+	return f->mount->type->put_data(f->cookie, ptr);
+}
+
 int fs_write_file(filecookie fcookie, const void *buf, off_t offset, size_t len)
 {
 	struct fs_file *f = fcookie;
@@ -335,18 +415,27 @@ int fs_write_file(filecookie fcookie, const void *buf, off_t offset, size_t len)
 	return f->mount->type->write(f->cookie, buf, offset, len);
 }
 
+int fs_truncate_file(filecookie fcookie, off_t len)
+{
+	struct fs_file *f = fcookie;
+
+	if (!f->mount->type->truncate)
+		return ERR_NOT_SUPPORTED;
+
+	return f->mount->type->truncate(f->cookie, len);
+}
+
 int fs_close_file(filecookie fcookie)
 {
 	int err;
 	struct fs_file *f = fcookie;
 
+	/* the file is gone even if writing back what was left of it failed */
 	err = f->mount->type->close(f->cookie);
-	if (err < 0)
-		return err;
 
 	put_mount(f->mount);
 	free(f);
-	return 0;
+	return err;
 }
 
 int fs_stat_file(filecookie fcookie, struct file_stat *stat)
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/fs.h>
+
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/mutex.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* a mapped file, shared by everyone who maps the same path */
+struct fs_mapping {
+	struct list_node node;
+	char *path;
+	void *ptr;
+	size_t len;
+	uint refs;
+
+#if WITH_KERNEL_VM
+	/* open for as long as it's mapped, pages are read in from it as they're touched */
+	filecookie file;
+	mutex_t lock;
+#endif
+};
+
+static struct list_node mapping_list = LIST_INITIAL_VALUE(mapping_list);
+static mutex_t mapping_lock = MUTEX_INITIAL_VALUE(mapping_lock);
+
+#if WITH_KERNEL_VM
+static status_t fs_mmap_fill(void *arg, size_t offset, void *page)
+{
+	struct fs_mapping *m = arg;
+
+	LTRACEF("path %s offset 0x%zx\n", m->path, offset);
+
+	/* faults on different pages can't share the file's read state */
+	mutex_acquire(&m->lock);
+	int err = fs_read_file(m->file, page, offset, MIN(PAGE_SIZE, m->len - offset));
+	mutex_release(&m->lock);
+	if (err < 0)
+		return err;
+
+	/* past the end of the file reads as zeros */
+	memset((uint8_t *)page + err, 0, PAGE_SIZE - err);
+
+	return NO_ERROR;
+}
+#endif
+
+static status_t fs_mmap_create(struct fs_mapping *m)
+{
+	filecookie file;
+	status_t err = fs_open_file(m->path, &file);
+	if (err < 0)
+		return err;
+
+	struct file_stat stat;
+	err = fs_stat_file(file, &stat);
+	if (err < 0)
+		goto out;
+
+	if (stat.is_dir) {
+		err = ERR_NOT_FILE;
+		goto out;
+	}
+	if (stat.size <= 0 || (uint64_t)stat.size > SIZE_MAX) {
+		err = ERR_NOT_VALID;
+		goto out;
+	}
+	m->len = stat.size;
+
+#if WITH_KERNEL_VM
+	m->file = file;
+	mutex_init(&m->lock);
+
+	err = vmm_alloc_backed(vmm_get_kernel_aspace(), "fs mmap", m->len, &m->ptr, 0, fs_mmap_fill, m, 0,
+	                       ARCH_MMU_FLAG_CACHED | ARCH_MMU_FLAG_PERM_RO | ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+	if (err < 0) {
+		mutex_destroy(&m->lock);
+		goto out;
+	}
+
+	return NO_ERROR;
+#else
+	/* no way to fault it in, read the whole thing now */
+	m->ptr = malloc(m->len);
+	if (!m->ptr) {
+		err = ERR_NO_MEMORY;
+		goto out;
+	}
+
+	err = fs_read_file(file, m->ptr, 0, m->len);
+	if (err >= 0 && (size_t)err < m->len)
+		err = ERR_IO;
+	if (err < 0) {
+		free(m->ptr);
+		goto out;
+	}
+
+	err = NO_ERROR;
+#endif
+
+out:
+	fs_close_file(file);
+	return err;
+}
+
+int fs_mmap_file(const char *_path, const void **ptr, size_t *len)
+{
+	char *path = strdup(_path);
+	if (!path)
+		return ERR_NO_MEMORY;
+	fs_normalize_path(path);
+
+	mutex_acquire(&mapping_lock);
+
+	struct fs_mapping *m;
+	list_for_every_entry(&mapping_list, m, struct fs_mapping, node) {
+		if (!strcmp(m->path, path)) {
+			m->refs++;
+			goto done;
+		}
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		mutex_release(&mapping_lock);
+		free(path);
+		return ERR_NO_MEMORY;
+	}
+	m->path = path;
+	path = NULL;
+
+	status_t err = fs_mmap_create(m);
+	if (err < 0) {
+		mutex_release(&mapping_lock);
+		free(m->path);
+		free(m);
+		return err;
+	}
+
+	m->refs = 1;
+	list_add_head(&mapping_list, &m->node);
+
+done:
+	*ptr = m->ptr;
+	if (len)
+		*len = m->len;
+
+	mutex_release(&mapping_lock);
+	free(path);
+
+	LTRACEF("path %s ptr %p len %zu refs %u\n", m->path, m->ptr, m->len, m->refs);
+
+	return NO_ERROR;
+}
+
+int fs_munmap_file(const void *ptr)
+{
+	mutex_acquire(&mapping_lock);
+
+	struct fs_mapping *m;
+	list_for_every_entry(&mapping_list, m, struct fs_mapping, node) {
+		if (m->ptr == ptr)
+			goto found;
+	}
+
+	mutex_release(&mapping_lock);
+	return ERR_NOT_FOUND;
+
+found:
+	if (--m->refs > 0) {
+		mutex_release(&mapping_lock);
+		return NO_ERROR;
+	}
+
+	list_delete(&m->node);
+	mutex_release(&mapping_lock);
+
+#if WITH_KERNEL_VM
+	vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)m->ptr);
+	fs_close_file(m->file);
+	mutex_destroy(&m->lock);
+#else
+	free(m->ptr);
+#endif
+	free(m->path);
+	free(m);
+
+	return NO_ERROR;
+}
@@ -4,6 +4,8 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/fs.c \
+	$(LOCAL_DIR)/cache.c \
+	$(LOCAL_DIR)/mmap.c \
 	$(LOCAL_DIR)/debug.c
 
 include make/module.mk
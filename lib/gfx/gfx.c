@@ -38,6 +38,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <arch/ops.h>
+#include <arch/simd.h>
 #include <sys/types.h>
 #include <lib/gfx.h>
 #include <dev/display.h>
@@ -55,6 +56,65 @@ static uint16_t ARGB8888_to_RGB565(uint32_t in)
 	return out;
 }
 
+/*
+ * RGB565 channels widened to 8 bits by replicating their top bits, so full
+ * scale maps to 0xff. Built by the compiler into .rodata rather than at first
+ * use.
+ */
+#define EXPAND5(n) (((n) << 3) | ((n) >> 2))
+#define EXPAND6(n) (((n) << 2) | ((n) >> 4))
+#define EXPAND_X4(e, n) e(n), e((n) + 1), e((n) + 2), e((n) + 3)
+#define EXPAND_X16(e, n) EXPAND_X4(e, n), EXPAND_X4(e, (n) + 4), EXPAND_X4(e, (n) + 8), EXPAND_X4(e, (n) + 12)
+
+static const uint8_t rgb565_expand5[32] = {
+	EXPAND_X16(EXPAND5, 0), EXPAND_X16(EXPAND5, 16),
+};
+
+static const uint8_t rgb565_expand6[64] = {
+	EXPAND_X16(EXPAND6, 0), EXPAND_X16(EXPAND6, 16),
+	EXPAND_X16(EXPAND6, 32), EXPAND_X16(EXPAND6, 48),
+};
+
+static inline uint32_t RGB565_to_ARGB8888(uint16_t in)
+{
+	return 0xff000000 |
+	       ((uint32_t)rgb565_expand5[in >> 11] << 16) |
+	       ((uint32_t)rgb565_expand6[(in >> 5) & 0x3f] << 8) |
+	       rgb565_expand5[in & 0x1f];
+}
+
+/**
+ * @brief  Add a rectangle to what the next flush sends to the display.
+ *
+ * The rectangle must already be clipped to the surface.
+ */
+static void mark_dirty(gfx_surface *surface, uint x, uint y, uint width, uint height)
+{
+	if (surface->dirty_x2 == 0) {
+		surface->dirty_x1 = x;
+		surface->dirty_y1 = y;
+		surface->dirty_x2 = x + width;
+		surface->dirty_y2 = y + height;
+		return;
+	}
+
+	surface->dirty_x1 = MIN(surface->dirty_x1, x);
+	surface->dirty_y1 = MIN(surface->dirty_y1, y);
+	surface->dirty_x2 = MAX(surface->dirty_x2, x + width);
+	surface->dirty_y2 = MAX(surface->dirty_y2, y + height);
+}
+
+/**
+ * @brief  Note a rectangle that was written to without the gfx_* calls.
+ */
+void gfx_surface_mark_dirty(gfx_surface *surface, uint x, uint y, uint width, uint height)
+{
+	if (x >= surface->width || y >= surface->height || width == 0 || height == 0)
+		return;
+
+	mark_dirty(surface, x, y, MIN(width, surface->width - x), MIN(height, surface->height - y));
+}
+
 /**
  * @brief  Copy a rectangle of pixels from one part of the display to another.
  */
@@ -85,6 +145,7 @@ void gfx_copyrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
 		height = surface->height - y2;
 
 	surface->copyrect(surface, x, y, width, height, x2, y2);
+	mark_dirty(surface, x2, y2, width, height);
 }
 
 /**
@@ -110,6 +171,7 @@ void gfx_fillrect(gfx_surface *surface, uint x, uint y, uint width, uint height,
 		height = surface->height - y;
 
 	surface->fillrect(surface, x, y, width, height, color);
+	mark_dirty(surface, x, y, width, height);
 }
 
 /**
@@ -123,6 +185,7 @@ void gfx_putpixel(gfx_surface *surface, uint x, uint y, uint color)
 		return;
 
 	surface->putpixel(surface, x, y, color);
+	mark_dirty(surface, x, y, 1, 1);
 }
 
 static void putpixel16(gfx_surface *surface, uint x, uint y, uint color)
@@ -140,248 +203,506 @@ static void putpixel32(gfx_surface *surface, uint x, uint y, uint color)
 	*dest = color;
 }
 
-static void copyrect16(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
+uint32_t alpha32_add_ignore_destalpha(uint32_t dest, uint32_t src)
 {
-	// copy
-	const uint16_t *src = &((const uint16_t *)surface->ptr)[x + y * surface->stride];
-	uint16_t *dest = &((uint16_t *)surface->ptr)[x2 + y2 * surface->stride];
-	uint stride_diff = surface->stride - width;
+	uint32_t cdest[3];
+	uint32_t csrc[3];
 
-	if (dest < src) {
-		uint i, j;
-		for (i=0; i < height; i++) {
-			for (j=0; j < width; j++) {
-				*dest = *src;
-				dest++;
-				src++;
-			}
-			dest += stride_diff;
-			src += stride_diff;
-		}
-	} else {
-		// copy backwards
-		src += height * surface->stride + width;
-		dest += height * surface->stride + width;
+	uint32_t srca;
+	uint32_t srcainv;
 
-		uint i, j;
-		for (i=0; i < height; i++) {
-			for (j=0; j < width; j++) {
-				*dest = *src;
-				dest--;
-				src--;
-			}
-			dest -= stride_diff;
-			src -= stride_diff;
-		}
+	srca = (src >> 24) & 0xff;
+	if (srca == 0) {
+		return dest;
+	} else if (srca == 255) {
+		return src;
 	}
+	srca++;
+	srcainv = (255 - srca);
+
+	cdest[0] = (dest >> 16) & 0xff;
+	cdest[1] = (dest >> 8) & 0xff;
+	cdest[2] = (dest >> 0) & 0xff;
+
+	csrc[0] = (src >> 16) & 0xff;
+	csrc[1] = (src >> 8) & 0xff;
+	csrc[2] = (src >> 0) & 0xff;
+
+//	if (srca > 0)
+//		printf("s %d %d %d d %d %d %d a %d ai %d\n", csrc[0], csrc[1], csrc[2], cdest[0], cdest[1], cdest[2], srca, srcainv);
+
+	uint32_t cres[3];
+
+	cres[0] = ((csrc[0] * srca) / 256) + ((cdest[0] * srcainv) / 256);
+	cres[1] = ((csrc[1] * srca) / 256) + ((cdest[1] * srcainv) / 256);
+	cres[2] = ((csrc[2] * srca) / 256) + ((cdest[2] * srcainv) / 256);
+
+	return (srca << 24) | (cres[0] << 16) | (cres[1] << 8) | (cres[2]);
 }
 
-static void fillrect16(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
-{
-	uint16_t *dest = &((uint16_t *)surface->ptr)[x + y * surface->stride];
-	uint stride_diff = surface->stride - width;
+#if WITH_KERNEL_SIMD
+/* rows narrower than this, in pixels, aren't worth the simd_begin() */
+#define SIMD_MIN_WIDTH 16
+/* interrupts are off inside simd_begin(), so big rectangles go this many pixels at a time */
+#define SIMD_CHUNK 16384
 
-	uint16_t color16 = ARGB8888_to_RGB565(color);
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
 
-	uint i, j;
-	for (i=0; i < height; i++) {
-		for (j=0; j < width; j++) {
-			*dest = color16;
-			dest++;
+static inline uint simd_rows(uint width)
+{
+	return MAX(1u, SIMD_CHUNK / width);
+}
+
+/*
+ * Fill rows of row_len bytes with a repeating 32 bit pattern, 16 bytes a
+ * store. A 16 bit color is passed doubled up. Runs between simd_begin() and
+ * simd_end().
+ */
+__NO_INLINE static void fill_simd(uint8_t *dest, size_t pitch, size_t row_len, uint rows, uint32_t pattern)
+{
+	const u32x4 v = { pattern, pattern, pattern, pattern };
+
+	for (uint i = 0; i < rows; i++) {
+		uint8_t *d = dest;
+		size_t len = row_len;
+
+		for (; len >= 64; len -= 64) {
+			memcpy(d, &v, 16);
+			memcpy(d + 16, &v, 16);
+			memcpy(d + 32, &v, 16);
+			memcpy(d + 48, &v, 16);
+			d += 64;
 		}
-		dest += stride_diff;
+		for (; len >= 16; len -= 16) {
+			memcpy(d, &v, 16);
+			d += 16;
+		}
+		for (; len >= 4; len -= 4) {
+			memcpy(d, &pattern, 4);
+			d += 4;
+		}
+		if (len)
+			memcpy(d, &pattern, len);
+
+		dest += pitch;
 	}
 }
 
-static void copyrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
+/*
+ * alpha32_add_ignore_destalpha() four pixels at a time, with the same
+ * results. Runs between simd_begin() and simd_end().
+ */
+__NO_INLINE static void blend_row32_simd(uint32_t *dest, const uint32_t *src, uint width)
 {
-	// copy
-	const uint32_t *src = &((const uint32_t *)surface->ptr)[x + y * surface->stride];
-	uint32_t *dest = &((uint32_t *)surface->ptr)[x2 + y2 * surface->stride];
-	uint stride_diff = surface->stride - width;
+	const u32x4 ff = { 0xff, 0xff, 0xff, 0xff };
+	const u32x4 zero = { 0, 0, 0, 0 };
+	uint j;
+
+	for (j = 0; j + 4 <= width; j += 4) {
+		u32x4 s, d;
+		memcpy(&s, &src[j], 16);
+		memcpy(&d, &dest[j], 16);
+
+		u32x4 sa = s >> 24;
+		u32x4 a = sa + 1;
+		u32x4 ainv = ff - a;
+
+		u32x4 r = ((((s >> 16) & ff) * a) >> 8) + ((((d >> 16) & ff) * ainv) >> 8);
+		u32x4 g = ((((s >> 8) & ff) * a) >> 8) + ((((d >> 8) & ff) * ainv) >> 8);
+		u32x4 b = (((s & ff) * a) >> 8) + (((d & ff) * ainv) >> 8);
+		u32x4 out = (a << 24) | (r << 16) | (g << 8) | b;
+
+		// fully opaque and fully clear source pixels pass straight through
+		u32x4 opaque = (u32x4)(sa == ff);
+		u32x4 clear = (u32x4)(sa == zero);
+		out = (out & ~(opaque | clear)) | (s & opaque) | (d & clear);
+
+		memcpy(&dest[j], &out, 16);
+	}
 
-	if (dest < src) {
-		uint i, j;
-		for (i=0; i < height; i++) {
-			for (j=0; j < width; j++) {
-				*dest = *src;
-				dest++;
-				src++;
-			}
-			dest += stride_diff;
-			src += stride_diff;
+	for (; j < width; j++)
+		dest[j] = alpha32_add_ignore_destalpha(dest[j], src[j]);
+}
+
+/*
+ * ARGB8888_to_RGB565() four pixels at a time. Runs between simd_begin() and
+ * simd_end().
+ */
+__NO_INLINE static void convert_row565_simd(uint16_t *dest, const uint32_t *src, uint width)
+{
+	uint j;
+
+	for (j = 0; j + 4 <= width; j += 4) {
+		u32x4 s;
+		memcpy(&s, &src[j], 16);
+
+		u32x4 out = ((s >> 3) & 0x1f) | (((s >> 10) & 0x3f) << 5) | (((s >> 19) & 0x1f) << 11);
+
+		dest[j] = out[0];
+		dest[j + 1] = out[1];
+		dest[j + 2] = out[2];
+		dest[j + 3] = out[3];
+	}
+
+	for (; j < width; j++)
+		dest[j] = ARGB8888_to_RGB565(src[j]);
+}
+#endif
+
+/*
+ * Copy a rectangle a row at a time, in whichever order keeps an overlapping
+ * source intact. memmove handles overlap within a row.
+ */
+static void copyrect_rows(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
+{
+	size_t pitch = surface->stride * surface->pixelsize;
+	size_t len = width * surface->pixelsize;
+	const uint8_t *src = (const uint8_t *)surface->ptr + y * pitch + x * surface->pixelsize;
+	uint8_t *dest = (uint8_t *)surface->ptr + y2 * pitch + x2 * surface->pixelsize;
+
+	if (y2 <= y) {
+		for (uint i = 0; i < height; i++) {
+			memmove(dest, src, len);
+			dest += pitch;
+			src += pitch;
 		}
 	} else {
 		// copy backwards
-		src += height * surface->stride + width;
-		dest += height * surface->stride + width;
+		src += (height - 1) * pitch;
+		dest += (height - 1) * pitch;
 
-		uint i, j;
-		for (i=0; i < height; i++) {
-			for (j=0; j < width; j++) {
-				*dest = *src;
-				dest--;
-				src--;
-			}
-			dest -= stride_diff;
-			src -= stride_diff;
+		for (uint i = 0; i < height; i++) {
+			memmove(dest, src, len);
+			dest -= pitch;
+			src -= pitch;
 		}
 	}
 }
 
-static void fillrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
+/*
+ * Fill a rectangle with a 32 bit pattern, a 16 bit color doubled up.
+ */
+static void fillrect_pattern(gfx_surface *surface, uint x, uint y, uint width, uint height, uint32_t pattern)
 {
-	uint32_t *dest = &((uint32_t *)surface->ptr)[x + y * surface->stride];
-	uint stride_diff = surface->stride - width;
+	size_t pitch = surface->stride * surface->pixelsize;
+	uint8_t *dest = (uint8_t *)surface->ptr + y * pitch + x * surface->pixelsize;
+
+#if WITH_KERNEL_SIMD
+	if (width >= SIMD_MIN_WIDTH && simd_available()) {
+		uint rows = simd_rows(width);
+		for (uint i = 0; i < height; i += rows) {
+			simd_begin();
+			fill_simd(dest + i * pitch, pitch, width * surface->pixelsize, MIN(rows, height - i), pattern);
+			simd_end();
+		}
+		return;
+	}
+#endif
 
 	uint i, j;
-	for (i=0; i < height; i++) {
-		for (j=0; j < width; j++) {
-			*dest = color;
-			dest++;
+	if (surface->pixelsize == 2) {
+		for (i=0; i < height; i++) {
+			uint16_t *d = (uint16_t *)dest;
+			for (j=0; j < width; j++)
+				d[j] = pattern;
+			dest += pitch;
+		}
+	} else {
+		for (i=0; i < height; i++) {
+			uint32_t *d = (uint32_t *)dest;
+			for (j=0; j < width; j++)
+				d[j] = pattern;
+			dest += pitch;
 		}
-		dest += stride_diff;
 	}
 }
 
-uint32_t alpha32_add_ignore_destalpha(uint32_t dest, uint32_t src)
+static void copyrect16(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
 {
-	uint32_t cdest[3];
-	uint32_t csrc[3];
+	copyrect_rows(surface, x, y, width, height, x2, y2);
+}
 
-	uint32_t srca;
-	uint32_t srcainv;
+static void fillrect16(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
+{
+	uint16_t color16 = ARGB8888_to_RGB565(color);
 
-	srca = (src >> 24) & 0xff;
-	if (srca == 0) {
-		return dest;
-	} else if (srca == 255) {
-		return src;
-	}
-	srca++;
-	srcainv = (255 - srca);
+	fillrect_pattern(surface, x, y, width, height, color16 | ((uint32_t)color16 << 16));
+}
 
-	cdest[0] = (dest >> 16) & 0xff;
-	cdest[1] = (dest >> 8) & 0xff;
-	cdest[2] = (dest >> 0) & 0xff;
+static void copyrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint x2, uint y2)
+{
+	copyrect_rows(surface, x, y, width, height, x2, y2);
+}
 
-	csrc[0] = (src >> 16) & 0xff;
-	csrc[1] = (src >> 8) & 0xff;
-	csrc[2] = (src >> 0) & 0xff;
+static void fillrect32(gfx_surface *surface, uint x, uint y, uint width, uint height, uint color)
+{
+	fillrect_pattern(surface, x, y, width, height, color);
+}
 
-//	if (srca > 0)
-//		printf("s %d %d %d d %d %d %d a %d ai %d\n", csrc[0], csrc[1], csrc[2], cdest[0], cdest[1], cdest[2], srca, srcainv);
+/*
+ * Blend rows srcy to srcy + height of source onto target at destx, desty,
+ * already clipped. With simd set the caller is between simd_begin() and
+ * simd_end().
+ */
+static void blend_rect(struct gfx_surface *target, struct gfx_surface *source,
+                       uint destx, uint desty, uint srcy, uint width, uint height, bool simd)
+{
+	size_t src_pitch = source->stride * source->pixelsize;
+	size_t dest_pitch = target->stride * target->pixelsize;
+	const uint8_t *src = (const uint8_t *)source->ptr + srcy * src_pitch;
+	uint8_t *dest = (uint8_t *)target->ptr + desty * dest_pitch + destx * target->pixelsize;
 
-	uint32_t cres[3];
+	LTRACEF("w %u h %u dpitch %zu spitch %zu simd %d\n", width, height, dest_pitch, src_pitch, simd);
 
-	cres[0] = ((csrc[0] * srca) / 256) + ((cdest[0] * srcainv) / 256);
-	cres[1] = ((csrc[1] * srca) / 256) + ((cdest[1] * srcainv) / 256);
-	cres[2] = ((csrc[2] * srca) / 256) + ((cdest[2] * srcainv) / 256);
+	uint i, j;
+	if (source->format == target->format &&
+	        (source->format == GFX_FORMAT_RGB_565 || source->format == GFX_FORMAT_RGB_x888)) {
+		// no alpha, straight copy
+		for (i=0; i < height; i++) {
+			memcpy(dest, src, width * target->pixelsize);
+			dest += dest_pitch;
+			src += src_pitch;
+		}
+	} else if (source->format == GFX_FORMAT_ARGB_8888 && target->format == GFX_FORMAT_ARGB_8888) {
+		// both are 32 bit modes, both alpha
+		for (i=0; i < height; i++) {
+#if WITH_KERNEL_SIMD
+			if (simd) {
+				blend_row32_simd((uint32_t *)dest, (const uint32_t *)src, width);
+			} else
+#endif
+			{
+				uint32_t *d = (uint32_t *)dest;
+				const uint32_t *s = (const uint32_t *)src;
+				for (j=0; j < width; j++) {
+					// XXX ignores destination alpha
+					d[j] = alpha32_add_ignore_destalpha(d[j], s[j]);
+				}
+			}
+			dest += dest_pitch;
+			src += src_pitch;
+		}
+	} else if (source->pixelsize == 4 && target->format == GFX_FORMAT_RGB_565) {
+		// 32 bit down to 16 bit, ignores source alpha
+		for (i=0; i < height; i++) {
+#if WITH_KERNEL_SIMD
+			if (simd) {
+				convert_row565_simd((uint16_t *)dest, (const uint32_t *)src, width);
+			} else
+#endif
+			{
+				uint16_t *d = (uint16_t *)dest;
+				const uint32_t *s = (const uint32_t *)src;
+				for (j=0; j < width; j++)
+					d[j] = ARGB8888_to_RGB565(s[j]);
+			}
+			dest += dest_pitch;
+			src += src_pitch;
+		}
+	} else if (source->format == GFX_FORMAT_RGB_565 && target->pixelsize == 4) {
+		// 16 bit up to 32 bit, opaque
+		for (i=0; i < height; i++) {
+			uint32_t *d = (uint32_t *)dest;
+			const uint16_t *s = (const uint16_t *)src;
+			for (j=0; j < width; j++)
+				d[j] = RGB565_to_ARGB8888(s[j]);
+			dest += dest_pitch;
+			src += src_pitch;
+		}
+	} else {
+		panic("gfx_surface_blend: unimplemented colorspace combination (source %d target %d)\n", source->format, target->format);
+	}
+}
 
-	return (srca << 24) | (cres[0] << 16) | (cres[1] << 8) | (cres[2]);
+/*
+ * Clip a blend to the target, returns false if nothing is left.
+ */
+static bool blend_clip(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty, uint *width, uint *height)
+{
+	if (destx >= target->width)
+		return false;
+	if (desty >= target->height)
+		return false;
+
+	*width = MIN(source->width, target->width - destx);
+	*height = MIN(source->height, target->height - desty);
+
+	return true;
+}
+
+/*
+ * Blend a clipped rectangle, holding the vector unit a chunk of rows at a
+ * time when it's worth it.
+ */
+static void blend_chunked(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty, uint width, uint height)
+{
+#if WITH_KERNEL_SIMD
+	// the plain copies are memcpy already and widening 565 is table driven
+	bool vector = (source->format == GFX_FORMAT_ARGB_8888 ||
+	               (target->format != source->format && source->format != GFX_FORMAT_RGB_565));
+
+	if (vector && width >= SIMD_MIN_WIDTH && simd_available()) {
+		uint rows = simd_rows(width);
+		for (uint i = 0; i < height; i += rows) {
+			simd_begin();
+			blend_rect(target, source, destx, desty + i, i, width, MIN(rows, height - i), true);
+			simd_end();
+		}
+		return;
+	}
+#endif
+
+	blend_rect(target, source, destx, desty, 0, width, height, false);
 }
 
 /**
  * @brief  Copy pixels from source to dest.
  *
- * Currently does not support alpha channel.
+ * ARGB8888 sources are alpha blended onto ARGB8888 targets, ignoring the
+ * destination alpha. 32 bit sources can also be converted onto RGB565
+ * targets and RGB565 sources onto 32 bit ones, other combinations have to
+ * match.
  */
 void gfx_surface_blend(struct gfx_surface *target, struct gfx_surface *source, uint destx, uint desty)
 {
-	DEBUG_ASSERT(target->format == source->format);
-
 	LTRACEF("target %p, source %p, destx %u, desty %u\n", target, source, destx, desty);
 
-	if (destx >= target->width)
-		return;
-	if (desty >= target->height)
+	uint width, height;
+	if (!blend_clip(target, source, destx, desty, &width, &height))
 		return;
 
-	uint width = source->width;
-	if (destx + width > target->width)
-		width = target->width - destx;
+	blend_chunked(target, source, destx, desty, width, height);
 
-	uint height = source->height;
-	if (desty + height > target->height)
-		height = target->height - desty;
+	mark_dirty(target, destx, desty, width, height);
+}
 
-	// XXX total hack to deal with various blends
-	if (source->format == GFX_FORMAT_RGB_565 && target->format == GFX_FORMAT_RGB_565) {
-		// 16 bit to 16 bit
-		const uint16_t *src = (const uint16_t *)source->ptr;
-		uint16_t *dest = &((uint16_t *)target->ptr)[destx + desty * target->stride];
-		uint dest_stride_diff = target->stride - width;
-		uint source_stride_diff = source->stride - width;
+/**
+ * @brief  Blend a list of surfaces onto target, in order.
+ *
+ * Small blits share one simd_begin()/simd_end(), which is most of the cost of
+ * blending something the size of a glyph or an icon.
+ */
+void gfx_surface_blend_list(struct gfx_surface *target, const struct gfx_blit *blits, uint count)
+{
+	LTRACEF("target %p, blits %p, count %u\n", target, blits, count);
 
-		LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
+#if WITH_KERNEL_SIMD
+	bool held = false;
+	uint budget = 0;
+#endif
 
-		uint i, j;
-		for (i=0; i < height; i++) {
-			for (j=0; j < width; j++) {
-				*dest = *src;
-				dest++;
-				src++;
-			}
-			dest += dest_stride_diff;
-			src += source_stride_diff;
-		}
-	} else if (source->format == GFX_FORMAT_ARGB_8888 && target->format == GFX_FORMAT_ARGB_8888) {
-		// both are 32 bit modes, both alpha
-		const uint32_t *src = (const uint32_t *)source->ptr;
-		uint32_t *dest = &((uint32_t *)target->ptr)[destx + desty * target->stride];
-		uint dest_stride_diff = target->stride - width;
-		uint source_stride_diff = source->stride - width;
+	for (uint i = 0; i < count; i++) {
+		struct gfx_surface *source = blits[i].source;
+		uint destx = blits[i].destx;
+		uint desty = blits[i].desty;
+		uint width, height;
 
-		LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
+		if (!blend_clip(target, source, destx, desty, &width, &height))
+			continue;
 
-		uint i, j;
-		for (i=0; i < height; i++) {
-			for (j=0; j < width; j++) {
-				// XXX ignores destination alpha
-				*dest = alpha32_add_ignore_destalpha(*dest, *src);
-				dest++;
-				src++;
+#if WITH_KERNEL_SIMD
+		if (width * height <= SIMD_CHUNK && simd_available()) {
+			if (held && budget < width * height) {
+				simd_end();
+				held = false;
+			}
+			if (!held) {
+				simd_begin();
+				held = true;
+				budget = SIMD_CHUNK;
+			}
+			blend_rect(target, source, destx, desty, 0, width, height, true);
+			budget -= width * height;
+		} else {
+			if (held) {
+				simd_end();
+				held = false;
 			}
-			dest += dest_stride_diff;
-			src += source_stride_diff;
+			blend_chunked(target, source, destx, desty, width, height);
 		}
-	} else if (source->format == GFX_FORMAT_RGB_x888 && target->format == GFX_FORMAT_RGB_x888) {
-		// both are 32 bit modes, no alpha
-		const uint32_t *src = (const uint32_t *)source->ptr;
-		uint32_t *dest = &((uint32_t *)target->ptr)[destx + desty * target->stride];
-		uint dest_stride_diff = target->stride - width;
-		uint source_stride_diff = source->stride - width;
+#else
+		blend_rect(target, source, destx, desty, 0, width, height, false);
+#endif
 
-		LTRACEF("w %u h %u dstride %u sstride %u\n", width, height, dest_stride_diff, source_stride_diff);
+		mark_dirty(target, destx, desty, width, height);
+	}
 
-		uint i, j;
-		for (i=0; i < height; i++) {
-			for (j=0; j < width; j++) {
-				*dest = *src;
-				dest++;
-				src++;
-			}
-			dest += dest_stride_diff;
-			src += source_stride_diff;
-		}
-	} else {
-		panic("gfx_surface_blend: unimplemented colorspace combination (source %d target %d)\n", source->format, target->format);
+#if WITH_KERNEL_SIMD
+	if (held)
+		simd_end();
+#endif
+}
+
+static void clean_rows(gfx_surface *surface, const void *buf, uint start, uint count)
+{
+	size_t row = surface->stride * surface->pixelsize;
+
+	arch_clean_cache_range((addr_t)buf + start * row, count * row);
+}
+
+/**
+ * @brief  Send a rectangle of the surface to the display.
+ */
+static void flush_rect(gfx_surface *surface, uint x, uint y, uint width, uint height)
+{
+	clean_rows(surface, surface->ptr, y, height);
+
+	if (surface->flush_rect)
+		surface->flush_rect(surface->ptr, x, y, width, height);
+	else if (surface->flush)
+		surface->flush(y, y + height - 1);
+}
+
+/**
+ * @brief  Show the back buffer and catch the new back buffer up with it.
+ */
+static void flip(gfx_surface *surface)
+{
+	uint x = surface->dirty_x1;
+	uint y = surface->dirty_y1;
+	uint width = surface->dirty_x2 - x;
+	uint height = surface->dirty_y2 - y;
+
+	flush_rect(surface, x, y, width, height);
+
+	void *shown = surface->ptr;
+	surface->ptr = surface->front;
+	surface->front = shown;
+
+	// the new back buffer is a frame behind, copy over what was just drawn
+	size_t row = surface->stride * surface->pixelsize;
+	size_t offset = y * row + x * surface->pixelsize;
+	for (uint i = 0; i < height; i++) {
+		memcpy((uint8_t *)surface->ptr + offset, (const uint8_t *)shown + offset, width * surface->pixelsize);
+		offset += row;
 	}
 }
 
 /**
  * @brief  Ensure all graphics rendering is sent to display
+ *
+ * Only the area drawn to since the last flush is sent.
  */
 void gfx_flush(gfx_surface *surface)
 {
-	arch_clean_cache_range((addr_t)surface->ptr, surface->len);
+	if (surface->dirty_x2 == 0)
+		return;
 
-	if (surface->flush)
-		surface->flush(0, surface->height-1);
+	if (surface->front) {
+		flip(surface);
+	} else {
+		flush_rect(surface, surface->dirty_x1, surface->dirty_y1,
+		           surface->dirty_x2 - surface->dirty_x1, surface->dirty_y2 - surface->dirty_y1);
+	}
+
+	surface->dirty_x2 = 0;
 }
 
 /**
  * @brief  Ensure that a sub-region of the display is up to date.
+ *
+ * Only what was drawn to within the rows is sent. A double buffered surface
+ * can only flip all of it, so it flushes everything.
  */
 void gfx_flush_rows(struct gfx_surface *surface, uint start, uint end)
 {
@@ -396,11 +717,23 @@ void gfx_flush_rows(struct gfx_surface *surface, uint start, uint end)
 	if (end >= surface->height)
 		end = surface->height - 1;
 
-	arch_clean_cache_range((addr_t)surface->ptr + start * surface->stride * surface->pixelsize, (end - start + 1) * surface->stride * surface->pixelsize);
+	if (surface->front) {
+		gfx_flush(surface);
+		return;
+	}
+
+	// nothing drawn within these rows
+	if (surface->dirty_x2 == 0 || surface->dirty_y1 > end || surface->dirty_y2 <= start)
+		return;
+
+	uint y = MAX(surface->dirty_y1, start);
+	uint y2 = MIN(surface->dirty_y2, end + 1);
 
-	if (surface->flush)
-		surface->flush(start, end);
+	flush_rect(surface, surface->dirty_x1, y, surface->dirty_x2 - surface->dirty_x1, y2 - y);
 
+	// the damage is tracked as one rectangle, only drop it if it's all been sent
+	if (y == surface->dirty_y1 && y2 == surface->dirty_y2)
+		surface->dirty_x2 = 0;
 }
 
 
@@ -414,7 +747,7 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
 	DEBUG_ASSERT(stride >= width);
 	DEBUG_ASSERT(format < GFX_FORMAT_MAX);
 
-	gfx_surface *surface = malloc(sizeof(gfx_surface));
+	gfx_surface *surface = calloc(1, sizeof(gfx_surface));
 
 	surface->free_on_destroy = false;
 	surface->format = format;
@@ -462,11 +795,34 @@ gfx_surface *gfx_create_surface(void *ptr, uint width, uint height, uint stride,
  * @brief  Create a new graphics surface object from a display
  */
 gfx_surface *gfx_create_surface_from_display(struct display_info *info)
+{
+	return gfx_create_surface_from_display_etc(info, false);
+}
+
+/**
+ * @brief  Create a new graphics surface object from a display, optionally
+ * double buffered.
+ *
+ * Double buffering needs the display to have a back buffer and flush_rect,
+ * otherwise the surface is single buffered. Only one double buffered surface
+ * should be drawing to a display at a time.
+ */
+gfx_surface *gfx_create_surface_from_display_etc(struct display_info *info, bool double_buffer)
 {
 	gfx_surface* surface;
 	surface = gfx_create_surface(info->framebuffer, info->width, info->height, info->stride, info->format);
+	if (!surface)
+		return NULL;
 
 	surface->flush = info->flush;
+	surface->flush_rect = info->flush_rect;
+
+	if (double_buffer && info->back_framebuffer && info->flush_rect) {
+		// start out drawing into the back buffer with what's on display now
+		surface->front = info->framebuffer;
+		surface->ptr = info->back_framebuffer;
+		memcpy(surface->ptr, surface->front, surface->len);
+	}
 
 	return surface;
 }
@@ -32,6 +32,8 @@
 
 #include <debug.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <lk/init.h>
 #include <lib/gfx.h>
 #include <lib/gfxconsole.h>
@@ -49,13 +51,122 @@ static struct {
 	gfx_surface *surface;
 	uint rows, columns;
 	uint extray; // extra pixels left over if the rows doesn't fit precisely
+	uint height; // of the screen, the surface can be taller
 
 	uint x, y;
 
 	uint32_t front_color;
 	uint32_t back_color;
+
+	// glyph tiles in the colors above, NULL if they couldn't be allocated
+	struct font_cache *glyphs;
+
+	// hardware scrolling, the screen starts pan_y rows down the surface
+	status_t (*pan)(uint y);
+	uint pan_y;
+
+	// otherwise scrolling is put off until the end of a print. text holds
+	// the screen as characters, a ring of rows starting at text_top
+	char *text;
+	uint text_top;
+	uint scroll_pending;
 } gfxconsole;
 
+static char *gfxconsole_text_row(uint row)
+{
+	return &gfxconsole.text[((gfxconsole.text_top + row) % gfxconsole.rows) * gfxconsole.columns];
+}
+
+static void gfxconsole_draw_glyph(char c, uint x, uint y)
+{
+	uint px = x * FONT_X;
+	uint py = gfxconsole.pan_y + y * FONT_Y;
+
+	if (gfxconsole.glyphs)
+		font_draw_char_cached(gfxconsole.surface, gfxconsole.glyphs, c, px, py);
+	else
+		font_draw_char(gfxconsole.surface, c, px, py, gfxconsole.front_color);
+}
+
+static void gfxconsole_draw_char(char c)
+{
+	if (gfxconsole.text)
+		gfxconsole_text_row(gfxconsole.y)[gfxconsole.x] = c;
+
+	// the row gets redrawn once the scroll catches up
+	if (gfxconsole.scroll_pending == 0)
+		gfxconsole_draw_glyph(c, gfxconsole.x, gfxconsole.y);
+
+	gfxconsole.x++;
+}
+
+static void gfxconsole_scroll(void)
+{
+	gfx_surface *s = gfxconsole.surface;
+	uint last = (gfxconsole.rows - 1) * FONT_Y;
+
+	if (gfxconsole.text) {
+		gfxconsole.text_top = (gfxconsole.text_top + 1) % gfxconsole.rows;
+		memset(gfxconsole_text_row(gfxconsole.rows - 1), ' ', gfxconsole.columns);
+	}
+
+	if (gfxconsole.pan) {
+		// slide the screen down a line, going back to the top once the
+		// framebuffer runs out
+		uint top = gfxconsole.pan_y + FONT_Y;
+		if (top + gfxconsole.height > s->height) {
+			gfx_copyrect(s, 0, top, s->width, last, 0, 0);
+			top = 0;
+		}
+		gfxconsole.pan_y = top;
+
+		gfx_fillrect(s, 0, top + last, s->width, gfxconsole.height - last, gfxconsole.back_color);
+		gfx_flush(s);
+		gfxconsole.pan(top);
+		return;
+	}
+
+	if (gfxconsole.text) {
+		// see gfxconsole_catch_up()
+		gfxconsole.scroll_pending++;
+		return;
+	}
+
+	gfx_copyrect(s, 0, FONT_Y, s->width, last, 0, 0);
+	gfx_fillrect(s, 0, last, s->width, FONT_Y, gfxconsole.back_color);
+	gfx_flush(s);
+}
+
+/*
+ * Do the scrolling put off during a print in one go: a single copy of the
+ * lines that are still on screen, and a redraw of the new ones from text.
+ */
+static void gfxconsole_catch_up(void)
+{
+	gfx_surface *s = gfxconsole.surface;
+	uint n = gfxconsole.scroll_pending;
+
+	if (n > 0) {
+		uint first = 0;
+		if (n < gfxconsole.rows) {
+			first = gfxconsole.rows - n;
+			gfx_copyrect(s, 0, n * FONT_Y, s->width, first * FONT_Y, 0, 0);
+		}
+		gfxconsole.scroll_pending = 0;
+
+		gfx_fillrect(s, 0, first * FONT_Y, s->width, gfxconsole.height - first * FONT_Y, gfxconsole.back_color);
+		for (uint y = first; y < gfxconsole.rows; y++) {
+			const char *row = gfxconsole_text_row(y);
+			for (uint x = 0; x < gfxconsole.columns; x++) {
+				if (row[x] != ' ')
+					gfxconsole_draw_glyph(row[x], x, y);
+			}
+		}
+	}
+
+	gfx_flush(s);
+}
+
 static void gfxconsole_putc(char c)
 {
 	static enum { NORMAL, ESCAPE } state = NORMAL;
@@ -70,8 +181,7 @@ static void gfxconsole_putc(char c)
 				p_num = 0;
 				state = ESCAPE;
 			} else {
-				font_draw_char(gfxconsole.surface, c, gfxconsole.x * FONT_X, gfxconsole.y * FONT_Y, gfxconsole.front_color);
-				gfxconsole.x++;
+				gfxconsole_draw_char(c);
 			}
 			break;
 		}
@@ -86,8 +196,7 @@ static void gfxconsole_putc(char c)
 			} else if (c == '[') {
 				// eat this character
 			} else {
-				font_draw_char(gfxconsole.surface, c, gfxconsole.x * FONT_X, gfxconsole.y * FONT_Y, gfxconsole.front_color);
-				gfxconsole.x++;
+				gfxconsole_draw_char(c);
 				state = NORMAL;
 			}
 			break;
@@ -100,10 +209,8 @@ static void gfxconsole_putc(char c)
 	}
 	if (gfxconsole.y >= gfxconsole.rows) {
 		// scroll up
-		gfx_copyrect(gfxconsole.surface, 0, FONT_Y, gfxconsole.surface->width, gfxconsole.surface->height - FONT_Y - gfxconsole.extray, 0, 0);
+		gfxconsole_scroll();
 		gfxconsole.y--;
-		gfx_fillrect(gfxconsole.surface, 0, gfxconsole.surface->height - FONT_Y - gfxconsole.extray, gfxconsole.surface->width, FONT_Y, gfxconsole.back_color);
-		gfx_flush(gfxconsole.surface);
 	}
 }
 
@@ -112,6 +219,8 @@ void gfxconsole_print_callback(print_callback_t *cb, const char *str, size_t len
 	for (size_t i = 0; i < len; i++) {
 		gfxconsole_putc(str[i]);
 	}
+
+	gfxconsole_catch_up();
 }
 
 static print_callback_t cb = {
@@ -119,23 +228,20 @@ static print_callback_t cb = {
 	gfxconsole_print_callback
 };
 
-/**
- * @brief  Initialize graphics console on given drawing surface.
- *
- * The graphics console subsystem is initialized, and registered as
- * an output device for debug output.
- */
-void gfxconsole_start(gfx_surface *surface)
+static void gfxconsole_start_etc(gfx_surface *surface, uint height, status_t (*pan)(uint y))
 {
 	DEBUG_ASSERT(gfxconsole.surface == NULL);
 
 	// set up the surface
 	gfxconsole.surface = surface;
+	gfxconsole.height = height;
+	gfxconsole.pan = pan;
+	gfxconsole.pan_y = 0;
 
 	// calculate how many rows/columns we have
-	gfxconsole.rows = surface->height / FONT_Y;
+	gfxconsole.rows = height / FONT_Y;
 	gfxconsole.columns = surface->width / FONT_X;
-	gfxconsole.extray = surface->height - (gfxconsole.rows * FONT_Y);
+	gfxconsole.extray = height - (gfxconsole.rows * FONT_Y);
 
 	dprintf(SPEW, "gfxconsole: rows %d, columns %d, extray %d\n", gfxconsole.rows, gfxconsole.columns, gfxconsole.extray);
 
@@ -147,12 +253,37 @@ void gfxconsole_start(gfx_surface *surface)
 	gfxconsole.front_color = 0xffffffff;
 	gfxconsole.back_color = 0;
 
+	gfxconsole.glyphs = font_cache_create(surface->format, gfxconsole.front_color, gfxconsole.back_color);
+
+	// without panning, keep the text around to redraw from after a batched scroll
+	if (!pan) {
+		gfxconsole.text = malloc(gfxconsole.rows * gfxconsole.columns);
+		if (gfxconsole.text)
+			memset(gfxconsole.text, ' ', gfxconsole.rows * gfxconsole.columns);
+	}
+	gfxconsole.text_top = 0;
+	gfxconsole.scroll_pending = 0;
+
 	// register for debug callbacks
 	register_print_callback(&cb);
 }
 
+/**
+ * @brief  Initialize graphics console on given drawing surface.
+ *
+ * The graphics console subsystem is initialized, and registered as
+ * an output device for debug output.
+ */
+void gfxconsole_start(gfx_surface *surface)
+{
+	gfxconsole_start_etc(surface, surface->height, NULL);
+}
+
 /**
  * @brief  Initialize graphics console on default display
+ *
+ * Scrolls by panning if the display can, drawing over the whole of its
+ * taller framebuffer.
  */
 void gfxconsole_start_on_display(void)
 {
@@ -166,8 +297,19 @@ void gfxconsole_start_on_display(void)
 	if (display_get_info(&info) < 0)
 		return;
 
-	gfx_surface *s = gfx_create_surface_from_display(&info);
-	gfxconsole_start(s);
+	gfx_surface *s;
+	if (info.pan && info.virtual_height > info.height) {
+		s = gfx_create_surface(info.framebuffer, info.width, info.virtual_height, info.stride, info.format);
+		if (s) {
+			s->flush = info.flush;
+			s->flush_rect = info.flush_rect;
+			gfxconsole_start_etc(s, info.height, info.pan);
+		}
+	} else {
+		s = gfx_create_surface_from_display(&info);
+		if (s)
+			gfxconsole_start(s);
+	}
 	started = true;
 }
 
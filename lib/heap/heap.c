@@ -24,6 +24,7 @@
 #include <debug.h>
 #include <trace.h>
 #include <assert.h>
+#include <bits.h>
 #include <err.h>
 #include <list.h>
 #include <rand.h>
@@ -32,6 +33,7 @@
 #include <string.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <kernel/shrinker.h>
 #include <kernel/spinlock.h>
 #include <lib/heap.h>
 
@@ -55,6 +57,12 @@
 
 STATIC_ASSERT(IS_PAGE_ALIGNED(HEAP_GROW_SIZE));
 
+/* a free span at least this big is handed back to the pmm as soon as it appears,
+ * as long as that still leaves this much free in the heap. 0 leaves it to heap_trim() */
+#if !defined(HEAP_TRIM_THRESHOLD)
+#define HEAP_TRIM_THRESHOLD HEAP_GROW_SIZE
+#endif
+
 #elif WITH_STATIC_HEAP
 
 #if !defined(HEAP_START) || !defined(HEAP_LEN)
@@ -75,18 +83,54 @@ uintptr_t _heap_end = (uintptr_t)&_end_of_ram;
 #define HEAP_LEN ((uintptr_t)_heap_end - HEAP_START)
 #endif
 
+/*
+ * Every chunk starts with a boundary tag holding its own length and the length
+ * of the chunk in front of it, so a freed chunk merges with both neighbours
+ * without a search. Each block given to the heap ends in a tag that is never
+ * freed, so the last real chunk always has a next chunk to look at.
+ *
+ * Free chunks up to HEAP_SMALL_MAX bytes sit in exact size bins with a bitmap
+ * of the non empty ones. Larger chunks live in a tree ordered by length and
+ * then address, so a best fit is found in log time.
+ */
+struct heap_chunk {
+	size_t prev_len;	// length of the chunk in front, 0 if this is the first in its block
+	size_t len;			// length including this tag, HEAP_CHUNK_FREE set while free
+};
+
+#define HEAP_CHUNK_FREE 1
+#define HEAP_GRAIN sizeof(struct heap_chunk)
+
 struct free_heap_chunk {
-	struct list_node node;
-	size_t len;
+	struct heap_chunk tag;
+	union {
+		struct list_node node;	// size bin, or the delayed free list
+		struct {
+			struct free_heap_chunk *parent;
+			struct free_heap_chunk *left;
+			struct free_heap_chunk *right;
+			int height;
+		} tree;
+	};
 };
 
+#define HEAP_MIN_CHUNK ROUNDUP(sizeof(struct heap_chunk) + sizeof(struct list_node), HEAP_GRAIN)
+#define HEAP_SMALL_MAX 1024
+#define HEAP_SMALL_BINS (HEAP_SMALL_MAX / HEAP_GRAIN + 1)
+
+STATIC_ASSERT((HEAP_GRAIN & (HEAP_GRAIN - 1)) == 0);
+STATIC_ASSERT(sizeof(struct free_heap_chunk) <= HEAP_SMALL_MAX);
+
 struct heap {
 	void *base;
 	size_t len;
 	size_t remaining;
 	size_t low_watermark;
+	size_t returned;
 	mutex_t lock;
-	struct list_node free_list;
+	struct list_node small_bins[HEAP_SMALL_BINS];
+	unsigned long small_map[BITMAP_NUM_WORDS(HEAP_SMALL_BINS)];
+	struct free_heap_chunk *large_tree;
 	struct list_node delayed_free_list;
 	spin_lock_t delayed_free_lock;
 };
@@ -101,6 +145,9 @@ struct alloc_struct_begin {
 #endif
 	void *ptr;
 	size_t size;
+#if WITH_HEAP_PROFILE
+	void *caller;
+#endif
 #if DEBUG_HEAP
 	void *padding_start;
 	size_t padding_size;
@@ -109,23 +156,540 @@ struct alloc_struct_begin {
 
 static ssize_t heap_grow(size_t len);
 
-static void dump_free_chunk(struct free_heap_chunk *chunk)
+#if WITH_HEAP_PROFILE
+/*
+ * Allocation profile, enabled by building with WITH_HEAP_PROFILE=1.
+ *
+ * Every allocation is charged against the pc that asked for it, and the
+ * caller is remembered in the allocation so the free can be charged back.
+ * Sites live in a fixed, open addressed table keyed by pc. The table has a
+ * spinlock of its own since heap_delayed_free can't take the heap lock.
+ */
+#define HEAP_PROFILE_ENTRIES 512
+
+struct heap_profile_site {
+	void *caller;
+	ulong allocs;
+	ulong frees;
+	size_t live_bytes;
+	uint64_t total_bytes;
+};
+
+static struct heap_profile_site heap_profile[HEAP_PROFILE_ENTRIES];
+static ulong heap_profile_dropped; // allocations not charged because the table was full
+static spin_lock_t heap_profile_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static struct heap_profile_site *heap_profile_site(void *caller, bool create)
+{
+	uint hash = ((uintptr_t)caller >> 2) * 2654435761U;
+
+	for (uint i = 0; i < HEAP_PROFILE_ENTRIES; i++) {
+		struct heap_profile_site *site = &heap_profile[(hash + i) % HEAP_PROFILE_ENTRIES];
+
+		if (site->caller == caller)
+			return site;
+		if (site->caller == NULL) {
+			if (!create)
+				return NULL;
+			site->caller = caller;
+			return site;
+		}
+	}
+
+	return NULL;
+}
+
+static void heap_profile_alloc(struct alloc_struct_begin *as, void *caller)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&heap_profile_lock, state);
+
+	struct heap_profile_site *site = heap_profile_site(caller, true);
+	if (site) {
+		as->caller = caller;
+		site->allocs++;
+		site->live_bytes += as->size;
+		site->total_bytes += as->size;
+	} else {
+		as->caller = NULL;
+		heap_profile_dropped++;
+	}
+
+	spin_unlock_irqrestore(&heap_profile_lock, state);
+}
+
+static void heap_profile_free(struct alloc_struct_begin *as)
+{
+	if (!as->caller)
+		return;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&heap_profile_lock, state);
+
+	struct heap_profile_site *site = heap_profile_site(as->caller, false);
+	DEBUG_ASSERT(site);
+
+	site->frees++;
+	site->live_bytes -= as->size;
+
+	spin_unlock_irqrestore(&heap_profile_lock, state);
+}
+#endif
+
+static inline size_t chunk_len(const struct heap_chunk *chunk)
+{
+	return chunk->len & ~(size_t)HEAP_CHUNK_FREE;
+}
+
+static inline bool chunk_is_free(const struct heap_chunk *chunk)
+{
+	return chunk->len & HEAP_CHUNK_FREE;
+}
+
+static inline struct heap_chunk *chunk_next(const struct heap_chunk *chunk)
+{
+	return (struct heap_chunk *)((uint8_t *)chunk + chunk_len(chunk));
+}
+
+static inline struct heap_chunk *chunk_prev(const struct heap_chunk *chunk)
+{
+	if (chunk->prev_len == 0)
+		return NULL;
+	return (struct heap_chunk *)((uint8_t *)chunk - chunk->prev_len);
+}
+
+// set the length of a chunk and keep the tag of the chunk behind it in sync
+static inline void chunk_set_len(struct heap_chunk *chunk, size_t len)
+{
+	chunk->len = len;
+	chunk_next(chunk)->prev_len = len & ~(size_t)HEAP_CHUNK_FREE;
+}
+
+/* large chunk tree, an avl tree keyed on (length, address) */
+static inline int tree_height(const struct free_heap_chunk *c)
+{
+	return c ? c->tree.height : 0;
+}
+
+static inline bool tree_less(const struct free_heap_chunk *a, const struct free_heap_chunk *b)
+{
+	size_t alen = chunk_len(&a->tag);
+	size_t blen = chunk_len(&b->tag);
+
+	return (alen < blen) || (alen == blen && a < b);
+}
+
+static void tree_update(struct free_heap_chunk *c)
+{
+	c->tree.height = 1 + MAX(tree_height(c->tree.left), tree_height(c->tree.right));
+}
+
+static void tree_replace_child(struct free_heap_chunk *parent,
+                               struct free_heap_chunk *old, struct free_heap_chunk *new)
+{
+	if (!parent)
+		theheap.large_tree = new;
+	else if (parent->tree.left == old)
+		parent->tree.left = new;
+	else
+		parent->tree.right = new;
+}
+
+static struct free_heap_chunk *tree_rotate_left(struct free_heap_chunk *c)
+{
+	struct free_heap_chunk *pivot = c->tree.right;
+
+	c->tree.right = pivot->tree.left;
+	if (c->tree.right)
+		c->tree.right->tree.parent = c;
+
+	pivot->tree.parent = c->tree.parent;
+	tree_replace_child(c->tree.parent, c, pivot);
+
+	pivot->tree.left = c;
+	c->tree.parent = pivot;
+
+	tree_update(c);
+	tree_update(pivot);
+	return pivot;
+}
+
+static struct free_heap_chunk *tree_rotate_right(struct free_heap_chunk *c)
+{
+	struct free_heap_chunk *pivot = c->tree.left;
+
+	c->tree.left = pivot->tree.right;
+	if (c->tree.left)
+		c->tree.left->tree.parent = c;
+
+	pivot->tree.parent = c->tree.parent;
+	tree_replace_child(c->tree.parent, c, pivot);
+
+	pivot->tree.right = c;
+	c->tree.parent = pivot;
+
+	tree_update(c);
+	tree_update(pivot);
+	return pivot;
+}
+
+// recompute heights from c up to the root, rebalancing on the way
+static void tree_fixup(struct free_heap_chunk *c)
+{
+	while (c) {
+		tree_update(c);
+
+		int balance = tree_height(c->tree.left) - tree_height(c->tree.right);
+		if (balance > 1) {
+			if (tree_height(c->tree.left->tree.left) < tree_height(c->tree.left->tree.right))
+				tree_rotate_left(c->tree.left);
+			c = tree_rotate_right(c);
+		} else if (balance < -1) {
+			if (tree_height(c->tree.right->tree.right) < tree_height(c->tree.right->tree.left))
+				tree_rotate_right(c->tree.right);
+			c = tree_rotate_left(c);
+		}
+
+		c = c->tree.parent;
+	}
+}
+
+static void tree_insert(struct free_heap_chunk *c)
+{
+	struct free_heap_chunk *parent = NULL;
+	struct free_heap_chunk **link = &theheap.large_tree;
+
+	while (*link) {
+		parent = *link;
+		link = tree_less(c, parent) ? &parent->tree.left : &parent->tree.right;
+	}
+
+	c->tree.parent = parent;
+	c->tree.left = c->tree.right = NULL;
+	*link = c;
+
+	tree_fixup(c);
+}
+
+static void tree_remove(struct free_heap_chunk *c)
+{
+	struct free_heap_chunk *fix;
+
+	if (!c->tree.left || !c->tree.right) {
+		struct free_heap_chunk *child = c->tree.left ? c->tree.left : c->tree.right;
+
+		if (child)
+			child->tree.parent = c->tree.parent;
+		tree_replace_child(c->tree.parent, c, child);
+		fix = c->tree.parent;
+	} else {
+		// splice the successor into c's spot
+		struct free_heap_chunk *succ = c->tree.right;
+		while (succ->tree.left)
+			succ = succ->tree.left;
+
+		if (succ->tree.parent == c) {
+			fix = succ;
+		} else {
+			fix = succ->tree.parent;
+			fix->tree.left = succ->tree.right;
+			if (succ->tree.right)
+				succ->tree.right->tree.parent = fix;
+			succ->tree.right = c->tree.right;
+			succ->tree.right->tree.parent = succ;
+		}
+
+		succ->tree.left = c->tree.left;
+		succ->tree.left->tree.parent = succ;
+		succ->tree.parent = c->tree.parent;
+		tree_replace_child(c->tree.parent, c, succ);
+	}
+
+	tree_fixup(fix);
+}
+
+// smallest large chunk of at least len bytes, lowest address among equals
+static struct free_heap_chunk *tree_best_fit(size_t len)
+{
+	struct free_heap_chunk *c = theheap.large_tree;
+	struct free_heap_chunk *found = NULL;
+
+	while (c) {
+		if (chunk_len(&c->tag) >= len) {
+			found = c;
+			c = c->tree.left;
+		} else {
+			c = c->tree.right;
+		}
+	}
+
+	return found;
+}
+
+static struct free_heap_chunk *tree_first(struct free_heap_chunk *c)
 {
-	dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk, (vaddr_t)chunk + chunk->len, chunk->len);
+	while (c && c->tree.left)
+		c = c->tree.left;
+	return c;
 }
 
-static void heap_dump(void)
+static struct free_heap_chunk *tree_next(struct free_heap_chunk *c)
+{
+	if (c->tree.right)
+		return tree_first(c->tree.right);
+
+	while (c->tree.parent && c->tree.parent->tree.right == c)
+		c = c->tree.parent;
+	return c->tree.parent;
+}
+
+/* free chunk bookkeeping, called with the heap lock held */
+static inline uint small_bin(size_t len)
+{
+	return len / HEAP_GRAIN;
+}
+
+static void free_chunk_insert(struct free_heap_chunk *chunk, size_t len)
+{
+	DEBUG_ASSERT((len % HEAP_GRAIN) == 0);
+	DEBUG_ASSERT(len >= HEAP_MIN_CHUNK);
+
+	chunk_set_len(&chunk->tag, len | HEAP_CHUNK_FREE);
+	theheap.remaining += len;
+
+	if (len <= HEAP_SMALL_MAX) {
+		uint bin = small_bin(len);
+		list_add_head(&theheap.small_bins[bin], &chunk->node);
+		theheap.small_map[BITMAP_WORD(bin)] |= 1UL << BITMAP_BIT_IN_WORD(bin);
+	} else {
+		tree_insert(chunk);
+	}
+}
+
+static void free_chunk_remove(struct free_heap_chunk *chunk)
+{
+	size_t len = chunk_len(&chunk->tag);
+
+	DEBUG_ASSERT(chunk_is_free(&chunk->tag));
+
+	if (len <= HEAP_SMALL_MAX) {
+		uint bin = small_bin(len);
+		list_delete(&chunk->node);
+		if (list_is_empty(&theheap.small_bins[bin]))
+			theheap.small_map[BITMAP_WORD(bin)] &= ~(1UL << BITMAP_BIT_IN_WORD(bin));
+	} else {
+		tree_remove(chunk);
+	}
+
+	chunk_set_len(&chunk->tag, len);
+	theheap.remaining -= len;
+}
+
+// first non empty small bin at or after bin, -1 if there is none
+static int small_bin_search(uint bin)
+{
+	uint word = BITMAP_WORD(bin);
+	unsigned long map = theheap.small_map[word] & ~BIT_MASK(BITMAP_BIT_IN_WORD(bin));
+
+	for (;;) {
+		if (map)
+			return word * BITMAP_BITS_PER_WORD + __builtin_ctzl(map);
+		if (++word == countof(theheap.small_map))
+			return -1;
+		map = theheap.small_map[word];
+	}
+}
+
+// find, remove and trim a free chunk of at least len bytes
+static struct heap_chunk *heap_take_chunk(size_t len)
+{
+	struct free_heap_chunk *chunk = NULL;
+
+	if (len <= HEAP_SMALL_MAX) {
+		int bin = small_bin_search(small_bin(len));
+		if (bin >= 0)
+			chunk = list_peek_head_type(&theheap.small_bins[bin], struct free_heap_chunk, node);
+	}
+	if (!chunk)
+		chunk = tree_best_fit(len);
+	if (!chunk)
+		return NULL;
+
+	free_chunk_remove(chunk);
+
+	// hand the tail back if it's big enough to be a chunk of its own
+	size_t chunk_size = chunk_len(&chunk->tag);
+	if (chunk_size - len >= HEAP_MIN_CHUNK) {
+		struct free_heap_chunk *rest = (struct free_heap_chunk *)((uint8_t *)chunk + len);
+
+		chunk->tag.len = len;
+		rest->tag.prev_len = len;
+		free_chunk_insert(rest, chunk_size - len);
+	}
+
+	return &chunk->tag;
+}
+
+// return an allocated chunk to the free pool, merging it with free neighbours.
+// returns the free chunk it ended up part of
+static struct free_heap_chunk *heap_release_chunk(struct heap_chunk *chunk)
+{
+	size_t len = chunk_len(chunk);
+
+	DEBUG_ASSERT(!chunk_is_free(chunk));
+
+	struct heap_chunk *next = chunk_next(chunk);
+	if (chunk_is_free(next)) {
+		len += chunk_len(next);
+		free_chunk_remove((struct free_heap_chunk *)next);
+	}
+
+	struct heap_chunk *prev = chunk_prev(chunk);
+	if (prev && chunk_is_free(prev)) {
+		len += chunk_len(prev);
+		free_chunk_remove((struct free_heap_chunk *)prev);
+		chunk = prev;
+	}
+
+	free_chunk_insert((struct free_heap_chunk *)chunk, len);
+
+	return (struct free_heap_chunk *)chunk;
+}
+
+#if WITH_KERNEL_VM
+/* pages cut out of the heap, strung together through their first bytes until
+ * they can be freed outside the heap lock */
+struct heap_trim_span {
+	struct heap_trim_span *next;
+	size_t len;
+};
+
+// cut the whole pages out of a free chunk, leaving valid blocks on either side.
+// gives up if that would leave less than keep bytes free in the heap.
+// called with the heap lock held, returns the span or NULL if there was nothing to cut.
+static struct heap_trim_span *heap_carve_pages(struct free_heap_chunk *chunk, size_t keep)
+{
+	uintptr_t start = (uintptr_t)chunk;
+	uintptr_t end = start + chunk_len(&chunk->tag);
+	struct heap_chunk *next = (struct heap_chunk *)end;
+	bool first = chunk->tag.prev_len == 0;
+	bool last = next->len == HEAP_GRAIN; // the next chunk is the block's end tag
+
+	// in front, the block before the hole needs an end tag, plus a free chunk
+	// if there's anything else left over
+	uintptr_t pstart = start;
+	if (!first || !IS_PAGE_ALIGNED(start)) {
+		pstart = ROUNDUP(start + HEAP_GRAIN, PAGE_SIZE);
+		size_t lead = pstart - start;
+		if ((first || lead != HEAP_GRAIN) && lead < HEAP_MIN_CHUNK + HEAP_GRAIN)
+			pstart += PAGE_SIZE;
+	}
+
+	// behind, the block after the hole needs to start with a chunk. if the
+	// chunk runs up to the end tag, the end tag can go too
+	uintptr_t tail_end = last ? end + HEAP_GRAIN : end;
+	uintptr_t pend = ROUNDDOWN(tail_end, PAGE_SIZE);
+	size_t tail = tail_end - pend;
+	if (tail != 0 && tail < (last ? HEAP_MIN_CHUNK + HEAP_GRAIN : HEAP_MIN_CHUNK))
+		pend -= PAGE_SIZE;
+
+	if (pend <= pstart)
+		return NULL;
+	if (theheap.remaining - (pend - pstart) < keep)
+		return NULL;
+
+	LTRACEF("chunk %p len 0x%zx, cutting [0x%lx, 0x%lx)\n", chunk, end - start, pstart, pend);
+
+	free_chunk_remove(chunk);
+
+	size_t lead = pstart - start;
+	if (lead == HEAP_GRAIN) {
+		chunk->tag.len = HEAP_GRAIN;
+	} else if (lead > 0) {
+		struct heap_chunk *end_tag = (struct heap_chunk *)(pstart - HEAP_GRAIN);
+		end_tag->len = HEAP_GRAIN;
+		free_chunk_insert(chunk, lead - HEAP_GRAIN);
+	}
+
+	if (pend < end) {
+		struct free_heap_chunk *rest = (struct free_heap_chunk *)pend;
+		rest->tag.prev_len = 0;
+		free_chunk_insert(rest, end - pend);
+	} else if (!last) {
+		next->prev_len = 0;
+	}
+
+	theheap.returned += pend - pstart;
+
+	struct heap_trim_span *span = (struct heap_trim_span *)pstart;
+	span->next = NULL;
+	span->len = pend - pstart;
+	return span;
+}
+
+// hand carved out spans back to the pmm, called without the heap lock
+static size_t heap_free_spans(struct heap_trim_span *span)
+{
+	size_t len = 0;
+
+	while (span) {
+		struct heap_trim_span *next = span->next;
+
+		len += span->len;
+		pmm_free_kpages(span, span->len / PAGE_SIZE);
+		span = next;
+	}
+
+	return len;
+}
+#endif
+
+// turn a range of memory into a free chunk followed by an end tag
+static void heap_add_range(void *ptr, size_t len)
+{
+	uintptr_t start = ROUNDUP((uintptr_t)ptr, HEAP_GRAIN);
+	uintptr_t end = ROUNDDOWN((uintptr_t)ptr + len, HEAP_GRAIN);
+
+	if (end <= start || end - start < HEAP_MIN_CHUNK + HEAP_GRAIN)
+		return;
+
+	struct heap_chunk *chunk = (struct heap_chunk *)start;
+	struct heap_chunk *end_tag = (struct heap_chunk *)(end - HEAP_GRAIN);
+
+	LTRACEF("range %p len 0x%zx\n", chunk, end - start);
+
+	chunk->prev_len = 0;
+	end_tag->len = HEAP_GRAIN;
+
+	mutex_acquire(&theheap.lock);
+	free_chunk_insert((struct free_heap_chunk *)chunk, end - start - HEAP_GRAIN);
+	mutex_release(&theheap.lock);
+}
+
+static void __COLD dump_free_chunk(struct free_heap_chunk *chunk)
+{
+	dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk,
+	        (vaddr_t)chunk + chunk_len(&chunk->tag), chunk_len(&chunk->tag));
+}
+
+static void __COLD heap_dump(void)
 {
 	dprintf(INFO, "Heap dump:\n");
-	dprintf(INFO, "\tbase %p, len 0x%zx\n", theheap.base, theheap.len);
-	dprintf(INFO, "\tfree list:\n");
+	dprintf(INFO, "\tbase %p, len 0x%zx, returned 0x%zx\n", theheap.base, theheap.len, theheap.returned);
 
 	mutex_acquire(&theheap.lock);
 
 	struct free_heap_chunk *chunk;
-	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-		dump_free_chunk(chunk);
+	dprintf(INFO, "\tsmall bins:\n");
+	for (uint i = 0; i < HEAP_SMALL_BINS; i++) {
+		list_for_every_entry(&theheap.small_bins[i], chunk, struct free_heap_chunk, node) {
+			dump_free_chunk(chunk);
+		}
 	}
+	dprintf(INFO, "\tlarge tree:\n");
+	for (chunk = tree_first(theheap.large_tree); chunk; chunk = tree_next(chunk))
+		dump_free_chunk(chunk);
+
 	mutex_release(&theheap.lock);
 
 	dprintf(INFO, "\tdelayed free list:\n");
@@ -189,85 +753,7 @@ static void heap_test(void)
 	heap_dump();
 }
 
-// try to insert this free chunk into the free list, consuming the chunk by merging it with
-// nearby ones if possible. Returns base of whatever chunk it became in the list.
-static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
-{
-#if LK_DEBUGLEVEL > INFO
-	vaddr_t chunk_end = (vaddr_t)chunk + chunk->len;
-#endif
-
-	LTRACEF("chunk ptr %p, size 0x%zx\n", chunk, chunk->len);
-
-	struct free_heap_chunk *next_chunk;
-	struct free_heap_chunk *last_chunk;
-
-	mutex_acquire(&theheap.lock);
-
-	theheap.remaining += chunk->len;
-
-	// walk through the list, finding the node to insert before
-	list_for_every_entry(&theheap.free_list, next_chunk, struct free_heap_chunk, node) {
-		if (chunk < next_chunk) {
-			DEBUG_ASSERT(chunk_end <= (vaddr_t)next_chunk);
-
-			list_add_before(&next_chunk->node, &chunk->node);
-
-			goto try_merge;
-		}
-	}
-
-	// walked off the end of the list, add it at the tail
-	list_add_tail(&theheap.free_list, &chunk->node);
-
-	// try to merge with the previous chunk
-try_merge:
-	last_chunk = list_prev_type(&theheap.free_list, &chunk->node, struct free_heap_chunk, node);
-	if (last_chunk) {
-		if ((vaddr_t)last_chunk + last_chunk->len == (vaddr_t)chunk) {
-			// easy, just extend the previous chunk
-			last_chunk->len += chunk->len;
-
-			// remove ourself from the list
-			list_delete(&chunk->node);
-
-			// set the chunk pointer to the newly extended chunk, in case
-			// it needs to merge with the next chunk below
-			chunk = last_chunk;
-		}
-	}
-
-	// try to merge with the next chunk
-	if (next_chunk) {
-		if ((vaddr_t)chunk + chunk->len == (vaddr_t)next_chunk) {
-			// extend our chunk
-			chunk->len += next_chunk->len;
-
-			// remove them from the list
-			list_delete(&next_chunk->node);
-		}
-	}
-
-	mutex_release(&theheap.lock);
-
-	return chunk;
-}
-
-static struct free_heap_chunk *heap_create_free_chunk(void *ptr, size_t len, bool allow_debug)
-{
-	DEBUG_ASSERT((len % sizeof(void *)) == 0); // size must be aligned on pointer boundary
-
-#if DEBUG_HEAP
-	if (allow_debug)
-		memset(ptr, FREE_FILL, len);
-#endif
-
-	struct free_heap_chunk *chunk = (struct free_heap_chunk *)ptr;
-	chunk->len = len;
-
-	return chunk;
-}
-
+// free whatever heap_delayed_free queued up, called with the heap lock held
 static void heap_free_delayed_list(void)
 {
 	struct list_node list;
@@ -285,131 +771,121 @@ static void heap_free_delayed_list(void)
 
 	while ((chunk = list_remove_head_type(&list, struct free_heap_chunk, node))) {
 		LTRACEF("freeing chunk %p\n", chunk);
-		heap_insert_free_chunk(chunk);
-	}
-}
-
-void *heap_alloc(size_t size, unsigned int alignment)
-{
-	void *ptr;
 #if DEBUG_HEAP
-	size_t original_size = size;
+		memset((uint8_t *)chunk + sizeof(struct heap_chunk), FREE_FILL,
+		       chunk_len(&chunk->tag) - sizeof(struct heap_chunk));
 #endif
-
-	LTRACEF("size %zd, align %d\n", size, alignment);
-
-	// deal with the pending free list
-	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
-		heap_free_delayed_list();
+		heap_release_chunk(&chunk->tag);
 	}
+}
 
-	// alignment must be power of 2
-	if (alignment & (alignment - 1))
-		return NULL;
-
-	// we always put a size field + base pointer + magic in front of the allocation
-	size += sizeof(struct alloc_struct_begin);
+// pad a request out to the chunk length needed to satisfy it
+static size_t heap_chunk_size(size_t size, unsigned int alignment)
+{
+	// we always put a chunk tag, size field + base pointer + magic in front of the allocation
+	size += sizeof(struct heap_chunk) + sizeof(struct alloc_struct_begin);
 #if DEBUG_HEAP
 	size += PADDING_SIZE;
 #endif
 
-	// make sure we allocate at least the size of a struct free_heap_chunk so that
-	// when we free it, we can create a struct free_heap_chunk struct and stick it
-	// in the spot
-	if (size < sizeof(struct free_heap_chunk))
-		size = sizeof(struct free_heap_chunk);
-
-	// round up size to a multiple of native pointer size
-	size = ROUNDUP(size, sizeof(void *));
-
 	// deal with nonzero alignments
 	if (alignment > 0) {
-		if (alignment < 16)
-			alignment = 16;
-
 		// add alignment for worst case fit
 		size += alignment;
 	}
 
-#if WITH_KERNEL_VM
-	int retry_count = 0;
-retry:
-#endif
-	mutex_acquire(&theheap.lock);
-
-	// walk through the list
-	ptr = NULL;
-	struct free_heap_chunk *chunk;
-	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-		DEBUG_ASSERT((chunk->len % sizeof(void *)) == 0); // len should always be a multiple of pointer size
-
-		// is it big enough to service our allocation?
-		if (chunk->len >= size) {
-			ptr = chunk;
-
-			// remove it from the list
-			struct list_node *next_node = list_next(&theheap.free_list, &chunk->node);
-			list_delete(&chunk->node);
+	// chunks are whole grains, and at least big enough to hold a free chunk
+	size = ROUNDUP(size, HEAP_GRAIN);
+	if (size < HEAP_MIN_CHUNK)
+		size = HEAP_MIN_CHUNK;
 
-			if (chunk->len > size + sizeof(struct free_heap_chunk)) {
-				// there's enough space in this chunk to create a new one after the allocation
-				struct free_heap_chunk *newchunk = heap_create_free_chunk((uint8_t *)ptr + size, chunk->len - size, true);
-
-				// truncate this chunk
-				chunk->len -= chunk->len - size;
+	return size;
+}
 
-				// add the new one where chunk used to be
-				if (next_node)
-					list_add_before(next_node, &newchunk->node);
-				else
-					list_add_tail(&theheap.free_list, &newchunk->node);
-			}
+// carve an allocation out of the free pool, called with the heap lock held
+static void *heap_alloc_locked(size_t size, unsigned int alignment, size_t original_size, void *caller)
+{
+	struct heap_chunk *chunk = heap_take_chunk(size);
+	if (!chunk)
+		return NULL;
 
-			// the allocated size is actually the length of this chunk, not the size requested
-			DEBUG_ASSERT(chunk->len >= size);
-			size = chunk->len;
+	// the allocated size is actually the length of this chunk, not the size requested
+	size = chunk_len(chunk);
 
 #if DEBUG_HEAP
-			memset(ptr, ALLOC_FILL, size);
+	memset((uint8_t *)chunk + sizeof(struct heap_chunk), ALLOC_FILL, size - sizeof(struct heap_chunk));
 #endif
 
-			ptr = (void *)((addr_t)ptr + sizeof(struct alloc_struct_begin));
+	void *ptr = (void *)((addr_t)chunk + sizeof(struct heap_chunk) + sizeof(struct alloc_struct_begin));
 
-			// align the output if requested
-			if (alignment > 0) {
-				ptr = (void *)ROUNDUP((addr_t)ptr, (addr_t)alignment);
-			}
+	// align the output if requested
+	if (alignment > 0) {
+		ptr = (void *)ROUNDUP((addr_t)ptr, (addr_t)alignment);
+	}
 
-			struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
-			as--;
+	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+	as--;
 #if LK_DEBUGLEVEL > 1
-			as->magic = HEAP_MAGIC;
+	as->magic = HEAP_MAGIC;
+#endif
+	as->ptr = (void *)chunk;
+	as->size = size;
+#if WITH_HEAP_PROFILE
+	heap_profile_alloc(as, caller);
 #endif
-			as->ptr = (void *)chunk;
-			as->size = size;
-			theheap.remaining -= size;
 
-			if (theheap.remaining < theheap.low_watermark) {
-				theheap.low_watermark = theheap.remaining;
-			}
+	if (theheap.remaining < theheap.low_watermark) {
+		theheap.low_watermark = theheap.remaining;
+	}
 #if DEBUG_HEAP
-			as->padding_start = ((uint8_t *)ptr + original_size);
-			as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
-//			printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
+	as->padding_start = ((uint8_t *)ptr + original_size);
+	as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
+//	printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
 
-			memset(as->padding_start, PADDING_FILL, as->padding_size);
+	memset(as->padding_start, PADDING_FILL, as->padding_size);
 #endif
 
-			break;
-		}
+	return ptr;
+}
+
+__HOT void *heap_alloc(size_t size, unsigned int alignment)
+{
+	return heap_alloc_etc(size, alignment, __GET_CALLER());
+}
+
+__HOT void *heap_alloc_etc(size_t size, unsigned int alignment, void *caller)
+{
+	void *ptr;
+
+	LTRACEF("size %zd, align %d, caller %p\n", size, alignment, caller);
+
+	// alignment must be power of 2
+	if (unlikely(alignment & (alignment - 1)))
+		return NULL;
+
+	if (alignment > 0 && alignment < 16)
+		alignment = 16;
+
+	size_t chunk_size = heap_chunk_size(size, alignment);
+
+	int retry_count = 0;
+retry:
+	mutex_acquire(&theheap.lock);
+
+	// deal with the pending free list
+	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
+		heap_free_delayed_list();
 	}
 
+	ptr = heap_alloc_locked(chunk_size, alignment, size, caller);
+
 	mutex_release(&theheap.lock);
 
 #if WITH_KERNEL_VM
-	/* try to grow the heap if we can */
-	if (ptr == NULL && retry_count == 0) {
-		size_t growby = MAX(HEAP_GROW_SIZE, ROUNDUP(size, PAGE_SIZE));
+	/* try to grow the heap if we can, the pmm shrinks the caches if it has to */
+	if (unlikely(ptr == NULL && retry_count == 0)) {
+		// leave room for the end tag of the new block
+		size_t growby = MAX(HEAP_GROW_SIZE, ROUNDUP(chunk_size + HEAP_GRAIN, PAGE_SIZE));
 
 		ssize_t err = heap_grow(growby);
 		if (err >= 0) {
@@ -417,6 +893,12 @@ retry:
 			goto retry;
 		}
 	}
+#else
+	/* nowhere to grow, have the caches give some of the heap back */
+	if (unlikely(ptr == NULL && retry_count == 0) && shrink_caches(chunk_size, SHRINK_ALLOC_FAILED) > 0) {
+		retry_count++;
+		goto retry;
+	}
 #endif
 
 	LTRACEF("returning ptr %p\n", ptr);
@@ -424,13 +906,42 @@ retry:
 	return ptr;
 }
 
-void heap_free(void *ptr)
+size_t heap_alloc_batch(size_t size, void **ptrs, size_t count)
 {
-	if (ptr == 0)
-		return;
+	void *caller = __GET_CALLER();
 
-	LTRACEF("ptr %p\n", ptr);
+	LTRACEF("size %zd, count %zu\n", size, count);
+
+	size_t chunk_size = heap_chunk_size(size, 0);
+	size_t i;
+
+	mutex_acquire(&theheap.lock);
+
+	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
+		heap_free_delayed_list();
+	}
+
+	for (i = 0; i < count; i++) {
+		ptrs[i] = heap_alloc_locked(chunk_size, 0, size, caller);
+		if (!ptrs[i])
+			break;
+	}
 
+	mutex_release(&theheap.lock);
+
+	// let heap_alloc deal with growing the heap
+	if (i == 0 && count > 0) {
+		ptrs[0] = heap_alloc_etc(size, 0, caller);
+		if (ptrs[0])
+			i = 1;
+	}
+
+	return i;
+}
+
+// validate an allocation and return its chunk
+static struct heap_chunk *heap_ptr_to_chunk(void *ptr)
+{
 	// check for the old allocation structure
 	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
 	as--;
@@ -454,8 +965,77 @@ void heap_free(void *ptr)
 
 	LTRACEF("allocation was %zd bytes long at ptr %p\n", as->size, as->ptr);
 
-	// looks good, create a free chunk and add it to the pool
-	heap_insert_free_chunk(heap_create_free_chunk(as->ptr, as->size, true));
+	struct heap_chunk *chunk = (struct heap_chunk *)as->ptr;
+	DEBUG_ASSERT(chunk_len(chunk) == as->size);
+
+#if WITH_HEAP_PROFILE
+	heap_profile_free(as);
+#endif
+
+#if DEBUG_HEAP
+	memset((uint8_t *)chunk + sizeof(struct heap_chunk), FREE_FILL, as->size - sizeof(struct heap_chunk));
+#endif
+
+	return chunk;
+}
+
+void __HOT heap_free(void *ptr)
+{
+	if (ptr == 0)
+		return;
+
+	LTRACEF("ptr %p\n", ptr);
+
+	struct heap_chunk *chunk = heap_ptr_to_chunk(ptr);
+
+	// looks good, give the chunk back to the pool
+	mutex_acquire(&theheap.lock);
+	struct free_heap_chunk *free_chunk = heap_release_chunk(chunk);
+#if WITH_KERNEL_VM && HEAP_TRIM_THRESHOLD > 0
+	struct heap_trim_span *span = NULL;
+	if (unlikely(chunk_len(&free_chunk->tag) >= HEAP_TRIM_THRESHOLD))
+		span = heap_carve_pages(free_chunk, HEAP_TRIM_THRESHOLD);
+	mutex_release(&theheap.lock);
+
+	heap_free_spans(span);
+#else
+	(void)free_chunk;
+	mutex_release(&theheap.lock);
+#endif
+}
+
+void heap_free_batch(void **ptrs, size_t count)
+{
+	LTRACEF("count %zu\n", count);
+
+	for (size_t i = 0; i < count; i++) {
+		if (ptrs[i])
+			ptrs[i] = heap_ptr_to_chunk(ptrs[i]);
+	}
+
+	mutex_acquire(&theheap.lock);
+	for (size_t i = 0; i < count; i++) {
+		if (ptrs[i])
+			heap_release_chunk(ptrs[i]);
+	}
+	mutex_release(&theheap.lock);
+}
+
+size_t heap_usable_size(void *ptr)
+{
+	if (ptr == 0)
+		return 0;
+
+	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+	as--;
+
+	DEBUG_ASSERT(as->magic == HEAP_MAGIC);
+
+#if DEBUG_HEAP
+	return (uint8_t *)as->padding_start - (uint8_t *)ptr;
+#else
+	return ((uint8_t *)as->ptr + as->size) - (uint8_t *)ptr;
+#endif
 }
 
 void heap_delayed_free(void *ptr)
@@ -468,7 +1048,13 @@ void heap_delayed_free(void *ptr)
 
 	DEBUG_ASSERT(as->magic == HEAP_MAGIC);
 
-	struct free_heap_chunk *chunk = heap_create_free_chunk(as->ptr, as->size, false);
+#if WITH_HEAP_PROFILE
+	heap_profile_free(as);
+#endif
+
+	// the chunk stays marked allocated until the list is drained, so its
+	// neighbours won't try to merge with it in the meantime
+	struct free_heap_chunk *chunk = (struct free_heap_chunk *)as->ptr;
 
 	spin_lock_saved_state_t state;
 	spin_lock_irqsave(&theheap.delayed_free_lock, state);
@@ -476,38 +1062,95 @@ void heap_delayed_free(void *ptr)
 	spin_unlock_irqrestore(&theheap.delayed_free_lock, state);
 }
 
-void heap_get_stats(struct heap_stats *ptr)
+size_t heap_trim(void)
 {
-	struct free_heap_chunk *chunk;
+#if WITH_KERNEL_VM
+	struct heap_trim_span *spans = NULL;
+
+	mutex_acquire(&theheap.lock);
 
-	if ((struct heap_stats*)NULL==ptr) {
-		return;
-	}
-	//flush the delayed free list
 	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
 		heap_free_delayed_list();
 	}
 
+	// only chunks in the tree can cover a whole page, counting a trailing end tag
+	struct free_heap_chunk *chunk = tree_best_fit(PAGE_SIZE - HEAP_GRAIN);
+	while (chunk) {
+		struct free_heap_chunk *next = tree_next(chunk);
+
+		struct heap_trim_span *span = heap_carve_pages(chunk, 0);
+		if (span) {
+			span->next = spans;
+			spans = span;
+		}
+		chunk = next;
+	}
+
+	mutex_release(&theheap.lock);
+
+	size_t len = heap_free_spans(spans);
+	LTRACEF("returned 0x%zx bytes\n", len);
+	return len;
+#else
+	return 0;
+#endif
+}
+
+void heap_get_stats(struct heap_stats *ptr)
+{
+	if ((struct heap_stats*)NULL==ptr) {
+		return;
+	}
+
 	ptr->heap_start = theheap.base;
 	ptr->heap_len = theheap.len;
-	ptr->heap_free=0;
-	ptr->heap_max_chunk = 0;
 
 	mutex_acquire(&theheap.lock);
 
-	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-		ptr->heap_free += chunk->len;
+	//flush the delayed free list
+	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
+		heap_free_delayed_list();
+	}
+
+	ptr->heap_free = theheap.remaining;
 
-		if (chunk->len > ptr->heap_max_chunk) {
-			ptr->heap_max_chunk = chunk->len;
+	// the biggest chunk is the rightmost in the tree, or failing that in the highest small bin
+	ptr->heap_max_chunk = 0;
+	struct free_heap_chunk *chunk = theheap.large_tree;
+	if (chunk) {
+		while (chunk->tree.right)
+			chunk = chunk->tree.right;
+		ptr->heap_max_chunk = chunk_len(&chunk->tag);
+	} else {
+		for (int i = HEAP_SMALL_BINS - 1; i >= 0; i--) {
+			if (!list_is_empty(&theheap.small_bins[i])) {
+				ptr->heap_max_chunk = i * HEAP_GRAIN;
+				break;
+			}
 		}
 	}
 
 	ptr->heap_low_watermark = theheap.low_watermark;
+	ptr->heap_returned = theheap.returned;
 
 	mutex_release(&theheap.lock);
 }
 
+#if WITH_KERNEL_VM
+/* the heap is a cache of pages too, free ones go back to the pmm under pressure */
+static size_t heap_shrinker_count(shrinker_t *s)
+{
+	return theheap.remaining;
+}
+
+static size_t heap_shrinker_scan(shrinker_t *s, size_t target)
+{
+	return heap_trim();
+}
+
+static shrinker_t heap_shrinker = SHRINKER_INITIAL_VALUE("heap", 0, &heap_shrinker_count, &heap_shrinker_scan, NULL);
+#endif
+
 static ssize_t heap_grow(size_t size)
 {
 #if WITH_KERNEL_VM
@@ -521,7 +1164,7 @@ static ssize_t heap_grow(size_t size)
 
 	LTRACEF("growing heap by 0x%zx bytes, new ptr %p\n", size, ptr);
 
-	heap_insert_free_chunk(heap_create_free_chunk(ptr, size, true));
+	heap_add_range(ptr, size);
 
 	/* change the heap start and end variables */
 	if ((uintptr_t)ptr < (uintptr_t)theheap.base)
@@ -545,8 +1188,10 @@ void heap_init(void)
 	// create a mutex
 	mutex_init(&theheap.lock);
 
-	// initialize the free list
-	list_initialize(&theheap.free_list);
+	// initialize the free bins
+	for (uint i = 0; i < HEAP_SMALL_BINS; i++)
+		list_initialize(&theheap.small_bins[i]);
+	theheap.large_tree = NULL;
 
 	// initialize the delayed free list
 	list_initialize(&theheap.delayed_free_list);
@@ -564,18 +1209,22 @@ void heap_init(void)
 	theheap.base = (void *)HEAP_START;
 	theheap.len = HEAP_LEN;
 #endif
-	theheap.remaining = 0; // will get set by heap_insert_free_chunk()
+	theheap.remaining = 0; // will get set by heap_add_range()
 	theheap.low_watermark = theheap.len;
 	LTRACEF("base %p size %zd bytes\n", theheap.base, theheap.len);
 
 	// create an initial free chunk
-	heap_insert_free_chunk(heap_create_free_chunk(theheap.base, theheap.len, false));
+	heap_add_range(theheap.base, theheap.len);
+
+#if WITH_KERNEL_VM
+	shrinker_register(&heap_shrinker);
+#endif
 }
 
 /* add a new block of memory to the heap */
 void heap_add_block(void *ptr, size_t len)
 {
-	heap_insert_free_chunk(heap_create_free_chunk(ptr, len, false));
+	heap_add_range(ptr, len);
 }
 
 #if LK_DEBUGLEVEL > 1
@@ -589,6 +1238,97 @@ STATIC_COMMAND_START
 STATIC_COMMAND("heap", "heap debug commands", &cmd_heap)
 STATIC_COMMAND_END(heap);
 
+#if WITH_HEAP_PROFILE
+static struct heap_profile_site heap_profile_copy[HEAP_PROFILE_ENTRIES];
+static struct heap_profile_site heap_profile_snap[HEAP_PROFILE_ENTRIES];
+static uint16_t heap_profile_order[HEAP_PROFILE_ENTRIES];
+
+// change at a site since the last snapshot. sites never move once they've
+// been handed out, so the same slot of the snapshot is the same site or empty
+static void heap_profile_delta(uint slot, struct heap_profile_site *d)
+{
+	const struct heap_profile_site *c = &heap_profile_copy[slot];
+	const struct heap_profile_site *s = &heap_profile_snap[slot];
+
+	*d = *c;
+	if (s->caller == c->caller) {
+		d->allocs -= s->allocs;
+		d->frees -= s->frees;
+		d->live_bytes -= s->live_bytes;
+		d->total_bytes -= s->total_bytes;
+	}
+}
+
+static uint64_t heap_profile_key(uint slot, bool diff)
+{
+	struct heap_profile_site d;
+
+	if (!diff)
+		return heap_profile_copy[slot].live_bytes;
+
+	// order by how far live bytes moved, then by churn
+	heap_profile_delta(slot, &d);
+	ssize_t live = (ssize_t)d.live_bytes;
+	return ((uint64_t)(live < 0 ? -live : live) << 24) + (d.total_bytes >> 8);
+}
+
+static void heap_profile_show(bool diff, uint limit)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&heap_profile_lock, state);
+	memcpy(heap_profile_copy, heap_profile, sizeof(heap_profile));
+	ulong dropped = heap_profile_dropped;
+	spin_unlock_irqrestore(&heap_profile_lock, state);
+
+	// insertion sort the interesting sites, biggest first
+	uint count = 0;
+	for (uint slot = 0; slot < HEAP_PROFILE_ENTRIES; slot++) {
+		struct heap_profile_site d;
+
+		if (!heap_profile_copy[slot].caller)
+			continue;
+		if (diff) {
+			heap_profile_delta(slot, &d);
+			if (d.allocs == 0 && d.frees == 0)
+				continue;
+		} else if (heap_profile_copy[slot].allocs == heap_profile_copy[slot].frees) {
+			continue;
+		}
+
+		uint64_t key = heap_profile_key(slot, diff);
+		uint i = count++;
+		while (i > 0 && heap_profile_key(heap_profile_order[i - 1], diff) < key) {
+			heap_profile_order[i] = heap_profile_order[i - 1];
+			i--;
+		}
+		heap_profile_order[i] = slot;
+	}
+
+	printf("%-18s %10s %10s %12s %14s\n", "caller", "allocs", "frees",
+	       diff ? "live delta" : "live bytes", "total bytes");
+	for (uint i = 0; i < count && i < limit; i++) {
+		struct heap_profile_site d;
+		const struct heap_profile_site *site = &heap_profile_copy[heap_profile_order[i]];
+
+		if (diff) {
+			heap_profile_delta(heap_profile_order[i], &d);
+			site = &d;
+		}
+
+		printf("%-18p %10lu %10lu %12zd %14llu\n", site->caller, site->allocs, site->frees,
+		       (ssize_t)site->live_bytes, site->total_bytes);
+	}
+	printf("%u sites%s", count, diff ? " changed since the last snapshot" : " with live allocations");
+	if (dropped)
+		printf(", %lu allocations dropped, table full", dropped);
+	printf("\n");
+
+	// each diff starts a new interval
+	if (diff)
+		memcpy(heap_profile_snap, heap_profile_copy, sizeof(heap_profile_snap));
+}
+#endif
+
 static int cmd_heap(int argc, const cmd_args *argv)
 {
 	if (argc < 2) {
@@ -599,6 +1339,12 @@ usage:
 		printf("\t%s info\n", argv[0].str);
 		printf("\t%s alloc <size> [alignment]\n", argv[0].str);
 		printf("\t%s free <address>\n", argv[0].str);
+		printf("\t%s trim\n", argv[0].str);
+#if WITH_HEAP_PROFILE
+		printf("\t%s profile [count]        : live bytes per call site\n", argv[0].str);
+		printf("\t%s profile snap           : start a new interval\n", argv[0].str);
+		printf("\t%s profile diff [count]   : changes since the last snap or diff\n", argv[0].str);
+#endif
 		return -1;
 	}
 
@@ -613,6 +1359,22 @@ usage:
 		if (argc < 2) goto notenoughargs;
 
 		heap_free((void *)argv[2].u);
+	} else if (strcmp(argv[1].str, "trim") == 0) {
+		size_t len = heap_trim();
+		printf("returned 0x%zx bytes, 0x%zx total\n", len, theheap.returned);
+#if WITH_HEAP_PROFILE
+	} else if (strcmp(argv[1].str, "profile") == 0) {
+		if (argc >= 3 && !strcmp(argv[2].str, "snap")) {
+			spin_lock_saved_state_t state;
+			spin_lock_irqsave(&heap_profile_lock, state);
+			memcpy(heap_profile_snap, heap_profile, sizeof(heap_profile_snap));
+			spin_unlock_irqrestore(&heap_profile_lock, state);
+		} else if (argc >= 3 && !strcmp(argv[2].str, "diff")) {
+			heap_profile_show(true, (argc >= 4) ? argv[3].u : 32);
+		} else {
+			heap_profile_show(false, (argc >= 3) ? argv[2].u : 32);
+		}
+#endif
 	} else {
 		printf("unrecognized command\n");
 		goto usage;
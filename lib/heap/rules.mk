@@ -5,4 +5,9 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/heap.c
 
+# per call site allocation profile, see the heap profile console command
+ifeq ($(WITH_HEAP_PROFILE),1)
+GLOBAL_DEFINES += WITH_HEAP_PROFILE=1
+endif
+
 include make/module.mk
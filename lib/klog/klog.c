@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <platform.h>
+#include <arch/ops.h>
 #include <lib/cksum.h>
 
 #define LOCAL_TRACE 0
@@ -281,8 +282,6 @@ status_t klog_set_current_buffer(uint buffer)
     return NO_ERROR;
 }
 
-#include <arch/ops.h>
-
 ssize_t klog_read(char *buf, size_t len, int buf_id)
 {
     size_t offset = 0;
@@ -312,10 +311,14 @@ ssize_t klog_read(char *buf, size_t len, int buf_id)
         offset += tmp_len;
     }
 
-    /* Since iovecs are generated by get_buffer we only need to update the tail pointer */
-    klog->tail += offset;
-    if (klog->tail >= klog->size)
-        klog->tail -= klog->size;
+    /* Since iovecs are generated by get_buffer we only need to update the tail pointer.
+     * If a writer pushed it along meanwhile what we read was overwritten, leave theirs. */
+    struct klog_header *k = (buf_id < 0) ? klog : find_nth_log(buf_id);
+    uint tail = (const uint8_t *)vec[0].iov_base - k->data;
+    uint newtail = tail + offset;
+    if (newtail >= k->size)
+        newtail -= k->size;
+    atomic_cmpxchg((volatile int *)&k->tail, tail, newtail);
 
     return offset;
 }
@@ -341,49 +344,75 @@ bool klog_has_data(void)
     return (klog->head != klog->tail);
 }
 
+/* copy a run into the log, returning what it does to the data checksum */
+static uint32_t klog_copy(uint8_t *dst, const char *src, size_t len)
+{
+    uint32_t deltasum = 0;
+
+    for (size_t i = 0; i < len; i++)
+        deltasum += (uint8_t)src[i] - dst[i];
+    memcpy(dst, src, len);
+
+    return deltasum;
+}
+
+/*
+ * Writers on any cpu, or interrupting each other, reserve their run by moving
+ * the head with a compare and swap and then fill it in, so nothing is held
+ * while copying. The checksum is a plain sum of the data, each writer adds
+ * its own delta atomically.
+ */
 static size_t klog_puts_len(const char *str, size_t len)
 {
     LTRACEF("puts '%s'\n", str);
 
-    DEBUG_ASSERT(klog);
-    DEBUG_ASSERT(klog->magic == KLOG_HEADER_MAGIC);
+    struct klog_header *k = klog;
+    DEBUG_ASSERT(k);
+    DEBUG_ASSERT(k->magic == KLOG_HEADER_MAGIC);
 
-    LTRACEF("before write head %u tail %u size %u\n", klog->head, klog->tail, klog->size);
-    uint32_t deltasum = 0;
-    size_t count = 0;
-    while (count < len && *str) {
-        /* compute the delta checksum */
-        deltasum += *str - klog->data[klog->head];
-
-        /* store the data */
-        klog->data[klog->head] = *str;
-
-        /* bump the head */
-        uint newhead = klog->head + 1;
-        if (newhead >= klog->size)
-            newhead -= klog->size;
-        DEBUG_ASSERT(newhead < klog->size);
-
-        /* bump the tail if the head collided with it */
-        if (klog->tail == newhead) {
-            uint newtail = klog->tail + 1;
-            if (newtail >= klog->size)
-                newtail -= klog->size;
-            DEBUG_ASSERT(newtail < klog->size);
-            klog->tail = newtail;
-        }
+    len = strnlen(str, len);
+    size_t count = len;
+    if (len == 0)
+        return 0;
 
-        /* writeback the head */
-        klog->head = newhead;
+    /* the log holds size - 1 bytes, anything before that would be overwritten anyway */
+    if (len > k->size - 1) {
+        str += len - (k->size - 1);
+        len = k->size - 1;
+    }
 
-        str++;
-        count++;
+    /* reserve [head, head + len) */
+    uint head, newhead;
+    do {
+        head = k->head;
+        newhead = head + len;
+        if (newhead >= k->size)
+            newhead -= k->size;
+    } while ((uint)atomic_cmpxchg((volatile int *)&k->head, head, newhead) != head);
+
+    /* push the tail along if the run covers it, it ends up just past our head.
+     * a reader or another writer moving it first means we look again. */
+    for (;;) {
+        uint tail = k->tail;
+        uint dist = (tail >= head) ? tail - head : tail + k->size - head;
+        if (dist == 0 || dist > len)
+            break;
+
+        uint newtail = newhead + 1;
+        if (newtail >= k->size)
+            newtail -= k->size;
+        if ((uint)atomic_cmpxchg((volatile int *)&k->tail, tail, newtail) == tail)
+            break;
     }
-    LTRACEF("after write head %u tail %u\n", klog->head, klog->tail);
+    LTRACEF("reserved head %u len %zu, now head %u tail %u\n", head, len, k->head, k->tail);
+
+    size_t first = MIN(len, k->size - head);
+    uint32_t deltasum = klog_copy(&k->data[head], str, first);
+    deltasum += klog_copy(&k->data[0], str + first, len - first);
 
-    klog->data_checksum += deltasum;
+    atomic_add((volatile int *)&k->data_checksum, deltasum);
 
-    LTRACEF("kputs len %u\n", count);
+    LTRACEF("kputs len %zu\n", count);
 
     return count;
 }
@@ -25,14 +25,151 @@
 #include <string.h>
 #include <lib/heap.h>
 
+#if WITH_MALLOC_THREAD_CACHE
+#include <kernel/thread.h>
+
+/*
+ * Per thread cache of small blocks, hung off the thread's TLS_ENTRY_MALLOC
+ * slot. Blocks are binned by usable size in MALLOC_CACHE_GRAIN steps and move
+ * to and from the heap MALLOC_CACHE_BATCH at a time, so a thread churning
+ * through small allocations takes the heap lock once per batch rather than on
+ * every call. Only the owning thread ever touches its cache.
+ */
+#define MALLOC_CACHE_GRAIN 16
+#define MALLOC_CACHE_MAX 256
+#define MALLOC_CACHE_BINS (MALLOC_CACHE_MAX / MALLOC_CACHE_GRAIN)
+#define MALLOC_CACHE_DEPTH 16
+#define MALLOC_CACHE_BATCH (MALLOC_CACHE_DEPTH / 2)
+
+struct malloc_cache_bin {
+	uint count;
+	void *ptrs[MALLOC_CACHE_DEPTH];
+};
+
+struct malloc_cache {
+	struct malloc_cache_bin bins[MALLOC_CACHE_BINS];
+};
+
+static struct malloc_cache *malloc_cache_get(void)
+{
+	thread_t *t = get_current_thread();
+	if (unlikely(!t))
+		return NULL;
+
+	struct malloc_cache *cache = (struct malloc_cache *)t->tls[TLS_ENTRY_MALLOC];
+	if (unlikely(!cache)) {
+		cache = heap_alloc(sizeof(*cache), 0);
+		if (!cache)
+			return NULL;
+		memset(cache, 0, sizeof(*cache));
+		t->tls[TLS_ENTRY_MALLOC] = (uintptr_t)cache;
+	}
+
+	return cache;
+}
+
+static void *malloc_cache_alloc(size_t size, void *caller)
+{
+	uint bin = (size + MALLOC_CACHE_GRAIN - 1) / MALLOC_CACHE_GRAIN;
+	if (bin == 0)
+		bin = 1;
+
+	struct malloc_cache *cache = malloc_cache_get();
+	if (!cache)
+		return heap_alloc_etc(size, 0, caller);
+
+	/* bin n holds blocks with at least n grains usable */
+	struct malloc_cache_bin *b = &cache->bins[bin - 1];
+	if (b->count == 0) {
+		b->count = heap_alloc_batch(bin * MALLOC_CACHE_GRAIN, b->ptrs, MALLOC_CACHE_BATCH);
+		if (b->count == 0)
+			return NULL;
+	}
+
+	return b->ptrs[--b->count];
+}
+
+static void malloc_cache_free(void *ptr)
+{
+	size_t usable = heap_usable_size(ptr);
+	if (usable < MALLOC_CACHE_GRAIN || usable >= MALLOC_CACHE_MAX + MALLOC_CACHE_GRAIN) {
+		heap_free(ptr);
+		return;
+	}
+
+	struct malloc_cache *cache = malloc_cache_get();
+	if (!cache) {
+		heap_free(ptr);
+		return;
+	}
+
+	struct malloc_cache_bin *b = &cache->bins[usable / MALLOC_CACHE_GRAIN - 1];
+	if (b->count == MALLOC_CACHE_DEPTH) {
+		/* hand back the oldest half */
+		heap_free_batch(b->ptrs, MALLOC_CACHE_BATCH);
+		memmove(&b->ptrs[0], &b->ptrs[MALLOC_CACHE_BATCH],
+		        (MALLOC_CACHE_DEPTH - MALLOC_CACHE_BATCH) * sizeof(void *));
+		b->count -= MALLOC_CACHE_BATCH;
+	}
+
+	b->ptrs[b->count++] = ptr;
+}
+
+void malloc_thread_cache_flush(void)
+{
+	thread_t *t = get_current_thread();
+	if (!t)
+		return;
+
+	struct malloc_cache *cache = (struct malloc_cache *)t->tls[TLS_ENTRY_MALLOC];
+	if (!cache)
+		return;
+
+	t->tls[TLS_ENTRY_MALLOC] = 0;
+
+	for (uint i = 0; i < MALLOC_CACHE_BINS; i++)
+		heap_free_batch(cache->bins[i].ptrs, cache->bins[i].count);
+	heap_free(cache);
+}
+
+static void *malloc_etc(size_t size, void *caller)
+{
+	if (size <= MALLOC_CACHE_MAX)
+		return malloc_cache_alloc(size, caller);
+
+	return heap_alloc_etc(size, 0, caller);
+}
+
+void free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	malloc_cache_free(ptr);
+}
+
+#else
+
+static void *malloc_etc(size_t size, void *caller)
+{
+	return heap_alloc_etc(size, 0, caller);
+}
+
+void free(void *ptr)
+{
+	return heap_free(ptr);
+}
+
+#endif
+
 void *malloc(size_t size)
 {
-	return heap_alloc(size, 0);
+	return malloc_etc(size, __GET_CALLER());
 }
 
 void *memalign(size_t boundary, size_t size)
 {
-	return heap_alloc(size, boundary);
+	return heap_alloc_etc(size, boundary, __GET_CALLER());
 }
 
 void *calloc(size_t count, size_t size)
@@ -40,7 +177,7 @@ void *calloc(size_t count, size_t size)
 	void *ptr;
 	size_t realsize = count * size;
 
-	ptr = heap_alloc(realsize, 0);
+	ptr = malloc_etc(realsize, __GET_CALLER());
 	if (!ptr)
 		return NULL;
 
@@ -51,10 +188,10 @@ void *calloc(size_t count, size_t size)
 void *realloc(void *ptr, size_t size)
 {
 	if (!ptr)
-		return malloc(size);
+		return malloc_etc(size, __GET_CALLER());
 
 	// XXX better implementation
-	void *p = malloc(size);
+	void *p = malloc_etc(size, __GET_CALLER());
 	if (!p)
 		return NULL;
 
@@ -63,9 +200,3 @@ void *realloc(void *ptr, size_t size)
 
 	return p;
 }
-
-void free(void *ptr)
-{
-	return heap_free(ptr);
-}
-
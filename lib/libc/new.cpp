@@ -26,12 +26,12 @@
 
 void *operator new(size_t s)
 {
-	return heap_alloc(s, 0);
+	return heap_alloc_etc(s, 0, __GET_CALLER());
 }
 
 void *operator new[](size_t s)
 {
-	return heap_alloc(s, 0);
+	return heap_alloc_etc(s, 0, __GET_CALLER());
 }
 
 void *operator new(size_t , void *p)
@@ -27,6 +27,7 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <platform/debug.h>
 
@@ -76,6 +77,14 @@ int snprintf(char *str, size_t len, const char *fmt, ...)
 #define LEADZEROFLAG   0x00001000
 #define BLANKPOSFLAG   0x00002000
 
+/* "00".."99", so the decimal conversion retires two digits per division */
+static const char digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
 __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, size_t len, uint flag, char *signchar)
 {
 	size_t pos = len;
@@ -88,15 +97,32 @@ __NO_INLINE static char *longlong_to_string(char *buf, unsigned long long n, siz
 
 	buf[--pos] = 0;
 
-	/* only do the math if the number is >= 10 */
-	while (n >= 10) {
-		int digit = n % 10;
+	/* stay in 64 bit math only as long as the number needs it, a 64 bit
+	 * divide is a libgcc call on 32 bit cpus */
+	while (n > UINT32_MAX) {
+		uint digits = n % 100;
+
+		n /= 100;
+
+		pos -= 2;
+		memcpy(&buf[pos], &digit_pairs[digits * 2], 2);
+	}
 
-		n /= 10;
+	uint32_t n32 = n;
+	while (n32 >= 100) {
+		uint digits = n32 % 100;
 
-		buf[--pos] = digit + '0';
+		n32 /= 100;
+
+		pos -= 2;
+		memcpy(&buf[pos], &digit_pairs[digits * 2], 2);
+	}
+	if (n32 >= 10) {
+		pos -= 2;
+		memcpy(&buf[pos], &digit_pairs[n32 * 2], 2);
+	} else {
+		buf[--pos] = n32 + '0';
 	}
-	buf[--pos] = n + '0';
 
 	if (negative)
 		*signchar = '-';
@@ -356,47 +382,92 @@ int vsprintf(char *str, const char *fmt, va_list ap)
 	return vsnprintf(str, INT_MAX, fmt, ap);
 }
 
-struct _output_args {
-	char *outstr;
-	size_t len;
-	size_t pos;
+/* The engine gathers its output here and hands it to the output function a
+ * buffer at a time, instead of once per literal run, field and pad char.
+ * vsnprintf has no output function and the buffer is the caller's string.
+ */
+#define PRINTF_BUF_SIZE 64
+
+struct _printf_sink {
+	_printf_engine_output_func out;
+	void *state;
+	char *buf;
+	size_t size;
+	size_t pos;		/* chars in buf, or chars so far if writing direct */
+	size_t flushed;	/* chars the output function has taken */
 };
 
-static int _vsnprintf_output(const char *str, size_t len, void *state)
+static int sink_flush(struct _printf_sink *sink)
 {
-	struct _output_args *args = state;
+	if (!sink->out || sink->pos == 0)
+		return 0;
 
-	size_t count = 0;
-	while (count < len) {
-		if (args->pos < args->len) {
-			args->outstr[args->pos++] = *str;
-		}
+	int err = sink->out(sink->buf, sink->pos, sink->state);
+	sink->pos = 0;
+	if (err < 0)
+		return err;
+
+	sink->flushed += err;
+	return 0;
+}
+
+static int sink_write(struct _printf_sink *sink, const char *str, size_t len)
+{
+	if (!sink->out) {
+		/* copy what fits, but keep counting past the end */
+		if (sink->pos < sink->size)
+			memcpy(&sink->buf[sink->pos], str, MIN(len, sink->size - sink->pos));
+		sink->pos += len;
+		return 0;
+	}
+
+	if (len > sink->size - sink->pos) {
+		int err = sink_flush(sink);
+		if (err < 0)
+			return err;
 
-		str++;
-		count++;
+		/* no point staging something that fills the buffer by itself */
+		if (len >= sink->size) {
+			err = sink->out(str, len, sink->state);
+			if (err < 0)
+				return err;
+
+			sink->flushed += err;
+			return 0;
+		}
 	}
 
-	return count;
+	memcpy(&sink->buf[sink->pos], str, len);
+	sink->pos += len;
+	return 0;
 }
 
-int vsnprintf(char *str, size_t len, const char *fmt, va_list ap)
+static int sink_pad(struct _printf_sink *sink, char c, size_t count)
 {
-	struct _output_args args;
-	int wlen;
+	if (!sink->out) {
+		if (sink->pos < sink->size)
+			memset(&sink->buf[sink->pos], c, MIN(count, sink->size - sink->pos));
+		sink->pos += count;
+		return 0;
+	}
 
-	args.outstr = str;
-	args.len = len;
-	args.pos = 0;
+	while (count > 0) {
+		if (sink->pos == sink->size) {
+			int err = sink_flush(sink);
+			if (err < 0)
+				return err;
+		}
 
-	wlen = _printf_engine(&_vsnprintf_output, (void *)&args, fmt, ap);
-	if (args.pos >= len)
-		str[len-1] = '\0';
-	else
-		str[wlen] = '\0';
-	return wlen;
+		size_t n = MIN(count, sink->size - sink->pos);
+		memset(&sink->buf[sink->pos], c, n);
+		sink->pos += n;
+		count -= n;
+	}
+
+	return 0;
 }
 
-int _printf_engine(_printf_engine_output_func out, void *state, const char *fmt, va_list ap)
+static int printf_engine_sink(struct _printf_sink *sink, const char *fmt, va_list ap)
 {
 	int err = 0;
 	char c;
@@ -408,11 +479,12 @@ int _printf_engine(_printf_engine_output_func out, void *state, const char *fmt,
 	int flags;
 	unsigned int format_num;
 	char signchar;
-	size_t chars_written = 0;
+	size_t chars_written;
 	char num_buffer[32];
 
-#define OUTPUT_STRING(str, len) do { err = out(str, len, state); if (err < 0) { goto exit; } else { chars_written += err; } } while(0)
+#define OUTPUT_STRING(str, len) do { err = sink_write(sink, str, len); if (err < 0) goto exit; } while (0)
 #define OUTPUT_CHAR(c) do { char __temp[1] = { c }; OUTPUT_STRING(__temp, 1); } while (0)
+#define OUTPUT_PAD(c, count) do { err = sink_pad(sink, c, count); if (err < 0) goto exit; } while (0)
 
 	for (;;) {
 		/* reset the format state */
@@ -508,7 +580,7 @@ next_format:
 				    va_arg(ap, int);
 				flags |= SIGNEDFLAG;
 				s = longlong_to_string(num_buffer, n, sizeof(num_buffer), flags, &signchar);
-				goto _output_string;
+				goto _output_number;
 			case 'u':
 				n = (flags & LONGLONGFLAG) ? va_arg(ap, unsigned long long) :
 				    (flags & LONGFLAG) ? va_arg(ap, unsigned long) :
@@ -519,7 +591,7 @@ next_format:
 				    (flags & PTRDIFFFLAG) ? (uintptr_t)va_arg(ap, ptrdiff_t) :
 				    va_arg(ap, unsigned int);
 				s = longlong_to_string(num_buffer, n, sizeof(num_buffer), flags, &signchar);
-				goto _output_string;
+				goto _output_number;
 			case 'p':
 				flags |= LONGFLAG | ALTFLAG;
 				goto hex;
@@ -537,13 +609,12 @@ hex:
 				    (flags & PTRDIFFFLAG) ? (uintptr_t)va_arg(ap, ptrdiff_t) :
 				    va_arg(ap, unsigned int);
 				s = longlong_to_hexstring(num_buffer, n, sizeof(num_buffer), flags);
-				if (flags & ALTFLAG) {
-					OUTPUT_CHAR('0');
-					OUTPUT_CHAR((flags & CAPSFLAG) ? 'X': 'x');
-				}
-				goto _output_string;
+				if (flags & ALTFLAG)
+					OUTPUT_STRING((flags & CAPSFLAG) ? "0X" : "0x", 2);
+				goto _output_number;
 			case 'n':
 				ptr = va_arg(ap, void *);
+				chars_written = sink->flushed + sink->pos;
 				if (flags & LONGLONGFLAG)
 					*(long long *)ptr = chars_written;
 				else if (flags & LONGFLAG)
@@ -587,15 +658,26 @@ hex:
 		/* shared output code */
 _output_string:
 		string_len = strlen(s);
+		goto _output_field;
+
+_output_number:
+		/* the integer conversions fill num_buffer up to its terminator */
+		string_len = &num_buffer[sizeof(num_buffer) - 1] - s;
+
+_output_field:
+		/* the common case, nothing to pad or sign */
+		if (format_num <= string_len && signchar == '\0') {
+			OUTPUT_STRING(s, string_len);
+			continue;
+		}
 
 		if (flags & LEFTFORMATFLAG) {
 			/* left justify the text */
 			OUTPUT_STRING(s, string_len);
-			uint written = err;
 
 			/* pad to the right (if necessary) */
-			for (; format_num > written; format_num--)
-				OUTPUT_CHAR(' ');
+			if (format_num > string_len)
+				OUTPUT_PAD(' ', format_num - string_len);
 		} else {
 			/* right justify the text (digits) */
 
@@ -609,8 +691,8 @@ _output_string:
 				OUTPUT_CHAR(signchar);
 
 			/* pad according to the format string */
-			for (; format_num > string_len; format_num--)
-				OUTPUT_CHAR(flags & LEADZEROFLAG ? '0' : ' ');
+			if (format_num > string_len)
+				OUTPUT_PAD(flags & LEADZEROFLAG ? '0' : ' ', format_num - string_len);
 
 			/* if not leading zeros, output the sign char just before the number */
 			if (!(flags & LEADZEROFLAG) && signchar != '\0')
@@ -624,9 +706,45 @@ _output_string:
 
 #undef OUTPUT_STRING
 #undef OUTPUT_CHAR
+#undef OUTPUT_PAD
+
+	err = sink_flush(sink);
 
 exit:
-	return (err < 0) ? err : (int)chars_written;
+	return (err < 0) ? err : (int)(sink->flushed + sink->pos);
+}
+
+int vsnprintf(char *str, size_t len, const char *fmt, va_list ap)
+{
+	struct _printf_sink sink = {
+		.out = NULL,
+		.buf = str,
+		.size = len,
+	};
+	int wlen;
+
+	/* format straight into the caller's buffer */
+	wlen = printf_engine_sink(&sink, fmt, ap);
+	if (len == 0)
+		return wlen;
+	if (sink.pos >= len)
+		str[len-1] = '\0';
+	else
+		str[wlen] = '\0';
+	return wlen;
+}
+
+int _printf_engine(_printf_engine_output_func out, void *state, const char *fmt, va_list ap)
+{
+	char buf[PRINTF_BUF_SIZE];
+	struct _printf_sink sink = {
+		.out = out,
+		.state = state,
+		.buf = buf,
+		.size = sizeof(buf),
+	};
+
+	return printf_engine_sink(&sink, fmt, ap);
 }
 
 // vim: set ts=4 sw=4 noexpandtab:
@@ -29,18 +29,29 @@
  */
 
 #include <sys/types.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
-static __inline char	*med3(char *, char *, char *, int (*)(const void *, const void *));
-static __inline void	 swapfunc(char *, char *, int, int);
+typedef int cmp_t(const void *, const void *);
 
-#define min(a, b)	(a) < (b) ? a : b
+static __inline char	*med3(char *, char *, char *, cmp_t *);
+static __inline void	 swapfunc(char *, char *, size_t, int);
 
 /*
- * Qsort routine from Bentley & McIlroy's "Engineering a Sort Function".
+ * Pattern defeating quicksort: Bentley & McIlroy's partitioning from
+ * "Engineering a Sort Function", with Orson Peters' guards against bad
+ * inputs. Unbalanced partitions shuffle a few elements to break up whatever
+ * pattern caused them and after log2(n) of them the range is heap sorted, so
+ * the worst case stays O(n log n). Ranges that partition without any swaps
+ * are likely sorted already and get an insertion sort that gives up if it
+ * has to move too much.
  */
+#define INSERTION_SORT_THRESHOLD	12
+#define NINTHER_THRESHOLD		40
+#define PARTIAL_INSERTION_LIMIT		8
+
 #define swapcode(TYPE, parmi, parmj, n) {		\
-	long i = (n) / sizeof (TYPE);			\
+	size_t i = (n) / sizeof (TYPE);			\
 	TYPE *pi = (TYPE *) (parmi);			\
 	TYPE *pj = (TYPE *) (parmj);			\
 	do {						\
@@ -50,14 +61,22 @@ static __inline void	 swapfunc(char *, char *, int, int);
         } while (--i > 0);				\
 }
 
-#define SWAPINIT(a, es) swaptype = ((char *)a - (char *)0) % sizeof(long) || \
-	es % sizeof(long) ? 2 : es == sizeof(long)? 0 : 1;
+/*
+ * 0: one long, 1: several longs, 2: one uint32_t, 3: several uint32_ts,
+ * 4: bytes. Every element of the array shares the same alignment, so this is
+ * worked out once.
+ */
+#define SWAPINIT(a, es) swaptype = \
+	(((uintptr_t)(a) | (es)) % sizeof(long) == 0) ? ((es) == sizeof(long) ? 0 : 1) : \
+	(((uintptr_t)(a) | (es)) % sizeof(uint32_t) == 0) ? ((es) == sizeof(uint32_t) ? 2 : 3) : 4;
 
 static __inline void
-swapfunc(char *a, char *b, int n, int swaptype)
+swapfunc(char *a, char *b, size_t n, int swaptype)
 {
 	if (swaptype <= 1)
 		swapcode(long, a, b, n)
+	else if (swaptype <= 3)
+		swapcode(uint32_t, a, b, n)
 	else
 		swapcode(char, a, b, n)
 }
@@ -67,95 +86,188 @@ swapfunc(char *a, char *b, int n, int swaptype)
 		long t = *(long *)(a);			\
 		*(long *)(a) = *(long *)(b);		\
 		*(long *)(b) = t;			\
+	} else if (swaptype == 2) {			\
+		uint32_t t = *(uint32_t *)(a);		\
+		*(uint32_t *)(a) = *(uint32_t *)(b);	\
+		*(uint32_t *)(b) = t;			\
 	} else						\
 		swapfunc(a, b, es, swaptype)
 
 #define vecswap(a, b, n)	if ((n) > 0) swapfunc(a, b, n, swaptype)
 
 static __inline char *
-med3(char *a, char *b, char *c, int (*cmp)(const void *, const void *))
+med3(char *a, char *b, char *c, cmp_t *cmp)
 {
 	return cmp(a, b) < 0 ?
 	       (cmp(b, c) < 0 ? b : (cmp(a, c) < 0 ? c : a ))
               :(cmp(b, c) > 0 ? b : (cmp(a, c) < 0 ? a : c ));
 }
 
-void
-qsort(void *aa, size_t n, size_t es, int (*cmp)(const void *, const void *))
+static void
+insertion_sort(char *a, size_t n, size_t es, cmp_t *cmp, int swaptype)
 {
-	char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
-	int d, r, swaptype, swap_cnt;
-	char *a = aa;
-
-loop:	SWAPINIT(a, es);
-	swap_cnt = 0;
-	if (n < 7) {
-		for (pm = (char *)a + es; pm < (char *) a + n * es; pm += es)
-			for (pl = pm; pl > (char *) a && cmp(pl - es, pl) > 0;
-			     pl -= es)
-				swap(pl, pl - es);
-		return;
+	char *pm, *pl;
+
+	for (pm = a + es; pm < a + n * es; pm += es)
+		for (pl = pm; pl > a && cmp(pl - es, pl) > 0; pl -= es)
+			swap(pl, pl - es);
+}
+
+/* insertion sort that gives up, leaving a permutation, after too many moves */
+static bool
+partial_insertion_sort(char *a, size_t n, size_t es, cmp_t *cmp, int swaptype)
+{
+	char *pm, *pl;
+	uint moves = 0;
+
+	for (pm = a + es; pm < a + n * es; pm += es) {
+		for (pl = pm; pl > a && cmp(pl - es, pl) > 0; pl -= es) {
+			swap(pl, pl - es);
+			moves++;
+		}
+		if (moves > PARTIAL_INSERTION_LIMIT)
+			return false;
 	}
-	pm = (char *)a + (n / 2) * es;
-	if (n > 7) {
-		pl = (char *)a;
-		pn = (char *)a + (n - 1) * es;
-		if (n > 40) {
+	return true;
+}
+
+static void
+sift_down(char *a, size_t root, size_t n, size_t es, cmp_t *cmp, int swaptype)
+{
+	size_t child;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && cmp(a + child * es, a + (child + 1) * es) < 0)
+			child++;
+		if (cmp(a + root * es, a + child * es) >= 0)
+			return;
+		swap(a + root * es, a + child * es);
+		root = child;
+	}
+}
+
+static void
+heap_sort(char *a, size_t n, size_t es, cmp_t *cmp, int swaptype)
+{
+	size_t i;
+
+	for (i = n / 2; i-- > 0; )
+		sift_down(a, i, n, es, cmp, swaptype);
+	for (i = n - 1; i > 0; i--) {
+		swap(a, a + i * es);
+		sift_down(a, 0, i, es, cmp, swaptype);
+	}
+}
+
+/* swap the ends of a range with elements a quarter of the way in */
+static void
+break_patterns(char *a, size_t n, size_t es, int swaptype)
+{
+	if (n < INSERTION_SORT_THRESHOLD)
+		return;
+	swap(a, a + (n / 4) * es);
+	swap(a + (n - 1) * es, a + (n - n / 4) * es);
+}
+
+static void
+pdqsort(char *a, size_t n, size_t es, cmp_t *cmp, int swaptype, int bad_allowed)
+{
+	char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
+	size_t d, l, r;
+	int c, swap_cnt;
+
+	for (;;) {
+		if (n < INSERTION_SORT_THRESHOLD) {
+			insertion_sort(a, n, es, cmp, swaptype);
+			return;
+		}
+		if (bad_allowed == 0) {
+			heap_sort(a, n, es, cmp, swaptype);
+			return;
+		}
+
+		pl = a;
+		pm = a + (n / 2) * es;
+		pn = a + (n - 1) * es;
+		if (n > NINTHER_THRESHOLD) {
 			d = (n / 8) * es;
 			pl = med3(pl, pl + d, pl + 2 * d, cmp);
 			pm = med3(pm - d, pm, pm + d, cmp);
 			pn = med3(pn - 2 * d, pn - d, pn, cmp);
 		}
 		pm = med3(pl, pm, pn, cmp);
-	}
-	swap(a, pm);
-	pa = pb = (char *)a + es;
+		swap(a, pm);
 
-	pc = pd = (char *)a + (n - 1) * es;
-	for (;;) {
-		while (pb <= pc && (r = cmp(pb, a)) <= 0) {
-			if (r == 0) {
-				swap_cnt = 1;
-				swap(pa, pb);
-				pa += es;
+		/* elements equal to the pivot collect at both ends */
+		swap_cnt = 0;
+		pa = pb = a + es;
+		pc = pd = a + (n - 1) * es;
+		for (;;) {
+			while (pb <= pc && (c = cmp(pb, a)) <= 0) {
+				if (c == 0) {
+					swap_cnt = 1;
+					swap(pa, pb);
+					pa += es;
+				}
+				pb += es;
 			}
-			pb += es;
-		}
-		while (pb <= pc && (r = cmp(pc, a)) >= 0) {
-			if (r == 0) {
-				swap_cnt = 1;
-				swap(pc, pd);
-				pd -= es;
+			while (pb <= pc && (c = cmp(pc, a)) >= 0) {
+				if (c == 0) {
+					swap_cnt = 1;
+					swap(pc, pd);
+					pd -= es;
+				}
+				pc -= es;
 			}
+			if (pb > pc)
+				break;
+			swap(pb, pc);
+			swap_cnt = 1;
+			pb += es;
 			pc -= es;
 		}
-		if (pb > pc)
-			break;
-		swap(pb, pc);
-		swap_cnt = 1;
-		pb += es;
-		pc -= es;
+
+		/* move them into the middle, leaving less at the front and greater at the back */
+		pn = a + n * es;
+		d = MIN((size_t)(pa - a), (size_t)(pb - pa));
+		vecswap(a, pb - d, d);
+		d = MIN((size_t)(pd - pc), (size_t)(pn - pd) - es);
+		vecswap(pb, pn - d, d);
+
+		l = (size_t)(pb - pa) / es;
+		r = (size_t)(pd - pc) / es;
+		pn -= r * es;
+
+		if (l < n / 8 || r < n / 8) {
+			bad_allowed--;
+			break_patterns(a, l, es, swaptype);
+			break_patterns(pn, r, es, swaptype);
+		} else if (swap_cnt == 0 &&
+		           partial_insertion_sort(a, l, es, cmp, swaptype) &&
+		           partial_insertion_sort(pn, r, es, cmp, swaptype)) {
+			return;
+		}
+
+		/* recurse into the smaller side to bound the stack, loop on the other */
+		if (l < r) {
+			pdqsort(a, l, es, cmp, swaptype, bad_allowed);
+			a = pn;
+			n = r;
+		} else {
+			pdqsort(pn, r, es, cmp, swaptype, bad_allowed);
+			n = l;
+		}
 	}
-	if (swap_cnt == 0) {  /* Switch to insertion sort */
-		for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-			for (pl = pm; pl > (char *) a && cmp(pl - es, pl) > 0;
-			     pl -= es)
-				swap(pl, pl - es);
+}
+
+void
+qsort(void *aa, size_t n, size_t es, cmp_t *cmp)
+{
+	int swaptype;
+
+	if (n < 2 || es == 0)
 		return;
-	}
 
-	pn = (char *)a + n * es;
-	r = min(pa - (char *)a, pb - pa);
-	vecswap(a, pb - r, r);
-	r = min(pd - pc, pn - pd - (int)es);
-	vecswap(pb, pn - r, r);
-	if ((r = pb - pa) > (int)es)
-		qsort(a, r / es, es, cmp);
-	if ((r = pd - pc) > (int)es) {
-		/* Iterate rather than recurse to save stack space */
-		a = pn - r;
-		n = r / es;
-		goto loop;
-	}
-	/* qsort(pn - r, r / es, es, cmp); */
+	SWAPINIT(aa, es);
+	pdqsort(aa, n, es, cmp, swaptype, (int)(sizeof(long) * 8) - __builtin_clzl(n));
 }
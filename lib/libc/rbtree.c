@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <rbtree.h>
+#include <assert.h>
+
+/* point whatever linked to old, its parent or the root, at new instead */
+static void replace_child(struct rb_tree *tree, struct rb_node *parent,
+                          struct rb_node *old, struct rb_node *new)
+{
+	if (!parent)
+		tree->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static void rotate_left(struct rb_tree *tree, struct rb_node *x)
+{
+	struct rb_node *y = x->right;
+
+	x->right = y->left;
+	if (y->left)
+		y->left->parent = x;
+	y->parent = x->parent;
+	replace_child(tree, x->parent, x, y);
+	y->left = x;
+	x->parent = y;
+}
+
+static void rotate_right(struct rb_tree *tree, struct rb_node *x)
+{
+	struct rb_node *y = x->left;
+
+	x->left = y->right;
+	if (y->right)
+		y->right->parent = x;
+	y->parent = x->parent;
+	replace_child(tree, x->parent, x, y);
+	y->right = x;
+	x->parent = y;
+}
+
+static inline bool is_red(const struct rb_node *node)
+{
+	return node && node->red;
+}
+
+void rb_tree_insert_at(struct rb_tree *tree, struct rb_node *parent, struct rb_node **link, struct rb_node *node)
+{
+	DEBUG_ASSERT(*link == NULL);
+
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->red = true;
+	*link = node;
+
+	/* the only thing that can be wrong is a red node with a red parent */
+	while ((parent = node->parent) && parent->red) {
+		/* a red parent is never the root, so there is a grandparent */
+		struct rb_node *grandparent = parent->parent;
+
+		if (parent == grandparent->left) {
+			struct rb_node *uncle = grandparent->right;
+
+			if (is_red(uncle)) {
+				/* push the grandparent's blackness down a level and carry on above */
+				parent->red = uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+
+			if (node == parent->right) {
+				rotate_left(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			rotate_right(tree, grandparent);
+		} else {
+			struct rb_node *uncle = grandparent->left;
+
+			if (is_red(uncle)) {
+				parent->red = uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+
+			if (node == parent->left) {
+				rotate_right(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			rotate_left(tree, grandparent);
+		}
+	}
+
+	tree->root->red = false;
+}
+
+void rb_tree_insert(struct rb_tree *tree, struct rb_node *node, rb_compare_func compare)
+{
+	struct rb_node *parent = NULL;
+	struct rb_node **link = &tree->root;
+
+	while (*link) {
+		parent = *link;
+		if (compare(node, parent) < 0)
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+
+	rb_tree_insert_at(tree, parent, link, node);
+}
+
+/* node has one black level too few on its side of parent. node may be NULL */
+static void delete_fixup(struct rb_tree *tree, struct rb_node *node, struct rb_node *parent)
+{
+	while (node != tree->root && !is_red(node)) {
+		if (node == parent->left) {
+			struct rb_node *sibling = parent->right;
+
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rotate_left(tree, parent);
+				sibling = parent->right;
+			}
+
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				/* take a black level off the sibling's side too and move up */
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if (!is_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				rotate_right(tree, sibling);
+				sibling = parent->right;
+			}
+
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rotate_left(tree, parent);
+			node = tree->root;
+		} else {
+			struct rb_node *sibling = parent->left;
+
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rotate_right(tree, parent);
+				sibling = parent->left;
+			}
+
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if (!is_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				rotate_left(tree, sibling);
+				sibling = parent->left;
+			}
+
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rotate_right(tree, parent);
+			node = tree->root;
+		}
+	}
+
+	if (node)
+		node->red = false;
+}
+
+void rb_tree_delete(struct rb_tree *tree, struct rb_node *node)
+{
+	struct rb_node *child, *parent;
+	bool removed_red;
+
+	if (!node->left || !node->right) {
+		/* at most one child, which takes the node's place */
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		removed_red = node->red;
+
+		if (child)
+			child->parent = parent;
+		replace_child(tree, parent, node, child);
+	} else {
+		/* two children, the successor is lifted out of the right subtree into
+		 * the node's place, and its own right child takes the successor's */
+		struct rb_node *next = node->right;
+		while (next->left)
+			next = next->left;
+
+		child = next->right;
+		removed_red = next->red;
+
+		if (next->parent == node) {
+			parent = next;
+		} else {
+			parent = next->parent;
+			parent->left = child;
+			if (child)
+				child->parent = parent;
+			next->right = node->right;
+			node->right->parent = next;
+		}
+
+		next->left = node->left;
+		node->left->parent = next;
+		next->parent = node->parent;
+		next->red = node->red;
+		replace_child(tree, node->parent, node, next);
+	}
+
+	node->parent = node->left = node->right = NULL;
+
+	if (!removed_red)
+		delete_fixup(tree, child, parent);
+}
+
+struct rb_node *rb_tree_find(const struct rb_tree *tree, const void *key, rb_key_compare_func compare)
+{
+	struct rb_node *node = tree->root;
+
+	while (node) {
+		int result = compare(key, node);
+		if (result < 0)
+			node = node->left;
+		else if (result > 0)
+			node = node->right;
+		else
+			return node;
+	}
+
+	return NULL;
+}
+
+struct rb_node *rb_tree_lower_bound(const struct rb_tree *tree, const void *key, rb_key_compare_func compare)
+{
+	struct rb_node *node = tree->root;
+	struct rb_node *found = NULL;
+
+	while (node) {
+		if (compare(key, node) <= 0) {
+			found = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return found;
+}
+
+struct rb_node *rb_tree_first(const struct rb_tree *tree)
+{
+	struct rb_node *node = tree->root;
+
+	if (node) {
+		while (node->left)
+			node = node->left;
+	}
+
+	return node;
+}
+
+struct rb_node *rb_tree_last(const struct rb_tree *tree)
+{
+	struct rb_node *node = tree->root;
+
+	if (node) {
+		while (node->right)
+			node = node->right;
+	}
+
+	return node;
+}
+
+struct rb_node *rb_tree_next(const struct rb_node *node)
+{
+	if (node->right) {
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return (struct rb_node *)node;
+	}
+
+	/* climb until we come up from a left child */
+	while (node->parent && node == node->parent->right)
+		node = node->parent;
+
+	return node->parent;
+}
+
+struct rb_node *rb_tree_prev(const struct rb_node *node)
+{
+	if (node->left) {
+		node = node->left;
+		while (node->right)
+			node = node->right;
+		return (struct rb_node *)node;
+	}
+
+	while (node->parent && node == node->parent->left)
+		node = node->parent;
+
+	return node->parent;
+}
@@ -9,6 +9,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/errno.c \
 	$(LOCAL_DIR)/printf.c \
 	$(LOCAL_DIR)/rand.c \
+	$(LOCAL_DIR)/rbtree.c \
 	$(LOCAL_DIR)/strtol.c \
 	$(LOCAL_DIR)/strtoll.c \
 	$(LOCAL_DIR)/stdio.c \
@@ -17,6 +18,15 @@ MODULE_SRCS += \
 
 ifneq ($(WITH_CUSTOM_MALLOC),true)
 MODULE_SRCS += $(LOCAL_DIR)/malloc.c
+
+# per thread caches of small blocks in front of the heap. left out of heap
+# profile builds, which want each block charged to its real caller
+MALLOC_THREAD_CACHE ?= 0
+ifeq ($(MALLOC_THREAD_CACHE),1)
+ifneq ($(WITH_HEAP_PROFILE),1)
+GLOBAL_DEFINES += WITH_MALLOC_THREAD_CACHE=1
+endif
+endif
 endif
 
 ifeq ($(WITH_CPP_SUPPORT),true)
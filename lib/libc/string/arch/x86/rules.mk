@@ -1,11 +1,11 @@
 LOCAL_DIR := $(GET_LOCAL_DIR)
 
-ASM_STRING_OPS := #bcopy bzero memcpy memmove memset
+ASM_STRING_OPS := bzero memcpy memset
 
 MODULE_SRCS += \
-	#$(LOCAL_DIR)/memcpy.S \
-	#$(LOCAL_DIR)/memset.S
+	$(LOCAL_DIR)/memcpy.S \
+	$(LOCAL_DIR)/memset.S \
+	$(LIBC_STRING_C_DIR)/arch/x86/string_features.c
 
 # filter out the C implementation
 C_STRING_OPS := $(filter-out $(ASM_STRING_OPS),$(C_STRING_OPS))
-
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lk/init.h>
+#include <sys/types.h>
+#include <arch/x86.h>
+
+/*
+ * Picks which copy loops memcpy and memset use, see memcpy.S. Until this runs
+ * they stick to rep movs/stos of whole words, which works on any cpu.
+ *
+ * bit 0: enhanced rep movsb/stosb, byte granular rep is the fastest bulk copy
+ * bit 1: fast short rep movsb, it's also the fastest for short copies
+ */
+uint32_t x86_string_features;
+
+static void x86_string_init(uint level)
+{
+	uint32_t features = 0;
+
+	if (check_erms_avail())
+		features |= (1 << 0);
+	if (check_fsrm_avail())
+		features |= (1 << 1);
+
+	x86_string_features = features;
+}
+
+LK_INIT_HOOK(x86_string, &x86_string_init, LK_INIT_LEVEL_EARLIEST);
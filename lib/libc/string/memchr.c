@@ -26,20 +26,36 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 void *
 memchr(void const *buf, int c, size_t len)
 {
-	size_t i;
 	unsigned char const *b= buf;
 	unsigned char        x= (c&0xff);
 
-	for (i= 0; i< len; i++) {
-		if (b[i]== x) {
-			return (void*)(b+i);
+	for (; len > 0 && !STRING_WORD_ALIGNED(b); len--, b++) {
+		if (*b== x) {
+			return (void*)b;
+		}
+	}
+
+	if (len >= STRING_WORD_SIZE) {
+		const string_word_t *w = (const string_word_t *)b;
+		string_word_t mask = string_word_repeat(x);
+
+		while (len >= STRING_WORD_SIZE && !string_word_haszero(*w ^ mask)) {
+			w++;
+			len -= STRING_WORD_SIZE;
+		}
+		b = (unsigned char const *)w;
+	}
+
+	for (; len > 0; len--, b++) {
+		if (*b== x) {
+			return (void*)b;
 		}
 	}
 
 	return NULL;
 }
-
@@ -26,11 +26,27 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 char *
 strchr(const char *s, int c)
 {
-	for (; *s != (char) c; ++s)
+	const string_word_t *w;
+	string_word_t mask;
+
+	for (; !STRING_WORD_ALIGNED(s); ++s) {
+		if (*s == (char) c)
+			return (char *) s;
+		if (*s == '\0')
+			return NULL;
+	}
+
+	/* skip words holding neither the terminator nor c */
+	mask = string_word_repeat(c);
+	for (w = (const string_word_t *)s; !string_word_haszero(*w) && !string_word_haszero(*w ^ mask); w++)
+		;
+
+	for (s = (const char *)w; *s != (char) c; ++s)
 		if (*s == '\0')
 			return NULL;
 	return (char *) s;
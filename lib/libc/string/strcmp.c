@@ -26,16 +26,34 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 int
 strcmp(char const *cs, char const *ct)
 {
-	signed char __res;
+	/* compare a word at a time when both strings can be aligned together */
+	if ((((uintptr_t)cs ^ (uintptr_t)ct) & (STRING_WORD_SIZE - 1)) == 0) {
+		const string_word_t *ws, *wt;
 
-	while (1) {
-		if ((__res = *cs - *ct++) != 0 || !*cs++)
-			break;
+		for (; !STRING_WORD_ALIGNED(cs); cs++, ct++) {
+			if (*cs != *ct || !*cs)
+				return (signed char)(*cs - *ct);
+		}
+
+		ws = (const string_word_t *)cs;
+		wt = (const string_word_t *)ct;
+		while (*ws == *wt && !string_word_haszero(*ws)) {
+			ws++;
+			wt++;
+		}
+		cs = (const char *)ws;
+		ct = (const char *)wt;
+	}
+
+	while (*cs == *ct && *cs) {
+		cs++;
+		ct++;
 	}
 
-	return __res;
+	return (signed char)(*cs - *ct);
 }
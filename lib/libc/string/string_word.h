@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdint.h>
+
+/*
+ * Helpers for the string routines that scan a word at a time. Aligned word
+ * loads never span a page boundary, so reading the rest of the word holding
+ * a terminator is safe.
+ */
+typedef unsigned long __MAY_ALIAS string_word_t;
+
+#define STRING_WORD_SIZE sizeof(string_word_t)
+#define STRING_WORD_ONES ((string_word_t)-1 / 0xff)
+#define STRING_WORD_HIGHS (STRING_WORD_ONES * 0x80)
+
+#define STRING_WORD_ALIGNED(p) (((uintptr_t)(p) & (STRING_WORD_SIZE - 1)) == 0)
+
+/* non zero if any byte of x is zero */
+static inline string_word_t string_word_haszero(string_word_t x)
+{
+	return (x - STRING_WORD_ONES) & ~x & STRING_WORD_HIGHS;
+}
+
+/* c in every byte of a word */
+static inline string_word_t string_word_repeat(unsigned char c)
+{
+	return STRING_WORD_ONES * c;
+}
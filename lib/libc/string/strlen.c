@@ -26,16 +26,24 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_word.h"
 
 size_t
 strlen(char const *s)
 {
-	size_t i;
+	const char *p = s;
+	const string_word_t *w;
 
-	i= 0;
-	while (s[i]) {
-		i+= 1;
+	for (; !STRING_WORD_ALIGNED(p); p++) {
+		if (!*p)
+			return p - s;
 	}
 
-	return i;
+	for (w = (const string_word_t *)p; !string_word_haszero(*w); w++)
+		;
+
+	for (p = (const char *)w; *p; p++)
+		;
+
+	return p - s;
 }
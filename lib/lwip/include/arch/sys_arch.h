@@ -4,23 +4,28 @@
 #include <kernel/thread.h>
 #include <kernel/semaphore.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 
 #define MBOX_MAGIC 'mbox'
 
 typedef semaphore_t sys_sem_t; 
 typedef mutex_t sys_mutex_t;
 
+/* ring of messages with a single consumer, which is all lwip ever fetches
+ * an mbox from. the consumer takes no lock, posters only hold post_lock
+ * long enough to fill in their slot.
+ */
 typedef struct {
 	uint32_t magic;
 
-	semaphore_t empty;
-	semaphore_t full;
-	mutex_t lock;
+	semaphore_t empty;	/* free slots */
+	semaphore_t full;	/* posted messages */
+	spin_lock_t post_lock;
 
-	int head;
-	int tail;
+	uint head;		/* next slot to post to, under post_lock */
+	uint tail;		/* next slot to fetch, consumer only */
 
-	int size;
+	uint size;
 
 	void **queue;
 } sys_mbox_t;
@@ -53,8 +53,24 @@
 #define DEFAULT_TCP_RECVMBOX_SIZE 16
 #define DEFAULT_ACCEPTMBOX_SIZE 16
 
+#define LWIP_SO_RCVTIMEO 1
+
 #define LWIP_STATS_DISPLAY 0
 
 #endif
+
+// pin the tcpip thread to a cpu, -1 leaves it free to migrate
+#ifndef LWIP_LK_TCPIP_CPU
+#define LWIP_LK_TCPIP_CPU -1
+#endif
+
+// take the core lock and run received frames through the stack right in the
+// driver's rx thread instead of queueing them for the tcpip thread. raw api
+// callbacks then run straight out of the driver's poll loop.
+#if LWIP_LK_DIRECT_INPUT
+#define LWIP_TCPIP_CORE_LOCKING 1
+#define LWIP_TCPIP_CORE_LOCKING_INPUT 1
+#endif
+
 #endif
 
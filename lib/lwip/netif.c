@@ -4,6 +4,7 @@
 #include <netif/etharp.h>
 #include <lwip/netif.h>
 #include <lwip/dhcp.h>
+#include <lwip/tcpip.h>
 #include <debug.h>
 #include <trace.h>
 #include <assert.h>
@@ -123,7 +124,9 @@ status_t class_netif_add(struct device *dev)
 	IP4_ADDR(&ipaddr, 0, 0, 0, 0);
 	IP4_ADDR(&netmask, 255, 255, 255, 255);
 
-	netif_add(&nif->netif, &ipaddr, &netmask, &gw, nif, local_netif_init, ethernet_input);
+	/* tcpip_input either queues the frame for the tcpip thread or, with
+	 * LWIP_LK_DIRECT_INPUT, runs it through the core in the caller's thread */
+	netif_add(&nif->netif, &ipaddr, &netmask, &gw, nif, local_netif_init, tcpip_input);
 	netif_set_default(&nif->netif);
 	netif_set_status_callback(&nif->netif, local_netif_status);
 	dhcp_start(&nif->netif);
@@ -56,6 +56,18 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/core/ipv4/ip_frag.c \
 
 endif
+
+# drivers push received frames through the stack from their own rx thread,
+# see LWIP_LK_DIRECT_INPUT in lwipopts.h
+LWIP_DIRECT_INPUT ?= 0
+ifeq ($(LWIP_DIRECT_INPUT),1)
+GLOBAL_DEFINES += LWIP_LK_DIRECT_INPUT=1
+endif
+
+# cpu to pin the tcpip thread to
+ifneq ($(LWIP_TCPIP_CPU),)
+GLOBAL_DEFINES += LWIP_LK_TCPIP_CPU=$(LWIP_TCPIP_CPU)
+endif
 	
 include make/module.mk
 
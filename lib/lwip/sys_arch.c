@@ -1,11 +1,13 @@
 #include <arch/sys_arch.h>
 #include <lwip/err.h>
 #include <lwip/sys.h>
+#include <lwip/tcpip.h>
 #include <platform.h>
 #include <assert.h>
 #include <trace.h>
 #include <err.h>
 #include <stdbool.h>
+#include <string.h>
 #include <lk/init.h>
 
 #define LOCAL_TRACE 1
@@ -19,6 +21,12 @@ sys_thread_t sys_thread_new(const char *name, lwip_thread_fn func, void *arg, in
     thread_t *t = thread_create(name, (void*) func, arg, prio, stacksize);
     DEBUG_ASSERT(t);
 
+#if LWIP_LK_TCPIP_CPU >= 0
+    /* keep the core on the cpu the nic interrupts and polls on */
+    if (!strcmp(name, TCPIP_THREAD_NAME))
+        t->pinned_cpu = LWIP_LK_TCPIP_CPU;
+#endif
+
     thread_detach(t);
     thread_resume(t);
 
@@ -66,7 +74,7 @@ err_t sys_mbox_new(sys_mbox_t * mbox, int size)
 {
     sem_init(&mbox->empty, size);
     sem_init(&mbox->full, 0);
-    mutex_init(&mbox->lock);
+    spin_lock_init(&mbox->post_lock);
 
     mbox->magic = MBOX_MAGIC;
     mbox->head = 0;
@@ -86,18 +94,40 @@ void sys_mbox_free(sys_mbox_t *mbox)
     mbox->queue = NULL;
 }
 
-void sys_mbox_post(sys_mbox_t * mbox, void *msg)
+/* the caller holds a slot from the empty semaphore. the slot is filled in before
+ * the next poster can claim one after it, so the consumer never sees a hole.
+ */
+static void mbox_put(sys_mbox_t *mbox, void *msg)
 {
-    sem_wait(&mbox->empty);
-    mutex_acquire(&mbox->lock);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&mbox->post_lock, state);
 
     mbox->queue[mbox->head] = msg;
     mbox->head = (mbox->head + 1) % mbox->size;
 
-    mutex_release(&mbox->lock);
+    spin_unlock_irqrestore(&mbox->post_lock, state);
     sem_post(&mbox->full, true);
 }
 
+/* the caller holds a message from the full semaphore, which also orders the
+ * read after the poster's store.
+ */
+static void *mbox_get(sys_mbox_t *mbox)
+{
+    void *msg = mbox->queue[mbox->tail];
+    mbox->tail = (mbox->tail + 1) % mbox->size;
+
+    sem_post(&mbox->empty, true);
+
+    return msg;
+}
+
+void sys_mbox_post(sys_mbox_t * mbox, void *msg)
+{
+    sem_wait(&mbox->empty);
+    mbox_put(mbox, msg);
+}
+
 u32_t sys_arch_mbox_tryfetch(sys_mbox_t * mbox, void **msg)
 {
     //LTRACE_ENTRY;
@@ -110,13 +140,7 @@ u32_t sys_arch_mbox_tryfetch(sys_mbox_t * mbox, void **msg)
         return SYS_MBOX_EMPTY;
     }
 
-    mutex_acquire(&mbox->lock);
-
-    *msg = mbox->queue[mbox->tail];
-    mbox->tail = (mbox->tail + 1) % mbox->size;
-
-    mutex_release(&mbox->lock);
-    sem_post(&mbox->empty, true);
+    *msg = mbox_get(mbox);
 
     //LTRACE_EXIT;
     return 0;
@@ -135,13 +159,7 @@ u32_t sys_arch_mbox_fetch(sys_mbox_t *mbox, void **msg, u32_t timeout)
         return SYS_ARCH_TIMEOUT; //timeout ? SYS_ARCH_TIMEOUT : 0;
     }
 
-    mutex_acquire(&mbox->lock);
-
-    *msg = mbox->queue[mbox->tail];
-    mbox->tail = (mbox->tail + 1) % mbox->size;
-
-    mutex_release(&mbox->lock);
-    sem_post(&mbox->empty, true);
+    *msg = mbox_get(mbox);
 
     //LTRACE_EXIT;
     return current_time() - start;
@@ -155,13 +173,7 @@ err_t sys_mbox_trypost(sys_mbox_t * mbox, void *msg)
     if (res == ERR_NOT_READY)
         return ERR_TIMEOUT;
 
-    mutex_acquire(&mbox->lock);
-
-    mbox->queue[mbox->head] = msg;
-    mbox->head = (mbox->head + 1) % mbox->size;
-
-    mutex_release(&mbox->lock);
-    sem_post(&mbox->full, true);
+    mbox_put(mbox, msg);
 
     return ERR_OK;
 }
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2012 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if WITH_LIB_CONSOLE
+
+#include <debug.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <kernel/thread.h>
+#include <platform.h>
+#include <lib/mincrypt/sha.h>
+#include <lib/mincrypt/sha256.h>
+
+#include <lib/console.h>
+
+static int cmd_sha_bench(int argc, const cmd_args *argv);
+
+STATIC_COMMAND_START
+#if LK_DEBUGLEVEL > 1
+	STATIC_COMMAND("bench_sha", "benchmark sha1 and sha256", &cmd_sha_bench)
+#endif
+STATIC_COMMAND_END(mincrypt);
+
+static int cmd_sha_bench(int argc, const cmd_args *argv)
+{
+#define BUFSIZE 0x1000
+#define ITER 1024
+	void *buf;
+	bool freebuf;
+
+	if (argc > 1) {
+		buf = (void *)argv[1].u;
+		freebuf = false;
+	} else {
+		buf = malloc(BUFSIZE);
+		freebuf = true;
+	}
+
+	if (!buf)
+		return -1;
+
+	lk_bigtime_t t;
+
+	printf("buffer at %p, size %u\n", buf, BUFSIZE);
+
+	SHA_CTX sha1;
+	SHA_init(&sha1);
+	t = current_time_hires();
+	for (int i = 0; i < ITER; i++) {
+		SHA_update(&sha1, buf, BUFSIZE);
+	}
+	SHA_final(&sha1);
+	t = current_time_hires() - t;
+
+	printf("took %llu usecs to sha1 %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
+	thread_sleep(500);
+
+	SHA256_CTX sha256;
+	SHA256_init(&sha256);
+	t = current_time_hires();
+	for (int i = 0; i < ITER; i++) {
+		SHA256_update(&sha256, buf, BUFSIZE);
+	}
+	SHA256_final(&sha256);
+	t = current_time_hires() - t;
+
+	printf("took %llu usecs to sha256 %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
+
+	if (freebuf)
+		free(buf);
+	return 0;
+}
+
+#endif // WITH_LIB_CONSOLE
+
+// vim: set noexpandtab:
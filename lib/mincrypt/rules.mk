@@ -5,7 +5,24 @@ MODULE := $(LOCAL_DIR)
 GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 
 MODULE_SRCS += \
+	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/sha.c \
 	$(LOCAL_DIR)/sha256.c
 
+# hardware sha1/sha256 where the cpu has it, checked at boot
+ifeq ($(ARCH)-$(KERNEL_SIMD),arm64-1)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/sha_arm64.c \
+	$(LOCAL_DIR)/sha1_armv8.S \
+	$(LOCAL_DIR)/sha256_armv8.S
+MODULE_DEFINES += MINCRYPT_HW=1
+endif
+ifeq ($(ARCH)-$(KERNEL_SIMD),x86-64-1)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/sha_x86_64.c \
+	$(LOCAL_DIR)/sha1_shani.S \
+	$(LOCAL_DIR)/sha256_shani.S
+MODULE_DEFINES += MINCRYPT_HW=1
+endif
+
 include make/module.mk
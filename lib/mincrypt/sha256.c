@@ -33,6 +33,8 @@
 #include <string.h>
 #include <stdint.h>
 
+#include "sha_hw.h"
+
 #define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
 #define shr(value, bits) ((value) >> (bits))
 
@@ -54,10 +56,9 @@ static const uint32_t K[64] = {
     0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
 
-static void SHA256_Transform(SHA256_CTX* ctx) {
+static void SHA256_Transform(uint32_t* state, const uint8_t* p) {
     uint32_t W[64];
     uint32_t A, B, C, D, E, F, G, H;
-    uint8_t* p = ctx->buf;
     int t;
 
     for(t = 0; t < 16; ++t) {
@@ -74,14 +75,14 @@ static void SHA256_Transform(SHA256_CTX* ctx) {
         W[t] = W[t-16] + s0 + W[t-7] + s1;
     }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-    F = ctx->state[5];
-    G = ctx->state[6];
-    H = ctx->state[7];
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+    F = state[5];
+    G = state[6];
+    H = state[7];
 
     for(t = 0; t < 64; t++) {
         uint32_t s0 = ror(A, 2) ^ ror(A, 13) ^ ror(A, 22);
@@ -101,14 +102,27 @@ static void SHA256_Transform(SHA256_CTX* ctx) {
         A = t1 + t2;
     }
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
-    ctx->state[5] += F;
-    ctx->state[6] += G;
-    ctx->state[7] += H;
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+    state[5] += F;
+    state[6] += G;
+    state[7] += H;
+}
+
+static void SHA256_blocks(uint32_t* state, const uint8_t* data, size_t blocks) {
+#if MINCRYPT_HW
+    if (sha256_hw_available()) {
+        sha256_hw_blocks(state, data, blocks);
+        return;
+    }
+#endif
+    while (blocks--) {
+        SHA256_Transform(state, data);
+        data += 64;
+    }
 }
 
 static const HASH_VTAB SHA256_VTAB = {
@@ -139,13 +153,28 @@ void SHA256_update(SHA256_CTX* ctx, const void* data, int len) {
 
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
-        if (i == 64) {
-            SHA256_Transform(ctx);
-            i = 0;
-        }
+    // top up a partial block first
+    if (i) {
+        int n = 64 - i;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + i, p, n);
+        i += n;
+        p += n;
+        len -= n;
+        if (i < 64)
+            return;
+        SHA256_blocks(ctx->state, ctx->buf, 1);
+    }
+
+    // whole blocks straight from the caller's buffer
+    if (len >= 64) {
+        SHA256_blocks(ctx->state, p, len / 64);
+        p += len & ~63;
+        len &= 63;
     }
+
+    memcpy(ctx->buf, p, len);
 }
 
 
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/arm64.h>
+#include <arch/simd.h>
+#include <lk/init.h>
+#include <stdlib.h>
+#include "sha_hw.h"
+
+/* see sha1_armv8.S and sha256_armv8.S */
+void sha1_armv8(uint32_t state[5], const uint8_t *data, size_t blocks);
+void sha256_armv8(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+/* keep each simd section, and the interrupts off time with it, to 4KB */
+#define ARMV8_CHUNK_BLOCKS 64
+
+static bool sha1_armv8_present;
+static bool sha256_armv8_present;
+
+static void sha_armv8_init(uint level)
+{
+    /* ID_AA64ISAR0_EL1.SHA1 is bits [11:8], SHA2 bits [15:12] */
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    sha1_armv8_present = simd_available() && ((isar0 >> 8) & 0xf) != 0;
+    sha256_armv8_present = simd_available() && ((isar0 >> 12) & 0xf) != 0;
+}
+
+LK_INIT_HOOK(sha_armv8, &sha_armv8_init, LK_INIT_LEVEL_EARLIEST);
+
+bool sha1_hw_available(void)
+{
+    return sha1_armv8_present;
+}
+
+void sha1_hw_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    while (blocks) {
+        size_t n = MIN(blocks, ARMV8_CHUNK_BLOCKS);
+
+        simd_begin();
+        sha1_armv8(state, data, n);
+        simd_end();
+
+        data += n * 64;
+        blocks -= n;
+    }
+}
+
+bool sha256_hw_available(void)
+{
+    return sha256_armv8_present;
+}
+
+void sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    while (blocks) {
+        size_t n = MIN(blocks, ARMV8_CHUNK_BLOCKS);
+
+        simd_begin();
+        sha256_armv8(state, data, n);
+        simd_end();
+
+        data += n * 64;
+        blocks -= n;
+    }
+}
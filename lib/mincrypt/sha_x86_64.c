@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/x86.h>
+#include <arch/simd.h>
+#include <lk/init.h>
+#include <stdlib.h>
+#include "sha_hw.h"
+
+/* see sha1_shani.S and sha256_shani.S */
+void sha1_shani(uint32_t state[5], const uint8_t *data, size_t blocks);
+void sha256_shani(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+/* interrupts are off inside simd_begin(), so do big buffers 4KB at a time */
+#define SHANI_CHUNK_BLOCKS 64
+
+static bool sha_ni_present;
+
+static void sha_ni_init(uint level)
+{
+    sha_ni_present = simd_available() && check_sha_avail();
+}
+
+LK_INIT_HOOK(sha_ni, &sha_ni_init, LK_INIT_LEVEL_EARLIEST);
+
+bool sha1_hw_available(void)
+{
+    return sha_ni_present;
+}
+
+void sha1_hw_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    while (blocks) {
+        size_t n = MIN(blocks, SHANI_CHUNK_BLOCKS);
+
+        simd_begin();
+        sha1_shani(state, data, n);
+        simd_end();
+
+        data += n * 64;
+        blocks -= n;
+    }
+}
+
+bool sha256_hw_available(void)
+{
+    return sha_ni_present;
+}
+
+void sha256_hw_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    while (blocks) {
+        size_t n = MIN(blocks, SHANI_CHUNK_BLOCKS);
+
+        simd_begin();
+        sha256_shani(state, data, n);
+        simd_end();
+
+        data += n * 64;
+        blocks -= n;
+    }
+}
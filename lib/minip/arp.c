@@ -23,12 +23,16 @@
 
 #include "minip-internal.h"
 
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
 #include <list.h>
 #include <string.h>
 #include <malloc.h>
 #include <stdio.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <platform.h>
 #include <trace.h>
 
 typedef union {
@@ -37,34 +41,157 @@ typedef union {
 } ipv4_t;
 
 #define LOCAL_TRACE 0
-static struct list_node arp_list;
+
+#define ARP_HASH_SIZE       32  /* buckets, must be a power of 2 */
+#define ARP_MAX_ENTRIES     64
+#define ARP_MAX_PENDING     8   /* packets held per address while it resolves */
+#define ARP_RETRY_INTERVAL  100 /* ms between requests for an unresolved address */
+#define ARP_MAX_RETRIES     3
+#define ARP_ENTRY_TIMEOUT   (5 * 60 * 1000) /* forget hosts we haven't heard from */
+#define ARP_AGE_INTERVAL    (10 * 1000)
+
 typedef struct {
-    struct list_node node;
+    struct list_node node;      /* in its hash bucket */
     uint32_t addr;
     uint8_t mac[6];
+    bool resolved;
+    uint retries;
+    lk_time_t updated;          /* last heard from, or last asked about if not resolved */
+    struct list_node pending;   /* pktbufs waiting for the address to resolve */
+    uint pending_count;
 } arp_entry_t;
 
+/* everything below is protected by arp_mutex */
 static mutex_t arp_mutex = MUTEX_INITIAL_VALUE(arp_mutex);
+static struct list_node arp_hash[ARP_HASH_SIZE];
+static uint arp_entry_count;
+
+/* one timer drives retries and aging for the whole table */
+static net_timer_t arp_timer;
+static bool arp_timer_armed;
+static lk_time_t arp_timer_due;
+
+static void arp_timer_cb(void *arg);
+
+static inline struct list_node *arp_bucket(uint32_t addr)
+{
+    /* addresses differ mostly in the low byte, which is the top byte in network order */
+    uint32_t a = ntohl(addr);
+    return &arp_hash[(a ^ (a >> 8)) & (ARP_HASH_SIZE - 1)];
+}
 
 void arp_cache_init(void)
 {
-    list_initialize(&arp_list);
+    for (uint i = 0; i < ARP_HASH_SIZE; i++) {
+        list_initialize(&arp_hash[i]);
+    }
+}
+
+static arp_entry_t *arp_find_locked(uint32_t addr)
+{
+    arp_entry_t *arp;
+
+    list_for_every_entry(arp_bucket(addr), arp, arp_entry_t, node) {
+        if (arp->addr == addr) {
+            return arp;
+        }
+    }
+
+    return NULL;
+}
+
+/* takes the entry out of the table, handing its pending packets to the caller */
+static void arp_remove_locked(arp_entry_t *arp, struct list_node *dropped)
+{
+    pktbuf_t *p;
+
+    while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)) != NULL) {
+        list_add_tail(dropped, &p->list);
+    }
+
+    list_delete(&arp->node);
+    arp_entry_count--;
+    free(arp);
+}
+
+/* make room by throwing out the entry that has gone longest without an update */
+static void arp_evict_locked(struct list_node *dropped)
+{
+    arp_entry_t *oldest = NULL;
+    lk_time_t now = current_time();
+
+    for (uint i = 0; i < ARP_HASH_SIZE; i++) {
+        arp_entry_t *arp;
+        list_for_every_entry(&arp_hash[i], arp, arp_entry_t, node) {
+            if (!oldest || now - arp->updated > now - oldest->updated) {
+                oldest = arp;
+            }
+        }
+    }
+
+    if (oldest) {
+        arp_remove_locked(oldest, dropped);
+    }
+}
+
+static arp_entry_t *arp_insert_locked(uint32_t addr, struct list_node *dropped)
+{
+    if (arp_entry_count >= ARP_MAX_ENTRIES) {
+        arp_evict_locked(dropped);
+    }
+
+    arp_entry_t *arp = calloc(1, sizeof(arp_entry_t));
+    if (!arp) {
+        return NULL;
+    }
+
+    arp->addr = addr;
+    list_initialize(&arp->pending);
+    list_add_head(arp_bucket(addr), &arp->node);
+    arp_entry_count++;
+
+    return arp;
 }
 
-static inline void mru_update(struct list_node *entry)
+/* only ever pulls the shared timer in, so a burst of new hosts can't keep pushing it back */
+static void arp_timer_arm_locked(lk_time_t delay)
 {
-    if (arp_list.next == entry)
+    lk_time_t due = current_time() + delay;
+
+    if (arp_timer_armed && TIME_LTE(arp_timer_due, due)) {
         return;
+    }
+
+    arp_timer_armed = true;
+    arp_timer_due = due;
+    net_timer_set(&arp_timer, arp_timer_cb, NULL, delay);
+}
+
+static void arp_free_list(struct list_node *list)
+{
+    pktbuf_t *p;
+
+    while ((p = list_remove_head_type(list, pktbuf_t, list)) != NULL) {
+        pktbuf_free_chain(p, true);
+    }
+}
+
+/* hosts in the cache are all on one of our networks, which says where p goes */
+static void arp_transmit(pktbuf_t *p, uint32_t host, const uint8_t mac[6])
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->data;
+    minip_netif_t *netif = minip_route(host);
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+    minip_build_mac_hdr(netif, eth, mac, ETH_TYPE_IPV4);
+    minip_netif_output(netif, p);
 }
 
 void arp_cache_update(uint32_t addr, const uint8_t mac[6])
 {
+    struct list_node ready = LIST_INITIAL_VALUE(ready);
+    struct list_node dropped = LIST_INITIAL_VALUE(dropped);
     arp_entry_t *arp;
     ipv4_t ip;
-    bool found = false;
 
     ip.u = addr;
 
@@ -73,72 +200,84 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6])
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
-            break;
-        }
-    }
-
-    if (!found) {
+    arp = arp_find_locked(addr);
+    if (!arp) {
         LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x to cache\n",
             ip.b[0], ip.b[1], ip.b[2], ip.b[3],
             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
+        arp = arp_insert_locked(addr, &dropped);
         if (arp == NULL) {
-            goto err;
+            goto out;
         }
+    }
+
+    memcpy(arp->mac, mac, sizeof(arp->mac));
+    arp->resolved = true;
+    arp->retries = 0;
+    arp->updated = current_time();
 
-        arp->addr = addr;
-        memcpy(arp->mac, mac, sizeof(arp->mac));
-        list_add_head(&arp_list, &arp->node);
+    /* whatever was waiting on this address can go now */
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)) != NULL) {
+        list_add_tail(&ready, &p->list);
     }
+    arp->pending_count = 0;
+
+    arp_timer_arm_locked(ARP_AGE_INTERVAL);
 
-err:
+out:
     mutex_release(&arp_mutex);
-    return;
+
+    /* send outside the lock, the tx path may block on the driver */
+    while ((p = list_remove_head_type(&ready, pktbuf_t, list)) != NULL) {
+        arp_transmit(p, addr, mac);
+    }
+    arp_free_list(&dropped);
 }
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr)
+/* Copies the MAC address for the provided ip addr into mac if it's known */
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6])
 {
-    arp_entry_t *arp = NULL;
-    uint8_t *ret = NULL;
+    arp_entry_t *arp;
+    bool found = false;
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            ret = arp->mac;
-            break;
-        }
+    arp = arp_find_locked(addr);
+    if (arp && arp->resolved) {
+        memcpy(mac, arp->mac, sizeof(arp->mac));
+        found = true;
     }
     mutex_release(&arp_mutex);
 
-    return ret;
+    return found;
 }
 
 void arp_cache_dump(void)
 {
     int i = 0;
-    arp_entry_t *arp;
+    lk_time_t now = current_time();
 
-    if (!list_is_empty(&arp_list)) {
-            list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
+    mutex_acquire(&arp_mutex);
+    for (uint b = 0; b < ARP_HASH_SIZE; b++) {
+        arp_entry_t *arp;
+        list_for_every_entry(&arp_hash[b], arp, arp_entry_t, node) {
             ipv4_t ip;
             ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+            if (arp->resolved) {
+                printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x, age %u ms\n",
+                    i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
+                    arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5],
+                    (uint)(now - arp->updated));
+            } else {
+                printf("%2d: %u.%u.%u.%u -> (incomplete), retries %u, %u pending\n",
+                    i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3], arp->retries, arp->pending_count);
             }
-    } else {
+        }
+    }
+    mutex_release(&arp_mutex);
+
+    if (i == 0) {
         printf("The arp table is empty\n");
     }
 }
@@ -148,6 +287,7 @@ int arp_send_request(uint32_t addr)
     pktbuf_t *p;
     struct eth_hdr *eth;
     struct arp_pkt *arp;
+    minip_netif_t *netif = minip_route(addr);
 
     if ((p = pktbuf_alloc()) == NULL) {
         return -1;
@@ -155,52 +295,129 @@ int arp_send_request(uint32_t addr)
 
     eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
     arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
+    minip_build_mac_hdr(netif, eth, bcast_mac, ETH_TYPE_ARP);
 
     arp->htype = htons(0x0001);
     arp->ptype = htons(0x0800);
     arp->hlen = 6;
     arp->plen = 4;
     arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_get_ipaddr();
+    arp->spa = netif->ip;
     arp->tpa = addr;
-    minip_get_macaddr(arp->sha);
+    mac_addr_copy(arp->sha, netif->mac);
     mac_addr_copy(arp->tha, bcast_mac);
 
-    minip_tx_handler(p);
+    minip_netif_output(netif, p);
     return 0;
 }
 
-static void handle_arp_timeout_cb(void *arg) {
-    *(bool *)arg = true;
+/* Retries requests for addresses still resolving, gives up on the ones that
+ * never answered and ages out hosts that have gone quiet. */
+static void arp_timer_cb(void *arg)
+{
+    struct list_node dropped = LIST_INITIAL_VALUE(dropped);
+    uint32_t retry[ARP_MAX_ENTRIES];
+    uint retry_count = 0;
+    bool incomplete = false;
+    lk_time_t now = current_time();
+
+    mutex_acquire(&arp_mutex);
+    arp_timer_armed = false;
+
+    for (uint b = 0; b < ARP_HASH_SIZE; b++) {
+        arp_entry_t *arp, *temp;
+        list_for_every_entry_safe(&arp_hash[b], arp, temp, arp_entry_t, node) {
+            if (arp->resolved) {
+                if (TIME_GTE(now, arp->updated + ARP_ENTRY_TIMEOUT)) {
+                    arp_remove_locked(arp, &dropped);
+                }
+                continue;
+            }
+
+            if (TIME_LT(now, arp->updated + ARP_RETRY_INTERVAL)) {
+                incomplete = true;
+                continue;
+            }
+
+            if (arp->retries >= ARP_MAX_RETRIES) {
+                LTRACEF("giving up on %u.%u.%u.%u\n", IPV4_SPLIT(arp->addr));
+                arp_remove_locked(arp, &dropped);
+                continue;
+            }
+
+            arp->retries++;
+            arp->updated = now;
+            retry[retry_count++] = arp->addr;
+            incomplete = true;
+        }
+    }
+
+    if (incomplete) {
+        arp_timer_arm_locked(ARP_RETRY_INTERVAL);
+    } else if (arp_entry_count > 0) {
+        arp_timer_arm_locked(ARP_AGE_INTERVAL);
+    }
+    mutex_release(&arp_mutex);
+
+    for (uint i = 0; i < retry_count; i++) {
+        arp_send_request(retry[i]);
+    }
+    arp_free_list(&dropped);
 }
 
-const uint8_t *arp_get_dest_mac(uint32_t host)
+/* Sends p, which starts with room for an ethernet header, to host on the
+ * local network. If host hasn't been resolved yet p is held until it is and
+ * the caller carries on; it's dropped if host never answers. */
+status_t arp_send_ipv4(pktbuf_t *p, uint32_t host)
 {
-    const uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
+    struct list_node dropped = LIST_INITIAL_VALUE(dropped);
+    status_t err = NO_ERROR;
+    bool request = false;
+    uint8_t mac[6];
+
+    mutex_acquire(&arp_mutex);
+    arp_entry_t *arp = arp_find_locked(host);
+    if (arp && arp->resolved) {
+        memcpy(mac, arp->mac, sizeof(mac));
+        mutex_release(&arp_mutex);
 
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
+        arp_transmit(p, host, mac);
+        return NO_ERROR;
     }
 
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        arp_send_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
+    if (!arp) {
+        arp = arp_insert_locked(host, &dropped);
+        if (!arp) {
+            err = -ENOMEM;
+            goto out;
         }
+        arp->updated = current_time();
+        request = true;
+        arp_timer_arm_locked(ARP_RETRY_INTERVAL);
     }
 
-    return dst_mac;
+    if (arp->pending_count >= ARP_MAX_PENDING) {
+        /* like a full transmit queue, the oldest packet makes way */
+        pktbuf_t *old = list_remove_head_type(&arp->pending, pktbuf_t, list);
+        list_add_tail(&dropped, &old->list);
+        arp->pending_count--;
+    }
+
+    list_add_tail(&arp->pending, &p->list);
+    arp->pending_count++;
+
+out:
+    mutex_release(&arp_mutex);
+
+    if (err < 0) {
+        pktbuf_free_chain(p, true);
+    }
+    if (request) {
+        arp_send_request(host);
+    }
+    arp_free_list(&dropped);
+
+    return err;
 }
 
 // vim: set ts=4 sw=4 expandtab:
-
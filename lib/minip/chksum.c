@@ -23,21 +23,169 @@
 
 #include "minip-internal.h"
 
-/* XXX alternate implementation, merge */
-uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
+#include <arch/simd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * A ones complement sum comes out the same whether it's added up 16 or 32
+ * bits at a time, as long as the carries are folded back in. So native 32
+ * bit words go into a 64 bit accumulator, which can't overflow on anything
+ * shorter than 16GB, and get folded down to 16 bits once at the end.
+ */
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+#if WITH_KERNEL_SIMD
+/* below this the simd_begin() overhead isn't worth it */
+#define SIMD_MIN 512
+/* interrupts are off inside simd_begin(), so do big buffers a piece at a time */
+#define SIMD_CHUNK 4096
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+/* 64 bytes a loop into four vector accumulators, counting the carries out
+ * of each lane on the side. 2^32 is 1 mod 0xffff, so a carry is worth one.
+ * len is a multiple of 64. Runs between simd_begin() and simd_end().
+ */
+static inline uint64_t sum_simd(uint64_t sum, uint8_t *dst, const uint8_t *src, size_t len, bool copy)
+{
+    u32x4 a0 = {0}, a1 = {0}, a2 = {0}, a3 = {0};
+    u32x4 carry = {0};
+    u32x4 v0, v1, v2, v3;
+
+    for (; len > 0; len -= 64) {
+        memcpy(&v0, src, 16);
+        memcpy(&v1, src + 16, 16);
+        memcpy(&v2, src + 32, 16);
+        memcpy(&v3, src + 48, 16);
+        if (copy) {
+            memcpy(dst, &v0, 16);
+            memcpy(dst + 16, &v1, 16);
+            memcpy(dst + 32, &v2, 16);
+            memcpy(dst + 48, &v3, 16);
+            dst += 64;
+        }
+        src += 64;
+
+        a0 += v0;
+        carry -= (u32x4)(a0 < v0);
+        a1 += v1;
+        carry -= (u32x4)(a1 < v1);
+        a2 += v2;
+        carry -= (u32x4)(a2 < v2);
+        a3 += v3;
+        carry -= (u32x4)(a3 < v3);
+    }
+
+    for (int i = 0; i < 4; i++)
+        sum += (uint64_t)a0[i] + a1[i] + a2[i] + a3[i] + carry[i];
+    return sum;
+}
+
+__NO_INLINE static uint64_t sum_simd_nocopy(uint64_t sum, const uint8_t *src, size_t len)
 {
-    const uint16_t *buf = _buf;
+    return sum_simd(sum, NULL, src, len, false);
+}
 
-    while (len >= 2) {
-        sum += *buf++;
-        if(sum & 0x80000000)
-            sum = (sum & 0xffff) + (sum >> 16);
+__NO_INLINE static uint64_t sum_simd_copy(uint64_t sum, uint8_t *dst, const uint8_t *src, size_t len)
+{
+    return sum_simd(sum, dst, src, len, true);
+}
+#endif
+
+static inline uint16_t sum_buf(uint32_t initial, uint8_t *dst, const uint8_t *src, size_t len, bool copy)
+{
+    uint64_t sum = initial;
+
+#if WITH_KERNEL_SIMD
+    if (len >= SIMD_MIN && simd_available()) {
+        while (len >= 64) {
+            size_t chunk = MIN(len, SIMD_CHUNK) & ~(size_t)63;
+
+            simd_begin();
+            if (copy)
+                sum = sum_simd_copy(sum, dst, src, chunk);
+            else
+                sum = sum_simd_nocopy(sum, src, chunk);
+            simd_end();
+
+            if (copy)
+                dst += chunk;
+            src += chunk;
+            len -= chunk;
+        }
+    }
+#endif
+
+    /* eight words a loop, with independent adds */
+    while (len >= 32) {
+        uint32_t w0 = load32(src), w1 = load32(src + 4);
+        uint32_t w2 = load32(src + 8), w3 = load32(src + 12);
+        uint32_t w4 = load32(src + 16), w5 = load32(src + 20);
+        uint32_t w6 = load32(src + 24), w7 = load32(src + 28);
+
+        if (copy) {
+            store32(dst, w0);
+            store32(dst + 4, w1);
+            store32(dst + 8, w2);
+            store32(dst + 12, w3);
+            store32(dst + 16, w4);
+            store32(dst + 20, w5);
+            store32(dst + 24, w6);
+            store32(dst + 28, w7);
+            dst += 32;
+        }
+        sum += ((uint64_t)w0 + w1) + ((uint64_t)w2 + w3) +
+               ((uint64_t)w4 + w5) + ((uint64_t)w6 + w7);
+        src += 32;
+        len -= 32;
+    }
+
+    while (len >= 4) {
+        uint32_t w = load32(src);
+
+        if (copy) {
+            store32(dst, w);
+            dst += 4;
+        }
+        sum += w;
+        src += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        uint16_t h;
+
+        memcpy(&h, src, sizeof(h));
+        if (copy) {
+            memcpy(dst, &h, sizeof(h));
+            dst += 2;
+        }
+        sum += h;
+        src += 2;
         len -= 2;
     }
 
     if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
-        sum += temp;
+        /* the odd byte is the first half of a zero padded word */
+        uint8_t pad[2] = { *src, 0 };
+        uint16_t h;
+
+        memcpy(&h, pad, sizeof(h));
+        if (copy)
+            *dst = *src;
+        sum += h;
     }
 
     while (sum >> 16)
@@ -46,6 +194,16 @@ uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
     return sum;
 }
 
+uint16_t ones_sum16(uint32_t sum, const void *buf, int len)
+{
+    return sum_buf(sum, NULL, buf, len, false);
+}
+
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, int len)
+{
+    return sum_buf(sum, dst, src, len, true);
+}
+
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
 {
     uint32_t total = 0;
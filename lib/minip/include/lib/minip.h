@@ -50,7 +50,22 @@ void minip_init_dhcp(tx_func_t tx_func, void *tx_arg);
 /* packet rx hook to hand to ethernet driver */
 void minip_rx_driver_callback(pktbuf_t *p);
 
-/* global configuration state */
+/* network interfaces. minip_init() sets up the first one, which the calls
+ * without a netif act on. Boards with more than one mac add the others with
+ * minip_netif_add() afterwards and hand each one's received packets to
+ * minip_netif_rx(). A packet leaves through the interface whose subnet holds
+ * its destination, else the first one with a gateway, else the first one.
+ * Each interface has its own transmit queue, so they are driven independently. */
+typedef struct minip_netif minip_netif_t;
+typedef int (*netif_tx_func_t)(void *arg, pktbuf_t *p);
+
+/* returns NULL once MINIP_MAX_NETIFS are in use */
+minip_netif_t *minip_netif_add(const char *name, const uint8_t *mac, netif_tx_func_t tx_func, void *tx_arg);
+void minip_netif_set_addr(minip_netif_t *netif, uint32_t ip, uint32_t netmask, uint32_t gateway);
+void minip_netif_set_offload(minip_netif_t *netif, uint32_t offload);
+void minip_netif_rx(minip_netif_t *netif, pktbuf_t *p);
+
+/* global configuration state, of the first interface */
 void minip_get_macaddr(uint8_t *addr);
 void minip_set_macaddr(const uint8_t *addr);
 
@@ -62,6 +77,15 @@ const char *minip_get_hostname(void);
 
 uint32_t minip_parse_ipaddr(const char *addr, size_t len);
 
+/* transmit work the ethernet driver can do for us, see the PKTBUF_FLAG_CKSUM_PARTIAL
+ * and PKTBUF_FLAG_GSO_TCPV4 pktbuf flags */
+#define MINIP_OFFLOAD_TX_CSUM   (1<<0)
+#define MINIP_OFFLOAD_TSO4      (1<<1) /* implies MINIP_OFFLOAD_TX_CSUM */
+#define MINIP_OFFLOAD_SG        (1<<2) /* takes multi part pktbufs to tx */
+#define MINIP_OFFLOAD_RX_KEEP   (1<<3) /* rx pktbufs the stack took a ref on are replaced, not reused */
+
+void minip_set_offload(uint32_t offload);
+
 /* udp */
 typedef struct udp_socket udp_socket_t;
 
@@ -70,6 +94,21 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
 status_t udp_send(void *buf, size_t len, udp_socket_t *handle);
 status_t udp_close(udp_socket_t *handle);
 
+/* batched variants, several datagrams per call. udp_send_batch hands them to the
+ * driver together and returns how many were sent. udp_recv_batch waits up to timeout
+ * for the socket to have something, then fills in as many msgs as it can and returns
+ * how many. each buf is len bytes long, len comes back as the size received. only
+ * datagrams for ports nobody udp_listen()s on are queued for udp_recv_batch. */
+typedef struct udp_msg {
+    void *buf;
+    size_t len;
+    uint32_t addr;  /* recv: where it came from */
+    uint16_t port;
+} udp_msg_t;
+
+ssize_t udp_send_batch(const udp_msg_t *msgs, uint count, udp_socket_t *handle);
+ssize_t udp_recv_batch(udp_msg_t *msgs, uint count, udp_socket_t *handle, lk_time_t timeout);
+
 /* tcp */
 typedef struct tcp_socket tcp_socket_t;
 
@@ -79,6 +118,30 @@ status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/* set the receive and send buffer sizes of a socket, 0 leaves one as it is. on a
+ * listening socket they're used for the connections it accepts. the receive size
+ * is the window we advertise, so it can only be set on a listening socket, and it's
+ * rounded up to a power of 2. */
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size);
+
+/* zero copy variants. tcp_write_pktbuf takes over every part of the chain p and
+ * queues it as is. tcp_read_pktbuf hands back a pktbuf of received data for the
+ * caller to pktbuf_free, copying only if the driver can't lend its buffers. */
+ssize_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p);
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p);
+
+/* bytes that can be read right now without blocking */
+size_t tcp_bytes_available(tcp_socket_t *socket);
+
+/* watch a socket with a poller, see kernel/poll.h. POLL_IN reports data to read,
+ * the peer closing, or on a listening socket a connection to accept. POLL_OUT
+ * reports room to write. It's edge triggered, so drain the socket until
+ * tcp_bytes_available() is 0 before polling again. Closing the socket drops it
+ * from the poller with POLL_HUP. */
+struct poller;
+status_t tcp_poller_add(tcp_socket_t *socket, struct poller *poller, uint events, void *cookie);
+status_t tcp_poller_remove(tcp_socket_t *socket, struct poller *poller);
+
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
 {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
@@ -26,6 +26,8 @@
 
 #include <sys/types.h>
 #include <list.h>
+#include <arch/ops.h>
+#include <kernel/atomic.h>
 
 /* PAGE_SIZE minus 16 bytes of metadata in pktbuf_buf */
 #ifndef PKTBUF_POOL_SIZE
@@ -41,6 +43,14 @@
 /* The remaining space in the buffer */
 #define PKTBUF_MAX_DATA (PKTBUF_SIZE - PKTBUF_MAX_HDR)
 
+/* Large buffers for segmentation offload, handed out by pktbuf_alloc_large */
+#ifndef PKTBUF_LARGE_POOL_SIZE
+#define PKTBUF_LARGE_POOL_SIZE 8
+#endif
+
+#define PKTBUF_LARGE_SIZE		16384
+#define PKTBUF_LARGE_MAX_DATA	(PKTBUF_LARGE_SIZE - PKTBUF_MAX_HDR)
+
 typedef void (*pktbuf_free_callback)(void *buf, void *arg);
 typedef struct pktbuf {
 	u8 *data;
@@ -48,7 +58,14 @@ typedef struct pktbuf {
 	u32 dlen;
 	paddr_t phys_base;
 	struct list_node list;
+	/* the rest of a multi part packet, only the last part has PKTBUF_FLAG_EOF */
+	struct pktbuf *next;
+	volatile int ref;
 	u32 flags;
+	/* tx offload, csum_start is an offset from buffer so it survives _prepend */
+	u16 csum_start;
+	u16 csum_offset;
+	u16 gso_size;
 	pktbuf_free_callback cb;
 	void *cb_args;
 	u8 *buffer;
@@ -66,6 +83,14 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
 #define PKTBUF_FLAG_EOF			   (1<<3)
 #define PKTBUF_FLAG_CACHED		   (1<<4)
+/* tx: the l4 checksum at csum_start + csum_offset only holds the pseudo header
+ * sum, the nic folds in the rest starting at csum_start */
+#define PKTBUF_FLAG_CKSUM_PARTIAL  (1<<5)
+/* tx: tcp segment larger than the mtu, the nic cuts it into gso_size pieces */
+#define PKTBUF_FLAG_GSO_TCPV4	   (1<<6)
+/* tx: another packet follows right behind this one, the driver can hold off on
+ * telling the nic until the last of them */
+#define PKTBUF_FLAG_TX_MORE		   (1<<7)
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p) {
@@ -86,6 +111,10 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p) {
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
+// allocate a packet buffer with PKTBUF_LARGE_MAX_DATA bytes of room,
+// returns NULL rather than waiting if none are free
+pktbuf_t *pktbuf_alloc_large(void);
+
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
 		uint32_t flags, pktbuf_free_callback cb, void *cb_args);
@@ -93,9 +122,42 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
 // returns number of threads woken up
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
+// take another reference, pktbuf_free only returns it to the pool once
+// every reference has been dropped
+static inline pktbuf_t *pktbuf_ref(pktbuf_t *p) {
+	atomic_fetch_add_explicit(&p->ref, 1, ATOMIC_RELAXED);
+	return p;
+}
+
+// free every part of a multi part packet
+void pktbuf_free_chain(pktbuf_t *p, bool reschedule);
+
+// total length of a multi part packet
+static inline size_t pktbuf_chain_len(const pktbuf_t *p) {
+	size_t len = 0;
+	for (; p; p = p->next)
+		len += p->dlen;
+	return len;
+}
+
+// make p the next part of tail's packet
+static inline void pktbuf_chain(pktbuf_t *tail, pktbuf_t *p) {
+	tail->next = p;
+	tail->flags &= ~PKTBUF_FLAG_EOF;
+}
+
+// a new pktbuf covering len bytes of p's data starting at offset, without
+// copying. it holds a reference on p until it is freed.
+pktbuf_t *pktbuf_slice(pktbuf_t *p, u32 offset, u32 len);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
+// same, returning the 16 bit ones complement sum of the copied bytes,
+// taken in the same pass. the sum treats data as starting on an even
+// offset, so callers append it at one.
+uint16_t pktbuf_append_data_chksum(pktbuf_t *p, const void *data, size_t sz);
+
 // extend buffer by sz bytes, returning a pointer to the
 // start of the newly appended region
 void *pktbuf_append(pktbuf_t *p, size_t sz);
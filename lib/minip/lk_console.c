@@ -98,10 +98,16 @@ minip_usage:
                 break;
 
             case 's': {
-                uint32_t ipaddr = minip_get_ipaddr();
-
                 printf("hostname: %s\n", minip_get_hostname());
-                printf("ip: %u.%u.%u.%u\n", IPV4_SPLIT(ipaddr));
+                for (uint i = 0; i < minip_netif_count(); i++) {
+                    minip_netif_t *n = minip_netif_get(i);
+
+                    printf("%s: ip %u.%u.%u.%u netmask %u.%u.%u.%u gateway %u.%u.%u.%u\n", n->name,
+                        IPV4_SPLIT(n->ip), IPV4_SPLIT(n->netmask), IPV4_SPLIT(n->gateway));
+                    printf("\tmac %02x:%02x:%02x:%02x:%02x:%02x, rx %lu, tx %lu, tx dropped %lu\n",
+                        n->mac[0], n->mac[1], n->mac[2], n->mac[3], n->mac[4], n->mac[5],
+                        n->rx_packets, n->tx_packets, n->tx_dropped);
+                }
             }
             break;
             case 't': {
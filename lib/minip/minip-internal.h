@@ -30,12 +30,20 @@
 #include <list.h>
 #include <stdint.h>
 #include <string.h>
+#include <kernel/spinlock.h>
 
 /* Lib configuration */
 #define MINIP_USE_UDP_CHECKSUM    0
 #define MINIP_MTU_SIZE            1536
 #define MINIP_USE_ARP             1
 
+#ifndef MINIP_MAX_NETIFS
+#define MINIP_MAX_NETIFS          4
+#endif
+#ifndef MINIP_NETIF_TXQ_LEN
+#define MINIP_NETIF_TXQ_LEN       128
+#endif
+
 #pragma pack(push, 1)
 struct arp_pkt {
     uint16_t htype;
@@ -100,32 +108,83 @@ enum {
     ARP_OPER_REPLY   = 0x0002,
 };
 
-extern tx_func_t minip_tx_handler;
+struct minip_netif {
+    char name[8];
+    uint8_t mac[6];
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t broadcast;
+    uint32_t gateway;
+    uint32_t offload;
+
+    netif_tx_func_t tx;
+    void *tx_arg;
+
+    /* packets on their way to the driver. whoever finds the queue idle sends
+     * until it's empty, anyone else queues behind them and carries on */
+    spin_lock_t tx_lock;
+    struct list_node tx_queue;
+    uint tx_queue_len;
+    bool tx_running;
+
+    ulong rx_packets;
+    ulong tx_packets;
+    ulong tx_dropped;
+};
+
+/* MINIP_OFFLOAD_* bits every interface supports */
+extern uint32_t minip_offload;
+
+/* the interface packets for dest_addr leave through, see minip.h */
+minip_netif_t *minip_route(uint32_t dest_addr);
+/* the interface that has addr, NULL if none */
+minip_netif_t *minip_netif_by_addr(uint32_t addr);
+/* hands p, ethernet header and all, to netif's driver. never blocks on other
+ * senders, p is queued if one of them is already at the driver. */
+void minip_netif_output(minip_netif_t *netif, pktbuf_t *p);
+uint minip_netif_count(void);
+minip_netif_t *minip_netif_get(uint index);
 typedef struct udp_hdr udp_hdr_t;
 static const uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
 void arp_cache_init(void);
 void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6]);
 void arp_cache_dump(void);
 int arp_send_request(uint32_t addr);
-const uint8_t *arp_get_dest_mac(uint32_t host);
+/* transmits p, whose ethernet header is filled in here, once host resolves. never blocks. */
+status_t arp_send_ipv4(pktbuf_t *p, uint32_t host);
 
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
 uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp);
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
+/* copies len bytes from src to dst and returns ones_sum16() of them */
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, int len);
+
+/* adds a partial sum of bytes that sit at offset in the summed data */
+static inline uint16_t ones_add16(uint16_t sum, uint16_t part, size_t offset) {
+    /* a sum taken from an odd offset has its bytes the other way around */
+    if (offset & 1)
+        part = (part >> 8) | (part << 8);
+
+    uint32_t total = (uint32_t)sum + part;
+    return (total & 0xffff) + (total >> 16);
+}
 
 /* Helper methods for building headers */
-void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
+void minip_build_mac_hdr(minip_netif_t *netif, struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
 void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len);
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
+/* same, from src_addr and out the interface that has it */
+status_t minip_ipv4_send_from(pktbuf_t *p, uint32_t src_addr, uint32_t dest_addr, uint8_t proto);
+/* sends a packet with its ip header already built, routing and resolving dest_addr */
+status_t minip_ipv4_output(pktbuf_t *p, uint32_t dest_addr);
+void minip_ipv4_output_batch(pktbuf_t **pkts, uint count, uint32_t dest_addr);
 
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
 void udp_input(pktbuf_t *p, uint32_t src_ip);
 
-const uint8_t *get_dest_mac(uint32_t host);
-
 // timers
 typedef void (*net_timer_callback_t)(void *);
 
@@ -35,25 +35,38 @@
 #include <trace.h>
 #include <malloc.h>
 #include <list.h>
+#include <kernel/mutex.h>
 #include <kernel/thread.h>
 
-static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
-
 // TODO
 // 1. Tear endian code out into something that flips words before/after tx/rx calls
 
 #define LOCAL_TRACE 0
-static uint32_t minip_ip      = IPV4_NONE;
-static uint32_t minip_netmask = IPV4_NONE;
-static uint32_t minip_broadcast = IPV4_BCAST;
-static uint32_t minip_gateway = IPV4_NONE;
+
+/* interfaces are only ever added, so readers walk the first minip_netifs_used
+ * of them without a lock */
+static minip_netif_t minip_netifs[MINIP_MAX_NETIFS] = {
+    [0] = {
+        .name = "net0",
+        .mac = {0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC},
+        .ip = IPV4_NONE,
+        .netmask = IPV4_NONE,
+        .broadcast = IPV4_BCAST,
+        .gateway = IPV4_NONE,
+        .tx_lock = SPIN_LOCK_INITIAL_VALUE,
+        .tx_queue = LIST_INITIAL_VALUE(minip_netifs[0].tx_queue),
+    },
+};
+static volatile uint minip_netifs_used = 1;
+static mutex_t minip_netif_lock = MUTEX_INITIAL_VALUE(minip_netif_lock);
+
+#define minip_netif0 (&minip_netifs[0])
 
 static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-static uint8_t minip_mac[6] = {0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC};
 
 static char minip_hostname[32] = "";
 
-static void dump_mac_address(const uint8_t *mac);
+static void __COLD dump_mac_address(const uint8_t *mac);
 static void dump_ipv4_addr(uint32_t addr);
 
 void minip_set_hostname(const char *name) {
@@ -64,42 +77,217 @@ const char *minip_get_hostname(void) {
    return minip_hostname;
 }
 
-static void compute_broadcast_address(void)
+static void compute_broadcast_address(minip_netif_t *netif)
 {
-    minip_broadcast = (minip_ip & minip_netmask) | (IPV4_BCAST & ~minip_netmask);
+    netif->broadcast = (netif->ip & netif->netmask) | (IPV4_BCAST & ~netif->netmask);
 }
 
 void minip_get_macaddr(uint8_t *addr) {
-    mac_addr_copy(addr, minip_mac);
+    mac_addr_copy(addr, minip_netif0->mac);
 }
 
 void minip_set_macaddr(const uint8_t *addr) {
-    mac_addr_copy(minip_mac, addr);
+    mac_addr_copy(minip_netif0->mac, addr);
 }
 
 uint32_t minip_get_ipaddr(void) {
-    return minip_ip;
+    return minip_netif0->ip;
 }
 
 void minip_set_ipaddr(const uint32_t addr) {
-    minip_ip = addr;
-    compute_broadcast_address();
+    minip_netif0->ip = addr;
+    compute_broadcast_address(minip_netif0);
+}
+
+/* the first interface's driver, from minip_init() */
+static tx_func_t minip_tx_handler;
+
+static int minip_tx_handler_shim(void *arg, pktbuf_t *p)
+{
+    return minip_tx_handler(p);
+}
+
+/* MINIP_OFFLOAD_* bits every interface supports, so the protocols can build
+ * packets without knowing where they'll go out */
+uint32_t minip_offload;
+
+static void minip_update_offload_locked(void)
+{
+    uint32_t offload = ~0u;
+
+    for (uint i = 0; i < minip_netifs_used; i++) {
+        offload &= minip_netifs[i].offload;
+    }
+    minip_offload = offload;
+}
+
+void minip_netif_set_offload(minip_netif_t *netif, uint32_t offload)
+{
+    if (offload & MINIP_OFFLOAD_TSO4)
+        offload |= MINIP_OFFLOAD_TX_CSUM;
+
+    mutex_acquire(&minip_netif_lock);
+    netif->offload = offload;
+    minip_update_offload_locked();
+    mutex_release(&minip_netif_lock);
+}
+
+void minip_set_offload(uint32_t offload)
+{
+    minip_netif_set_offload(minip_netif0, offload);
+}
+
+void minip_netif_set_addr(minip_netif_t *netif, uint32_t ip, uint32_t netmask, uint32_t gateway)
+{
+    netif->ip = ip;
+    netif->netmask = netmask;
+    netif->gateway = gateway;
+    compute_broadcast_address(netif);
+}
+
+minip_netif_t *minip_netif_add(const char *name, const uint8_t *mac, netif_tx_func_t tx_func, void *tx_arg)
+{
+    minip_netif_t *netif = NULL;
+
+    mutex_acquire(&minip_netif_lock);
+    if (minip_netifs_used < MINIP_MAX_NETIFS) {
+        netif = &minip_netifs[minip_netifs_used];
+        strlcpy(netif->name, name, sizeof(netif->name));
+        mac_addr_copy(netif->mac, mac);
+        netif->ip = IPV4_NONE;
+        netif->netmask = IPV4_NONE;
+        netif->broadcast = IPV4_BCAST;
+        netif->gateway = IPV4_NONE;
+        netif->offload = 0;
+        netif->tx = tx_func;
+        netif->tx_arg = tx_arg;
+        spin_lock_init(&netif->tx_lock);
+        list_initialize(&netif->tx_queue);
+
+        smp_wmb();
+        minip_netifs_used++;
+        minip_update_offload_locked();
+    }
+    mutex_release(&minip_netif_lock);
+
+    return netif;
 }
 
-/* This function is called by minip to send packets */
-tx_func_t minip_tx_handler;
-void *minip_tx_arg;
+uint minip_netif_count(void)
+{
+    return minip_netifs_used;
+}
+
+minip_netif_t *minip_netif_get(uint index)
+{
+    return (index < minip_netifs_used) ? &minip_netifs[index] : NULL;
+}
+
+minip_netif_t *minip_route(uint32_t dest_addr)
+{
+    minip_netif_t *gateway = NULL;
+
+    /* dhcp and the like, before anything is configured */
+    if (dest_addr == IPV4_BCAST) {
+        return minip_netif0;
+    }
+
+    for (uint i = 0; i < minip_netifs_used; i++) {
+        minip_netif_t *netif = &minip_netifs[i];
+
+        if (netif->ip == IPV4_NONE) {
+            continue;
+        }
+        if ((dest_addr & netif->netmask) == (netif->ip & netif->netmask)) {
+            return netif;
+        }
+        if (!gateway && netif->gateway != IPV4_NONE) {
+            gateway = netif;
+        }
+    }
+
+    return gateway ? gateway : minip_netif0;
+}
+
+minip_netif_t *minip_netif_by_addr(uint32_t addr)
+{
+    for (uint i = 0; i < minip_netifs_used; i++) {
+        if (addr != IPV4_NONE && minip_netifs[i].ip == addr) {
+            return &minip_netifs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void minip_netif_enqueue(minip_netif_t *netif, pktbuf_t *p)
+{
+    spin_lock_saved_state_t state;
+    bool queued = false;
+
+    spin_lock_irqsave(&netif->tx_lock, state);
+    if (netif->tx && netif->tx_queue_len < MINIP_NETIF_TXQ_LEN) {
+        list_add_tail(&netif->tx_queue, &p->list);
+        netif->tx_queue_len++;
+        queued = true;
+    } else {
+        netif->tx_dropped++;
+    }
+    spin_unlock_irqrestore(&netif->tx_lock, state);
+
+    if (!queued) {
+        pktbuf_free_chain(p, true);
+    }
+}
+
+/* sends what's queued on netif, unless someone else already is, in which case
+ * they pick up our packets too. No sender waits on the driver for anybody
+ * else's packets, and each interface drains without regard to the others. */
+static void minip_netif_kick(minip_netif_t *netif)
+{
+    spin_lock_saved_state_t state;
+    pktbuf_t *p;
+
+    spin_lock_irqsave(&netif->tx_lock, state);
+    if (netif->tx_running) {
+        spin_unlock_irqrestore(&netif->tx_lock, state);
+        return;
+    }
+    netif->tx_running = true;
+
+    while ((p = list_remove_head_type(&netif->tx_queue, pktbuf_t, list)) != NULL) {
+        netif->tx_queue_len--;
+        netif->tx_packets++;
+
+        /* whatever is still queued goes to the driver right after this one */
+        if (netif->tx_queue_len > 0) {
+            p->flags |= PKTBUF_FLAG_TX_MORE;
+        } else {
+            p->flags &= ~PKTBUF_FLAG_TX_MORE;
+        }
+        spin_unlock_irqrestore(&netif->tx_lock, state);
+
+        netif->tx(netif->tx_arg, p);
+
+        spin_lock_irqsave(&netif->tx_lock, state);
+    }
+    netif->tx_running = false;
+    spin_unlock_irqrestore(&netif->tx_lock, state);
+}
+
+void minip_netif_output(minip_netif_t *netif, pktbuf_t *p)
+{
+    minip_netif_enqueue(netif, p);
+    minip_netif_kick(netif);
+}
 
 void minip_init(tx_func_t tx_handler, void *tx_arg,
     uint32_t ip, uint32_t mask, uint32_t gateway)
 {
     minip_tx_handler = tx_handler;
-    minip_tx_arg = tx_arg;
-
-    minip_ip = ip;
-    minip_netmask = mask;
-    minip_gateway = gateway;
-    compute_broadcast_address();
+    minip_netif0->tx_arg = tx_arg;
+    minip_netif_set_addr(minip_netif0, ip, mask, gateway);
+    minip_netif0->tx = minip_tx_handler_shim;
 
     arp_cache_init();
     net_timer_init();
@@ -110,14 +298,14 @@ uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
     return (pkt->len - ((pkt->ver_ihl >> 4) * 5));
 }
 
-void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type)
+void minip_build_mac_hdr(minip_netif_t *netif, struct eth_hdr *pkt, const uint8_t *dst, uint16_t type)
 {
     mac_addr_copy(pkt->dst_mac, dst);
-    mac_addr_copy(pkt->src_mac, minip_mac);
+    mac_addr_copy(pkt->src_mac, netif->mac);
     pkt->type = htons(type);
 }
 
-void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len)
+static void build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t src, uint32_t dst, uint8_t proto, uint16_t len)
 {
     ipv4->ver_ihl       = 0x45;
     ipv4->dscp_ecn      = 0;
@@ -127,102 +315,101 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
     ipv4->ttl           = 64;
     ipv4->proto         = proto;
     ipv4->dst_addr      = dst;
-    ipv4->src_addr      = minip_ip;
+    ipv4->src_addr      = src;
 
     /* This may be unnecessary if the controller supports checksum offloading */
     ipv4->chksum = 0;
     ipv4->chksum = rfc1701_chksum((uint8_t *) ipv4, sizeof(struct ipv4_hdr));
 }
 
-int send_arp_request(uint32_t addr)
+void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len)
 {
-    pktbuf_t *p;
-    struct eth_hdr *eth;
-    struct arp_pkt *arp;
+    build_ipv4_hdr(ipv4, minip_route(dst)->ip, dst, proto, len);
+}
 
-    if ((p = pktbuf_alloc()) == NULL) {
-        return -1;
+/* hosts off the interface's network are reached through its gateway, if it has one */
+static uint32_t minip_next_hop(minip_netif_t *netif, uint32_t dest_addr)
+{
+    if (netif->gateway != IPV4_NONE &&
+        (dest_addr & netif->netmask) != (netif->ip & netif->netmask)) {
+        return netif->gateway;
     }
 
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
-    arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
-
-    arp->htype = htons(0x0001);
-    arp->ptype = htons(0x0800);
-    arp->hlen = 6;
-    arp->plen = 4;
-    arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_ip;
-    arp->tpa = addr;
-    mac_addr_copy(arp->sha, minip_mac);
-    mac_addr_copy(arp->tha, bcast_mac);
-
-    minip_tx_handler(p);
-    return 0;
+    return dest_addr;
 }
 
-static void handle_arp_timeout_cb(void *arg) {
-    *(bool *)arg = true;
+static status_t minip_netif_ipv4_output(minip_netif_t *netif, pktbuf_t *p, uint32_t dest_addr)
+{
+    if (dest_addr == IPV4_BCAST || dest_addr == netif->broadcast) {
+        minip_build_mac_hdr(netif, (struct eth_hdr *)p->data, bcast_mac, ETH_TYPE_IPV4);
+        minip_netif_output(netif, p);
+        return NO_ERROR;
+    }
+
+    return arp_send_ipv4(p, minip_next_hop(netif, dest_addr));
 }
 
-const uint8_t *get_dest_mac(uint32_t host)
+status_t minip_ipv4_output(pktbuf_t *p, uint32_t dest_addr)
 {
-    uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
+    return minip_netif_ipv4_output(minip_route(dest_addr), p, dest_addr);
+}
 
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
-    }
+/* once the destination is resolved the packets are queued together, so they go to
+ * the driver back to back marked PKTBUF_FLAG_TX_MORE and it can tell the nic about
+ * them at once */
+void minip_ipv4_output_batch(pktbuf_t **pkts, uint count, uint32_t dest_addr)
+{
+    minip_netif_t *netif = minip_route(dest_addr);
+    const uint8_t *dst_mac = bcast_mac;
+    uint8_t mac[6];
 
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        send_arp_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
+    if (dest_addr != IPV4_BCAST && dest_addr != netif->broadcast) {
+        uint32_t next_hop = minip_next_hop(netif, dest_addr);
+
+        if (!arp_cache_lookup(next_hop, mac)) {
+            /* arp holds on to them until it hears back */
+            for (uint i = 0; i < count; i++) {
+                arp_send_ipv4(pkts[i], next_hop);
             }
+            return;
         }
+        dst_mac = mac;
     }
 
-    return dst_mac;
+    for (uint i = 0; i < count; i++) {
+        minip_build_mac_hdr(netif, (struct eth_hdr *)pkts[i]->data, dst_mac, ETH_TYPE_IPV4);
+        minip_netif_enqueue(netif, pkts[i]);
+    }
+    minip_netif_kick(netif);
 }
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
-    status_t ret = 0;
-    size_t data_len = p->dlen;
-    const uint8_t *dst_mac;
+    size_t data_len = pktbuf_chain_len(p);
 
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
-    struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
+    pktbuf_prepend(p, sizeof(struct eth_hdr));
 
+    minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
 
-    if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
-        dst_mac = bcast_mac;
-        goto ready;
-    }
+    return minip_ipv4_output(p, dest_addr);
+}
+
+status_t minip_ipv4_send_from(pktbuf_t *p, uint32_t src_addr, uint32_t dest_addr, uint8_t proto)
+{
+    minip_netif_t *netif = minip_netif_by_addr(src_addr);
+    size_t data_len = pktbuf_chain_len(p);
 
-    dst_mac = get_dest_mac(dest_addr);
-    if (!dst_mac) {
-        pktbuf_free(p, true);
-        ret = -EHOSTUNREACH;
-        goto err;
+    if (!netif) {
+        netif = minip_route(dest_addr);
     }
 
-ready:
-    minip_build_mac_hdr(eth, dst_mac, ETH_TYPE_IPV4);
-    minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
+    struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
+    pktbuf_prepend(p, sizeof(struct eth_hdr));
 
-    minip_tx_handler(p);
+    build_ipv4_hdr(ip, src_addr, dest_addr, proto, data_len);
 
-err:
-    return ret;
+    return minip_netif_ipv4_output(netif, p, dest_addr);
 }
 
 /* Swap the dst/src ip addresses and send an ICMP ECHO REPLY with the same payload.
@@ -233,7 +420,6 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 {
     pktbuf_t *p;
     size_t len;
-    struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     struct icmp_pkt *icmp;
 
@@ -243,12 +429,11 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 
     icmp = pktbuf_prepend(p, sizeof(struct icmp_pkt));
     ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
+    pktbuf_prepend(p, sizeof(struct eth_hdr));
     pktbuf_append_data(p, req->data, reqdatalen);
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    minip_build_mac_hdr(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
@@ -257,7 +442,7 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
     icmp->chksum = 0;
     icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
 
-    minip_tx_handler(p);
+    minip_ipv4_output(p, ipaddr);
 }
 
 static void dump_ipv4_addr(uint32_t addr)
@@ -267,7 +452,7 @@ static void dump_ipv4_addr(uint32_t addr)
     printf("%hhu.%hhu.%hhu.%hhu", a[0], a[1], a[2], a[3]);
 }
 
-static void dump_ipv4_packet(const struct ipv4_hdr *ip)
+static void __COLD dump_ipv4_packet(const struct ipv4_hdr *ip)
 {
     printf("IP ");
     dump_ipv4_addr(ip->src_addr);
@@ -277,12 +462,12 @@ static void dump_ipv4_packet(const struct ipv4_hdr *ip)
         (ip->ver_ihl & 0xf) * 4, ip->proto, ntohs(ip->chksum), ntohs(ip->len), ntohs(ip->id), ntohs(ip->flags_frags) & 0x1fff);
 }
 
-__NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
+__NO_INLINE __HOT static void handle_ipv4_packet(minip_netif_t *netif, pktbuf_t *p, const uint8_t *src_mac)
 {
     struct ipv4_hdr *ip;
 
     ip = (struct ipv4_hdr *)p->data;
-    if (p->dlen < sizeof(struct ipv4_hdr))
+    if (unlikely(p->dlen < sizeof(struct ipv4_hdr)))
         return;
 
     /* print packets for us */
@@ -291,7 +476,7 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
     }
 
     /* reject bad packets */
-    if (((ip->ver_ihl >> 4) & 0xf) != 4) {
+    if (unlikely(((ip->ver_ihl >> 4) & 0xf) != 4)) {
         /* not version 4 */
         LTRACEF("REJECT: not version 4\n");
         return;
@@ -299,20 +484,20 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
 
     /* do we have enough buffer to hold the full header + options? */
     size_t header_len = (ip->ver_ihl & 0xf) * 4;
-    if (p->dlen < header_len) {
+    if (unlikely(p->dlen < header_len)) {
         LTRACEF("REJECT: not enough buffer to hold header\n");
         return;
     }
 
     /* compute checksum */
-    if (rfc1701_chksum((void *)ip, header_len) != 0) {
+    if (unlikely(rfc1701_chksum((void *)ip, header_len) != 0)) {
         /* bad checksum */
         LTRACEF("REJECT: bad checksum\n");
         return;
     }
 
     /* is the pkt_buf large enough to hold the length the header says the packet is? */
-    if (htons(ip->len) > p->dlen) {
+    if (unlikely(htons(ip->len) > p->dlen)) {
         LTRACEF("REJECT: packet exceeds size of buffer (header %d, dlen %d)\n", htons(ip->len), p->dlen);
         return;
     }
@@ -323,7 +508,7 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
     }
 
     /* remove the header from the front of the packet_buf  */
-    if (pktbuf_consume(p, header_len) == NULL) {
+    if (unlikely(pktbuf_consume(p, header_len) == NULL)) {
         return;
     }
 
@@ -332,7 +517,7 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
 
     /* see if it's for us */
     if (ip->dst_addr != IPV4_BCAST) {
-        if (minip_ip != IPV4_NONE && ip->dst_addr != minip_ip && ip->dst_addr != minip_broadcast) {
+        if (netif->ip != IPV4_NONE && ip->dst_addr != netif->ip && ip->dst_addr != netif->broadcast) {
             LTRACEF("REJECT: for another host\n");
             return;
         }
@@ -361,7 +546,7 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
     }
 }
 
-__NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
+__NO_INLINE static int handle_arp_pkt(minip_netif_t *netif, pktbuf_t *p)
 {
     struct eth_hdr *eth;
     struct arp_pkt *arp;
@@ -378,7 +563,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
             struct eth_hdr *reth;
             struct arp_pkt *rarp;
 
-            if (memcmp(&arp->tpa, &minip_ip, sizeof(minip_ip)) == 0) {
+            if (memcmp(&arp->tpa, &netif->ip, sizeof(netif->ip)) == 0) {
                 if ((rp = pktbuf_alloc()) == NULL) {
                     break;
                 }
@@ -387,7 +572,7 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
                 rarp = pktbuf_append(rp, sizeof(struct arp_pkt));
 
                 // Eth header
-                minip_build_mac_hdr(reth, eth->src_mac, ETH_TYPE_ARP);
+                minip_build_mac_hdr(netif, reth, eth->src_mac, ETH_TYPE_ARP);
 
                 // ARP packet
                 rarp->oper = htons(ARP_OPER_REPLY);
@@ -395,12 +580,12 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
                 rarp->ptype = htons(0x0800);
                 rarp->hlen = 6;
                 rarp->plen = 4;
-                mac_addr_copy(rarp->sha, minip_mac);
-                rarp->spa = minip_ip;
+                mac_addr_copy(rarp->sha, netif->mac);
+                rarp->spa = netif->ip;
                 mac_addr_copy(rarp->tha, arp->sha);
                 rarp->tpa = arp->spa;
 
-                minip_tx_handler(rp);
+                minip_netif_output(netif, rp);
             }
         }
         break;
@@ -416,13 +601,13 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
     return 0;
 }
 
-static void dump_mac_address(const uint8_t *mac)
+static void __COLD dump_mac_address(const uint8_t *mac)
 {
     printf("%02x:%02x:%02x:%02x:%02x:%02x",
         mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 }
 
-static void dump_eth_packet(const struct eth_hdr *eth)
+static void __COLD dump_eth_packet(const struct eth_hdr *eth)
 {
     printf("ETH src ");
     dump_mac_address(eth->src_mac);
@@ -431,19 +616,20 @@ static void dump_eth_packet(const struct eth_hdr *eth)
     printf(" type 0x%hx\n", htons(eth->type));
 }
 
-void minip_rx_driver_callback(pktbuf_t *p)
+void __HOT minip_netif_rx(minip_netif_t *netif, pktbuf_t *p)
 {
     struct eth_hdr *eth;
 
-    if ((eth = (void*) pktbuf_consume(p, sizeof(struct eth_hdr))) == NULL) {
+    if (unlikely((eth = (void*) pktbuf_consume(p, sizeof(struct eth_hdr))) == NULL)) {
         return;
     }
+    netif->rx_packets++;
 
     if (LOCAL_TRACE) {
         dump_eth_packet(eth);
     }
 
-    if (memcmp(eth->dst_mac, minip_mac, 6) != 0 &&
+    if (memcmp(eth->dst_mac, netif->mac, 6) != 0 &&
         memcmp(eth->dst_mac, broadcast_mac, 6) != 0) {
         /* not for us */
         return;
@@ -452,16 +638,21 @@ void minip_rx_driver_callback(pktbuf_t *p)
     switch(htons(eth->type)) {
         case ETH_TYPE_IPV4:
             LTRACEF("ipv4 pkt\n");
-            handle_ipv4_packet(p, eth->src_mac);
+            handle_ipv4_packet(netif, p, eth->src_mac);
             break;
 
         case ETH_TYPE_ARP:
             LTRACEF("arp pkt\n");
-            handle_arp_pkt(p);
+            handle_arp_pkt(netif, p);
             break;
     }
 }
 
+void __HOT minip_rx_driver_callback(pktbuf_t *p)
+{
+    minip_netif_rx(minip_netif0, p);
+}
+
 uint32_t minip_parse_ipaddr(const char* ipaddr_str, size_t len)
 {
     uint8_t ip[4] = { 0, 0, 0, 0 };
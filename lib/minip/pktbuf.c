@@ -31,31 +31,39 @@
 
 #include <kernel/thread.h>
 #include <kernel/semaphore.h>
-#include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
 #include <lk/init.h>
 
+#include "minip-internal.h"
+
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #endif
 
 #define LOCAL_TRACE 0
 
-static pool_t pktbuf_pool;
-static semaphore_t pktbuf_sem;
-static spin_lock_t lock;
+/* every packet goes through the pool heads, keep them in fast memory */
+static pool_t pktbuf_pool __FAST_BSS;
+static semaphore_t pktbuf_sem __FAST_BSS;
+
+#if !WITH_KERNEL_VM && PKTBUF_FAST_POOL
+/* pktbuf objects out of tcm instead of the heap, PKTBUF_POOL_SIZE has to be cut
+ * down to fit */
+static pktbuf_pool_object_t pktbuf_fast_slab[PKTBUF_POOL_SIZE] __FAST_BSS __ALIGNED(CACHE_LINE);
+#endif
+
+static pool_t pktbuf_large_pool;
+static semaphore_t pktbuf_large_sem;
 
 
-/* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
+/* Take an object from the pool of pktbuf objects to act as a header or buffer.
+ * The pool is lock free, the semaphore just keeps count of what's left. */
 static void *get_pool_object(void) {
 	pool_t *entry;
-	spin_lock_saved_state_t state;
 
 	sem_wait(&pktbuf_sem);
-	spin_lock_irqsave(&lock, state);
 	entry = pool_alloc(&pktbuf_pool);
-	spin_unlock_irqrestore(&lock, state);
 
 	return (pktbuf_pool_object_t *) entry;
 
@@ -64,11 +72,8 @@ static void *get_pool_object(void) {
 /* Return an object to thje pktbuf object pool. */
 static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule) {
 	DEBUG_ASSERT(entry);
-	spin_lock_saved_state_t state;
 
-	spin_lock_irqsave(&lock, state);
 	pool_free(&pktbuf_pool, entry);
-	spin_unlock_irqrestore(&lock, state);
 	sem_post(&pktbuf_sem, reschedule);
 }
 
@@ -128,19 +133,87 @@ pktbuf_t *pktbuf_alloc(void) {
 	}
 
 	memset(p, 0, sizeof(pktbuf_t));
+	p->ref = 1;
 	pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
 	return p;
 }
 
+static void free_pktbuf_large_buf_cb(void *buf, void *arg) {
+	pool_free(&pktbuf_large_pool, buf);
+	sem_post(&pktbuf_large_sem, true);
+}
+
+pktbuf_t *pktbuf_alloc_large(void) {
+	pktbuf_t *p = NULL;
+	void *buf = NULL;
+
+	/* callers fall back to mtu sized packets, don't make them wait */
+	if (sem_trywait(&pktbuf_large_sem) < 0) {
+		return NULL;
+	}
+
+	buf = pool_alloc(&pktbuf_large_pool);
+
+	p = get_pool_object();
+	if (!p) {
+		free_pktbuf_large_buf_cb(buf, NULL);
+		return NULL;
+	}
+
+	memset(p, 0, sizeof(pktbuf_t));
+	p->ref = 1;
+	pktbuf_add_buffer(p, buf, PKTBUF_LARGE_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_large_buf_cb, NULL);
+	return p;
+}
+
 pktbuf_t *pktbuf_alloc_empty(void) {
 	pktbuf_t *p = (pktbuf_t *) get_pool_object();
 
 	p->flags = PKTBUF_FLAG_EOF;
+	p->next = NULL;
+	p->ref = 1;
 	return p;
 }
 
+/* A slice's buffer belongs to the pktbuf it was cut from */
+static void free_pktbuf_slice_cb(void *buf, void *arg) {
+	pktbuf_free((pktbuf_t *)arg, false);
+}
+
+pktbuf_t *pktbuf_slice(pktbuf_t *p, u32 offset, u32 len) {
+	DEBUG_ASSERT(p);
+	DEBUG_ASSERT(offset + len <= p->dlen);
+
+	pktbuf_t *s = get_pool_object();
+	if (!s) {
+		return NULL;
+	}
+
+	memset(s, 0, sizeof(pktbuf_t));
+	s->ref = 1;
+	s->buffer = p->buffer;
+	s->blen = p->blen;
+	s->phys_base = p->phys_base;
+	s->data = p->data + offset;
+	s->dlen = len;
+	s->flags = PKTBUF_FLAG_EOF | (p->flags & PKTBUF_FLAG_CACHED);
+	s->cb = free_pktbuf_slice_cb;
+	s->cb_args = pktbuf_ref(p);
+
+	return s;
+}
+
 int pktbuf_free(pktbuf_t *p, bool reschedule) {
 	DEBUG_ASSERT(p);
+	DEBUG_ASSERT(p->ref > 0);
+
+	/* still in use by someone else */
+	if (atomic_fetch_sub_explicit(&p->ref, 1, ATOMIC_RELEASE) > 1) {
+		return 0;
+	}
+
+	/* see everything the other holders did before they let go */
+	atomic_fence_acquire();
 
 	if (p->cb) {
 		p->cb(p->buffer, p->cb_args);
@@ -150,6 +223,14 @@ int pktbuf_free(pktbuf_t *p, bool reschedule) {
 	return 1;
 }
 
+void pktbuf_free_chain(pktbuf_t *p, bool reschedule) {
+	while (p) {
+		pktbuf_t *next = p->next;
+		pktbuf_free(p, reschedule);
+		p = next;
+	}
+}
+
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
 	if (pktbuf_avail_tail(p) < sz) {
 		panic("pktbuf_append_data: overflow");
@@ -159,6 +240,17 @@ void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
 	p->dlen += sz;
 }
 
+uint16_t pktbuf_append_data_chksum(pktbuf_t *p, const void *data, size_t sz) {
+	if (pktbuf_avail_tail(p) < sz) {
+		panic("pktbuf_append_data_chksum: overflow");
+	}
+
+	uint16_t sum = ones_sum16_copy(0, p->data + p->dlen, data, sz);
+	p->dlen += sz;
+
+	return sum;
+}
+
 void *pktbuf_append(pktbuf_t *p, size_t sz) {
 	if (pktbuf_avail_tail(p) < sz) {
 		panic("pktbuf_append: overflow");
@@ -226,12 +318,36 @@ static void pktbuf_init(uint level)
 		printf("Failed to initialize pktbuf hdr slab\n");
 		return;
 	}
+#elif PKTBUF_FAST_POOL
+	slab = pktbuf_fast_slab;
 #else
 	slab = memalign(CACHE_LINE, PKTBUF_POOL_SIZE * sizeof(pktbuf_pool_object_t));
 #endif
 
 	pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
 	sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
+
+	/* large buffers are handed to the nic whole, so they come out of one contiguous run.
+	 * if there's no room for them pktbuf_alloc_large just always fails. */
+	uint large_count = PKTBUF_LARGE_POOL_SIZE;
+#if WITH_KERNEL_VM
+	if (vmm_alloc_contiguous(vmm_get_kernel_aspace(), "pktbuf_large",
+			PKTBUF_LARGE_POOL_SIZE * PKTBUF_LARGE_SIZE,
+			&slab, 0, 0, ARCH_MMU_FLAG_CACHED) < 0) {
+		printf("Failed to initialize large pktbuf slab\n");
+		large_count = 0;
+	}
+#else
+	slab = memalign(CACHE_LINE, PKTBUF_LARGE_POOL_SIZE * PKTBUF_LARGE_SIZE);
+	if (!slab) {
+		large_count = 0;
+	}
+#endif
+
+	if (large_count > 0) {
+		pool_init(&pktbuf_large_pool, PKTBUF_LARGE_SIZE, CACHE_LINE, large_count, slab);
+	}
+	sem_init(&pktbuf_large_sem, large_count);
 }
 
 LK_INIT_HOOK(pktbuf, pktbuf_init, LK_INIT_LEVEL_THREADING);
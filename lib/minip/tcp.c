@@ -32,10 +32,15 @@
 #include <sys/types.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
+#include <lib/slab.h>
 #include <kernel/mutex.h>
+#include <kernel/poll.h>
 #include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
 #include <arch/ops.h>
+#include <lk/init.h>
 #include <platform.h>
+#include <pow2.h>
 
 #define LOCAL_TRACE 0
 
@@ -60,11 +65,38 @@ typedef struct tcp_pseudo_header {
     uint16_t tcp_length;
 } __PACKED tcp_pseudo_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+/* options we understand */
+#define TCP_OPT_END             0
+#define TCP_OPT_NOP             1
+#define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERMITTED  4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TIMESTAMP       8
+
+#define TCP_MAX_OPTIONS_LEN     40
+#define TCP_TS_OPTION_LEN       12 // nop, nop, timestamp
+#define TCP_MAX_WSCALE          14
+#define TCP_SACK_BLOCKS         4  // the most a sack option can carry
+#define TCP_SACK_SCOREBOARD     8  // ranges we remember per socket
+
+/* a range of sequence space, [start, end) */
+struct tcp_sack_block {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* what was in the options of an incoming segment */
+typedef struct tcp_options {
+    uint16_t mss;   // 0 if they didn't say
+    int      wscale; // -1 if they didn't offer it
+    bool     sack_permitted;
+    bool     ts;
+    uint32_t tsval;
+    uint32_t tsecr;
+    uint     sack_count;
+    struct tcp_sack_block sack[TCP_SACK_BLOCKS];
+} tcp_options_t;
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -89,8 +121,22 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+struct tcp_hash_bucket;
+
+struct tcp_socket_stats {
+    ulong segs_in;
+    ulong segs_out;
+    ulong bytes_in;  // new data handed to the reader
+    ulong bytes_out; // new data sent, not counting resends
+    ulong retransmits; // segments resent
+    ulong fast_retransmits; // times we went into recovery on duplicate acks
+    ulong timeouts;
+    ulong dup_acks;
+};
+
 typedef struct tcp_socket {
     struct list_node node;
+    struct tcp_hash_bucket *bucket; // which hash chain node is on
 
     mutex_t lock;
     volatile int ref;
@@ -103,12 +149,22 @@ typedef struct tcp_socket {
 
     uint32_t mss;
 
+    /* negotiated in the handshake */
+    bool     wscale_ok; // both sides scale their windows
+    uint8_t  rx_wscale; // shift on the windows we advertise
+    uint8_t  tx_wscale; // shift on the windows they advertise
+    bool     sack_ok;   // they'll tell us what they have past a hole
+    bool     ts_ok;     // every segment carries a timestamp
+    uint32_t ts_recent; // their latest timestamp, echoed back to them
+
     /* rx */
     uint32_t rx_win_size;
     uint32_t rx_win_low;
     uint32_t rx_win_high;
     uint8_t  *rx_buffer_raw;
-    cbuf_t   rx_buffer;
+    cbuf_t   rx_buffer; // received data, for drivers that can't lend us their pktbufs
+    struct list_node rx_queue; // pktbufs kept from drivers that can, in sequence order
+    uint32_t rx_queued; // bytes in rx_queue
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
@@ -117,11 +173,29 @@ typedef struct tcp_socket {
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
     uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer;  // our outgoing buffer
-    uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    struct list_node tx_queue; // pktbufs of unacked and unsent data, starting at tx_win_low
+    uint32_t tx_buffer_size; // how much we'll queue before making writers wait
+    uint32_t tx_queued; // bytes in tx_queue
+    bool     tx_tail_open; // tcp_write may append to the last pktbuf in tx_queue
     event_t  tx_event;
     net_timer_t retransmit_timer;
+    lk_time_t rto; // current retransmit timeout
+    lk_time_t srtt; // smoothed round trip time from timestamps, 0 until we have one
+    lk_time_t rttvar;
+    struct tcp_sack_block sacked[TCP_SACK_SCOREBOARD]; // what they have past tx_win_low, sorted
+    uint     sacked_count;
+    uint32_t rtt_seq;   // without timestamps, we time one segment at a time until this is acked
+    lk_time_t rtt_start;
+    bool     rtt_timing;
+
+    /* congestion control */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover; // highest sequence sent when we went into recovery
+    bool     in_recovery;
+    uint     dup_acks; // in a row
+
+    struct tcp_socket_stats stats;
 
     /* listen accept */
     semaphore_t accept_sem;
@@ -131,22 +205,46 @@ typedef struct tcp_socket {
 } tcp_socket_t;
 
 #define DEFAULT_MSS (1460)
-#define DEFAULT_RX_WINDOW_SIZE (8192)
-#define DEFAULT_TX_BUFFER_SIZE (8192)
-
-#define RETRANSMIT_TIMEOUT (50)
+#define DEFAULT_RX_WINDOW_SIZE (32768)
+#define DEFAULT_TX_BUFFER_SIZE (32768)
+
+/* limits for tcp_set_buffer_sizes */
+#define TCP_MIN_BUFFER_SIZE (4096)
+#define TCP_MAX_BUFFER_SIZE (1024*1024)
+
+#define RETRANSMIT_TIMEOUT (50) // until we have a round trip time, and the least we'll wait
+#define TCP_MAX_RTO (10000)
+#define TCP_RETRANSMIT_SEGMENTS (4) // most segments resent per timeout when filling sack holes
+#define TCP_INITIAL_WINDOW_SEGMENTS (10) // rfc 6928
+#define TCP_DUP_ACK_THRESHOLD (3)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
 #define FORCE_TCP_CHECKSUM (false)
 
+/* pktbufs all sockets together may hold in their queues, so they can't starve the
+ * drivers and our own acks out of the pool */
+#define TCP_QUEUE_PKTBUFS (PKTBUF_POOL_SIZE / 8)
+
 #define SEQUENCE_GTE(a, b) ((int32_t)((a) - (b)) >= 0)
 #define SEQUENCE_LTE(a, b) ((int32_t)((a) - (b)) <= 0)
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
-static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+/* sockets are hashed on their 4-tuple, listening ones on their local port alone.
+ * each chain has its own lock so segments for different connections don't contend. */
+#define TCP_HASH_SIZE 64 // must be a power of 2
+
+struct tcp_hash_bucket {
+    spin_lock_t lock;
+    struct list_node list;
+};
+
+static struct tcp_hash_bucket tcp_conn_hash[TCP_HASH_SIZE];
+static struct tcp_hash_bucket tcp_listen_hash[TCP_HASH_SIZE];
+
+static semaphore_t tcp_tx_queue_sem;
+static semaphore_t tcp_rx_queue_sem;
 
 static bool tcp_debug = false;
 
@@ -154,13 +252,16 @@ static bool tcp_debug = false;
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-    size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+static tcp_socket_t *create_tcp_socket(void);
+static status_t tcp_socket_alloc_buffers(tcp_socket_t *s);
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, pktbuf_t *p,
+    uint16_t data_sum, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence,
+    uint16_t window_size, uint32_t gso_size);
+static status_t tcp_socket_send(tcp_socket_t *s, uint32_t offset, size_t len, tcp_flags_t flags, uint32_t sequence);
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len, const tcp_options_t *opts);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
@@ -169,6 +270,14 @@ static void tcp_wakeup_waiters(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
 
+static void tcp_socket_ctor(void *obj)
+{
+    memset(obj, 0, sizeof(tcp_socket_t));
+}
+
+static slab_cache_t tcp_socket_cache =
+    SLAB_CACHE_INITIAL_VALUE(tcp_socket_cache, "tcp_socket", sizeof(tcp_socket_t), 0, tcp_socket_ctor);
+
 static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *buf, size_t len)
 {
     uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
@@ -215,56 +324,81 @@ static void dump_socket(tcp_socket_t *s)
         printf("\trx: wsize %u wlo %u whi %u (%u)\n",
                 s->rx_win_size, s->rx_win_low, s->rx_win_high,
                 s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
+        printf("\t    queued %zu (%u in pktbufs)\n",
+                cbuf_space_used(&s->rx_buffer) + s->rx_queued, s->rx_queued);
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u queued %u\n",
                 s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                 s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-                s->tx_buffer_size, s->tx_buffer_offset);
+                s->tx_buffer_size, s->tx_queued);
+        printf("\t    mss %u wscale %u/%u%s%s rto %u srtt %u rttvar %u sacked %u\n",
+                s->mss, s->rx_wscale, s->tx_wscale, s->sack_ok ? " sack" : "", s->ts_ok ? " ts" : "",
+                s->rto, s->srtt, s->rttvar, s->sacked_count);
+        printf("\t    cwnd %u ssthresh %u%s\n",
+                s->cwnd, s->ssthresh, s->in_recovery ? " recovering" : "");
     }
+
+    const struct tcp_socket_stats *st = &s->stats;
+    printf("\tstats: segs in %lu out %lu, bytes in %lu out %lu, retransmits %lu (fast %lu, timeouts %lu), dup acks %lu\n",
+            st->segs_in, st->segs_out, st->bytes_in, st->bytes_out,
+            st->retransmits, st->fast_retransmits, st->timeouts, st->dup_acks);
+}
+
+static inline uint tcp_conn_hash_index(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t h = remote_ip ^ local_ip ^ ((uint32_t)remote_port << 16 | local_port);
+
+    /* fold the high bits down, most of the variation is in the remote port and address */
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+
+    return h & (TCP_HASH_SIZE - 1);
+}
+
+static inline uint tcp_listen_hash_index(uint16_t local_port)
+{
+    return (local_port ^ (local_port >> 8)) & (TCP_HASH_SIZE - 1);
 }
 
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
 {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    spin_lock_saved_state_t state;
+    tcp_socket_t *s;
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
+    /* connected sockets first */
+    struct tcp_hash_bucket *b = &tcp_conn_hash[tcp_conn_hash_index(remote_ip, local_ip, remote_port, local_port)];
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_CLOSED)
             continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                s->local_ip == local_ip &&
-                s->remote_port == remote_port &&
-                s->local_port == local_port) {
-                goto out;
-            }
+
+        if (s->remote_ip == remote_ip &&
+            s->local_ip == local_ip &&
+            s->remote_port == remote_port &&
+            s->local_port == local_port) {
+            /* bump the ref before returning it */
+            inc_socket_ref(s);
+            spin_unlock_irqrestore(&b->lock, state);
+            return s;
         }
     }
-
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+    spin_unlock_irqrestore(&b->lock, state);
+
+    /* sockets in listen state only care about local port */
+    b = &tcp_listen_hash[tcp_listen_hash_index(local_port)];
+    spin_lock_irqsave(&b->lock, state);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_LISTEN && s->local_port == local_port) {
+            inc_socket_ref(s);
+            spin_unlock_irqrestore(&b->lock, state);
+            return s;
         }
     }
+    spin_unlock_irqrestore(&b->lock, state);
 
-    /* fall through case returns null */
-    s = NULL;
-
-out:
-    /* bump the ref before returning it */
-    if (s)
-        inc_socket_ref(s);
-
-    mutex_release(&tcp_socket_list_lock);
-
-    return s;
+    return NULL;
 }
 
 static void add_socket_to_list(tcp_socket_t *s)
@@ -272,11 +406,20 @@ static void add_socket_to_list(tcp_socket_t *s)
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
 
-    mutex_acquire(&tcp_socket_list_lock);
+    /* the addressing has to be filled in by now, it picks the chain */
+    struct tcp_hash_bucket *b;
+    if (s->state == STATE_LISTEN)
+        b = &tcp_listen_hash[tcp_listen_hash_index(s->local_port)];
+    else
+        b = &tcp_conn_hash[tcp_conn_hash_index(s->remote_ip, s->local_ip, s->remote_port, s->local_port)];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&b->lock, state);
 
-    list_add_head(&tcp_socket_list, &s->node);
+    list_add_head(&b->list, &s->node);
+    s->bucket = b;
 
-    mutex_release(&tcp_socket_list_lock);
+    spin_unlock_irqrestore(&b->lock, state);
 }
 
 static void remove_socket_from_list(tcp_socket_t *s)
@@ -284,14 +427,34 @@ static void remove_socket_from_list(tcp_socket_t *s)
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    struct tcp_hash_bucket *b = s->bucket;
+    DEBUG_ASSERT(b);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&b->lock, state);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
+    s->bucket = NULL;
 
-    mutex_release(&tcp_socket_list_lock);
+    spin_unlock_irqrestore(&b->lock, state);
 }
 
+static void tcp_init(uint level)
+{
+    for (uint i = 0; i < TCP_HASH_SIZE; i++) {
+        spin_lock_init(&tcp_conn_hash[i].lock);
+        list_initialize(&tcp_conn_hash[i].list);
+        spin_lock_init(&tcp_listen_hash[i].lock);
+        list_initialize(&tcp_listen_hash[i].list);
+    }
+
+    sem_init(&tcp_tx_queue_sem, TCP_QUEUE_PKTBUFS);
+    sem_init(&tcp_rx_queue_sem, TCP_QUEUE_PKTBUFS);
+}
+
+LK_INIT_HOOK(minip_tcp, tcp_init, LK_INIT_LEVEL_THREADING);
+
 static void inc_socket_ref(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
@@ -313,10 +476,19 @@ static bool dec_socket_ref(tcp_socket_t *s)
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
+        pktbuf_t *p;
+        while ((p = list_remove_head_type(&s->tx_queue, pktbuf_t, list))) {
+            pktbuf_free(p, false);
+            sem_post(&tcp_tx_queue_sem, false);
+        }
+        while ((p = list_remove_head_type(&s->rx_queue, pktbuf_t, list))) {
+            pktbuf_free(p, false);
+            sem_post(&tcp_rx_queue_sem, false);
+        }
+
         free(s->rx_buffer_raw);
-        free(s->tx_buffer);
 
-        free(s);
+        slab_free(&tcp_socket_cache, s);
     }
     return (oldval == 1);
 }
@@ -340,6 +512,140 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer)
         dec_socket_ref(s);
 }
 
+static inline uint32_t tcp_opt_get16(const uint8_t *opt)
+{
+    return (opt[0] << 8) | opt[1];
+}
+
+static inline uint32_t tcp_opt_get32(const uint8_t *opt)
+{
+    return ((uint32_t)opt[0] << 24) | (opt[1] << 16) | (opt[2] << 8) | opt[3];
+}
+
+static inline void tcp_opt_put16(uint8_t *opt, uint16_t val)
+{
+    opt[0] = val >> 8;
+    opt[1] = val;
+}
+
+static inline void tcp_opt_put32(uint8_t *opt, uint32_t val)
+{
+    opt[0] = val >> 24;
+    opt[1] = val >> 16;
+    opt[2] = val >> 8;
+    opt[3] = val;
+}
+
+static void tcp_parse_options(const uint8_t *opt, size_t len, tcp_options_t *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->wscale = -1;
+
+    while (len > 0) {
+        uint8_t kind = opt[0];
+        if (kind == TCP_OPT_END)
+            break;
+        if (kind == TCP_OPT_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+
+        /* everything else has a length, stop at anything malformed */
+        if (len < 2 || opt[1] < 2 || opt[1] > len)
+            break;
+        uint8_t olen = opt[1];
+
+        switch (kind) {
+            case TCP_OPT_MSS:
+                if (olen == 4)
+                    o->mss = tcp_opt_get16(opt + 2);
+                break;
+            case TCP_OPT_WSCALE:
+                if (olen == 3)
+                    o->wscale = opt[2];
+                break;
+            case TCP_OPT_SACK_PERMITTED:
+                if (olen == 2)
+                    o->sack_permitted = true;
+                break;
+            case TCP_OPT_SACK:
+                for (uint i = 0; i < (uint)(olen - 2) / 8 && i < TCP_SACK_BLOCKS; i++) {
+                    o->sack[i].start = tcp_opt_get32(opt + 2 + i * 8);
+                    o->sack[i].end = tcp_opt_get32(opt + 6 + i * 8);
+                    o->sack_count++;
+                }
+                break;
+            case TCP_OPT_TIMESTAMP:
+                if (olen == 10) {
+                    o->ts = true;
+                    o->tsval = tcp_opt_get32(opt + 2);
+                    o->tsecr = tcp_opt_get32(opt + 6);
+                }
+                break;
+        }
+
+        opt += olen;
+        len -= olen;
+    }
+}
+
+/* options for an outgoing segment of s, opt must have room for TCP_MAX_OPTIONS_LEN.
+ * returns their length, which is always a multiple of 4. */
+static size_t tcp_build_options(tcp_socket_t *s, tcp_flags_t flags, uint8_t *opt)
+{
+    size_t len = 0;
+
+    if (flags & PKT_SYN) {
+        opt[len++] = TCP_OPT_MSS;
+        opt[len++] = 4;
+        tcp_opt_put16(opt + len, DEFAULT_MSS);
+        len += 2;
+
+        if (s->wscale_ok) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_WSCALE;
+            opt[len++] = 3;
+            opt[len++] = s->rx_wscale;
+        }
+
+        if (s->sack_ok) {
+            /* rides in the padding in front of the timestamp if there is one */
+            if (!s->ts_ok) {
+                opt[len++] = TCP_OPT_NOP;
+                opt[len++] = TCP_OPT_NOP;
+            }
+            opt[len++] = TCP_OPT_SACK_PERMITTED;
+            opt[len++] = 2;
+        }
+    }
+
+    if (s->ts_ok) {
+        if (!(flags & PKT_SYN) || !s->sack_ok) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_NOP;
+        }
+        opt[len++] = TCP_OPT_TIMESTAMP;
+        opt[len++] = 10;
+        tcp_opt_put32(opt + len, current_time());
+        tcp_opt_put32(opt + len + 4, s->ts_recent);
+        len += 8;
+    }
+
+    DEBUG_ASSERT(len <= TCP_MAX_OPTIONS_LEN && (len % 4) == 0);
+    return len;
+}
+
+/* the smallest shift that lets us advertise all of a window of size */
+static uint8_t tcp_wscale_for(uint32_t size)
+{
+    uint8_t shift = 0;
+    while (shift < TCP_MAX_WSCALE && (size >> shift) > 0xffff)
+        shift++;
+
+    return shift;
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 {
     if (unlikely(tcp_debug))
@@ -361,6 +667,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         TRACEF("REJECT: packet too large for buffer\n");
         return;
     }
+    if (header_len < sizeof(tcp_header_t)) {
+        TRACEF("REJECT: bad header length %zu\n", header_len);
+        return;
+    }
 
     /* checksum */
     if (FORCE_TCP_CHECKSUM || (p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD) == 0) {
@@ -389,6 +699,9 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
     header->win_size = ntohs(header->win_size);
     header->urg_pointer = ntohs(header->urg_pointer);
 
+    tcp_options_t opts;
+    tcp_parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &opts);
+
     /* get some data from the packet */
     uint8_t packet_flags = header->length_flags & 0x3f;
     size_t data_len = p->dlen - header_len;
@@ -409,6 +722,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     mutex_acquire(&s->lock);
 
+    s->stats.segs_in++;
+
+    /* remember their timestamp to echo, if this segment is the next one we're expecting */
+    if (s->ts_ok && opts.ts && SEQUENCE_LTE(header->seq_num, s->rx_win_low))
+        s->ts_recent = opts.tsval;
+
     /* check to see if they're resetting us */
     if (packet_flags & PKT_RST) {
         if (s->state != STATE_CLOSED && s->state != STATE_LISTEN) {
@@ -434,13 +753,38 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             if (s->accepted != NULL)
                 goto done;
 
-            /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            /* make a new accept socket, with the buffer sizes set on the listening one */
+            tcp_socket_t *accept_socket = create_tcp_socket();
             if (!accept_socket)
                 goto done;
 
+            accept_socket->rx_win_size = s->rx_win_size;
+            accept_socket->tx_buffer_size = s->tx_buffer_size;
+            if (tcp_socket_alloc_buffers(accept_socket) < 0) {
+                dec_socket_ref(accept_socket);
+                goto done;
+            }
+
+            /* take up whatever they offered */
+            if (opts.mss)
+                accept_socket->mss = MIN(opts.mss, DEFAULT_MSS);
+            if (opts.wscale >= 0) {
+                accept_socket->wscale_ok = true;
+                accept_socket->tx_wscale = MIN(opts.wscale, TCP_MAX_WSCALE);
+                accept_socket->rx_wscale = tcp_wscale_for(accept_socket->rx_win_size);
+            }
+            accept_socket->sack_ok = opts.sack_permitted;
+            if (opts.ts) {
+                accept_socket->ts_ok = true;
+                accept_socket->ts_recent = opts.tsval;
+
+                /* every segment carries one, leave room for it */
+                accept_socket->mss -= TCP_TS_OPTION_LEN;
+            }
+
             /* set it up */
-            accept_socket->local_ip = minip_get_ipaddr();
+            /* answer from the address they connected to, unless it isn't one of ours */
+            accept_socket->local_ip = minip_netif_by_addr(dst_ip) ? dst_ip : minip_route(src_ip)->ip;
             accept_socket->local_port = s->local_port;
             accept_socket->remote_ip = src_ip;
             accept_socket->remote_port = header->source_port;
@@ -458,15 +802,8 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
 
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
-
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
-                accept_socket->tx_win_low);
+            tcp_socket_send(accept_socket, 0, 0, PKT_ACK|PKT_SYN, accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
             accept_socket->tx_win_low++;
@@ -487,9 +824,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + (header->win_size << s->tx_wscale);
                 s->tx_highest_seq = s->tx_win_low;
 
+                /* now that the mss is settled */
+                s->cwnd = TCP_INITIAL_WINDOW_SEGMENTS * s->mss;
+
                 s->state = STATE_ESTABLISHED;
             } else {
                 goto send_reset;
@@ -500,12 +840,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, data_len, &opts);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -526,7 +866,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, data_len, &opts);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -598,19 +938,62 @@ send_reset:
 
     LTRACEF("SEND RST\n");
     if (!(packet_flags & PKT_RST)) {
-        tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
-            NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+        pktbuf_t *rst = pktbuf_alloc();
+        if (rst) {
+            tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
+                rst, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0, 0);
+        }
+    }
+}
+
+/* bytes received and waiting for the reader */
+static inline size_t tcp_rx_pending(tcp_socket_t *s)
+{
+    return cbuf_space_used(&s->rx_buffer) + s->rx_queued;
+}
+
+/* hand len bytes of p, starting at offset, to the reader */
+static void tcp_rx_store(tcp_socket_t *s, pktbuf_t *p, size_t offset, size_t len)
+{
+    if (len == 0)
+        return;
+
+    /* once anything is in the cbuf everything after it has to go there too, it's read
+     * after the queue. it's as big as the window, so it never runs out of room. */
+    if ((minip_offload & MINIP_OFFLOAD_RX_KEEP) == 0 || cbuf_space_used(&s->rx_buffer) > 0) {
+        cbuf_write(&s->rx_buffer, p->data + offset, len, false);
+        return;
+    }
+
+    /* small segments get copied onto the end of the last one we kept */
+    pktbuf_t *tail = list_peek_tail_type(&s->rx_queue, pktbuf_t, list);
+    if (!tail || pktbuf_avail_tail(tail) < len) {
+        if (sem_trywait(&tcp_rx_queue_sem) < 0) {
+            /* every socket together is holding on to too much, copy it instead */
+            cbuf_write(&s->rx_buffer, p->data + offset, len, false);
+            return;
+        }
+
+        /* keep the driver's buffer, it'll get itself another */
+        pktbuf_ref(p);
+        pktbuf_consume(p, offset);
+        pktbuf_consume_tail(p, p->dlen - len);
+        list_add_tail(&s->rx_queue, &p->list);
+    } else {
+        pktbuf_append_data(tail, p->data + offset, len);
     }
+    s->rx_queued += len;
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence)
 {
+    size_t len = p->dlen;
+
     if (unlikely(tcp_debug))
-        TRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
+        TRACEF("p %p, len %zu, sequence %u\n", p, len, sequence);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(data);
     DEBUG_ASSERT(len > 0);
 
     /* see if it matches our current window */
@@ -618,17 +1001,19 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     if (SEQUENCE_LTE(sequence, s->rx_win_low) && SEQUENCE_GTE(sequence_top, s->rx_win_low)) {
         /* it intersects the bottom of our window, so it's in order */
 
-        /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
+        /* skip anything we already have */
+        size_t offset = s->rx_win_low - sequence;
         size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
 
         DEBUG_ASSERT(offset < len);
 
-        LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
+        LTRACEF("taking from offset %zu, len %zu\n", offset, copy_len);
+
+        tcp_rx_store(s, p, offset, copy_len);
 
         s->rx_win_low += copy_len;
+        s->stats.bytes_in += copy_len;
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
         event_signal(&s->rx_event, true);
 
         /* keep a counter if they've been sending a full mss */
@@ -653,38 +1038,109 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, 
-    const void *options, size_t options_length, uint32_t sequence)
+/* build the payload for a segment carrying len bytes of the tx queue, offset bytes
+ * past tx_win_low. with scatter gather the data is chained on by reference behind
+ * an empty pktbuf, otherwise it's copied in, summing it on the way if sum is set.
+ * either way there's room in front for the headers. */
+static pktbuf_t *tcp_tx_build(tcp_socket_t *s, uint32_t offset, size_t len, bool large, bool sum, uint16_t *data_sum)
+{
+    bool sg = minip_offload & MINIP_OFFLOAD_SG;
+
+    pktbuf_t *p = (large && !sg) ? pktbuf_alloc_large() : pktbuf_alloc();
+    if (!p)
+        return NULL;
+
+    pktbuf_t *tail = p;
+    size_t done = 0;
+    uint16_t total = 0;
+
+    pktbuf_t *q;
+    list_for_every_entry(&s->tx_queue, q, pktbuf_t, list) {
+        if (done == len)
+            break;
+        if (offset >= q->dlen) {
+            offset -= q->dlen;
+            continue;
+        }
+
+        size_t n = MIN(q->dlen - offset, len - done);
+        if (sg) {
+            pktbuf_t *slice = pktbuf_slice(q, offset, n);
+            if (!slice) {
+                pktbuf_free_chain(p, false);
+                return NULL;
+            }
+            pktbuf_chain(tail, slice);
+            tail = slice;
+        } else if (sum) {
+            total = ones_add16(total, pktbuf_append_data_chksum(p, q->data + offset, n), done);
+        } else {
+            pktbuf_append_data(p, q->data + offset, n);
+        }
+
+        done += n;
+        offset = 0;
+    }
+    DEBUG_ASSERT(done == len);
+
+    *data_sum = total;
+    return p;
+}
+
+static status_t tcp_socket_send(tcp_socket_t *s, uint32_t offset, size_t len, tcp_flags_t flags, uint32_t sequence)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(len == 0 || data);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
+    DEBUG_ASSERT(offset + len <= s->tx_queued);
 
     // calculate the new right edge of the rx window
-    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
+    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - tcp_rx_pending(s) - 1;
 
     LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
-        s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
+        s->rx_win_low, s->rx_win_size, tcp_rx_pending(s), rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
-        win_size = rx_win_high - s->rx_win_low;
+        win = rx_win_high - s->rx_win_low;
     } else {
         // the window size has shrunk, but we can't move the
         // right edge of the window backwards
-        win_size = s->rx_win_high - s->rx_win_low;
+        win = s->rx_win_high - s->rx_win_low;
     }
 
+    // the window in a syn is never scaled
+    if (!(flags & PKT_SYN))
+        win >>= s->rx_wscale;
+    uint16_t win_size = MIN(win, 0xffff);
+
+    uint8_t options[TCP_MAX_OPTIONS_LEN];
+    size_t options_length = tcp_build_options(s, flags, options);
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    /* anything over the mss is only handed to us when the nic can segment it */
+    uint32_t gso_size = (len > s->mss) ? s->mss : 0;
+
+    pktbuf_t *p;
+    uint16_t data_sum = 0;
+    if (len > 0) {
+        bool sum = FORCE_TCP_CHECKSUM || (minip_offload & MINIP_OFFLOAD_TX_CSUM) == 0;
+        p = tcp_tx_build(s, offset, len, gso_size != 0, sum, &data_sum);
+    } else {
+        p = pktbuf_alloc();
+    }
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    s->stats.segs_out++;
+
+    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, p, data_sum, flags,
+            options_length ? options : NULL, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence,
+            win_size, gso_size);
 
     return err;
 }
@@ -697,19 +1153,21 @@ static void send_ack(tcp_socket_t *s)
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    tcp_socket_send(s, 0, 0, PKT_ACK, s->tx_win_low);
 }
 
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-    size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+/* send a segment whose payload is already in p, chained on behind it or both.
+ * data_sum is the ones sum of the payload in p itself, the chained parts are summed here. */
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, pktbuf_t *p,
+    uint16_t data_sum, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence,
+    uint16_t window_size, uint32_t gso_size)
 {
-    DEBUG_ASSERT(len == 0 || buf);
+    DEBUG_ASSERT(p);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
+    DEBUG_ASSERT(gso_size == 0 || (minip_offload & MINIP_OFFLOAD_TSO4));
 
-    pktbuf_t *p = pktbuf_alloc();
-    if (!p)
-        return ERR_NO_MEMORY;
+    size_t head_len = p->dlen;
 
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
@@ -726,21 +1184,38 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
+    bool partial = !FORCE_TCP_CHECKSUM && (minip_offload & MINIP_OFFLOAD_TX_CSUM);
 
     /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(pktbuf_chain_len(p));
+
+    if (partial) {
+        /* leave the pseudo header sum for the nic to fold the segment into */
+        header->checksum = ones_sum16(0, &pheader, sizeof(pheader));
+        p->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+        p->csum_start = (uint8_t *)header - p->buffer;
+        p->csum_offset = offsetof(tcp_header_t, checksum);
+
+        if (gso_size) {
+            p->flags |= PKTBUF_FLAG_GSO_TCPV4;
+            p->gso_size = gso_size;
+        }
+    } else {
+        /* fold in the parts chained on after the head's own data */
+        size_t offset = head_len;
+        for (const pktbuf_t *q = p->next; q; q = q->next) {
+            data_sum = ones_add16(data_sum, ones_sum16(0, q->data, q->dlen), offset);
+            offset += q->dlen;
+        }
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        /* the header is a multiple of 4 bytes, so the data sum slots right in */
+        uint16_t checksum = ones_sum16(data_sum, &pheader, sizeof(pheader));
+        header->checksum = ~ones_sum16(checksum, header, sizeof(tcp_header_t) + options_length);
     }
 
     if (LOCAL_TRACE) {
@@ -748,12 +1223,142 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
         dump_tcp_header(header);
     }
 
-    status_t err = minip_ipv4_send(p, dest_ip, IP_PROTO_TCP);
+    status_t err = minip_ipv4_send_from(p, src_ip, dest_ip, IP_PROTO_TCP);
 
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+/* fold a round trip sample into our estimate, rfc 6298 */
+static void tcp_rtt_sample(tcp_socket_t *s, lk_time_t rtt)
+{
+    rtt = MAX(rtt, 1u);
+
+    if (s->srtt == 0) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    } else {
+        lk_time_t delta = (s->srtt > rtt) ? s->srtt - rtt : rtt - s->srtt;
+        s->rttvar = (3 * s->rttvar + delta) / 4;
+        s->srtt = (7 * s->srtt + rtt) / 8;
+    }
+}
+
+static lk_time_t tcp_rto(tcp_socket_t *s)
+{
+    if (s->srtt == 0)
+        return RETRANSMIT_TIMEOUT;
+
+    lk_time_t rto = s->srtt + MAX(4 * s->rttvar, 1u);
+    return MIN(MAX(rto, (lk_time_t)RETRANSMIT_TIMEOUT), (lk_time_t)TCP_MAX_RTO);
+}
+
+/* drop the parts of the scoreboard they've now acked outright */
+static void tcp_sack_prune(tcp_socket_t *s)
+{
+    uint n = 0;
+    for (uint i = 0; i < s->sacked_count; i++) {
+        struct tcp_sack_block b = s->sacked[i];
+        if (SEQUENCE_LTE(b.end, s->tx_win_low))
+            continue;
+        if (SEQUENCE_LT(b.start, s->tx_win_low))
+            b.start = s->tx_win_low;
+        s->sacked[n++] = b;
+    }
+    s->sacked_count = n;
+}
+
+/* merge a range they say they have into the scoreboard, keeping it sorted */
+static void tcp_sack_insert(tcp_socket_t *s, uint32_t start, uint32_t end)
+{
+    struct tcp_sack_block out[TCP_SACK_SCOREBOARD + 1];
+    uint n = 0;
+    bool placed = false;
+
+    for (uint i = 0; i < s->sacked_count; i++) {
+        const struct tcp_sack_block *b = &s->sacked[i];
+        if (SEQUENCE_LT(b->end, start)) {
+            out[n++] = *b;
+        } else if (SEQUENCE_GT(b->start, end)) {
+            if (!placed) {
+                out[n++] = (struct tcp_sack_block){ start, end };
+                placed = true;
+            }
+            out[n++] = *b;
+        } else {
+            /* touches the new one, swallow it */
+            if (SEQUENCE_LT(b->start, start))
+                start = b->start;
+            if (SEQUENCE_GT(b->end, end))
+                end = b->end;
+        }
+    }
+    if (!placed)
+        out[n++] = (struct tcp_sack_block){ start, end };
+
+    /* when it's full forget the highest ones, they'll be reported again */
+    s->sacked_count = MIN(n, (uint)TCP_SACK_SCOREBOARD);
+    memcpy(s->sacked, out, s->sacked_count * sizeof(out[0]));
+}
+
+static void tcp_sack_update(tcp_socket_t *s, const tcp_options_t *opts)
+{
+    for (uint i = 0; i < opts->sack_count; i++) {
+        uint32_t start = opts->sack[i].start;
+        uint32_t end = opts->sack[i].end;
+
+        /* only take what makes sense against what we've sent */
+        if (!SEQUENCE_LT(start, end) || SEQUENCE_LTE(end, s->tx_win_low) || SEQUENCE_GT(end, s->tx_highest_seq))
+            continue;
+        if (SEQUENCE_LT(start, s->tx_win_low))
+            start = s->tx_win_low;
+
+        tcp_sack_insert(s, start, end);
+    }
+}
+
+static inline uint32_t tcp_flight_size(tcp_socket_t *s)
+{
+    return s->tx_highest_seq - s->tx_win_low;
+}
+
+/* new data was acked outside of recovery, grow the window. rfc 5681 */
+static void tcp_cc_ack(tcp_socket_t *s, uint32_t acked)
+{
+    if (s->cwnd < s->ssthresh) {
+        /* slow start */
+        s->cwnd += MIN(acked, s->mss);
+    } else {
+        /* congestion avoidance, about a segment per round trip */
+        s->cwnd += MAX(s->mss * s->mss / s->cwnd, 1u);
+    }
+}
+
+/* something was lost, halve what we'll allow in flight */
+static void tcp_cc_loss(tcp_socket_t *s)
+{
+    s->ssthresh = MAX(tcp_flight_size(s) / 2, 2 * s->mss);
+}
+
+/* resend the segment at tx_win_low, stopping short of anything they've sacked */
+static uint32_t tcp_resend_head(tcp_socket_t *s)
+{
+    uint32_t tosend = MIN(s->mss, tcp_flight_size(s));
+    if (s->sacked_count > 0)
+        tosend = MIN(tosend, s->sacked[0].start - s->tx_win_low);
+    if (tosend == 0)
+        return 0;
+
+    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
+    tcp_socket_send(s, 0, tosend, PKT_ACK|PKT_PSH, s->tx_win_low);
+    s->stats.retransmits++;
+
+    /* karn, don't time anything that went out twice */
+    s->rtt_timing = false;
+
+    return tosend;
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len, const tcp_options_t *opts)
 {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
@@ -761,14 +1366,22 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_queued);
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
     } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
         /* they're acking stuff we haven't sent */
         return;
-    } else {
+    }
+
+    if (s->sack_ok)
+        tcp_sack_update(s, opts);
+
+    /* even a duplicate ack may be opening their window */
+    uint32_t win_high = sequence + (win_size << s->tx_wscale);
+
+    if (SEQUENCE_GT(sequence, s->tx_win_low)) {
         /* their ack is somewhere in our window */
         uint32_t acked_len;
 
@@ -776,55 +1389,143 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
 
         LTRACEF("acked len %u\n", acked_len);
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+        DEBUG_ASSERT(acked_len <= s->tx_queued);
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+        /* drop what they've got from the front of the queue. anything still going out
+         * holds its own reference. */
+        s->tx_queued -= acked_len;
+        for (uint32_t left = acked_len; left > 0; ) {
+            pktbuf_t *p = list_peek_head_type(&s->tx_queue, pktbuf_t, list);
+            DEBUG_ASSERT(p);
 
-        s->tx_buffer_offset -= acked_len;
+            size_t n = MIN(p->dlen, left);
+            pktbuf_consume(p, n);
+            left -= n;
+
+            if (p->dlen == 0 && !(s->tx_tail_open && list_peek_tail_type(&s->tx_queue, pktbuf_t, list) == p)) {
+                list_delete(&p->list);
+                pktbuf_free(p, false);
+                sem_post(&tcp_tx_queue_sem, false);
+            }
+        }
         s->tx_win_low += acked_len;
-        s->tx_win_high = s->tx_win_low + win_size;
+        tcp_sack_prune(s);
+
+        /* our timestamp came back with it, which makes for a round trip time.
+         * without them we time one segment at a time. */
+        if (s->ts_ok && opts->ts && opts->tsecr != 0)
+            tcp_rtt_sample(s, current_time() - opts->tsecr);
+        if (s->rtt_timing && SEQUENCE_GTE(sequence, s->rtt_seq)) {
+            if (!s->ts_ok)
+                tcp_rtt_sample(s, current_time() - s->rtt_start);
+            s->rtt_timing = false;
+        }
+        s->rto = tcp_rto(s);
+
+        if (s->in_recovery) {
+            if (SEQUENCE_GTE(sequence, s->recover)) {
+                /* everything that was out when we noticed the loss is in, rfc 6582 */
+                s->in_recovery = false;
+                s->cwnd = MIN(s->ssthresh, tcp_flight_size(s) + s->mss);
+            } else {
+                /* a partial ack, the next hole is gone too */
+                tcp_resend_head(s);
+                s->cwnd = ((s->cwnd > acked_len) ? s->cwnd - acked_len : 0) + s->mss;
+            }
+        } else {
+            tcp_cc_ack(s, acked_len);
+        }
+        s->dup_acks = 0;
 
         /* cancel or reset our retransmit timer */
         if (s->tx_win_low == s->tx_highest_seq) {
             tcp_timer_cancel(s, &s->retransmit_timer);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
         }
 
         /* we have opened the transmit buffer */
         event_signal(&s->tx_event, true);
+    } else if (data_len == 0 && tcp_flight_size(s) > 0 && win_high == s->tx_win_high) {
+        /* a duplicate, something after tx_win_low got there without it */
+        s->stats.dup_acks++;
+
+        if (s->in_recovery) {
+            /* another segment has left the network, let one more in */
+            s->cwnd += s->mss;
+        } else if (++s->dup_acks == TCP_DUP_ACK_THRESHOLD) {
+            /* fast retransmit, and stay in recovery until everything sent so far is acked */
+            tcp_cc_loss(s);
+            s->recover = s->tx_highest_seq;
+            s->in_recovery = true;
+            s->stats.fast_retransmits++;
+
+            tcp_resend_head(s);
+            s->cwnd = s->ssthresh + TCP_DUP_ACK_THRESHOLD * s->mss;
+        }
     }
+
+    s->tx_win_high = win_high;
+
+    /* send anything that was waiting on the window */
+    tcp_write_pending_data(s);
 }
 
 static ssize_t tcp_write_pending_data(tcp_socket_t *s)
 {
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_queued);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
     DEBUG_ASSERT(s->tx_buffer_size > 0);
-    DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
     /* do we have any new data to send? */
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = s->tx_buffer_offset - outstanding;
-    LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
+    uint32_t queued = s->tx_queued - outstanding;
+
+    /* only as much as they have room for, and the network too */
+    uint32_t window = SEQUENCE_GT(s->tx_win_high, s->tx_highest_seq) ? s->tx_win_high - s->tx_highest_seq : 0;
+    uint32_t cwnd_room = (s->cwnd > outstanding) ? s->cwnd - outstanding : 0;
+    uint32_t pending = MIN(queued, MIN(window, cwnd_room));
+    LTRACEF("outstanding %u, queued %u, pending %u\n", outstanding, queued, pending);
 
     /* send packets that cover the pending area of the window */
     uint32_t offset = 0;
     while (offset < pending) {
         uint32_t tosend = MIN(s->mss, pending - offset);
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
+        /* hand the nic as many full segments as fit in a large pktbuf */
+        if ((minip_offload & MINIP_OFFLOAD_TSO4) && pending - offset > s->mss) {
+            uint32_t tso_len = MIN(pending - offset, (PKTBUF_LARGE_MAX_DATA / s->mss) * s->mss);
+
+            status_t err = tcp_socket_send(s, outstanding + offset, tso_len, PKT_ACK|PKT_PSH, s->tx_highest_seq);
+            if (err != ERR_NO_MEMORY) {
+                s->tx_highest_seq += tso_len;
+                offset += tso_len;
+                continue;
+            }
+            /* out of large buffers, send this one the slow way */
+        }
+
+        tcp_socket_send(s, outstanding + offset, tosend, PKT_ACK|PKT_PSH, s->tx_highest_seq);
         s->tx_highest_seq += tosend;
         offset += tosend;
     }
 
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    s->stats.bytes_out += offset;
+
+    /* time a round trip if we aren't already */
+    if (offset > 0 && !s->ts_ok && !s->rtt_timing) {
+        s->rtt_timing = true;
+        s->rtt_seq = s->tx_highest_seq;
+        s->rtt_start = current_time();
+    }
+
+    /* reset the retransmit timer if we sent anything. if their window is shut with
+     * nothing in flight, it's what gets us to probe it. */
+    if (offset > 0 || (queued > 0 && outstanding == 0)) {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
 
     return offset;
@@ -840,15 +1541,43 @@ static ssize_t tcp_retransmit(tcp_socket_t *s)
 
     /* how much data have we sent but not gotten an ack for? */
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    if (outstanding == 0)
-        return 0;
+    if (outstanding == 0) {
+        if (s->tx_queued == 0)
+            return 0;
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+        /* their window is shut, poke a byte at it to get it reopened */
+        LTRACEF("s %p, window probe seq %u\n", s, s->tx_highest_seq);
+        tcp_socket_send(s, 0, 1, PKT_ACK, s->tx_highest_seq);
+        s->tx_highest_seq++;
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+        return 1;
+    }
 
-    return tosend;
+    /* resend the holes in front of each block they've told us they have, a few
+     * segments at a time. without any that's just the first segment. */
+    uint32_t sent = 0;
+    uint32_t seq = s->tx_win_low;
+    uint segments = 0;
+    for (uint i = 0; i < s->sacked_count && segments < TCP_RETRANSMIT_SEGMENTS; i++) {
+        while (SEQUENCE_LT(seq, s->sacked[i].start) && segments < TCP_RETRANSMIT_SEGMENTS) {
+            uint32_t tosend = MIN(s->mss, s->sacked[i].start - seq);
+
+            LTRACEF("s %p, hole tosend %u seq %u\n", s, tosend, seq);
+            tcp_socket_send(s, seq - s->tx_win_low, tosend, PKT_ACK|PKT_PSH, seq);
+            s->stats.retransmits++;
+            s->rtt_timing = false;
+            seq += tosend;
+            sent += tosend;
+            segments++;
+        }
+        if (SEQUENCE_GT(s->sacked[i].end, seq))
+            seq = s->sacked[i].end;
+    }
+
+    if (sent == 0)
+        sent = tcp_resend_head(s);
+
+    return sent;
 }
 
 static void handle_retransmit_timeout(void *_s)
@@ -861,10 +1590,22 @@ static void handle_retransmit_timeout(void *_s)
 
     mutex_acquire(&s->lock);
 
+    if (tcp_flight_size(s) > 0 && (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT)) {
+        /* the pipe drained, start again from a segment and recover everything that's out */
+        tcp_cc_loss(s);
+        s->cwnd = s->mss;
+        s->recover = s->tx_highest_seq;
+        s->in_recovery = true;
+        s->dup_acks = 0;
+        s->stats.timeouts++;
+    }
+
     if (tcp_retransmit(s) == 0)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* back off until they answer */
+    s->rto = MIN(s->rto * 2, (lk_time_t)TCP_MAX_RTO);
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
@@ -934,11 +1675,11 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
+static tcp_socket_t *create_tcp_socket(void)
 {
     tcp_socket_t *s;
 
-    s = calloc(1, sizeof(tcp_socket_t));
+    s = slab_alloc(&tcp_socket_cache);
     if (!s)
         return NULL;
 
@@ -948,28 +1689,40 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     s->state = STATE_CLOSED;
     s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_queue);
 
     s->mss = DEFAULT_MSS;
+    s->rto = RETRANSMIT_TIMEOUT;
+    s->cwnd = TCP_INITIAL_WINDOW_SEGMENTS * s->mss;
+    s->ssthresh = UINT32_MAX;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
     event_init(&s->tx_event, true, 0);
+    list_initialize(&s->tx_queue);
 
-    if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
-    }
+    s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
 
     sem_init(&s->accept_sem, 0);
 
     return s;
 }
 
+/* the receive buffer, once rx_win_size is settled */
+static status_t tcp_socket_alloc_buffers(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(!s->rx_buffer_raw);
+
+    s->rx_buffer_raw = malloc(s->rx_win_size);
+    if (!s->rx_buffer_raw)
+        return ERR_NO_MEMORY;
+
+    cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
+
+    return NO_ERROR;
+}
+
 /* user api */
 
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
@@ -979,7 +1732,7 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1024,6 +1777,51 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
     return NO_ERROR;
 }
 
+/* copy up to len bytes out of the receive queue and then the buffer, in that order */
+static size_t tcp_rx_copy(tcp_socket_t *s, void *buf, size_t len)
+{
+    size_t ret = 0;
+
+    while (ret < len) {
+        pktbuf_t *p = list_peek_head_type(&s->rx_queue, pktbuf_t, list);
+        if (!p)
+            break;
+
+        size_t n = MIN(p->dlen, len - ret);
+        memcpy((uint8_t *)buf + ret, pktbuf_consume(p, n), n);
+        s->rx_queued -= n;
+        ret += n;
+
+        if (p->dlen == 0) {
+            list_delete(&p->list);
+            pktbuf_free(p, false);
+            sem_post(&tcp_rx_queue_sem, false);
+        }
+    }
+
+    if (ret < len)
+        ret += cbuf_read(&s->rx_buffer, (uint8_t *)buf + ret, len - ret, false);
+
+    return ret;
+}
+
+/* the reader took something, let the other end know if the window has opened up */
+static void tcp_rx_consumed(tcp_socket_t *s)
+{
+    /* if we've used up the last byte in the read buffer, unsignal the read event */
+    size_t remaining_bytes = tcp_rx_pending(s);
+    if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
+        event_unsignal(&s->rx_event);
+    }
+
+    /* we've read something, make sure the other end knows that our window is opening */
+    uint32_t new_rx_win_size = s->rx_win_size - remaining_bytes;
+
+    /* if we've opened it enough, send an ack */
+    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
+        send_ack(s);
+}
+
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
 {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
@@ -1045,7 +1843,7 @@ retry:
     mutex_acquire(&s->lock);
 
     /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
+    ret = tcp_rx_copy(s, buf, len);
     if (ret == 0) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED) {
@@ -1059,18 +1857,61 @@ retry:
         goto retry;
     }
 
-    /* if we've used up the last byte in the read buffer, unsignal the read event */
-    size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
-    if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
+    tcp_rx_consumed(s);
+
+out:
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return ret;
+}
+
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **out)
+{
+    LTRACEF("socket %p\n", socket);
+    if (!socket || !out)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = 0;
+retry:
+    /* block on available data */
+    event_wait(&s->rx_event);
+
+    mutex_acquire(&s->lock);
+
+    pktbuf_t *p = list_remove_head_type(&s->rx_queue, pktbuf_t, list);
+    if (p) {
+        /* it's the caller's now */
+        s->rx_queued -= p->dlen;
+        sem_post(&tcp_rx_queue_sem, false);
+        ret = p->dlen;
+    } else if (cbuf_space_used(&s->rx_buffer) > 0) {
+        /* whatever came in without a pktbuf to keep has to be copied out */
+        p = pktbuf_alloc();
+        if (!p) {
+            ret = ERR_NO_MEMORY;
+            goto out;
+        }
+        ret = cbuf_read(&s->rx_buffer, p->data, pktbuf_avail_tail(p), false);
+        p->dlen = ret;
+    } else {
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED) {
+            ret = ERR_CHANNEL_CLOSED;
+            goto out;
+        }
+
+        /* we must have raced with another thread */
         event_unsignal(&s->rx_event);
+        mutex_release(&s->lock);
+        goto retry;
     }
 
-    /* we've read something, make sure the other end knows that our window is opening */
-    uint32_t new_rx_win_size = s->rx_win_size - remaining_bytes;
-
-    /* if we've opened it enough, send an ack */
-    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
-        send_ack(s);
+    tcp_rx_consumed(s);
+    *out = p;
 
 out:
     mutex_release(&s->lock);
@@ -1110,21 +1951,55 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         }
 
         DEBUG_ASSERT(s->tx_buffer_size > 0);
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+
+        if (s->tx_queued >= s->tx_buffer_size) {
+            mutex_release(&s->lock);
+            continue;
+        }
+
+        /* copy onto the end of the last pktbuf if we can, otherwise start another */
+        pktbuf_t *p = s->tx_tail_open ? list_peek_tail_type(&s->tx_queue, pktbuf_t, list) : NULL;
+        if (!p || pktbuf_avail_tail(p) == 0) {
+            /* don't hold the socket up while we wait for one */
+            mutex_release(&s->lock);
+
+            sem_wait(&tcp_tx_queue_sem);
+            p = pktbuf_alloc();
+            if (!p) {
+                sem_post(&tcp_tx_queue_sem, true);
+                dec_socket_ref(s);
+                return ERR_NO_MEMORY;
+            }
+
+            /* the headers never go in front of queued data, use the whole buffer */
+            p->data = p->buffer;
+
+            mutex_acquire(&s->lock);
+            if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+                mutex_release(&s->lock);
+                pktbuf_free(p, true);
+                sem_post(&tcp_tx_queue_sem, true);
+                dec_socket_ref(s);
+                return ERR_CHANNEL_CLOSED;
+            }
+
+            list_add_tail(&s->tx_queue, &p->list);
+            s->tx_tail_open = true;
+        }
 
         /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
+        size_t room = (s->tx_queued < s->tx_buffer_size) ? s->tx_buffer_size - s->tx_queued : 0;
+        size_t to_copy = MIN(MIN(room, len - off), pktbuf_avail_tail(p));
         if (to_copy == 0) {
             mutex_release(&s->lock);
             continue;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
-        s->tx_buffer_offset += to_copy;
+        pktbuf_append_data(p, (uint8_t *)buf + off, to_copy);
+        s->tx_queued += to_copy;
 
         /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        if (s->tx_queued >= s->tx_buffer_size) {
             event_unsignal(&s->tx_event);
         }
 
@@ -1140,6 +2015,168 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
     return len;
 }
 
+ssize_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p)
+{
+    LTRACEF("socket %p, p %p\n", socket, p);
+    if (!socket || !p)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = 0;
+    while (p) {
+        /* every part holds a permit for as long as it's queued */
+        sem_wait(&tcp_tx_queue_sem);
+
+        /* wait for the tx buffer to open up */
+        event_wait(&s->tx_event);
+
+        mutex_acquire(&s->lock);
+
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+            mutex_release(&s->lock);
+            sem_post(&tcp_tx_queue_sem, true);
+            pktbuf_free_chain(p, true);
+            dec_socket_ref(s);
+            return ERR_CHANNEL_CLOSED;
+        }
+
+        if (s->tx_queued >= s->tx_buffer_size) {
+            mutex_release(&s->lock);
+            sem_post(&tcp_tx_queue_sem, false);
+            continue;
+        }
+
+        pktbuf_t *next = p->next;
+        p->next = NULL;
+        p->flags |= PKTBUF_FLAG_EOF;
+
+        /* queue it whole, even if that goes a little past the buffer size */
+        ret += p->dlen;
+        if (p->dlen > 0) {
+            list_add_tail(&s->tx_queue, &p->list);
+            s->tx_queued += p->dlen;
+            s->tx_tail_open = false;
+        } else {
+            pktbuf_free(p, false);
+            sem_post(&tcp_tx_queue_sem, false);
+        }
+
+        if (s->tx_queued >= s->tx_buffer_size) {
+            event_unsignal(&s->tx_event);
+        }
+
+        /* send as much data as we can */
+        tcp_write_pending_data(s);
+
+        mutex_release(&s->lock);
+
+        p = next;
+    }
+
+    dec_socket_ref(s);
+    return ret;
+}
+
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (rx_size && (rx_size < TCP_MIN_BUFFER_SIZE || rx_size > TCP_MAX_BUFFER_SIZE))
+        return ERR_INVALID_ARGS;
+    if (tx_size && (tx_size < TCP_MIN_BUFFER_SIZE || tx_size > TCP_MAX_BUFFER_SIZE))
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&s->lock);
+
+    if (rx_size) {
+        /* it's the window we offer in the handshake, and what we pick its scale from */
+        if (s->state != STATE_LISTEN) {
+            err = ERR_BAD_STATE;
+            goto out;
+        }
+
+        /* the receive buffer is a cbuf */
+        if (!ispow2(rx_size))
+            rx_size = 1U << (log2_uint(rx_size) + 1);
+        s->rx_win_size = rx_size;
+    }
+
+    if (tx_size) {
+        s->tx_buffer_size = tx_size;
+        if (s->tx_queued < s->tx_buffer_size)
+            event_signal(&s->tx_event, true);
+        else
+            event_unsignal(&s->tx_event);
+    }
+
+out:
+    mutex_release(&s->lock);
+
+    return err;
+}
+
+size_t tcp_bytes_available(tcp_socket_t *socket)
+{
+    if (!socket)
+        return 0;
+
+    tcp_socket_t *s = socket;
+
+    mutex_acquire(&s->lock);
+    size_t pending = tcp_rx_pending(s);
+    mutex_release(&s->lock);
+
+    return pending;
+}
+
+status_t tcp_poller_add(tcp_socket_t *socket, poller_t *poller, uint events, void *cookie)
+{
+    if (!socket || !poller || (events & ~(POLL_IN | POLL_OUT)) || !events)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    status_t err = NO_ERROR;
+
+    /* a listening socket is readable when there's a connection to accept */
+    if (events & POLL_IN) {
+        if (s->state == STATE_LISTEN)
+            err = poller_add_sem(poller, &s->accept_sem, POLL_IN, cookie);
+        else
+            err = poller_add_event(poller, &s->rx_event, POLL_IN, cookie);
+        if (err < 0)
+            return err;
+    }
+
+    if (events & POLL_OUT) {
+        err = poller_add_event(poller, &s->tx_event, POLL_OUT, cookie);
+        if (err < 0 && (events & POLL_IN))
+            tcp_poller_remove(socket, poller);
+    }
+
+    return err;
+}
+
+status_t tcp_poller_remove(tcp_socket_t *socket, poller_t *poller)
+{
+    if (!socket || !poller)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+
+    /* whichever of them it was added with */
+    status_t in = (s->state == STATE_LISTEN) ? poller_remove_sem(poller, &s->accept_sem)
+                                             : poller_remove_event(poller, &s->rx_event);
+    status_t out = poller_remove_event(poller, &s->tx_event);
+
+    return (in < 0 && out < 0) ? ERR_NOT_FOUND : NO_ERROR;
+}
+
 status_t tcp_close(tcp_socket_t *socket)
 {
     if (!socket)
@@ -1171,14 +2208,14 @@ status_t tcp_close(tcp_socket_t *socket)
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, 0, 0, PKT_ACK|PKT_FIN, s->tx_win_low);
             s->tx_win_low++;
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, 0, 0, PKT_ACK|PKT_FIN, s->tx_win_low);
             s->tx_win_low++;
 
             // XXX set up fin retransmit timer here
@@ -1227,12 +2264,20 @@ usage:
 
     if (!strcmp(argv[1].str, "sockets")) {
 
-        mutex_acquire(&tcp_socket_list_lock);
-        tcp_socket_t *s = NULL;
-        list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-            dump_socket(s);
+        struct tcp_hash_bucket *tables[] = { tcp_listen_hash, tcp_conn_hash };
+        for (uint t = 0; t < countof(tables); t++) {
+            for (uint i = 0; i < TCP_HASH_SIZE; i++) {
+                struct tcp_hash_bucket *b = &tables[t][i];
+
+                spin_lock_saved_state_t state;
+                spin_lock_irqsave(&b->lock, state);
+                tcp_socket_t *s = NULL;
+                list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+                    dump_socket(s);
+                }
+                spin_unlock_irqrestore(&b->lock, state);
+            }
         }
-        mutex_release(&tcp_socket_list_lock);
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
@@ -31,12 +31,29 @@
 #include <list.h>
 #include <malloc.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <trace.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/semaphore.h>
+#include <lk/init.h>
 
 #define LOCAL_TRACE 0
 
+#define UDP_RX_QUEUE_LEN    16  /* datagrams held per socket for udp_recv_batch */
+#define UDP_QUEUE_PKTBUFS   (PKTBUF_POOL_SIZE / 8)
+#define UDP_BATCH_MAX       16  /* datagrams handed to the driver at once */
+
 static struct list_node udp_list = LIST_INITIAL_VALUE(udp_list);
 
+/* open sockets, for udp_input to queue datagrams on. protects their rx queues too. */
+static struct list_node udp_socket_list = LIST_INITIAL_VALUE(udp_socket_list);
+static mutex_t udp_socket_lock = MUTEX_INITIAL_VALUE(udp_socket_lock);
+
+/* driver pktbufs every socket together may hold on to, the rest are copied */
+static semaphore_t udp_rx_queue_sem;
+
 struct udp_listener {
     struct list_node list;
     uint16_t port;
@@ -44,11 +61,25 @@ struct udp_listener {
     void *arg;
 };
 
+struct udp_rx_slot {
+    pktbuf_t *p;    /* the driver's buffer, or NULL if the data was copied */
+    void *data;
+    size_t len;
+    uint32_t addr;
+    uint16_t port;
+};
+
 typedef struct udp_socket {
+    struct list_node node;
     uint32_t host;
     uint16_t sport;
     uint16_t dport;
-    const uint8_t *mac;
+
+    /* received datagrams, a ring protected by udp_socket_lock */
+    struct udp_rx_slot rx_queue[UDP_RX_QUEUE_LEN];
+    uint rx_head;
+    uint rx_count;
+    event_t rx_event;
 } udp_socket_t;
 
 typedef struct udp_hdr {
@@ -90,66 +121,82 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
     LTRACEF("host %u.%u.%u.%u sport %u dport %u handle %p\n",
            IPV4_SPLIT(host), sport, dport, handle);
     udp_socket_t *socket;
-    const uint8_t *dst_mac;
 
     if (handle == NULL) {
         return -EINVAL;
     }
 
-    socket = (udp_socket_t *) malloc(sizeof(udp_socket_t));
+    socket = (udp_socket_t *) calloc(1, sizeof(udp_socket_t));
     if (!socket) {
         return -ENOMEM;
     }
 
-    dst_mac = arp_get_dest_mac(host);
-    if (dst_mac == NULL) {
-        return -EHOSTUNREACH;
-    }
-
     socket->host = host;
     socket->sport = sport;
     socket->dport = dport;
-    socket->mac = dst_mac;
+    event_init(&socket->rx_event, false, 0);
+
+    mutex_acquire(&udp_socket_lock);
+    list_add_tail(&udp_socket_list, &socket->node);
+    mutex_release(&udp_socket_lock);
 
     *handle = socket;
 
     return NO_ERROR;
 }
 
+static void udp_rx_slot_free(struct udp_rx_slot *slot)
+{
+    if (slot->p) {
+        pktbuf_free(slot->p, false);
+        sem_post(&udp_rx_queue_sem, false);
+    } else {
+        free(slot->data);
+    }
+}
+
 status_t udp_close(udp_socket_t *handle)
 {
     if (handle == NULL) {
         return -EINVAL;
     }
 
+    mutex_acquire(&udp_socket_lock);
+    list_delete(&handle->node);
+    mutex_release(&udp_socket_lock);
+
+    for (uint i = 0; i < handle->rx_count; i++) {
+        udp_rx_slot_free(&handle->rx_queue[(handle->rx_head + i) % UDP_RX_QUEUE_LEN]);
+    }
+    event_destroy(&handle->rx_event);
+
     free(handle);
     return NO_ERROR;
 }
 
-status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle)
+/* builds a datagram for handle, ready for minip_ipv4_output */
+static status_t udp_build(const iovec_t *iov, uint iov_count, udp_socket_t *handle, pktbuf_t **out)
 {
     pktbuf_t *p;
-    struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     udp_hdr_t *udp;
-    status_t ret = NO_ERROR;
     void *buf;
     ssize_t len;
 
-    if (handle == NULL || iov == NULL || iov_count == 0) {
-        return -EINVAL;
-    }
-
     if ((p = pktbuf_alloc()) == NULL) {
         return -ENOMEM;
     }
 
     len = iovec_size(iov, iov_count);
+    if ((size_t)len > pktbuf_avail_tail(p)) {
+        pktbuf_free(p, true);
+        return -EINVAL;
+    }
 
     buf = pktbuf_append(p, len);
     udp = pktbuf_prepend(p, sizeof(udp_hdr_t));
     ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
+    pktbuf_prepend(p, sizeof(struct eth_hdr));
 
     iovec_to_membuf(buf, len, iov, iov_count, 0);
 
@@ -158,16 +205,108 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
     udp->len        = htons(sizeof(udp_hdr_t) + len);
     udp->chksum     = 0;
 
-    minip_build_mac_hdr(eth, handle->mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, handle->host, IP_PROTO_UDP, len + sizeof(udp_hdr_t));
 
 #if (MINIP_USE_UDP_CHECKSUM != 0)
     udp->chksum = rfc768_chksum(ip, udp);
 #endif
 
-    minip_tx_handler(p);
+    *out = p;
+    return NO_ERROR;
+}
 
-    return ret;
+status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle)
+{
+    pktbuf_t *p;
+
+    if (handle == NULL || iov == NULL || iov_count == 0) {
+        return -EINVAL;
+    }
+
+    status_t err = udp_build(iov, iov_count, handle, &p);
+    if (err < 0) {
+        return err;
+    }
+
+    return minip_ipv4_output(p, handle->host);
+}
+
+ssize_t udp_send_batch(const udp_msg_t *msgs, uint count, udp_socket_t *handle)
+{
+    pktbuf_t *batch[UDP_BATCH_MAX];
+    uint sent = 0;
+
+    if (handle == NULL || msgs == NULL) {
+        return -EINVAL;
+    }
+
+    while (sent < count) {
+        uint n;
+        status_t err = NO_ERROR;
+
+        for (n = 0; n < UDP_BATCH_MAX && sent + n < count; n++) {
+            const udp_msg_t *msg = &msgs[sent + n];
+            iovec_t iov = { msg->buf, msg->len };
+
+            if (msg->buf == NULL || msg->len == 0) {
+                err = -EINVAL;
+                break;
+            }
+            if ((err = udp_build(&iov, 1, handle, &batch[n])) < 0) {
+                break;
+            }
+        }
+
+        if (n > 0) {
+            minip_ipv4_output_batch(batch, n, handle->host);
+            sent += n;
+        }
+
+        if (err < 0) {
+            return sent > 0 ? (ssize_t)sent : err;
+        }
+    }
+
+    return sent;
+}
+
+ssize_t udp_recv_batch(udp_msg_t *msgs, uint count, udp_socket_t *handle, lk_time_t timeout)
+{
+    if (handle == NULL || msgs == NULL || count == 0) {
+        return -EINVAL;
+    }
+
+    status_t err = event_wait_timeout(&handle->rx_event, timeout);
+    if (err < 0) {
+        return err;
+    }
+
+    struct udp_rx_slot slots[UDP_RX_QUEUE_LEN];
+    uint n = 0;
+
+    /* take what's there, copy it out once the rx path can get at the queue again */
+    mutex_acquire(&udp_socket_lock);
+    while (n < count && n < UDP_RX_QUEUE_LEN && handle->rx_count > 0) {
+        slots[n++] = handle->rx_queue[handle->rx_head];
+        handle->rx_head = (handle->rx_head + 1) % UDP_RX_QUEUE_LEN;
+        handle->rx_count--;
+    }
+    if (handle->rx_count == 0) {
+        event_unsignal(&handle->rx_event);
+    }
+    mutex_release(&udp_socket_lock);
+
+    for (uint i = 0; i < n; i++) {
+        size_t len = MIN(msgs[i].len, slots[i].len);
+
+        memcpy(msgs[i].buf, slots[i].data, len);
+        msgs[i].len = len;
+        msgs[i].addr = slots[i].addr;
+        msgs[i].port = slots[i].port;
+        udp_rx_slot_free(&slots[i]);
+    }
+
+    return n;
 }
 
 status_t udp_send(void *buf, size_t len, udp_socket_t *handle)
@@ -204,4 +343,48 @@ void udp_input(pktbuf_t *p, uint32_t src_ip)
             return;
         }
     }
+
+    /* otherwise queue it on a socket opened to the sender for udp_recv_batch */
+    udp_socket_t *s;
+    mutex_acquire(&udp_socket_lock);
+    list_for_every_entry(&udp_socket_list, s, udp_socket_t, node) {
+        if (s->sport != port || (s->host != src_ip && s->host != IPV4_BCAST)) {
+            continue;
+        }
+
+        if (s->rx_count == UDP_RX_QUEUE_LEN) {
+            LTRACEF("socket %p rx queue full, dropping\n", s);
+            break;
+        }
+
+        struct udp_rx_slot *slot = &s->rx_queue[(s->rx_head + s->rx_count) % UDP_RX_QUEUE_LEN];
+        if ((minip_offload & MINIP_OFFLOAD_RX_KEEP) && sem_trywait(&udp_rx_queue_sem) >= 0) {
+            /* keep the driver's buffer, it'll get itself another */
+            slot->p = pktbuf_ref(p);
+            slot->data = p->data;
+        } else {
+            slot->p = NULL;
+            slot->data = malloc(p->dlen);
+            if (!slot->data) {
+                break;
+            }
+            memcpy(slot->data, p->data, p->dlen);
+        }
+        slot->len = p->dlen;
+        slot->addr = src_ip;
+        slot->port = ntohs(udp->src_port);
+
+        if (s->rx_count++ == 0) {
+            event_signal(&s->rx_event, false);
+        }
+        break;
+    }
+    mutex_release(&udp_socket_lock);
 }
+
+static void udp_init(uint level)
+{
+    sem_init(&udp_rx_queue_sem, UDP_QUEUE_PKTBUFS);
+}
+
+LK_INIT_HOOK(minip_udp, udp_init, LK_INIT_LEVEL_THREADING);
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Inflate a deflate or zlib stream straight from storage into memory.
+ *
+ * The source is read a chunk at a time by a helper thread, so the next read
+ * runs while the current chunk is being inflated and only a couple of
+ * chunks are ever held in memory. The output buffer must be big enough for
+ * the whole decompressed image.
+ */
+
+/* read len bytes at offset into buf, returns bytes read or a negative error */
+typedef ssize_t (*inflate_read_func)(void *arg, void *buf, off_t offset, size_t len);
+
+/* src_len bytes of compressed data at offset through read. zlib selects a
+ * zlib stream (header and adler32 checked) over raw deflate. Returns the
+ * number of bytes inflated into dst, or a negative error.
+ */
+ssize_t inflate_stream(inflate_read_func read, void *arg, off_t offset, size_t src_len,
+                       void *dst, size_t dst_len, bool zlib);
+
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+
+ssize_t inflate_bdev(bdev_t *dev, off_t offset, size_t src_len, void *dst, size_t dst_len, bool zlib);
+#endif
+
+#if WITH_LIB_FS
+/* the whole file is taken to be the compressed stream */
+ssize_t inflate_file(const char *path, void *dst, size_t dst_len, bool zlib);
+#endif
+
+__END_CDECLS
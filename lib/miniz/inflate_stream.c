@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/inflate_stream.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/semaphore.h>
+#include <kernel/thread.h>
+#include <lib/miniz.h>
+
+#if WITH_LIB_FS
+#include <lib/fs.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* double buffered: the reader fills one chunk while the other is inflated */
+#define INFLATE_CHUNK_SIZE (64 * 1024)
+#define INFLATE_CHUNKS 2
+
+struct inflate_pipe {
+	inflate_read_func read;
+	void *arg;
+	off_t offset;
+	size_t remaining;
+
+	uint8_t *buf[INFLATE_CHUNKS];
+	ssize_t len[INFLATE_CHUNKS];	/* bytes in the chunk, or a read error */
+
+	semaphore_t empty;		/* chunks free for the reader */
+	semaphore_t full;		/* chunks ready to inflate */
+	volatile bool stop;
+};
+
+static int inflate_reader(void *_pipe)
+{
+	struct inflate_pipe *pipe = _pipe;
+
+	for (uint i = 0; pipe->remaining > 0; i = (i + 1) % INFLATE_CHUNKS) {
+		sem_wait(&pipe->empty);
+		if (pipe->stop)
+			break;
+
+		size_t n = MIN(pipe->remaining, INFLATE_CHUNK_SIZE);
+		ssize_t err = pipe->read(pipe->arg, pipe->buf[i], pipe->offset, n);
+		LTRACEF("read %zu at %lld: %ld\n", n, pipe->offset, err);
+		if (err <= 0) {
+			pipe->len[i] = (err < 0) ? err : ERR_IO;
+			sem_post(&pipe->full, false);
+			break;
+		}
+
+		pipe->len[i] = err;
+		pipe->offset += err;
+		pipe->remaining -= MIN((size_t)err, pipe->remaining);
+		sem_post(&pipe->full, true);
+	}
+
+	return 0;
+}
+
+static status_t tinfl_to_status(tinfl_status status)
+{
+	switch (status) {
+		case TINFL_STATUS_ADLER32_MISMATCH:
+			return ERR_CHECKSUM_FAIL;
+		case TINFL_STATUS_HAS_MORE_OUTPUT:
+			return ERR_NOT_ENOUGH_BUFFER;
+		case TINFL_STATUS_NEEDS_MORE_INPUT:
+			return ERR_BAD_LEN;
+		default:
+			return ERR_NOT_VALID;
+	}
+}
+
+ssize_t inflate_stream(inflate_read_func read, void *arg, off_t offset, size_t src_len,
+                       void *dst, size_t dst_len, bool zlib)
+{
+	LTRACEF("offset %lld, src_len %zu, dst %p, dst_len %zu\n", offset, src_len, dst, dst_len);
+
+	if (!read || !dst || src_len == 0)
+		return ERR_INVALID_ARGS;
+
+	struct inflate_pipe pipe = {
+		.read = read,
+		.arg = arg,
+		.offset = offset,
+		.remaining = src_len,
+	};
+	tinfl_decompressor *decomp = malloc(sizeof(*decomp));
+	uint8_t *bufs = malloc(INFLATE_CHUNKS * INFLATE_CHUNK_SIZE);
+	ssize_t ret;
+
+	if (!decomp || !bufs) {
+		ret = ERR_NO_MEMORY;
+		goto out_free;
+	}
+	for (uint i = 0; i < INFLATE_CHUNKS; i++)
+		pipe.buf[i] = bufs + i * INFLATE_CHUNK_SIZE;
+	sem_init(&pipe.empty, INFLATE_CHUNKS);
+	sem_init(&pipe.full, 0);
+
+	thread_t *reader = thread_create("inflate reader", &inflate_reader, &pipe,
+	                                 get_current_thread()->priority, DEFAULT_STACK_SIZE);
+	if (!reader) {
+		ret = ERR_NO_MEMORY;
+		goto out_sem;
+	}
+	thread_resume(reader);
+
+	tinfl_init(decomp);
+
+	uint32_t flags = TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+	if (zlib)
+		flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;
+
+	uint8_t *out = dst;
+	size_t out_ofs = 0;
+	size_t consumed = 0;
+	tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+	for (uint i = 0; status == TINFL_STATUS_NEEDS_MORE_INPUT; i = (i + 1) % INFLATE_CHUNKS) {
+		if (consumed == src_len)
+			break;
+
+		sem_wait(&pipe.full);
+		if (pipe.len[i] < 0) {
+			ret = pipe.len[i];
+			goto out_join;
+		}
+
+		size_t in_len = MIN((size_t)pipe.len[i], src_len - consumed);
+		consumed += in_len;
+
+		size_t in_size = in_len;
+		size_t out_size = dst_len - out_ofs;
+		status = tinfl_decompress(decomp, pipe.buf[i], &in_size, out, out + out_ofs, &out_size,
+		                          flags | ((consumed < src_len) ? TINFL_FLAG_HAS_MORE_INPUT : 0));
+		out_ofs += out_size;
+		LTRACEF("chunk %u: in %zu/%zu out %zu status %d\n", i, in_size, in_len, out_size, status);
+
+		/* the chunk can be refilled now */
+		sem_post(&pipe.empty, false);
+	}
+
+	ret = (status == TINFL_STATUS_DONE) ? (ssize_t)out_ofs : tinfl_to_status(status);
+
+out_join:
+	/* knock the reader out of its wait if it hasn't finished */
+	pipe.stop = true;
+	sem_post(&pipe.empty, false);
+	thread_join(reader, NULL, INFINITE_TIME);
+out_sem:
+	sem_destroy(&pipe.empty);
+	sem_destroy(&pipe.full);
+out_free:
+	free(bufs);
+	free(decomp);
+
+	LTRACEF("returning %ld\n", ret);
+	return ret;
+}
+
+#if WITH_LIB_BIO
+static ssize_t inflate_read_bdev(void *arg, void *buf, off_t offset, size_t len)
+{
+	return bio_read(arg, buf, offset, len);
+}
+
+ssize_t inflate_bdev(bdev_t *dev, off_t offset, size_t src_len, void *dst, size_t dst_len, bool zlib)
+{
+	if (!dev)
+		return ERR_INVALID_ARGS;
+
+	src_len = bio_trim_range(dev, offset, src_len);
+
+	return inflate_stream(&inflate_read_bdev, dev, offset, src_len, dst, dst_len, zlib);
+}
+#endif
+
+#if WITH_LIB_FS
+static ssize_t inflate_read_file(void *arg, void *buf, off_t offset, size_t len)
+{
+	return fs_read_file(arg, buf, offset, len);
+}
+
+ssize_t inflate_file(const char *path, void *dst, size_t dst_len, bool zlib)
+{
+	filecookie fcookie;
+	struct file_stat stat;
+
+	status_t err = fs_open_file(path, &fcookie);
+	if (err < 0)
+		return err;
+
+	err = fs_stat_file(fcookie, &stat);
+	if (err < 0) {
+		fs_close_file(fcookie);
+		return err;
+	}
+
+	ssize_t ret = inflate_stream(&inflate_read_file, fcookie, 0, stat.size, dst, dst_len, zlib);
+
+	fs_close_file(fcookie);
+
+	return ret;
+}
+#endif
@@ -7,6 +7,7 @@ GLOBAL_INCLUDES += $(LOCAL_DIR)/include
 MODULE_DEPS +=
 
 MODULE_SRCS += \
+    $(LOCAL_DIR)/inflate_stream.c \
     $(LOCAL_DIR)/miniz.c
 
 include make/module.mk
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/netpoll.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/spinlock.h>
+
+#define LOCAL_TRACE 0
+
+/* every netpoll_init'd instance, for the console */
+static struct list_node netpoll_list = LIST_INITIAL_VALUE(netpoll_list);
+static spin_lock_t netpoll_list_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static int netpoll_thread(void *arg)
+{
+	netpoll_t *np = arg;
+
+	for (;;) {
+		event_wait(&np->event);
+
+		for (;;) {
+			int frames = np->poll(np->arg, np->budget);
+
+			LTRACEF("%s: %d frames\n", np->name, frames);
+			np->polls++;
+			np->frames += frames;
+
+			if (frames < np->budget) {
+				/* drained, go back to interrupts unless more showed up meanwhile */
+				if (np->done(np->arg))
+					break;
+			} else {
+				np->exhausted++;
+			}
+
+			/* don't let a busy link keep everything else at our priority off the cpu */
+			thread_yield();
+		}
+	}
+
+	return 0;
+}
+
+status_t netpoll_init(netpoll_t *np, const char *name, netpoll_func_t poll, netpoll_done_func_t done,
+                      void *arg, int budget, int priority)
+{
+	DEBUG_ASSERT(np);
+	DEBUG_ASSERT(poll);
+	DEBUG_ASSERT(done);
+
+	memset(np, 0, sizeof(*np));
+	np->name = name;
+	np->poll = poll;
+	np->done = done;
+	np->arg = arg;
+	np->budget = budget > 0 ? budget : NETPOLL_DEFAULT_BUDGET;
+	event_init(&np->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+	np->thread = thread_create(name, &netpoll_thread, np, priority, DEFAULT_STACK_SIZE);
+	if (!np->thread)
+		return ERR_NO_MEMORY;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&netpoll_list_lock, state);
+	list_add_tail(&netpoll_list, &np->node);
+	spin_unlock_irqrestore(&netpoll_list_lock, state);
+
+	return NO_ERROR;
+}
+
+void netpoll_start(netpoll_t *np)
+{
+	DEBUG_ASSERT(np && np->thread);
+
+	thread_resume(np->thread);
+}
+
+enum handler_return netpoll_schedule(netpoll_t *np)
+{
+	np->schedules++;
+	event_signal(&np->event, false);
+
+	return INT_RESCHEDULE;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_netpoll(int argc, const cmd_args *argv)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&netpoll_list_lock, state);
+
+	netpoll_t *np;
+	list_for_every_entry(&netpoll_list, np, netpoll_t, node) {
+		printf("netpoll '%s': budget %d schedules %lu polls %lu frames %lu exhausted %lu\n",
+		       np->name, np->budget, np->schedules, np->polls, np->frames, np->exhausted);
+	}
+
+	spin_unlock_irqrestore(&netpoll_list_lock, state);
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("netpoll", "network driver polling statistics", &cmd_netpoll)
+STATIC_COMMAND_END(netpoll);
+
+#endif
@@ -45,4 +45,28 @@
 
 #define NORFS_DELETED_MASK 1
 
+/* Checkpoints of the inode table are stored under a key objects can't use.
+ * The live bit is left out of the header crc, so a mount can consume one by
+ * clearing that bit in place.
+ */
+#define NORFS_CHECKPOINT_KEY 0xFFFF
+#define NORFS_CHECKPOINT_LIVE_MASK 2
+
+#define NORFS_INODE_HASH_SIZE 32
+
+/* Writes collect a whole block once fewer than NORFS_MIN_FREE_BLOCKS are
+ * free. Before it gets that far, a background thread starts collecting when
+ * NORFS_GC_START_FREE_BLOCKS or fewer are free, NORFS_GC_STEP_OBJECTS objects
+ * at a time, so a writer only ever waits for one step.
+ */
+#ifndef NORFS_GC_BACKGROUND
+#define NORFS_GC_BACKGROUND 1
+#endif
+#ifndef NORFS_GC_START_FREE_BLOCKS
+#define NORFS_GC_START_FREE_BLOCKS 2
+#endif
+#ifndef NORFS_GC_STEP_OBJECTS
+#define NORFS_GC_STEP_OBJECTS 4
+#endif
+
 #endif
@@ -27,7 +27,8 @@
 #include <stdint.h>
 
 struct norfs_inode {
-	struct list_node lnode;
+	struct list_node lnode;		/* links the inode into its hash bucket */
+	uint32_t key;
 	uint32_t location;
 	uint32_t reference_count;
 };
@@ -33,6 +33,11 @@
 #include <platform/flash_nor_config.h>
 #include <list.h>
 #include <debug.h>
+#include <kernel/mutex.h>
+#if NORFS_GC_BACKGROUND
+#include <kernel/event.h>
+#include <kernel/thread.h>
+#endif
 
 /* FRIEND_TEST non-static if unit testing, in order to
  * allow functions to be exposed by a test header file.
@@ -63,6 +68,22 @@ struct norfs_header {
 	uint16_t crc;
 };
 
+/* Payload of the checkpoint object, followed by inode_count entries. */
+struct norfs_checkpoint {
+	uint32_t used_blocks;		/* bitmap of the blocks in use */
+	uint32_t tail;			/* where the last write before it ended */
+	uint32_t remaining_space;
+	uint32_t inode_count;
+};
+
+struct norfs_checkpoint_entry {
+	uint32_t key;
+	uint32_t location;
+	uint32_t reference_count;
+};
+
+STATIC_ASSERT(NORFS_NUM_BLOCKS <= 32);
+
 /* Block header written after successful erase. */
 FRIEND_TEST const unsigned char NORFS_BLOCK_HEADER[4] = {'T', 'O', 'F', 'U'};
 /* Block header to indicate garbage collection has started. */
@@ -77,10 +98,22 @@ FRIEND_TEST uint32_t total_remaining_space = NORFS_AVAILABLE_SPACE;
 FRIEND_TEST uint8_t num_free_blocks = 0;
 static bool fs_mounted = false;
 FRIEND_TEST uint32_t norfs_nvram_offset;
-static struct list_node inode_list;
+static struct list_node inode_table[NORFS_INODE_HASH_SIZE];
+static uint32_t inode_count;
+static mutex_t norfs_lock = MUTEX_INITIAL_VALUE(norfs_lock);
 
 static bool block_free[NORFS_NUM_BLOCKS];
 
+/* Block being collected a few objects at a time, -1 if none. */
+static int gc_block = -1;
+static uint32_t gc_read_ptr;
+
+#if NORFS_GC_BACKGROUND
+static thread_t *gc_thread;
+static event_t gc_event = EVENT_INITIAL_VALUE(gc_event, false,
+                          EVENT_FLAG_AUTOUNSIGNAL);
+#endif
+
 static status_t collect_garbage(void);
 static status_t load_and_verify_obj(uint32_t *ptr, struct norfs_header *header);
 
@@ -119,9 +152,26 @@ static bool block_full(uint8_t block, uint32_t ptr)
 	return curr_block_free_space(ptr) < NORFS_OBJ_OFFSET;
 }
 
-static uint8_t select_garbage_block(uint32_t ptr)
+/* Oldest block in use, going round robin from the one being written. */
+static int select_garbage_block(uint32_t ptr)
+{
+	uint8_t block;
+	for (uint8_t i = 1; i < NORFS_NUM_BLOCKS; i++) {
+		block = (block_num(ptr) + i) % NORFS_NUM_BLOCKS;
+		if (!block_free[block])
+			return block;
+	}
+	return -1;
+}
+
+static uint32_t used_block_map(void)
 {
-	return (block_num(ptr) + 1) % 8;
+	uint32_t map = 0;
+	for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+		if (!block_free[i])
+			map |= 1u << i;
+	}
+	return map;
 }
 
 static ssize_t nvram_read(size_t offset, size_t length, void *ptr)
@@ -146,21 +196,39 @@ unsigned char* nvram_flash_pointer(uint32_t loc)
 	return FLASH_PTR(flash_nor_get_bank(NORFS_BANK), loc + norfs_nvram_offset);
 }
 
+static bool flash_erased(uint32_t loc, size_t len)
+{
+	const unsigned char *ptr = nvram_flash_pointer(loc);
+	for (size_t i = 0; i < len; i++) {
+		if (ptr[i] != 0xFF)
+			return false;
+	}
+	return true;
+}
+
+static struct list_node *inode_bucket(uint32_t key)
+{
+	return &inode_table[((key * 2654435761u) >> 16) % NORFS_INODE_HASH_SIZE];
+}
+
+static void init_inode_table(void)
+{
+	for (uint i = 0; i < NORFS_INODE_HASH_SIZE; i++)
+		list_initialize(&inode_table[i]);
+	inode_count = 0;
+}
+
 FRIEND_TEST bool get_inode(uint32_t key, struct norfs_inode **inode)
 {
-	struct list_node *curr_lnode;
 	struct norfs_inode *curr_inode;
-	uint32_t curr_key;
 
 	if (!inode)
 		return false;
 
 	*inode = NULL;
-	list_for_every(&inode_list, curr_lnode) {
-		curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
-		nvram_read(curr_inode->location + NORFS_KEY_OFFSET,
-		           sizeof(curr_key), &curr_key);
-		if (curr_key == key) {
+	list_for_every_entry(inode_bucket(key), curr_inode, struct norfs_inode,
+	                     lnode) {
+		if (curr_inode->key == key) {
 			*inode = curr_inode;
 			return true;
 		}
@@ -168,10 +236,29 @@ FRIEND_TEST bool get_inode(uint32_t key, struct norfs_inode **inode)
 	return false;
 }
 
+static struct norfs_inode *add_inode(uint32_t key, uint32_t location)
+{
+	struct norfs_inode *inode = malloc(sizeof(struct norfs_inode));
+	if (!inode)
+		return NULL;
+
+	inode->key = key;
+	inode->location = location;
+	inode->reference_count = 1;
+	list_add_tail(inode_bucket(key), &inode->lnode);
+	inode_count++;
+	return inode;
+}
+
 static uint16_t calculate_header_crc(uint32_t key, uint16_t version,
                                      uint16_t len, uint8_t flags)
 {
-	uint16_t crc = crc16((unsigned char *) &key, sizeof(key));
+	uint16_t crc;
+
+	/* Clearing the live bit of a checkpoint mustn't invalidate it. */
+	flags &= ~NORFS_CHECKPOINT_LIVE_MASK;
+
+	crc = crc16((unsigned char *) &key, sizeof(key));
 	crc = update_crc16(crc, (unsigned char *) &version, sizeof(version));
 	crc = update_crc16(crc, (unsigned char *) &len, sizeof(len));
 	crc = update_crc16(crc, (unsigned char *) &flags, sizeof(flags));
@@ -220,8 +307,8 @@ static ssize_t read_header(uint32_t ptr, struct norfs_header *header)
 	return total_bytes_read;
 }
 
-status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
-                              uint32_t iov_count, size_t *bytes_read, uint8_t flags)
+static status_t read_obj_iovec(uint32_t key, iovec_t *obj_iov,
+                               uint32_t iov_count, size_t *bytes_read)
 {
 	if (!fs_mounted)
 		return ERR_NOT_MOUNTED;
@@ -273,6 +360,17 @@ status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
 	return NO_ERROR;
 }
 
+status_t norfs_read_obj_iovec(uint32_t key, iovec_t *obj_iov,
+                              uint32_t iov_count, size_t *bytes_read, uint8_t flags)
+{
+	status_t status;
+
+	mutex_acquire(&norfs_lock);
+	status = read_obj_iovec(key, obj_iov, iov_count, bytes_read);
+	mutex_release(&norfs_lock);
+	return status;
+}
+
 static status_t write_obj_header(uint32_t *ptr, uint32_t key, uint16_t version,
                                  uint16_t len, uint8_t flags, uint16_t crc)
 {
@@ -452,7 +550,7 @@ status_t norfs_put_obj(uint32_t key, unsigned char *obj, uint16_t len,
 	if (!fs_mounted)
 		return ERR_NOT_MOUNTED;
 
-	if (key == 0xFFFF) {
+	if (key == NORFS_CHECKPOINT_KEY) {
 		return ERR_INVALID_ARGS;
 	}
 	status_t status;
@@ -468,7 +566,10 @@ bool is_deleted(uint32_t loc)
 	return NORFS_DELETED_MASK & flags;
 }
 
-status_t norfs_remove_obj(uint32_t key)
+static status_t put_obj_iovec(uint32_t key, const iovec_t *iov,
+                              uint32_t iov_count, uint8_t flags);
+
+static status_t remove_obj(uint32_t key)
 {
 	if (!fs_mounted)
 		return ERR_NOT_MOUNTED;
@@ -495,13 +596,23 @@ status_t norfs_remove_obj(uint32_t key)
 	 * Write a deleted object by passing a null iovec pointer.  Only header
 	 * will be written.
 	 */
-	status = norfs_put_obj_iovec(key, iov, 0, NORFS_DELETED_MASK);
+	status = put_obj_iovec(key, iov, 0, NORFS_DELETED_MASK);
 	if (status)
 		TRACEF("Error putting object. %d\n", status);
 
 	return status;
 }
 
+status_t norfs_remove_obj(uint32_t key)
+{
+	status_t status;
+
+	mutex_acquire(&norfs_lock);
+	status = remove_obj(key);
+	mutex_release(&norfs_lock);
+	return status;
+}
+
 static status_t find_space_for_object(uint16_t obj_len, uint32_t *ptr)
 {
 	status_t status;
@@ -517,21 +628,13 @@ static status_t find_space_for_object(uint16_t obj_len, uint32_t *ptr)
 	return NO_ERROR;
 }
 
-/*
- * Store an object in flash.  Moves write_pointer to new block and garbage
- * collects if needed.  If write fails, will reattempt.
- * How to handle write failures is not fully defined - at the moment I stop once
- * find_free_block is attempting to rewrite to a block it has already failed to
- * write to - after a full loop in a round-robin style garbage selection of
- * blocks.  Which is a lot of write attempts.
- */
-status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
-                             uint32_t iov_count, uint8_t flags)
+static status_t put_obj_iovec(uint32_t key, const iovec_t *iov,
+                              uint32_t iov_count, uint8_t flags)
 {
 	if (!fs_mounted)
 		return ERR_NOT_MOUNTED;
 
-	if (key == 0xFFFF) {
+	if (key == NORFS_CHECKPOINT_KEY) {
 		return ERR_INVALID_ARGS;
 	}
 
@@ -561,9 +664,6 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
 		/* Attempting to delete a non-existent object. */
 		TRACEF("Attempting to remove an object not in filesystem.\n");
 		return ERR_NOT_FOUND;
-	} else {
-		inode = malloc(sizeof(struct norfs_inode));
-		inode->reference_count = 1;
 	}
 
 	flash_nor_begin(NORFS_BANK);
@@ -594,7 +694,9 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
 	                         version, flags);
 	if (!status) {
 		if (!obj_preexists) {
-			list_add_tail(&inode_list, &inode->lnode);
+			inode = add_inode(key, header_loc);
+			if (!inode)
+				status = ERR_NO_MEMORY;
 		} else {
 			/* If object preexists, remove outdated version from remaining space. */
 			uint16_t prior_len;
@@ -603,6 +705,8 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
 			total_remaining_space += NORFS_FLASH_SIZE(prior_len);
 			inode->reference_count++;
 		}
+	}
+	if (!status) {
 		inode->location = header_loc;
 		total_remaining_space -= NORFS_FLASH_SIZE(len);
 	} else {
@@ -614,17 +718,53 @@ status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
 		initialize_next_block(&write_pointer);
 	}
 
+#if NORFS_GC_BACKGROUND
+	/* Get ahead of the synchronous collection in initialize_next_block. */
+	if (gc_thread && num_free_blocks <= NORFS_GC_START_FREE_BLOCKS)
+		event_signal(&gc_event, false);
+#endif
+
 	flash_nor_end(NORFS_BANK);
 	return status;
 }
 
+/*
+ * Store an object in flash.  Moves write_pointer to new block and garbage
+ * collects if needed.  If write fails, will reattempt.
+ * How to handle write failures is not fully defined - at the moment I stop once
+ * find_free_block is attempting to rewrite to a block it has already failed to
+ * write to - after a full loop in a round-robin style garbage selection of
+ * blocks.  Which is a lot of write attempts.
+ */
+status_t norfs_put_obj_iovec(uint32_t key, const iovec_t *iov,
+                             uint32_t iov_count, uint8_t flags)
+{
+	status_t status;
+
+	mutex_acquire(&norfs_lock);
+	status = put_obj_iovec(key, iov, iov_count, flags);
+	mutex_release(&norfs_lock);
+	return status;
+}
+
 static void remove_inode(struct norfs_inode *inode)
 {
 	if (!inode)
 		return;
 	list_delete(&inode->lnode);
 	free(inode);
-	inode = NULL;
+	inode_count--;
+}
+
+static void remove_all_inodes(void)
+{
+	struct norfs_inode *curr_inode, *temp_inode;
+	for (uint i = 0; i < NORFS_INODE_HASH_SIZE; i++) {
+		list_for_every_entry_safe(&inode_table[i], curr_inode, temp_inode,
+		                          struct norfs_inode, lnode) {
+			remove_inode(curr_inode);
+		}
+	}
 }
 
 /*  Verifies objects, and copies to new block if it is the latest version. */
@@ -643,6 +783,10 @@ static status_t collect_garbage_object(uint32_t *garbage_read_pointer,
 		TRACEF("Failed to load garbage_obj at %d\n", *garbage_read_pointer);
 		return status;
 	}
+	if (header.key == NORFS_CHECKPOINT_KEY) {
+		/* Only ever of use to the mount right after it was written. */
+		return NO_ERROR;
+	}
 	inode_found = get_inode(header.key, &inode);
 	if (inode_found) {
 		if (garb_obj_loc == inode->location) {
@@ -710,18 +854,19 @@ static status_t erase_block(uint8_t block)
 		TRACEF("Error during nvram_write.  Status: %d\n", bytes_written);
 		return bytes_written;
 	}
-	block_free[block] = true;
-	num_free_blocks++;
+	if (!block_free[block]) {
+		block_free[block] = true;
+		num_free_blocks++;
+	}
 
 	return NO_ERROR;
 }
 
-FRIEND_TEST status_t collect_block(uint32_t garbage_block,
+static status_t collect_block_from(uint32_t garbage_block,
+                                   uint32_t garbage_read_ptr,
                                    uint32_t *garbage_write_ptr)
 {
 	status_t status;
-	uint32_t garbage_read_ptr = garbage_block * FLASH_PAGE_SIZE +
-	                            NORFS_BLOCK_HEADER_SIZE;
 
 	while (!(block_full(garbage_block, garbage_read_ptr))) {
 		status = collect_garbage_object(&garbage_read_ptr, garbage_write_ptr);
@@ -732,15 +877,145 @@ FRIEND_TEST status_t collect_block(uint32_t garbage_block,
 	return erase_block(garbage_block);
 }
 
+FRIEND_TEST status_t collect_block(uint32_t garbage_block,
+                                   uint32_t *garbage_write_ptr)
+{
+	return collect_block_from(garbage_block,
+	                          garbage_block * FLASH_PAGE_SIZE +
+	                          NORFS_BLOCK_HEADER_SIZE, garbage_write_ptr);
+}
+
+/*
+ * Collect a whole block into the one just started at write_pointer, finishing
+ * the one gc_step was part way through if there is one.
+ */
 static status_t collect_garbage(void)
 {
+	int block = gc_block;
+	uint32_t read_ptr = gc_read_ptr;
+
+	if (block < 0) {
+		block = select_garbage_block(write_pointer);
+		if (block < 0)
+			return NO_ERROR;
+		read_ptr = block * FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE;
+	}
+	gc_block = -1;
+
+	return collect_block_from(block, read_ptr, &write_pointer);
+}
+
+/*
+ * Collect up to max_objects objects from the block being collected, picking
+ * the next one if there isn't one yet.  Unlike collect_garbage, write_pointer
+ * may be anywhere in its block, so live objects only get copied where they
+ * fit.  The block is erased once the last object has been looked at.
+ */
+static status_t gc_step(uint max_objects)
+{
+	uint16_t len;
+	uint8_t write_block;
 	status_t status;
-	uint8_t garbage_read_block = select_garbage_block(write_pointer);
-	status = collect_block(garbage_read_block, &write_pointer);
 
+	if (gc_block < 0) {
+		gc_block = select_garbage_block(write_pointer);
+		if (gc_block < 0)
+			return ERR_NOT_FOUND;
+		gc_read_ptr = gc_block * FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE;
+	}
+
+	for (uint i = 0; i < max_objects; i++) {
+		if (block_full(gc_block, gc_read_ptr))
+			goto done;
+
+		nvram_read(gc_read_ptr + NORFS_LENGTH_OFFSET, sizeof(len), &len);
+		if (len <= NORFS_MAX_OBJ_LEN && curr_block_free_space(write_pointer) <
+		        NORFS_FLASH_SIZE(ROUNDUP(len, WORD_SIZE))) {
+			status = initialize_next_block(&write_pointer);
+			if (status)
+				return status;
+			/* Running low on blocks finishes the collection right away. */
+			if (gc_block < 0)
+				return NO_ERROR;
+		}
+
+		write_block = block_num(write_pointer);
+		status = collect_garbage_object(&gc_read_ptr, &write_pointer);
+		if (status)
+			goto done;
+		if (block_num(write_pointer) != write_block) {
+			status = initialize_next_block(&write_pointer);
+			if (status)
+				return status;
+			if (gc_block < 0)
+				return NO_ERROR;
+		}
+	}
+	return NO_ERROR;
+
+done:
+	status = erase_block(gc_block);
+	gc_block = -1;
 	return status;
 }
 
+#if NORFS_GC_BACKGROUND
+/*
+ * Collects a block whenever a write leaves NORFS_GC_START_FREE_BLOCKS or fewer
+ * free, dropping the lock between steps to let reads and writes through.
+ */
+static int norfs_gc_thread(void *arg)
+{
+	status_t status;
+
+	mutex_acquire(&norfs_lock);
+	while (gc_thread == get_current_thread()) {
+		mutex_release(&norfs_lock);
+		event_wait(&gc_event);
+		mutex_acquire(&norfs_lock);
+
+		while (gc_thread == get_current_thread() &&
+		        (gc_block >= 0 || num_free_blocks <= NORFS_GC_START_FREE_BLOCKS)) {
+			flash_nor_begin(NORFS_BANK);
+			status = gc_step(NORFS_GC_STEP_OBJECTS);
+			flash_nor_end(NORFS_BANK);
+			if (status || gc_block < 0)
+				break;
+
+			mutex_release(&norfs_lock);
+			thread_yield();
+			mutex_acquire(&norfs_lock);
+		}
+	}
+	mutex_release(&norfs_lock);
+	return 0;
+}
+
+static void start_gc_thread(void)
+{
+	thread_t *t = thread_create("norfs gc", &norfs_gc_thread, NULL,
+	                            LOW_PRIORITY, DEFAULT_STACK_SIZE);
+	if (t) {
+		gc_thread = t;
+		thread_resume(t);
+	}
+}
+
+/* Called with the lock held, which is dropped while waiting for the thread. */
+static void stop_gc_thread(void)
+{
+	thread_t *t = gc_thread;
+	if (!t)
+		return;
+
+	gc_thread = NULL;
+	mutex_release(&norfs_lock);
+	event_signal(&gc_event, true);
+	thread_join(t, NULL, INFINITE_TIME);
+	mutex_acquire(&norfs_lock);
+}
+#endif
+
 /*
  * Load object into buffer and verify object's integrity via crc.  ptr parameter
  * is updated upon successful verification.
@@ -842,6 +1117,10 @@ static status_t mount_next_obj(void)
 	if (status) {
 		return status;
 	}
+	if (header.key == NORFS_CHECKPOINT_KEY) {
+		/* Consumed checkpoint left behind by an earlier mount. */
+		return NO_ERROR;
+	}
 	if (get_inode(header.key, &inode)) {
 		nvram_read(inode->location + NORFS_VERSION_OFFSET,
 		           sizeof(inode_version), &inode_version);
@@ -857,12 +1136,10 @@ static status_t mount_next_obj(void)
 		inode->reference_count += 1;
 	} else {
 		/* Object not yet held in memory.  Create new inode. */
-		inode = malloc(sizeof(struct norfs_inode));
-		inode->location = curr_obj_loc;
-
-		inode->reference_count = 1;
+		inode = add_inode(header.key, curr_obj_loc);
+		if (!inode)
+			return ERR_NO_MEMORY;
 
-		list_add_tail(&inode_list, &inode->lnode);
 		total_remaining_space -= NORFS_FLASH_SIZE(header.len);
 	}
 
@@ -876,17 +1153,157 @@ static status_t mount_next_obj(void)
  */
 static void purge_unreferenced_inodes(void)
 {
-	struct list_node *curr_lnode, *temp_node;
-	struct norfs_inode *curr_inode;
-	list_for_every_safe(&inode_list, curr_lnode, temp_node) {
-		curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
-		if (curr_inode->reference_count == 0) {
-			remove_inode(curr_inode);
+	struct norfs_inode *curr_inode, *temp_inode;
+	for (uint i = 0; i < NORFS_INODE_HASH_SIZE; i++) {
+		list_for_every_entry_safe(&inode_table[i], curr_inode, temp_inode,
+		                          struct norfs_inode, lnode) {
+			if (curr_inode->reference_count == 0) {
+				remove_inode(curr_inode);
+			}
 		}
 	}
 }
 
-status_t norfs_mount_fs(uint32_t offset)
+/*
+ * Store the inode table at the start of a block, where the next mount can find
+ * it without scanning the objects.  Only written at unmount, and consumed by
+ * the next mount, so a live checkpoint always describes the flash as it is.
+ */
+static status_t write_checkpoint(void)
+{
+	struct norfs_checkpoint checkpoint;
+	struct norfs_checkpoint_entry *entries;
+	struct norfs_inode *inode;
+	struct iovec iov[2];
+	uint32_t len = sizeof(checkpoint) + inode_count * sizeof(*entries);
+	uint32_t count = 0;
+	status_t status;
+
+	if (NORFS_FLASH_SIZE(len) > NORFS_MAX_OBJ_LEN) {
+		/* Too many objects, the next mount scans them instead. */
+		return ERR_TOO_BIG;
+	}
+
+	checkpoint.tail = write_pointer;
+	for (uint8_t i = 0; write_pointer != block_num(write_pointer) *
+	        FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE ||
+	        !flash_erased(write_pointer, NORFS_FLASH_SIZE(len)); i++) {
+		if (i == NORFS_NUM_BLOCKS)
+			return ERR_NO_MEMORY;
+		checkpoint.tail = write_pointer;
+		status = initialize_next_block(&write_pointer);
+		if (status)
+			return status;
+	}
+
+	/* Starting a block may have collected one, so fill this in after. */
+	entries = malloc(MAX(inode_count, 1) * sizeof(*entries));
+	if (!entries)
+		return ERR_NO_MEMORY;
+
+	for (uint i = 0; i < NORFS_INODE_HASH_SIZE; i++) {
+		list_for_every_entry(&inode_table[i], inode, struct norfs_inode, lnode) {
+			entries[count].key = inode->key;
+			entries[count].location = inode->location;
+			entries[count].reference_count = inode->reference_count;
+			count++;
+		}
+	}
+	checkpoint.used_blocks = used_block_map();
+	checkpoint.remaining_space = total_remaining_space;
+	checkpoint.inode_count = count;
+
+	iov[0].iov_base = &checkpoint;
+	iov[0].iov_len = sizeof(checkpoint);
+	iov[1].iov_base = entries;
+	iov[1].iov_len = count * sizeof(*entries);
+	status = write_obj_iovec(iov, 2, &write_pointer, NORFS_CHECKPOINT_KEY, 0,
+	                         NORFS_CHECKPOINT_LIVE_MASK);
+	free(entries);
+	return status;
+}
+
+/* Clear the live bit, leaving the rest of the header word as it was. */
+static status_t consume_checkpoint(uint32_t loc, struct norfs_header *header)
+{
+	unsigned char buff[WORD_SIZE];
+	ssize_t bytes_written;
+
+	buff[0] = header->flags & ~NORFS_CHECKPOINT_LIVE_MASK;
+	buff[1] = 1;
+	memcpy(buff + 2, &header->crc, sizeof(header->crc));
+	bytes_written = nvram_write(loc + NORFS_FLAGS_OFFSET, sizeof(buff), buff);
+	if (bytes_written < 0)
+		return bytes_written;
+	return NO_ERROR;
+}
+
+/*
+ * Consume the live checkpoint at the start of a block in use, if there is one,
+ * and load the inode table from it when the flash still matches it.  Returns
+ * false, with the table left empty, if the objects have to be scanned.
+ */
+static bool mount_checkpoint(void)
+{
+	const struct norfs_checkpoint_entry *entries;
+	struct norfs_checkpoint checkpoint;
+	struct norfs_header header;
+	struct norfs_inode *inode;
+	uint32_t loc, ptr, found_loc = 0, found_end = 0;
+	uint16_t found_len = 0;
+	uint live = 0;
+
+	for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+		if (block_free[i])
+			continue;
+		loc = i * FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE;
+		ptr = loc;
+		if (read_header(loc, &header) < 0 ||
+		        header.key != NORFS_CHECKPOINT_KEY ||
+		        !(header.flags & NORFS_CHECKPOINT_LIVE_MASK))
+			continue;
+		if (load_and_verify_obj(&ptr, &header))
+			continue;
+		if (consume_checkpoint(loc, &header))
+			return false;
+		found_loc = loc;
+		found_end = ptr;
+		found_len = header.len;
+		live++;
+	}
+	if (live != 1 || found_len < sizeof(checkpoint))
+		return false;
+
+	nvram_read(found_loc + NORFS_OBJ_OFFSET, sizeof(checkpoint), &checkpoint);
+	if (found_len != sizeof(checkpoint) +
+	        checkpoint.inode_count * sizeof(*entries))
+		return false;
+	if (checkpoint.used_blocks != used_block_map())
+		return false;
+
+	/* Anything written past where the filesystem left off isn't in it. */
+	if (checkpoint.tail != found_loc &&
+	        !block_full(block_num(checkpoint.tail), checkpoint.tail) &&
+	        !flash_erased(checkpoint.tail, WORD_SIZE))
+		return false;
+
+	entries = (const struct norfs_checkpoint_entry *)nvram_flash_pointer(
+	              found_loc + NORFS_OBJ_OFFSET + sizeof(checkpoint));
+	for (uint32_t i = 0; i < checkpoint.inode_count; i++) {
+		inode = add_inode(entries[i].key, entries[i].location);
+		if (!inode) {
+			remove_all_inodes();
+			return false;
+		}
+		inode->reference_count = entries[i].reference_count;
+	}
+
+	total_remaining_space = checkpoint.remaining_space;
+	write_pointer = found_end;
+	return true;
+}
+
+static status_t mount_fs(uint32_t offset)
 {
 	if (fs_mounted) {
 		TRACEF("Filesystem already mounted.\n");
@@ -895,12 +1312,13 @@ status_t norfs_mount_fs(uint32_t offset)
 	status_t status = 0;
 	norfs_nvram_offset = offset;
 
-	list_initialize(&inode_list);
+	init_inode_table();
 	flash_nor_begin(NORFS_BANK);
 	srand(current_time());
 
 	total_remaining_space = NORFS_AVAILABLE_SPACE;
 	num_free_blocks = 0;
+	gc_block = -1;
 	TRACEF("Mounting NOR file system.\n");
 	for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
 		write_pointer = i * FLASH_PAGE_SIZE;
@@ -919,17 +1337,30 @@ status_t norfs_mount_fs(uint32_t offset)
 			return status;
 		}
 		block_free[i] = false;
-		while (!block_full(i, write_pointer)) {
-			status = mount_next_obj();
-			if (status)
-				break;
-		}
 	}
 
-	purge_unreferenced_inodes();
+	if (mount_checkpoint()) {
+		/* Carry on writing right after the checkpoint. */
+		status = NO_ERROR;
+		if (block_full(block_num(write_pointer - 1), write_pointer))
+			status = initialize_next_block(&write_pointer);
+	} else {
+		for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
+			if (block_free[i])
+				continue;
+			write_pointer = i * FLASH_PAGE_SIZE + NORFS_BLOCK_HEADER_SIZE;
+			while (!block_full(i, write_pointer)) {
+				status = mount_next_obj();
+				if (status)
+					break;
+			}
+		}
+
+		purge_unreferenced_inodes();
 
-	write_pointer = rand() % NORFS_NVRAM_SIZE;
-	status = initialize_next_block(&write_pointer);
+		write_pointer = rand() % NORFS_NVRAM_SIZE;
+		status = initialize_next_block(&write_pointer);
+	}
 	if (status) {
 		TRACEF("Failed to find free block after mount.\n");
 		flash_nor_end(NORFS_BANK);
@@ -939,35 +1370,59 @@ status_t norfs_mount_fs(uint32_t offset)
 	TRACEF("NOR filesystem successfully mounted.\n");
 	flash_nor_end(NORFS_BANK);
 	fs_mounted = true;
+#if NORFS_GC_BACKGROUND
+	start_gc_thread();
+#endif
 	return NO_ERROR;
 }
 
+status_t norfs_mount_fs(uint32_t offset)
+{
+	status_t status;
+
+	mutex_acquire(&norfs_lock);
+	status = mount_fs(offset);
+	mutex_release(&norfs_lock);
+	return status;
+}
+
 void norfs_unmount_fs(void)
 {
 	TRACEF("Unmounting NOR file system\n");
-	struct list_node *curr_lnode;
-	struct norfs_inode *curr_inode;
-	struct list_node *temp_node;
+	status_t status;
 
+	mutex_acquire(&norfs_lock);
 	if (!fs_mounted) {
 		TRACEF("Filesystem not mounted.\n");
+		mutex_release(&norfs_lock);
 		return;
 	}
-	if (!list_is_empty(&inode_list)) {
-		list_for_every_safe(&inode_list, curr_lnode, temp_node) {
-			if (curr_lnode) {
-				curr_inode = containerof(curr_lnode, struct norfs_inode, lnode);
-				remove_inode(curr_inode);
-			}
-		}
+#if NORFS_GC_BACKGROUND
+	stop_gc_thread();
+#endif
+
+	flash_nor_begin(NORFS_BANK);
+	/* A checkpoint can't describe a block that's half collected. */
+	while (gc_block >= 0) {
+		status = gc_step(NORFS_GC_STEP_OBJECTS);
+		if (status)
+			break;
 	}
+	status = gc_block < 0 ? write_checkpoint() : ERR_BUSY;
+	if (status)
+		TRACEF("No checkpoint written, next mount scans.  Status: %d\n", status);
+	flash_nor_end(NORFS_BANK);
+
+	remove_all_inodes();
 	write_pointer = rand() % NORFS_NVRAM_SIZE;
 	total_remaining_space = NORFS_AVAILABLE_SPACE;
 	num_free_blocks = 0;
+	gc_block = -1;
 	for (uint8_t i = 0; i < NORFS_NUM_BLOCKS; i++) {
 		block_free[i] = false;
 	}
 	fs_mounted = false;
+	mutex_release(&norfs_lock);
 }
 
 void norfs_wipe_fs(void)
@@ -697,6 +697,45 @@ static bool test_wrapping(void)
 	END_TEST;
 }
 
+static bool test_remount_many_objects(void)
+{
+	BEGIN_TEST;
+	status_t status;
+	size_t bytes_read;
+	uint32_t val;
+
+	wipe_fs();
+	norfs_mount_fs(norfs_nvram_offset);
+
+	/* Enough keys to share hash buckets. */
+	for (uint32_t i = 0; i < 60; i++) {
+		val = i * 3;
+		status = norfs_put_obj(i, (unsigned char *)&val, sizeof(val), 0);
+		EXPECT_EQ(NO_ERROR, status, "Error putting object");
+	}
+	for (uint32_t i = 0; i < 60; i += 2) {
+		EXPECT_EQ(NO_ERROR, norfs_remove_obj(i), "Error removing object");
+	}
+
+	/* Remounting loads the inode table from the checkpoint. */
+	norfs_unmount_fs();
+	EXPECT_EQ(NO_ERROR, norfs_mount_fs(norfs_nvram_offset), "Error during mount");
+
+	for (uint32_t i = 0; i < 60; i++) {
+		status = norfs_read_obj(i, (unsigned char *)&val, sizeof(val),
+								&bytes_read, 0);
+		if (i % 2) {
+			EXPECT_EQ(NO_ERROR, status, "Object lost across remount");
+			EXPECT_EQ(i * 3, val, "Object not correct value");
+		} else {
+			EXPECT_EQ(ERR_NOT_FOUND, status, "Removed object back after remount");
+		}
+	}
+
+	wipe_fs();
+	END_TEST;
+}
+
 static void init_tests(void)
 {
 	platform_init();
@@ -715,4 +754,5 @@ RUN_TEST(test_total_remaining_space);
 RUN_TEST(test_thrash_fs);
 RUN_TEST(test_wrapping);
 RUN_TEST(test_overflow_filesystem);
+RUN_TEST(test_remount_many_objects);
 END_TEST_CASE(norfs_tests);
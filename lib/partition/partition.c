@@ -26,6 +26,9 @@
 #include <compiler.h>
 #include <stdlib.h>
 #include <arch.h>
+#include <malloc.h>
+#include <arch/defines.h>
+#include <kernel/event.h>
 #include <lib/bio.h>
 #include <lib/partition.h>
 
@@ -64,10 +67,50 @@ static status_t validate_mbr_partition(bdev_t *dev, const struct mbr_part *part)
 	return 0;
 }
 
+/* publish the partitions in the mbr held in buf, returns how many were published */
+static int publish_mbr(bdev_t *dev, const char *device, const uint8_t *buf)
+{
+	int i;
+	int count = 0;
+
+	/* look for the aa55 tag */
+	if (buf[510] != 0x55 || buf[511] != 0xaa)
+		return 0;
+
+	/* see if a partition table makes sense here */
+	struct mbr_part part[4];
+	memcpy(part, buf + 446, sizeof(part));
+
+#if LK_DEBUGLEVEL >= INFO
+	dprintf(INFO, "mbr partition table dump:\n");
+	for (i=0; i < 4; i++) {
+		dprintf(INFO, "\t%i: status 0x%hhx, type 0x%hhx, start 0x%x, len 0x%x\n", i, part[i].status, part[i].type, part[i].lba_start, part[i].lba_length);
+	}
+#endif
+
+	/* validate each of the partition entries */
+	for (i=0; i < 4; i++) {
+		if (validate_mbr_partition(dev, &part[i]) >= 0) {
+			// publish it
+			char subdevice[128];
+
+			sprintf(subdevice, "%sp%d", device, i);
+
+			int err = bio_publish_subdevice(device, subdevice, part[i].lba_start, part[i].lba_length);
+			if (err < 0) {
+				dprintf(INFO, "error publishing subdevice '%s'\n", subdevice);
+				continue;
+			}
+			count++;
+		}
+	}
+
+	return count;
+}
+
 int partition_publish(const char *device, off_t offset)
 {
 	int err = 0;
-	int count = 0;
 
 	// clear any partitions that may have already existed
 	partition_unpublish(device);
@@ -82,50 +125,78 @@ int partition_publish(const char *device, off_t offset)
 	STACKBUF_DMA_ALIGN(buf, dev->block_size);
 
 	/* sniff for MBR partition types */
-	do {
-		int i;
+	err = bio_read(dev, buf, offset, 512);
+	if (err >= 0)
+		err = publish_mbr(dev, device, buf);
 
-		err = bio_read(dev, buf, offset, 512);
-		if (err < 0)
-			goto err;
+	bio_close(dev);
 
-		/* look for the aa55 tag */
-		if (buf[510] != 0x55 || buf[511] != 0xaa)
-			break;
+	return err;
+}
 
-		/* see if a partition table makes sense here */
-		struct mbr_part part[4];
-		memcpy(part, buf + 446, sizeof(part));
+struct partition_scan {
+	const char *device;
+	bdev_t *dev;
+	uint8_t *buf;
+	bio_request_t req;
+	bool submitted;
+};
 
-#if LK_DEBUGLEVEL >= INFO
-		dprintf(INFO, "mbr partition table dump:\n");
-		for (i=0; i < 4; i++) {
-			dprintf(INFO, "\t%i: status 0x%hhx, type 0x%hhx, start 0x%x, len 0x%x\n", i, part[i].status, part[i].type, part[i].lba_start, part[i].lba_length);
+int partition_publish_devices(const char * const *devices, uint count, off_t offset)
+{
+	int total = 0;
+
+	struct partition_scan *scan = calloc(count, sizeof(struct partition_scan));
+	if (!scan)
+		return ERR_NO_MEMORY;
+
+	/* get every device's header read in flight before waiting on any of them,
+	 * so the disks seek and transfer at the same time
+	 */
+	for (uint i = 0; i < count; i++) {
+		struct partition_scan *s = &scan[i];
+
+		s->device = devices[i];
+		partition_unpublish(s->device);
+
+		s->dev = bio_open(s->device);
+		if (!s->dev) {
+			printf("partition_publish: unable to open device '%s'\n", s->device);
+			continue;
 		}
-#endif
 
-		/* validate each of the partition entries */
-		for (i=0; i < 4; i++) {
-			if (validate_mbr_partition(dev, &part[i]) >= 0) {
-				// publish it
-				char subdevice[128];
+		s->buf = memalign(CACHE_LINE, ROUNDUP(MAX(s->dev->block_size, 512U), CACHE_LINE));
+		if (!s->buf)
+			continue;
 
-				sprintf(subdevice, "%sp%d", device, i);
+		bio_request_init(&s->req, BIO_OP_READ, s->buf, offset, 512, NULL, NULL);
+		if (bio_submit(s->dev, &s->req) < 0) {
+			event_destroy(&s->req.event);
+			continue;
+		}
+		s->submitted = true;
+	}
 
-				err = bio_publish_subdevice(device, subdevice, part[i].lba_start, part[i].lba_length);
-				if (err < 0) {
-					dprintf(INFO, "error publishing subdevice '%s'\n", subdevice);
-					continue;
-				}
-				count++;
-			}
+	/* then publish them as the reads complete */
+	for (uint i = 0; i < count; i++) {
+		struct partition_scan *s = &scan[i];
+
+		if (s->submitted) {
+			ssize_t err = bio_wait(&s->req);
+			event_destroy(&s->req.event);
+
+			if (err == 512)
+				total += publish_mbr(s->dev, s->device, s->buf);
 		}
-	} while (0);
 
-	bio_close(dev);
+		free(s->buf);
+		if (s->dev)
+			bio_close(s->dev);
+	}
+
+	free(scan);
 
-err:
-	return (err < 0) ? err : count;
+	return total;
 }
 
 int partition_unpublish(const char *device)
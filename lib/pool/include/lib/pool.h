@@ -4,6 +4,12 @@
  * This is an efficient (constant-time allocation and freeing) allocator for objects of a fixed size
  * and alignment (typically, fixed type), based on a fixed-size object pool.
  *
+ * Allocation and freeing are lock-free, so a pool may be shared between threads, cpus and
+ * interrupt handlers without any external locking. The free list is a stack whose head packs the
+ * index of the top object with a tag that changes on every update, so a pop that raced with other
+ * pops and pushes can't mistake a recycled object for the one it started from. The tag takes half
+ * of a word, which also limits a pool to 2^16 - 1 objects on 32-bit targets.
+ *
  * The main API works with void* buffers and a couple of helper macros are used for a type-safe
  * (well, as far as C can go with type safety) "templatization" of the pool for a specific object
  * type.
@@ -57,7 +63,9 @@ __BEGIN_CDECLS
  */
 typedef struct {
     // Private:
-    void * next_free;
+    uintptr_t head;     // update tag | index + 1 of the first free object, 0 index if none
+    uint8_t * storage;
+    size_t object_size; // padded
 } pool_t;
 
 /**
@@ -114,6 +122,7 @@ void pool_init(pool_t * pool,
 
 /**
  * Allocate an object from the pool.
+ * Safe to call concurrently with other pool_alloc and pool_free calls on the same pool.
  * Returns NULL if all pool objects are currently allocated.
  * Otherwise, the return value is guarantee to be aligned at object_align and be at least of size
  * object_size.
@@ -122,6 +131,7 @@ void * pool_alloc(pool_t * pool);
 
 /**
  * Free an object previously allocated with pool_alloc.
+ * Safe to call concurrently with other pool_alloc and pool_free calls on the same pool.
  */
 void pool_free(pool_t * pool, void * object);
 
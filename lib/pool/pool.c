@@ -2,6 +2,17 @@
 
 #include <lib/pool.h>
 #include <assert.h>
+#include <stdbool.h>
+
+/* The low half of the head word is the index + 1 of the top object, the high half is a tag bumped
+ * on every update so that a stale compare-and-swap always fails. */
+#define POOL_INDEX_BITS (sizeof(uintptr_t) * 4)
+#define POOL_INDEX_MASK (((uintptr_t) 1 << POOL_INDEX_BITS) - 1)
+#define POOL_TAG_ONE ((uintptr_t) 1 << POOL_INDEX_BITS)
+
+static inline uintptr_t pool_next_head(uintptr_t head, uintptr_t index) {
+    return ((head + POOL_TAG_ONE) & ~POOL_INDEX_MASK) | index;
+}
 
 void pool_init(pool_t * pool,
                size_t object_size,
@@ -11,22 +22,39 @@ void pool_init(pool_t * pool,
     assert(pool);
     assert(!object_count || storage);
     assert((intptr_t) storage % POOL_STORAGE_ALIGN(object_size, object_align) == 0);
+    assert(object_count < POOL_INDEX_MASK);
+
+    pool->head = 0;
+    pool->storage = (uint8_t *) storage;
+    pool->object_size = POOL_PADDED_OBJECT_SIZE(object_size, object_align);
 
     size_t offset = 0;
     for (size_t i = 0; i < object_count; ++i) {
         pool_free(pool, (uint8_t *) storage + offset);
-        offset += POOL_PADDED_OBJECT_SIZE(object_size, object_align);
+        offset += pool->object_size;
     }
 }
 
 void * pool_alloc(pool_t * pool) {
     assert(pool);
 
-    void * result = pool->next_free;
-    if (!result) {
-        return NULL;
-    }
-    pool->next_free = *((void **) result);
+    uintptr_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    void * result;
+    uintptr_t next;
+
+    do {
+        uintptr_t index = head & POOL_INDEX_MASK;
+        if (!index) {
+            return NULL;
+        }
+        result = pool->storage + (index - 1) * pool->object_size;
+
+        // If another cpu takes this object first, its owner may be scribbling over the link as we
+        // read it. That's harmless, the tag will have moved on and the swap below fails.
+        next = pool_next_head(head, __atomic_load_n((uintptr_t *) result, __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, next, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
     return result;
 }
 
@@ -34,6 +62,16 @@ void pool_free(pool_t * pool, void * object) {
     assert(pool);
     assert(object);
 
-    *((void **) object) = pool->next_free;
-    pool->next_free = object;
+    size_t offset = (uint8_t *) object - pool->storage;
+    assert(offset % pool->object_size == 0);
+
+    uintptr_t index = offset / pool->object_size + 1;
+    uintptr_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    uintptr_t next;
+
+    do {
+        __atomic_store_n((uintptr_t *) object, head & POOL_INDEX_MASK, __ATOMIC_RELAXED);
+        next = pool_next_head(head, index);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, next, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
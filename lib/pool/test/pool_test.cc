@@ -2,6 +2,9 @@
 
 #include <gtest/gtest.h>
 
+#include <thread>
+#include <vector>
+
 #define DEFINE_DOUBLE_POOL_STORAGE(name, count) DEFINE_TYPED_POOL_STORAGE(double, name, count)
 #define DOUBLE_POOL_INIT(pool, count, storage) TYPED_POOL_INIT(double, pool, count, storage)
 #define DOUBLE_POOL_ALLOC(pool) TYPED_POOL_ALLOC(double, pool)
@@ -40,3 +43,42 @@ TEST(Pool, Basic) {
     EXPECT_NE(nullptr, d3);
     EXPECT_EQ(0, (intptr_t) d3 % __alignof(double));
 }
+
+TEST(Pool, Concurrent) {
+    const int kObjects = 64;
+    const int kThreads = 4;
+    const int kIterations = 100000;
+
+    pool_t pool;
+    DEFINE_DOUBLE_POOL_STORAGE(storage, kObjects);
+    DOUBLE_POOL_INIT(&pool, kObjects, storage);
+
+    // Each thread repeatedly grabs a handful of objects, marks them as its own and checks nobody
+    // else got handed the same object before giving them back.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&pool, t, kIterations] {
+            for (int i = 0; i < kIterations; ++i) {
+                double * d[4];
+                for (int j = 0; j < 4; ++j) {
+                    d[j] = DOUBLE_POOL_ALLOC(&pool);
+                    ASSERT_NE(nullptr, d[j]);
+                    *d[j] = t * 4 + j;
+                }
+                for (int j = 0; j < 4; ++j) {
+                    EXPECT_EQ(t * 4 + j, *d[j]);
+                    DOUBLE_POOL_FREE(&pool, d[j]);
+                }
+            }
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    // Everything should have made it back.
+    for (int i = 0; i < kObjects; ++i) {
+        EXPECT_NE(nullptr, DOUBLE_POOL_ALLOC(&pool));
+    }
+    EXPECT_EQ(nullptr, DOUBLE_POOL_ALLOC(&pool));
+}
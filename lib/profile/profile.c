@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/profile.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+
+#define LOCAL_TRACE 0
+
+/* bumped whenever the dump output changes */
+#define PROFILE_DUMP_VERSION 1
+
+/* buckets looked at before a sample with a new stack is dropped */
+#define PROFILE_PROBES 8
+
+STATIC_ASSERT((PROFILE_BUCKETS & (PROFILE_BUCKETS - 1)) == 0);
+
+struct profile_bucket {
+	uint count;
+	uint depth;
+	uintptr_t pc[PROFILE_MAX_DEPTH];
+};
+
+/* only ever touched by its own cpu while sampling is enabled */
+struct profile_cpu {
+	timer_t timer;
+	struct profile_bucket *buckets;
+	ulong samples;
+	ulong dropped;
+} __CPU_ALIGN;
+
+static struct profile_cpu profile_cpus[SMP_MAX_CPUS];
+
+/* serializes start, stop and dump */
+static mutex_t profile_lock = MUTEX_INITIAL_VALUE(profile_lock);
+static bool profile_running;
+static bool profile_backtrace;
+static uint profile_hz;
+
+static volatile bool profile_enabled;
+volatile bool profile_pending[SMP_MAX_CPUS];
+
+#define PROFILE_ALL_CPUS MP_CPU_MASK_ALL
+
+/* the timer fires inside an irq, the platform's exit path picks the request up
+ * with the interrupted frame in hand */
+static enum handler_return profile_timer(timer_t *t, lk_time_t now, void *arg)
+{
+	profile_pending[arch_curr_cpu_num()] = true;
+
+	return INT_NO_RESCHEDULE;
+}
+
+/* follow {next fp, return address} frame records, the layout x86 and arm64 use.
+ * the interrupted thread's stack bounds every load so a bad fp just ends the walk. */
+static uint profile_walk(uintptr_t *pcs, uintptr_t fp)
+{
+	thread_t *t = get_current_thread();
+	uintptr_t lo = (uintptr_t)t->stack;
+	uintptr_t hi = lo + t->stack_size;
+	uint depth = 1;
+
+	while (depth < PROFILE_MAX_DEPTH) {
+		if (!lo || fp < lo || fp + 2 * sizeof(uintptr_t) > hi || (fp & (sizeof(uintptr_t) - 1)))
+			break;
+
+		const uintptr_t *frame = (const uintptr_t *)fp;
+		if (!frame[1])
+			break;
+		pcs[depth++] = frame[1];
+
+		/* stacks grow down, the caller's record is always above ours */
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+
+	return depth;
+}
+
+static uint profile_hash(const uintptr_t *pcs, uint depth)
+{
+	uintptr_t h = 0;
+
+	for (uint i = 0; i < depth; i++)
+		h = h * 31 + (pcs[i] >> 1);
+
+	return (uint)(h ^ (h >> 16));
+}
+
+void profile_sample(uintptr_t pc, uintptr_t fp)
+{
+	DEBUG_ASSERT(arch_ints_disabled());
+
+	if (!profile_enabled)
+		return;
+
+	struct profile_cpu *c = &profile_cpus[arch_curr_cpu_num()];
+	uintptr_t pcs[PROFILE_MAX_DEPTH];
+
+	pcs[0] = pc;
+	uint depth = (profile_backtrace && fp) ? profile_walk(pcs, fp) : 1;
+	uint h = profile_hash(pcs, depth);
+
+	c->samples++;
+
+	for (uint i = 0; i < PROFILE_PROBES; i++) {
+		struct profile_bucket *b = &c->buckets[(h + i) & (PROFILE_BUCKETS - 1)];
+
+		if (b->count == 0) {
+			memcpy(b->pc, pcs, depth * sizeof(uintptr_t));
+			b->depth = depth;
+			b->count = 1;
+			return;
+		}
+		if (b->depth == depth && !memcmp(b->pc, pcs, depth * sizeof(uintptr_t))) {
+			b->count++;
+			return;
+		}
+	}
+
+	c->dropped++;
+}
+
+static void profile_start_cpu(void *arg)
+{
+	struct profile_cpu *c = &profile_cpus[arch_curr_cpu_num()];
+
+	timer_initialize(&c->timer);
+	timer_set_periodic_hires(&c->timer, 1000000 / profile_hz, &profile_timer, NULL);
+}
+
+static void profile_stop_cpu(void *arg)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	timer_cancel(&profile_cpus[cpu].timer);
+	profile_pending[cpu] = false;
+}
+
+static void profile_nop(void *arg)
+{
+}
+
+/* the cross cpu call only runs once each cpu is out of whatever irq it was in,
+ * so nobody is in the middle of a sample when this returns */
+static void profile_quiesce(void)
+{
+	profile_enabled = false;
+	mp_sync_exec(PROFILE_ALL_CPUS, &profile_nop, NULL);
+}
+
+status_t profile_start(uint hz, bool backtrace)
+{
+	if (hz == 0 || hz > 100000)
+		return ERR_INVALID_ARGS;
+
+	mutex_acquire(&profile_lock);
+
+	if (profile_running) {
+		mutex_release(&profile_lock);
+		return ERR_ALREADY_STARTED;
+	}
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		struct profile_cpu *c = &profile_cpus[i];
+
+		if (!c->buckets) {
+			c->buckets = malloc(PROFILE_BUCKETS * sizeof(struct profile_bucket));
+			if (!c->buckets) {
+				mutex_release(&profile_lock);
+				return ERR_NO_MEMORY;
+			}
+		}
+		memset(c->buckets, 0, PROFILE_BUCKETS * sizeof(struct profile_bucket));
+		c->samples = 0;
+		c->dropped = 0;
+	}
+
+	LTRACEF("hz %u, backtrace %d\n", hz, backtrace);
+
+	profile_hz = hz;
+	profile_backtrace = backtrace;
+	profile_running = true;
+	profile_enabled = true;
+	mp_sync_exec(PROFILE_ALL_CPUS, &profile_start_cpu, NULL);
+
+	mutex_release(&profile_lock);
+
+	return NO_ERROR;
+}
+
+void profile_stop(void)
+{
+	mutex_acquire(&profile_lock);
+
+	if (profile_running) {
+		profile_quiesce();
+		mp_sync_exec(PROFILE_ALL_CPUS, &profile_stop_cpu, NULL);
+		profile_running = false;
+	}
+
+	mutex_release(&profile_lock);
+}
+
+void profile_dump(void)
+{
+	mutex_acquire(&profile_lock);
+
+	if (profile_running)
+		profile_quiesce();
+
+	printf("profile begin %u %u %u %u\n", PROFILE_DUMP_VERSION, SMP_MAX_CPUS, profile_hz, PROFILE_MAX_DEPTH);
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		const struct profile_cpu *c = &profile_cpus[i];
+
+		if (!c->buckets)
+			continue;
+
+		printf("profile c %u %lu %lu\n", i, c->samples, c->dropped);
+		for (uint j = 0; j < PROFILE_BUCKETS; j++) {
+			const struct profile_bucket *b = &c->buckets[j];
+
+			if (b->count == 0)
+				continue;
+
+			printf("profile s %u %u", i, b->count);
+			for (uint k = 0; k < b->depth; k++)
+				printf(" 0x%lx", (unsigned long)b->pc[k]);
+			printf("\n");
+		}
+	}
+	printf("profile end\n");
+
+	if (profile_running)
+		profile_enabled = true;
+
+	mutex_release(&profile_lock);
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_profile(int argc, const cmd_args *argv)
+{
+	if (argc < 2) {
+usage:
+		printf("usage:\n");
+		printf("%s start [hz] [bt] : sample every cpu, default %u hz, bt walks frame pointers\n",
+		       argv[0].str, PROFILE_DEFAULT_HZ);
+		printf("%s stop            : stop sampling\n", argv[0].str);
+		printf("%s dump            : dump the samples for scripts/profile2txt.py\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	if (!strcmp(argv[1].str, "start")) {
+		uint hz = PROFILE_DEFAULT_HZ;
+		bool bt = false;
+
+		for (int i = 2; i < argc; i++) {
+			if (!strcmp(argv[i].str, "bt"))
+				bt = true;
+			else
+				hz = argv[i].u;
+		}
+
+		status_t err = profile_start(hz, bt);
+		if (err < 0) {
+			printf("error %d starting profiler\n", err);
+			return err;
+		}
+	} else if (!strcmp(argv[1].str, "stop")) {
+		profile_stop();
+
+		ulong samples = 0, dropped = 0;
+		for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+			samples += profile_cpus[i].samples;
+			dropped += profile_cpus[i].dropped;
+		}
+		printf("%lu samples, %lu dropped\n", samples, dropped);
+	} else if (!strcmp(argv[1].str, "dump")) {
+		profile_dump();
+	} else {
+		goto usage;
+	}
+
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("profile", "sampling profiler", &cmd_profile)
+STATIC_COMMAND_END(profile);
+
+#endif
+
+// vim: set noexpandtab:
@@ -0,0 +1,14 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/profile.c
+
+# backtraces in samples need frame pointers all the way down
+ifeq ($(PROFILE_FRAME_POINTERS),1)
+GLOBAL_COMPILEFLAGS += -fno-omit-frame-pointer
+GLOBAL_DEFINES += PROFILE_FRAME_POINTERS=1
+endif
+
+include make/module.mk
@@ -573,6 +573,7 @@ static status_t ptable_allocate_at(off_t _offset, uint64_t* plength)
 status_t ptable_scan(const char* bdev_name, uint64_t offset)
 {
     ssize_t err;
+    uint8_t *buf = NULL;
     DEBUG_ASSERT(bdev_name);
 
     ptable_reset();
@@ -584,15 +585,29 @@ status_t ptable_scan(const char* bdev_name, uint64_t offset)
         BAIL(ERR_NOT_FOUND);
     }
 
-    /* validate the header */
-    struct ptable_header header;
+    /* the whole table fits in a block, so pull it in with a single read */
+    if (offset >= (uint64_t)ptable.bdev->total_size)
+        BAIL(ERR_NOT_FOUND);
+    size_t read_len = MIN(ptable.bdev->block_size, ptable.bdev->total_size - offset);
+    if (read_len < sizeof(struct ptable_header))
+        BAIL(ERR_NOT_FOUND);
 
-    err = bio_read(ptable.bdev, &header, offset, sizeof(header));
-    if (err < (ssize_t)sizeof(header)) {
-        LTRACEF("failed to read partition table header @%llu (%ld)\n", offset, err);
+    buf = malloc(read_len);
+    if (!buf)
+        BAIL(ERR_NO_MEMORY);
+
+    err = bio_read(ptable.bdev, buf, offset, read_len);
+    if (err < (ssize_t)read_len) {
+        LTRACEF("failed to read partition table @%llu (%ld)\n", offset, err);
+        if (err >= 0)
+            err = ERR_IO;
         goto bailout;
     }
 
+    /* validate the header */
+    struct ptable_header header;
+    memcpy(&header, buf, sizeof(header));
+
     if (LOCAL_TRACE)
         hexdump(&header, sizeof(struct ptable_header));
 
@@ -604,7 +619,7 @@ status_t ptable_scan(const char* bdev_name, uint64_t offset)
         LTRACEF("total length too short\n");
         BAIL(ERR_NOT_FOUND);
     }
-    if (header.total_length > ptable.bdev->block_size) {
+    if (header.total_length > read_len) {
         LTRACEF("total length too long\n");
         BAIL(ERR_NOT_FOUND);
     }
@@ -613,25 +628,24 @@ status_t ptable_scan(const char* bdev_name, uint64_t offset)
         BAIL(ERR_NOT_FOUND);
     }
 
-    /* start a crc check by calculating the header */
+    /* check the crc over the header, with the crc field zeroed, and all of the entries
+     * before publishing anything out of it
+     */
     uint32_t crc;
-    uint32_t saved_crc = header.crc32;
     header.crc32 = 0;
     crc = crc32(0, (void *)&header, sizeof(header));
-    header.crc32 = saved_crc;
-    bool found_ptable = false;
+    crc = crc32(crc, buf + sizeof(header), header.total_length - sizeof(header));
+    header.crc32 = ((const struct ptable_header *)buf)->crc32;
+
+    if (header.crc32 != crc) {
+        LTRACEF("failed crc check (0x%08x != 0x%08x)\n", header.crc32, crc);
+        BAIL(ERR_CRC_FAIL);
+    }
 
-    /* read the entries into memory */
-    off_t off = offset + sizeof(struct ptable_header);
+    bool found_ptable = false;
     for (uint i = 0; i < PTABLE_HEADER_NUM_ENTRIES(header); i++) {
         struct ptable_entry entry;
-
-        /* read the next entry off the device */
-        err = bio_read(ptable.bdev, &entry, off, sizeof(entry));
-        if (err < 0) {
-            LTRACEF("failed to read entry\n");
-            goto bailout;
-        }
+        memcpy(&entry, buf + sizeof(header) + i * sizeof(entry), sizeof(entry));
 
         LTRACEF("looking at entry:\n");
         if (LOCAL_TRACE)
@@ -653,17 +667,6 @@ status_t ptable_scan(const char* bdev_name, uint64_t offset)
                 BAIL(ERR_BAD_STATE);
             }
         }
-
-        /* append the crc */
-        crc = crc32(crc, (void *)&entry, sizeof(entry));
-
-        /* Move on to the next entry */
-        off += sizeof(struct ptable_entry);
-    }
-
-    if (header.crc32 != crc) {
-        LTRACEF("failed crc check at the end (0x%08x != 0x%08x)\n", header.crc32, crc);
-        BAIL(ERR_CRC_FAIL);
     }
 
     if (!found_ptable) {
@@ -674,6 +677,8 @@ status_t ptable_scan(const char* bdev_name, uint64_t offset)
     err = NO_ERROR;
 
 bailout:
+    free(buf);
+
     if (err < 0)
         ptable_reset();
 
@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/slab.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <pow2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/shrinker.h>
+#include <lib/heap.h>
+#include <lk/init.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* a slab is sized to hold at least this many objects, up to SLAB_MAX_SIZE */
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_SIZE (64 * 1024)
+
+/* empty slabs kept around per cache before handing pages back */
+#define SLAB_MAX_EMPTY 1
+
+#define SLAB_DEFAULT_ALIGN 16
+
+/* a slab header sits at the start of its slab, which is aligned to its size */
+struct slab {
+	struct list_node node;
+	void *free_list; /* linked through the first word of every free object */
+	uint inuse;
+#if WITH_KERNEL_VM
+	vm_page_t *pages;
+#endif
+};
+
+static struct list_node slab_cache_list = LIST_INITIAL_VALUE(slab_cache_list);
+static spin_lock_t slab_cache_list_lock = SPIN_LOCK_INITIAL_VALUE;
+
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t size, size_t align, slab_ctor_t ctor)
+{
+	DEBUG_ASSERT(cache);
+
+	memset(cache, 0, sizeof(*cache));
+	list_clear_node(&cache->node);
+	cache->name = name;
+	cache->size = size;
+	cache->align = align;
+	cache->ctor = ctor;
+	spin_lock_init(&cache->lock);
+	list_initialize(&cache->partial_list);
+	list_initialize(&cache->full_list);
+	list_initialize(&cache->empty_list);
+}
+
+/* work out the slab geometry on first use, called with the cache lock held */
+static status_t slab_cache_setup(slab_cache_t *cache)
+{
+	size_t align = cache->align ? cache->align : SLAB_DEFAULT_ALIGN;
+
+	DEBUG_ASSERT(ispow2(align));
+
+	cache->obj_size = ROUNDUP(MAX(cache->size, sizeof(void *)), align);
+	cache->obj_offset = ROUNDUP(sizeof(struct slab), align);
+
+	cache->slab_size = PAGE_SIZE;
+	while ((cache->slab_size - cache->obj_offset) / cache->obj_size < SLAB_MIN_OBJECTS &&
+	        cache->slab_size < SLAB_MAX_SIZE)
+		cache->slab_size *= 2;
+
+	if (cache->slab_size <= cache->obj_offset ||
+	        (cache->slab_size - cache->obj_offset) / cache->obj_size == 0) {
+		TRACEF("cache %s: object size %zu too large\n", cache->name, cache->size);
+		return ERR_TOO_BIG;
+	}
+	cache->objs_per_slab = (cache->slab_size - cache->obj_offset) / cache->obj_size;
+	cache->setup = true;
+
+	spin_lock(&slab_cache_list_lock);
+	list_add_tail(&slab_cache_list, &cache->node);
+	spin_unlock(&slab_cache_list_lock);
+
+	LTRACEF("cache %s: obj size %zu, slab size %zu, %u objects per slab\n",
+	        cache->name, cache->obj_size, cache->slab_size, cache->objs_per_slab);
+
+	return NO_ERROR;
+}
+
+/* grab memory for a new slab and thread its objects onto the slab's free list */
+static struct slab *slab_create(slab_cache_t *cache)
+{
+	struct slab *slab;
+
+#if WITH_KERNEL_VM
+	struct list_node pages = LIST_INITIAL_VALUE(pages);
+	uint count = cache->slab_size / PAGE_SIZE;
+	paddr_t pa;
+
+	if (pmm_alloc_contiguous(count, log2_uint(cache->slab_size), &pa, &pages) < count)
+		return NULL;
+
+	slab = paddr_to_kvaddr(pa);
+	slab->pages = list_peek_head_type(&pages, vm_page_t, node);
+#else
+	slab = heap_alloc(cache->slab_size, cache->slab_size);
+	if (!slab)
+		return NULL;
+#endif
+
+	list_clear_node(&slab->node);
+	slab->inuse = 0;
+	slab->free_list = NULL;
+
+	uint8_t *obj = (uint8_t *)slab + cache->obj_offset + (cache->objs_per_slab - 1) * cache->obj_size;
+	for (uint i = 0; i < cache->objs_per_slab; i++) {
+		*(void **)obj = slab->free_list;
+		slab->free_list = obj;
+		obj -= cache->obj_size;
+	}
+
+	return slab;
+}
+
+static void slab_destroy(slab_cache_t *cache, struct slab *slab)
+{
+	DEBUG_ASSERT(slab->inuse == 0);
+
+#if WITH_KERNEL_VM
+	/* the pages of a contiguous run sit next to each other in the arena's page array */
+	struct list_node pages = LIST_INITIAL_VALUE(pages);
+	vm_page_t *p = slab->pages;
+	for (uint i = 0; i < cache->slab_size / PAGE_SIZE; i++)
+		list_add_tail(&pages, &p[i].node);
+	pmm_free(&pages);
+#else
+	heap_free(slab);
+#endif
+}
+
+static inline struct slab *obj_to_slab(slab_cache_t *cache, void *obj)
+{
+	struct slab *slab = (struct slab *)ROUNDDOWN((uintptr_t)obj, cache->slab_size);
+
+	DEBUG_ASSERT(((uintptr_t)obj - (uintptr_t)slab) >= cache->obj_offset);
+	DEBUG_ASSERT(((uintptr_t)obj - (uintptr_t)slab - cache->obj_offset) % cache->obj_size == 0);
+
+	return slab;
+}
+
+/* pop an object off the slabs, called with the cache lock held */
+static void *slab_take(slab_cache_t *cache)
+{
+	struct slab *slab = list_peek_head_type(&cache->partial_list, struct slab, node);
+	if (!slab) {
+		slab = list_remove_head_type(&cache->empty_list, struct slab, node);
+		if (!slab)
+			return NULL;
+		cache->empty_count--;
+		list_add_head(&cache->partial_list, &slab->node);
+	}
+
+	void *obj = slab->free_list;
+	DEBUG_ASSERT(obj);
+	slab->free_list = *(void **)obj;
+	slab->inuse++;
+
+	if (slab->inuse == cache->objs_per_slab) {
+		list_delete(&slab->node);
+		list_add_head(&cache->full_list, &slab->node);
+	}
+
+	cache->slab_allocs++;
+	return obj;
+}
+
+/* push an object back on its slab, called with the cache lock held */
+static void slab_put(slab_cache_t *cache, void *obj)
+{
+	struct slab *slab = obj_to_slab(cache, obj);
+
+	DEBUG_ASSERT(slab->inuse > 0);
+
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+
+	if (slab->inuse == cache->objs_per_slab) {
+		list_delete(&slab->node);
+		list_add_head(&cache->partial_list, &slab->node);
+	}
+	if (--slab->inuse == 0) {
+		list_delete(&slab->node);
+		list_add_head(&cache->empty_list, &slab->node);
+		cache->empty_count++;
+	}
+
+	cache->slab_frees++;
+}
+
+static void *slab_alloc_slow(slab_cache_t *cache)
+{
+	struct list_node reap = LIST_INITIAL_VALUE(reap);
+	spin_lock_saved_state_t state;
+	struct slab *slab;
+	void *obj;
+
+	for (;;) {
+		spin_lock_irqsave(&cache->lock, state);
+
+		if (!cache->setup && slab_cache_setup(cache) < 0) {
+			spin_unlock_irqrestore(&cache->lock, state);
+			return NULL;
+		}
+
+		obj = slab_take(cache);
+		if (obj) {
+			/* top up this cpu's magazine while we hold the lock */
+			struct slab_magazine *mag = &cache->mag[arch_curr_cpu_num()];
+			while (mag->count < SLAB_MAGAZINE_SIZE / 2) {
+				void *extra = slab_take(cache);
+				if (!extra)
+					break;
+				mag->objs[mag->count++] = extra;
+			}
+			mag->refills++;
+
+			/* slab_free can't block, so surplus empty slabs are handed back from here */
+			while (cache->empty_count > SLAB_MAX_EMPTY) {
+				slab = list_remove_tail_type(&cache->empty_list, struct slab, node);
+				list_add_head(&reap, &slab->node);
+				cache->empty_count--;
+				cache->slab_count--;
+			}
+
+			spin_unlock_irqrestore(&cache->lock, state);
+			break;
+		}
+
+		spin_unlock_irqrestore(&cache->lock, state);
+
+		/* grow by a slab, the page allocator may block */
+		slab = slab_create(cache);
+		if (!slab)
+			return NULL;
+
+		spin_lock_irqsave(&cache->lock, state);
+		list_add_head(&cache->empty_list, &slab->node);
+		cache->empty_count++;
+		cache->slab_count++;
+		spin_unlock_irqrestore(&cache->lock, state);
+	}
+
+	while ((slab = list_remove_head_type(&reap, struct slab, node)))
+		slab_destroy(cache, slab);
+
+	return obj;
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+	spin_lock_saved_state_t state;
+	void *obj = NULL;
+
+	DEBUG_ASSERT(cache);
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	struct slab_magazine *mag = &cache->mag[arch_curr_cpu_num()];
+	if (mag->count > 0) {
+		obj = mag->objs[--mag->count];
+		mag->hits++;
+	}
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	if (!obj) {
+		obj = slab_alloc_slow(cache);
+		if (!obj)
+			return NULL;
+	}
+
+	if (cache->ctor)
+		cache->ctor(obj);
+
+	return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj)
+{
+	spin_lock_saved_state_t state;
+
+	DEBUG_ASSERT(cache);
+
+	if (!obj)
+		return;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	struct slab_magazine *mag = &cache->mag[arch_curr_cpu_num()];
+	if (mag->count == SLAB_MAGAZINE_SIZE) {
+		/* spill the older half back to the slabs. the object being freed stays
+		 * on this cpu, so a thread freeing its own structure on the way out
+		 * can't have it handed to another cpu before it switches away.
+		 */
+		spin_lock(&cache->lock);
+		for (uint i = 0; i < SLAB_MAGAZINE_SIZE / 2; i++)
+			slab_put(cache, mag->objs[i]);
+		spin_unlock(&cache->lock);
+
+		memmove(&mag->objs[0], &mag->objs[SLAB_MAGAZINE_SIZE / 2],
+		        (SLAB_MAGAZINE_SIZE / 2) * sizeof(void *));
+		mag->count -= SLAB_MAGAZINE_SIZE / 2;
+		mag->spills++;
+	}
+	mag->objs[mag->count++] = obj;
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* caches are never taken off the list, so it can be walked a cache at a time */
+static slab_cache_t *next_cache(slab_cache_t *cache)
+{
+	spin_lock_saved_state_t state;
+
+	spin_lock_irqsave(&slab_cache_list_lock, state);
+	if (cache)
+		cache = list_next_type(&slab_cache_list, &cache->node, slab_cache_t, node);
+	else
+		cache = list_peek_head_type(&slab_cache_list, slab_cache_t, node);
+	spin_unlock_irqrestore(&slab_cache_list_lock, state);
+
+	return cache;
+}
+
+static size_t slab_shrinker_count(shrinker_t *s)
+{
+	size_t bytes = 0;
+
+	for (slab_cache_t *cache = next_cache(NULL); cache; cache = next_cache(cache))
+		bytes += (size_t)cache->empty_count * cache->slab_size;
+
+	return bytes;
+}
+
+/*
+ * Hand empty slabs back until target is met. This cpu's magazine goes back to
+ * the slabs first, which may empty a few more. The other cpus' magazines are
+ * only touched from their own cpu, so they're left alone.
+ */
+static size_t slab_shrinker_scan(shrinker_t *s, size_t target)
+{
+	size_t freed = 0;
+
+	for (slab_cache_t *cache = next_cache(NULL); cache && freed < target; cache = next_cache(cache)) {
+		struct list_node reap = LIST_INITIAL_VALUE(reap);
+		spin_lock_saved_state_t state;
+		struct slab *slab;
+
+		spin_lock_irqsave(&cache->lock, state);
+		struct slab_magazine *mag = &cache->mag[arch_curr_cpu_num()];
+		while (mag->count > 0)
+			slab_put(cache, mag->objs[--mag->count]);
+
+		while (freed < target && (slab = list_remove_tail_type(&cache->empty_list, struct slab, node))) {
+			list_add_head(&reap, &slab->node);
+			cache->empty_count--;
+			cache->slab_count--;
+			freed += cache->slab_size;
+		}
+		spin_unlock_irqrestore(&cache->lock, state);
+
+		while ((slab = list_remove_head_type(&reap, struct slab, node)))
+			slab_destroy(cache, slab);
+	}
+
+	return freed;
+}
+
+static shrinker_t slab_shrinker = SHRINKER_INITIAL_VALUE("slab", 0, &slab_shrinker_count, &slab_shrinker_scan, NULL);
+
+static void slab_init(uint level)
+{
+	shrinker_register(&slab_shrinker);
+}
+
+LK_INIT_HOOK(slab, &slab_init, LK_INIT_LEVEL_HEAP);
+
+#if LK_DEBUGLEVEL > 1
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+static int cmd_slab(int argc, const cmd_args *argv);
+
+STATIC_COMMAND_START
+STATIC_COMMAND("slab", "slab object cache stats", &cmd_slab)
+STATIC_COMMAND_END(slab);
+
+static int cmd_slab(int argc, const cmd_args *argv)
+{
+	spin_lock_saved_state_t state;
+	slab_cache_t *cache;
+
+	printf("%-16s %6s %6s %5s %5s %8s %8s %8s %10s\n",
+	       "name", "objsz", "slabsz", "slabs", "empty", "inuse", "cached", "refills", "mag hits");
+
+	spin_lock_irqsave(&slab_cache_list_lock, state);
+	list_for_every_entry(&slab_cache_list, cache, slab_cache_t, node) {
+		ulong cached = 0, hits = 0, refills = 0;
+		for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+			cached += cache->mag[i].count;
+			hits += cache->mag[i].hits;
+			refills += cache->mag[i].refills;
+		}
+
+		printf("%-16s %6zu %6zu %5u %5u %8lu %8lu %8lu %10lu\n",
+		       cache->name, cache->obj_size, cache->slab_size, cache->slab_count, cache->empty_count,
+		       cache->slab_allocs - cache->slab_frees - cached, cached, refills, hits);
+	}
+	spin_unlock_irqrestore(&slab_cache_list_lock, state);
+
+	return 0;
+}
+
+#endif
+#endif
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <list.h>
+#include <lib/arena.h>
 #include <lib/bio.h>
 #include <lib/cksum.h>
 #include <lib/sysparam.h>
@@ -36,11 +37,21 @@
 
 /* implementation of system parameter block, stored on a block device */
 /* sysparams are simple name/value pairs, with the data unstructured */
+/*
+ * Writes append the changes to the end of the block where there's still
+ * erased space, and only rewrite the whole block once it fills up. So a
+ * later copy of a name overrides an earlier one, and a removed param leaves
+ * a deleted entry behind.
+ */
 #define LOCAL_TRACE 0
 
 #define SYSPARAM_MAGIC 'SYSP'
 
 #define SYSPARAM_FLAG_LOCK 0x1
+#define SYSPARAM_FLAG_DELETED 0x2
+
+/* buckets in the name index, a power of 2 */
+#define SYSPARAM_HASH_SIZE 32
 
 struct sysparam_phys {
 	uint32_t magic;
@@ -61,6 +72,10 @@ struct sysparam_phys {
 struct sysparam {
 	struct list_node node;
 
+	/* name index chain */
+	struct sysparam *hash_next;
+	uint32_t hash;
+
 	uint32_t flags;
 
 	char *name;
@@ -70,22 +85,44 @@ struct sysparam {
 
 	/* in memory size to hold this structure, the name string, and the data */
 	size_t memlen;
+
+	/* came out of params.arena rather than the heap */
+	bool arena;
+
+	/* changed since the last write, goes out with the next append */
+	bool unsaved;
 };
 
 /* global state */
 static struct {
 	struct list_node list;
+	struct sysparam *hash[SYSPARAM_HASH_SIZE];
+
+	/* removed params whose deleted entries haven't been written yet */
+	struct list_node removed;
 
 	bool dirty;
 
 	bdev_t *bdev;
 	off_t offset;
 	size_t len;
+
+	/* the bdev's memory map while we hold it, scanned params point their data into it */
+	void *map;
+
+	/* end of the last entry in the block, and whether everything after it is erased */
+	size_t end;
+	bool append_ok;
+
+	/* memory for the params read in by sysparam_scan, dropped all at once on reload */
+	arena_t arena;
 } params;
 
 static void sysparam_init(uint level)
 {
 	list_initialize(&params.list);
+	list_initialize(&params.removed);
+	arena_init(&params.arena, 0);
 }
 
 LK_INIT_HOOK(sysparam, &sysparam_init, LK_INIT_LEVEL_THREADING);
@@ -116,18 +153,85 @@ static inline uint32_t sysparam_crc32(const struct sysparam_phys *sp)
 	return sum;
 }
 
-static struct sysparam *sysparam_create(const char *name, size_t namelen, const void *data, size_t datalen, uint32_t flags)
+static void *sysparam_alloc(size_t len, bool arena)
+{
+	if (arena)
+		return arena_alloc(&params.arena, len, 0);
+	return malloc(len);
+}
+
+static void sysparam_free(struct sysparam *param)
+{
+	if (param->arena)
+		return;
+
+	free(param->name);
+	free(param->data);
+	free(param);
+}
+
+/* FNV-1a */
+static uint32_t sysparam_hash(const char *name, size_t namelen)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < namelen; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void sysparam_index_add(struct sysparam *param)
+{
+	struct sysparam **bucket = &params.hash[param->hash % SYSPARAM_HASH_SIZE];
+
+	param->hash_next = *bucket;
+	*bucket = param;
+}
+
+static void sysparam_index_remove(struct sysparam *param)
+{
+	struct sysparam **p = &params.hash[param->hash % SYSPARAM_HASH_SIZE];
+
+	while (*p != param) {
+		DEBUG_ASSERT(*p);
+		p = &(*p)->hash_next;
+	}
+	*p = param->hash_next;
+}
+
+static void sysparam_insert(struct sysparam *param)
+{
+	list_add_tail(&params.list, &param->node);
+	sysparam_index_add(param);
+}
+
+static void sysparam_unlink(struct sysparam *param)
 {
-	struct sysparam *param = malloc(sizeof(struct sysparam));
+	list_delete(&param->node);
+	sysparam_index_remove(param);
+}
+
+/* the struct and its name, data is filled in by the caller */
+static struct sysparam *sysparam_create_name(const char *name, size_t namelen, uint32_t flags, bool arena)
+{
+	struct sysparam *param = sysparam_alloc(sizeof(struct sysparam), arena);
 	if (!param)
 		return NULL;
 
+	param->hash_next = NULL;
+	param->hash = sysparam_hash(name, namelen);
 	param->flags = flags;
 	param->memlen = sizeof(struct sysparam);
+	param->arena = arena;
+	param->unsaved = false;
 
-	param->name = malloc(namelen + 1);
+	param->name = sysparam_alloc(namelen + 1, arena);
 	if (!param->name) {
-		free(param);
+		if (!arena)
+			free(param);
 		return NULL;
 	}
 	param->memlen += namelen + 1;
@@ -135,12 +239,26 @@ static struct sysparam *sysparam_create(const char *name, size_t namelen, const
 	memcpy(param->name, name, namelen);
 	param->name[namelen] = '\0';
 
+	param->datalen = 0;
+	param->data = NULL;
+
+	return param;
+}
+
+static struct sysparam *sysparam_create(const char *name, size_t namelen, const void *data, size_t datalen, uint32_t flags, bool arena)
+{
+	struct sysparam *param = sysparam_create_name(name, namelen, flags, arena);
+	if (!param)
+		return NULL;
+
 	param->datalen = datalen;
 	size_t alloclen = ROUNDUP(datalen, 4); /* allocate a multiple of 4 for padding purposes */
-	param->data = malloc(alloclen);
+	param->data = sysparam_alloc(alloclen, arena);
 	if (!param->data) {
-		free(param->name);
-		free(param);
+		if (!arena) {
+			free(param->name);
+			free(param);
+		}
 		return NULL;
 	}
 	param->memlen += alloclen;
@@ -153,20 +271,42 @@ static struct sysparam *sysparam_create(const char *name, size_t namelen, const
 
 static struct sysparam *sysparam_read_phys(const struct sysparam_phys *sp)
 {
-	return sysparam_create((const char *)sp->namedata, sp->namelen, sp->namedata + ROUNDUP(sp->namelen, 4), sp->datalen, sp->flags);
+	const uint8_t *data = sp->namedata + ROUNDUP(sp->namelen, 4);
+
+	if (!params.map)
+		return sysparam_create((const char *)sp->namedata, sp->namelen, data, sp->datalen, sp->flags, true);
+
+	/* the data stays where it is in the memory map, only the name gets copied */
+	struct sysparam *param = sysparam_create_name((const char *)sp->namedata, sp->namelen, sp->flags, true);
+	if (!param)
+		return NULL;
+
+	param->datalen = sp->datalen;
+	param->data = (void *)data;
+
+	return param;
 }
 
 static struct sysparam *sysparam_find(const char *name)
 {
-	struct sysparam *param;
-	list_for_every_entry(&params.list, param, struct sysparam, node) {
-		if (strcmp(name, param->name) == 0)
+	uint32_t hash = sysparam_hash(name, strlen(name));
+
+	for (struct sysparam *param = params.hash[hash % SYSPARAM_HASH_SIZE]; param; param = param->hash_next) {
+		if (param->hash == hash && strcmp(name, param->name) == 0)
 			return param;
 	}
 
 	return NULL;
 }
 
+static void sysparam_unmap(void)
+{
+	if (params.map) {
+		bio_ioctl(params.bdev, BIO_IOCTL_PUT_MEM_MAP, NULL);
+		params.map = NULL;
+	}
+}
+
 status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
 {
 	status_t err = NO_ERROR;
@@ -178,21 +318,36 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
 	DEBUG_ASSERT(offset + len <= bdev->total_size);
 	DEBUG_ASSERT((offset % bdev->block_size) == 0);
 
+	sysparam_unmap();
+
 	params.bdev = bdev;
 	params.offset = offset;
 	params.len = len;
 	params.dirty = false;
-
-	/* allocate a len sized block */
-	uint8_t *buf = malloc(len);
-	if (!buf)
-		return ERR_NO_MEMORY;
-
-	/* read in the sector at the scan offset */
-	err = bio_read(bdev, buf, offset, len);
-	if (err < (ssize_t)len) {
-		err = ERR_IO;
-		goto err;
+	params.end = 0;
+	params.append_ok = false;
+
+	/* look at it in place if the device can be memory mapped, otherwise read in a copy */
+	const uint8_t *buf;
+	uint8_t *copy = NULL;
+	void *map = NULL;
+	if (bio_ioctl(bdev, BIO_IOCTL_GET_MEM_MAP, &map) >= 0 && map) {
+		params.map = map;
+		buf = (const uint8_t *)map + offset;
+	} else {
+		/* allocate a len sized block */
+		copy = malloc(len);
+		if (!copy)
+			return ERR_NO_MEMORY;
+
+		/* read in the sector at the scan offset */
+		err = bio_read(bdev, copy, offset, len);
+		if (err < (ssize_t)len) {
+			err = ERR_IO;
+			goto err;
+		}
+		err = NO_ERROR;
+		buf = copy;
 	}
 
 	LTRACEF("looking for sysparams in block:\n");
@@ -200,8 +355,8 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
 		hexdump(buf, len);
 
 	size_t pos = 0;
-	while (pos < len) {
-		struct sysparam_phys *sp = (struct sysparam_phys *)(buf + pos);
+	while (pos + sizeof(struct sysparam_phys) <= len) {
+		const struct sysparam_phys *sp = (const struct sysparam_phys *)(buf + pos);
 
 		/* examine the sysparam entry, making sure it's valid */
 		if (sp->magic != SYSPARAM_MAGIC) {
@@ -212,13 +367,14 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
 
 		/* looks valid, see if length is sane */
 		size_t splen = sysparam_len(sp);
-		if (pos + splen > offset + len) {
+		if (pos + splen > len) {
 			/* length exceeds the size of the area */
 			LTRACEF("param at 0x%x: bad length\n", pos);
 			break;
 		}
 
 		pos += splen;
+		params.end = pos;
 
 		/* calculate a checksum of it */
 		uint32_t sum = sysparam_crc32(sp);
@@ -238,12 +394,34 @@ status_t sysparam_scan(bdev_t *bdev, off_t offset, size_t len)
 			break;
 		}
 
-		list_add_tail(&params.list, &param->node);
+		/* later entries override earlier ones */
+		struct sysparam *old = sysparam_find(param->name);
+		if (old) {
+			sysparam_unlink(old);
+			sysparam_free(old);
+		}
+
+		if (param->flags & SYSPARAM_FLAG_DELETED) {
+			sysparam_free(param);
+			continue;
+		}
+
+		sysparam_insert(param);
 	}
 
+	/* appending needs everything past the last entry to still be erased */
+	if (err == NO_ERROR) {
+		params.append_ok = true;
+		for (pos = params.end; pos < len; pos++) {
+			if (buf[pos] != bdev->erase_byte) {
+				params.append_ok = false;
+				break;
+			}
+		}
+	}
 
 err:
-	free(buf);
+	free(copy);
 
 	LTRACE_EXIT;
 	return err;
@@ -261,11 +439,19 @@ status_t sysparam_reload(void)
 	struct sysparam *temp;
 	list_for_every_entry_safe(&params.list, param, temp, struct sysparam, node) {
 		list_delete(&param->node);
-
-		free(param->name);
-		free(param->data);
-		free(param);
+		sysparam_free(param);
+	}
+	list_for_every_entry_safe(&params.removed, param, temp, struct sysparam, node) {
+		list_delete(&param->node);
+		sysparam_free(param);
 	}
+	memset(params.hash, 0, sizeof(params.hash));
+
+	/* scanned params may point into the map */
+	sysparam_unmap();
+
+	/* everything scanned in last time goes in one shot */
+	arena_reset(&params.arena);
 
 	/* reset the list back to scratch */
 	params.dirty = false;
@@ -318,35 +504,97 @@ status_t sysparam_get_ptr(const char *name, const void **ptr, size_t *len)
 
 #if SYSPARAM_ALLOW_WRITE
 
-/* write all of the parameters in memory to the space reserved in flash */
-status_t sysparam_write(void)
+static size_t sysparam_phys_len(const struct sysparam *param)
 {
-	if (params.bdev == NULL)
-		return ERR_INVALID_ARGS;
-	if (params.len == 0)
-		return ERR_INVALID_ARGS;
+	return sizeof(struct sysparam_phys) + ROUNDUP(strlen(param->name), 4) + ROUNDUP(param->datalen, 4);
+}
 
-	if (!params.dirty)
-		return NO_ERROR;
+/* lay out a param's on disk entry at buf, which must have room for it */
+static size_t sysparam_serialize(const struct sysparam *param, uint8_t *buf)
+{
+	struct sysparam_phys *sp = (struct sysparam_phys *)buf;
+	size_t namelen = strlen(param->name);
+
+	sp->magic = SYSPARAM_MAGIC;
+	sp->flags = param->flags;
+	sp->namelen = namelen;
+	sp->datalen = param->datalen;
+
+	/* name and data, each zero padded to a multiple of 4 */
+	memset(sp->namedata, 0, ROUNDUP(namelen, 4) + ROUNDUP(param->datalen, 4));
+	memcpy(sp->namedata, param->name, namelen);
+	if (param->datalen)
+		memcpy(sp->namedata + ROUNDUP(namelen, 4), param->data, param->datalen);
+
+	sp->crc32 = sysparam_crc32(sp);
+
+	return sysparam_len(sp);
+}
+
+/* write just what changed after the last entry */
+static status_t sysparam_write_append(size_t len)
+{
+	uint8_t *buf = malloc(len);
+	if (!buf) {
+		TRACEF("error allocating buffer to stage write\n");
+		return ERR_NO_MEMORY;
+	}
+
+	/* removals first, so a param removed and added back again stays */
+	struct sysparam *param;
+	size_t pos = 0;
+	list_for_every_entry(&params.removed, param, struct sysparam, node) {
+		pos += sysparam_serialize(param, buf + pos);
+	}
+	list_for_every_entry(&params.list, param, struct sysparam, node) {
+		if (param->unsaved)
+			pos += sysparam_serialize(param, buf + pos);
+	}
+	DEBUG_ASSERT(pos == len);
+
+	/* the device may not be writable while mapped, and the staging copy is done with it */
+	sysparam_unmap();
+
+	ssize_t err = bio_write(params.bdev, buf, params.offset + params.end, len);
+	free(buf);
+	if (err < (ssize_t)len) {
+		TRACEF("error appending to sysparam area\n");
+		return ERR_IO;
+	}
+
+	params.end += len;
+
+	return NO_ERROR;
+}
 
+/* erase the area and write all of the parameters in memory back out */
+static status_t sysparam_write_all(void)
+{
 	/* preflight the length, make sure we have enough space */
 	struct sysparam *param;
 	off_t total_len = 0;
 	list_for_every_entry(&params.list, param, struct sysparam, node) {
-		total_len += sizeof(struct sysparam_phys);
-		total_len += ROUNDUP(strlen(param->name), 4);
-		total_len += ROUNDUP(param->datalen, 4);
+		total_len += sysparam_phys_len(param);
 	}
 
 	if (total_len > params.len)
 		return ERR_NO_MEMORY;
 
-	/* allocate a buffer to stage it */
-	uint8_t *buf = calloc(1, params.len);
+	/* allocate a buffer to stage it, the rest stays erased for appending to */
+	uint8_t *buf = malloc(params.len);
 	if (!buf) {
 		TRACEF("error allocating buffer to stage write\n");
 		return ERR_NO_MEMORY;
 	}
+	memset(buf, params.bdev->erase_byte, params.len);
+
+	/* serialize all of the parameters */
+	size_t pos = 0;
+	list_for_every_entry(&params.list, param, struct sysparam, node) {
+		pos += sysparam_serialize(param, buf + pos);
+	}
+
+	sysparam_unmap();
 
 	/* erase the block device area this covers */
 	ssize_t err = bio_erase(params.bdev, params.offset, params.len);
@@ -356,48 +604,70 @@ status_t sysparam_write(void)
 		return ERR_IO;
 	}
 
-	/* serialize all of the parameters */
-	off_t pos = 0;
+	/* write the block out */
+	err = bio_write(params.bdev, buf, params.offset, params.len);
+	free(buf);
+	if (err < (ssize_t)params.len) {
+		TRACEF("error writing sysparam area\n");
+		params.append_ok = false;
+		return ERR_IO;
+	}
+
+	params.end = pos;
+	params.append_ok = true;
+
+	return NO_ERROR;
+}
+
+/*
+ * Save the changes to the parameters to the space reserved in flash,
+ * appending them if there's room and rewriting the lot if there isn't.
+ */
+status_t sysparam_write(void)
+{
+	if (params.bdev == NULL)
+		return ERR_INVALID_ARGS;
+	if (params.len == 0)
+		return ERR_INVALID_ARGS;
+
+	if (!params.dirty)
+		return NO_ERROR;
+
+	struct sysparam *param;
+	size_t append_len = 0;
+	list_for_every_entry(&params.removed, param, struct sysparam, node) {
+		append_len += sysparam_phys_len(param);
+	}
 	list_for_every_entry(&params.list, param, struct sysparam, node) {
-		struct sysparam_phys phys;
-
-		/* start filling out a struct */
-		phys.magic = SYSPARAM_MAGIC;
-		phys.crc32 = 0;
-		phys.flags = param->flags;
-		phys.namelen = strlen(param->name);
-		phys.datalen = param->datalen;
-
-		/* calculate the crc of the entire thing + padding */
-		uint32_t zero = 0;
-		uint32_t sum = crc32(0, (const void *)&phys.flags, 8);
-		sum = crc32(sum, (const void *)param->name, strlen(param->name));
-		if (strlen(param->name) % 4)
-			sum = crc32(sum, (const void *)&zero, 4 - (strlen(param->name) % 4));
-		sum = crc32(sum, (const void *)param->data, ROUNDUP(param->datalen, 4));
-		phys.crc32 = sum;
-
-		/* structure portion */
-		memcpy(buf + pos, &phys, sizeof(struct sysparam_phys));
-		pos += sizeof(struct sysparam_phys);
-
-		/* name portion */
-		memcpy(buf + pos, param->name, strlen(param->name));
-		pos += ROUNDUP(strlen(param->name), 2);
-		if (pos % 4) {
-			/* write 2 zeros to realign */
-			pos += 2;
-		}
+		if (param->unsaved)
+			append_len += sysparam_phys_len(param);
+	}
+
+	bool mapped = params.map != NULL;
 
-		/* data portion */
-		memcpy(buf + pos, param->data, param->datalen);
-		pos += ROUNDUP(param->datalen, 4);
+	status_t err;
+	if (params.append_ok && params.end + append_len <= params.len)
+		err = sysparam_write_append(append_len);
+	else
+		err = sysparam_write_all();
+
+	/* mapped params lost their data along with the map, pick them up again from the device */
+	if (mapped && params.map == NULL) {
+		status_t reload_err = sysparam_reload();
+		return (err < 0) ? err : reload_err;
 	}
 
-	/* write the block out */
-	bio_write(params.bdev, buf, params.offset, params.len);
+	if (err < 0)
+		return err;
 
-	free(buf);
+	struct sysparam *temp;
+	list_for_every_entry_safe(&params.removed, param, temp, struct sysparam, node) {
+		list_delete(&param->node);
+		sysparam_free(param);
+	}
+	list_for_every_entry(&params.list, param, struct sysparam, node) {
+		param->unsaved = false;
+	}
 
 	params.dirty = false;
 
@@ -412,11 +682,12 @@ status_t sysparam_add(const char *name, const void *value, size_t len)
 	if (param)
 		return ERR_ALREADY_EXISTS;
 
-	param = sysparam_create(name, strlen(name), value, len, 0);
+	param = sysparam_create(name, strlen(name), value, len, 0, false);
 	if (!param)
 		return ERR_NO_MEMORY;
 
-	list_add_tail(&params.list, &param->node);
+	param->unsaved = true;
+	sysparam_insert(param);
 
 	params.dirty = true;
 
@@ -434,11 +705,11 @@ status_t sysparam_remove(const char *name)
 	if (sysparam_is_locked(param))
 		return ERR_NOT_ALLOWED;
 
-	list_delete(&param->node);
-
-	free(param->name);
-	free(param->data);
-	free(param);
+	/* hang on to it until its deleted entry is written */
+	sysparam_unlink(param);
+	param->flags |= SYSPARAM_FLAG_DELETED;
+	param->datalen = 0;
+	list_add_tail(&params.removed, &param->node);
 
 	params.dirty = true;
 
@@ -456,6 +727,7 @@ status_t sysparam_lock(const char *name)
 	/* set the lock bit if it isn't already */
 	if (!sysparam_is_locked(param)) {
 		param->flags |= SYSPARAM_FLAG_LOCK;
+		param->unsaved = true;
 		params.dirty = true;
 	}
 
@@ -23,9 +23,27 @@
 
 #pragma once
 
+#include <sys/types.h>
+
+// Called with each block of a file as it comes in, and with NULL at the end.
+// Returning a negative value aborts the transfer.
 typedef int (*tftp_callback_t)(void *data, size_t len, void *arg);
 
+// Called at the end of each file received by one of the sinks below, with its
+// size or a negative error.
+typedef void (*tftp_done_callback_t)(ssize_t len, void *arg);
+
 int tftp_server_init(void *arg);
 
 int tftp_set_write_client(const char* file_name, tftp_callback_t cb, void* arg);
 
+// Receive file_name straight into len bytes of memory at buf.
+int tftp_set_write_memory(const char* file_name, void* buf, size_t len,
+                          tftp_done_callback_t done, void* arg);
+
+// Receive file_name straight into the block device bdev_name, starting at
+// offset. Flash is erased just ahead of the data, so offset has to be on an
+// erase block boundary there.
+int tftp_set_write_bdev(const char* file_name, const char* bdev_name, off_t offset,
+                        tftp_done_callback_t done, void* arg);
+
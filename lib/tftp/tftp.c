@@ -26,11 +26,15 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <list.h>
 #include <compiler.h>
 #include <endian.h>
 #include <stdbool.h>
 #include <lib/minip.h>
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+#endif
 #include <platform.h>
 
 #include <lib/tftp.h>
@@ -43,6 +47,7 @@
 #define TFTP_OPCODE_DATA  3UL
 #define TFTP_OPCODE_ACK   4UL
 #define TFTP_OPCODE_ERROR 5UL
+#define TFTP_OPCODE_OACK  6UL
 
 // TFTP Errors:
 #define TFTP_ERROR_UNDEF        0UL
@@ -56,6 +61,13 @@
 
 #define TFTP_PORT 69
 
+// Block sizes: classic, and the largest (RFC 2348) that fits an ethernet frame
+// without ip fragmentation.
+#define TFTP_DEFAULT_BLKSIZE 512
+#define TFTP_MAX_BLKSIZE     1468
+// Blocks the client may send before waiting for an ack (RFC 7440).
+#define TFTP_MAX_WINDOWSIZE  64
+
 #define	RD_U16(ptr)	\
     (uint16_t)(((uint16_t)*((uint8_t*)(ptr)+1)<<8)|(uint16_t)*(uint8_t*)(ptr))
 
@@ -74,7 +86,14 @@ typedef struct {
     uint32_t src_addr;
     uint16_t src_port;
     uint16_t listen_port;
-    uint16_t pkt_count;
+    // Last block received in order, and how many of those since the last ack.
+    uint16_t block;
+    uint16_t window_count;
+    // An ack for |block| went out when something arrived out of order.
+    bool resync_sent;
+    // Negotiated options.
+    uint16_t blksize;
+    uint16_t windowsize;
 } tftp_job_t;
 
 uint16_t next_port = 2224;
@@ -103,6 +122,28 @@ static void send_error(udp_socket_t* socket, uint16_t code)
     }
 }
 
+// Packet is [6]([option][0][value][0])*, acknowledging the options we took.
+static void send_oack(udp_socket_t* socket, const tftp_job_t* job, bool blksize, bool windowsize)
+{
+    status_t st;
+    uint8_t oack[64];
+    size_t len = 2;
+
+    oack[0] = 0;
+    oack[1] = TFTP_OPCODE_OACK;
+    if (blksize) {
+        len += snprintf((char*)oack + len, sizeof(oack) - len, "blksize%c%u", 0, job->blksize) + 1;
+    }
+    if (windowsize) {
+        len += snprintf((char*)oack + len, sizeof(oack) - len, "windowsize%c%u", 0, job->windowsize) + 1;
+    }
+
+    st = udp_send(oack, len, socket);
+    if (st < 0) {
+        LTRACEF("send_oack failed: %d\n", st);
+    }
+}
+
 static void end_transfer(tftp_job_t* job, bool do_callback)
 {
     udp_listen(job->listen_port, NULL, NULL);
@@ -118,11 +159,10 @@ static void udp_wrq_callback(void *data, size_t len,
                              uint32_t srcaddr, uint16_t srcport,
                              void *arg)
 { 
-    // Packet is [3][count][data]. All packets but the last have 512
+    // Packet is [3][block][data]. All packets but the last have blksize
     // bytes of data, including zero data.
     char* data_c = data;
     tftp_job_t* job = arg;
-    job->pkt_count++;
 
     if (len < 4) {
         // Not to spec. Ignore.
@@ -149,21 +189,62 @@ static void udp_wrq_callback(void *data, size_t len,
         return;
     }
 
-    send_ack(job->socket, job->pkt_count);
+    uint16_t block = ntohs(RD_U16(&data_c[2]));
+    if (block != (uint16_t)(job->block + 1)) {
+        // A retransmit, or we lost some of the window. Ack the last block we
+        // have once, so the client resends from there (RFC 7440).
+        if (!job->resync_sent) {
+            send_ack(job->socket, job->block);
+            job->resync_sent = true;
+            job->window_count = 0;
+        }
+        return;
+    }
+    job->block = block;
+    job->resync_sent = false;
+
+    // The last packet always has less than blksize bytes of payload.
+    size_t data_len = len - 4;
+    bool last = data_len < job->blksize;
+
+    // Ack a full window before handing it over, so the client has the next
+    // one on the way while the callback writes this one out. The last block
+    // is only acked once it's been taken.
+    if (!last && ++job->window_count >= job->windowsize) {
+        send_ack(job->socket, block);
+        job->window_count = 0;
+    }
 
-    if (job->callback(&data_c[4], len - 4, job->arg) < 0) {
+    if (job->callback(&data_c[4], data_len, job->arg) < 0) {
         // The client wants to abort.
         send_error(job->socket, TFTP_ERROR_FULL);
         end_transfer(job, true);
+        return;
     }
-    
-    // 512 bytes payload plus 4 of fixed header. The last packet.
-    // has always less than 512 bytes of payload.
-    if (len != 516) {
+
+    if (last) {
+        send_ack(job->socket, block);
         end_transfer(job, true);
     }
 }
 
+// The next nul terminated string of a request, or NULL if it runs off the end.
+static const char* next_string(const char** pos, const char* end)
+{
+    const char* str = *pos;
+    if (str >= end) {
+        return NULL;
+    }
+
+    size_t len = strnlen(str, end - str);
+    if (len == (size_t)(end - str)) {
+        return NULL;
+    }
+
+    *pos = str + len + 1;
+    return str;
+}
+
 static tftp_job_t* get_job_by_name(const char* file_name) 
 {
     DEBUG_ASSERT(file_name);    
@@ -202,9 +283,21 @@ static void udp_svc_callback(void *data, size_t len,
         return;
     }
 
-    // Look for a client that can hadle the file. TODO: |data|
-    // needs to be null terminated. A malicious client can crash us.
-    job = get_job_by_name(((char*)data) + 2);
+    // Packet is [2][file name][0][mode][0]([option][0][value][0])*.
+    const char* pos = (const char*)data + 2;
+    const char* end = (const char*)data + len;
+    const char* file_name = next_string(&pos, end);
+    const char* mode = next_string(&pos, end);
+
+    if (!file_name || !mode) {
+        LTRACEF("malformed request\n");
+        send_error(socket, TFTP_ERROR_ILLEGAL_OP);
+        udp_close(socket);
+        return;
+    }
+
+    // Look for a client that can hadle the file.
+    job = get_job_by_name(file_name);
 
     if (!job) {
         // Nobody claims to handle that file.
@@ -231,16 +324,41 @@ static void udp_svc_callback(void *data, size_t len,
     job->socket = socket;
     job->src_addr = srcaddr;
     job->src_port = srcport;
-    job->pkt_count = 0UL;
+    job->block = 0;
+    job->window_count = 0;
+    job->resync_sent = false;
+    job->blksize = TFTP_DEFAULT_BLKSIZE;
+    job->windowsize = 1;
     job->listen_port = next_port;
 
+    // Take the options we know, the client treats any we leave out of the
+    // OACK as refused.
+    bool has_blksize = false;
+    bool has_windowsize = false;
+    const char* opt;
+    const char* val;
+    while ((opt = next_string(&pos, end)) && (val = next_string(&pos, end))) {
+        unsigned long v = atoul(val);
+        if (!strnicmp(opt, "blksize", sizeof("blksize")) && v >= 8) {
+            job->blksize = MIN(v, TFTP_MAX_BLKSIZE);
+            has_blksize = true;
+        } else if (!strnicmp(opt, "windowsize", sizeof("windowsize")) && v >= 1) {
+            job->windowsize = MIN(v, TFTP_MAX_WINDOWSIZE);
+            has_windowsize = true;
+        }
+    }
+
     st = udp_listen(job->listen_port, &udp_wrq_callback, job);
     if (st < 0) {
         LTRACEF("error listening on port\n");
         return;
     }
 
-    send_ack(socket, 0UL);
+    if (has_blksize || has_windowsize) {
+        send_oack(socket, job, has_blksize, has_windowsize);
+    } else {
+        send_ack(socket, 0UL);
+    }
     next_port++;
 }
 
@@ -275,6 +393,235 @@ int tftp_set_write_client(const char* file_name, tftp_callback_t cb, void* arg)
     return 0;
 }
 
+// Sinks, clients that write each file somewhere as it arrives.
+typedef struct {
+    tftp_done_callback_t done;
+    void* arg;
+    // Bytes of the current file so far, and the first error writing them.
+    size_t pos;
+    status_t err;
+    // Memory sink.
+    uint8_t* buf;
+    size_t len;
+#if WITH_LIB_BIO
+    // Block device sink. Data is staged until there's a chunk worth writing.
+    bdev_t* dev;
+    off_t offset;
+    off_t erased;
+    uint8_t* staging;
+    size_t staged;
+#endif
+} tftp_sink_t;
+
+#define TFTP_SINK_STAGING (64 * 1024)
+
+static void sink_finish(tftp_sink_t* sink)
+{
+    if (sink->done) {
+        sink->done(sink->err < 0 ? sink->err : (ssize_t)sink->pos, sink->arg);
+    }
+
+    // Ready for the next one.
+    sink->pos = 0;
+    sink->err = NO_ERROR;
+#if WITH_LIB_BIO
+    sink->erased = sink->offset;
+    sink->staged = 0;
+#endif
+}
+
+static int register_sink(const char* file_name, tftp_callback_t cb, tftp_sink_t* sink)
+{
+    // tftp_set_write_client() would take this as removing the existing one.
+    if (get_job_by_name(file_name)) {
+        return ERR_ALREADY_EXISTS;
+    }
+
+    return tftp_set_write_client(file_name, cb, sink);
+}
+
+static int memory_sink_callback(void* data, size_t len, void* arg)
+{
+    tftp_sink_t* sink = arg;
+
+    if (!data) {
+        sink_finish(sink);
+        return 0;
+    }
+
+    if (len > sink->len - sink->pos) {
+        sink->err = ERR_NOT_ENOUGH_BUFFER;
+        return -1;
+    }
+
+    memcpy(sink->buf + sink->pos, data, len);
+    sink->pos += len;
+    return 0;
+}
+
+int tftp_set_write_memory(const char* file_name, void* buf, size_t len,
+                          tftp_done_callback_t done, void* arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(buf);
+
+    tftp_sink_t* sink = calloc(1, sizeof(tftp_sink_t));
+    if (!sink) {
+        return ERR_NO_MEMORY;
+    }
+
+    sink->done = done;
+    sink->arg = arg;
+    sink->buf = buf;
+    sink->len = len;
+
+    int ret = register_sink(file_name, &memory_sink_callback, sink);
+    if (ret < 0) {
+        free(sink);
+    }
+    return ret;
+}
+
+#if WITH_LIB_BIO
+
+// The erase block size at offset, 0 if it doesn't need erasing.
+static size_t erase_size_at(const bdev_t* dev, off_t offset)
+{
+    for (size_t i = 0; i < dev->geometry_count; i++) {
+        const bio_erase_geometry_info_t* geo = &dev->geometry[i];
+        if (offset >= geo->start && offset < geo->start + geo->size) {
+            return geo->erase_size;
+        }
+    }
+    return 0;
+}
+
+// Write out what's staged, erasing ahead of it first.
+static status_t bdev_sink_flush(tftp_sink_t* sink)
+{
+    if (sink->staged == 0) {
+        return NO_ERROR;
+    }
+
+    off_t offset = sink->offset + sink->pos - sink->staged;
+    off_t end = offset + sink->staged;
+
+    while (sink->erased < end) {
+        size_t erase_size = erase_size_at(sink->dev, sink->erased);
+        if (erase_size == 0) {
+            sink->erased = end;
+            break;
+        }
+
+        ssize_t err = bio_erase(sink->dev, sink->erased, erase_size);
+        if (err < 0) {
+            return err;
+        }
+        sink->erased += erase_size;
+    }
+
+    ssize_t ret = bio_write(sink->dev, sink->staging, offset, sink->staged);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((size_t)ret != sink->staged) {
+        return ERR_IO;
+    }
+
+    sink->staged = 0;
+    return NO_ERROR;
+}
+
+static int bdev_sink_callback(void* data, size_t len, void* arg)
+{
+    tftp_sink_t* sink = arg;
+
+    if (!data) {
+        if (sink->err >= 0) {
+            sink->err = bdev_sink_flush(sink);
+        }
+        sink_finish(sink);
+        return 0;
+    }
+
+    if ((off_t)(sink->pos + len) > sink->dev->total_size - sink->offset) {
+        sink->err = ERR_NOT_ENOUGH_BUFFER;
+        return -1;
+    }
+
+    const uint8_t* src = data;
+    while (len > 0) {
+        size_t n = MIN(len, TFTP_SINK_STAGING - sink->staged);
+        memcpy(sink->staging + sink->staged, src, n);
+        sink->staged += n;
+        sink->pos += n;
+        src += n;
+        len -= n;
+
+        if (sink->staged == TFTP_SINK_STAGING) {
+            status_t err = bdev_sink_flush(sink);
+            if (err < 0) {
+                sink->err = err;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int tftp_set_write_bdev(const char* file_name, const char* bdev_name, off_t offset,
+                        tftp_done_callback_t done, void* arg)
+{
+    DEBUG_ASSERT(file_name);
+    DEBUG_ASSERT(bdev_name);
+
+    bdev_t* dev = bio_open(bdev_name);
+    if (!dev) {
+        return ERR_NOT_FOUND;
+    }
+
+    size_t erase_size = erase_size_at(dev, offset);
+    if (offset < 0 || offset >= dev->total_size ||
+        (erase_size && !IS_ALIGNED(offset, erase_size))) {
+        bio_close(dev);
+        return ERR_INVALID_ARGS;
+    }
+
+    tftp_sink_t* sink = calloc(1, sizeof(tftp_sink_t));
+    uint8_t* staging = malloc(TFTP_SINK_STAGING);
+    if (!sink || !staging) {
+        free(sink);
+        free(staging);
+        bio_close(dev);
+        return ERR_NO_MEMORY;
+    }
+
+    sink->done = done;
+    sink->arg = arg;
+    sink->dev = dev;
+    sink->offset = offset;
+    sink->erased = offset;
+    sink->staging = staging;
+
+    int ret = register_sink(file_name, &bdev_sink_callback, sink);
+    if (ret < 0) {
+        free(staging);
+        free(sink);
+        bio_close(dev);
+    }
+    return ret;
+}
+
+#else
+
+int tftp_set_write_bdev(const char* file_name, const char* bdev_name, off_t offset,
+                        tftp_done_callback_t done, void* arg)
+{
+    return ERR_NOT_SUPPORTED;
+}
+
+#endif
+
 int tftp_server_init(void *arg)
 {
     status_t st = udp_listen(TFTP_PORT, &udp_svc_callback, 0);
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/workqueue.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/debug.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+#define WORKQUEUE_DEFAULT_MAX_QUEUED 64
+
+/* every queue made by workqueue_create, for the console */
+static struct list_node workqueue_list = LIST_INITIAL_VALUE(workqueue_list);
+static spin_lock_t workqueue_list_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static int workqueue_worker(void *arg)
+{
+	struct workqueue_cpu *q = arg;
+	spin_lock_saved_state_t state;
+
+	for (;;) {
+		spin_lock_irqsave(&q->lock, state);
+
+		work_t *work = NULL;
+		for (uint i = 0; i < WORK_PRIORITY_COUNT && !work; i++)
+			work = list_remove_head_type(&q->pending[i], work_t, node);
+
+		if (!work) {
+			spin_unlock_irqrestore(&q->lock, state);
+			event_wait(&q->work_event);
+			continue;
+		}
+
+		/* the work may be requeued or freed once it starts, grab what we need first */
+		work_func_t func = work->func;
+		void *arg = work->arg;
+
+		q->queued--;
+		q->running++;
+		spin_unlock_irqrestore(&q->lock, state);
+
+		LTRACEF("q %p calling %p, arg %p\n", q, func, arg);
+		KEVLOG_WORK_BEGIN(func, arg);
+		func(arg);
+		KEVLOG_WORK_END(func, arg);
+
+		spin_lock_irqsave(&q->lock, state);
+		if (--q->running == 0 && q->queued == 0)
+			event_signal(&q->idle_event, false);
+		spin_unlock_irqrestore(&q->lock, state);
+	}
+
+	return 0;
+}
+
+workqueue_t *workqueue_create(const char *name, uint threads_per_cpu, int priority, uint max_queued)
+{
+	DEBUG_ASSERT(threads_per_cpu > 0);
+
+	workqueue_t *wq = memalign(CACHE_LINE, sizeof(workqueue_t));
+	if (!wq)
+		return NULL;
+
+	memset(wq, 0, sizeof(*wq));
+	wq->name = name;
+	wq->max_queued = max_queued ? max_queued : WORKQUEUE_DEFAULT_MAX_QUEUED;
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		struct workqueue_cpu *q = &wq->cpu[cpu];
+
+		spin_lock_init(&q->lock);
+		for (uint i = 0; i < WORK_PRIORITY_COUNT; i++)
+			list_initialize(&q->pending[i]);
+		event_init(&q->work_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+		event_init(&q->idle_event, true, 0);
+	}
+
+	/* workers for cpus that aren't up yet just sit in their run queue until they are */
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		for (uint i = 0; i < threads_per_cpu; i++) {
+			char tname[32];
+			snprintf(tname, sizeof(tname), "%s %u.%u", name, cpu, i);
+
+			thread_t *t = thread_create(tname, &workqueue_worker, &wq->cpu[cpu], priority, DEFAULT_STACK_SIZE);
+			if (!t)
+				panic("workqueue %s: failed to create worker\n", name);
+
+			t->pinned_cpu = cpu;
+			thread_detach_and_resume(t);
+		}
+	}
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&workqueue_list_lock, state);
+	list_add_tail(&workqueue_list, &wq->node);
+	spin_unlock_irqrestore(&workqueue_list_lock, state);
+
+	return wq;
+}
+
+static status_t workqueue_queue_locked(workqueue_t *wq, struct workqueue_cpu *q, work_t *work, work_func_t func, void *arg, uint flags)
+{
+	if (list_in_list(&work->node))
+		return ERR_ALREADY_EXISTS;
+
+	if (q->queued >= wq->max_queued) {
+		q->rejected++;
+		return ERR_BUSY;
+	}
+
+	uint prio = (flags & WORK_FLAG_HIGH_PRIORITY) ? WORK_PRIORITY_HIGH : WORK_PRIORITY_NORMAL;
+
+	work->func = func;
+	work->arg = arg;
+	work->queue = q;
+	list_add_tail(&q->pending[prio], &work->node);
+	q->queued++;
+	q->submitted++;
+	event_unsignal(&q->idle_event);
+
+	return NO_ERROR;
+}
+
+status_t workqueue_submit(workqueue_t *wq, work_t *work, work_func_t func, void *arg, uint flags)
+{
+	DEBUG_ASSERT(wq);
+	DEBUG_ASSERT(work);
+	DEBUG_ASSERT(func);
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	/* we can't migrate with interrupts off */
+	struct workqueue_cpu *q = &wq->cpu[arch_curr_cpu_num()];
+
+	spin_lock(&q->lock);
+	status_t err = workqueue_queue_locked(wq, q, work, func, arg, flags);
+	spin_unlock(&q->lock);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	if (err == NO_ERROR)
+		event_signal(&q->work_event, (flags & WORK_FLAG_NORESCHED) ? false : true);
+
+	return err;
+}
+
+status_t workqueue_submit_cpu(workqueue_t *wq, uint cpu, work_t *work, work_func_t func, void *arg, uint flags)
+{
+	DEBUG_ASSERT(wq);
+	DEBUG_ASSERT(work);
+	DEBUG_ASSERT(func);
+
+	if (cpu >= SMP_MAX_CPUS)
+		return ERR_INVALID_ARGS;
+
+	struct workqueue_cpu *q = &wq->cpu[cpu];
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+	status_t err = workqueue_queue_locked(wq, q, work, func, arg, flags);
+	spin_unlock_irqrestore(&q->lock, state);
+
+	if (err == NO_ERROR)
+		event_signal(&q->work_event, (flags & WORK_FLAG_NORESCHED) ? false : true);
+
+	return err;
+}
+
+bool workqueue_cancel(work_t *work)
+{
+	DEBUG_ASSERT(work);
+
+	struct workqueue_cpu *q = work->queue;
+	if (!q)
+		return false;
+
+	bool removed = false;
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+
+	/* it may have been run and submitted somewhere else since we looked */
+	if (list_in_list(&work->node) && work->queue == q) {
+		list_delete(&work->node);
+		if (--q->queued == 0 && q->running == 0)
+			event_signal(&q->idle_event, false);
+		removed = true;
+	}
+
+	spin_unlock_irqrestore(&q->lock, state);
+
+	return removed;
+}
+
+void workqueue_flush(workqueue_t *wq)
+{
+	DEBUG_ASSERT(wq);
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+		event_wait(&wq->cpu[cpu].idle_event);
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_wq(int argc, const cmd_args *argv)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&workqueue_list_lock, state);
+
+	workqueue_t *wq;
+	list_for_every_entry(&workqueue_list, wq, workqueue_t, node) {
+		printf("workqueue '%s', max queued %u\n", wq->name, wq->max_queued);
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			const struct workqueue_cpu *q = &wq->cpu[cpu];
+			printf("\tcpu %u: queued %u running %u submitted %lu rejected %lu\n",
+			       cpu, q->queued, q->running, q->submitted, q->rejected);
+		}
+	}
+
+	spin_unlock_irqrestore(&workqueue_list_lock, state);
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("wq", "work queue statistics", &cmd_wq)
+STATIC_COMMAND_END(workqueue);
+
+#endif
@@ -89,7 +89,7 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 	// get the current vector
 	unsigned int vector = IntActiveIrqNumGet();
 
-	THREAD_STATS_INC(interrupts);
+	THREAD_STATS_IRQ_ENTER();
 
 //	printf("platform_irq: spsr 0x%x, pc 0x%x, currthread %p, vector %d\n", frame->spsr, frame->pc, current_thread, vector);
 
@@ -106,6 +106,8 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 
 //	dprintf("platform_irq: exit %d\n", ret);
 
+	THREAD_STATS_IRQ_EXIT();
+
 	return ret;
 }
 
@@ -64,6 +64,10 @@ status_t display_get_info(struct display_info *info)
 	info->height = display_h;
 	info->stride = display_w;
 	info->flush = NULL;
+	info->flush_rect = NULL;
+	info->back_framebuffer = NULL;
+	info->virtual_height = info->height;
+	info->pan = NULL;
 
 	return NO_ERROR;
 }
@@ -76,7 +76,7 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 	if (vector == 0xffffffff)
 		return INT_NO_RESCHEDULE;
 
-	THREAD_STATS_INC(interrupts);
+	THREAD_STATS_IRQ_ENTER();
 	KEVLOG_IRQ_ENTER(vector);
 
 //	printf("platform_irq: spsr 0x%x, pc 0x%x, currthread %p, vector %d\n", frame->spsr, frame->pc, current_thread, vector);
@@ -91,6 +91,7 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 //	dprintf("platform_irq: exit %d\n", ret);
 
 	KEVLOG_IRQ_EXIT(vector);
+	THREAD_STATS_IRQ_EXIT();
 
 	return ret;
 }
@@ -26,6 +26,7 @@
 #include <bits.h>
 #include <arch/arm.h>
 #include <kernel/spinlock.h>
+#include <kernel/irqstats.h>
 #include <kernel/thread.h>
 #include <kernel/mp.h>
 #include <platform/interrupts.h>
@@ -33,6 +34,13 @@
 
 #define LOCAL_TRACE 0
 
+#define INTC_NO_VECTOR 0xffffffff
+
+/* interrupts taken per exception before returning to the interrupted code */
+#ifndef INTC_IRQ_BUDGET
+#define INTC_IRQ_BUDGET 8
+#endif
+
 /* global interrupt controller */
 #define INTC_PEND0  (ARMCTRL_INTC_BASE + 0x0)
 #define INTC_PEND1  (ARMCTRL_INTC_BASE + 0x4)
@@ -167,12 +175,10 @@ void register_int_handler(unsigned int vector, int_handler handler, void *arg)
     spin_unlock_irqrestore(&lock, state);
 }
 
-enum handler_return platform_irq(struct arm_iframe *frame)
+/* the highest priority pending vector on cpu, or INTC_NO_VECTOR */
+static uint intc_decode(uint cpu)
 {
     uint vector;
-    uint cpu = arch_curr_cpu_num();
-
-    THREAD_STATS_INC(interrupts);
 
     // see what kind of irq it is
     uint32_t pend = *REG32(INTC_LOCAL_IRQ_PEND0 + cpu * 4);
@@ -217,33 +223,35 @@ enum handler_return platform_irq(struct arm_iframe *frame)
         goto decoded;
     }
 
-    vector = 0xffffffff;
+    vector = INTC_NO_VECTOR;
 
 decoded:
     LTRACEF("cpu %u vector %u\n", cpu, vector);
 
-    // dispatch the irq
+    return vector;
+}
+
+static enum handler_return intc_dispatch(uint vector, uint cpu)
+{
     enum handler_return ret = INT_NO_RESCHEDULE;
 
 #if WITH_SMP
     if (vector == INTERRUPT_ARM_LOCAL_MAILBOX0) {
-        pend = *REG32(INTC_LOCAL_MAILBOX0_CLR0 + 0x10 * cpu);
+        uint32_t pend = *REG32(INTC_LOCAL_MAILBOX0_CLR0 + 0x10 * cpu);
         LTRACEF("mailbox0 clr 0x%x\n", pend);
 
         // ack it
         *REG32(INTC_LOCAL_MAILBOX0_CLR0 + 0x10 * cpu) = pend;
 
         if (pend & (1 << MP_IPI_GENERIC)) {
-            PANIC_UNIMPLEMENTED;
+            mp_mbx_generic_irq();
         }
         if (pend & (1 << MP_IPI_RESCHEDULE)) {
             ret = mp_mbx_reschedule_irq();
         }
     } else
 #endif // WITH_SMP
-    if (vector == 0xffffffff) {
-        ret = INT_NO_RESCHEDULE;
-    } else if (int_handler_table[vector].handler) {
+    if (int_handler_table[vector].handler) {
         ret = int_handler_table[vector].handler(int_handler_table[vector].arg);
     } else {
         panic("irq %u fired on cpu %u but no handler set!\n", vector, cpu);
@@ -252,6 +260,28 @@ decoded:
     return ret;
 }
 
+enum handler_return platform_irq(struct arm_iframe *frame)
+{
+    uint cpu = arch_curr_cpu_num();
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    THREAD_STATS_INC(interrupts);
+
+    /* there's no ack, keep going while anything is still pending */
+    for (uint i = 0; i < INTC_IRQ_BUDGET; i++) {
+        uint vector = intc_decode(cpu);
+        if (vector == INTC_NO_VECTOR)
+            break;
+
+        IRQSTATS_BEGIN(start);
+        if (intc_dispatch(vector, cpu) == INT_RESCHEDULE)
+            ret = INT_RESCHEDULE;
+        IRQSTATS_END(vector, start);
+    }
+
+    return ret;
+}
+
 enum handler_return platform_fiq(struct arm_iframe *frame)
 {
     PANIC_UNIMPLEMENTED;
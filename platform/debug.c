@@ -24,6 +24,16 @@
 #include <compiler.h>
 #include <debug.h>
 
+__WEAK void platform_dputs(const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		platform_dputc(str[i]);
+}
+
+__WEAK void platform_panic_start(void)
+{
+}
+
 __WEAK void platform_pputc(char c)
 {
 	return platform_dputc(c);
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <platform/interrupts.h>
+
+#include <compiler.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * default implementation, if the interrupt controller can't route interrupts.
+ */
+__WEAK status_t set_interrupt_affinity(unsigned int vector, uint cpu_mask)
+{
+	return ERR_NOT_SUPPORTED;
+}
+
+struct int_thread {
+	unsigned int vector;
+	int_check_handler check;
+	int_thread_handler handler;
+	void *arg;
+	event_t event;
+	thread_t *thread;
+};
+
+static enum handler_return int_thread_irq(void *arg)
+{
+	struct int_thread *it = arg;
+
+	if (it->check && !it->check(it->arg))
+		return INT_NO_RESCHEDULE;
+
+	mask_interrupt(it->vector);
+	event_signal(&it->event, false);
+
+	return INT_RESCHEDULE;
+}
+
+static int int_thread_entry(void *arg)
+{
+	struct int_thread *it = arg;
+
+	for (;;) {
+		event_wait(&it->event);
+
+		LTRACEF("vector %u\n", it->vector);
+		it->handler(it->arg);
+
+		unmask_interrupt(it->vector);
+	}
+
+	return 0;
+}
+
+status_t register_int_handler_threaded(unsigned int vector, int_check_handler check,
+                                       int_thread_handler handler, void *arg, int priority)
+{
+	DEBUG_ASSERT(handler);
+
+	struct int_thread *it = calloc(1, sizeof(*it));
+	if (!it)
+		return ERR_NO_MEMORY;
+
+	it->vector = vector;
+	it->check = check;
+	it->handler = handler;
+	it->arg = arg;
+	event_init(&it->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+	char name[32];
+	snprintf(name, sizeof(name), "irq %u", vector);
+
+	it->thread = thread_create(name, &int_thread_entry, it, priority, DEFAULT_STACK_SIZE);
+	if (!it->thread) {
+		free(it);
+		return ERR_NO_MEMORY;
+	}
+	thread_detach_and_resume(it->thread);
+
+	register_int_handler(vector, &int_thread_irq, it);
+
+	return NO_ERROR;
+}
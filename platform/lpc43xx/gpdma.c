@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <err.h>
+#include <reg.h>
+#include <arch/arm/cm.h>
+#include <kernel/spinlock.h>
+
+#include <platform/lpc43xx-gpdma.h>
+
+static struct {
+	lpc43xx_dma_callback_t cb;
+	void *arg;
+} dma_handlers[DMA_CHANNELS];
+
+static spin_lock_t dma_lock = SPIN_LOCK_INITIAL_VALUE;
+
+status_t lpc43xx_dma_register(unsigned ch, lpc43xx_dma_callback_t cb, void *arg)
+{
+	spin_lock_saved_state_t state;
+	status_t err = NO_ERROR;
+
+	if (ch >= DMA_CHANNELS)
+		return ERR_INVALID_ARGS;
+
+	spin_lock_irqsave(&dma_lock, state);
+	if (cb && dma_handlers[ch].cb) {
+		err = ERR_ALREADY_EXISTS;
+	} else {
+		dma_handlers[ch].cb = cb;
+		dma_handlers[ch].arg = arg;
+		writel(DMA_CONFIG_EN, DMA_CONFIG);
+		NVIC_EnableIRQ(DMA_IRQn);
+	}
+	spin_unlock_irqrestore(&dma_lock, state);
+
+	return err;
+}
+
+void lpc43xx_dma_set_periph(unsigned n, unsigned sel)
+{
+	spin_lock_saved_state_t state;
+
+	spin_lock_irqsave(&dma_lock, state);
+	writel((readl(DMAMUX_REG) & DMAMUX_M(n)) | DMAMUX_P(n, sel), DMAMUX_REG);
+	spin_unlock_irqrestore(&dma_lock, state);
+}
+
+void lpc43xx_DMA_IRQ(void)
+{
+	enum handler_return ret = INT_NO_RESCHEDULE;
+	unsigned tc, err, ch;
+
+	arm_cm_irq_entry();
+
+	tc = readl(DMA_INTTCSTAT);
+	err = readl(DMA_INTERRSTAT);
+	writel(tc, DMA_INTTCCLR);
+	writel(err, DMA_INTERRCLR);
+
+	for (ch = 0; ch < DMA_CHANNELS; ch++) {
+		unsigned status = 0;
+		if (tc & (1 << ch))
+			status |= DMA_STATUS_DONE;
+		if (err & (1 << ch))
+			status |= DMA_STATUS_ERROR;
+		if (status && dma_handlers[ch].cb) {
+			if (dma_handlers[ch].cb(ch, status, dma_handlers[ch].arg) == INT_RESCHEDULE)
+				ret = INT_RESCHEDULE;
+		}
+	}
+
+	arm_cm_irq_exit(ret == INT_RESCHEDULE);
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <reg.h>
+#include <trace.h>
+#include <arch/arm/cm.h>
+#include <dev/driver.h>
+#include <dev/class/i2c.h>
+#include <kernel/spinlock.h>
+
+#include <platform/lpc43xx-i2c.h>
+#include <platform/lpc43xx-clocks.h>
+
+#define LOCAL_TRACE 0
+
+extern uint8_t __lpc43xx_main_clock_sel;
+extern uint32_t __lpc43xx_main_clock_mhz;
+
+// The i2c block has no dma requests, so transfers are run a byte at a time
+// from its interrupt. The cpu is only involved once per byte on the bus.
+
+struct device_class i2c_device_class = {
+	.name = "i2c",
+};
+
+struct i2c_state {
+	uint32_t base;
+
+	// everything below is protected by lock
+	spin_lock_t lock;
+	struct list_node queue;	// requests waiting behind the active one
+	i2c_request_t *active;
+	size_t index;		// current transaction of the active request
+	size_t pos;		// next byte of it
+};
+
+// one per controller, for the interrupt handlers
+static struct i2c_state *i2c_states[2];
+
+static status_t i2c_init(struct device *dev);
+static status_t i2c_submit(struct device *dev, i2c_request_t *req);
+
+static struct i2c_ops the_ops = {
+	.std = {
+		.device_class = &i2c_device_class,
+		.init = i2c_init,
+	},
+	.submit = i2c_submit,
+};
+
+DRIVER_EXPORT(i2c, &the_ops.std);
+
+static status_t i2c_init(struct device *dev)
+{
+	if (!dev)
+		return ERR_INVALID_ARGS;
+
+	if (!dev->config)
+		return ERR_NOT_CONFIGURED;
+
+	const struct lpc43xx_i2c_config *config = dev->config;
+	unsigned num;
+
+	if (config->base == I2C0_BASE)
+		num = 0;
+	else if (config->base == I2C1_BASE)
+		num = 1;
+	else
+		return ERR_INVALID_ARGS;
+
+	if (config->hz == 0)
+		return ERR_INVALID_ARGS;
+	if (i2c_states[num])
+		return ERR_ALREADY_EXISTS;
+
+	struct i2c_state *state = calloc(1, sizeof(*state));
+	if (!state)
+		return ERR_NO_MEMORY;
+
+	state->base = config->base;
+	spin_lock_init(&state->lock);
+	list_initialize(&state->queue);
+
+	if (num == 0) {
+		writel(SFSI2C0_SCL_EZI | SFSI2C0_SDA_EZI, SFSI2C0);
+		writel(BASE_CLK_SEL(__lpc43xx_main_clock_sel), BASE_APB1_CLK);
+	} else {
+		writel(BASE_CLK_SEL(__lpc43xx_main_clock_sel), BASE_APB3_CLK);
+	}
+
+	uint32_t half = __lpc43xx_main_clock_mhz / config->hz / 2;
+	if (half < 4)
+		half = 4;
+	if (half > 0xFFFF)
+		half = 0xFFFF;
+
+	writel(CON_AA | CON_SI | CON_STO | CON_STA | CON_I2EN, state->base + REG_I2C_CONCLR);
+	writel(half, state->base + REG_I2C_SCLH);
+	writel(half, state->base + REG_I2C_SCLL);
+	writel(CON_I2EN, state->base + REG_I2C_CONSET);
+
+	dev->state = state;
+	i2c_states[num] = state;
+
+	NVIC_EnableIRQ(num == 0 ? I2C0_IRQn : I2C1_IRQn);
+
+	return NO_ERROR;
+}
+
+// start the next queued request, if there is one and the bus is ours.
+// stop is optional, it's queued in front of the start on the bus.
+static void i2c_start_locked(struct i2c_state *state, uint32_t stop)
+{
+	if (!state->active) {
+		state->active = list_remove_head_type(&state->queue, i2c_request_t, node);
+		state->index = 0;
+		state->pos = 0;
+	}
+
+	writel(state->active ? (stop | CON_STA) : stop, state->base + REG_I2C_CONSET);
+}
+
+static void i2c_finish_locked(struct i2c_state *state, status_t result, struct list_node *done)
+{
+	i2c_request_t *req = state->active;
+
+	LTRACEF("req %p result %d\n", req, result);
+
+	req->result = result;
+	list_add_tail(done, &req->node);
+	state->active = NULL;
+}
+
+static status_t i2c_submit(struct device *dev, i2c_request_t *req)
+{
+	DEBUG_ASSERT(dev);
+	DEBUG_ASSERT(req);
+
+	struct i2c_state *state = dev->state;
+	if (!state)
+		return ERR_NOT_CONFIGURED;
+
+	// a read has to clock in at least one byte before it can nack and stop
+	for (size_t i = 0; i < req->count; i++) {
+		if ((req->txn[i].flags & I2C_READ) && req->txn[i].len == 0)
+			return ERR_INVALID_ARGS;
+	}
+
+	if (req->count == 0) {
+		class_i2c_request_complete(req, NO_ERROR);
+		return NO_ERROR;
+	}
+
+	spin_lock_saved_state_t sstate;
+	spin_lock_irqsave(&state->lock, sstate);
+	list_add_tail(&state->queue, &req->node);
+	if (!state->active)
+		i2c_start_locked(state, 0);
+	spin_unlock_irqrestore(&state->lock, sstate);
+
+	return NO_ERROR;
+}
+
+// move on from a transaction that's done: a repeated start for the next one,
+// or a stop and on to the next request
+static void i2c_next_txn_locked(struct i2c_state *state, struct list_node *done)
+{
+	state->index++;
+	state->pos = 0;
+
+	if (state->index < state->active->count) {
+		writel(CON_STA, state->base + REG_I2C_CONSET);
+		return;
+	}
+
+	i2c_finish_locked(state, NO_ERROR, done);
+	i2c_start_locked(state, CON_STO);
+}
+
+static void i2c_fail_locked(struct i2c_state *state, status_t err, struct list_node *done)
+{
+	i2c_finish_locked(state, err, done);
+	i2c_start_locked(state, CON_STO);
+}
+
+static bool i2c_irq(struct i2c_state *state)
+{
+	struct list_node done = LIST_INITIAL_VALUE(done);
+	uint32_t base = state->base;
+
+	spin_lock(&state->lock);
+
+	uint32_t stat = readl(base + REG_I2C_STAT);
+	i2c_request_t *req = state->active;
+	struct i2c_transaction *txn = req ? &req->txn[state->index] : NULL;
+	uint8_t *buf = txn ? txn->buf : NULL;
+
+	LTRACEF("stat 0x%x\n", stat);
+
+	if (!req) {
+		// nothing to do, let go of the bus
+		writel(CON_STO, base + REG_I2C_CONSET);
+		writel(CON_STA, base + REG_I2C_CONCLR);
+	} else switch (stat) {
+		case STAT_START:
+		case STAT_RESTART:
+			writel((txn->addr << 1) | ((txn->flags & I2C_READ) ? 1 : 0), base + REG_I2C_DAT);
+			writel(CON_STA, base + REG_I2C_CONCLR);
+			break;
+		case STAT_SLAW_ACK:
+		case STAT_TX_ACK:
+			if (state->pos < txn->len)
+				writel(buf[state->pos++], base + REG_I2C_DAT);
+			else
+				i2c_next_txn_locked(state, &done);
+			break;
+		case STAT_SLAR_ACK:
+			// ack every byte but the last
+			if (txn->len > 1)
+				writel(CON_AA, base + REG_I2C_CONSET);
+			else
+				writel(CON_AA, base + REG_I2C_CONCLR);
+			break;
+		case STAT_RX_ACK:
+			buf[state->pos++] = readl(base + REG_I2C_DAT);
+			if (state->pos + 1 < txn->len)
+				writel(CON_AA, base + REG_I2C_CONSET);
+			else
+				writel(CON_AA, base + REG_I2C_CONCLR);
+			break;
+		case STAT_RX_NACK:
+			buf[state->pos++] = readl(base + REG_I2C_DAT);
+			i2c_next_txn_locked(state, &done);
+			break;
+		case STAT_SLAW_NACK:
+		case STAT_SLAR_NACK:
+			// nobody answered at that address
+			i2c_fail_locked(state, ERR_NOT_FOUND, &done);
+			break;
+		case STAT_TX_NACK:
+			i2c_fail_locked(state, ERR_IO, &done);
+			break;
+		case STAT_ARB_LOST:
+			// we're off the bus already, a start goes out once it's free
+			i2c_finish_locked(state, ERR_BUSY, &done);
+			i2c_start_locked(state, 0);
+			break;
+		default:
+			i2c_fail_locked(state, ERR_IO, &done);
+			break;
+	}
+
+	writel(CON_SI, base + REG_I2C_CONCLR);
+
+	spin_unlock(&state->lock);
+
+	if (list_is_empty(&done))
+		return false;
+
+	i2c_request_t *r;
+	while ((r = list_remove_head_type(&done, i2c_request_t, node)) != NULL)
+		class_i2c_request_complete(r, r->result);
+
+	return true;
+}
+
+void lpc43xx_I2C0_IRQ(void)
+{
+	bool resched = false;
+
+	arm_cm_irq_entry();
+	if (i2c_states[0])
+		resched = i2c_irq(i2c_states[0]);
+	arm_cm_irq_exit(resched);
+}
+
+void lpc43xx_I2C1_IRQ(void)
+{
+	bool resched = false;
+
+	arm_cm_irq_entry();
+	if (i2c_states[1])
+		resched = i2c_irq(i2c_states[1]);
+	arm_cm_irq_exit(resched);
+}
@@ -23,6 +23,8 @@
 
 #pragma once
 
+#include <sys/types.h>
+
 // these are bitmasks of ch0..ch7 in bit0..bit7
 #define DMA_INTSTAT		0x40002000 // ro: INTTCSTAT | INTERRSTAT
 #define DMA_INTTCSTAT		0x40002004
@@ -145,7 +147,7 @@
 #define P9_I2S0_DMA1	1
 #define P9_SCT_DMA1	2
 
-#define P10_SSP0_RX	0
+#define P10_SSP0_TX	0
 #define P10_I2S0_DMA2	1
 #define P10_SCT_DMA0	2
 
@@ -153,7 +155,7 @@
 #define P11_SGPIO14	1
 #define P11_USART0_TX	2
 
-#define P12_SSP1_RX	0
+#define P12_SSP1_TX	0
 #define P12_SGPIO15	1
 #define P12_USART0_RX	2
 
@@ -172,3 +174,17 @@
 #define P15_SGPIO15	2
 #define P15_TIMER3_M0	3
 
+#define DMA_CHANNELS	8
+
+// status bits passed to channel callbacks
+#define DMA_STATUS_DONE		(1 << 0) // terminal count reached
+#define DMA_STATUS_ERROR	(1 << 1)
+
+typedef enum handler_return (*lpc43xx_dma_callback_t)(unsigned ch, unsigned status, void *arg);
+
+// route a channel's interrupts to cb, from the shared DMA irq.
+// also turns on the controller. pass a NULL cb to release the channel.
+status_t lpc43xx_dma_register(unsigned ch, lpc43xx_dma_callback_t cb, void *arg);
+
+// select which of the four sources drives peripheral request line n
+void lpc43xx_dma_set_periph(unsigned n, unsigned sel);
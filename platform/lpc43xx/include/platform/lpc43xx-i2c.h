@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#define I2C0_BASE	0x400A1000
+#define I2C1_BASE	0x400E0000
+
+#define REG_I2C_CONSET	0x00 // RW Control Set
+#define REG_I2C_STAT	0x04 // RO Status
+#define REG_I2C_DAT	0x08 // RW Data
+#define REG_I2C_ADR0	0x0C // RW Slave Address 0
+#define REG_I2C_SCLH	0x10 // RW SCL High Duty Cycle
+#define REG_I2C_SCLL	0x14 // RW SCL Low Duty Cycle
+#define REG_I2C_CONCLR	0x18 // WO Control Clear
+
+#define CON_AA		(1 << 2) // assert ack
+#define CON_SI		(1 << 3) // interrupt, bus stalls while set
+#define CON_STO		(1 << 4) // stop
+#define CON_STA		(1 << 5) // start
+#define CON_I2EN	(1 << 6) // enable
+
+// master mode STAT values
+#define STAT_START	0x08 // start sent
+#define STAT_RESTART	0x10 // repeated start sent
+#define STAT_SLAW_ACK	0x18
+#define STAT_SLAW_NACK	0x20
+#define STAT_TX_ACK	0x28 // data sent, ack'd
+#define STAT_TX_NACK	0x30 // data sent, nack'd
+#define STAT_ARB_LOST	0x38
+#define STAT_SLAR_ACK	0x40
+#define STAT_SLAR_NACK	0x48
+#define STAT_RX_ACK	0x50 // data received, ack returned
+#define STAT_RX_NACK	0x58 // data received, nack returned
+#define STAT_IDLE	0xF8 // no SI pending
+#define STAT_BUS_ERROR	0x00
+
+// I2C0 uses dedicated open drain pins, configured here instead of the scu
+#define SFSI2C0		0x40086C80
+#define SFSI2C0_SCL_EFP	(1 << 0) // 3ns glitch filter (fast mode plus)
+#define SFSI2C0_SCL_EHD	(1 << 2) // fast mode plus drive
+#define SFSI2C0_SCL_EZI	(1 << 3) // input receiver enable
+#define SFSI2C0_SCL_ZIF	(1 << 7) // 1 = disable the 50ns glitch filter
+#define SFSI2C0_SDA_EFP	(1 << 8)
+#define SFSI2C0_SDA_EHD	(1 << 10)
+#define SFSI2C0_SDA_EZI	(1 << 11)
+#define SFSI2C0_SDA_ZIF	(1 << 15)
+
+// config for an i2c class device instance
+struct lpc43xx_i2c_config {
+	uint32_t base;		// I2C0_BASE or I2C1_BASE
+	uint32_t hz;		// bus clock
+};
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#define SSP0_BASE	0x40083000
+#define SSP1_BASE	0x400C5000
+
+#define REG_SSP_CR0	0x00 // RW Control 0
+#define REG_SSP_CR1	0x04 // RW Control 1
+#define REG_SSP_DR	0x08 // RW Data (fifo)
+#define REG_SSP_SR	0x0C // RO Status
+#define REG_SSP_CPSR	0x10 // RW Clock Prescale (even, 2..254)
+#define REG_SSP_IMSC	0x14 // RW Interrupt Mask Set/Clear
+#define REG_SSP_RIS	0x18 // RO Raw Interrupt Status
+#define REG_SSP_MIS	0x1C // RO Masked Interrupt Status
+#define REG_SSP_ICR	0x20 // WO Interrupt Clear
+#define REG_SSP_DMACR	0x24 // RW DMA Control
+
+#define CR0_DSS(n)	(((n) - 1) & 15) // data size, 4..16 bits
+#define CR0_FRF_SPI	(0 << 4)
+#define CR0_FRF_TI	(1 << 4)
+#define CR0_FRF_MW	(2 << 4) // microwire
+#define CR0_CPOL	(1 << 6) // clock idles high
+#define CR0_CPHA	(1 << 7) // capture on the second edge
+#define CR0_SCR(n)	(((n) & 0xFF) << 8) // bit clock = PCLK / (CPSR * (SCR + 1))
+
+#define CR1_LBM		(1 << 0) // loopback
+#define CR1_SSE		(1 << 1) // enable
+#define CR1_MS		(1 << 2) // 1 = slave
+#define CR1_SOD		(1 << 3) // slave output disable
+
+#define SR_TFE		(1 << 0) // tx fifo empty
+#define SR_TNF		(1 << 1) // tx fifo not full
+#define SR_RNE		(1 << 2) // rx fifo not empty
+#define SR_RFF		(1 << 3) // rx fifo full
+#define SR_BSY		(1 << 4) // busy
+
+#define SSP_INT_ROR	(1 << 0) // rx overrun
+#define SSP_INT_RT	(1 << 1) // rx timeout
+#define SSP_INT_RX	(1 << 2) // rx fifo half full
+#define SSP_INT_TX	(1 << 3) // tx fifo half empty
+
+#define DMACR_RXDMAE	(1 << 0)
+#define DMACR_TXDMAE	(1 << 1)
+
+// config for an spi class device instance. the target sets up the
+// pin mux for the ssp and the chip select gpio.
+struct lpc43xx_spi_config {
+	uint32_t base;		// SSP0_BASE or SSP1_BASE
+	uint32_t hz;		// bit clock, rounded down
+	uint32_t mode;		// CR0_CPOL | CR0_CPHA
+	unsigned cs_gpio;	// driven low by SPI_CS_ASSERT, high by SPI_CS_DEASSERT
+	unsigned dma_rx_ch;	// gpdma channels, lower numbers have priority
+	unsigned dma_tx_ch;	// so rx should have the lower one
+};
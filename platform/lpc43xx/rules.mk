@@ -20,6 +20,9 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/gpio.c \
 	$(LOCAL_DIR)/vectab.c \
 	$(LOCAL_DIR)/debug.c \
+	$(LOCAL_DIR)/gpdma.c \
+	$(LOCAL_DIR)/i2c.c \
+	$(LOCAL_DIR)/ssp.c \
 	$(LOCAL_DIR)/udc.c \
 	$(LOCAL_DIR)/udc-common.c
 
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <reg.h>
+#include <trace.h>
+#include <arch/arm/cm.h>
+#include <dev/driver.h>
+#include <dev/gpio.h>
+#include <dev/class/spi.h>
+#include <kernel/spinlock.h>
+
+#include <platform/lpc43xx-ssp.h>
+#include <platform/lpc43xx-gpdma.h>
+#include <platform/lpc43xx-clocks.h>
+
+#define LOCAL_TRACE 0
+
+// largest transfer a gpdma channel can do in one go
+#define SSP_MAX_CHUNK	0xFFF
+
+extern uint8_t __lpc43xx_main_clock_sel;
+extern uint32_t __lpc43xx_main_clock_mhz;
+
+struct device_class spi_device_class = {
+	.name = "spi",
+};
+
+struct ssp_state {
+	struct device *dev;
+	unsigned rx_periph;
+	unsigned tx_periph;
+
+	// clocked in and out for transactions that only go one way
+	uint8_t dummy_rx;
+	uint8_t dummy_tx;
+
+	// everything below is protected by lock
+	spin_lock_t lock;
+	struct list_node queue;	// requests waiting behind the active one
+	spi_request_t *active;
+	size_t index;		// current transaction of the active request
+	size_t offset;		// how far into it we are
+	size_t chunk;		// size of the transfer in flight
+	ssize_t transferred;
+};
+
+static status_t ssp_init(struct device *dev);
+static status_t ssp_submit(struct device *dev, spi_request_t *req);
+static enum handler_return ssp_dma_irq(unsigned ch, unsigned status, void *arg);
+
+static struct spi_ops the_ops = {
+	.std = {
+		.device_class = &spi_device_class,
+		.init = ssp_init,
+	},
+	.submit = ssp_submit,
+};
+
+DRIVER_EXPORT(spi, &the_ops.std);
+
+static status_t ssp_init(struct device *dev)
+{
+	if (!dev)
+		return ERR_INVALID_ARGS;
+
+	if (!dev->config)
+		return ERR_NOT_CONFIGURED;
+
+	const struct lpc43xx_spi_config *config = dev->config;
+	uint32_t base_clk;
+
+	if (config->base == SSP0_BASE)
+		base_clk = BASE_SSP0_CLK;
+	else if (config->base == SSP1_BASE)
+		base_clk = BASE_SSP1_CLK;
+	else
+		return ERR_INVALID_ARGS;
+
+	if (config->hz == 0 || config->dma_rx_ch >= DMA_CHANNELS ||
+	    config->dma_tx_ch >= DMA_CHANNELS || config->dma_rx_ch == config->dma_tx_ch)
+		return ERR_INVALID_ARGS;
+
+	struct ssp_state *state = calloc(1, sizeof(*state));
+	if (!state)
+		return ERR_NO_MEMORY;
+
+	state->dev = dev;
+	state->dummy_tx = 0xFF;
+	spin_lock_init(&state->lock);
+	list_initialize(&state->queue);
+
+	// each ssp has a fixed pair of request lines
+	if (config->base == SSP0_BASE) {
+		state->rx_periph = 9;
+		state->tx_periph = 10;
+		lpc43xx_dma_set_periph(9, P9_SSP0_RX);
+		lpc43xx_dma_set_periph(10, P10_SSP0_TX);
+	} else {
+		state->rx_periph = 11;
+		state->tx_periph = 12;
+		lpc43xx_dma_set_periph(11, P11_SSP1_RX);
+		lpc43xx_dma_set_periph(12, P12_SSP1_TX);
+	}
+
+	status_t err = lpc43xx_dma_register(config->dma_rx_ch, ssp_dma_irq, state);
+	if (err < 0)
+		goto fail;
+	err = lpc43xx_dma_register(config->dma_tx_ch, ssp_dma_irq, state);
+	if (err < 0) {
+		lpc43xx_dma_register(config->dma_rx_ch, NULL, NULL);
+		goto fail;
+	}
+
+	gpio_config(config->cs_gpio, GPIO_OUTPUT);
+	gpio_set(config->cs_gpio, 1);
+
+	// bit clock = pclk / (cpsr * (scr + 1)), cpsr even
+	uint32_t pclk = __lpc43xx_main_clock_mhz;
+	uint32_t cpsr = 2;
+	uint32_t scr;
+	for (;;) {
+		scr = (pclk + (cpsr * config->hz) - 1) / (cpsr * config->hz);
+		if (scr > 0)
+			scr--;
+		if (scr <= 255 || cpsr == 254)
+			break;
+		cpsr += 2;
+	}
+	if (scr > 255)
+		scr = 255;
+
+	writel(BASE_CLK_SEL(__lpc43xx_main_clock_sel), base_clk);
+	writel(0, config->base + REG_SSP_CR1);
+	writel(CR0_DSS(8) | CR0_FRF_SPI | (config->mode & (CR0_CPOL | CR0_CPHA)) | CR0_SCR(scr),
+		config->base + REG_SSP_CR0);
+	writel(cpsr, config->base + REG_SSP_CPSR);
+	writel(0, config->base + REG_SSP_IMSC);
+	writel(DMACR_RXDMAE | DMACR_TXDMAE, config->base + REG_SSP_DMACR);
+	writel(CR1_SSE, config->base + REG_SSP_CR1);
+
+	LTRACEF("ssp 0x%x: cpsr %u scr %u, %u hz\n", config->base, cpsr, scr, pclk / (cpsr * (scr + 1)));
+
+	dev->state = state;
+
+	return NO_ERROR;
+
+fail:
+	free(state);
+	return err;
+}
+
+// Program both channels for the next piece of the active request. The rx
+// channel finishing is what ends a transfer, tx always runs alongside it
+// so the clock keeps going. Returns 1 if a transfer was started, 0 if the
+// request has nothing left to do.
+static status_t ssp_start_chunk_locked(struct ssp_state *state)
+{
+	const struct lpc43xx_spi_config *config = state->dev->config;
+	spi_request_t *req = state->active;
+
+	while (state->index < req->count) {
+		struct spi_transaction *txn = &req->txn[state->index];
+
+		if (state->offset == 0 && (txn->flags & SPI_CS_ASSERT))
+			gpio_set(config->cs_gpio, 0);
+
+		size_t len = MIN(txn->len - state->offset, SSP_MAX_CHUNK);
+		if (len == 0) {
+			if (txn->flags & SPI_CS_DEASSERT)
+				gpio_set(config->cs_gpio, 1);
+			state->index++;
+			state->offset = 0;
+			continue;
+		}
+
+		if (!(txn->flags & (SPI_READ | SPI_WRITE)))
+			return ERR_INVALID_ARGS;
+
+		bool rx = txn->flags & SPI_READ;
+		bool tx = txn->flags & SPI_WRITE;
+		uint32_t rx_addr = rx ? (uint32_t)txn->rx_buf + state->offset : (uint32_t)&state->dummy_rx;
+		uint32_t tx_addr = tx ? (uint32_t)txn->tx_buf + state->offset : (uint32_t)&state->dummy_tx;
+
+		LTRACEF("txn %zu offset %zu len %zu\n", state->index, state->offset, len);
+
+		writel(config->base + REG_SSP_DR, DMA_SRC(config->dma_rx_ch));
+		writel(rx_addr, DMA_DST(config->dma_rx_ch));
+		writel(0, DMA_LLI(config->dma_rx_ch));
+		writel(DMA_XFER_SIZE(len) |
+			DMA_SRC_BURST(BURST_1) | DMA_DST_BURST(BURST_1) |
+			DMA_SRC_BYTE | DMA_DST_BYTE | DMA_SRC_MASTER1 | DMA_DST_MASTER0 |
+			(rx ? DMA_DST_INCR : 0) | DMA_PROT1 | DMA_TC_IE,
+			DMA_CTL(config->dma_rx_ch));
+		writel(DMA_ENABLE | DMA_SRC_PERIPH(state->rx_periph) | DMA_FLOW_P2M_DMAc |
+			DMA_TC_IRQ_EN | DMA_ERR_IRQ_EN,
+			DMA_CFG(config->dma_rx_ch));
+
+		writel(tx_addr, DMA_SRC(config->dma_tx_ch));
+		writel(config->base + REG_SSP_DR, DMA_DST(config->dma_tx_ch));
+		writel(0, DMA_LLI(config->dma_tx_ch));
+		writel(DMA_XFER_SIZE(len) |
+			DMA_SRC_BURST(BURST_1) | DMA_DST_BURST(BURST_1) |
+			DMA_SRC_BYTE | DMA_DST_BYTE | DMA_SRC_MASTER0 | DMA_DST_MASTER1 |
+			(tx ? DMA_SRC_INCR : 0) | DMA_PROT1,
+			DMA_CTL(config->dma_tx_ch));
+		writel(DMA_ENABLE | DMA_DST_PERIPH(state->tx_periph) | DMA_FLOW_M2P_DMAc |
+			DMA_ERR_IRQ_EN,
+			DMA_CFG(config->dma_tx_ch));
+
+		state->chunk = len;
+		return 1;
+	}
+
+	return 0;
+}
+
+// account for the transfer that just finished
+static void ssp_chunk_done_locked(struct ssp_state *state)
+{
+	const struct lpc43xx_spi_config *config = state->dev->config;
+	struct spi_transaction *txn = &state->active->txn[state->index];
+
+	state->offset += state->chunk;
+	state->transferred += state->chunk;
+	state->chunk = 0;
+
+	if (state->offset == txn->len) {
+		if (txn->flags & SPI_CS_DEASSERT)
+			gpio_set(config->cs_gpio, 1);
+		state->index++;
+		state->offset = 0;
+	}
+}
+
+static void ssp_finish_locked(struct ssp_state *state, ssize_t result, struct list_node *done)
+{
+	const struct lpc43xx_spi_config *config = state->dev->config;
+	spi_request_t *req = state->active;
+
+	if (result < 0) {
+		// stop both channels and drop whatever made it into the fifo
+		writel(0, DMA_CFG(config->dma_rx_ch));
+		writel(0, DMA_CFG(config->dma_tx_ch));
+		while (readl(config->base + REG_SSP_SR) & (SR_BSY | SR_RNE))
+			readl(config->base + REG_SSP_DR);
+		gpio_set(config->cs_gpio, 1);
+	}
+
+	req->result = result;
+	list_add_tail(done, &req->node);
+	state->active = NULL;
+}
+
+// Keep the ssp busy until the queue is empty. Finished requests are moved
+// to done, to be completed once the lock is dropped.
+static void ssp_run_locked(struct ssp_state *state, struct list_node *done)
+{
+	for (;;) {
+		if (!state->active) {
+			state->active = list_remove_head_type(&state->queue, spi_request_t, node);
+			if (!state->active)
+				return;
+
+			state->index = 0;
+			state->offset = 0;
+			state->chunk = 0;
+			state->transferred = 0;
+		}
+
+		status_t err = ssp_start_chunk_locked(state);
+		if (err > 0)
+			return;
+
+		ssp_finish_locked(state, (err < 0) ? err : state->transferred, done);
+	}
+}
+
+static void ssp_complete_list(struct list_node *done)
+{
+	spi_request_t *req;
+	while ((req = list_remove_head_type(done, spi_request_t, node)) != NULL)
+		class_spi_request_complete(req, req->result);
+}
+
+static status_t ssp_submit(struct device *dev, spi_request_t *req)
+{
+	DEBUG_ASSERT(dev);
+	DEBUG_ASSERT(req);
+
+	struct ssp_state *state = dev->state;
+	if (!state)
+		return ERR_NOT_CONFIGURED;
+
+	struct list_node done = LIST_INITIAL_VALUE(done);
+	spin_lock_saved_state_t sstate;
+
+	spin_lock_irqsave(&state->lock, sstate);
+	list_add_tail(&state->queue, &req->node);
+	if (!state->active)
+		ssp_run_locked(state, &done);
+	spin_unlock_irqrestore(&state->lock, sstate);
+
+	ssp_complete_list(&done);
+
+	return NO_ERROR;
+}
+
+static enum handler_return ssp_dma_irq(unsigned ch, unsigned status, void *arg)
+{
+	struct ssp_state *state = arg;
+	const struct lpc43xx_spi_config *config = state->dev->config;
+	struct list_node done = LIST_INITIAL_VALUE(done);
+
+	// tx finishing early means nothing, the last bytes are still in flight
+	if (ch == config->dma_tx_ch && !(status & DMA_STATUS_ERROR))
+		return INT_NO_RESCHEDULE;
+
+	spin_lock(&state->lock);
+	if (state->active) {
+		if (status & DMA_STATUS_ERROR) {
+			ssp_finish_locked(state, ERR_IO, &done);
+		} else {
+			ssp_chunk_done_locked(state);
+		}
+		ssp_run_locked(state, &done);
+	}
+	spin_unlock(&state->lock);
+
+	if (list_is_empty(&done))
+		return INT_NO_RESCHEDULE;
+
+	ssp_complete_list(&done);
+	return INT_RESCHEDULE;
+}
@@ -80,6 +80,7 @@ typedef struct usb_request {
 	udc_request_t req;
 	struct usb_request *next;
 	usb_dtd_t *dtd;
+	usb_dtd_t *zlp; // trailing zero length packet, while queued with UDC_REQUEST_FLAG_ZLP
 } usb_request_t;
 
 struct udc_endpoint {
@@ -166,16 +167,14 @@ void udc_endpoint_free(struct udc_endpoint *ept)
 	// todo
 }
 
-static void handle_ept_complete(struct udc_endpoint *ept);
+static void handle_ept_complete(struct udc_endpoint *ept, bool flush);
 
 static void endpoint_flush(usb_t *usb, udc_endpoint_t *ept) {
 	if (ept->req) {
 		// flush outstanding transfers
 		writel(ept->bit, usb->base + USB_ENDPTFLUSH);
 		while (readl(usb->base + USB_ENDPTFLUSH)) ;
-		while (ept->req) {
-			handle_ept_complete(ept);
-		}
+		handle_ept_complete(ept, true);
 	}
 }
 
@@ -230,6 +229,8 @@ udc_request_t *udc_request_alloc(void)
 
 		req->req.buffer = 0;
 		req->req.length = 0;
+		req->req.flags = 0;
+		req->zlp = NULL;
 		return &req->req;
 	}
 }
@@ -240,6 +241,59 @@ void udc_request_free(struct udc_request *req)
 	free(req);
 }
 
+static unsigned endpoint_maxpkt(udc_endpoint_t *ept)
+{
+	if (ept->num == 0)
+		return ept->maxpkt;
+	return ept->usb->highspeed ? 512 : 64;
+}
+
+static void endpoint_prime(udc_endpoint_t *ept, usb_dtd_t *dtd)
+{
+	ept->head->next_dtd = (unsigned) dtd;
+	ept->head->dtd_config = 0;
+	DSB;
+	writel(ept->bit, ept->usb->base + USB_ENDPTPRIME);
+}
+
+// add a request's dtds to the end of the endpoint's queue. if there's
+// already a transfer in flight the dtds are linked on behind it, following
+// the databook's add-dTD-tripwire sequence, so the controller runs straight
+// into them rather than waiting for the irq handler to re-prime it.
+// called with the lock held.
+static void endpoint_append(udc_endpoint_t *ept, usb_request_t *req)
+{
+	usb_t *usb = ept->usb;
+
+	if (!ept->req) {
+		ept->req = req;
+		ept->last = req;
+		endpoint_prime(ept, req->dtd);
+		return;
+	}
+
+	usb_dtd_t *tail = ept->last->zlp ? ept->last->zlp : ept->last->dtd;
+	ept->last->next = req;
+	ept->last = req;
+	tail->next_dtd = (unsigned) req->dtd;
+	DSB;
+
+	// still priming, it'll see the new link
+	if (readl(usb->base + USB_ENDPTPRIME) & ept->bit)
+		return;
+
+	unsigned active;
+	do {
+		writel(readl(usb->base + USB_CMD) | CMD_ATDTW, usb->base + USB_CMD);
+		active = readl(usb->base + USB_ENDPTSTAT) & ept->bit;
+	} while (!(readl(usb->base + USB_CMD) & CMD_ATDTW));
+	writel(readl(usb->base + USB_CMD) & ~CMD_ATDTW, usb->base + USB_CMD);
+
+	// the controller ran off the end before the link went in
+	if (!active)
+		endpoint_prime(ept, req->dtd);
+}
+
 int udc_request_queue(udc_endpoint_t *ept, struct udc_request *_req)
 {
 	spin_lock_saved_state_t state;
@@ -248,8 +302,13 @@ int udc_request_queue(udc_endpoint_t *ept, struct udc_request *_req)
 	unsigned phys = (unsigned) req->req.buffer;
 	int ret = 0;
 
+	// a transfer that ends on a packet boundary needs a zero length packet
+	// after it for the host to see the end of it
+	bool zlp = ept->in && (req->req.flags & UDC_REQUEST_FLAG_ZLP) &&
+		req->req.length && (req->req.length % endpoint_maxpkt(ept)) == 0;
+
 	dtd->next_dtd = 1; // terminate bit
-	dtd->config = DTD_LEN(req->req.length) | DTD_IOC | DTD_ACTIVE;
+	dtd->config = DTD_LEN(req->req.length) | (zlp ? 0 : DTD_IOC) | DTD_ACTIVE;
 	dtd->bptr0 = phys;
 	phys &= 0xfffff000;
 	dtd->bptr1 = phys + 0x1000;
@@ -261,48 +320,55 @@ int udc_request_queue(udc_endpoint_t *ept, struct udc_request *_req)
 	spin_lock_irqsave(&ept->usb->lock, state);
 	if (!USB.online && ept->num) {
 		ret = -1;
-	} else if (ept->req) {
-		// already a transfer in flight, add us to the list
-		// we'll get queue'd by the irq handler when it's our turn
-		ept->last->next = req;
+	} else if (zlp && !USB.dtd_freelist) {
+		ret = -1;
 	} else {
-		ept->head->next_dtd = (unsigned) dtd;
-		ept->head->dtd_config = 0;
-		DSB;
-		writel(ept->bit, ept->usb->base + USB_ENDPTPRIME);
-		ept->req = req;
+		if (zlp) {
+			req->zlp = USB.dtd_freelist;
+			USB.dtd_freelist = req->zlp->next;
+
+			req->zlp->next_dtd = 1;
+			req->zlp->config = DTD_LEN(0) | DTD_IOC | DTD_ACTIVE;
+			req->zlp->bptr0 = 0;
+			dtd->next_dtd = (unsigned) req->zlp;
+		}
+		endpoint_append(ept, req);
 	}
-	ept->last = req;
 	spin_unlock_irqrestore(&ept->usb->lock, state);
 
 	DBG("ept%d %s queue req=%p\n", ept->num, ept->in ? "in" : "out", req);
 	return ret;
 }
 
-static void handle_ept_complete(struct udc_endpoint *ept)
+// retire requests off the front of the endpoint queue, in order, as long as
+// the controller is done with them. when flushing, everything that was queued
+// on entry goes, but not anything a completion callback queues again.
+static void handle_ept_complete(struct udc_endpoint *ept, bool flush)
 {
 	usb_request_t *req;
+	usb_request_t *stop = flush ? ept->last : NULL;
 	usb_dtd_t *dtd;
 	unsigned actual;
 	int status;
 
-	DBG("ept%d %s complete req=%p\n",
-            ept->num, ept->in ? "in" : "out", ept->req);
-
-	if ((req = ept->req)) {
-		if (req->next) {
-			// queue next req to hw
-			ept->head->next_dtd = (unsigned) req->next->dtd;
-			ept->head->dtd_config = 0;
-			DSB;
-			writel(ept->bit, ept->usb->base + USB_ENDPTPRIME);
-			ept->req = req->next;
-		} else {
-			ept->req = 0;
-			ept->last = 0;
-		}
+	while ((req = ept->req)) {
+		DBG("ept%d %s complete req=%p\n",
+			ept->num, ept->in ? "in" : "out", req);
+
 		dtd = req->dtd;
-		if (dtd->config & 0xff) {
+		if (!flush && req->zlp) {
+			// still busy, unless the data part failed and the controller stopped there
+			if ((req->zlp->config & DTD_ACTIVE) && !(dtd->config & (DTD_STS_MASK & ~DTD_ACTIVE)))
+				break;
+		} else if (!flush && (dtd->config & DTD_ACTIVE)) {
+			break;
+		}
+
+		ept->req = req->next;
+		if (!ept->req)
+			ept->last = 0;
+
+		if ((dtd->config & 0xff) || (req->zlp && (req->zlp->config & 0xff))) {
 			actual = 0;
 			status = -1;
 			dprintf(INFO, "EP%d/%s FAIL nfo=%x pg0=%x\n",
@@ -311,9 +377,23 @@ static void handle_ept_complete(struct udc_endpoint *ept)
 			actual = req->req.length - ((dtd->config >> 16) & 0x7fff);
 			status = 0;
 		}
+		if (req->zlp) {
+			req->zlp->next = USB.dtd_freelist;
+			USB.dtd_freelist = req->zlp;
+			req->zlp = NULL;
+		}
 		if(req->req.complete) {
 			req->req.complete(&req->req, actual, status);
 		}
+		if (req == stop)
+			break;
+	}
+
+	// if the controller stopped short of the queue, on an error say, restart it
+	if (!flush && ept->req &&
+		!(readl(ept->usb->base + USB_ENDPTSTAT) & ept->bit) &&
+		!(readl(ept->usb->base + USB_ENDPTPRIME) & ept->bit)) {
+		endpoint_prime(ept, ept->req->dtd);
 	}
 }
 
@@ -546,10 +626,7 @@ void lpc43xx_USB0_IRQ(void)
 		usb->config_value = 0;
 		notify_gadgets(usb->gadget, UDC_EVENT_OFFLINE);
 		for (ept = usb->ept_list; ept; ept = ept->next) {
-			if (ept->req) {
-				ept->req->dtd->config = DTD_HALTED;
-				handle_ept_complete(ept);
-			}
+			handle_ept_complete(ept, true);
 		}
 	}
 	if (n & STS_PCI) {
@@ -565,7 +642,7 @@ void lpc43xx_USB0_IRQ(void)
 
 		for (ept = usb->ept_list; ept; ept = ept->next) {
 			if (n & ept->bit) {
-				handle_ept_complete(ept);
+				handle_ept_complete(ept, false);
 				ret = INT_RESCHEDULE;
 			}
 		}
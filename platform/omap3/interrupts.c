@@ -116,7 +116,7 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 
 //	TRACEF("spsr 0x%x, pc 0x%x, currthread %p, vector %d, handler %p\n", frame->spsr, frame->pc, current_thread, vector, int_handler_table[vector].handler);
 
-	THREAD_STATS_INC(interrupts);
+	THREAD_STATS_IRQ_ENTER();
 
 	// deliver the interrupt
 	enum handler_return ret;
@@ -128,6 +128,8 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 	// ack the interrupt
 	*REG32(INTC_CONTROL) = 0x1;
 
+	THREAD_STATS_IRQ_EXIT();
+
 	return ret;
 }
 
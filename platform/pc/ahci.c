@@ -0,0 +1,783 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if WITH_LIB_BIO
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <reg.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <dev/pci.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <lk/init.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * AHCI SATA controllers. Every port with a disk on it becomes a bdev, with up to
+ * 32 commands in flight at once. Disks that can do it get native command queuing,
+ * so the drive is free to finish them in whatever order suits it.
+ */
+
+#define AHCI_PCI_CLASS		0x010601
+
+/* hba registers */
+#define AHCI_CAP			0x00
+#define AHCI_GHC			0x04
+#define AHCI_IS				0x08
+#define AHCI_PI				0x0c
+
+#define AHCI_CAP_NP(cap)	(((cap) & 0x1f) + 1)
+#define AHCI_CAP_NCS(cap)	((((cap) >> 8) & 0x1f) + 1)
+#define AHCI_CAP_SNCQ		(1U << 30)
+#define AHCI_CAP_S64A		(1U << 31)
+
+#define AHCI_GHC_IE			(1U << 1)
+#define AHCI_GHC_AE			(1U << 31)
+
+/* port registers */
+#define AHCI_PORT_BASE(n)	(0x100 + (n) * 0x80)
+#define AHCI_PxCLB			0x00
+#define AHCI_PxCLBU			0x04
+#define AHCI_PxFB			0x08
+#define AHCI_PxFBU			0x0c
+#define AHCI_PxIS			0x10
+#define AHCI_PxIE			0x14
+#define AHCI_PxCMD			0x18
+#define AHCI_PxTFD			0x20
+#define AHCI_PxSIG			0x24
+#define AHCI_PxSSTS			0x28
+#define AHCI_PxSERR			0x30
+#define AHCI_PxSACT			0x34
+#define AHCI_PxCI			0x38
+
+#define AHCI_PxCMD_ST		(1U << 0)
+#define AHCI_PxCMD_FRE		(1U << 4)
+#define AHCI_PxCMD_FR		(1U << 14)
+#define AHCI_PxCMD_CR		(1U << 15)
+
+#define AHCI_PxIS_DHRS		(1U << 0)
+#define AHCI_PxIS_PSS		(1U << 1)
+#define AHCI_PxIS_SDBS		(1U << 3)
+#define AHCI_PxIS_DPS		(1U << 5)
+#define AHCI_PxIS_IFS		(1U << 27)
+#define AHCI_PxIS_HBDS		(1U << 28)
+#define AHCI_PxIS_HBFS		(1U << 29)
+#define AHCI_PxIS_TFES		(1U << 30)
+#define AHCI_PxIS_ERRORS	(AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define AHCI_PxTFD_ERR		(1U << 0)
+#define AHCI_PxTFD_DRQ		(1U << 3)
+#define AHCI_PxTFD_BSY		(1U << 7)
+
+#define AHCI_SIG_ATA		0x00000101
+
+/* ata commands */
+#define ATA_CMD_READ_DMA_EXT		0x25
+#define ATA_CMD_WRITE_DMA_EXT		0x35
+#define ATA_CMD_READ_FPDMA_QUEUED	0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED	0x61
+#define ATA_CMD_IDENTIFY			0xec
+
+#define FIS_TYPE_REG_H2D	0x27
+
+#define AHCI_MAX_PORTS		32
+#define AHCI_MAX_SLOTS		32
+#define AHCI_SECTOR_SIZE	512
+
+/* transfers are cut into pieces of at most this size, one per command slot */
+#define AHCI_MAX_PIECE		(128 * 1024)
+#define AHCI_MAX_SEGS		(AHCI_MAX_PIECE / PAGE_SIZE + 1)
+
+struct ahci_cmd_header {
+	uint16_t flags; /* fis length in dwords, write */
+	uint16_t prdtl;
+	volatile uint32_t prdbc;
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __PACKED;
+
+#define AHCI_CMD_WRITE		(1U << 6)
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc; /* byte count - 1 */
+} __PACKED;
+
+struct ahci_cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[AHCI_MAX_SEGS];
+} __PACKED;
+
+/* command tables are 128 byte aligned */
+#define AHCI_CMD_TABLE_SIZE	ROUNDUP(sizeof(struct ahci_cmd_table), 128)
+
+/* layout of a port's dma memory */
+#define AHCI_MEM_CMD_LIST	0
+#define AHCI_MEM_RX_FIS		1024
+#define AHCI_MEM_CMD_TABLES	2048
+#define AHCI_MEM_IDENTIFY	(AHCI_MEM_CMD_TABLES + AHCI_MAX_SLOTS * AHCI_CMD_TABLE_SIZE)
+#define AHCI_MEM_SIZE		ROUNDUP(AHCI_MEM_IDENTIFY + 512, PAGE_SIZE)
+
+/* state for one piece in flight, indexed by its command slot */
+struct ahci_slot {
+	bio_request_t *bio;
+	bool sync;
+	size_t len;
+};
+
+struct ahci_hba;
+
+struct ahci_port {
+	struct ahci_hba *hba;
+	uint num;
+	addr_t regs;
+
+	/* protects the slots and issuing commands */
+	spin_lock_t lock;
+	event_t slot_event; /* signaled when slots are freed */
+	uint32_t slot_mask; /* the slots the disk and controller can both use */
+	uint32_t busy;      /* slots handed out */
+	uint32_t issued;    /* slots handed to the controller */
+	bool ncq;
+
+	uint8_t *mem;
+	paddr_t mem_phys;
+	struct ahci_slot slot[AHCI_MAX_SLOTS];
+
+	/* stats */
+	ulong commands;
+	ulong errors;
+
+	bdev_t bdev;
+};
+
+struct ahci_hba {
+	addr_t regs;
+	uint32_t cap;
+	uint irq;       /* an msi vector if use_msi, otherwise the pin interrupt */
+	bool use_msi;
+	struct ahci_port *port[AHCI_MAX_PORTS];
+};
+
+static uint ahci_found_index;
+
+static inline uint32_t hba_read(struct ahci_hba *hba, uint reg)
+{
+	return *REG32(hba->regs + reg);
+}
+
+static inline void hba_write(struct ahci_hba *hba, uint reg, uint32_t val)
+{
+	*REG32(hba->regs + reg) = val;
+}
+
+static inline uint32_t port_read(struct ahci_port *port, uint reg)
+{
+	return *REG32(port->regs + reg);
+}
+
+static inline void port_write(struct ahci_port *port, uint reg, uint32_t val)
+{
+	*REG32(port->regs + reg) = val;
+}
+
+static inline struct ahci_cmd_header *ahci_cmd_header(struct ahci_port *port, uint slot)
+{
+	return (struct ahci_cmd_header *)(port->mem + AHCI_MEM_CMD_LIST) + slot;
+}
+
+static inline struct ahci_cmd_table *ahci_cmd_table(struct ahci_port *port, uint slot)
+{
+	return (struct ahci_cmd_table *)(port->mem + AHCI_MEM_CMD_TABLES + slot * AHCI_CMD_TABLE_SIZE);
+}
+
+/* wait for the bits in mask of a port register to read back as val */
+static status_t ahci_port_wait(struct ahci_port *port, uint reg, uint32_t mask, uint32_t val, lk_time_t timeout)
+{
+	lk_time_t start = current_time();
+
+	while ((port_read(port, reg) & mask) != val) {
+		if (current_time() - start > timeout)
+			return ERR_TIMED_OUT;
+	}
+
+	return NO_ERROR;
+}
+
+static status_t ahci_port_stop(struct ahci_port *port)
+{
+	port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+	if (ahci_port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500) < 0)
+		return ERR_TIMED_OUT;
+
+	port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+	return ahci_port_wait(port, AHCI_PxCMD, AHCI_PxCMD_FR, 0, 500);
+}
+
+static void ahci_port_start(struct ahci_port *port)
+{
+	port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+	port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+/* put a register fis for an lba48 command in a slot's table */
+static void ahci_build_fis(struct ahci_cmd_table *table, uint8_t command, uint64_t lba, uint count, uint tag, bool ncq)
+{
+	uint8_t *fis = table->cfis;
+
+	memset(fis, 0, 20);
+	fis[0] = FIS_TYPE_REG_H2D;
+	fis[1] = 0x80; /* command, not control */
+	fis[2] = command;
+	fis[4] = lba;
+	fis[5] = lba >> 8;
+	fis[6] = lba >> 16;
+	fis[7] = 0x40; /* lba mode */
+	fis[8] = lba >> 24;
+	fis[9] = lba >> 32;
+	fis[10] = lba >> 40;
+
+	if (ncq) {
+		/* queued commands carry the count in the features and the tag in the count */
+		fis[3] = count;
+		fis[11] = count >> 8;
+		fis[12] = tag << 3;
+	} else {
+		fis[12] = count;
+		fis[13] = count >> 8;
+	}
+}
+
+/* run a command with nothing else going on and interrupts off, during setup only */
+static status_t ahci_port_polled_command(struct ahci_port *port, uint8_t command, void *buf, size_t len)
+{
+	struct ahci_cmd_header *hdr = ahci_cmd_header(port, 0);
+	struct ahci_cmd_table *table = ahci_cmd_table(port, 0);
+
+	ahci_build_fis(table, command, 0, 0, 0, false);
+	table->cfis[7] = 0;
+
+	table->prdt[0].dba = (uint32_t)(port->mem_phys + ((uint8_t *)buf - port->mem));
+	table->prdt[0].dbau = (uint64_t)(port->mem_phys + ((uint8_t *)buf - port->mem)) >> 32;
+	table->prdt[0].dbc = len - 1;
+
+	hdr->flags = 5; /* 20 byte fis */
+	hdr->prdtl = 1;
+	hdr->prdbc = 0;
+
+	port_write(port, AHCI_PxIS, 0xffffffff);
+	port_write(port, AHCI_PxCI, 1);
+
+	status_t err = ahci_port_wait(port, AHCI_PxCI, 1, 0, 1000);
+	if (err < 0 || (port_read(port, AHCI_PxIS) & AHCI_PxIS_TFES) ||
+			(port_read(port, AHCI_PxTFD) & AHCI_PxTFD_ERR)) {
+		LTRACEF("port %u command 0x%x failed, tfd 0x%x\n", port->num, command, port_read(port, AHCI_PxTFD));
+		return ERR_IO;
+	}
+
+	return NO_ERROR;
+}
+
+/* something went wrong on the port. the controller stops processing the list and
+ * there's no telling which of the outstanding commands made it, so restart the
+ * port and fail all of them. called with the port lock held.
+ */
+static void ahci_port_recover(struct ahci_port *port)
+{
+	LTRACEF("port %u error, is 0x%x tfd 0x%x serr 0x%x\n", port->num, port_read(port, AHCI_PxIS),
+	        port_read(port, AHCI_PxTFD), port_read(port, AHCI_PxSERR));
+
+	port->errors++;
+
+	port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+	ahci_port_wait(port, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500);
+
+	port_write(port, AHCI_PxSERR, 0xffffffff);
+	port_write(port, AHCI_PxIS, 0xffffffff);
+
+	port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+static void ahci_port_irq(struct ahci_port *port)
+{
+	struct ahci_slot done_slot[AHCI_MAX_SLOTS];
+	uint32_t done;
+	bool error;
+
+	uint32_t is = port_read(port, AHCI_PxIS);
+	port_write(port, AHCI_PxIS, is);
+
+	spin_lock(&port->lock);
+	error = is & AHCI_PxIS_ERRORS;
+	if (error) {
+		done = port->issued;
+		ahci_port_recover(port);
+	} else {
+		/* queued commands finish when the disk clears them from SACT, the rest from CI */
+		done = port->issued & ~(port_read(port, AHCI_PxCI) | port_read(port, AHCI_PxSACT));
+	}
+	port->issued &= ~done;
+
+	/* the slots are free for reuse once the lock is dropped, grab what we need first */
+	for (uint32_t bits = done; bits; bits &= bits - 1) {
+		uint slot = __builtin_ctz(bits);
+		done_slot[slot] = port->slot[slot];
+	}
+	port->busy &= ~done;
+	spin_unlock(&port->lock);
+
+	if (!done)
+		return;
+
+	/* wake anyone waiting for a slot */
+	event_signal(&port->slot_event, false);
+
+	for (uint32_t bits = done; bits; bits &= bits - 1) {
+		struct ahci_slot *s = &done_slot[__builtin_ctz(bits)];
+
+		if (error)
+			s->bio->result = ERR_IO;
+		else if (s->bio->result >= 0)
+			s->bio->result += s->len;
+
+		bio_put_piece(&port->bdev, s->bio, s->sync);
+	}
+}
+
+static enum handler_return ahci_irq_handler(void *arg)
+{
+	struct ahci_hba *hba = arg;
+
+	uint32_t is = hba_read(hba, AHCI_IS);
+	if (is == 0)
+		return INT_NO_RESCHEDULE;
+
+	for (uint32_t bits = is; bits; bits &= bits - 1) {
+		struct ahci_port *port = hba->port[__builtin_ctz(bits)];
+		if (port)
+			ahci_port_irq(port);
+	}
+
+	/* the port bits only clear once the ports' own status is */
+	hba_write(hba, AHCI_IS, is);
+
+	return INT_RESCHEDULE;
+}
+
+/* queue one piece of a transfer, waiting for a slot if they're all in use */
+static void ahci_queue_piece(struct bdev *bdev, bio_request_t *bio, bool sync,
+                             const bio_seg_t *seg, uint seg_count, off_t offset, size_t len)
+{
+	struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+	bool write = (bio->op == BIO_OP_WRITE);
+	spin_lock_saved_state_t state;
+	uint slot;
+
+	LTRACEF("port %u, segs %u, offset 0x%llx, len %zu\n", port->num, seg_count, offset, len);
+
+	DEBUG_ASSERT(len <= AHCI_MAX_PIECE);
+	DEBUG_ASSERT(seg_count <= AHCI_MAX_SEGS);
+
+	for (;;) {
+		spin_lock_irqsave(&port->lock, state);
+		uint32_t free = port->slot_mask & ~port->busy;
+		if (free) {
+			slot = __builtin_ctz(free);
+			port->busy |= 1U << slot;
+			spin_unlock_irqrestore(&port->lock, state);
+			break;
+		}
+		spin_unlock_irqrestore(&port->lock, state);
+		event_wait(&port->slot_event);
+	}
+
+	/* the slot is ours until it completes */
+	struct ahci_cmd_header *hdr = ahci_cmd_header(port, slot);
+	struct ahci_cmd_table *table = ahci_cmd_table(port, slot);
+	uint8_t command;
+
+	if (port->ncq)
+		command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+	else
+		command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	ahci_build_fis(table, command, offset / AHCI_SECTOR_SIZE, len / AHCI_SECTOR_SIZE, slot, port->ncq);
+
+	for (uint i = 0; i < seg_count; i++) {
+		table->prdt[i].dba = (uint32_t)seg[i].pa;
+		table->prdt[i].dbau = (uint64_t)seg[i].pa >> 32;
+		table->prdt[i].reserved = 0;
+		table->prdt[i].dbc = seg[i].len - 1;
+	}
+
+	hdr->flags = 5 | (write ? AHCI_CMD_WRITE : 0);
+	hdr->prdtl = seg_count;
+	hdr->prdbc = 0;
+
+	port->slot[slot].bio = bio;
+	port->slot[slot].sync = sync;
+	port->slot[slot].len = len;
+
+	/* x86 keeps stores in order, the compiler has to get the tables out before the doorbell too */
+	__asm__ volatile("" ::: "memory");
+
+	spin_lock_irqsave(&port->lock, state);
+	if (port->ncq)
+		port_write(port, AHCI_PxSACT, 1U << slot);
+	port_write(port, AHCI_PxCI, 1U << slot);
+	port->issued |= 1U << slot;
+	port->commands++;
+	spin_unlock_irqrestore(&port->lock, state);
+}
+
+/* can the request go straight to the prd tables. the disk only moves whole sectors
+ * and the controller only whole words, and every fragment but the last needs to be
+ * a sector or more, so that a piece limited by its prd count still covers one.
+ */
+static bool ahci_can_map(struct bdev *bdev, off_t offset, size_t len, const void *buf,
+                         const iovec_t *iov, uint iov_cnt)
+{
+	if ((offset | len) & (bdev->block_size - 1))
+		return false;
+
+	if (!iov)
+		return ((uintptr_t)buf & 1) == 0;
+
+	for (uint i = 0; i < iov_cnt && len > 0; i++) {
+		if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) & 1)
+			return false;
+		if (iov[i].iov_len < len && iov[i].iov_len < AHCI_SECTOR_SIZE && iov[i].iov_len > 0)
+			return false;
+		len -= MIN(len, iov[i].iov_len);
+	}
+
+	return true;
+}
+
+static const bio_piece_ops_t ahci_piece_ops = {
+	.can_map = ahci_can_map,
+	.queue_piece = ahci_queue_piece,
+};
+
+static const bio_piece_limits_t ahci_piece_limits = {
+	.max_len = AHCI_MAX_PIECE,
+	.max_segs = AHCI_MAX_SEGS,
+	.sector_size = AHCI_SECTOR_SIZE,
+};
+
+static ssize_t ahci_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+	struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+
+	LTRACEF("port %u, buf %p, block 0x%x, count %u\n", port->num, buf, block, count);
+
+	if (count == 0)
+		return 0;
+
+	/* the default read hands us its own aligned bounce buffers, anything else is a caller bug */
+	if ((uintptr_t)buf & 1)
+		return ERR_INVALID_ARGS;
+
+	bio_request_t req;
+	bio_request_init(&req, BIO_OP_READ, buf, (off_t)block * AHCI_SECTOR_SIZE, count * AHCI_SECTOR_SIZE,
+	                 NULL, NULL);
+
+	return bio_pieces_sync(bdev, &req);
+}
+
+static ssize_t ahci_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+	struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+
+	LTRACEF("port %u, buf %p, block 0x%x, count %u\n", port->num, buf, block, count);
+
+	if (count == 0)
+		return 0;
+
+	if ((uintptr_t)buf & 1)
+		return ERR_INVALID_ARGS;
+
+	bio_request_t req;
+	bio_request_init(&req, BIO_OP_WRITE, (void *)buf, (off_t)block * AHCI_SECTOR_SIZE, count * AHCI_SECTOR_SIZE,
+	                 NULL, NULL);
+
+	return bio_pieces_sync(bdev, &req);
+}
+
+static status_t ahci_port_init(struct ahci_hba *hba, uint num)
+{
+	addr_t regs = hba->regs + AHCI_PORT_BASE(num);
+
+	/* a device present with the phy up, and a disk rather than atapi */
+	uint32_t ssts = *REG32(regs + AHCI_PxSSTS);
+	if ((ssts & 0xf) != 3 || ((ssts >> 8) & 0xf) != 1)
+		return ERR_NOT_FOUND;
+	if (*REG32(regs + AHCI_PxSIG) != AHCI_SIG_ATA)
+		return ERR_NOT_SUPPORTED;
+
+	struct ahci_port *port = calloc(1, sizeof(struct ahci_port));
+	if (!port)
+		return ERR_NO_MEMORY;
+
+	port->hba = hba;
+	port->num = num;
+	port->regs = regs;
+	spin_lock_init(&port->lock);
+	event_init(&port->slot_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+	status_t err = ahci_port_stop(port);
+	if (err < 0)
+		goto fail;
+
+	/* command list, received fises and the command tables, physically contiguous */
+#if WITH_KERNEL_VM
+	void *mem;
+	err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "ahci", AHCI_MEM_SIZE, &mem,
+	                           PAGE_SIZE_SHIFT, 0, ARCH_MMU_FLAG_CACHED);
+	if (err < 0)
+		goto fail;
+	port->mem = mem;
+	arch_mmu_query((vaddr_t)port->mem, &port->mem_phys, NULL);
+#else
+	port->mem = memalign(PAGE_SIZE, AHCI_MEM_SIZE);
+	if (!port->mem) {
+		err = ERR_NO_MEMORY;
+		goto fail;
+	}
+	port->mem_phys = (paddr_t)(uintptr_t)port->mem;
+#endif
+	memset(port->mem, 0, AHCI_MEM_SIZE);
+
+	/* everything the controller walks, and every buffer, is expected below 4GB
+	 * unless it can do 64 bit addressing. on the pc that's all of memory. */
+	for (uint i = 0; i < AHCI_MAX_SLOTS; i++) {
+		paddr_t pa = port->mem_phys + AHCI_MEM_CMD_TABLES + i * AHCI_CMD_TABLE_SIZE;
+		ahci_cmd_header(port, i)->ctba = (uint32_t)pa;
+		ahci_cmd_header(port, i)->ctbau = (uint64_t)pa >> 32;
+	}
+
+	port_write(port, AHCI_PxCLB, (uint32_t)(port->mem_phys + AHCI_MEM_CMD_LIST));
+	port_write(port, AHCI_PxCLBU, (uint64_t)(port->mem_phys + AHCI_MEM_CMD_LIST) >> 32);
+	port_write(port, AHCI_PxFB, (uint32_t)(port->mem_phys + AHCI_MEM_RX_FIS));
+	port_write(port, AHCI_PxFBU, (uint64_t)(port->mem_phys + AHCI_MEM_RX_FIS) >> 32);
+
+	port_write(port, AHCI_PxSERR, 0xffffffff);
+	port_write(port, AHCI_PxIS, 0xffffffff);
+	port_write(port, AHCI_PxIE, 0);
+
+	err = ahci_port_wait(port, AHCI_PxTFD, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ, 0, 1000);
+	if (err < 0)
+		goto fail_mem;
+
+	ahci_port_start(port);
+
+	uint16_t *identify = (uint16_t *)(port->mem + AHCI_MEM_IDENTIFY);
+	err = ahci_port_polled_command(port, ATA_CMD_IDENTIFY, identify, 512);
+	if (err < 0)
+		goto fail_stop;
+
+	/* word 83 bit 10: 48 bit addressing, which the read and write commands need */
+	if ((identify[83] & (1 << 10)) == 0) {
+		printf("ahci port %u: disk without lba48, ignoring\n", num);
+		err = ERR_NOT_SUPPORTED;
+		goto fail_stop;
+	}
+	uint64_t sectors = *(uint64_t *)&identify[100];
+
+	/* word 76 bit 8: ncq, with the queue depth in word 75 */
+	uint slots = AHCI_CAP_NCS(hba->cap);
+	port->ncq = (hba->cap & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8));
+	if (port->ncq)
+		slots = MIN(slots, (identify[75] & 0x1f) + 1U);
+	port->slot_mask = (slots >= 32) ? 0xffffffff : ((1U << slots) - 1);
+
+	port_write(port, AHCI_PxIS, 0xffffffff);
+	port_write(port, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS |
+	           AHCI_PxIS_ERRORS);
+
+	char name[16];
+	snprintf(name, sizeof(name), "ahci%u", ahci_found_index++);
+	bio_initialize_bdev(&port->bdev, name, AHCI_SECTOR_SIZE, MIN(sectors, (uint64_t)UINT32_MAX), 0, NULL);
+
+	port->bdev.read_block = &ahci_bdev_read_block;
+	port->bdev.write_block = &ahci_bdev_write_block;
+	bio_init_pieces(&port->bdev, &ahci_piece_ops, &ahci_piece_limits);
+
+	hba->port[num] = port;
+
+	printf("ahci port %u: %s, %llu sectors, %u slots%s\n", num, name, sectors, slots,
+	       port->ncq ? ", ncq" : "");
+
+	return NO_ERROR;
+
+fail_stop:
+	ahci_port_stop(port);
+fail_mem:
+#if WITH_KERNEL_VM
+	vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)port->mem);
+#else
+	free(port->mem);
+#endif
+fail:
+	free(port);
+	return err;
+}
+
+static status_t ahci_hba_init(const pci_location_t *loc)
+{
+	uint32_t bar;
+	uint16_t command;
+	uint8_t irq;
+
+	if (pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES + 5 * 4, &bar) != _PCI_SUCCESSFUL ||
+			pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command) != _PCI_SUCCESSFUL ||
+			pci_read_config_byte(loc, PCI_CONFIG_INTERRUPT_LINE, &irq) != _PCI_SUCCESSFUL)
+		return ERR_IO;
+
+	/* ABAR is memory space */
+	paddr_t abar = bar & ~0xfU;
+	if ((bar & 1) || abar == 0) {
+		LTRACEF("unusable controller, bar 0x%x\n", bar);
+		return ERR_NOT_SUPPORTED;
+	}
+
+	/* an msi if the controller and the apic can do it, otherwise the legacy
+	 * interrupt, which has to be routed to the pic */
+	int vector = ERR_NOT_SUPPORTED;
+	if (pci_find_capability(loc, PCI_CAP_ID_MSI))
+		vector = pc_alloc_msi_vector();
+	if (vector < 0 && irq >= 16) {
+		LTRACEF("no msi and no usable irq (%u)\n", irq);
+		return ERR_NOT_SUPPORTED;
+	}
+
+	pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+	struct ahci_hba *hba = calloc(1, sizeof(struct ahci_hba));
+	if (!hba)
+		return ERR_NO_MEMORY;
+
+#if WITH_KERNEL_VM
+	void *regs;
+	status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "ahci regs", PAGE_SIZE * 2, &regs,
+	                                  PAGE_SIZE_SHIFT, abar, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+	if (err < 0) {
+		free(hba);
+		return err;
+	}
+	hba->regs = (addr_t)regs;
+#else
+	hba->regs = abar;
+#endif
+	hba->use_msi = vector >= 0;
+	hba->irq = hba->use_msi ? (uint)vector : INT_BASE + irq;
+
+	hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_AE);
+	hba->cap = hba_read(hba, AHCI_CAP);
+
+	LTRACEF("abar 0x%lx cap 0x%x pi 0x%x vector 0x%x%s\n", abar, hba->cap, hba_read(hba, AHCI_PI),
+	        hba->irq, hba->use_msi ? " (msi)" : "");
+
+	uint32_t pi = hba_read(hba, AHCI_PI);
+	uint found = 0;
+	for (uint i = 0; i < MIN(AHCI_CAP_NP(hba->cap), AHCI_MAX_PORTS); i++) {
+		if ((pi & (1U << i)) && ahci_port_init(hba, i) == NO_ERROR)
+			found++;
+	}
+
+	/* ports come up quiet, turn on interrupts before anyone can use them */
+	register_int_handler(hba->irq, &ahci_irq_handler, hba);
+	hba_write(hba, AHCI_IS, 0xffffffff);
+	hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_IE);
+	if (hba->use_msi)
+		pci_enable_msi(loc, hba->irq, 0); /* the one vector serves every port */
+	else
+		unmask_interrupt(hba->irq);
+
+	for (uint i = 0; i < AHCI_MAX_PORTS; i++) {
+		if (hba->port[i])
+			bio_register_device(&hba->port[i]->bdev);
+	}
+
+	return found ? NO_ERROR : ERR_NOT_FOUND;
+}
+
+static void ahci_init(uint level)
+{
+	pci_location_t loc;
+
+	for (uint16_t index = 0; pci_find_pci_class_code(&loc, AHCI_PCI_CLASS, index) == _PCI_SUCCESSFUL; index++) {
+		LTRACEF("found ahci controller at %02x:%02x\n", loc.bus, loc.dev_fn);
+		ahci_hba_init(&loc);
+	}
+}
+
+/* port resets and spin up waits are slow, let them overlap with the other probes */
+LK_INIT_HOOK_PARALLEL(ahci, &ahci_init, LK_INIT_LEVEL_PLATFORM + 1);
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_ahci(int argc, const cmd_args *argv)
+{
+	/* there's no list of controllers, walk the block devices for ours */
+	for (uint i = 0; i < ahci_found_index; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "ahci%u", i);
+
+		bdev_t *bdev = bio_open(name);
+		if (!bdev)
+			continue;
+
+		struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+		printf("%s: port %u, %s, slot mask 0x%x busy 0x%x, commands %lu errors %lu\n",
+		       name, port->num, port->ncq ? "ncq" : "no ncq", port->slot_mask, port->busy,
+		       port->commands, port->errors);
+		bio_close(bdev);
+	}
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("ahci", "ahci port statistics", &cmd_ahci)
+STATIC_COMMAND_END(ahci);
+
+#endif
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <sys/types.h>
+#include <debug.h>
+#include <err.h>
+#include <reg.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <arch/x86.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/vm.h>
+#include <lk/init.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+#include "platform_p.h"
+
+#if WITH_SMP
+#include <arch/x86/mp.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* no acpi tables are parsed, these are where every pc chipset puts them */
+#define LAPIC_PHYS_BASE         (0xfee00000)
+#define IOAPIC_PHYS_BASE        (0xfec00000)
+
+/* local apic registers */
+#define LAPIC_ID                (0x020)
+#define LAPIC_VERSION           (0x030)
+#define LAPIC_TPR               (0x080)
+#define LAPIC_EOI               (0x0b0)
+#define LAPIC_SVR               (0x0f0)
+#define LAPIC_ICR_LO            (0x300)
+#define LAPIC_ICR_HI            (0x310)
+#define LAPIC_LVT_TIMER         (0x320)
+#define LAPIC_LVT_LINT0         (0x350)
+#define LAPIC_LVT_LINT1         (0x360)
+#define LAPIC_LVT_ERROR         (0x370)
+
+#define LAPIC_SVR_ENABLE        (1U << 8)
+#define LAPIC_LVT_MASKED        (1U << 16)
+#define LAPIC_LVT_NMI           (4U << 8)
+#define LAPIC_LVT_TSC_DEADLINE  (2U << 17)
+
+#define LAPIC_ICR_INIT          (5U << 8)
+#define LAPIC_ICR_STARTUP       (6U << 8)
+#define LAPIC_ICR_PENDING       (1U << 12)
+#define LAPIC_ICR_ASSERT        (1U << 14)
+#define LAPIC_ICR_ALL_BUT_SELF  (3U << 18)
+
+#define X86_MSR_APIC_BASE       (0x1b)
+#define X86_APIC_BASE_ENABLE    (1ULL << 11)
+
+/* io-apic, an index register and a window onto the indexed one */
+#define IOAPIC_REGSEL           (0x00)
+#define IOAPIC_WINDOW           (0x10)
+
+#define IOAPIC_REG_VERSION      (0x01)
+#define IOAPIC_REG_REDIR(pin)   (0x10 + (pin) * 2)
+
+#define IOAPIC_REDIR_ACTIVE_LOW (1U << 13)
+#define IOAPIC_REDIR_LEVEL      (1U << 15)
+#define IOAPIC_REDIR_MASKED     (1U << 16)
+
+/* edge/level control, one bit per isa irq set for the level triggered (pci) ones */
+#define PIC_ELCR1               (0x4d0)
+#define PIC_ELCR2               (0x4d1)
+
+#define ISA_IRQS                16
+
+/* the pit's irq 0 comes in on pin 2, the way the acpi override on every pc has it */
+static const uint8_t isa_irq_to_pin[ISA_IRQS] = {
+	2, 1, 0xff, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+static vaddr_t lapic_base;
+static vaddr_t ioapic_base;
+static bool apic_active;
+static spin_lock_t ioapic_lock;
+
+/* redirection entries as last written, the low words anyway */
+static uint32_t ioapic_redir[ISA_IRQS];
+
+static uint msi_next = INT_MSI_BASE;
+
+/* where an msi goes when its cpu never came up */
+static uint32_t boot_apic_id;
+
+static inline uint32_t lapic_read(uint reg)
+{
+	return *REG32(lapic_base + reg);
+}
+
+static inline void lapic_write(uint reg, uint32_t val)
+{
+	*REG32(lapic_base + reg) = val;
+}
+
+static uint32_t ioapic_read(uint reg)
+{
+	*REG32(ioapic_base + IOAPIC_REGSEL) = reg;
+	return *REG32(ioapic_base + IOAPIC_WINDOW);
+}
+
+static void ioapic_write(uint reg, uint32_t val)
+{
+	*REG32(ioapic_base + IOAPIC_REGSEL) = reg;
+	*REG32(ioapic_base + IOAPIC_WINDOW) = val;
+}
+
+bool pc_apic_active(void)
+{
+	return apic_active;
+}
+
+uint32_t lapic_id(void)
+{
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void)
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_timer_tsc_deadline(unsigned int vector)
+{
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_TSC_DEADLINE | vector);
+}
+
+/* the high half picks the destination, writing the low half sends it */
+static void lapic_send_icr(uint32_t lo, uint32_t dest)
+{
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING)
+		__asm__ volatile("pause");
+	lapic_write(LAPIC_ICR_HI, dest << 24);
+	lapic_write(LAPIC_ICR_LO, lo);
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* everything but the timer, which platform_init_tsc_timer() sets up */
+static void lapic_init_regs(void)
+{
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INT_APIC_SPURIOUS);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+	/* LINT0 was the 8259's virtual wire, the io-apic takes over from it */
+	lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+}
+
+#if WITH_SMP
+uint x86_lapic_id(void)
+{
+	return lapic_id();
+}
+
+void x86_lapic_send_ipi(uint apic_id, uint ipi)
+{
+	DEBUG_ASSERT(ipi <= MP_IPI_RESCHEDULE);
+
+	lapic_send_icr(INT_IPI_BASE + ipi, apic_id);
+}
+
+/* INIT-SIPI-SIPI to every other cpu at once, there's no table of them to go by */
+void x86_lapic_start_aps(paddr_t entry)
+{
+	DEBUG_ASSERT(IS_PAGE_ALIGNED(entry) && entry < 0x100000);
+
+	lapic_send_icr(LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_INIT | LAPIC_ICR_ASSERT, 0);
+	thread_sleep(10);
+
+	for (int i = 0; i < 2; i++) {
+		lapic_send_icr(LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_STARTUP | (entry >> PAGE_SIZE_SHIFT), 0);
+		spin(200);
+	}
+}
+
+static enum handler_return lapic_ipi_generic(void *arg)
+{
+	return mp_mbx_generic_irq();
+}
+
+static enum handler_return lapic_ipi_reschedule(void *arg)
+{
+	return mp_mbx_reschedule_irq();
+}
+
+static void lapic_init_percpu(uint level)
+{
+	/* the boot cpu did all this in platform_init_apic() */
+	if (!apic_active)
+		return;
+
+	lapic_init_regs();
+	platform_init_tsc_timer_percpu();
+}
+
+LK_INIT_HOOK_FLAGS(lapic_init_percpu,
+                   lapic_init_percpu,
+                   LK_INIT_LEVEL_PLATFORM_EARLY, LK_INIT_FLAG_SECONDARY_CPUS);
+#endif
+
+status_t ioapic_mask(unsigned int vector, bool mask)
+{
+	if (vector < INT_BASE || vector >= INT_BASE + ISA_IRQS)
+		return ERR_INVALID_ARGS;
+
+	uint pin = isa_irq_to_pin[vector - INT_BASE];
+	if (pin == 0xff)
+		return ERR_INVALID_ARGS;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&ioapic_lock, state);
+
+	if (mask)
+		ioapic_redir[pin] |= IOAPIC_REDIR_MASKED;
+	else
+		ioapic_redir[pin] &= ~IOAPIC_REDIR_MASKED;
+	ioapic_write(IOAPIC_REG_REDIR(pin), ioapic_redir[pin]);
+
+	spin_unlock_irqrestore(&ioapic_lock, state);
+
+	return NO_ERROR;
+}
+
+int pc_alloc_msi_vector(void)
+{
+	if (!apic_active)
+		return ERR_NOT_SUPPORTED;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&ioapic_lock, state);
+
+	int vector = ERR_NO_RESOURCES;
+	if (msi_next < INT_MSI_BASE + INT_MSI_COUNT)
+		vector = msi_next++;
+
+	spin_unlock_irqrestore(&ioapic_lock, state);
+
+	return vector;
+}
+
+status_t pc_msi_message(unsigned int vector, uint cpu, uint64_t *addr, uint32_t *data)
+{
+	if (!apic_active || vector < INT_MSI_BASE || vector >= INT_MSI_BASE + INT_MSI_COUNT)
+		return ERR_NOT_SUPPORTED;
+
+	uint32_t dest = boot_apic_id;
+#if WITH_SMP
+	uint apic_id;
+	if (x86_cpu_apic_id(cpu, &apic_id) == NO_ERROR)
+		dest = apic_id;
+#endif
+
+	/* fixed delivery, edge triggered, physical destination of the cpu */
+	*addr = LAPIC_PHYS_BASE | (dest << 12);
+	*data = vector;
+
+	return NO_ERROR;
+}
+
+void platform_init_apic(void)
+{
+	uint32_t a, b, c, d;
+
+	x86_cpuid(1, &a, &b, &c, &d);
+	if (!(d & (1U << 9))) {
+		dprintf(INFO, "PC: no local apic, staying on the 8259s\n");
+		return;
+	}
+
+	void *ptr;
+	if (vmm_alloc_physical(vmm_get_kernel_aspace(), "lapic", PAGE_SIZE, &ptr, PAGE_SIZE_SHIFT,
+	                       LAPIC_PHYS_BASE, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE) < 0)
+		return;
+	lapic_base = (vaddr_t)ptr;
+
+	if (vmm_alloc_physical(vmm_get_kernel_aspace(), "ioapic", PAGE_SIZE, &ptr, PAGE_SIZE_SHIFT,
+	                       IOAPIC_PHYS_BASE, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE) < 0)
+		return;
+	ioapic_base = (vaddr_t)ptr;
+
+	uint32_t version = ioapic_read(IOAPIC_REG_VERSION);
+	uint pins = ((version >> 16) & 0xff) + 1;
+	if (version == 0xffffffff || pins < ISA_IRQS) {
+		dprintf(INFO, "PC: no usable io-apic (version 0x%x), staying on the 8259s\n", version);
+		return;
+	}
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	write_msr(X86_MSR_APIC_BASE, read_msr(X86_MSR_APIC_BASE) | X86_APIC_BASE_ENABLE);
+	lapic_init_regs();
+
+	/* everything but the pci irqs the bios made level triggered is isa edge */
+	uint16_t elcr = inp(PIC_ELCR1) | (inp(PIC_ELCR2) << 8);
+	boot_apic_id = lapic_id();
+	uint32_t dest = boot_apic_id << 24;
+
+	for (uint pin = 0; pin < pins; pin++) {
+		ioapic_write(IOAPIC_REG_REDIR(pin), IOAPIC_REDIR_MASKED);
+		ioapic_write(IOAPIC_REG_REDIR(pin) + 1, dest);
+	}
+
+	/* carry over whatever the drivers had unmasked at the 8259s */
+	uint16_t pic_enabled = pc_pic_enabled_irqs();
+	for (uint irq = 0; irq < ISA_IRQS; irq++) {
+		uint pin = isa_irq_to_pin[irq];
+		if (pin == 0xff)
+			continue;
+
+		uint32_t redir = INT_BASE + irq;
+		if (elcr & (1U << irq))
+			redir |= IOAPIC_REDIR_LEVEL;
+		if (!(pic_enabled & (1U << irq)))
+			redir |= IOAPIC_REDIR_MASKED;
+
+		ioapic_redir[pin] = redir;
+		ioapic_write(IOAPIC_REG_REDIR(pin), redir);
+	}
+
+	pc_pic_disable();
+	apic_active = true;
+
+#if WITH_SMP
+	register_int_handler(INT_IPI_BASE + MP_IPI_GENERIC, &lapic_ipi_generic, NULL);
+	register_int_handler(INT_IPI_BASE + MP_IPI_RESCHEDULE, &lapic_ipi_reschedule, NULL);
+#endif
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	dprintf(INFO, "PC: local apic id %u version 0x%x, io-apic with %u pins\n",
+	        lapic_id(), lapic_read(LAPIC_VERSION) & 0xff, pins);
+}
+
+/* vim: set noexpandtab: */
@@ -32,11 +32,42 @@
 #include <platform/keyboard.h>
 #include <platform/debug.h>
 
+#ifndef UART_TX_BUF_SIZE
+#define UART_TX_BUF_SIZE 4096
+#endif
+
+/* the 16550 fifo, free in its entirety once THRE is set */
+#define UART_TX_FIFO_SIZE 16
+
 static int uart_baud_rate = 115200;
 static int uart_io_port = 0x3f8;
 
 static cbuf_t uart_rx_buf;
 
+/* output queued for the transmit interrupt to drain */
+static cbuf_t uart_tx_buf;
+static spin_lock_t uart_tx_lock = SPIN_LOCK_INITIAL_VALUE;
+
+/* set once uart_init has the tx interrupt going, cleared again by a panic */
+static volatile bool uart_tx_irq;
+
+/* Move queued characters into the uart as long as it has room, and only leave
+ * the THR empty interrupt on while there's more waiting. Must hold uart_tx_lock.
+ */
+static void uart_tx_fill_locked(void)
+{
+	if (inp(uart_io_port + 5) & (1<<5)) {
+		char buf[UART_TX_FIFO_SIZE];
+		size_t len = cbuf_read(&uart_tx_buf, buf, sizeof(buf), false);
+
+		for (size_t i = 0; i < len; i++)
+			outp(uart_io_port + 0, buf[i]);
+	}
+
+	/* rx data available, plus thr empty if there's still something queued */
+	outp(uart_io_port + 1, cbuf_space_used(&uart_tx_buf) ? 0x3 : 0x1);
+}
+
 static enum handler_return uart_irq_handler(void *arg)
 {
 	unsigned char c;
@@ -48,6 +79,12 @@ static enum handler_return uart_irq_handler(void *arg)
 		resched = true;
 	}
 
+	if (uart_tx_irq) {
+		spin_lock(&uart_tx_lock);
+		uart_tx_fill_locked();
+		spin_unlock(&uart_tx_lock);
+	}
+
 	return resched ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 
@@ -68,11 +105,15 @@ void uart_init(void)
 {
 	/* finish uart init to get rx going */
 	cbuf_initialize(&uart_rx_buf, 16);
+	cbuf_initialize(&uart_tx_buf, UART_TX_BUF_SIZE);
 
 	register_int_handler(0x24, uart_irq_handler, NULL);
 	unmask_interrupt(0x24);
 
 	outp(uart_io_port + 1, 0x1); // enable receive data available interrupt
+
+	/* output is queued from here on */
+	uart_tx_irq = true;
 }
 
 void uart_putc(char c)
@@ -87,15 +128,67 @@ int uart_getc(char *c, bool wait)
 	return cbuf_read_char(&uart_rx_buf, c, wait);
 }
 
-void platform_dputc(char c)
+#if !WITH_CGA_CONSOLE
+static void uart_write(const char *str, size_t len)
+{
+	spin_lock_saved_state_t state;
+
+	if (!uart_tx_irq) {
+		for (size_t i = 0; i < len; i++)
+			uart_putc(str[i]);
+		return;
+	}
+
+	while (len > 0) {
+		size_t written = cbuf_write(&uart_tx_buf, str, len, false);
+		str += written;
+		len -= written;
+
+		spin_lock_irqsave(&uart_tx_lock, state);
+		if (len > 0) {
+			/* the queue is full. the caller may have interrupts off, so rather
+			 * than wait for the irq handler make room by hand as it would. */
+			while ((inp(uart_io_port + 5) & (1<<5)) == 0)
+				;
+		}
+		uart_tx_fill_locked();
+		spin_unlock_irqrestore(&uart_tx_lock, state);
+	}
+}
+#endif
+
+void platform_dputs(const char *str, size_t len)
 {
 #if WITH_CGA_CONSOLE
-	cputc(c);
+	for (size_t i = 0; i < len; i++)
+		cputc(str[i]);
 #else
-	uart_putc(c);
+	uart_write(str, len);
 #endif
 }
 
+void platform_dputc(char c)
+{
+	platform_dputs(&c, 1);
+}
+
+void platform_panic_start(void)
+{
+	spin_lock_saved_state_t state;
+	char c;
+
+	if (!uart_tx_irq)
+		return;
+
+	/* write out whatever is still queued, then go synchronous */
+	spin_lock_irqsave(&uart_tx_lock, state);
+	uart_tx_irq = false;
+	while (cbuf_read_char(&uart_tx_buf, &c, false) == 1)
+		uart_putc(c);
+	outp(uart_io_port + 1, 0x1);
+	spin_unlock_irqrestore(&uart_tx_lock, state);
+}
+
 int platform_dgetc(char *c, bool wait)
 {
 #if WITH_CGA_CONSOLE
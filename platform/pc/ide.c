@@ -37,6 +37,7 @@
 #include <dev/driver.h>
 #include <dev/class/block.h>
 #include <kernel/event.h>
+#include <kernel/vm.h>
 
 #define LOCAL_TRACE 1
 
@@ -108,6 +109,33 @@ enum {
 	IDE_REG_NUM,
 };
 
+/* bus master ide registers, relative to the channel's base in BAR4 */
+#define IDE_BM_REG_COMMAND	0
+#define IDE_BM_REG_STATUS	2
+#define IDE_BM_REG_PRDT		4
+
+#define IDE_BM_CMD_START	0x01
+#define IDE_BM_CMD_READ		0x08 /* device to memory */
+
+#define IDE_BM_STATUS_ACTIVE	0x01
+#define IDE_BM_STATUS_ERR		0x02
+#define IDE_BM_STATUS_IRQ		0x04
+
+/* physical region descriptor, a piece of a dma transfer. a byte count of 0 is
+ * 64K, and a region may not cross a 64K boundary. */
+struct ide_prd {
+	uint32_t addr;
+	uint16_t count;
+	uint16_t flags;
+} __PACKED;
+
+#define IDE_PRD_EOT			0x8000
+#define IDE_PRD_COUNT		512
+
+/* largest single dma command. it's at most one region per page of buffer, which
+ * has to fit in the table */
+#define IDE_DMA_MAX_SECTORS	2048
+
 enum {
 	TYPE_NONE,
 	TYPE_UNKNOWN,
@@ -148,10 +176,20 @@ struct ide_driver_state {
 
 	event_t completion;
 
+	/* bus master dma, bm_base is 0 if the controller can't do it */
+	uint16_t bm_base;
+	struct ide_prd *prdt;
+	paddr_t prdt_phys;
+	volatile bool dma_active;
+	volatile uint8_t dma_status; /* bus master status at the completion interrupt */
+	volatile uint8_t dma_ata_status;
+
 	int type[2];
 	struct {
-		int sectors;
+		uint64_t sectors;
 		int sector_size;
+		bool lba48;
+		bool dma;
 	} drive[2];
 };
 
@@ -212,6 +250,9 @@ static void ide_detect_drives(struct device *dev);
 static int ide_wait_for_completion(struct device *dev);
 static int ide_detect_ata(struct device *dev, int index);
 static void ide_lba_setup(struct device *dev, uint32_t addr, int index);
+static void ide_lba48_setup(struct device *dev, uint64_t addr, uint sectors, int drive);
+static void ide_dma_init(struct device *dev, const pci_location_t *loc, const pci_config_t *pci_config);
+static ssize_t ide_dma_transfer(struct device *dev, int index, uint64_t lba, void *buf, size_t sectors, bool write);
 
 static status_t ide_init(struct device *dev)
 {
@@ -252,7 +293,7 @@ static status_t ide_init(struct device *dev)
 		LTRACEF("BAR[%d]: 0x%08x\n", i, pci_config.base_addresses[i]);
 	}
 
-	struct ide_driver_state *state = malloc(sizeof(struct ide_driver_state));
+	struct ide_driver_state *state = calloc(1, sizeof(struct ide_driver_state));
 	if (!state) {
 		res = ERR_NO_MEMORY;
 		goto done;
@@ -269,6 +310,8 @@ static status_t ide_init(struct device *dev)
 	register_int_handler(state->irq, ide_irq_handler, dev);
 	unmask_interrupt(state->irq);
 
+	ide_dma_init(dev, &loc, &pci_config);
+
 	/* enable interrupts */
 	ide_write_reg8(dev, IDE_REG_DEVICE_CONTROL, 0);
 
@@ -285,6 +328,21 @@ static enum handler_return ide_irq_handler(void *arg)
 	struct ide_driver_state *state = dev->state;
 	uint8_t val;
 
+	if (state->dma_active) {
+		val = inp(state->bm_base + IDE_BM_REG_STATUS);
+		if ((val & IDE_BM_STATUS_IRQ) == 0)
+			return INT_NO_RESCHEDULE;
+
+		/* writing the irq and error bits back clears them, errors are sorted out
+		 * by the waiter */
+		outp(state->bm_base + IDE_BM_REG_STATUS, val);
+		state->dma_status = val;
+		state->dma_ata_status = ide_read_reg8(dev, IDE_REG_STATUS);
+		event_signal(&state->completion, false);
+
+		return INT_RESCHEDULE;
+	}
+
 	val = ide_read_reg8(dev, IDE_REG_STATUS);
 
 	if ((val & IDE_DRV_ERR) == 0) {
@@ -340,6 +398,18 @@ static ssize_t ide_write(struct device *dev, off_t offset, const void *buf, size
 	sectors = count;
 	
 	while (sectors > 0) {
+		ssize_t xferred = ide_dma_transfer(dev, index, offset, (void *)ubuf, sectors, true);
+		if (xferred < 0) {
+			ret = xferred;
+			goto done;
+		} else if (xferred > 0) {
+			sectors -= xferred;
+			offset += xferred;
+			ubuf += xferred * 256;
+			continue;
+		}
+
+		/* no dma for this buffer, fall back to pio */
 		do_sectors = sectors;
 
 		if (do_sectors > 256)
@@ -425,6 +495,18 @@ static ssize_t ide_read(struct device *dev, off_t offset, void *buf, size_t coun
 	sectors = count;
 	
 	while (sectors > 0) {
+		ssize_t xferred = ide_dma_transfer(dev, index, offset, (void *)ubuf, sectors, false);
+		if (xferred < 0) {
+			ret = xferred;
+			goto done;
+		} else if (xferred > 0) {
+			sectors -= xferred;
+			offset += xferred;
+			ubuf += xferred * 256;
+			continue;
+		}
+
+		/* no dma for this buffer, fall back to pio */
 		do_sectors = sectors;
 
 		if (do_sectors > 256)
@@ -886,11 +968,22 @@ static status_t ide_detect_ata(struct device *dev, int index)
 
 	ide_read_reg16_array(dev, IDE_REG_DATA, info, 256);
 
-	state->drive[index].sectors = *((uint32_t *) (info + 120));
+	const uint16_t *words = (const uint16_t *)info;
+
+	/* word 83 bit 10: 48 bit addressing, with the sector count in words 100-103 */
+	state->drive[index].lba48 = words[83] & (1 << 10);
+	if (state->drive[index].lba48)
+		state->drive[index].sectors = *((uint64_t *) (info + 200));
+	else
+		state->drive[index].sectors = *((uint32_t *) (info + 120));
 	state->drive[index].sector_size = 512;
 
-	LTRACEF("Disk supports %u sectors for a total of %u bytes\n", state->drive[index].sectors,
-			state->drive[index].sectors * 512);
+	/* word 49 bit 8: dma supported */
+	state->drive[index].dma = words[49] & (1 << 8);
+
+	LTRACEF("Disk supports %llu sectors for a total of %llu bytes, lba48 %d dma %d\n",
+			state->drive[index].sectors, state->drive[index].sectors * 512,
+			state->drive[index].lba48, state->drive[index].dma);
 
 error:
 	free(info);
@@ -906,3 +999,170 @@ static void ide_lba_setup(struct device *dev, uint32_t addr, int drive)
 	ide_write_reg8(dev, IDE_REG_PRECOMP, 0xff);
 }
 
+
+static void ide_lba48_setup(struct device *dev, uint64_t addr, uint sectors, int drive)
+{
+	/* the high bytes go in first, each register holds two */
+	ide_write_reg8(dev, IDE_REG_DRIVE_HEAD, 0x40 | ((drive & 0x00000001) << 4));
+	ide_write_reg8(dev, IDE_REG_SECTOR_COUNT, (sectors >> 8) & 0xff);
+	ide_write_reg8(dev, IDE_REG_SECTOR_NUM, (addr >> 24) & 0xff);
+	ide_write_reg8(dev, IDE_REG_CYLINDER_LOW, (addr >> 32) & 0xff);
+	ide_write_reg8(dev, IDE_REG_CYLINDER_HIGH, (addr >> 40) & 0xff);
+	ide_write_reg8(dev, IDE_REG_SECTOR_COUNT, sectors & 0xff);
+	ide_write_reg8(dev, IDE_REG_SECTOR_NUM, addr & 0xff);
+	ide_write_reg8(dev, IDE_REG_CYLINDER_LOW, (addr >> 8) & 0xff);
+	ide_write_reg8(dev, IDE_REG_CYLINDER_HIGH, (addr >> 16) & 0xff);
+}
+
+static void ide_dma_init(struct device *dev, const pci_location_t *loc, const pci_config_t *pci_config)
+{
+	struct ide_driver_state *state = dev->state;
+
+	/* BAR4 is the bus master block, io space only. the first channel is at its base */
+	uint32_t bar = pci_config->base_addresses[4];
+	if ((bar & 1) == 0 || (bar & ~3) == 0) {
+		LTRACEF("no bus master registers, using pio\n");
+		return;
+	}
+
+	/* keeping the table inside its own size keeps it off a 64K boundary */
+	struct ide_prd *prdt = memalign(IDE_PRD_COUNT * sizeof(struct ide_prd),
+	                                IDE_PRD_COUNT * sizeof(struct ide_prd));
+	if (!prdt)
+		return;
+
+	paddr_t pa = kvaddr_to_paddr(prdt);
+	if (pa == 0 || pa > 0xffffffff - IDE_PRD_COUNT * sizeof(struct ide_prd)) {
+		free(prdt);
+		return;
+	}
+
+	uint16_t command = pci_config->command | PCI_COMMAND_IO_EN | PCI_COMMAND_BUS_MASTER_EN;
+	if (pci_write_config_half(loc, 0x04, command) != _PCI_SUCCESSFUL) {
+		free(prdt);
+		return;
+	}
+
+	state->bm_base = bar & ~3;
+	state->prdt = prdt;
+	state->prdt_phys = pa;
+
+	/* stop anything the firmware left running */
+	outp(state->bm_base + IDE_BM_REG_COMMAND, 0);
+	outp(state->bm_base + IDE_BM_REG_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+
+	LTRACEF("bus master dma at io 0x%x, prdt at 0x%lx\n", state->bm_base, state->prdt_phys);
+}
+
+/* Fill in the prd table for a buffer, merging pages that turn out to be
+ * physically contiguous. Returns false if the controller can't reach it: an odd
+ * address, or memory above 4GB.
+ */
+static bool ide_dma_build_prdt(struct ide_driver_state *state, void *buf, size_t len)
+{
+	vaddr_t va = (vaddr_t)buf;
+	uint count = 0;
+
+	if (va & 1)
+		return false;
+
+	while (len > 0) {
+		paddr_t pa = kvaddr_to_paddr((void *)ROUNDDOWN(va, PAGE_SIZE));
+		if (pa == 0)
+			return false;
+		pa += va % PAGE_SIZE;
+
+		size_t chunk = MIN(len, PAGE_SIZE - (va % PAGE_SIZE));
+		if (pa + chunk - 1 > 0xffffffff)
+			return false;
+
+		/* grow the last region if this picks up where it left off and stays in its 64K */
+		struct ide_prd *prd = count ? &state->prdt[count - 1] : NULL;
+		size_t prd_len = (prd && prd->count == 0) ? 0x10000 : (prd ? prd->count : 0);
+		if (prd && prd->addr + prd_len == pa &&
+				(prd->addr & ~0xffff) == ((pa + chunk - 1) & ~0xffff)) {
+			prd->count = (prd_len + chunk) & 0xffff;
+		} else {
+			if (count == IDE_PRD_COUNT)
+				return false;
+			prd = &state->prdt[count++];
+			prd->addr = pa;
+			prd->count = chunk & 0xffff;
+			prd->flags = 0;
+		}
+
+		va += chunk;
+		len -= chunk;
+	}
+
+	state->prdt[count - 1].flags = IDE_PRD_EOT;
+
+	return true;
+}
+
+/* Transfer up to IDE_DMA_MAX_SECTORS with one READ/WRITE DMA (EXT) command,
+ * completed by the interrupt. Returns the sectors transferred, 0 if this can't be
+ * done with dma and the caller should use pio, or an error.
+ */
+static ssize_t ide_dma_transfer(struct device *dev, int index, uint64_t lba, void *buf, size_t sectors, bool write)
+{
+	struct ide_driver_state *state = dev->state;
+	int err;
+
+	if (!state->bm_base || !state->drive[index].dma)
+		return 0;
+
+	/* without lba48 it's 28 bit addresses and up to 256 sectors */
+	bool lba48 = state->drive[index].lba48;
+	if (!lba48 && lba + sectors > (1 << 28))
+		return 0;
+	sectors = MIN(sectors, lba48 ? IDE_DMA_MAX_SECTORS : 256U);
+
+	if (!ide_dma_build_prdt(state, buf, sectors * 512))
+		return 0;
+
+	err = ide_poll_status(dev, 0, IDE_CTRL_BSY | IDE_DRV_DRQ);
+	if (err) {
+		LTRACEF("Error while waiting for controller: %s\n", ide_error_str[err]);
+		return ERR_GENERIC;
+	}
+
+	uint8_t bm_cmd = write ? 0 : IDE_BM_CMD_READ;
+	outp(state->bm_base + IDE_BM_REG_COMMAND, bm_cmd);
+	outpd(state->bm_base + IDE_BM_REG_PRDT, state->prdt_phys);
+	outp(state->bm_base + IDE_BM_REG_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+
+	event_unsignal(&state->completion);
+	state->dma_status = 0;
+	state->dma_active = true;
+
+	if (lba48) {
+		ide_lba48_setup(dev, lba, sectors, index);
+		ide_write_reg8(dev, IDE_REG_COMMAND, write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT);
+	} else {
+		ide_lba_setup(dev, lba, index);
+		ide_write_reg8(dev, IDE_REG_SECTOR_COUNT, sectors & 0xff);
+		ide_write_reg8(dev, IDE_REG_COMMAND, write ? ATA_WRITE_DMA : ATA_READ_DMA);
+	}
+
+	outp(state->bm_base + IDE_BM_REG_COMMAND, bm_cmd | IDE_BM_CMD_START);
+
+	err = ide_wait_for_completion(dev);
+
+	outp(state->bm_base + IDE_BM_REG_COMMAND, bm_cmd);
+	state->dma_active = false;
+
+	if (err) {
+		LTRACEF("Timed out waiting for dma: bm status 0x%x\n", inp(state->bm_base + IDE_BM_REG_STATUS));
+		outp(state->bm_base + IDE_BM_REG_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+		return ERR_TIMED_OUT;
+	}
+
+	if ((state->dma_status & IDE_BM_STATUS_ERR) || (state->dma_ata_status & IDE_DRV_ERR)) {
+		err = (state->dma_ata_status & IDE_DRV_ERR) ? ide_eval_error(dev) : IDE_DMAERROR;
+		LTRACEF("Error during dma: %s\n", ide_error_str[err]);
+		return ERR_IO;
+	}
+
+	return sectors;
+}
@@ -29,7 +29,7 @@
 /* NOTE: keep arch/x86/crt0.S in sync with these definitions */
 
 /* interrupts */
-#define INT_VECTORS 0x31
+#define INT_VECTORS 0x40
 
 /* defined interrupts */
 #define INT_BASE            0x20
@@ -54,14 +54,33 @@
 #define INT_GP_FAULT        0x0d
 #define INT_PAGE_FAULT      0x0e
 
-/* APIC vectors */
-#define INT_APIC_TIMER      0x22
-
 #define INT_SYSCALL         0x30
 
+/* message signaled interrupts, handed out by pc_alloc_msi_vector() */
+#define INT_MSI_BASE        0x31
+#define INT_MSI_COUNT       11
+
+/* mp_ipi_t, sent between the local APICs */
+#define INT_IPI_BASE        0x3c
+
+/* local APIC vectors */
+#define INT_APIC_TIMER      0x3e
+#define INT_APIC_SPURIOUS   0x3f
+
 /* PIC remap bases */
 #define PIC1_BASE 0x20
 #define PIC2_BASE 0x28
 
+#ifndef ASSEMBLY
+#include <stdbool.h>
+
+/* true once the local APIC and IO-APIC have taken over from the 8259s */
+bool pc_apic_active(void);
+
+/* a free vector for an msi, to register a handler on before pci_enable_msi() or pci_msix_set().
+ * returns ERR_NOT_SUPPORTED without an APIC or ERR_NO_RESOURCES when they're all taken */
+int pc_alloc_msi_vector(void);
+#endif
+
 #endif
 
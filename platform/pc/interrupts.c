@@ -24,19 +24,22 @@
 #include <debug.h>
 #include <err.h>
 #include <reg.h>
+#include <kernel/debug.h>
+#include <kernel/irqstats.h>
 #include <kernel/thread.h>
 #include <platform/interrupts.h>
 #include <arch/ops.h>
 #include <arch/x86.h>
 #include <kernel/spinlock.h>
+#include <lib/profile.h>
 #include "platform_p.h"
 #include <platform/pc.h>
 
 static spin_lock_t lock;
 
-void x86_gpf_handler(struct x86_iframe *frame);
-void x86_invop_handler(struct x86_iframe *frame);
-void x86_unhandled_exception(struct x86_iframe *frame);
+void x86_gpf_handler(struct x86_iframe *frame) __COLD;
+void x86_invop_handler(struct x86_iframe *frame) __COLD;
+void x86_unhandled_exception(struct x86_iframe *frame) __COLD;
 #ifdef ARCH_X86_64
 void x86_pfe_handler(struct x86_iframe *frame);
 #endif
@@ -47,6 +50,16 @@ void x86_pfe_handler(struct x86_iframe *frame);
 #define ICW1 0x11
 #define ICW4 0x01
 
+/* OCW3 poll command, the next read of the command port acks the highest
+ * priority pending irq the way an INTA cycle would */
+#define OCW3_POLL 0x0c
+#define PIC_POLL_PENDING 0x80
+
+/* interrupts taken per exception before returning to the interrupted code */
+#ifndef PC_IRQ_BUDGET
+#define PC_IRQ_BUDGET 8
+#endif
+
 struct int_handler_struct {
 	int_handler handler;
 	void *arg;
@@ -143,7 +156,10 @@ static void enable(unsigned int vector, bool enable)
 
 void issueEOI(unsigned int vector)
 {
-	if (vector >= PIC1_BASE && vector <= PIC1_BASE + 7) {
+	if (pc_apic_active()) {
+		if (vector >= INT_BASE && vector != INT_APIC_SPURIOUS)
+			lapic_eoi();
+	} else if (vector >= PIC1_BASE && vector <= PIC1_BASE + 7) {
 		outp(PIC1, 0x20);
 	} else if (vector >= PIC2_BASE && vector <= PIC2_BASE + 7) {
 		outp(PIC2, 0x20);
@@ -151,6 +167,57 @@ void issueEOI(unsigned int vector)
 	}
 }
 
+/* the next pending pic vector, acked, or 0 if there's nothing */
+static unsigned int pic_poll(void)
+{
+	outp(PIC1, OCW3_POLL);
+	uint8_t val = inp(PIC1);
+	if (!(val & PIC_POLL_PENDING))
+		return 0;
+
+	if ((val & 7) != INT_PIC2 - PIC1_BASE)
+		return PIC1_BASE + (val & 7);
+
+	outp(PIC2, OCW3_POLL);
+	val = inp(PIC2);
+	if (!(val & PIC_POLL_PENDING)) {
+		/* spurious on the slave, the master still took the cascade */
+		outp(PIC1, 0x20);
+		return 0;
+	}
+
+	return PIC2_BASE + (val & 7);
+}
+
+static enum handler_return __HOT pic_dispatch(unsigned int vector)
+{
+	enum handler_return ret = INT_NO_RESCHEDULE;
+
+	KEVLOG_IRQ_ENTER(vector);
+	IRQSTATS_BEGIN(start);
+	if (int_handler_table[vector].handler)
+		ret = int_handler_table[vector].handler(int_handler_table[vector].arg);
+	IRQSTATS_END(vector, start);
+	KEVLOG_IRQ_EXIT(vector);
+
+	issueEOI(vector);
+
+	return ret;
+}
+
+uint16_t pc_pic_enabled_irqs(void)
+{
+	return (uint16_t)~(irqMask[0] | (irqMask[1] << 8));
+}
+
+void pc_pic_disable(void)
+{
+	outp(PIC1 + 1, 0xff);
+	outp(PIC2 + 1, 0xff);
+	irqMask[0] = 0xff;
+	irqMask[1] = 0xff;
+}
+
 void platform_init_interrupts(void)
 {
 	// rebase the PIC out of the way of processor exceptions
@@ -164,6 +231,10 @@ status_t mask_interrupt(unsigned int vector)
 
 //	dprintf(DEBUG, "%s: vector %d\n", __PRETTY_FUNCTION__, vector);
 
+	/* the msi and local apic vectors have nothing to mask at the io-apic */
+	if (pc_apic_active())
+		return (vector >= INT_BASE && vector < INT_SYSCALL) ? ioapic_mask(vector, true) : NO_ERROR;
+
 	spin_lock_saved_state_t state;
 	spin_lock_irqsave(&lock, state);
 
@@ -194,6 +265,10 @@ status_t unmask_interrupt(unsigned int vector)
 
 //	dprintf("%s: vector %d\n", __PRETTY_FUNCTION__, vector);
 
+	/* the msi and local apic vectors have nothing to mask at the io-apic */
+	if (pc_apic_active())
+		return (vector >= INT_BASE && vector < INT_SYSCALL) ? ioapic_mask(vector, false) : NO_ERROR;
+
 	spin_lock_saved_state_t state;
 	spin_lock_irqsave(&lock, state);
 
@@ -204,12 +279,12 @@ status_t unmask_interrupt(unsigned int vector)
 	return NO_ERROR;
 }
 
-enum handler_return platform_irq(struct x86_iframe *frame)
+enum handler_return __HOT platform_irq(struct x86_iframe *frame)
 {
 	// get the current vector
 	unsigned int vector = frame->vector;
 
-	THREAD_STATS_INC(interrupts);
+	THREAD_STATS_IRQ_ENTER();
 
 	// deliver the interrupt
 	enum handler_return ret = INT_NO_RESCHEDULE;
@@ -236,12 +311,26 @@ enum handler_return platform_irq(struct x86_iframe *frame)
 			break;
 
 		default:
-			if (int_handler_table[vector].handler)
-				ret = int_handler_table[vector].handler(int_handler_table[vector].arg);
+			ret = pic_dispatch(vector);
+
+			/* take whatever else is pending before paying for another exception */
+			if (!pc_apic_active() && vector >= PIC1_BASE && vector < PIC2_BASE + 8) {
+				for (uint i = 1; i < PC_IRQ_BUDGET; i++) {
+					unsigned int next = pic_poll();
+					if (!next)
+						break;
+					if (pic_dispatch(next) == INT_RESCHEDULE)
+						ret = INT_RESCHEDULE;
+				}
+			}
+#ifdef ARCH_X86_64
+			profile_irq_exit(frame->rip, frame->rbp);
+#else
+			profile_irq_exit(frame->eip, frame->ebp);
+#endif
 	}
 
-	// ack the interrupt
-	issueEOI(vector);
+	THREAD_STATS_IRQ_EXIT();
 
 	return ret;
 }
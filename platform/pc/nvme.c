@@ -0,0 +1,806 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if WITH_LIB_BIO
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <malloc.h>
+#include <reg.h>
+#include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <dev/pci.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <lk/init.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * NVMe controllers. Each cpu gets an io submission and completion queue pair of
+ * its own, so issuing a command only ever takes that cpu's queue lock. Every
+ * active namespace becomes a bdev.
+ */
+
+#define NVME_PCI_CLASS		0x010802
+
+/* controller registers */
+#define NVME_CAP			0x00
+#define NVME_VS				0x08
+#define NVME_INTMS			0x0c
+#define NVME_INTMC			0x10
+#define NVME_CC				0x14
+#define NVME_CSTS			0x1c
+#define NVME_AQA			0x24
+#define NVME_ASQ			0x28
+#define NVME_ACQ			0x30
+#define NVME_DOORBELLS		0x1000
+
+#define NVME_CAP_MQES(cap)		(((cap) & 0xffff) + 1)
+#define NVME_CAP_TO(cap)		(((cap) >> 24) & 0xff) /* 500ms units */
+#define NVME_CAP_DSTRD(cap)		(((cap) >> 32) & 0xf)
+#define NVME_CAP_MPSMIN(cap)	(((cap) >> 48) & 0xf)
+
+#define NVME_CC_EN			(1U << 0)
+#define NVME_CC_IOSQES		(6U << 16) /* 64 byte submission entries */
+#define NVME_CC_IOCQES		(4U << 20) /* 16 byte completion entries */
+
+#define NVME_CSTS_RDY		(1U << 0)
+#define NVME_CSTS_CFS		(1U << 1)
+
+/* admin commands */
+#define NVME_ADMIN_CREATE_SQ	0x01
+#define NVME_ADMIN_CREATE_CQ	0x05
+#define NVME_ADMIN_IDENTIFY		0x06
+#define NVME_ADMIN_SET_FEATURES	0x09
+
+#define NVME_FEAT_NUM_QUEUES	0x07
+
+/* nvm commands */
+#define NVME_CMD_WRITE		0x01
+#define NVME_CMD_READ		0x02
+
+struct nvme_sqe {
+	uint32_t cdw0; /* opcode, command id in the top half */
+	uint32_t nsid;
+	uint32_t cdw2;
+	uint32_t cdw3;
+	uint64_t mptr;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw10;
+	uint32_t cdw11;
+	uint32_t cdw12;
+	uint32_t cdw13;
+	uint32_t cdw14;
+	uint32_t cdw15;
+} __PACKED;
+
+struct nvme_cqe {
+	uint32_t dw0;
+	uint32_t dw1;
+	uint16_t sq_head;
+	uint16_t sq_id;
+	uint16_t cid;
+	volatile uint16_t status; /* phase in bit 0 */
+} __PACKED;
+
+#define NVME_ADMIN_DEPTH	16
+#define NVME_IO_DEPTH		64
+#define NVME_MAX_IO_QUEUES	SMP_MAX_CPUS
+#define NVME_MAX_NAMESPACES	4
+
+/* transfers are cut into pieces of at most this size, one per command. each has a
+ * prp list of its own for the pages past the first. */
+#define NVME_MAX_PIECE		(128 * 1024)
+#define NVME_PRP_LIST_SIZE	512
+#define NVME_PRP_LIST_MAX	(NVME_PRP_LIST_SIZE / sizeof(uint64_t))
+STATIC_ASSERT(NVME_MAX_PIECE / PAGE_SIZE <= NVME_PRP_LIST_MAX);
+
+/* layout of an io queue pair's dma memory */
+#define NVME_QMEM_SQ		0
+#define NVME_QMEM_CQ		PAGE_SIZE
+#define NVME_QMEM_PRP		(2 * PAGE_SIZE)
+#define NVME_QMEM_SIZE		(NVME_QMEM_PRP + NVME_IO_DEPTH * NVME_PRP_LIST_SIZE)
+STATIC_ASSERT(NVME_IO_DEPTH * sizeof(struct nvme_sqe) <= PAGE_SIZE);
+
+/* and of the admin queue's, which also holds the identify buffer */
+#define NVME_AMEM_SQ		0
+#define NVME_AMEM_CQ		PAGE_SIZE
+#define NVME_AMEM_IDENTIFY	(2 * PAGE_SIZE)
+#define NVME_AMEM_SIZE		(3 * PAGE_SIZE)
+
+struct nvme_ctrl;
+
+/* state for one piece in flight, indexed by its command id */
+struct nvme_slot {
+	bdev_t *dev; /* the namespace, the queues are shared between them */
+	bio_request_t *bio;
+	bool sync;
+	size_t len;
+};
+
+struct nvme_queue {
+	struct nvme_ctrl *ctrl;
+	uint qid;
+	uint depth;
+	uint vector;        /* its own msi-x vector, when the controller uses them */
+
+	/* protects everything below */
+	spin_lock_t lock;
+	event_t slot_event; /* signaled when slots are freed */
+	uint sq_tail;
+	uint cq_head;
+	uint16_t cq_phase;
+	uint64_t busy;      /* command ids in use, at most depth - 1 of them */
+
+	struct nvme_sqe *sq;
+	struct nvme_cqe *cq;
+	uint8_t *mem;
+	paddr_t mem_phys;
+	struct nvme_slot slot[NVME_IO_DEPTH];
+
+	/* stats */
+	ulong commands;
+	ulong errors;
+};
+
+struct nvme_ns {
+	struct nvme_ctrl *ctrl;
+	uint32_t nsid;
+	uint lba_shift;
+	bdev_t bdev;
+	bio_piece_limits_t piece_limits;
+};
+
+struct nvme_ctrl {
+	addr_t regs;
+	uint64_t cap;
+	uint doorbell_stride;
+	uint irq;           /* the pin interrupt, unless use_msix */
+	bool use_msix;
+	pci_msix_t msix;
+	size_t max_piece;
+
+	/* admin queue, only used polled during setup */
+	struct nvme_queue admin;
+
+	uint io_queue_count;
+	struct nvme_queue io[NVME_MAX_IO_QUEUES];
+
+	uint ns_count;
+	struct nvme_ns ns[NVME_MAX_NAMESPACES];
+};
+
+static uint nvme_found_index;
+
+static inline uint32_t nvme_read32(struct nvme_ctrl *ctrl, uint reg)
+{
+	return *REG32(ctrl->regs + reg);
+}
+
+static inline void nvme_write32(struct nvme_ctrl *ctrl, uint reg, uint32_t val)
+{
+	*REG32(ctrl->regs + reg) = val;
+}
+
+static inline uint64_t nvme_read64(struct nvme_ctrl *ctrl, uint reg)
+{
+	return nvme_read32(ctrl, reg) | ((uint64_t)nvme_read32(ctrl, reg + 4) << 32);
+}
+
+static inline void nvme_write64(struct nvme_ctrl *ctrl, uint reg, uint64_t val)
+{
+	nvme_write32(ctrl, reg, val);
+	nvme_write32(ctrl, reg + 4, val >> 32);
+}
+
+static inline void nvme_sq_doorbell(struct nvme_queue *q)
+{
+	nvme_write32(q->ctrl, NVME_DOORBELLS + (2 * q->qid) * q->ctrl->doorbell_stride, q->sq_tail);
+}
+
+static inline void nvme_cq_doorbell(struct nvme_queue *q)
+{
+	nvme_write32(q->ctrl, NVME_DOORBELLS + (2 * q->qid + 1) * q->ctrl->doorbell_stride, q->cq_head);
+}
+
+static status_t nvme_wait_ready(struct nvme_ctrl *ctrl, bool ready)
+{
+	lk_time_t timeout = MAX(NVME_CAP_TO(ctrl->cap), 1U) * 500;
+	lk_time_t start = current_time();
+
+	while (!!(nvme_read32(ctrl, NVME_CSTS) & NVME_CSTS_RDY) != ready) {
+		if (nvme_read32(ctrl, NVME_CSTS) & NVME_CSTS_CFS)
+			return ERR_IO;
+		if (current_time() - start > timeout)
+			return ERR_TIMED_OUT;
+	}
+
+	return NO_ERROR;
+}
+
+static status_t nvme_alloc_dma(size_t size, uint8_t **ptr, paddr_t *pa)
+{
+#if WITH_KERNEL_VM
+	void *mem;
+	status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "nvme", ROUNDUP(size, PAGE_SIZE), &mem,
+	                                    PAGE_SIZE_SHIFT, 0, ARCH_MMU_FLAG_CACHED);
+	if (err < 0)
+		return err;
+	*ptr = mem;
+	arch_mmu_query((vaddr_t)mem, pa, NULL);
+#else
+	*ptr = memalign(PAGE_SIZE, ROUNDUP(size, PAGE_SIZE));
+	if (!*ptr)
+		return ERR_NO_MEMORY;
+	*pa = (paddr_t)(uintptr_t)*ptr;
+#endif
+	memset(*ptr, 0, size);
+
+	return NO_ERROR;
+}
+
+static void nvme_queue_init(struct nvme_ctrl *ctrl, struct nvme_queue *q, uint qid, uint depth)
+{
+	q->ctrl = ctrl;
+	q->qid = qid;
+	q->depth = depth;
+	spin_lock_init(&q->lock);
+	event_init(&q->slot_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+	q->sq_tail = 0;
+	q->cq_head = 0;
+	q->cq_phase = 1;
+	q->busy = 0;
+}
+
+/* run an admin command and wait for it, during setup only */
+static status_t nvme_admin_command(struct nvme_ctrl *ctrl, struct nvme_sqe *cmd, uint32_t *result)
+{
+	struct nvme_queue *q = &ctrl->admin;
+
+	cmd->cdw0 |= (uint32_t)q->sq_tail << 16;
+	q->sq[q->sq_tail] = *cmd;
+	q->sq_tail = (q->sq_tail + 1) % q->depth;
+	nvme_sq_doorbell(q);
+
+	struct nvme_cqe *cqe = &q->cq[q->cq_head];
+	lk_time_t start = current_time();
+	while ((cqe->status & 1) != q->cq_phase) {
+		if (current_time() - start > 1000) {
+			LTRACEF("admin command 0x%x timed out\n", cmd->cdw0 & 0xff);
+			return ERR_TIMED_OUT;
+		}
+	}
+
+	uint16_t status = cqe->status >> 1;
+	if (result)
+		*result = cqe->dw0;
+
+	if (++q->cq_head == q->depth) {
+		q->cq_head = 0;
+		q->cq_phase ^= 1;
+	}
+	nvme_cq_doorbell(q);
+
+	if (status) {
+		LTRACEF("admin command 0x%x failed, status 0x%x\n", cmd->cdw0 & 0xff, status);
+		return ERR_IO;
+	}
+
+	return NO_ERROR;
+}
+
+static status_t nvme_identify(struct nvme_ctrl *ctrl, uint32_t nsid, uint cns)
+{
+	struct nvme_sqe cmd = {
+		.cdw0 = NVME_ADMIN_IDENTIFY,
+		.nsid = nsid,
+		.prp1 = ctrl->admin.mem_phys + NVME_AMEM_IDENTIFY,
+		.cdw10 = cns,
+	};
+
+	return nvme_admin_command(ctrl, &cmd, NULL);
+}
+
+/* reap a queue's completions. returns whether there were any */
+static bool nvme_queue_irq(struct nvme_queue *q)
+{
+	struct nvme_slot done_slot[NVME_IO_DEPTH];
+	uint16_t done_status[NVME_IO_DEPTH];
+	uint count = 0;
+
+	spin_lock(&q->lock);
+	for (;;) {
+		struct nvme_cqe *cqe = &q->cq[q->cq_head];
+		if ((cqe->status & 1) != q->cq_phase)
+			break;
+
+		uint cid = cqe->cid;
+		DEBUG_ASSERT(cid < q->depth && (q->busy & (1ULL << cid)));
+
+		/* the slot is free for reuse once the lock is dropped, grab what we need first */
+		done_slot[count] = q->slot[cid];
+		done_status[count] = cqe->status >> 1;
+		count++;
+		q->busy &= ~(1ULL << cid);
+
+		if (++q->cq_head == q->depth) {
+			q->cq_head = 0;
+			q->cq_phase ^= 1;
+		}
+	}
+	if (count)
+		nvme_cq_doorbell(q);
+	spin_unlock(&q->lock);
+
+	if (!count)
+		return false;
+
+	/* wake anyone waiting for a slot */
+	event_signal(&q->slot_event, false);
+
+	for (uint i = 0; i < count; i++) {
+		struct nvme_slot *s = &done_slot[i];
+
+		if (done_status[i]) {
+			LTRACEF("queue %u command failed, status 0x%x\n", q->qid, done_status[i]);
+			q->errors++;
+			s->bio->result = ERR_IO;
+		} else if (s->bio->result >= 0) {
+			s->bio->result += s->len;
+		}
+
+		bio_put_piece(s->dev, s->bio, s->sync);
+	}
+
+	return true;
+}
+
+static enum handler_return nvme_irq_handler(void *arg)
+{
+	struct nvme_ctrl *ctrl = arg;
+	bool any = false;
+
+	/* a pin interrupt is shared by every queue, look at all of them */
+	for (uint i = 0; i < ctrl->io_queue_count; i++)
+		any |= nvme_queue_irq(&ctrl->io[i]);
+
+	return any ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+static enum handler_return nvme_msix_handler(void *arg)
+{
+	/* the vector is this queue's alone */
+	return nvme_queue_irq(arg) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+/* build the prps for a piece. the first segment may start anywhere, the rest have
+ * to start on a page and all but the last end on one, which nvme_can_map and
+ * the page_joins limit see to. */
+static void nvme_build_prps(struct nvme_queue *q, uint cid, const bio_seg_t *seg, uint seg_count,
+                            struct nvme_sqe *cmd)
+{
+	paddr_t page[NVME_PRP_LIST_MAX + 1];
+	uint pages = 0;
+
+	for (uint i = 0; i < seg_count; i++) {
+		paddr_t pa = seg[i].pa;
+		paddr_t end = seg[i].pa + seg[i].len;
+		while (pa < end) {
+			page[pages++] = pa;
+			pa = ROUNDDOWN(pa, PAGE_SIZE) + PAGE_SIZE;
+		}
+	}
+
+	/* every piece carries data, a read or write of nothing never gets here */
+	DEBUG_ASSERT(pages > 0);
+	if (pages == 0)
+		return;
+
+	cmd->prp1 = page[0];
+	if (pages == 2) {
+		cmd->prp2 = page[1];
+	} else if (pages > 2) {
+		uint64_t *list = (uint64_t *)(q->mem + NVME_QMEM_PRP + cid * NVME_PRP_LIST_SIZE);
+		for (uint i = 1; i < pages; i++)
+			list[i - 1] = page[i];
+		cmd->prp2 = q->mem_phys + NVME_QMEM_PRP + cid * NVME_PRP_LIST_SIZE;
+	}
+}
+
+/* queue one piece of a transfer on the current cpu's queue, waiting for a slot if it's full */
+static void nvme_queue_piece(struct bdev *bdev, bio_request_t *bio, bool sync,
+                             const bio_seg_t *seg, uint seg_count, off_t offset, size_t len)
+{
+	struct nvme_ns *ns = containerof(bdev, struct nvme_ns, bdev);
+	struct nvme_ctrl *ctrl = ns->ctrl;
+	bool write = (bio->op == BIO_OP_WRITE);
+	spin_lock_saved_state_t state;
+	struct nvme_queue *q;
+	uint cid;
+
+	LTRACEF("ns %u, segs %u, offset 0x%llx, len %zu\n", ns->nsid, seg_count, offset, len);
+
+	DEBUG_ASSERT(len <= ctrl->max_piece);
+
+	for (;;) {
+		/* we can't migrate with interrupts off, so this stays our cpu's queue */
+		arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+		q = &ctrl->io[arch_curr_cpu_num() % ctrl->io_queue_count];
+		spin_lock(&q->lock);
+
+		uint64_t free = ~q->busy & ((1ULL << (q->depth - 1)) - 1);
+		if (free) {
+			cid = __builtin_ctzll(free);
+			q->busy |= 1ULL << cid;
+			break;
+		}
+
+		spin_unlock(&q->lock);
+		arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+		event_wait(&q->slot_event);
+	}
+
+	struct nvme_sqe *cmd = &q->sq[q->sq_tail];
+	memset(cmd, 0, sizeof(*cmd));
+
+	uint64_t lba = offset >> ns->lba_shift;
+	cmd->cdw0 = (write ? NVME_CMD_WRITE : NVME_CMD_READ) | ((uint32_t)cid << 16);
+	cmd->nsid = ns->nsid;
+	cmd->cdw10 = lba;
+	cmd->cdw11 = lba >> 32;
+	cmd->cdw12 = (len >> ns->lba_shift) - 1;
+	nvme_build_prps(q, cid, seg, seg_count, cmd);
+
+	q->slot[cid].dev = bdev;
+	q->slot[cid].bio = bio;
+	q->slot[cid].sync = sync;
+	q->slot[cid].len = len;
+
+	/* x86 keeps stores in order, the compiler has to get the entry out before the doorbell too */
+	__asm__ volatile("" ::: "memory");
+
+	q->sq_tail = (q->sq_tail + 1) % q->depth;
+	nvme_sq_doorbell(q);
+	q->commands++;
+
+	spin_unlock(&q->lock);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* can the request go straight to prps. the controller only moves whole blocks to
+ * dword aligned memory, and a prp list can only join fragments on page boundaries,
+ * so every fragment but the last has to be whole blocks for the pieces to be.
+ */
+static bool nvme_can_map(struct bdev *bdev, off_t offset, size_t len, const void *buf,
+                         const iovec_t *iov, uint iov_cnt)
+{
+	if ((offset | len) & (bdev->block_size - 1))
+		return false;
+
+	if (!iov)
+		return ((uintptr_t)buf & 3) == 0;
+
+	for (uint i = 0; i < iov_cnt && len > 0; i++) {
+		if ((uintptr_t)iov[i].iov_base & 3)
+			return false;
+		if (iov[i].iov_len < len && (iov[i].iov_len & (bdev->block_size - 1)))
+			return false;
+		len -= MIN(len, iov[i].iov_len);
+	}
+
+	return true;
+}
+
+static const bio_piece_ops_t nvme_piece_ops = {
+	.can_map = nvme_can_map,
+	.queue_piece = nvme_queue_piece,
+};
+
+static ssize_t nvme_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+	struct nvme_ns *ns = containerof(bdev, struct nvme_ns, bdev);
+
+	LTRACEF("ns %u, buf %p, block 0x%x, count %u\n", ns->nsid, buf, block, count);
+
+	if (count == 0)
+		return 0;
+	if ((uintptr_t)buf & 3)
+		return ERR_INVALID_ARGS;
+
+	bio_request_t req;
+	bio_request_init(&req, BIO_OP_READ, buf, (off_t)block << ns->lba_shift, (size_t)count << ns->lba_shift,
+	                 NULL, NULL);
+
+	return bio_pieces_sync(bdev, &req);
+}
+
+static ssize_t nvme_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+	struct nvme_ns *ns = containerof(bdev, struct nvme_ns, bdev);
+
+	LTRACEF("ns %u, buf %p, block 0x%x, count %u\n", ns->nsid, buf, block, count);
+
+	if (count == 0)
+		return 0;
+	if ((uintptr_t)buf & 3)
+		return ERR_INVALID_ARGS;
+
+	bio_request_t req;
+	bio_request_init(&req, BIO_OP_WRITE, (void *)buf, (off_t)block << ns->lba_shift,
+	                 (size_t)count << ns->lba_shift, NULL, NULL);
+
+	return bio_pieces_sync(bdev, &req);
+}
+
+static status_t nvme_create_io_queue(struct nvme_ctrl *ctrl, struct nvme_queue *q, uint qid, uint depth)
+{
+	nvme_queue_init(ctrl, q, qid, depth);
+
+	status_t err = nvme_alloc_dma(NVME_QMEM_SIZE, &q->mem, &q->mem_phys);
+	if (err < 0)
+		return err;
+	q->sq = (struct nvme_sqe *)(q->mem + NVME_QMEM_SQ);
+	q->cq = (struct nvme_cqe *)(q->mem + NVME_QMEM_CQ);
+
+	/* the completion queue first, physically contiguous, interrupts on msi-x entry
+	 * qid, or on the pin interrupt which is vector 0 */
+	struct nvme_sqe cmd = {
+		.cdw0 = NVME_ADMIN_CREATE_CQ,
+		.prp1 = q->mem_phys + NVME_QMEM_CQ,
+		.cdw10 = qid | ((depth - 1) << 16),
+		.cdw11 = (1 << 0) | (1 << 1) | ((ctrl->use_msix ? qid : 0) << 16),
+	};
+	err = nvme_admin_command(ctrl, &cmd, NULL);
+	if (err < 0)
+		return err;
+
+	cmd = (struct nvme_sqe) {
+		.cdw0 = NVME_ADMIN_CREATE_SQ,
+		.prp1 = q->mem_phys + NVME_QMEM_SQ,
+		.cdw10 = qid | ((depth - 1) << 16),
+		.cdw11 = (1 << 0) | (qid << 16),
+	};
+	return nvme_admin_command(ctrl, &cmd, NULL);
+}
+
+static status_t nvme_ctrl_init(const pci_location_t *loc)
+{
+	uint32_t bar0, bar1;
+	uint16_t command;
+	uint8_t irq;
+
+	if (pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES, &bar0) != _PCI_SUCCESSFUL ||
+			pci_read_config_word(loc, PCI_CONFIG_BASE_ADDRESSES + 4, &bar1) != _PCI_SUCCESSFUL ||
+			pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command) != _PCI_SUCCESSFUL ||
+			pci_read_config_byte(loc, PCI_CONFIG_INTERRUPT_LINE, &irq) != _PCI_SUCCESSFUL)
+		return ERR_IO;
+
+	/* BAR0 is memory space, usually 64 bit */
+	paddr_t base = bar0 & ~0xfU;
+	if ((bar0 & 0x6) == 0x4)
+		base |= (uint64_t)bar1 << 32;
+	if ((bar0 & 1) || base == 0) {
+		LTRACEF("unusable controller, bar 0x%x\n", bar0);
+		return ERR_NOT_SUPPORTED;
+	}
+
+	pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+	struct nvme_ctrl *ctrl = calloc(1, sizeof(struct nvme_ctrl));
+	if (!ctrl)
+		return ERR_NO_MEMORY;
+
+	/* registers, and the doorbells for the admin queue and ours in the page after */
+#if WITH_KERNEL_VM
+	void *regs;
+	status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "nvme regs", PAGE_SIZE * 2, &regs,
+	                                  PAGE_SIZE_SHIFT, base, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+	if (err < 0)
+		goto fail;
+	ctrl->regs = (addr_t)regs;
+#else
+	status_t err;
+	ctrl->regs = base;
+#endif
+	ctrl->cap = nvme_read64(ctrl, NVME_CAP);
+	ctrl->doorbell_stride = 4U << NVME_CAP_DSTRD(ctrl->cap);
+
+	LTRACEF("base 0x%lx cap 0x%llx vs 0x%x irq %u\n", base, ctrl->cap, nvme_read32(ctrl, NVME_VS), irq);
+
+	if (NVME_DOORBELLS + (NVME_MAX_IO_QUEUES + 1) * 2 * ctrl->doorbell_stride > PAGE_SIZE * 2 ||
+			NVME_CAP_MPSMIN(ctrl->cap) > PAGE_SIZE_SHIFT - 12) {
+		err = ERR_NOT_SUPPORTED;
+		goto fail;
+	}
+
+	/* reset, then bring it up with the admin queue */
+	nvme_write32(ctrl, NVME_CC, 0);
+	err = nvme_wait_ready(ctrl, false);
+	if (err < 0)
+		goto fail;
+
+	nvme_queue_init(ctrl, &ctrl->admin, 0, NVME_ADMIN_DEPTH);
+	err = nvme_alloc_dma(NVME_AMEM_SIZE, &ctrl->admin.mem, &ctrl->admin.mem_phys);
+	if (err < 0)
+		goto fail;
+	ctrl->admin.sq = (struct nvme_sqe *)(ctrl->admin.mem + NVME_AMEM_SQ);
+	ctrl->admin.cq = (struct nvme_cqe *)(ctrl->admin.mem + NVME_AMEM_CQ);
+
+	/* interrupts stay masked until the io queues exist */
+	nvme_write32(ctrl, NVME_AQA, (NVME_ADMIN_DEPTH - 1) | ((NVME_ADMIN_DEPTH - 1) << 16));
+	nvme_write64(ctrl, NVME_ASQ, ctrl->admin.mem_phys + NVME_AMEM_SQ);
+	nvme_write64(ctrl, NVME_ACQ, ctrl->admin.mem_phys + NVME_AMEM_CQ);
+	nvme_write32(ctrl, NVME_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+	err = nvme_wait_ready(ctrl, true);
+	if (err < 0)
+		goto fail;
+
+	/* controller: the max transfer size is in units of the minimum page size */
+	err = nvme_identify(ctrl, 0, 1);
+	if (err < 0)
+		goto fail;
+	const uint8_t *id = ctrl->admin.mem + NVME_AMEM_IDENTIFY;
+	uint8_t mdts = id[77];
+	uint32_t nn = *(const uint32_t *)(id + 516);
+	ctrl->max_piece = NVME_MAX_PIECE;
+	if (mdts)
+		ctrl->max_piece = MIN(ctrl->max_piece, (size_t)PAGE_SIZE << mdts);
+
+	/* ask for a queue pair per cpu, take what we're given */
+	uint32_t queues;
+	struct nvme_sqe cmd = {
+		.cdw0 = NVME_ADMIN_SET_FEATURES,
+		.cdw10 = NVME_FEAT_NUM_QUEUES,
+		.cdw11 = (NVME_MAX_IO_QUEUES - 1) | ((NVME_MAX_IO_QUEUES - 1) << 16),
+	};
+	err = nvme_admin_command(ctrl, &cmd, &queues);
+	if (err < 0)
+		goto fail;
+	ctrl->io_queue_count = MIN(MIN((queues & 0xffff), (queues >> 16)) + 1U, (uint)NVME_MAX_IO_QUEUES);
+
+	/* an msi-x vector per queue, aimed at the cpu that submits to it. entry 0 goes
+	 * with the admin queue, which is polled, so that one stays masked. if the
+	 * vectors run out, fewer queues it is */
+	if (pci_msix_init(loc, &ctrl->msix) == NO_ERROR && ctrl->msix.count > 1) {
+		uint count = MIN(ctrl->io_queue_count, ctrl->msix.count - 1);
+		uint i;
+		for (i = 0; i < count; i++) {
+			int vector = pc_alloc_msi_vector();
+			if (vector < 0)
+				break;
+			ctrl->io[i].vector = vector;
+		}
+		if (i > 0) {
+			ctrl->io_queue_count = i;
+			ctrl->use_msix = true;
+		}
+	}
+
+	/* otherwise every queue shares the legacy interrupt, which has to be routed to the pic */
+	if (!ctrl->use_msix) {
+		if (irq >= 16) {
+			LTRACEF("no msi-x and no usable irq (%u)\n", irq);
+			err = ERR_NOT_SUPPORTED;
+			goto fail;
+		}
+		ctrl->irq = INT_BASE + irq;
+	}
+
+	uint depth = MIN(NVME_IO_DEPTH, NVME_CAP_MQES(ctrl->cap));
+	for (uint i = 0; i < ctrl->io_queue_count; i++) {
+		err = nvme_create_io_queue(ctrl, &ctrl->io[i], i + 1, depth);
+		if (err < 0) {
+			/* run with the ones we got */
+			ctrl->io_queue_count = i;
+			break;
+		}
+	}
+	if (ctrl->io_queue_count == 0)
+		goto fail;
+
+	/* namespaces */
+	for (uint32_t nsid = 1; nsid <= nn && ctrl->ns_count < NVME_MAX_NAMESPACES; nsid++) {
+		if (nvme_identify(ctrl, nsid, 0) < 0)
+			continue;
+
+		uint64_t nsze = *(const uint64_t *)id;
+		uint lbaf = id[26] & 0xf;
+		uint lba_shift = id[128 + lbaf * 4 + 2];
+		if (nsze == 0 || lba_shift < 9 || lba_shift > PAGE_SIZE_SHIFT)
+			continue;
+
+		struct nvme_ns *ns = &ctrl->ns[ctrl->ns_count++];
+		ns->ctrl = ctrl;
+		ns->nsid = nsid;
+		ns->lba_shift = lba_shift;
+
+		char name[16];
+		snprintf(name, sizeof(name), "nvme%un%u", nvme_found_index, nsid);
+		bio_initialize_bdev(&ns->bdev, name, 1U << lba_shift, MIN(nsze, (uint64_t)UINT32_MAX), 0, NULL);
+
+		ns->bdev.read_block = &nvme_bdev_read_block;
+		ns->bdev.write_block = &nvme_bdev_write_block;
+
+		/* pieces only break where a fragment does, which nvme_can_map made a whole
+		 * number of blocks, or at max_piece */
+		ns->piece_limits = (bio_piece_limits_t) {
+			.max_len = ctrl->max_piece,
+			.max_segs = NVME_MAX_PIECE / PAGE_SIZE + 1,
+			.sector_size = ns->bdev.block_size,
+			.page_joins = true,
+		};
+		bio_init_pieces(&ns->bdev, &nvme_piece_ops, &ns->piece_limits);
+
+		printf("nvme%u: %s, %llu blocks of %u bytes\n", nvme_found_index, name, nsze, 1U << lba_shift);
+	}
+
+	printf("nvme%u: %u io queues of %u, max transfer %zu, %s\n", nvme_found_index, ctrl->io_queue_count,
+	       depth, ctrl->max_piece, ctrl->use_msix ? "msi-x" : "intx");
+	nvme_found_index++;
+
+	if (ctrl->use_msix) {
+		/* queue i is the one cpu i submits to */
+		for (uint i = 0; i < ctrl->io_queue_count; i++) {
+			register_int_handler(ctrl->io[i].vector, &nvme_msix_handler, &ctrl->io[i]);
+			pci_msix_set(&ctrl->msix, ctrl->io[i].qid, ctrl->io[i].vector, i);
+		}
+		pci_msix_enable(&ctrl->msix);
+	} else {
+		register_int_handler(ctrl->irq, &nvme_irq_handler, ctrl);
+		unmask_interrupt(ctrl->irq);
+	}
+
+	for (uint i = 0; i < ctrl->ns_count; i++)
+		bio_register_device(&ctrl->ns[i].bdev);
+
+	return NO_ERROR;
+
+fail:
+	/* the controller may still own the queue memory, so leave it all be */
+	LTRACEF("controller init failed %d\n", err);
+	return err;
+}
+
+static void nvme_init(uint level)
+{
+	pci_location_t loc;
+
+	for (uint16_t index = 0; pci_find_pci_class_code(&loc, NVME_PCI_CLASS, index) == _PCI_SUCCESSFUL; index++) {
+		LTRACEF("found nvme controller at %02x:%02x\n", loc.bus, loc.dev_fn);
+		nvme_ctrl_init(&loc);
+	}
+}
+
+/* probing resets each controller and waits on it, let it overlap with the others */
+LK_INIT_HOOK_PARALLEL(nvme, &nvme_init, LK_INIT_LEVEL_PLATFORM + 1);
+
+#endif
@@ -22,12 +22,16 @@
  */
 #include <debug.h>
 #include <err.h>
+#include <reg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <kernel/thread.h>
 #include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <arch/x86.h>
 #include <arch/x86/descriptor.h>
 #include <dev/pci.h>
+#include "platform_p.h"
 
 static int last_bus = 0;
 static spin_lock_t lock;
@@ -39,7 +43,9 @@ typedef struct {
 } __PACKED irq_routing_options_t;
 
 static int pci_type1_detect(void);
+#if ARCH_X86
 static int pci_bios_detect(void);
+#endif
 
 int pci_get_last_bus(void)
 {
@@ -69,7 +75,8 @@ int pci_find_pci_device(pci_location_t *state, uint16_t device_id, uint16_t vend
 	spin_lock_saved_state_t irqstate;
 	spin_lock_irqsave(&lock, irqstate);
 
-	int res = g_pci_find_pci_device(state, device_id, vendor_id, index);
+	int res = g_pci_find_pci_device ? g_pci_find_pci_device(state, device_id, vendor_id, index) :
+	          _PCI_FUNC_NOT_SUPPORTED;
 
 	spin_unlock_irqrestore(&lock, irqstate);
 
@@ -81,7 +88,8 @@ int pci_find_pci_class_code(pci_location_t *state, uint32_t class_code, uint16_t
 	spin_lock_saved_state_t irqstate;
 	spin_lock_irqsave(&lock, irqstate);
 
-	int res = g_pci_find_pci_class_code(state, class_code, index);
+	int res = g_pci_find_pci_class_code ? g_pci_find_pci_class_code(state, class_code, index) :
+	          _PCI_FUNC_NOT_SUPPORTED;
 
 	spin_unlock_irqrestore(&lock, irqstate);
 
@@ -162,6 +170,9 @@ int pci_write_config_word(const pci_location_t *state, uint32_t reg, uint32_t va
 
 int pci_get_irq_routing_options(irq_routing_entry *entries, uint16_t *count, uint16_t *pci_irqs)
 {
+	if (!g_pci_get_irq_routing_options)
+		return _PCI_FUNC_NOT_SUPPORTED;
+
 	irq_routing_options_t options;
 	options.size = sizeof(irq_routing_entry) * *count;
 	options.selector = DATA_SELECTOR;
@@ -181,6 +192,9 @@ int pci_get_irq_routing_options(irq_routing_entry *entries, uint16_t *count, uin
 
 int pci_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq)
 {
+	if (!g_pci_set_irq_hw_int)
+		return _PCI_FUNC_NOT_SUPPORTED;
+
 	spin_lock_saved_state_t irqstate;
 	spin_lock_irqsave(&lock, irqstate);
 
@@ -191,14 +205,344 @@ int pci_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq
 	return res;
 }
 
+uint8_t pci_find_capability(const pci_location_t *state, uint8_t cap_id)
+{
+	uint16_t status;
+	uint8_t ptr;
+
+	if (pci_read_config_half(state, 0x06, &status) != _PCI_SUCCESSFUL ||
+	        !(status & PCI_STATUS_NEW_CAPS))
+		return 0;
+
+	if (pci_read_config_byte(state, 0x34, &ptr) != _PCI_SUCCESSFUL)
+		return 0;
+
+	/* a broken list could loop, there's only room for 48 of them anyway */
+	for (int i = 0; i < 48 && ptr >= 0x40; i++) {
+		pci_capability_t cap;
+
+		ptr &= ~3;
+		if (pci_read_config_byte(state, ptr, &cap.id) != _PCI_SUCCESSFUL ||
+		        pci_read_config_byte(state, ptr + 1, &cap.next) != _PCI_SUCCESSFUL)
+			return 0;
+
+		if (cap.id == cap_id)
+			return ptr;
+		ptr = cap.next;
+	}
+
+	return 0;
+}
+
+static void pci_disable_intx(const pci_location_t *state)
+{
+	uint16_t command;
+
+	if (pci_read_config_half(state, PCI_CONFIG_COMMAND, &command) == _PCI_SUCCESSFUL)
+		pci_write_config_half(state, PCI_CONFIG_COMMAND, command | PCI_COMMAND_INT_DISABLE);
+}
+
+status_t pci_enable_msi(const pci_location_t *state, uint vector, uint cpu)
+{
+	uint64_t addr;
+	uint32_t data;
+	uint16_t control;
+
+	uint8_t cap = pci_find_capability(state, PCI_CAP_ID_MSI);
+	if (!cap)
+		return ERR_NOT_SUPPORTED;
+
+	if (pc_msi_message(vector, cpu, &addr, &data) < 0)
+		return ERR_NOT_SUPPORTED;
+
+	if (pci_read_config_half(state, cap + PCI_MSI_CONTROL, &control) != _PCI_SUCCESSFUL)
+		return ERR_IO;
+
+	/* one message only, the multiple message enable field stays at 0 */
+	pci_write_config_word(state, cap + PCI_MSI_ADDRESS_LO, (uint32_t)addr);
+	if (control & PCI_MSI_CONTROL_64BIT) {
+		pci_write_config_word(state, cap + PCI_MSI_ADDRESS_HI, (uint32_t)(addr >> 32));
+		pci_write_config_half(state, cap + PCI_MSI_DATA_64, data);
+	} else {
+		pci_write_config_half(state, cap + PCI_MSI_DATA_32, data);
+	}
+	pci_write_config_half(state, cap + PCI_MSI_CONTROL, control | PCI_MSI_CONTROL_ENABLE);
+	pci_disable_intx(state);
+
+	return NO_ERROR;
+}
+
+status_t pci_msix_init(const pci_location_t *state, pci_msix_t *msix)
+{
+	uint16_t control;
+	uint32_t table, bar, bar_hi = 0;
+
+	uint8_t cap = pci_find_capability(state, PCI_CAP_ID_MSIX);
+	if (!cap)
+		return ERR_NOT_SUPPORTED;
+
+	if (pci_read_config_half(state, cap + PCI_MSIX_CONTROL, &control) != _PCI_SUCCESSFUL ||
+			pci_read_config_word(state, cap + PCI_MSIX_TABLE, &table) != _PCI_SUCCESSFUL)
+		return ERR_IO;
+
+	/* the table lives in one of the device's memory bars, which may be 64 bit */
+	uint bir = PCI_MSIX_TABLE_BIR(table);
+	if (bir > 5 ||
+			pci_read_config_word(state, PCI_CONFIG_BASE_ADDRESSES + bir * 4, &bar) != _PCI_SUCCESSFUL)
+		return ERR_IO;
+	if ((bar & 1) || ((bar & 0x6) == 0x4 && (bir == 5 ||
+			pci_read_config_word(state, PCI_CONFIG_BASE_ADDRESSES + bir * 4 + 4, &bar_hi) != _PCI_SUCCESSFUL)))
+		return ERR_NOT_SUPPORTED;
+
+	paddr_t base = (paddr_t)bar_hi << 32 | (bar & ~0xfU);
+	if (base == 0)
+		return ERR_NOT_SUPPORTED;
+	paddr_t pa = base + PCI_MSIX_TABLE_OFFSET(table);
+
+	msix->loc = *state;
+	msix->cap = cap;
+	msix->count = PCI_MSIX_CONTROL_SIZE(control);
+
+#if WITH_KERNEL_VM
+	paddr_t page = ROUNDDOWN(pa, PAGE_SIZE);
+	size_t size = ROUNDUP(pa + msix->count * PCI_MSIX_ENTRY_SIZE, PAGE_SIZE) - page;
+	void *ptr;
+	status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "msix table", size, &ptr,
+	                                  PAGE_SIZE_SHIFT, page, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+	if (err < 0)
+		return err;
+	msix->table = (addr_t)ptr + (pa - page);
+#else
+	msix->table = pa;
+#endif
+
+	/* masked until someone points them somewhere */
+	for (uint i = 0; i < msix->count; i++)
+		*REG32(msix->table + i * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CONTROL) |= PCI_MSIX_ENTRY_MASKED;
+
+	return NO_ERROR;
+}
+
+status_t pci_msix_set(pci_msix_t *msix, uint entry, uint vector, uint cpu)
+{
+	uint64_t addr;
+	uint32_t data;
+
+	if (entry >= msix->count)
+		return ERR_INVALID_ARGS;
+
+	if (pc_msi_message(vector, cpu, &addr, &data) < 0)
+		return ERR_NOT_SUPPORTED;
+
+	addr_t e = msix->table + entry * PCI_MSIX_ENTRY_SIZE;
+	*REG32(e + PCI_MSIX_ENTRY_ADDRESS_LO) = (uint32_t)addr;
+	*REG32(e + PCI_MSIX_ENTRY_ADDRESS_HI) = (uint32_t)(addr >> 32);
+	*REG32(e + PCI_MSIX_ENTRY_DATA) = data;
+	*REG32(e + PCI_MSIX_ENTRY_CONTROL) &= ~PCI_MSIX_ENTRY_MASKED;
+
+	return NO_ERROR;
+}
+
+void pci_msix_enable(pci_msix_t *msix)
+{
+	uint16_t control;
+
+	if (pci_read_config_half(&msix->loc, msix->cap + PCI_MSIX_CONTROL, &control) != _PCI_SUCCESSFUL)
+		return;
+
+	control = (control | PCI_MSIX_CONTROL_ENABLE) & ~PCI_MSIX_CONTROL_MASK;
+	pci_write_config_half(&msix->loc, msix->cap + PCI_MSIX_CONTROL, control);
+	pci_disable_intx(&msix->loc);
+}
+
 void pci_init(void)
 {
+#if ARCH_X86
 	if (!pci_bios_detect()) {
 		dprintf(INFO, "pci bios functions installed\n");
 		dprintf(INFO, "last pci bus is %d\n", last_bus);
+		return;
+	}
+#endif
+
+	if (!pci_type1_detect()) {
+		dprintf(INFO, "pci configuration mechanism #1 installed\n");
+		dprintf(INFO, "last pci bus is %d\n", last_bus);
 	}
 }
 
+/*
+ * configuration mechanism #1, through the address and data ports. there's no
+ * firmware to search for devices, so that's a scan of every bus up to the last
+ * one seen populated.
+ */
+#define PCI_CONFIG_ADDRESS	0xcf8
+#define PCI_CONFIG_DATA		0xcfc
+
+static void type1_select(const pci_location_t *state, uint32_t reg)
+{
+	outpd(PCI_CONFIG_ADDRESS, 0x80000000 | ((uint32_t)state->bus << 16) |
+	      ((uint32_t)state->dev_fn << 8) | (reg & 0xfc));
+}
+
+static int type1_read_config_byte(const pci_location_t *state, uint32_t reg, uint8_t *value)
+{
+	type1_select(state, reg);
+	*value = inp(PCI_CONFIG_DATA + (reg & 3));
+	return _PCI_SUCCESSFUL;
+}
+
+static int type1_read_config_half(const pci_location_t *state, uint32_t reg, uint16_t *value)
+{
+	if (reg & 1)
+		return _PCI_BAD_REGISTER_NUMBER;
+
+	type1_select(state, reg);
+	*value = inpw(PCI_CONFIG_DATA + (reg & 2));
+	return _PCI_SUCCESSFUL;
+}
+
+static int type1_read_config_word(const pci_location_t *state, uint32_t reg, uint32_t *value)
+{
+	if (reg & 3)
+		return _PCI_BAD_REGISTER_NUMBER;
+
+	type1_select(state, reg);
+	*value = inpd(PCI_CONFIG_DATA);
+	return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_byte(const pci_location_t *state, uint32_t reg, uint8_t value)
+{
+	type1_select(state, reg);
+	outp(PCI_CONFIG_DATA + (reg & 3), value);
+	return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_half(const pci_location_t *state, uint32_t reg, uint16_t value)
+{
+	if (reg & 1)
+		return _PCI_BAD_REGISTER_NUMBER;
+
+	type1_select(state, reg);
+	outpw(PCI_CONFIG_DATA + (reg & 2), value);
+	return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_word(const pci_location_t *state, uint32_t reg, uint32_t value)
+{
+	if (reg & 3)
+		return _PCI_BAD_REGISTER_NUMBER;
+
+	type1_select(state, reg);
+	outpd(PCI_CONFIG_DATA, value);
+	return _PCI_SUCCESSFUL;
+}
+
+/* call match on every function present, in bus order, until it returns true */
+static bool type1_scan(bool (*match)(uint32_t id, uint32_t class_code, void *arg), void *arg,
+                       pci_location_t *found)
+{
+	for (int bus = 0; bus <= last_bus; bus++) {
+		for (uint dev = 0; dev < 32; dev++) {
+			for (uint fn = 0; fn < 8; fn++) {
+				pci_location_t loc = { .bus = bus, .dev_fn = (dev << 3) | fn };
+				uint32_t id, class_rev;
+				uint8_t header_type;
+
+				type1_read_config_word(&loc, PCI_CONFIG_VENDOR_ID, &id);
+				if ((id & 0xffff) == 0xffff) {
+					if (fn == 0)
+						break;
+					continue;
+				}
+
+				/* the class code is the top 24 bits, over the revision */
+				type1_read_config_word(&loc, PCI_CONFIG_REVISION_ID, &class_rev);
+				if (match(id, class_rev >> 8, arg)) {
+					*found = loc;
+					return true;
+				}
+
+				type1_read_config_byte(&loc, PCI_CONFIG_HEADER_TYPE, &header_type);
+				if (fn == 0 && (header_type & 0x80) == 0)
+					break;
+			}
+		}
+	}
+
+	return false;
+}
+
+struct type1_match {
+	uint32_t value;
+	uint16_t index;
+};
+
+static bool type1_match_device(uint32_t id, uint32_t class_code, void *arg)
+{
+	struct type1_match *m = arg;
+	return id == m->value && m->index-- == 0;
+}
+
+static bool type1_match_class(uint32_t id, uint32_t class_code, void *arg)
+{
+	struct type1_match *m = arg;
+	return class_code == m->value && m->index-- == 0;
+}
+
+static int type1_find_pci_device(pci_location_t *state, uint16_t device_id, uint16_t vendor_id, uint16_t index)
+{
+	struct type1_match m = { ((uint32_t)device_id << 16) | vendor_id, index };
+
+	return type1_scan(type1_match_device, &m, state) ? _PCI_SUCCESSFUL : _PCI_DEVICE_NOT_FOUND;
+}
+
+static int type1_find_pci_class_code(pci_location_t *state, uint32_t class_code, uint16_t index)
+{
+	struct type1_match m = { class_code, index };
+
+	return type1_scan(type1_match_class, &m, state) ? _PCI_SUCCESSFUL : _PCI_DEVICE_NOT_FOUND;
+}
+
+static int pci_type1_detect(void)
+{
+	/* the address port reads back what was written to it if it's there */
+	outpd(PCI_CONFIG_ADDRESS, 0x80000000);
+	if (inpd(PCI_CONFIG_ADDRESS) != 0x80000000)
+		return -1;
+
+	/* any bridges behind bus 0 were numbered by the firmware, find the highest
+	 * bus that has something on it */
+	for (int bus = 0; bus < 256; bus++) {
+		for (uint dev = 0; dev < 32; dev++) {
+			pci_location_t loc = { .bus = bus, .dev_fn = dev << 3 };
+			uint32_t id;
+
+			type1_read_config_word(&loc, PCI_CONFIG_VENDOR_ID, &id);
+			if ((id & 0xffff) != 0xffff) {
+				last_bus = bus;
+				break;
+			}
+		}
+	}
+
+	g_pci_find_pci_device = type1_find_pci_device;
+	g_pci_find_pci_class_code = type1_find_pci_class_code;
+
+	g_pci_read_config_word = type1_read_config_word;
+	g_pci_read_config_half = type1_read_config_half;
+	g_pci_read_config_byte = type1_read_config_byte;
+
+	g_pci_write_config_word = type1_write_config_word;
+	g_pci_write_config_half = type1_write_config_half;
+	g_pci_write_config_byte = type1_write_config_byte;
+
+	return 0;
+}
+
+#if ARCH_X86
+
 #define PCIBIOS_PRESENT                 0xB101
 #define PCIBIOS_FIND_PCI_DEVICE         0xB102
 #define PCIBIOS_FIND_PCI_CLASS_CODE     0xB103
@@ -588,3 +932,5 @@ static int pci_bios_detect(void)
 
 	return -1;
 }
+
+#endif
@@ -38,7 +38,18 @@
 #include <malloc.h>
 #include <string.h>
 #include <assert.h>
+#include <kernel/mp.h>
 #include <kernel/vm.h>
+#if WITH_SMP
+#include <arch/x86/mp.h>
+#endif
+#if WITH_DEV_VIRTIO
+#include <dev/virtio.h>
+#endif
+#if WITH_DEV_VIRTIO_NET
+#include <dev/virtio/net.h>
+#include <lib/minip.h>
+#endif
 
 extern multiboot_info_t *_multiboot_info;
 
@@ -176,6 +187,10 @@ void mem_arena_init(void)
 void platform_init_multiboot_info(void)
 {
 	if (_multiboot_info) {
+		if (_multiboot_info->flags & MB_INFO_CMD_LINE) {
+			mp_parse_boot_args((const char *)(uintptr_t)_multiboot_info->cmdline);
+		}
+
 		if (_multiboot_info->flags & MB_INFO_MEM_SIZE) {
 			_heap_end = _multiboot_info->mem_upper * 1024;
 		}
@@ -229,14 +244,45 @@ void platform_init(void)
 	uart_init();
 
 	platform_init_keyboard();
-#if defined(ARCH_X86)
 	pci_init();
-#endif
 
 	/* MMU init for x86 Archs done after the heap is setup */
 	// XXX move this into arch/
     arch_mmu_init();
 	platform_init_mmu_mappings();
+
+	/* off the 8259s and pit, now that their replacements can be mapped */
+	platform_init_apic();
+	platform_init_tsc_timer();
+
+#if WITH_SMP
+	/* the pit only ever interrupts cpu 0, the others need their own tsc deadline timer */
+	if (pc_tsc_timer_active())
+		x86_mp_start_secondaries();
+	else
+		dprintf(INFO, "PC: no per cpu timer, leaving the secondary cpus off\n");
+#endif
+
+#if WITH_DEV_VIRTIO
+	/* detect any virtio devices */
+	virtio_pci_detect();
+#endif
+
+#if WITH_DEV_VIRTIO_NET
+	if (virtio_net_found() > 0) {
+		uint8_t mac_addr[6];
+
+		virtio_net_get_mac_addr(mac_addr);
+
+		TRACEF("found virtio networking interface\n");
+
+		/* start minip */
+		minip_set_macaddr(mac_addr);
+		minip_init_dhcp(virtio_net_send_minip_pkt, NULL);
+
+		virtio_net_start();
+	}
+#endif
 }
 
 /* vim: set noexpandtab: */
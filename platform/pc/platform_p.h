@@ -23,9 +23,33 @@
 #ifndef __PLATFORM_P_H
 #define __PLATFORM_P_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+
 void platform_init_interrupts(void);
 void platform_init_timer(void);
 void platform_init_uart(void);
 
+/* switch interrupt delivery from the 8259s over to the local apic and io-apic,
+ * and the timer to the tsc deadline timer if the cpu has one. needs the vm up */
+void platform_init_apic(void);
+void platform_init_tsc_timer(void);
+
+/* timer.c, the tsc deadline timer on a secondary cpu and whether cpu 0 got it */
+void platform_init_tsc_timer_percpu(void);
+bool pc_tsc_timer_active(void);
+
+/* apic.c */
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_timer_tsc_deadline(unsigned int vector);
+status_t ioapic_mask(unsigned int vector, bool mask);
+/* the address and data for an msi of vector on cpu, the boot cpu if that one isn't up */
+status_t pc_msi_message(unsigned int vector, uint cpu, uint64_t *addr, uint32_t *data);
+
+/* interrupts.c, for handing over to the io-apic */
+uint16_t pc_pic_enabled_irqs(void);
+void pc_pic_disable(void);
+
 #endif
 
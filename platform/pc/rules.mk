@@ -4,6 +4,11 @@ MODULE := $(LOCAL_DIR)
 
 CPU := generic
 
+# the kernel timer queue programs one shots, the pit emulates them on its 1ms
+# tick until the tsc deadline timer takes over
+GLOBAL_DEFINES += \
+	PLATFORM_HAS_DYNAMIC_TIMER=1
+
 MODULE_DEPS += \
 	lib/cbuf \
 
@@ -12,24 +17,31 @@ GLOBAL_INCLUDES += \
 
 ifeq ($(ARCH), x86)
 MODULE_SRCS += \
+	$(LOCAL_DIR)/ahci.c \
+	$(LOCAL_DIR)/apic.c \
 	$(LOCAL_DIR)/interrupts.c \
 	$(LOCAL_DIR)/platform.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/console.c \
 	$(LOCAL_DIR)/keyboard.c \
+	$(LOCAL_DIR)/nvme.c \
 	$(LOCAL_DIR)/pci.c \
 	$(LOCAL_DIR)/ide.c \
 	$(LOCAL_DIR)/uart.c \
 
 else
 MODULE_SRCS += \
+        $(LOCAL_DIR)/ahci.c \
+        $(LOCAL_DIR)/apic.c \
         $(LOCAL_DIR)/interrupts.c \
         $(LOCAL_DIR)/platform.c \
         $(LOCAL_DIR)/timer.c \
         $(LOCAL_DIR)/debug.c \
         $(LOCAL_DIR)/console.c \
         $(LOCAL_DIR)/keyboard.c \
+        $(LOCAL_DIR)/nvme.c \
+        $(LOCAL_DIR)/pci.c \
         $(LOCAL_DIR)/uart.c \
 
 endif
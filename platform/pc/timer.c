@@ -26,12 +26,14 @@
 #include <debug.h>
 #include <kernel/thread.h>
 #include <kernel/spinlock.h>
+#include <kernel/vm.h>
 #include <platform.h>
 #include <platform/interrupts.h>
 #include <platform/console.h>
 #include <platform/timer.h>
 #include <platform/pc.h>
 #include "platform_p.h"
+#include <arch/ops.h>
 #include <arch/x86.h>
 
 static platform_timer_callback t_callback;
@@ -47,14 +49,90 @@ static volatile uint64_t timer_current_time;
 
 static uint16_t divisor;
 
+/* until the tsc takes over, one shots are checked against the 1ms pit tick */
+static bool oneshot_armed;
+static lk_bigtime_t oneshot_deadline;
+
+/* tsc timekeeping and the tsc deadline timer, see platform_init_tsc_timer() */
+static bool tsc_active;
+static uint64_t tsc_base;
+static lk_bigtime_t tsc_base_time;
+static uint64_t tsc_hz;
+static uint32_t tsc_us_mult; /* usecs per tick, 0.32 fixed point */
+
+/*
+ * kvm's paravirtual clock. The hypervisor keeps a tsc timestamp, the system
+ * time at it and the tsc to ns scale in a page of ours, bumping version to odd
+ * around each update, so it's read locklessly like a seqcount.
+ */
+struct pvclock_vcpu_time_info {
+	uint32_t version;
+	uint32_t pad0;
+	uint64_t tsc_timestamp;
+	uint64_t system_time;
+	uint32_t tsc_to_system_mul;
+	int8_t tsc_shift;
+	uint8_t flags;
+	uint8_t pad[2];
+} __PACKED;
+
+#define X86_CPUID_HYP_BASE          0x40000000
+#define X86_CPUID_KVM_FEATURES      0x40000001
+#define KVM_FEATURE_CLOCKSOURCE     (1U << 0)
+#define KVM_FEATURE_CLOCKSOURCE2    (1U << 3)
+#define KVM_FEATURE_CLOCKSOURCE_STABLE_BIT (1U << 24)
+#define MSR_KVM_SYSTEM_TIME         0x12
+#define MSR_KVM_SYSTEM_TIME_NEW     0x4b564d01
+#define PVCLOCK_TSC_STABLE_BIT      (1U << 0)
+
+/* the boot cpu's copy, good for every cpu when the tsc is stable across them */
+static volatile struct pvclock_vcpu_time_info kvmclock __ALIGNED(32);
+static bool kvmclock_active;
+static uint64_t kvmclock_base_ns;
+static lk_bigtime_t kvmclock_base_time;
+
 #define INTERNAL_FREQ 1193182ULL
 #define INTERNAL_FREQ_3X 3579546ULL
 
-/* Maximum amount of time that can be program on the timer to schedule the next
- *  interrupt, in miliseconds */
-#define MAX_TIMER_INTERVAL 55
+#define X86_MSR_TSC_DEADLINE 0x6e0
+
+/* how long the tsc is counted against the pit */
+#define TSC_CALIBRATE_USECS 100000
+
+/* deadlines further out than this are cut short, the kernel just reprograms */
+#define TSC_MAX_INTERVAL (3600ULL * 1000000)
+
+static lk_bigtime_t tsc_to_usecs(uint64_t ticks)
+{
+	return (ticks >> 32) * tsc_us_mult + (((ticks & 0xffffffff) * tsc_us_mult) >> 32);
+}
 
+static uint64_t usecs_to_tsc(lk_bigtime_t usecs)
+{
+	return usecs * (tsc_hz / 1000000) + usecs * (tsc_hz % 1000000) / 1000000;
+}
 
+static uint64_t kvmclock_read_ns(void)
+{
+	uint32_t version;
+	uint64_t ns;
+
+	do {
+		version = kvmclock.version;
+		CF;
+		uint64_t delta = x86_rdtsc() - kvmclock.tsc_timestamp;
+		int8_t shift = kvmclock.tsc_shift;
+		if (shift < 0)
+			delta >>= -shift;
+		else
+			delta <<= shift;
+		ns = kvmclock.system_time +
+		     (uint64_t)(((unsigned __int128)delta * kvmclock.tsc_to_system_mul) >> 32);
+		CF;
+	} while ((version & 1) || version != kvmclock.version);
+
+	return ns;
+}
 
 status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
 {
@@ -71,6 +149,9 @@ lk_time_t current_time(void)
 {
 	lk_time_t time;
 
+	if (kvmclock_active || tsc_active)
+		return current_time_hires() / 1000;
+
 	// XXX slight race
 	time = (lk_time_t) (timer_current_time >> 32);
 
@@ -81,6 +162,11 @@ lk_bigtime_t current_time_hires(void)
 {
 	lk_bigtime_t time;
 
+	if (kvmclock_active)
+		return kvmclock_base_time + (kvmclock_read_ns() - kvmclock_base_ns) / 1000;
+	if (tsc_active)
+		return tsc_base_time + tsc_to_usecs(x86_rdtsc() - tsc_base);
+
 	// XXX slight race
 	time = (lk_bigtime_t) ((timer_current_time >> 22) * 1000) >> 10;
 
@@ -97,7 +183,15 @@ static enum handler_return os_timer_tick(void *arg)
 	//printf_xy(71, 0, WHITE, "%08u", (uint32_t) time);
 	//printf_xy(63, 1, WHITE, "%016llu", (uint64_t) btime);
 
-	if (t_callback && timer_current_time >= next_trigger_time) {
+	if (oneshot_armed) {
+		if (t_callback && current_time_hires() >= oneshot_deadline) {
+			oneshot_armed = false;
+			return t_callback(callback_arg, time);
+		}
+		return INT_NO_RESCHEDULE;
+	}
+
+	if (t_callback && next_trigger_delta && timer_current_time >= next_trigger_time) {
 		delta = timer_current_time - next_trigger_time;
 		next_trigger_time = timer_current_time + next_trigger_delta - delta;
 
@@ -107,6 +201,14 @@ static enum handler_return os_timer_tick(void *arg)
 	}
 }
 
+static enum handler_return tsc_deadline_tick(void *arg)
+{
+	if (!t_callback)
+		return INT_NO_RESCHEDULE;
+
+	return t_callback(callback_arg, current_time());
+}
+
 static void set_pit_frequency(uint32_t frequency)
 {
 	uint32_t count, remainder;
@@ -152,6 +254,12 @@ static void set_pit_frequency(uint32_t frequency)
 	outp(I8253_DATA_REG, divisor >> 8); // MSB
 }
 
+/* Enable interrupt mode that will stop the decreasing counter of the PIT */
+static void platform_stop_pit(void)
+{
+	outp(I8253_CONTROL_REG, 0x30);
+}
+
 void platform_init_timer(void)
 {
 
@@ -162,52 +270,202 @@ void platform_init_timer(void)
 	unmask_interrupt(INT_PIT);
 }
 
-void platform_halt_timers(void)
+/* switch timekeeping over to kvmclock if we're a kvm guest that has it.
+ * returns the tsc frequency the hypervisor reports, or 0.
+ */
+static uint64_t kvmclock_init(void)
 {
-	mask_interrupt(INT_PIT);
+	uint32_t a, b, c, d;
+
+	x86_cpuid(1, &a, &b, &c, &d);
+	if (!(c & (1U << 31))) /* hypervisor present */
+		return 0;
+
+	x86_cpuid(X86_CPUID_HYP_BASE, &a, &b, &c, &d);
+	if (b != 0x4b4d564b || c != 0x564b4d56 || d != 0x4d) /* "KVMKVMKVM\0\0\0" */
+		return 0;
+
+	uint32_t msr;
+	x86_cpuid(X86_CPUID_KVM_FEATURES, &a, &b, &c, &d);
+	if (a & KVM_FEATURE_CLOCKSOURCE2)
+		msr = MSR_KVM_SYSTEM_TIME_NEW;
+	else if (a & KVM_FEATURE_CLOCKSOURCE)
+		msr = MSR_KVM_SYSTEM_TIME;
+	else
+		return 0;
+	bool stable = a & KVM_FEATURE_CLOCKSOURCE_STABLE_BIT;
+
+	/* bit 0 turns the updates on */
+	write_msr(msr, kvaddr_to_paddr((void *)&kvmclock) | 1);
+
+#if WITH_SMP
+	/* without a stable tsc every cpu would need its own copy, read with
+	 * preemption off. not worth it, tsc or pit timekeeping will do */
+	if (!stable || !(kvmclock.flags & PVCLOCK_TSC_STABLE_BIT)) {
+		write_msr(msr, 0);
+		dprintf(INFO, "PC: kvmclock without a stable tsc, not using it\n");
+		return 0;
+	}
+#else
+	(void)stable;
+#endif
+	if (kvmclock.tsc_to_system_mul == 0) {
+		write_msr(msr, 0);
+		return 0;
+	}
+
+	/* ns per tick is mul / 2^32, scaled by 2^shift */
+	uint64_t hz = (1000000000ULL << 32) / kvmclock.tsc_to_system_mul;
+	if (kvmclock.tsc_shift < 0)
+		hz <<= -kvmclock.tsc_shift;
+	else
+		hz >>= kvmclock.tsc_shift;
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&lock, state);
+
+	/* carry on from the pit's time so it never goes backwards */
+	kvmclock_base_time = current_time_hires();
+	kvmclock_base_ns = kvmclock_read_ns();
+	kvmclock_active = true;
+
+	spin_unlock_irqrestore(&lock, state);
+
+	dprintf(INFO, "PC: kvmclock, tsc at %llu khz\n", hz / 1000);
+
+	return hz;
 }
 
+void platform_init_tsc_timer(void)
+{
+	uint32_t a, b, c, d;
 
+	uint64_t kvm_tsc_hz = kvmclock_init();
 
-status_t platform_set_oneshot_timer(platform_timer_callback callback,
-		                    void *arg, lk_time_t interval)
+	if (!pc_apic_active())
+		return;
+
+	/* the deadline timer, and a tsc that ticks at the same rate through p and c states */
+	x86_cpuid(1, &a, &b, &c, &d);
+	bool deadline = c & (1U << 24);
+	x86_cpuid(0x80000000, &a, &b, &c, &d);
+	bool invariant = false;
+	if (a >= 0x80000007) {
+		x86_cpuid(0x80000007, &a, &b, &c, &d);
+		invariant = d & (1U << 8);
+	}
+	/* kvm doesn't advertise an invariant tsc, but a stable kvmclock vouches for it */
+	if (!deadline || (!invariant && !kvm_tsc_hz)) {
+		dprintf(INFO, "PC: no tsc deadline timer or invariant tsc, staying on the pit\n");
+		return;
+	}
+
+	if (kvm_tsc_hz) {
+		/* no need to count it, the hypervisor said */
+		tsc_hz = kvm_tsc_hz;
+	} else {
+		/* count the tsc across pit ticks, starting and ending right on one */
+		DEBUG_ASSERT(!arch_ints_disabled());
+		lk_bigtime_t t = current_time_hires();
+		while (current_time_hires() == t)
+			;
+		uint64_t tsc0 = x86_rdtsc();
+		lk_bigtime_t t0 = current_time_hires();
+		while (current_time_hires() < t0 + TSC_CALIBRATE_USECS)
+			;
+		uint64_t tsc1 = x86_rdtsc();
+		lk_bigtime_t t1 = current_time_hires();
+
+		tsc_hz = (tsc1 - tsc0) * 1000000 / (t1 - t0);
+	}
+	if (tsc_hz < 1000000) {
+		dprintf(INFO, "PC: tsc calibrated to %llu hz, staying on the pit\n", tsc_hz);
+		return;
+	}
+	tsc_us_mult = (1000000ULL << 32) / tsc_hz;
+
+	register_int_handler(INT_APIC_TIMER, &tsc_deadline_tick, NULL);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&lock, state);
+
+	lapic_timer_tsc_deadline(INT_APIC_TIMER);
+
+	/* carry on from the pit's time so it never goes backwards */
+	lk_bigtime_t now = current_time_hires();
+	tsc_base = x86_rdtsc();
+	tsc_base_time = now;
+	tsc_active = true;
+
+	mask_interrupt(INT_PIT);
+	platform_stop_pit();
+
+	if (oneshot_armed) {
+		oneshot_armed = false;
+		lk_bigtime_t interval = (oneshot_deadline > now) ? oneshot_deadline - now : 0;
+		write_msr(X86_MSR_TSC_DEADLINE, tsc_base + usecs_to_tsc(interval));
+	}
+
+	spin_unlock_irqrestore(&lock, state);
+
+	dprintf(INFO, "PC: tsc deadline timer, tsc at %llu khz\n", tsc_hz / 1000);
+}
+
+void platform_init_tsc_timer_percpu(void)
 {
+	/* the msr is per cpu, the tsc and the interrupt handler are shared */
+	if (tsc_active)
+		lapic_timer_tsc_deadline(INT_APIC_TIMER);
+}
 
-    uint32_t count;
+bool pc_tsc_timer_active(void)
+{
+	return tsc_active;
+}
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&lock, state);
+void platform_halt_timers(void)
+{
+	if (tsc_active)
+		write_msr(X86_MSR_TSC_DEADLINE, 0);
+	mask_interrupt(INT_PIT);
+}
 
-    t_callback = callback;
-    callback_arg = arg;
+status_t platform_set_oneshot_timer(platform_timer_callback callback,
+		                    void *arg, lk_time_t interval)
+{
+	return platform_set_oneshot_timer_hires(callback, arg, (lk_bigtime_t)interval * 1000);
+}
 
-    
-    if (interval > MAX_TIMER_INTERVAL)
-	    interval = MAX_TIMER_INTERVAL;
-    if (interval < 1) interval = 1;
+status_t platform_set_oneshot_timer_hires(platform_timer_callback callback,
+                                          void *arg, lk_bigtime_t interval)
+{
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&lock, state);
 
-    count = ticks_per_ms * interval;
-    
-    divisor = count & 0xffff;
-    timer_delta_time = (3685982306ULL * count) >> 10;
-/* Program PIT in teh software strobe configuration, to send one pulse
- * after the count reach 0 */
-    outp(I8253_CONTROL_REG, 0x38);
-    outp(I8253_DATA_REG, divisor & 0xff); // LSB
-    outp(I8253_DATA_REG, divisor >> 8); // MSB
+	t_callback = callback;
+	callback_arg = arg;
+	next_trigger_delta = 0;
 
+	if (tsc_active) {
+		if (interval > TSC_MAX_INTERVAL)
+			interval = TSC_MAX_INTERVAL;
+		/* a deadline already in the past fires right away */
+		write_msr(X86_MSR_TSC_DEADLINE, x86_rdtsc() + usecs_to_tsc(interval));
+	} else {
+		oneshot_deadline = current_time_hires() + interval;
+		oneshot_armed = true;
+	}
 
-    unmask_interrupt(INT_PIT);
-    spin_unlock_irqrestore(&lock, state);
+	spin_unlock_irqrestore(&lock, state);
 
-    return NO_ERROR;
+	return NO_ERROR;
 }
 
 void platform_stop_timer(void)
 {
-/* Enable interrupt mode that will stop the decreasing counter of the PIT */ 
-    outp(I8253_CONTROL_REG, 0x30);
-    return;
+	oneshot_armed = false;
+	if (tsc_active)
+		write_msr(X86_MSR_TSC_DEADLINE, 0);
 }
 
 /* vim: set noexpandtab */
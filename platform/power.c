@@ -54,15 +54,28 @@ __WEAK void platform_halt(platform_halt_action suggested_action,
 #if WITH_LIB_CONSOLE
 
 #include <lib/console.h>
+#if WITH_LIB_BIO
+#include <lib/bio.h>
+#endif
+
+/* let anything caching writes get them out before the power goes */
+static void sync_storage(void)
+{
+#if WITH_LIB_BIO
+    bio_sync_all();
+#endif
+}
 
 static int cmd_reboot(int argc, const cmd_args *argv)
 {
+    sync_storage();
     platform_halt(HALT_ACTION_REBOOT, HALT_REASON_SW_RESET);
     return 0;
 }
 
 static int cmd_poweroff(int argc, const cmd_args *argv)
 {
+    sync_storage();
     platform_halt(HALT_ACTION_SHUTDOWN, HALT_REASON_SW_RESET);
     return 0;
 }
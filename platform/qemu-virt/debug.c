@@ -25,6 +25,9 @@
 #include <stdio.h>
 #include <kernel/thread.h>
 #include <dev/uart.h>
+#if WITH_DEV_VIRTIO_CONSOLE
+#include <dev/virtio/console.h>
+#endif
 #include <platform/debug.h>
 #include <platform/qemu-virt.h>
 #include <target/debugconfig.h>
@@ -46,8 +49,23 @@ void platform_dputc(char c)
     uart_putc(DEBUG_UART, c);
 }
 
+void platform_dputs(const char *str, size_t len)
+{
+#if WITH_DEV_VIRTIO_CONSOLE
+    /* its print callback already has it, the uart would only hold things up */
+    if (virtio_console_active())
+        return;
+#endif
+    for (size_t i = 0; i < len; i++)
+        platform_dputc(str[i]);
+}
+
 int platform_dgetc(char *c, bool wait)
 {
+#if WITH_DEV_VIRTIO_CONSOLE
+    if (virtio_console_active())
+        return virtio_console_getc(c, wait);
+#endif
     int ret = uart_getc(DEBUG_UART, wait);
     if (ret == -1)
         return -1;
@@ -27,4 +27,5 @@
 #define GICBASE(n)  (CPUPRIV_BASE_VIRT)
 #define GICD_OFFSET (0x00000)
 #define GICC_OFFSET (0x10000)
+#define GICR_OFFSET (0xa0000)
 
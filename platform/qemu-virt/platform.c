@@ -24,19 +24,27 @@
 #include <err.h>
 #include <debug.h>
 #include <trace.h>
+#if WITH_DEV_INTERRUPT_ARM_GICV3
+#include <dev/interrupt/arm_gicv3.h>
+#else
 #include <dev/interrupt/arm_gic.h>
+#endif
 #include <dev/timer/arm_generic.h>
 #include <dev/uart.h>
 #include <dev/virtio.h>
 #include <dev/virtio/net.h>
 #include <lk/init.h>
 #include <kernel/vm.h>
+#include <kernel/mp.h>
 #include <kernel/spinlock.h>
 #include <platform.h>
 #include <platform/gic.h>
 #include <platform/interrupts.h>
 #include <platform/qemu-virt.h>
 #include <libfdt.h>
+#if WITH_DEV_POWER_PSCI
+#include <dev/power/psci.h>
+#endif
 #include "platform_p.h"
 
 #if WITH_LIB_MINIP
@@ -79,7 +87,11 @@ static pmm_arena_t arena = {
 void platform_early_init(void)
 {
     /* initialize the interrupt controller */
+#if WITH_DEV_INTERRUPT_ARM_GICV3
+    arm_gicv3_init();
+#else
     arm_gic_init();
+#endif
 
     arm_generic_timer_init(ARM_GENERIC_TIMER_PHYSICAL_INT, 0);
 
@@ -122,6 +134,10 @@ void platform_early_init(void)
                     /* set the size in the pmm arena */
                     arena.size = len;
                 }
+            } else if (strcmp(name, "chosen") == 0) {
+                const char *bootargs = fdt_getprop(fdt, offset, "bootargs", NULL);
+                if (bootargs)
+                    mp_parse_boot_args(bootargs);
             }
         }
     }
@@ -134,6 +150,25 @@ void platform_early_init(void)
     pmm_alloc_range(MEMBASE, 0x10000 / PAGE_SIZE, &list);
 }
 
+#if WITH_SMP && WITH_DEV_POWER_PSCI
+/* qemu holds the secondaries powered off until they're asked for with psci */
+status_t arm64_platform_cpu_on(ulong mpidr, paddr_t entry)
+{
+    int ret = psci_cpu_on(mpidr, entry, 0);
+
+    switch (ret) {
+        case PSCI_SUCCESS:
+        case PSCI_ALREADY_ON:
+        case PSCI_ON_PENDING:
+            return NO_ERROR;
+        case PSCI_NOT_SUPPORTED:
+            return ERR_NOT_SUPPORTED;
+        default:
+            return ERR_NOT_FOUND;
+    }
+}
+#endif
+
 void platform_init(void)
 {
     uart_init();
@@ -146,6 +181,11 @@ void platform_init(void)
 
     virtio_mmio_detect((void *)VIRTIO_BASE, NUM_VIRTIO_TRANSPORTS, virtio_irqs);
 
+#if WITH_DEV_POWER_PSCI && WITH_KERNEL_CPUIDLE
+    /* the fdt is still sitting in the reserved first 64k */
+    psci_cpuidle_init((const void *)KERNEL_BASE);
+#endif
+
 #if WITH_LIB_MINIP
     if (virtio_net_found() > 0) {
         uint8_t mac_addr[6];
@@ -13,6 +13,26 @@ ARM_CPU ?= cortex-a15
 endif
 WITH_SMP ?= 1
 
+# 2 or 3, pass the matching -machine virt,gic-version= to qemu
+GIC_VERSION ?= 2
+
+ifeq ($(GIC_VERSION),3)
+ifneq ($(ARCH),arm64)
+$(error gicv3 is only supported on arm64)
+endif
+# qemu puts 16 cpus in each aff1 cluster with a gicv3
+SMP_CPU_CLUSTER_SHIFT := 4
+GIC_MODULE := dev/interrupt/arm_gicv3
+else
+GIC_MODULE := dev/interrupt/arm_gic
+endif
+
+# qemu implements psci itself and takes calls over hvc unless it's running el3 firmware
+ifeq ($(ARCH),arm64)
+PSCI_USE_HVC ?= 1
+MODULE_DEPS += dev/power/psci
+endif
+
 GLOBAL_INCLUDES += \
     $(LOCAL_DIR)/include
 
@@ -28,9 +48,10 @@ KERNEL_LOAD_OFFSET := 0x10000 # 64k
 MODULE_DEPS += \
     lib/cbuf \
     lib/fdt \
-    dev/interrupt/arm_gic \
+    $(GIC_MODULE) \
     dev/timer/arm_generic \
     dev/virtio/block \
+    dev/virtio/console \
     dev/virtio/gpu \
     dev/virtio/net \
 
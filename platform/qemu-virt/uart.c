@@ -97,7 +97,8 @@ void uart_init(void)
         uintptr_t base = uart_to_ptr(i);
 
         // create circular buffer to hold received data
-        cbuf_initialize(&uart_rx_buf[i], RXBUF_SIZE);
+        // filled by the irq handler and drained by the console, nobody else
+        cbuf_initialize_flags(&uart_rx_buf[i], RXBUF_SIZE, NULL, CBUF_FLAG_SPSC);
 
         // assumes interrupts are contiguous
         register_int_handler(UART0_INT + i, &uart_irq, (void *)i);
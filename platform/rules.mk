@@ -6,6 +6,7 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/init.c \
+	$(LOCAL_DIR)/interrupts.c \
 	$(LOCAL_DIR)/power.c
 
 include make/module.mk
@@ -24,6 +24,7 @@
 #include <reg.h>
 #include <debug.h>
 #include <stdio.h>
+#include <string.h>
 #include <kernel/thread.h>
 #include <platform/debug.h>
 #include <arch/ops.h>
@@ -43,11 +44,32 @@ void stm32_debug_init(void)
 	uart_init();
 }
 
+void platform_dputs(const char *str, size_t len)
+{
+	/* queue the string a line at a time, with a \r in front of each \n */
+	while (len > 0) {
+		const char *nl = memchr(str, '\n', len);
+		size_t run = nl ? (size_t)(nl - str) : len;
+
+		if (run > 0)
+			stm32_uart_write(DEBUG_UART, str, run);
+		if (!nl)
+			break;
+
+		stm32_uart_write(DEBUG_UART, "\r\n", 2);
+		str += run + 1;
+		len -= run + 1;
+	}
+}
+
 void platform_dputc(char c)
 {
-	if (c == '\n')
-		uart_putc(DEBUG_UART, '\r');
-	uart_putc(DEBUG_UART, c);
+	platform_dputs(&c, 1);
+}
+
+void platform_panic_start(void)
+{
+	stm32_uart_panic_start(DEBUG_UART);
 }
 
 int platform_dgetc(char *c, bool wait)
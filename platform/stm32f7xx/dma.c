@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <assert.h>
+#include <arch/arm/cm.h>
+#include <platform/dma.h>
+#include <platform/stm32.h>
+
+#define NUM_STREAMS 16
+
+static const struct {
+    DMA_Stream_TypeDef *regs;
+    IRQn_Type irq;
+} streams[NUM_STREAMS] = {
+    { DMA1_Stream0, DMA1_Stream0_IRQn },
+    { DMA1_Stream1, DMA1_Stream1_IRQn },
+    { DMA1_Stream2, DMA1_Stream2_IRQn },
+    { DMA1_Stream3, DMA1_Stream3_IRQn },
+    { DMA1_Stream4, DMA1_Stream4_IRQn },
+    { DMA1_Stream5, DMA1_Stream5_IRQn },
+    { DMA1_Stream6, DMA1_Stream6_IRQn },
+    { DMA1_Stream7, DMA1_Stream7_IRQn },
+    { DMA2_Stream0, DMA2_Stream0_IRQn },
+    { DMA2_Stream1, DMA2_Stream1_IRQn },
+    { DMA2_Stream2, DMA2_Stream2_IRQn },
+    { DMA2_Stream3, DMA2_Stream3_IRQn },
+    { DMA2_Stream4, DMA2_Stream4_IRQn },
+    { DMA2_Stream5, DMA2_Stream5_IRQn },
+    { DMA2_Stream6, DMA2_Stream6_IRQn },
+    { DMA2_Stream7, DMA2_Stream7_IRQn },
+};
+
+/* the handle each stream's interrupt is passed to */
+static DMA_HandleTypeDef *stream_handles[NUM_STREAMS];
+
+status_t stm32_dma_stream_init(DMA_HandleTypeDef *hdma, DMA_Stream_TypeDef *stream,
+                               uint32_t channel, uint32_t direction)
+{
+    uint index;
+    for (index = 0; index < NUM_STREAMS; index++) {
+        if (streams[index].regs == stream)
+            break;
+    }
+    if (index == NUM_STREAMS)
+        return ERR_INVALID_ARGS;
+
+    if (stream_handles[index] && stream_handles[index] != hdma)
+        return ERR_ALREADY_EXISTS;
+
+    if (index < 8) {
+        __HAL_RCC_DMA1_CLK_ENABLE();
+    } else {
+        __HAL_RCC_DMA2_CLK_ENABLE();
+    }
+
+    hdma->Instance                 = stream;
+    hdma->Init.Channel             = channel;
+    hdma->Init.Direction           = direction;
+    hdma->Init.PeriphInc           = DMA_PINC_DISABLE;
+    hdma->Init.MemInc              = DMA_MINC_ENABLE;
+    hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma->Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+    hdma->Init.Mode                = DMA_NORMAL;
+    hdma->Init.Priority            = DMA_PRIORITY_MEDIUM;
+    hdma->Init.FIFOMode            = DMA_FIFOMODE_DISABLE;
+    hdma->Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL;
+    hdma->Init.MemBurst            = DMA_MBURST_SINGLE;
+    hdma->Init.PeriphBurst         = DMA_PBURST_SINGLE;
+
+    HAL_StatusTypeDef status = HAL_DMA_Init(hdma);
+    if (status != HAL_OK)
+        return hal_error_to_status(status);
+
+    stream_handles[index] = hdma;
+
+    HAL_NVIC_EnableIRQ(streams[index].irq);
+
+    return NO_ERROR;
+}
+
+static void stm32_dma_irq(uint index)
+{
+    arm_cm_irq_entry();
+
+    DMA_HandleTypeDef *hdma = stream_handles[index];
+    if (hdma)
+        HAL_DMA_IRQHandler(hdma);
+
+    arm_cm_irq_exit(true);
+}
+
+#define DMA_STREAM_IRQ(dma, stream, index) \
+void stm32_DMA##dma##_Stream##stream##_IRQ(void) \
+{ \
+    stm32_dma_irq(index); \
+}
+
+DMA_STREAM_IRQ(1, 0, 0)
+DMA_STREAM_IRQ(1, 1, 1)
+DMA_STREAM_IRQ(1, 2, 2)
+DMA_STREAM_IRQ(1, 3, 3)
+DMA_STREAM_IRQ(1, 4, 4)
+DMA_STREAM_IRQ(1, 5, 5)
+DMA_STREAM_IRQ(1, 6, 6)
+DMA_STREAM_IRQ(1, 7, 7)
+DMA_STREAM_IRQ(2, 0, 8)
+DMA_STREAM_IRQ(2, 1, 9)
+DMA_STREAM_IRQ(2, 2, 10)
+DMA_STREAM_IRQ(2, 3, 11)
+DMA_STREAM_IRQ(2, 4, 12)
+DMA_STREAM_IRQ(2, 5, 13)
+DMA_STREAM_IRQ(2, 6, 14)
+DMA_STREAM_IRQ(2, 7, 15)
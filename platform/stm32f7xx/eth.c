@@ -61,6 +61,7 @@
 #include <dev/display.h>
 #include <kernel/event.h>
 #include <kernel/thread.h>
+#include <lib/netpoll.h>
 #include <arch/ops.h>
 #include <arch/arm/cm.h>
 #include <platform.h>
@@ -79,25 +80,44 @@
 /* DP83848 PHY Address*/
 #define DP83848_PHY_ADDRESS             0x01
 
+#if WITH_LIB_MINIP
+/* rx descriptors, each pointing straight at the buffer of a pktbuf */
+#define ETH_RX_RING_SIZE                16
+#endif
+
 struct eth_status {
     ETH_HandleTypeDef EthHandle;
 
     eth_phy_itf eth_phy;
-    event_t rx_event;
+    netpoll_t rx_poll;
 
     /* allocated directly out of DTCM below */
+#if WITH_LIB_MINIP
+    ETH_DMADescTypeDef  *DMARxDscrTab;  // ETH_RX_RING_SIZE
+#else
     ETH_DMADescTypeDef  *DMARxDscrTab;  // ETH_RXBUFNB
-    ETH_DMADescTypeDef  *DMATxDscrTab;  // ETH_TXBUFNB
     uint8_t             *Rx_Buff;       // ETH_RXBUFNB * ETH_RX_BUF_SIZE
+#endif
+    ETH_DMADescTypeDef  *DMATxDscrTab;  // ETH_TXBUFNB
     uint8_t             *Tx_Buff;       // ETH_TXBUFNB * ETH_TX_BUF_SIZE
+
+#if WITH_LIB_MINIP
+    /* the descriptors from rx_tail up to rx_head have no buffer */
+    pktbuf_t            *rx_pbufs[ETH_RX_RING_SIZE];
+    uint                rx_head;        // next descriptor the dma completes
+    uint                rx_tail;        // next descriptor to get a buffer
+    uint                rx_empty;       // descriptors without a buffer
+#endif
 };
 
 static struct eth_status eth;
 
-static int eth_rx_worker(void *arg);
+static int eth_rx_poll(void *arg, int budget);
+static bool eth_rx_poll_done(void *arg);
 
 #if WITH_LIB_MINIP
 static int eth_send_raw_pkt(pktbuf_t *p);
+static void eth_rx_ring_init(void);
 #endif
 
 status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
@@ -138,18 +158,30 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
     eth.DMATxDscrTab = (void *)tcm_ptr;
     tcm_ptr += sizeof(*eth.DMATxDscrTab) * ETH_TXBUFNB;
     eth.DMARxDscrTab = (void *)tcm_ptr;
+#if WITH_LIB_MINIP
+    tcm_ptr += sizeof(*eth.DMARxDscrTab) * ETH_RX_RING_SIZE;
+#else
     tcm_ptr += sizeof(*eth.DMARxDscrTab) * ETH_RXBUFNB;
+#endif
 
     eth.Tx_Buff = (void *)tcm_ptr;
     tcm_ptr += ETH_TX_BUF_SIZE * ETH_TXBUFNB;
+#if !WITH_LIB_MINIP
     eth.Rx_Buff = (void *)tcm_ptr;
     tcm_ptr += ETH_RX_BUF_SIZE * ETH_RXBUFNB;
+#endif
 
     /* Initialize Tx Descriptors list: Chain Mode */
     HAL_ETH_DMATxDescListInit(&eth.EthHandle, eth.DMATxDscrTab, eth.Tx_Buff, ETH_TXBUFNB);
 
+#if WITH_LIB_MINIP
+    /* rx goes straight into pktbufs, which the stack may hang on to */
+    eth_rx_ring_init();
+    minip_set_offload(MINIP_OFFLOAD_RX_KEEP);
+#else
     /* Initialize Rx Descriptors list: Chain Mode  */
     HAL_ETH_DMARxDescListInit(&eth.EthHandle, eth.DMARxDscrTab, eth.Rx_Buff, ETH_RXBUFNB);
+#endif
 
     /* Enable MAC and DMA transmission and reception */
     HAL_ETH_Start(&eth.EthHandle);
@@ -175,11 +207,10 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
     HAL_ETH_WritePHYRegister(&eth.EthHandle, PHY_MISR, regvalue);
 #endif
 
-    /* set up an event to block the rx thread on */
-    event_init(&eth.rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-
-    /* start worker thread */
-    thread_resume(thread_create("eth_rx", &eth_rx_worker, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+    /* start the rx poll thread */
+    if (netpoll_init(&eth.rx_poll, "eth_rx", &eth_rx_poll, &eth_rx_poll_done, NULL, 0, HIGH_PRIORITY) < 0)
+        return ERR_NO_MEMORY;
+    netpoll_start(&eth.rx_poll);
 
     /* enable interrupts */
     HAL_NVIC_EnableIRQ(ETH_IRQn);
@@ -189,7 +220,7 @@ status_t eth_init(const uint8_t *mac_addr, eth_phy_itf eth_phy)
     return NO_ERROR;
 }
 
-void stm32_ETH_IRQ(void)
+void __HOT_TEXT stm32_ETH_IRQ(void)
 {
     arm_cm_irq_entry();
 
@@ -205,7 +236,9 @@ void stm32_ETH_IRQ(void)
   */
 void HAL_ETH_RxCpltCallback(ETH_HandleTypeDef *heth)
 {
-    event_signal(&eth.rx_event, false);
+    /* masked until the poll thread has emptied the ring */
+    __HAL_ETH_DMA_DISABLE_IT(heth, ETH_DMA_IT_R);
+    netpoll_schedule(&eth.rx_poll);
 }
 
 static status_t eth_send(const void *buf, size_t len)
@@ -244,85 +277,211 @@ error:
     return err;
 }
 
-static int eth_rx_worker(void *arg)
-{
-    for (;;) {
 #if 0
-        status_t event_err = event_wait_timeout(&eth.rx_event, 1000);
-        if (event_err == ERR_TIMED_OUT) {
-            /* periodically poll the phys status register */
-            /* XXX specific to DP83848 */
-            uint32_t val;
-
-            /* Read PHY_MISR */
-            /* seems to take about 30 usecs */
-            HAL_ETH_ReadPHYRegister(&eth.EthHandle, PHY_MISR, &val);
-
-            /* Check whether the link interrupt has occurred or not */
-            if (val & PHY_LINK_INTERRUPT) {
-                /* Read PHY_SR*/
-                HAL_ETH_ReadPHYRegister(&eth.EthHandle, PHY_SR, &val);
-
-                /* Check whether the link is up or down*/
-                if (val & PHY_LINK_STATUS) {
-                    printf("eth: link up\n");
-                    //netif_set_link_up(link_arg->netif);
-                } else {
-                    printf("eth: link down\n");
-                    //netif_set_link_down(link_arg->netif);
-                }
-            }
+/* periodically poll the phys status register */
+/* XXX specific to DP83848 */
+static void eth_check_link(void)
+{
+    uint32_t val;
+
+    /* Read PHY_MISR */
+    /* seems to take about 30 usecs */
+    HAL_ETH_ReadPHYRegister(&eth.EthHandle, PHY_MISR, &val);
+
+    /* Check whether the link interrupt has occurred or not */
+    if (val & PHY_LINK_INTERRUPT) {
+        /* Read PHY_SR*/
+        HAL_ETH_ReadPHYRegister(&eth.EthHandle, PHY_SR, &val);
+
+        /* Check whether the link is up or down*/
+        if (val & PHY_LINK_STATUS) {
+            printf("eth: link up\n");
+            //netif_set_link_up(link_arg->netif);
         } else {
-#else
-        status_t event_err = event_wait(&eth.rx_event);
-        if (event_err >= NO_ERROR) {
+            printf("eth: link down\n");
+            //netif_set_link_down(link_arg->netif);
+        }
+    }
+}
 #endif
-            // XXX probably race with the event here
-            while (HAL_ETH_GetReceivedFrame_IT(&eth.EthHandle) == HAL_OK) {
-                LTRACEF("got packet len %u, buffer %p, seg count %u\n", eth.EthHandle.RxFrameInfos.length,
-                        (void *)eth.EthHandle.RxFrameInfos.buffer,
-                        eth.EthHandle.RxFrameInfos.SegCount);
 
 #if WITH_LIB_MINIP
-                /* allocate a pktbuf header, point it at our rx buffer, and pass up the stack */
-                pktbuf_t *p = pktbuf_alloc_empty();
-                if (p) {
-                    pktbuf_add_buffer(p, (void *)eth.EthHandle.RxFrameInfos.buffer, eth.EthHandle.RxFrameInfos.length,
-                            0, 0, NULL, NULL);
-                    p->dlen = eth.EthHandle.RxFrameInfos.length;
 
-                    minip_rx_driver_callback(p);
+/* put p on the next empty descriptor and give it to the dma */
+static void eth_rx_queue_pbuf(pktbuf_t *p)
+{
+    DEBUG_ASSERT(eth.rx_empty > 0);
 
-                    pktbuf_free(p, true);
-                }
-#endif
+    ETH_DMADescTypeDef *desc = &eth.DMARxDscrTab[eth.rx_tail];
+
+    /* no dirty line may be written back over the frame once the dma owns it */
+    p->data = p->buffer;
+    p->dlen = 0;
+    arch_clean_invalidate_cache_range((addr_t)p->buffer, ETH_RX_BUF_SIZE);
+
+    eth.rx_pbufs[eth.rx_tail] = p;
+    desc->Buffer1Addr = (uint32_t)p->buffer;
+
+    /* the buffer address has to land before the own bit does */
+    __DMB();
+    desc->Status = ETH_DMARXDESC_OWN;
+
+    eth.rx_tail = (eth.rx_tail + 1) % ETH_RX_RING_SIZE;
+    eth.rx_empty--;
+}
+
+/* fill every empty descriptor in one go and kick the dma if it ran dry */
+static void eth_rx_refill(void)
+{
+    while (eth.rx_empty > 0) {
+        pktbuf_t *p = pktbuf_alloc();
+        if (!p)
+            break;
+
+        eth_rx_queue_pbuf(p);
+    }
+
+    if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t)RESET) {
+        /* Clear RBUS ETHERNET DMA flag */
+        eth.EthHandle.Instance->DMASR = ETH_DMASR_RBUS;
+        /* Resume DMA reception */
+        eth.EthHandle.Instance->DMARPDR = 0;
+    }
+}
+
+/* build the rx ring in place of HAL_ETH_DMARxDescListInit, before the dma is started */
+static void eth_rx_ring_init(void)
+{
+    for (uint i = 0; i < ETH_RX_RING_SIZE; i++) {
+        ETH_DMADescTypeDef *desc = &eth.DMARxDscrTab[i];
+
+        desc->Status = 0;
+        desc->ControlBufferSize = ETH_DMARXDESC_RCH | ETH_RX_BUF_SIZE;
+        desc->Buffer1Addr = 0;
+        desc->Buffer2NextDescAddr = (uint32_t)&eth.DMARxDscrTab[(i + 1) % ETH_RX_RING_SIZE];
+        eth.rx_pbufs[i] = NULL;
+    }
+
+    eth.rx_head = 0;
+    eth.rx_tail = 0;
+    eth.rx_empty = ETH_RX_RING_SIZE;
+    eth_rx_refill();
+
+    eth.EthHandle.RxDesc = eth.DMARxDscrTab;
+    eth.EthHandle.Instance->DMARDLAR = (uint32_t)eth.DMARxDscrTab;
+}
+
+static bool eth_rx_pending(void)
+{
+    if (eth.rx_empty == ETH_RX_RING_SIZE)
+        return false;
+
+    return (eth.DMARxDscrTab[eth.rx_head].Status & ETH_DMARXDESC_OWN) == 0;
+}
+
+/* hand up to budget received frames to the stack */
+static int eth_rx_poll(void *arg, int budget)
+{
+    int count = 0;
 
-                /* Release descriptors to DMA */
-                /* Point to first descriptor */
-                __IO ETH_DMADescTypeDef *dmarxdesc;
-
-                dmarxdesc = eth.EthHandle.RxFrameInfos.FSRxDesc;
-                /* Set Own bit in Rx descriptors: gives the buffers back to DMA */
-                for (uint i=0; i< eth.EthHandle.RxFrameInfos.SegCount; i++) {
-                    dmarxdesc->Status |= ETH_DMARXDESC_OWN;
-                    dmarxdesc = (ETH_DMADescTypeDef *)(dmarxdesc->Buffer2NextDescAddr);
-                }
-
-                /* Clear Segment_Count */
-                eth.EthHandle.RxFrameInfos.SegCount =0;
-
-                /* When Rx Buffer unavailable flag is set: clear it and resume reception */
-                if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t)RESET) {
-                    /* Clear RBUS ETHERNET DMA flag */
-                    eth.EthHandle.Instance->DMASR = ETH_DMASR_RBUS;
-                    /* Resume DMA reception */
-                    eth.EthHandle.Instance->DMARPDR = 0;
-                }
-            }
+    while (count < budget && eth_rx_pending()) {
+        uint32_t status = eth.DMARxDscrTab[eth.rx_head].Status;
+        pktbuf_t *p = eth.rx_pbufs[eth.rx_head];
+
+        eth.rx_pbufs[eth.rx_head] = NULL;
+        eth.rx_head = (eth.rx_head + 1) % ETH_RX_RING_SIZE;
+        eth.rx_empty++;
+        count++;
+
+        /* a buffer holds a whole frame, anything spread over several is junk */
+        const uint32_t whole = ETH_DMARXDESC_FS | ETH_DMARXDESC_LS;
+        if ((status & (whole | ETH_DMARXDESC_ES)) == whole) {
+            /* strip the fcs */
+            uint32_t len = ((status & ETH_DMARXDESC_FL) >> ETH_DMARXDESC_FRAMELENGTHSHIFT) - 4;
+
+            LTRACEF("got packet len %u, buffer %p\n", len, p->buffer);
+
+            /* drop anything the cpu speculatively pulled in while the dma owned it */
+            arch_invalidate_cache_range((addr_t)p->buffer, len);
+            p->dlen = len;
+
+            minip_rx_driver_callback(p);
         }
+
+        /* the stack kept the frame, its slot gets a fresh buffer in the refill */
+        if (p->ref > 1) {
+            pktbuf_free(p, false);
+            continue;
+        }
+
+        /* otherwise the buffer goes right back on the ring */
+        eth_rx_queue_pbuf(p);
+    }
+
+    eth_rx_refill();
+
+    return count;
+}
+
+#else
+
+/* no stack to give them to, hand the frames straight back to the dma */
+static int eth_rx_poll(void *arg, int budget)
+{
+    int count = 0;
+
+    while (count < budget && HAL_ETH_GetReceivedFrame_IT(&eth.EthHandle) == HAL_OK) {
+        LTRACEF("got packet len %u, buffer %p, seg count %u\n", eth.EthHandle.RxFrameInfos.length,
+                (void *)eth.EthHandle.RxFrameInfos.buffer,
+                eth.EthHandle.RxFrameInfos.SegCount);
+
+        /* Release descriptors to DMA */
+        /* Point to first descriptor */
+        __IO ETH_DMADescTypeDef *dmarxdesc;
+
+        dmarxdesc = eth.EthHandle.RxFrameInfos.FSRxDesc;
+        /* Set Own bit in Rx descriptors: gives the buffers back to DMA */
+        for (uint i=0; i< eth.EthHandle.RxFrameInfos.SegCount; i++) {
+            dmarxdesc->Status |= ETH_DMARXDESC_OWN;
+            dmarxdesc = (ETH_DMADescTypeDef *)(dmarxdesc->Buffer2NextDescAddr);
+        }
+
+        /* Clear Segment_Count */
+        eth.EthHandle.RxFrameInfos.SegCount =0;
+
+        /* When Rx Buffer unavailable flag is set: clear it and resume reception */
+        if ((eth.EthHandle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t)RESET) {
+            /* Clear RBUS ETHERNET DMA flag */
+            eth.EthHandle.Instance->DMASR = ETH_DMASR_RBUS;
+            /* Resume DMA reception */
+            eth.EthHandle.Instance->DMARPDR = 0;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+static bool eth_rx_pending(void)
+{
+    return (eth.EthHandle.RxDesc->Status & ETH_DMARXDESC_OWN) == 0;
+}
+
+#endif
+
+/* the ring is empty, take rx interrupts again */
+static bool eth_rx_poll_done(void *arg)
+{
+    __HAL_ETH_DMA_ENABLE_IT(&eth.EthHandle, ETH_DMA_IT_R);
+
+    /* a frame that landed before the interrupt was back on, keep going */
+    if (eth_rx_pending()) {
+        __HAL_ETH_DMA_DISABLE_IT(&eth.EthHandle, ETH_DMA_IT_R);
+        return false;
     }
 
-    return 0;
+    return true;
 }
 
 #if WITH_LIB_MINIP
@@ -242,8 +242,10 @@ static int stm32_flash_ioctl(struct bdev *bdev, int request, void *argp)
             /* we're already mapped */
             if (argp)
                 *(void **)argp = (void *)FLASHAXI_BASE;
+            ret = NO_ERROR;
             break;
         case BIO_IOCTL_PUT_MEM_MAP:
+            ret = NO_ERROR;
             break;
     }
 
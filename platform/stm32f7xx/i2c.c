@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <malloc.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <dev/driver.h>
+#include <dev/class/i2c.h>
+#include <kernel/spinlock.h>
+#include <platform/dma.h>
+#include <platform/i2c.h>
+#include <platform/stm32.h>
+
+#define LOCAL_TRACE 0
+
+struct device_class i2c_device_class = {
+    .name = "i2c",
+};
+
+struct stm32_i2c_state {
+    struct device *dev;
+
+    I2C_HandleTypeDef handle;
+    DMA_HandleTypeDef tx_dma;
+    DMA_HandleTypeDef rx_dma;
+
+    /* everything below is protected by lock */
+    spin_lock_t lock;
+    struct list_node queue;     /* requests waiting behind the active one */
+    i2c_request_t *active;
+    size_t index;               /* next transaction of the active request */
+    size_t step;                /* transactions covered by the transfer in flight */
+};
+
+static status_t stm32_i2c_init(struct device *dev);
+static status_t stm32_i2c_submit(struct device *dev, i2c_request_t *req);
+
+static struct i2c_ops the_ops = {
+    .std = {
+        .device_class = &i2c_device_class,
+        .init = stm32_i2c_init,
+    },
+    .submit = stm32_i2c_submit,
+};
+
+DRIVER_EXPORT(i2c, &the_ops.std);
+
+static status_t stm32_i2c_init(struct device *dev)
+{
+    if (!dev)
+        return ERR_INVALID_ARGS;
+
+    if (!dev->config)
+        return ERR_NOT_CONFIGURED;
+
+    const struct stm32_i2c_config *config = dev->config;
+
+    struct stm32_i2c_state *state = calloc(1, sizeof(*state));
+    if (!state)
+        return ERR_NO_MEMORY;
+
+    state->dev = dev;
+    spin_lock_init(&state->lock);
+    list_initialize(&state->queue);
+
+    status_t err = stm32_dma_stream_init(&state->tx_dma, config->tx_stream,
+                                         config->tx_channel, DMA_MEMORY_TO_PERIPH);
+    if (err < 0)
+        goto fail;
+    err = stm32_dma_stream_init(&state->rx_dma, config->rx_stream,
+                                config->rx_channel, DMA_PERIPH_TO_MEMORY);
+    if (err < 0)
+        goto fail;
+
+    I2C_HandleTypeDef *h = &state->handle;
+    h->Instance             = config->regs;
+    h->Init.Timing          = config->timing;
+    h->Init.OwnAddress1     = 0;
+    h->Init.AddressingMode  = I2C_ADDRESSINGMODE_7BIT;
+    h->Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
+    h->Init.OwnAddress2     = 0;
+    h->Init.GeneralCallMode = I2C_GENERALCALL_DISABLE;
+    h->Init.NoStretchMode   = I2C_NOSTRETCH_DISABLE;
+
+    __HAL_LINKDMA(h, hdmatx, state->tx_dma);
+    __HAL_LINKDMA(h, hdmarx, state->rx_dma);
+
+    HAL_StatusTypeDef status = HAL_I2C_Init(h);
+    if (status != HAL_OK) {
+        err = hal_error_to_status(status);
+        goto fail;
+    }
+
+    dev->state = state;
+
+    return NO_ERROR;
+
+fail:
+    free(state);
+    return err;
+}
+
+static bool i2c_txn_valid(const struct i2c_transaction *txn)
+{
+    /* the HAL can't do zero length transfers and counts in 16 bits */
+    return txn->len > 0 && txn->len <= 0xffff;
+}
+
+/* Start the next transfer of the active request. A short register address
+ * write followed by a read of the same device goes out as one memory read,
+ * which is the only way the HAL can put a repeated start between them.
+ */
+static status_t i2c_start_locked(struct stm32_i2c_state *state)
+{
+    i2c_request_t *req = state->active;
+    struct i2c_transaction *txn = &req->txn[state->index];
+    uint16_t addr = txn->addr << 1;
+    HAL_StatusTypeDef status;
+
+    if (!i2c_txn_valid(txn))
+        return ERR_INVALID_ARGS;
+
+    if (!(txn->flags & I2C_READ) && txn->len <= 2 && state->index + 1 < req->count) {
+        struct i2c_transaction *next = txn + 1;
+
+        if ((next->flags & I2C_READ) && next->addr == txn->addr && i2c_txn_valid(next)) {
+            const uint8_t *reg = txn->buf;
+            uint16_t mem = (txn->len == 2) ? (reg[0] << 8) | reg[1] : reg[0];
+
+            arch_clean_invalidate_cache_range((addr_t)next->buf, next->len);
+
+            status = HAL_I2C_Mem_Read_DMA(&state->handle, addr, mem,
+                                          (txn->len == 2) ? I2C_MEMADD_SIZE_16BIT : I2C_MEMADD_SIZE_8BIT,
+                                          next->buf, next->len);
+            state->step = 2;
+            return hal_error_to_status(status);
+        }
+    }
+
+    if (txn->flags & I2C_READ) {
+        arch_clean_invalidate_cache_range((addr_t)txn->buf, txn->len);
+        status = HAL_I2C_Master_Receive_DMA(&state->handle, addr, txn->buf, txn->len);
+    } else {
+        arch_clean_cache_range((addr_t)txn->buf, txn->len);
+        status = HAL_I2C_Master_Transmit_DMA(&state->handle, addr, txn->buf, txn->len);
+    }
+    state->step = 1;
+
+    return hal_error_to_status(status);
+}
+
+static void i2c_finish_locked(struct stm32_i2c_state *state, status_t result, struct list_node *done)
+{
+    i2c_request_t *req = state->active;
+
+    req->result = result;
+    list_add_tail(done, &req->node);
+    state->active = NULL;
+}
+
+/* Keep the controller busy until the queue is empty. Finished requests are
+ * moved to done, to be completed once the lock is dropped.
+ */
+static void i2c_run_locked(struct stm32_i2c_state *state, struct list_node *done)
+{
+    for (;;) {
+        if (!state->active) {
+            state->active = list_remove_head_type(&state->queue, i2c_request_t, node);
+            if (!state->active)
+                return;
+
+            state->index = 0;
+            state->step = 0;
+        }
+
+        if (state->index == state->active->count) {
+            i2c_finish_locked(state, NO_ERROR, done);
+            continue;
+        }
+
+        status_t err = i2c_start_locked(state);
+        if (err == NO_ERROR)
+            return;
+
+        i2c_finish_locked(state, err, done);
+    }
+}
+
+static void i2c_complete_list(struct list_node *done)
+{
+    i2c_request_t *req;
+    while ((req = list_remove_head_type(done, i2c_request_t, node)) != NULL)
+        class_i2c_request_complete(req, req->result);
+}
+
+static status_t stm32_i2c_submit(struct device *dev, i2c_request_t *req)
+{
+    DEBUG_ASSERT(dev);
+    DEBUG_ASSERT(req);
+
+    struct stm32_i2c_state *state = dev->state;
+    if (!state)
+        return ERR_NOT_CONFIGURED;
+
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    spin_lock_saved_state_t sstate;
+
+    spin_lock_irqsave(&state->lock, sstate);
+    list_add_tail(&state->queue, &req->node);
+    if (!state->active)
+        i2c_run_locked(state, &done);
+    spin_unlock_irqrestore(&state->lock, sstate);
+
+    i2c_complete_list(&done);
+
+    return NO_ERROR;
+}
+
+/* called from the dma interrupt when the transfer in flight ends */
+static void i2c_transfer_done(I2C_HandleTypeDef *hi2c, status_t err)
+{
+    struct stm32_i2c_state *state = containerof(hi2c, struct stm32_i2c_state, handle);
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    spin_lock_saved_state_t sstate;
+
+    spin_lock_irqsave(&state->lock, sstate);
+    if (state->active) {
+        if (err < 0) {
+            i2c_finish_locked(state, err, &done);
+        } else {
+            state->index += state->step;
+
+            struct i2c_transaction *last = &state->active->txn[state->index - 1];
+            if (last->flags & I2C_READ)
+                arch_invalidate_cache_range((addr_t)last->buf, last->len);
+        }
+    }
+    i2c_run_locked(state, &done);
+    spin_unlock_irqrestore(&state->lock, sstate);
+
+    i2c_complete_list(&done);
+}
+
+void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    i2c_transfer_done(hi2c, NO_ERROR);
+}
+
+void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    i2c_transfer_done(hi2c, NO_ERROR);
+}
+
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    i2c_transfer_done(hi2c, NO_ERROR);
+}
+
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+    LTRACEF("error 0x%x\n", hi2c->ErrorCode);
+
+    /* a nack means nobody answered at that address */
+    i2c_transfer_done(hi2c, (hi2c->ErrorCode & HAL_I2C_ERROR_AF) ? ERR_NOT_FOUND : ERR_IO);
+}
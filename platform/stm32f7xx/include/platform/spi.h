@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stm32f7xx.h>
+
+/* Config for an spi class device instance, driven by DMA in master mode. The
+ * target enables the peripheral clock and sets up the pins in HAL_SPI_MspInit.
+ */
+struct stm32_spi_config {
+    SPI_TypeDef *regs;          /* SPI1 .. SPI6 */
+    uint32_t prescaler;         /* SPI_BAUDRATEPRESCALER_* */
+    uint32_t polarity;          /* SPI_POLARITY_* */
+    uint32_t phase;             /* SPI_PHASE_* */
+
+    /* gpio driven low by SPI_CS_ASSERT and high by SPI_CS_DEASSERT */
+    unsigned int cs_gpio;
+
+    DMA_Stream_TypeDef *tx_stream;
+    uint32_t tx_channel;        /* DMA_CHANNEL_* */
+    DMA_Stream_TypeDef *rx_stream;
+    uint32_t rx_channel;
+};
@@ -37,5 +37,13 @@ void stm32_flash_init(void);
 
 int stm32_uart_getc_poll(int port);
 
+/* queue output for the uart's tx interrupt, or write it directly until that's up */
+void stm32_uart_write(int port, const char *str, size_t len);
+/* flush queued output and stay synchronous from here on */
+void stm32_uart_panic_start(int port);
+
+/* map a HAL return code to an lk error */
+status_t hal_error_to_status(HAL_StatusTypeDef hal_status);
+
 /* unique id of device */
 uint32_t stm32_unique_id[3];
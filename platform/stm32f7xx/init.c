@@ -197,7 +197,12 @@ static void mpu_init(void)
     MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
     MPU_InitStruct.Number = region_num++;
     MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL0;
+#if STM32_ITCM_TEXT
+    /* except for the itcm ram in the first 16KB, where the hot text runs */
+    MPU_InitStruct.SubRegionDisable = 0x01;
+#else
     MPU_InitStruct.SubRegionDisable = 0x00;
+#endif
     MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
     HAL_MPU_ConfigRegion(&MPU_InitStruct);
 
@@ -255,6 +260,23 @@ static void mpu_init(void)
     HAL_MPU_ConfigRegion(&MPU_InitStruct);
 #endif
 
+#if STM32_ITCM_TEXT
+    /* still catch null pointers in the bit of itcm ram below the hot text. the
+     * highest numbered region wins, so this goes last */
+    MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+    MPU_InitStruct.BaseAddress = 0x0;
+    MPU_InitStruct.Size = MPU_REGION_SIZE_256B;
+    MPU_InitStruct.AccessPermission = MPU_REGION_NO_ACCESS;
+    MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+    MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+    MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+    MPU_InitStruct.Number = region_num++;
+    MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL0;
+    MPU_InitStruct.SubRegionDisable = 0x00;
+    MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+    HAL_MPU_ConfigRegion(&MPU_InitStruct);
+#endif
+
     HAL_MPU_Enable(MPU_HFNMI_PRIVDEF);
 }
 
@@ -12,6 +12,17 @@ MEMSIZE ?= 0x40000
 ARCH := arm
 ARM_CPU := cortex-m7
 
+# __HOT_TEXT and __FAST_DATA are copied into the tightly coupled memories at
+# boot. itcm ram is at 0 so the bottom of it is left out, for the mpu to keep
+# catching null pointers. set them to . to leave everything in flash and sram.
+ITCM_BASE ?= 0x00000100
+ITCM_SIZE ?= 0x3f00
+DTCM_BASE ?= 0x20000000
+DTCM_SIZE ?= 0x10000
+ifneq ($(ITCM_BASE),.)
+GLOBAL_DEFINES += STM32_ITCM_TEXT=1
+endif
+
 ifeq ($(STM32_CHIP),stm32f746)
 GLOBAL_DEFINES += STM32F746xx
 # XXX workaround for uppercasing in GLOBAL_DEFINES
@@ -31,10 +42,13 @@ GLOBAL_INCLUDES += \
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/debug.c \
+	$(LOCAL_DIR)/dma.c \
 	$(LOCAL_DIR)/eth.c \
 	$(LOCAL_DIR)/flash.c \
 	$(LOCAL_DIR)/gpio.c \
+	$(LOCAL_DIR)/i2c.c \
 	$(LOCAL_DIR)/init.c \
+	$(LOCAL_DIR)/spi.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/uart.c \
 	$(LOCAL_DIR)/vectab.c \
@@ -52,7 +66,8 @@ LINKER_SCRIPT += \
 MODULE_DEPS += \
 	arch/arm/arm-m/systick \
 	lib/bio \
-	lib/cbuf
+	lib/cbuf \
+	lib/netpoll
 
 include $(LOCAL_DIR)/STM32F7xx_HAL_Driver/rules.mk $(LOCAL_DIR)/CMSIS/rules.mk
 
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <arch/arm/cm.h>
+#include <dev/driver.h>
+#include <dev/gpio.h>
+#include <dev/class/spi.h>
+#include <kernel/spinlock.h>
+#include <platform/dma.h>
+#include <platform/spi.h>
+#include <platform/stm32.h>
+
+#define LOCAL_TRACE 0
+
+/* the HAL counts transfers in 16 bits, longer transactions are split */
+#define SPI_MAX_CHUNK 0xffff
+
+#define NUM_SPI 6
+
+struct device_class spi_device_class = {
+    .name = "spi",
+};
+
+struct stm32_spi_state {
+    struct device *dev;
+
+    SPI_HandleTypeDef handle;
+    DMA_HandleTypeDef tx_dma;
+    DMA_HandleTypeDef rx_dma;
+
+    /* everything below is protected by lock */
+    spin_lock_t lock;
+    struct list_node queue;     /* requests waiting behind the active one */
+    spi_request_t *active;
+    size_t index;               /* current transaction of the active request */
+    size_t offset;              /* how far into it we are */
+    size_t chunk;               /* size of the transfer in flight */
+    ssize_t transferred;
+};
+
+static const struct {
+    SPI_TypeDef *regs;
+    IRQn_Type irq;
+} spis[NUM_SPI] = {
+    { SPI1, SPI1_IRQn },
+    { SPI2, SPI2_IRQn },
+    { SPI3, SPI3_IRQn },
+    { SPI4, SPI4_IRQn },
+    { SPI5, SPI5_IRQn },
+    { SPI6, SPI6_IRQn },
+};
+
+static struct stm32_spi_state *spi_states[NUM_SPI];
+
+static status_t stm32_spi_init(struct device *dev);
+static status_t stm32_spi_submit(struct device *dev, spi_request_t *req);
+
+static struct spi_ops the_ops = {
+    .std = {
+        .device_class = &spi_device_class,
+        .init = stm32_spi_init,
+    },
+    .submit = stm32_spi_submit,
+};
+
+DRIVER_EXPORT(spi, &the_ops.std);
+
+static status_t stm32_spi_init(struct device *dev)
+{
+    if (!dev)
+        return ERR_INVALID_ARGS;
+
+    if (!dev->config)
+        return ERR_NOT_CONFIGURED;
+
+    const struct stm32_spi_config *config = dev->config;
+
+    uint num;
+    for (num = 0; num < NUM_SPI; num++) {
+        if (spis[num].regs == config->regs)
+            break;
+    }
+    if (num == NUM_SPI)
+        return ERR_INVALID_ARGS;
+    if (spi_states[num])
+        return ERR_ALREADY_EXISTS;
+
+    struct stm32_spi_state *state = calloc(1, sizeof(*state));
+    if (!state)
+        return ERR_NO_MEMORY;
+
+    state->dev = dev;
+    spin_lock_init(&state->lock);
+    list_initialize(&state->queue);
+
+    gpio_config(config->cs_gpio, GPIO_OUTPUT);
+    gpio_set(config->cs_gpio, 1);
+
+    status_t err = stm32_dma_stream_init(&state->tx_dma, config->tx_stream,
+                                         config->tx_channel, DMA_MEMORY_TO_PERIPH);
+    if (err < 0)
+        goto fail;
+    err = stm32_dma_stream_init(&state->rx_dma, config->rx_stream,
+                                config->rx_channel, DMA_PERIPH_TO_MEMORY);
+    if (err < 0)
+        goto fail;
+
+    SPI_HandleTypeDef *h = &state->handle;
+    h->Instance               = config->regs;
+    h->Init.Mode              = SPI_MODE_MASTER;
+    h->Init.Direction         = SPI_DIRECTION_2LINES;
+    h->Init.DataSize          = SPI_DATASIZE_8BIT;
+    h->Init.CLKPolarity       = config->polarity;
+    h->Init.CLKPhase          = config->phase;
+    h->Init.NSS               = SPI_NSS_SOFT;
+    h->Init.BaudRatePrescaler = config->prescaler;
+    h->Init.FirstBit          = SPI_FIRSTBIT_MSB;
+    h->Init.TIMode            = SPI_TIMODE_DISABLE;
+    h->Init.CRCCalculation    = SPI_CRCCALCULATION_DISABLE;
+    h->Init.CRCPolynomial     = 7;
+    h->Init.NSSPMode          = SPI_NSS_PULSE_DISABLE;
+
+    __HAL_LINKDMA(h, hdmatx, state->tx_dma);
+    __HAL_LINKDMA(h, hdmarx, state->rx_dma);
+
+    HAL_StatusTypeDef status = HAL_SPI_Init(h);
+    if (status != HAL_OK) {
+        err = hal_error_to_status(status);
+        goto fail;
+    }
+
+    dev->state = state;
+    spi_states[num] = state;
+    HAL_NVIC_EnableIRQ(spis[num].irq);
+
+    return NO_ERROR;
+
+fail:
+    free(state);
+    return err;
+}
+
+/* Start dma for the next piece of the active request. Returns 1 if a transfer
+ * was started, 0 if the request has nothing left to do.
+ */
+static status_t spi_start_chunk_locked(struct stm32_spi_state *state)
+{
+    const struct stm32_spi_config *config = state->dev->config;
+    spi_request_t *req = state->active;
+
+    while (state->index < req->count) {
+        struct spi_transaction *txn = &req->txn[state->index];
+
+        if (state->offset == 0 && (txn->flags & SPI_CS_ASSERT))
+            gpio_set(config->cs_gpio, 0);
+
+        size_t len = MIN(txn->len - state->offset, SPI_MAX_CHUNK);
+        if (len == 0) {
+            if (txn->flags & SPI_CS_DEASSERT)
+                gpio_set(config->cs_gpio, 1);
+            state->index++;
+            state->offset = 0;
+            continue;
+        }
+
+        uint8_t *tx = (txn->flags & SPI_WRITE) ? (uint8_t *)txn->tx_buf + state->offset : NULL;
+        uint8_t *rx = (txn->flags & SPI_READ) ? (uint8_t *)txn->rx_buf + state->offset : NULL;
+
+        if (tx)
+            arch_clean_cache_range((addr_t)tx, len);
+        if (rx)
+            arch_clean_invalidate_cache_range((addr_t)rx, len);
+
+        LTRACEF("txn %zu offset %zu len %zu tx %p rx %p\n", state->index, state->offset, len, tx, rx);
+
+        HAL_StatusTypeDef status;
+        if (tx && rx) {
+            status = HAL_SPI_TransmitReceive_DMA(&state->handle, tx, rx, len);
+        } else if (tx) {
+            status = HAL_SPI_Transmit_DMA(&state->handle, tx, len);
+        } else if (rx) {
+            status = HAL_SPI_Receive_DMA(&state->handle, rx, len);
+        } else {
+            return ERR_INVALID_ARGS;
+        }
+
+        if (status != HAL_OK)
+            return hal_error_to_status(status);
+
+        state->chunk = len;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* account for the transfer that just finished */
+static void spi_chunk_done_locked(struct stm32_spi_state *state)
+{
+    const struct stm32_spi_config *config = state->dev->config;
+    struct spi_transaction *txn = &state->active->txn[state->index];
+
+    if (txn->flags & SPI_READ)
+        arch_invalidate_cache_range((addr_t)txn->rx_buf + state->offset, state->chunk);
+
+    state->offset += state->chunk;
+    state->transferred += state->chunk;
+    state->chunk = 0;
+
+    if (state->offset == txn->len) {
+        if (txn->flags & SPI_CS_DEASSERT)
+            gpio_set(config->cs_gpio, 1);
+        state->index++;
+        state->offset = 0;
+    }
+}
+
+static void spi_finish_locked(struct stm32_spi_state *state, ssize_t result, struct list_node *done)
+{
+    const struct stm32_spi_config *config = state->dev->config;
+    spi_request_t *req = state->active;
+
+    /* don't leave the device selected after a failed transfer */
+    if (result < 0)
+        gpio_set(config->cs_gpio, 1);
+
+    req->result = result;
+    list_add_tail(done, &req->node);
+    state->active = NULL;
+}
+
+/* Keep the controller busy until the queue is empty. Finished requests are
+ * moved to done, to be completed once the lock is dropped.
+ */
+static void spi_run_locked(struct stm32_spi_state *state, struct list_node *done)
+{
+    for (;;) {
+        if (!state->active) {
+            state->active = list_remove_head_type(&state->queue, spi_request_t, node);
+            if (!state->active)
+                return;
+
+            state->index = 0;
+            state->offset = 0;
+            state->chunk = 0;
+            state->transferred = 0;
+        }
+
+        status_t err = spi_start_chunk_locked(state);
+        if (err > 0)
+            return;
+
+        spi_finish_locked(state, (err < 0) ? err : state->transferred, done);
+    }
+}
+
+static void spi_complete_list(struct list_node *done)
+{
+    spi_request_t *req;
+    while ((req = list_remove_head_type(done, spi_request_t, node)) != NULL)
+        class_spi_request_complete(req, req->result);
+}
+
+static status_t stm32_spi_submit(struct device *dev, spi_request_t *req)
+{
+    DEBUG_ASSERT(dev);
+    DEBUG_ASSERT(req);
+
+    struct stm32_spi_state *state = dev->state;
+    if (!state)
+        return ERR_NOT_CONFIGURED;
+
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    spin_lock_saved_state_t sstate;
+
+    spin_lock_irqsave(&state->lock, sstate);
+    list_add_tail(&state->queue, &req->node);
+    if (!state->active)
+        spi_run_locked(state, &done);
+    spin_unlock_irqrestore(&state->lock, sstate);
+
+    spi_complete_list(&done);
+
+    return NO_ERROR;
+}
+
+/* called from the dma or spi interrupt when the transfer in flight ends */
+static void spi_transfer_done(SPI_HandleTypeDef *hspi, status_t err)
+{
+    struct stm32_spi_state *state = containerof(hspi, struct stm32_spi_state, handle);
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    spin_lock_saved_state_t sstate;
+
+    spin_lock_irqsave(&state->lock, sstate);
+    if (state->active) {
+        if (err < 0)
+            spi_finish_locked(state, err, &done);
+        else
+            spi_chunk_done_locked(state);
+    }
+    spi_run_locked(state, &done);
+    spin_unlock_irqrestore(&state->lock, sstate);
+
+    spi_complete_list(&done);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    spi_transfer_done(hspi, NO_ERROR);
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    spi_transfer_done(hspi, NO_ERROR);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    spi_transfer_done(hspi, NO_ERROR);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    LTRACEF("error 0x%x\n", hspi->ErrorCode);
+    spi_transfer_done(hspi, ERR_IO);
+}
+
+static void stm32_spi_irq(uint num)
+{
+    arm_cm_irq_entry();
+
+    if (spi_states[num])
+        HAL_SPI_IRQHandler(&spi_states[num]->handle);
+
+    arm_cm_irq_exit(true);
+}
+
+void stm32_SPI1_IRQ(void) { stm32_spi_irq(0); }
+void stm32_SPI2_IRQ(void) { stm32_spi_irq(1); }
+void stm32_SPI3_IRQ(void) { stm32_spi_irq(2); }
+void stm32_SPI4_IRQ(void) { stm32_spi_irq(3); }
+void stm32_SPI5_IRQ(void) { stm32_spi_irq(4); }
+void stm32_SPI6_IRQ(void) { stm32_spi_irq(5); }
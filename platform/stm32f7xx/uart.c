@@ -46,10 +46,19 @@ cbuf_t uart1_rx_buf;
 #ifndef UART1_RXBUF_SIZE
 #define UART1_RXBUF_SIZE 16
 #endif
+#ifndef UART1_TXBUF_SIZE
+#define UART1_TXBUF_SIZE 1024
+#endif
+cbuf_t uart1_tx_buf;
 #endif
 
 static UART_HandleTypeDef handle;
 
+// Output queued for the TXE interrupt, once uart_init has it set up.
+// A panic goes back to writing synchronously.
+static spin_lock_t tx_lock = SPIN_LOCK_INITIAL_VALUE;
+static volatile bool tx_irq;
+
 // This function is called by HAL_UART_Init().
 void HAL_UART_MspInit(UART_HandleTypeDef *huart)
 {
@@ -89,9 +98,11 @@ static void usart_init1_early(USART_TypeDef *usart, uint32_t baud, uint16_t flow
     HAL_UART_Init(&handle);
 }
 
-static void usart_init1(USART_TypeDef *usart, int irqn, cbuf_t *rxbuf, size_t rxsize)
+static void usart_init1(USART_TypeDef *usart, int irqn, cbuf_t *rxbuf, size_t rxsize,
+                        cbuf_t *txbuf, size_t txsize)
 {
     cbuf_initialize(rxbuf, rxsize);
+    cbuf_initialize(txbuf, txsize);
 
     /* Enable the UART Parity Error Interrupt */
     __HAL_UART_ENABLE_IT(&handle, UART_IT_PE);
@@ -103,6 +114,8 @@ static void usart_init1(USART_TypeDef *usart, int irqn, cbuf_t *rxbuf, size_t rx
     __HAL_UART_ENABLE_IT(&handle, UART_IT_RXNE);
 
     HAL_NVIC_EnableIRQ(USART1_IRQn);
+
+    tx_irq = true;
 }
 
 void uart_init_early(void)
@@ -115,10 +128,31 @@ void uart_init_early(void)
 void uart_init(void)
 {
 #ifdef ENABLE_UART1
-    usart_init1(USART1, USART1_IRQn, &uart1_rx_buf, UART1_RXBUF_SIZE);
+    usart_init1(USART1, USART1_IRQn, &uart1_rx_buf, UART1_RXBUF_SIZE,
+                &uart1_tx_buf, UART1_TXBUF_SIZE);
 #endif
 }
 
+#ifdef ENABLE_UART1
+// Feed TDR from the queue while it's empty, leaving the TXE interrupt on
+// only while there's more to send. Must hold tx_lock.
+static void uart_tx_fill_locked(void)
+{
+    char c;
+
+    if (__HAL_UART_GET_FLAG(&handle, UART_FLAG_TXE) != RESET &&
+            cbuf_read_char(&uart1_tx_buf, &c, false) == 1) {
+        handle.Instance->TDR = (uint8_t)c;
+    }
+
+    if (cbuf_space_used(&uart1_tx_buf) > 0) {
+        __HAL_UART_ENABLE_IT(&handle, UART_IT_TXE);
+    } else {
+        __HAL_UART_DISABLE_IT(&handle, UART_IT_TXE);
+    }
+}
+#endif
+
 void stm32_USART1_IRQ(void)
 {
     bool resched = false;
@@ -169,7 +203,9 @@ void stm32_USART1_IRQ(void)
 
     /* UART in mode Transmitter ------------------------------------------------*/
     if ((__HAL_UART_GET_IT(&handle, UART_IT_TXE) != RESET) &&(__HAL_UART_GET_IT_SOURCE(&handle, UART_IT_TXE) != RESET)) {
-        ;
+        spin_lock(&tx_lock);
+        uart_tx_fill_locked();
+        spin_unlock(&tx_lock);
     }
 
     /* UART in mode Transmitter (transmission end) -----------------------------*/
@@ -206,7 +242,53 @@ int stm32_uart_getc_poll(int port)
   return -1;
 }
 
-void uart_flush_tx(int port) {}
+void stm32_uart_write(int port, const char *str, size_t len)
+{
+#ifdef ENABLE_UART1
+    spin_lock_saved_state_t state;
+
+    if (!tx_irq) {
+        for (size_t i = 0; i < len; i++)
+            uart_putc(port, str[i]);
+        return;
+    }
+
+    while (len > 0) {
+        size_t written = cbuf_write(&uart1_tx_buf, str, len, false);
+        str += written;
+        len -= written;
+
+        spin_lock_irqsave(&tx_lock, state);
+        if (len > 0) {
+            // queue is full. the caller may have interrupts masked, so make
+            // room by hand instead of waiting on the irq handler.
+            while (__HAL_UART_GET_FLAG(&handle, UART_FLAG_TXE) == RESET)
+                ;
+        }
+        uart_tx_fill_locked();
+        spin_unlock_irqrestore(&tx_lock, state);
+    }
+#endif
+}
+
+void uart_flush_tx(int port)
+{
+#ifdef ENABLE_UART1
+    spin_lock_saved_state_t state;
+    char c;
+
+    spin_lock_irqsave(&tx_lock, state);
+    while (cbuf_read_char(&uart1_tx_buf, &c, false) == 1)
+        uart_putc(port, c);
+    spin_unlock_irqrestore(&tx_lock, state);
+#endif
+}
+
+void stm32_uart_panic_start(int port)
+{
+    tx_irq = false;
+    uart_flush_tx(port);
+}
 
 void uart_flush_rx(int port) {}
 
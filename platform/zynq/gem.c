@@ -48,6 +48,7 @@
 #include <kernel/event.h>
 #include <kernel/semaphore.h>
 
+#include <lib/netpoll.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
 
@@ -106,7 +107,8 @@ struct gem_state {
     struct list_node queued_pbufs;
 
     gem_cb_t rx_callback;
-    event_t rx_pending;
+    netpoll_t poll;
+    unsigned int rx_head;
     event_t tx_complete;
     bool debug_rx;
     pktbuf_t *rx_pbufs[GEM_RX_DESC_CNT];
@@ -131,16 +133,17 @@ static int free_completed_pbuf_frames(void) {
     while (gem.tx_count > 0 &&
             (gem.descs->tx_tbl[gem.tx_tail].ctrl & TX_DESC_USED)) {
 
+        /* the hardware only marks the first descriptor of a frame used, free all of its parts */
         bool eof;
         do {
             pktbuf_t *p = list_remove_head_type(&gem.queued_pbufs, pktbuf_t, list);
             DEBUG_ASSERT(p);
             eof = p->flags & PKTBUF_FLAG_EOF;
             ret += pktbuf_free(p, false);
-        } while (!eof);
 
-        gem.tx_tail = (gem.tx_tail + 1) % GEM_TX_DESC_CNT;
-        gem.tx_count--;
+            gem.tx_tail = (gem.tx_tail + 1) % GEM_TX_DESC_CNT;
+            gem.tx_count--;
+        } while (!eof);
     }
 
     return ret;
@@ -154,31 +157,52 @@ void queue_pkts_in_tx_tbl(void) {
         return;
     }
 
-    // XXX handle multi part buffers
-
     /* Queue packets in the descriptor table until we're either out of space in the table
      * or out of packets in our tx queue. Any packets left will remain in the list and be
-     * processed the next time available */
-    while (gem.tx_count < GEM_TX_DESC_CNT &&
-            ((p = list_remove_head_type(&gem.tx_queue, pktbuf_t, list)) != NULL)) {
-        cur_pos = gem.tx_head;
-
-        uint32_t addr = pktbuf_data_phys(p);
-        uint32_t ctrl = gem.descs->tx_tbl[cur_pos].ctrl & TX_DESC_WRAP; /* protect the wrap bit */
-        ctrl |= TX_BUF_LEN(p->dlen);
-
-        DEBUG_ASSERT(p->flags & PKTBUF_FLAG_EOF); // a multi part buffer would have caused a race condition w/hardware
-        if (p->flags & PKTBUF_FLAG_EOF) {
-            ctrl |= TX_LAST_BUF;
+     * processed the next time available. Each part of a multi part packet gets a descriptor
+     * of its own, so a packet only goes in once there's room for all of them. */
+    while ((p = list_peek_head_type(&gem.tx_queue, pktbuf_t, list)) != NULL) {
+        unsigned int parts = 0;
+        for (pktbuf_t *q = p; q; q = q->next) {
+            parts++;
+        }
+        if (gem.tx_count + parts > GEM_TX_DESC_CNT) {
+            break;
         }
+        list_delete(&p->list);
 
-        /* fill in the descriptor, control word last (in case hardware is racing us) */
-        gem.descs->tx_tbl[cur_pos].addr = addr;
-        gem.descs->tx_tbl[cur_pos].ctrl = ctrl;
+        unsigned int first = gem.tx_head;
+        uint32_t first_ctrl = 0;
+        while (p) {
+            pktbuf_t *next = p->next;
+            cur_pos = gem.tx_head;
+
+            uint32_t addr = pktbuf_data_phys(p);
+            uint32_t ctrl = gem.descs->tx_tbl[cur_pos].ctrl & TX_DESC_WRAP; /* protect the wrap bit */
+            ctrl |= TX_BUF_LEN(p->dlen);
+
+            if (!next) {
+                ctrl |= TX_LAST_BUF;
+            }
+
+            /* fill in the descriptor. the first control word is written after the rest
+             * so the hardware can't start on a half built frame */
+            gem.descs->tx_tbl[cur_pos].addr = addr;
+            if (cur_pos == first) {
+                first_ctrl = ctrl;
+            } else {
+                gem.descs->tx_tbl[cur_pos].ctrl = ctrl;
+            }
+
+            gem.tx_head = (gem.tx_head + 1) % GEM_TX_DESC_CNT;
+            gem.tx_count++;
+            list_add_tail(&gem.queued_pbufs, &p->list);
+
+            p = next;
+        }
 
-        gem.tx_head = (gem.tx_head + 1) % GEM_TX_DESC_CNT;
-        gem.tx_count++;
-        list_add_tail(&gem.queued_pbufs, &p->list);
+        DMB;
+        gem.descs->tx_tbl[first].ctrl = first_ctrl;
     }
 
     DMB;
@@ -194,16 +218,41 @@ int gem_send_raw_pkt(struct pktbuf *p)
         goto err;
     }
 
-    /* make sure the output buffer is fully written to memory before
-     * placing on the outgoing list. */
+    /* the gem works out the whole checksum itself, summing the field along with the
+     * rest, so the pseudo header sum minip left there has to go */
+    if (p->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        memset(p->buffer + p->csum_start + p->csum_offset, 0, sizeof(uint16_t));
+    }
 
-    // XXX handle multi part buffers
-    arch_clean_cache_range((vaddr_t)p->data, p->dlen);
+    unsigned int parts = 0;
+    for (pktbuf_t *q = p; q; q = q->next) {
+        parts++;
+    }
+
+    /* it would never fit in the descriptor table */
+    if (parts > GEM_TX_DESC_CNT) {
+        pktbuf_free_chain(p, true);
+        ret = -1;
+        goto err;
+    }
+
+    /* make sure the output buffers are fully written to memory before
+     * placing on the outgoing list, the whole chain with one barrier. */
+    struct arch_cache_range ranges[GEM_TX_DESC_CNT];
+    unsigned int i = 0;
+    for (pktbuf_t *q = p; q; q = q->next, i++) {
+        ranges[i].start = (vaddr_t)q->data;
+        ranges[i].len = q->dlen;
+    }
+    arch_clean_cache_ranges(ranges, parts);
 
     spin_lock_saved_state_t irqstate;
     spin_lock_irqsave(&lock, irqstate);
     list_add_tail(&gem.tx_queue, &p->list);
-    queue_pkts_in_tx_tbl();
+    /* the rest of a batch lands in the table with the last of it, with one tx start */
+    if (!(p->flags & PKTBUF_FLAG_TX_MORE)) {
+        queue_pkts_in_tx_tbl();
+    }
     spin_unlock_irqrestore(&lock, irqstate);
 
 err:
@@ -224,8 +273,10 @@ enum handler_return gem_int_handler(void *arg) {
         gem.regs->intr_status = intr_status;
 
         // Received an RX complete
+        /* masked until the poll thread has emptied the ring */
         if (intr_status & INTR_RX_COMPLETE) {
-            event_signal(&gem.rx_pending, false);
+            gem.regs->intr_dis = INTR_RX_COMPLETE;
+            netpoll_schedule(&gem.poll);
 
             gem.regs->rx_status |= INTR_RX_COMPLETE;
 
@@ -251,11 +302,12 @@ enum handler_return gem_int_handler(void *arg) {
             }
         }
 
-        /* A frame has been completed so we can clean up ownership of its buffers */
+        /* A frame has been completed, the poll thread cleans up its buffers */
         if (intr_status & INTR_TX_COMPLETE) {
-            if (free_completed_pbuf_frames() > 0) {
-                resched = true;
-            }
+            gem.regs->intr_dis = INTR_TX_COMPLETE;
+            netpoll_schedule(&gem.poll);
+
+            resched = true;
         }
 
         /* The controller has processed packets until it hit a buffer owned by the driver */
@@ -356,54 +408,82 @@ static void gem_cfg_ints(void)
                     INTR_RX_USED_READ | INTR_TX_CORRUPT | INTR_TX_USED_READ | INTR_RX_OVERRUN;
 }
 
-int gem_rx_thread(void *arg)
+/* interrupts that are masked while the poll thread has work */
+#define GEM_POLL_INTRS (INTR_RX_COMPLETE | INTR_TX_COMPLETE)
+
+static bool gem_tx_reap_pending(void)
+{
+    return gem.tx_count > 0 && (gem.descs->tx_tbl[gem.tx_tail].ctrl & TX_DESC_USED);
+}
+
+/* free whatever the gem has finished sending, then hand up to budget
+ * received frames to the stack */
+static int gem_poll(void *arg, int budget)
 {
     pktbuf_t *p;
-    int bp = 0;
+    int count = 0;
 
-    while (1) {
-        event_wait(&gem.rx_pending);
+    spin_lock_saved_state_t irqstate;
+    spin_lock_irqsave(&lock, irqstate);
+    if (gem_tx_reap_pending()) {
+        free_completed_pbuf_frames();
+        queue_pkts_in_tx_tbl();
+    }
+    spin_unlock_irqrestore(&lock, irqstate);
 
-        for (;;) {
-            if (gem.descs->rx_tbl[bp].addr & RX_DESC_USED) {
-                uint32_t ctrl = gem.descs->rx_tbl[bp].ctrl;
+    while (count < budget && (gem.descs->rx_tbl[gem.rx_head].addr & RX_DESC_USED)) {
+        unsigned int bp = gem.rx_head;
+        uint32_t ctrl = gem.descs->rx_tbl[bp].ctrl;
 
-                p = gem.rx_pbufs[bp];
-                p->dlen = RX_BUF_LEN(ctrl);
-                p->data = p->buffer + 2;
+        p = gem.rx_pbufs[bp];
+        p->dlen = RX_BUF_LEN(ctrl);
+        p->data = p->buffer + 2;
 
-                /* copy the checksum offloading bits */
-                p->flags = 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) != 0) ? PKTBUF_FLAG_CKSUM_IP_GOOD : 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 1) ? PKTBUF_FLAG_CKSUM_UDP_GOOD : 0;
-                p->flags |= (BITS_SHIFT(ctrl, 23, 22) == 2) ? PKTBUF_FLAG_CKSUM_TCP_GOOD : 0;
+        /* copy the checksum offloading bits */
+        uint32_t csum = RX_CHKSUM_MATCH(ctrl);
+        p->flags = 0;
+        p->flags |= (csum != RX_CHKSUM_NONE) ? PKTBUF_FLAG_CKSUM_IP_GOOD : 0;
+        p->flags |= (csum == RX_CHKSUM_IP_UDP) ? PKTBUF_FLAG_CKSUM_UDP_GOOD : 0;
+        p->flags |= (csum == RX_CHKSUM_IP_TCP) ? PKTBUF_FLAG_CKSUM_TCP_GOOD : 0;
 
-                /* invalidate any stale cache lines on the receive buffer to ensure
-                 * the cpu has a fresh copy of incomding data. */
-                arch_invalidate_cache_range((vaddr_t)p->data, p->dlen);
+        /* invalidate any stale cache lines on the receive buffer to ensure
+         * the cpu has a fresh copy of incomding data. */
+        arch_invalidate_cache_range((vaddr_t)p->data, p->dlen);
 
-                if (unlikely(gem.debug_rx)) {
-                    debug_rx_handler(p);
-                }
+        if (unlikely(gem.debug_rx)) {
+            debug_rx_handler(p);
+        }
 
-                if (likely(gem.rx_callback)) {
-                    gem.rx_callback(p);
-                }
+        if (likely(gem.rx_callback)) {
+            gem.rx_callback(p);
+        }
 
-                /* make sure all dirty data is flushed out of the buffer before
-                 * putting into the receive queue */
-                arch_clean_invalidate_cache_range((vaddr_t)p->buffer, PKTBUF_SIZE);
+        /* make sure all dirty data is flushed out of the buffer before
+         * putting into the receive queue */
+        arch_clean_invalidate_cache_range((vaddr_t)p->buffer, PKTBUF_SIZE);
 
-                gem.descs->rx_tbl[bp].addr &= ~RX_DESC_USED;
-                gem.descs->rx_tbl[bp].ctrl = 0;
-                bp = (bp + 1) % GEM_RX_DESC_CNT;
-            } else {
-                break;
-            }
-        }
+        gem.descs->rx_tbl[bp].addr &= ~RX_DESC_USED;
+        gem.descs->rx_tbl[bp].ctrl = 0;
+        gem.rx_head = (bp + 1) % GEM_RX_DESC_CNT;
+        count++;
     }
 
-    return 0;
+    return count;
+}
+
+/* both rings are caught up, take interrupts again */
+static bool gem_poll_done(void *arg)
+{
+    gem.regs->intr_en = GEM_POLL_INTRS;
+    DMB;
+
+    /* anything that finished before the interrupts were back on won't raise one */
+    if ((gem.descs->rx_tbl[gem.rx_head].addr & RX_DESC_USED) || gem_tx_reap_pending()) {
+        gem.regs->intr_dis = GEM_POLL_INTRS;
+        return false;
+    }
+
+    return true;
 }
 
 
@@ -452,7 +532,6 @@ status_t gem_init(uintptr_t gem_base)
 {
     status_t ret;
     uint32_t reg_val;
-    thread_t *rx_thread;
     void *descs_vaddr;
     paddr_t descs_paddr;
 
@@ -460,7 +539,6 @@ status_t gem_init(uintptr_t gem_base)
 
     /* Data structure init */
     event_init(&gem.tx_complete, false, EVENT_FLAG_AUTOUNSIGNAL);
-    event_init(&gem.rx_pending, false, EVENT_FLAG_AUTOUNSIGNAL);
     list_initialize(&gem.queued_pbufs);
     list_initialize(&gem.tx_queue);
 
@@ -476,9 +554,11 @@ status_t gem_init(uintptr_t gem_base)
     gem.descs_phys = descs_paddr;
     gem.regs = (struct gem_regs *)gem_base;
 
-    /* rx background thread */
-    rx_thread = thread_create("gem_rx", gem_rx_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
-    thread_resume(rx_thread);
+    /* rx and tx completion background thread */
+    if ((ret = netpoll_init(&gem.poll, "gem", gem_poll, gem_poll_done, NULL, 0, HIGH_PRIORITY)) < 0) {
+        return ret;
+    }
+    netpoll_start(&gem.poll);
 
     /* Bring whatever existing configuration is up down so we can do it cleanly */
     gem_deinit(gem_base);
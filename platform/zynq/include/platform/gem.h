@@ -202,9 +202,13 @@ struct gem_regs {
 #define RX_VLAN_PRIO(x)                      ((x >> 17) & 0x7)
 #define RX_PRIO_TAG                          (1 << 20)
 #define RX_VLAN_DETECT                       (1 << 21)
-#define RX_CHKSUM_MATCH(x)                   ((1 >> 22) & 0x3)
+#define RX_CHKSUM_MATCH(x)                   ((x >> 22) & 0x3)
+#define RX_CHKSUM_NONE                       (0)
+#define RX_CHKSUM_IP                         (1) /* ip header checked, not tcp or udp */
+#define RX_CHKSUM_IP_TCP                     (2)
+#define RX_CHKSUM_IP_UDP                     (3)
 #define RX_SNAP_ENCODED                      (1 << 24)
-#define RX_ADDR_REG_MATCH(x)                 ((1 >> 25) & 0x3)
+#define RX_ADDR_REG_MATCH(x)                 ((x >> 25) & 0x3)
 #define RX_SPECIFIC_ADDR_MATCH               (1 << 27)
 #define RX_EXT_MATCH                         (1 << 28)
 #define RX_UNICAST_MATCH                     (1 << 30)
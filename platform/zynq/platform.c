@@ -273,12 +273,7 @@ struct mmu_initial_mapping mmu_initial_mappings[] = {
       .flags = MMU_INITIAL_MAPPING_FLAG_DEVICE,
       .name = "hw-f8000000" },
 
-    /* 0xfc000000 hardware devices */
-    { .phys = 0xfc000000,
-      .virt = 0xfc000000,
-      .size = 0x02000000,
-      .flags = MMU_INITIAL_MAPPING_FLAG_DEVICE,
-      .name = "hw-fc000000" },
+    /* 0xfc000000 is the qspi linear window, the spiflash driver maps it cached while in linear mode */
 
     /* sram high aperture */
     { .phys = 0xfff00000,
@@ -310,7 +305,7 @@ static pmm_arena_t sram_arena = {
     .base = SRAM_BASE,
     .size = SRAM_SIZE,
     .priority = 1,
-    .flags = PMM_ARENA_FLAG_KMAP
+    .flags = PMM_ARENA_FLAG_KMAP | PMM_ARENA_FLAG_FAST /* on chip memory */
 };
 
 void platform_init_mmu_mappings(void)
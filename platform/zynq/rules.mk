@@ -47,7 +47,8 @@ GLOBAL_DEFINES += \
 
 # gem driver depends on minip interface
 MODULE_DEPS += \
-	lib/minip
+	lib/minip \
+	lib/netpoll
 endif
 
 ifeq ($(ZYNQ_USE_SRAM),1)
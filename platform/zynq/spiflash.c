@@ -35,8 +35,12 @@
 
 #include <lib/bio.h>
 #include <lib/console.h>
+#include <arch/ops.h>
 #include <dev/qspi.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
 #include <kernel/thread.h>
+#include <kernel/vm.h>
 
 #include <platform/zynq.h>
 
@@ -45,6 +49,7 @@
 // parameters specifically for the 16MB spansion S25FL128S flash
 #define PARAMETER_AREA_SIZE (128*1024)
 #define PAGE_PROGRAM_SIZE (256)     // can be something else based on the part
+#define MAX_PAGE_PROGRAM_SIZE (512) // largest program buffer we'll use if the cfi says the part has it
 #define PAGE_ERASE_SLEEP_TIME (150) // amount of time before waiting to check if erase completed
 #define SECTOR_ERASE_SIZE (4096)
 #define LARGE_SECTOR_ERASE_SIZE (64*1024)
@@ -55,23 +60,55 @@
 
 #define MAX_GEOMETRY_COUNT (2)
 
+// linear mode uses 24 bit addresses, so only the first 16MB of a part show up in the window
+#define QSPI_LINEAR_SIZE (16*1024*1024)
+
 struct spi_flash {
 	bool detected;
 
+	/* held around anything that talks to the part */
+	mutex_t lock;
+
 	struct qspi_ctxt qspi;
 	bdev_t bdev;
 	bio_erase_geometry_info_t geometry[MAX_GEOMETRY_COUNT];
 
 	off_t size;
+	size_t program_size; /* bytes a single page program can take */
+
+	/* cached mapping of the linear window while the controller is in linear mode */
+	void *linear;
+	size_t linear_size;
+	uint map_count;         /* BIO_IOCTL_GET_MEM_MAP users holding the window */
+	off_t touched_start;    /* what may be in the cache from the window */
+	off_t touched_end;
+
+	/* asynchronous requests, run in order by the worker thread */
+	spin_lock_t queue_lock;
+	struct list_node queue;
+	event_t queue_event;
+
+	/* for checking whether sectors are already blank */
+	uint32_t scratch[SECTOR_ERASE_SIZE / 4];
+
+	/* stats */
+	ulong erases_skipped;
+	ulong pages_skipped;
 };
 
-static struct spi_flash flash;
+static struct spi_flash flash = {
+	.lock = MUTEX_INITIAL_VALUE(flash.lock),
+	.queue_lock = SPIN_LOCK_INITIAL_VALUE,
+	.queue = LIST_INITIAL_VALUE(flash.queue),
+	.queue_event = EVENT_INITIAL_VALUE(flash.queue_event, false, EVENT_FLAG_AUTOUNSIGNAL),
+};
 
 static ssize_t spiflash_bdev_read(struct bdev *, void *buf, off_t offset, size_t len);
 static ssize_t spiflash_bdev_read_block(struct bdev *, void *buf, bnum_t block, uint count);
 static ssize_t spiflash_bdev_write_block(struct bdev *, const void *buf, bnum_t block, uint count);
 static ssize_t spiflash_bdev_erase(struct bdev *, off_t offset, size_t len);
 static int spiflash_ioctl(struct bdev *, int request, void *argp);
+static status_t spiflash_bdev_submit(struct bdev *, bio_request_t *req);
 
 // adjust 24 bit address to be correct-byte-order for 32bit qspi commands
 static uint32_t qspi_fix_addr(uint32_t addr)
@@ -114,6 +151,80 @@ static inline void qspi_wr_status_cr1(struct qspi_ctxt *qspi, uint8_t status, ui
 	qspi_wr3(qspi, cmd);
 }
 
+// switch the controller to linear mode and map the window cached, read only.
+// Must hold flash.lock before calling.
+static status_t spiflash_linear_enter(void)
+{
+	if (flash.linear)
+		return NO_ERROR;
+
+	void *ptr;
+	status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "qspi linear", flash.linear_size, &ptr,
+		log2_uint(1024*1024), QSPI_LINEAR_BASE, 0, ARCH_MMU_FLAG_CACHED | ARCH_MMU_FLAG_PERM_RO);
+	if (err < 0)
+		return err;
+
+	qspi_enable_linear(&flash.qspi);
+	flash.linear = ptr;
+	flash.touched_start = flash.linear_size;
+	flash.touched_end = 0;
+
+	return NO_ERROR;
+}
+
+// back to command mode for anything but reads, fails while someone holds the memory map.
+// Must hold flash.lock before calling.
+static status_t spiflash_linear_exit(void)
+{
+	if (!flash.linear)
+		return NO_ERROR;
+	if (flash.map_count > 0)
+		return ERR_BUSY;
+
+	// the caches are physically tagged, so whatever was read through the window
+	// would outlive the mapping and go stale once the flash is written
+	if (flash.touched_end > flash.touched_start)
+		arch_invalidate_cache_range((addr_t)flash.linear + flash.touched_start,
+			flash.touched_end - flash.touched_start);
+
+	qspi_disable_linear(&flash.qspi);
+	vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)flash.linear);
+	flash.linear = NULL;
+
+	return NO_ERROR;
+}
+
+// wait for an erase or program to finish, giving the cpu to someone else while the part is busy
+static uint32_t qspi_wait_ready(struct qspi_ctxt *qspi, lk_time_t sleep)
+{
+	uint32_t status;
+
+	while ((status = qspi_rd_status(qspi)) & STS_BUSY) {
+		if (sleep > 0)
+			thread_sleep(sleep);
+		else
+			thread_yield();
+	}
+
+	return status;
+}
+
+// check if a sector already reads back as erased
+static bool qspi_sector_blank(struct qspi_ctxt *qspi, uint32_t addr, size_t len)
+{
+	for (size_t pos = 0; pos < len; pos += sizeof(flash.scratch)) {
+		qspi_rd32(qspi, addr + pos, flash.scratch, countof(flash.scratch));
+
+		for (uint i = 0; i < countof(flash.scratch); i++) {
+			if (flash.scratch[i] != 0xffffffff)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// Must hold flash.lock before calling.
 static ssize_t qspi_erase_sector(struct qspi_ctxt *qspi, uint32_t addr)
 {
 	uint32_t cmd;
@@ -142,12 +253,17 @@ static ssize_t qspi_erase_sector(struct qspi_ctxt *qspi, uint32_t addr)
 		toerase = LARGE_SECTOR_ERASE_SIZE;
 	}
 
+	// reading a sector back is much quicker than erasing it
+	if (qspi_sector_blank(qspi, addr, toerase)) {
+		flash.erases_skipped++;
+		return toerase;
+	}
+
 	qspi_wren(qspi);
 	qspi_wr(qspi, qspi_fix_addr(addr) | cmd, 3, 0, 0);
 
 	thread_sleep(PAGE_ERASE_SLEEP_TIME);
-	while ((status = qspi_rd_status(qspi)) & STS_BUSY)
-		;
+	status = qspi_wait_ready(qspi, 1);
 
 	LTRACEF("status 0x%x\n", status);
 	if (status & (STS_PROGRAM_ERR | STS_ERASE_ERR)) {
@@ -159,35 +275,49 @@ static ssize_t qspi_erase_sector(struct qspi_ctxt *qspi, uint32_t addr)
 	return toerase;
 }
 
-static ssize_t qspi_write_page(struct qspi_ctxt *qspi, uint32_t addr, const uint8_t *data)
+// quad page program len bytes, len is PAGE_PROGRAM_SIZE or the part's program buffer size
+// Must hold flash.lock before calling.
+static ssize_t qspi_write_page(struct qspi_ctxt *qspi, uint32_t addr, const uint8_t *data, size_t len)
 {
 	uint32_t oldkhz, status;
 
-	LTRACEF("addr 0x%x, data %p\n", addr, data);
+	LTRACEF("addr 0x%x, data %p, len %zu\n", addr, data, len);
 
 	DEBUG_ASSERT(qspi);
 	DEBUG_ASSERT(data);
-	DEBUG_ASSERT(IS_ALIGNED(addr, PAGE_PROGRAM_SIZE));
+	DEBUG_ASSERT(IS_ALIGNED(addr, len));
 
-	if (!IS_ALIGNED(addr, PAGE_PROGRAM_SIZE))
+	if (!IS_ALIGNED(addr, len) || len > MAX_PAGE_PROGRAM_SIZE)
 		return ERR_INVALID_ARGS;
 
+	// programming all ones doesn't change anything, the page is assumed to be erased already
+	const uint32_t *words = (const uint32_t *)data;
+	uint i;
+	for (i = 0; i < len / 4; i++) {
+		if (words[i] != 0xffffffff)
+			break;
+	}
+	if (i == len / 4) {
+		flash.pages_skipped++;
+		return len;
+	}
+
 	oldkhz = qspi->khz;
 	if (qspi_set_speed(qspi, 80000))
 		return ERR_IO;
 
 	qspi_wren(qspi);
-	qspi_wr(qspi, qspi_fix_addr(addr) | 0x32, 3, (uint32_t *)data, PAGE_PROGRAM_SIZE / 4);
+	qspi_wr(qspi, qspi_fix_addr(addr) | 0x32, 3, (uint32_t *)data, len / 4);
 	qspi_set_speed(qspi, oldkhz);
 
-	while ((status = qspi_rd_status(qspi)) & STS_BUSY) ;
+	status = qspi_wait_ready(qspi, 0);
 
 	if (status & (STS_PROGRAM_ERR | STS_ERASE_ERR)) {
 		printf("qspi_write_page failed @ %x\n", addr);
 		qspi_clsr(qspi);
 		return ERR_IO;
 	}
-	return PAGE_PROGRAM_SIZE;
+	return len;
 }
 
 static ssize_t spiflash_read_cfi(void *buf, size_t len)
@@ -224,6 +354,48 @@ static ssize_t spiflash_read_otp(void *buf, uint32_t addr, size_t len)
 	return len;
 }
 
+static int spiflash_worker(void *arg)
+{
+	for (;;) {
+		spin_lock_saved_state_t state;
+		spin_lock_irqsave(&flash.queue_lock, state);
+		bio_request_t *req = list_remove_head_type(&flash.queue, bio_request_t, node);
+		spin_unlock_irqrestore(&flash.queue_lock, state);
+
+		if (!req) {
+			event_wait(&flash.queue_event);
+			continue;
+		}
+
+		bdev_t *bdev = req->dev;
+		ssize_t result;
+		switch (req->op) {
+			case BIO_OP_READ:
+				if (req->iov)
+					result = bdev->readv(bdev, req->iov, req->iov_cnt, req->offset, req->len);
+				else
+					result = bdev->read(bdev, req->buf, req->offset, req->len);
+				break;
+			case BIO_OP_WRITE:
+				if (req->iov)
+					result = bdev->writev(bdev, req->iov, req->iov_cnt, req->offset, req->len);
+				else
+					result = bdev->write(bdev, req->buf, req->offset, req->len);
+				break;
+			case BIO_OP_ERASE:
+				result = bdev->erase(bdev, req->offset, req->len);
+				break;
+			default:
+				result = ERR_INVALID_ARGS;
+				break;
+		}
+
+		bio_request_complete(req, result);
+	}
+
+	return 0;
+}
+
 status_t spiflash_detect(void)
 {
 	if (flash.detected)
@@ -289,6 +461,13 @@ status_t spiflash_detect(void)
 		offset += flash.geometry[i].size;
 	}
 
+	flash.linear_size = MIN(flash.size, QSPI_LINEAR_SIZE);
+
+	/* the cfi has the size of the page program buffer as a power of two */
+	flash.program_size = PAGE_PROGRAM_SIZE;
+	if (buf[0x2A] > log2_uint(PAGE_PROGRAM_SIZE) && buf[0x2A] <= log2_uint(MAX_PAGE_PROGRAM_SIZE))
+		flash.program_size = 1U << buf[0x2A];
+
 	free(buf);
 
 	/* read the 16 byte random number out of the OTP area and add to the rand entropy pool */
@@ -320,13 +499,18 @@ status_t spiflash_detect(void)
 	flash.bdev.write_block = &spiflash_bdev_write_block;
 	flash.bdev.erase = &spiflash_bdev_erase;
 	flash.bdev.ioctl = &spiflash_ioctl;
+	flash.bdev.submit = &spiflash_bdev_submit;
 
 	/* we erase to 0xff */
 	flash.bdev.erase_byte = 0xff;
 
+	/* one worker keeps the requests in order and the qspi controller to itself */
+	thread_detach_and_resume(thread_create("spiflash", &spiflash_worker, NULL,
+		DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+
 	bio_register_device(&flash.bdev);
 
-	LTRACEF("found flash of size 0x%llx\n", flash.size);
+	LTRACEF("found flash of size 0x%llx, program size %zu\n", flash.size, flash.program_size);
 
 nouse:
 	return NO_ERROR;
@@ -350,8 +534,25 @@ static ssize_t spiflash_bdev_read(struct bdev *bdev, void *buf, off_t offset, si
 	if (len == 0)
 		return 0;
 
-	// XXX handle not mulitple of 4
-	qspi_rd32(&flash.qspi, offset, buf, len / 4);
+	mutex_acquire(&flash.lock);
+
+	// copy out of the cached linear window where we can, it runs at full bus speed
+	if (offset + (off_t)len <= (off_t)flash.linear_size && spiflash_linear_enter() == NO_ERROR) {
+		memcpy(buf, (uint8_t *)flash.linear + offset, len);
+		flash.touched_start = MIN(flash.touched_start, offset);
+		flash.touched_end = MAX(flash.touched_end, offset + (off_t)len);
+	} else {
+		ssize_t err = spiflash_linear_exit();
+		if (err < 0) {
+			mutex_release(&flash.lock);
+			return err;
+		}
+
+		// XXX handle not mulitple of 4
+		qspi_rd32(&flash.qspi, offset, buf, len / 4);
+	}
+
+	mutex_release(&flash.lock);
 
 	return len;
 }
@@ -378,19 +579,31 @@ static ssize_t spiflash_bdev_write_block(struct bdev *bdev, const void *_buf, bn
 		return 0;
 
 	const uint8_t *buf = _buf;
+	const uint pages_per_program = flash.program_size / PAGE_PROGRAM_SIZE;
 
-	ssize_t written = 0;
-	while (count > 0) {
-		ssize_t err = qspi_write_page(&flash.qspi, block * PAGE_PROGRAM_SIZE, buf);
-		if (err < 0)
-			return err;
+	mutex_acquire(&flash.lock);
+
+	ssize_t written = spiflash_linear_exit();
+	while (written >= 0 && count > 0) {
+		// use the whole program buffer where the run lines up with it
+		uint pages = 1;
+		if (IS_ALIGNED(block, pages_per_program) && count >= pages_per_program)
+			pages = pages_per_program;
+
+		ssize_t err = qspi_write_page(&flash.qspi, block * PAGE_PROGRAM_SIZE, buf, pages * PAGE_PROGRAM_SIZE);
+		if (err < 0) {
+			written = err;
+			break;
+		}
 
-		buf += PAGE_PROGRAM_SIZE;
+		buf += err;
 		written += err;
-		block++;
-		count--;
+		block += pages;
+		count -= pages;
 	}
 
+	mutex_release(&flash.lock);
+
 	return written;
 }
 
@@ -402,16 +615,22 @@ static ssize_t spiflash_bdev_erase(struct bdev *bdev, off_t offset, size_t len)
 	if (len == 0)
 		return 0;
 
-	ssize_t erased = 0;
-	while (erased < (ssize_t)len) {
+	mutex_acquire(&flash.lock);
+
+	ssize_t erased = spiflash_linear_exit();
+	while (erased >= 0 && erased < (ssize_t)len) {
 		ssize_t err = qspi_erase_sector(&flash.qspi, offset);
-		if (err < 0)
-			return err;
+		if (err < 0) {
+			erased = err;
+			break;
+		}
 
 		erased += err;
 		offset += err;
 	}
 
+	mutex_release(&flash.lock);
+
 	return erased;
 }
 
@@ -420,22 +639,45 @@ static int spiflash_ioctl(struct bdev *bdev, int request, void *argp)
 	LTRACEF("dev %p, request %d, argp %p\n", bdev, request, argp);
 
 	int ret = ERR_NOT_SUPPORTED;
+	mutex_acquire(&flash.lock);
 	switch (request) {
 		case BIO_IOCTL_GET_MEM_MAP:
-			/* put the device into linear mode */
-			ret = qspi_enable_linear(&flash.qspi);
+			/* put the device into linear mode, it stays there until someone needs command mode */
+			ret = spiflash_linear_enter();
+			if (ret < 0)
+				break;
+			flash.map_count++;
+			flash.touched_start = 0;
+			flash.touched_end = flash.linear_size;
 			if (argp)
-				*(void **)argp = (void *)QSPI_LINEAR_BASE;
+				*(void **)argp = flash.linear;
 			break;
 		case BIO_IOCTL_PUT_MEM_MAP:
-			/* put the device back into regular mode */
-			ret = qspi_disable_linear(&flash.qspi);
+			/* let the next write or erase put the device back into regular mode */
+			if (flash.map_count > 0)
+				flash.map_count--;
+			ret = NO_ERROR;
 			break;
 	}
+	mutex_release(&flash.lock);
 
 	return ret;
 }
 
+static status_t spiflash_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+	LTRACEF("dev %p, req %p, op %u, offset 0x%llx, len %zu\n", bdev, req, req->op, req->offset, req->len);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&flash.queue_lock, state);
+	list_add_tail(&flash.queue, &req->node);
+	spin_unlock_irqrestore(&flash.queue_lock, state);
+
+	event_signal(&flash.queue_event, true);
+
+	return NO_ERROR;
+}
+
 // debug tests
 int cmd_spiflash(int argc, const cmd_args *argv)
 {
@@ -454,6 +696,7 @@ usage:
 		printf("\t%s write <offset> <length> <address>\n", argv[0].str);
 		printf("\t%s erase <offset>\n", argv[0].str);
 #endif
+		printf("\t%s stats\n", argv[0].str);
 		printf("\t%s setquad (dangerous)\n", argv[0].str);
 		return ERR_INVALID_ARGS;
 	}
@@ -502,10 +745,10 @@ usage:
 			return -1;
 		}
 
-		if (argv[2].b)
-			qspi_enable_linear(&flash.qspi);
-		else
-			qspi_disable_linear(&flash.qspi);
+		mutex_acquire(&flash.lock);
+		status_t err = argv[2].b ? spiflash_linear_enter() : spiflash_linear_exit();
+		printf("linear window %p, err %d\n", flash.linear, err);
+		mutex_release(&flash.lock);
 	} else if (!strcmp(argv[1].str, "read")) {
 		if (argc < 4) goto notenoughargs;
 		if (!flash.detected) {
@@ -515,7 +758,10 @@ usage:
 
 		uint8_t *buf = calloc(1, argv[3].u);
 
-		qspi_rd32(&flash.qspi, argv[2].u, (uint32_t *)buf, argv[3].u / 4);
+		mutex_acquire(&flash.lock);
+		if (spiflash_linear_exit() == NO_ERROR)
+			qspi_rd32(&flash.qspi, argv[2].u, (uint32_t *)buf, argv[3].u / 4);
+		mutex_release(&flash.lock);
 
 		hexdump8(buf, argv[3].u);
 		free(buf);
@@ -526,7 +772,11 @@ usage:
 			return -1;
 		}
 
-		status_t err = qspi_write_page(&flash.qspi, argv[2].u, (void *)argv[4].u);
+		mutex_acquire(&flash.lock);
+		status_t err = spiflash_linear_exit();
+		if (err == NO_ERROR)
+			err = qspi_write_page(&flash.qspi, argv[2].u, (void *)argv[4].u, PAGE_PROGRAM_SIZE);
+		mutex_release(&flash.lock);
 		printf("write_page returns %d\n", err);
 	} else if (!strcmp(argv[1].str, "erase")) {
 		if (argc < 3) goto notenoughargs;
@@ -535,11 +785,18 @@ usage:
 			return -1;
 		}
 
-		status_t err = qspi_erase_sector(&flash.qspi, argv[2].u);
+		mutex_acquire(&flash.lock);
+		status_t err = spiflash_linear_exit();
+		if (err == NO_ERROR)
+			err = qspi_erase_sector(&flash.qspi, argv[2].u);
+		mutex_release(&flash.lock);
 		printf("erase returns %d\n", err);
 	} else
 #endif
-	if (!strcmp(argv[1].str, "setquad")) {
+	if (!strcmp(argv[1].str, "stats")) {
+		printf("program size %zu, erases skipped %lu, pages skipped %lu\n",
+			flash.program_size, flash.erases_skipped, flash.pages_skipped);
+	} else if (!strcmp(argv[1].str, "setquad")) {
 		if (!flash.detected) {
 			printf("flash not detected\n");
 			return -1;
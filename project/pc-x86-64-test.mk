@@ -3,6 +3,11 @@
 ARCH := x86-64
 TARGET := pc-x86
 MODULES += \
-	app/shell
+	app/perfreplay \
+	app/shell \
+	dev/virtio/block \
+	dev/virtio/console \
+	dev/virtio/net \
+	lib/fiber
 
 include project/virtual/test.mk
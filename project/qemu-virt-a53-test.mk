@@ -3,7 +3,10 @@ TARGET := qemu-virt
 ARM_CPU := cortex-a53
 
 MODULES += \
-	app/shell
+	app/perfreplay \
+	app/shell \
+	lib/fiber \
+	lib/gfx
 
 WITH_LINKER_GC := 0
 
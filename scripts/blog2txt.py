@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+#
+# Expand the output of the 'blog export' console command into text, taking the
+# format strings (and any %s arguments that point into the image) out of the
+# lk elf the log was taken from.
+#
+# usage: blog2txt.py lk.elf [console log]
+#
+# The console log can hold anything else around the export, only the lines
+# starting with 'blog' are looked at.
+
+import argparse
+import re
+import struct
+import sys
+
+EXPORT_VERSION = 1
+MAX_ARGS = 4
+
+SHT_NOBITS = 8
+SHF_ALLOC = 0x2
+
+line_re = re.compile(r'blog (begin|r|end)\b ?(.*)$')
+spec_re = re.compile(r'%([-+ #0]*)(\d+|\*)?(?:\.(\d+|\*))?(hh|h|ll|l|z|t|j)?([diouxXcsp%])')
+
+
+class Image:
+    """the loadable sections of an elf, enough to read strings by address"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF':
+            sys.exit('%s is not an elf file' % path)
+        is64 = self.data[4] == 2
+        end = '<' if self.data[5] == 1 else '>'
+
+        if is64:
+            shoff, = struct.unpack_from(end + 'Q', self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(end + 'HH', self.data, 0x3a)
+            shfmt = end + 'IIQQQQ'
+        else:
+            shoff, = struct.unpack_from(end + 'I', self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(end + 'HH', self.data, 0x2e)
+            shfmt = end + 'IIIIII'
+
+        self.sections = []
+        for i in range(shnum):
+            _name, type, flags, addr, offset, size = struct.unpack_from(shfmt, self.data, shoff + i * shentsize)
+            if flags & SHF_ALLOC and type != SHT_NOBITS and size:
+                self.sections.append((addr, offset, size))
+
+    def string(self, addr):
+        for base, offset, size in self.sections:
+            if base <= addr < base + size:
+                start = offset + addr - base
+                stop = self.data.find(b'\0', start, offset + size)
+                if stop < 0:
+                    stop = offset + size
+                return self.data[start:stop].decode('utf-8', 'replace')
+        return None
+
+
+def parse(f):
+    fmt = None
+    word = 0
+    records = []
+    for line in f:
+        m = line_re.search(line.rstrip('\r\n'))
+        if not m:
+            continue
+        kind, rest = m.groups()
+        if kind == 'begin':
+            version, order, size, word = rest.split()
+            if int(version) != EXPORT_VERSION:
+                sys.exit('unsupported export version %s' % version)
+            fmt = ('<' if order == 'le' else '>') + 'QQII%dQ' % MAX_ARGS
+            if struct.calcsize(fmt) != int(size):
+                sys.exit('record size %s does not match the script' % size)
+            word = int(word)
+            records = []
+        elif kind == 'r' and fmt:
+            r = struct.unpack(fmt, bytes.fromhex(rest.strip()))
+            records.append((r[0], r[1], r[2], r[3], r[4:]))
+        elif kind == 'end' and fmt:
+            break
+    if fmt is None:
+        sys.exit('no blog export found')
+    return word, records
+
+
+def expand(image, word, fmt, args):
+    """printf on the host, with the arguments sized the way the target passed them"""
+    args = list(args)
+    out = []
+
+    def next_arg():
+        return args.pop(0) if args else 0
+
+    def sized(value, length, signed):
+        bits = {'hh': 8, 'h': 16, 'll': 64, 'j': 64}.get(length, word * 8 if length in ('l', 'z', 't') else 32)
+        value &= (1 << bits) - 1
+        if signed and value & (1 << (bits - 1)):
+            value -= 1 << bits
+        return value
+
+    pos = 0
+    for m in spec_re.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, prec, length, conv = m.groups()
+        if conv == '%':
+            out.append('%')
+            continue
+        if width == '*':
+            width = str(sized(next_arg(), None, True))
+        if prec == '*':
+            prec = str(sized(next_arg(), None, True))
+        spec = '%' + flags + (width or '') + ('.' + prec if prec is not None else '')
+
+        value = next_arg()
+        if conv in 'di':
+            out.append((spec + 'd') % sized(value, length, True))
+        elif conv in 'ouxX':
+            out.append((spec + conv) % sized(value, length, False))
+        elif conv == 'c':
+            out.append((spec + 'c') % chr(value & 0xff))
+        elif conv == 'p':
+            out.append((spec + 's') % ('0x%x' % value))
+        elif conv == 's':
+            s = image.string(value) if value else '<null>'
+            out.append((spec + 's') % (s if s is not None else '<0x%x>' % value))
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='expand a blog export')
+    parser.add_argument('elf', help='the lk elf the log was taken from')
+    parser.add_argument('log', nargs='?', help='console capture, stdin if not given')
+    parser.add_argument('-c', '--cpu', type=int, help='only show records from this cpu')
+    args = parser.parse_args()
+
+    image = Image(args.elf)
+
+    if args.log:
+        with open(args.log, errors='replace') as f:
+            word, records = parse(f)
+    else:
+        word, records = parse(sys.stdin)
+
+    for time, fmt_addr, cpu, nargs, rargs in records:
+        if args.cpu is not None and cpu != args.cpu:
+            continue
+        fmt = image.string(fmt_addr)
+        if fmt is None:
+            text = 'unknown format 0x%x %s' % (fmt_addr, ' '.join('0x%x' % a for a in rargs[:nargs]))
+        else:
+            text = expand(image, word, fmt, rargs[:nargs]).rstrip('\n')
+        print('%u.%06u %u: %s' % (time // 1000000, time % 1000000, cpu, text))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+#
+# Receive and take apart the crash dumps lib/crashdump writes.
+#
+# usage: crashdump.py recv [-p port] dump.bin
+#        crashdump.py extract dump.bin outdir
+#
+# recv writes what arrives on the udp port to a file, extract takes a file from
+# recv or a copy of the dump partition and writes threads.txt, klog<n>.txt and
+# one mem-<address>.bin per run of contiguous memory into outdir.
+
+import argparse
+import os
+import socket
+import struct
+import sys
+import zlib
+
+# must match include/lib/crashdump.h
+MAGIC = 0x44434b4c
+VERSION = 1
+UDP_MAGIC = 0x55434b4c
+
+RECORD_END = 0
+RECORD_THREADS = 1
+RECORD_KLOG = 2
+RECORD_MEMORY = 3
+
+FLAG_DEFLATE = 1 << 0
+FLAG_ZERO = 1 << 1
+
+HEADER = 'IIIIQQ96s'
+RECORD = 'IIQII'
+UDP_HEADER = 'IIQ'
+
+
+def recv(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('', args.port))
+    print('listening on udp port %u' % args.port, file=sys.stderr)
+
+    hdr_size = struct.calcsize('<' + UDP_HEADER)
+    got = {}
+    end = 0
+    with open(args.output, 'wb') as f:
+        while True:
+            data, addr = sock.recvfrom(65536)
+            if len(data) < hdr_size:
+                continue
+            magic, seq, offset = struct.unpack_from('<' + UDP_HEADER, data)
+            if magic != UDP_MAGIC:
+                continue
+            payload = data[hdr_size:]
+            if not payload:
+                # an empty one goes out when a target is set, and a few at the end
+                if got:
+                    break
+                print('target %s:%u is set up' % addr, file=sys.stderr)
+                continue
+            f.seek(offset)
+            f.write(payload)
+            got[offset] = len(payload)
+            end = max(end, offset + len(payload))
+
+    missing = end - sum(got.values())
+    print('%u bytes in %u datagrams, %u bytes missing' % (end, len(got), missing), file=sys.stderr)
+
+
+def parse(data):
+    order = '<'
+    if struct.unpack_from('<I', data)[0] != MAGIC:
+        order = '>'
+        if struct.unpack_from('>I', data)[0] != MAGIC:
+            sys.exit('no crash dump found')
+
+    magic, version, header_size, page_size, time, caller, reason = \
+        struct.unpack_from(order + HEADER, data)
+    if version != VERSION:
+        sys.exit('unsupported dump version %u' % version)
+
+    header = {'time': time, 'caller': caller, 'page_size': page_size,
+              'reason': reason.split(b'\0')[0].decode(errors='replace')}
+
+    records = []
+    rec_size = struct.calcsize(order + RECORD)
+    pos = header_size
+    complete = False
+    while pos + rec_size <= len(data):
+        type, flags, addr, length, stored = struct.unpack_from(order + RECORD, data, pos)
+        pos += rec_size
+        if type == RECORD_END:
+            complete = True
+            break
+        if type > RECORD_MEMORY or pos + stored > len(data):
+            break
+        payload = data[pos:pos + stored]
+        pos += stored
+        if flags & FLAG_ZERO:
+            payload = bytes(length)
+        elif flags & FLAG_DEFLATE:
+            payload = zlib.decompress(payload, -15)
+        records.append((type, addr, payload))
+
+    return header, records, complete
+
+
+def extract(args):
+    with open(args.dump, 'rb') as f:
+        data = f.read()
+
+    header, records, complete = parse(data)
+    print('dump taken at %u us, caller 0x%x: %s' % (header['time'], header['caller'], header['reason']))
+    if not complete:
+        print('dump is truncated')
+
+    os.makedirs(args.outdir, exist_ok=True)
+
+    threads = b''.join(p for t, _, p in records if t == RECORD_THREADS)
+    with open(os.path.join(args.outdir, 'threads.txt'), 'wb') as f:
+        f.write(threads)
+
+    klogs = {}
+    for t, addr, p in records:
+        if t == RECORD_KLOG:
+            klogs[addr] = klogs.get(addr, b'') + p
+    for buffer, text in sorted(klogs.items()):
+        with open(os.path.join(args.outdir, 'klog%u.txt' % buffer), 'wb') as f:
+            f.write(text)
+
+    # merge the chunks back into runs of contiguous memory
+    runs = []
+    for t, addr, p in sorted((r for r in records if r[0] == RECORD_MEMORY), key=lambda r: r[1]):
+        if runs and runs[-1][0] + len(runs[-1][1]) == addr:
+            runs[-1][1].extend(p)
+        else:
+            runs.append((addr, bytearray(p)))
+    for addr, mem in runs:
+        with open(os.path.join(args.outdir, 'mem-%x.bin' % addr), 'wb') as f:
+            f.write(mem)
+        print('memory 0x%x-0x%x' % (addr, addr + len(mem)))
+
+    print('%u bytes of memory in %u runs, %u klog buffers' %
+          (sum(len(m) for _, m in runs), len(runs), len(klogs)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='receive and take apart lk crash dumps')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('recv', help='write a dump sent over udp to a file')
+    p.add_argument('-p', '--port', type=int, default=9999, help='udp port to listen on')
+    p.add_argument('output', help='file to write the dump to')
+    p.set_defaults(func=recv)
+
+    p = sub.add_parser('extract', help='take a dump file apart')
+    p.add_argument('dump', help='dump file, from recv or read back from the partition')
+    p.add_argument('outdir', help='directory to write the pieces to')
+    p.set_defaults(func=extract)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
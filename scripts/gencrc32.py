@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+#
+# Generate the slice-by-8 crc32 tables in lib/cksum/crc32.h. The tables used
+# to be built by crc32.c on first use under DYNAMIC_CRC_TABLE, which raced
+# between threads and cost a few thousand cycles on the first crc. They're
+# checked in const now and land in .rodata; rerun this if TBLS changes.
+#
+# usage: gencrc32.py [-t tables] > lib/cksum/crc32.h
+
+import argparse
+
+# x^32+x^26+x^23+x^22+x^16+x^12+x^11+x^10+x^8+x^7+x^5+x^4+x^2+x+1, reflected
+POLY = 0xedb88320
+
+
+def make_tables(count):
+    tables = [[0] * 256 for _ in range(count)]
+    for n in range(256):
+        c = n
+        for _ in range(8):
+            c = (c >> 1) ^ POLY if c & 1 else c >> 1
+        tables[0][n] = c
+    # table k advances the crc over k more zero bytes
+    for n in range(256):
+        c = tables[0][n]
+        for k in range(1, count):
+            c = tables[0][c & 0xff] ^ (c >> 8)
+            tables[k][n] = c
+    return tables
+
+
+def write_table(table):
+    lines = []
+    for i in range(0, len(table), 5):
+        lines.append('    ' + ', '.join('0x%08xUL' % v for v in table[i:i + 5]))
+    return ',\n'.join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='generate the crc32 lookup tables')
+    parser.add_argument('-t', '--tables', type=int, default=8, help='slice tables, must match TBLS in crc32.c')
+    args = parser.parse_args()
+
+    print('/* crc32.h -- tables for rapid CRC calculation')
+    print(' * Generated automatically by scripts/gencrc32.py')
+    print(' */')
+    print()
+    print('local const z_crc_t FAR crc_table[TBLS][256] =')
+    print('{')
+    print('  {')
+    print('\n  },\n  {\n'.join(write_table(t) for t in make_tables(args.tables)))
+    print('  }')
+    print('};')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+#
+# Convert the output of the 'kevlog export' console command into a chrome
+# trace json file, which chrome://tracing and ui.perfetto.dev both open.
+#
+# usage: kevlog2trace.py [console log] > trace.json
+#
+# The console log can hold anything else around the export, only the lines
+# starting with 'kevlog' are looked at. Pass the nm output of the lk binary
+# with -s to get names instead of addresses for timer and work callbacks.
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+EXPORT_VERSION = 1
+
+# must match the enum in include/kernel/debug.h
+CONTEXT_SWITCH = 1
+PREEMPT = 2
+TIMER_TICK = 3
+TIMER_CALL = 4
+IRQ_ENTER = 5
+IRQ_EXIT = 6
+THREAD_WAKEUP = 7
+WORK_BEGIN = 8
+WORK_END = 9
+BIO_SUBMIT = 10
+BIO_COMPLETE = 11
+USER = 0x1000
+
+PID_CPU = 0
+PID_WORK = 1
+
+line_re = re.compile(r'kevlog (begin|t|r|end)\b ?(.*)$')
+
+
+def load_symbols(path):
+    syms = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) < 3:
+                continue
+            try:
+                addr = int(fields[0], 16)
+            except ValueError:
+                continue
+            syms.append((addr, fields[-1]))
+    syms.sort()
+    return syms
+
+
+def symbolize(syms, addr):
+    lo, hi = 0, len(syms)
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if syms[mid][0] <= addr:
+            lo = mid + 1
+        else:
+            hi = mid
+    if lo == 0:
+        return '0x%x' % addr
+    base, name = syms[lo - 1]
+    return name if base == addr else '%s+0x%x' % (name, addr - base)
+
+
+def parse(f):
+    fmt = None
+    threads = {}
+    records = []
+    for line in f:
+        m = line_re.search(line.rstrip('\r\n'))
+        if not m:
+            continue
+        kind, rest = m.groups()
+        if kind == 'begin':
+            version, order, size, _cpus = rest.split()
+            if int(version) != EXPORT_VERSION:
+                sys.exit('unsupported export version %s' % version)
+            fmt = ('<' if order == 'le' else '>') + 'QIIQQ'
+            if struct.calcsize(fmt) != int(size):
+                sys.exit('record size %s does not match the script' % size)
+            threads = {}
+            records = []
+        elif kind == 't' and fmt:
+            addr, _, name = rest.partition(' ')
+            threads[int(addr, 16)] = name
+        elif kind == 'r' and fmt:
+            records.append(struct.unpack(fmt, bytes.fromhex(rest.strip())))
+        elif kind == 'end' and fmt:
+            return threads, records
+    if fmt is None:
+        sys.exit('no kevlog export found')
+    # a truncated capture, use what there is
+    return threads, records
+
+
+def convert(threads, records, syms):
+    events = []
+    running = {}
+    cpus = set()
+
+    def thread_name(addr):
+        return threads.get(addr, '0x%x' % addr)
+
+    def func_name(addr):
+        return symbolize(syms, addr) if syms else '0x%x' % addr
+
+    for time, id, cpu, arg0, arg1 in records:
+        cpus.add(cpu)
+        ev = {'pid': PID_CPU, 'tid': cpu, 'ts': time}
+        if id == CONTEXT_SWITCH:
+            if cpu in running:
+                start, t = running[cpu]
+                events.append({'pid': PID_CPU, 'tid': cpu, 'ts': start, 'dur': time - start,
+                               'ph': 'X', 'name': thread_name(t), 'args': {'thread': '0x%x' % t}})
+            running[cpu] = (time, arg1)
+            continue
+        elif id == IRQ_ENTER:
+            ev.update(ph='B', name='irq %u' % arg0)
+        elif id == IRQ_EXIT:
+            ev.update(ph='E', name='irq %u' % arg0)
+        elif id == WORK_BEGIN:
+            ev.update(pid=PID_WORK, ph='B', name=func_name(arg0), args={'arg': '0x%x' % arg1})
+        elif id == WORK_END:
+            ev.update(pid=PID_WORK, ph='E', name=func_name(arg0))
+        elif id == BIO_SUBMIT:
+            ev.update(ph='b', cat='bio', id='0x%x' % arg0, name='bio', args={'len': arg1})
+        elif id == BIO_COMPLETE:
+            result = arg1 - (1 << 64) if arg1 & (1 << 63) else arg1
+            ev.update(ph='e', cat='bio', id='0x%x' % arg0, name='bio', args={'result': result})
+        elif id == THREAD_WAKEUP:
+            ev.update(ph='i', s='t', name='wakeup ' + thread_name(arg0))
+        elif id == PREEMPT:
+            ev.update(ph='i', s='t', name='preempt ' + thread_name(arg0))
+        elif id == TIMER_TICK:
+            ev.update(ph='i', s='t', name='tick')
+        elif id == TIMER_CALL:
+            ev.update(ph='i', s='t', name='timer ' + func_name(arg0), args={'arg': '0x%x' % arg1})
+        elif id >= USER:
+            ev.update(ph='i', s='t', name='user %u' % (id - USER),
+                      args={'arg0': '0x%x' % arg0, 'arg1': '0x%x' % arg1})
+        else:
+            ev.update(ph='i', s='t', name='id %u' % id,
+                      args={'arg0': '0x%x' % arg0, 'arg1': '0x%x' % arg1})
+        events.append(ev)
+
+    # close out whatever was running when the log stopped
+    end = records[-1][0] if records else 0
+    for cpu, (start, t) in running.items():
+        events.append({'pid': PID_CPU, 'tid': cpu, 'ts': start, 'dur': end - start,
+                       'ph': 'X', 'name': thread_name(t), 'args': {'thread': '0x%x' % t}})
+
+    meta = [{'ph': 'M', 'pid': PID_CPU, 'name': 'process_name', 'args': {'name': 'cpus'}},
+            {'ph': 'M', 'pid': PID_WORK, 'name': 'process_name', 'args': {'name': 'work queues'}}]
+    for cpu in sorted(cpus):
+        for pid in (PID_CPU, PID_WORK):
+            meta.append({'ph': 'M', 'pid': pid, 'tid': cpu, 'name': 'thread_name',
+                         'args': {'name': 'cpu %u' % cpu}})
+
+    return {'traceEvents': meta + events, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='convert a kevlog export to chrome trace json')
+    parser.add_argument('log', nargs='?', help='console capture, stdin if not given')
+    parser.add_argument('-s', '--symbols', help='symbol table (nm output) of the lk binary')
+    parser.add_argument('-o', '--output', help='output file, stdout if not given')
+    args = parser.parse_args()
+
+    syms = load_symbols(args.symbols) if args.symbols else None
+
+    if args.log:
+        with open(args.log, errors='replace') as f:
+            threads, records = parse(f)
+    else:
+        threads, records = parse(sys.stdin)
+
+    trace = convert(threads, records, syms)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
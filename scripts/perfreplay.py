@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+#
+# Host side of the 'perfreplay' console command. 'load' drives the tcp_echo
+# workers, minip can't open connections of its own, and 'compare' lines up the
+# json summaries from two console captures.
+#
+# usage: perfreplay.py load [-c conns] [-s size] [-t secs] <host> [port]
+#        perfreplay.py compare <base log> <new log>
+#
+# The filesystem workers want an ext2 image with a file to load on the first
+# virtio block device, e.g.
+#
+#   mkdir perf && head -c 1M /dev/urandom > perf/data
+#   mke2fs -t ext2 -d perf blk.bin 8M
+#
+# then for qemu-virt-a53-test, with a tap network so the host can reach lk
+#
+#   scripts/do-qemuarm -6 -b -t -d
+#
+# or for pc-x86-64-test
+#
+#   qemu-system-x86_64 -nographic -kernel build-pc-x86-64-test/lk.elf \
+#       -drive if=none,file=blk.bin,id=blk,format=raw -device virtio-blk-pci,drive=blk \
+#       -netdev user,id=net,hostfwd=tcp::5003-:5003 -device virtio-net-pci,netdev=net
+#
+# and 'perfreplay run' on the console while this runs 'load' against it. Log
+# the console to a file to compare it with another build later.
+
+import argparse
+import json
+import re
+import socket
+import sys
+import threading
+import time
+
+REPORT_VERSION = 1
+
+# the per run metrics compare looks at, and whether bigger is better
+METRICS = [('ops_per_sec', True), ('kbytes_per_sec', True), ('p50', False),
+           ('p99', False), ('max', False), ('errors', False)]
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0
+    return samples[min(len(samples) * pct // 100, len(samples) - 1)]
+
+
+def load_conn(host, port, size, deadline, stats, lock):
+    payload = bytes(i & 0xff for i in range(size))
+    rtts = []
+    count = 0
+    try:
+        s = socket.create_connection((host, port), timeout=5)
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        while time.monotonic() < deadline:
+            start = time.monotonic()
+            s.sendall(payload)
+            got = 0
+            while got < size:
+                data = s.recv(size - got)
+                if not data:
+                    raise ConnectionError('connection closed')
+                got += len(data)
+            rtts.append(int((time.monotonic() - start) * 1000000))
+            count += 1
+        s.close()
+        error = None
+    except (OSError, ConnectionError) as e:
+        error = str(e)
+    with lock:
+        stats['rtts'] += rtts
+        stats['ops'] += count
+        if error:
+            stats['errors'].append(error)
+
+
+def cmd_load(args):
+    stats = {'rtts': [], 'ops': 0, 'errors': []}
+    lock = threading.Lock()
+    start = time.monotonic()
+    deadline = start + args.secs
+    threads = [threading.Thread(target=load_conn,
+                                args=(args.host, args.port, args.size, deadline, stats, lock))
+               for _ in range(args.conns)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    secs = max(time.monotonic() - start, 1e-6)
+
+    rtts = sorted(stats['rtts'])
+    json.dump({'perfreplay_load': REPORT_VERSION, 'conns': args.conns, 'size': args.size,
+               'secs': round(secs, 3), 'ops': stats['ops'],
+               'ops_per_sec': int(stats['ops'] / secs),
+               'kbytes_per_sec': int(stats['ops'] * args.size / 1024 / secs),
+               'rtt_us': {'p50': percentile(rtts, 50), 'p90': percentile(rtts, 90),
+                          'p99': percentile(rtts, 99), 'max': rtts[-1] if rtts else 0},
+               'errors': stats['errors']}, sys.stdout)
+    print()
+
+
+def parse(path):
+    # the summary is printed a line at a time, with console noise around it
+    text = []
+    inside = False
+    with open(path, errors='replace') as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('{"perfreplay":'):
+                text = [line]
+                inside = True
+            elif inside:
+                text.append(line)
+                if line == ']}':
+                    inside = False
+    if not text or inside:
+        sys.exit('%s: no complete perfreplay summary found' % path)
+    report = json.loads('\n'.join(text))
+    if report['perfreplay'] != REPORT_VERSION:
+        sys.exit('%s: unsupported summary version %s' % (path, report['perfreplay']))
+    return report
+
+
+def averages(report):
+    # mean of each metric over the runs, per worker, plus the mean cpu idle
+    sums = {}
+    idle = []
+    for run in report['runs']:
+        for w in run['workers']:
+            m = sums.setdefault(w['name'], {k: 0 for k, _ in METRICS})
+            for k, _ in METRICS:
+                m[k] += w['lat_us'][k] if k in w['lat_us'] else w[k]
+        idle += [c['idle_pct'] for c in run['cpus'] if c['idle_pct'] is not None]
+    runs = max(len(report['runs']), 1)
+    for m in sums.values():
+        for k in m:
+            m[k] /= runs
+    return sums, (sum(idle) / len(idle) if idle else None)
+
+
+def change(base, new, bigger_better):
+    if base == new:
+        return '     0.0%'
+    if base == 0:
+        return '      new'
+    pct = 100.0 * (new - base) / base
+    worse = (pct < 0) == bigger_better
+    return '%+8.1f%%%s' % (pct, ' *' if worse and abs(pct) >= 5 else '')
+
+
+def cmd_compare(args):
+    base, base_idle = averages(parse(args.base))
+    new, new_idle = averages(parse(args.new))
+
+    print('%-28s %-14s %12s %12s %10s' % ('worker', 'metric', 'base', 'new', 'change'))
+    for name in sorted(set(base) | set(new)):
+        if name not in base or name not in new:
+            print('%-28s only in %s' % (name, 'base' if name in base else 'new'))
+            continue
+        for k, bigger_better in METRICS:
+            print('%-28s %-14s %12.1f %12.1f %s' % (name, k, base[name][k], new[name][k],
+                                                  change(base[name][k], new[name][k], bigger_better)))
+    if base_idle is not None and new_idle is not None:
+        print('%-28s %-14s %12.2f %12.2f %s' % ('cpus', 'idle_pct', base_idle, new_idle,
+                                              change(base_idle, new_idle, True)))
+    print('\n* a change of 5% or more for the worse')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='drive and compare perfreplay runs')
+    sub = parser.add_subparsers(dest='cmd')
+    sub.required = True
+
+    p = sub.add_parser('load', help='tcp echo load for the tcp_echo workers')
+    p.add_argument('host', help='address lk is reachable at')
+    p.add_argument('port', nargs='?', type=int, default=5003, help='tcp_echo port, 5003 by default')
+    p.add_argument('-c', '--conns', type=int, default=4, help='concurrent connections')
+    p.add_argument('-s', '--size', type=int, default=64, help='bytes per request')
+    p.add_argument('-t', '--secs', type=float, default=30, help='how long to keep the load up')
+    p.set_defaults(func=cmd_load)
+
+    p = sub.add_parser('compare', help='compare the summaries in two console captures')
+    p.add_argument('base', help='console capture of the baseline build')
+    p.add_argument('new', help='console capture of the build to check')
+    p.set_defaults(func=cmd_compare)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
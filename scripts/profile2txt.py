@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#
+# Symbolize the output of the 'profile dump' console command against the lk
+# elf and print a flat profile, or folded stacks for flamegraph.pl.
+#
+# usage: profile2txt.py [-n nm] lk.elf [console log]
+#
+# The console log can hold anything else around the dump, only the lines
+# starting with 'profile' are looked at.
+
+import argparse
+import collections
+import re
+import subprocess
+import sys
+
+from kevlog2trace import symbolize
+
+DUMP_VERSION = 1
+
+line_re = re.compile(r'profile (begin|c|s|end)\b ?(.*)$')
+
+
+def elf_symbols(nm, elf):
+    out = subprocess.run([nm, '-n', '--defined-only', elf], check=True,
+                         stdout=subprocess.PIPE, universal_newlines=True).stdout
+    syms = []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[1] in 'tTwW':
+            syms.append((int(fields[0], 16), fields[2]))
+    syms.sort()
+    return syms
+
+
+def parse(f):
+    header = None
+    cpus = {}
+    samples = []
+    for line in f:
+        m = line_re.search(line.rstrip('\r\n'))
+        if not m:
+            continue
+        kind, rest = m.groups()
+        fields = rest.split()
+        if kind == 'begin':
+            if int(fields[0]) != DUMP_VERSION:
+                sys.exit('unsupported dump version %s' % fields[0])
+            header = {'hz': int(fields[2]), 'depth': int(fields[3])}
+            cpus = {}
+            samples = []
+        elif kind == 'c' and header:
+            cpus[int(fields[0])] = (int(fields[1]), int(fields[2]))
+        elif kind == 's' and header:
+            samples.append((int(fields[0]), int(fields[1]), [int(x, 16) for x in fields[2:]]))
+        elif kind == 'end' and header:
+            break
+    if header is None:
+        sys.exit('no profile dump found')
+    return header, cpus, samples
+
+
+def function(syms, pc):
+    # drop the offset, samples are counted per function
+    return symbolize(syms, pc).split('+')[0]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='symbolize a profile dump')
+    parser.add_argument('elf', help='the lk elf the dump was taken from')
+    parser.add_argument('log', nargs='?', help='console capture, stdin if not given')
+    parser.add_argument('-n', '--nm', default='nm', help='nm to use, e.g. an arm-eabi- prefixed one')
+    parser.add_argument('-c', '--cpu', type=int, help='only count samples from this cpu')
+    parser.add_argument('-f', '--folded', action='store_true', help='print folded stacks for flamegraph.pl')
+    parser.add_argument('-t', '--top', type=int, default=40, help='functions to list, 0 for all')
+    args = parser.parse_args()
+
+    syms = elf_symbols(args.nm, args.elf)
+
+    if args.log:
+        with open(args.log, errors='replace') as f:
+            header, cpus, samples = parse(f)
+    else:
+        header, cpus, samples = parse(sys.stdin)
+
+    if args.cpu is not None:
+        samples = [s for s in samples if s[0] == args.cpu]
+
+    if args.folded:
+        folded = collections.Counter()
+        for _cpu, count, pcs in samples:
+            folded[';'.join(function(syms, pc) for pc in reversed(pcs))] += count
+        for stack, count in sorted(folded.items()):
+            print('%s %u' % (stack, count))
+        return
+
+    total = sum(s[1] for s in samples)
+    self_counts = collections.Counter()
+    incl_counts = collections.Counter()
+    for _cpu, count, pcs in samples:
+        self_counts[function(syms, pcs[0])] += count
+        # a recursive function only counts once per stack
+        for name in set(function(syms, pc) for pc in pcs):
+            incl_counts[name] += count
+
+    for cpu, (n, dropped) in sorted(cpus.items()):
+        if args.cpu is None or cpu == args.cpu:
+            print('cpu %u: %u samples, %u dropped' % (cpu, n, dropped))
+    print('%u samples at %u hz\n' % (total, header['hz']))
+
+    if not total:
+        return
+
+    backtraces = any(len(s[2]) > 1 for s in samples)
+    print('  self%%  %s samples  function' % (' incl%' if backtraces else ''))
+    top = self_counts.most_common(args.top or None)
+    for name, count in top:
+        incl = ' %5.1f%%' % (100.0 * incl_counts[name] / total) if backtraces else ''
+        print('%6.1f%% %s %7u  %s' % (100.0 * count / total, incl, count, name))
+
+
+if __name__ == '__main__':
+    main()
@@ -412,6 +412,10 @@ status_t display_get_info(struct display_info *info)
     info->height = BSP_LCD_GetYSize();
     info->stride = BSP_LCD_GetXSize();
     info->flush = NULL;
+    info->flush_rect = NULL;
+    info->back_framebuffer = NULL;
+    info->virtual_height = info->height;
+    info->pan = NULL;
 
     return NO_ERROR;
 }
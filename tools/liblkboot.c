@@ -29,9 +29,19 @@
 #include <fcntl.h>
 #include <sys/types.h>
 
+#include <lib/miniz.h>
+
 #include "network.h"
 #include "../app/lkboot/lkboot_protocol.h"
 
+#define FRAME_SIZE 65536
+
+static int compress = 0;
+
+void lkboot_set_compression(int enable) {
+	compress = enable;
+}
+
 static int readx(int s, void *_data, int len) {
 	char *data = _data;
 	int r;
@@ -52,64 +62,152 @@ static int readx(int s, void *_data, int len) {
 	return 0;
 }
 
-static int upload(int s, int txfd, size_t txlen, int do_endian_swap) {
+static int writex(int s, const void *_data, size_t len) {
+	const char *data = _data;
+	while (len > 0) {
+		ssize_t r = write(s, data, len);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "error: %s during socket write\n", strerror(errno));
+			return -1;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int send_frame(int s, const void *data, size_t len) {
+	msg_hdr_t hdr;
+
+	hdr.opcode = MSG_SEND_DATA;
+	hdr.extra = 0;
+	hdr.length = len - 1;
+	if (writex(s, &hdr, sizeof(hdr))) return -1;
+	return writex(s, data, len);
+}
+
+/* deflated output is gathered up into full frames */
+struct deflate_out {
+	int s;
+	size_t len;
+	size_t total;
+	unsigned char buf[FRAME_SIZE];
+};
+
+static mz_bool deflate_put(const void *data, int len, void *arg) {
+	struct deflate_out *out = arg;
+	const unsigned char *p = data;
+
+	while (len > 0) {
+		size_t xfer = FRAME_SIZE - out->len;
+		if (xfer > (size_t)len) xfer = len;
+		memcpy(out->buf + out->len, p, xfer);
+		out->len += xfer;
+		out->total += xfer;
+		p += xfer;
+		len -= xfer;
+
+		if (out->len == FRAME_SIZE) {
+			if (send_frame(out->s, out->buf, out->len)) return MZ_FALSE;
+			out->len = 0;
+		}
+	}
+	return MZ_TRUE;
+}
+
+/* the file goes out a chunk at a time as it's read, nothing waits on the
+ * server until MSG_END_DATA.
+ */
+static int upload(int s, int txfd, size_t txlen, int do_endian_swap, int deflate) {
 	int err = 0;
 	msg_hdr_t hdr;
+	tdefl_compressor *comp = NULL;
+	struct deflate_out *out = NULL;
 
-	char *buf = malloc(txlen);
+	char *buf = malloc(FRAME_SIZE);
 	if (!buf)
 		return -1;
 
-	if (readx(txfd, buf, txlen)) {
-		fprintf(stderr, "error: reading from file\n");
-		err = -1;
-		goto done;
-	}
-
-	/* 4 byte swap data if requested */
-	if (do_endian_swap) {
-		size_t i;
-		for (i = 0; i < txlen; i += 4) {
-			char temp = buf[i];
-			buf[i] = buf[i + 3];
-			buf[i + 3] = temp;
-
-			temp = buf[i + 1];
-			buf[i + 1] = buf[i + 2];
-			buf[i + 2] = temp;
+	if (deflate) {
+		comp = malloc(sizeof(*comp));
+		out = malloc(sizeof(*out));
+		if (!comp || !out) {
+			err = -1;
+			goto done;
+		}
+		out->s = s;
+		out->len = 0;
+		out->total = 0;
+		if (tdefl_init(comp, deflate_put, out,
+				TDEFL_DEFAULT_MAX_PROBES | TDEFL_WRITE_ZLIB_HEADER) != TDEFL_STATUS_OKAY) {
+			err = -1;
+			goto done;
 		}
 	}
 
 	size_t pos = 0;
 	while (pos < txlen) {
-		size_t xfer = (txlen - pos > 65536) ? 65536 : txlen - pos;
+		size_t xfer = (txlen - pos > FRAME_SIZE) ? FRAME_SIZE : txlen - pos;
 
-		hdr.opcode = MSG_SEND_DATA;
-		hdr.extra = 0;
-		hdr.length = xfer - 1;
-		if (write(s, &hdr, sizeof(hdr)) != sizeof(hdr)) {
-			fprintf(stderr, "error: writing socket\n");
+		if (readx(txfd, buf, xfer)) {
+			fprintf(stderr, "error: reading from file\n");
 			err = -1;
 			goto done;
 		}
-		if (write(s, buf + pos, xfer) != xfer) {
+
+		/* 4 byte swap data if requested */
+		if (do_endian_swap) {
+			size_t i;
+			for (i = 0; i + 3 < xfer; i += 4) {
+				char temp = buf[i];
+				buf[i] = buf[i + 3];
+				buf[i + 3] = temp;
+
+				temp = buf[i + 1];
+				buf[i + 1] = buf[i + 2];
+				buf[i + 2] = temp;
+			}
+		}
+
+		pos += xfer;
+		if (deflate) {
+			if (tdefl_compress_buffer(comp, buf, xfer, TDEFL_NO_FLUSH) < 0) {
+				fprintf(stderr, "error: writing socket\n");
+				err = -1;
+				goto done;
+			}
+		} else {
+			if (send_frame(s, buf, xfer)) {
+				fprintf(stderr, "error: writing socket\n");
+				err = -1;
+				goto done;
+			}
+		}
+	}
+
+	if (deflate) {
+		if (tdefl_compress_buffer(comp, NULL, 0, TDEFL_FINISH) != TDEFL_STATUS_DONE ||
+				(out->len > 0 && send_frame(s, out->buf, out->len))) {
 			fprintf(stderr, "error: writing socket\n");
 			err = -1;
 			goto done;
 		}
-		pos += xfer;
+		fprintf(stderr, "sent %zu bytes deflated to %zu\n", txlen, out->total);
 	}
 
 	hdr.opcode = MSG_END_DATA;
 	hdr.extra = 0;
 	hdr.length = 0;
-	if (write(s, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+	if (writex(s, &hdr, sizeof(hdr))) {
 		fprintf(stderr, "error: writing socket\n");
 		err = -1;
 		goto done;
 	}
 
 done:
+	free(out);
+	free(comp);
 	free(buf);
 
 	return err;
@@ -262,16 +360,17 @@ int lkboot_txn(const char *host, const char *_cmd, int txfd, const char *args) {
 	}
 
 	hdr.opcode = MSG_CMD;
-	hdr.extra = 0;
+	hdr.extra = (compress && txlen > 0) ? CMD_FLAG_DEFLATE : 0;
 	hdr.length = len;
-	if (write(fd_out, &hdr, sizeof(hdr)) != sizeof(hdr)) goto iofail;
-	if (write(fd_out, cmd, len) != len) goto iofail;
+	if (writex(fd_out, &hdr, sizeof(hdr))) goto iofail;
+	if (writex(fd_out, cmd, len)) goto iofail;
 
 	for (;;) {
 		if (readx(fd_in, &hdr, sizeof(hdr))) goto iofail;
 		switch (hdr.opcode) {
 		case MSG_GO_AHEAD:
-			if (upload(fd_out, txfd, txlen, do_endian_swap)) {
+			/* only deflate if the server said it can take it */
+			if (upload(fd_out, txfd, txlen, do_endian_swap, hdr.extra & CMD_FLAG_DEFLATE)) {
 				ret = -1;
 				goto out;
 			}
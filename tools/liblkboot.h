@@ -27,6 +27,10 @@
 // of that file as the command payload
 int lkboot_txn(const char *host, const char *cmd, int txfd, const char *args);
 
+// if enabled, offer to send payloads deflated. servers that don't
+// support it are sent the data as is.
+void lkboot_set_compression(int enable);
+
 // return number of bytes of data the last txn resulted in and if nonzero
 // set *ptr = the buffer (which remains valid until next lkboot_txn())
 unsigned lkboot_get_reply(void **ptr);
@@ -33,7 +33,7 @@
 
 void usage(void) {
 	fprintf(stderr,
-"usage: lkboot <hostname> <command> ...\n"
+"usage: lkboot [-z] <hostname> <command> ...\n"
 "\n"
 "       lkboot <hostname> flash <partition> <filename>\n"
 "       lkboot <hostname> erase <partition>\n"
@@ -44,6 +44,8 @@ void usage(void) {
 "       lkboot <hostname> reboot\n"
 "       lkboot <hostname> :<commandname> [ <arg>* ]\n"
 "\n"
+"       -z   deflate the data sent to the target, if it supports it\n"
+"\n"
 "NOTE: If <hostname> is 'jtag', lkboot will attempt to use\n"
 "       a tool 'zynq-dcc' to communicate with the device.\n"
 "       Make sure it is in your path.\n"
@@ -69,6 +71,12 @@ printhex:
 }
 
 int main(int argc, char **argv) {
+	if (argc > 1 && !strcmp(argv[1], "-z")) {
+		lkboot_set_compression(1);
+		argc--;
+		argv++;
+	}
+
 	const char *host = argv[1];
 	const char *cmd = argv[2];
 	const char *args = argv[3];
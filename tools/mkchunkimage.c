@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <lib/miniz.h>
+#include <lib/chunkimage_struct.h>
+
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+
+static const char *outname = "lk.chunked";
+
+void usage(const char *binary) {
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "%s [-h] [-c <chunk size>] [-o <output file>] <input file>\n\n", binary);
+	fprintf(stderr, "Compresses the input in independent chunks (default %u bytes)\n", DEFAULT_CHUNK_SIZE);
+	fprintf(stderr, "that the target can inflate in parallel.\n");
+}
+
+static void *load_file(const char *fn, size_t *len) {
+	struct stat st;
+	uint8_t *data;
+	size_t pos = 0;
+	int fd;
+
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		fprintf(stderr, "error: cannot open '%s'\n", fn);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if ((data = malloc(st.st_size ? st.st_size : 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	while (pos < (size_t)st.st_size) {
+		ssize_t r = read(fd, data + pos, st.st_size - pos);
+		if (r <= 0) {
+			fprintf(stderr, "error: failed to read '%s'\n", fn);
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		pos += r;
+	}
+	close(fd);
+	*len = pos;
+	return data;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		ssize_t r = write(fd, p, len);
+		if (r <= 0) {
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *binary = argv[0];
+	const char *inname = NULL;
+	unsigned long chunk_size = DEFAULT_CHUNK_SIZE;
+	chunkimage_header hdr;
+	chunkimage_chunk *index;
+	void **chunks;
+	uint8_t *data;
+	size_t len;
+	uint32_t offset;
+	unsigned n;
+	int fd;
+
+	while (argc > 1) {
+		char *cmd = argv[1];
+		argc--;
+		argv++;
+
+		if (!strcmp(cmd, "-h") || !strcmp(cmd, "--help")) {
+			usage(binary);
+			return 1;
+		} else if (!strcmp(cmd, "-o") && argc > 1) {
+			outname = argv[1];
+			argc--;
+			argv++;
+		} else if (!strcmp(cmd, "-c") && argc > 1) {
+			chunk_size = strtoul(argv[1], NULL, 0);
+			argc--;
+			argv++;
+		} else if (inname == NULL) {
+			inname = cmd;
+		} else {
+			fprintf(stderr, "error: invalid argument '%s'\n", cmd);
+			return 1;
+		}
+	}
+
+	if (inname == NULL) {
+		usage(binary);
+		return 1;
+	}
+	if (chunk_size == 0 || chunk_size > 0x10000000) {
+		fprintf(stderr, "error: bad chunk size %lu\n", chunk_size);
+		return 1;
+	}
+	if ((data = load_file(inname, &len)) == NULL) {
+		return 1;
+	}
+	if (len > UINT32_MAX) {
+		fprintf(stderr, "error: '%s' is too large\n", inname);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHUNKIMAGE_MAGIC, CHUNKIMAGE_MAGIC_LENGTH);
+	hdr.version = CHUNKIMAGE_VERSION;
+	hdr.image_size = len;
+	hdr.chunk_size = chunk_size;
+	hdr.chunk_count = (len + chunk_size - 1) / chunk_size;
+	hdr.header_size = sizeof(hdr) + hdr.chunk_count * sizeof(chunkimage_chunk);
+
+	index = calloc(hdr.chunk_count ? hdr.chunk_count : 1, sizeof(chunkimage_chunk));
+	chunks = calloc(hdr.chunk_count ? hdr.chunk_count : 1, sizeof(void *));
+	if (index == NULL || chunks == NULL) {
+		return 1;
+	}
+
+	offset = hdr.header_size;
+	for (n = 0; n < hdr.chunk_count; n++) {
+		size_t in_len = len - (size_t)n * chunk_size;
+		size_t out_len;
+
+		if (in_len > chunk_size) {
+			in_len = chunk_size;
+		}
+		chunks[n] = tdefl_compress_mem_to_heap(data + (size_t)n * chunk_size, in_len, &out_len,
+				TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+		if (chunks[n] == NULL || (uint64_t)offset + out_len > UINT32_MAX) {
+			fprintf(stderr, "error: failed to compress chunk %u\n", n);
+			return 1;
+		}
+		index[n].offset = offset;
+		index[n].length = out_len;
+		offset += out_len;
+	}
+
+	if ((fd = open(outname, O_CREAT|O_TRUNC|O_WRONLY, 0644)) < 0) {
+		fprintf(stderr, "error: cannot open '%s' for writing\n", outname);
+		return 1;
+	}
+	if (write_all(fd, &hdr, sizeof(hdr)) ||
+			write_all(fd, index, hdr.chunk_count * sizeof(chunkimage_chunk))) {
+		goto fail;
+	}
+	for (n = 0; n < hdr.chunk_count; n++) {
+		if (write_all(fd, chunks[n], index[n].length)) {
+			goto fail;
+		}
+	}
+	close(fd);
+
+	printf("%s: %zu bytes in %u chunks, %u bytes compressed\n", outname, len, hdr.chunk_count, offset);
+	return 0;
+
+fail:
+	fprintf(stderr, "error: failed to write '%s'\n", outname);
+	close(fd);
+	unlink(outname);
+	return 1;
+}
+
+// vim: set noexpandtab:
@@ -32,7 +32,13 @@
 #include <assert.h>
 #include <compiler.h>
 #include <debug.h>
+#include <stdlib.h>
+#include <string.h>
 #include <trace.h>
+#include <malloc.h>
+#include <platform.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
 
 #define LOCAL_TRACE 0
 #define TRACE_INIT (LK_DEBUGLEVEL >= 2)
@@ -43,6 +49,191 @@
 extern const struct lk_init_struct __lk_init[];
 extern const struct lk_init_struct __lk_init_end[];
 
+static void lk_init_call(const struct lk_init_struct *init)
+{
+#if TRACE_INIT
+    if (init->level >= EARLIEST_TRACE_LEVEL) {
+        printf("INIT: cpu %d, calling hook %p (%s) at level %#x, flags %#x\n",
+               arch_curr_cpu_num(), init->hook, init->name, init->level, init->flags);
+    }
+#endif
+    int slot = lk_boottime_begin(LK_BOOTTIME_HOOK, init->name, init->level);
+    init->hook(init->level);
+    lk_boottime_end(slot);
+}
+
+static const struct lk_init_struct *lk_init_find(const char *name)
+{
+    for (const struct lk_init_struct *ptr = __lk_init; ptr != __lk_init_end; ptr++) {
+        if ((ptr->flags & LK_INIT_FLAG_PRIMARY_CPU) && !strcmp(ptr->name, name))
+            return ptr;
+    }
+    return NULL;
+}
+
+/* a hook of a level being run in parallel */
+struct lk_init_task {
+    const struct lk_init_struct *init;
+    thread_t *thread;
+    event_t done;
+
+    /* the tasks of the level it waits for, and the serial hook called just before it */
+    struct lk_init_task **deps;
+    uint dep_count;
+    struct lk_init_task *prev_serial;
+    uint visited;
+};
+
+/* does task wait, directly or through others, for target to finish */
+static bool lk_init_waits_for(struct lk_init_task *task, const struct lk_init_task *target, uint pass)
+{
+    if (task == target)
+        return true;
+    if (task->visited == pass)
+        return false;
+    task->visited = pass;
+
+    if (task->prev_serial && lk_init_waits_for(task->prev_serial, target, pass))
+        return true;
+    for (uint i = 0; i < task->dep_count; i++) {
+        if (lk_init_waits_for(task->deps[i], target, pass))
+            return true;
+    }
+    return false;
+}
+
+/* look a task's dependencies up among the tasks of its level. one that waits for
+ * the task itself, such as a serial hook called after it or anything else closing
+ * a cycle, could never finish first and is reported and ignored like one on a
+ * later level. */
+static void lk_init_resolve_deps(struct lk_init_task *tasks, uint count, struct lk_init_task *task, uint *pass)
+{
+    const struct lk_init_struct *init = task->init;
+
+    for (uint i = 0; i < init->dep_count; i++) {
+        const char *name = init->deps[i];
+
+        struct lk_init_task *dep = NULL;
+        for (uint j = 0; j < count; j++) {
+            if (!strcmp(tasks[j].init->name, name)) {
+                dep = &tasks[j];
+                break;
+            }
+        }
+
+        if (dep) {
+            if (lk_init_waits_for(dep, task, ++*pass)) {
+                dprintf(CRITICAL, "INIT: hook %s at level %#x depends on %s, which waits for it\n",
+                        init->name, init->level, name);
+                continue;
+            }
+            task->deps[task->dep_count++] = dep;
+            continue;
+        }
+
+        /* earlier levels are done already, a later one can never be waited for */
+        const struct lk_init_struct *later = lk_init_find(name);
+        if (later && later->level > init->level) {
+            dprintf(CRITICAL, "INIT: hook %s at level %#x depends on %s at later level %#x\n",
+                    init->name, init->level, later->name, later->level);
+        }
+    }
+}
+
+static void lk_init_wait_deps(const struct lk_init_task *task)
+{
+    for (uint i = 0; i < task->dep_count; i++)
+        event_wait(&task->deps[i]->done);
+}
+
+static void lk_init_run_task(struct lk_init_task *task)
+{
+    lk_init_wait_deps(task);
+    lk_init_call(task->init);
+    event_signal(&task->done, false);
+}
+
+static int lk_init_thread(void *arg)
+{
+    lk_init_run_task(arg);
+    return 0;
+}
+
+/* run every primary cpu hook at a level, the parallel ones on threads of their
+ * own. returns the last hook of the level in section order, or NULL if there
+ * was nothing to run in parallel and the caller should carry on as usual. */
+static const struct lk_init_struct *lk_init_level_parallel(uint level)
+{
+    uint count = 0;
+    uint dep_total = 0;
+    bool parallel = false;
+    for (const struct lk_init_struct *ptr = __lk_init; ptr != __lk_init_end; ptr++) {
+        if ((ptr->flags & LK_INIT_FLAG_PRIMARY_CPU) && ptr->level == level) {
+            count++;
+            dep_total += ptr->dep_count;
+            if (ptr->flags & LK_INIT_FLAG_PARALLEL)
+                parallel = true;
+        }
+    }
+    if (!parallel)
+        return NULL;
+
+    /* the dependency slots of every task follow the tasks themselves */
+    struct lk_init_task *tasks = calloc(1, count * sizeof(struct lk_init_task) +
+                                        dep_total * sizeof(struct lk_init_task *));
+    if (!tasks)
+        return NULL;
+    struct lk_init_task **dep_slot = (struct lk_init_task **)&tasks[count];
+
+    const struct lk_init_struct *last = NULL;
+    struct lk_init_task *prev_serial = NULL;
+    uint i = 0;
+    for (const struct lk_init_struct *ptr = __lk_init; ptr != __lk_init_end; ptr++) {
+        if ((ptr->flags & LK_INIT_FLAG_PRIMARY_CPU) && ptr->level == level) {
+            tasks[i].init = ptr;
+            tasks[i].deps = dep_slot;
+            dep_slot += ptr->dep_count;
+            if (!(ptr->flags & LK_INIT_FLAG_PARALLEL)) {
+                tasks[i].prev_serial = prev_serial;
+                prev_serial = &tasks[i];
+            }
+            event_init(&tasks[i].done, false, 0);
+            i++;
+            last = ptr;
+        }
+    }
+
+    uint pass = 0;
+    for (i = 0; i < count; i++)
+        lk_init_resolve_deps(tasks, count, &tasks[i], &pass);
+
+    /* start the parallel ones, then call the rest in order from here */
+    for (i = 0; i < count; i++) {
+        if (tasks[i].init->flags & LK_INIT_FLAG_PARALLEL) {
+            tasks[i].thread = thread_create(tasks[i].init->name, &lk_init_thread, &tasks[i],
+                                            DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            if (tasks[i].thread)
+                thread_resume(tasks[i].thread);
+            else
+                lk_init_run_task(&tasks[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!(tasks[i].init->flags & LK_INIT_FLAG_PARALLEL))
+            lk_init_run_task(&tasks[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (tasks[i].thread)
+            thread_join(tasks[i].thread, NULL, INFINITE_TIME);
+        event_destroy(&tasks[i].done);
+    }
+    free(tasks);
+
+    return last;
+}
+
 void lk_init_level(enum lk_init_flags required_flag, uint start_level, uint stop_level)
 {
     LTRACEF("flags %#x, start_level %#x, stop_level %#x\n",
@@ -92,18 +283,149 @@ void lk_init_level(enum lk_init_flags required_flag, uint start_level, uint stop
         if (!found)
             break;
 
-#if TRACE_INIT
-        if (found->level >= EARLIEST_TRACE_LEVEL) {
-            printf("INIT: cpu %d, calling hook %p (%s) at level %#x, flags %#x\n",
-                   arch_curr_cpu_num(), found->hook, found->name, found->level, found->flags);
+        /* only the boot cpu's hooks, once there are threads to run them on */
+        if (required_flag == LK_INIT_FLAG_PRIMARY_CPU && found->level >= LK_INIT_LEVEL_THREADING &&
+                found->level != last_called_level) {
+            const struct lk_init_struct *level_last = lk_init_level_parallel(found->level);
+            if (level_last) {
+                last_called_level = found->level;
+                last = level_last;
+                continue;
+            }
         }
-#endif
-        found->hook(found->level);
+
+        lk_init_call(found);
         last_called_level = found->level;
         last = found;
     }
 }
 
+#ifndef LK_BOOTTIME_MAX
+#define LK_BOOTTIME_MAX 128
+#endif
+
+struct lk_boottime_entry {
+    const char *name;
+    uint level;
+    uint cpu;
+    enum lk_boottime_type type;
+    lk_bigtime_t start;
+    lk_bigtime_t end;   /* 0 until it returns */
+};
+
+static struct lk_boottime_entry boottime[LK_BOOTTIME_MAX];
+static volatile int boottime_count;
+
+int lk_boottime_begin(enum lk_boottime_type type, const char *name, uint level)
+{
+    /* secondary cpus run their hooks at the same time as the boot cpu */
+    int slot = atomic_add(&boottime_count, 1);
+    if (slot >= LK_BOOTTIME_MAX)
+        return -1;
+
+    struct lk_boottime_entry *e = &boottime[slot];
+    e->name = name;
+    e->level = level;
+    e->cpu = arch_curr_cpu_num();
+    e->type = type;
+    e->end = 0;
+    e->start = current_time_hires();
+
+    return slot;
+}
+
+void lk_boottime_end(int slot)
+{
+    if (slot < 0)
+        return;
+
+    boottime[slot].end = current_time_hires();
+}
+
+static const char *boottime_type_name(enum lk_boottime_type type)
+{
+    switch (type) {
+        case LK_BOOTTIME_HOOK:
+            return "hook";
+        case LK_BOOTTIME_STEP:
+            return "step";
+        case LK_BOOTTIME_APP_INIT:
+            return "app init";
+        case LK_BOOTTIME_APP_ENTRY:
+            return "app entry";
+    }
+    return "unknown";
+}
+
+static lk_bigtime_t boottime_duration(const struct lk_boottime_entry *e)
+{
+    return e->end ? e->end - e->start : 0;
+}
+
+static int boottime_cmp(const void *_a, const void *_b)
+{
+    lk_bigtime_t a = boottime_duration(*(const struct lk_boottime_entry * const *)_a);
+    lk_bigtime_t b = boottime_duration(*(const struct lk_boottime_entry * const *)_b);
+
+    return (a > b) ? -1 : (a < b) ? 1 : 0;
+}
+
+void lk_boottime_dump(bool sorted)
+{
+    uint count = MIN((uint)boottime_count, LK_BOOTTIME_MAX);
+    const struct lk_boottime_entry *order[LK_BOOTTIME_MAX];
+
+    for (uint i = 0; i < count; i++)
+        order[i] = &boottime[i];
+    if (sorted)
+        qsort(order, count, sizeof(order[0]), &boottime_cmp);
+
+    printf("boot time, %u entries", count);
+    if ((uint)boottime_count > LK_BOOTTIME_MAX)
+        printf(", %u more not recorded", boottime_count - LK_BOOTTIME_MAX);
+    printf(", times in usec\n");
+    printf("%10s %10s %3s %10s %-9s %s\n", "start", "time", "cpu", "level", "type", "name");
+
+    for (uint i = 0; i < count; i++) {
+        const struct lk_boottime_entry *e = order[i];
+
+        printf("%10llu ", e->start);
+        if (e->end)
+            printf("%10llu ", boottime_duration(e));
+        else
+            printf("%10s ", "running");
+        printf("%3u ", e->cpu);
+        if (e->type == LK_BOOTTIME_HOOK)
+            printf("0x%08x ", e->level);
+        else
+            printf("%10s ", "");
+        printf("%-9s %s\n", boottime_type_name(e->type), e->name);
+    }
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_boottime(int argc, const cmd_args *argv)
+{
+    bool sorted = (argc > 1 && !strcmp(argv[1].str, "sort"));
+
+    if (argc > 1 && !sorted) {
+        printf("usage: %s [sort]\n", argv[0].str);
+        return -1;
+    }
+
+    lk_boottime_dump(sorted);
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("boottime", "time taken by each init hook and app", &cmd_boottime)
+STATIC_COMMAND_END(boottime);
+
+#endif
+
 #if 0
 void test_hook(uint level)
 {
@@ -55,6 +55,13 @@ static int bootstrap2(void *arg);
 
 extern void kernel_init(void);
 
+/* time one of the fixed init steps into the boot time trace */
+#define BOOT_STEP(call) do { \
+	int __slot = lk_boottime_begin(LK_BOOTTIME_STEP, #call, 0); \
+	call; \
+	lk_boottime_end(__slot); \
+} while (0)
+
 static void call_constructors(void)
 {
 	void **ctor;
@@ -84,15 +91,15 @@ void lk_main(ulong arg0, ulong arg1, ulong arg2, ulong arg3)
 
 	// early arch stuff
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_ARCH_EARLY - 1);
-	arch_early_init();
+	BOOT_STEP(arch_early_init());
 
 	// do any super early platform initialization
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_ARCH_EARLY, LK_INIT_LEVEL_PLATFORM_EARLY - 1);
-	platform_early_init();
+	BOOT_STEP(platform_early_init());
 
 	// do any super early target initialization
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_PLATFORM_EARLY, LK_INIT_LEVEL_TARGET_EARLY - 1);
-	target_early_init();
+	BOOT_STEP(target_early_init());
 
 #if WITH_SMP
 	dprintf(INFO, "\nwelcome to lk/MP\n\n");
@@ -105,15 +112,15 @@ void lk_main(ulong arg0, ulong arg1, ulong arg2, ulong arg3)
 	// bring up the kernel heap
 	dprintf(SPEW, "initializing heap\n");
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_TARGET_EARLY, LK_INIT_LEVEL_HEAP - 1);
-	heap_init();
+	BOOT_STEP(heap_init());
 
 	// deal with any static constructors
 	dprintf(SPEW, "calling constructors\n");
-	call_constructors();
+	BOOT_STEP(call_constructors());
 
 	// initialize the kernel
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_HEAP, LK_INIT_LEVEL_KERNEL - 1);
-	kernel_init();
+	BOOT_STEP(kernel_init());
 
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_KERNEL, LK_INIT_LEVEL_THREADING - 1);
 
@@ -133,24 +140,28 @@ static int bootstrap2(void *arg)
 	dprintf(SPEW, "top of bootstrap2()\n");
 
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_THREADING, LK_INIT_LEVEL_ARCH - 1);
-	arch_init();
+	BOOT_STEP(arch_init());
 
 	// initialize the rest of the platform
 	dprintf(SPEW, "initializing platform\n");
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_ARCH, LK_INIT_LEVEL_PLATFORM - 1);
-	platform_init();
+	BOOT_STEP(platform_init());
 
 	// initialize the target
 	dprintf(SPEW, "initializing target\n");
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_PLATFORM, LK_INIT_LEVEL_TARGET - 1);
-	target_init();
+	BOOT_STEP(target_init());
 
 	dprintf(SPEW, "calling apps_init()\n");
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_TARGET, LK_INIT_LEVEL_APPS - 1);
-	apps_init();
+	BOOT_STEP(apps_init());
 
 	lk_primary_cpu_init_level(LK_INIT_LEVEL_APPS, LK_INIT_LEVEL_LAST);
 
+#if LK_BOOTTIME_PRINT
+	lk_boottime_dump(false);
+#endif
+
 	return 0;
 }
 
@@ -13,4 +13,9 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/init.c \
 	$(LOCAL_DIR)/main.c \
 
+# print the boot time trace once the last init level has run
+ifeq ($(LK_BOOTTIME_PRINT),1)
+GLOBAL_DEFINES += LK_BOOTTIME_PRINT=1
+endif
+
 include make/module.mk